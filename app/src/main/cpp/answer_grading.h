@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Grading of free-text quiz answers without a generation per answer.
+ *
+ * The student answers and the reference answers of a whole quiz are embedded
+ * in one batch (embed_batcher.h); each answer then scores against the
+ * references of its question by a blend of embedding similarity and keyword
+ * recall, the IDF-weighted share of a reference's terms the answer uses
+ * (KeywordIndex::term_recall over the study material's index). The best
+ * reference counts. Scores at or above `accept` are correct, below `reject`
+ * incorrect, and only those in between are left to the chat model.
+ *
+ * Raw cosines are not comparable across embedders (the chat model's pooled
+ * hidden states sit much higher than a sentence embedder's), so similarity is
+ * taken relative to a baseline: the answer's mean similarity to the other
+ * questions' references, which are on topic but wrong, or `floor` for a quiz
+ * of one question.
+ */
+namespace answer_grading {
+
+enum Verdict : int {
+    kIncorrect = 0,
+    kCorrect = 1,
+    kAmbiguous = 2,  // for the chat model to decide
+};
+
+struct Settings {
+    float similarity_weight = 0.7f;  // the rest is keyword recall
+    float accept = 0.7f;
+    float reject = 0.4f;
+    float floor = 0.3f;  // baseline similarity for a quiz of one question
+};
+
+struct Grade {
+    float score = 0.0f;
+    float similarity = 0.0f;  // above the baseline, 0..1, for the best reference
+    float recall = 0.0f;      // of that reference; 0 without a keyword index
+    Verdict verdict = kIncorrect;
+};
+
+// Eight running sums, so the loop vectorizes without reassociating floats
+inline float dot(const float* a, const float* b, size_t dim) {
+    float sums[8] = {0.0f};
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        for (size_t lane = 0; lane < 8; ++lane) {
+            sums[lane] += a[i + lane] * b[i + lane];
+        }
+    }
+    float sum = ((sums[0] + sums[4]) + (sums[1] + sums[5])) + ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+    for (; i < dim; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// `answers`: one L2-normalized row of `dim` per question. `references`: the rows
+// of question q's references are [first[q], first[q + 1]). `recall`: one value per
+// reference, or empty without a keyword index. A blank answer is incorrect.
+inline std::vector<Grade> grade(const float* answers, const float* references, const std::vector<size_t>& first,
+                                size_t dim, const std::vector<float>& recall, const std::vector<bool>& blank,
+                                const Settings& settings) {
+    size_t questions = first.empty() ? 0 : first.size() - 1;
+    size_t total = questions > 0 ? first[questions] : 0;
+    float weight = recall.empty() ? 1.0f : settings.similarity_weight;
+    std::vector<Grade> grades(questions);
+    std::vector<float> cosines(total);
+    for (size_t q = 0; q < questions; ++q) {
+        const float* answer = answers + q * dim;
+        if (blank[q] || first[q] == first[q + 1]) {
+            continue;
+        }
+        float others = 0.0f;
+        for (size_t r = 0; r < total; ++r) {
+            cosines[r] = dot(answer, references + r * dim, dim);
+            others += r < first[q] || r >= first[q + 1] ? cosines[r] : 0.0f;
+        }
+        size_t own = first[q + 1] - first[q];
+        float baseline = total > own ? others / static_cast<float>(total - own) : settings.floor;
+        baseline = std::min(baseline, 0.99f);
+        Grade& best = grades[q];
+        for (size_t r = first[q]; r < first[q + 1]; ++r) {
+            Grade candidate;
+            float cosine = cosines[r];
+            candidate.similarity = std::max(0.0f, std::min(1.0f, (cosine - baseline) / (1.0f - baseline)));
+            candidate.recall = recall.empty() ? 0.0f : recall[r];
+            candidate.score = weight * candidate.similarity + (1.0f - weight) * candidate.recall;
+            if (r == first[q] || candidate.score > best.score) {
+                best = candidate;
+            }
+        }
+        best.verdict = best.score >= settings.accept ? kCorrect : best.score < settings.reject ? kIncorrect
+                                                                                               : kAmbiguous;
+    }
+    return grades;
+}
+
+}  // namespace answer_grading
@@ -0,0 +1,513 @@
+#pragma once
+
+#include <jni.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "generation_worker.h"
+#include "jni_cache.h"
+
+// Request states reported to Kotlin; mirrored as REQUEST_* constants
+enum AsyncStatus : int {
+    kAsyncUnknown = -1,   // never submitted, or already released
+    kAsyncQueued = 0,
+    kAsyncRunning = 1,
+    kAsyncDone = 2,
+    kAsyncFailed = 3,
+    kAsyncCancelled = 4,
+};
+
+/**
+ * Non-blocking generation requests.
+ *
+ * submit() returns a request id right away and runs the generation on the
+ * library's persistent GenerationWorker. Kotlin either passes a (String) -> Unit
+ * completion callback, invoked once on the worker with the final text, or polls
+ * status(), output() (partial text while running) and queue_position(). No call
+ * here waits on a generation, so the UI thread never parks in native code.
+ *
+ * A request submitted with a callback is dropped once the callback ran. Polled
+ * requests are kept until release() or until more than kMaxFinished newer ones
+ * have finished.
+ *
+ * enqueue() registers a request that something else runs instead of the
+ * worker, e.g. a batch scheduler; it reports through start(), append() and
+ * complete(), and the same status/output/cancel calls apply. A job on a
+ * worker that runs such requests on its behalf can block on them with wait().
+ *
+ * Identical requests in flight at once (a double tap, a retry, two screens
+ * asking for the same summary) run once. A request submitted or enqueued with
+ * a `key` that a queued or running request already has joins that one instead
+ * of running: it gets its own id and callback, reports the status, output and
+ * queue position of the one it joined, and finishes with its text. Cancelling
+ * a joined request only detaches it; cancelling the one running for others
+ * drops its own result but keeps the generation going while anyone still
+ * waits on it.
+ */
+class AsyncRequestTable {
+public:
+    // Runs the generation, calling emit() with each piece of text as it is
+    // produced. Returns false (with `error` set) if generation failed.
+    using Run = std::function<bool(const std::string& prompt,
+                                   const std::function<void(const std::string&)>& emit,
+                                   const std::atomic<bool>& cancelled, std::string& error)>;
+
+    explicit AsyncRequestTable(const char* worker_name, void (*on_start)() = nullptr)
+        : worker_(worker_name, on_start) {}
+
+    // Called from cancel() while the request is running, e.g. to abort the module
+    void set_abort_hook(std::function<void()> hook) { abort_hook_ = std::move(hook); }
+
+    // Joining identical requests (see above) is on unless turned off here
+    void set_coalescing(bool enabled) { coalescing_.store(enabled); }
+    bool coalescing() const { return coalescing_.load(); }
+
+    // Requests that joined an identical one in flight, since load
+    uint64_t coalesced() const { return coalesced_.load(); }
+
+    // Returns the request id, or -1 if the worker is shutting down. A non-empty
+    // `key` joins a request in flight with the same key instead of running.
+    int64_t submit(JNIEnv* env, std::string prompt, jobject callback, Run run, const std::string& key = "") {
+        auto request = std::make_shared<Request>();
+        request->prompt = std::move(prompt);
+        if (callback != nullptr) {
+            request->callback = env->NewGlobalRef(callback);
+            request->method = jni_function1_invoke(env, callback);
+        }
+
+        JavaVM* jvm = nullptr;
+        env->GetJavaVM(&jvm);
+
+        int64_t id;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            id = next_id_++;
+            requests_[id] = request;
+            if (join(request, id, key)) {
+                return id;
+            }
+        }
+
+        bool queued = worker_.submit(jvm, [this, request, run](JNIEnv* worker_env) {
+            execute(worker_env, *request, run);
+        });
+        if (!queued) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_.erase(id);
+            if (request->callback != nullptr) {
+                env->DeleteGlobalRef(request->callback);
+            }
+            return -1;
+        }
+        return id;
+    }
+
+    // Register a request run by the caller rather than the worker. With a
+    // non-empty `key` it may join one in flight instead; `joined` then says
+    // so, and the caller must not run it.
+    int64_t enqueue(JNIEnv* env, std::string prompt, jobject callback, const std::string& key = "",
+                    bool* joined = nullptr) {
+        auto request = std::make_shared<Request>();
+        request->prompt = std::move(prompt);
+        request->external = true;
+        if (callback != nullptr) {
+            request->callback = env->NewGlobalRef(callback);
+            request->method = jni_function1_invoke(env, callback);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t id = next_id_++;
+        requests_[id] = request;
+        bool was_joined = join(request, id, key);
+        if (joined != nullptr) {
+            *joined = was_joined;
+        }
+        return id;
+    }
+
+    // Queued -> running for an enqueued request. False (and no prompt) if it
+    // was cancelled or released meanwhile.
+    bool start(int64_t id, std::string* prompt) {
+        std::shared_ptr<Request> request = find(id);
+        int expected = kAsyncQueued;
+        if (!request || !request->status.compare_exchange_strong(expected, kAsyncRunning)) {
+            return false;
+        }
+        *prompt = request->prompt;
+        return true;
+    }
+
+    // The prompt of a request that has not started, to size it meanwhile
+    std::string prompt(int64_t id) {
+        std::shared_ptr<Request> request = find(id);
+        return request ? request->prompt : std::string();
+    }
+
+    void append(int64_t id, const std::string& text) {
+        std::shared_ptr<Request> request = find(id);
+        if (request) {
+            std::lock_guard<std::mutex> lock(request->text_mutex);
+            request->text += text;
+        }
+    }
+
+    bool cancelled(int64_t id) {
+        std::shared_ptr<Request> request = find(id);
+        return !request || request->cancelled.load();
+    }
+
+    // Finish an enqueued request and run its callback on `env`'s thread. Call
+    // without engine locks held; callbacks may call back into the library.
+    void complete(JNIEnv* env, int64_t id, bool ok, const std::string& error) {
+        std::shared_ptr<Request> request = find(id);
+        if (!request) {
+            return;
+        }
+        int state = request->status.load();
+        if (state == kAsyncRunning) {
+            finish(*request, ok, error);
+        } else {
+            notify_done();
+        }
+        deliver(env, *request);
+    }
+
+    // Status of `id` once it is no longer queued or running, or after `timeout`
+    // if it still is. A request already dropped reports kAsyncUnknown.
+    int wait(int64_t id, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(done_mutex_);
+        int state = kAsyncUnknown;
+        done_cond_.wait_for(lock, timeout, [&] {
+            state = status(id);
+            return state != kAsyncQueued && state != kAsyncRunning;
+        });
+        return state;
+    }
+
+    int status(int64_t id) {
+        std::shared_ptr<Request> request = find(id);
+        if (!request) {
+            return kAsyncUnknown;
+        }
+        int state = request->status.load();
+        // A joined request is running until the one it joined hands over its text
+        return request->leader && state < kAsyncDone ? std::min<int>(request->leader->status.load(), kAsyncRunning)
+                                                     : state;
+    }
+
+    // Text produced so far; the full answer (or the error) once finished
+    std::string output(int64_t id) {
+        std::shared_ptr<Request> request = find(id);
+        if (!request) {
+            return "";
+        }
+        if (request->leader && request->status.load() < kAsyncDone) {
+            request = request->leader;
+        }
+        std::lock_guard<std::mutex> lock(request->text_mutex);
+        return request->text;
+    }
+
+    // 0 while running, N with N requests ahead of it, -1 if not waiting to run
+    int queue_position(int64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = requests_.find(id);
+        if (it == requests_.end()) {
+            return -1;
+        }
+        if (it->second->leader && it->second->status.load() < kAsyncDone) {
+            it = requests_.find(it->second->leader_id);
+            if (it == requests_.end()) {
+                return 0;  // finished and dropped; its text is being handed over
+            }
+        }
+        int state = it->second->status.load();
+        if (state == kAsyncRunning) {
+            return 0;
+        }
+        if (state != kAsyncQueued) {
+            return -1;
+        }
+        int ahead = 0;
+        for (auto other = requests_.begin(); other != it; ++other) {
+            int other_state = other->second->status.load();
+            if (other_state == kAsyncQueued || other_state == kAsyncRunning) {
+                ahead++;
+            }
+        }
+        return ahead;
+    }
+
+    // Requests queued or running
+    size_t in_flight() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t count = 0;
+        for (const auto& entry : requests_) {
+            int state = entry.second->status.load();
+            count += state == kAsyncQueued || state == kAsyncRunning ? 1 : 0;
+        }
+        return count;
+    }
+    
+    // Drop a queued request, or stop a running one at its next token
+    bool cancel(int64_t id) {
+        std::shared_ptr<Request> request = find(id);
+        if (!request) {
+            return false;
+        }
+        std::shared_ptr<Request> orphaned;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (request->leader) {
+                // A joined request only stops waiting; the one it joined stops too
+                // if it was cancelled itself and nobody else waits on it
+                int expected = kAsyncQueued;
+                if (!request->status.compare_exchange_strong(expected, kAsyncCancelled)) {
+                    return false;
+                }
+                // It stays among the followers so the handover releases its callback
+                request->cancelled.store(true);
+                if (request->leader->detached && !waited_on(*request->leader)) {
+                    orphaned = request->leader;
+                }
+            } else if (waited_on(*request)) {
+                request->detached = true;
+                return true;
+            }
+        }
+        if (request->leader) {
+            notify_done();
+            if (orphaned) {
+                stop(*orphaned);
+            }
+            return true;
+        }
+        return stop(*request);
+    }
+
+    void release(int64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = requests_.find(id);
+        if (it != requests_.end() && it->second->status.load() >= kAsyncDone) {
+            requests_.erase(it);
+        }
+    }
+
+private:
+    static constexpr size_t kMaxFinished = 32;
+
+    struct Request {
+        std::string prompt;
+        std::atomic<int> status{kAsyncQueued};
+        std::atomic<bool> cancelled{false};
+        std::mutex text_mutex;
+        std::string text;
+        jobject callback = nullptr;
+        jmethodID method = nullptr;
+        bool external = false;  // run by enqueue()'s caller, not the worker
+        // Coalescing, under the table's mutex_: the request this one joined, or
+        // the requests that joined this one
+        std::string key;
+        std::shared_ptr<Request> leader;
+        int64_t leader_id = 0;
+        std::vector<std::shared_ptr<Request>> followers;
+        bool detached = false;  // cancelled while others wait on it
+        int outcome = kAsyncUnknown;  // status for its followers, set before `status`
+    };
+
+    std::function<void()> abort_hook_;
+    std::atomic<bool> coalescing_{true};
+    std::atomic<uint64_t> coalesced_{0};
+    std::mutex mutex_;
+    // Signalled whenever a request finishes, for wait()
+    std::mutex done_mutex_;
+    std::condition_variable done_cond_;
+    std::map<int64_t, std::shared_ptr<Request>> requests_;  // ordered by id = submission order
+    int64_t next_id_ = 1;
+    // Last, so it is joined before the state its jobs touch is destroyed
+    GenerationWorker worker_;
+
+    std::shared_ptr<Request> find(int64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = requests_.find(id);
+        return it == requests_.end() ? nullptr : it->second;
+    }
+
+    // Make `request` (id `id`) join a request in flight with the same key. Under mutex_.
+    bool join(const std::shared_ptr<Request>& request, int64_t id, const std::string& key) {
+        if (key.empty() || !coalescing_.load()) {
+            return false;
+        }
+        request->key = key;
+        for (const auto& entry : requests_) {
+            const std::shared_ptr<Request>& other = entry.second;
+            int state = other->status.load();
+            if (entry.first != id && !other->leader && other->key == key && !other->cancelled.load() &&
+                (state == kAsyncQueued || state == kAsyncRunning)) {
+                request->leader = other;
+                request->leader_id = entry.first;
+                other->followers.push_back(request);
+                coalesced_++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether a follower of `request` still waits for its text. Under mutex_.
+    static bool waited_on(const Request& request) {
+        return std::any_of(request.followers.begin(), request.followers.end(),
+                           [](const std::shared_ptr<Request>& follower) {
+                               return follower->status.load() == kAsyncQueued;
+                           });
+    }
+
+    // Drop `request` if queued, or stop it at its next token if running
+    bool stop(Request& request) {
+        request.cancelled.store(true);
+        int expected = kAsyncQueued;
+        if (request.status.compare_exchange_strong(expected, kAsyncCancelled)) {
+            notify_done();
+            return true;
+        }
+        // Externally run requests poll cancelled() instead of aborting the module
+        if (expected == kAsyncRunning && abort_hook_ && !request.external) {
+            abort_hook_();
+        }
+        return expected == kAsyncRunning;
+    }
+
+    void execute(JNIEnv* env, Request& request, const Run& run) {
+        int expected = kAsyncQueued;
+        if (request.status.compare_exchange_strong(expected, kAsyncRunning)) {
+            std::string error;
+            bool ok = false;
+            try {
+                ok = run(request.prompt, [&request](const std::string& text) {
+                    std::lock_guard<std::mutex> lock(request.text_mutex);
+                    request.text += text;
+                }, request.cancelled, error);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            finish(request, ok, error);
+        }
+        deliver(env, request);
+    }
+
+    void finish(Request& request, bool ok, const std::string& error) {
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(request.text_mutex);
+            request.text = "Error: " + (error.empty() ? std::string("Generation failed") : error);
+        }
+        request.outcome = !ok ? kAsyncFailed : request.cancelled.load() ? kAsyncCancelled : kAsyncDone;
+        bool detached;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            detached = request.detached;
+        }
+        request.status.store(detached && ok ? kAsyncCancelled : request.outcome);
+        notify_done();
+    }
+
+    void notify_done() {
+        // Taking the lock orders the status change before a waiter's check
+        { std::lock_guard<std::mutex> lock(done_mutex_); }
+        done_cond_.notify_all();
+    }
+
+    void deliver(JNIEnv* env, Request& request) {
+        // Requests that joined this one finish with its text
+        std::vector<std::shared_ptr<Request>> followers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            followers.swap(request.followers);
+        }
+        if (!followers.empty()) {
+            std::string text;
+            {
+                std::lock_guard<std::mutex> lock(request.text_mutex);
+                text = request.text;
+            }
+            int outcome = request.outcome != kAsyncUnknown ? request.outcome : request.status.load();
+            for (const std::shared_ptr<Request>& follower : followers) {
+                {
+                    std::lock_guard<std::mutex> lock(follower->text_mutex);
+                    follower->text = text;
+                }
+                int expected = kAsyncQueued;
+                follower->status.compare_exchange_strong(expected, outcome);
+                deliver(env, *follower);
+            }
+            notify_done();
+        }
+        // Completion callback, then the prompt is no longer needed
+        if (request.callback != nullptr && env != nullptr) {
+            if (request.method != nullptr && request.status.load() != kAsyncCancelled) {
+                std::string text;
+                {
+                    std::lock_guard<std::mutex> lock(request.text_mutex);
+                    text = request.text;
+                }
+                jstring jtext = env->NewStringUTF(text.c_str());
+                jobject unit = env->CallObjectMethod(request.callback, request.method, jtext);
+                if (env->ExceptionCheck()) {
+                    env->ExceptionDescribe();
+                    env->ExceptionClear();
+                }
+                if (unit != nullptr) {
+                    env->DeleteLocalRef(unit);
+                }
+                env->DeleteLocalRef(jtext);
+            }
+            env->DeleteGlobalRef(request.callback);
+            request.callback = nullptr;
+            // The callback already delivered the result, so nobody polls this request
+            forget(request);
+        }
+        request.prompt.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            request.key.clear();
+        }
+        evict_finished();
+    }
+
+    void forget(const Request& request) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = requests_.begin(); it != requests_.end(); ++it) {
+            if (it->second.get() == &request) {
+                requests_.erase(it);
+                return;
+            }
+        }
+    }
+
+    void evict_finished() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t finished = 0;
+        for (const auto& entry : requests_) {
+            if (entry.second->status.load() >= kAsyncDone) {
+                finished++;
+            }
+        }
+        for (auto it = requests_.begin(); it != requests_.end() && finished > kMaxFinished;) {
+            if (it->second->status.load() >= kAsyncDone) {
+                it = requests_.erase(it);
+                finished--;
+            } else {
+                ++it;
+            }
+        }
+    }
+};
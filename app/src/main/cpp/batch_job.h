@@ -0,0 +1,370 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "generation_config.h"
+#include "model_manifest.h"
+
+/**
+ * Resumable background jobs over a whole document (startBatchJob), e.g.
+ * flashcards from every chapter of an OCR'd textbook, run overnight.
+ *
+ * A job is a directory. job.bin holds what the job is: the task instruction,
+ * the generation config and the document already split into chunks
+ * (document_summary::split), written once, atomically. outputs.log is the
+ * checkpoint: one record per finished chunk (its index and output, or that an
+ * attempt at it failed), appended and fsynced as each chunk completes. A
+ * record is checksummed so a torn tail from a kill mid-write is dropped and
+ * cut off on open. The scheduler state is what the log implies: the chunks
+ * without an output are the work left, in order, so after a process kill the
+ * job resumes with the first chunk it had not finished. Chunks that were
+ * generating when the process died start again from their prompt; nothing of
+ * them was recorded.
+ *
+ * Chunks go to the batch scheduler kWindowChunks at a time as one group over
+ * the shared instruction at background priority, so a window is batched
+ * decode branches off one prefilled prefix, and a chat turn preempts them. A
+ * window only starts while the device charges and no chat turn ran for
+ * kIdleQuietMs; unplugging stops the window at the next token and the job
+ * waits again. A chunk that fails kMaxAttempts times is given up with an
+ * empty output so one bad page cannot hold the job forever.
+ */
+namespace batch_job {
+
+static constexpr uint32_t kManifestMagic = 0x4a425342;  // "BSBJ"
+static constexpr uint32_t kRecordMagic = 0x52425342;    // "BSBR"
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kWindowChunks = 8;
+static constexpr int kMaxAttempts = 3;
+static constexpr int64_t kIdleQuietMs = 120000;  // since the last chat turn
+static constexpr int64_t kPollMs = 5000;         // while waiting to be allowed to run
+static constexpr const char* kManifestFile = "/job.bin";
+static constexpr const char* kLogFile = "/outputs.log";
+
+enum State : int {
+    kStateStopped = 0,  // not running in this process (never started, cancelled, or the engine closed)
+    kStateWaiting = 1,  // for the conditions to run (Wait)
+    kStateRunning = 2,
+    kStateDone = 3,
+    kStateFailed = 4,   // the job files could not be read or written
+};
+
+enum Wait : int {
+    kWaitNone = 0,
+    kWaitCharging = 1,
+    kWaitIdle = 2,    // a chat turn is running or ran recently
+    kWaitEngine = 3,  // no model loaded
+};
+
+struct Manifest {
+    std::string instruction;
+    GenerationConfig config;
+    std::vector<std::string> chunks;
+};
+
+namespace detail {
+
+template <typename T>
+inline void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void put_string(std::string& out, const std::string& value) {
+    put<uint32_t>(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+struct Reader {
+    const std::string& data;
+    size_t offset = 0;
+
+    template <typename T>
+    bool get(T* value) {
+        if (data.size() - offset < sizeof(T)) {
+            return false;
+        }
+        memcpy(value, data.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    }
+
+    bool get_string(std::string* value) {
+        uint32_t size = 0;
+        if (!get(&size) || data.size() - offset < size) {
+            return false;
+        }
+        value->assign(data, offset, size);
+        offset += size;
+        return true;
+    }
+};
+
+inline bool read_file(const std::string& path, std::string* out) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    out->clear();
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        out->append(buffer, n);
+    }
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+inline bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline uint64_t checksum(const std::string& data, size_t offset, size_t size) {
+    return model_manifest::fnv1a(reinterpret_cast<const unsigned char*>(data.data()) + offset, size);
+}
+
+}  // namespace detail
+
+inline bool has_manifest(const std::string& dir) {
+    return access((dir + kManifestFile).c_str(), R_OK) == 0;
+}
+
+// Written to a temporary file, synced and renamed into place
+inline bool write_manifest(const std::string& dir, const Manifest& manifest) {
+    using namespace detail;
+    std::string body;
+    put_string(body, manifest.instruction);
+    put<float>(body, manifest.config.temperature);
+    put<float>(body, manifest.config.top_p);
+    put<float>(body, manifest.config.repetition_penalty);
+    put<int32_t>(body, manifest.config.max_gen_len);
+    put<int64_t>(body, manifest.config.seed);
+    put_string(body, manifest.config.json_schema);
+    put_string(body, manifest.config.adapter);
+    put<uint32_t>(body, static_cast<uint32_t>(manifest.config.stop_strings.size()));
+    for (const std::string& stop : manifest.config.stop_strings) {
+        put_string(body, stop);
+    }
+    put<uint32_t>(body, static_cast<uint32_t>(manifest.chunks.size()));
+    for (const std::string& chunk : manifest.chunks) {
+        put_string(body, chunk);
+    }
+    std::string out;
+    put<uint32_t>(out, kManifestMagic);
+    put<uint32_t>(out, kVersion);
+    put<uint64_t>(out, checksum(body, 0, body.size()));
+    out += body;
+
+    mkdir(dir.c_str(), 0700);
+    std::string path = dir + kManifestFile;
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_all(fd, out.data(), out.size()) && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline bool read_manifest(const std::string& dir, Manifest* manifest) {
+    using namespace detail;
+    std::string data;
+    if (!read_file(dir + kManifestFile, &data)) {
+        return false;
+    }
+    Reader reader{data};
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t sum = 0;
+    if (!reader.get(&magic) || !reader.get(&version) || !reader.get(&sum) || magic != kManifestMagic ||
+        version != kVersion || checksum(data, reader.offset, data.size() - reader.offset) != sum) {
+        return false;
+    }
+    *manifest = Manifest();
+    GenerationConfig& config = manifest->config;
+    int32_t max_gen_len = 0;
+    uint32_t stops = 0;
+    uint32_t chunks = 0;
+    if (!reader.get_string(&manifest->instruction) || !reader.get(&config.temperature) ||
+        !reader.get(&config.top_p) || !reader.get(&config.repetition_penalty) || !reader.get(&max_gen_len) ||
+        !reader.get(&config.seed) || !reader.get_string(&config.json_schema) || !reader.get_string(&config.adapter) ||
+        !reader.get(&stops)) {
+        return false;
+    }
+    config.max_gen_len = max_gen_len;
+    config.stop_strings.resize(stops);
+    for (std::string& stop : config.stop_strings) {
+        if (!reader.get_string(&stop)) {
+            return false;
+        }
+    }
+    if (!reader.get(&chunks)) {
+        return false;
+    }
+    manifest->chunks.resize(chunks);
+    for (std::string& chunk : manifest->chunks) {
+        if (!reader.get_string(&chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// outputs.log: [magic u32][index u32][flags u32, bit 0 failed][length u32][fnv1a u64][output or error]
+class OutputLog {
+public:
+    ~OutputLog() { close(); }
+
+    // Replays the records of a job of `chunks` chunks, cutting off a torn tail
+    bool open(const std::string& dir, size_t chunks) {
+        close();
+        outputs_.assign(chunks, std::string());
+        finished_.assign(chunks, false);
+        attempts_.assign(chunks, 0);
+        done_ = 0;
+        std::string path = dir + kLogFile;
+        std::string data;
+        size_t valid = 0;
+        if (detail::read_file(path, &data)) {
+            detail::Reader reader{data};
+            while (true) {
+                uint32_t magic = 0;
+                uint32_t index = 0;
+                uint32_t flags = 0;
+                uint32_t length = 0;
+                uint64_t sum = 0;
+                if (!reader.get(&magic) || !reader.get(&index) || !reader.get(&flags) || !reader.get(&length) ||
+                    !reader.get(&sum) || magic != kRecordMagic || data.size() - reader.offset < length ||
+                    detail::checksum(data, reader.offset, length) != sum) {
+                    break;
+                }
+                if (index < chunks && !finished_[index]) {
+                    if (flags & 1u) {
+                        attempts_[index]++;
+                    } else {
+                        outputs_[index].assign(data, reader.offset, length);
+                        finished_[index] = true;
+                        done_++;
+                    }
+                }
+                reader.offset += length;
+                valid = reader.offset;
+            }
+        }
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(valid)) != 0 ||
+            lseek(fd_, static_cast<off_t>(valid), SEEK_SET) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // A finished chunk, on disk before this returns
+    bool append_output(size_t index, const std::string& output) {
+        if (index >= finished_.size() || finished_[index] || !append(index, 0, output)) {
+            return false;
+        }
+        outputs_[index] = output;
+        finished_[index] = true;
+        done_++;
+        return true;
+    }
+
+    // A failed attempt; the chunk is given up (finished, empty) after kMaxAttempts
+    bool append_failure(size_t index, const std::string& error) {
+        if (index >= finished_.size() || finished_[index] || !append(index, 1, error)) {
+            return false;
+        }
+        if (++attempts_[index] >= kMaxAttempts) {
+            return append_output(index, std::string());
+        }
+        return true;
+    }
+
+    // Up to `limit` unfinished chunks, in order
+    std::vector<size_t> next(size_t limit) const {
+        std::vector<size_t> indices;
+        for (size_t i = 0; i < finished_.size() && indices.size() < limit; ++i) {
+            if (!finished_[i]) {
+                indices.push_back(i);
+            }
+        }
+        return indices;
+    }
+
+    size_t done() const { return done_; }
+    size_t total() const { return finished_.size(); }
+    bool finished(size_t index) const { return index < finished_.size() && finished_[index]; }
+    const std::vector<std::string>& outputs() const { return outputs_; }
+
+private:
+    int fd_ = -1;
+    std::vector<std::string> outputs_;
+    std::vector<bool> finished_;
+    std::vector<int> attempts_;
+    size_t done_ = 0;
+
+    bool append(size_t index, uint32_t flags, const std::string& payload) {
+        if (fd_ < 0) {
+            return false;
+        }
+        std::string record;
+        detail::put<uint32_t>(record, kRecordMagic);
+        detail::put<uint32_t>(record, static_cast<uint32_t>(index));
+        detail::put<uint32_t>(record, flags);
+        detail::put<uint32_t>(record, static_cast<uint32_t>(payload.size()));
+        detail::put<uint64_t>(record, detail::checksum(payload, 0, payload.size()));
+        record += payload;
+        return detail::write_all(fd_, record.data(), record.size()) && fdatasync(fd_) == 0;
+    }
+};
+
+// One job of this process, shared between the JNI calls and its runner
+struct Job {
+    std::string dir;
+    Manifest manifest;
+    std::mutex mutex;  // guards log
+    OutputLog log;
+    std::atomic<int> state{kStateStopped};
+    std::atomic<int> wait{kWaitNone};
+    std::atomic<bool> cancelled{false};  // stop for good in this process
+    std::atomic<bool> window_stop{false};  // stop the running window (the device was unplugged)
+    std::atomic<bool> queued{false};  // a runner is queued or running for it
+};
+
+}  // namespace batch_job
@@ -0,0 +1,523 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "generation_config.h"
+#include "json_grammar.h"
+#include "latency_metrics.h"
+#include "output_lengths.h"
+#include "request_cost.h"
+#include "request_priority.h"
+#include "sp_tokenizer.h"
+#include "stop_strings.h"
+#include "trace_context.h"
+
+/**
+ * Continuous (in-flight) batching of independent generation requests.
+ *
+ * Every active request is one sequence in the module's batched KV cache. Each
+ * step() is one token boundary: finished and cancelled sequences retire,
+ * waiting requests are admitted (one prefill per step, so running decodes are
+ * never stalled behind a queue of prompts), and then all active sequences
+ * advance by one token in a single forward pass. Decode on a phone is bound
+ * by reading the weights, so a pass over N sequences costs little more than
+ * a pass over one.
+ *
+ * Requests carry a priority class. Waiting requests are admitted highest class
+ * first, FIFO within a class. When the batch is full and a request of a higher
+ * class waits, the lowest-class active sequence is preempted at the token
+ * boundary: it leaves the decode batch but keeps its KV in the module, parked,
+ * and rejoins ahead of waiting requests of its class once there is room.
+ *
+ * Admission also keeps to the KV the engine can give the batch: a request
+ * reserves its prompt plus the answer length its task usually needs
+ * (output_lengths.h), not max_gen_len, and waits while the batch's KV, held
+ * or reserved, would not fit it; what it may hold depends on the request's
+ * class (memory_forecast.h). The batch always admits into an empty one.
+ *
+ * Each pass's CPU time and energy is charged to the sequences in it, evenly;
+ * a prefill to its own sequence.
+ *
+ * The scheduler owns no threads and no model state; the engine supplies the
+ * forward passes and sampling through Backend and calls step() in a loop.
+ */
+
+struct BatchSequence {
+    using Clock = std::chrono::steady_clock;
+
+    int64_t request = 0;  // AsyncRequestTable id
+    int64_t seq_id = 0;   // sequence in the module's batched KV
+    int priority = kPriorityBackground;
+    int task = kTaskChat;  // whose answer lengths size its KV reservation
+    uint64_t reserved_tokens = 0;  // KV reserved at admission, prompt included; 0 until then
+    std::string prompt;
+    GenerationConfig config;
+    bool default_config = false;  // take the engine's defaults at admission
+    std::string adapter;  // LoRA adapter held while it decodes (see lora_adapters.h)
+    std::vector<int> generated;
+    int next_token = -1;  // sampled from the last pass, not fed back yet
+    std::unique_ptr<SpStreamDecoder> decoder;
+    Clock::time_point enqueued_at;
+
+    // Branches of a shared prefix (generateBatch): `prompt` is only the suffix,
+    // and the prefix is prefilled once per group. group 0 is a lone request.
+    int64_t group = 0;
+    int index = 0;
+    int group_size = 1;
+    std::shared_ptr<const std::string> prefix;
+    std::function<void(int index, const std::string& text)> on_text;  // besides Backend::emit
+
+    // Ends the sequence early, without emitting the stop string
+    std::unique_ptr<StopStringMatcher> stops;
+    // Stop strings that are single pieces, on top of Backend::is_stop
+    std::vector<int> stop_tokens;
+    // Own generator for a seeded config, swapped into the shared sampler for
+    // this sequence's rows so its output does not depend on its batch mates
+    std::mt19937_64 rng;
+    // Keeps the output to the config's JSON schema, when it has one
+    std::unique_ptr<GrammarMatcher> grammar;
+    // Stage timestamps for LatencyMetrics; prefill sets prompt_tokens
+    RequestTiming timing;
+};
+
+// Latency of one priority class, over the requests it admitted
+struct ClassLatency {
+    uint64_t requests = 0;
+    uint64_t preemptions = 0;
+    double total_wait_ms = 0.0;         // enqueue to admission
+    double total_first_token_ms = 0.0;  // enqueue to first token
+    double max_first_token_ms = 0.0;
+    uint64_t first_tokens = 0;          // requests that produced one
+
+    float mean_wait_ms() const {
+        return requests == 0 ? 0.0f : static_cast<float>(total_wait_ms / static_cast<double>(requests));
+    }
+    float mean_first_token_ms() const {
+        return first_tokens == 0 ? 0.0f
+                                 : static_cast<float>(total_first_token_ms / static_cast<double>(first_tokens));
+    }
+};
+
+struct BatchStats {
+    uint64_t steps = 0;           // batched forward passes
+    uint64_t tokens = 0;          // tokens decoded by them
+    uint64_t requests = 0;        // sequences admitted
+    uint32_t peak_batch = 0;
+    uint32_t active = 0;          // as of the last step
+    uint32_t parked = 0;          // preempted, KV kept
+    uint32_t waiting = 0;
+    uint64_t kv_tokens = 0;       // KV held or reserved by the batch, as of the last step
+    uint64_t kv_deferrals = 0;    // steps an admission waited for KV
+    ClassLatency classes[kPriorityClasses];
+
+    float average_batch() const {
+        return steps == 0 ? 0.0f : static_cast<float>(tokens) / static_cast<float>(steps);
+    }
+};
+
+class BatchScheduler {
+public:
+    static constexpr int kDefaultMaxBatch = 4;
+
+    struct Backend {
+        // Prefill the sequence's prompt and sample its first token into next_token
+        std::function<bool(BatchSequence&)> prefill;
+        // One pass feeding every sequence its next_token, sampling the following one
+        std::function<bool(const std::vector<BatchSequence*>&)> decode;
+        // Free the sequence's KV
+        std::function<void(BatchSequence&)> release;
+        std::function<bool(int token)> is_stop;
+        std::function<bool(const BatchSequence&)> cancelled;
+        std::function<void(const BatchSequence&, const std::string& text)> emit;
+        // Optional. KV tokens to reserve for a waiting sequence, and what the batch may hold for one
+        // of a priority class (0: no limit)
+        std::function<uint64_t(const BatchSequence&)> reserve;
+        std::function<uint64_t(int priority)> kv_capacity;
+        // Optional. A sequence ran to its end (not failed), before release
+        std::function<void(const BatchSequence&)> completed;
+    };
+
+    // A sequence that left the batch, for the caller to complete outside its locks
+    struct Finished {
+        int64_t request;
+        bool ok;
+        std::string error;
+    };
+
+    // Where retired sequences report their stage latencies; null to stop
+    void set_metrics(LatencyMetrics* metrics) {
+        metrics_ = metrics;
+    }
+
+    void set_max_batch(int n) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_batch_ = std::max(1, n);
+    }
+
+    int max_batch() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_batch_;
+    }
+
+    // A lower cap on top of max_batch while the generation governor holds back; 0 lifts it.
+    // Sequences already in the batch finish; only admissions wait.
+    void set_batch_limit(int n) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch_limit_ = std::max(0, n);
+    }
+
+    // Thread-safe; the sequence waits until a step admits it
+    void enqueue(BatchSequence seq) {
+        seq.priority = std::min(std::max(seq.priority, 0), kPriorityClasses - 1);
+        seq.enqueued_at = BatchSequence::Clock::now();
+        seq.timing.enqueued = seq.enqueued_at;
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiting_.push_back(std::move(seq));
+    }
+
+    bool idle() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return waiting_.empty() && stats_.active == 0 && stats_.parked == 0;
+    }
+
+    // One token boundary. Appends the sequences that finished to `finished`
+    // and returns false once nothing is waiting or active.
+    bool step(const Backend& backend, std::vector<Finished>* finished) {
+        admit(backend, finished);
+
+        // Emit what the last pass sampled and retire completed sequences
+        for (auto it = active_.begin(); it != active_.end();) {
+            BatchSequence& seq = **it;
+            trace_context::Scope trace(seq.timing.trace_id);  // delivery is per request; the shared pass is not
+            bool done = backend.cancelled(seq) || seq.next_token < 0 || backend.is_stop(seq.next_token) ||
+                        std::find(seq.stop_tokens.begin(), seq.stop_tokens.end(), seq.next_token) !=
+                            seq.stop_tokens.end() ||
+                        static_cast<int>(seq.generated.size()) >= seq.config.max_gen_len;
+            if (!done) {
+                if (seq.generated.empty()) {
+                    record_first_token(seq);
+                }
+                seq.generated.push_back(seq.next_token);
+                seq.timing.token();
+                std::string text = seq.decoder ? seq.decoder->push(seq.next_token) : std::string();
+                if (seq.stops) {
+                    text = seq.stops->push(text);
+                }
+                if (!text.empty()) {
+                    emit(backend, seq, text);
+                }
+                done = static_cast<int>(seq.generated.size()) >= seq.config.max_gen_len ||
+                       (seq.stops && seq.stops->stopped());
+            }
+            if (done) {
+                retire(backend, seq, true, std::string(), finished);
+                it = active_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if (!active_.empty()) {
+            std::vector<BatchSequence*> batch;
+            batch.reserve(active_.size());
+            for (auto& seq : active_) {
+                batch.push_back(seq.get());
+            }
+            bool ok = false;
+            std::string error = "Batched decode failed";
+            request_cost::Span span;
+            try {
+                ok = backend.decode(batch);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            double share = 1.0 / static_cast<double>(batch.size());
+            uint64_t cpu = static_cast<uint64_t>(span.process_us() * share);
+            uint64_t thread_cpu = static_cast<uint64_t>(span.thread_us() * share);
+            double mj = span.energy_mj() * share;
+            for (BatchSequence* seq : batch) {
+                seq->timing.charge(cpu, thread_cpu, mj);
+            }
+            if (ok) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.steps++;
+                stats_.tokens += batch.size();
+                stats_.peak_batch = std::max(stats_.peak_batch, static_cast<uint32_t>(batch.size()));
+            } else {
+                for (auto& seq : active_) {
+                    retire(backend, *seq, false, error, finished);
+                }
+                active_.clear();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.active = static_cast<uint32_t>(active_.size());
+        stats_.parked = static_cast<uint32_t>(parked_.size());
+        stats_.kv_tokens = kv_held();
+        return !waiting_.empty() || !active_.empty() || !parked_.empty();
+    }
+
+    // A request served outside the batch (a blocking chat turn) waited `wait_ms` for the engine
+    void record_wait(int priority, double wait_ms) {
+        priority = std::min(std::max(priority, 0), kPriorityClasses - 1);
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.classes[priority].requests++;
+        stats_.classes[priority].total_wait_ms += wait_ms;
+    }
+
+    // Most urgent class waiting, parked or in the batch; kPriorityClasses when idle
+    int top_priority() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int top = kPriorityClasses;
+        for (const auto& seq : waiting_) top = std::min(top, seq.priority);
+        for (const auto& seq : active_) top = std::min(top, seq->priority);
+        for (const auto& seq : parked_) top = std::min(top, seq->priority);
+        return top;
+    }
+
+    BatchStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        BatchStats stats = stats_;
+        stats.waiting = static_cast<uint32_t>(waiting_.size());
+        return stats;
+    }
+
+    // Drop everything, e.g. when the engine closes; the caller completes them as failed
+    void clear(const Backend& backend, std::vector<Finished>* finished) {
+        for (auto& seq : active_) {
+            retire(backend, *seq, false, "Engine closed", finished);
+        }
+        active_.clear();
+        for (auto& seq : parked_) {
+            retire(backend, *seq, false, "Engine closed", finished);
+        }
+        parked_.clear();
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.active = 0;
+        stats_.parked = 0;
+        for (auto& seq : waiting_) {
+            finished->push_back({seq.request, false, "Engine closed"});
+        }
+        waiting_.clear();
+    }
+
+private:
+    std::mutex mutex_;  // guards waiting_, max_batch_, batch_limit_ and stats_
+    std::deque<BatchSequence> waiting_;
+    // active_ and parked_ belong to the stepping thread; parked_ is in admission order
+    std::vector<std::unique_ptr<BatchSequence>> active_;
+    std::vector<std::unique_ptr<BatchSequence>> parked_;
+    int max_batch_ = kDefaultMaxBatch;
+    int batch_limit_ = 0;
+    LatencyMetrics* metrics_ = nullptr;
+    int64_t next_seq_id_ = 1;
+    BatchStats stats_;
+
+    // Under mutex_
+    int admit_limit() const {
+        return batch_limit_ > 0 ? std::min(max_batch_, batch_limit_) : max_batch_;
+    }
+
+    // KV of the admitted sequences: what each reserved, or holds once past it
+    uint64_t kv_held() const {
+        uint64_t held = 0;
+        for (const auto* list : {&active_, &parked_}) {
+            for (const auto& seq : *list) {
+                held += std::max<uint64_t>(seq->reserved_tokens, seq->timing.prompt_tokens + seq->generated.size());
+            }
+        }
+        return held;
+    }
+
+    // Whether the waiting sequence fits the KV left; reserves it on the way. Under mutex_.
+    bool kv_admits(const Backend& backend, BatchSequence& seq) {
+        if (seq.reserved_tokens == 0 && backend.reserve) {
+            seq.reserved_tokens = backend.reserve(seq);
+        }
+        uint64_t capacity = backend.kv_capacity ? backend.kv_capacity(seq.priority) : 0;
+        if (capacity == 0 || active_.empty() || kv_held() + seq.reserved_tokens <= capacity) {
+            return true;
+        }
+        stats_.kv_deferrals++;
+        return false;
+    }
+
+    // Highest class first, oldest first within it; waiting_.size() if empty. Under mutex_.
+    size_t best_waiting() const {
+        size_t best = waiting_.size();
+        for (size_t i = 0; i < waiting_.size(); ++i) {
+            if (best == waiting_.size() || waiting_[i].priority < waiting_[best].priority) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    size_t best_parked() const {
+        size_t best = parked_.size();
+        for (size_t i = 0; i < parked_.size(); ++i) {
+            if (best == parked_.size() || parked_[i]->priority < parked_[best]->priority) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // Active sequence to preempt for a request of class `priority`: the lowest
+    // class below it, latest admitted first. active_.size() if none.
+    size_t preemption_victim(int priority) const {
+        size_t victim = active_.size();
+        for (size_t i = 0; i < active_.size(); ++i) {
+            if (active_[i]->priority > priority &&
+                (victim == active_.size() || active_[i]->priority >= active_[victim]->priority)) {
+                victim = i;
+            }
+        }
+        return victim;
+    }
+
+    void admit(const Backend& backend, std::vector<Finished>* finished) {
+        // Cancelled parked sequences retire without rejoining
+        for (auto it = parked_.begin(); it != parked_.end();) {
+            if (backend.cancelled(**it)) {
+                retire(backend, **it, true, std::string(), finished);
+                it = parked_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Parked sequences rejoin for free, ahead of waiting requests of their class
+        while (!parked_.empty()) {
+            size_t p = best_parked();
+            size_t w = best_waiting();
+            if (w < waiting_.size() && waiting_[w].priority < parked_[p]->priority) {
+                break;
+            }
+            if (static_cast<int>(active_.size()) >= admit_limit() && !make_room(parked_[p]->priority)) {
+                break;
+            }
+            active_.push_back(std::move(parked_[p]));
+            parked_.erase(parked_.begin() + static_cast<std::ptrdiff_t>(p));
+        }
+
+        // Then at most one prefill, preempting a lower class if the batch is full
+        size_t w = best_waiting();
+        if (w == waiting_.size()) {
+            return;
+        }
+        // Preempting frees no KV (a parked sequence keeps it), so that is checked first
+        if (!kv_admits(backend, waiting_[w])) {
+            return;
+        }
+        if (static_cast<int>(active_.size()) >= admit_limit() && !make_room(waiting_[w].priority)) {
+            return;
+        }
+        auto seq = std::make_unique<BatchSequence>(std::move(waiting_[w]));
+        waiting_.erase(waiting_.begin() + static_cast<std::ptrdiff_t>(w));
+        lock.unlock();
+
+        if (backend.cancelled(*seq)) {
+            retire(backend, *seq, true, std::string(), finished);
+            return;
+        }
+        seq->seq_id = next_seq_id_++;
+        bool ok = false;
+        std::string error = "Prefill failed";
+        trace_context::Scope trace(seq->timing.trace_id);
+        seq->timing.admit();
+        seq->timing.begin_prefill();
+        request_cost::Span span;
+        try {
+            ok = backend.prefill(*seq);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        seq->timing.end_prefill();
+        seq->timing.charge(span.process_us(), span.thread_us(), span.energy_mj());
+        lock.lock();
+        ClassLatency& latency = stats_.classes[seq->priority];
+        latency.total_wait_ms += elapsed_ms(seq->enqueued_at);
+        latency.requests++;
+        if (!ok) {
+            lock.unlock();
+            retire(backend, *seq, false, error, finished);
+            return;
+        }
+        stats_.requests++;
+        active_.push_back(std::move(seq));
+        stats_.active = static_cast<uint32_t>(active_.size());
+    }
+
+    // Park one active sequence of a lower class than `priority`. Under mutex_.
+    bool make_room(int priority) {
+        size_t victim = preemption_victim(priority);
+        if (victim == active_.size()) {
+            return false;
+        }
+        stats_.classes[active_[victim]->priority].preemptions++;
+        parked_.push_back(std::move(active_[victim]));
+        active_.erase(active_.begin() + static_cast<std::ptrdiff_t>(victim));
+        return true;
+    }
+
+    void record_first_token(const BatchSequence& seq) {
+        double ms = elapsed_ms(seq.enqueued_at);
+        std::lock_guard<std::mutex> lock(mutex_);
+        ClassLatency& latency = stats_.classes[seq.priority];
+        latency.total_first_token_ms += ms;
+        latency.max_first_token_ms = std::max(latency.max_first_token_ms, ms);
+        latency.first_tokens++;
+    }
+
+    static double elapsed_ms(BatchSequence::Clock::time_point since) {
+        return std::chrono::duration<double, std::milli>(BatchSequence::Clock::now() - since).count();
+    }
+
+    static void emit(const Backend& backend, const BatchSequence& seq, const std::string& text) {
+        backend.emit(seq, text);
+        if (seq.on_text) {
+            seq.on_text(seq.index, text);
+        }
+    }
+
+    // Every sequence that was dequeued retires here once, released or not
+    void retire(const Backend& backend, BatchSequence& seq, bool ok, const std::string& error,
+                std::vector<Finished>* finished) {
+        if (ok && seq.decoder) {
+            std::string tail = seq.decoder->flush();
+            if (seq.stops) {
+                tail = seq.stops->push(tail);
+                tail += seq.stops->flush();
+            }
+            if (!tail.empty()) {
+                emit(backend, seq, tail);
+            }
+        }
+        if (ok && backend.completed) {
+            backend.completed(seq);
+        }
+        try {
+            backend.release(seq);
+        } catch (const std::exception&) {
+            // The sequence is gone either way
+        }
+        if (metrics_ != nullptr) {
+            seq.timing.ok = ok;
+            metrics_->record(seq.timing);
+        }
+        finished->push_back({seq.request, ok, error});
+    }
+};
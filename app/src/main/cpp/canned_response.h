@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "topic_router.h"
+
+/**
+ * Canned answers by subject, for when no model can answer: the MlcEngine
+ * placeholder in mlc_llm_jni.cpp, and the real engine when a request's
+ * deadline cannot be met by generating (deadline.h).
+ */
+namespace canned_response {
+
+// Educational responses by topic
+constexpr size_t kResponsesPerTopic = 3;
+constexpr std::string_view kTopicResponses[kSubjectCount][kResponsesPerTopic] = {
+    {
+        "In mathematics, we approach this problem by identifying the variables and constants, then applying the appropriate formulas. For instance, in algebra, we might isolate the variable to solve for the unknown value.",
+        "This appears to be a mathematical concept related to functions and their properties. Remember that functions map inputs to unique outputs, and understanding their domain and range is crucial.",
+        "When working with geometric problems, it's helpful to visualize the shapes and their properties. The key principles of congruence and similarity can often lead to elegant solutions.",
+    },
+    {
+        "In physics, this phenomenon is explained by the conservation of energy principle, which states that energy cannot be created or destroyed, only transformed from one form to another.",
+        "When analyzing motion in physics, we typically use Newton's laws to understand the relationship between force, mass, and acceleration. These fundamental principles help us predict how objects move.",
+        "Quantum mechanics describes this behavior at the subatomic level, where particles exhibit both wave-like and particle-like properties, leading to probabilistic rather than deterministic outcomes.",
+    },
+    {
+        "In chemistry, this reaction occurs because electrons are transferred between atoms, creating a more stable electron configuration for both reactants. This is the basis of most chemical bonds.",
+        "The periodic table organizes elements based on their atomic numbers and chemical properties, revealing patterns that help predict how elements will behave in various reactions.",
+        "When examining molecular structures, we focus on the arrangement of atoms and the bonds between them, which determine the physical and chemical properties of the substance.",
+    },
+    {
+        "In cellular biology, this process is facilitated by specialized proteins that transport materials across the cell membrane, maintaining the cell's internal environment.",
+        "Evolutionary adaptations like this develop over generations through natural selection, where traits that enhance survival and reproduction become more common in a population.",
+        "The genetic code in DNA provides instructions for building proteins, which carry out most of the cell's functions and give organisms their specific characteristics.",
+    },
+    {
+        "This historical event was influenced by economic factors, political tensions, and social movements that converged to create significant change in society.",
+        "Throughout history, civilizations have developed similar solutions to common problems, demonstrating parallel evolution in human innovation across different geographical regions.",
+        "Primary sources from this period reveal the complexity of perspectives and experiences, challenging simplified narratives that emerged in later historical accounts.",
+    },
+    {
+        "In literature, this narrative technique creates depth by allowing readers to understand characters' thoughts and motivations, creating empathy and connection with fictional personas.",
+        "The author's use of symbolism in this text adds layers of meaning beyond the literal interpretation, inviting readers to engage with the work on multiple levels.",
+        "Literary movements are influenced by the historical and cultural context in which they emerge, reflecting the concerns, values, and artistic sensibilities of their time.",
+    },
+    {
+        "In computer science, algorithms are designed to solve problems efficiently by breaking them down into a series of well-defined steps that can be implemented in code.",
+        "Data structures are specialized formats for organizing and storing data to facilitate specific operations. Choosing the right data structure significantly impacts an application's performance.",
+        "Software engineering principles emphasize maintainability, scalability, and reliability through practices like modular design, testing, and documentation.",
+    },
+    {
+        "Based on educational principles, this concept involves critical thinking and analysis of the available information to draw meaningful conclusions.",
+        "Learning about this topic involves understanding key principles and their applications in real-world scenarios, which helps develop both knowledge and practical skills.",
+        "Educational research suggests that connecting new information to existing knowledge enhances retention and comprehension, making learning more effective and meaningful.",
+    },
+};
+
+// Key terms used to quote the relevant part of the prompt back to the user
+constexpr size_t kIntroKeywordsPerTopic = 6;
+constexpr std::string_view kIntroKeywords[kSubjectCount][kIntroKeywordsPerTopic] = {
+    {"equation", "problem", "formula", "calculate", "solve", "function"},
+    {"force", "energy", "motion", "gravity", "acceleration", "velocity"},
+    {"reaction", "molecule", "element", "compound", "acid", "bond"},
+    {"cell", "organism", "species", "evolution", "gene", "protein"},
+    {"event", "war", "revolution", "period", "century", "civilization"},
+    {"book", "novel", "author", "character", "story", "theme"},
+    {"algorithm", "code", "program", "data", "function", "system"},
+    {"concept", "idea", "principle", "theory", "topic", "subject"},
+};
+
+constexpr std::string_view kClosingPrefix =
+    "\n\nTo further understand this concept, you might want to explore related ideas and practice with examples. "
+    "The key to mastering ";
+constexpr std::string_view kClosingSuffix = " is to connect theoretical knowledge with practical applications.";
+
+// Append an intro that quotes the question, or the text around a topic keyword
+inline bool append_quoted_intro(std::string& out, std::string_view prompt, Subject topic) {
+    // Try to extract the question part
+    size_t questionPos = prompt.find('?');
+    if (questionPos != std::string_view::npos && questionPos > 10) {
+        // Look for the start of the question
+        size_t questionStart = prompt.rfind('.', questionPos);
+        if (questionStart == std::string_view::npos || questionStart > questionPos - 10) {
+            questionStart = prompt.rfind(',', questionPos);
+        }
+        if (questionStart == std::string_view::npos || questionStart > questionPos - 10) {
+            questionStart = 0;
+        } else {
+            questionStart += 1; // Skip the period or comma
+        }
+        
+        std::string_view question = prompt.substr(questionStart, questionPos - questionStart + 1);
+        if (question.length() > 10) {
+            out.append("Regarding your question: \"").append(question).append("\"\n\n");
+            return true;
+        }
+    }
+    
+    // Find if any of the topic's key terms are in the prompt
+    for (std::string_view keyword : kIntroKeywords[topic]) {
+        size_t pos = prompt.find(keyword);
+        if (pos == std::string_view::npos) {
+            continue;
+        }
+        
+        // Extract a phrase around the keyword
+        size_t start = (pos > 15) ? pos - 15 : 0;
+        size_t end = (pos + keyword.length() + 15 < prompt.length()) ? 
+                      pos + keyword.length() + 15 : prompt.length();
+        std::string_view context = prompt.substr(start, end - start);
+        
+        // Clean up the context (find word boundaries)
+        if (start > 0) {
+            size_t firstSpace = context.find(' ');
+            if (firstSpace != std::string_view::npos && firstSpace < pos - start) {
+                context.remove_prefix(firstSpace + 1);
+            }
+        }
+        if (end < prompt.length()) {
+            size_t lastSpace = context.find_last_of(" .");
+            if (lastSpace != std::string_view::npos) {
+                context = context.substr(0, lastSpace + 1);
+            }
+        }
+        
+        out.append("Regarding the ").append(keyword).append(" you mentioned: \"")
+           .append(context).append("\"\n\n");
+        return true;
+    }
+    return false;
+}
+
+// An educational response on the topic, the `pick`th of its canned ones. The tables above are
+// static, so the output string is the only allocation.
+inline std::string respond(std::string_view prompt, Subject topic, uint32_t pick) {
+    std::string_view topicName = kSubjectNames[topic];
+    std::string_view baseResponse = kTopicResponses[topic][pick % kResponsesPerTopic];
+    
+    std::string response;
+    response.reserve(prompt.length() + 64 + baseResponse.length() +
+                     kClosingPrefix.length() + topicName.length() + kClosingSuffix.length());
+    
+    // If we couldn't quote the prompt, use it whole if it's not too long
+    if (!append_quoted_intro(response, prompt, topic)) {
+        if (prompt.length() < 100) {
+            response.append("Regarding your input: \"").append(prompt).append("\"\n\n");
+        } else {
+            response.append("Regarding your question about ").append(topicName).append(":\n\n");
+        }
+    }
+    
+    // Craft a complete response
+    response.append(baseResponse);
+    response.append(kClosingPrefix).append(topicName).append(kClosingSuffix);
+    return response;
+}
+
+}  // namespace canned_response
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sp_tokenizer.h"
+
+/**
+ * The conversation template of a user turn as token ids, compiled once per
+ * model so a turn costs one tokenization of its text.
+ *
+ * A turn is rendered as user_prefix + text + user_suffix + assistant_prefix,
+ * e.g. for gemma_instruction
+ *   <start_of_turn>user\n{text}<end_of_turn>\n<start_of_turn>model\n
+ * Each fragment is tokenized here with its markers (<start_of_turn>, ...)
+ * taken as their single pieces, and the text on its own. The boundaries
+ * come out the same whatever the text is, which the prefix and KV caches
+ * rely on.
+ *
+ * Only templates of SentencePiece models that add no dummy prefix are
+ * compiled: with one, a fragment tokenized alone would gain a leading space
+ * piece it does not have in place. Anything else is left to the module.
+ */
+class ChatTemplate {
+public:
+    struct Spec {
+        const char* name;  // conv_template in mlc-chat-config.json
+        const char* user_prefix;
+        const char* user_suffix;
+        const char* assistant_prefix;
+    };
+
+    static const Spec* find(const std::string& conv_template) {
+        static const Spec kSpecs[] = {
+            {"gemma_instruction", "<start_of_turn>user\n", "<end_of_turn>\n", "<start_of_turn>model\n"},
+            {"chatml", "<|im_start|>user\n", "<|im_end|>\n", "<|im_start|>assistant\n"},
+        };
+        for (const Spec& spec : kSpecs) {
+            if (conv_template == spec.name) {
+                return &spec;
+            }
+        }
+        return nullptr;
+    }
+
+    // False (and nothing compiled) for an unknown template, or markers that are not single pieces
+    bool compile(const std::string& conv_template, const SpTokenizer& tokenizer) {
+        *this = ChatTemplate();
+        const Spec* spec = find(conv_template);
+        if (spec == nullptr || !tokenizer.loaded() || tokenizer.adds_dummy_prefix()) {
+            return false;
+        }
+        std::vector<int> suffix;
+        if (!fragment(spec->user_prefix, tokenizer, &prefix_) || !fragment(spec->user_suffix, tokenizer, &suffix) ||
+            !fragment(spec->assistant_prefix, tokenizer, &suffix_)) {
+            prefix_.clear();
+            suffix_.clear();
+            return false;
+        }
+        suffix_.insert(suffix_.begin(), suffix.begin(), suffix.end());
+        name_ = spec->name;
+        return true;
+    }
+
+    bool compiled() const { return !name_.empty(); }
+    const std::string& name() const { return name_; }
+    // Template tokens around the text of every turn
+    size_t overhead() const { return prefix_.size() + suffix_.size(); }
+
+    // The ids of a user turn of `text`, up to the assistant header
+    std::vector<int> user_turn(const SpTokenizer& tokenizer, std::string_view text) const {
+        std::vector<int> text_ids = tokenizer.encode(text);
+        return wrap(text_ids);
+    }
+
+    // Likewise for a text already tokenized
+    std::vector<int> wrap(const std::vector<int>& text_ids) const {
+        std::vector<int> ids;
+        ids.reserve(overhead() + text_ids.size());
+        ids.insert(ids.end(), prefix_.begin(), prefix_.end());
+        ids.insert(ids.end(), text_ids.begin(), text_ids.end());
+        ids.insert(ids.end(), suffix_.begin(), suffix_.end());
+        return ids;
+    }
+
+private:
+    // `text` with each <...> marker as its one piece and the rest tokenized
+    static bool fragment(std::string_view text, const SpTokenizer& tokenizer, std::vector<int>* ids) {
+        size_t at = 0;
+        while (at < text.size()) {
+            size_t open = text.find('<', at);
+            size_t close = open == std::string_view::npos ? open : text.find('>', open);
+            size_t end = close == std::string_view::npos ? text.size() : open;
+            if (end > at) {
+                std::vector<int> plain = tokenizer.encode(text.substr(at, end - at));
+                ids->insert(ids->end(), plain.begin(), plain.end());
+            }
+            if (close == std::string_view::npos) {
+                break;
+            }
+            int marker = tokenizer.piece_id(text.substr(open, close + 1 - open));
+            if (marker < 0) {
+                return false;
+            }
+            ids->push_back(marker);
+            at = close + 1;
+        }
+        return true;
+    }
+
+    std::string name_;
+    std::vector<int> prefix_;  // user_prefix
+    std::vector<int> suffix_;  // user_suffix + assistant_prefix
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "shared_pool.h"
+
+/**
+ * Block-compressed weight shards: params_shard_N.bin stored as
+ * params_shard_N.bin.zblk, for downloads and storage that cost about half.
+ *
+ *   Header | uint64 offset[blocks + 1] | block 0 | block 1 | ...
+ *
+ * Every block is an independent zlib stream of `block_bytes` of the shard (the
+ * last one shorter), and offset[i]..offset[i + 1] are its bytes in the file, so
+ * the blocks of one shard decode on several cores at once. zlib rather than
+ * zstd because the NDK ships it as a stable system library. The loader decodes
+ * a shard in its read stage, alongside the uploads of the shards before it.
+ * tools/compress_shards.py writes them.
+ */
+namespace compressed_shard {
+
+static constexpr const char* kSuffix = ".zblk";
+static constexpr uint32_t kMagic = 0x425a4253;  // "SBZB"
+static constexpr uint32_t kVersion = 1;
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_bytes;
+    uint32_t block_count;
+    uint64_t raw_bytes;
+};
+
+static_assert(sizeof(Header) == 24, "matches tools/compress_shards.py");
+
+// Bytes the shard in `file` decodes to; 0 if `file` is not a well-formed compressed shard
+inline uint64_t raw_size(const uint8_t* file, size_t size) {
+    if (size < sizeof(Header)) {
+        return 0;
+    }
+    Header header;
+    memcpy(&header, file, sizeof(header));
+    uint64_t table_end = sizeof(Header) + (uint64_t(header.block_count) + 1) * sizeof(uint64_t);
+    if (header.magic != kMagic || header.version != kVersion || header.block_bytes == 0 || table_end > size ||
+        header.raw_bytes > uint64_t(header.block_count) * header.block_bytes ||
+        header.raw_bytes + header.block_bytes <= uint64_t(header.block_count) * header.block_bytes) {
+        return 0;
+    }
+    const uint8_t* table = file + sizeof(Header);
+    uint64_t previous = table_end;
+    for (uint32_t i = 0; i <= header.block_count; ++i) {
+        uint64_t offset;
+        memcpy(&offset, table + i * sizeof(uint64_t), sizeof(offset));
+        if (offset < previous || offset > size) {
+            return 0;
+        }
+        previous = offset;
+    }
+    return header.raw_bytes;
+}
+
+// Decodes the shard in `file` into `out` (raw_size() bytes) as up to `threads`
+// tasks on the shared pool; false if a block is damaged
+inline bool decode(const uint8_t* file, size_t size, uint8_t* out, unsigned threads) {
+    uint64_t raw = raw_size(file, size);
+    if (raw == 0) {
+        return false;
+    }
+    Header header;
+    memcpy(&header, file, sizeof(header));
+    auto offset = [file](uint32_t i) {
+        uint64_t value;
+        memcpy(&value, file + sizeof(Header) + i * sizeof(uint64_t), sizeof(value));
+        return value;
+    };
+
+    std::atomic<bool> ok{true};
+    auto block = [&](int64_t index) {
+        uint32_t i = static_cast<uint32_t>(index);
+        if (!ok.load(std::memory_order_relaxed)) {
+            return;
+        }
+        uint64_t begin = uint64_t(i) * header.block_bytes;
+        uLongf expected = static_cast<uLongf>(std::min<uint64_t>(header.block_bytes, raw - begin));
+        uLongf written = expected;
+        if (uncompress(out + begin, &written, file + offset(i), static_cast<uLong>(offset(i + 1) - offset(i))) !=
+                Z_OK ||
+            written != expected) {
+            ok = false;
+        }
+    };
+    shared_pool::pool().parallel_for(0, header.block_count, block, static_cast<int>(std::max(threads, 1u)));
+    return ok.load();
+}
+
+}  // namespace compressed_shard
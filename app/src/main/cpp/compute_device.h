@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <tvm/runtime/device_api.h>
+
+#include "native_log.h"
+
+/**
+ * Picks the device the chat module runs on.
+ *
+ * Backends are probed through the TVM device API: one that was not compiled
+ * into libtvm_runtime.so has no DeviceAPI, and one without a usable device
+ * (no OpenCL ICD, no Vulkan driver) reports kExist = 0. On Adreno and Mali
+ * phones decode is memory bound and the GPU reads weights several times
+ * faster than the CPU cores, so the order is OpenCL (what MLC's Android
+ * kernels target first), then Vulkan, then CPU. An explicit choice is taken
+ * when that backend exists and otherwise falls back to the same order.
+ *
+ * The NPU (the Hexagon DSP, through TVM's Hexagon runtime) is never the
+ * module's device: it only runs the fixed-shape prefill graphs a model
+ * library may carry for it, as a phase device (phase_devices.h).
+ */
+enum ComputeBackend : int {
+    kBackendAuto = 0,
+    kBackendOpenCL = 1,
+    kBackendVulkan = 2,
+    kBackendCpu = 3,
+    kBackendNpu = 4,  // prefill only
+};
+
+struct ComputeDevice {
+    DLDevice device{kDLCPU, 0};
+    ComputeBackend backend = kBackendCpu;
+    std::string name;  // as the driver reports it; empty for the CPU
+};
+
+inline const char* compute_backend_name(ComputeBackend backend) {
+    switch (backend) {
+        case kBackendOpenCL: return "opencl";
+        case kBackendVulkan: return "vulkan";
+        case kBackendCpu: return "cpu";
+        case kBackendNpu: return "npu";
+        default: return "auto";
+    }
+}
+
+// "opencl", "vulkan" or "cpu"; anything else is auto
+inline ComputeBackend compute_backend_from_name(const std::string& name) {
+    if (name == "opencl") return kBackendOpenCL;
+    if (name == "vulkan") return kBackendVulkan;
+    if (name == "cpu") return kBackendCpu;
+    return kBackendAuto;
+}
+
+// A "device" of mlc-chat-config.json (ModelConfig::device), by backend name
+inline ComputeBackend compute_backend_from_device(std::string device) {
+    size_t colon = device.find(':');
+    if (colon != std::string::npos) {
+        device.resize(colon);  // "opencl:0" names the same backend
+    }
+    return compute_backend_from_name(device);
+}
+
+inline DLDevice compute_backend_device(ComputeBackend backend) {
+    switch (backend) {
+        case kBackendOpenCL: return DLDevice{kDLOpenCL, 0};
+        case kBackendVulkan: return DLDevice{kDLVulkan, 0};
+        case kBackendNpu: return DLDevice{kDLHexagon, 0};
+        default: return DLDevice{kDLCPU, 0};
+    }
+}
+
+// The backend is compiled in and has a device; `name` gets the driver's device name
+inline bool compute_device_exists(DLDevice device, std::string* name) {
+    try {
+        tvm::runtime::DeviceAPI* api = tvm::runtime::DeviceAPI::Get(device, /*allow_missing=*/true);
+        if (api == nullptr) {
+            return false;
+        }
+        tvm::runtime::TVMRetValue exists;
+        api->GetAttr(device, tvm::runtime::kExist, &exists);
+        if (exists.type_code() == kTVMNullptr || exists.operator int() == 0) {
+            return false;
+        }
+        if (name != nullptr && device.device_type != kDLCPU) {
+            tvm::runtime::TVMRetValue device_name;
+            api->GetAttr(device, tvm::runtime::kDeviceName, &device_name);
+            if (device_name.type_code() == kTVMStr) {
+                *name = device_name.operator std::string();
+            }
+        }
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+inline ComputeDevice select_compute_device(ComputeBackend preferred) {
+    ComputeDevice chosen;
+    if (preferred != kBackendAuto) {
+        DLDevice device = compute_backend_device(preferred);
+        if (compute_device_exists(device, &chosen.name)) {
+            chosen.device = device;
+            chosen.backend = preferred;
+            return chosen;
+        }
+        NLOGW("ComputeDevice", "Requested %s backend is unavailable, probing",
+              compute_backend_name(preferred));
+    }
+    for (ComputeBackend backend : {kBackendOpenCL, kBackendVulkan}) {
+        DLDevice device = compute_backend_device(backend);
+        if (compute_device_exists(device, &chosen.name)) {
+            chosen.device = device;
+            chosen.backend = backend;
+            return chosen;
+        }
+    }
+    chosen.name.clear();
+    return chosen;
+}
+
+// Every backend with a device, in probing order; the CPU is always last
+inline std::vector<ComputeDevice> available_compute_devices() {
+    std::vector<ComputeDevice> devices;
+    for (ComputeBackend backend : {kBackendOpenCL, kBackendVulkan}) {
+        ComputeDevice candidate;
+        candidate.device = compute_backend_device(backend);
+        candidate.backend = backend;
+        if (compute_device_exists(candidate.device, &candidate.name)) {
+            devices.push_back(candidate);
+        }
+    }
+    devices.push_back(ComputeDevice());
+    return devices;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sp_tokenizer.h"
+
+/**
+ * Long retrieved or OCR'd context thinned to a share of its tokens before
+ * prefill, for requests that ask for it (GenerationConfig.contextRatio).
+ *
+ * Prompt compressors such as LLMLingua score each context token by a small
+ * model's perplexity. The model library here prefills a prompt in one call
+ * and returns the last position's logits only, so the score comes from the
+ * tokenizer instead: a BPE vocabulary is ordered by how often its merges
+ * occur, so by Zipf a piece of rank r carries about log r bits. A word scores
+ * the mean over its pieces, which is its information per token spent, divided
+ * by one plus the times the same word appeared earlier in the context.
+ * Function words and repeats go first; names, terms and rare words stay.
+ *
+ * Words with digits or formula symbols, words with pieces outside the
+ * vocabulary (bytes, user-defined symbols) and "[n]" marks are always kept.
+ * A dropped word leaves its sentence-ending punctuation and its line break
+ * behind, so paragraphs and sentences stay where they were.
+ */
+namespace context_compression {
+
+constexpr size_t kMinTokens = 64;  // shorter contexts are left as they are
+
+struct Result {
+    size_t tokens_in = 0;
+    size_t tokens_out = 0;
+    size_t words_dropped = 0;
+};
+
+namespace detail {
+
+struct Word {
+    size_t text = 0;  // index into the texts
+    size_t begin = 0;
+    size_t end = 0;
+    int newlines_before = 0;  // at most 2: a paragraph break
+    size_t tokens = 0;
+    float density = 0.0f;  // information per token, after repeats
+    bool kept = true;
+    bool fixed = false;  // never dropped
+};
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+inline bool sentence_end(char c) { return c == '.' || c == '!' || c == '?' || c == ':'; }
+
+// Digits, formula symbols and citation marks carry what the text is about
+inline bool fixed_word(std::string_view word) {
+    for (char c : word) {
+        if ((c >= '0' && c <= '9') || strchr("=+<>^%$#@&*/\\|[]{}", c) != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lower case without surrounding punctuation, for counting repeats
+inline std::string repeat_key(std::string_view word) {
+    size_t begin = 0;
+    size_t end = word.size();
+    while (begin < end && strchr("\"'([{", word[begin]) != nullptr) begin++;
+    while (end > begin && strchr("\"')]},.;:!?", word[end - 1]) != nullptr) end--;
+    std::string key(word.substr(begin, end - begin));
+    for (char& c : key) {
+        if (c >= 'A' && c <= 'Z') c = static_cast<char>(c + 32);
+    }
+    return key;
+}
+
+}  // namespace detail
+
+// `texts` thinned together to about `keep` (0..1) of their tokens, so a word
+// repeated across texts counts as a repeat. Returned as they are when `keep`
+// is outside (0, 1), the tokenizer is not loaded or they total under
+// kMinTokens. `result` may be null.
+inline std::vector<std::string> compress(const std::vector<std::string>& texts, double keep,
+                                         const SpTokenizer& tokenizer, Result* result) {
+    Result local;
+    Result* r = result != nullptr ? result : &local;
+    *r = Result();
+    if (!tokenizer.loaded()) {
+        return texts;
+    }
+    for (const std::string& text : texts) {
+        r->tokens_in += tokenizer.count(text);
+    }
+    r->tokens_out = r->tokens_in;
+    if (keep <= 0.0 || keep >= 1.0 || r->tokens_in < kMinTokens) {
+        return texts;
+    }
+
+    std::vector<detail::Word> words;
+    std::unordered_map<std::string, int> seen;
+    size_t total = 0;
+    for (size_t t = 0; t < texts.size(); ++t) {
+        const std::string& text = texts[t];
+        int newlines = 0;
+        size_t i = 0;
+        while (i < text.size()) {
+            if (detail::is_space(text[i])) {
+                newlines += text[i] == '\n';
+                i++;
+                continue;
+            }
+            detail::Word word;
+            word.text = t;
+            word.begin = i;
+            while (i < text.size() && !detail::is_space(text[i])) i++;
+            word.end = i;
+            word.newlines_before = std::min(newlines, 2);
+            newlines = 0;
+
+            std::string_view spelled(text.data() + word.begin, word.end - word.begin);
+            std::vector<int> ids = tokenizer.encode(spelled);
+            word.tokens = std::max<size_t>(1, ids.size());
+            word.fixed = ids.empty() || detail::fixed_word(spelled);
+            double bits = 0.0;
+            for (int id : ids) {
+                if (!tokenizer.normal_piece(id)) {
+                    word.fixed = true;
+                }
+                bits += std::log1p(std::max(0.0f, -tokenizer.piece_score(id)));
+            }
+            int& repeats = seen[detail::repeat_key(spelled)];
+            word.density = static_cast<float>(bits / static_cast<double>(word.tokens) / (1.0 + repeats));
+            repeats++;
+            total += word.tokens;
+            words.push_back(word);
+        }
+    }
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (!words[i].fixed) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&words](size_t a, size_t b) {
+        return words[a].density < words[b].density;
+    });
+    size_t target = static_cast<size_t>(std::ceil(keep * static_cast<double>(total)));
+    size_t kept = total;
+    for (size_t i : order) {
+        if (kept <= target) {
+            break;
+        }
+        words[i].kept = false;
+        kept -= words[i].tokens;
+        r->words_dropped++;
+    }
+
+    std::vector<std::string> out(texts.size());
+    int pending_newlines = 0;
+    size_t current = SIZE_MAX;
+    for (const detail::Word& word : words) {
+        if (word.text != current) {
+            current = word.text;
+            pending_newlines = 0;
+        }
+        std::string& text = out[word.text];
+        pending_newlines = std::max(pending_newlines, word.newlines_before);
+        const char* spelled = texts[word.text].data() + word.begin;
+        if (!word.kept) {
+            char last = spelled[word.end - word.begin - 1];
+            if (detail::sentence_end(last) && !text.empty() && !detail::sentence_end(text.back())) {
+                text += last;
+            }
+            continue;
+        }
+        if (!text.empty()) {
+            text.append(pending_newlines > 0 ? static_cast<size_t>(pending_newlines) : 1,
+                        pending_newlines > 0 ? '\n' : ' ');
+        }
+        pending_newlines = 0;
+        text.append(spelled, word.end - word.begin);
+    }
+    r->tokens_out = 0;
+    for (const std::string& text : out) {
+        r->tokens_out += tokenizer.count(text);
+    }
+    return out;
+}
+
+}  // namespace context_compression
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "model_config.h"
+
+/**
+ * Sliding-window policy for conversations that outgrow the model's context.
+ *
+ * Before a turn, the conversation plus the new prompt and mean_gen_len tokens
+ * of expected answer must fit context_window_size. If it does not, the oldest
+ * turns are shifted out until the remaining history is at most
+ * shift_fill_factor of the window. The system prompt and the first
+ * attention_sink_size tokens always stay, since attention leans on them.
+ * Values come from mlc-chat-config.json; the defaults match the shipped
+ * app config.
+ *
+ * Before that point, once the history passes memory_fill_factor of the
+ * window, its oldest turns are folded into a summary (conversation_memory.h)
+ * down to the same shift_fill_factor, so the window rarely has to drop any.
+ */
+struct ContextWindow {
+    static constexpr int64_t kDefaultSinkTokens = 4;
+
+    int64_t window = 4096;  // context_window_size; <= 0 disables shifting
+    int64_t mean_gen_len = 256;
+    double shift_fill_factor = 0.3;
+    int64_t sink_tokens = kDefaultSinkTokens;
+    double memory_fill_factor = 0.6;  // setConversationMemory; 0 disables folding
+
+    static ContextWindow from_config(const model_config::ModelConfig& config) {
+        ContextWindow cw;
+        cw.window = config.context_window_size;
+        cw.mean_gen_len = config.mean_gen_len;
+        cw.shift_fill_factor = config.shift_fill_factor;
+        // -1 in MLC configs means "model default"
+        int64_t sinks = config.attention_sink_size;
+        cw.sink_tokens = sinks >= 0 ? sinks : kDefaultSinkTokens;
+        if (cw.shift_fill_factor <= 0.0 || cw.shift_fill_factor >= 1.0) {
+            cw.shift_fill_factor = 0.3;
+        }
+        return cw;
+    }
+
+    // Number of oldest turns to shift out before a turn of `prompt_tokens`,
+    // given the fixed prefix and each turn's token count (oldest first)
+    size_t turns_to_shift(uint64_t prefix_tokens, const std::vector<uint64_t>& turn_tokens,
+                          uint64_t prompt_tokens) const {
+        if (window <= 0) {
+            return 0;
+        }
+        uint64_t history = 0;
+        for (uint64_t tokens : turn_tokens) {
+            history += tokens;
+        }
+        uint64_t fixed = prefix_tokens + static_cast<uint64_t>(sink_tokens);
+        uint64_t need = fixed + history + prompt_tokens + static_cast<uint64_t>(mean_gen_len);
+        if (need < static_cast<uint64_t>(window)) {
+            return 0;
+        }
+        uint64_t keep = static_cast<uint64_t>(shift_fill_factor * static_cast<double>(window));
+        size_t drop = 0;
+        while (drop < turn_tokens.size() && history > keep) {
+            history -= turn_tokens[drop++];
+        }
+        return drop;
+    }
+    
+    // Number of oldest turns to fold into the conversation's summary after a
+    // turn, leaving at least `keep` turns; 0 while the history is below
+    // memory_fill_factor. The prefix includes the summary folded so far.
+    size_t turns_to_fold(uint64_t prefix_tokens, const std::vector<uint64_t>& turn_tokens, size_t keep) const {
+        if (window <= 0 || memory_fill_factor <= 0.0 || turn_tokens.size() <= keep) {
+            return 0;
+        }
+        uint64_t history = 0;
+        for (uint64_t tokens : turn_tokens) {
+            history += tokens;
+        }
+        uint64_t fixed = prefix_tokens + static_cast<uint64_t>(sink_tokens);
+        uint64_t need = fixed + history + static_cast<uint64_t>(mean_gen_len);
+        if (need < static_cast<uint64_t>(memory_fill_factor * static_cast<double>(window))) {
+            return 0;
+        }
+        uint64_t keep_tokens = static_cast<uint64_t>(shift_fill_factor * static_cast<double>(window));
+        size_t fold = 0;
+        while (fold + keep < turn_tokens.size() && history > keep_tokens) {
+            history -= turn_tokens[fold++];
+        }
+        return fold;
+    }
+};
@@ -0,0 +1,305 @@
+#include "conversation_log.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("CONVERSATION_LOG", __VA_ARGS__)
+#define LOGE(...) NLOGE("CONVERSATION_LOG", __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t kFileMagic = 0x4c434253;    // "SBCL"
+constexpr uint32_t kRecordMagic = 0x4e525554;  // "TURN"
+constexpr uint32_t kVersion = 1;
+constexpr char kLogSuffix[] = ".log";
+constexpr char kIndexSuffix[] = ".idx";
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_hash;
+};
+
+// Followed by the text, padded to 4 bytes, and the ids
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t role;
+    uint32_t text_bytes;
+    uint32_t ids;
+};
+
+size_t padded(size_t bytes) {
+    return (bytes + 3) & ~static_cast<size_t>(3);
+}
+
+uint64_t record_bytes(const RecordHeader& header) {
+    return sizeof(RecordHeader) + padded(header.text_bytes) + static_cast<uint64_t>(header.ids) * sizeof(int32_t);
+}
+
+bool write_all(int fd, const void* data, size_t size, uint64_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, p, size, static_cast<off_t>(offset));
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        size -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+    }
+    return true;
+}
+
+bool read_all(int fd, void* data, size_t size, uint64_t offset) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = pread(fd, p, size, static_cast<off_t>(offset));
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        size -= static_cast<size_t>(got);
+        offset += static_cast<uint64_t>(got);
+    }
+    return true;
+}
+
+}  // namespace
+
+bool ConversationLog::open(const std::string& path, uint64_t model_hash) {
+    close();
+    std::string log_path = path + kLogSuffix;
+    std::string index_path = path + kIndexSuffix;
+    log_fd_ = ::open(log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    index_fd_ = ::open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (log_fd_ < 0 || index_fd_ < 0) {
+        LOGE("Cannot open conversation log %s", path.c_str());
+        close();
+        return false;
+    }
+    path_ = path;
+    model_hash_ = model_hash;
+
+    struct stat st;
+    FileHeader header{};
+    bool valid = fstat(log_fd_, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(header) &&
+                 read_all(log_fd_, &header, sizeof(header), 0) && header.magic == kFileMagic &&
+                 header.version == kVersion;
+    if (valid && header.model_hash != model_hash) {
+        LOGI("Conversation log %s was written for another model, starting it over", path.c_str());
+        valid = false;
+    }
+    if (!valid) {
+        header = FileHeader{kFileMagic, kVersion, model_hash};
+        if (ftruncate(log_fd_, 0) != 0 || !write_all(log_fd_, &header, sizeof(header), 0) ||
+            ftruncate(index_fd_, 0) != 0) {
+            LOGE("Cannot initialize conversation log %s", path.c_str());
+            close();
+            return false;
+        }
+        log_bytes_ = sizeof(header);
+        return true;
+    }
+    log_bytes_ = static_cast<uint64_t>(st.st_size);
+
+    // Index entries that point at whole records, in order, up to the first that does not
+    struct stat index_st;
+    size_t count = fstat(index_fd_, &index_st) == 0 ? static_cast<size_t>(index_st.st_size) / sizeof(uint64_t) : 0;
+    offsets_.resize(count);
+    if (count > 0 && !read_all(index_fd_, offsets_.data(), count * sizeof(uint64_t), 0)) {
+        offsets_.clear();
+    }
+    uint64_t end = sizeof(FileHeader);
+    size_t good = 0;
+    for (; good < offsets_.size(); ++good) {
+        RecordHeader record;
+        if (offsets_[good] != end || end + sizeof(record) > log_bytes_ ||
+            !read_all(log_fd_, &record, sizeof(record), end) || record.magic != kRecordMagic ||
+            end + record_bytes(record) > log_bytes_) {
+            break;
+        }
+        end += record_bytes(record);
+    }
+    offsets_.resize(good);
+    if (end != log_bytes_ || count != good) {
+        return rebuild_index();
+    }
+    return true;
+}
+
+// Walk the records from the start, cut the log after the last whole one and write the index again
+bool ConversationLog::rebuild_index() {
+    offsets_.clear();
+    uint64_t end = sizeof(FileHeader);
+    RecordHeader record;
+    while (end + sizeof(record) <= log_bytes_ && read_all(log_fd_, &record, sizeof(record), end) &&
+           record.magic == kRecordMagic && end + record_bytes(record) <= log_bytes_) {
+        offsets_.push_back(end);
+        end += record_bytes(record);
+    }
+    if (end != log_bytes_) {
+        LOGI("Conversation log %s ends in a partial message, dropping it", path_.c_str());
+    }
+    log_bytes_ = end;
+    if (ftruncate(log_fd_, static_cast<off_t>(end)) != 0 || ftruncate(index_fd_, 0) != 0 ||
+        !write_all(index_fd_, offsets_.data(), offsets_.size() * sizeof(uint64_t), 0)) {
+        LOGE("Cannot rebuild the index of %s", path_.c_str());
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ConversationLog::close() {
+    unmap();
+    if (log_fd_ >= 0) {
+        ::close(log_fd_);
+    }
+    if (index_fd_ >= 0) {
+        ::close(index_fd_);
+    }
+    log_fd_ = -1;
+    index_fd_ = -1;
+    log_bytes_ = 0;
+    offsets_.clear();
+}
+
+void ConversationLog::unmap() {
+    if (map_ != nullptr) {
+        munmap(const_cast<char*>(map_), map_bytes_);
+    }
+    map_ = nullptr;
+    map_bytes_ = 0;
+}
+
+// Map the log through at least `bytes`; the mapping is replaced when the log has grown past it
+bool ConversationLog::map_to(uint64_t bytes) {
+    if (map_ != nullptr && map_bytes_ >= bytes) {
+        return true;
+    }
+    unmap();
+    void* addr = mmap(nullptr, static_cast<size_t>(log_bytes_), PROT_READ, MAP_SHARED, log_fd_, 0);
+    if (addr == MAP_FAILED) {
+        LOGE("Failed to mmap %s%s", path_.c_str(), kLogSuffix);
+        return false;
+    }
+    map_ = static_cast<const char*>(addr);
+    map_bytes_ = static_cast<size_t>(log_bytes_);
+    return map_bytes_ >= bytes;
+}
+
+bool ConversationLog::entry(size_t i, Entry* entry) {
+    if (i >= offsets_.size()) {
+        return false;
+    }
+    uint64_t end = i + 1 < offsets_.size() ? offsets_[i + 1] : log_bytes_;
+    if (!map_to(end)) {
+        return false;
+    }
+    RecordHeader record;
+    memcpy(&record, map_ + offsets_[i], sizeof(record));
+    const char* text = map_ + offsets_[i] + sizeof(record);
+    entry->role = static_cast<Role>(record.role);
+    entry->text = std::string_view(text, record.text_bytes);
+    entry->ids = reinterpret_cast<const int32_t*>(text + padded(record.text_bytes));
+    entry->id_count = record.ids;
+    return true;
+}
+
+std::vector<int32_t> ConversationLog::ids(size_t first, size_t last) {
+    std::vector<int32_t> out;
+    out.reserve(id_count(first, last));
+    Entry e;
+    for (size_t i = first; i < last && entry(i, &e); ++i) {
+        out.insert(out.end(), e.ids, e.ids + e.id_count);
+    }
+    return out;
+}
+
+size_t ConversationLog::id_count(size_t first, size_t last) {
+    size_t count = 0;
+    Entry e;
+    for (size_t i = first; i < last && entry(i, &e); ++i) {
+        count += e.id_count;
+    }
+    return count;
+}
+
+bool ConversationLog::append(Role role, std::string_view text, const std::vector<int>& ids) {
+    if (!is_open()) {
+        return false;
+    }
+    RecordHeader header{kRecordMagic, role, static_cast<uint32_t>(text.size()), static_cast<uint32_t>(ids.size())};
+    std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(text.data(), text.size());
+    record.resize(sizeof(header) + padded(text.size()), '\0');
+    record.append(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(int32_t));
+
+    // The record first: an index entry never points past what was written
+    uint64_t offset = log_bytes_;
+    if (!write_all(log_fd_, record.data(), record.size(), offset) ||
+        !write_all(index_fd_, &offset, sizeof(offset), offsets_.size() * sizeof(uint64_t))) {
+        LOGE("Failed to append to %s", path_.c_str());
+        ftruncate(log_fd_, static_cast<off_t>(offset));
+        return false;
+    }
+    offsets_.push_back(offset);
+    log_bytes_ += record.size();
+    return true;
+}
+
+bool ConversationLog::truncate(size_t entries) {
+    if (!is_open()) {
+        return false;
+    }
+    if (entries >= offsets_.size()) {
+        return true;
+    }
+    uint64_t end = offsets_[entries];
+    unmap();
+    offsets_.resize(entries);
+    log_bytes_ = end;
+    // The index first, so a kill in between leaves entries that all still point at records
+    return ftruncate(index_fd_, static_cast<off_t>(entries * sizeof(uint64_t))) == 0 &&
+           ftruncate(log_fd_, static_cast<off_t>(end)) == 0;
+}
+
+bool ConversationLog::branch(const std::string& path, size_t entries) const {
+    if (!is_open() || path == path_) {
+        return false;
+    }
+    entries = std::min(entries, offsets_.size());
+    uint64_t end = entries < offsets_.size() ? offsets_[entries] : log_bytes_;
+    std::string data(static_cast<size_t>(end), '\0');
+    if (!read_all(log_fd_, &data[0], data.size(), 0)) {
+        return false;
+    }
+    remove(path);
+    int log_fd = ::open((path + kLogSuffix).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int index_fd = ::open((path + kIndexSuffix).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = log_fd >= 0 && index_fd >= 0 && write_all(log_fd, data.data(), data.size(), 0) &&
+              write_all(index_fd, offsets_.data(), entries * sizeof(uint64_t), 0);
+    if (log_fd >= 0) {
+        ::close(log_fd);
+    }
+    if (index_fd >= 0) {
+        ::close(index_fd);
+    }
+    if (!ok) {
+        LOGE("Failed to branch %s into %s", path_.c_str(), path.c_str());
+        remove(path);
+    }
+    return ok;
+}
+
+void ConversationLog::remove(const std::string& path) {
+    unlink((path + kLogSuffix).c_str());
+    unlink((path + kIndexSuffix).c_str());
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Append-only log of one conversation's turns, as text and as token ids.
+ *
+ * A saved session (session_store.h) is rewritten whole on every save, and its
+ * turns are text that resume has to tokenize again. The log instead grows by
+ * one record per message: the role, the text and the ids it was tokenized to,
+ * in <name>.log, with the record's offset appended to <name>.idx. Message i is
+ * found through the index in O(1) and read in place from the mapped log, so
+ * resume, a branch or a truncated history take ids straight from the page
+ * cache. Records are written before their index entry, and open() drops index
+ * entries past the end of the log or rebuilds the index from the records, so
+ * a kill mid-append loses at most that message.
+ *
+ * Views returned by entry() stay valid until the next append(), truncate() or
+ * close(). Not thread-safe; the engine calls it under its lock.
+ */
+class ConversationLog {
+public:
+    enum Role : uint32_t {
+        kUser = 0,
+        kAssistant = 1,
+    };
+
+    struct Entry {
+        Role role = kUser;
+        std::string_view text;
+        const int32_t* ids = nullptr;
+        size_t id_count = 0;
+    };
+
+    ConversationLog() = default;
+    ConversationLog(const ConversationLog&) = delete;
+    ConversationLog& operator=(const ConversationLog&) = delete;
+    ~ConversationLog() { close(); }
+
+    // `path` without suffix; created if missing. A log written for another model is emptied.
+    bool open(const std::string& path, uint64_t model_hash);
+    void close();
+    bool is_open() const { return log_fd_ >= 0; }
+    const std::string& path() const { return path_; }
+
+    size_t size() const { return offsets_.size(); }
+    // Turns are a user message and its answer
+    size_t turns() const { return offsets_.size() / 2; }
+    bool entry(size_t i, Entry* entry);
+    // Ids of entries [first, last) back to back
+    std::vector<int32_t> ids(size_t first, size_t last);
+    size_t id_count(size_t first, size_t last);
+
+    bool append(Role role, std::string_view text, const std::vector<int>& ids);
+    // Keep the first `entries` messages
+    bool truncate(size_t entries);
+    // A new log at `path` holding the first `entries` messages of this one
+    bool branch(const std::string& path, size_t entries) const;
+
+    static void remove(const std::string& path);
+
+private:
+    std::string path_;
+    uint64_t model_hash_ = 0;
+    int log_fd_ = -1;
+    int index_fd_ = -1;
+    uint64_t log_bytes_ = 0;
+    std::vector<uint64_t> offsets_;  // of each record, as in the index file
+    const char* map_ = nullptr;      // the log, mapped up to map_bytes_
+    size_t map_bytes_ = 0;
+
+    bool rebuild_index();
+    bool map_to(uint64_t bytes);
+    void unmap();
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Long conversations folded into a running summary instead of losing their
+ * oldest turns to the sliding window.
+ *
+ * When a finished turn leaves the history past memory_fill_factor of the
+ * context window (ContextWindow::turns_to_fold), the oldest turns are
+ * summarized off the interactive path, together with the summary they add to,
+ * and the conversation is rebuilt with that summary in its system message and
+ * only the recent turns after it. The KV and the attention cost per token stay
+ * bounded by the window while what was discussed early on is still there.
+ *
+ * The summary is applied only if the conversation still starts with the
+ * turns it covers; a reset, rewind or shift meanwhile drops it.
+ */
+namespace conversation_memory {
+
+static constexpr int kMemoryTokens = 192;  // output of one fold
+static constexpr size_t kKeepTurns = 2;    // most recent turns never folded
+
+static constexpr const char* kInstruction =
+        "Below is the start of a tutoring conversation between a student and StudyBuddy. Write a short summary "
+        "of it for StudyBuddy to continue from: the topics covered, what the student asked and understood, "
+        "answers given and anything still open. Use at most a few sentences.\n\n";
+
+// The fold step's input: the summary so far, then `turns` (prompt, response), oldest first
+inline std::string fold_input(const std::string& memory,
+                              const std::vector<std::pair<std::string, std::string>>& turns) {
+    std::string input;
+    if (!memory.empty()) {
+        input += "Summary of what came before:\n" + memory + "\n\n";
+    }
+    for (const auto& turn : turns) {
+        input += "Student: " + turn.first + "\nStudyBuddy: " + turn.second + "\n\n";
+    }
+    return input;
+}
+
+// The generated summary without the whitespace around it
+inline std::string trimmed(const std::string& summary) {
+    size_t begin = summary.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return std::string();
+    }
+    size_t end = summary.find_last_not_of(" \t\r\n");
+    return summary.substr(begin, end + 1 - begin);
+}
+
+// What the system message carries for a conversation with `memory`
+inline std::string system_section(const std::string& memory) {
+    return "Earlier in this conversation (summary):\n" + memory;
+}
+
+}  // namespace conversation_memory
@@ -0,0 +1,502 @@
+#include "cpu_attention.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <tvm/runtime/c_backend_api.h>
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/packed_func.h>
+#include <tvm/runtime/registry.h>
+
+#include "native_log.h"
+#include "shared_pool.h"
+
+#define LOGI(...) NLOGI("CPU_ATTENTION", __VA_ARGS__)
+#define LOGE(...) NLOGE("CPU_ATTENTION", __VA_ARGS__)
+
+namespace cpu_attention {
+
+namespace {
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        exponent = 113;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+    float out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+// Round to nearest even; overflow saturates to infinity
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t abs = bits & 0x7fffffffu;
+    if (abs >= 0x7f800000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0));
+    }
+    if (abs >= 0x477ff000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u);
+    }
+    if (abs < 0x38800000u) {
+        // Subnormal (or zero) half
+        if (abs < 0x33000000u) {
+            return static_cast<uint16_t>(sign);
+        }
+        uint32_t exponent = abs >> 23;
+        uint32_t mantissa = (abs & 0x7fffffu) | 0x800000u;
+        uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1u))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (abs - 0x38000000u) >> 13;
+    uint32_t rest = abs & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+// e4m3fn: bias 7, no infinities, 0x7f / 0xff are NaN
+const float* e4m3_table() {
+    static float table[256];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int i = 0; i < 256; ++i) {
+            int exponent = (i >> 3) & 0xf;
+            int mantissa = i & 0x7;
+            float value;
+            if ((i & 0x7f) == 0x7f) {
+                value = std::numeric_limits<float>::quiet_NaN();
+            } else if (exponent == 0) {
+                value = std::ldexp(static_cast<float>(mantissa), -9);
+            } else {
+                value = std::ldexp(1.0f + mantissa / 8.0f, exponent - 7);
+            }
+            table[i] = (i & 0x80) ? -value : value;
+        }
+    });
+    return table;
+}
+
+void widen_half(const uint16_t* in, float* out, int count) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t h = vld1q_u16(in + i);
+        vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(vget_low_u16(h))));
+        vst1q_f32(out + i + 4, vcvt_f32_f16(vreinterpret_f16_u16(vget_high_u16(h))));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = half_to_float(in[i]);
+    }
+}
+
+void widen_int8(const int8_t* in, const uint16_t* scales, int group_size, float* out, int count) {
+    for (int start = 0; start < count; start += group_size) {
+        int end = std::min(count, start + group_size);
+        float scale = half_to_float(scales[start / group_size]);
+        int i = start;
+#if defined(__ARM_NEON)
+        float32x4_t s = vdupq_n_f32(scale);
+        for (; i + 8 <= end; i += 8) {
+            int16x8_t wide = vmovl_s8(vld1_s8(in + i));
+            vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(wide))), s));
+            vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(wide))), s));
+        }
+#endif
+        for (; i < end; ++i) {
+            out[i] = in[i] * scale;
+        }
+    }
+}
+
+void widen_e4m3(const uint8_t* in, const uint16_t* scales, int group_size, float* out, int count) {
+    const float* table = e4m3_table();
+    for (int start = 0; start < count; start += group_size) {
+        int end = std::min(count, start + group_size);
+        float scale = half_to_float(scales[start / group_size]);
+        for (int i = start; i < end; ++i) {
+            out[i] = table[in[i]] * scale;
+        }
+    }
+}
+
+float dot(const float* a, const float* b, int count) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= count; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+    for (; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// acc = acc * alpha + p * v
+void rescale_add(float* acc, float alpha, float p, const float* v, int count) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    float32x4_t a = vdupq_n_f32(alpha);
+    float32x4_t w = vdupq_n_f32(p);
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(acc + i, vfmaq_f32(vmulq_f32(vld1q_f32(acc + i), a), vld1q_f32(v + i), w));
+    }
+#endif
+    for (; i < count; ++i) {
+        acc[i] = acc[i] * alpha + p * v[i];
+    }
+}
+
+// Row `token` of one KV head, widened to fp32
+void load_row(const PagedKv& kv, const void* pages, const uint16_t* scales, int head, int64_t token, float* out) {
+    int64_t index = token / kv.page_size;
+    int64_t page = kv.page_table[kv.ring_pages > 0 ? index % kv.ring_pages : index];
+    int64_t row = (page * kv.kv_heads + head) * kv.page_size + token % kv.page_size;
+    int64_t offset = row * kv.head_dim;
+    switch (kv.dtype) {
+        case kKvInt8:
+            widen_int8(static_cast<const int8_t*>(pages) + offset, scales + row * (kv.head_dim / kv.group_size),
+                       kv.group_size, out, kv.head_dim);
+            break;
+        case kKvFloat8:
+            widen_e4m3(static_cast<const uint8_t*>(pages) + offset, scales + row * (kv.head_dim / kv.group_size),
+                       kv.group_size, out, kv.head_dim);
+            break;
+        default:
+            widen_half(static_cast<const uint16_t*>(pages) + offset, out, kv.head_dim);
+            break;
+    }
+}
+
+struct Job;
+using ItemFunc = void (*)(const Job&, int);
+
+struct Job {
+    const PagedKv* kv = nullptr;
+    ItemFunc run = nullptr;
+    const float* q = nullptr;  // widened, [heads, head_dim]
+    int group = 1;             // query heads per KV head
+    float scale = 1.0f;
+    float softcap = 0.0f;
+    int64_t first = 0;         // first token attended to (the window's start)
+    int splits = 1;
+    int64_t split_tokens = 0;
+    int items = 0;             // kv_heads * splits
+    float* partials = nullptr; // per item and group head: acc[head_dim], max, sum
+};
+
+size_t partial_stride(const Job& job) {
+    return static_cast<size_t>(job.kv->head_dim) + 2;
+}
+
+// Online softmax over one KV head's slice of the sequence, for its query
+// heads. kGroup and kDim fix the query heads per KV head and head_dim at
+// compile time where they are known (0: taken from the job), so the per-row
+// loops unroll and the scratch is sized to fit.
+template <int kGroup, int kDim>
+void run_item(const Job& job, int item) {
+    const PagedKv& kv = *job.kv;
+    const int d = kDim > 0 ? kDim : kv.head_dim;
+    const int group = kGroup > 0 ? kGroup : job.group;
+    const int head = item / job.splits;
+    const int64_t begin = job.first + (item % job.splits) * job.split_tokens;
+    const int64_t end = std::min(kv.length, begin + job.split_tokens);
+
+    constexpr int kRowValues = kDim > 0 ? kDim : kMaxHeadDim;
+    constexpr int kHeads = kGroup > 0 ? kGroup : kMaxGroupHeads;
+    float keys[kTileTokens * kRowValues];
+    float value[kRowValues];
+    float scores[kHeads * kTileTokens];
+    float alpha[kHeads];
+
+    const size_t stride = partial_stride(job);
+    float* part = job.partials + static_cast<size_t>(item) * group * stride;
+    for (int g = 0; g < group; ++g) {
+        std::fill(part + g * stride, part + g * stride + d, 0.0f);
+        part[g * stride + d] = -std::numeric_limits<float>::infinity();
+        part[g * stride + d + 1] = 0.0f;
+    }
+
+    for (int64_t t0 = begin; t0 < end; t0 += kTileTokens) {
+        const int n = static_cast<int>(std::min(kTileTokens, end - t0));
+        for (int i = 0; i < n; ++i) {
+            load_row(kv, kv.k, kv.k_scales, head, t0 + i, keys + i * d);
+        }
+        for (int g = 0; g < group; ++g) {
+            const float* q = job.q + static_cast<size_t>(head * group + g) * d;
+            float* s = scores + g * kTileTokens;
+            float tile_max = -std::numeric_limits<float>::infinity();
+            for (int i = 0; i < n; ++i) {
+                float score = dot(q, keys + i * d, d) * job.scale;
+                if (job.softcap > 0.0f) {
+                    score = job.softcap * std::tanh(score / job.softcap);
+                }
+                s[i] = score;
+                tile_max = std::max(tile_max, score);
+            }
+            float& m = part[g * stride + d];
+            float& l = part[g * stride + d + 1];
+            float m_new = std::max(m, tile_max);
+            alpha[g] = std::isinf(m) ? 0.0f : std::exp(m - m_new);
+            l *= alpha[g];
+            for (int i = 0; i < n; ++i) {
+                s[i] = std::exp(s[i] - m_new);
+                l += s[i];
+            }
+            m = m_new;
+        }
+        // The rescale rides along with the first row's accumulate
+        for (int i = 0; i < n; ++i) {
+            load_row(kv, kv.v, kv.v_scales, head, t0 + i, value);
+            for (int g = 0; g < group; ++g) {
+                rescale_add(part + g * stride, i == 0 ? alpha[g] : 1.0f, scores[g * kTileTokens + i], value, d);
+            }
+        }
+    }
+}
+
+int attention_task(int task_id, TVMParallelGroupEnv* penv, void* cdata) {
+    const Job& job = *static_cast<const Job*>(cdata);
+    for (int item = task_id; item < job.items; item += penv->num_task) {
+        job.run(job, item);
+    }
+    return 0;
+}
+
+bool is_dtype(const DLTensor* t, uint8_t code, uint8_t bits) {
+    return t->dtype.code == code && t->dtype.bits == bits && t->dtype.lanes == 1;
+}
+
+bool is_cpu(const DLTensor* t) {
+    return t->device.device_type == kDLCPU || t->device.device_type == kDLCUDAHost;
+}
+
+template <typename T>
+const T* data_of(const DLTensor* t) {
+    return reinterpret_cast<const T*>(static_cast<const char*>(t->data) + t->byte_offset);
+}
+
+const DLTensor* optional_tensor(const tvm::runtime::TVMArgValue& arg) {
+    if (arg.type_code() == kTVMNullptr) {
+        return nullptr;
+    }
+    return arg.operator DLTensor*();
+}
+
+}  // namespace
+
+bool decode(const uint16_t* q, int heads, const PagedKv& kv, float scale, float softcap, uint16_t* out,
+            int threads) {
+    if (q == nullptr || out == nullptr || kv.k == nullptr || kv.v == nullptr || kv.page_table == nullptr ||
+        heads <= 0 || kv.kv_heads <= 0 || heads % kv.kv_heads != 0 || heads / kv.kv_heads > kMaxGroupHeads ||
+        kv.head_dim <= 0 || kv.head_dim > kMaxHeadDim || kv.page_size <= 0 || kv.length < 0 || kv.window < 0) {
+        return false;
+    }
+    if (kv.ring_pages > 0 && (kv.window == 0 || kv.ring_pages < ring_pages_for(kv.window, kv.page_size))) {
+        return false;
+    }
+    if (kv.dtype != kKvFloat16 &&
+        (kv.k_scales == nullptr || kv.v_scales == nullptr || kv.group_size <= 0 || kv.head_dim % kv.group_size != 0)) {
+        return false;
+    }
+    const int d = kv.head_dim;
+    if (kv.length == 0) {
+        std::fill(out, out + static_cast<size_t>(heads) * d, static_cast<uint16_t>(0));
+        return true;
+    }
+
+    std::vector<float> queries(static_cast<size_t>(heads) * d);
+    widen_half(q, queries.data(), heads * d);
+
+    Job job;
+    job.kv = &kv;
+    job.q = queries.data();
+    job.group = heads / kv.kv_heads;
+    job.scale = scale;
+    job.softcap = softcap;
+    job.first = kv.window > 0 ? std::max<int64_t>(0, kv.length - kv.window) : 0;
+    job.run = job.group == 2 && d == 256 ? run_item<2, 256> : run_item<0, 0>;
+    const int64_t span = kv.length - job.first;
+
+    // Split the sequence so every thread gets an (item) to itself, but not so
+    // finely that the merge and per-split setup outweigh the rows read
+    int target = threads > 0 ? threads : shared_pool::pool().concurrency();
+    int64_t by_length = (span + kMinSplitTokens - 1) / kMinSplitTokens;
+    int64_t by_threads = std::max(1, (target + kv.kv_heads - 1) / kv.kv_heads);
+    job.splits = static_cast<int>(std::max<int64_t>(1, std::min(by_length, by_threads)));
+    int64_t per_split = (span + job.splits - 1) / job.splits;
+    job.split_tokens = (per_split + kTileTokens - 1) / kTileTokens * kTileTokens;
+    job.splits = static_cast<int>((span + job.split_tokens - 1) / job.split_tokens);
+    job.items = kv.kv_heads * job.splits;
+
+    std::vector<float> partials(static_cast<size_t>(job.items) * job.group * partial_stride(job));
+    job.partials = partials.data();
+
+    if (job.items == 1) {
+        job.run(job, 0);
+    } else if (shared_pool::pool().launch(attention_task, &job, threads > 0 ? threads : 0) != 0) {
+        LOGE("Parallel launch failed; decoding attention on one thread");
+        for (int item = 0; item < job.items; ++item) {
+            job.run(job, item);
+        }
+    }
+
+    // Merge the splits' partial softmaxes per query head
+    const size_t stride = partial_stride(job);
+    float merged[kMaxHeadDim];
+    for (int h = 0; h < heads; ++h) {
+        const int head = h / job.group;
+        const int g = h % job.group;
+        float m = -std::numeric_limits<float>::infinity();
+        for (int s = 0; s < job.splits; ++s) {
+            const float* part = job.partials + (static_cast<size_t>(head * job.splits + s) * job.group + g) * stride;
+            m = std::max(m, part[d]);
+        }
+        std::fill(merged, merged + d, 0.0f);
+        float l = 0.0f;
+        for (int s = 0; s < job.splits; ++s) {
+            const float* part = job.partials + (static_cast<size_t>(head * job.splits + s) * job.group + g) * stride;
+            if (std::isinf(part[d])) {
+                continue;
+            }
+            float weight = std::exp(part[d] - m);
+            l += part[d + 1] * weight;
+            rescale_add(merged, 1.0f, weight, part, d);
+        }
+        float inv = l > 0.0f ? 1.0f / l : 0.0f;
+        uint16_t* row = out + static_cast<size_t>(h) * d;
+        for (int i = 0; i < d; ++i) {
+            row[i] = float_to_half(merged[i] * inv);
+        }
+    }
+    return true;
+}
+
+void install() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        tvm::runtime::Registry::Register("studybuddy.attention.paged_decode", true)
+            .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                if (args.size() != 10 && args.size() != 11) {
+                    throw std::runtime_error("paged_decode expects 10 or 11 arguments, got " +
+                                             std::to_string(args.size()));
+                }
+                bool local = args.size() == 11;
+                const DLTensor* q = args[0];
+                const DLTensor* k = args[1];
+                const DLTensor* v = args[2];
+                const DLTensor* k_scales = optional_tensor(args[3]);
+                const DLTensor* v_scales = optional_tensor(args[4]);
+                const DLTensor* page_table = args[5];
+                int64_t length = args[6];
+                double scale = args[7];
+                double softcap = args[8];
+                int64_t window = local ? args[9].operator int64_t() : 0;
+                DLTensor* out = args[local ? 10 : 9];
+
+                if (q->ndim != 2 || out->ndim != 2 || k->ndim != 4 || v->ndim != 4 || page_table->ndim != 1 ||
+                    !is_dtype(q, kDLFloat, 16) || !is_dtype(out, kDLFloat, 16) || !is_dtype(page_table, kDLInt, 32) ||
+                    k->dtype.code != v->dtype.code || k->dtype.bits != v->dtype.bits) {
+                    throw std::runtime_error("paged_decode: unexpected tensor ranks or dtypes");
+                }
+                if (!is_cpu(q) || !is_cpu(out) || !is_cpu(k) || !is_cpu(v) || !is_cpu(page_table)) {
+                    throw std::runtime_error("paged_decode: tensors must be on the CPU");
+                }
+                PagedKv kv;
+                kv.k = data_of<char>(k);
+                kv.v = data_of<char>(v);
+                kv.page_table = data_of<int32_t>(page_table);
+                kv.length = length;
+                kv.kv_heads = static_cast<int>(k->shape[1]);
+                kv.page_size = static_cast<int>(k->shape[2]);
+                kv.head_dim = static_cast<int>(k->shape[3]);
+                if (is_dtype(k, kDLFloat, 16)) {
+                    kv.dtype = kKvFloat16;
+                } else if (is_dtype(k, kDLInt, 8)) {
+                    kv.dtype = kKvInt8;
+                } else if (k->dtype.bits == 8) {
+                    kv.dtype = kKvFloat8;  // uint8 or a float8 code, both read as e4m3
+                } else {
+                    throw std::runtime_error("paged_decode: unsupported KV dtype");
+                }
+                if (kv.dtype != kKvFloat16) {
+                    if (k_scales == nullptr || v_scales == nullptr || k_scales->ndim != 4 ||
+                        !is_dtype(k_scales, kDLFloat, 16) || !is_dtype(v_scales, kDLFloat, 16) ||
+                        k_scales->shape[3] <= 0) {
+                        throw std::runtime_error("paged_decode: 8-bit KV needs fp16 scales");
+                    }
+                    kv.k_scales = data_of<uint16_t>(k_scales);
+                    kv.v_scales = data_of<uint16_t>(v_scales);
+                    kv.group_size = kv.head_dim / static_cast<int>(k_scales->shape[3]);
+                }
+                int heads = static_cast<int>(q->shape[0]);
+                int64_t pages_needed = (length + kv.page_size - 1) / std::max(1, kv.page_size);
+                kv.window = std::max<int64_t>(0, window);
+                if (kv.window > 0 && page_table->shape[0] < pages_needed) {
+                    kv.ring_pages = page_table->shape[0];
+                    pages_needed = kv.ring_pages;
+                    if (kv.ring_pages < ring_pages_for(kv.window, std::max(1, kv.page_size))) {
+                        throw std::runtime_error("paged_decode: ring page table shorter than the window");
+                    }
+                }
+                if (q->shape[1] != kv.head_dim || out->shape[0] != heads || out->shape[1] != kv.head_dim ||
+                    v->shape[1] != kv.kv_heads || v->shape[2] != kv.page_size || v->shape[3] != kv.head_dim ||
+                    page_table->shape[0] < pages_needed) {
+                    throw std::runtime_error("paged_decode: shapes do not agree");
+                }
+                for (int64_t i = 0; i < pages_needed; ++i) {
+                    if (kv.page_table[i] < 0 || kv.page_table[i] >= k->shape[0] || kv.page_table[i] >= v->shape[0]) {
+                        throw std::runtime_error("paged_decode: page table entry out of range");
+                    }
+                }
+                uint16_t* dst = reinterpret_cast<uint16_t*>(static_cast<char*>(out->data) + out->byte_offset);
+                if (!decode(data_of<uint16_t>(q), heads, kv, static_cast<float>(scale), static_cast<float>(softcap),
+                            dst)) {
+                    throw std::runtime_error("paged_decode: shapes out of range");
+                }
+            });
+        LOGI("Installed CPU paged decode attention");
+    });
+}
+
+}  // namespace cpu_attention
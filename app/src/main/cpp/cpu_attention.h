@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "kv_budget.h"
+
+/**
+ * Decode attention on the CPU over the paged KV cache, for long contexts.
+ *
+ * One query token against the whole sequence, in a single fused pass: K and
+ * V are read page by page in tiles, scores go through an online softmax
+ * (running max and sum per head, the accumulator rescaled as the max moves),
+ * so nothing of sequence length is ever materialized. Query heads sharing a
+ * KV head (Gemma's grouped-query layout) are scored together, so each K and V
+ * row is loaded and widened once per group; Gemma 2 2B's shape (two query
+ * heads per KV head, head_dim 256) has its own instance with both fixed. The sequence is split across the
+ * TVM thread pool (split-K, as in flash decoding) and the per-split partial
+ * softmaxes are merged at the end, so threads stay busy even with one KV
+ * head, and per-token time grows with context only by the bandwidth of
+ * reading it. K/V may be fp16, int8 or e4m3 with one fp16 scale per group of
+ * values (kv_budget.h); NEON widens and dequantizes on arm64.
+ *
+ * Gemma 2 alternates global layers with local ones that attend only to the
+ * last sliding_window tokens. A local layer's KV can be a ring of pages just
+ * over the window long instead of a page table that grows with the sequence:
+ * token t then lives on page_table[(t / page_size) % ring_pages], and the
+ * pages of tokens that left the window are overwritten.
+ *
+ * Registered as a TVM global (install()) that CPU builds of the model call in
+ * place of their own attention when compiled to use it as an extern:
+ *
+ *   studybuddy.attention.paged_decode(q, k_pages, v_pages, k_scales, v_scales,
+ *                                     page_table, length, scale, softcap, [window,] out)
+ *
+ *   q, out              [heads, head_dim] fp16
+ *   k_pages, v_pages    [pages, kv_heads, page_size, head_dim] fp16, int8 or e4m3 (uint8)
+ *   k_scales, v_scales  [pages, kv_heads, page_size, head_dim / group] fp16; None for fp16 KV
+ *   page_table          [ceil(length / page_size)] int32, the sequence's pages in order
+ *   scale               applied to q.k (1 / sqrt(head_dim) or the model's query_pre_attn_scalar)
+ *   softcap             > 0: scores become softcap * tanh(score / softcap) (Gemma 2)
+ *   window              > 0: a local layer attending to the last `window` tokens; a page
+ *                       table shorter than the sequence's pages is then a ring
+ *
+ * The KV dtype comes from k_pages' dtype; the group size from the scales' shape.
+ */
+namespace cpu_attention {
+
+static constexpr int kMaxHeadDim = 512;
+static constexpr int kMaxGroupHeads = 32;      // query heads per KV head
+static constexpr int64_t kTileTokens = 32;     // K/V rows widened per pass
+static constexpr int64_t kMinSplitTokens = 256;  // below this, one thread takes the whole head
+
+struct PagedKv {
+    const void* k = nullptr;
+    const void* v = nullptr;
+    const uint16_t* k_scales = nullptr;  // fp16, 8-bit modes only
+    const uint16_t* v_scales = nullptr;
+    const int32_t* page_table = nullptr;
+    int64_t length = 0;
+    int page_size = 16;
+    int kv_heads = 1;
+    int head_dim = 256;
+    KvCacheDtype dtype = kKvFloat16;
+    int group_size = 32;
+    int64_t window = 0;      // > 0: attend to the last `window` tokens only
+    int64_t ring_pages = 0;  // > 0: page_table is a ring of this many pages (needs a window)
+};
+
+// Pages a ring needs for a window of `window` tokens: it may start mid-page
+inline int64_t ring_pages_for(int64_t window, int page_size) {
+    return (window + page_size - 1) / page_size + 1;
+}
+
+// out = softmax(scale * q K^T) V for each of `heads` query heads (fp16 in and
+// out); false if the shapes are out of range. `threads` <= 0 uses the pool's size.
+bool decode(const uint16_t* q, int heads, const PagedKv& kv, float scale, float softcap, uint16_t* out,
+            int threads = 0);
+
+// Register studybuddy.attention.paged_decode; idempotent
+void install();
+
+}  // namespace cpu_attention
@@ -0,0 +1,188 @@
+#include "cpu_embedding.h"
+
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/packed_func.h>
+#include <tvm/runtime/registry.h>
+
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("CPU_EMBEDDING", __VA_ARGS__)
+
+namespace cpu_embedding {
+
+namespace {
+
+constexpr int kValuesPerWord = 8;
+constexpr int kZeroPoint = 7;
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        exponent = 113;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+    float out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+// Round to nearest even. (q - 7) * scale is exact in fp32, so this rounds the
+// way the model's own fp16 multiply does.
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t abs = bits & 0x7fffffffu;
+    if (abs >= 0x7f800000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0));
+    }
+    if (abs >= 0x477ff000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u);
+    }
+    if (abs < 0x38800000u) {
+        if (abs < 0x33000000u) {
+            return static_cast<uint16_t>(sign);
+        }
+        uint32_t exponent = abs >> 23;
+        uint32_t mantissa = (abs & 0x7fffffu) | 0x800000u;
+        uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1u))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (abs - 0x38000000u) >> 13;
+    uint32_t rest = abs & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+// One group of `group_size` values: group_size / 8 words sharing `scale`
+void dequantize_group(const uint32_t* words, float scale, int group_size, uint16_t* out) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    float32x4_t s = vdupq_n_f32(scale);
+    int32x4_t zero = vdupq_n_s32(kZeroPoint);
+    int32x4_t shifts_low = {0, -4, -8, -12};
+    int32x4_t shifts_high = {-16, -20, -24, -28};
+    uint32x4_t mask = vdupq_n_u32(0xf);
+    for (; i + kValuesPerWord <= group_size; i += kValuesPerWord) {
+        uint32x4_t word = vdupq_n_u32(words[i / kValuesPerWord]);
+        int32x4_t low = vsubq_s32(vreinterpretq_s32_u32(vandq_u32(vshlq_u32(word, shifts_low), mask)), zero);
+        int32x4_t high = vsubq_s32(vreinterpretq_s32_u32(vandq_u32(vshlq_u32(word, shifts_high), mask)), zero);
+        float16x4_t a = vcvt_f16_f32(vmulq_f32(vcvtq_f32_s32(low), s));
+        float16x4_t b = vcvt_f16_f32(vmulq_f32(vcvtq_f32_s32(high), s));
+        vst1q_u16(out + i, vreinterpretq_u16_f16(vcombine_f16(a, b)));
+    }
+#endif
+    for (; i < group_size; ++i) {
+        int q = static_cast<int>((words[i / kValuesPerWord] >> (4 * (i % kValuesPerWord))) & 0xfu);
+        out[i] = float_to_half(static_cast<float>(q - kZeroPoint) * scale);
+    }
+}
+
+bool is_dtype(const DLTensor* t, uint8_t code, uint8_t bits) {
+    return t->dtype.code == code && t->dtype.bits == bits && t->dtype.lanes == 1;
+}
+
+bool is_cpu(const DLTensor* t) {
+    return t->device.device_type == kDLCPU || t->device.device_type == kDLCUDAHost;
+}
+
+template <typename T>
+T* data_of(const DLTensor* t) {
+    return reinterpret_cast<T*>(static_cast<char*>(t->data) + t->byte_offset);
+}
+
+}  // namespace
+
+bool take(const QuantizedTable& table, const int32_t* ids, int64_t n, uint16_t* out) {
+    if (table.q_weight == nullptr || table.q_scale == nullptr || ids == nullptr || out == nullptr || n < 0 ||
+        table.hidden <= 0 || table.group_size <= 0 || table.group_size % kValuesPerWord != 0 ||
+        table.hidden % table.group_size != 0) {
+        return false;
+    }
+    const int64_t words_per_row = table.hidden / kValuesPerWord;
+    const int64_t groups_per_row = table.hidden / table.group_size;
+    for (int64_t row = 0; row < n; ++row) {
+        int64_t id = ids[row];
+        if (id < 0 || id >= table.vocab) {
+            return false;
+        }
+        const uint32_t* words = table.q_weight + id * words_per_row;
+        const uint16_t* scales = table.q_scale + id * groups_per_row;
+        uint16_t* dst = out + row * table.hidden;
+        for (int64_t g = 0; g < groups_per_row; ++g) {
+            dequantize_group(words + g * (table.group_size / kValuesPerWord), half_to_float(scales[g]),
+                             table.group_size, dst + g * table.group_size);
+        }
+    }
+    return true;
+}
+
+void install() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        tvm::runtime::Registry::Register("studybuddy.embedding.take_q4f16", true)
+            .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                if (args.size() != 4) {
+                    throw std::runtime_error("take_q4f16 expects 4 arguments, got " + std::to_string(args.size()));
+                }
+                const DLTensor* q_weight = args[0];
+                const DLTensor* q_scale = args[1];
+                const DLTensor* ids = args[2];
+                DLTensor* out = args[3];
+                if (q_weight->ndim != 2 || q_scale->ndim != 2 || ids->ndim != 1 || out->ndim != 2 ||
+                    !is_dtype(q_weight, kDLUInt, 32) || !is_dtype(q_scale, kDLFloat, 16) ||
+                    !is_dtype(ids, kDLInt, 32) || !is_dtype(out, kDLFloat, 16)) {
+                    throw std::runtime_error("take_q4f16: unexpected tensor ranks or dtypes");
+                }
+                if (!is_cpu(q_weight) || !is_cpu(q_scale) || !is_cpu(ids) || !is_cpu(out)) {
+                    throw std::runtime_error("take_q4f16: tensors must be on the CPU");
+                }
+                QuantizedTable table;
+                table.q_weight = data_of<const uint32_t>(q_weight);
+                table.q_scale = data_of<const uint16_t>(q_scale);
+                table.vocab = q_weight->shape[0];
+                table.hidden = static_cast<int>(q_weight->shape[1] * kValuesPerWord);
+                table.group_size = q_scale->shape[1] > 0 ? table.hidden / static_cast<int>(q_scale->shape[1]) : 0;
+                if (q_scale->shape[0] != table.vocab || out->shape[0] != ids->shape[0] ||
+                    out->shape[1] != table.hidden) {
+                    throw std::runtime_error("take_q4f16: shapes do not agree");
+                }
+                if (!take(table, data_of<const int32_t>(ids), ids->shape[0], data_of<uint16_t>(out))) {
+                    throw std::runtime_error("take_q4f16: shapes out of range or token id outside the vocabulary");
+                }
+            });
+        LOGI("Installed CPU quantized embedding lookup");
+    });
+}
+
+}  // namespace cpu_embedding
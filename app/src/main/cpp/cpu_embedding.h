@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Embedding lookup on the CPU straight from the quantized table.
+ *
+ * Gemma ties its 256k-row embedding table to the LM head, so the loader keeps
+ * a single copy of it in the q4f16_1 layout the head's matmul reads
+ * (ndarray_mmap_loader.cpp). A lookup dequantizes just the rows of the tokens
+ * being embedded, and nothing of vocabulary size is ever materialized in
+ * fp16. In place on a mapped table, only those rows' pages are read.
+ *
+ * q4f16_1: eight 4-bit values per uint32, low nibble first, each (q - 7)
+ * times the fp16 scale of its group of values.
+ *
+ * Registered as a TVM global (install()) that CPU builds of the model call in
+ * place of their own embedding when compiled to use it as an extern:
+ *
+ *   studybuddy.embedding.take_q4f16(q_weight, q_scale, ids, out)
+ *
+ *   q_weight  [vocab, hidden / 8] uint32
+ *   q_scale   [vocab, hidden / group] fp16
+ *   ids       [n] int32
+ *   out       [n, hidden] fp16
+ */
+namespace cpu_embedding {
+
+struct QuantizedTable {
+    const uint32_t* q_weight = nullptr;
+    const uint16_t* q_scale = nullptr;  // fp16
+    int64_t vocab = 0;
+    int hidden = 0;
+    int group_size = 32;
+};
+
+// Rows `ids[0..n)` of `table`, dequantized to fp16 in `out` [n, hidden]. False
+// if the shapes are out of range or an id is outside the vocabulary.
+bool take(const QuantizedTable& table, const int32_t* ids, int64_t n, uint16_t* out);
+
+// Register studybuddy.embedding.take_q4f16; idempotent
+void install();
+
+}  // namespace cpu_embedding
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/auxv.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "requantize.h"
+
+/**
+ * Picks the model library build for this CPU.
+ *
+ * The model library is compiled once per target feature set: the baseline
+ * (libgemma-2-2b-it-q4f16_1.so, or whatever the config's "model_lib" names; see
+ * model_lib_base()) for any ARMv8-A core, and optionally variants
+ * next to it named with a suffix ("-dotprod", "-sve", "-i8mm") whose CPU
+ * kernels use those instructions. Features come from the kernel's hwcaps, so a
+ * variant is only tried on cores that can run it; the baseline is always last,
+ * and a missing variant costs nothing. The GPU path is unaffected, since its
+ * kernels are the same in every build.
+ */
+struct CpuFeatures {
+    bool dotprod = false;  // SDOT/UDOT, ARMv8.2
+    bool sve = false;
+    bool i8mm = false;     // SMMLA/UMMLA int8 matrix multiply, ARMv8.6
+    bool sha2 = false;     // SHA256H/SHA256SU0..., the crypto extension (sha256.h)
+};
+
+inline CpuFeatures detect_cpu_features() {
+    CpuFeatures features;
+#if defined(__aarch64__)
+    // Bit values of the arm64 <asm/hwcap.h>, spelled out for older NDK headers
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    unsigned long hwcap2 = getauxval(AT_HWCAP2);
+    features.sha2 = (hwcap & (1ul << 6)) != 0;      // HWCAP_SHA2
+    features.dotprod = (hwcap & (1ul << 20)) != 0;  // HWCAP_ASIMDDP
+    features.sve = (hwcap & (1ul << 22)) != 0;      // HWCAP_SVE
+    features.i8mm = (hwcap2 & (1ul << 13)) != 0;    // HWCAP2_I8MM
+#endif
+    return features;
+}
+
+// Library file names to try, best first, for `base` without its ".so"
+inline std::vector<std::string> model_lib_candidates(const std::string& base, const CpuFeatures& features) {
+    std::vector<std::string> names;
+    if (features.i8mm) {
+        names.push_back(base + "-i8mm.so");
+    }
+    if (features.sve) {
+        names.push_back(base + "-sve.so");
+    }
+    if (features.dotprod) {
+        names.push_back(base + "-dotprod.so");
+    }
+    names.push_back(base + ".so");
+    return names;
+}
+
+static constexpr const char* kDefaultModelLib = "libgemma-2-2b-it-q4f16_1";
+
+// Base name (no ".so") of the model library in `dir`: `configured` (the config's
+// "model_lib") if set, else the one baseline library there, else kDefaultModelLib
+inline std::string model_lib_base(const std::string& dir, const std::string& configured) {
+    if (!configured.empty()) {
+        std::string base = configured.rfind("lib", 0) == 0 ? configured : "lib" + configured;
+        return base.size() > 3 && base.compare(base.size() - 3, 3, ".so") == 0 ? base.substr(0, base.size() - 3) : base;
+    }
+    std::vector<std::string> found;
+    if (DIR* listing = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(listing)) {
+            std::string name = entry->d_name;
+            bool variant = name.find("-i8mm.so") != std::string::npos || name.find("-sve.so") != std::string::npos ||
+                           name.find("-dotprod.so") != std::string::npos;
+            if (name.rfind("lib", 0) == 0 && name.size() > 6 && name.compare(name.size() - 3, 3, ".so") == 0 && !variant) {
+                found.push_back(name.substr(0, name.size() - 3));
+            }
+        }
+        closedir(listing);
+    }
+    // Builds for requantized weights (requantize.h) sit next to the one they were made from
+    if (found.size() > 1) {
+        std::vector<std::string> sources;
+        for (const std::string& name : found) {
+            bool variant = false;
+            for (const std::string& other : found) {
+                for (int scheme = 0; scheme < requantize::kSchemeCount; ++scheme) {
+                    variant = variant || (other != name && requantize::model_lib_base(other, scheme) == name);
+                }
+            }
+            if (!variant) {
+                sources.push_back(name);
+            }
+        }
+        found.swap(sources);
+    }
+    return found.size() == 1 ? found[0] : kDefaultModelLib;
+}
+
+// The best candidate present in `dir`; the baseline path if none is
+inline std::string select_model_lib(const std::string& dir, const std::string& base) {
+    std::vector<std::string> names = model_lib_candidates(base, detect_cpu_features());
+    for (const std::string& name : names) {
+        if (access((dir + "/" + name).c_str(), R_OK) == 0) {
+            return dir + "/" + name;
+        }
+    }
+    return dir + "/" + names.back();
+}
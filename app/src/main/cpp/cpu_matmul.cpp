@@ -0,0 +1,433 @@
+#include "cpu_matmul.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <tvm/runtime/c_backend_api.h>
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/packed_func.h>
+#include <tvm/runtime/registry.h>
+
+#include "cpu_features.h"
+#include "native_log.h"
+#include "shared_pool.h"
+
+#define LOGI(...) NLOGI("CPU_MATMUL", __VA_ARGS__)
+#define LOGE(...) NLOGE("CPU_MATMUL", __VA_ARGS__)
+
+namespace cpu_matmul {
+
+namespace {
+
+constexpr int kValuesPerWord = 8;
+constexpr int kZeroPoint = 7;
+constexpr float kInt8Max = 127.0f;
+
+float half_to_float(uint16_t h) {
+    uint32_t sign = (h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        exponent = 113;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+    float out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t abs = bits & 0x7fffffffu;
+    if (abs >= 0x7f800000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0));
+    }
+    if (abs >= 0x477ff000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u);
+    }
+    if (abs < 0x38800000u) {
+        if (abs < 0x33000000u) {
+            return static_cast<uint16_t>(sign);
+        }
+        uint32_t exponent = abs >> 23;
+        uint32_t mantissa = (abs & 0x7fffffu) | 0x800000u;
+        uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1u))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (abs - 0x38000000u) >> 13;
+    uint32_t rest = abs & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+struct Job;
+// Every token against the `rows` weight rows of one unpacked tile starting at `first_row`
+using TileFunc = void (*)(const Job&, const int8_t* values, const float* scales, int64_t first_row, int rows);
+
+struct Job {
+    const QuantizedWeight* weight = nullptr;
+    TileFunc run = nullptr;
+    int64_t tokens = 0;
+    int64_t groups = 0;                // per row
+    const int8_t* x_values = nullptr;  // [tokens, k] int8 (W4A8 kernels)
+    const float* x_scales = nullptr;   // [tokens, groups]
+    const float* x_float = nullptr;    // [tokens, k] (fp32 path)
+    uint16_t* out = nullptr;           // [tokens, rows]
+    int64_t tiles = 0;
+};
+
+// Each token's activations per group: q = round(x * 127 / max |x|), scale = max |x| / 127
+void quantize_activations(const float* x, int64_t tokens, int64_t k, int group_size, int8_t* values,
+                          float* scales) {
+    const int64_t groups = k / group_size;
+    for (int64_t t = 0; t < tokens; ++t) {
+        for (int64_t g = 0; g < groups; ++g) {
+            const float* in = x + t * k + g * group_size;
+            float peak = 0.0f;
+            for (int i = 0; i < group_size; ++i) {
+                peak = std::max(peak, std::fabs(in[i]));
+            }
+            float inv = peak > 0.0f ? kInt8Max / peak : 0.0f;
+            int8_t* dst = values + t * k + g * group_size;
+            for (int i = 0; i < group_size; ++i) {
+                float q = std::min(kInt8Max, std::max(-kInt8Max, std::nearbyint(in[i] * inv)));
+                dst[i] = static_cast<int8_t>(q);
+            }
+            scales[t * groups + g] = peak / kInt8Max;
+        }
+    }
+}
+
+// Rows [first_row, first_row + rows) as int8 (q - 7) and fp32 scales; the
+// tile's unused rows are zero so paired kernels can read them
+void unpack_tile(const QuantizedWeight& weight, int64_t groups, int64_t first_row, int rows, int8_t* values,
+                 float* scales) {
+    const int64_t k = weight.k;
+    const int64_t words_per_row = k / kValuesPerWord;
+    for (int r = 0; r < kRowTile; ++r) {
+        int8_t* dst = values + r * k;
+        float* dst_scales = scales + r * groups;
+        if (r >= rows) {
+            std::fill(dst, dst + k, static_cast<int8_t>(0));
+            std::fill(dst_scales, dst_scales + groups, 0.0f);
+            continue;
+        }
+        const uint32_t* words = weight.q_weight + (first_row + r) * words_per_row;
+        for (int64_t w = 0; w < words_per_row; ++w) {
+            uint32_t word = words[w];
+            for (int i = 0; i < kValuesPerWord; ++i) {
+                int q = static_cast<int>((word >> (4 * i)) & 0xfu);
+                dst[w * kValuesPerWord + i] = static_cast<int8_t>(q - kZeroPoint);
+            }
+        }
+        const uint16_t* row_scales = weight.q_scale + (first_row + r) * groups;
+        for (int64_t g = 0; g < groups; ++g) {
+            dst_scales[g] = half_to_float(row_scales[g]);
+        }
+    }
+}
+
+void store(const Job& job, int64_t token, int64_t row, float value) {
+    job.out[token * job.weight->rows + row] = float_to_half(value);
+}
+
+// Small batches: fp32 activations against the dequantized weights, no activation rounding
+void run_float(const Job& job, const int8_t* values, const float* scales, int64_t first_row, int rows) {
+    const int64_t k = job.weight->k;
+    const int group_size = job.weight->group_size;
+    for (int64_t t = 0; t < job.tokens; ++t) {
+        const float* x = job.x_float + t * k;
+        for (int r = 0; r < rows; ++r) {
+            const int8_t* w = values + r * k;
+            float acc = 0.0f;
+            for (int64_t g = 0; g < job.groups; ++g) {
+                float sum = 0.0f;
+                for (int i = 0; i < group_size; ++i) {
+                    sum += x[g * group_size + i] * static_cast<float>(w[g * group_size + i]);
+                }
+                acc += sum * scales[r * job.groups + g];
+            }
+            store(job, t, first_row + r, acc);
+        }
+    }
+}
+
+void run_scalar(const Job& job, const int8_t* values, const float* scales, int64_t first_row, int rows) {
+    const int64_t k = job.weight->k;
+    const int group_size = job.weight->group_size;
+    for (int64_t t = 0; t < job.tokens; ++t) {
+        const int8_t* x = job.x_values + t * k;
+        const float* x_scales = job.x_scales + t * job.groups;
+        for (int r = 0; r < rows; ++r) {
+            const int8_t* w = values + r * k;
+            float acc = 0.0f;
+            for (int64_t g = 0; g < job.groups; ++g) {
+                int32_t sum = 0;
+                for (int i = 0; i < group_size; ++i) {
+                    sum += static_cast<int32_t>(x[g * group_size + i]) * w[g * group_size + i];
+                }
+                acc += static_cast<float>(sum) * x_scales[g] * scales[r * job.groups + g];
+            }
+            store(job, t, first_row + r, acc);
+        }
+    }
+}
+
+#if defined(__aarch64__)
+// One token against four rows at a time, each group's int32 sums by SDOT over
+// 16 values; group_size is a multiple of 16
+__attribute__((target("dotprod"))) void run_dotprod(const Job& job, const int8_t* values, const float* scales,
+                                                    int64_t first_row, int rows) {
+    const int64_t k = job.weight->k;
+    const int group_size = job.weight->group_size;
+    for (int64_t t = 0; t < job.tokens; ++t) {
+        const int8_t* x = job.x_values + t * k;
+        const float* x_scales = job.x_scales + t * job.groups;
+        for (int r = 0; r < rows; r += 4) {
+            const int8_t* w = values + r * k;
+            float32x4_t acc = vdupq_n_f32(0.0f);
+            for (int64_t g = 0; g < job.groups; ++g) {
+                int32x4_t s0 = vdupq_n_s32(0);
+                int32x4_t s1 = vdupq_n_s32(0);
+                int32x4_t s2 = vdupq_n_s32(0);
+                int32x4_t s3 = vdupq_n_s32(0);
+                for (int i = 0; i < group_size; i += 16) {
+                    int64_t at = g * group_size + i;
+                    int8x16_t a = vld1q_s8(x + at);
+                    s0 = vdotq_s32(s0, a, vld1q_s8(w + at));
+                    s1 = vdotq_s32(s1, a, vld1q_s8(w + k + at));
+                    s2 = vdotq_s32(s2, a, vld1q_s8(w + 2 * k + at));
+                    s3 = vdotq_s32(s3, a, vld1q_s8(w + 3 * k + at));
+                }
+                int32x4_t sums = {vaddvq_s32(s0), vaddvq_s32(s1), vaddvq_s32(s2), vaddvq_s32(s3)};
+                float32x4_t row_scales = {scales[r * job.groups + g], scales[(r + 1) * job.groups + g],
+                                          scales[(r + 2) * job.groups + g], scales[(r + 3) * job.groups + g]};
+                acc = vfmaq_f32(acc, vcvtq_f32_s32(sums), vmulq_n_f32(row_scales, x_scales[g]));
+            }
+            float results[4];
+            vst1q_f32(results, acc);
+            for (int i = 0; i < 4 && r + i < rows; ++i) {
+                store(job, t, first_row + r + i, results[i]);
+            }
+        }
+    }
+}
+
+// Two tokens against two rows per SMMLA: {x0, x1} (2 x 8 int8) times {w0, w1}
+// transposed accumulates the 2 x 2 int32 block {x0.w0, x0.w1, x1.w0, x1.w1}
+__attribute__((target("i8mm"))) void run_i8mm(const Job& job, const int8_t* values, const float* scales,
+                                              int64_t first_row, int rows) {
+    const int64_t k = job.weight->k;
+    const int group_size = job.weight->group_size;
+    for (int64_t t = 0; t < job.tokens; t += 2) {
+        const int64_t t1 = std::min(t + 1, job.tokens - 1);  // an odd last token is paired with itself
+        const int8_t* x0 = job.x_values + t * k;
+        const int8_t* x1 = job.x_values + t1 * k;
+        const float* xs0 = job.x_scales + t * job.groups;
+        const float* xs1 = job.x_scales + t1 * job.groups;
+        for (int r = 0; r < rows; r += 2) {
+            const int8_t* w0 = values + r * k;
+            const int8_t* w1 = w0 + k;
+            const float* ws0 = scales + r * job.groups;
+            const float* ws1 = ws0 + job.groups;
+            float32x4_t acc = vdupq_n_f32(0.0f);
+            for (int64_t g = 0; g < job.groups; ++g) {
+                int32x4_t sums = vdupq_n_s32(0);
+                for (int i = 0; i < group_size; i += 8) {
+                    int64_t at = g * group_size + i;
+                    int8x16_t a = vcombine_s8(vld1_s8(x0 + at), vld1_s8(x1 + at));
+                    int8x16_t b = vcombine_s8(vld1_s8(w0 + at), vld1_s8(w1 + at));
+                    sums = vmmlaq_s32(sums, a, b);
+                }
+                float32x4_t block_scales = {xs0[g] * ws0[g], xs0[g] * ws1[g], xs1[g] * ws0[g], xs1[g] * ws1[g]};
+                acc = vfmaq_f32(acc, vcvtq_f32_s32(sums), block_scales);
+            }
+            float results[4];
+            vst1q_f32(results, acc);
+            store(job, t, first_row + r, results[0]);
+            if (r + 1 < rows) {
+                store(job, t, first_row + r + 1, results[1]);
+            }
+            if (t1 != t) {
+                store(job, t1, first_row + r, results[2]);
+                if (r + 1 < rows) {
+                    store(job, t1, first_row + r + 1, results[3]);
+                }
+            }
+        }
+    }
+}
+#endif
+
+// The tiles are shared out by index; each task unpacks into scratch of its own
+int matmul_task(int task_id, TVMParallelGroupEnv* penv, void* cdata) {
+    const Job& job = *static_cast<const Job*>(cdata);
+    const int64_t k = job.weight->k;
+    std::vector<int8_t> values(static_cast<size_t>(kRowTile * k));
+    std::vector<float> scales(static_cast<size_t>(kRowTile * job.groups));
+    for (int64_t tile = task_id; tile < job.tiles; tile += penv->num_task) {
+        int64_t first_row = tile * kRowTile;
+        int rows = static_cast<int>(std::min<int64_t>(kRowTile, job.weight->rows - first_row));
+        unpack_tile(*job.weight, job.groups, first_row, rows, values.data(), scales.data());
+        job.run(job, values.data(), scales.data(), first_row, rows);
+    }
+    return 0;
+}
+
+bool is_dtype(const DLTensor* t, uint8_t code, uint8_t bits) {
+    return t->dtype.code == code && t->dtype.bits == bits && t->dtype.lanes == 1;
+}
+
+bool is_cpu(const DLTensor* t) {
+    return t->device.device_type == kDLCPU || t->device.device_type == kDLCUDAHost;
+}
+
+template <typename T>
+T* data_of(const DLTensor* t) {
+    return reinterpret_cast<T*>(static_cast<char*>(t->data) + t->byte_offset);
+}
+
+}  // namespace
+
+Kernel kernel() {
+    static const Kernel picked = [] {
+        CpuFeatures features = detect_cpu_features();
+        if (features.i8mm) {
+            return kKernelI8mm;
+        }
+        return features.dotprod ? kKernelDotprod : kKernelScalar;
+    }();
+    return picked;
+}
+
+const char* kernel_name(Kernel kernel) {
+    switch (kernel) {
+        case kKernelI8mm: return "i8mm";
+        case kKernelDotprod: return "dotprod";
+        default: return "scalar";
+    }
+}
+
+bool prefill(const uint16_t* x, int64_t tokens, const QuantizedWeight& weight, uint16_t* out, int threads) {
+    if (x == nullptr || out == nullptr || weight.q_weight == nullptr || weight.q_scale == nullptr || tokens < 0 ||
+        weight.rows <= 0 || weight.k <= 0 || weight.group_size <= 0 || weight.group_size % kValuesPerWord != 0 ||
+        weight.k % weight.group_size != 0) {
+        return false;
+    }
+    if (tokens == 0) {
+        return true;
+    }
+    const int64_t k = weight.k;
+    std::vector<float> widened(static_cast<size_t>(tokens * k));
+    for (int64_t i = 0; i < tokens * k; ++i) {
+        widened[i] = half_to_float(x[i]);
+    }
+
+    Job job;
+    job.weight = &weight;
+    job.tokens = tokens;
+    job.groups = k / weight.group_size;
+    job.out = out;
+    job.tiles = (weight.rows + kRowTile - 1) / kRowTile;
+    std::vector<int8_t> x_values;
+    std::vector<float> x_scales;
+    if (tokens < kMinTokens) {
+        job.run = run_float;
+        job.x_float = widened.data();
+    } else {
+        x_values.resize(widened.size());
+        x_scales.resize(static_cast<size_t>(tokens * job.groups));
+        quantize_activations(widened.data(), tokens, k, weight.group_size, x_values.data(), x_scales.data());
+        job.x_values = x_values.data();
+        job.x_scales = x_scales.data();
+        job.run = run_scalar;
+#if defined(__aarch64__)
+        Kernel picked = kernel();
+        if (picked == kKernelI8mm) {
+            job.run = run_i8mm;
+        } else if (picked == kKernelDotprod && weight.group_size % 16 == 0) {
+            job.run = run_dotprod;
+        }
+#endif
+    }
+
+    if (job.tiles == 1) {
+        TVMParallelGroupEnv single{nullptr, 1};
+        matmul_task(0, &single, &job);
+    } else if (shared_pool::pool().launch(matmul_task, &job, threads > 0 ? threads : 0) != 0) {
+        LOGE("Parallel launch failed; running the prefill matmul on one thread");
+        TVMParallelGroupEnv single{nullptr, 1};
+        matmul_task(0, &single, &job);
+    }
+    return true;
+}
+
+void install() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        tvm::runtime::Registry::Register("studybuddy.matmul.q4f16_prefill", true)
+            .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                if (args.size() != 4) {
+                    throw std::runtime_error("q4f16_prefill expects 4 arguments, got " + std::to_string(args.size()));
+                }
+                const DLTensor* x = args[0];
+                const DLTensor* q_weight = args[1];
+                const DLTensor* q_scale = args[2];
+                DLTensor* out = args[3];
+                if (x->ndim != 2 || q_weight->ndim != 2 || q_scale->ndim != 2 || out->ndim != 2 ||
+                    !is_dtype(x, kDLFloat, 16) || !is_dtype(q_weight, kDLUInt, 32) ||
+                    !is_dtype(q_scale, kDLFloat, 16) || !is_dtype(out, kDLFloat, 16)) {
+                    throw std::runtime_error("q4f16_prefill: unexpected tensor ranks or dtypes");
+                }
+                if (!is_cpu(x) || !is_cpu(q_weight) || !is_cpu(q_scale) || !is_cpu(out)) {
+                    throw std::runtime_error("q4f16_prefill: tensors must be on the CPU");
+                }
+                QuantizedWeight weight;
+                weight.q_weight = data_of<const uint32_t>(q_weight);
+                weight.q_scale = data_of<const uint16_t>(q_scale);
+                weight.rows = q_weight->shape[0];
+                weight.k = q_weight->shape[1] * kValuesPerWord;
+                weight.group_size = q_scale->shape[1] > 0 ? static_cast<int>(weight.k / q_scale->shape[1]) : 0;
+                if (x->shape[1] != weight.k || q_scale->shape[0] != weight.rows || out->shape[0] != x->shape[0] ||
+                    out->shape[1] != weight.rows || weight.group_size * q_scale->shape[1] != weight.k) {
+                    throw std::runtime_error("q4f16_prefill: shapes do not agree");
+                }
+                if (!prefill(data_of<const uint16_t>(x), x->shape[0], weight, data_of<uint16_t>(out))) {
+                    throw std::runtime_error("q4f16_prefill: shapes out of range");
+                }
+            });
+        LOGI("Installed CPU W4A8 prefill matmul (%s kernel)", kernel_name(kernel()));
+    });
+}
+
+}  // namespace cpu_matmul
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Prefill matmuls on the CPU with int8 activations against the q4f16_1
+ * weights (W4A8).
+ *
+ * Prefill multiplies many tokens by every weight and is bound by arithmetic,
+ * which fp16 activations leave on the table on cores with int8 dot products.
+ * Here each token's activations are quantized on the fly to int8, one scale
+ * per group of 32 values (the weights' group), and every group's dot product
+ * is an exact int32 sum of int4 x int8 products, scaled once by both groups'
+ * scales. The kernel is picked from the hwcaps (cpu_features.h): SMMLA on
+ * i8mm cores, two tokens by two weight rows per instruction, else SDOT on
+ * dotprod cores, else plain C. Rows are split across the TVM thread pool in
+ * tiles whose weights are unpacked to int8 once for all the tokens.
+ *
+ * Batches under kMinTokens are not worth quantizing and take an fp32 path
+ * instead; decode stays on the model's own kernels entirely, since it calls
+ * this only from the prefill function of CPU builds compiled against it:
+ *
+ *   studybuddy.matmul.q4f16_prefill(x, q_weight, q_scale, out)
+ *
+ *   x         [tokens, k] fp16
+ *   q_weight  [rows, k / 8] uint32, eight 4-bit values low nibble first, each (q - 7) * scale
+ *   q_scale   [rows, k / group] fp16
+ *   out       [tokens, rows] fp16, x times the weight transposed
+ */
+namespace cpu_matmul {
+
+static constexpr int64_t kMinTokens = 8;  // fewer go through the fp32 path
+static constexpr int kRowTile = 8;        // weight rows unpacked per task item
+
+enum Kernel : int {
+    kKernelScalar = 0,
+    kKernelDotprod = 1,
+    kKernelI8mm = 2,
+};
+
+struct QuantizedWeight {
+    const uint32_t* q_weight = nullptr;
+    const uint16_t* q_scale = nullptr;  // fp16
+    int64_t rows = 0;
+    int64_t k = 0;
+    int group_size = 32;
+};
+
+// The kernel this CPU runs
+Kernel kernel();
+const char* kernel_name(Kernel kernel);
+
+// out = x W^T for `tokens` rows of fp16 `x` [tokens, k]; false if the shapes are
+// out of range. `threads` <= 0 uses the pool's size.
+bool prefill(const uint16_t* x, int64_t tokens, const QuantizedWeight& weight, uint16_t* out, int threads = 0);
+
+// Register studybuddy.matmul.q4f16_prefill; idempotent
+void install();
+
+}  // namespace cpu_matmul
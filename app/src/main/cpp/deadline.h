@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Requests with a latency deadline (GenerationConfig::deadline_ms, counted
+ * from when the request was made).
+ *
+ * Before generating, the time left is split with the device's measured
+ * rates: the prompt's prefill first, then as many answer tokens as still fit
+ * at the decode rate, which caps max_gen_len. With a draft model the draft
+ * length is picked for the fastest expected rate at the measured acceptance.
+ * A request that cannot fit even kMinTokens of answer, or that finds no model
+ * loaded, gets a canned answer (canned_response.h) instead of a late one. A
+ * request that runs past its deadline anyway is stopped there with what it
+ * has (kStopDeadline). Each request's outcome is kept for the caller.
+ */
+namespace deadline {
+
+enum Outcome : int {
+    kOutcomeNone = 0,     // no deadline
+    kOutcomeMet = 1,      // answered in time as asked
+    kOutcomeTrimmed = 2,  // answered in time with max_gen_len capped
+    kOutcomeCut = 3,      // stopped at the deadline
+    kOutcomeMissed = 4,   // finished, but late
+    kOutcomeCanned = 5,   // canned answer
+};
+
+static constexpr int kMinTokens = 24;      // shortest answer worth generating
+static constexpr double kMarginMs = 50.0;  // detokenizing, delivery, scheduling
+static constexpr double kSmoothing = 0.2;
+
+// Recent rates of this device, smoothed over requests
+struct Rates {
+    double prefill_tokens_per_s = 0.0;  // 0 until measured
+    double tpot_ms = 0.0;
+    // Draft model, from SpeculativeStats; zeros without one
+    double draft_ms_per_token = 0.0;
+    double verify_ms_per_round = 0.0;
+    double acceptance = 0.0;
+
+    void observe_prefill(size_t tokens, double ms) {
+        if (tokens > 0 && ms > 0.0) {
+            smooth(&prefill_tokens_per_s, tokens * 1000.0 / ms);
+        }
+    }
+
+    void observe_decode(size_t tokens, double ms) {
+        if (tokens > 1 && ms > 0.0) {
+            smooth(&tpot_ms, ms / static_cast<double>(tokens - 1));
+        }
+    }
+
+    bool speculative() const { return draft_ms_per_token > 0.0 && verify_ms_per_round > 0.0; }
+
+private:
+    static void smooth(double* value, double sample) {
+        *value = *value <= 0.0 ? sample : *value + kSmoothing * (sample - *value);
+    }
+};
+
+// Expected ms per emitted token with drafts of `k`: a round drafts k tokens and
+// verifies them in one pass, emitting the accepted run plus one
+inline double speculative_ms_per_token(const Rates& rates, int k) {
+    double a = std::min(std::max(rates.acceptance, 0.0), 0.999);
+    double emitted = (1.0 - std::pow(a, k + 1)) / (1.0 - a);
+    return (k * rates.draft_ms_per_token + rates.verify_ms_per_round) / emitted;
+}
+
+struct Plan {
+    bool canned = false;
+    int max_tokens = 0;
+    int draft_length = 0;  // 0 keeps the engine's
+    double predicted_ms = 0.0;  // from the request's start to its last token
+};
+
+// What became of a request's deadline, for getLastDeadlineOutcome
+struct Report {
+    int outcome = kOutcomeNone;
+    int64_t deadline_ms = 0;
+    double predicted_ms = 0.0;
+    double elapsed_ms = 0.0;  // from the request's start to its answer
+    int max_tokens = 0;    // as planned
+    int draft_length = 0;  // as planned, 0 if kept
+};
+
+// `elapsed_ms` went to queueing already; `max_tokens` is what the request asked for
+inline Plan plan(int64_t deadline_ms, double elapsed_ms, size_t prompt_tokens, int max_tokens, const Rates& rates,
+                 int max_draft_length) {
+    Plan p;
+    p.max_tokens = max_tokens;
+    double ms_per_token = rates.tpot_ms;
+    if (rates.speculative()) {
+        for (int k = 1; k <= max_draft_length; ++k) {
+            double ms = speculative_ms_per_token(rates, k);
+            if (ms_per_token <= 0.0 || ms < ms_per_token) {
+                ms_per_token = ms;
+                p.draft_length = k;
+            }
+        }
+    }
+    double prefill_ms = rates.prefill_tokens_per_s > 0.0 ? prompt_tokens * 1000.0 / rates.prefill_tokens_per_s
+                                                         : 0.0;
+    double left = static_cast<double>(deadline_ms) - elapsed_ms - prefill_ms - kMarginMs;
+    if (ms_per_token > 0.0) {
+        int fit = left > 0.0 ? static_cast<int>(left / ms_per_token) : 0;
+        if (fit < std::min(kMinTokens, max_tokens)) {
+            p.canned = true;
+        }
+        p.max_tokens = std::max(1, std::min(max_tokens, fit));
+    } else if (left <= 0.0) {
+        p.canned = true;  // nothing measured, but the prefill alone is over
+    }
+    p.predicted_ms = elapsed_ms + prefill_ms + p.max_tokens * std::max(ms_per_token, 0.0);
+    return p;
+}
+
+}  // namespace deadline
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+
+#include <tvm/runtime/container/shape_tuple.h>
+#include <tvm/runtime/module.h>
+#include <tvm/runtime/packed_func.h>
+
+/**
+ * Recorded decode steps on the GPU backends.
+ *
+ * Every decode step launches the same kernels with the same shapes; only the
+ * sequence position (and the KV length behind it) moves. Modules that can
+ * record the step's launches once, into a Vulkan command buffer or an
+ * OpenCL recording (cl_qcom_recordable_queues on Adreno), replay them with
+ * the position patched in, which skips the per-launch argument setup and
+ * driver validation that dominates small-batch decode on mobile drivers:
+ *
+ *   decode_graph(enable) -> bool    record the next decode step and replay it after; false if
+ *                                   this device cannot record (the steps stay eager)
+ *   decode_graph_reset()            drop the recordings (their command buffers and argument
+ *                                   copies); the next step records again
+ *   decode_graph_stats() -> ShapeTuple   [recordings, replayed steps, eager steps]
+ *
+ * The module re-records on its own whenever something it owns changes what
+ * the step launches (a kernel variant, the adapter, the decode device, the
+ * batch width). The engine turns recording off around the profiler, which
+ * needs eager launches to time, and drops the recordings when it trims memory.
+ */
+struct DecodeGraphStats {
+    int64_t recordings = 0;
+    int64_t replays = 0;
+    int64_t eager_steps = 0;
+};
+
+class DecodeGraph {
+public:
+    void bind(tvm::runtime::Module& module) {
+        enable_ = module.GetFunction("decode_graph");
+        reset_ = module.GetFunction("decode_graph_reset");
+        stats_ = module.GetFunction("decode_graph_stats");
+        active_ = false;
+    }
+
+    void unbind() {
+        enable_ = tvm::runtime::PackedFunc(nullptr);
+        reset_ = tvm::runtime::PackedFunc(nullptr);
+        stats_ = tvm::runtime::PackedFunc(nullptr);
+        active_ = false;
+    }
+
+    bool available() const { return enable_ != nullptr && reset_ != nullptr; }
+
+    // Whether the decode steps are being recorded and replayed now
+    bool active() const { return active_; }
+
+    // Returns whether recording took effect
+    bool set_enabled(bool enabled) {
+        if (!available()) {
+            return false;
+        }
+        bool active = enable_(enabled);
+        active_ = enabled && active;
+        return active_;
+    }
+
+    void reset() {
+        if (available()) {
+            reset_();
+        }
+    }
+
+    DecodeGraphStats stats() const {
+        DecodeGraphStats stats;
+        if (stats_ == nullptr) {
+            return stats;
+        }
+        tvm::runtime::ShapeTuple counts = stats_();
+        if (counts.size() >= 3) {
+            stats.recordings = counts[0];
+            stats.replays = counts[1];
+            stats.eager_steps = counts[2];
+        }
+        return stats;
+    }
+
+private:
+    tvm::runtime::PackedFunc enable_{nullptr};
+    tvm::runtime::PackedFunc reset_{nullptr};
+    tvm::runtime::PackedFunc stats_{nullptr};
+    bool active_ = false;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "compute_device.h"
+#include "json_fields.h"
+#include "kernel_cache.h"
+#include "kernel_tuning.h"
+#include "phase_devices.h"
+#include "sha256.h"
+#include "thread_config.h"
+
+/**
+ * Tuning results shipped between phones of the same kind.
+ *
+ * Thread calibration (thread_config.h), the phase plan (phase_devices.h, which
+ * also picks the backend for each phase) and the kernel variant search
+ * (kernel_tuning.h) come out the same on every unit with a given SoC and GPU
+ * driver, so one phone's results can spare the others the measuring. A
+ * profile holds the outcome of all three for one model, keyed by SoC name,
+ * the module's backend and driver, and the model fingerprint.
+ *
+ * The blob is JSON lines: a key line, then a line per tuned part (threads,
+ * phases, one per kernel), then an HMAC-SHA256 over everything before it under
+ * a key the app provides, so a profile from the app's backend cannot be
+ * altered on the way and one from another app is refused. A profile that
+ * matches the loaded model on this phone fills in whatever this phone has not
+ * measured itself; local results always win, and what it fills in is saved
+ * like a local result.
+ */
+namespace device_profile {
+
+static constexpr int kFormat = 1;
+// A few dozen kernels fit many times over; anything bigger is not a profile
+static constexpr size_t kMaxBlobBytes = 64 << 10;
+
+inline void sanitize(std::string* text) {
+    for (char& c : *text) {
+        if (c == '"' || c == '\\' || c == '\n' || c == '\r') {
+            c = '_';
+        }
+    }
+}
+
+// "Qualcomm SM8550" from ro.soc.* (Android 12 on), else the board platform; the
+// CPU model name on a host build
+inline std::string soc_name() {
+    std::string name;
+#ifdef __ANDROID__
+    char manufacturer[PROP_VALUE_MAX] = {0};
+    char model[PROP_VALUE_MAX] = {0};
+    __system_property_get("ro.soc.manufacturer", manufacturer);
+    __system_property_get("ro.soc.model", model);
+    if (model[0] != '\0') {
+        name = manufacturer[0] != '\0' ? std::string(manufacturer) + " " + model : std::string(model);
+    } else {
+        char platform[PROP_VALUE_MAX] = {0};
+        __system_property_get("ro.board.platform", platform);
+        name = platform;
+    }
+#else
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (name.empty() && std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0 || line.compare(0, 8, "Hardware") == 0) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos && colon + 2 <= line.size()) {
+                name = line.substr(colon + 2);
+            }
+        }
+    }
+#endif
+    if (name.empty()) {
+        name = "unknown";
+    }
+    sanitize(&name);
+    return name;
+}
+
+// The module's backend and, on a GPU, its name and driver version
+inline std::string driver_name(const ComputeDevice& device) {
+    std::string name = compute_backend_name(device.backend);
+    if (device.backend != kBackendCpu) {
+        name += " " + device.name + " " + compute_driver_version(device.device);
+    }
+    sanitize(&name);
+    return name;
+}
+
+struct DeviceProfile {
+    std::string soc;
+    std::string driver;
+    uint64_t model_hash = 0;
+    ThreadConfig threads;               // kAffinityAuto: not calibrated
+    PhasePlan phases;                   // uncalibrated: no plan
+    std::vector<TuningRecord> kernels;  // every variant measured, as in the tuning database
+
+    bool empty() const { return threads.affinity == kAffinityAuto && !phases.calibrated() && kernels.empty(); }
+
+    bool matches(const std::string& other_soc, const std::string& other_driver, uint64_t other_hash) const {
+        return soc == other_soc && driver == other_driver && model_hash == other_hash;
+    }
+
+    // The signed blob; empty without a key
+    std::string to_blob(const std::string& key) const {
+        if (key.empty()) {
+            return std::string();
+        }
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(model_hash));
+        std::string body = "{\"format\": " + std::to_string(kFormat) + ", \"soc\": \"" + soc + "\", \"driver\": \"" +
+                           driver + "\", \"model_hash\": \"" + buffer + "\"}\n";
+        if (threads.affinity != kAffinityAuto) {
+            snprintf(buffer, sizeof(buffer), "{\"threads\": \"%s\", \"workers\": %d, \"decode_ms_per_token\": %.4f}\n",
+                     thread_affinity_name(threads.affinity), threads.workers, threads.decode_ms_per_token);
+            body += buffer;
+        }
+        if (phases.calibrated()) {
+            body += phases.to_json(model_hash);
+        }
+        for (const TuningRecord& record : kernels) {
+            body += "{\"kernel\": \"" + record.kernel + "\", \"variant\": \"" + record.variant + "\", \"run_ms\": ";
+            snprintf(buffer, sizeof(buffer), "%.4f}\n", record.run_ms);
+            body += buffer;
+        }
+        return body + "{\"signature\": \"" + sha256::hmac_hex(key, body) + "\"}\n";
+    }
+
+    // False if the blob is malformed, unsigned or signed under another key
+    static bool from_blob(const std::string& blob, const std::string& key, DeviceProfile* profile) {
+        if (key.empty() || blob.size() > kMaxBlobBytes) {
+            return false;
+        }
+        size_t end = blob.find_last_not_of('\n');
+        size_t last = end == std::string::npos ? std::string::npos : blob.rfind('\n', end);
+        if (last == std::string::npos) {
+            return false;
+        }
+        std::string body = blob.substr(0, last + 1);
+        std::string signature = json_string_field(blob.substr(last + 1), "signature");
+        std::string expected = sha256::hmac_hex(key, body);
+        // Compared in full whatever differs, so timing says nothing about the key
+        unsigned char diff = signature.size() == expected.size() ? 0 : 1;
+        for (size_t i = 0; i < signature.size() && i < expected.size(); ++i) {
+            diff |= static_cast<unsigned char>(signature[i] ^ expected[i]);
+        }
+        if (diff != 0) {
+            return false;
+        }
+
+        DeviceProfile loaded;
+        size_t start = 0;
+        while (start < body.size()) {
+            size_t line_end = body.find('\n', start);
+            std::string line = body.substr(start, line_end - start);
+            start = line_end + 1;
+            if (json_value_offset(line, "soc") != std::string::npos) {
+                if (json_int_field(line, "format", 0) != kFormat) {
+                    return false;
+                }
+                loaded.soc = json_string_field(line, "soc");
+                loaded.driver = json_string_field(line, "driver");
+                loaded.model_hash = strtoull(json_string_field(line, "model_hash").c_str(), nullptr, 16);
+            } else if (json_value_offset(line, "threads") != std::string::npos) {
+                std::string affinity = json_string_field(line, "threads");
+                for (ThreadAffinity candidate : {kAffinityBig, kAffinityBigMid, kAffinityAll, kAffinityMid}) {
+                    if (affinity == thread_affinity_name(candidate)) {
+                        loaded.threads.affinity = candidate;
+                    }
+                }
+                loaded.threads.workers = static_cast<int>(json_int_field(line, "workers", 0));
+                loaded.threads.decode_ms_per_token = json_float_field(line, "decode_ms_per_token", 0.0);
+            } else if (json_value_offset(line, "prefill") != std::string::npos) {
+                PhasePlan::from_json(line, loaded.model_hash, &loaded.phases);
+            } else if (json_value_offset(line, "kernel") != std::string::npos) {
+                TuningRecord record;
+                record.kernel = json_string_field(line, "kernel");
+                record.variant = json_string_field(line, "variant");
+                record.run_ms = json_float_field(line, "run_ms", 0.0);
+                if (!record.kernel.empty() && !record.variant.empty() && record.run_ms > 0.0) {
+                    loaded.kernels.push_back(record);
+                }
+            }
+        }
+        if (loaded.soc.empty() || loaded.empty()) {
+            return false;
+        }
+        *profile = loaded;
+        return true;
+    }
+};
+
+}  // namespace device_profile
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "response_cache.h"
+
+/**
+ * Map-reduce summaries of documents longer than the context window
+ * (summarizeDocument), e.g. a chapter of OCR'd pages.
+ *
+ * The text is split into chunks of at most `chunk_tokens`: whole paragraphs
+ * while they fit, else sentences, else runs of words. Cuts fall on
+ * whitespace, which starts a SentencePiece token, so no token is split and
+ * each chunk encodes as it would in place. Every chunk is summarized on its
+ * own (map), all of them as one batch over the shared instruction. The partial
+ * summaries are then grouped in order, as many per group as fit a chunk, and
+ * each group is summarized again (reduce), level by level until one summary
+ * is left. A document of n chunks takes n + about n / fan-in + ... requests
+ * of one chunk each, and every level runs in parallel.
+ *
+ * Past half the budget, a chunk also ends after any paragraph whose own hash
+ * makes it an anchor, so boundaries follow the content rather than where the
+ * text starts: a re-capture with a page more or less in front produces the
+ * same chunks from the first anchor on. Steps are cached by the hash of their
+ * whitespace-normalized input (step_key), so re-opened chapters and
+ * paragraphs shared between captures are not summarized again.
+ */
+namespace document_summary {
+
+static constexpr size_t kMaxChunkTokens = 1536;  // keeps a batch of branches inside the KV budget
+static constexpr size_t kMinChunkTokens = 128;
+static constexpr int kMapTokens = 256;     // output of one map or reduce step
+static constexpr size_t kPromptMargin = 64;  // chat template and separators
+static constexpr uint32_t kCacheSlots = 1024;  // summaries.bin, 4 MB
+
+static constexpr const char* kMapInstruction =
+        "Summarize this part of a longer document. Keep the key facts, definitions, names and numbers, "
+        "in the order they appear.\n\n";
+static constexpr const char* kReduceInstruction =
+        "These are summaries of consecutive parts of one document. Combine them into one summary, in the "
+        "same order, without repeating anything.\n\n";
+
+// Tokens a chunk may take in a `window`-token context, next to an
+// instruction of `instruction_tokens` and `output_tokens` of summary
+inline size_t chunk_budget(int64_t window, size_t instruction_tokens, size_t output_tokens, size_t requested) {
+    size_t budget = kMaxChunkTokens;
+    if (window > 0) {
+        size_t overhead = instruction_tokens + output_tokens + kPromptMargin;
+        size_t room = static_cast<size_t>(window) > overhead ? static_cast<size_t>(window) - overhead : 0;
+        budget = std::min(budget, room);
+    }
+    if (requested > 0) {
+        budget = std::min(budget, requested);
+    }
+    return std::max(budget, kMinChunkTokens);
+}
+
+namespace detail {
+
+inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Byte offsets just past each unit end in [begin, end) of `text`: paragraph
+// breaks (a blank line) at level 0, sentence ends at 1, whitespace at 2
+inline std::vector<size_t> boundaries(const std::string& text, size_t begin, size_t end, int level) {
+    std::vector<size_t> cuts;
+    for (size_t i = begin; i < end; ++i) {
+        char c = text[i];
+        bool cut = false;
+        if (level == 0) {
+            cut = c == '\n' && i + 1 < end && text[i + 1] == '\n';
+        } else if (level == 1) {
+            cut = (c == '.' || c == '?' || c == '!' || c == '\n') && i + 1 < end && is_space(text[i + 1]);
+        } else {
+            cut = is_space(c) && i + 1 < end && !is_space(text[i + 1]);
+        }
+        if (cut) {
+            cuts.push_back(i + 1);
+        }
+    }
+    cuts.push_back(end);
+    return cuts;
+}
+
+// Whether the paragraph in [begin, end) may end a chunk early; about one in four does
+inline bool anchor(const std::string& text, size_t begin, size_t end) {
+    uint64_t hash = 14695981039346656037ull;
+    bool space = false;
+    for (size_t i = begin; i < end; ++i) {
+        // Line wraps and spacing differ between captures of one page
+        if (is_space(text[i])) {
+            space = true;
+            continue;
+        }
+        if (space) {
+            hash = (hash ^ ' ') * 1099511628211ull;
+            space = false;
+        }
+        hash = (hash ^ static_cast<uint8_t>(text[i])) * 1099511628211ull;
+    }
+    return ((hash >> 29) & 3) == 0;
+}
+
+inline std::string trimmed(const std::string& text, size_t begin, size_t end) {
+    while (begin < end && is_space(text[begin])) begin++;
+    while (end > begin && is_space(text[end - 1])) end--;
+    return text.substr(begin, end - begin);
+}
+
+template <typename Count>
+void split_range(const std::string& text, size_t begin, size_t end, int level, size_t budget, Count& count,
+                 std::vector<std::string>* chunks) {
+    if (level > 2) {
+        // One word longer than a chunk: cut it at a UTF-8 character boundary
+        size_t bytes = std::max<size_t>(1, budget * 2);
+        for (size_t at = begin; at < end;) {
+            size_t stop = std::min(end, at + bytes);
+            while (stop < end && (static_cast<uint8_t>(text[stop]) & 0xC0) == 0x80) stop++;
+            chunks->push_back(text.substr(at, stop - at));
+            at = stop;
+        }
+        return;
+    }
+    std::vector<size_t> cuts = boundaries(text, begin, end, level);
+    size_t start = begin;  // of the chunk being filled
+    size_t last = begin;   // end of its last unit that fit
+    size_t anchored = budget / 2;
+    for (size_t cut : cuts) {
+        size_t tokens = count(trimmed(text, start, cut));
+        if (tokens <= budget) {
+            size_t unit = last;
+            last = cut;
+            if (level == 0 && tokens >= anchored && anchor(text, unit, cut)) {
+                chunks->push_back(trimmed(text, start, last));
+                start = last;
+            }
+            continue;
+        }
+        if (last > start) {
+            chunks->push_back(trimmed(text, start, last));
+            start = last;
+        }
+        if (count(trimmed(text, start, cut)) <= budget) {
+            last = cut;
+        } else {
+            // This unit alone is over the budget
+            split_range(text, start, cut, level + 1, budget, count, chunks);
+            start = last = cut;
+        }
+    }
+    if (last > start) {
+        chunks->push_back(trimmed(text, start, last));
+    }
+}
+
+}  // namespace detail
+
+// Chunks of at most `budget` tokens by `count`, in document order, blank ones dropped
+template <typename Count>
+std::vector<std::string> split(const std::string& text, size_t budget, Count&& count) {
+    std::vector<std::string> chunks;
+    detail::split_range(text, 0, text.size(), 0, budget, count, &chunks);
+    chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [](const std::string& c) { return c.empty(); }),
+                 chunks.end());
+    return chunks;
+}
+
+// Consecutive runs of `tokens` (one partial summary each) that fit `budget`
+// together, at least two per run so every level shrinks; as [begin, end) pairs
+inline std::vector<std::pair<size_t, size_t>> group(const std::vector<size_t>& tokens, size_t budget) {
+    std::vector<std::pair<size_t, size_t>> groups;
+    size_t begin = 0;
+    while (begin < tokens.size()) {
+        size_t end = begin;
+        size_t used = 0;
+        while (end < tokens.size() && (end - begin < 2 || used + tokens[end] <= budget)) {
+            used += tokens[end];
+            end++;
+        }
+        groups.emplace_back(begin, end);
+        begin = end;
+    }
+    return groups;
+}
+
+// Cache key of one step's output; `scope` is ResponseCache::scope of its settings
+inline uint64_t step_key(const char* instruction, const std::string& input, uint64_t scope) {
+    return ResponseCache::key(ResponseCache::normalize(instruction + input), scope);
+}
+
+// The reduce step's input for summaries [begin, end)
+inline std::string reduce_input(const std::vector<std::string>& summaries, size_t begin, size_t end) {
+    std::string input;
+    for (size_t i = begin; i < end; ++i) {
+        input += "Part " + std::to_string(i - begin + 1) + ":\n" + summaries[i] + "\n\n";
+    }
+    return input;
+}
+
+}  // namespace document_summary
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "model_manifest.h"
+
+/**
+ * The file end of a shard download: the target is preallocated at its full
+ * size and every received range is pwrite()n straight to its offset, so any
+ * number of range requests can fill one file at once, in any order.
+ *
+ * Bytes are hashed as they arrive into the manifest's chunk hashes (see
+ * model_manifest.h). Connections fetch whole chunks each (ranges aligned to
+ * model_manifest::kChunkBytes), so every chunk is written in order by one
+ * connection; finish() hands the finished tree to model_manifest::write(),
+ * which then does not read the shard again. A chunk written out of order (a
+ * reconnect that did not resume exactly) only costs that: the manifest hashes
+ * the file itself.
+ *
+ * Writes go to `<path>.tmp`, renamed over `path` when complete, as the JVM
+ * download path does.
+ */
+namespace download_sink {
+
+class Sink {
+public:
+    // Null if the target cannot be created at `size` bytes
+    static std::unique_ptr<Sink> open(const std::string& path, uint64_t size) {
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+        // Reserves the blocks up front, so a full disk fails here rather than mid-download
+        int error = size > 0 ? posix_fallocate(fd, 0, static_cast<off_t>(size)) : 0;
+        if (error != 0 && (error == EOPNOTSUPP || error == EINVAL)) {
+            error = ftruncate(fd, static_cast<off_t>(size)) == 0 ? 0 : errno;
+        }
+        if (error != 0) {
+            ::close(fd);
+            remove(tmp.c_str());
+            return nullptr;
+        }
+        std::unique_ptr<Sink> sink(new Sink());
+        sink->fd_ = fd;
+        sink->path_ = path;
+        sink->size_ = size;
+        size_t chunks = model_manifest::chunk_count(size, model_manifest::kChunkBytes);
+        sink->leaves_.assign(chunks, model_manifest::kFnvBasis);
+        sink->filled_.assign(chunks, 0);
+        return sink;
+    }
+
+    Sink(const Sink&) = delete;
+    Sink& operator=(const Sink&) = delete;
+
+    ~Sink() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            remove((path_ + ".tmp").c_str());
+        }
+    }
+
+    uint64_t size() const { return size_; }
+
+    // Thread safe for writes to different chunks
+    bool write(uint64_t offset, const uint8_t* data, size_t size) {
+        if (offset > size_ || size > size_ - offset) {
+            return false;
+        }
+        for (size_t done = 0; done < size;) {
+            ssize_t n = pwrite(fd_, data + done, size - done, static_cast<off_t>(offset + done));
+            if (n <= 0) {
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        while (size > 0) {
+            size_t chunk = static_cast<size_t>(offset / model_manifest::kChunkBytes);
+            uint64_t chunk_offset = offset % model_manifest::kChunkBytes;
+            size_t take = static_cast<size_t>(std::min<uint64_t>(size, model_manifest::kChunkBytes - chunk_offset));
+            if (filled_[chunk] == chunk_offset) {
+                leaves_[chunk] = model_manifest::fnv1a(data, take, leaves_[chunk]);
+                filled_[chunk] += take;
+            } else {
+                in_order_.store(false, std::memory_order_relaxed);
+            }
+            offset += take;
+            data += take;
+            size -= take;
+        }
+        return true;
+    }
+
+    // Syncs, renames the target into place and hands its chunk hashes to the manifest
+    bool finish() {
+        bool ok = fsync(fd_) == 0;
+        ok = ::close(fd_) == 0 && ok;
+        fd_ = -1;
+        std::string tmp = path_ + ".tmp";
+        struct stat st;
+        if (!ok || rename(tmp.c_str(), path_.c_str()) != 0 || stat(path_.c_str(), &st) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        bool complete = in_order_.load();
+        for (size_t i = 0; complete && i < filled_.size(); ++i) {
+            complete = filled_[i] == std::min<uint64_t>(model_manifest::kChunkBytes, size_ - i * model_manifest::kChunkBytes);
+        }
+        if (complete) {
+            model_manifest::remember_chunks(path_, size_, model_manifest::mtime_ns(st), leaves_);
+        }
+        return true;
+    }
+
+private:
+    Sink() = default;
+
+    int fd_ = -1;
+    std::string path_;
+    uint64_t size_ = 0;
+    std::vector<uint64_t> leaves_;  // running FNV-1a of each chunk
+    std::vector<uint64_t> filled_;  // bytes of each chunk hashed so far
+    std::atomic<bool> in_order_{true};
+};
+
+// Open sinks by the handle the Java side holds
+inline std::mutex& sinks_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline std::map<int64_t, std::shared_ptr<Sink>>& sinks() {
+    static std::map<int64_t, std::shared_ptr<Sink>> open_sinks;
+    return open_sinks;
+}
+
+// 0 if the target cannot be created
+inline int64_t open_handle(const std::string& path, uint64_t size) {
+    static int64_t next_handle = 1;
+    std::unique_ptr<Sink> sink = Sink::open(path, size);
+    if (!sink) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(sinks_mutex());
+    int64_t handle = next_handle++;
+    sinks()[handle] = std::move(sink);
+    return handle;
+}
+
+inline std::shared_ptr<Sink> find_handle(int64_t handle) {
+    std::lock_guard<std::mutex> lock(sinks_mutex());
+    auto it = sinks().find(handle);
+    return it != sinks().end() ? it->second : nullptr;
+}
+
+// Finishes the download if `complete`, otherwise discards it
+inline bool close_handle(int64_t handle, bool complete) {
+    std::shared_ptr<Sink> sink;
+    {
+        std::lock_guard<std::mutex> lock(sinks_mutex());
+        auto it = sinks().find(handle);
+        if (it == sinks().end()) {
+            return false;
+        }
+        sink = std::move(it->second);
+        sinks().erase(it);
+    }
+    return complete && sink->finish();
+}
+
+}  // namespace download_sink
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+
+#include "output_lengths.h"
+
+/**
+ * Proposal length per speculation round, chosen from how well proposals have
+ * been doing.
+ *
+ * A round proposes k tokens and the target keeps a prefix of them plus one of
+ * its own. If each proposed token survives with probability a, a round emits
+ * (1 - a^(k+1)) / (1 - a) tokens on average, and costs k draft steps plus a
+ * verification pass that grows slowly with k. Before every round the
+ * controller picks the k in [0, ceiling] with the most expected tokens per
+ * millisecond, from the measured draft and verify times and the session's a.
+ * Creative answers, where little survives, fall back towards k 0, which is a
+ * plain decode step; every kProbeEvery rounds at 0 try k 1 so a run of
+ * formulaic text is noticed. Templated answers climb towards the ceiling.
+ *
+ * a is a decaying count of kept over tested proposals per session (a window
+ * of about ten rounds). A session's first rounds lean on its task type's
+ * rate, which decays more slowly, so a fresh one-shot session (summary steps,
+ * flashcards) starts from what that kind of request usually gets. One
+ * controller serves one speculation method, since the methods' rates and
+ * costs have little to do with each other.
+ */
+class DraftController {
+public:
+    static constexpr int kMaxLength = 16;
+    static constexpr int kDefaultCeiling = 8;
+    static constexpr double kSessionDecay = 0.9;   // per round
+    static constexpr double kTaskDecay = 0.98;
+    static constexpr double kPriorTrials = 16.0;   // weight of the task's rate in a session's estimate
+    static constexpr double kDefaultRate = 0.6;    // before anything was measured
+    static constexpr double kVerifyGrowth = 0.03;  // verify pass cost per proposed token, relative
+    static constexpr double kTimeWeight = 0.2;     // EWMA weight of a new time sample
+    static constexpr int kProbeEvery = 8;
+    static constexpr size_t kMaxSessions = 32;
+
+    // Proposal length for the next round of `session`, a request of `task`
+    int next(int64_t session, int task, int ceiling) {
+        ceiling = std::max(0, std::min(ceiling, kMaxLength));
+        SessionState& state = session_state(session);
+        double rate = estimate(state, task);
+        double verify = verify_ms_ > 0.0 ? verify_ms_ : 1.0;
+        double draft = draft_ms_per_token_ > 0.0 || rounds_ > 0 ? draft_ms_per_token_ : 0.1 * verify;
+        int best = 0;
+        double best_value = 1.0 / verify;
+        for (int k = 1; k <= ceiling; ++k) {
+            double value = expected_tokens(rate, k) / (k * draft + verify * (1.0 + kVerifyGrowth * k));
+            if (value > best_value) {
+                best = k;
+                best_value = value;
+            }
+        }
+        if (best == 0 && ceiling > 0 && ++state.zero_rounds >= kProbeEvery) {
+            best = 1;
+        }
+        if (best > 0) {
+            state.zero_rounds = 0;
+        }
+        state.length = best;
+        return best;
+    }
+
+    // A finished round: `proposed` tokens offered (a proposer may offer fewer than asked), `accepted` kept
+    void observe(int64_t session, int task, int proposed, int accepted, double draft_ms, double verify_ms) {
+        proposed = std::max(0, std::min(proposed, kMaxLength));
+        accepted = std::max(0, std::min(accepted, proposed));
+        rounds_++;
+        lengths_[proposed]++;
+        proposed_ += static_cast<uint64_t>(proposed);
+        accepted_ += static_cast<uint64_t>(accepted);
+        if (proposed > 0) {
+            ewma(draft_ms_per_token_, draft_ms / proposed);
+            // The first rejection is the last token tested; past it nothing was
+            double trials = accepted + (accepted < proposed ? 1 : 0);
+            session_state(session).rate.add(accepted, trials, kSessionDecay);
+            if (task >= 0 && task < kTaskTypes) {
+                tasks_[task].add(accepted, trials, kTaskDecay);
+            }
+        }
+        ewma(verify_ms_, verify_ms / (1.0 + kVerifyGrowth * proposed));
+    }
+
+    void forget(int64_t session) { sessions_.erase(session); }
+
+    void reset() {
+        *this = DraftController();
+    }
+
+    uint64_t rounds() const { return rounds_; }
+
+    // {"rounds", "mean_length", "acceptance", "task_acceptance": [chat, flashcard, summary],
+    //  "draft_ms_per_token", "verify_ms", "lengths": [rounds at k 0..16], "sessions"}
+    std::string to_json() const {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"rounds\": %llu, \"mean_length\": %.2f, \"acceptance\": %.3f, \"task_acceptance\": [",
+                 static_cast<unsigned long long>(rounds_), rounds_ > 0 ? static_cast<double>(proposed_) / rounds_ : 0.0,
+                 proposed_ > 0 ? static_cast<double>(accepted_) / proposed_ : 0.0);
+        std::string out = buffer;
+        for (int task = 0; task < kTaskTypes; ++task) {
+            snprintf(buffer, sizeof(buffer), "%s%.3f", task > 0 ? ", " : "", tasks_[task].value(kDefaultRate));
+            out += buffer;
+        }
+        snprintf(buffer, sizeof(buffer), "], \"draft_ms_per_token\": %.3f, \"verify_ms\": %.3f, \"lengths\": [",
+                 draft_ms_per_token_, verify_ms_);
+        out += buffer;
+        for (int k = 0; k <= kMaxLength; ++k) {
+            out += (k > 0 ? ", " : "") + std::to_string(lengths_[k]);
+        }
+        return out + "], \"sessions\": " + std::to_string(sessions_.size()) + "}";
+    }
+
+private:
+    struct Rate {
+        double kept = 0.0;
+        double tested = 0.0;
+
+        void add(double k, double t, double decay) {
+            kept = kept * decay + k;
+            tested = tested * decay + t;
+        }
+
+        double value(double fallback) const { return tested > 0.0 ? kept / tested : fallback; }
+    };
+
+    struct SessionState {
+        Rate rate;
+        int zero_rounds = 0;
+        int length = 0;
+        uint64_t used = 0;
+    };
+
+    Rate tasks_[kTaskTypes];
+    std::map<int64_t, SessionState> sessions_;
+    uint64_t tick_ = 0;
+    double draft_ms_per_token_ = 0.0;
+    double verify_ms_ = 0.0;  // per pass, scaled back to an empty proposal
+    uint64_t rounds_ = 0;
+    uint64_t proposed_ = 0;
+    uint64_t accepted_ = 0;
+    uint64_t lengths_[kMaxLength + 1] = {};
+
+    static double expected_tokens(double rate, int k) {
+        rate = std::min(std::max(rate, 0.0), 0.99);
+        return (1.0 - std::pow(rate, k + 1)) / (1.0 - rate);
+    }
+
+    static void ewma(double& average, double sample) {
+        average = average > 0.0 ? (1.0 - kTimeWeight) * average + kTimeWeight * sample : sample;
+    }
+
+    double estimate(const SessionState& state, int task) const {
+        double prior = task >= 0 && task < kTaskTypes ? tasks_[task].value(kDefaultRate) : kDefaultRate;
+        return (state.rate.kept + kPriorTrials * prior) / (state.rate.tested + kPriorTrials);
+    }
+
+    // The least recently used session goes once kMaxSessions are tracked
+    SessionState& session_state(int64_t session) {
+        auto it = sessions_.find(session);
+        if (it == sessions_.end()) {
+            if (sessions_.size() >= kMaxSessions) {
+                auto oldest = std::min_element(sessions_.begin(), sessions_.end(), [](const auto& a, const auto& b) {
+                    return a.second.used < b.second.used;
+                });
+                sessions_.erase(oldest);
+            }
+            it = sessions_.emplace(session, SessionState()).first;
+        }
+        it->second.used = ++tick_;
+        return it->second;
+    }
+};
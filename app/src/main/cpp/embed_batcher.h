@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "batch_scheduler.h"
+#include "text_embedding.h"
+
+/**
+ * Micro-batching of embedding calls from different callers.
+ *
+ * Note indexing, the semantic cache and answer grading each embed one or a
+ * few texts at a time, and the embedding model costs about as much for one
+ * text as for a dozen. A call waits up to its priority class's window for
+ * others of the same source to join, or until the queued texts reach the
+ * class's batch size; one forward pass then embeds the lot and every caller
+ * gets its own rows back.
+ *
+ * There is no batching thread: the first waiter whose batch is ready runs it
+ * on its own thread while the others sleep, and a call that arrives while a
+ * pass runs queues for the next one, so under load batches form by
+ * themselves. A call is never split across passes. A window of 0 runs a call
+ * as soon as no pass is running.
+ */
+class EmbedBatcher {
+public:
+    using Clock = std::chrono::steady_clock;
+    // One forward pass over `texts`: rows of `*dim` values back to back, empty on failure
+    using Run = std::function<std::vector<float>(const std::vector<std::string>& texts, EmbedSource source,
+                                                 size_t* dim)>;
+
+    struct Window {
+        std::chrono::microseconds wait{0};
+        size_t max_texts = 1;
+    };
+
+    struct Stats {
+        uint64_t batches = 0;
+        uint64_t calls = 0;
+        uint64_t texts = 0;
+        double wait_ms = 0.0;  // summed over calls, queueing included
+    };
+
+    EmbedBatcher() {
+        // An interactive caller waits about a fifth of a short pass, background work can wait longer
+        windows_[kPriorityInteractive] = {std::chrono::microseconds(2000), 16};
+        windows_[kPriorityBackground] = {std::chrono::microseconds(20000), 64};
+        windows_[kPriorityPrefetch] = {std::chrono::microseconds(50000), 64};
+    }
+
+    void set_window(int priority, Window window) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        window.max_texts = std::max<size_t>(1, window.max_texts);
+        windows_[clamp(priority)] = window;
+    }
+
+    Window window(int priority) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return windows_[clamp(priority)];
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // Rows for `texts` in order, as `run` would return them for these texts alone
+    std::vector<float> embed(const std::vector<std::string>& texts, EmbedSource source, int priority, size_t* dim,
+                             const Run& run) {
+        *dim = 0;
+        if (texts.empty()) {
+            return {};
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        priority = clamp(priority);
+        Clock::time_point start = Clock::now();
+        auto call = calls_.insert(calls_.end(), Call());
+        call->texts = &texts;
+        call->source = source;
+        call->priority = priority;
+        call->deadline = start + windows_[priority].wait;
+        cond_.notify_all();  // may complete someone's batch
+
+        while (!call->done) {
+            Clock::time_point deadline;
+            if (!running_ && ready(*call, &deadline)) {
+                run_batch(lock, call->source, run);
+                continue;
+            }
+            if (running_) {
+                cond_.wait(lock);
+            } else {
+                cond_.wait_until(lock, deadline);
+            }
+        }
+        std::vector<float> rows = std::move(call->rows);
+        *dim = call->dim;
+        stats_.calls++;
+        stats_.wait_ms += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        calls_.erase(call);
+        cond_.notify_all();  // the next batch may be waiting on this one's turn
+        return rows;
+    }
+
+private:
+    struct Call {
+        const std::vector<std::string>* texts = nullptr;
+        EmbedSource source = kEmbedAuto;
+        int priority = kPriorityInteractive;
+        Clock::time_point deadline;
+        bool taken = false;  // in the pass now running
+        bool done = false;
+        std::vector<float> rows;
+        size_t dim = 0;
+    };
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    Window windows_[kPriorityClasses];
+    std::list<Call> calls_;  // arrival order; a call's node stays put while it waits
+    bool running_ = false;
+    Stats stats_;
+
+    static int clamp(int priority) { return std::max(0, std::min(kPriorityClasses - 1, priority)); }
+
+    // Whether the batch of `call`'s source can run now; else `*deadline` is when it can at the latest
+    bool ready(const Call& call, Clock::time_point* deadline) const {
+        size_t texts = 0;
+        size_t cap = 0;
+        *deadline = Clock::time_point::max();
+        for (const Call& other : calls_) {
+            if (other.done || other.taken || other.source != call.source) {
+                continue;
+            }
+            texts += other.texts->size();
+            cap = cap == 0 ? windows_[other.priority].max_texts : std::min(cap, windows_[other.priority].max_texts);
+            *deadline = std::min(*deadline, other.deadline);
+        }
+        return texts >= cap || Clock::now() >= *deadline;
+    }
+
+    // Take waiting calls of `source`, most urgent class first, up to the batch size of the
+    // most urgent; run them as one pass with the lock released and hand out the rows
+    void run_batch(std::unique_lock<std::mutex>& lock, EmbedSource source, const Run& run) {
+        std::vector<Call*> batch;
+        size_t cap = 0;
+        size_t count = 0;
+        for (int priority = 0; priority < kPriorityClasses; ++priority) {
+            for (Call& call : calls_) {
+                if (call.done || call.taken || call.source != source || call.priority != priority) {
+                    continue;
+                }
+                if (cap == 0) {
+                    cap = windows_[priority].max_texts;
+                } else if (count + call.texts->size() > cap) {
+                    continue;
+                }
+                call.taken = true;
+                batch.push_back(&call);
+                count += call.texts->size();
+            }
+        }
+        std::vector<std::string> texts;
+        texts.reserve(count);
+        for (const Call* call : batch) {
+            texts.insert(texts.end(), call->texts->begin(), call->texts->end());
+        }
+
+        running_ = true;
+        lock.unlock();
+        size_t dim = 0;
+        std::vector<float> rows;
+        try {
+            rows = run(texts, source, &dim);
+        } catch (...) {
+            rows.clear();
+        }
+        lock.lock();
+        running_ = false;
+
+        bool ok = dim > 0 && rows.size() == texts.size() * dim;
+        size_t offset = 0;
+        for (Call* call : batch) {
+            size_t size = call->texts->size() * dim;
+            if (ok) {
+                call->rows.assign(rows.begin() + offset, rows.begin() + offset + size);
+                call->dim = dim;
+            }
+            offset += size;
+            call->done = true;
+        }
+        stats_.batches++;
+        stats_.texts += texts.size();
+        cond_.notify_all();
+    }
+};
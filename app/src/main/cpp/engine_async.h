@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define ENGINE_ASYNC_COROUTINES 1
+#endif
+#endif
+
+#include "generation_config.h"
+#include "text_embedding.h"
+
+/**
+ * Non-blocking engine operations for native callers: the study pipeline, the
+ * batch job runner, the model server.
+ *
+ * The engine's own entry points block the calling thread for the whole
+ * generation or embedding pass, so a native module with many requests in
+ * flight needs as many threads parked on them. Here an operation returns
+ * right away with a Future, and the work is multiplexed over the engine's
+ * executors: generations join the continuous batch (batch_scheduler.h) and
+ * embeddings the embed worker, which merges the calls queued meanwhile into
+ * one pass. A Future's continuation runs on the executor thread that settled
+ * it, after the executor let go of the engine's locks, so it may start the
+ * next operation but should not block for long.
+ *
+ *   auto gen = engine_async::generate(prompt, nullptr, kPriorityBackground);
+ *   gen->prefill().then([gen](const Result<uint64_t>& r) { ... });
+ *   gen->next_tokens(16).then([gen](const Result<std::string>& r) { ... });
+ *
+ * The library builds as C++17, where continuations are what there is. Built
+ * as C++20, a Future is also an awaitable, and a coroutine can write
+ * `Result<std::string> r = co_await gen->next_tokens(16);` and is resumed
+ * on the executor the same way.
+ *
+ * Generation rides the batch, so it needs a module with batched entry points
+ * (g_batching_ready); without one it finishes at once with an error, and the
+ * caller falls back to the blocking calls.
+ */
+namespace engine_async {
+
+// Continuations made ready while an executor holds the engine's locks; the
+// executor's thread runs them once it has let go
+class ReadyQueue {
+public:
+    void post(std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        items_.push_back(std::move(fn));
+    }
+
+    // Runs everything posted, including what the continuations post; returns how many ran
+    size_t run() {
+        size_t ran = 0;
+        while (true) {
+            std::vector<std::function<void()>> items;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                items.swap(items_);
+            }
+            if (items.empty()) {
+                return ran;
+            }
+            for (std::function<void()>& item : items) {
+                item();
+            }
+            ran += items.size();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::function<void()>> items_;
+};
+
+inline ReadyQueue& ready_queue() {
+    static ReadyQueue* queue = new ReadyQueue();
+    return *queue;
+}
+
+template <typename T>
+struct Result {
+    bool ok = false;
+    T value{};
+    std::string error;
+};
+
+template <typename T>
+class Promise;
+
+template <typename T>
+class Future {
+public:
+    using Continuation = std::function<void(const Result<T>&)>;
+
+    struct State {
+        std::mutex mutex;
+        bool done = false;
+        Result<T> result;
+        Continuation then;
+    };
+
+    Future() = default;
+    explicit Future(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+    bool valid() const { return state_ != nullptr; }
+
+    bool ready() const {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->done;
+    }
+
+    // `fn` runs once with the result: here if it is already in, else where it is settled. One per Future.
+    void then(Continuation fn) {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        if (!state_->done) {
+            state_->then = std::move(fn);
+            return;
+        }
+        lock.unlock();
+        fn(state_->result);
+    }
+
+    // Once ready()
+    const Result<T>& result() const { return state_->result; }
+
+#if ENGINE_ASYNC_COROUTINES
+    bool await_ready() const { return ready(); }
+    void await_suspend(std::coroutine_handle<> waiting) {
+        then([waiting](const Result<T>&) { waiting.resume(); });
+    }
+    Result<T> await_resume() const { return state_->result; }
+#endif
+
+private:
+    std::shared_ptr<State> state_;
+};
+
+template <typename T>
+class Promise {
+public:
+    Promise() : state_(std::make_shared<typename Future<T>::State>()) {}
+
+    Future<T> future() const { return Future<T>(state_); }
+
+    // The first call settles; the continuation is posted to `queue`, or runs here without one
+    bool settle(Result<T> result, ReadyQueue* queue = nullptr) {
+        typename Future<T>::Continuation then;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            if (state_->done) {
+                return false;
+            }
+            state_->done = true;
+            state_->result = std::move(result);
+            then.swap(state_->then);
+        }
+        if (then) {
+            std::shared_ptr<typename Future<T>::State> state = state_;
+            auto run = [state, then] { then(state->result); };
+            if (queue != nullptr) {
+                queue->post(std::move(run));
+            } else {
+                run();
+            }
+        }
+        return true;
+    }
+
+    bool resolve(T value, ReadyQueue* queue = nullptr) {
+        Result<T> result;
+        result.ok = true;
+        result.value = std::move(value);
+        return settle(std::move(result), queue);
+    }
+
+    bool fail(std::string error, ReadyQueue* queue = nullptr) {
+        Result<T> result;
+        result.error = std::move(error);
+        return settle(std::move(result), queue);
+    }
+
+private:
+    std::shared_ptr<typename Future<T>::State> state_;
+};
+
+// A generation in the batch, read a few pieces at a time. A piece is what one
+// decode step adds to the text, as the detokenizer releases it.
+class Generation {
+public:
+    explicit Generation(ReadyQueue* queue) : queue_(queue) {}
+
+    Generation(const Generation&) = delete;
+    Generation& operator=(const Generation&) = delete;
+
+    // The prompt's token count once it is in the KV cache, the first token sampled
+    Future<uint64_t> prefill() { return prefill_.future(); }
+
+    // The text of the next `pieces` pieces; fewer at the end, "" after it. One read at a time.
+    Future<std::string> next_tokens(size_t pieces) {
+        Promise<std::string> promise;
+        Future<std::string> future = promise.future();
+        std::string text;
+        bool settled = true;
+        bool ok = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (reading_) {
+                ok = false;
+                text = "A read is already pending";
+            } else if (pieces_.size() >= std::max<size_t>(1, pieces) || finished_) {
+                ok = !failed_ || !pieces_.empty();
+                text = ok ? take(pieces) : error_;
+            } else {
+                reading_ = true;
+                want_ = std::max<size_t>(1, pieces);
+                read_ = promise;
+                settled = false;
+            }
+        }
+        if (settled) {
+            ok ? promise.resolve(std::move(text)) : promise.fail(std::move(text));
+        }
+        return future;
+    }
+
+    bool finished() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return finished_;
+    }
+
+    // Stops it at the next token boundary; a pending read gets what was produced
+    void cancel() {
+        std::function<void()> cancel;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancel = cancel_;
+        }
+        if (cancel) {
+            cancel();
+        }
+    }
+
+    // Engine side, on the executor
+
+    void bind(int64_t request, std::function<void()> cancel) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        request_ = request;
+        cancel_ = std::move(cancel);
+    }
+
+    int64_t request() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return request_;
+    }
+
+    void prefilled(bool ok, uint64_t prompt_tokens) {
+        ok ? prefill_.resolve(prompt_tokens, queue_) : prefill_.fail("Prefill failed", queue_);
+    }
+
+    void text(const std::string& piece) {
+        Promise<std::string> read;
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pieces_.push_back(piece);
+            if (!reading_ || pieces_.size() < want_) {
+                return;
+            }
+            reading_ = false;
+            read = read_;
+            text = take(want_);
+        }
+        read.resolve(std::move(text), queue_);
+    }
+
+    void finish(bool ok, const std::string& error) {
+        Promise<std::string> read;
+        bool reading;
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            finished_ = true;
+            failed_ = !ok;
+            error_ = error.empty() ? std::string("Generation failed") : error;
+            reading = reading_;
+            reading_ = false;
+            if (reading) {
+                read = read_;
+                text = take(pieces_.size());
+            }
+        }
+        prefill_.fail(ok ? "Finished before prefill" : error_, queue_);
+        if (reading) {
+            ok || !text.empty() ? read.resolve(std::move(text), queue_) : read.fail(error_, queue_);
+        }
+    }
+
+private:
+    ReadyQueue* queue_;
+    mutable std::mutex mutex_;
+    int64_t request_ = -1;
+    std::function<void()> cancel_;
+    Promise<uint64_t> prefill_;
+    std::vector<std::string> pieces_;  // produced, not read yet
+    bool reading_ = false;
+    size_t want_ = 0;
+    Promise<std::string> read_;
+    bool finished_ = false;
+    bool failed_ = false;
+    std::string error_;
+
+    // Under mutex_
+    std::string take(size_t pieces) {
+        size_t n = std::min(pieces, pieces_.size());
+        std::string text;
+        for (size_t i = 0; i < n; ++i) {
+            text += pieces_[i];
+        }
+        pieces_.erase(pieces_.begin(), pieces_.begin() + static_cast<std::ptrdiff_t>(n));
+        return text;
+    }
+};
+
+struct Embedding {
+    std::vector<float> rows;  // `dim` values per text, back to back
+    size_t dim = 0;
+};
+
+// Defined with the engine (real_mlc_llm_jni.cpp). `config` null takes the
+// engine's defaults; `priority` is a RequestPriority class.
+std::shared_ptr<Generation> generate(const std::string& prompt, const GenerationConfig* config, int priority);
+Future<Embedding> embed(std::vector<std::string> texts, EmbedSource source, int priority);
+
+}  // namespace engine_async
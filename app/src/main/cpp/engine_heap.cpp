@@ -0,0 +1,305 @@
+#include "engine_heap.h"
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace {
+
+// 16-byte steps up to 256, then 64-byte steps up to kMaxSmall
+constexpr int kFineClasses = 16;
+constexpr int kClasses = kFineClasses + static_cast<int>((engine_heap::kMaxSmall - 256) / 64);
+
+constexpr size_t class_size(int k) {
+    return k < kFineClasses ? static_cast<size_t>(k + 1) * 16 : 256 + static_cast<size_t>(k - kFineClasses + 1) * 64;
+}
+
+// The smallest class that holds `bytes` (at most kMaxSmall)
+inline int request_class(size_t bytes) {
+    if (bytes <= 256) {
+        return bytes == 0 ? 0 : static_cast<int>((bytes + 15) / 16) - 1;
+    }
+    return kFineClasses + static_cast<int>((bytes - 256 + 63) / 64) - 1;
+}
+
+// The largest class a block of `usable` bytes can serve; -1 for blocks too small or far too large
+inline int block_class(size_t usable) {
+    if (usable < 16 || usable > engine_heap::kMaxSmall + 64) {
+        return -1;
+    }
+    if (usable < 320) {
+        return static_cast<int>(std::min<size_t>(usable / 16, kFineClasses)) - 1;
+    }
+    return std::min(kFineClasses + static_cast<int>((usable - 256) / 64) - 1, kClasses - 1);
+}
+
+// Counters are written by the owning thread only and read by stats()
+inline void bump(std::atomic<uint64_t>& counter, uint64_t by = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+struct Cache {
+    void* lists[kClasses] = {nullptr};  // each block's first word links to the next
+    uint64_t epoch = 0;
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> cached{0};
+};
+
+std::atomic<uint64_t> g_epoch{0};  // bumped by trim()
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<Cache*> caches;
+    // Counts of threads that have exited
+    uint64_t allocations = 0;
+    uint64_t hits = 0;
+    uint64_t frees = 0;
+    // For the rate
+    uint64_t last_allocations = 0;
+    std::chrono::steady_clock::time_point last_read = std::chrono::steady_clock::now();
+};
+
+Registry& registry() {
+    static Registry* r = new Registry();
+    return *r;
+}
+
+// Trivially destructible, so the allocation path reads it without a TLS guard
+thread_local Cache* t_cache = nullptr;
+
+void flush(Cache* cache) {
+    for (void*& head : cache->lists) {
+        while (head != nullptr) {
+            void* next = *static_cast<void**>(head);
+            free(head);
+            head = next;
+        }
+    }
+    cache->cached.store(0, std::memory_order_relaxed);
+}
+
+// Flushes a cache trim() asked for since the thread last looked
+inline void check_epoch(Cache* cache) {
+    uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+    if (cache->epoch != epoch) {
+        cache->epoch = epoch;
+        flush(cache);
+    }
+}
+
+// Gives the cache back when the thread exits; later frees on the thread go to free()
+struct Owner {
+    Cache* cache = nullptr;
+
+    ~Owner() {
+        if (cache == nullptr) {
+            return;
+        }
+        t_cache = nullptr;
+        flush(cache);
+        Registry& r = registry();
+        {
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.caches.erase(std::remove(r.caches.begin(), r.caches.end(), cache), r.caches.end());
+            r.allocations += cache->allocations.load(std::memory_order_relaxed);
+            r.hits += cache->hits.load(std::memory_order_relaxed);
+            r.frees += cache->frees.load(std::memory_order_relaxed);
+        }
+        cache->~Cache();
+        free(cache);
+    }
+};
+
+thread_local Owner t_owner;
+
+void* allocate(size_t bytes) {
+    Cache* cache = t_cache;
+    if (cache != nullptr) {
+        bump(cache->allocations);
+        if (bytes <= engine_heap::kMaxSmall) {
+            check_epoch(cache);
+            int k = request_class(bytes);
+            void* block = cache->lists[k];
+            if (block != nullptr) {
+                cache->lists[k] = *static_cast<void**>(block);
+                bump(cache->hits);
+                cache->cached.store(cache->cached.load(std::memory_order_relaxed) - class_size(k),
+                                    std::memory_order_relaxed);
+                return block;
+            }
+            return malloc(class_size(k));
+        }
+    }
+    return malloc(bytes == 0 ? 1 : bytes);
+}
+
+void deallocate(void* block) {
+    if (block == nullptr) {
+        return;
+    }
+    Cache* cache = t_cache;
+    if (cache == nullptr) {
+        free(block);
+        return;
+    }
+    bump(cache->frees);
+    check_epoch(cache);
+    // By what the block holds, not what was asked for: it may come from malloc anywhere
+    int k = block_class(malloc_usable_size(block));
+    uint64_t cached = cache->cached.load(std::memory_order_relaxed);
+    if (k < 0 || cached + class_size(k) > engine_heap::kMaxCachedBytes) {
+        free(block);
+        return;
+    }
+    *static_cast<void**>(block) = cache->lists[k];
+    cache->lists[k] = block;
+    cache->cached.store(cached + class_size(k), std::memory_order_relaxed);
+}
+
+void* allocate_or_throw(size_t bytes) {
+    while (true) {
+        void* block = allocate(bytes);
+        if (block != nullptr) {
+            return block;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void* allocate_nothrow(size_t bytes) noexcept {
+    try {
+        return allocate_or_throw(bytes);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+}  // namespace
+
+namespace engine_heap {
+
+void attach_thread() {
+    if (t_cache != nullptr) {
+        return;
+    }
+#ifdef M_THREAD_DISABLE_MEM_INIT
+    mallopt(M_THREAD_DISABLE_MEM_INIT, 1);
+#endif
+    void* memory = malloc(sizeof(Cache));
+    if (memory == nullptr) {
+        return;
+    }
+    Cache* cache = new (memory) Cache();
+    cache->epoch = g_epoch.load(std::memory_order_relaxed);
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.caches.push_back(cache);
+    }
+    t_owner.cache = cache;
+    t_cache = cache;
+}
+
+bool attached() {
+    return t_cache != nullptr;
+}
+
+uint64_t cached_bytes() {
+    uint64_t cached = 0;
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (Cache* cache : r.caches) {
+        cached += cache->cached.load(std::memory_order_relaxed);
+    }
+    return cached;
+}
+
+uint64_t trim() {
+    g_epoch.fetch_add(1, std::memory_order_relaxed);
+    if (t_cache == nullptr) {
+        return 0;
+    }
+    uint64_t cached = t_cache->cached.load(std::memory_order_relaxed);
+    check_epoch(t_cache);
+    return cached;
+}
+
+Stats stats() {
+    Stats stats;
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    stats.threads = r.caches.size();
+    stats.allocations = r.allocations;
+    stats.cache_hits = r.hits;
+    stats.frees = r.frees;
+    for (Cache* cache : r.caches) {
+        stats.allocations += cache->allocations.load(std::memory_order_relaxed);
+        stats.cache_hits += cache->hits.load(std::memory_order_relaxed);
+        stats.frees += cache->frees.load(std::memory_order_relaxed);
+        stats.cached_bytes += cache->cached.load(std::memory_order_relaxed);
+    }
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - r.last_read).count();
+    if (seconds > 0.0) {
+        stats.allocations_per_s = static_cast<double>(stats.allocations - r.last_allocations) / seconds;
+    }
+    r.last_allocations = stats.allocations;
+    r.last_read = now;
+    return stats;
+}
+
+}  // namespace engine_heap
+
+// Replacements for the library this file is linked into (see engine_heap.h).
+// Aligned new and delete are left to the C++ runtime: it pairs them itself.
+void* operator new(size_t bytes) {
+    return allocate_or_throw(bytes);
+}
+
+void* operator new[](size_t bytes) {
+    return allocate_or_throw(bytes);
+}
+
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept {
+    return allocate_nothrow(bytes);
+}
+
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept {
+    return allocate_nothrow(bytes);
+}
+
+void operator delete(void* block) noexcept {
+    deallocate(block);
+}
+
+void operator delete[](void* block) noexcept {
+    deallocate(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    deallocate(block);
+}
+
+void operator delete[](void* block, size_t) noexcept {
+    deallocate(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept {
+    deallocate(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept {
+    deallocate(block);
+}
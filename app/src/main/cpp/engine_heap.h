@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Small-allocation cache for the engine's own threads.
+ *
+ * Decoding allocates constantly and in small pieces: token lists, strings,
+ * std::function and PackedFunc argument boxes, map nodes. Android's scudo
+ * pays for its hardening on every one of them (a checksummed header, often
+ * zero-initialized memory, a shared cache behind the thread's TSD), and most
+ * of those blocks are freed within the same step.
+ *
+ * engine_heap.cpp replaces operator new and delete for the library it is
+ * linked into. A thread that called attach_thread() keeps freed blocks of up
+ * to kMaxSmall bytes in per-size-class free lists of its own and hands them
+ * out again with no lock and no call into libc; everything else goes straight
+ * to malloc and free, exactly as before. Only the engine's worker threads
+ * attach (GenerationWorker), so ART's threads, its heap and its own native
+ * allocations are untouched: the replacement lives in our library's linker
+ * namespace, ART never binds to it, and the process-wide mallopt() options it
+ * shares with the runtime are left alone. The one scudo option set is per
+ * thread: M_THREAD_DISABLE_MEM_INIT, so blocks of an attached thread are not
+ * zeroed on allocation (Android 12 and later; ignored elsewhere).
+ *
+ * Cached blocks are ordinary malloc blocks, so a block may be freed by any
+ * thread or library, with or without the cache, and freeing a block malloc'd
+ * elsewhere is fine too: its class comes from malloc_usable_size(). A thread
+ * holds at most kMaxCachedBytes; trim() gives the caller's cache back and makes
+ * every other thread give its own back on its next allocation or free, so an
+ * idle thread keeps its cache until it next runs. A thread's cache goes when
+ * it exits.
+ */
+namespace engine_heap {
+
+constexpr size_t kMaxSmall = 1024;
+constexpr size_t kMaxCachedBytes = 256 << 10;
+
+struct Stats {
+    uint64_t threads = 0;            // attached threads alive
+    uint64_t allocations = 0;        // operator new calls on attached threads, since start
+    uint64_t cache_hits = 0;         // of those, served from a free list
+    uint64_t frees = 0;              // operator delete calls on attached threads
+    uint64_t cached_bytes = 0;       // in free lists now, including those trim() asked back from idle threads
+    double allocations_per_s = 0.0;  // since the previous stats() call
+};
+
+// Give the calling thread a cache and the per-thread scudo options; idempotent
+void attach_thread();
+bool attached();
+
+// Every cache is given back: the caller's now, the others' on their next use.
+// Returns the bytes given back now, the caller's.
+uint64_t trim();
+
+Stats stats();
+// What stats() reports as cached_bytes, without starting a new rate window
+uint64_t cached_bytes();
+
+}  // namespace engine_heap
@@ -0,0 +1,583 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Flight recorder: the last kEvents events of every thread, kept in native
+ * memory and written out when something goes wrong, for latency spikes that
+ * logcat alone cannot explain.
+ *
+ * Each thread writes its own fixed ring, allocated or taken over from an
+ * exited thread on its first event, so recording takes no lock: a monotonic
+ * clock read and a few relaxed stores. Slots carry a sequence number written around the fields (a seqlock), so a
+ * dump taken while threads keep recording skips the slot being overwritten
+ * instead of reporting it torn. Events are the trace sections (native_trace.h:
+ * load stages, prefill chunks, decode steps, sampling, detokenize, JNI
+ * delivery, each with its duration and the caller's trace id), the request
+ * lifecycle from RequestTiming, and driver allocations of at least
+ * kAllocThreshold bytes.
+ *
+ * Dumps are text, one event per line, "ns tid kind name a b", with ns on
+ * CLOCK_MONOTONIC (what native traces and the metrics sampler stamp). A
+ * request slower than the SLO asks for a dump (sorted by time, off the
+ * request's thread, at most one per kMinDumpIntervalMs, the last kMaxDumps
+ * kept); a fatal signal writes one from the handler, per thread and unsorted,
+ * with only async-signal-safe calls into a file opened beforehand, then hands
+ * the signal on to whoever handled it before (debuggerd included).
+ */
+namespace flight {
+
+enum EventKind : uint32_t {
+    kEventMark = 0,
+    kEventSpan = 1,           // a: duration ns, b: trace id (trace_context.h); ns is its start
+    kEventRequestAdmit = 2,   // a: request id, b: queue wait us
+    kEventRequestPrefill = 3, // a: request id, b: prefill us
+    kEventRequestFirst = 4,   // a: request id, b: time to first token us
+    kEventRequestEnd = 5,     // a: request id, b: end to end us
+    kEventAlloc = 6,          // a: bytes, b: device type
+    kEventSlo = 7,            // a: request id, b: end to end us; what triggered the dump
+    kEventTrace = 8,          // a: request id, b: the caller's trace id for it
+};
+
+static constexpr size_t kEvents = 1024;  // per thread, a power of two
+static constexpr size_t kMaxThreads = 64;
+static constexpr uint64_t kAllocThreshold = 1ull << 20;
+static constexpr int64_t kMinDumpIntervalMs = 10000;
+static constexpr int kMaxDumps = 8;
+
+inline uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+inline const char* kind_name(uint32_t kind) {
+    static const char* const kNames[] = {"mark", "span", "admit", "prefill", "first_token", "end", "alloc", "slo",
+                                          "trace"};
+    return kind < sizeof(kNames) / sizeof(kNames[0]) ? kNames[kind] : "?";
+}
+
+struct Slot {
+    std::atomic<uint64_t> seq{0};  // odd while being written
+    std::atomic<uint64_t> ns{0};
+    std::atomic<const char*> name{nullptr};  // static strings only
+    std::atomic<int64_t> a{0};
+    std::atomic<int64_t> b{0};
+    std::atomic<uint32_t> kind{0};
+};
+
+struct Ring {
+    std::atomic<bool> owned{false};
+    std::atomic<int> tid{0};
+    std::atomic<uint64_t> head{0};  // events written since claimed
+    std::atomic<const char*> stage{nullptr};  // innermost trace section open on the thread
+    std::atomic<uint64_t> stage_ns{0};
+    Slot slots[kEvents];
+
+    // Only the owning thread calls this
+    void write(uint32_t kind, const char* name, uint64_t ns, int64_t a, int64_t b) {
+        uint64_t at = head.load(std::memory_order_relaxed);
+        Slot& slot = slots[at & (kEvents - 1)];
+        uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+        slot.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.ns.store(ns, std::memory_order_relaxed);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.a.store(a, std::memory_order_relaxed);
+        slot.b.store(b, std::memory_order_relaxed);
+        slot.kind.store(kind, std::memory_order_relaxed);
+        slot.seq.store(seq + 2, std::memory_order_release);
+        head.store(at + 1, std::memory_order_release);
+    }
+};
+
+struct Event {
+    uint64_t ns = 0;
+    int tid = 0;
+    uint32_t kind = 0;
+    const char* name = nullptr;
+    int64_t a = 0;
+    int64_t b = 0;
+};
+
+// Reads slot `at`; false if it was being written meanwhile
+inline bool read_slot(const Ring& ring, uint64_t at, Event* event) {
+    const Slot& slot = ring.slots[at & (kEvents - 1)];
+    uint64_t before = slot.seq.load(std::memory_order_acquire);
+    if (before & 1) {
+        return false;
+    }
+    event->ns = slot.ns.load(std::memory_order_relaxed);
+    event->name = slot.name.load(std::memory_order_relaxed);
+    event->a = slot.a.load(std::memory_order_relaxed);
+    event->b = slot.b.load(std::memory_order_relaxed);
+    event->kind = slot.kind.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == before && before != 0;
+}
+
+// Formats without the heap or stdio, so the signal handler can use it
+class LineWriter {
+public:
+    explicit LineWriter(int fd) : fd_(fd) {}
+    ~LineWriter() { flush(); }
+
+    void text(const char* s) {
+        while (s != nullptr && *s != '\0') {
+            put(*s++);
+        }
+    }
+
+    void number(int64_t value) {
+        char digits[24];
+        int n = 0;
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do {
+            digits[n++] = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (value < 0) {
+            put('-');
+        }
+        while (n > 0) {
+            put(digits[--n]);
+        }
+    }
+
+    void event(const Event& e) {
+        number(static_cast<int64_t>(e.ns));
+        put(' ');
+        number(e.tid);
+        put(' ');
+        text(kind_name(e.kind));
+        put(' ');
+        text(e.name != nullptr ? e.name : "-");
+        put(' ');
+        number(e.a);
+        put(' ');
+        number(e.b);
+        put('\n');
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < used_) {
+            ssize_t n = ::write(fd_, buffer_ + done, used_ - done);
+            if (n <= 0) {
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        used_ = 0;
+    }
+
+private:
+    int fd_;
+    char buffer_[4096];
+    size_t used_ = 0;
+
+    void put(char c) {
+        if (used_ == sizeof(buffer_)) {
+            flush();
+        }
+        buffer_[used_++] = c;
+    }
+};
+
+class FlightRecorder {
+public:
+    using SloCallback = void (*)(int64_t request_id, int64_t e2e_us);
+
+    void record(uint32_t kind, const char* name, int64_t a = 0, int64_t b = 0, uint64_t ns = 0) {
+        Ring* ring = thread_ring();
+        if (ring != nullptr) {
+            ring->write(kind, name, ns != 0 ? ns : now_ns(), a, b);
+        }
+    }
+
+    // The thread enters the trace section `name`; returns the one it was in
+    const char* enter(const char* name, uint64_t ns, uint64_t* previous_ns) {
+        Ring* ring = thread_ring();
+        if (ring == nullptr) {
+            *previous_ns = 0;
+            return nullptr;
+        }
+        *previous_ns = ring->stage_ns.load(std::memory_order_relaxed);
+        const char* previous = ring->stage.load(std::memory_order_relaxed);
+        ring->stage_ns.store(ns, std::memory_order_relaxed);
+        ring->stage.store(name, std::memory_order_release);
+        return previous;
+    }
+
+    void leave(const char* previous, uint64_t previous_ns) {
+        Ring* ring = thread_ring();
+        if (ring != nullptr) {
+            ring->stage_ns.store(previous_ns, std::memory_order_relaxed);
+            ring->stage.store(previous, std::memory_order_release);
+        }
+    }
+
+    // "tid stage ms" for every thread inside a trace section, longest in it first
+    std::string stages() const {
+        uint64_t now = now_ns();
+        std::vector<std::pair<uint64_t, std::string>> open;
+        for (const auto& slot : rings_) {
+            const Ring* ring = slot.load(std::memory_order_acquire);
+            if (ring == nullptr || !ring->owned.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            const char* stage = ring->stage.load(std::memory_order_acquire);
+            uint64_t since = ring->stage_ns.load(std::memory_order_relaxed);
+            if (stage == nullptr) {
+                continue;
+            }
+            uint64_t ms = now > since ? (now - since) / 1000000 : 0;
+            open.emplace_back(ms, std::to_string(ring->tid.load(std::memory_order_relaxed)) + " " + stage + " " +
+                                          std::to_string(ms) + " ms\n");
+        }
+        std::sort(open.begin(), open.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        std::string out;
+        for (const auto& entry : open) {
+            out += entry.second;
+        }
+        return out;
+    }
+
+    // A finished request; past the SLO it is marked and a dump asked for
+    void request_end(int64_t id, int64_t e2e_us) {
+        record(kEventRequestEnd, "request", id, e2e_us);
+        int64_t slo_us = slo_us_.load(std::memory_order_relaxed);
+        SloCallback callback = on_slo_.load(std::memory_order_acquire);
+        if (slo_us <= 0 || e2e_us <= slo_us || callback == nullptr) {
+            return;
+        }
+        int64_t now_ms = static_cast<int64_t>(now_ns() / 1000000);
+        int64_t last = last_dump_ms_.load(std::memory_order_relaxed);
+        if (last != 0 && now_ms - last < kMinDumpIntervalMs) {
+            return;
+        }
+        if (!last_dump_ms_.compare_exchange_strong(last, now_ms)) {
+            return;
+        }
+        record(kEventSlo, "slo", id, e2e_us);
+        callback(id, e2e_us);
+    }
+
+    // `slo_ms` <= 0 turns SLO dumps off; `callback` should dump off the calling thread
+    void set_slo(int64_t slo_ms, SloCallback callback) {
+        on_slo_.store(callback, std::memory_order_release);
+        slo_us_.store(slo_ms > 0 ? slo_ms * 1000 : 0, std::memory_order_relaxed);
+    }
+
+    int64_t slo_ms() const { return slo_us_.load(std::memory_order_relaxed) / 1000; }
+
+    // Every readable event, oldest first
+    std::vector<Event> snapshot() const {
+        std::vector<Event> events;
+        for (const auto& slot : rings_) {
+            const Ring* ring_ptr = slot.load(std::memory_order_acquire);
+            if (ring_ptr == nullptr) {
+                continue;
+            }
+            const Ring& ring = *ring_ptr;
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            int tid = ring.tid.load(std::memory_order_relaxed);
+            uint64_t from = head > kEvents ? head - kEvents : 0;
+            for (uint64_t at = from; at < head; ++at) {
+                Event event;
+                if (read_slot(ring, at, &event)) {
+                    event.tid = tid;
+                    events.push_back(event);
+                }
+            }
+        }
+        std::stable_sort(events.begin(), events.end(), [](const Event& x, const Event& y) { return x.ns < y.ns; });
+        return events;
+    }
+
+    // The events of one traced request as dump lines, oldest first: its spans
+    // and its request lifecycle, found through the kEventTrace naming it
+    std::string trace_lines(int64_t trace_id) const {
+        std::vector<Event> events = snapshot();
+        std::vector<int64_t> requests;
+        for (const Event& event : events) {
+            if (event.kind == kEventTrace && event.b == trace_id &&
+                std::find(requests.begin(), requests.end(), event.a) == requests.end()) {
+                requests.push_back(event.a);
+            }
+        }
+        std::string lines;
+        char line[160];
+        for (const Event& event : events) {
+            bool request = event.kind >= kEventRequestAdmit && event.kind <= kEventRequestEnd &&
+                           std::find(requests.begin(), requests.end(), event.a) != requests.end();
+            bool mine = event.kind == kEventSpan && event.b == trace_id;
+            if (!request && !mine) {
+                continue;
+            }
+            snprintf(line, sizeof(line), "%llu %d %s %s %lld %lld\n", static_cast<unsigned long long>(event.ns),
+                     event.tid, kind_name(event.kind), event.name != nullptr ? event.name : "-",
+                     static_cast<long long>(event.a), static_cast<long long>(event.b));
+            lines += line;
+        }
+        return lines;
+    }
+
+    // `preamble` goes between the header and the events, as is
+    bool dump_to(const std::string& path, const char* reason, const std::string& preamble = std::string()) const {
+        std::vector<Event> events = snapshot();
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        {
+            LineWriter out(fd);
+            header(out, reason);
+            out.text(preamble.c_str());
+            for (const Event& event : events) {
+                out.event(event);
+            }
+        }
+        bool ok = fsync(fd) == 0;
+        close(fd);
+        return ok;
+    }
+
+    // Into `dir` as flight_<wall ms>.txt, keeping the newest kMaxDumps; "" on failure
+    std::string dump_in(const std::string& dir, const char* reason,
+                        const std::string& preamble = std::string()) const {
+        timespec wall{};
+        clock_gettime(CLOCK_REALTIME, &wall);
+        long long wall_ms = static_cast<long long>(wall.tv_sec) * 1000 + wall.tv_nsec / 1000000;
+        std::string path = dir + "/flight_" + std::to_string(wall_ms) + ".txt";
+        if (!dump_to(path, reason, preamble)) {
+            return std::string();
+        }
+        prune(dir);
+        return path;
+    }
+
+    // Async-signal-safe: everything each ring holds, per thread, into `fd`
+    void dump_from_signal(int fd, int sig) const {
+        LineWriter out(fd);
+        header(out, "signal");
+        out.text("# signal ");
+        out.number(sig);
+        out.text("\n");
+        for (const auto& slot : rings_) {
+            const Ring* ring_ptr = slot.load(std::memory_order_acquire);
+            if (ring_ptr == nullptr) {
+                continue;
+            }
+            const Ring& ring = *ring_ptr;
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            int tid = ring.tid.load(std::memory_order_relaxed);
+            uint64_t from = head > kEvents ? head - kEvents : 0;
+            for (uint64_t at = from; at < head; ++at) {
+                Event event;
+                if (read_slot(ring, at, &event)) {
+                    event.tid = tid;
+                    out.event(event);
+                }
+            }
+        }
+    }
+
+private:
+    std::atomic<Ring*> rings_[kMaxThreads] = {};  // allocated on first use, never freed
+    std::atomic<int64_t> slo_us_{0};
+    std::atomic<SloCallback> on_slo_{nullptr};
+    std::atomic<int64_t> last_dump_ms_{0};
+
+    // Gives the ring back when its thread exits; its events stay until reused
+    struct Claim {
+        Ring* ring = nullptr;
+        ~Claim() {
+            if (ring != nullptr) {
+                ring->owned.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    Ring* thread_ring() {
+        thread_local Claim claim;
+        thread_local bool tried = false;
+        if (claim.ring != nullptr || tried) {
+            return claim.ring;
+        }
+        tried = true;
+        // A new ring while there is room, so exited threads' events last longer
+        for (auto& slot : rings_) {
+            if (slot.load(std::memory_order_acquire) != nullptr) {
+                continue;
+            }
+            Ring* fresh = new Ring();
+            fresh->owned.store(true, std::memory_order_relaxed);
+            Ring* expected = nullptr;
+            if (slot.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+                claim.ring = fresh;
+                break;
+            }
+            delete fresh;
+        }
+        if (claim.ring == nullptr) {
+            for (auto& slot : rings_) {
+                Ring* ring = slot.load(std::memory_order_acquire);
+                bool owned = false;
+                if (ring != nullptr && ring->owned.compare_exchange_strong(owned, true)) {
+                    ring->head.store(0, std::memory_order_release);
+                    claim.ring = ring;
+                    break;
+                }
+            }
+        }
+        if (claim.ring != nullptr) {
+            claim.ring->tid.store(static_cast<int>(syscall(SYS_gettid)), std::memory_order_relaxed);
+        }
+        return claim.ring;  // nullptr: more than kMaxThreads threads record at once, this one is not kept
+    }
+
+    static void header(LineWriter& out, const char* reason) {
+        timespec wall{};
+        clock_gettime(CLOCK_REALTIME, &wall);
+        out.text("# flight recorder: ");
+        out.text(reason);
+        out.text(", wall_ms ");
+        out.number(static_cast<int64_t>(wall.tv_sec) * 1000 + wall.tv_nsec / 1000000);
+        out.text(", monotonic_ns ");
+        out.number(static_cast<int64_t>(now_ns()));
+        out.text("\n# ns tid kind name a b\n");
+    }
+
+    static void prune(const std::string& dir) {
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr) {
+            return;
+        }
+        std::vector<std::string> dumps;
+        while (dirent* entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (name.rfind("flight_", 0) == 0 && name != "flight_crash.txt" && name != "flight_crash.prev.txt") {
+                dumps.push_back(name);
+            }
+        }
+        closedir(d);
+        if (dumps.size() <= static_cast<size_t>(kMaxDumps)) {
+            return;
+        }
+        // Same-length millisecond stamps sort by time
+        std::sort(dumps.begin(), dumps.end());
+        for (size_t i = 0; i + kMaxDumps < dumps.size(); ++i) {
+            unlink((dir + "/" + dumps[i]).c_str());
+        }
+    }
+};
+
+inline FlightRecorder& recorder() {
+    static FlightRecorder* instance = new FlightRecorder();
+    return *instance;
+}
+
+inline void record(uint32_t kind, const char* name, int64_t a = 0, int64_t b = 0) {
+    recorder().record(kind, name, a, b);
+}
+
+inline int64_t next_request_id() {
+    static std::atomic<int64_t> next{1};
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Dumping on fatal signals. install() opens <dir>/flight_crash.txt up front
+ * (a dump left by the previous run moves to flight_crash.prev.txt); the
+ * handler writes to it once, then restores the earlier handler and calls it.
+ */
+namespace crash {
+
+static constexpr int kSignals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+static constexpr int kSignalCount = sizeof(kSignals) / sizeof(kSignals[0]);
+
+inline std::atomic<int>& crash_fd() {
+    static std::atomic<int> fd{-1};
+    return fd;
+}
+
+inline struct sigaction* previous_actions() {
+    static struct sigaction actions[kSignalCount];
+    return actions;
+}
+
+inline void handle(int sig, siginfo_t* info, void* context) {
+    int fd = crash_fd().exchange(-1);
+    if (fd >= 0) {
+        recorder().dump_from_signal(fd, sig);
+        fsync(fd);
+    }
+    for (int i = 0; i < kSignalCount; ++i) {
+        if (kSignals[i] != sig) {
+            continue;
+        }
+        const struct sigaction& previous = previous_actions()[i];
+        sigaction(sig, &previous, nullptr);
+        if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction != nullptr) {
+            previous.sa_sigaction(sig, info, context);
+            return;
+        }
+        if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN && previous.sa_handler != nullptr) {
+            previous.sa_handler(sig);
+            return;
+        }
+    }
+    // Default action: the faulting instruction runs again under it, and raise covers abort
+    raise(sig);
+}
+
+inline bool install(const std::string& dir) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string path = dir + "/flight_crash.txt";
+    struct stat st{};
+    if (stat(path.c_str(), &st) == 0 && st.st_size > 0) {
+        rename(path.c_str(), (dir + "/flight_crash.prev.txt").c_str());
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    int old = crash_fd().exchange(fd);
+    if (old >= 0) {
+        close(old);
+    }
+    static bool installed = false;
+    if (!installed) {
+        for (int i = 0; i < kSignalCount; ++i) {
+            struct sigaction action{};
+            action.sa_sigaction = handle;
+            action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset(&action.sa_mask);
+            sigaction(kSignals[i], &action, &previous_actions()[i]);
+        }
+        installed = true;
+    }
+    return true;
+}
+
+}  // namespace crash
+
+}  // namespace flight
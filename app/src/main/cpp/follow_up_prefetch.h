@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Follow-up answers prepared while the app sits idle after a turn.
+ *
+ * After an answer the next message is very often one of a few fixed taps
+ * ("Explain more", "Give an example", "Quiz me"). Once a turn ends and no
+ * other one is waiting, the prefetch worker (nice 19) prepares them:
+ *
+ *   prefill    the top prediction is prefilled as the session's draft, so
+ *              sending it only pays for the answer. Typing anything else
+ *              rolls the draft back like any other draft edit.
+ *   generate   each prediction is answered in full on a branch forked off
+ *              the session (fork_session; with paged KV the branch shares
+ *              the session's pages and holds only its own turn). Sending a
+ *              prediction adopts its branch: the session takes the branch's
+ *              KV and turns, and the answer is served at once.
+ *
+ * The cache holds the branches of one session at one turn. It is dropped when
+ * that session gets any other turn, when the draft typed into it is not the
+ * start of a prediction, and on memory trims.
+ *
+ * Caps: at most kMaxFollowUps branches of at most max_tokens each, none while
+ * the KV budget has no room for one more, none on the battery saver profile,
+ * and a TokenAllowance per hour across both modes. A chat turn or a keystroke
+ * stops the running branch at its next token; a branch cut short is closed,
+ * only complete answers are kept.
+ */
+namespace follow_up {
+
+enum Mode : int {
+    kModeOff = 0,
+    kModePrefill = 1,
+    kModeGenerate = 2,
+};
+
+static constexpr int kMaxFollowUps = 3;
+static constexpr int kDefaultMaxTokens = 256;
+static constexpr int kMaxTokensLimit = 1024;
+static constexpr int64_t kTokensPerHour = 4096;  // prefilled and generated, summed
+
+inline std::vector<std::string> default_prompts() {
+    return {"Explain more", "Give an example", "Quiz me"};
+}
+
+// Lowercased, whitespace collapsed, trailing punctuation dropped: "Quiz me!" is "quiz me"
+inline std::string normalize(const std::string& text) {
+    std::string out;
+    out.reserve(text.size());
+    bool space = false;
+    for (unsigned char c : text) {
+        if (std::isspace(c)) {
+            space = !out.empty();
+            continue;
+        }
+        if (space) {
+            out += ' ';
+            space = false;
+        }
+        out += static_cast<char>(std::tolower(c));
+    }
+    while (!out.empty() && std::ispunct(static_cast<unsigned char>(out.back()))) {
+        out.pop_back();
+    }
+    return out;
+}
+
+struct Branch {
+    std::string prompt;
+    std::string key;  // normalize(prompt)
+    int64_t session = -1;  // generate mode: the forked session holding the answered turn
+    std::string answer;
+};
+
+struct Stats {
+    uint64_t predicted = 0;  // branches prefilled or answered
+    uint64_t served = 0;     // sent while prepared
+    uint64_t discarded = 0;  // dropped unused
+    uint64_t tokens = 0;     // prefilled and generated on branches
+    uint64_t preempted = 0;  // branches stopped by a turn or a keystroke
+};
+
+// The branches prepared for one session after its `turn_count`th turn
+struct Cache {
+    int64_t parent = -1;
+    int turn_count = 0;
+    std::vector<Branch> branches;
+
+    bool empty() const { return parent < 0; }
+
+    const Branch* find(const std::string& key) const {
+        for (const Branch& branch : branches) {
+            if (branch.key == key) {
+                return &branch;
+            }
+        }
+        return nullptr;
+    }
+
+    // Whether `draft` (normalized) can still become one of the predictions
+    bool leads_to_any(const std::string& draft) const {
+        for (const Branch& branch : branches) {
+            if (branch.key.compare(0, draft.size(), draft) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void clear() {
+        parent = -1;
+        turn_count = 0;
+        branches.clear();
+    }
+};
+
+// Tokens left in the current hour; steady-clock milliseconds
+class TokenAllowance {
+public:
+    bool available(int64_t now_ms, int64_t tokens) {
+        roll(now_ms);
+        return used_ + tokens <= kTokensPerHour;
+    }
+
+    void spend(int64_t now_ms, int64_t tokens) {
+        roll(now_ms);
+        used_ += std::max<int64_t>(0, tokens);
+    }
+
+    int64_t left(int64_t now_ms) {
+        roll(now_ms);
+        return std::max<int64_t>(0, kTokensPerHour - used_);
+    }
+
+private:
+    static constexpr int64_t kHourMs = 3600 * 1000;
+    int64_t window_start_ = -1;
+    int64_t used_ = 0;
+
+    void roll(int64_t now_ms) {
+        if (window_start_ < 0 || now_ms - window_start_ >= kHourMs) {
+            window_start_ = now_ms;
+            used_ = 0;
+        }
+    }
+};
+
+}  // namespace follow_up
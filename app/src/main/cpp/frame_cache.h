@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "image_preprocess.h"
+
+/**
+ * OCR results of recent camera frames, by the frames' perceptual hash.
+ *
+ * Held over a page, the camera delivers frame after frame of the same text,
+ * and each capture would run OCR and then the prompt path again. A frame's
+ * 256-bit difference hash (image_preprocess::frame_hash) barely moves with
+ * noise, exposure or a slight shift, so a frame within kNearDuplicateBits of a
+ * recent one reuses its text, and the token ids of that text once a caller
+ * has stored them. The same text in gives the same prompt, which is what lets
+ * the prefix KV and the response caches hit. The kDefaultCapacity least
+ * recently used frames are kept, in memory only; thread-safe.
+ */
+class FrameCache {
+public:
+    static constexpr size_t kDefaultCapacity = 32;
+    static constexpr int kNearDuplicateBits = 48;  // of 256; other pages differ in about half
+
+    using Hash = image_preprocess::FrameHash;
+
+    struct Entry {
+        Hash hash;
+        std::string text;
+        std::vector<int32_t> ids;  // empty until stored
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t size = 0;
+    };
+
+    explicit FrameCache(size_t capacity = kDefaultCapacity) : capacity_(capacity > 0 ? capacity : 1) {}
+
+    // The nearest frame within `max_distance` bits of `hash`; counts a hit or a
+    // miss unless `count` is false, for a second look at the same frame
+    bool find(const Hash& hash, int max_distance, Entry* entry, bool count = true) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot* slot = nearest(hash, max_distance);
+        if (slot == nullptr) {
+            stats_.misses += count;
+            return false;
+        }
+        stats_.hits += count;
+        slot->used = ++clock_;
+        *entry = slot->entry;
+        return true;
+    }
+
+    // Text of the frame `hash`; replaces the entry of the same hash or the least recently used one
+    void put(const Hash& hash, std::string text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot* slot = nearest(hash, 0);
+        if (slot == nullptr && slots_.size() < capacity_) {
+            slots_.emplace_back();
+            slot = &slots_.back();
+        } else if (slot == nullptr) {
+            slot = &slots_[0];
+            for (Slot& candidate : slots_) {
+                if (candidate.used < slot->used) {
+                    slot = &candidate;
+                }
+            }
+        }
+        slot->entry.hash = hash;
+        slot->entry.text = std::move(text);
+        slot->entry.ids.clear();
+        slot->used = ++clock_;
+    }
+
+    // Token ids of the text of the frame nearest `hash`; false without one
+    bool set_ids(const Hash& hash, int max_distance, std::vector<int32_t> ids) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot* slot = nearest(hash, max_distance);
+        if (slot == nullptr) {
+            return false;
+        }
+        slot->entry.ids = std::move(ids);
+        return true;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slots_.clear();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats stats = stats_;
+        stats.size = slots_.size();
+        return stats;
+    }
+
+private:
+    struct Slot {
+        Entry entry;
+        uint64_t used = 0;
+    };
+
+    // Under mutex_
+    Slot* nearest(const Hash& hash, int max_distance) {
+        Slot* best = nullptr;
+        int best_distance = max_distance + 1;
+        for (Slot& slot : slots_) {
+            int d = image_preprocess::hash_distance(hash, slot.entry.hash);
+            if (d < best_distance) {
+                best = &slot;
+                best_distance = d;
+            }
+        }
+        return best;
+    }
+
+    std::mutex mutex_;
+    size_t capacity_;
+    std::vector<Slot> slots_;
+    uint64_t clock_ = 0;
+    Stats stats_;
+};
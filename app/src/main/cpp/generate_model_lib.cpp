@@ -1,6 +1,15 @@
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
 #include <string>
+#include <thread>
+
+#include "model_lib_abi.h"
 
 // Define platform specific exports
 #ifdef _WIN32
@@ -9,41 +18,277 @@
 #define EXPORT __attribute__((visibility("default")))
 #endif
 
+// A fake model with fixed timing, loaded through the engine's dlsym path like
+// a real model library. It needs no weights, so the JNI, queueing, delivery
+// and UI pipeline can be benchmarked and regressed on CI emulators.
+//
+// Timing comes from <model dir>/fake-model.json when present, and can be
+// changed at run time with set_parameter:
+//   {"tokens_per_second": 20, "prefill_ms": 50, "prefill_ms_per_token": 2, "output_tokens": 48}
+// The prompt "costs" one token per 4 bytes. Output is a fixed passage, one word
+// per token, starting at a point picked by the prompt, so the same prompt
+// always streams the same text at the same pace.
+
+namespace {
+
+struct FakeTiming {
+    double tokens_per_second = 20.0;
+    double prefill_ms = 50.0;
+    double prefill_ms_per_token = 2.0;
+    int output_tokens = 48;
+};
+
+std::mutex g_timing_mutex;
+FakeTiming g_timing;
+int g_max_gen_len = 0;  // from set_parameter("max_gen_len"); 0: output_tokens only
+std::atomic<bool> g_abort{false};
+std::atomic<int64_t> g_running_request{0};  // caller's id while generate_stream runs
+
+const char* kWords[] = {
+    "Photosynthesis", "turns", "light,", "water", "and", "carbon", "dioxide", "into", "glucose", "and",
+    "oxygen.", "It", "happens", "in", "the", "chloroplasts", "of", "plant", "cells,", "where",
+    "chlorophyll", "absorbs", "mostly", "red", "and", "blue", "light.", "The", "light", "reactions",
+    "split", "water", "and", "store", "energy", "in", "ATP", "and", "NADPH,", "which", "the",
+    "Calvin", "cycle", "then", "uses", "to", "fix", "carbon", "into", "sugar.",
+};
+const int kWordCount = static_cast<int>(sizeof(kWords) / sizeof(kWords[0]));
+
+// Reads `"key": <number>` from a flat JSON object
+bool json_number(const std::string& json, const char* key, double* value) {
+    std::string quoted = std::string("\"") + key + "\"";
+    size_t at = json.find(quoted);
+    if (at == std::string::npos) {
+        return false;
+    }
+    at = json.find(':', at + quoted.size());
+    if (at == std::string::npos) {
+        return false;
+    }
+    char* end = nullptr;
+    double parsed = strtod(json.c_str() + at + 1, &end);
+    if (end == json.c_str() + at + 1) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+void load_timing(const std::string& model_dir) {
+    std::ifstream in(model_dir + "/fake-model.json");
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    FakeTiming timing;
+    double value = 0.0;
+    if (json_number(json, "tokens_per_second", &value) && value > 0.0) timing.tokens_per_second = value;
+    if (json_number(json, "prefill_ms", &value) && value >= 0.0) timing.prefill_ms = value;
+    if (json_number(json, "prefill_ms_per_token", &value) && value >= 0.0) timing.prefill_ms_per_token = value;
+    if (json_number(json, "output_tokens", &value) && value >= 0.0) timing.output_tokens = static_cast<int>(value);
+    std::lock_guard<std::mutex> lock(g_timing_mutex);
+    g_timing = timing;
+    fprintf(stderr, "Fake model: %.1f tokens/s, prefill %.0f ms + %.1f ms/token, %d tokens per reply\n",
+            timing.tokens_per_second, timing.prefill_ms, timing.prefill_ms_per_token, timing.output_tokens);
+}
+
+// One reply: waits out the prefill, then hands out words on the token clock.
+// on_token returns false to stop. Returns false if stopped or aborted before the end.
+template <typename OnToken>
+bool fake_generate(const char* prompt, size_t prompt_bytes, OnToken on_token) {
+    FakeTiming timing;
+    int max_gen_len = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_timing_mutex);
+        timing = g_timing;
+        max_gen_len = g_max_gen_len;
+    }
+    g_abort = false;
+    int tokens = timing.output_tokens;
+    if (max_gen_len > 0 && max_gen_len < tokens) {
+        tokens = max_gen_len;
+    }
+    unsigned start_word = 0;
+    for (size_t i = 0; i < prompt_bytes; ++i) {
+        start_word = start_word * 31 + static_cast<unsigned char>(prompt[i]);
+    }
+
+    using Clock = std::chrono::steady_clock;
+    double prefill_ms = timing.prefill_ms + timing.prefill_ms_per_token * static_cast<double>(prompt_bytes / 4 + 1);
+    auto next = Clock::now() + std::chrono::microseconds(static_cast<long long>(prefill_ms * 1000.0));
+    auto interval = std::chrono::microseconds(static_cast<long long>(1e6 / timing.tokens_per_second));
+    for (int i = 0; i < tokens; ++i) {
+        // Sleep in slices so an abort lands within a few milliseconds
+        while (Clock::now() < next) {
+            if (g_abort.load()) {
+                return false;
+            }
+            auto slice = Clock::now() + std::chrono::milliseconds(5);
+            std::this_thread::sleep_until(slice < next ? slice : next);
+        }
+        if (g_abort.load()) {
+            return false;
+        }
+        std::string piece = std::string(i == 0 ? "" : " ") + kWords[(start_word + i) % kWordCount];
+        if (!on_token(piece)) {
+            return false;
+        }
+        next += interval;
+    }
+    return true;
+}
+
+char* copy_string(const std::string& text) {
+    // The engine releases replies with free()
+    char* result = static_cast<char*>(malloc(text.size() + 1));
+    if (result != nullptr) {
+        memcpy(result, text.c_str(), text.size() + 1);
+    }
+    return result;
+}
+
+}  // namespace
+
 // Module creation function (name must match what's looked up in registry)
 extern "C" EXPORT void* mlc_create_chat_module(const char* model_path) {
     // Log the call
     fprintf(stderr, "mlc_create_chat_module called with path: %s\n", model_path);
-    
+    load_timing(model_path != nullptr ? model_path : ".");
+
     // Return a non-null pointer to indicate success
     static int dummy = 42;
     return &dummy;
 }
 
 // Function implementation stubs
+extern "C" EXPORT void load_model() {
+    fprintf(stderr, "load_model called\n");
+}
+
+// Older name of load_model
 extern "C" EXPORT void model_load() {
-    fprintf(stderr, "model_load called\n");
+    load_model();
 }
 
 extern "C" EXPORT char* generate(const char* prompt) {
-    fprintf(stderr, "generate called with prompt: %s\n", prompt);
-    
-    // Create a simple response
-    static const char* message = "This is a simplified response from the Gemma model.";
-    char* result = new char[strlen(message) + 1];
-    strcpy(result, message);
-    return result;
+    std::string reply;
+    fake_generate(prompt, strlen(prompt), [&reply](const std::string& piece) {
+        reply += piece;
+        return true;
+    });
+    return copy_string(reply);
+}
+
+// Streams the reply one word at a time; on_token runs on the calling thread
+extern "C" EXPORT void stream_chat(const char* prompt, void (*on_token)(const char* token, void* user_data),
+                                   void* user_data) {
+    fake_generate(prompt, strlen(prompt), [on_token, user_data](const std::string& piece) {
+        on_token(piece.c_str(), user_data);
+        return true;
+    });
+}
+
+// Ends the generation in progress at its next token (abort() itself is libc's)
+extern "C" EXPORT void abort_chat() {
+    g_abort = true;
+}
+
+// Replies to `count` prompts one after another into outputs[i] (free() each); returns the count done
+extern "C" EXPORT int generate_batch(const char** prompts, int count, char** outputs) {
+    int done = 0;
+    for (int i = 0; i < count; ++i) {
+        std::string reply;
+        bool finished = fake_generate(prompts[i], strlen(prompts[i]), [&reply](const std::string& piece) {
+            reply += piece;
+            return true;
+        });
+        outputs[i] = copy_string(reply);
+        if (!finished) {
+            for (int rest = i + 1; rest < count; ++rest) {
+                outputs[rest] = copy_string("");
+            }
+            break;
+        }
+        done++;
+    }
+    return done;
 }
 
 extern "C" EXPORT void reset_chat() {
     fprintf(stderr, "reset_chat called\n");
 }
 
+// Sampling parameters are accepted and ignored, except max_gen_len; fake_* set the timing
 extern "C" EXPORT void set_parameter(const char* key, float value) {
-    fprintf(stderr, "set_parameter called with %s=%f\n", key, value);
+    std::lock_guard<std::mutex> lock(g_timing_mutex);
+    if (strcmp(key, "max_gen_len") == 0) {
+        g_max_gen_len = static_cast<int>(value);
+    } else if (strcmp(key, "fake_tokens_per_second") == 0 && value > 0.0f) {
+        g_timing.tokens_per_second = value;
+    } else if (strcmp(key, "fake_prefill_ms") == 0 && value >= 0.0f) {
+        g_timing.prefill_ms = value;
+    } else if (strcmp(key, "fake_prefill_ms_per_token") == 0 && value >= 0.0f) {
+        g_timing.prefill_ms_per_token = value;
+    } else if (strcmp(key, "fake_output_tokens") == 0 && value >= 0.0f) {
+        g_timing.output_tokens = static_cast<int>(value);
+    }
+}
+
+namespace {
+
+int abi_generate_stream(int64_t request_id, const char* prompt, size_t prompt_length, MlcTokenCallback on_token,
+                        void* user_data) {
+    g_running_request = request_id;
+    bool finished = fake_generate(prompt, prompt_length, [on_token, user_data](const std::string& piece) {
+        return on_token(piece.data(), piece.size(), user_data) == 0;
+    });
+    g_running_request = 0;
+    return finished ? 0 : 1;
+}
+
+int abi_abort(int64_t request_id) {
+    int64_t running = g_running_request.load();
+    if (request_id != 0 && request_id != running) {
+        return -1;
+    }
+    g_abort = true;
+    return running != 0 || request_id == 0 ? 0 : -1;
+}
+
+int64_t abi_generate_into(const char* prompt, size_t prompt_length, char* buffer, size_t capacity) {
+    size_t length = 0;
+    fake_generate(prompt, prompt_length, [&](const std::string& piece) {
+        if (length + 1 < capacity) {
+            size_t room = capacity - 1 - length;
+            memcpy(buffer + length, piece.data(), piece.size() < room ? piece.size() : room);
+        }
+        length += piece.size();
+        return true;
+    });
+    if (capacity > 0) {
+        buffer[length < capacity ? length : capacity - 1] = '\0';
+    }
+    return static_cast<int64_t>(length);
+}
+
+const MlcModelAbi kAbi = {
+    MLC_MODEL_ABI_VERSION,
+    sizeof(MlcModelAbi),
+    kMlcAbiStream | kMlcAbiAbort | kMlcAbiGenerateInto,
+    mlc_create_chat_module,
+    load_model,
+    reset_chat,
+    set_parameter,
+    abi_generate_stream,
+    abi_abort,
+    abi_generate_into,
+};
+
+}  // namespace
+
+// The versioned entry points (model_lib_abi.h); the exports above stay for older loaders
+extern "C" EXPORT const MlcModelAbi* mlc_model_abi(uint32_t version) {
+    return version == MLC_MODEL_ABI_VERSION ? &kAbi : nullptr;
 }
 
 // Library initialization function
 extern "C" EXPORT int __attribute__((constructor)) init_library() {
     fprintf(stderr, "Gemma model library initialized\n");
     return 0;
-} 
\ No newline at end of file
+}
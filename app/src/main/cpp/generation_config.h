@@ -0,0 +1,204 @@
+#pragma once
+
+#include <jni.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "jni_strings.h"
+
+/**
+ * Sampling settings for one request, mirroring ai.mlc.mlcllm.GenerationConfig.
+ *
+ * Engines keep a default config for requests that do not bring their own and
+ * push a config into the chat module in one call, only when it differs from the
+ * one the module already has.
+ */
+struct GenerationConfig {
+    float temperature = 0.7f;
+    float top_p = 0.95f;
+    float repetition_penalty = 1.0f;
+    int max_gen_len = 1024;
+    int64_t seed = -1;  // negative: fresh randomness per request
+    std::string json_schema;  // non-empty: constrain output to JSON (see json_grammar.h); "{}" for any JSON
+    std::vector<std::string> stop_strings;  // end the output at the first of these, without it
+    std::string adapter;  // LoRA adapter to run with (see lora_adapters.h); "base" for none, empty to route
+    int64_t deadline_ms = 0;  // > 0: answer within this long of the request (see deadline.h)
+    float context_ratio = 0.0f;  // in (0, 1): retrieved context thinned to this share (context_compression.h)
+
+    // Same module settings; the seed is applied per request either way
+    bool same_sampling(const GenerationConfig& other) const {
+        return temperature == other.temperature && top_p == other.top_p &&
+               repetition_penalty == other.repetition_penalty && max_gen_len == other.max_gen_len;
+    }
+
+    // Every field, for telling requests apart (async_requests.h coalescing)
+    std::string identity() const {
+        std::string out = to_override_json();
+        out += '\x1f' + std::to_string(seed) + '\x1f' + json_schema + '\x1f' + adapter + '\x1f' +
+               std::to_string(deadline_ms) + '\x1f' + std::to_string(context_ratio);
+        for (const std::string& stop : stop_strings) {
+            out += '\x1f' + stop;
+        }
+        return out;
+    }
+
+    // Partial chat-config override carrying every sampling field at once
+    std::string to_override_json() const {
+        char buffer[160];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"temperature\": %.6g, \"top_p\": %.6g, \"repetition_penalty\": %.6g, \"max_gen_len\": %d}",
+                 temperature, top_p, repetition_penalty, max_gen_len);
+        return buffer;
+    }
+};
+
+/**
+ * A default config that setters on any thread change while generations read
+ * it, RCU style: readers take the current snapshot (an atomic shared_ptr load,
+ * never behind a writer's copy), writers copy it, change the copy and publish
+ * it. A request keeps the snapshot it started with, so a setter never changes
+ * a generation mid-step; the next request sees the new value.
+ */
+class SharedConfig {
+public:
+    explicit SharedConfig(GenerationConfig initial = GenerationConfig())
+        : current_(std::make_shared<const GenerationConfig>(std::move(initial))) {}
+
+    std::shared_ptr<const GenerationConfig> snapshot() const { return std::atomic_load(&current_); }
+    GenerationConfig get() const { return *snapshot(); }
+
+    // `change` edits a copy of the current config, which then replaces it
+    template <typename Change>
+    void update(Change&& change) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        auto next = std::make_shared<GenerationConfig>(*std::atomic_load(&current_));
+        change(*next);
+        std::atomic_store(&current_, std::shared_ptr<const GenerationConfig>(std::move(next)));
+    }
+
+private:
+    std::shared_ptr<const GenerationConfig> current_;
+    std::mutex write_mutex_;  // between writers only
+};
+
+// Field IDs of ai.mlc.mlcllm.GenerationConfig, resolved once per library
+struct GenerationConfigFields {
+    jfieldID temperature = nullptr;
+    jfieldID top_p = nullptr;
+    jfieldID repetition_penalty = nullptr;
+    jfieldID max_gen_len = nullptr;
+    jfieldID seed = nullptr;
+    jfieldID json_schema = nullptr;  // optional: older configs have no schema
+    jfieldID stop_strings = nullptr;  // optional, likewise
+    jfieldID adapter = nullptr;  // optional, likewise
+    jfieldID deadline_ms = nullptr;  // optional, likewise
+    jfieldID context_ratio = nullptr;  // optional, likewise
+};
+
+inline GenerationConfigFields& generation_config_fields() {
+    static GenerationConfigFields fields;
+    return fields;
+}
+
+// Call from JNI_OnLoad. A library without the Java class keeps null IDs.
+inline void generation_config_on_load(JNIEnv* env) {
+    jclass clazz = env->FindClass("ai/mlc/mlcllm/GenerationConfig");
+    if (clazz == nullptr) {
+        env->ExceptionClear();
+        return;
+    }
+    GenerationConfigFields& fields = generation_config_fields();
+    fields.temperature = env->GetFieldID(clazz, "temperature", "F");
+    fields.top_p = env->GetFieldID(clazz, "topP", "F");
+    fields.repetition_penalty = env->GetFieldID(clazz, "repetitionPenalty", "F");
+    fields.max_gen_len = env->GetFieldID(clazz, "maxGenLen", "I");
+    fields.seed = env->GetFieldID(clazz, "seed", "J");
+    if (env->ExceptionCheck()) {
+        env->ExceptionClear();
+        fields = GenerationConfigFields();
+    } else {
+        fields.json_schema = env->GetFieldID(clazz, "jsonSchema", "Ljava/lang/String;");
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            fields.json_schema = nullptr;
+        }
+        fields.stop_strings = env->GetFieldID(clazz, "stopStrings", "[Ljava/lang/String;");
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            fields.stop_strings = nullptr;
+        }
+        fields.adapter = env->GetFieldID(clazz, "adapter", "Ljava/lang/String;");
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            fields.adapter = nullptr;
+        }
+        fields.deadline_ms = env->GetFieldID(clazz, "deadlineMs", "J");
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            fields.deadline_ms = nullptr;
+        }
+        fields.context_ratio = env->GetFieldID(clazz, "contextRatio", "F");
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            fields.context_ratio = nullptr;
+        }
+    }
+    env->DeleteLocalRef(clazz);
+}
+
+// Read a Java GenerationConfig; a null object (or unresolved fields) yields `defaults`
+inline GenerationConfig generation_config_from_java(JNIEnv* env, jobject jconfig,
+                                                    const GenerationConfig& defaults) {
+    const GenerationConfigFields& fields = generation_config_fields();
+    if (jconfig == nullptr || fields.seed == nullptr) {
+        return defaults;
+    }
+    GenerationConfig config;
+    config.temperature = env->GetFloatField(jconfig, fields.temperature);
+    config.top_p = env->GetFloatField(jconfig, fields.top_p);
+    config.repetition_penalty = env->GetFloatField(jconfig, fields.repetition_penalty);
+    config.max_gen_len = env->GetIntField(jconfig, fields.max_gen_len);
+    config.seed = env->GetLongField(jconfig, fields.seed);
+    if (fields.json_schema != nullptr) {
+        auto schema = static_cast<jstring>(env->GetObjectField(jconfig, fields.json_schema));
+        if (schema != nullptr) {
+            jni_utf8_into(env, schema, config.json_schema);
+            env->DeleteLocalRef(schema);
+        }
+    }
+    if (fields.stop_strings != nullptr) {
+        auto stops = static_cast<jobjectArray>(env->GetObjectField(jconfig, fields.stop_strings));
+        if (stops != nullptr) {
+            jsize count = env->GetArrayLength(stops);
+            for (jsize i = 0; i < count; ++i) {
+                auto stop = static_cast<jstring>(env->GetObjectArrayElement(stops, i));
+                if (stop == nullptr) {
+                    continue;
+                }
+                config.stop_strings.push_back(jni_utf8(env, stop));
+                env->DeleteLocalRef(stop);
+            }
+            env->DeleteLocalRef(stops);
+        }
+    }
+    if (fields.adapter != nullptr) {
+        auto adapter = static_cast<jstring>(env->GetObjectField(jconfig, fields.adapter));
+        if (adapter != nullptr) {
+            jni_utf8_into(env, adapter, config.adapter);
+            env->DeleteLocalRef(adapter);
+        }
+    }
+    if (fields.deadline_ms != nullptr) {
+        config.deadline_ms = env->GetLongField(jconfig, fields.deadline_ms);
+    }
+    if (fields.context_ratio != nullptr) {
+        config.context_ratio = env->GetFloatField(jconfig, fields.context_ratio);
+    }
+    return config;
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <string>
+
+/**
+ * Holds generation at a steady rate as the phone heats up or drains.
+ *
+ * Left alone, decode runs flat out until the SoC throttles a few minutes in,
+ * and tokens/s then drops by half or more at unpredictable moments. The
+ * governor trades speed for heat before that happens: with a target rate set
+ * it steps down one level while turns run well above the target and back up
+ * when they fall below it, and thermal headroom or a low battery put a floor
+ * under the level regardless. Each level scales what the caller configured
+ * (thread pool workers, batch size, speculative draft length), never past it.
+ *
+ * Device state comes from Kotlin (PowerManager.getThermalHeadroom and the
+ * battery broadcast) while it is fresh, otherwise from sysfs: the hottest CPU
+ * thermal zone against kThrottleCelsius, and power_supply/battery. Decisions
+ * are kept as JSON lines until drained, for the app's metrics.
+ */
+struct DeviceState {
+    float thermal_headroom = -1.0f;  // 1.0 at the throttling threshold; < 0 unknown
+    float battery_percent = -1.0f;   // < 0 unknown
+    bool charging = false;
+    bool power_save = false;
+};
+
+struct GovernorSettings {
+    int workers = 0;       // 0: the thread pool's own count
+    int max_batch = 1;
+    int draft_length = 1;
+};
+
+class GenerationGovernor {
+public:
+    static constexpr int kLevels = 4;  // 0: as configured ... 3: coolest
+    static constexpr float kThrottleCelsius = 95.0f;
+    static constexpr int64_t kStateFreshMs = 30000;
+    static constexpr size_t kMaxEvents = 64;
+
+    void set_enabled(bool enabled) { enabled_ = enabled; }
+    bool enabled() const { return enabled_; }
+
+    // 0 only applies the thermal and battery floors
+    void set_target_rate(float tokens_per_second) { target_rate_ = std::max(0.0f, tokens_per_second); }
+    float target_rate() const { return target_rate_; }
+
+    void set_state(const DeviceState& state, int64_t now_ms) {
+        reported_ = state;
+        reported_at_ms_ = now_ms;
+    }
+
+    int level() const { return level_; }
+    float rate() const { return rate_; }
+    const DeviceState& state() const { return state_; }
+
+    // The configured settings scaled down for the current level
+    GovernorSettings settings(const GovernorSettings& base, int cores) const {
+        static constexpr float kScale[kLevels] = {1.0f, 0.75f, 0.5f, 0.25f};
+        float scale = kScale[level_];
+        GovernorSettings scaled = base;
+        if (level_ > 0 && cores > 0) {
+            int workers = base.workers > 0 ? base.workers : cores;
+            scaled.workers = std::max(1, static_cast<int>(workers * scale));
+        }
+        scaled.max_batch = std::max(1, static_cast<int>(base.max_batch * scale));
+        scaled.draft_length = std::max(1, static_cast<int>(base.draft_length * scale));
+        return scaled;
+    }
+
+    // A finished turn of `tokens` in `ms`; true if the level changed
+    bool observe(size_t tokens, double ms, int64_t now_ms) {
+        if (!enabled_) {
+            return false;
+        }
+        if (ms > 0.0 && tokens > 0) {
+            float rate = static_cast<float>(tokens * 1000.0 / ms);
+            rate_ = rate_ > 0.0f ? 0.7f * rate_ + 0.3f * rate : rate;
+        }
+        state_ = now_ms - reported_at_ms_ <= kStateFreshMs && reported_at_ms_ > 0 ? reported_ : read_sysfs_state();
+
+        const char* reason = nullptr;
+        int floor = 0;
+        if (state_.thermal_headroom >= 1.0f) {
+            floor = 3;
+            reason = "throttling";
+        } else if (state_.thermal_headroom >= 0.9f) {
+            floor = 2;
+            reason = "thermal headroom";
+        } else if (state_.battery_percent >= 0.0f && state_.battery_percent < 15.0f && !state_.charging) {
+            floor = 2;
+            reason = "low battery";
+        } else if (state_.power_save) {
+            floor = 1;
+            reason = "power saver";
+        }
+
+        int next = std::max(level_, floor);
+        if (next == level_ && target_rate_ > 0.0f && rate_ > 0.0f) {
+            if (rate_ > target_rate_ * 1.15f && level_ < kLevels - 1) {
+                next = level_ + 1;
+                reason = "above target";
+            } else if (rate_ < target_rate_ * 0.9f && level_ > floor) {
+                next = level_ - 1;
+                reason = "below target";
+            }
+        } else if (next == level_ && target_rate_ <= 0.0f && level_ > floor) {
+            next = floor;
+            reason = "cooled down";
+        }
+        if (next == level_) {
+            return false;
+        }
+        record(level_, next, reason, now_ms);
+        level_ = next;
+        return true;
+    }
+
+    // Decisions since the last call, one JSON object per line
+    std::string drain_events() {
+        std::string out;
+        for (const std::string& event : events_) {
+            out += event;
+        }
+        events_.clear();
+        return out;
+    }
+
+    void reset() {
+        level_ = 0;
+        rate_ = 0.0f;
+    }
+
+    static DeviceState read_sysfs_state() {
+        DeviceState state;
+        float hottest = -1.0f;
+        if (DIR* dir = opendir("/sys/class/thermal")) {
+            while (dirent* entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name.compare(0, 12, "thermal_zone") != 0) {
+                    continue;
+                }
+                std::string zone = "/sys/class/thermal/" + name;
+                std::string type = read_line(zone + "/type");
+                if (type.find("cpu") == std::string::npos && type.find("soc") == std::string::npos) {
+                    continue;
+                }
+                std::string temp = read_line(zone + "/temp");
+                if (!temp.empty()) {
+                    hottest = std::max(hottest, static_cast<float>(std::atof(temp.c_str())) / 1000.0f);
+                }
+            }
+            closedir(dir);
+        }
+        if (hottest > 0.0f) {
+            state.thermal_headroom = hottest / kThrottleCelsius;
+        }
+        std::string capacity = read_line("/sys/class/power_supply/battery/capacity");
+        if (!capacity.empty()) {
+            state.battery_percent = static_cast<float>(std::atof(capacity.c_str()));
+        }
+        std::string status = read_line("/sys/class/power_supply/battery/status");
+        state.charging = status == "Charging" || status == "Full";
+        return state;
+    }
+
+private:
+    bool enabled_ = false;
+    float target_rate_ = 0.0f;
+    int level_ = 0;
+    float rate_ = 0.0f;  // tokens/s, smoothed over turns
+    DeviceState reported_;
+    int64_t reported_at_ms_ = 0;
+    DeviceState state_;
+    std::deque<std::string> events_;
+
+    void record(int from, int to, const char* reason, int64_t now_ms) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"event\": \"governor\", \"at_ms\": %lld, \"from\": %d, \"to\": %d, \"reason\": \"%s\", "
+                 "\"rate\": %.2f, \"target\": %.2f, \"headroom\": %.3f, \"battery\": %.0f}\n",
+                 static_cast<long long>(now_ms), from, to, reason != nullptr ? reason : "", rate_, target_rate_,
+                 state_.thermal_headroom, state_.battery_percent);
+        events_.emplace_back(buffer);
+        if (events_.size() > kMaxEvents) {
+            events_.pop_front();
+        }
+    }
+
+    static std::string read_line(const std::string& path) {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <jni.h>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "native_log.h"
+#include "trace_context.h"
+
+/**
+ * Long-lived generation thread that runs requests one at a time from a queue.
+ *
+ * The thread is created on the first submit and attached to the JVM the first
+ * time a job needs it, then stays attached, so a request pays neither thread
+ * creation nor AttachCurrentThread before its first token. Because every job
+ * runs on this one thread, requests never race on engine state.
+ */
+class GenerationWorker {
+public:
+    // Jobs get the worker's JNIEnv, or nullptr if no JavaVM was ever supplied
+    using Job = std::function<void(JNIEnv*)>;
+
+    // `on_start` runs first thing on the thread, e.g. engine_heap::attach_thread
+    explicit GenerationWorker(std::string thread_name, void (*on_start)() = nullptr)
+        : thread_name_(std::move(thread_name)), on_start_(on_start) {}
+
+    ~GenerationWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cond_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    GenerationWorker(const GenerationWorker&) = delete;
+    GenerationWorker& operator=(const GenerationWorker&) = delete;
+
+    // Queue a job. Pass the JavaVM when the job calls back into Java.
+    bool submit(JavaVM* jvm, Job job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return false;
+        }
+        if (jvm != nullptr) {
+            jvm_ = jvm;
+        }
+        // The job runs under the submitter's trace id (trace_context.h)
+        if (int64_t trace = trace_context::current()) {
+            job = [trace, inner = std::move(job)](JNIEnv* env) {
+                trace_context::Scope scope(trace);
+                inner(env);
+            };
+        }
+        jobs_.push_back(std::move(job));
+        if (!thread_.joinable()) {
+            thread_ = std::thread(&GenerationWorker::run, this);
+        }
+        cond_.notify_one();
+        return true;
+    }
+
+    // Jobs waiting behind the one that is running
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.size();
+    }
+
+private:
+    std::string thread_name_;
+    void (*on_start_)();
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Job> jobs_;
+    JavaVM* jvm_ = nullptr;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    void run() {
+        if (on_start_ != nullptr) {
+            on_start_();
+        }
+        JNIEnv* env = nullptr;
+        JavaVM* attached_vm = nullptr;
+
+        while (true) {
+            Job job;
+            JavaVM* jvm;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) {
+                    break;
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+                jvm = jvm_;
+            }
+
+            // Attach once, the first time a JavaVM is known
+            if (env == nullptr && jvm != nullptr) {
+                JavaVMAttachArgs args;
+                args.version = JNI_VERSION_1_6;
+                args.name = const_cast<char*>(thread_name_.c_str());
+                args.group = nullptr;
+                if (jvm->AttachCurrentThread(&env, &args) == JNI_OK && env != nullptr) {
+                    attached_vm = jvm;
+                } else {
+                    NLOGE("GenerationWorker", "Failed to attach %s to the JVM", thread_name_.c_str());
+                    env = nullptr;
+                }
+            }
+
+            try {
+                job(env);
+            } catch (const std::exception& e) {
+                NLOGE("GenerationWorker", "Job failed: %s", e.what());
+            }
+        }
+
+        if (attached_vm != nullptr) {
+            attached_vm->DetachCurrentThread();
+        }
+    }
+};
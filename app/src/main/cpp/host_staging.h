@@ -0,0 +1,131 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include <tvm/runtime/ndarray.h>
+
+/**
+ * Host side of device-to-host copies: reusable page-aligned staging memory
+ * and copies of just the part of an array the host reads.
+ *
+ * Logits come back once per decode step. The staging block grows to the
+ * largest copy seen and is then reused for the life of the engine, so steady
+ * decode makes no host allocations, and it is page aligned, which the OpenCL
+ * and Vulkan drivers on phones can read into directly. Their TVM device APIs
+ * offer no page-locked host memory and no extra copy queue (CreateStream is
+ * not implemented), so device-host overlap comes from ordering the work
+ * around the copies instead: the decode loop launches the next step before
+ * it detokenizes and delivers the current token (see stream_with_sampler).
+ *
+ * read() copies a slice of a compact array through a view of it: for the
+ * next-token row that is one vocabulary row instead of every row of a
+ * prefill's logits.
+ */
+namespace host_staging {
+
+struct TransferStats {
+    uint64_t copies = 0;
+    uint64_t bytes = 0;             // copied to the host
+    uint64_t skipped_bytes = 0;     // rows of copied arrays left on the device
+    double copy_ms = 0.0;           // waiting for the copies
+    uint64_t overlapped_steps = 0;  // decode steps launched before the previous token was delivered
+    uint64_t grows = 0;             // staging block reallocations
+};
+
+class StagingBuffer {
+public:
+    StagingBuffer() = default;
+    StagingBuffer(const StagingBuffer&) = delete;
+    StagingBuffer& operator=(const StagingBuffer&) = delete;
+
+    ~StagingBuffer() { free(data_); }
+
+    // At least `bytes` of page-aligned memory; the old contents are not kept
+    uint8_t* reserve(size_t bytes, uint64_t* grows) {
+        if (bytes > capacity_) {
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t capacity = (bytes + page - 1) / page * page;
+            void* data = nullptr;
+            if (posix_memalign(&data, page, capacity) != 0) {
+                throw std::bad_alloc();
+            }
+            free(data_);
+            data_ = static_cast<uint8_t*>(data);
+            capacity_ = capacity;
+            (*grows)++;
+        }
+        return data_;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    void release() {
+        free(data_);
+        data_ = nullptr;
+        capacity_ = 0;
+    }
+
+private:
+    uint8_t* data_ = nullptr;
+    size_t capacity_ = 0;
+};
+
+class DeviceReadback {
+public:
+    // Elements [first, first + count) of `array` in staging memory. Arrays
+    // with strides are copied whole and offset into.
+    const uint8_t* read(const tvm::runtime::NDArray& array, size_t first, size_t count) {
+        const DLTensor* tensor = array.operator->();
+        size_t element_size = (tensor->dtype.bits * tensor->dtype.lanes + 7) / 8;
+        size_t total = 1;
+        for (int i = 0; i < tensor->ndim; ++i) {
+            total *= static_cast<size_t>(tensor->shape[i]);
+        }
+        auto start = std::chrono::steady_clock::now();
+        const uint8_t* out = nullptr;
+        if (tensor->strides != nullptr) {
+            uint8_t* data = buffer_.reserve(total * element_size, &stats_.grows);
+            array.CopyToBytes(data, total * element_size);
+            out = data + first * element_size;
+            count = total;
+        } else {
+            uint8_t* data = buffer_.reserve(count * element_size, &stats_.grows);
+            int64_t shape = static_cast<int64_t>(count);
+            DLTensor from = *tensor;
+            from.ndim = 1;
+            from.shape = &shape;
+            from.byte_offset += first * element_size;
+            DLTensor to = from;
+            to.data = data;
+            to.device = DLDevice{kDLCPU, 0};
+            to.byte_offset = 0;
+            tvm::runtime::NDArray::CopyFromTo(&from, &to);
+            out = data;
+        }
+        stats_.copy_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats_.copies++;
+        stats_.bytes += count * element_size;
+        stats_.skipped_bytes += (total - count) * element_size;
+        return out;
+    }
+
+    void note_overlapped_step() { stats_.overlapped_steps++; }
+
+    TransferStats stats() const { return stats_; }
+
+    size_t capacity() const { return buffer_.capacity(); }
+
+    // Memory trims; the next copy allocates again
+    void trim() { buffer_.release(); }
+
+private:
+    StagingBuffer buffer_;
+    TransferStats stats_;
+};
+
+}  // namespace host_staging
@@ -0,0 +1,1749 @@
+// host_tests: checks of engine pieces whose mistakes are silent, with no model
+// loaded: memory admission under pressure, the futures of the non-blocking
+// engine operations, document chunking for summaries, weight deltas applied
+// to and recovered in a model directory, offloaded KV packed and staged back
+// for a resume, the SentencePiece tokenizer (its flat image against the
+// parsed model and a reference, its parallel encode and its memo), the CPU
+// attention and W4A8 matmul kernels against naive references, the logit
+// sampler's variants against a reference sampler, the fp16 packing of
+// embeddings, and SHA-256 and HMAC against known digests.
+//
+//   ./host_tests [--filter <substring>]
+// on a host build (CMakeLists.txt, the host branch), also run by ctest. The
+// same file builds as C++20 into host_tests_cpp20, which also checks the
+// futures' co_await path (engine_async.h).
+//
+// Each case prints one line, "ok <name>" or "FAILED <name>: <what>" with the
+// failed expectation, and the exit status is the number of failed cases.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cpu_attention.h"
+#include "cpu_matmul.h"
+#include "document_summary.h"
+#include "engine_async.h"
+#include "kv_offload.h"
+#include "logit_sampler.h"
+#include "memory_forecast.h"
+#include "model_manifest.h"
+#include "sha256.h"
+#include "sp_tokenizer.h"
+#include "text_embedding.h"
+#include "weight_delta.h"
+
+namespace {
+
+constexpr uint64_t kMiB = 1ull << 20;
+
+struct Case {
+    const char* name;
+    std::function<void()> body;
+};
+
+std::vector<Case>& cases() {
+    static std::vector<Case> all;
+    return all;
+}
+
+// Failed expectations of the running case
+std::vector<std::string>& failures() {
+    static std::vector<std::string> all;
+    return all;
+}
+
+void expect(bool ok, const char* what, int line) {
+    if (!ok) {
+        failures().push_back(std::string(what) + " (line " + std::to_string(line) + ")");
+    }
+}
+
+#define EXPECT_TRUE(cond) expect((cond), #cond, __LINE__)
+#define EXPECT_EQ(a, b) expect((a) == (b), #a " == " #b, __LINE__)
+
+// The rest of the process (1.5 GB RSS, 0.5 GB of it not the engine's) holds
+// what the budget would otherwise call free, and MemAvailable is already below
+// the reserve: nothing more fits, whatever the class's share says
+void memory_forecast_room_under_pressure() {
+    using memory_forecast::Admission;
+    memory_forecast::Meminfo meminfo;
+    meminfo.rss = 1536 * kMiB;
+    meminfo.available = 200 * kMiB;
+    memory_forecast::Usage usage;
+    usage.weights = 1024 * kMiB;
+    const uint64_t reserve = 300 * kMiB;
+    EXPECT_EQ(Admission::effective_budget(0, reserve, meminfo), 1536 * kMiB);
+    for (int priority = 0; priority < kPriorityClasses; ++priority) {
+        EXPECT_EQ(Admission::room(0, reserve, meminfo, usage, priority), 0u);
+        EXPECT_EQ(Admission::room(4096 * kMiB, reserve, meminfo, usage, priority), 0u);
+    }
+}
+
+// With the system's headroom ample, the class's share of the budget is what binds
+void memory_forecast_room_by_share() {
+    using memory_forecast::Admission;
+    memory_forecast::Meminfo meminfo;
+    meminfo.rss = 1024 * kMiB;
+    meminfo.available = 4096 * kMiB;
+    memory_forecast::Usage usage;
+    usage.weights = 900 * kMiB;
+    const uint64_t budget = 2000 * kMiB;
+    const uint64_t reserve = 300 * kMiB;
+    EXPECT_EQ(Admission::room(budget, reserve, meminfo, usage, kPriorityInteractive), 1100 * kMiB);
+    EXPECT_EQ(Admission::room(budget, reserve, meminfo, usage, kPriorityPrefetch), 600 * kMiB);
+    // Less headroom lowers the budget to 1824 MB, and caps the interactive room below its share of that
+    meminfo.available = 1100 * kMiB;
+    EXPECT_EQ(Admission::room(budget, reserve, meminfo, usage, kPriorityInteractive), 800 * kMiB);
+    EXPECT_EQ(Admission::room(budget, reserve, meminfo, usage, kPriorityPrefetch), 468 * kMiB);
+    // Unreadable meminfo leaves the set budget alone, and no budget at all is unbounded
+    EXPECT_EQ(Admission::room(budget, reserve, memory_forecast::Meminfo(), usage, kPriorityInteractive),
+              1100 * kMiB);
+    EXPECT_EQ(Admission::room(0, reserve, memory_forecast::Meminfo(), usage, kPriorityInteractive), UINT64_MAX);
+}
+
+// Paragraphs of 20 to 90 words from a fixed vocabulary, as a long OCR'd chapter
+std::string summary_document(uint32_t seed, int paragraphs) {
+    static const char* kWords[] = {"cell",   "membrane", "energy", "protein", "the",       "of",     "and",
+                                   "which",  "enzyme",   "ATP",    "mitochondria", "is", "transport", "gradient",
+                                   "in",     "a",        "binds",  "release", "glucose",   "pathway"};
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> word(0, static_cast<int>(sizeof(kWords) / sizeof(kWords[0])) - 1);
+    std::uniform_int_distribution<int> length(20, 90);
+    std::string text;
+    for (int p = 0; p < paragraphs; ++p) {
+        int words = length(rng);
+        for (int w = 0; w < words; ++w) {
+            text += kWords[word(rng)];
+            text += w % 13 == 12 ? ".\n" : " ";  // line-wrapped sentences
+        }
+        text += "end.\n\n";
+    }
+    return text;
+}
+
+size_t count_words(const std::string& text) {
+    size_t words = 0;
+    bool in_word = false;
+    for (char c : text) {
+        bool space = c == ' ' || c == '\n' || c == '\t' || c == '\r';
+        words += !space && !in_word ? 1 : 0;
+        in_word = !space;
+    }
+    return words;
+}
+
+std::string collapse_spaces(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        bool space = c == ' ' || c == '\n' || c == '\t' || c == '\r';
+        if (!space) {
+            out += c;
+        } else if (!out.empty() && out.back() != ' ') {
+            out += ' ';
+        }
+    }
+    while (!out.empty() && out.back() == ' ') {
+        out.pop_back();
+    }
+    return out;
+}
+
+// Chunks keep to the budget and, joined, are the document: nothing dropped or repeated
+void document_summary_split_covers() {
+    std::string text = summary_document(1, 150);
+    const size_t budget = 400;
+    std::vector<std::string> chunks = document_summary::split(text, budget, count_words);
+    EXPECT_TRUE(chunks.size() > 10);
+    std::string joined;
+    for (const std::string& chunk : chunks) {
+        EXPECT_TRUE(count_words(chunk) <= budget);
+        EXPECT_TRUE(!chunk.empty());
+        joined += chunk + " ";
+    }
+    EXPECT_EQ(collapse_spaces(joined), collapse_spaces(text));
+    // A paragraph over the budget is cut by sentences, then by words
+    std::string long_paragraph;
+    for (int i = 0; i < 500; ++i) {
+        long_paragraph += i % 40 == 39 ? "word. " : "word ";
+    }
+    chunks = document_summary::split(long_paragraph, 64, count_words);
+    joined.clear();
+    for (const std::string& chunk : chunks) {
+        EXPECT_TRUE(count_words(chunk) <= 64);
+        joined += chunk + " ";
+    }
+    EXPECT_EQ(collapse_spaces(joined), collapse_spaces(long_paragraph));
+}
+
+// A re-capture missing its first three paragraphs, and wrapped differently,
+// chunks the same as the original from the first anchor on
+void document_summary_split_anchored() {
+    std::string text = summary_document(2, 200);
+    size_t third = 0;
+    for (int p = 0; p < 3; ++p) {
+        third = text.find("\n\n", third) + 2;
+    }
+    std::string recapture = text.substr(third);
+    for (size_t i = 0; i < recapture.size(); i += 97) {
+        if (recapture[i] == ' ') {
+            recapture[i] = '\n';  // another line wrap, not another paragraph
+        }
+    }
+    const size_t budget = 400;
+    std::vector<std::string> original = document_summary::split(text, budget, count_words);
+    std::vector<std::string> shifted = document_summary::split(recapture, budget, count_words);
+    std::vector<std::string> tail;
+    for (const std::string& chunk : original) {
+        tail.push_back(collapse_spaces(chunk));
+    }
+    size_t first_match = shifted.size();
+    for (size_t i = 0; i < shifted.size() && first_match == shifted.size(); ++i) {
+        if (std::find(tail.begin(), tail.end(), collapse_spaces(shifted[i])) != tail.end()) {
+            first_match = i;
+        }
+    }
+    // Only the chunks before the first anchor may differ
+    EXPECT_TRUE(first_match <= 2);
+    size_t at = std::find(tail.begin(), tail.end(), collapse_spaces(shifted[first_match])) - tail.begin();
+    EXPECT_EQ(shifted.size() - first_match, tail.size() - at);
+    for (size_t i = first_match; i < shifted.size() && at < tail.size(); ++i, ++at) {
+        EXPECT_EQ(collapse_spaces(shifted[i]), tail[at]);
+    }
+}
+
+// A scratch model directory, removed with its files
+class ScratchDir {
+public:
+    ScratchDir() {
+        const char* tmp = getenv("TMPDIR");
+        std::string pattern = std::string(tmp != nullptr ? tmp : "/tmp") + "/host_tests.XXXXXX";
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        path_ = mkdtemp(name.data()) != nullptr ? name.data() : "";
+    }
+    ~ScratchDir() {
+        for (const std::string& file : files()) {
+            unlink((path_ + "/" + file).c_str());
+        }
+        rmdir(path_.c_str());
+    }
+
+    const std::string& path() const { return path_; }
+
+    std::vector<std::string> files() const {
+        std::vector<std::string> names;
+        if (DIR* listing = opendir(path_.c_str())) {
+            while (dirent* entry = readdir(listing)) {
+                if (entry->d_name[0] != '.') {
+                    names.push_back(entry->d_name);
+                }
+            }
+            closedir(listing);
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+private:
+    std::string path_;
+};
+
+std::string random_bytes(uint32_t seed, size_t size) {
+    std::mt19937 rng(seed);
+    std::string bytes(size, '\0');
+    for (char& byte : bytes) {
+        byte = static_cast<char>(rng());
+    }
+    return bytes;
+}
+
+bool write_file(const std::string& path, const std::string& bytes) {
+    FILE* out = fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+    return fclose(out) == 0 && ok;
+}
+
+std::string read_file(const std::string& path) {
+    std::string bytes;
+    FILE* in = fopen(path.c_str(), "rb");
+    if (in == nullptr) {
+        return "<missing>";
+    }
+    char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        bytes.append(buffer, n);
+    }
+    fclose(in);
+    return bytes;
+}
+
+// A delta to `files` (name, contents) as tools/make_weight_delta.py writes it:
+// chunks the installed manifest has by reference, the rest literally, with
+// `corrupt` flipping a byte of the first literal chunk after it was hashed
+std::string make_delta(const model_manifest::Manifest& installed,
+                       const std::vector<std::pair<std::string, std::string>>& files,
+                       const std::vector<std::string>& removed, bool corrupt = false) {
+    const uint64_t chunk_bytes = installed.chunk_bytes;
+    std::map<uint64_t, bool> have;
+    for (const model_manifest::Entry& entry : installed.files) {
+        for (uint64_t hash : entry.chunks) {
+            have[hash] = true;
+        }
+    }
+    size_t table = sizeof(weight_delta::Header);
+    for (const auto& file : files) {
+        table += sizeof(weight_delta::FileHeader) + file.first.size() +
+                 model_manifest::chunk_count(file.second.size(), chunk_bytes) * sizeof(weight_delta::ChunkRef);
+    }
+    for (const std::string& name : removed) {
+        table += sizeof(uint32_t) + name.size();
+    }
+    weight_delta::Header header = {weight_delta::kMagic, weight_delta::kVersion, chunk_bytes,
+                                   static_cast<uint32_t>(files.size()), static_cast<uint32_t>(removed.size())};
+    std::string head(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::string literals;
+    for (const auto& file : files) {
+        size_t chunks = model_manifest::chunk_count(file.second.size(), chunk_bytes);
+        weight_delta::FileHeader file_header = {static_cast<uint32_t>(file.first.size()),
+                                                static_cast<uint32_t>(chunks), file.second.size()};
+        head.append(reinterpret_cast<const char*>(&file_header), sizeof(file_header));
+        head += file.first;
+        for (size_t c = 0; c < chunks; ++c) {
+            std::string chunk = file.second.substr(c * chunk_bytes, chunk_bytes);
+            weight_delta::ChunkRef ref;
+            ref.hash = model_manifest::fnv1a(reinterpret_cast<const unsigned char*>(chunk.data()), chunk.size());
+            ref.literal = weight_delta::kFromInstalled;
+            if (!have.count(ref.hash)) {
+                ref.literal = table + literals.size();
+                if (corrupt && literals.empty()) {
+                    chunk[0] ^= 1;
+                }
+                literals += chunk;
+            }
+            head.append(reinterpret_cast<const char*>(&ref), sizeof(ref));
+        }
+    }
+    for (const std::string& name : removed) {
+        uint32_t bytes = static_cast<uint32_t>(name.size());
+        head.append(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+        head += name;
+    }
+    return head + literals;
+}
+
+// An installed release: two shards, a config and a file the next one drops
+void install_release(const std::string& dir, std::string* shard0, std::string* shard1) {
+    const size_t mb = model_manifest::kChunkBytes;
+    *shard0 = random_bytes(10, 2 * mb + mb / 2);
+    *shard1 = random_bytes(11, mb + mb / 2);
+    write_file(dir + "/params_shard_0.bin", *shard0);
+    write_file(dir + "/params_shard_1.bin", *shard1);
+    write_file(dir + "/mlc-chat-config.json", "{\"release\": 1}");
+    write_file(dir + "/tokenizer-extra.txt", "old");
+    model_manifest::write(dir, "model.so");
+}
+
+// Edited, moved, added and removed files: the directory ends up exactly the
+// new release, and its new manifest verifies against it by content
+void weight_delta_apply() {
+    ScratchDir dir;
+    std::string shard0, shard1;
+    install_release(dir.path(), &shard0, &shard1);
+    model_manifest::Manifest installed = model_manifest::read(dir.path());
+    EXPECT_TRUE(installed.loaded());
+
+    const size_t mb = model_manifest::kChunkBytes;
+    // shard 0: its second chunk first, one new chunk, then shard 1's first chunk
+    std::string new_shard0 = shard0.substr(mb, mb) + random_bytes(20, mb) + shard1.substr(0, mb);
+    std::string new_shard2 = random_bytes(21, mb / 3);
+    std::string config = "{\"release\": 2}";
+    std::string delta = make_delta(installed,
+                                   {{"params_shard_0.bin", new_shard0},
+                                    {"params_shard_2.bin", new_shard2},
+                                    {"mlc-chat-config.json", config}},
+                                   {"tokenizer-extra.txt"});
+    // Only the new bytes travel
+    EXPECT_TRUE(delta.size() < mb + new_shard2.size() + 4096);
+    std::string delta_path = dir.path() + "/update.delta";
+    write_file(delta_path, delta);
+
+    std::string error;
+    EXPECT_TRUE(weight_delta::apply(dir.path(), delta_path, &error));
+    EXPECT_EQ(error, std::string());
+    unlink(delta_path.c_str());
+    EXPECT_TRUE(read_file(dir.path() + "/params_shard_0.bin") == new_shard0);
+    EXPECT_TRUE(read_file(dir.path() + "/params_shard_1.bin") == shard1);
+    EXPECT_TRUE(read_file(dir.path() + "/params_shard_2.bin") == new_shard2);
+    EXPECT_EQ(read_file(dir.path() + "/mlc-chat-config.json"), config);
+    std::vector<std::string> expected = {"mlc-chat-config.json", model_manifest::kFileName, "params_shard_0.bin",
+                                         "params_shard_1.bin", "params_shard_2.bin"};
+    EXPECT_TRUE(dir.files() == expected);  // no staged files, no journal
+    model_manifest::Manifest updated = model_manifest::read(dir.path());
+    EXPECT_EQ(updated.files.size(), 4u);
+    EXPECT_TRUE(model_manifest::verify(dir.path(), updated, true).empty());
+}
+
+// A delta whose literal chunk does not match its hash leaves the old release as it was
+void weight_delta_damaged() {
+    ScratchDir dir;
+    std::string shard0, shard1;
+    install_release(dir.path(), &shard0, &shard1);
+    model_manifest::Manifest installed = model_manifest::read(dir.path());
+    std::vector<std::string> before = dir.files();
+    std::string manifest_before = read_file(dir.path() + "/" + model_manifest::kFileName);
+
+    std::string delta = make_delta(installed,
+                                   {{"mlc-chat-config.json", "{\"release\": 2}"},
+                                    {"params_shard_1.bin", random_bytes(30, model_manifest::kChunkBytes)}},
+                                   {"tokenizer-extra.txt"}, true);
+    std::string delta_path = dir.path() + "/update.delta";
+    write_file(delta_path, delta);
+    std::string error;
+    EXPECT_TRUE(!weight_delta::apply(dir.path(), delta_path, &error));
+    EXPECT_TRUE(!error.empty());
+    unlink(delta_path.c_str());
+    EXPECT_TRUE(dir.files() == before);
+    EXPECT_TRUE(read_file(dir.path() + "/params_shard_1.bin") == shard1);
+    EXPECT_EQ(read_file(dir.path() + "/mlc-chat-config.json"), std::string("{\"release\": 1}"));
+    EXPECT_EQ(read_file(dir.path() + "/" + model_manifest::kFileName), manifest_before);
+    EXPECT_TRUE(model_manifest::verify(dir.path(), installed, true).empty());
+}
+
+// A crash after the journal was written, partway through its renames: recover()
+// finishes what is left, and a second recover() has nothing to do
+void weight_delta_recover() {
+    ScratchDir dir;
+    const std::string path = dir.path();
+    write_file(path + "/params_shard_0.bin", "new shard 0");  // renamed before the crash
+    write_file(path + "/params_shard_1.bin", "old shard 1");
+    write_file(path + "/params_shard_1.bin" + weight_delta::kStagedSuffix, "new shard 1");
+    write_file(path + "/tokenizer-extra.txt", "old");
+    write_file(path + "/" + model_manifest::kFileName + weight_delta::kStagedSuffix, "new manifest");
+    write_file(path + "/" + weight_delta::kJournalName,
+               std::string("rename params_shard_0.bin\nrename params_shard_1.bin\nremove tokenizer-extra.txt\n") +
+                   "rename " + model_manifest::kFileName + "\n");
+    EXPECT_TRUE(weight_delta::recover(path));
+    EXPECT_EQ(read_file(path + "/params_shard_0.bin"), std::string("new shard 0"));
+    EXPECT_EQ(read_file(path + "/params_shard_1.bin"), std::string("new shard 1"));
+    EXPECT_EQ(read_file(path + "/" + model_manifest::kFileName), std::string("new manifest"));
+    std::vector<std::string> expected = {model_manifest::kFileName, "params_shard_0.bin", "params_shard_1.bin"};
+    EXPECT_TRUE(dir.files() == expected);
+    EXPECT_TRUE(weight_delta::recover(path));
+    EXPECT_TRUE(dir.files() == expected);
+}
+
+// fp16 words normal around 0, the way K and V activations look
+std::vector<uint8_t> fp16_kv(uint32_t seed, size_t size) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> value(0.0f, 1.0f);
+    std::vector<uint8_t> kv(size);
+    for (size_t i = 0; i < size; ++i) {
+        if (i % 2 == 1) {
+            float f = value(rng);
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            int exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+            kv[i] = static_cast<uint8_t>(((bits >> 24) & 0x80) | (std::min(std::max(exponent, 0), 31) << 2));
+        } else {
+            kv[i] = static_cast<uint8_t>(rng());
+        }
+    }
+    return kv;
+}
+
+std::vector<uint8_t> unpacked(const std::vector<uint8_t>& packed, size_t size, bool* ok) {
+    std::vector<uint8_t> out;
+    *ok = kv_offload::unpack(packed.data(), size, [&](const uint8_t* data, size_t n) {
+        out.insert(out.end(), data, data + n);
+        return true;
+    });
+    return out;
+}
+
+// fp16 KV packs (the high plane deflated, the low one as it is) and round-trips
+// whatever its size; random bytes stay stored whole; a cut stream is refused
+void kv_offload_round_trip() {
+    bool ok = false;
+    std::vector<uint8_t> packed;
+    for (size_t size : {size_t(0), size_t(1), size_t(4097), 2 * kv_offload::kBlockBytes + 3}) {
+        std::vector<uint8_t> kv = fp16_kv(static_cast<uint32_t>(size), size);
+        kv_offload::pack(kv.data(), kv.size(), &packed);
+        EXPECT_TRUE(unpacked(packed, packed.size(), &ok) == kv);
+        EXPECT_TRUE(ok);
+    }
+    EXPECT_TRUE(packed.size() < (2 * kv_offload::kBlockBytes + 3) * 7 / 8);
+
+    std::string noise = random_bytes(5, kv_offload::kBlockBytes + 1);
+    std::vector<uint8_t> bytes(noise.begin(), noise.end());
+    kv_offload::pack(bytes.data(), bytes.size(), &packed);
+    EXPECT_EQ(packed.size(), bytes.size() + 2 * 8);
+    EXPECT_TRUE(unpacked(packed, packed.size(), &ok) == bytes);
+    EXPECT_TRUE(ok);
+
+    std::vector<uint8_t> kv = fp16_kv(6, kv_offload::kBlockBytes);
+    kv_offload::pack(kv.data(), kv.size(), &packed);
+    unpacked(packed, packed.size() - 1, &ok);
+    EXPECT_TRUE(!ok);
+}
+
+// A session packed into memory is staged back into a memfd, leaving nothing
+// in the store's directory, and reads back as save_kv wrote it
+void kv_offload_stage_buffer() {
+    ScratchDir dir;
+    kv_offload::Store store;
+    EXPECT_TRUE(store.open(dir.path(), 64 * kMiB, 64 * kMiB));
+    std::vector<uint8_t> kv = fp16_kv(7, 3 * kv_offload::kBlockBytes / 2);
+    EXPECT_TRUE(write_file(store.begin_raw(7), std::string(kv.begin(), kv.end())));
+    store.commit_raw(7);
+    store.compact();
+    EXPECT_EQ(store.tier(7), kv_offload::kMemory);
+    EXPECT_TRUE(dir.files().empty());
+
+    std::string path = store.stage(7);
+    EXPECT_EQ(path.compare(0, 14, "/proc/self/fd/"), 0);
+    EXPECT_TRUE(dir.files().empty());
+    EXPECT_TRUE(read_file(path) == std::string(kv.begin(), kv.end()));
+    EXPECT_EQ(store.stage(7), path);
+    store.erase(7, true);
+    EXPECT_EQ(store.tier(7), kv_offload::kNone);
+    EXPECT_EQ(store.stats().restored, 1u);
+}
+
+// Protobuf wire format, enough to write a sentencepiece_model.proto
+void put_varint(std::string* out, uint64_t value) {
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+void put_bytes(std::string* out, uint32_t field, const std::string& bytes) {
+    put_varint(out, field << 3 | 2);
+    put_varint(out, bytes.size());
+    *out += bytes;
+}
+
+void put_number(std::string* out, uint32_t field, uint64_t value) {
+    put_varint(out, field << 3);
+    put_varint(out, value);
+}
+
+const char* const kSpWords[] = {
+    "the", "cell", "membrane", "regulates", "which", "molecules", "enter", "and", "leave", "energy",
+    "photosynthesis", "light", "reaction", "produces", "glucose", "oxygen", "water", "in", "of", "a", "is",
+    "to", "by", "equation", "velocity", "force", "mass", "newton", "law", "states", "that", "figure",
+    "chapter", "example", "therefore", "respiration", "pressure", "volume", "derivative", "function",
+    "limit", "theorem", "proof", "notice", "the", "The", "Cell", "Energy"};
+const char* const kSpSymbols[] = {"<start_of_turn>", "<end_of_turn>", "\n", "\xE2\x96\x81<sep>",
+                                  "<br\xE2\x96\x81/>"};
+const char* const kSpExtraChars[] = {"\xC3\xA9", "\xC3\xAF", "\xC2\xB2", ".", ",", "(", ")", "=", "+", "-",
+                                     "0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+
+struct SpPiece {
+    std::string text;
+    float score;
+    int type;  // sentencepiece_model.proto's: 1 normal, 2 unknown, 3 control, 4 user-defined, 6 byte
+};
+
+// A BPE vocabulary over kSpWords, shaped like Gemma's: every run of up to six
+// characters inside a word, with and without its leading space symbol, at
+// scores drawn from `seed`; runs of up to four space symbols; byte pieces;
+// and user-defined symbols, one led by a space symbol and one with a space
+// inside. `extra` adds one more normal piece.
+std::vector<SpPiece> sp_pieces(uint32_t seed, const std::string& extra = "") {
+    const std::string space = "\xE2\x96\x81";
+    std::vector<SpPiece> pieces = {{"<unk>", 0.0f, 2}, {"<s>", 0.0f, 3}, {"</s>", 0.0f, 3}};
+    for (const char* symbol : kSpSymbols) {
+        pieces.push_back({symbol, 0.0f, 4});
+    }
+    for (int b = 0; b < 256; ++b) {
+        char name[8];
+        snprintf(name, sizeof(name), "<0x%02X>", b);
+        pieces.push_back({name, 0.0f, 6});
+    }
+    std::map<std::string, bool> normal;
+    for (const char* word : kSpWords) {
+        for (const std::string& text : {std::string(word), space + word}) {
+            std::vector<std::string> chars;
+            for (size_t i = 0; i < text.size(); i += text.compare(i, space.size(), space) == 0 ? space.size() : 1) {
+                chars.push_back(text.compare(i, space.size(), space) == 0 ? space : text.substr(i, 1));
+            }
+            for (size_t from = 0; from < chars.size(); ++from) {
+                std::string piece;
+                for (size_t to = from; to < chars.size() && to < from + 6; ++to) {
+                    piece += chars[to];
+                    normal[piece] = true;
+                }
+            }
+        }
+    }
+    for (const char* c : kSpExtraChars) {
+        normal[c] = true;
+    }
+    for (std::string run = space; run.size() <= 4 * space.size(); run += space) {
+        normal[run] = true;
+    }
+    if (!extra.empty()) {
+        normal[extra] = true;
+    }
+    std::mt19937 rng(seed);
+    for (const auto& piece : normal) {
+        pieces.push_back({piece.first, -static_cast<float>(rng() % 10000) / 8.0f, 1});
+    }
+    return pieces;
+}
+
+// tokenizer.model for `pieces`: BPE with byte fallback, a dummy prefix and
+// runs of spaces kept
+std::string sp_model(const std::vector<SpPiece>& pieces, bool whitespace_only_pieces) {
+    std::string model;
+    for (const SpPiece& piece : pieces) {
+        std::string record;
+        put_bytes(&record, 1, piece.text);
+        if (piece.type == 1) {
+            uint32_t bits;
+            memcpy(&bits, &piece.score, sizeof(bits));
+            put_varint(&record, 2 << 3 | 5);
+            record.append(reinterpret_cast<const char*>(&bits), sizeof(bits));
+        }
+        put_number(&record, 3, static_cast<uint64_t>(piece.type));
+        put_bytes(&model, 1, record);
+    }
+    std::string trainer;
+    put_number(&trainer, 3, 2);  // BPE
+    put_number(&trainer, 26, whitespace_only_pieces ? 1 : 0);
+    put_number(&trainer, 35, 1);  // byte fallback
+    put_number(&trainer, 40, 0);
+    put_number(&trainer, 41, 1);
+    put_number(&trainer, 42, 2);
+    put_bytes(&model, 2, trainer);
+    std::string normalizer;
+    put_number(&normalizer, 3, 1);  // add a dummy prefix
+    put_number(&normalizer, 4, 0);  // keep runs of spaces
+    put_bytes(&model, 3, normalizer);
+    return model;
+}
+
+// SentencePiece BPE by the book, for the model sp_model() writes: pieces in a
+// std::map, segments found by trying every symbol at every byte, and each
+// merge the best pair over the whole segment, leftmost on ties
+class ReferenceSp {
+public:
+    ReferenceSp(const std::vector<SpPiece>& pieces, bool whitespace_only_pieces)
+        : pieces_(pieces), whitespace_only_(whitespace_only_pieces) {
+        for (size_t id = 0; id < pieces.size(); ++id) {
+            ids_.emplace(pieces[id].text, static_cast<int>(id));
+            if (pieces[id].type == 4) {
+                symbols_.push_back(pieces[id].text);
+            }
+        }
+    }
+
+    std::vector<int> encode(const std::string& text) const {
+        const std::string space = "\xE2\x96\x81";
+        std::string normalized;
+        if (!text.empty()) {
+            normalized = space;
+        }
+        for (char c : text) {
+            normalized += c == ' ' ? space : std::string(1, c);
+        }
+        std::vector<int> out;
+        size_t start = 0;
+        size_t i = 0;
+        bool in_whitespace = false;
+        while (i < normalized.size()) {
+            size_t longest = 0;
+            for (const std::string& symbol : symbols_) {
+                if (symbol.size() > longest && normalized.compare(i, symbol.size(), symbol) == 0) {
+                    longest = symbol.size();
+                }
+            }
+            if (longest > 0) {
+                merge(normalized.substr(start, i - start), &out);
+                out.push_back(ids_.at(normalized.substr(i, longest)));
+                i += longest;
+                start = i;
+                in_whitespace = false;
+            } else if (normalized.compare(i, space.size(), space) == 0) {
+                if (i > start && (!in_whitespace || !whitespace_only_)) {
+                    merge(normalized.substr(start, i - start), &out);
+                    start = i;
+                }
+                in_whitespace = true;
+                i += space.size();
+            } else {
+                in_whitespace = false;
+                i++;
+            }
+        }
+        merge(normalized.substr(start), &out);
+        return out;
+    }
+
+private:
+    const std::vector<SpPiece>& pieces_;
+    bool whitespace_only_;
+    std::map<std::string, int> ids_;
+    std::vector<std::string> symbols_;
+
+    int mergeable(const std::string& text) const {
+        auto it = ids_.find(text);
+        return it != ids_.end() && (pieces_[it->second].type == 1 || pieces_[it->second].type == 4) ? it->second
+                                                                                                    : -1;
+    }
+
+    void merge(const std::string& segment, std::vector<int>* out) const {
+        std::vector<std::string> parts;
+        for (size_t i = 0; i < segment.size();) {
+            uint8_t lead = static_cast<uint8_t>(segment[i]);
+            size_t len = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+            parts.push_back(segment.substr(i, len));
+            i += len;
+        }
+        while (true) {
+            int best = -1;
+            float best_score = 0.0f;
+            for (size_t k = 0; k + 1 < parts.size(); ++k) {
+                int id = mergeable(parts[k] + parts[k + 1]);
+                if (id >= 0 && (best < 0 || pieces_[id].score > best_score)) {
+                    best = static_cast<int>(k);
+                    best_score = pieces_[id].score;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+            parts[best] += parts[best + 1];
+            parts.erase(parts.begin() + best + 1);
+        }
+        for (const std::string& part : parts) {
+            int id = mergeable(part);
+            if (id >= 0) {
+                out->push_back(id);
+                continue;
+            }
+            for (char c : part) {
+                char name[8];
+                snprintf(name, sizeof(name), "<0x%02X>", static_cast<uint8_t>(c));
+                out->push_back(ids_.at(name));
+            }
+        }
+    }
+};
+
+// Prose over kSpWords with runs of spaces, digits, accented words and the
+// user-defined symbols, each glued to a word, spaced off or between spaces
+std::string sp_corpus(uint32_t seed, size_t bytes) {
+    static const char* const kOther[] = {"caf\xC3\xA9", "na\xC3\xAFve", "x\xC2\xB2", "(see", "2.5", "=", "+"};
+    std::mt19937 rng(seed);
+    std::string text;
+    while (text.size() < bytes) {
+        uint32_t pick = rng() % 100;
+        if (pick < 8) {
+            text += kSpSymbols[rng() % (sizeof(kSpSymbols) / sizeof(kSpSymbols[0]))];
+        } else if (pick < 14) {
+            text += kOther[rng() % (sizeof(kOther) / sizeof(kOther[0]))];
+        } else {
+            text += kSpWords[rng() % (sizeof(kSpWords) / sizeof(kSpWords[0]))];
+        }
+        uint32_t gap = rng() % 10;
+        text.append(gap < 6 ? 1 : gap < 8 ? 0 : gap - 6, ' ');
+    }
+    // The space symbol inside <br▁/> and <sep> only occurs once normalized; spell them with spaces
+    for (size_t at; (at = text.find("\xE2\x96\x81")) != std::string::npos;) {
+        text.replace(at, 3, " ");
+    }
+    return text;
+}
+
+// Slices cut at spaces next to user-defined symbols (one led by a space, one
+// spanning a space) join to exactly encode()'s ids, with whitespace-only
+// pieces on and off; a separate tokenizer does each, so neither reuses the
+// other's segment cache
+void sp_tokenizer_encode_parallel() {
+    for (bool whitespace_only : {false, true}) {
+        ScratchDir dir;
+        std::string path = dir.path() + "/tokenizer.model";
+        EXPECT_TRUE(write_file(path, sp_model(sp_pieces(17), whitespace_only)));
+        SpTokenizer serial;
+        SpTokenizer parallel;
+        EXPECT_TRUE(serial.load(path, false));
+        EXPECT_TRUE(parallel.load(path, false));
+        std::string corpus = sp_corpus(whitespace_only ? 2 : 1, 256 << 10);
+        std::vector<int> expected = serial.encode(corpus);
+        EXPECT_TRUE(expected.size() > corpus.size() / 8);
+        for (size_t workers : {2, 3, 4, 8, 13}) {
+            EXPECT_TRUE(parallel.encode_parallel(corpus, workers) == expected);
+        }
+        // Long unspaced runs, so the first space after each share is inside <br />
+        std::string glued;
+        for (int i = 0; i < 6; ++i) {
+            for (int k = 0; k < 1500; ++k) {
+                glued += kSpWords[k % 12];
+            }
+            glued += i % 2 == 0 ? "<br />  <sep> and " : "<br /> <end_of_turn> ";
+        }
+        EXPECT_TRUE(parallel.encode_parallel(glued, 6) == serial.encode(glued));
+        std::mt19937 rng(whitespace_only ? 4 : 3);
+        for (int i = 0; i < 24; ++i) {
+            size_t from = rng() % (corpus.size() / 2);
+            std::string_view part = std::string_view(corpus).substr(from, 40000 + rng() % 60000);
+            EXPECT_TRUE(parallel.encode_parallel(part, 2 + rng() % 6) == serial.encode(part));
+        }
+    }
+}
+
+// A memoized tokenizer against one whose memo holds nothing: encode(), count()
+// and encode_parallel() agree on texts under and over kMaxTextBytes, hit or
+// miss, in either order. The memo keeps to its byte bound, least recently used
+// out first, and load() empties it, so a new model's ids are never answered
+// from the old one's.
+void sp_tokenizer_memo() {
+    ScratchDir dir;
+    std::string path = dir.path() + "/tokenizer.model";
+    std::string other = dir.path() + "/other.model";
+    EXPECT_TRUE(write_file(path, sp_model(sp_pieces(17), false)));
+    EXPECT_TRUE(write_file(other, sp_model(sp_pieces(19, "\xE2\x96\x81membrane"), true)));
+    SpTokenizer memoized;
+    SpTokenizer plain;
+    EXPECT_TRUE(memoized.load(path, false));
+    EXPECT_TRUE(plain.load(path, false));
+    plain.memo().set_max_bytes(0);
+
+    std::string corpus = sp_corpus(5, 256 << 10);
+    std::mt19937 rng(37);
+    std::vector<std::string> texts = {"", " ", "<br />", corpus.substr(0, TokenMemo::kMaxTextBytes),
+                                      corpus.substr(0, TokenMemo::kMaxTextBytes + 1), corpus.substr(0, 100 << 10)};
+    for (int i = 0; i < 40; ++i) {
+        texts.push_back(corpus.substr(rng() % (corpus.size() / 2), 1 + rng() % 3000));
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < texts.size(); ++i) {
+            const std::string& text = texts[i];
+            std::vector<int> expected = plain.encode(text);
+            // Half the texts are counted first, so count() fills the memo encode() reads
+            if ((i + pass) % 2 == 0) {
+                EXPECT_EQ(memoized.count(text), expected.size());
+                EXPECT_TRUE(memoized.encode(text) == expected);
+            } else {
+                EXPECT_TRUE(memoized.encode(text) == expected);
+                EXPECT_EQ(memoized.count(text), expected.size());
+            }
+            EXPECT_TRUE(memoized.encode_parallel(text, 4) == expected);
+            EXPECT_EQ(plain.count(text), expected.size());
+            EXPECT_TRUE(plain.encode_parallel(text, 4) == expected);
+        }
+    }
+    TokenMemo::Stats stats = memoized.memo().stats();
+    EXPECT_TRUE(stats.hits > stats.misses);
+    EXPECT_EQ(stats.entries, texts.size() - 3);  // not "" or the two over kMaxTextBytes
+    EXPECT_EQ(plain.memo().stats().entries, 0u);
+
+    // The byte bound, least recently used out first
+    memoized.memo().set_max_bytes(8 << 10);
+    stats = memoized.memo().stats();
+    EXPECT_TRUE(stats.bytes <= (8u << 10) && stats.entries > 0 && stats.entries < texts.size() - 3);
+    for (int i = 0; i < 200; ++i) {
+        std::string text = corpus.substr(rng() % (corpus.size() / 2), 1 + rng() % 400);
+        EXPECT_TRUE(memoized.encode(text) == plain.encode(text));
+        EXPECT_TRUE(memoized.memo().stats().bytes <= (8u << 10));
+        EXPECT_TRUE(memoized.memo().find(text, nullptr));  // the latest always stays
+    }
+    std::string kept = corpus.substr(10, 50);
+    std::string dropped = corpus.substr(20, 50);
+    memoized.encode(kept);
+    memoized.encode(dropped);
+    for (int i = 0; i < 200; ++i) {  // far more than the bound holds
+        memoized.memo().find(kept, nullptr);
+        memoized.encode(corpus.substr(1000 + i * 7, 60));
+    }
+    EXPECT_TRUE(memoized.memo().find(kept, nullptr));
+    EXPECT_TRUE(!memoized.memo().find(dropped, nullptr));
+    TokenMemo tiny;
+    tiny.set_max_bytes(100);
+    tiny.put("a long enough text", std::vector<int>(64, 1));  // bigger than the whole bound
+    EXPECT_EQ(tiny.stats().entries, 0u);
+
+    // load() empties the memo, so the next model's ids are its own
+    memoized.memo().set_max_bytes(TokenMemo::kDefaultMaxBytes);
+    std::vector<std::vector<int>> before;
+    for (const std::string& text : texts) {
+        before.push_back(memoized.encode(text));
+    }
+    EXPECT_TRUE(memoized.memo().stats().entries > 0);
+    EXPECT_TRUE(memoized.load(other, false));
+    stats = memoized.memo().stats();
+    EXPECT_EQ(stats.entries, 0u);
+    EXPECT_EQ(stats.bytes, 0u);
+    EXPECT_TRUE(plain.load(other, false));
+    size_t changed = 0;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        std::vector<int> ids = memoized.encode(texts[i]);
+        EXPECT_TRUE(ids == plain.encode(texts[i]));
+        EXPECT_EQ(memoized.count(texts[i]), ids.size());
+        changed += ids != before[i] ? 1 : 0;
+    }
+    EXPECT_TRUE(changed > texts.size() / 2);
+}
+
+// Texts of every shape sp_corpus() makes, short and long
+std::vector<std::string> sp_texts() {
+    std::vector<std::string> texts = {"", " ", "the", "  the   cell  ",
+                                      "<start_of_turn>user\nthe cell<end_of_turn>\n", "x<br />y <sep>z",
+                                      "caf\xC3\xA9 na\xC3\xAFve x\xC2\xB2 = 2.5", "\xF0\x9F\x93\x9A ~ |"};
+    for (uint32_t seed = 0; seed < 40; ++seed) {
+        texts.push_back(sp_corpus(100 + seed, 16 + seed * 97));
+    }
+    texts.push_back(sp_corpus(7, 64 << 10));
+    return texts;
+}
+
+void set_mtime(const std::string& path, time_t seconds) {
+    struct timespec times[2] = {{seconds, 0}, {seconds, 0}};
+    utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+// The mapped flat image and the model parsed in place give the same ids,
+// and both the ids of the reference; an image whose model changed size or
+// mtime under it is converted again rather than used
+void sp_tokenizer_flat_image() {
+    for (bool whitespace_only : {false, true}) {
+        ScratchDir dir;
+        std::string path = dir.path() + "/tokenizer.model";
+        std::vector<SpPiece> pieces = sp_pieces(17);
+        EXPECT_TRUE(write_file(path, sp_model(pieces, whitespace_only)));
+        set_mtime(path, 1000000000);
+        ReferenceSp reference(pieces, whitespace_only);
+        SpTokenizer parsed;
+        SpTokenizer converted;
+        SpTokenizer mapped;
+        EXPECT_TRUE(parsed.load(path, false));
+        EXPECT_TRUE(!parsed.mapped());
+        EXPECT_TRUE(converted.load(path));
+        EXPECT_TRUE(mapped.load(path));
+        EXPECT_TRUE(mapped.mapped());
+        EXPECT_EQ(mapped.vocab_size(), pieces.size());
+        std::vector<std::string> texts = sp_texts();
+        for (const std::string& text : texts) {
+            std::vector<int> ids = reference.encode(text);
+            EXPECT_TRUE(parsed.encode(text) == ids);
+            EXPECT_TRUE(mapped.encode(text) == ids);
+        }
+        for (const SpPiece& piece : pieces) {
+            EXPECT_EQ(mapped.piece_id(piece.text), parsed.piece_id(piece.text));
+        }
+        std::string before = read_file(path + ".flat");
+
+        // Same size, other scores, a new mtime
+        std::vector<SpPiece> rescored = sp_pieces(18);
+        EXPECT_TRUE(write_file(path, sp_model(rescored, whitespace_only)));
+        set_mtime(path, 1000000001);
+        ReferenceSp rescored_reference(rescored, whitespace_only);
+        EXPECT_TRUE(mapped.load(path));
+        EXPECT_TRUE(mapped.mapped());
+        EXPECT_TRUE(read_file(path + ".flat") != before);
+        EXPECT_TRUE(mapped.encode(texts.back()) == rescored_reference.encode(texts.back()));
+        EXPECT_TRUE(mapped.encode(texts.back()) != reference.encode(texts.back()));
+
+        // One more piece, the mtime put back
+        std::vector<SpPiece> grown = sp_pieces(18, "\xE2\x96\x81membranes");
+        EXPECT_TRUE(write_file(path, sp_model(grown, whitespace_only)));
+        set_mtime(path, 1000000001);
+        EXPECT_TRUE(mapped.load(path));
+        EXPECT_EQ(mapped.vocab_size(), grown.size());
+        EXPECT_TRUE(mapped.piece_id("\xE2\x96\x81membranes") >= 0);
+        EXPECT_TRUE(mapped.encode(texts.back()) == ReferenceSp(grown, whitespace_only).encode(texts.back()));
+    }
+}
+
+// An fp16 value by its definition
+double half_value(uint16_t h) {
+    int exponent = (h >> 10) & 0x1f;
+    int mantissa = h & 0x3ff;
+    double sign = (h & 0x8000) != 0 ? -1.0 : 1.0;
+    if (exponent == 31) {
+        return mantissa != 0 ? NAN : sign * INFINITY;
+    }
+    if (exponent == 0) {
+        return sign * std::ldexp(mantissa, -24);
+    }
+    return sign * std::ldexp(1024 + mantissa, exponent - 25);
+}
+
+// The fp16 nearest to `value` by search over every finite half, ties to the
+// even one; past the largest half by half an ulp or more, infinity
+uint16_t nearest_half(float value) {
+    uint16_t sign = std::signbit(value) ? 0x8000 : 0;
+    double magnitude = std::fabs(static_cast<double>(value));
+    if (std::isnan(value)) {
+        return 0x7e00;
+    }
+    if (magnitude >= 65520.0) {
+        return static_cast<uint16_t>(sign | 0x7c00);
+    }
+    uint16_t lo = 0;
+    uint16_t hi = 0x7bff;
+    while (hi - lo > 1) {
+        uint16_t mid = static_cast<uint16_t>((lo + hi) / 2);
+        (half_value(mid) <= magnitude ? lo : hi) = mid;
+    }
+    double below = magnitude - half_value(lo);
+    double above = half_value(hi) - magnitude;
+    uint16_t pick = below < above ? lo : above < below ? hi : (lo & 1) == 0 ? lo : hi;
+    if (magnitude <= half_value(lo)) {
+        pick = lo;
+    }
+    return static_cast<uint16_t>(sign | pick);
+}
+
+// softmax(scale * q K^T) V over tokens [first, length) of one KV head, in double
+std::vector<double> naive_attention(const std::vector<float>& q, const std::vector<std::vector<float>>& k,
+                                    const std::vector<std::vector<float>>& v, int64_t first, float scale,
+                                    float softcap) {
+    std::vector<double> scores;
+    double peak = -INFINITY;
+    for (size_t t = static_cast<size_t>(first); t < k.size(); ++t) {
+        double score = 0.0;
+        for (size_t i = 0; i < q.size(); ++i) {
+            score += static_cast<double>(q[i]) * k[t][i];
+        }
+        score *= scale;
+        if (softcap > 0.0f) {
+            score = softcap * std::tanh(score / softcap);
+        }
+        scores.push_back(score);
+        peak = std::max(peak, score);
+    }
+    std::vector<double> out(q.size(), 0.0);
+    double sum = 0.0;
+    for (size_t j = 0; j < scores.size(); ++j) {
+        double p = std::exp(scores[j] - peak);
+        sum += p;
+        for (size_t i = 0; i < out.size(); ++i) {
+            out[i] += p * v[first + j][i];
+        }
+    }
+    for (double& x : out) {
+        x /= sum;
+    }
+    return out;
+}
+
+// decode() over linear page tables (pages shuffled) and, for a window, over
+// a ring that later tokens overwrote, against naive_attention: within fp16
+// rounding of the output, and the ring bit for bit the linear table's. Both
+// the generic instance and Gemma 2 2B's (two query heads per KV head, 256
+// wide) run, split across threads and not.
+void cpu_attention_paged_decode() {
+    struct Shape {
+        int heads, kv_heads, head_dim;
+        int64_t length, window;
+        float softcap;
+    };
+    const Shape shapes[] = {
+        {4, 2, 64, 1, 0, 0.0f},      {4, 2, 64, 37, 0, 0.0f},     {6, 2, 64, 700, 0, 0.0f},
+        {4, 2, 256, 700, 0, 50.0f},  {4, 2, 64, 700, 128, 0.0f},  {4, 2, 256, 700, 100, 50.0f},
+        {4, 2, 256, 90, 128, 0.0f},  {2, 1, 64, 1030, 17, 0.0f},
+    };
+    const int page_size = 16;
+    std::mt19937 rng(23);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    auto half_of = [&]() { return nearest_half(normal(rng)); };
+
+    for (const Shape& shape : shapes) {
+        const int d = shape.head_dim;
+        const int64_t pages = (shape.length + page_size - 1) / page_size;
+        const size_t page_values = static_cast<size_t>(shape.kv_heads) * page_size * d;
+        const float scale = 1.0f / std::sqrt(static_cast<float>(d));
+        std::vector<uint16_t> q(static_cast<size_t>(shape.heads) * d);
+        for (uint16_t& x : q) {
+            x = half_of();
+        }
+        // Every token's rows, per KV head, as floats and as fp16
+        std::vector<std::vector<std::vector<float>>> k_rows(shape.kv_heads), v_rows(shape.kv_heads);
+        std::vector<std::vector<std::vector<uint16_t>>> k_half(shape.kv_heads), v_half(shape.kv_heads);
+        for (int head = 0; head < shape.kv_heads; ++head) {
+            for (int64_t t = 0; t < shape.length; ++t) {
+                std::vector<uint16_t> kh(d), vh(d);
+                std::vector<float> kf(d), vf(d);
+                for (int i = 0; i < d; ++i) {
+                    kh[i] = half_of();
+                    vh[i] = half_of();
+                    kf[i] = static_cast<float>(half_value(kh[i]));
+                    vf[i] = static_cast<float>(half_value(vh[i]));
+                }
+                k_half[head].push_back(kh);
+                v_half[head].push_back(vh);
+                k_rows[head].push_back(kf);
+                v_rows[head].push_back(vf);
+            }
+        }
+        auto place = [&](std::vector<uint16_t>* k, std::vector<uint16_t>* v, int32_t page, int64_t t) {
+            for (int head = 0; head < shape.kv_heads; ++head) {
+                size_t at = ((static_cast<size_t>(page) * shape.kv_heads + head) * page_size + t % page_size) * d;
+                std::copy(k_half[head][t].begin(), k_half[head][t].end(), k->begin() + at);
+                std::copy(v_half[head][t].begin(), v_half[head][t].end(), v->begin() + at);
+            }
+        };
+
+        std::vector<int32_t> linear_table(pages);
+        std::iota(linear_table.begin(), linear_table.end(), 0);
+        std::shuffle(linear_table.begin(), linear_table.end(), rng);
+        std::vector<uint16_t> k_linear(pages * page_values), v_linear(pages * page_values);
+        for (int64_t t = 0; t < shape.length; ++t) {
+            place(&k_linear, &v_linear, linear_table[t / page_size], t);
+        }
+        cpu_attention::PagedKv kv;
+        kv.k = k_linear.data();
+        kv.v = v_linear.data();
+        kv.page_table = linear_table.data();
+        kv.length = shape.length;
+        kv.page_size = page_size;
+        kv.kv_heads = shape.kv_heads;
+        kv.head_dim = d;
+        kv.window = shape.window;
+
+        const int64_t first = shape.window > 0 ? std::max<int64_t>(0, shape.length - shape.window) : 0;
+        std::vector<uint16_t> out(q.size());
+        for (int threads : {1, 4}) {
+            EXPECT_TRUE(cpu_attention::decode(q.data(), shape.heads, kv, scale, shape.softcap, out.data(), threads));
+            for (int h = 0; h < shape.heads; ++h) {
+                int head = h / (shape.heads / shape.kv_heads);
+                std::vector<float> query(d);
+                for (int i = 0; i < d; ++i) {
+                    query[i] = static_cast<float>(half_value(q[h * d + i]));
+                }
+                std::vector<double> expected =
+                    naive_attention(query, k_rows[head], v_rows[head], first, scale, shape.softcap);
+                double worst = 0.0;
+                for (int i = 0; i < d; ++i) {
+                    double got = half_value(out[h * d + i]);
+                    worst = std::max(worst, std::fabs(got - expected[i]) / (1e-3 + std::fabs(expected[i])));
+                }
+                EXPECT_TRUE(worst < 2e-3);
+            }
+        }
+        if (shape.window == 0) {
+            continue;
+        }
+
+        // The ring: token t on ring[(t / page_size) % ring_pages], written in order so old pages are overwritten
+        const int64_t ring_pages = cpu_attention::ring_pages_for(shape.window, page_size);
+        std::vector<int32_t> ring(ring_pages);
+        std::iota(ring.begin(), ring.end(), 0);
+        std::shuffle(ring.begin(), ring.end(), rng);
+        std::vector<uint16_t> k_ring(ring_pages * page_values), v_ring(ring_pages * page_values);
+        for (int64_t t = 0; t < shape.length; ++t) {
+            place(&k_ring, &v_ring, ring[(t / page_size) % ring_pages], t);
+        }
+        cpu_attention::PagedKv ring_kv = kv;
+        ring_kv.k = k_ring.data();
+        ring_kv.v = v_ring.data();
+        ring_kv.page_table = ring.data();
+        ring_kv.ring_pages = ring_pages;
+        std::vector<uint16_t> ring_out(q.size());
+        EXPECT_TRUE(cpu_attention::decode(q.data(), shape.heads, ring_kv, scale, shape.softcap, ring_out.data(), 4));
+        EXPECT_TRUE(ring_out == out);
+        ring_kv.ring_pages = ring_pages - 1;  // too short for the window
+        EXPECT_TRUE(!cpu_attention::decode(q.data(), shape.heads, ring_kv, scale, shape.softcap, ring_out.data()));
+    }
+}
+
+// prefill() on both of its paths against x times the dequantized weight in
+// double. Under kMinTokens the fp32 path only rounds its output to fp16; at
+// kMinTokens and over, the W4A8 kernel (whichever this CPU runs) may also be
+// off by each group's activation rounding, at most half a step of max |x| / 127
+// per value, times that group's |w|; against activations rounded that way in
+// the reference as well, it is as close as the fp32 path.
+void cpu_matmul_prefill() {
+    struct Shape {
+        int64_t tokens, rows, k;
+        int group_size;
+    };
+    const Shape shapes[] = {
+        {1, 5, 64, 32}, {7, 37, 256, 32}, {8, 37, 256, 32}, {13, 70, 512, 32}, {9, 16, 256, 128}, {33, 3, 96, 32},
+    };
+    std::mt19937 rng(29);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::uniform_int_distribution<uint32_t> word;
+    std::uniform_real_distribution<float> scale_of(0.001f, 0.05f);
+
+    for (const Shape& shape : shapes) {
+        const int64_t groups = shape.k / shape.group_size;
+        std::vector<uint16_t> x(shape.tokens * shape.k);
+        for (uint16_t& h : x) {
+            h = nearest_half(normal(rng));
+        }
+        x[3] = nearest_half(40.0f);  // one outlier, so a group's step is coarse
+        std::vector<uint32_t> q_weight(shape.rows * shape.k / 8);
+        for (uint32_t& w : q_weight) {
+            w = word(rng);
+        }
+        std::vector<uint16_t> q_scale(shape.rows * groups);
+        for (uint16_t& h : q_scale) {
+            h = nearest_half(scale_of(rng));
+        }
+        auto weight_at = [&](int64_t row, int64_t i) {
+            uint32_t q = (q_weight[(row * shape.k + i) / 8] >> (4 * (i % 8))) & 0xf;
+            return (static_cast<double>(q) - 7.0) * half_value(q_scale[row * groups + i / shape.group_size]);
+        };
+
+        cpu_matmul::QuantizedWeight weight;
+        weight.q_weight = q_weight.data();
+        weight.q_scale = q_scale.data();
+        weight.rows = shape.rows;
+        weight.k = shape.k;
+        weight.group_size = shape.group_size;
+        std::vector<uint16_t> out(shape.tokens * shape.rows);
+        EXPECT_TRUE(cpu_matmul::prefill(x.data(), shape.tokens, weight, out.data(), 3));
+
+        const bool quantized = shape.tokens >= cpu_matmul::kMinTokens;
+        int bad = 0;
+        for (int64_t t = 0; t < shape.tokens; ++t) {
+            for (int64_t row = 0; row < shape.rows; ++row) {
+                double expected = 0.0;
+                double rounded = 0.0;  // with the activations rounded to int8 as the kernel does
+                double slack = 0.0;
+                for (int64_t g = 0; g < groups; ++g) {
+                    double peak = 0.0;
+                    double weight_sum = 0.0;
+                    std::vector<double> xs(shape.group_size);
+                    for (int i = 0; i < shape.group_size; ++i) {
+                        xs[i] = half_value(x[t * shape.k + g * shape.group_size + i]);
+                        peak = std::max(peak, std::fabs(xs[i]));
+                    }
+                    float inv = peak > 0.0 ? 127.0f / static_cast<float>(peak) : 0.0f;
+                    for (int i = 0; i < shape.group_size; ++i) {
+                        double w = weight_at(row, g * shape.group_size + i);
+                        expected += xs[i] * w;
+                        rounded += std::nearbyint(static_cast<float>(xs[i]) * inv) * (peak / 127.0) * w;
+                        weight_sum += std::fabs(w);
+                        slack += 1e-6 * std::fabs(xs[i] * w);  // fp32 accumulation
+                    }
+                    if (quantized) {
+                        slack += 0.5 * peak / 127.0 * weight_sum;
+                    }
+                }
+                double got = half_value(out[t * shape.rows + row]);
+                double tolerance = slack + std::fabs(expected) / 1024.0 + 1e-7;  // plus fp16 rounding
+                bad += std::fabs(got - expected) > tolerance ? 1 : 0;
+                if (quantized) {
+                    bad += std::fabs(got - rounded) > std::fabs(rounded) / 1024.0 + 1e-4 ? 1 : 0;
+                }
+            }
+        }
+        EXPECT_EQ(bad, 0);
+    }
+
+    cpu_matmul::QuantizedWeight ragged;  // k not a whole number of groups
+    std::vector<uint32_t> q_weight(8);
+    std::vector<uint16_t> q_scale(2), x(40), out(1);
+    ragged.q_weight = q_weight.data();
+    ragged.q_scale = q_scale.data();
+    ragged.rows = 1;
+    ragged.k = 40;
+    EXPECT_TRUE(!cpu_matmul::prefill(x.data(), 1, ragged, out.data()));
+}
+
+// The distribution a sampler configured so should draw from, done the plain
+// way: each distinct history id penalized once, blocked and out-of-mask rows
+// dropped, a softmax at the temperature, and the nucleus as the most probable
+// tokens until top_p of the mass is covered. Greedy is the first argmax.
+std::vector<double> reference_sampler(const std::vector<float>& logits, float temperature, float top_p,
+                                      float penalty, const std::vector<int>& history, const uint64_t* mask,
+                                      size_t mask_words) {
+    const size_t n = logits.size();
+    std::vector<double> values(n, -INFINITY);
+    for (size_t i = 0; i < n; ++i) {
+        bool in_mask = mask == nullptr || (i < mask_words * 64 && (mask[i / 64] >> (i % 64) & 1) != 0);
+        if (in_mask) {
+            values[i] = logits[i];
+        }
+    }
+    std::vector<bool> seen(n, false);
+    for (int id : history) {
+        if (id >= 0 && static_cast<size_t>(id) < n && !seen[id] && values[id] != -INFINITY) {
+            seen[id] = true;
+            values[id] = values[id] > 0.0 ? values[id] / penalty : values[id] * penalty;
+        }
+    }
+    std::vector<double> probs(n, 0.0);
+    size_t best = std::max_element(values.begin(), values.end()) - values.begin();
+    if (values[best] == -INFINITY) {
+        return probs;
+    }
+    if (temperature <= 0.0f) {
+        probs[best] = 1.0;
+        return probs;
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        probs[i] = std::exp((values[i] - values[best]) / temperature);
+        sum += probs[i];
+    }
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return probs[a] > probs[b]; });
+    double kept = 0.0;
+    size_t cut = 0;
+    while (cut < n && (top_p >= 1.0f || kept < top_p * sum)) {
+        kept += probs[order[cut++]];
+    }
+    for (size_t j = cut; j < n; ++j) {
+        probs[order[j]] = 0.0;
+    }
+    for (double& p : probs) {
+        p /= kept;
+    }
+    return probs;
+}
+
+// Every variant configure() picks (greedy or not, nucleus or not, penalty or
+// not) through sample() and sample_masked() over `logits`, against
+// reference_sampler(), with fixed seeds: greedy exactly, sampling by what it
+// may draw and by how often (total variation over 20000 draws). A full mask
+// must draw bit for bit what sample() does; masked greedy must pick what
+// sample() picks over a copy of the row with the blocked logits at -inf; a
+// mask allowing nothing gives -1.
+void check_sampler_row(const std::vector<float>& logits, const std::vector<uint64_t>& mask,
+                       const std::vector<int>& history) {
+    const size_t vocab = logits.size();
+    const size_t mask_words = mask.size();
+    std::vector<float> masked_copy(logits);
+    for (size_t i = 0; i < vocab; ++i) {
+        if (i >= mask_words * 64 || (mask[i / 64] >> (i % 64) & 1) == 0) {
+            masked_copy[i] = -INFINITY;
+        }
+    }
+    const std::vector<uint64_t> full(mask_words + 1, ~0ull);
+    const std::vector<uint64_t> none(mask_words, 0ull);
+
+    struct Config {
+        float temperature, top_p, penalty;
+    };
+    const Config configs[] = {
+        {0.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 1.3f}, {0.9f, 1.0f, 1.0f},
+        {0.9f, 1.0f, 1.3f}, {0.9f, 0.8f, 1.0f}, {1.2f, 0.6f, 1.3f},
+    };
+    const int draws = 20000;
+    for (const Config& config : configs) {
+        for (bool penalized_history : {false, true}) {
+            const std::vector<int> used = penalized_history ? history : std::vector<int>();
+            for (bool masked : {false, true}) {
+                LogitSampler sampler;
+                sampler.configure(config.temperature, config.top_p, config.penalty);
+                sampler.seed(7);
+                std::vector<double> expected = reference_sampler(logits, config.temperature, config.top_p,
+                                                                 config.penalty, used,
+                                                                 masked ? mask.data() : nullptr, mask_words);
+                auto draw = [&]() {
+                    return masked ? sampler.sample_masked(logits.data(), vocab, mask.data(), mask_words,
+                                                          used.data(), used.size())
+                                  : sampler.sample(logits.data(), vocab, used.data(), used.size());
+                };
+                if (sampler.greedy()) {
+                    int token = draw();
+                    EXPECT_TRUE(token >= 0 && expected[token] == 1.0);
+                    continue;
+                }
+                std::vector<double> seen(vocab, 0.0);
+                int outside = 0;
+                for (int i = 0; i < draws; ++i) {
+                    int token = draw();
+                    if (token < 0 || static_cast<size_t>(token) >= vocab || expected[token] == 0.0) {
+                        ++outside;
+                        continue;
+                    }
+                    seen[token] += 1.0 / draws;
+                }
+                double distance = 0.0;
+                for (size_t i = 0; i < vocab; ++i) {
+                    distance += std::fabs(seen[i] - expected[i]) / 2.0;
+                }
+                EXPECT_EQ(outside, 0);
+                EXPECT_TRUE(distance < 0.03);
+            }
+
+            // A full mask draws what sample() draws
+            LogitSampler plain, all;
+            plain.configure(config.temperature, config.top_p, config.penalty);
+            all.configure(config.temperature, config.top_p, config.penalty);
+            plain.seed(11);
+            all.seed(11);
+            int differ = 0;
+            for (int i = 0; i < 2000; ++i) {
+                int a = plain.sample(logits.data(), vocab, used.data(), used.size());
+                int b = all.sample_masked(logits.data(), vocab, full.data(), full.size(), used.data(), used.size());
+                differ += a != b ? 1 : 0;
+            }
+            EXPECT_EQ(differ, 0);
+
+            // Masked greedy is greedy over a masked copy; nothing allowed is -1
+            LogitSampler greedy;
+            greedy.configure(0.0f, config.top_p, config.penalty);
+            EXPECT_EQ(greedy.sample_masked(logits.data(), vocab, mask.data(), mask_words, used.data(), used.size()),
+                      greedy.sample(masked_copy.data(), vocab, used.data(), used.size()));
+            LogitSampler nothing;
+            nothing.configure(config.temperature, config.top_p, config.penalty);
+            EXPECT_EQ(nothing.sample_masked(logits.data(), vocab, none.data(), none.size(), used.data(), used.size()),
+                      -1);
+        }
+    }
+}
+
+// check_sampler_row() over a row whose mask blocks runs across the 64-wide
+// word boundaries, a whole word, the row's maximum and part of the history,
+// and is one word short of the row; then over the same row shifted negative,
+// where the penalty multiplies instead of dividing. The allowed maximum is in
+// the history, so penalized greedy rescans, and loses to a blocked logit if
+// the rescan ignores the mask.
+void logit_sampler_variants() {
+    const size_t vocab = 330;
+    const size_t mask_words = 5;  // rows 320.. are past the mask
+    std::mt19937 rng(31);
+    std::normal_distribution<float> normal(0.0f, 1.5f);
+    std::vector<float> logits(vocab);
+    for (float& x : logits) {
+        x = std::min(normal(rng), 3.0f);
+    }
+    logits[70] = 9.0f;   // the raw maximum, blocked, in history
+    logits[60] = 5.5f;   // blocked
+    logits[100] = 4.0f;  // the allowed maximum, in history
+    logits[325] = 8.0f;  // past the mask
+    std::vector<uint64_t> mask(mask_words, ~0ull);
+    auto block = [&](size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            mask[i / 64] &= ~(1ull << (i % 64));
+        }
+    };
+    block(50, 80);    // across 64
+    block(120, 200);  // across 128, all of word 2, across 192
+    block(255, 257);  // across 256
+    for (size_t i = 0; i < 320; i += 7) {
+        block(i, i + 1);
+    }
+    const std::vector<int> history = {100, 3, 70, 100, 64, 190, 3, 319, 329, -1, 5000};
+    check_sampler_row(logits, mask, history);
+    for (float& x : logits) {
+        x -= 10.0f;
+    }
+    check_sampler_row(logits, mask, history);
+}
+
+// text_embedding's float_to_half against nearest_half(): every half back from
+// its float exactly (signed zeros, subnormals, infinities), the midpoints
+// between neighbours to the even one and a float ulp either side to the
+// nearer, the overflow to infinity at 65520, underflow to zero below 2^-25,
+// NaN to a NaN, and random floats over the whole range; then pack_row's fp16
+// rows as those halves, little-endian.
+void text_embedding_fp16_pack() {
+    auto as_float = [](uint32_t bits) {
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    };
+    int wrong = 0;
+    for (uint32_t h = 0; h < 0x10000; ++h) {
+        if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0) {
+            continue;  // NaN
+        }
+        float value = static_cast<float>(half_value(static_cast<uint16_t>(h)));
+        wrong += text_embedding::float_to_half(value) != h ? 1 : 0;
+        if ((h & 0x7fff) >= 0x7bff) {
+            continue;  // no finite neighbour above
+        }
+        float next = static_cast<float>(half_value(static_cast<uint16_t>(h + 1)));
+        float midpoint = (value + next) / 2.0f;  // exact: halves are floats with bits to spare
+        for (float probe : {midpoint, std::nextafter(midpoint, 0.0f), std::nextafter(midpoint, 2.0f * next)}) {
+            wrong += text_embedding::float_to_half(probe) != nearest_half(probe) ? 1 : 0;
+        }
+        wrong += (text_embedding::float_to_half(midpoint) & 1) != 0 ? 1 : 0;
+    }
+    EXPECT_EQ(wrong, 0);
+
+    EXPECT_EQ(text_embedding::float_to_half(65504.0f), 0x7bff);
+    EXPECT_EQ(text_embedding::float_to_half(std::nextafter(65520.0f, 0.0f)), 0x7bff);
+    EXPECT_EQ(text_embedding::float_to_half(65520.0f), 0x7c00);
+    EXPECT_EQ(text_embedding::float_to_half(-1e30f), 0xfc00);
+    EXPECT_EQ(text_embedding::float_to_half(INFINITY), 0x7c00);
+    EXPECT_EQ(text_embedding::float_to_half(-INFINITY), 0xfc00);
+    EXPECT_EQ(text_embedding::float_to_half(std::ldexp(1.0f, -24)), 0x0001);
+    EXPECT_EQ(text_embedding::float_to_half(std::ldexp(1.0f, -25)), 0x0000);
+    EXPECT_EQ(text_embedding::float_to_half(std::nextafter(std::ldexp(1.0f, -25), 1.0f)), 0x0001);
+    EXPECT_EQ(text_embedding::float_to_half(-std::ldexp(1.0f, -26)), 0x8000);
+    EXPECT_EQ(text_embedding::float_to_half(std::ldexp(1.0f, -14)), 0x0400);
+    EXPECT_EQ(text_embedding::float_to_half(std::nextafter(std::ldexp(1.0f, -14), 0.0f)), 0x0400);
+    EXPECT_EQ(text_embedding::float_to_half(as_float(0x00000001)), 0x0000);
+    EXPECT_EQ(text_embedding::float_to_half(-0.0f), 0x8000);
+    uint16_t nan = text_embedding::float_to_half(NAN);
+    EXPECT_TRUE((nan & 0x7c00) == 0x7c00 && (nan & 0x3ff) != 0);
+    nan = text_embedding::float_to_half(as_float(0xff800001u));  // a signalling NaN, whose top bits are clear
+    EXPECT_TRUE((nan & 0x7c00) == 0x7c00 && (nan & 0x3ff) != 0);
+
+    std::mt19937 rng(41);
+    std::vector<float> row;
+    while (row.size() < 200000) {
+        float value = as_float(static_cast<uint32_t>(rng()));
+        if (!std::isnan(value)) {
+            row.push_back(value);
+        }
+    }
+    std::vector<uint8_t> packed(text_embedding::packed_row_bytes(kEmbedFloat16, row.size()));
+    text_embedding::pack_row(row.data(), row.size(), kEmbedFloat16, packed.data());
+    wrong = 0;
+    for (size_t i = 0; i < row.size(); ++i) {
+        uint16_t half = static_cast<uint16_t>(packed[2 * i] | packed[2 * i + 1] << 8);
+        wrong += half != nearest_half(row[i]) ? 1 : 0;
+    }
+    EXPECT_EQ(wrong, 0);
+}
+
+std::string sha256_hex(const std::string& bytes) {
+    sha256::Hasher hasher;
+    hasher.update(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+    return hasher.hex_digest();
+}
+
+// Digests as sha256sum and Python's hashlib and hmac give them (FIPS 180-2 and
+// RFC 4231 vectors among them), from one update, from uneven pieces across
+// the block boundaries, and from files through hash_file() and hash_files(),
+// one larger than hash_file()'s chunk.
+void sha256_known_vectors() {
+    struct Vector {
+        std::string message, digest;
+    };
+    const Vector vectors[] = {
+        {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+         "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+        {std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+    };
+    for (const Vector& vector : vectors) {
+        EXPECT_EQ(sha256_hex(vector.message), vector.digest);
+        sha256::Hasher pieces;
+        size_t at = 0;
+        for (size_t step : {1, 63, 64, 65, 7, 128}) {
+            size_t take = std::min(step, vector.message.size() - at);
+            pieces.update(reinterpret_cast<const uint8_t*>(vector.message.data()) + at, take);
+            at += take;
+        }
+        pieces.update(reinterpret_cast<const uint8_t*>(vector.message.data()) + at, vector.message.size() - at);
+        EXPECT_EQ(pieces.hex_digest(), vector.digest);
+    }
+
+    EXPECT_EQ(sha256::hmac_hex(std::string(20, '\x0b'), "Hi There"),
+              "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7");
+    EXPECT_EQ(sha256::hmac_hex("Jefe", "what do ya want for nothing?"),
+              "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+    EXPECT_EQ(sha256::hmac_hex(std::string(131, '\xaa'), "Test Using Larger Than Block-Size Key - Hash Key First"),
+              "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54");
+    EXPECT_EQ(sha256::hmac_hex(std::string(64, 'k'), "exactly one block of key"),
+              "baa93ea4ccc7062ed6870c5e7937dbd35ad7791df4e29df9addeb429ff491acf");
+
+    ScratchDir dir;
+    std::string large((4 << 20) + 3, '\0');
+    for (size_t i = 0; i < large.size(); ++i) {
+        large[i] = static_cast<char>((i * 31 + 7) % 251);
+    }
+    std::vector<std::string> paths = {dir.path() + "/empty", dir.path() + "/abc", dir.path() + "/large",
+                                      dir.path() + "/missing"};
+    EXPECT_TRUE(write_file(paths[0], ""));
+    EXPECT_TRUE(write_file(paths[1], "abc"));
+    EXPECT_TRUE(write_file(paths[2], large));
+    const std::vector<std::string> expected = {
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        "fd8f7c1ab7be070416f8916f9a7463bd0e1af958a523ee3bc1392e7293e8e15f",
+        "",
+    };
+    std::atomic<uint64_t> done{0};
+    for (size_t i = 0; i < paths.size(); ++i) {
+        EXPECT_EQ(sha256::hash_file(paths[i], &done), expected[i]);
+    }
+    EXPECT_EQ(done.load(), large.size() + 3);
+    uint64_t last_done = 0;
+    uint64_t last_total = 0;
+    std::vector<std::string> digests = sha256::hash_files(paths, [&](uint64_t now, uint64_t total) {
+        last_done = now;
+        last_total = total;
+    }, 1);
+    EXPECT_TRUE(digests == expected);
+    EXPECT_EQ(last_done, large.size() + 3);
+    EXPECT_EQ(last_total, last_done);
+    EXPECT_EQ(read_file(paths[2]), large);  // evicting the cache leaves the file alone
+}
+
+// A continuation set before the result runs where it is settled, through the
+// ready queue when one is given; one set after runs right away
+void engine_async_then() {
+    using namespace engine_async;
+    ReadyQueue queue;
+    Promise<int> early;
+    int seen = 0;
+    early.future().then([&](const Result<int>& r) { seen = r.ok ? r.value : -1; });
+    EXPECT_TRUE(early.resolve(7, &queue));
+    EXPECT_EQ(seen, 0);
+    EXPECT_EQ(queue.run(), 1u);
+    EXPECT_EQ(seen, 7);
+    EXPECT_TRUE(!early.resolve(8));  // the first settle wins
+
+    Promise<int> late;
+    late.fail("no");
+    std::string error;
+    late.future().then([&](const Result<int>& r) { error = r.ok ? "" : r.error; });
+    EXPECT_EQ(error, std::string("no"));
+}
+
+// next_tokens() waits for as many pieces as asked, a pending read gets what
+// was produced when the generation ends, and reads after the end are ""
+void engine_async_generation_reads() {
+    using namespace engine_async;
+    Generation generation(nullptr);
+    std::vector<std::string> reads;
+    auto read = [&](size_t pieces) {
+        generation.next_tokens(pieces).then([&](const Result<std::string>& r) {
+            reads.push_back(r.ok ? r.value : "error: " + r.error);
+        });
+    };
+    uint64_t prompt_tokens = 0;
+    generation.prefill().then([&](const Result<uint64_t>& r) { prompt_tokens = r.value; });
+    generation.prefilled(true, 12);
+    EXPECT_EQ(prompt_tokens, 12u);
+
+    read(2);
+    generation.text("a");
+    EXPECT_TRUE(reads.empty());
+    generation.text("b");
+    generation.text("c");
+    read(1);
+    read(5);
+    generation.finish(true, "");
+    read(1);
+    std::vector<std::string> expected = {"ab", "c", "", ""};
+    EXPECT_TRUE(reads == expected);
+
+    Generation failed(nullptr);
+    std::string prefill_error;
+    failed.prefill().then([&](const Result<uint64_t>& r) { prefill_error = r.error; });
+    reads.clear();
+    failed.next_tokens(1).then([&](const Result<std::string>& r) { reads.push_back(r.ok ? r.value : r.error); });
+    failed.finish(false, "out of memory");
+    EXPECT_EQ(prefill_error, std::string("out of memory"));
+    EXPECT_TRUE(reads == std::vector<std::string>{"out of memory"});
+}
+
+#if ENGINE_ASYNC_COROUTINES
+// Runs to its first co_await and is resumed by whoever settles the future
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+Detached read_twice(engine_async::Generation* generation, std::vector<std::string>* out) {
+    engine_async::Result<std::string> first = co_await generation->next_tokens(2);
+    out->push_back(first.value);
+    engine_async::Result<std::string> second = co_await generation->next_tokens(1);
+    out->push_back(second.ok ? second.value : second.error);
+}
+
+// co_await resumes on the executor's ready queue, like a continuation
+void engine_async_co_await() {
+    engine_async::ReadyQueue queue;
+    engine_async::Generation generation(&queue);
+    std::vector<std::string> reads;
+    read_twice(&generation, &reads);
+    generation.text("x");
+    generation.text("y");
+    EXPECT_TRUE(reads.empty());
+    queue.run();
+    EXPECT_TRUE(reads == std::vector<std::string>{"xy"});
+    generation.text("z");
+    queue.run();
+    EXPECT_TRUE((reads == std::vector<std::string>{"xy", "z"}));
+}
+#endif
+
+void register_cases() {
+    cases().push_back({"memory_forecast/room_under_pressure", memory_forecast_room_under_pressure});
+    cases().push_back({"memory_forecast/room_by_share", memory_forecast_room_by_share});
+    cases().push_back({"document_summary/split_covers", document_summary_split_covers});
+    cases().push_back({"document_summary/split_anchored", document_summary_split_anchored});
+    cases().push_back({"weight_delta/apply", weight_delta_apply});
+    cases().push_back({"weight_delta/damaged", weight_delta_damaged});
+    cases().push_back({"weight_delta/recover", weight_delta_recover});
+    cases().push_back({"kv_offload/round_trip", kv_offload_round_trip});
+    cases().push_back({"kv_offload/stage_buffer", kv_offload_stage_buffer});
+    cases().push_back({"sp_tokenizer/encode_parallel", sp_tokenizer_encode_parallel});
+    cases().push_back({"sp_tokenizer/flat_image", sp_tokenizer_flat_image});
+    cases().push_back({"sp_tokenizer/memo", sp_tokenizer_memo});
+    cases().push_back({"cpu_attention/paged_decode", cpu_attention_paged_decode});
+    cases().push_back({"cpu_matmul/prefill", cpu_matmul_prefill});
+    cases().push_back({"logit_sampler/variants", logit_sampler_variants});
+    cases().push_back({"text_embedding/fp16_pack", text_embedding_fp16_pack});
+    cases().push_back({"sha256/known_vectors", sha256_known_vectors});
+    cases().push_back({"engine_async/then", engine_async_then});
+    cases().push_back({"engine_async/generation_reads", engine_async_generation_reads});
+#if ENGINE_ASYNC_COROUTINES
+    cases().push_back({"engine_async/co_await", engine_async_co_await});
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string filter;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: host_tests [--filter SUBSTRING]\n");
+            return 2;
+        }
+    }
+    register_cases();
+    int failed = 0;
+    for (const Case& test : cases()) {
+        if (!filter.empty() && std::string(test.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        failures().clear();
+        test.body();
+        if (failures().empty()) {
+            printf("ok %s\n", test.name);
+            continue;
+        }
+        failed++;
+        for (const std::string& failure : failures()) {
+            printf("FAILED %s: %s\n", test.name, failure.c_str());
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,398 @@
+#include "image_preprocess.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace image_preprocess {
+
+namespace {
+
+constexpr int kMaxSide = 8192;
+
+// BT.601 full range in 6-bit fixed point; every intermediate fits int16
+constexpr int kRv = 90;   // 1.402
+constexpr int kGu = 22;   // 0.344
+constexpr int kGv = 46;   // 0.714
+constexpr int kBu = 113;  // 1.772
+
+struct Scratch {
+    std::vector<uint8_t> y, u, v, rotated, rgb;
+    std::vector<uint16_t> row0, row1;
+    std::vector<int32_t> x0, x1;
+    std::vector<uint16_t> wx;
+};
+
+// One plane and the part of it sampled, in the plane's own pixels
+struct Plane {
+    const uint8_t* data;
+    int row_stride;
+    int pixel_stride;
+    int width;
+    int height;
+    float crop_x, crop_y, crop_width, crop_height;
+};
+
+// Source index and upper weight (of 256) of `out` pixel centers over `size`
+// pixels starting at `origin`, `count` samples in all
+void sample_positions(float origin, float size, int count, int limit, int32_t* lower, int32_t* upper,
+                      uint16_t* weight) {
+    float step = size / static_cast<float>(count);
+    for (int i = 0; i < count; ++i) {
+        float at = origin + (static_cast<float>(i) + 0.5f) * step - 0.5f;
+        at = std::min(std::max(at, 0.0f), static_cast<float>(limit - 1));
+        int base = static_cast<int>(at);
+        lower[i] = base;
+        upper[i] = std::min(base + 1, limit - 1);
+        weight[i] = static_cast<uint16_t>(std::lround((at - static_cast<float>(base)) * 256.0f));
+    }
+}
+
+// Row `row` of `plane` blended along x: lerp * 256, at most 65280
+void horizontal(const Plane& plane, int row, const Scratch& s, int count, uint16_t* out) {
+    const uint8_t* src = plane.data + static_cast<size_t>(row) * plane.row_stride;
+    for (int i = 0; i < count; ++i) {
+        uint32_t a = src[s.x0[i]];
+        uint32_t b = src[s.x1[i]];
+        out[i] = static_cast<uint16_t>(a * (256u - s.wx[i]) + b * s.wx[i]);
+    }
+}
+
+// (row0 * (256 - fy) + row1 * fy) / 65536, rounded
+void vertical(const uint16_t* row0, const uint16_t* row1, uint32_t fy, int count, uint8_t* out) {
+    int i = 0;
+#if defined(__ARM_NEON)
+    uint16_t w0 = static_cast<uint16_t>(256u - fy);
+    uint16_t w1 = static_cast<uint16_t>(fy);
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t a = vld1q_u16(row0 + i);
+        uint16x8_t b = vld1q_u16(row1 + i);
+        uint32x4_t lo = vmlal_n_u16(vmull_n_u16(vget_low_u16(a), w0), vget_low_u16(b), w1);
+        uint32x4_t hi = vmlal_n_u16(vmull_n_u16(vget_high_u16(a), w0), vget_high_u16(b), w1);
+        uint16x8_t sum = vcombine_u16(vrshrn_n_u32(lo, 16), vrshrn_n_u32(hi, 16));
+        vst1_u8(out + i, vqmovn_u16(sum));
+    }
+#endif
+    for (; i < count; ++i) {
+        uint32_t sum = row0[i] * (256u - fy) + row1[i] * fy;
+        out[i] = static_cast<uint8_t>(std::min<uint32_t>((sum + 32768u) >> 16, 255u));
+    }
+}
+
+// Bilinear resize of the plane's crop to `width` x `height` in `out`
+void resize(const Plane& plane, int width, int height, uint8_t* out, Scratch& s) {
+    s.x0.resize(width);
+    s.x1.resize(width);
+    s.wx.resize(width);
+    s.row0.resize(width);
+    s.row1.resize(width);
+    sample_positions(plane.crop_x, plane.crop_width, width, plane.width, s.x0.data(), s.x1.data(), s.wx.data());
+    for (int i = 0; i < width; ++i) {
+        s.x0[i] *= plane.pixel_stride;
+        s.x1[i] *= plane.pixel_stride;
+    }
+    // The two source rows last blended, reused while consecutive outputs share them
+    int tag0 = -1;
+    int tag1 = -1;
+    float step = plane.crop_height / static_cast<float>(height);
+    for (int row = 0; row < height; ++row) {
+        float at = plane.crop_y + (static_cast<float>(row) + 0.5f) * step - 0.5f;
+        at = std::min(std::max(at, 0.0f), static_cast<float>(plane.height - 1));
+        int y0 = static_cast<int>(at);
+        int y1 = std::min(y0 + 1, plane.height - 1);
+        uint32_t fy = static_cast<uint32_t>(std::lround((at - static_cast<float>(y0)) * 256.0f));
+        if (tag0 != y0) {
+            if (tag1 == y0) {
+                std::swap(s.row0, s.row1);
+                std::swap(tag0, tag1);
+            } else {
+                horizontal(plane, y0, s, width, s.row0.data());
+                tag0 = y0;
+            }
+        }
+        if (tag1 != y1) {
+            horizontal(plane, y1, s, width, s.row1.data());
+            tag1 = y1;
+        }
+        vertical(s.row0.data(), s.row1.data(), fy, width, out + static_cast<size_t>(row) * width);
+    }
+}
+
+// `src` (width x height) turned `rotation` degrees clockwise into `dst`
+void rotate(const uint8_t* src, int width, int height, int rotation, uint8_t* dst) {
+    if (rotation == 0) {
+        memcpy(dst, src, static_cast<size_t>(width) * height);
+        return;
+    }
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* row = src + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; ++x) {
+            size_t at;
+            if (rotation == 90) {
+                at = static_cast<size_t>(x) * height + (height - 1 - y);
+            } else if (rotation == 180) {
+                at = static_cast<size_t>(height - 1 - y) * width + (width - 1 - x);
+            } else {
+                at = static_cast<size_t>(width - 1 - x) * height + y;
+            }
+            dst[at] = row[x];
+        }
+    }
+}
+
+// Resize to the output's `width` x `height` (after rotation) and rotate into `dst`
+void resize_rotated(const Plane& plane, int width, int height, int rotation, uint8_t* dst, Scratch& s) {
+    bool turned = rotation == 90 || rotation == 270;
+    int source_width = turned ? height : width;
+    int source_height = turned ? width : height;
+    if (rotation == 0) {
+        resize(plane, width, height, dst, s);
+        return;
+    }
+    s.rotated.resize(static_cast<size_t>(width) * height);
+    resize(plane, source_width, source_height, s.rotated.data(), s);
+    rotate(s.rotated.data(), source_width, source_height, rotation, dst);
+}
+
+inline uint8_t clamp_shift(int value) {
+    return static_cast<uint8_t>(std::min(std::max((value + 32) >> 6, 0), 255));
+}
+
+// Full-size Y, U and V to packed RGB
+void yuv_to_rgb(const uint8_t* y, const uint8_t* u, const uint8_t* v, size_t count, uint8_t* rgb) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    uint8x8_t bias = vdup_n_u8(128);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t luma = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(y + i), 6));
+        int16x8_t cb = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + i), bias));
+        int16x8_t cr = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + i), bias));
+        uint8x8x3_t px;
+        px.val[0] = vqrshrun_n_s16(vmlaq_n_s16(luma, cr, kRv), 6);
+        px.val[1] = vqrshrun_n_s16(vmlsq_n_s16(vmlsq_n_s16(luma, cb, kGu), cr, kGv), 6);
+        px.val[2] = vqrshrun_n_s16(vmlaq_n_s16(luma, cb, kBu), 6);
+        vst3_u8(rgb + 3 * i, px);
+    }
+#endif
+    for (; i < count; ++i) {
+        int luma = y[i] << 6;
+        int cb = u[i] - 128;
+        int cr = v[i] - 128;
+        rgb[3 * i] = clamp_shift(luma + kRv * cr);
+        rgb[3 * i + 1] = clamp_shift(luma - kGu * cb - kGv * cr);
+        rgb[3 * i + 2] = clamp_shift(luma + kBu * cb);
+    }
+}
+
+// Packed RGB to float, value * scale[c] + bias[c] per channel
+void normalize(const uint8_t* rgb, size_t count, const float* scale, const float* bias, float* out) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    float32x4_t s[3];
+    float32x4_t b[3];
+    for (int c = 0; c < 3; ++c) {
+        s[c] = vdupq_n_f32(scale[c]);
+        b[c] = vdupq_n_f32(bias[c]);
+    }
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x3_t px = vld3_u8(rgb + 3 * i);
+        float32x4x3_t lo;
+        float32x4x3_t hi;
+        for (int c = 0; c < 3; ++c) {
+            uint16x8_t wide = vmovl_u8(px.val[c]);
+            lo.val[c] = vmlaq_f32(b[c], vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide))), s[c]);
+            hi.val[c] = vmlaq_f32(b[c], vcvtq_f32_u32(vmovl_u16(vget_high_u16(wide))), s[c]);
+        }
+        vst3q_f32(out + 3 * i, lo);
+        vst3q_f32(out + 3 * i + 12, hi);
+    }
+#endif
+    for (; i < count; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            out[3 * i + c] = bias[c] + static_cast<float>(rgb[3 * i + c]) * scale[c];
+        }
+    }
+}
+
+// Sum of `count` bytes
+uint32_t sum_bytes(const uint8_t* p, int count) {
+    int i = 0;
+    uint32_t sum = 0;
+#if defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= count; i += 16) {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(p + i)));
+    }
+    sum = vaddvq_u32(acc);
+#endif
+    for (; i < count; ++i) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+bool luma_fits(const YuvImage& image) {
+    if (image.y == nullptr || image.width <= 0 || image.height <= 0 || image.width > kMaxSide ||
+        image.height > kMaxSide || image.y_row_stride < image.width) {
+        return false;
+    }
+    return static_cast<size_t>(image.height - 1) * image.y_row_stride + image.width <= image.y_size;
+}
+
+// The crop of `options` over `image`, whole frame for a zero size; false if outside the frame
+bool crop_of(const YuvImage& image, const Options& options, int* width, int* height) {
+    *width = options.crop_width > 0 ? options.crop_width : image.width;
+    *height = options.crop_height > 0 ? options.crop_height : image.height;
+    return options.crop_x >= 0 && options.crop_y >= 0 && options.crop_x + *width <= image.width &&
+           options.crop_y + *height <= image.height;
+}
+
+bool planes_fit(const YuvImage& image) {
+    if (!luma_fits(image) || image.u == nullptr || image.v == nullptr || image.uv_pixel_stride < 1) {
+        return false;
+    }
+    size_t chroma_width = static_cast<size_t>(image.width + 1) / 2;
+    size_t chroma_height = static_cast<size_t>(image.height + 1) / 2;
+    size_t chroma_row = (chroma_width - 1) * image.uv_pixel_stride + 1;
+    if (static_cast<size_t>(image.uv_row_stride) < chroma_row) {
+        return false;
+    }
+    size_t chroma = (chroma_height - 1) * image.uv_row_stride + chroma_row;
+    return chroma <= image.u_size && chroma <= image.v_size;
+}
+
+}  // namespace
+
+size_t output_bytes(const Options& options) {
+    if (options.width <= 0 || options.height <= 0 || options.width > kMaxSide || options.height > kMaxSide ||
+        (options.rotation != 0 && options.rotation != 90 && options.rotation != 180 && options.rotation != 270)) {
+        return 0;
+    }
+    size_t pixels = static_cast<size_t>(options.width) * options.height;
+    switch (options.format) {
+        case kFormatRgb: return pixels * 3;
+        case kFormatGray: return pixels;
+        case kFormatNv21: return options.width % 2 == 0 && options.height % 2 == 0 ? pixels * 3 / 2 : 0;
+        case kFormatFloatRgb: return pixels * 3 * sizeof(float);
+        default: return 0;
+    }
+}
+
+bool preprocess(const YuvImage& image, const Options& options, void* out, size_t out_size) {
+    size_t needed = output_bytes(options);
+    if (needed == 0 || out == nullptr || out_size < needed || !planes_fit(image)) {
+        return false;
+    }
+    int crop_width;
+    int crop_height;
+    if (!crop_of(image, options, &crop_width, &crop_height)) {
+        return false;
+    }
+    if (options.format == kFormatFloatRgb) {
+        for (float deviation : options.std) {
+            if (!(deviation > 0.0f)) {
+                return false;
+            }
+        }
+    }
+    thread_local Scratch s;
+    const int width = options.width;
+    const int height = options.height;
+    const size_t pixels = static_cast<size_t>(width) * height;
+    Plane luma{image.y, image.y_row_stride, 1, image.width, image.height, static_cast<float>(options.crop_x),
+               static_cast<float>(options.crop_y), static_cast<float>(crop_width), static_cast<float>(crop_height)};
+    auto chroma = [&](const uint8_t* data) {
+        return Plane{data, image.uv_row_stride, image.uv_pixel_stride, (image.width + 1) / 2, (image.height + 1) / 2,
+                     luma.crop_x / 2, luma.crop_y / 2, luma.crop_width / 2, luma.crop_height / 2};
+    };
+    uint8_t* bytes = static_cast<uint8_t*>(out);
+
+    if (options.format == kFormatGray) {
+        resize_rotated(luma, width, height, options.rotation, bytes, s);
+        return true;
+    }
+    if (options.format == kFormatNv21) {
+        resize_rotated(luma, width, height, options.rotation, bytes, s);
+        const int half_width = width / 2;
+        const int half_height = height / 2;
+        const size_t half = static_cast<size_t>(half_width) * half_height;
+        s.u.resize(half);
+        s.v.resize(half);
+        resize_rotated(chroma(image.u), half_width, half_height, options.rotation, s.u.data(), s);
+        resize_rotated(chroma(image.v), half_width, half_height, options.rotation, s.v.data(), s);
+        uint8_t* vu = bytes + pixels;
+        for (size_t i = 0; i < half; ++i) {
+            vu[2 * i] = s.v[i];
+            vu[2 * i + 1] = s.u[i];
+        }
+        return true;
+    }
+
+    s.y.resize(pixels);
+    s.u.resize(pixels);
+    s.v.resize(pixels);
+    resize_rotated(luma, width, height, options.rotation, s.y.data(), s);
+    resize_rotated(chroma(image.u), width, height, options.rotation, s.u.data(), s);
+    resize_rotated(chroma(image.v), width, height, options.rotation, s.v.data(), s);
+    if (options.format == kFormatRgb) {
+        yuv_to_rgb(s.y.data(), s.u.data(), s.v.data(), pixels, bytes);
+        return true;
+    }
+    s.rgb.resize(pixels * 3);
+    yuv_to_rgb(s.y.data(), s.u.data(), s.v.data(), pixels, s.rgb.data());
+    float scale[3];
+    float bias[3];
+    for (int c = 0; c < 3; ++c) {
+        scale[c] = 1.0f / (255.0f * options.std[c]);
+        bias[c] = -options.mean[c] / options.std[c];
+    }
+    normalize(s.rgb.data(), pixels, scale, bias, static_cast<float*>(out));
+    return true;
+}
+
+bool frame_hash(const YuvImage& image, const Options& options, FrameHash* hash) {
+    int crop_width;
+    int crop_height;
+    if (!luma_fits(image) || !crop_of(image, options, &crop_width, &crop_height) || crop_width < kHashColumns ||
+        crop_height < kHashRows) {
+        return false;
+    }
+    int edges[kHashColumns + 1];
+    for (int c = 0; c <= kHashColumns; ++c) {
+        edges[c] = options.crop_x + c * crop_width / kHashColumns;
+    }
+    uint64_t sums[kHashRows][kHashColumns] = {};
+    uint32_t rows[kHashRows] = {};
+    int samples = std::min(crop_height, kHashSampledRows);
+    for (int i = 0; i < samples; ++i) {
+        int y = static_cast<int>((2 * static_cast<int64_t>(i) + 1) * crop_height / (2 * samples));
+        int cell = y * kHashRows / crop_height;
+        const uint8_t* row = image.y + static_cast<size_t>(options.crop_y + y) * image.y_row_stride;
+        for (int c = 0; c < kHashColumns; ++c) {
+            sums[cell][c] += sum_bytes(row + edges[c], edges[c + 1] - edges[c]);
+        }
+        rows[cell]++;
+    }
+    FrameHash bits;
+    for (int r = 0; r < kHashRows; ++r) {
+        for (int c = 0; c + 1 < kHashColumns; ++c) {
+            // Means compared without dividing: cells differ in width by a pixel
+            uint64_t left = sums[r][c] * static_cast<uint64_t>(edges[c + 2] - edges[c + 1]);
+            uint64_t right = sums[r][c + 1] * static_cast<uint64_t>(edges[c + 1] - edges[c]);
+            if (rows[r] > 0 && left < right) {
+                int bit = r * (kHashColumns - 1) + c;
+                bits.bits[bit / 64] |= 1ull << (bit % 64);
+            }
+        }
+    }
+    *hash = bits;
+    return true;
+}
+
+}  // namespace image_preprocess
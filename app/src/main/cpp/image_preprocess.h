@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Camera frames to model inputs, straight from the YUV_420_888 planes.
+ *
+ * OCR and the image classifier both start from a CameraX ImageProxy. Going
+ * through a Bitmap decodes or converts the whole frame, allocates it on the
+ * Java heap and then scales it down again; here the crop and the bilinear
+ * resize run on the planes themselves (luma and both chroma planes, whatever
+ * their pixel stride), the result is rotated while it is small, and only the
+ * output size is converted. Conversion to RGB is full-range BT.601 (JFIF, what
+ * camera YUV is) in 6-bit fixed point, and the float output is NHWC with each
+ * channel normalized as (value / 255 - mean) / std, both in NEON on arm64 with
+ * a scalar path that gives the same bytes.
+ *
+ * Bilinear sampling at pixel centers, as TFLite's ResizeOp(BILINEAR) samples,
+ * so a model sees the same inputs it did through the support library.
+ *
+ * frame_hash() is a difference hash of the crop's luma for recognizing near
+ * duplicate frames (frame_cache.h): the crop is averaged into kHashColumns x
+ * kHashRows cells, over every pixel of each sampled row rather than a few
+ * bilinear taps, and bit row * 16 + column is set where a cell is darker than
+ * the one to its right, so exposure changes and noise leave it alone. 256
+ * bits rather than the usual 64, since two pages of body text framed alike
+ * differ mostly in where their lines and paragraphs break.
+ */
+namespace image_preprocess {
+
+enum Format : int {
+    kFormatRgb = 0,       // uint8 RGB, 3 bytes per pixel
+    kFormatGray = 1,      // uint8 luma
+    kFormatNv21 = 2,      // luma then interleaved VU at half size, what ML Kit takes; even sizes only
+    kFormatFloatRgb = 3,  // float32 RGB, normalized
+};
+
+// The planes of an ImageProxy; sizes are the buffers' capacities
+struct YuvImage {
+    const uint8_t* y = nullptr;
+    const uint8_t* u = nullptr;
+    const uint8_t* v = nullptr;
+    size_t y_size = 0;
+    size_t u_size = 0;
+    size_t v_size = 0;
+    int width = 0;
+    int height = 0;
+    int y_row_stride = 0;
+    int uv_row_stride = 0;
+    int uv_pixel_stride = 1;  // 2 where U and V interleave
+};
+
+struct Options {
+    // In frame pixels; a width or height of 0 takes the whole frame
+    int crop_x = 0;
+    int crop_y = 0;
+    int crop_width = 0;
+    int crop_height = 0;
+    int rotation = 0;  // clockwise degrees, 0, 90, 180 or 270, applied after the crop
+    int width = 0;     // of the output, after rotation
+    int height = 0;
+    Format format = kFormatRgb;
+    float mean[3] = {0.0f, 0.0f, 0.0f};  // kFormatFloatRgb only
+    float std[3] = {1.0f, 1.0f, 1.0f};
+};
+
+constexpr int kHashColumns = 17;
+constexpr int kHashRows = 16;
+constexpr int kHashSampledRows = 128;  // rows of the crop read, evenly spaced
+
+struct FrameHash {
+    uint64_t bits[4] = {0, 0, 0, 0};
+};
+
+// Bits that differ
+inline int hash_distance(const FrameHash& a, const FrameHash& b) {
+    int d = 0;
+    for (int i = 0; i < 4; ++i) {
+        d += __builtin_popcountll(a.bits[i] ^ b.bits[i]);
+    }
+    return d;
+}
+
+// Bytes `options` writes; 0 if they are out of range
+size_t output_bytes(const Options& options);
+
+// `image` cropped, resized, rotated and converted into `out`; false if the
+// options are out of range, a plane is smaller than its strides say or
+// `out_size` is under output_bytes(options)
+bool preprocess(const YuvImage& image, const Options& options, void* out, size_t out_size);
+
+// Difference hash of the luma in `options`' crop (nothing else of them is
+// read; the chroma planes may be null); false if the crop is out of range
+bool frame_hash(const YuvImage& image, const Options& options, FrameHash* hash);
+
+}  // namespace image_preprocess
@@ -0,0 +1,486 @@
+#include <jni.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "frame_cache.h"
+#include "image_preprocess.h"
+#include "jni_cache.h"
+#include "jni_strings.h"
+#include "native_log.h"
+#include "page_store.h"
+#include "utf8_stream.h"
+
+#define LOGE(...) NLOGE("IMAGE_PREPROCESS_JNI", __VA_ARGS__)
+
+// A direct ByteBuffer's memory and capacity; null for a heap buffer
+static uint8_t* direct_bytes(JNIEnv* env, jobject buffer, size_t* size) {
+    *size = 0;
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+    void* address = env->GetDirectBufferAddress(buffer);
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (address == nullptr || capacity < 0) {
+        return nullptr;
+    }
+    *size = static_cast<size_t>(capacity);
+    return static_cast<uint8_t*>(address);
+}
+
+// OCR results of recent frames, process-wide
+static FrameCache& frame_cache() {
+    static FrameCache* cache = new FrameCache();
+    return *cache;
+}
+
+// A hash passed as four longs; false for any other length
+static bool hash_from(JNIEnv* env, jlongArray jHash, FrameCache::Hash* hash) {
+    if (jHash == nullptr || env->GetArrayLength(jHash) != 4) {
+        return false;
+    }
+    jlong words[4];
+    env->GetLongArrayRegion(jHash, 0, 4, words);
+    for (int i = 0; i < 4; ++i) {
+        hash->bits[i] = static_cast<uint64_t>(words[i]);
+    }
+    return true;
+}
+
+// OCR results of saved pages, process-wide; closed until openPageStore
+static PageStore& page_store() {
+    static PageStore* store = new PageStore();
+    return *store;
+}
+
+// The stored record of the page hashed `jHash`
+static bool find_page(JNIEnv* env, jstring jHash, PageRecord* record, bool count) {
+    PageStore::Digest digest;
+    return jHash != nullptr && PageStore::Digest::from_hex(jni_utf8(env, jHash), &digest) &&
+           page_store().find(digest, record, count);
+}
+
+// Loads the record of `jHash` (empty if none), applies `update` and stores it back
+template <typename Update>
+static bool update_page(JNIEnv* env, jstring jHash, Update update) {
+    PageStore::Digest digest;
+    if (jHash == nullptr || !PageStore::Digest::from_hex(jni_utf8(env, jHash), &digest)) {
+        return false;
+    }
+    PageRecord record;
+    page_store().find(digest, &record, false);
+    update(&record);
+    return page_store().put(digest, record);
+}
+
+extern "C" {
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_outputBytes(
+        JNIEnv* env,
+        jobject /* this */,
+        jint width,
+        jint height,
+        jint format) {
+    
+    image_preprocess::Options options;
+    options.width = width;
+    options.height = height;
+    options.format = static_cast<image_preprocess::Format>(format);
+    return static_cast<jint>(image_preprocess::output_bytes(options));
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_nativePreprocess(
+        JNIEnv* env,
+        jobject /* this */,
+        jobject yBuffer,
+        jobject uBuffer,
+        jobject vBuffer,
+        jint width,
+        jint height,
+        jint yRowStride,
+        jint uvRowStride,
+        jint uvPixelStride,
+        jintArray jCropAndSize,
+        jint format,
+        jfloatArray jMeanStd,
+        jobject outBuffer) {
+    
+    image_preprocess::YuvImage image;
+    image.y = direct_bytes(env, yBuffer, &image.y_size);
+    image.u = direct_bytes(env, uBuffer, &image.u_size);
+    image.v = direct_bytes(env, vBuffer, &image.v_size);
+    image.width = width;
+    image.height = height;
+    image.y_row_stride = yRowStride;
+    image.uv_row_stride = uvRowStride;
+    image.uv_pixel_stride = uvPixelStride;
+
+    // crop x, y, width, height, rotation, output width, height
+    jint geometry[7] = {0, 0, 0, 0, 0, 0, 0};
+    if (jCropAndSize == nullptr || env->GetArrayLength(jCropAndSize) != 7) {
+        LOGE("Expected 7 crop and size values");
+        return JNI_FALSE;
+    }
+    env->GetIntArrayRegion(jCropAndSize, 0, 7, geometry);
+    image_preprocess::Options options;
+    options.crop_x = geometry[0];
+    options.crop_y = geometry[1];
+    options.crop_width = geometry[2];
+    options.crop_height = geometry[3];
+    options.rotation = geometry[4];
+    options.width = geometry[5];
+    options.height = geometry[6];
+    options.format = static_cast<image_preprocess::Format>(format);
+    if (jMeanStd != nullptr && env->GetArrayLength(jMeanStd) == 6) {
+        jfloat mean_std[6];
+        env->GetFloatArrayRegion(jMeanStd, 0, 6, mean_std);
+        for (int c = 0; c < 3; ++c) {
+            options.mean[c] = mean_std[c];
+            options.std[c] = mean_std[3 + c];
+        }
+    }
+
+    size_t out_size = 0;
+    uint8_t* out = direct_bytes(env, outBuffer, &out_size);
+    if (image.y == nullptr || image.u == nullptr || image.v == nullptr || out == nullptr) {
+        LOGE("Planes and output must be direct ByteBuffers");
+        return JNI_FALSE;
+    }
+    if (!image_preprocess::preprocess(image, options, out, out_size)) {
+        LOGE("Cannot preprocess a %dx%d frame to %dx%d (format %d, rotation %d, %zu output bytes)", width, height,
+             options.width, options.height, format, options.rotation, out_size);
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_nativeFrameHash(
+        JNIEnv* env,
+        jobject /* this */,
+        jobject yBuffer,
+        jint width,
+        jint height,
+        jint yRowStride,
+        jint cropX,
+        jint cropY,
+        jint cropWidth,
+        jint cropHeight) {
+    
+    image_preprocess::YuvImage image;
+    image.y = direct_bytes(env, yBuffer, &image.y_size);
+    image.width = width;
+    image.height = height;
+    image.y_row_stride = yRowStride;
+    image_preprocess::Options options;
+    options.crop_x = cropX;
+    options.crop_y = cropY;
+    options.crop_width = cropWidth;
+    options.crop_height = cropHeight;
+    image_preprocess::FrameHash hash;
+    if (!image_preprocess::frame_hash(image, options, &hash)) {
+        LOGE("Cannot hash a %dx%d frame", width, height);
+        return nullptr;
+    }
+    jlongArray result = env->NewLongArray(4);
+    if (result != nullptr) {
+        jlong words[4];
+        for (int i = 0; i < 4; ++i) {
+            words[i] = static_cast<jlong>(hash.bits[i]);
+        }
+        env->SetLongArrayRegion(result, 0, 4, words);
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_frameDistance(
+        JNIEnv* env,
+        jobject /* this */,
+        jlongArray jA,
+        jlongArray jB) {
+    
+    FrameCache::Hash a;
+    FrameCache::Hash b;
+    if (!hash_from(env, jA, &a) || !hash_from(env, jB, &b)) {
+        return -1;
+    }
+    return image_preprocess::hash_distance(a, b);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_lookupFrameText(
+        JNIEnv* env,
+        jobject /* this */,
+        jlongArray jHash,
+        jint maxDistance) {
+    
+    FrameCache::Hash hash;
+    FrameCache::Entry entry;
+    if (!hash_from(env, jHash, &hash) || !frame_cache().find(hash, maxDistance, &entry)) {
+        return nullptr;
+    }
+    std::u16string text;
+    utf8_to_utf16(entry.text, text);
+    return env->NewString(reinterpret_cast<const jchar*>(text.data()), static_cast<jsize>(text.size()));
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_lookupFrameTokens(
+        JNIEnv* env,
+        jobject /* this */,
+        jlongArray jHash,
+        jint maxDistance) {
+    
+    FrameCache::Hash hash;
+    FrameCache::Entry entry;
+    if (!hash_from(env, jHash, &hash) || !frame_cache().find(hash, maxDistance, &entry, false) ||
+        entry.ids.empty()) {
+        return nullptr;
+    }
+    jintArray result = env->NewIntArray(static_cast<jsize>(entry.ids.size()));
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(entry.ids.size()),
+                               reinterpret_cast<const jint*>(entry.ids.data()));
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_rememberFrame(
+        JNIEnv* env,
+        jobject /* this */,
+        jlongArray jHash,
+        jstring jText) {
+    
+    FrameCache::Hash hash;
+    if (jText == nullptr || !hash_from(env, jHash, &hash)) {
+        return JNI_FALSE;
+    }
+    frame_cache().put(hash, jni_utf8(env, jText));
+    return JNI_TRUE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_rememberFrameTokens(
+        JNIEnv* env,
+        jobject /* this */,
+        jlongArray jHash,
+        jint maxDistance,
+        jintArray jIds) {
+    
+    FrameCache::Hash hash;
+    if (jIds == nullptr || !hash_from(env, jHash, &hash)) {
+        return JNI_FALSE;
+    }
+    std::vector<int32_t> ids(static_cast<size_t>(env->GetArrayLength(jIds)));
+    if (!ids.empty()) {
+        env->GetIntArrayRegion(jIds, 0, static_cast<jsize>(ids.size()), reinterpret_cast<jint*>(ids.data()));
+    }
+    return frame_cache().set_ids(hash, maxDistance, std::move(ids)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_getFrameCacheStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    FrameCache::Stats stats = frame_cache().stats();
+    jlong values[3] = {static_cast<jlong>(stats.hits), static_cast<jlong>(stats.misses),
+                       static_cast<jlong>(stats.size)};
+    jlongArray result = env->NewLongArray(3);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 3, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_clearFrameCache(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    frame_cache().clear();
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_openPageStore(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir,
+        jstring jTag,
+        jlong maxBytes) {
+    
+    if (jDir == nullptr) {
+        return JNI_FALSE;
+    }
+    uint64_t max_bytes = static_cast<uint64_t>(std::max<jlong>(0, maxBytes));
+    return page_store().open(jni_utf8(env, jDir), jni_utf8(env, jTag), max_bytes) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_nativePageHash(
+        JNIEnv* env,
+        jobject /* this */,
+        jobject buffer,
+        jint length) {
+    
+    size_t size = 0;
+    const uint8_t* data = direct_bytes(env, buffer, &size);
+    if (data == nullptr || length < 0 || static_cast<size_t>(length) > size) {
+        return nullptr;
+    }
+    return env->NewStringUTF(PageStore::hash(data, static_cast<size_t>(length)).hex().c_str());
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_pageHashOfFile(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPath) {
+    
+    PageStore::Digest digest;
+    if (jPath == nullptr || !PageStore::hash_file(jni_utf8(env, jPath), &digest)) {
+        return nullptr;
+    }
+    return env->NewStringUTF(digest.hex().c_str());
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_lookupPageText(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jHash) {
+    
+    PageRecord record;
+    if (!find_page(env, jHash, &record, true)) {
+        return nullptr;
+    }
+    std::u16string text;
+    utf8_to_utf16(record.text, text);
+    return env->NewString(reinterpret_cast<const jchar*>(text.data()), static_cast<jsize>(text.size()));
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_lookupPageTokens(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jHash) {
+    
+    PageRecord record;
+    if (!find_page(env, jHash, &record, false) || record.ids.empty()) {
+        return nullptr;
+    }
+    jintArray result = env->NewIntArray(static_cast<jsize>(record.ids.size()));
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(record.ids.size()),
+                               reinterpret_cast<const jint*>(record.ids.data()));
+    }
+    return result;
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_lookupPageKeys(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jHash) {
+    
+    PageRecord record;
+    if (!find_page(env, jHash, &record, false) || record.keys.empty()) {
+        return nullptr;
+    }
+    jobjectArray result = env->NewObjectArray(static_cast<jsize>(record.keys.size()), jni_cache().string_class,
+                                              nullptr);
+    for (size_t i = 0; result != nullptr && i < record.keys.size(); ++i) {
+        jstring key = env->NewStringUTF(record.keys[i].c_str());
+        env->SetObjectArrayElement(result, static_cast<jsize>(i), key);
+        env->DeleteLocalRef(key);
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_rememberPage(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jHash,
+        jstring jText) {
+    
+    if (jText == nullptr) {
+        return JNI_FALSE;
+    }
+    std::string text = jni_utf8(env, jText);
+    return update_page(env, jHash, [&](PageRecord* record) {
+        if (record->text != text) {
+            *record = PageRecord();
+            record->text = std::move(text);
+        }
+    }) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_rememberPageTokens(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jHash,
+        jintArray jIds) {
+    
+    if (jIds == nullptr) {
+        return JNI_FALSE;
+    }
+    std::vector<int32_t> ids(static_cast<size_t>(env->GetArrayLength(jIds)));
+    if (!ids.empty()) {
+        env->GetIntArrayRegion(jIds, 0, static_cast<jsize>(ids.size()), reinterpret_cast<jint*>(ids.data()));
+    }
+    return update_page(env, jHash, [&](PageRecord* record) { record->ids = std::move(ids); }) ? JNI_TRUE
+                                                                                              : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_rememberPageKeys(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jHash,
+        jobjectArray jKeys) {
+    
+    if (jKeys == nullptr) {
+        return JNI_FALSE;
+    }
+    std::vector<std::string> keys;
+    jsize count = env->GetArrayLength(jKeys);
+    for (jsize i = 0; i < count; ++i) {
+        jstring key = static_cast<jstring>(env->GetObjectArrayElement(jKeys, i));
+        keys.push_back(jni_utf8(env, key));
+        env->DeleteLocalRef(key);
+    }
+    return update_page(env, jHash, [&](PageRecord* record) { record->keys = std::move(keys); }) ? JNI_TRUE
+                                                                                                : JNI_FALSE;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_getPageStoreStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    PageStore::Stats stats = page_store().stats();
+    jlong values[4] = {static_cast<jlong>(stats.hits), static_cast<jlong>(stats.misses),
+                       static_cast<jlong>(stats.pages), static_cast<jlong>(stats.bytes)};
+    jlongArray result = env->NewLongArray(4);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_NativeImagePreprocessor_clearPageStore(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    page_store().clear();
+}
+
+}  // extern "C"
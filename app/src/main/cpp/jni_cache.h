@@ -0,0 +1,149 @@
+#pragma once
+
+#include <jni.h>
+
+#include "native_log.h"
+
+/**
+ * Classes and method IDs the bridges use on the request path, resolved once in
+ * JNI_OnLoad and pinned with global references.
+ *
+ * Each native library calls jni_cache_on_load() from its own JNI_OnLoad, so
+ * every library gets its own copy. Classes that may be absent from the app
+ * (e.g. a callback interface of a bridge that is not packaged) are optional:
+ * they stay null and callers fall back to a reflective lookup.
+ */
+struct JniCache {
+    JavaVM* vm = nullptr;
+
+    jclass string_class = nullptr;
+    jclass long_class = nullptr;
+    jclass float_array_class = nullptr;         // float[], for arrays of rows
+    jmethodID long_init = nullptr;              // Long(long)
+    jclass runtime_exception_class = nullptr;
+
+    // Kotlin lambdas such as (String) -> Unit implement Function1
+    jclass function1_class = nullptr;
+    jmethodID function1_invoke = nullptr;       // Object invoke(Object)
+
+    // com.example.studybuddy.mlc.TVMBridge.StreamingCallback (optional)
+    jclass streaming_callback_class = nullptr;
+    jmethodID streaming_callback_on_token = nullptr;  // void onToken(String, boolean)
+};
+
+inline JniCache& jni_cache() {
+    static JniCache cache;
+    return cache;
+}
+
+// FindClass + NewGlobalRef. A missing optional class clears the pending exception.
+inline jclass jni_pin_class(JNIEnv* env, const char* name, bool optional) {
+    jclass local = env->FindClass(name);
+    if (local == nullptr) {
+        env->ExceptionClear();
+        if (!optional) {
+            NLOGE("JniCache", "Class not found: %s", name);
+        }
+        return nullptr;
+    }
+    jclass global = static_cast<jclass>(env->NewGlobalRef(local));
+    env->DeleteLocalRef(local);
+    return global;
+}
+
+inline jmethodID jni_pin_method(JNIEnv* env, jclass clazz, const char* name, const char* signature) {
+    if (clazz == nullptr) {
+        return nullptr;
+    }
+    jmethodID method = env->GetMethodID(clazz, name, signature);
+    if (method == nullptr) {
+        env->ExceptionClear();
+        NLOGE("JniCache", "Method not found: %s%s", name, signature);
+    }
+    return method;
+}
+
+// Call from JNI_OnLoad; returns the JNI version to report
+inline jint jni_cache_on_load(JavaVM* vm) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK || env == nullptr) {
+        return JNI_ERR;
+    }
+
+    JniCache& cache = jni_cache();
+    cache.vm = vm;
+    cache.string_class = jni_pin_class(env, "java/lang/String", false);
+    cache.long_class = jni_pin_class(env, "java/lang/Long", false);
+    cache.float_array_class = jni_pin_class(env, "[F", false);
+    cache.long_init = jni_pin_method(env, cache.long_class, "<init>", "(J)V");
+    cache.runtime_exception_class = jni_pin_class(env, "java/lang/RuntimeException", false);
+
+    cache.function1_class = jni_pin_class(env, "kotlin/jvm/functions/Function1", true);
+    cache.function1_invoke = jni_pin_method(env, cache.function1_class, "invoke",
+                                            "(Ljava/lang/Object;)Ljava/lang/Object;");
+
+    cache.streaming_callback_class = jni_pin_class(env, "com/example/studybuddy/mlc/TVMBridge$StreamingCallback", true);
+    cache.streaming_callback_on_token = jni_pin_method(env, cache.streaming_callback_class, "onToken",
+                                                       "(Ljava/lang/String;Z)V");
+    return JNI_VERSION_1_6;
+}
+
+// Resolve `name` on the callback's class; only used when the cache has no entry
+inline jmethodID jni_lookup_method(JNIEnv* env, jobject target, const char* name, const char* signature) {
+    jclass clazz = env->GetObjectClass(target);
+    if (clazz == nullptr) {
+        return nullptr;
+    }
+    jmethodID method = env->GetMethodID(clazz, name, signature);
+    env->DeleteLocalRef(clazz);
+    if (method == nullptr) {
+        env->ExceptionClear();
+    }
+    return method;
+}
+
+// invoke(Object) of a Kotlin (T) -> R lambda
+inline jmethodID jni_function1_invoke(JNIEnv* env, jobject callback) {
+    const JniCache& cache = jni_cache();
+    if (cache.function1_invoke != nullptr) {
+        return cache.function1_invoke;
+    }
+    return jni_lookup_method(env, callback, "invoke", "(Ljava/lang/Object;)Ljava/lang/Object;");
+}
+
+// onToken(String, boolean) of a TVMBridge.StreamingCallback
+inline jmethodID jni_streaming_callback_on_token(JNIEnv* env, jobject callback) {
+    const JniCache& cache = jni_cache();
+    if (cache.streaming_callback_on_token != nullptr) {
+        return cache.streaming_callback_on_token;
+    }
+    return jni_lookup_method(env, callback, "onToken", "(Ljava/lang/String;Z)V");
+}
+
+inline void jni_throw_runtime_exception(JNIEnv* env, const char* message) {
+    jclass clazz = jni_cache().runtime_exception_class;
+    if (clazz != nullptr) {
+        env->ThrowNew(clazz, message);
+        return;
+    }
+    jclass local = env->FindClass("java/lang/RuntimeException");
+    if (local != nullptr) {
+        env->ThrowNew(local, message);
+        env->DeleteLocalRef(local);
+    }
+}
+
+// java.lang.Long box for a native handle
+inline jobject jni_new_long(JNIEnv* env, jlong value) {
+    const JniCache& cache = jni_cache();
+    if (cache.long_class != nullptr && cache.long_init != nullptr) {
+        return env->NewObject(cache.long_class, cache.long_init, value);
+    }
+    jclass local = env->FindClass("java/lang/Long");
+    if (local == nullptr) {
+        return nullptr;
+    }
+    jobject boxed = env->NewObject(local, env->GetMethodID(local, "<init>", "(J)V"), value);
+    env->DeleteLocalRef(local);
+    return boxed;
+}
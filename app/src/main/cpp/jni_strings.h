@@ -0,0 +1,104 @@
+#pragma once
+
+#include <jni.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "utf8_stream.h"
+
+/**
+ * Java strings as real UTF-8, transcoded once from their UTF-16 contents.
+ *
+ * GetStringUTFChars copies the string inside the VM and yields modified UTF-8,
+ * where an emoji or any other supplementary character comes out as two 3-byte
+ * surrogates the tokenizer has no pieces for; copying that into a std::string
+ * is a second copy. Here the UTF-16 is read in place (GetStringCritical, for
+ * the multi-KB OCR prompts) or into a small per-thread buffer (GetStringRegion,
+ * for short strings, which keeps the critical section off the common path) and
+ * transcoded straight into the destination.
+ *
+ * JniUtf8 writes into a buffer leased from a per-thread pool, so a request path
+ * allocates nothing once its buffers have grown to the prompt sizes it sees.
+ * Leases nest: a Java callback that re-enters native code on the same thread
+ * gets a buffer of its own. Use jni_utf8() instead when the text must outlive
+ * the call, e.g. a prompt queued for a worker thread.
+ */
+
+// Strings at least this long (in UTF-16 units) are read through GetStringCritical
+static constexpr jsize kJniCriticalChars = 1024;
+// A pooled buffer that grew past this is given back when its lease ends
+static constexpr size_t kJniRetainedBytes = 256 << 10;
+
+// Transcodes `text` into `out`; null becomes ""
+inline void jni_utf8_into(JNIEnv* env, jstring text, std::string& out) {
+    out.clear();
+    if (text == nullptr) {
+        return;
+    }
+    jsize length = env->GetStringLength(text);
+    if (length == 0) {
+        return;
+    }
+    if (length >= kJniCriticalChars) {
+        // Nothing between Get and Release may call back into the VM; transcoding does not
+        const jchar* chars = env->GetStringCritical(text, nullptr);
+        if (chars != nullptr) {
+            utf16_to_utf8(reinterpret_cast<const char16_t*>(chars), static_cast<size_t>(length), out);
+            env->ReleaseStringCritical(text, chars);
+            return;
+        }
+        env->ExceptionClear();
+    }
+    thread_local std::u16string utf16;
+    utf16.resize(static_cast<size_t>(length));
+    env->GetStringRegion(text, 0, length, reinterpret_cast<jchar*>(&utf16[0]));
+    utf16_to_utf8(utf16.data(), utf16.size(), out);
+}
+
+// An owned copy, for text kept past the call
+inline std::string jni_utf8(JNIEnv* env, jstring text) {
+    std::string out;
+    jni_utf8_into(env, text, out);
+    return out;
+}
+
+// A string argument for the duration of a JNI call
+class JniUtf8 {
+public:
+    JniUtf8(JNIEnv* env, jstring text) : buffer_(lease()) { jni_utf8_into(env, text, *buffer_); }
+    ~JniUtf8() { give_back(std::move(buffer_)); }
+    JniUtf8(const JniUtf8&) = delete;
+    JniUtf8& operator=(const JniUtf8&) = delete;
+
+    const std::string& str() const { return *buffer_; }
+    std::string_view view() const { return *buffer_; }
+    const char* c_str() const { return buffer_->c_str(); }
+
+private:
+    std::unique_ptr<std::string> buffer_;
+
+    static std::vector<std::unique_ptr<std::string>>& pool() {
+        thread_local std::vector<std::unique_ptr<std::string>> buffers;
+        return buffers;
+    }
+
+    static std::unique_ptr<std::string> lease() {
+        auto& buffers = pool();
+        if (buffers.empty()) {
+            return std::make_unique<std::string>();
+        }
+        std::unique_ptr<std::string> buffer = std::move(buffers.back());
+        buffers.pop_back();
+        return buffer;
+    }
+
+    static void give_back(std::unique_ptr<std::string> buffer) {
+        if (buffer->capacity() > kJniRetainedBytes) {
+            std::string().swap(*buffer);
+        }
+        pool().push_back(std::move(buffer));
+    }
+};
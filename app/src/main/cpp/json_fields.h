@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+// Minimal lookups of scalar fields in the small JSON records the engines write
+// themselves (tuning caches, phase plans, traces). The first occurrence of the
+// key wins, at any nesting level; that is enough for flat, well-known records
+// and needs no JSON library. mlc-chat-config.json goes through model_config.h.
+
+// Offset just past the ':' of the first `key`, or npos
+inline size_t json_value_offset(const std::string& json, const char* key) {
+    std::string quoted = std::string("\"") + key + "\"";
+    size_t pos = json.find(quoted);
+    if (pos == std::string::npos) {
+        return pos;
+    }
+    pos = json.find(':', pos + quoted.size());
+    return pos == std::string::npos ? pos : pos + 1;
+}
+
+inline int64_t json_int_field(const std::string& json, const char* key, int64_t fallback) {
+    size_t pos = json_value_offset(json, key);
+    if (pos == std::string::npos) {
+        return fallback;
+    }
+    char* end = nullptr;
+    long long value = strtoll(json.c_str() + pos, &end, 10);
+    return end == json.c_str() + pos ? fallback : static_cast<int64_t>(value);
+}
+
+inline double json_float_field(const std::string& json, const char* key, double fallback) {
+    size_t pos = json_value_offset(json, key);
+    if (pos == std::string::npos) {
+        return fallback;
+    }
+    char* end = nullptr;
+    double value = strtod(json.c_str() + pos, &end);
+    return end == json.c_str() + pos ? fallback : value;
+}
+
+inline std::string json_string_field(const std::string& json, const char* key) {
+    size_t open = json_value_offset(json, key);
+    if (open == std::string::npos || (open = json.find_first_not_of(" \t\r\n", open)) == std::string::npos ||
+        json[open] != '"') {
+        return std::string();
+    }
+    size_t close = json.find('"', open + 1);
+    return close == std::string::npos ? std::string() : json.substr(open + 1, close - open - 1);
+}
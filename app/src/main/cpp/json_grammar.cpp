@@ -0,0 +1,1086 @@
+#include "json_grammar.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+#include "native_log.h"
+#include "sp_tokenizer.h"
+
+#define LOGI(...) NLOGI("JSON_GRAMMAR", __VA_ARGS__)
+
+namespace {
+
+// Built-in nodes every grammar starts with
+constexpr uint16_t kRootNode = 0;
+constexpr uint16_t kAnyNode = 1;
+constexpr uint16_t kStringNode = 2;
+constexpr uint16_t kNumberNode = 3;
+constexpr uint16_t kIntegerNode = 4;
+constexpr uint16_t kBooleanNode = 5;
+constexpr uint16_t kNullNode = 6;
+constexpr uint16_t kAnyObjectNode = 7;
+constexpr uint16_t kAnyArrayNode = 8;
+
+constexpr uint32_t kMaxIntegerDigits = 18;
+constexpr uint32_t kMaxExponentDigits = 3;
+constexpr size_t kMaxAlternatives = 32;  // enum values, and optional keys in a row
+
+bool is_whitespace(uint8_t c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+bool is_digit(uint8_t c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_hex(uint8_t c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+uint32_t all_bits(size_t n) {
+    return n >= 32 ? ~0u : (1u << n) - 1;
+}
+
+// Just enough of a JSON reader for schemas
+struct JsonValue {
+    enum Type { kNull, kBool, kNumber, kString, kArray, kObject };
+    Type type = kNull;
+    bool boolean = false;
+    std::string text;  // string value, or a number as written
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* get(const char* key) const {
+        for (const auto& member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonReader {
+public:
+    JsonReader(const char* begin, const char* end) : p_(begin), end_(end) {}
+
+    bool read_document(JsonValue* value) {
+        if (!read(value, 0)) {
+            return false;
+        }
+        skip_whitespace();
+        return p_ == end_;
+    }
+
+private:
+    static constexpr int kMaxNesting = 64;
+    const char* p_;
+    const char* end_;
+
+    void skip_whitespace() {
+        while (p_ < end_ && is_whitespace(static_cast<uint8_t>(*p_))) {
+            ++p_;
+        }
+    }
+
+    bool literal(const char* word) {
+        size_t n = strlen(word);
+        if (static_cast<size_t>(end_ - p_) < n || memcmp(p_, word, n) != 0) {
+            return false;
+        }
+        p_ += n;
+        return true;
+    }
+
+    bool read(JsonValue* value, int depth) {
+        if (depth > kMaxNesting) {
+            return false;
+        }
+        skip_whitespace();
+        if (p_ >= end_) {
+            return false;
+        }
+        switch (*p_) {
+            case '{': return read_object(value, depth);
+            case '[': return read_array(value, depth);
+            case '"': value->type = JsonValue::kString; return read_string(&value->text);
+            case 't': value->type = JsonValue::kBool; value->boolean = true; return literal("true");
+            case 'f': value->type = JsonValue::kBool; return literal("false");
+            case 'n': value->type = JsonValue::kNull; return literal("null");
+            default: return read_number(value);
+        }
+    }
+
+    bool read_object(JsonValue* value, int depth) {
+        value->type = JsonValue::kObject;
+        ++p_;
+        skip_whitespace();
+        if (p_ < end_ && *p_ == '}') {
+            ++p_;
+            return true;
+        }
+        while (true) {
+            skip_whitespace();
+            std::pair<std::string, JsonValue> member;
+            if (p_ >= end_ || *p_ != '"' || !read_string(&member.first)) {
+                return false;
+            }
+            skip_whitespace();
+            if (p_ >= end_ || *p_++ != ':' || !read(&member.second, depth + 1)) {
+                return false;
+            }
+            value->members.push_back(std::move(member));
+            skip_whitespace();
+            if (p_ >= end_) {
+                return false;
+            }
+            char c = *p_++;
+            if (c == '}') {
+                return true;
+            }
+            if (c != ',') {
+                return false;
+            }
+        }
+    }
+
+    bool read_array(JsonValue* value, int depth) {
+        value->type = JsonValue::kArray;
+        ++p_;
+        skip_whitespace();
+        if (p_ < end_ && *p_ == ']') {
+            ++p_;
+            return true;
+        }
+        while (true) {
+            JsonValue item;
+            if (!read(&item, depth + 1)) {
+                return false;
+            }
+            value->items.push_back(std::move(item));
+            skip_whitespace();
+            if (p_ >= end_) {
+                return false;
+            }
+            char c = *p_++;
+            if (c == ']') {
+                return true;
+            }
+            if (c != ',') {
+                return false;
+            }
+        }
+    }
+
+    bool read_number(JsonValue* value) {
+        value->type = JsonValue::kNumber;
+        const char* start = p_;
+        while (p_ < end_ && (is_digit(static_cast<uint8_t>(*p_)) || strchr("+-.eE", *p_) != nullptr)) {
+            ++p_;
+        }
+        value->text.assign(start, p_);
+        return p_ > start;
+    }
+
+    static void append_utf8(uint32_t cp, std::string* out) {
+        if (cp < 0x80) {
+            out->push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out->push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out->push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out->push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    bool read_hex4(uint32_t* cp) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        *cp = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *p_++;
+            if (!is_hex(static_cast<uint8_t>(c))) {
+                return false;
+            }
+            *cp = *cp * 16 + static_cast<uint32_t>(is_digit(static_cast<uint8_t>(c)) ? c - '0' : (c | 0x20) - 'a' + 10);
+        }
+        return true;
+    }
+
+    bool read_string(std::string* out) {
+        ++p_;  // opening quote
+        while (p_ < end_) {
+            char c = *p_++;
+            if (c == '"') {
+                return true;
+            }
+            if (c != '\\') {
+                out->push_back(c);
+                continue;
+            }
+            if (p_ >= end_) {
+                return false;
+            }
+            char e = *p_++;
+            switch (e) {
+                case '"': case '\\': case '/': out->push_back(e); break;
+                case 'b': out->push_back('\b'); break;
+                case 'f': out->push_back('\f'); break;
+                case 'n': out->push_back('\n'); break;
+                case 'r': out->push_back('\r'); break;
+                case 't': out->push_back('\t'); break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!read_hex4(&cp)) {
+                        return false;
+                    }
+                    if (cp >= 0xD800 && cp < 0xDC00 && end_ - p_ >= 6 && p_[0] == '\\' && p_[1] == 'u') {
+                        p_ += 2;
+                        uint32_t low;
+                        if (!read_hex4(&low)) {
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    append_utf8(cp, out);
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return false;
+    }
+};
+
+// String contents as they appear between quotes in compact JSON
+std::string escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        uint8_t u = static_cast<uint8_t>(c);
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (u < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", u);
+            out += buffer;
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+std::string to_json(const JsonValue& value) {
+    switch (value.type) {
+        case JsonValue::kNull: return "null";
+        case JsonValue::kBool: return value.boolean ? "true" : "false";
+        case JsonValue::kNumber: return value.text;
+        case JsonValue::kString: return "\"" + escape(value.text) + "\"";
+        case JsonValue::kArray: {
+            std::string out = "[";
+            for (size_t i = 0; i < value.items.size(); ++i) {
+                out += (i > 0 ? "," : "") + to_json(value.items[i]);
+            }
+            return out + "]";
+        }
+        case JsonValue::kObject: {
+            std::string out = "{";
+            for (size_t i = 0; i < value.members.size(); ++i) {
+                out += (i > 0 ? ",\"" : "\"") + escape(value.members[i].first) + "\":" + to_json(value.members[i].second);
+            }
+            return out + "}";
+        }
+    }
+    return "null";
+}
+
+}  // namespace
+
+class JsonSchemaCompiler {
+public:
+    explicit JsonSchemaCompiler(JsonGrammar* grammar) : grammar_(grammar) {
+        using Node = JsonGrammar::Node;
+        std::vector<Node>& nodes = grammar_->nodes_;
+        nodes.resize(kAnyArrayNode + 1);
+        nodes[kRootNode].kind = JsonGrammar::kRoot;
+        nodes[kAnyNode].kind = JsonGrammar::kAny;
+        nodes[kStringNode].kind = JsonGrammar::kString;
+        nodes[kNumberNode].kind = JsonGrammar::kNumber;
+        nodes[kIntegerNode].kind = JsonGrammar::kInteger;
+        nodes[kBooleanNode].kind = JsonGrammar::kLiterals;
+        nodes[kBooleanNode].literals = {"true", "false"};
+        nodes[kNullNode].kind = JsonGrammar::kLiterals;
+        nodes[kNullNode].literals = {"null"};
+        nodes[kAnyObjectNode].kind = JsonGrammar::kAnyObject;
+        nodes[kAnyArrayNode].kind = JsonGrammar::kArray;
+        nodes[kAnyArrayNode].items = kAnyNode;
+    }
+
+    bool compile(const JsonValue& schema, uint16_t* out, std::string* error, int depth) {
+        if (depth > JsonGrammar::kMaxDepth) {
+            *error = "schema nests too deeply";
+            return false;
+        }
+        if (schema.type != JsonValue::kObject) {
+            *out = kAnyNode;  // `true` and other non-object schemas accept anything
+            return true;
+        }
+
+        const JsonValue* constant = schema.get("const");
+        const JsonValue* choices = schema.get("enum");
+        if (constant != nullptr || (choices != nullptr && choices->type == JsonValue::kArray)) {
+            JsonGrammar::Node node;
+            node.kind = JsonGrammar::kLiterals;
+            if (constant != nullptr) {
+                node.literals.push_back(to_json(*constant));
+            } else {
+                for (const auto& choice : choices->items) {
+                    node.literals.push_back(to_json(choice));
+                }
+            }
+            if (node.literals.empty() || node.literals.size() > kMaxAlternatives) {
+                *error = "enum must have 1 to 32 values";
+                return false;
+            }
+            return add(std::move(node), out, error);
+        }
+
+        std::string type;
+        const JsonValue* type_value = schema.get("type");
+        if (type_value != nullptr && type_value->type == JsonValue::kString) {
+            type = type_value->text;
+        }
+        const JsonValue* properties = schema.get("properties");
+        const JsonValue* items = schema.get("items");
+        if (type.empty() && properties != nullptr) {
+            type = "object";
+        } else if (type.empty() && items != nullptr) {
+            type = "array";
+        }
+
+        if (type == "string") {
+            *out = kStringNode;
+        } else if (type == "number") {
+            *out = kNumberNode;
+        } else if (type == "integer") {
+            *out = kIntegerNode;
+        } else if (type == "boolean") {
+            *out = kBooleanNode;
+        } else if (type == "null") {
+            *out = kNullNode;
+        } else if (type == "object") {
+            if (properties == nullptr || properties->type != JsonValue::kObject) {
+                *out = kAnyObjectNode;
+                return true;
+            }
+            return compile_object(schema, *properties, out, error, depth);
+        } else if (type == "array") {
+            JsonGrammar::Node node;
+            node.kind = JsonGrammar::kArray;
+            node.items = kAnyNode;
+            if (items != nullptr && !compile(*items, &node.items, error, depth + 1)) {
+                return false;
+            }
+            node.min_items = count_field(schema, "minItems", 0);
+            node.max_items = count_field(schema, "maxItems", UINT32_MAX);
+            if (node.max_items < node.min_items) {
+                *error = "maxItems is below minItems";
+                return false;
+            }
+            return add(std::move(node), out, error);
+        } else {
+            *out = kAnyNode;
+        }
+        return true;
+    }
+
+    void set_root(uint16_t node) { grammar_->nodes_[kRootNode].items = node; }
+
+private:
+    JsonGrammar* grammar_;
+
+    bool add(JsonGrammar::Node node, uint16_t* out, std::string* error) {
+        if (grammar_->nodes_.size() >= UINT16_MAX) {
+            *error = "schema is too large";
+            return false;
+        }
+        *out = static_cast<uint16_t>(grammar_->nodes_.size());
+        grammar_->nodes_.push_back(std::move(node));
+        return true;
+    }
+
+    static uint32_t count_field(const JsonValue& schema, const char* key, uint32_t fallback) {
+        const JsonValue* value = schema.get(key);
+        if (value == nullptr || value->type != JsonValue::kNumber) {
+            return fallback;
+        }
+        double n = std::atof(value->text.c_str());
+        return n < 0 ? 0 : n > static_cast<double>(UINT32_MAX) ? UINT32_MAX : static_cast<uint32_t>(n);
+    }
+
+    bool compile_object(const JsonValue& schema, const JsonValue& properties, uint16_t* out, std::string* error,
+                        int depth) {
+        JsonGrammar::Node node;
+        node.kind = JsonGrammar::kObject;
+        const JsonValue* required = schema.get("required");
+        size_t optional_run = 0;
+        for (const auto& member : properties.members) {
+            JsonGrammar::Property property;
+            property.key = escape(member.first);
+            if (property.key.size() > 255) {
+                *error = "property name too long: " + member.first;
+                return false;
+            }
+            if (required != nullptr) {
+                for (const auto& name : required->items) {
+                    property.required = property.required || name.text == member.first;
+                }
+            }
+            optional_run = property.required ? 0 : optional_run + 1;
+            if (optional_run >= kMaxAlternatives) {
+                *error = "too many optional properties in a row";
+                return false;
+            }
+            if (!compile(member.second, &property.value, error, depth + 1)) {
+                return false;
+            }
+            node.properties.push_back(std::move(property));
+        }
+        return add(std::move(node), out, error);
+    }
+};
+
+std::shared_ptr<const JsonGrammar> JsonGrammar::compile(const std::string& schema, std::string* error) {
+    auto grammar = std::make_shared<JsonGrammar>();
+    JsonSchemaCompiler compiler(grammar.get());
+    uint16_t root = kAnyNode;
+    if (schema.find_first_not_of(" \t\r\n") != std::string::npos) {
+        JsonValue value;
+        JsonReader reader(schema.data(), schema.data() + schema.size());
+        if (!reader.read_document(&value) || value.type != JsonValue::kObject) {
+            *error = "schema is not a JSON object";
+            return nullptr;
+        }
+        if (!compiler.compile(value, &root, error, 0)) {
+            return nullptr;
+        }
+    }
+    compiler.set_root(root);
+    grammar->root_ = kRootNode;
+    LOGI("Compiled JSON grammar: %zu nodes", grammar->nodes_.size());
+    return grammar;
+}
+
+std::string JsonGrammar::State::key() const {
+    std::string key(reinterpret_cast<const char*>(frames), depth * sizeof(Frame));
+    key.append(reinterpret_cast<const char*>(&whitespace), sizeof(whitespace));
+    return key;
+}
+
+JsonGrammar::State JsonGrammar::initial() const {
+    State state;
+    push(state, root_);
+    return state;
+}
+
+bool JsonGrammar::push(State& state, uint16_t node, uint8_t phase) const {
+    if (state.depth >= static_cast<uint32_t>(kMaxDepth)) {
+        return false;
+    }
+    Frame& frame = state.frames[state.depth++];
+    frame = Frame{node, phase, 0, 0, 0};
+    if (nodes_[node].kind == kLiterals) {
+        frame.b = all_bits(nodes_[node].literals.size());
+    }
+    return true;
+}
+
+bool JsonGrammar::rest_optional(const Node& node, uint32_t from) const {
+    for (size_t i = from; i < node.properties.size(); ++i) {
+        if (node.properties[i].required) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keys that may come next: every property up to and including the next required one
+uint32_t JsonGrammar::key_candidates(const Node& node, uint32_t from) const {
+    uint32_t mask = 0;
+    for (size_t i = from; i < node.properties.size() && i - from < kMaxAlternatives; ++i) {
+        mask |= 1u << (i - from);
+        if (node.properties[i].required) {
+            break;
+        }
+    }
+    return mask;
+}
+
+bool JsonGrammar::scalar_can_end(const Frame& frame) const {
+    const Node& node = nodes_[frame.node];
+    switch (node.kind) {
+        case kNumber:
+        case kInteger:
+            return frame.phase == 2 || frame.phase == 3 || frame.phase == 5 || frame.phase == 8;
+        case kLiterals:
+            for (size_t i = 0; i < node.literals.size(); ++i) {
+                if ((frame.b >> i & 1) && node.literals[i].size() == frame.a) {
+                    return true;
+                }
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+void JsonGrammar::child_done(Frame& parent) const {
+    const Node& node = nodes_[parent.node];
+    switch (node.kind) {
+        case kRoot:
+            parent.phase = 2;
+            break;
+        case kObject:
+            parent.phase = 7;
+            parent.a++;  // the property after the one just written
+            break;
+        case kAnyObject:
+            parent.phase = parent.phase == 3 ? 4 : 7;
+            break;
+        case kArray: {
+            parent.phase = 3;
+            // Only counts up to where minItems / maxItems care, so states recur
+            uint32_t saturation = std::max(node.min_items, node.max_items == UINT32_MAX ? 0 : node.max_items);
+            parent.b = std::min(parent.b + 1, saturation);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+JsonGrammar::Step JsonGrammar::step(State& state, uint8_t c) const {
+    Frame& f = state.frames[state.depth - 1];
+    const Node& node = nodes_[f.node];
+    bool ws = is_whitespace(c);
+
+    switch (node.kind) {
+        case kRoot:
+            if (f.phase == 0) {
+                if (ws) {
+                    return kConsumedWhitespace;
+                }
+                f.phase = 1;
+                return push(state, node.items) ? kRefeed : kReject;
+            }
+            return kReject;  // finished: only a stop token may follow
+
+        case kAny: {
+            uint16_t target;
+            if (c == '{') {
+                target = kAnyObjectNode;
+            } else if (c == '[') {
+                target = kAnyArrayNode;
+            } else if (c == '"') {
+                target = kStringNode;
+            } else if (c == '-' || is_digit(c)) {
+                target = kNumberNode;
+            } else if (c == 't' || c == 'f') {
+                target = kBooleanNode;
+            } else if (c == 'n') {
+                target = kNullNode;
+            } else {
+                return kReject;
+            }
+            state.depth--;
+            push(state, target);
+            return kRefeed;
+        }
+
+        case kString:
+            switch (f.phase) {
+                case 0:
+                    if (c != '"') return kReject;
+                    f.phase = 1;
+                    return kConsumed;
+                case 1:
+                    if (c == '"') return kPopConsumed;
+                    if (c == '\\') {
+                        f.phase = 2;
+                        return kConsumed;
+                    }
+                    return c < 0x20 ? kReject : kConsumed;
+                case 2:
+                    if (c == 'u') {
+                        f.phase = 3;
+                        f.a = 0;
+                        return kConsumed;
+                    }
+                    if (c != 0 && strchr("\"\\/bfnrt", c) != nullptr) {
+                        f.phase = 1;
+                        return kConsumed;
+                    }
+                    return kReject;
+                default:
+                    if (!is_hex(c)) return kReject;
+                    if (++f.a == 4) {
+                        f.phase = 1;
+                        f.a = 0;
+                    }
+                    return kConsumed;
+            }
+
+        case kNumber:
+        case kInteger: {
+            bool fraction = node.kind == kNumber;
+            bool digit = is_digit(c);
+            switch (f.phase) {
+                case 0:
+                    if (c == '-') {
+                        f.phase = 1;
+                        return kConsumed;
+                    }
+                    // fallthrough
+                case 1:
+                    if (c == '0') {
+                        f.phase = 2;
+                        return kConsumed;
+                    }
+                    if (!digit) return kReject;
+                    f.phase = 3;
+                    f.a = 1;
+                    return kConsumed;
+                case 2:
+                case 3:
+                    if (f.phase == 3 && digit) {
+                        if (f.a >= kMaxIntegerDigits) return kReject;
+                        f.a++;
+                        return kConsumed;
+                    }
+                    if (fraction && c == '.') {
+                        f.phase = 4;
+                        f.a = 0;
+                        return kConsumed;
+                    }
+                    if (fraction && (c == 'e' || c == 'E')) {
+                        f.phase = 6;
+                        f.a = 0;
+                        return kConsumed;
+                    }
+                    return kPopRefeed;
+                case 4:
+                    if (!digit) return kReject;
+                    f.phase = 5;
+                    f.a = 1;
+                    return kConsumed;
+                case 5:
+                    if (digit) {
+                        if (f.a >= kMaxIntegerDigits) return kReject;
+                        f.a++;
+                        return kConsumed;
+                    }
+                    if (c == 'e' || c == 'E') {
+                        f.phase = 6;
+                        f.a = 0;
+                        return kConsumed;
+                    }
+                    return kPopRefeed;
+                case 6:
+                    if (c == '+' || c == '-') {
+                        f.phase = 7;
+                        return kConsumed;
+                    }
+                    // fallthrough
+                case 7:
+                    if (!digit) return kReject;
+                    f.phase = 8;
+                    f.a = 1;
+                    return kConsumed;
+                default:
+                    if (digit) {
+                        if (f.a >= kMaxExponentDigits) return kReject;
+                        f.a++;
+                        return kConsumed;
+                    }
+                    return kPopRefeed;
+            }
+        }
+
+        case kLiterals: {
+            uint32_t next = 0;
+            for (size_t i = 0; i < node.literals.size(); ++i) {
+                const std::string& literal = node.literals[i];
+                if ((f.b >> i & 1) && literal.size() > f.a && static_cast<uint8_t>(literal[f.a]) == c) {
+                    next |= 1u << i;
+                }
+            }
+            if (next != 0) {
+                f.b = next;
+                f.a++;
+                return kConsumed;
+            }
+            return scalar_can_end(f) ? kPopRefeed : kReject;
+        }
+
+        case kObject:
+            switch (f.phase) {
+                case 0:
+                    if (c != '{') return kReject;
+                    f.phase = 1;
+                    f.a = 0;
+                    return kConsumed;
+                case 1:
+                case 8:
+                    if (ws) return kConsumedWhitespace;
+                    if (c == '}' && f.phase == 1) return rest_optional(node, f.a) ? kPopConsumed : kReject;
+                    if (c != '"') return kReject;
+                    f.b = key_candidates(node, f.a);
+                    if (f.b == 0) return kReject;
+                    f.phase = 3;
+                    f.offset = 0;
+                    return kConsumed;
+                case 3: {
+                    // f.a is the first candidate, f.b the candidates left, f.offset the key bytes matched
+                    uint32_t next = 0;
+                    for (uint32_t i = 0; i < 32; ++i) {
+                        if (!(f.b >> i & 1)) continue;
+                        const std::string& key = node.properties[f.a + i].key;
+                        if (c == '"' && key.size() == f.offset) {
+                            f.a += i;
+                            f.b = 0;
+                            f.offset = 0;
+                            f.phase = 4;
+                            return kConsumed;
+                        }
+                        if (key.size() > f.offset && static_cast<uint8_t>(key[f.offset]) == c) {
+                            next |= 1u << i;
+                        }
+                    }
+                    if (next == 0) return kReject;
+                    f.b = next;
+                    f.offset++;
+                    return kConsumed;
+                }
+                case 4:
+                    if (ws) return kConsumedWhitespace;
+                    if (c != ':') return kReject;
+                    f.phase = 5;
+                    return kConsumed;
+                case 5:
+                    if (ws) return kConsumedWhitespace;
+                    f.phase = 6;
+                    return push(state, node.properties[f.a].value) ? kRefeed : kReject;
+                case 7:
+                    if (ws) return kConsumedWhitespace;
+                    if (c == ',') {
+                        if (f.a >= node.properties.size()) return kReject;
+                        f.phase = 8;
+                        return kConsumed;
+                    }
+                    if (c == '}') return rest_optional(node, f.a) ? kPopConsumed : kReject;
+                    return kReject;
+                default:
+                    return kReject;
+            }
+
+        case kAnyObject:
+            switch (f.phase) {
+                case 0:
+                    if (c != '{') return kReject;
+                    f.phase = 1;
+                    return kConsumed;
+                case 1:
+                case 8:
+                    if (ws) return kConsumedWhitespace;
+                    if (c == '}' && f.phase == 1) return kPopConsumed;
+                    if (c != '"') return kReject;
+                    f.phase = 3;
+                    return push(state, kStringNode, 1) ? kConsumed : kReject;  // the key, past its quote
+                case 4:
+                    if (ws) return kConsumedWhitespace;
+                    if (c != ':') return kReject;
+                    f.phase = 5;
+                    return kConsumed;
+                case 5:
+                    if (ws) return kConsumedWhitespace;
+                    f.phase = 6;
+                    return push(state, kAnyNode) ? kRefeed : kReject;
+                case 7:
+                    if (ws) return kConsumedWhitespace;
+                    if (c == ',') {
+                        f.phase = 8;
+                        return kConsumed;
+                    }
+                    return c == '}' ? kPopConsumed : kReject;
+                default:
+                    return kReject;
+            }
+
+        case kArray:
+            switch (f.phase) {
+                case 0:
+                    if (c != '[') return kReject;
+                    f.phase = 1;
+                    f.b = 0;
+                    return kConsumed;
+                case 1:
+                case 4:
+                    if (ws) return kConsumedWhitespace;
+                    if (c == ']' && f.phase == 1) return node.min_items == 0 ? kPopConsumed : kReject;
+                    if (node.max_items == 0) return kReject;
+                    f.phase = 2;
+                    return push(state, node.items) ? kRefeed : kReject;
+                case 3:
+                    if (ws) return kConsumedWhitespace;
+                    if (c == ',') {
+                        if (f.b >= node.max_items) return kReject;
+                        f.phase = 4;
+                        return kConsumed;
+                    }
+                    if (c == ']') return f.b >= node.min_items ? kPopConsumed : kReject;
+                    return kReject;
+                default:
+                    return kReject;
+            }
+    }
+    return kReject;
+}
+
+bool JsonGrammar::feed(State& state, uint8_t c) const {
+    // Each refeed pops or replaces a frame, or pushes one that consumes next
+    for (int guard = 0; guard < 2 * kMaxDepth + 2; ++guard) {
+        if (state.depth == 0) {
+            return false;
+        }
+        switch (step(state, c)) {
+            case kConsumed:
+                state.whitespace = 0;
+                return true;
+            case kConsumedWhitespace:
+                return ++state.whitespace <= kMaxWhitespace;
+            case kReject:
+                return false;
+            case kPopConsumed:
+                state.depth--;
+                child_done(state.frames[state.depth - 1]);
+                state.whitespace = 0;
+                return true;
+            case kPopRefeed:
+                state.depth--;
+                child_done(state.frames[state.depth - 1]);
+                break;
+            case kRefeed:
+                break;
+        }
+    }
+    return false;
+}
+
+bool JsonGrammar::can_end(const State& state) const {
+    if (finished(state)) {
+        return true;
+    }
+    // A bare number or literal document ends where it stands
+    return state.depth == 2 && state.frames[0].phase == 1 && scalar_can_end(state.frames[1]);
+}
+
+bool JsonGrammar::finished(const State& state) const {
+    return state.depth == 1 && state.frames[0].phase == 2;
+}
+
+void GrammarVocab::build(const SpTokenizer& tokenizer, const std::vector<int>& stop_ids) {
+    size_t n = tokenizer.vocab_size();
+    blob_.clear();
+    offsets_.assign(1, 0);
+    std::string piece;
+    for (size_t id = 0; id < n; ++id) {
+        piece.clear();
+        tokenizer.append_piece(static_cast<int>(id), piece);
+        blob_ += piece;
+        offsets_.push_back(static_cast<uint32_t>(blob_.size()));
+    }
+
+    sorted_.clear();
+    max_length_ = 0;
+    for (size_t id = 0; id < n; ++id) {
+        size_t size = offsets_[id + 1] - offsets_[id];
+        if (size > 0 && size <= UINT16_MAX) {
+            sorted_.push_back(static_cast<int>(id));
+            max_length_ = std::max(max_length_, size);
+        }
+    }
+    auto text = [this](int id) {
+        return std::string_view(blob_.data() + offsets_[id], offsets_[id + 1] - offsets_[id]);
+    };
+    std::sort(sorted_.begin(), sorted_.end(), [&](int a, int b) { return text(a) < text(b); });
+    shared_prefix_.assign(sorted_.size(), 0);
+    for (size_t i = 1; i < sorted_.size(); ++i) {
+        std::string_view prev = text(sorted_[i - 1]);
+        std::string_view cur = text(sorted_[i]);
+        size_t k = 0;
+        while (k < prev.size() && k < cur.size() && prev[k] == cur[k]) {
+            ++k;
+        }
+        shared_prefix_[i] = static_cast<uint16_t>(k);
+    }
+    stop_ids_ = stop_ids;
+    LOGI("Grammar vocabulary: %zu of %zu pieces have text, longest %zu bytes", sorted_.size(), n, max_length_);
+}
+
+std::shared_ptr<const std::vector<uint64_t>> CompiledGrammar::mask(const JsonGrammar::State& state) {
+    std::string key = state.key();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = masks_.find(key);
+    if (it != masks_.end()) {
+        hits_++;
+        lru_.splice(lru_.begin(), lru_, it->second.second);
+        return it->second.first;
+    }
+    misses_++;
+    Mask mask = compute(state);
+    lru_.push_front(key);
+    masks_[key] = {mask, lru_.begin()};
+    if (masks_.size() > kMaxCachedMasks) {
+        masks_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    return mask;
+}
+
+CompiledGrammar::Mask CompiledGrammar::compute(const JsonGrammar::State& state) const {
+    const GrammarVocab& vocab = *vocab_;
+    const JsonGrammar& grammar = *grammar_;
+    auto mask = std::make_shared<std::vector<uint64_t>>(vocab.mask_words(), 0);
+
+    // prefixes[d] is the state after the first d bytes of the last token walked
+    std::vector<JsonGrammar::State> prefixes(vocab.max_length() + 1);
+    prefixes[0].assign(state);
+    size_t valid = 0;                // prefixes[0..valid] are current
+    size_t failed_at = SIZE_MAX;     // byte at which the last walked token was rejected
+    const std::vector<int>& sorted = vocab.sorted();
+    const std::vector<uint16_t>& shared = vocab.shared_prefix();
+    bool any = false;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        size_t common = shared[i];
+        if (failed_at != SIZE_MAX && common > failed_at) {
+            continue;  // starts with the prefix that was just rejected
+        }
+        size_t size;
+        const char* bytes = vocab.bytes(sorted[i], &size);
+        size_t d = std::min(common, valid);
+        bool ok = true;
+        for (; d < size; ++d) {
+            prefixes[d + 1].assign(prefixes[d]);
+            if (!grammar.feed(prefixes[d + 1], static_cast<uint8_t>(bytes[d]))) {
+                ok = false;
+                break;
+            }
+        }
+        valid = d;
+        if (ok) {
+            failed_at = SIZE_MAX;
+            (*mask)[sorted[i] / 64] |= 1ull << (sorted[i] % 64);
+            any = true;
+        } else {
+            failed_at = d;
+        }
+    }
+
+    // Stop tokens end a complete document, and are the way out of a dead end
+    if (grammar.can_end(state) || !any) {
+        for (int id : vocab.stop_ids()) {
+            if (id >= 0 && static_cast<size_t>(id) < vocab.vocab_size()) {
+                (*mask)[id / 64] |= 1ull << (id % 64);
+            }
+        }
+    }
+    return mask;
+}
+
+void GrammarMatcher::apply(float* logits, size_t vocab_size) {
+    auto mask = compiled_->mask(state_);
+    apply_mask(mask->data(), mask->size(), logits, vocab_size);
+}
+
+bool GrammarMatcher::shortlist(size_t limit, std::vector<int>* ids) {
+    auto mask = compiled_->mask(state_);
+    size_t allowed = 0;
+    for (uint64_t bits : *mask) {
+        allowed += static_cast<size_t>(__builtin_popcountll(bits));
+        if (allowed > limit) {
+            return false;
+        }
+    }
+    ids->clear();
+    ids->reserve(allowed);
+    for (size_t w = 0; w < mask->size(); ++w) {
+        for (uint64_t bits = (*mask)[w]; bits != 0; bits &= bits - 1) {
+            ids->push_back(static_cast<int>(w * 64 + static_cast<size_t>(__builtin_ctzll(bits))));
+        }
+    }
+    return true;
+}
+
+bool GrammarMatcher::accept(int token) {
+    const GrammarVocab& vocab = compiled_->vocab();
+    const JsonGrammar& grammar = compiled_->grammar();
+    const std::vector<int>& stops = vocab.stop_ids();
+    if (std::find(stops.begin(), stops.end(), token) != stops.end()) {
+        return grammar.can_end(state_);
+    }
+    if (token < 0 || static_cast<size_t>(token) >= vocab.vocab_size()) {
+        return false;
+    }
+    size_t size;
+    const char* bytes = vocab.bytes(token, &size);
+    JsonGrammar::State next;
+    next.assign(state_);
+    for (size_t i = 0; i < size; ++i) {
+        if (!grammar.feed(next, static_cast<uint8_t>(bytes[i]))) {
+            return false;
+        }
+    }
+    if (size == 0) {
+        return false;
+    }
+    state_.assign(next);
+    return true;
+}
+
+void GrammarMatcher::apply_mask(const uint64_t* mask, size_t words, float* logits, size_t vocab_size) {
+    const float blocked = -INFINITY;
+    size_t covered = std::min(vocab_size, words * 64);
+    for (size_t w = 0; w * 64 < covered; ++w) {
+        uint64_t bits = mask[w];
+        size_t base = w * 64;
+        size_t n = std::min<size_t>(64, covered - base);
+        if (bits == ~0ull) {
+            continue;
+        }
+        if (bits == 0) {
+            std::fill(logits + base, logits + base + n, blocked);
+            continue;
+        }
+        for (size_t j = 0; j < n; ++j) {
+            if (!(bits >> j & 1)) {
+                logits[base + j] = blocked;
+            }
+        }
+    }
+    // Rows padded past the tokenizer's vocabulary
+    std::fill(logits + covered, logits + vocab_size, blocked);
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class SpTokenizer;
+
+/**
+ * Constrained decoding to JSON, optionally shaped by a JSON schema.
+ *
+ * A schema compiles into a table of nodes, and a byte-level pushdown matcher
+ * walks the text generated so far. The schema subset is what quiz and
+ * flashcard output needs: type (object, array, string, number, integer,
+ * boolean, null), properties with required (emitted in schema order; optional
+ * ones may be skipped), items with minItems / maxItems, enum and const. A
+ * missing or unsupported type accepts any JSON value, and an empty schema
+ * means "any JSON document". Objects do not take properties the schema does
+ * not list.
+ *
+ * At each step the matcher's state maps to a bitset over the vocabulary of
+ * the tokens that may come next. Masks are computed by walking the vocabulary
+ * in byte order, so tokens sharing a prefix share the matcher steps and a
+ * rejected prefix skips every token under it. They are cached per state:
+ * generation keeps revisiting the same few states (inside a string, after a
+ * comma, ...) so after the first few tokens a step costs a cache lookup and
+ * one pass over the logits.
+ */
+class JsonGrammar {
+public:
+    static constexpr int kMaxDepth = 32;
+    static constexpr uint32_t kMaxWhitespace = 24;  // per run between tokens, so it cannot loop
+
+    // Nodes the matcher pushes; laid out so a state is a few plain words
+    struct Frame {
+        uint16_t node;
+        uint8_t phase;
+        uint8_t offset;  // key character being matched
+        uint32_t a;
+        uint32_t b;
+    };
+
+    struct State {
+        Frame frames[kMaxDepth];
+        uint32_t depth = 0;
+        uint32_t whitespace = 0;  // length of the current run of structural whitespace
+
+        void assign(const State& other) {
+            depth = other.depth;
+            whitespace = other.whitespace;
+            for (uint32_t i = 0; i < depth; ++i) {
+                frames[i] = other.frames[i];
+            }
+        }
+        // Bytes that determine what may follow
+        std::string key() const;
+    };
+
+    // Returns nullptr and sets `error` if `schema` is not a JSON object (or empty)
+    static std::shared_ptr<const JsonGrammar> compile(const std::string& schema, std::string* error);
+
+    State initial() const;
+    // Consume one byte of output; false if no document matching the schema continues this way
+    bool feed(State& state, uint8_t c) const;
+    // The output so far is a complete document
+    bool can_end(const State& state) const;
+    // Complete and nothing more may follow
+    bool finished(const State& state) const;
+
+    size_t node_count() const { return nodes_.size(); }
+
+    enum Kind : uint8_t {
+        kRoot,
+        kAny,
+        kObject,     // properties from the schema
+        kAnyObject,
+        kArray,
+        kString,
+        kNumber,
+        kInteger,
+        kLiterals,   // enum / const / true / false / null, as serialized JSON
+    };
+
+    struct Property {
+        std::string key;  // escaped as it appears between the quotes
+        uint16_t value = 0;
+        bool required = false;
+    };
+
+    struct Node {
+        Kind kind = kAny;
+        std::vector<Property> properties;
+        uint16_t items = 0;
+        uint32_t min_items = 0;
+        uint32_t max_items = UINT32_MAX;
+        std::vector<std::string> literals;
+    };
+
+private:
+    std::vector<Node> nodes_;
+    uint16_t root_ = 0;
+
+    friend class JsonSchemaCompiler;
+
+    enum Step { kConsumed, kConsumedWhitespace, kReject, kPopConsumed, kPopRefeed, kRefeed };
+
+    Step step(State& state, uint8_t c) const;
+    void child_done(Frame& parent) const;
+    bool push(State& state, uint16_t node, uint8_t phase = 0) const;
+    bool scalar_can_end(const Frame& frame) const;
+    bool rest_optional(const Node& node, uint32_t from) const;
+    uint32_t key_candidates(const Node& node, uint32_t from) const;
+};
+
+/**
+ * The tokenizer's pieces as bytes, sorted, with the prefix each shares with the
+ * one before it. Built once per tokenizer; control and unused pieces (no text)
+ * are left out and never allowed except as stop tokens.
+ */
+class GrammarVocab {
+public:
+    void build(const SpTokenizer& tokenizer, const std::vector<int>& stop_ids);
+    size_t vocab_size() const { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+    size_t mask_words() const { return (vocab_size() + 63) / 64; }
+
+    const char* bytes(int id, size_t* size) const {
+        *size = offsets_[id + 1] - offsets_[id];
+        return blob_.data() + offsets_[id];
+    }
+    const std::vector<int>& sorted() const { return sorted_; }
+    const std::vector<uint16_t>& shared_prefix() const { return shared_prefix_; }
+    const std::vector<int>& stop_ids() const { return stop_ids_; }
+    size_t max_length() const { return max_length_; }
+
+private:
+    std::string blob_;
+    std::vector<uint32_t> offsets_;       // by token id, size + 1
+    std::vector<int> sorted_;             // ids with text, in byte order
+    std::vector<uint16_t> shared_prefix_; // with the previous entry of sorted_
+    std::vector<int> stop_ids_;
+    size_t max_length_ = 0;
+};
+
+// A compiled schema plus its mask cache; shared by every request using the schema
+class CompiledGrammar {
+public:
+    static constexpr size_t kMaxCachedMasks = 128;  // 32 KB each for Gemma's vocabulary
+
+    CompiledGrammar(std::shared_ptr<const JsonGrammar> grammar, std::shared_ptr<const GrammarVocab> vocab)
+        : grammar_(std::move(grammar)), vocab_(std::move(vocab)) {}
+
+    const JsonGrammar& grammar() const { return *grammar_; }
+    const GrammarVocab& vocab() const { return *vocab_; }
+
+    // Allowed tokens in `state`; the pointer stays valid until the next call
+    std::shared_ptr<const std::vector<uint64_t>> mask(const JsonGrammar::State& state);
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    std::shared_ptr<const JsonGrammar> grammar_;
+    std::shared_ptr<const GrammarVocab> vocab_;
+
+    using Mask = std::shared_ptr<const std::vector<uint64_t>>;
+    std::mutex mutex_;
+    std::list<std::string> lru_;  // most recent first
+    std::unordered_map<std::string, std::pair<Mask, std::list<std::string>::iterator>> masks_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+
+    Mask compute(const JsonGrammar::State& state) const;
+};
+
+// Constrains one generation: mask the logits, then report the sampled token
+class GrammarMatcher {
+public:
+    explicit GrammarMatcher(std::shared_ptr<CompiledGrammar> compiled)
+        : compiled_(std::move(compiled)), state_(compiled_->grammar().initial()) {}
+
+    // Set every disallowed token of `logits` to -inf
+    void apply(float* logits, size_t vocab_size);
+    // The allowed tokens in the current state, one bit per token id
+    std::shared_ptr<const std::vector<uint64_t>> mask() { return compiled_->mask(state_); }
+    // Advance over the sampled token; false if it was not allowed
+    bool accept(int token);
+    bool finished() const { return compiled_->grammar().finished(state_); }
+    // The allowed tokens in ascending order, when there are at most `limit` of
+    // them; false (ids untouched) when the step needs the whole vocabulary
+    bool shortlist(size_t limit, std::vector<int>* ids);
+
+    // Word-at-a-time masking: whole words of allowed or disallowed tokens take one test
+    static void apply_mask(const uint64_t* mask, size_t words, float* logits, size_t vocab_size);
+
+private:
+    std::shared_ptr<CompiledGrammar> compiled_;
+    JsonGrammar::State state_;
+};
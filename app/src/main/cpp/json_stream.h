@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Incremental JSON splitter for structured answers: a deck of flashcards or
+ * a quiz, fed text as it is generated, reports each item the moment its
+ * object closes, so the first card can be shown while the rest is decoded.
+ *
+ * Items are the objects of the document's item array: the document itself
+ * when it is an array, or the first array valued member of a top-level
+ * object ({"cards": [...]}; its key is array_key()). A top-level object with
+ * no such array is one item, reported when it closes. Text before the first
+ * '{' or '[' (a preamble, a code fence) and after the document is skipped.
+ *
+ * The scan is byte by byte over the JSON structure only (brackets, strings,
+ * escapes), so multi-byte characters and numbers need no decoding, and only
+ * the item being built is kept. With constrained decoding (json_schema) the
+ * text is valid JSON; without it a bracket that closes the wrong container
+ * ends the stream with kEventError, the items before it already delivered.
+ */
+namespace json_stream {
+
+enum Event : int {
+    kEventItem = 0,   // an item object closed; the text is the object
+    kEventEnd = 1,    // the document closed; the text is empty
+    kEventError = 2,  // the text is the reason; nothing follows
+};
+
+static constexpr int kMaxDepth = 64;
+
+class ItemStream {
+public:
+    using Emit = std::function<void(int event, int index, const std::string& text)>;
+
+    explicit ItemStream(Emit emit) : emit_(std::move(emit)) {}
+
+    void push(const std::string& text) {
+        for (char c : text) {
+            if (done_) {
+                return;
+            }
+            push(c);
+        }
+    }
+
+    // The generation ended; an open document is reported as cut short
+    void finish() {
+        if (done_) {
+            return;
+        }
+        done_ = true;
+        emit_(kEventError, items_, stack_.empty() ? "no JSON in the answer" : "answer ended inside the JSON");
+    }
+
+    int items() const { return items_; }
+    bool done() const { return done_; }
+    const std::string& array_key() const { return array_key_; }
+
+private:
+    Emit emit_;
+    std::vector<char> stack_;  // open containers, '{' or '['
+    bool in_string_ = false;
+    bool escaped_ = false;
+    bool done_ = false;
+    int items_ = 0;
+    size_t items_depth_ = 0;  // depth of the item array, 0 until found
+    bool in_item_ = false;
+    std::string item_;       // the item being built
+    std::string whole_;      // a top-level object, until an item array shows up
+    std::string string_;     // the last string directly in a top-level object
+    std::string array_key_;
+
+    void push(char c) {
+        if (stack_.empty() && c != '{' && c != '[') {
+            return;  // before the document
+        }
+        if (in_item_) {
+            item_ += c;
+        } else if (items_depth_ == 0) {
+            whole_ += c;
+        }
+        if (in_string_) {
+            if (escaped_) {
+                escaped_ = false;
+            } else if (c == '\\') {
+                escaped_ = true;
+            } else if (c == '"') {
+                in_string_ = false;
+            }
+            if (in_string_ && stack_.size() == 1 && stack_[0] == '{') {
+                string_ += c;
+            }
+            return;
+        }
+        switch (c) {
+            case '"':
+                in_string_ = true;
+                if (stack_.size() == 1) {
+                    string_.clear();
+                }
+                break;
+            case '{':
+            case '[':
+                open(c);
+                break;
+            case '}':
+            case ']':
+                close(c);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void open(char c) {
+        if (stack_.size() >= static_cast<size_t>(kMaxDepth)) {
+            fail("nested too deeply");
+            return;
+        }
+        if (c == '[' && items_depth_ == 0 && (stack_.empty() || (stack_.size() == 1 && stack_[0] == '{'))) {
+            items_depth_ = stack_.size() + 1;
+            array_key_ = stack_.empty() ? "" : string_;
+            whole_.clear();
+        } else if (c == '{' && items_depth_ > 0 && stack_.size() == items_depth_) {
+            in_item_ = true;
+            item_.assign(1, '{');
+        }
+        stack_.push_back(c);
+    }
+
+    void close(char c) {
+        if (stack_.empty() || stack_.back() != (c == '}' ? '{' : '[')) {
+            fail(std::string("unexpected '") + c + "'");
+            return;
+        }
+        stack_.pop_back();
+        if (in_item_ && stack_.size() == items_depth_) {
+            in_item_ = false;
+            emit_(kEventItem, items_++, item_);
+            item_.clear();
+        }
+        if (stack_.empty()) {
+            if (items_depth_ == 0) {
+                emit_(kEventItem, items_++, whole_);
+            }
+            done_ = true;
+            emit_(kEventEnd, items_, "");
+        }
+    }
+
+    void fail(const std::string& why) {
+        done_ = true;
+        emit_(kEventError, items_, why);
+    }
+};
+
+}  // namespace json_stream
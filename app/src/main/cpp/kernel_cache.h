@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <tvm/runtime/device_api.h>
+
+#include "compute_device.h"
+
+/**
+ * Compiled GPU kernels kept across launches.
+ *
+ * OpenCL builds every program from source at first use in a process, and
+ * Vulkan creates its pipelines the same way, which adds seconds to the first
+ * turn. Modules that can hand the compiled state out and back
+ * (get_kernel_binaries / set_kernel_binaries: OpenCL program binaries,
+ * the Vulkan pipeline cache) get it saved to one file per backend once the
+ * kernels have run, and restored before the first turn of the next launch.
+ *
+ * Binaries only load on the driver that produced them, so the file starts with
+ * a key of device name, driver version and model fingerprint. A driver update
+ * or a new model changes the key; the stale file is then ignored and replaced
+ * by the next save.
+ */
+inline std::string compute_driver_version(DLDevice device) {
+    try {
+        tvm::runtime::DeviceAPI* api = tvm::runtime::DeviceAPI::Get(device, /*allow_missing=*/true);
+        if (api == nullptr) {
+            return std::string();
+        }
+        tvm::runtime::TVMRetValue version;
+        api->GetAttr(device, tvm::runtime::kDriverVersion, &version);
+        if (version.type_code() == kTVMStr) {
+            return version.operator std::string();
+        }
+        if (version.type_code() == kDLInt) {
+            return std::to_string(version.operator int64_t());  // Vulkan packs it in an int
+        }
+    } catch (const std::exception&) {
+    }
+    return std::string();
+}
+
+class KernelBinaryCache {
+public:
+    // Cache of `device`'s kernels for the model with `model_hash`, in `dir`
+    void open(const std::string& dir, const ComputeDevice& device, uint64_t model_hash) {
+        path_ = dir + "/kernel-cache-" + compute_backend_name(device.backend) + ".bin";
+        std::string identity = device.name + "\n" + compute_driver_version(device.device) + "\n";
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : identity) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 1099511628211ull;
+        }
+        char key[40];
+        snprintf(key, sizeof(key), "%016llx-%016llx", static_cast<unsigned long long>(hash),
+                 static_cast<unsigned long long>(model_hash));
+        key_ = key;
+    }
+
+    bool is_open() const { return !path_.empty(); }
+    const std::string& path() const { return path_; }
+
+    // The saved binaries, or empty when there are none for this key
+    std::string load() const {
+        std::ifstream in(path_, std::ios::binary);
+        std::string key;
+        if (!std::getline(in, key) || key != key_) {
+            return std::string();
+        }
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    // Written aside and renamed over, so a crash mid-write never leaves a truncated cache
+    bool save(const std::string& binaries) const {
+        if (path_.empty() || binaries.empty()) {
+            return false;
+        }
+        std::string tmp = path_ + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            out << key_ << '\n';
+            out.write(binaries.data(), static_cast<std::streamsize>(binaries.size()));
+            if (!out.good()) {
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        return std::rename(tmp.c_str(), path_.c_str()) == 0;
+    }
+
+private:
+    std::string path_;
+    std::string key_;
+};
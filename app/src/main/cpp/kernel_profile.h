@@ -0,0 +1,114 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <tvm/runtime/container/array.h>
+#include <tvm/runtime/container/map.h>
+#include <tvm/runtime/container/string.h>
+#include <tvm/runtime/profiling.h>
+
+/**
+ * Per-operator profiles of one prefill and a few decode steps, written to app
+ * storage for offline analysis.
+ *
+ * A chat module built with the Relax VM profiler exposes profile_step(phase,
+ * input), which runs one prefill ("prefill", text) or decode ("decode", token)
+ * and returns [logits, Report] with a row per kernel launch. Those per-step
+ * reports are merged here into one: every call gets a "Phase" column, percents
+ * are taken against the whole run and per-device totals are summed. Without
+ * profile_step the engine times each step with a runtime Profiler instead,
+ * which still gives the device totals and any registered metric collectors.
+ *
+ * The report is saved as profile-<backend>.json (ReportNode::AsJSON, readable
+ * by Report.from_json in Python) and profile-<backend>.csv (the calls only).
+ */
+namespace kernel_profile {
+
+using tvm::runtime::Array;
+using tvm::runtime::Map;
+using tvm::runtime::ObjectRef;
+using tvm::runtime::String;
+using tvm::runtime::make_object;
+using tvm::runtime::profiling::CountNode;
+using tvm::runtime::profiling::DurationNode;
+using tvm::runtime::profiling::PercentNode;
+using tvm::runtime::profiling::Report;
+
+inline double call_us(const Map<String, ObjectRef>& call) {
+    auto it = call.find("Duration (us)");
+    if (it == call.end()) {
+        return 0.0;
+    }
+    const DurationNode* duration = (*it).second.as<DurationNode>();
+    return duration != nullptr ? duration->microseconds : 0.0;
+}
+
+// Durations and counts add up across steps; anything else keeps the last value
+inline ObjectRef add_metric(const ObjectRef& total, const ObjectRef& value) {
+    if (const DurationNode* a = total.as<DurationNode>()) {
+        if (const DurationNode* b = value.as<DurationNode>()) {
+            return ObjectRef(make_object<DurationNode>(a->microseconds + b->microseconds));
+        }
+    }
+    if (const CountNode* a = total.as<CountNode>()) {
+        if (const CountNode* b = value.as<CountNode>()) {
+            return ObjectRef(make_object<CountNode>(a->value + b->value));
+        }
+    }
+    return value;
+}
+
+inline Report merge_reports(const std::vector<std::pair<std::string, Report>>& steps,
+                            const Map<String, ObjectRef>& configuration) {
+    double total_us = 0.0;
+    for (const auto& step : steps) {
+        for (const Map<String, ObjectRef>& call : step.second->calls) {
+            total_us += call_us(call);
+        }
+    }
+
+    Array<Map<String, ObjectRef>> calls;
+    Map<String, Map<String, ObjectRef>> devices;
+    for (const auto& step : steps) {
+        for (Map<String, ObjectRef> call : step.second->calls) {
+            call.Set("Phase", String(step.first));
+            if (total_us > 0.0) {
+                call.Set("Percent", ObjectRef(make_object<PercentNode>(call_us(call) * 100.0 / total_us)));
+            }
+            calls.push_back(call);
+        }
+        for (const auto& device : step.second->device_metrics) {
+            Map<String, ObjectRef> merged = devices.count(device.first) ? devices[device.first]
+                                                                        : Map<String, ObjectRef>();
+            for (const auto& metric : device.second) {
+                if (metric.first == "Percent") {
+                    continue;  // per step; meaningless once summed
+                }
+                auto it = merged.find(metric.first);
+                merged.Set(metric.first, it == merged.end() ? metric.second : add_metric((*it).second, metric.second));
+            }
+            devices.Set(device.first, merged);
+        }
+    }
+    return Report(calls, devices, configuration);
+}
+
+inline bool write_file(const std::string& path, const std::string& contents) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << contents;
+    return static_cast<bool>(out);
+}
+
+// Path of the JSON report, or empty if either file could not be written
+inline std::string write_report(const std::string& dir, const std::string& backend, const Report& report) {
+    std::string base = dir + "/profile-" + backend;
+    if (!write_file(base + ".json", report->AsJSON()) || !write_file(base + ".csv", report->AsCSV())) {
+        return "";
+    }
+    return base + ".json";
+}
+
+}  // namespace kernel_profile
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "json_fields.h"
+
+/**
+ * Idle-time tuning of the chat module's hot kernels, remembered per device.
+ *
+ * Schedules cannot be searched and compiled on the phone, so the model
+ * library ships a few precompiled schedules per hot kernel (tilings and
+ * vector widths for the decode GEMVs, attention split sizes) and lets the
+ * engine pick one:
+ *   kernel_variants() -> String                 one "kernel\tvariant,variant,..." line per kernel
+ *   select_kernel_variant(kernel, variant)      use `variant` from the next call on
+ *
+ * The engine measures one (kernel, variant) candidate at a time on the real
+ * workload, while the others keep their best variant so far. Results go to a
+ * JSON-lines file in app storage; each record carries what a meta_schedule
+ * TuningRecord would (workload, schedule, run times) as kernel, variant and
+ * run_ms, plus the device and model it was measured on, since the same
+ * library behaves differently on Snapdragon, Exynos and Tensor GPUs. Later
+ * launches apply the best recorded variant without measuring again.
+ */
+struct KernelVariants {
+    std::string kernel;
+    std::vector<std::string> variants;
+};
+
+inline std::vector<KernelVariants> parse_kernel_variants(const std::string& text) {
+    std::vector<KernelVariants> kernels;
+    size_t line_start = 0;
+    while (line_start < text.size()) {
+        size_t line_end = text.find('\n', line_start);
+        if (line_end == std::string::npos) {
+            line_end = text.size();
+        }
+        std::string line = text.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0) {
+            continue;
+        }
+        KernelVariants kernel;
+        kernel.kernel = line.substr(0, tab);
+        size_t start = tab + 1;
+        while (start < line.size()) {
+            size_t comma = line.find(',', start);
+            if (comma == std::string::npos) {
+                comma = line.size();
+            }
+            if (comma > start) {
+                kernel.variants.push_back(line.substr(start, comma - start));
+            }
+            start = comma + 1;
+        }
+        if (kernel.variants.size() > 1) {  // nothing to choose between otherwise
+            kernels.push_back(std::move(kernel));
+        }
+    }
+    return kernels;
+}
+
+struct TuningRecord {
+    std::string kernel;
+    std::string variant;
+    double run_ms = 0.0;  // a typical turn with this variant
+};
+
+class TuningDatabase {
+public:
+    // Load the records of `device` and `model_hash` from `path`; a missing file is an empty database
+    void open(const std::string& path, const std::string& device, uint64_t model_hash) {
+        path_ = path;
+        device_ = device;
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(model_hash));
+        model_hash_ = hash;
+        records_.clear();
+
+        std::ifstream in(path_);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (json_string_field(line, "device") != device_ || json_string_field(line, "model_hash") != model_hash_) {
+                continue;
+            }
+            TuningRecord record;
+            record.kernel = json_string_field(line, "kernel");
+            record.variant = json_string_field(line, "variant");
+            record.run_ms = json_float_field(line, "run_ms", 0.0);
+            if (!record.kernel.empty() && !record.variant.empty() && record.run_ms > 0.0) {
+                records_[{record.kernel, record.variant}] = record;
+            }
+        }
+    }
+
+    bool is_open() const { return !path_.empty(); }
+    size_t size() const { return records_.size(); }
+
+    bool measured(const std::string& kernel, const std::string& variant) const {
+        return records_.count({kernel, variant}) != 0;
+    }
+
+    // Fastest recorded variant of `kernel`, or nullptr
+    const TuningRecord* best(const std::string& kernel) const {
+        const TuningRecord* best = nullptr;
+        for (auto it = records_.lower_bound({kernel, std::string()}); it != records_.end() && it->first.first == kernel;
+             ++it) {
+            if (best == nullptr || it->second.run_ms < best->run_ms) {
+                best = &it->second;
+            }
+        }
+        return best;
+    }
+
+    // Every record of this device and model, by kernel
+    std::vector<TuningRecord> records() const {
+        std::vector<TuningRecord> all;
+        for (const auto& entry : records_) {
+            all.push_back(entry.second);
+        }
+        return all;
+    }
+
+    // Keep `record` and append it to the file; false if the file could not be written
+    bool commit(const TuningRecord& record) {
+        records_[{record.kernel, record.variant}] = record;
+        if (path_.empty()) {
+            return false;
+        }
+        std::ofstream out(path_, std::ios::app);
+        out << "{\"device\": \"" << device_ << "\", \"model_hash\": \"" << model_hash_ << "\", \"kernel\": \""
+            << record.kernel << "\", \"variant\": \"" << record.variant << "\", \"run_ms\": " << record.run_ms << "}\n";
+        return out.good();
+    }
+
+private:
+    std::string path_;
+    std::string device_;
+    std::string model_hash_;
+    std::map<std::pair<std::string, std::string>, TuningRecord> records_;
+};
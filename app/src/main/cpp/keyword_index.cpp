@@ -0,0 +1,595 @@
+#include "keyword_index.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("KEYWORD_INDEX", __VA_ARGS__)
+#define LOGE(...) NLOGE("KEYWORD_INDEX", __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t kMagic = 0x574b4253;  // "SBKW"
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kRemoved = 0xffffffffu;
+constexpr size_t kMinCompactRecords = 64;
+
+constexpr char kDocsFile[] = "/docs.bin";
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vocab_size;
+    uint32_t reserved;
+};
+
+// Leads every record in docs.bin, followed by `bytes` of encoded terms
+struct RecordHeader {
+    int64_t id;
+    uint32_t length;  // kRemoved drops the id
+    uint32_t bytes;
+};
+
+void put_varint(std::vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+uint32_t get_varint(const uint8_t*& p) {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *p++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80) || shift >= 28) {
+            return value;
+        }
+    }
+}
+
+bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+}  // namespace
+
+size_t top_k_scores(const float* values, size_t n, size_t k, uint32_t* docs, float* scores) {
+    if (k == 0) {
+        return 0;
+    }
+    // Min-heap of the best k so far; nothing at or below `threshold` can enter
+    std::vector<std::pair<float, uint32_t>> best;
+    best.reserve(k);
+    float threshold = 0.0f;
+    auto offer = [&](float value, uint32_t doc) {
+        if (value <= threshold) {
+            return;
+        }
+        if (best.size() < k) {
+            best.emplace_back(value, doc);
+            std::push_heap(best.begin(), best.end(), std::greater<std::pair<float, uint32_t>>());
+        } else {
+            std::pop_heap(best.begin(), best.end(), std::greater<std::pair<float, uint32_t>>());
+            best.back() = {value, doc};
+            std::push_heap(best.begin(), best.end(), std::greater<std::pair<float, uint32_t>>());
+        }
+        if (best.size() == k) {
+            threshold = best.front().first;
+        }
+    };
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        if (vmaxvq_f32(vld1q_f32(values + i)) <= threshold) {
+            continue;
+        }
+        for (size_t j = i; j < i + 4; ++j) {
+            offer(values[j], static_cast<uint32_t>(j));
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        offer(values[i], static_cast<uint32_t>(i));
+    }
+    std::sort_heap(best.begin(), best.end(), std::greater<std::pair<float, uint32_t>>());
+    for (size_t r = 0; r < best.size(); ++r) {
+        docs[r] = best[r].second;
+        scores[r] = best[r].first;
+    }
+    return best.size();
+}
+
+KeywordIndex::~KeywordIndex() {
+    close();
+}
+
+bool KeywordIndex::open(const std::string& dir, std::shared_ptr<const SpTokenizer> tokenizer) {
+    close();
+    if (!tokenizer || !tokenizer->loaded()) {
+        return false;
+    }
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        LOGE("Cannot create %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+    dir_ = dir;
+    tokenizer_ = std::move(tokenizer);
+    indexed_.assign(tokenizer_->vocab_size(), 0);
+    std::string piece;
+    for (size_t id = 0; id < indexed_.size(); ++id) {
+        piece.clear();
+        tokenizer_->append_piece(static_cast<int>(id), piece);
+        indexed_[id] = std::any_of(piece.begin(), piece.end(), [](char c) {
+            unsigned char u = static_cast<unsigned char>(c);
+            return u >= 0x80 || (u >= '0' && u <= '9') || (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z');
+        }) ? 1 : 0;
+    }
+    if (!replay()) {
+        close();
+        return false;
+    }
+    if (docs_.size() - live_count_ > std::max(live_count_, kMinCompactRecords) && !compact()) {
+        LOGE("Cannot compact %s", dir.c_str());
+    }
+    std::string path = dir_ + kDocsFile;
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        LOGE("Cannot open %s: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+    if (st.st_size == 0) {
+        FileHeader header = {kMagic, kVersion, static_cast<uint32_t>(tokenizer_->vocab_size()), 0};
+        if (!write_all(fd_, &header, sizeof(header))) {
+            close();
+            return false;
+        }
+    }
+    LOGI("Opened keyword index %s: %zu docs, %zu terms, %zu posting bytes", dir.c_str(), live_count_,
+         postings_.size(), posting_bytes_);
+    return true;
+}
+
+void KeywordIndex::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    dir_.clear();
+    tokenizer_.reset();
+    indexed_.clear();
+    docs_.clear();
+    doc_of_.clear();
+    postings_.clear();
+    live_count_ = 0;
+    total_length_ = 0;
+    posting_bytes_ = 0;
+    norms_.clear();
+    norms_dirty_ = true;
+    accumulators_.clear();
+}
+
+// Rebuild the postings from docs.bin, dropping a record torn by a crash mid-append
+bool KeywordIndex::replay() {
+    std::string path = dir_ + kDocsFile;
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good()) {
+        return true;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    if (data.empty()) {
+        return true;
+    }
+    FileHeader header;
+    if (data.size() < sizeof(header)) {
+        return truncate(path.c_str(), 0) == 0;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != kMagic || header.version != kVersion || header.vocab_size != tokenizer_->vocab_size()) {
+        LOGE("%s was built with another tokenizer", path.c_str());
+        return false;
+    }
+    size_t offset = sizeof(header);
+    while (offset + sizeof(RecordHeader) <= data.size()) {
+        RecordHeader record;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        if (offset + sizeof(record) + record.bytes > data.size()) {
+            break;
+        }
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data()) + offset + sizeof(record);
+        if (record.length == kRemoved) {
+            drop_doc(record.id);
+        } else {
+            index_doc(record.id, record.length, std::vector<uint8_t>(bytes, bytes + record.bytes));
+        }
+        offset += sizeof(record) + record.bytes;
+    }
+    if (offset != data.size() && truncate(path.c_str(), static_cast<off_t>(offset)) != 0) {
+        return false;
+    }
+    return true;
+}
+
+// Rewrite docs.bin with only the live docs, then replay it
+bool KeywordIndex::compact() {
+    FileHeader header = {kMagic, kVersion, static_cast<uint32_t>(tokenizer_->vocab_size()), 0};
+    std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const Doc& doc : docs_) {
+        if (!doc.live) {
+            continue;
+        }
+        RecordHeader record = {doc.id, doc.length, static_cast<uint32_t>(doc.terms.size())};
+        out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        out.append(reinterpret_cast<const char*>(doc.terms.data()), doc.terms.size());
+    }
+    std::string path = dir_ + kDocsFile;
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_all(fd, out.data(), out.size()) && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    size_t before = docs_.size();
+    docs_.clear();
+    doc_of_.clear();
+    postings_.clear();
+    live_count_ = 0;
+    total_length_ = 0;
+    posting_bytes_ = 0;
+    norms_dirty_ = true;
+    bool replayed = replay();
+    LOGI("Compacted %s from %zu to %zu records", path.c_str(), before, docs_.size());
+    return replayed;
+}
+
+uint32_t KeywordIndex::encode_terms(std::string_view text, std::vector<uint8_t>* terms) const {
+    std::string lowered(text);
+    for (char& c : lowered) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    std::vector<int> ids = tokenizer_->encode(lowered);
+    ids.erase(std::remove_if(ids.begin(), ids.end(), [this](int id) {
+        return id < 0 || static_cast<size_t>(id) >= indexed_.size() || !indexed_[id];
+    }), ids.end());
+    std::sort(ids.begin(), ids.end());
+    terms->clear();
+    int previous = 0;
+    for (size_t i = 0; i < ids.size();) {
+        size_t run = i + 1;
+        while (run < ids.size() && ids[run] == ids[i]) {
+            run++;
+        }
+        put_varint(*terms, static_cast<uint32_t>(ids[i] - previous));
+        put_varint(*terms, static_cast<uint32_t>(run - i));
+        previous = ids[i];
+        i = run;
+    }
+    return static_cast<uint32_t>(ids.size());
+}
+
+std::vector<int32_t> KeywordIndex::distinct_terms(std::string_view text) const {
+    std::vector<uint8_t> encoded;
+    encode_terms(text, &encoded);
+    std::vector<int32_t> terms;
+    const uint8_t* p = encoded.data();
+    const uint8_t* end = p + encoded.size();
+    int32_t term = 0;
+    while (p < end) {
+        term += static_cast<int32_t>(get_varint(p));
+        get_varint(p);
+        terms.push_back(term);
+    }
+    return terms;
+}
+
+void KeywordIndex::index_doc(int64_t id, uint32_t length, std::vector<uint8_t> terms) {
+    drop_doc(id);
+    uint32_t doc = static_cast<uint32_t>(docs_.size());
+    const uint8_t* p = terms.data();
+    const uint8_t* end = p + terms.size();
+    int32_t term = 0;
+    while (p < end) {
+        term += static_cast<int32_t>(get_varint(p));
+        uint32_t tf = get_varint(p);
+        Postings& postings = postings_[term];
+        size_t before = postings.bytes.size();
+        put_varint(postings.bytes, doc - postings.last_doc);
+        put_varint(postings.bytes, tf);
+        posting_bytes_ += postings.bytes.size() - before;
+        postings.last_doc = doc;
+        postings.count++;
+        postings.live++;
+    }
+    Doc entry;
+    entry.id = id;
+    entry.length = length;
+    entry.live = true;
+    entry.terms = std::move(terms);
+    docs_.push_back(std::move(entry));
+    doc_of_[id] = doc;
+    live_count_++;
+    total_length_ += length;
+    norms_dirty_ = true;
+}
+
+void KeywordIndex::drop_doc(int64_t id) {
+    auto it = doc_of_.find(id);
+    if (it == doc_of_.end()) {
+        return;
+    }
+    Doc& doc = docs_[it->second];
+    const uint8_t* p = doc.terms.data();
+    const uint8_t* end = p + doc.terms.size();
+    int32_t term = 0;
+    while (p < end) {
+        term += static_cast<int32_t>(get_varint(p));
+        get_varint(p);
+        auto postings = postings_.find(term);
+        if (postings != postings_.end() && postings->second.live > 0) {
+            postings->second.live--;
+        }
+    }
+    doc.live = false;
+    std::vector<uint8_t>().swap(doc.terms);
+    live_count_--;
+    total_length_ -= doc.length;
+    doc_of_.erase(it);
+    norms_dirty_ = true;
+}
+
+bool KeywordIndex::append_record(int64_t id, uint32_t length, const std::vector<uint8_t>& terms) {
+    std::vector<uint8_t> record(sizeof(RecordHeader) + terms.size());
+    RecordHeader header = {id, length, static_cast<uint32_t>(terms.size())};
+    memcpy(record.data(), &header, sizeof(header));
+    if (!terms.empty()) {
+        memcpy(record.data() + sizeof(header), terms.data(), terms.size());
+    }
+    return fd_ >= 0 && write_all(fd_, record.data(), record.size());
+}
+
+bool KeywordIndex::add(int64_t id, std::string_view text) {
+    if (fd_ < 0) {
+        return false;
+    }
+    std::vector<uint8_t> terms;
+    uint32_t length = encode_terms(text, &terms);
+    if (!append_record(id, length, terms)) {
+        return false;
+    }
+    index_doc(id, length, std::move(terms));
+    return true;
+}
+
+bool KeywordIndex::remove(int64_t id) {
+    if (fd_ < 0 || doc_of_.find(id) == doc_of_.end() || !append_record(id, kRemoved, {})) {
+        return false;
+    }
+    drop_doc(id);
+    return true;
+}
+
+size_t KeywordIndex::search(std::string_view query, size_t k, int64_t* ids, float* scores) {
+    if (fd_ < 0 || k == 0 || live_count_ == 0) {
+        return 0;
+    }
+    if (norms_dirty_) {
+        float average = average_length();
+        norms_.resize(docs_.size());
+        for (size_t d = 0; d < docs_.size(); ++d) {
+            float relative = average > 0.0f ? docs_[d].length / average : 1.0f;
+            norms_[d] = kK1 * (1.0f - kB + kB * relative);
+        }
+        norms_dirty_ = false;
+    }
+    accumulators_.assign(docs_.size(), 0.0f);
+
+    std::vector<uint8_t> query_terms;
+    encode_terms(query, &query_terms);
+    const uint8_t* q = query_terms.data();
+    const uint8_t* q_end = q + query_terms.size();
+    int32_t term = 0;
+    float n = static_cast<float>(live_count_);
+    while (q < q_end) {
+        term += static_cast<int32_t>(get_varint(q));
+        get_varint(q);
+        auto it = postings_.find(term);
+        if (it == postings_.end() || it->second.live == 0) {
+            continue;
+        }
+        const Postings& postings = it->second;
+        float df = static_cast<float>(postings.live);
+        float idf = std::log(1.0f + (n - df + 0.5f) / (df + 0.5f));
+        const uint8_t* p = postings.bytes.data();
+        uint32_t doc = 0;
+        for (uint32_t i = 0; i < postings.count; ++i) {
+            doc += get_varint(p);
+            float tf = static_cast<float>(get_varint(p));
+            if (docs_[doc].live) {
+                accumulators_[doc] += idf * tf * (kK1 + 1.0f) / (tf + norms_[doc]);
+            }
+        }
+    }
+
+    std::vector<uint32_t> docs(k);
+    std::vector<float> best(k);
+    size_t found = top_k_scores(accumulators_.data(), accumulators_.size(), k, docs.data(), best.data());
+    for (size_t i = 0; i < found; ++i) {
+        ids[i] = docs_[docs[i]].id;
+        if (scores != nullptr) {
+            scores[i] = best[i];
+        }
+    }
+    return found;
+}
+
+float KeywordIndex::term_recall(std::string_view answer, std::string_view reference) const {
+    if (!tokenizer_) {
+        return 0.0f;
+    }
+    std::vector<int32_t> expected = distinct_terms(reference);
+    std::vector<int32_t> given = distinct_terms(answer);
+    float n = static_cast<float>(live_count_);
+    float total = 0.0f;
+    float matched = 0.0f;
+    size_t g = 0;
+    for (int32_t term : expected) {
+        auto it = postings_.find(term);
+        float df = it != postings_.end() ? static_cast<float>(it->second.live) : 0.0f;
+        float idf = std::log(1.0f + (n - df + 0.5f) / (df + 0.5f));
+        total += idf;
+        while (g < given.size() && given[g] < term) {
+            g++;
+        }
+        if (g < given.size() && given[g] == term) {
+            matched += idf;
+        }
+    }
+    return total > 0.0f ? matched / total : 0.0f;
+}
+
+bool KeywordIndex::sync() {
+    return fd_ >= 0 && fsync(fd_) == 0;
+}
+
+namespace keyword_index {
+
+namespace {
+
+std::mutex& handles_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::map<int64_t, std::pair<std::string, std::shared_ptr<Handle>>>& handles() {
+    static std::map<int64_t, std::pair<std::string, std::shared_ptr<Handle>>> open_handles;
+    return open_handles;
+}
+
+// Tokenizers by path, alive while an index uses them
+std::shared_ptr<const SpTokenizer> shared_tokenizer(const std::string& path) {
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const SpTokenizer>> tokenizers;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (std::shared_ptr<const SpTokenizer> tokenizer = tokenizers[path].lock()) {
+        return tokenizer;
+    }
+    auto tokenizer = std::make_shared<SpTokenizer>();
+    if (!tokenizer->load(path)) {
+        LOGE("Failed to load tokenizer from %s", path.c_str());
+        return nullptr;
+    }
+    tokenizers[path] = tokenizer;
+    return tokenizer;
+}
+
+}  // namespace
+
+int64_t open_handle(const std::string& dir, const std::string& tokenizer_path) {
+    static int64_t next_handle = 1;
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex());
+        for (const auto& entry : handles()) {
+            if (entry.second.first == dir) {
+                LOGE("Keyword index %s is already open", dir.c_str());
+                return 0;
+            }
+        }
+    }
+    std::shared_ptr<const SpTokenizer> tokenizer = shared_tokenizer(tokenizer_path);
+    auto handle = std::make_shared<Handle>();
+    if (!tokenizer || !handle->index.open(dir, tokenizer)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(handles_mutex());
+    int64_t id = next_handle++;
+    handles()[id] = {dir, handle};
+    return id;
+}
+
+std::shared_ptr<Handle> find_handle(int64_t handle) {
+    std::lock_guard<std::mutex> lock(handles_mutex());
+    auto it = handles().find(handle);
+    return it != handles().end() ? it->second.second : nullptr;
+}
+
+bool close_handle(int64_t handle) {
+    std::shared_ptr<Handle> index;
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex());
+        auto it = handles().find(handle);
+        if (it == handles().end()) {
+            return false;
+        }
+        index = std::move(it->second.second);
+        handles().erase(it);
+    }
+    std::lock_guard<std::mutex> lock(index->mutex);
+    bool synced = index->index.sync();
+    index->index.close();
+    return synced;
+}
+
+std::vector<int64_t> fuse_rankings(const std::vector<std::vector<int64_t>>& rankings, size_t k) {
+    std::unordered_map<int64_t, float> fused;
+    for (const std::vector<int64_t>& ranking : rankings) {
+        for (size_t rank = 0; rank < ranking.size(); ++rank) {
+            fused[ranking[rank]] += 1.0f / (kFusionK + static_cast<float>(rank + 1));
+        }
+    }
+    std::vector<std::pair<float, int64_t>> ordered;
+    ordered.reserve(fused.size());
+    for (const auto& entry : fused) {
+        ordered.emplace_back(entry.second, entry.first);
+    }
+    size_t count = std::min(k, ordered.size());
+    std::partial_sort(ordered.begin(), ordered.begin() + count, ordered.end(),
+                      [](const std::pair<float, int64_t>& a, const std::pair<float, int64_t>& b) {
+                          return a.first != b.first ? a.first > b.first : a.second < b.second;
+                      });
+    std::vector<int64_t> out;
+    out.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        out.push_back(ordered[i].second);
+    }
+    return out;
+}
+
+}  // namespace keyword_index
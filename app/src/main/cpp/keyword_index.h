@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sp_tokenizer.h"
+
+/**
+ * BM25 keyword index over study material, the lexical half of hybrid
+ * retrieval next to the vector index (vector_index.h).
+ *
+ * Terms are the SentencePiece ids of the lower-cased text, so pages split into
+ * words the way the chat model reads them and no second segmenter is needed.
+ * Pieces without a letter or digit are dropped. Each term keeps its postings
+ * as (doc, tf) pairs in doc order, the doc gap and the tf varint-coded, and a
+ * page appends one posting to each of its terms, so OCR pages go in one at
+ * a time as they arrive. A query adds up the BM25 weight of each of its terms
+ * into one score per doc (term at a time), then picks the top k with a NEON
+ * pass that skips four docs at a time below the k-th best.
+ *
+ * On disk, in the index directory, docs.bin holds append-only (id, length,
+ * encoded terms) records. They are replayed on open and rewritten without the
+ * dead ones once those are the majority. Adding an id again replaces it. The
+ * records are only valid for the tokenizer they were built with, so the
+ * header keeps its vocabulary size.
+ *
+ * Not thread safe; the JNI handles below serialize each index.
+ */
+class KeywordIndex {
+public:
+    static constexpr float kK1 = 1.2f;
+    static constexpr float kB = 0.75f;
+
+    KeywordIndex() = default;
+    KeywordIndex(const KeywordIndex&) = delete;
+    KeywordIndex& operator=(const KeywordIndex&) = delete;
+    ~KeywordIndex();
+
+    bool open(const std::string& dir, std::shared_ptr<const SpTokenizer> tokenizer);
+    void close();
+
+    bool add(int64_t id, std::string_view text);
+    bool remove(int64_t id);
+
+    // Up to `k` best ids with their BM25 scores, best first; returns how many
+    size_t search(std::string_view query, size_t k, int64_t* ids, float* scores);
+
+    // Share of `reference`'s terms that `answer` contains, each weighted by its IDF
+    // over the indexed pages, so the rare words of the material count the most
+    float term_recall(std::string_view answer, std::string_view reference) const;
+
+    // fsync the appended records
+    bool sync();
+
+    size_t size() const { return live_count_; }
+    size_t terms() const { return postings_.size(); }
+    size_t posting_bytes() const { return posting_bytes_; }
+    float average_length() const { return live_count_ > 0 ? static_cast<float>(total_length_) / live_count_ : 0.0f; }
+
+private:
+    struct Postings {
+        std::vector<uint8_t> bytes;  // varint (doc gap, tf) pairs
+        uint32_t last_doc = 0;
+        uint32_t count = 0;
+        uint32_t live = 0;  // document frequency among live docs
+    };
+
+    struct Doc {
+        int64_t id = 0;
+        uint32_t length = 0;  // total term count
+        bool live = false;
+        std::vector<uint8_t> terms;  // varint (term gap, tf) pairs, as in docs.bin
+    };
+
+    // Sorted (term, tf) pairs of `text`, encoded; returns the total tf
+    uint32_t encode_terms(std::string_view text, std::vector<uint8_t>* terms) const;
+    // The distinct terms of `text`, ascending
+    std::vector<int32_t> distinct_terms(std::string_view text) const;
+    void index_doc(int64_t id, uint32_t length, std::vector<uint8_t> terms);
+    void drop_doc(int64_t id);
+    bool append_record(int64_t id, uint32_t length, const std::vector<uint8_t>& terms);
+    bool replay();
+    bool compact();
+
+    std::string dir_;
+    int fd_ = -1;
+    std::shared_ptr<const SpTokenizer> tokenizer_;
+    std::vector<uint8_t> indexed_;  // per piece id: has a letter or digit
+
+    std::vector<Doc> docs_;  // by internal doc number, in the order added
+    std::unordered_map<int64_t, uint32_t> doc_of_;
+    std::unordered_map<int32_t, Postings> postings_;
+    size_t live_count_ = 0;
+    uint64_t total_length_ = 0;
+    size_t posting_bytes_ = 0;
+
+    // Per-doc BM25 length normalization, rebuilt when the collection changed
+    std::vector<float> norms_;
+    bool norms_dirty_ = true;
+    std::vector<float> accumulators_;
+};
+
+// Fill `docs` and `scores` with the `k` largest of the positive `values`,
+// best first; returns how many. NEON skips blocks below the current k-th best.
+size_t top_k_scores(const float* values, size_t n, size_t k, uint32_t* docs, float* scores);
+
+namespace keyword_index {
+
+struct Handle {
+    std::mutex mutex;
+    KeywordIndex index;
+};
+
+// 0 if the index cannot be opened. The tokenizer at `tokenizer_path` is
+// loaded once and shared by every index opened with it.
+int64_t open_handle(const std::string& dir, const std::string& tokenizer_path);
+std::shared_ptr<Handle> find_handle(int64_t handle);
+bool close_handle(int64_t handle);
+
+// Reciprocal rank fusion of ranked id lists: each id scores the sum of
+// 1 / (kFusionK + rank) over the lists it is in. Returns the best `k`.
+static constexpr float kFusionK = 60.0f;
+std::vector<int64_t> fuse_rankings(const std::vector<std::vector<int64_t>>& rankings, size_t k);
+
+}  // namespace keyword_index
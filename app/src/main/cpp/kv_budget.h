@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "model_config.h"
+
+// Reported by getKvStats()
+struct KvBudgetStats {
+    uint64_t budget_bytes = 0;
+    uint64_t resident_bytes = 0;
+    uint32_t resident_sessions = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes_per_token = 0;
+};
+
+// Storage of K and V entries, "kv_cache_dtype" in mlc-chat-config.json. The
+// 8-bit modes keep one fp16 scale per group of values within a head.
+enum KvCacheDtype {
+    kKvFloat16 = 0,
+    kKvInt8 = 1,
+    kKvFloat8 = 2,  // e4m3
+};
+
+inline KvCacheDtype kv_cache_dtype_from_name(const std::string& name) {
+    if (name == "int8") return kKvInt8;
+    if (name == "e4m3_float8" || name == "float8" || name == "fp8") return kKvFloat8;
+    return kKvFloat16;
+}
+
+inline const char* kv_cache_dtype_name(KvCacheDtype dtype) {
+    switch (dtype) {
+        case kKvInt8: return "int8";
+        case kKvFloat8: return "e4m3_float8";
+        default: return "float16";
+    }
+}
+
+/**
+ * Memory budget for the KV state of chat sessions.
+ *
+ * Tracks the KV bytes each session holds (in the module or in a snapshot slot)
+ * in least-recently-used order. When the total goes over the budget, victims()
+ * names the sessions to evict, oldest first, never the one in use.
+ *
+ * Bytes are estimated from the token count: K and V per layer, per KV head, of
+ * head_dim values each — about 104 KB per token for Gemma 2 2B in fp16, and
+ * 55 KB with an 8-bit KV cache and 32-value scale groups. Gemma 2's local
+ * layers, every other one, attend to the last sliding_window tokens only and
+ * keep their KV in a ring of that length, so past the window a token costs
+ * only the global layers' half.
+ */
+class KvBudget {
+public:
+    // 256 MB: a few long sessions fit without pushing a 4 GB device into the LMK
+    static constexpr uint64_t kDefaultBudgetBytes = 256ull << 20;
+
+    void set_budget(uint64_t bytes) { budget_ = bytes; }
+    uint64_t budget() const { return budget_; }
+
+    // `local_bytes` of each token's `bytes` are in layers that keep only the last `window` tokens
+    void set_bytes_per_token(uint64_t bytes, uint64_t local_bytes = 0, uint64_t window = 0) {
+        bytes_per_token_ = bytes;
+        local_bytes_per_token_ = window > 0 ? std::min(local_bytes, bytes) : 0;
+        window_ = window;
+    }
+    uint64_t bytes_for_tokens(uint64_t tokens) const {
+        uint64_t global = bytes_per_token_ - local_bytes_per_token_;
+        return tokens * global + std::min(tokens, window_) * local_bytes_per_token_;
+    }
+
+    // Record that `id` holds `tokens` tokens of KV and was just used
+    void update(int64_t id, uint64_t tokens) {
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            order_.push_front(id);
+            it = entries_.emplace(id, Entry{0, order_.begin()}).first;
+        } else {
+            order_.splice(order_.begin(), order_, it->second.position);
+        }
+        resident_ -= it->second.bytes;
+        it->second.bytes = bytes_for_tokens(tokens);
+        resident_ += it->second.bytes;
+    }
+
+    // The session's KV is gone (evicted, reset or closed)
+    void erase(int64_t id) {
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            return;
+        }
+        resident_ -= it->second.bytes;
+        order_.erase(it->second.position);
+        entries_.erase(it);
+    }
+
+    // Least recently used sessions to evict until the total fits, skipping `keep`.
+    // The caller evicts them and reports each with evicted().
+    std::vector<int64_t> victims(int64_t keep) const {
+        std::vector<int64_t> out;
+        uint64_t total = resident_;
+        for (auto it = order_.rbegin(); it != order_.rend() && total > budget_; ++it) {
+            if (*it == keep) {
+                continue;
+            }
+            out.push_back(*it);
+            total -= entries_.at(*it).bytes;
+        }
+        return out;
+    }
+
+    void evicted(int64_t id) {
+        erase(id);
+        evictions_++;
+    }
+
+    bool resident(int64_t id) const { return entries_.find(id) != entries_.end(); }
+
+    // Bytes per resident session, most recently used first
+    std::vector<std::pair<int64_t, uint64_t>> session_bytes() const {
+        std::vector<std::pair<int64_t, uint64_t>> out;
+        for (int64_t id : order_) {
+            out.emplace_back(id, entries_.at(id).bytes);
+        }
+        return out;
+    }
+
+    KvBudgetStats stats() const {
+        KvBudgetStats stats;
+        stats.budget_bytes = budget_;
+        stats.resident_bytes = resident_;
+        stats.resident_sessions = static_cast<uint32_t>(entries_.size());
+        stats.evictions = evictions_;
+        stats.bytes_per_token = bytes_per_token_;
+        return stats;
+    }
+
+    // Model shape and KV storage from mlc-chat-config.json
+    struct KvLayout {
+        uint64_t layers = 0;
+        uint64_t kv_heads = 0;
+        uint64_t head_dim = 0;
+        KvCacheDtype dtype = kKvFloat16;
+        uint64_t group_size = 32;  // values per scale in the 8-bit modes
+        uint64_t local_layers = 0;  // of `layers`, attending to the last `window` tokens
+        uint64_t window = 0;
+
+        // Returns 0 if a shape field was missing
+        uint64_t bytes_per_token() const { return bytes_per_layer_token() * layers; }
+        uint64_t local_bytes_per_token() const { return bytes_per_layer_token() * local_layers; }
+
+        uint64_t bytes_per_layer_token() const {
+            uint64_t values = 2 * kv_heads * head_dim;
+            if (dtype == kKvFloat16) {
+                return values * sizeof(uint16_t);
+            }
+            uint64_t groups_per_head = (head_dim + group_size - 1) / group_size;
+            return values + 2 * kv_heads * groups_per_head * sizeof(uint16_t);
+        }
+    };
+
+    static KvLayout layout_from_config(const model_config::ModelConfig& config) {
+        KvLayout layout;
+        layout.layers = positive(config.num_hidden_layers);
+        layout.kv_heads = positive(config.num_key_value_heads);
+        layout.head_dim = positive(config.head_dim);
+        layout.dtype = kv_cache_dtype_from_name(config.kv_cache_dtype);
+        uint64_t group_size = positive(config.kv_quant_group_size);
+        if (group_size > 0) {
+            layout.group_size = group_size;
+        }
+        // Gemma 2 starts with a local layer and alternates; the others have no local layers
+        if (config.model_type.compare(0, 6, "gemma2") == 0 && config.sliding_window > 0) {
+            layout.local_layers = (layout.layers + 1) / 2;
+            layout.window = static_cast<uint64_t>(config.sliding_window);
+        }
+        return layout;
+    }
+
+private:
+    struct Entry {
+        uint64_t bytes;
+        std::list<int64_t>::iterator position;
+    };
+
+    uint64_t budget_ = kDefaultBudgetBytes;
+    uint64_t bytes_per_token_ = 0;
+    uint64_t local_bytes_per_token_ = 0;
+    uint64_t window_ = 0;
+    uint64_t resident_ = 0;
+    uint64_t evictions_ = 0;
+    std::list<int64_t> order_;  // most recently used first
+    std::unordered_map<int64_t, Entry> entries_;
+
+    static uint64_t positive(int64_t value) { return value > 0 ? static_cast<uint64_t>(value) : 0; }
+};
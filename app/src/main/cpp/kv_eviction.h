@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * KV eviction policies for conversations that outgrow their token budget.
+ *
+ * The sliding window (context_window.h) drops whole turns, oldest first,
+ * whatever they held. The heavy-hitter policy (H2O) keeps the tokens later
+ * queries attended to instead: the module sums the attention mass each cached
+ * token has drawn, across heads, layers and steps, and the tokens with the
+ * least are evicted until the conversation fits its budget. The system
+ * prompt, the attention sinks after it and the last kRecentTokens always stay,
+ * since the next tokens attend to them whatever the past said.
+ */
+namespace kv_eviction {
+
+enum Policy : int {
+    kPolicyWindow = 0,       // shift whole turns out (fit_context)
+    kPolicyHeavyHitter = 1,  // evict the least attended tokens in place
+};
+
+// Tokens at the end of the conversation that are never evicted
+constexpr size_t kRecentTokens = 256;
+
+/**
+ * Positions to evict from a KV of `length` tokens with accumulated `mass` each,
+ * ascending, so that `budget` remain. The first `keep_front` and the last
+ * `recent` never go; when those alone pass the budget, everything else does.
+ * Ties go to the older token, which later queries are less likely to need.
+ */
+inline std::vector<int64_t> select(const float* mass, size_t length, size_t keep_front, size_t recent,
+                                   size_t budget) {
+    std::vector<int64_t> out;
+    if (length <= budget || keep_front + recent >= length) {
+        return out;
+    }
+    size_t first = keep_front;
+    size_t last = length - recent;  // evictable: [first, last)
+    size_t evict = std::min(length - budget, last - first);
+    out.reserve(last - first);
+    for (size_t i = first; i < last; ++i) {
+        out.push_back(static_cast<int64_t>(i));
+    }
+    auto lighter = [mass](int64_t a, int64_t b) { return mass[a] < mass[b] || (mass[a] == mass[b] && a < b); };
+    if (evict < out.size()) {
+        std::nth_element(out.begin(), out.begin() + evict, out.end(), lighter);
+        out.resize(evict);
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+}  // namespace kv_eviction
@@ -0,0 +1,731 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/memfd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Tiered store for the KV of sessions the KV budget evicts, so resuming one
+ * loads its pages back instead of prefilling every turn again.
+ *
+ * The module serializes a slot only to a file (save_kv / load_kv), so pages
+ * move between tiers as that file:
+ *
+ *   raw     the file as save_kv wrote it; what load_kv reads back
+ *   memory  packed in memory
+ *   flash   packed in a file next to the raw ones
+ *
+ * An evicted session starts raw. The offload worker packs it into memory and
+ * deletes the raw file; past the memory cap the least recently evicted move
+ * to flash, and past the flash cap they are dropped, leaving the session to
+ * its turn list as before. stage() brings a session's pages back for load_kv:
+ * unpacked into a memfd that load_kv opens through /proc/self/fd, so a resume
+ * from memory never touches flash (and from flash only reads the packed
+ * file), or into a raw file again where the kernel has no memfd_create. The
+ * engine calls it when the session is resumed, and prefetchSession ahead of
+ * that, from the worker, when the UI expects the resume (its chat tab gets
+ * focus), so the resume is only load_kv copying pages already unpacked.
+ *
+ * Packing is zlib, the one codec the NDK ships (LZ4 would need vendoring),
+ * over 1 MB blocks whose 16-bit words are split into a plane of low bytes and
+ * one of high bytes first. fp16 KV values cluster in a few exponents, so the
+ * high plane is Huffman coded; the low plane is mantissa bits that do not
+ * pack, and is kept as it is. A block whose high plane does not shrink in a
+ * 4 KB sample (int8 KV) is kept whole without deflating the rest.
+ *
+ * Files are named after the session and a generation number, so a worker
+ * still writing the files of an entry that was erased meanwhile never
+ * clobbers those of the session's next eviction; it deletes its own instead.
+ */
+namespace kv_offload {
+
+enum Tier : int {
+    kNone = 0,
+    kRaw = 1,
+    kMemory = 2,
+    kFlash = 3,
+};
+
+static constexpr uint64_t kDefaultMemoryBytes = 64ull << 20;
+static constexpr uint64_t kDefaultFlashBytes = 512ull << 20;
+static constexpr size_t kBlockBytes = 1 << 20;
+static constexpr uint32_t kStoredFlag = 0x80000000u;  // a block kept unpacked
+static constexpr size_t kSampleBytes = 4096;           // of a high plane, deflated first
+
+// Even bytes (the low ones of little-endian 16-bit words, and an odd last
+// byte) to `low`, odd ones to `high`
+inline void split_planes(const uint8_t* in, size_t size, uint8_t* low, uint8_t* high) {
+    size_t half = size / 2;
+    for (size_t i = 0; i < half; ++i) {
+        low[i] = in[2 * i];
+        high[i] = in[2 * i + 1];
+    }
+    if (size & 1) {
+        low[half] = in[size - 1];
+    }
+}
+
+inline void join_planes(const uint8_t* low, const uint8_t* high, size_t size, uint8_t* out) {
+    size_t half = size / 2;
+    for (size_t i = 0; i < half; ++i) {
+        out[2 * i] = low[i];
+        out[2 * i + 1] = high[i];
+    }
+    if (size & 1) {
+        out[size - 1] = low[half];
+    }
+}
+
+// Deflates `size` bytes into `out` (`out_size` in: its room, out: bytes
+// written) with Huffman coding alone: the high plane is sign and exponent bits
+// in no order LZ77 matches would find, so skipping the match search packs it
+// as tight as Z_BEST_SPEED does at about three times the speed
+inline bool deflate_plane(const uint8_t* in, size_t size, uint8_t* out, uLongf* out_size) {
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15, 8, Z_HUFFMAN_ONLY) != Z_OK) {
+        return false;
+    }
+    stream.next_in = const_cast<Bytef*>(in);
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = out;
+    stream.avail_out = static_cast<uInt>(*out_size);
+    bool ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+    *out_size = stream.total_out;
+    deflateEnd(&stream);
+    return ok;
+}
+
+// Appends `size` bytes as one block: u32 raw bytes, u32 deflated high-plane
+// bytes, the low plane as it is, then the high plane deflated. With
+// kStoredFlag on the second word the block follows as it is instead.
+inline void pack_block(const uint8_t* data, size_t size, std::vector<uint8_t>* scratch, std::vector<uint8_t>* out) {
+    size_t low_size = size - size / 2;
+    size_t high_size = size / 2;
+    uLong bound = compressBound(high_size);
+    scratch->resize(high_size + bound);
+    uint8_t* high = scratch->data();
+    uint8_t* packed = high + high_size;
+    size_t header = out->size();
+    out->resize(header + 8 + low_size);
+    split_planes(data, size, out->data() + header + 8, high);
+    // A sample that barely shrinks (int8 KV, or noise) skips deflating the whole plane
+    size_t sample = std::min(kSampleBytes, high_size);
+    uLongf packed_size = bound;
+    bool shrank = deflate_plane(high, sample, packed, &packed_size) && packed_size < sample - sample / 16;
+    packed_size = bound;
+    shrank = shrank && deflate_plane(high, high_size, packed, &packed_size) && packed_size < high_size;
+    uint32_t words[2] = {static_cast<uint32_t>(size),
+                         shrank ? static_cast<uint32_t>(packed_size) : static_cast<uint32_t>(size) | kStoredFlag};
+    memcpy(out->data() + header, words, sizeof(words));
+    if (!shrank) {
+        out->resize(header + sizeof(words));
+        out->insert(out->end(), data, data + size);
+        return;
+    }
+    out->insert(out->end(), packed, packed + packed_size);
+}
+
+inline bool pack(const uint8_t* data, size_t size, std::vector<uint8_t>* out) {
+    std::vector<uint8_t> scratch;
+    out->clear();
+    out->reserve(size / 2);
+    for (size_t offset = 0; offset < size; offset += kBlockBytes) {
+        pack_block(data + offset, std::min(kBlockBytes, size - offset), &scratch, out);
+    }
+    return true;
+}
+
+// Packs the file at `path`; `raw_bytes` gets its size
+inline bool pack_file(const std::string& path, std::vector<uint8_t>* out, uint64_t* raw_bytes) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::vector<uint8_t> block(kBlockBytes);
+    std::vector<uint8_t> scratch;
+    out->clear();
+    *raw_bytes = 0;
+    bool ok = true;
+    while (true) {
+        size_t n = fread(block.data(), 1, block.size(), file);
+        if (n > 0) {
+            pack_block(block.data(), n, &scratch, out);
+            *raw_bytes += n;
+        }
+        if (n < block.size()) {
+            ok = ferror(file) == 0;
+            break;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Calls `sink(bytes, size)` with each unpacked block in order; false on a malformed stream
+template <typename Sink>
+inline bool unpack(const uint8_t* data, size_t size, Sink&& sink) {
+    std::vector<uint8_t> high;
+    std::vector<uint8_t> block;
+    size_t offset = 0;
+    while (offset < size) {
+        uint32_t raw_size;
+        uint32_t stored;
+        if (size - offset < 8) {
+            return false;
+        }
+        memcpy(&raw_size, data + offset, 4);
+        memcpy(&stored, data + offset + 4, 4);
+        offset += 8;
+        uint32_t stored_size = stored & ~kStoredFlag;
+        if (raw_size > kBlockBytes) {
+            return false;
+        }
+        if (stored & kStoredFlag) {
+            if (stored_size != raw_size || raw_size > size - offset || !sink(data + offset, raw_size)) {
+                return false;
+            }
+            offset += raw_size;
+            continue;
+        }
+        size_t low_size = raw_size - raw_size / 2;
+        if (low_size > size - offset || stored_size > size - offset - low_size) {
+            return false;
+        }
+        high.resize(raw_size / 2);
+        block.resize(raw_size);
+        uLongf high_size = high.size();
+        if (uncompress(high.data(), &high_size, data + offset + low_size, stored_size) != Z_OK ||
+            high_size != high.size()) {
+            return false;
+        }
+        join_planes(data + offset, high.data(), raw_size, block.data());
+        if (!sink(block.data(), raw_size)) {
+            return false;
+        }
+        offset += low_size + stored_size;
+    }
+    return true;
+}
+
+// Written whole through a temporary file, so a reader never sees a partial one
+inline bool write_file(const std::string& path, const std::vector<uint8_t>& data) {
+    std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = data.empty() || fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline bool read_file(const std::string& path, std::vector<uint8_t>* out) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    out->clear();
+    uint8_t buffer[64 * 1024];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        out->insert(out->end(), buffer, buffer + n);
+    }
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+// Unpacks `packed` into the file at `path`, through a temporary file
+inline bool unpack_file(const std::vector<uint8_t>& packed, const std::string& path) {
+    std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = unpack(packed.data(), packed.size(), [file](const uint8_t* data, size_t size) {
+        return fwrite(data, 1, size, file) == size;
+    });
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline bool write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Unpacks `packed` into a memfd load_kv can open as buffer_path(fd); -1 if
+// it will not unpack or the kernel has no memfd_create
+inline int unpack_buffer(const std::vector<uint8_t>& packed, uint64_t raw_bytes) {
+    int fd = -1;
+#ifdef __NR_memfd_create
+    fd = static_cast<int>(syscall(__NR_memfd_create, "kv_offload", MFD_CLOEXEC));
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+    uint64_t written = 0;
+    bool ok = ftruncate(fd, static_cast<off_t>(raw_bytes)) == 0 &&
+              unpack(packed.data(), packed.size(), [fd, &written](const uint8_t* data, size_t size) {
+                  written += size;
+                  return write_all(fd, data, size);
+              });
+    if (!ok || written != raw_bytes) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline std::string buffer_path(int fd) {
+    return "/proc/self/fd/" + std::to_string(fd);
+}
+
+struct Stats {
+    uint32_t raw_sessions = 0;
+    uint32_t memory_sessions = 0;
+    uint32_t flash_sessions = 0;
+    uint64_t raw_bytes = 0;        // raw files and staged memfds
+    uint64_t memory_bytes = 0;     // packed, in memory
+    uint64_t flash_bytes = 0;      // packed, on flash
+    uint64_t packed_from = 0;      // raw bytes of what is packed in either tier
+    uint64_t offloaded = 0;
+    uint64_t restored = 0;         // loaded back into a slot
+    uint64_t prefetched = 0;       // staged by prefetch ahead of the resume
+    uint64_t dropped = 0;          // past the flash cap; resumed from the turn list
+    double pack_ms = 0.0;
+    double unpack_ms = 0.0;
+};
+
+class Store {
+public:
+    // Spill into `dir` (created if missing), keeping up to `memory_bytes`
+    // packed in memory and `flash_bytes` on flash. Files an earlier process
+    // left there are deleted: KV is only good for the module that wrote it.
+    bool open(const std::string& dir, uint64_t memory_bytes, uint64_t flash_bytes) {
+        if (dir.empty() || (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)) {
+            return false;
+        }
+        clear();
+        std::lock_guard<std::mutex> lock(mutex_);
+        dir_ = dir;
+        memory_cap_ = memory_bytes;
+        flash_cap_ = flash_bytes;
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d)) {
+                if (strncmp(e->d_name, "session-", 8) == 0) {
+                    unlink((dir + "/" + e->d_name).c_str());
+                }
+            }
+            closedir(d);
+        }
+        return true;
+    }
+
+    bool is_open() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !dir_.empty();
+    }
+
+    // Forgets every entry and deletes its files; the directory stays open
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& it : entries_) {
+            delete_files(it.first, it.second);
+        }
+        entries_.clear();
+        memory_bytes_ = 0;
+        flash_bytes_ = 0;
+        cond_.notify_all();
+    }
+
+    // Where the module should save `id`'s KV; the entry counts once commit_raw() says it is written
+    std::string begin_raw(int64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (dir_.empty()) {
+            return std::string();
+        }
+        auto it = entries_.find(id);
+        if (it != entries_.end()) {
+            forget(it);
+        }
+        Entry& entry = entries_[id];
+        entry.generation = ++next_generation_;
+        entry.used = ++clock_;
+        return raw_path(id, entry.generation);
+    }
+
+    void commit_raw(int64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            return;
+        }
+        struct stat st{};
+        std::string path = raw_path(id, it->second.generation);
+        if (stat(path.c_str(), &st) != 0 || st.st_size <= 0) {
+            forget(it);
+            return;
+        }
+        it->second.raw = true;
+        it->second.raw_bytes = static_cast<uint64_t>(st.st_size);
+        stats_.offloaded++;
+    }
+
+    // Packs raw entries into memory, spills memory past its cap to flash and
+    // drops flash past its cap, least recently used first. For the offload
+    // worker: packing runs outside the store's lock.
+    void compact() {
+        while (pack_next()) {
+        }
+        while (spill_next()) {
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (flash_bytes_ > flash_cap_) {
+            auto victim = entries_.end();
+            for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+                const Entry& entry = it->second;
+                if (entry.tier == kFlash && !entry.busy && !entry.staged &&
+                    (victim == entries_.end() || entry.used < victim->second.used)) {
+                    victim = it;
+                }
+            }
+            if (victim == entries_.end()) {
+                break;
+            }
+            stats_.dropped++;
+            forget(victim);
+        }
+    }
+
+    // A path load_kv reads `id`'s pages from, unpacked here if need be; ""
+    // if they were dropped or will not unpack. `prefetch` counts it as staged
+    // ahead of the resume.
+    std::string stage(int64_t id, bool prefetch = false) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        // A spill holds the packed bytes outside the lock; a pack still has the raw file
+        cond_.wait(lock, [&] {
+            it = entries_.find(id);
+            return it == entries_.end() || it->second.raw || !it->second.busy;
+        });
+        if (it == entries_.end()) {
+            return std::string();
+        }
+        Entry& entry = it->second;
+        entry.used = ++clock_;
+        uint64_t generation = entry.generation;
+        std::string path = raw_path(id, generation);
+        if (entry.raw) {
+            entry.staged = true;
+            return entry.fd >= 0 ? buffer_path(entry.fd) : path;
+        }
+        if (entry.tier == kNone) {
+            return std::string();
+        }
+        std::vector<uint8_t> packed;
+        if (entry.tier == kMemory) {
+            packed = entry.packed;
+        }
+        Tier tier = entry.tier;
+        uint64_t raw_bytes = entry.raw_bytes;
+        entry.busy = true;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = tier != kFlash || read_file(packed_path(id, generation), &packed);
+        int fd = ok ? unpack_buffer(packed, raw_bytes) : -1;
+        // Without memfd_create the pages go back to a raw file, as save_kv left them
+        ok = ok && (fd >= 0 || unpack_file(packed, path));
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        it = entries_.find(id);
+        bool current = it != entries_.end() && it->second.generation == generation;
+        if (current) {
+            it->second.busy = false;
+            it->second.raw = ok;
+            it->second.staged = ok;
+            it->second.fd = ok ? fd : -1;
+        }
+        cond_.notify_all();
+        if (!ok || !current) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            unlink(path.c_str());
+            return std::string();
+        }
+        stats_.unpack_ms += ms;
+        if (prefetch) {
+            stats_.prefetched++;
+        }
+        return fd >= 0 ? buffer_path(fd) : path;
+    }
+
+    // The entry's pages are in a slot again (`restored`) or no longer wanted
+    void erase(int64_t id, bool restored = false) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            return;
+        }
+        if (restored) {
+            stats_.restored++;
+        }
+        forget(it);
+    }
+
+    Tier tier(int64_t id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            return kNone;
+        }
+        return it->second.raw ? kRaw : it->second.tier;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats stats = stats_;
+        stats.memory_bytes = memory_bytes_;
+        stats.flash_bytes = flash_bytes_;
+        for (const auto& it : entries_) {
+            const Entry& entry = it.second;
+            if (entry.raw) {
+                stats.raw_sessions++;
+                stats.raw_bytes += entry.raw_bytes;
+            } else if (entry.tier == kMemory) {
+                stats.memory_sessions++;
+            } else if (entry.tier == kFlash) {
+                stats.flash_sessions++;
+            }
+            if (entry.tier != kNone) {
+                stats.packed_from += entry.raw_bytes;
+            }
+        }
+        return stats;
+    }
+
+    std::string stats_json() const {
+        Stats s = stats();
+        char json[640];
+        snprintf(json, sizeof(json),
+                 "{\"raw_sessions\": %u, \"memory_sessions\": %u, \"flash_sessions\": %u, \"raw_bytes\": %llu, "
+                 "\"memory_bytes\": %llu, \"flash_bytes\": %llu, \"packed_from\": %llu, \"offloaded\": %llu, "
+                 "\"restored\": %llu, \"prefetched\": %llu, \"dropped\": %llu, \"pack_ms\": %.1f, "
+                 "\"unpack_ms\": %.1f}",
+                 s.raw_sessions, s.memory_sessions, s.flash_sessions, static_cast<unsigned long long>(s.raw_bytes),
+                 static_cast<unsigned long long>(s.memory_bytes), static_cast<unsigned long long>(s.flash_bytes),
+                 static_cast<unsigned long long>(s.packed_from), static_cast<unsigned long long>(s.offloaded),
+                 static_cast<unsigned long long>(s.restored), static_cast<unsigned long long>(s.prefetched),
+                 static_cast<unsigned long long>(s.dropped), s.pack_ms, s.unpack_ms);
+        return json;
+    }
+
+private:
+    struct Entry {
+        uint64_t generation = 0;
+        uint64_t used = 0;            // LRU clock: evicted or staged
+        bool raw = false;             // the raw file is written and current
+        bool staged = false;          // brought back for a resume; the raw file stays
+        bool busy = false;            // a pack, spill or unpack runs outside the lock
+        int fd = -1;                  // staged into a memfd rather than the raw file
+        Tier tier = kNone;            // where the packed copy is, if any
+        uint64_t raw_bytes = 0;
+        uint64_t packed_bytes = 0;
+        std::vector<uint8_t> packed;  // kMemory
+    };
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::string dir_;
+    uint64_t memory_cap_ = kDefaultMemoryBytes;
+    uint64_t flash_cap_ = kDefaultFlashBytes;
+    uint64_t memory_bytes_ = 0;
+    uint64_t flash_bytes_ = 0;
+    uint64_t next_generation_ = 0;
+    uint64_t clock_ = 0;
+    std::map<int64_t, Entry> entries_;
+    Stats stats_;
+
+    std::string raw_path(int64_t id, uint64_t generation) const {
+        return dir_ + "/session-" + std::to_string(id) + "-" + std::to_string(generation) + ".kv";
+    }
+
+    std::string packed_path(int64_t id, uint64_t generation) const {
+        return dir_ + "/session-" + std::to_string(id) + "-" + std::to_string(generation) + ".kvz";
+    }
+
+    // Under mutex_; a busy entry's worker finds it gone and deletes what it wrote
+    void delete_files(int64_t id, const Entry& entry) {
+        if (entry.fd >= 0) {
+            close(entry.fd);
+        }
+        unlink(raw_path(id, entry.generation).c_str());
+        unlink(packed_path(id, entry.generation).c_str());
+    }
+
+    // Under mutex_
+    void forget(std::map<int64_t, Entry>::iterator it) {
+        if (it->second.tier == kMemory) {
+            memory_bytes_ -= it->second.packed_bytes;
+        } else if (it->second.tier == kFlash) {
+            flash_bytes_ -= it->second.packed_bytes;
+        }
+        delete_files(it->first, it->second);
+        entries_.erase(it);
+        cond_.notify_all();
+    }
+
+    // Packs the oldest raw entry not staged into memory; false when there is none
+    bool pack_next() {
+        int64_t id = 0;
+        uint64_t generation = 0;
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto next = entries_.end();
+            for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+                const Entry& entry = it->second;
+                if (entry.raw && !entry.staged && !entry.busy && entry.tier == kNone &&
+                    (next == entries_.end() || entry.used < next->second.used)) {
+                    next = it;
+                }
+            }
+            if (next == entries_.end()) {
+                return false;
+            }
+            next->second.busy = true;
+            id = next->first;
+            generation = next->second.generation;
+            path = raw_path(id, generation);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint8_t> packed;
+        uint64_t raw_bytes = 0;
+        bool ok = pack_file(path, &packed, &raw_bytes);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end() || it->second.generation != generation) {
+            return true;
+        }
+        Entry& entry = it->second;
+        entry.busy = false;
+        cond_.notify_all();
+        if (!ok) {
+            forget(it);
+            return true;
+        }
+        stats_.pack_ms += ms;
+        entry.packed_bytes = packed.size();
+        entry.packed = std::move(packed);
+        entry.tier = kMemory;
+        memory_bytes_ += entry.packed_bytes;
+        // A resume may have staged it meanwhile and be about to read the raw file
+        if (!entry.staged) {
+            entry.raw = false;
+            unlink(path.c_str());
+        }
+        return true;
+    }
+
+    // Moves the least recently used memory entry to flash while memory is over its cap
+    bool spill_next() {
+        int64_t id = 0;
+        uint64_t generation = 0;
+        std::vector<uint8_t> packed;
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (memory_bytes_ <= memory_cap_) {
+                return false;
+            }
+            auto victim = entries_.end();
+            for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+                const Entry& entry = it->second;
+                if (entry.tier == kMemory && !entry.busy && !entry.staged &&
+                    (victim == entries_.end() || entry.used < victim->second.used)) {
+                    victim = it;
+                }
+            }
+            if (victim == entries_.end()) {
+                return false;
+            }
+            Entry& entry = victim->second;
+            entry.busy = true;
+            id = victim->first;
+            generation = entry.generation;
+            packed = std::move(entry.packed);
+            entry.packed.clear();
+            path = packed_path(id, generation);
+        }
+
+        bool ok = write_file(path, packed);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(id);
+        if (it == entries_.end() || it->second.generation != generation) {
+            unlink(path.c_str());
+            return true;
+        }
+        Entry& entry = it->second;
+        entry.busy = false;
+        cond_.notify_all();
+        memory_bytes_ -= entry.packed_bytes;
+        if (!ok) {
+            // Flash is full or gone; the session goes back to its turn list
+            stats_.dropped++;
+            entry.tier = kNone;
+            forget(it);
+            return true;
+        }
+        entry.tier = kFlash;
+        flash_bytes_ += entry.packed_bytes;
+        return true;
+    }
+};
+
+inline Store& store() {
+    static Store* s = new Store();
+    return *s;
+}
+
+}  // namespace kv_offload
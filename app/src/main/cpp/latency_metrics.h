@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "flight_recorder.h"
+#include "stall_watchdog.h"
+#include "trace_context.h"
+
+/**
+ * Per-stage latency of generation requests, kept in native memory.
+ *
+ * Each request carries monotonic timestamps (enqueued, admitted to the
+ * engine, prefill start and end, first token, last token, completed) and is
+ * folded into histograms when it completes:
+ *   queue_wait   enqueued -> admitted
+ *   ttft         enqueued -> first token
+ *   tpot         first -> last token, per token after the first
+ *   prefill      prefill start -> end, and prefill tokens/s
+ *   e2e          enqueued -> completed
+ * and what each request cost (request_cost.h): CPU time across the process
+ * and on its own thread, and battery energy.
+ * The histograms are HDR-style: log-linear buckets with 32 sub-buckets per
+ * power of two, so any value from 1 us to hours is kept within ~3% at a fixed
+ * 8 KB each, and percentiles need no samples. getMetrics() returns them as
+ * JSON, which the app can ship with its release telemetry.
+ */
+class LatencyHistogram {
+public:
+    static constexpr int kSubBits = 5;
+    static constexpr int kSub = 1 << kSubBits;
+    static constexpr int kBuckets = (65 - kSubBits) * kSub;  // shifts 0..59 above the linear range
+
+    void record(uint64_t value) {
+        counts_[index_of(value)]++;
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(count_); }
+
+    // Value at or below which `p` (0..1) of the recorded values fall
+    uint64_t percentile(double p) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(count_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(max_, upper_of(i));
+            }
+        }
+        return max_;
+    }
+
+    void reset() { *this = LatencyHistogram(); }
+
+private:
+    std::array<uint32_t, kBuckets> counts_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+
+    // Values below 2 * kSub get a bucket each; above, kSub buckets per power of two
+    static int index_of(uint64_t value) {
+        if (value < 2 * kSub) {
+            return static_cast<int>(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - kSubBits;
+        return (shift + 1) * kSub + static_cast<int>((value >> shift) - kSub);
+    }
+
+    static uint64_t upper_of(int index) {
+        if (index < 2 * kSub) {
+            return static_cast<uint64_t>(index);
+        }
+        int shift = index / kSub - 1;
+        uint64_t sub = static_cast<uint64_t>(index % kSub + kSub);
+        return ((sub + 1) << shift) - 1;
+    }
+};
+
+// Tokens streamed by every request since start, for the metrics sampler's rate
+inline std::atomic<uint64_t>& tokens_emitted() {
+    static std::atomic<uint64_t> count{0};
+    return count;
+}
+
+struct RequestTiming {
+    using Clock = std::chrono::steady_clock;
+
+    int64_t id = flight::next_request_id();  // names the request in flight recorder dumps
+    int64_t trace_id = trace_context::current();  // the caller's, when it traces the request
+    Clock::time_point enqueued = Clock::now();
+    Clock::time_point admitted{};
+    Clock::time_point prefill_start{};
+    Clock::time_point prefill_end{};
+    Clock::time_point first_token{};
+    Clock::time_point last_token{};
+    size_t prompt_tokens = 0;  // set by whoever knows the count; 0 leaves prefill_rate out
+    size_t tokens = 0;  // streamed pieces; about one token each
+    bool ok = true;
+    // Cost, charged by whoever runs it
+    uint64_t cpu_us = 0;         // all threads working on it
+    uint64_t thread_cpu_us = 0;  // the thread that ran it
+    double energy_mj = 0.0;      // 0 when the battery could not tell
+
+    void admit() {
+        admitted = Clock::now();
+        if (trace_id != 0) {
+            flight::record(flight::kEventTrace, "request", id, trace_id);
+        }
+        flight::record(flight::kEventRequestAdmit, "request", id, micros(enqueued, admitted));
+    }
+    void begin_prefill() { prefill_start = Clock::now(); }
+    void end_prefill() {
+        prefill_end = Clock::now();
+        stall::progress();
+        if (prefill_start != Clock::time_point{}) {
+            flight::record(flight::kEventRequestPrefill, "request", id, micros(prefill_start, prefill_end));
+        }
+    }
+    void token(size_t count = 1) {
+        Clock::time_point now = Clock::now();
+        if (tokens == 0) {
+            first_token = now;
+            flight::record(flight::kEventRequestFirst, "request", id, micros(enqueued, now));
+        }
+        last_token = now;
+        tokens += count;
+        stall::progress();
+        tokens_emitted().fetch_add(count, std::memory_order_relaxed);
+    }
+    void charge(uint64_t cpu, uint64_t thread_cpu, double mj) {
+        cpu_us += cpu;
+        thread_cpu_us += thread_cpu;
+        energy_mj += mj;
+    }
+
+private:
+    static int64_t micros(Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    }
+};
+
+class LatencyMetrics {
+public:
+    // The last kTraced traced requests are kept whole for trace_json()
+    static constexpr size_t kTraced = 64;
+
+    void record(const RequestTiming& timing) {
+        RequestTiming::Clock::time_point done = RequestTiming::Clock::now();
+        if (timing.trace_id != 0) {
+            flight::record(flight::kEventTrace, "request", timing.id, timing.trace_id);
+        }
+        flight::recorder().request_end(timing.id, static_cast<int64_t>(us(timing.enqueued, done)));
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (timing.trace_id != 0) {
+            if (traced_.size() == kTraced) {
+                traced_.pop_front();
+            }
+            traced_.push_back(Traced{timing, done});
+        }
+        state_.requests++;
+        if (!timing.ok) {
+            state_.errors++;
+        }
+        state_.tokens += timing.tokens;
+        if (timing.admitted != RequestTiming::Clock::time_point{}) {
+            state_.queue_wait.record(us(timing.enqueued, timing.admitted));
+        }
+        if (timing.tokens > 0) {
+            state_.ttft.record(us(timing.enqueued, timing.first_token));
+        }
+        if (timing.tokens > 1) {
+            state_.tpot.record(us(timing.first_token, timing.last_token) / (timing.tokens - 1));
+        }
+        if (timing.prefill_start != RequestTiming::Clock::time_point{} &&
+            timing.prefill_end != RequestTiming::Clock::time_point{}) {
+            uint64_t prefill = us(timing.prefill_start, timing.prefill_end);
+            state_.prefill.record(prefill);
+            state_.prefill_tokens += timing.prompt_tokens;
+            state_.prefill_us += prefill;
+            if (prefill > 0 && timing.prompt_tokens > 0) {
+                state_.prefill_rate.record(timing.prompt_tokens * 1000000ull / prefill);
+            }
+        }
+        state_.e2e.record(us(timing.enqueued, done));
+        if (timing.cpu_us > 0) {
+            state_.cpu.record(timing.cpu_us);
+            state_.thread_cpu.record(timing.thread_cpu_us);
+            state_.cpu_us += timing.cpu_us;
+            state_.cpu_tokens += timing.tokens;
+        }
+        if (timing.energy_mj > 0.0) {
+            state_.energy.record(static_cast<uint64_t>(timing.energy_mj * 1000.0));  // in uJ
+            state_.energy_mj += timing.energy_mj;
+            state_.energy_tokens += timing.tokens;
+        }
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        state_ = State();
+    }
+
+    // The latest request made under `trace_id`, stage by stage in ms from when
+    // it was made (-1 for a stage it never reached), and its flight recorder
+    // events; "" if none of the last kTraced requests had that id
+    std::string trace_json(int64_t trace_id) {
+        char head[512];
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = std::find_if(traced_.rbegin(), traced_.rend(),
+                                   [trace_id](const Traced& t) { return t.timing.trace_id == trace_id; });
+            if (it == traced_.rend()) {
+                return std::string();
+            }
+            const RequestTiming& t = it->timing;
+            auto at = [&t](RequestTiming::Clock::time_point point) {
+                return point == RequestTiming::Clock::time_point{} ? -1.0 : us(t.enqueued, point) * 1e-3;
+            };
+            snprintf(head, sizeof(head),
+                     "{\"trace_id\": %lld, \"request_id\": %lld, \"ok\": %d, \"prompt_tokens\": %zu, "
+                     "\"tokens\": %zu, \"admitted_ms\": %.2f, \"prefill_start_ms\": %.2f, \"prefill_end_ms\": %.2f, "
+                     "\"first_token_ms\": %.2f, \"last_token_ms\": %.2f, \"done_ms\": %.2f, \"cpu_ms\": %.2f, "
+                     "\"events\": \"",
+                     static_cast<long long>(t.trace_id), static_cast<long long>(t.id), t.ok ? 1 : 0, t.prompt_tokens,
+                     t.tokens, at(t.admitted), at(t.prefill_start), at(t.prefill_end), at(t.first_token),
+                     at(t.last_token), at(it->done), t.cpu_us * 1e-3);
+        }
+        std::string json = head;
+        // Dump lines are digits, letters, ':' and '_'; only the newlines need escaping
+        for (char c : flight::recorder().trace_lines(trace_id)) {
+            json += c == '\n' ? std::string("\\n") : std::string(1, c);
+        }
+        json += "\"}";
+        return json;
+    }
+    
+    // The rates behind a latency prediction (RoutePolicy); zeros before any request
+    struct Profile {
+        double prefill_tokens_per_s = 0.0;
+        double tpot_ms = 0.0;  // median
+        double e2e_ms = 0.0;   // mean
+    };
+    
+    Profile profile() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Profile profile;
+        if (state_.prefill_us > 0) {
+            profile.prefill_tokens_per_s = state_.prefill_tokens * 1e6 / static_cast<double>(state_.prefill_us);
+        }
+        profile.tpot_ms = state_.tpot.percentile(0.5) * 1e-3;
+        profile.e2e_ms = state_.e2e.mean() * 1e-3;
+        return profile;
+    }
+
+    // {"requests", "errors", "tokens", "prefill_tokens_per_s", "cpu_ms_per_token",
+    // "joules", "mj_per_token", and per stage {"count", "mean", "p50", "p90",
+    // "p99", "max"} in ms (prefill_rate in tokens/s, energy_mj in mJ per request)}
+    std::string to_json() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char head[320];
+        snprintf(head, sizeof(head),
+                 "{\"requests\": %llu, \"errors\": %llu, \"tokens\": %llu, \"prefill_tokens_per_s\": %.1f, "
+                 "\"cpu_ms_per_token\": %.3f, \"joules\": %.3f, \"mj_per_token\": %.3f",
+                 static_cast<unsigned long long>(state_.requests), static_cast<unsigned long long>(state_.errors),
+                 static_cast<unsigned long long>(state_.tokens),
+                 state_.prefill_us == 0 ? 0.0 : state_.prefill_tokens * 1e6 / static_cast<double>(state_.prefill_us),
+                 state_.cpu_tokens == 0 ? 0.0 : state_.cpu_us * 1e-3 / static_cast<double>(state_.cpu_tokens),
+                 state_.energy_mj * 1e-3,
+                 state_.energy_tokens == 0 ? 0.0 : state_.energy_mj / static_cast<double>(state_.energy_tokens));
+        std::string json = head;
+        append(&json, "queue_wait_ms", state_.queue_wait, 1e-3);
+        append(&json, "ttft_ms", state_.ttft, 1e-3);
+        append(&json, "tpot_ms", state_.tpot, 1e-3);
+        append(&json, "prefill_ms", state_.prefill, 1e-3);
+        append(&json, "prefill_rate", state_.prefill_rate, 1.0);
+        append(&json, "e2e_ms", state_.e2e, 1e-3);
+        append(&json, "cpu_ms", state_.cpu, 1e-3);
+        append(&json, "thread_cpu_ms", state_.thread_cpu, 1e-3);
+        append(&json, "energy_mj", state_.energy, 1e-3);
+        json += "}";
+        return json;
+    }
+
+private:
+    struct State {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        uint64_t tokens = 0;
+        uint64_t prefill_tokens = 0;
+        uint64_t prefill_us = 0;
+        uint64_t cpu_us = 0;
+        uint64_t cpu_tokens = 0;  // of the requests charged CPU
+        double energy_mj = 0.0;
+        uint64_t energy_tokens = 0;  // of the requests charged energy
+        LatencyHistogram queue_wait, ttft, tpot, prefill, prefill_rate, e2e;
+        LatencyHistogram cpu, thread_cpu, energy;  // us, us, uJ
+    };
+
+    struct Traced {
+        RequestTiming timing;
+        RequestTiming::Clock::time_point done{};
+    };
+
+    std::mutex mutex_;
+    State state_;
+    std::deque<Traced> traced_;  // oldest first
+
+    static uint64_t us(RequestTiming::Clock::time_point from, RequestTiming::Clock::time_point to) {
+        return to <= from ? 0
+                          : static_cast<uint64_t>(
+                                    std::chrono::duration_cast<std::chrono::microseconds>(to - from).count());
+    }
+
+    static void append(std::string* json, const char* name, const LatencyHistogram& h, double scale) {
+        char buffer[192];
+        snprintf(buffer, sizeof(buffer),
+                 ", \"%s\": {\"count\": %llu, \"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, "
+                 "\"max\": %.2f}",
+                 name, static_cast<unsigned long long>(h.count()), h.mean() * scale, h.percentile(0.5) * scale,
+                 h.percentile(0.9) * scale, h.percentile(0.99) * scale, h.max() * scale);
+        *json += buffer;
+    }
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "native_log.h"
+#include "shard_pack.h"
+
+/**
+ * Low-RAM mode: the weights of transformer layers are paged in from flash per
+ * forward pass instead of staying resident.
+ *
+ * Only weights the mmap loader wraps in place (CPU, see ndarray_mmap_loader.h)
+ * can be paged: they are clean pages of read-only shard mappings, so
+ * MADV_DONTNEED drops them and the next touch reads them back from the file.
+ * The loader registers each "layers.<i>." param with its byte range; the rest
+ * (embedding, final norm) stays as the kernel keeps it.
+ *
+ * The compiled model runs a whole step in one call with no per-layer hook, so
+ * the pager paces itself: a worker thread walks the layers at the per-layer
+ * time measured over the previous passes, issuing MADV_WILLNEED for the layer
+ * after the current one and MADV_DONTNEED for the ones behind, which bounds
+ * what is resident to about kWindow layers. Pacing that runs behind or ahead
+ * costs a page fault, never a wrong result. At the end of a pass everything
+ * but the first layers is dropped and those are read ahead for the next pass.
+ *
+ * The mode is chosen before the model loads: on when MemAvailable is below the
+ * shards' size plus kHeadroomBytes (room for the camera and OCR pipeline), or
+ * as set through setLowRamMode().
+ */
+namespace layer_pager {
+
+enum Mode : int {
+    kModeAuto = 0,
+    kModeOn = 1,
+    kModeOff = 2,
+};
+
+// Layers resident at once: the one behind, the current one and the next
+static constexpr size_t kWindow = 3;
+static constexpr uint64_t kHeadroomBytes = 1536ull << 20;
+
+// "MemAvailable" of /proc/meminfo in bytes; 0 if unreadable
+inline uint64_t available_ram() {
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return static_cast<uint64_t>(kb) << 10;
+}
+
+// Total size of the params_shard_*.bin files in `model_dir`
+inline uint64_t shard_bytes(const std::string& model_dir) {
+    DIR* dir = opendir(model_dir.c_str());
+    if (dir == nullptr) {
+        return 0;
+    }
+    uint64_t total = 0;
+    while (dirent* entry = readdir(dir)) {
+        struct stat st;
+        if ((strncmp(entry->d_name, "params_shard_", 13) == 0 || strcmp(entry->d_name, shard_pack::kFileName) == 0) &&
+            stat((model_dir + "/" + entry->d_name).c_str(), &st) == 0) {
+            total += static_cast<uint64_t>(st.st_size);
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+// Whether `mode` pages weights of `model_bytes` (the shards' total size)
+inline bool wanted(Mode mode, uint64_t model_bytes) {
+    if (mode != kModeAuto) {
+        return mode == kModeOn;
+    }
+    uint64_t available = available_ram();
+    return available != 0 && available < model_bytes + kHeadroomBytes;
+}
+
+inline bool wanted(Mode mode, const std::string& model_dir) {
+    return mode == kModeAuto ? wanted(mode, shard_bytes(model_dir)) : mode == kModeOn;
+}
+
+// Layer index of a param named like "model.layers.12.mlp.down_proj.q_weight", or -1
+inline int layer_of(const std::string& name) {
+    size_t at = name.find("layers.");
+    if (at == std::string::npos) {
+        return -1;
+    }
+    char* end = nullptr;
+    long index = strtol(name.c_str() + at + 7, &end, 10);
+    return end != name.c_str() + at + 7 && *end == '.' ? static_cast<int>(index) : -1;
+}
+
+class LayerPager {
+public:
+    LayerPager() = default;
+    LayerPager(const LayerPager&) = delete;
+    LayerPager& operator=(const LayerPager&) = delete;
+    ~LayerPager() { stop(); }
+
+    // Decided by the engine before the weights load; the loader reads it
+    void set_enabled(bool enabled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enabled_ = enabled;
+    }
+
+    bool enabled() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return enabled_;
+    }
+
+    // A param wrapped in place at `data`; `keep` holds its mapping
+    void add_param(const std::string& name, const void* data, size_t bytes, std::shared_ptr<void> keep) {
+        int layer = layer_of(name);
+        if (layer < 0 || bytes == 0) {
+            return;
+        }
+        static const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t begin = reinterpret_cast<uintptr_t>(data) / page * page;
+        uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes + page - 1) / page * page;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Layer& entry = layers_[layer];
+        entry.ranges.push_back(Range{begin, end});
+        entry.bytes += end - begin;
+        mappings_.push_back(std::move(keep));
+    }
+
+    // After the load: drop every layer and start the paced worker
+    void start() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!enabled_ || layers_.empty() || worker_.joinable()) {
+            return;
+        }
+        order_.clear();
+        uint64_t bytes = 0;
+        for (auto& entry : layers_) {
+            order_.push_back(&entry.second);
+            bytes += entry.second.bytes;
+        }
+        for (size_t i = 0; i < order_.size(); ++i) {
+            advise(i, i < kWindow - 1 ? MADV_WILLNEED : MADV_DONTNEED);
+        }
+        stopping_ = false;
+        worker_ = std::thread([this] { run(); });
+        NLOGI("LayerPager", "Paging %zu layers (%llu MB) through a %zu-layer window",
+              order_.size(), static_cast<unsigned long long>(bytes >> 20), kWindow);
+    }
+
+    // Before the model is closed; the mappings go with it
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        layers_.clear();
+        order_.clear();
+        mappings_.clear();
+        in_pass_ = false;
+    }
+
+    size_t layers() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return worker_.joinable() ? order_.size() : 0;
+    }
+
+    double layer_ms() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return layer_ms_;
+    }
+
+    // One forward pass over every layer, `tokens` at a time (prefill runs longer per layer)
+    class Pass {
+    public:
+        Pass(LayerPager& pager, size_t tokens) : pager_(pager), tokens_(std::max<size_t>(1, tokens)) {
+            pager_.begin_pass(tokens_);
+        }
+        ~Pass() { pager_.end_pass(tokens_); }
+        Pass(const Pass&) = delete;
+        Pass& operator=(const Pass&) = delete;
+
+    private:
+        LayerPager& pager_;
+        size_t tokens_;
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Range {
+        uintptr_t begin;
+        uintptr_t end;
+    };
+
+    struct Layer {
+        std::vector<Range> ranges;
+        uint64_t bytes = 0;
+    };
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread worker_;
+    bool enabled_ = false;
+    bool stopping_ = false;
+    bool in_pass_ = false;
+    uint64_t pass_id_ = 0;
+    Clock::time_point pass_start_;
+    size_t pass_tokens_ = 1;
+    double layer_ms_ = 2.0;  // per layer and token; measured after the first pass
+    std::map<int, Layer> layers_;
+    std::vector<Layer*> order_;
+    std::vector<std::shared_ptr<void>> mappings_;
+
+    void advise(size_t index, int advice) {
+        if (index >= order_.size()) {
+            return;
+        }
+        for (const Range& range : order_[index]->ranges) {
+            madvise(reinterpret_cast<void*>(range.begin), range.end - range.begin, advice);
+        }
+    }
+
+    void begin_pass(size_t tokens) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!worker_.joinable()) {
+                return;
+            }
+            in_pass_ = true;
+            pass_id_++;
+            pass_start_ = Clock::now();
+            pass_tokens_ = tokens;
+        }
+        cv_.notify_all();
+    }
+
+    void end_pass(size_t tokens) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!in_pass_) {
+            return;
+        }
+        in_pass_ = false;
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - pass_start_).count();
+        double measured = ms / static_cast<double>(order_.size() * tokens);
+        layer_ms_ = layer_ms_ * 0.75 + measured * 0.25;
+        // Drop what the pass left behind and read the first layers ahead for the next one
+        for (size_t i = 0; i < order_.size(); ++i) {
+            advise(i, i < kWindow - 1 ? MADV_WILLNEED : MADV_DONTNEED);
+        }
+    }
+
+    // Walks the layers of each pass at the measured pace
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        uint64_t seen = 0;
+        while (true) {
+            cv_.wait(lock, [&] { return stopping_ || (in_pass_ && pass_id_ != seen); });
+            if (stopping_) {
+                return;
+            }
+            seen = pass_id_;
+            Clock::time_point start = pass_start_;
+            double per_layer = layer_ms_ * static_cast<double>(pass_tokens_);
+            for (size_t i = 0; i < order_.size(); ++i) {
+                auto at = start + std::chrono::microseconds(static_cast<int64_t>(per_layer * 1000.0 * i));
+                if (cv_.wait_until(lock, at, [&] { return stopping_ || !in_pass_ || pass_id_ != seen; })) {
+                    break;
+                }
+                // Layer i is computing: fetch i + 1, drop what is behind the window
+                advise(i + 1, MADV_WILLNEED);
+                if (i >= kWindow - 1) {
+                    advise(i + 1 - kWindow, MADV_DONTNEED);
+                }
+            }
+        }
+    }
+};
+
+inline LayerPager& instance() {
+    static LayerPager* pager = new LayerPager();
+    return *pager;
+}
+
+}  // namespace layer_pager
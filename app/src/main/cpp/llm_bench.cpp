@@ -0,0 +1,625 @@
+// llm_bench: run the inference engine from adb shell, without the app.
+//
+//   ./run_llm_bench.sh <model dir on the device> [llm_bench options]
+// or by hand:
+//   adb push llm_bench <libs> /data/local/tmp/llm_bench
+//   adb shell 'cd /data/local/tmp/llm_bench && LD_LIBRARY_PATH=. ./llm_bench
+//       --model <model dir> --prefill 64,256,1024 --decode 128 --warmup 1 --reps 5'
+//
+// On a Linux workstation or aarch64 server, build the host target instead
+// (CMakeLists.txt, -DSTUDYBUDDY_HOST_LIB_DIR) and run ./llm_bench --model
+// <model dir> --backend cpu with the same options; the model directory is the
+// same except for its library, which must be a host build of the model.
+//
+// Prints one JSON object on stdout: per prefill length the prompt and decode
+// rates, TTFT, and an energy estimate from the battery's current and voltage
+// (meaningless while charging, which is reported), plus the peak RSS of the
+// process. Progress and errors go to stderr; the engine logs to logcat (to
+// stderr on a host build).
+//
+// Soak mode (--soak SECONDS) instead generates continuously, turn after turn
+// of the first --prefill length and --decode tokens, to show what a long
+// tutoring session gets once the phone has heated up. Every --interval
+// seconds it records decode tokens/s, the thermal status (AThermal, API 30+),
+// the hottest CPU/SoC zone, the CPU clocks, the RSS and the governor's level,
+// and reports that curve with the peak, the steady state (median of the last
+// third) and the p5 rate. --configs runs the soak once per configuration,
+// with --cooldown seconds idle between them:
+//   --configs big+mid,big/4,all/0/gov=8
+// each one affinity (auto|big|big+mid|all|mid), optionally workers (0: one per
+// core) and "gov" or "gov=<target tokens/s>" for the generation governor.
+//
+// Sweep mode (--sessions 1,2,4,8) submits that many sessions at once to the
+// batch scheduler, each a prompt of every --prefill length (e.g.
+// 256,1024,4096,8192) decoding --decode tokens, --reps times per point. Per
+// point it reports aggregate and per-session decode tokens/s, TTFT
+// percentiles (submission to first text), the widest decode pass, KV
+// deferrals, the batch's peak KV and the RSS, and how close the aggregate
+// comes to scaling linearly from the smallest session count: where that
+// efficiency falls off is where batching, the paged KV or attention stops
+// keeping up on this device. A point that fails (e.g. out of KV) is reported
+// with its error and the sweep goes on.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fstream>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "compute_device.h"
+#include "llm_bench.h"
+
+namespace {
+
+struct Options {
+    std::string model_dir;
+    ComputeBackend backend = kBackendAuto;
+    std::vector<int> prefill = {128, 512};
+    int decode = 128;
+    int warmup = 1;
+    int reps = 5;
+    int soak_s = 0;       // 0: the prefill sweep instead
+    int interval_s = 10;
+    int cooldown_s = 60;  // between soak configurations
+    std::string configs;  // empty: the engine's own settings
+    std::vector<int> sessions;  // empty: no sweep
+};
+
+struct SoakConfig {
+    std::string name;
+    ThreadAffinity affinity = kAffinityAuto;
+    int workers = 0;
+    bool governor = false;
+    float governor_target = 0.0f;
+};
+
+void usage() {
+    fprintf(stderr,
+            "usage: llm_bench --model DIR [--backend auto|opencl|vulkan|cpu] [--prefill N[,N...]]\n"
+            "                 [--decode N] [--warmup N] [--reps N]\n"
+            "                 [--soak SECONDS [--interval SECONDS] [--configs C[,C...]] [--cooldown SECONDS]]\n"
+            "                 [--sessions N[,N...]]\n");
+}
+
+std::vector<int> parse_list(const char* text) {
+    std::vector<int> values;
+    for (const char* p = text; *p != '\0';) {
+        char* end = nullptr;
+        long value = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        if (value > 0) {
+            values.push_back(static_cast<int>(value));
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+bool parse_options(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (value == nullptr) {
+            return false;
+        }
+        if (strcmp(arg, "--model") == 0) {
+            options->model_dir = value;
+        } else if (strcmp(arg, "--backend") == 0) {
+            options->backend = compute_backend_from_name(value);
+        } else if (strcmp(arg, "--prefill") == 0) {
+            options->prefill = parse_list(value);
+        } else if (strcmp(arg, "--decode") == 0) {
+            options->decode = std::max(0, atoi(value));
+        } else if (strcmp(arg, "--warmup") == 0) {
+            options->warmup = std::max(0, atoi(value));
+        } else if (strcmp(arg, "--reps") == 0) {
+            options->reps = std::max(1, atoi(value));
+        } else if (strcmp(arg, "--soak") == 0) {
+            options->soak_s = std::max(0, atoi(value));
+        } else if (strcmp(arg, "--interval") == 0) {
+            options->interval_s = std::max(1, atoi(value));
+        } else if (strcmp(arg, "--configs") == 0) {
+            options->configs = value;
+        } else if (strcmp(arg, "--cooldown") == 0) {
+            options->cooldown_s = std::max(0, atoi(value));
+        } else if (strcmp(arg, "--sessions") == 0) {
+            options->sessions = parse_list(value);
+        } else {
+            return false;
+        }
+        ++i;
+    }
+    return !options->model_dir.empty() && !options->prefill.empty();
+}
+
+// "big+mid", "big/4", "all/0/gov=8"; false on an unknown affinity
+bool parse_soak_config(const std::string& text, SoakConfig* config) {
+    *config = SoakConfig();
+    config->name = text;
+    std::vector<std::string> fields;
+    for (size_t start = 0; start <= text.size();) {
+        size_t end = std::min(text.find('/', start), text.size());
+        fields.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    bool known = fields[0] == "auto";
+    for (ThreadAffinity affinity : {kAffinityBig, kAffinityBigMid, kAffinityAll, kAffinityMid}) {
+        if (fields[0] == thread_affinity_name(affinity)) {
+            config->affinity = affinity;
+            known = true;
+        }
+    }
+    if (fields.size() > 1) {
+        config->workers = std::max(0, atoi(fields[1].c_str()));
+    }
+    if (fields.size() > 2 && fields[2].compare(0, 3, "gov") == 0) {
+        config->governor = true;
+        config->governor_target = fields[2].size() > 4 ? static_cast<float>(atof(fields[2].c_str() + 4)) : 0.0f;
+    }
+    return known;
+}
+
+double read_number(const char* path) {
+    std::ifstream in(path);
+    double value = NAN;
+    in >> value;
+    return in ? value : NAN;
+}
+
+bool charging() {
+    std::ifstream in("/sys/class/power_supply/battery/status");
+    std::string status;
+    std::getline(in, status);
+    return status == "Charging" || status == "Full";
+}
+
+// Battery draw sampled every 50 ms while a configuration runs
+class EnergySampler {
+public:
+    void start() {
+        joules_ = 0.0;
+        samples_ = 0;
+        running_ = true;
+        thread_ = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        running_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    bool available() const { return samples_ > 0; }
+    double joules() const { return joules_; }
+
+private:
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+    double joules_ = 0.0;
+    int samples_ = 0;
+
+    void run() {
+        using Clock = std::chrono::steady_clock;
+        auto last = Clock::now();
+        while (running_) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            auto now = Clock::now();
+            // Microamps and microvolts; the sign of the current differs between vendors
+            double current = read_number("/sys/class/power_supply/battery/current_now");
+            double voltage = read_number("/sys/class/power_supply/battery/voltage_now");
+            if (!std::isnan(current) && !std::isnan(voltage) && voltage > 0.0) {
+                double watts = std::fabs(current) * 1e-6 * voltage * 1e-6;
+                joules_ += watts * std::chrono::duration<double>(now - last).count();
+                samples_++;
+            }
+            last = now;
+        }
+    }
+};
+
+struct Stats {
+    double mean = 0.0, p50 = 0.0, min = 0.0, max = 0.0;
+};
+
+Stats stats_of(std::vector<double> values) {
+    Stats stats;
+    if (values.empty()) {
+        return stats;
+    }
+    std::sort(values.begin(), values.end());
+    for (double value : values) {
+        stats.mean += value;
+    }
+    stats.mean /= static_cast<double>(values.size());
+    stats.p50 = values[values.size() / 2];
+    stats.min = values.front();
+    stats.max = values.back();
+    return stats;
+}
+
+std::string stats_json(const Stats& stats) {
+    char buffer[160];
+    snprintf(buffer, sizeof(buffer), "{\"mean\": %.2f, \"p50\": %.2f, \"min\": %.2f, \"max\": %.2f}", stats.mean,
+             stats.p50, stats.min, stats.max);
+    return buffer;
+}
+
+// Nearest-rank percentile of `values`, 0 when empty
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * values.size()));
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+std::string escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+long peak_rss_kb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;  // kilobytes on Linux
+}
+
+long rss_kb() {
+    std::ifstream in("/proc/self/statm");
+    long size = 0, resident = 0;
+    in >> size >> resident;
+    return in ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+// AThermal_getCurrentThermalStatus (0 none ... 6 shutdown), -1 where it is
+// missing: below API 30 and on hosts. Looked up at runtime, above minSdk.
+int thermal_status() {
+    using Acquire = void* (*)();
+    using Status = int (*)(void*);
+    static Acquire acquire = reinterpret_cast<Acquire>(dlsym(RTLD_DEFAULT, "AThermal_acquireManager"));
+    static Status status = reinterpret_cast<Status>(dlsym(RTLD_DEFAULT, "AThermal_getCurrentThermalStatus"));
+    static void* manager = acquire != nullptr ? acquire() : nullptr;
+    return manager != nullptr && status != nullptr ? status(manager) : -1;
+}
+
+// Hottest CPU or SoC thermal zone in Celsius, NAN without one
+double hottest_zone_c() {
+    double hottest = NAN;
+    if (DIR* dir = opendir("/sys/class/thermal")) {
+        while (dirent* entry = readdir(dir)) {
+            std::string zone = std::string("/sys/class/thermal/") + entry->d_name;
+            if (strncmp(entry->d_name, "thermal_zone", 12) != 0) {
+                continue;
+            }
+            std::ifstream type_in(zone + "/type");
+            std::string type;
+            std::getline(type_in, type);
+            if (type.find("cpu") == std::string::npos && type.find("soc") == std::string::npos) {
+                continue;
+            }
+            double temp = read_number((zone + "/temp").c_str()) / 1000.0;
+            if (!std::isnan(temp) && (std::isnan(hottest) || temp > hottest)) {
+                hottest = temp;
+            }
+        }
+        closedir(dir);
+    }
+    return hottest;
+}
+
+// Current clock of every CPU in MHz, as a JSON array; offline CPUs are 0
+std::string cpu_mhz_json() {
+    std::string out = "[";
+    for (int cpu = 0; cpu < 16; ++cpu) {
+        std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        if (access(base.c_str(), F_OK) != 0) {
+            break;
+        }
+        double khz = read_number((base + "/cpufreq/scaling_cur_freq").c_str());
+        out += (cpu > 0 ? ", " : "") + std::to_string(std::isnan(khz) ? 0 : static_cast<long>(khz / 1000.0));
+    }
+    return out + "]";
+}
+
+std::string number_json(double value, const char* format) {
+    if (std::isnan(value)) {
+        return "null";
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), format, value);
+    return buffer;
+}
+
+// Every --prefill length at every --sessions count; a JSON array of points
+std::string sweep(const Options& options) {
+    std::string points;
+    for (int context : options.prefill) {
+        double base_rate = 0.0;
+        int base_sessions = 0;
+        for (int sessions : options.sessions) {
+            BenchConcurrentRun run;
+            std::string error;
+            if (!bench_concurrent(sessions, context, options.decode, &run, &error)) {  // warm up
+                fprintf(stderr, "llm_bench: %d x %d: %s\n", sessions, context, error.c_str());
+                points += std::string(points.empty() ? "" : ", ") + "{\"sessions\": " + std::to_string(sessions) +
+                          ", \"context_tokens\": " + std::to_string(context) + ", \"error\": \"" + escape(error) +
+                          "\"}";
+                continue;
+            }
+            std::vector<double> aggregate, per_session, ttft;
+            uint32_t peak_batch = 0;
+            uint64_t deferrals = 0, peak_kv = 0, peak_rss = 0;
+            for (int rep = 0; rep < options.reps && error.empty(); ++rep) {
+                if (!bench_concurrent(sessions, context, options.decode, &run, &error)) {
+                    break;
+                }
+                aggregate.push_back(run.wall_ms > 0.0 ? run.decode_tokens * 1000.0 / run.wall_ms : 0.0);
+                per_session.insert(per_session.end(), run.session_tokens_per_s.begin(),
+                                   run.session_tokens_per_s.end());
+                ttft.insert(ttft.end(), run.ttft_ms.begin(), run.ttft_ms.end());
+                peak_batch = std::max(peak_batch, run.peak_batch);
+                deferrals += run.kv_deferrals;
+                peak_kv = std::max(peak_kv, run.peak_kv_tokens);
+                peak_rss = std::max(peak_rss, run.peak_rss_bytes);
+            }
+            if (!error.empty()) {
+                fprintf(stderr, "llm_bench: %d x %d: %s\n", sessions, context, error.c_str());
+            }
+            double rate = stats_of(aggregate).mean;
+            if (base_sessions == 0 && rate > 0.0) {
+                base_rate = rate;
+                base_sessions = sessions;
+            }
+            double efficiency = base_rate > 0.0 ? (rate / base_rate) / (static_cast<double>(sessions) / base_sessions)
+                                                : 0.0;
+            fprintf(stderr, "%d sessions x %d tokens: %.1f tok/s aggregate, TTFT p90 %.0f ms\n", sessions,
+                    run.context_tokens, rate, percentile(ttft, 90));
+            char head[512];
+            snprintf(head, sizeof(head),
+                     "{\"sessions\": %d, \"context_tokens\": %d, \"decode_tokens\": %d, \"reps\": %zu, "
+                     "\"scaling_efficiency\": %.3f, \"peak_batch\": %u, \"kv_deferrals\": %llu, "
+                     "\"peak_kv_tokens\": %llu, \"peak_rss_kb\": %llu, ",
+                     sessions, run.context_tokens, options.decode, aggregate.size(), efficiency, peak_batch,
+                     static_cast<unsigned long long>(deferrals), static_cast<unsigned long long>(peak_kv),
+                     static_cast<unsigned long long>(peak_rss >> 10));
+            char ttft_json[160];
+            snprintf(ttft_json, sizeof(ttft_json), "{\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+                     percentile(ttft, 50), percentile(ttft, 90), percentile(ttft, 99), percentile(ttft, 100));
+            points += std::string(points.empty() ? "" : ", ") + head + "\"aggregate_tokens_per_s\": " +
+                      stats_json(stats_of(aggregate)) + ", \"session_tokens_per_s\": " +
+                      stats_json(stats_of(per_session)) + ", \"ttft_ms\": " + ttft_json +
+                      (error.empty() ? "" : ", \"error\": \"" + escape(error) + "\"") + "}";
+        }
+    }
+    return "[" + points + "]";
+}
+
+// One soak configuration: turns back to back for `options.soak_s`, sampled
+// every `options.interval_s`; returns its JSON or "" with `error` set
+std::string soak(const Options& options, const SoakConfig& config, std::string* error) {
+    using Clock = std::chrono::steady_clock;
+    auto seconds_since = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    BenchRun run;
+    if (!bench_run(options.prefill[0], options.decode, &run, error)) {  // warm up
+        return "";
+    }
+
+    std::vector<double> rates;
+    std::string curve;
+    int turns = 0;
+    long tokens = 0;
+    double max_temp = NAN;
+    int interval_tokens = 0;
+    double interval_decode_ms = 0.0;
+    auto start = Clock::now();
+    auto sampled = start;
+    while (seconds_since(start) < options.soak_s) {
+        if (!bench_run(options.prefill[0], options.decode, &run, error)) {
+            return "";
+        }
+        turns++;
+        tokens += run.decode_tokens;
+        interval_tokens += run.decode_tokens;
+        interval_decode_ms += run.decode_ms;
+        if (seconds_since(sampled) < options.interval_s) {
+            continue;
+        }
+        sampled = Clock::now();
+        double rate = interval_decode_ms > 0.0 ? interval_tokens * 1000.0 / interval_decode_ms : 0.0;
+        double temp = hottest_zone_c();
+        if (!std::isnan(temp) && (std::isnan(max_temp) || temp > max_temp)) {
+            max_temp = temp;
+        }
+        rates.push_back(rate);
+        interval_tokens = 0;
+        interval_decode_ms = 0.0;
+        char head[160];
+        snprintf(head, sizeof(head), "{\"t_s\": %.1f, \"decode_tokens_per_s\": %.2f, \"thermal_status\": %d, ",
+                 seconds_since(start), rate, thermal_status());
+        if (!curve.empty()) {
+            curve += ", ";
+        }
+        curve += std::string(head) + "\"hottest_c\": " + number_json(temp, "%.1f") + ", \"cpu_mhz\": " +
+                 cpu_mhz_json() + ", \"rss_kb\": " + std::to_string(rss_kb()) +
+                 ", \"governor_level\": " + std::to_string(bench_governor_level()) + "}";
+        fprintf(stderr, "%s %.0f s: %.1f tok/s, %s C\n", config.name.c_str(), seconds_since(start), rate,
+                number_json(temp, "%.1f").c_str());
+    }
+
+    double peak = 0.0, steady = 0.0, p5 = 0.0;
+    if (!rates.empty()) {
+        peak = *std::max_element(rates.begin(), rates.end());
+        std::vector<double> tail(rates.begin() + rates.size() * 2 / 3, rates.end());
+        steady = stats_of(tail).p50;
+        std::vector<double> sorted = rates;
+        std::sort(sorted.begin(), sorted.end());
+        p5 = sorted[sorted.size() * 5 / 100];
+    }
+    char head[512];
+    snprintf(head, sizeof(head),
+             "{\"config\": \"%s\", \"affinity\": \"%s\", \"workers\": %d, \"governor\": %s, "
+             "\"governor_target\": %.2f, \"duration_s\": %.0f, \"turns\": %d, \"decode_tokens\": %ld, "
+             "\"peak_tokens_per_s\": %.2f, \"steady_tokens_per_s\": %.2f, \"p5_tokens_per_s\": %.2f, "
+             "\"retention\": %.3f, ",
+             escape(config.name).c_str(),
+             config.affinity == kAffinityAuto ? "auto" : thread_affinity_name(config.affinity), config.workers,
+             config.governor ? "true" : "false", config.governor_target, seconds_since(start), turns,
+             tokens, peak, steady, p5, peak > 0.0 ? steady / peak : 0.0);
+    return std::string(head) + "\"max_hottest_c\": " + number_json(max_temp, "%.1f") + ", \"curve\": [" + curve +
+           "]}";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_options(argc, argv, &options)) {
+        usage();
+        return 2;
+    }
+
+    std::string error;
+    auto load_start = std::chrono::steady_clock::now();
+    if (!bench_load_model(options.model_dir, options.backend, &error)) {
+        fprintf(stderr, "llm_bench: %s\n", error.c_str());
+        return 1;
+    }
+    double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+    fprintf(stderr, "Loaded %s on %s in %.0f ms\n", options.model_dir.c_str(), bench_device().c_str(), load_ms);
+
+    if (!options.sessions.empty()) {
+        std::string points = sweep(options);
+        printf("{\"model\": \"%s\", \"device\": \"%s\", \"load_ms\": %.0f, \"charging\": %s, "
+               "\"peak_rss_kb\": %ld, \"sweep\": %s}\n",
+               escape(options.model_dir).c_str(), escape(bench_device()).c_str(), load_ms,
+               charging() ? "true" : "false", peak_rss_kb(), points.c_str());
+        bench_unload();
+        return 0;
+    }
+
+    if (options.soak_s > 0) {
+        std::vector<SoakConfig> configs;
+        for (size_t start = 0; start < options.configs.size();) {
+            size_t end = std::min(options.configs.find(',', start), options.configs.size());
+            SoakConfig config;
+            if (!parse_soak_config(options.configs.substr(start, end - start), &config)) {
+                fprintf(stderr, "llm_bench: unknown configuration %s\n", config.name.c_str());
+                bench_unload();
+                return 2;
+            }
+            configs.push_back(config);
+            start = end + 1;
+        }
+        bool configured = !configs.empty();
+        if (!configured) {
+            configs.emplace_back();
+            configs.back().name = "default";
+        }
+        std::string soaks;
+        for (size_t i = 0; i < configs.size(); ++i) {
+            if (i > 0 && options.cooldown_s > 0) {
+                fprintf(stderr, "Cooling down for %d s\n", options.cooldown_s);
+                std::this_thread::sleep_for(std::chrono::seconds(options.cooldown_s));
+            }
+            if (configured) {
+                bench_configure(configs[i].affinity, configs[i].workers, configs[i].governor,
+                                configs[i].governor_target);
+            }
+            std::string result = soak(options, configs[i], &error);
+            if (result.empty()) {
+                fprintf(stderr, "llm_bench: soak failed: %s\n", error.c_str());
+                bench_unload();
+                return 1;
+            }
+            soaks += (soaks.empty() ? "" : ", ") + result;
+        }
+        printf("{\"model\": \"%s\", \"device\": \"%s\", \"load_ms\": %.0f, \"charging\": %s, "
+               "\"peak_rss_kb\": %ld, \"prefill_tokens\": %d, \"decode_tokens\": %d, \"interval_s\": %d, "
+               "\"soak\": [%s]}\n",
+               escape(options.model_dir).c_str(), escape(bench_device()).c_str(), load_ms,
+               charging() ? "true" : "false", peak_rss_kb(), options.prefill[0], options.decode, options.interval_s,
+               soaks.c_str());
+        bench_unload();
+        return 0;
+    }
+
+    std::string runs;
+    for (int prefill : options.prefill) {
+        BenchRun run;
+        for (int i = 0; i < options.warmup; ++i) {
+            if (!bench_run(prefill, options.decode, &run, &error)) {
+                fprintf(stderr, "llm_bench: warmup failed: %s\n", error.c_str());
+                bench_unload();
+                return 1;
+            }
+        }
+
+        std::vector<double> prefill_rate, decode_rate, ttft;
+        double seconds = 0.0;
+        int tokens = 0;
+        EnergySampler energy;
+        energy.start();
+        for (int rep = 0; rep < options.reps; ++rep) {
+            if (!bench_run(prefill, options.decode, &run, &error)) {
+                energy.stop();
+                fprintf(stderr, "llm_bench: run failed: %s\n", error.c_str());
+                bench_unload();
+                return 1;
+            }
+            prefill_rate.push_back(run.prefill_ms > 0.0 ? run.prompt_tokens * 1000.0 / run.prefill_ms : 0.0);
+            decode_rate.push_back(run.decode_ms > 0.0 ? run.decode_tokens * 1000.0 / run.decode_ms : 0.0);
+            ttft.push_back(run.ttft_ms);
+            seconds += (run.ttft_ms + run.decode_ms) / 1000.0;
+            tokens += run.prompt_tokens + run.decode_tokens;
+        }
+        energy.stop();
+        fprintf(stderr, "Prefill %d: %.1f tok/s prefill, %.1f tok/s decode\n", run.prompt_tokens,
+                stats_of(prefill_rate).mean, stats_of(decode_rate).mean);
+
+        std::string energy_json = "null";
+        if (energy.available() && seconds > 0.0) {
+            char buffer[128];
+            snprintf(buffer, sizeof(buffer), "{\"joules\": %.2f, \"watts\": %.2f, \"joules_per_token\": %.4f}",
+                     energy.joules(), energy.joules() / seconds, tokens > 0 ? energy.joules() / tokens : 0.0);
+            energy_json = buffer;
+        }
+        char head[128];
+        snprintf(head, sizeof(head), "{\"prefill_tokens\": %d, \"decode_tokens\": %d, \"reps\": %d", run.prompt_tokens,
+                 run.decode_tokens, options.reps);
+        if (!runs.empty()) {
+            runs += ", ";
+        }
+        runs += std::string(head) + ", \"prefill_tokens_per_s\": " + stats_json(stats_of(prefill_rate)) +
+                ", \"decode_tokens_per_s\": " + stats_json(stats_of(decode_rate)) +
+                ", \"ttft_ms\": " + stats_json(stats_of(ttft)) + ", \"energy\": " + energy_json + "}";
+    }
+
+    printf("{\"model\": \"%s\", \"device\": \"%s\", \"load_ms\": %.0f, \"charging\": %s, \"peak_rss_kb\": %ld, "
+           "\"runs\": [%s]}\n",
+           escape(options.model_dir).c_str(), escape(bench_device()).c_str(), load_ms, charging() ? "true" : "false",
+           peak_rss_kb(), runs.c_str());
+    bench_unload();
+    return 0;
+}
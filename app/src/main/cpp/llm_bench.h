@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "compute_device.h"
+#include "thread_config.h"
+
+/**
+ * The engine without a JVM, for the llm_bench executable.
+ *
+ * llm_bench links the same sources as libmlc_llm_jni.so and drives the
+ * engine through these calls, so a benchmark pushed with adb loads the model
+ * directory exactly as the app does (compute device, thread pool, kernel
+ * cache and tuning). A run uses the logits entry points: the prompt is
+ * prefilled once and tokens are picked greedily on the host, which waits for
+ * the device after every step, so the times include the full step.
+ */
+struct BenchRun {
+    int prompt_tokens = 0;    // as counted by tokenizer.model, or estimated without one
+    int decode_tokens = 0;
+    double prefill_ms = 0.0;  // prompt in, logits of its last token on the host
+    double ttft_ms = 0.0;     // prefill plus picking the first token
+    double decode_ms = 0.0;   // all decode steps
+};
+
+// One point of the concurrency sweep: sessions decoding together through the batch scheduler
+struct BenchConcurrentRun {
+    int sessions = 0;
+    int context_tokens = 0;   // prompt of each session
+    int decode_tokens = 0;    // decoded, all sessions together
+    double wall_ms = 0.0;     // submitting the sessions to the last one finishing
+    std::vector<double> ttft_ms;               // per session: submitted to its first text
+    std::vector<double> session_tokens_per_s;  // per session: its first text to its end
+    uint32_t peak_batch = 0;       // most sessions in one decode pass
+    uint64_t kv_deferrals = 0;     // steps an admission waited for KV
+    uint64_t peak_kv_tokens = 0;   // held or reserved by the batch
+    uint64_t peak_rss_bytes = 0;   // sampled at every step
+};
+
+// Load or reload `model_dir`; false with `error` set if it did not load
+bool bench_load_model(const std::string& model_dir, ComputeBackend backend, std::string* error);
+
+// "<backend> <device name>" of the loaded model
+std::string bench_device();
+
+// One fresh conversation: about `prompt_tokens` of prompt, then `decode_tokens` steps
+bool bench_run(int prompt_tokens, int decode_tokens, BenchRun* run, std::string* error);
+
+// `sessions` prompts of about `context_tokens` each, submitted at once and
+// decoded together for `decode_tokens` steps each; false without batching
+bool bench_concurrent(int sessions, int context_tokens, int decode_tokens, BenchConcurrentRun* run,
+                      std::string* error);
+
+// Thread pool and generation governor for the runs that follow (soak mode
+// compares them); a run with the governor on feeds it like a chat turn
+void bench_configure(ThreadAffinity affinity, int workers, bool governor, float governor_target);
+
+// The governor's level (0 as configured ... 3 coolest)
+int bench_governor_level();
+
+void bench_unload();
@@ -0,0 +1,465 @@
+#include "logit_sampler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Probabilities are bucketed by their binary exponent, so each bucket spans a factor of two
+constexpr int kExponentBuckets = 64;
+
+int exponent_bucket(float prob) {
+    uint32_t bits;
+    memcpy(&bits, &prob, sizeof(bits));
+    int exponent = static_cast<int>((bits >> 23) & 0xff);
+    return std::min(std::max(127 - exponent, 0), kExponentBuckets - 1);
+}
+
+#if defined(__ARM_NEON)
+// exp(x) for x <= 0, Cephes-style range reduction and a degree 5 polynomial
+inline float32x4_t exp_neg_f32(float32x4_t x) {
+    x = vmaxq_f32(x, vdupq_n_f32(-87.3365447504f));
+
+    // x = n * ln2 + r, |r| <= ln2 / 2
+    int32x4_t n = vcvtnq_s32_f32(vmulq_n_f32(x, 1.44269504088896341f));
+    float32x4_t fn = vcvtq_f32_s32(n);
+    float32x4_t r = vfmsq_f32(x, fn, vdupq_n_f32(0.693359375f));
+    r = vfmsq_f32(r, fn, vdupq_n_f32(-2.12194440e-4f));
+
+    float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+    p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), p, r);
+    p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, vmulq_f32(r, r));
+
+    // Multiply by 2^n through the exponent bits
+    int32x4_t scale = vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23);
+    return vmulq_f32(p, vreinterpretq_f32_s32(scale));
+}
+#endif
+
+float max_value(const float* values, size_t n) {
+    float best = -std::numeric_limits<float>::infinity();
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    float32x4_t m0 = vdupq_n_f32(best), m1 = m0, m2 = m0, m3 = m0;
+    for (; i + 16 <= n; i += 16) {
+        m0 = vmaxq_f32(m0, vld1q_f32(values + i));
+        m1 = vmaxq_f32(m1, vld1q_f32(values + i + 4));
+        m2 = vmaxq_f32(m2, vld1q_f32(values + i + 8));
+        m3 = vmaxq_f32(m3, vld1q_f32(values + i + 12));
+    }
+    best = vmaxvq_f32(vmaxq_f32(vmaxq_f32(m0, m1), vmaxq_f32(m2, m3)));
+#endif
+    for (; i < n; ++i) {
+        best = std::max(best, values[i]);
+    }
+    return best;
+}
+
+inline bool allowed(const uint64_t* mask, size_t id) {
+    return (mask[id >> 6] >> (id & 63) & 1) != 0;
+}
+
+// Largest value and the first index holding it, in one pass: the row is taken
+// 64 values (one mask word) at a time, and only the block that wins is looked
+// at again for the index. Masked out values are skipped, whole words at once;
+// the index is n when the mask allows nothing.
+template <bool kMasked>
+std::pair<float, size_t> arg_max(const float* values, size_t n, const uint64_t* mask) {
+    float best = -std::numeric_limits<float>::infinity();
+    size_t best_index = n;
+    size_t best_block = n;
+    for (size_t base = 0; base < n; base += 64) {
+        size_t len = std::min<size_t>(64, n - base);
+        if (kMasked) {
+            uint64_t bits = mask[base >> 6];
+            if (len < 64) {
+                bits &= (1ull << len) - 1;
+            }
+            if (bits == 0) {
+                continue;
+            }
+            if (bits != ~0ull) {
+                for (; bits != 0; bits &= bits - 1) {
+                    size_t i = base + static_cast<size_t>(__builtin_ctzll(bits));
+                    if (values[i] > best || best_index == n) {
+                        best = values[i];
+                        best_index = i;
+                        best_block = n;
+                    }
+                }
+                continue;
+            }
+        }
+        float block = max_value(values + base, len);
+        if (block > best || best_index == n) {
+            best = block;
+            best_index = base;
+            best_block = base;
+        }
+    }
+    if (best_block < n) {
+        const float* end = values + std::min<size_t>(best_block + 64, n);
+        best_index = static_cast<size_t>(std::find(values + best_block, end, best) - values);
+        if (values + best_index == end) {
+            best_index = best_block;  // a NaN block
+        }
+    }
+    if (!kMasked && best_index == n) {
+        best_index = 0;
+    }
+    return {best, best_index};
+}
+
+// probs = exp(logits * scale + offset) over n values, returning their sum
+float exp_block(const float* logits, float* probs, size_t n, float scale, float offset) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t vscale = vdupq_n_f32(scale);
+    float32x4_t voffset = vdupq_n_f32(offset);
+    float32x4_t s0 = vdupq_n_f32(0.0f), s1 = s0, s2 = s0, s3 = s0;
+    for (; i + 16 <= n; i += 16) {
+        float32x4_t e0 = exp_neg_f32(vfmaq_f32(voffset, vld1q_f32(logits + i), vscale));
+        float32x4_t e1 = exp_neg_f32(vfmaq_f32(voffset, vld1q_f32(logits + i + 4), vscale));
+        float32x4_t e2 = exp_neg_f32(vfmaq_f32(voffset, vld1q_f32(logits + i + 8), vscale));
+        float32x4_t e3 = exp_neg_f32(vfmaq_f32(voffset, vld1q_f32(logits + i + 12), vscale));
+        vst1q_f32(probs + i, e0);
+        vst1q_f32(probs + i + 4, e1);
+        vst1q_f32(probs + i + 8, e2);
+        vst1q_f32(probs + i + 12, e3);
+        s0 = vaddq_f32(s0, e0);
+        s1 = vaddq_f32(s1, e1);
+        s2 = vaddq_f32(s2, e2);
+        s3 = vaddq_f32(s3, e3);
+    }
+    sum = vaddvq_f32(vaddq_f32(vaddq_f32(s0, s1), vaddq_f32(s2, s3)));
+#endif
+    for (; i < n; ++i) {
+        probs[i] = std::exp(logits[i] * scale + offset);
+        sum += probs[i];
+    }
+    return sum;
+}
+
+}  // namespace
+
+void LogitSampler::configure(float temperature, float top_p, float repetition_penalty) {
+    temperature_ = std::max(temperature, 0.0f);
+    top_p_ = std::min(std::max(top_p, 1e-6f), 1.0f);
+    repetition_penalty_ = repetition_penalty > 0.0f ? repetition_penalty : 1.0f;
+    features_ = temperature_ < 1e-5f ? kFeatureGreedy : (top_p_ < 1.0f ? kFeatureNucleus : 0u);
+    if (repetition_penalty_ != 1.0f) {
+        features_ |= kFeaturePenalty;
+    }
+}
+
+float LogitSampler::penalize(float logit) const {
+    return logit > 0.0f ? logit / repetition_penalty_ : logit * repetition_penalty_;
+}
+
+bool LogitSampler::mark_penalized(int id, size_t vocab_size) {
+    if (id < 0 || static_cast<size_t>(id) >= vocab_size || penalized_epoch_[id] == epoch_) {
+        return false;
+    }
+    penalized_epoch_[id] = epoch_;
+    return true;
+}
+
+int LogitSampler::sample(const float* logits, size_t vocab_size, const int* history, size_t history_size) {
+    return sample_row(logits, vocab_size, history, history_size, nullptr);
+}
+
+int LogitSampler::sample_masked(const float* logits, size_t vocab_size, const uint64_t* mask, size_t mask_words,
+                               const int* history, size_t history_size) {
+    return sample_row(logits, std::min(vocab_size, mask_words * 64), history, history_size, mask);
+}
+
+int LogitSampler::sample_row(const float* logits, size_t vocab_size, const int* history, size_t history_size,
+                             const uint64_t* mask) {
+    if (vocab_size == 0) {
+        return -1;
+    }
+    auto start = Clock::now();
+
+    unsigned features = features_ | (mask != nullptr ? kFeatureMask : 0u);
+    if (history_size == 0) {
+        features &= ~kFeaturePenalty;
+    }
+    if ((features & kFeaturePenalty) != 0) {
+        if (penalized_epoch_.size() < vocab_size) {
+            penalized_epoch_.assign(vocab_size, 0);
+            epoch_ = 0;
+        }
+        if (++epoch_ == 0) {
+            std::fill(penalized_epoch_.begin(), penalized_epoch_.end(), 0);
+            epoch_ = 1;
+        }
+    }
+    static constexpr std::array<Kernel, kVariants> kKernels = kernels(std::make_index_sequence<kVariants>());
+    int token = (this->*kKernels[features])(logits, vocab_size, history, history_size, mask);
+
+    float us = std::chrono::duration<float, std::micro>(Clock::now() - start).count();
+    stats_.tokens++;
+    stats_.total_us += us;
+    stats_.last_us = us;
+    return token;
+}
+
+template <unsigned kFeatures>
+int LogitSampler::run(const float* logits, size_t vocab_size, const int* history, size_t history_size,
+                      const uint64_t* mask) {
+    constexpr bool kPenalty = (kFeatures & kFeaturePenalty) != 0;
+    constexpr bool kMasked = (kFeatures & kFeatureMask) != 0;
+    if constexpr ((kFeatures & kFeatureGreedy) != 0) {
+        return argmax<kPenalty, kMasked>(logits, vocab_size, history, history_size, mask);
+    } else {
+        // The raw maximum bounds every penalized logit unless the penalty boosts them
+        float max_logit = arg_max<kMasked>(logits, vocab_size, mask).first;
+        if (kMasked && max_logit == -std::numeric_limits<float>::infinity()) {
+            return -1;
+        }
+        if (kPenalty) {
+            for (size_t i = 0; i < history_size; ++i) {
+                int id = history[i];
+                if (id >= 0 && static_cast<size_t>(id) < vocab_size && (!kMasked || allowed(mask, id))) {
+                    max_logit = std::max(max_logit, penalize(logits[id]));
+                }
+            }
+        }
+        float sum = exponentiate<kPenalty, kMasked>(logits, vocab_size, max_logit, history, history_size, mask);
+        return (kFeatures & kFeatureNucleus) != 0 ? sample_nucleus(vocab_size, sum) : sample_all(vocab_size, sum);
+    }
+}
+
+template <bool kPenalty, bool kMasked>
+int LogitSampler::argmax(const float* logits, size_t vocab_size, const int* history, size_t history_size,
+                         const uint64_t* mask) {
+    auto best = arg_max<kMasked>(logits, vocab_size, mask);
+    if (kMasked && best.second >= vocab_size) {
+        return -1;
+    }
+    if (!kPenalty) {
+        return static_cast<int>(best.second);
+    }
+
+    float best_history = -std::numeric_limits<float>::infinity();
+    int best_history_id = -1;
+    bool max_penalized = false;
+    for (size_t i = 0; i < history_size; ++i) {
+        int id = history[i];
+        if (!mark_penalized(id, vocab_size) || (kMasked && !allowed(mask, id))) {
+            continue;
+        }
+        max_penalized |= static_cast<size_t>(id) == best.second;
+        float value = penalize(logits[id]);
+        if (value > best_history) {
+            best_history = value;
+            best_history_id = id;
+        }
+    }
+
+    // Slow path only when the raw winner was penalized: rescan the unpenalized tokens
+    float best_value = best.first;
+    int best_id = static_cast<int>(best.second);
+    if (max_penalized) {
+        best_value = -std::numeric_limits<float>::infinity();
+        best_id = -1;
+        for (size_t i = 0; i < vocab_size; ++i) {
+            if (penalized_epoch_[i] != epoch_ && logits[i] > best_value && (!kMasked || allowed(mask, i))) {
+                best_value = logits[i];
+                best_id = static_cast<int>(i);
+            }
+        }
+    }
+    return (best_id < 0 || best_history > best_value) ? best_history_id : best_id;
+}
+
+template <bool kPenalty, bool kMasked>
+float LogitSampler::exponentiate(const float* logits, size_t vocab_size, float max_logit, const int* history,
+                                 size_t history_size, const uint64_t* mask) {
+    if (probs_.size() < vocab_size) {
+        probs_.resize(vocab_size);
+    }
+    float* probs = probs_.data();
+    const float scale = 1.0f / temperature_;
+    const float offset = -max_logit * scale;
+
+    // probs = exp(logit / T - max / T), summed on the way; disallowed tokens get 0
+    float sum = 0.0f;
+    if (!kMasked) {
+        sum = exp_block(logits, probs, vocab_size, scale, offset);
+    } else {
+        for (size_t base = 0; base < vocab_size; base += 64) {
+            size_t len = std::min<size_t>(64, vocab_size - base);
+            uint64_t bits = mask[base >> 6];
+            if (len < 64) {
+                bits &= (1ull << len) - 1;
+            }
+            if (bits == ~0ull) {
+                sum += exp_block(logits + base, probs + base, len, scale, offset);
+                continue;
+            }
+            std::fill(probs + base, probs + base + len, 0.0f);
+            for (; bits != 0; bits &= bits - 1) {
+                size_t i = base + static_cast<size_t>(__builtin_ctzll(bits));
+                probs[i] = std::exp(logits[i] * scale + offset);
+                sum += probs[i];
+            }
+        }
+    }
+
+    // The history is tiny next to the vocabulary, so patch those entries afterwards
+    if (kPenalty) {
+        for (size_t h = 0; h < history_size; ++h) {
+            int id = history[h];
+            if (!mark_penalized(id, vocab_size) || (kMasked && !allowed(mask, id))) {
+                continue;
+            }
+            float penalized = std::exp(penalize(logits[id]) * scale + offset);
+            sum += penalized - probs[id];
+            probs[id] = penalized;
+        }
+    }
+    return sum;
+}
+
+int LogitSampler::sample_all(size_t vocab_size, float sum) {
+    const float* probs = probs_.data();
+    float u = std::uniform_real_distribution<float>(0.0f, sum)(rng_);
+    float cumulative = 0.0f;
+    for (size_t i = 0; i < vocab_size; ++i) {
+        cumulative += probs[i];
+        if (u < cumulative) {
+            return static_cast<int>(i);
+        }
+    }
+    return static_cast<int>(arg_max<false>(probs, vocab_size, nullptr).second);
+}
+
+int LogitSampler::sample_nucleus(size_t vocab_size, float sum) {
+    const float* probs = probs_.data();
+
+    // Every token below `threshold` together holds less than (1 - top_p) of the mass,
+    // so the tokens at or above it already cover top_p and contain the whole nucleus
+    const float threshold = (1.0f - top_p_) * sum / static_cast<float>(vocab_size);
+    candidates_.clear();
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    float32x4_t vthreshold = vdupq_n_f32(threshold);
+    for (; i + 4 <= vocab_size; i += 4) {
+        uint32x4_t keep = vcgeq_f32(vld1q_f32(probs + i), vthreshold);
+        if (vmaxvq_u32(keep) == 0) {
+            continue;
+        }
+        for (size_t lane = 0; lane < 4; ++lane) {
+            if (probs[i + lane] >= threshold) {
+                candidates_.push_back({probs[i + lane], static_cast<int>(i + lane)});
+            }
+        }
+    }
+#endif
+    for (; i < vocab_size; ++i) {
+        if (probs[i] >= threshold) {
+            candidates_.push_back({probs[i], static_cast<int>(i)});
+        }
+    }
+    stats_.candidates += candidates_.size();
+
+    // Only the bucket where the nucleus ends needs ordering; everything in the
+    // buckets above it is in the nucleus whatever its order
+    float bucket_mass[kExponentBuckets] = {};
+    for (const Candidate& c : candidates_) {
+        bucket_mass[exponent_bucket(c.prob)] += c.prob;
+    }
+    const float target = top_p_ * sum;
+    float kept_mass = 0.0f;
+    int cut = 0;
+    while (cut < kExponentBuckets - 1 && kept_mass + bucket_mass[cut] < target) {
+        kept_mass += bucket_mass[cut];
+        ++cut;
+    }
+
+    auto above_end = std::partition(candidates_.begin(), candidates_.end(),
+                                    [cut](const Candidate& c) { return exponent_bucket(c.prob) < cut; });
+    auto cut_end = std::partition(above_end, candidates_.end(),
+                                  [cut](const Candidate& c) { return exponent_bucket(c.prob) == cut; });
+    std::sort(above_end, cut_end, [](const Candidate& a, const Candidate& b) { return a.prob > b.prob; });
+
+    auto nucleus_end = above_end;
+    while (nucleus_end != cut_end && kept_mass < target) {
+        kept_mass += nucleus_end->prob;
+        ++nucleus_end;
+    }
+    if (nucleus_end == candidates_.begin()) {
+        return static_cast<int>(arg_max<false>(probs, vocab_size, nullptr).second);
+    }
+
+    float u = std::uniform_real_distribution<float>(0.0f, kept_mass)(rng_);
+    float cumulative = 0.0f;
+    for (auto it = candidates_.begin(); it != nucleus_end; ++it) {
+        cumulative += it->prob;
+        if (u < cumulative) {
+            return it->id;
+        }
+    }
+    return (nucleus_end - 1)->id;
+}
+
+void LogitSampler::record_device_sample(float us) {
+    stats_.tokens++;
+    stats_.device_tokens++;
+    stats_.total_us += us;
+    stats_.last_us = us;
+}
+
+void LogitSampler::record_shortlist(size_t rows) {
+    stats_.shortlist_tokens++;
+    stats_.shortlist_rows += rows;
+}
+
+void LogitSampler::half_to_float(const uint16_t* in, float* out, size_t count) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t h = vld1q_u16(in + i);
+        vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(vget_low_u16(h))));
+        vst1q_f32(out + i + 4, vcvt_f32_f16(vreinterpret_f16_u16(vget_high_u16(h))));
+    }
+#endif
+    for (; i < count; ++i) {
+        uint32_t h = in[i];
+        uint32_t sign = (h & 0x8000u) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ffu;
+        uint32_t bits;
+        if (exponent == 0x1f) {
+            bits = sign | 0x7f800000u | (mantissa << 13);
+        } else if (exponent != 0) {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        } else if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal half: normalize into a float
+            exponent = 113;
+            while ((mantissa & 0x400u) == 0) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+        }
+        memcpy(out + i, &bits, sizeof(bits));
+    }
+}
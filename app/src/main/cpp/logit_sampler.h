@@ -0,0 +1,160 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Temperature / top-p / repetition-penalty sampler over a full logits row.
+ *
+ * Penalty, temperature scaling and the softmax exponent are fused into one
+ * vectorized pass over the vocabulary. Nucleus sampling never sorts the full
+ * vocabulary: a probability threshold that provably keeps the whole nucleus
+ * filters the row first, and only the surviving candidates are ordered, using
+ * exponent buckets when there are many of them.
+ *
+ * Each combination of enabled features (greedy, repetition penalty, nucleus,
+ * grammar mask) is its own compile-time variant, picked once by configure(),
+ * so a step runs no code for what is off: a greedy request is one fused
+ * argmax pass over the row, with no exponentials and no candidate list.
+ */
+struct SamplerStats {
+    uint64_t tokens = 0;       // tokens sampled
+    uint64_t candidates = 0;   // nucleus candidates examined, summed over tokens
+    uint64_t device_tokens = 0;  // tokens sampled by a device kernel instead (included in tokens)
+    uint64_t shortlist_tokens = 0;  // sampled from a vocabulary shortlist (included in tokens)
+    uint64_t shortlist_rows = 0;    // shortlist sizes, summed over those tokens
+    double total_us = 0.0;
+    float last_us = 0.0f;
+
+    float average_us() const {
+        return tokens == 0 ? 0.0f : static_cast<float>(total_us / tokens);
+    }
+};
+
+/**
+ * What a conversation has generated, kept incrementally for the repetition
+ * penalty. add() is O(1) per token, and the sampler gets the distinct ids as
+ * one sparse list to scatter the penalty over, so a step costs the distinct
+ * tokens seen instead of a rescan of every token of the history. Counts are
+ * kept alongside for count-based penalties.
+ */
+class PenaltyHistory {
+public:
+    void add(int id) {
+        if (id < 0) {
+            return;
+        }
+        auto entry = counts_.emplace(id, 0u);
+        if (entry.second) {
+            ids_.push_back(id);
+        }
+        entry.first->second++;
+    }
+
+    void clear() {
+        counts_.clear();
+        ids_.clear();
+    }
+
+    // Distinct ids, in order of first occurrence
+    const int* ids() const { return ids_.data(); }
+    size_t size() const { return ids_.size(); }
+
+    uint32_t count(int id) const {
+        auto it = counts_.find(id);
+        return it == counts_.end() ? 0u : it->second;
+    }
+
+private:
+    std::unordered_map<int, uint32_t> counts_;
+    std::vector<int> ids_;
+};
+
+class LogitSampler {
+public:
+    // temperature <= 0 samples greedily; top_p >= 1 disables nucleus filtering;
+    // repetition_penalty 1 disables the penalty. Picks the variant later
+    // samples run.
+    void configure(float temperature, float top_p, float repetition_penalty);
+    void seed(uint64_t seed) { rng_.seed(seed); }
+    // Trade generators, to sample one stream of several with its own
+    void swap_rng(std::mt19937_64& rng) { std::swap(rng_, rng); }
+
+    // Pick the next token from `logits`. Tokens in `history` are penalized once
+    // each, however often they occur; a PenaltyHistory passes each only once.
+    int sample(const float* logits, size_t vocab_size, const int* history, size_t history_size);
+    // sample() over just the tokens whose bit is set in `mask` (64 per word, as
+    // CompiledGrammar builds them), read in place instead of masking a copy of
+    // the row. Rows past the mask are never picked; -1 when nothing is allowed.
+    int sample_masked(const float* logits, size_t vocab_size, const uint64_t* mask, size_t mask_words,
+                      const int* history, size_t history_size);
+    // Greedy requests take the argmax variant
+    bool greedy() const { return (features_ & kFeatureGreedy) != 0; }
+
+    // Convert an IEEE half logits row into `out` (used when the model emits fp16)
+    static void half_to_float(const uint16_t* in, float* out, size_t count);
+
+    // Uniform draw in [0, 1) from the seeded generator, for samplers that run
+    // elsewhere (e.g. on the GPU) but must stay reproducible from the same seed
+    float next_uniform() { return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng_); }
+    // Account a token sampled outside this class in the same stats
+    void record_device_sample(float us);
+    // The last sample() ran over a shortlist of `rows` logits
+    void record_shortlist(size_t rows);
+
+    SamplerStats stats() const { return stats_; }
+    void reset_stats() { stats_ = SamplerStats(); }
+
+private:
+    struct Candidate {
+        float prob;
+        int id;
+    };
+
+    // Variant bits, set by configure(); kFeatureMask comes with sample_masked()
+    enum Feature : unsigned {
+        kFeatureGreedy = 1u << 0,
+        kFeaturePenalty = 1u << 1,
+        kFeatureNucleus = 1u << 2,
+        kFeatureMask = 1u << 3,
+        kVariants = 1u << 4,
+    };
+    using Kernel = int (LogitSampler::*)(const float*, size_t, const int*, size_t, const uint64_t*);
+
+    float temperature_ = 0.7f;
+    float top_p_ = 0.95f;
+    float repetition_penalty_ = 1.0f;
+    unsigned features_ = kFeatureNucleus;
+
+    std::mt19937_64 rng_{std::random_device()()};
+    std::vector<float> probs_;               // unnormalized exp((logit - max) / T)
+    std::vector<Candidate> candidates_;
+    std::vector<uint32_t> penalized_epoch_;  // dedups history without clearing per token
+    uint32_t epoch_ = 0;
+    SamplerStats stats_;
+
+    int sample_row(const float* logits, size_t vocab_size, const int* history, size_t history_size,
+                   const uint64_t* mask);
+    // One variant; `mask` is null unless kFeatureMask is set
+    template <unsigned kFeatures>
+    int run(const float* logits, size_t vocab_size, const int* history, size_t history_size, const uint64_t* mask);
+    template <size_t... kFeatures>
+    static constexpr std::array<Kernel, sizeof...(kFeatures)> kernels(std::index_sequence<kFeatures...>) {
+        return {{&LogitSampler::run<static_cast<unsigned>(kFeatures)>...}};
+    }
+    template <bool kPenalty, bool kMasked>
+    int argmax(const float* logits, size_t vocab_size, const int* history, size_t history_size, const uint64_t* mask);
+    float penalize(float logit) const;
+    // Fill probs_ and return their sum
+    template <bool kPenalty, bool kMasked>
+    float exponentiate(const float* logits, size_t vocab_size, float max_logit, const int* history,
+                       size_t history_size, const uint64_t* mask);
+    int sample_all(size_t vocab_size, float sum);
+    int sample_nucleus(size_t vocab_size, float sum);
+    bool mark_penalized(int id, size_t vocab_size);
+};
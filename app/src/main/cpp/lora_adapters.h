@@ -0,0 +1,157 @@
+#pragma once
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "json_fields.h"
+
+/**
+ * LoRA adapters shipped next to the base model, one PEFT directory each:
+ *
+ *   <model_dir>/adapters/<name>/adapter_config.json   rank ("r") and "lora_alpha"
+ *   <model_dir>/adapters/<name>/...                   the low-rank weights, as converted for the module
+ *
+ * The chat module does the math on top of the base weights, which stay loaded
+ * as they are: load_adapter(name, dir) uploads an adapter's A and B matrices
+ * (a few MB at rank 8-16), set_adapter(name) picks the one the next turns run
+ * with ("" for the base model), and batch_set_adapter(seq, name) tags one
+ * sequence of a batch, so a batched decode step can mix adapters (the module
+ * gathers each row's A and B, as in a segmented LoRA matmul).
+ *
+ * An adapter named after a subject key ("math", "history", see topic_router.h)
+ * is what conversations routed to that subject run with. Loaded adapters are
+ * kept in least-recently-used order up to kMaxResident; one a batch sequence
+ * still decodes with is never unloaded.
+ */
+struct AdapterInfo {
+    std::string name;
+    std::string dir;
+    int rank = 0;
+    float alpha = 0.0f;
+    uint64_t bytes = 0;  // files in its directory
+};
+
+class AdapterSet {
+public:
+    static constexpr size_t kMaxResident = 8;
+
+    // List <model_dir>/adapters; a directory without adapter_config.json is skipped
+    void scan(const std::string& model_dir) {
+        clear();
+        std::string root = model_dir + "/adapters";
+        DIR* d = opendir(root.c_str());
+        if (d == nullptr) {
+            return;
+        }
+        while (dirent* entry = readdir(d)) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            AdapterInfo info;
+            info.name = entry->d_name;
+            info.dir = root + "/" + info.name;
+            std::ifstream in(info.dir + "/adapter_config.json");
+            if (!in.good()) {
+                continue;
+            }
+            std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            info.rank = static_cast<int>(json_int_field(json, "r", 0));
+            info.alpha = static_cast<float>(json_float_field(json, "lora_alpha", 0.0));
+            info.bytes = directory_bytes(info.dir);
+            available_[info.name] = info;
+        }
+        closedir(d);
+    }
+
+    bool empty() const { return available_.empty(); }
+    bool has(const std::string& name) const { return available_.find(name) != available_.end(); }
+    const AdapterInfo* find(const std::string& name) const {
+        auto it = available_.find(name);
+        return it != available_.end() ? &it->second : nullptr;
+    }
+    bool loaded(const std::string& name) const {
+        return std::find(order_.begin(), order_.end(), name) != order_.end();
+    }
+
+    // Every adapter found, by name
+    std::vector<const AdapterInfo*> available() const {
+        std::vector<const AdapterInfo*> out;
+        for (const auto& entry : available_) {
+            out.push_back(&entry.second);
+        }
+        return out;
+    }
+
+    // Mark `name` as just used. Sets `needs_load` if it is not loaded yet and
+    // returns the adapters to unload so it fits, least recently used first.
+    std::vector<std::string> use(const std::string& name, bool* needs_load) {
+        auto it = std::find(order_.begin(), order_.end(), name);
+        *needs_load = it == order_.end();
+        if (!*needs_load) {
+            order_.splice(order_.begin(), order_, it);
+            return {};
+        }
+        order_.push_front(name);
+        std::vector<std::string> out;
+        for (auto victim = std::prev(order_.end()); order_.size() > kMaxResident && victim != order_.begin();) {
+            auto current = victim--;
+            if (in_use(*current)) {
+                continue;
+            }
+            out.push_back(*current);
+            order_.erase(current);
+        }
+        return out;
+    }
+
+    // load_adapter failed: it is not resident after all
+    void forget(const std::string& name) { order_.remove(name); }
+
+    // A batch sequence decodes with `name` until release()
+    void acquire(const std::string& name) { refs_[name]++; }
+    void release(const std::string& name) {
+        auto it = refs_.find(name);
+        if (it != refs_.end() && --it->second <= 0) {
+            refs_.erase(it);
+        }
+    }
+
+    void clear() {
+        available_.clear();
+        order_.clear();
+        refs_.clear();
+    }
+
+private:
+    bool in_use(const std::string& name) const { return refs_.find(name) != refs_.end(); }
+
+    static uint64_t directory_bytes(const std::string& dir) {
+        uint64_t total = 0;
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr) {
+            return 0;
+        }
+        while (dirent* entry = readdir(d)) {
+            struct stat st;
+            if (entry->d_name[0] != '.' && stat((dir + "/" + entry->d_name).c_str(), &st) == 0 &&
+                S_ISREG(st.st_mode)) {
+                total += static_cast<uint64_t>(st.st_size);
+            }
+        }
+        closedir(d);
+        return total;
+    }
+
+    std::map<std::string, AdapterInfo> available_;
+    std::list<std::string> order_;  // loaded, most recently used first
+    std::map<std::string, int> refs_;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Block structure of a streamed Markdown/LaTeX answer, kept up to date one
+ * delta at a time.
+ *
+ * Re-parsing the whole answer on every token costs the chat view time
+ * quadratic in the answer's length; a worked solution of a few hundred lines
+ * re-parses every line it has for each token it adds. Here the answer is split
+ * into blocks (paragraphs, headings, lists, quotes, tables, rules, fenced code
+ * and display math) and a delta only re-scans from the block that was still
+ * open: blocks before it are final. append() reports which blocks the delta
+ * started or changed, so the view re-renders only those.
+ *
+ * A change carries the block's kind and its text from `keep` bytes on; the
+ * first `keep` bytes are the ones it had before. A token that extends a
+ * paragraph is a change with the old length as `keep` and the token as text.
+ * Since the last line may still be incomplete ("#" before "#tag", "1" before
+ * "1. "), a block can change kind, and a block started on that line can
+ * merge back into the one before it; `removed` then says from which index on
+ * blocks are gone.
+ *
+ * Rules follow CommonMark loosely: a blank line ends any block but a fence;
+ * lists and quotes take lazy continuation lines; ``` or ~~~ fences hold code,
+ * and $$ ... $$ or \[ ... \] display math, blank lines included. Inline spans
+ * ($x$, `code`, emphasis) stay inside their block. Setext headings and
+ * indented code are paragraphs.
+ */
+namespace markdown_blocks {
+
+enum Kind : uint8_t {
+    kParagraph = 0,
+    kHeading = 1,
+    kList = 2,
+    kQuote = 3,
+    kTable = 4,
+    kRule = 5,
+    kCode = 6,
+    kMath = 7,
+};
+
+enum Op : uint8_t {
+    kStarted = 0,
+    kUpdated = 1,
+    kRemoved = 2,  // this block and every one after it
+};
+
+struct Change {
+    Op op = kStarted;
+    Kind kind = kParagraph;
+    uint32_t index = 0;
+    uint32_t keep = 0;  // leading bytes of the block as last reported
+    std::string text;   // the block's text from `keep` on
+};
+
+class Tracker {
+public:
+    // Adds a streamed delta; appends to `changes` what it started, changed or removed, in block order
+    void append(std::string_view delta, std::vector<Change>* changes) {
+        if (delta.empty()) {
+            return;
+        }
+        text_.append(delta.data(), delta.size());
+        std::vector<Block> tail = scan(rescan_from());
+        size_t first = tail.empty() ? blocks_.size() : tail.front().index;
+        for (const Block& block : tail) {
+            if (block.index >= blocks_.size()) {
+                changes->push_back(change(kStarted, block, 0));
+                continue;
+            }
+            const Block& old = blocks_[block.index];
+            if (old.kind == block.kind && old.start == block.start && old.end == block.end) {
+                continue;
+            }
+            changes->push_back(change(kUpdated, block, common_prefix(old, block)));
+        }
+        size_t count = first + tail.size();
+        if (count < blocks_.size()) {
+            Change removed;
+            removed.op = kRemoved;
+            removed.index = static_cast<uint32_t>(count);
+            changes->push_back(std::move(removed));
+        }
+        blocks_.resize(first);
+        blocks_.insert(blocks_.end(), tail.begin(), tail.end());
+    }
+
+    void reset() {
+        text_.clear();
+        blocks_.clear();
+    }
+
+    size_t size() const { return blocks_.size(); }
+    const std::string& text() const { return text_; }
+    Kind kind(size_t index) const { return blocks_[index].kind; }
+
+    std::string_view block_text(size_t index) const {
+        const Block& block = blocks_[index];
+        return std::string_view(text_).substr(block.start, block.end - block.start);
+    }
+
+private:
+    struct Block {
+        Kind kind = kParagraph;
+        size_t index = 0;
+        size_t start = 0;  // at a line start outside any fence
+        size_t end = 0;    // end of its last line, without the newline
+    };
+
+    std::string text_;
+    std::vector<Block> blocks_;
+
+    // The open block, or the one before it if the open one began on the
+    // still incomplete last line and so may yet turn out to continue it
+    size_t rescan_from() const {
+        if (blocks_.empty()) {
+            return 0;
+        }
+        size_t last = blocks_.size() - 1;
+        size_t line = text_.rfind('\n', text_.size() - 1);
+        size_t last_line = line == std::string::npos ? 0 : line + 1;
+        if (last > 0 && blocks_[last].start >= last_line) {
+            last--;
+        }
+        return last;
+    }
+
+    Change change(Op op, const Block& block, size_t keep) const {
+        Change out;
+        out.op = op;
+        out.kind = block.kind;
+        out.index = static_cast<uint32_t>(block.index);
+        out.keep = static_cast<uint32_t>(keep);
+        out.text = text_.substr(block.start + keep, block.end - block.start - keep);
+        return out;
+    }
+
+    size_t common_prefix(const Block& a, const Block& b) const {
+        size_t length = std::min(a.end - a.start, b.end - b.start);
+        if (a.start == b.start) {
+            return length;
+        }
+        size_t same = 0;
+        while (same < length && text_[a.start + same] == text_[b.start + same]) {
+            same++;
+        }
+        return same;
+    }
+
+    static bool blank(std::string_view line) {
+        return line.find_first_not_of(" \t\r") == std::string_view::npos;
+    }
+
+    // Up to three spaces of indent, as CommonMark allows before a block marker
+    static std::string_view unindent(std::string_view line) {
+        size_t spaces = 0;
+        while (spaces < 3 && spaces < line.size() && line[spaces] == ' ') {
+            spaces++;
+        }
+        return line.substr(spaces);
+    }
+
+    static size_t run(std::string_view line, char c) {
+        size_t n = 0;
+        while (n < line.size() && line[n] == c) {
+            n++;
+        }
+        return n;
+    }
+
+    static bool rule(std::string_view line) {
+        char marker = line.empty() ? '\0' : line[0];
+        if (marker != '-' && marker != '*' && marker != '_') {
+            return false;
+        }
+        size_t count = 0;
+        for (char c : line) {
+            if (c == marker) {
+                count++;
+            } else if (c != ' ' && c != '\t' && c != '\r') {
+                return false;
+            }
+        }
+        return count >= 3;
+    }
+
+    static bool list_item(std::string_view line) {
+        if (line.size() >= 2 && (line[0] == '-' || line[0] == '*' || line[0] == '+') &&
+            (line[1] == ' ' || line[1] == '\t')) {
+            return true;
+        }
+        size_t digits = 0;
+        while (digits < line.size() && digits < 9 && line[digits] >= '0' && line[digits] <= '9') {
+            digits++;
+        }
+        return digits > 0 && digits + 1 < line.size() && (line[digits] == '.' || line[digits] == ')') &&
+               (line[digits + 1] == ' ' || line[digits + 1] == '\t');
+    }
+
+    static Kind classify(std::string_view line) {
+        std::string_view body = unindent(line);
+        size_t hashes = run(body, '#');
+        if (hashes >= 1 && hashes <= 6 && (hashes == body.size() || body[hashes] == ' ' || body[hashes] == '\t')) {
+            return kHeading;
+        }
+        if (rule(body)) {
+            return kRule;
+        }
+        if (list_item(body)) {
+            return kList;
+        }
+        if (!body.empty() && body[0] == '>') {
+            return kQuote;
+        }
+        if (!body.empty() && body[0] == '|') {
+            return kTable;
+        }
+        return kParagraph;
+    }
+
+    // Whether a line of kind `next` goes on in an open block of kind `open`
+    static bool continues(Kind open, Kind next, std::string_view line) {
+        switch (open) {
+            case kParagraph:
+                return next == kParagraph;
+            case kList:
+                return next == kList || next == kParagraph || line[0] == ' ' || line[0] == '\t';
+            case kQuote:
+                return next == kQuote || next == kParagraph;
+            case kTable:
+                return next == kTable;
+            default:
+                return false;
+        }
+    }
+
+    // Blocks from blocks_[index].start to the end of the text
+    std::vector<Block> scan(size_t index) const {
+        std::vector<Block> out;
+        size_t pos = index < blocks_.size() ? blocks_[index].start : 0;
+        bool open = false;        // out.back() takes the next line if it fits
+        std::string closer;       // inside a fence until a line that closes it
+        while (pos < text_.size()) {
+            size_t newline = text_.find('\n', pos);
+            size_t end = newline == std::string::npos ? text_.size() : newline;
+            size_t next = newline == std::string::npos ? text_.size() : newline + 1;
+            std::string_view line(text_.data() + pos, end - pos);
+            if (!closer.empty()) {
+                out.back().end = end;
+                if (closes(out.back().kind, line, closer)) {
+                    closer.clear();
+                    open = false;
+                }
+                pos = next;
+                continue;
+            }
+            if (blank(line)) {
+                open = false;
+                pos = next;
+                continue;
+            }
+            std::string_view body = unindent(line);
+            Kind kind = classify(line);
+            bool fence = false;
+            if (run(body, '`') >= 3 || run(body, '~') >= 3) {
+                kind = kCode;
+                closer.assign(run(body, body[0]), body[0]);
+                fence = true;
+            } else if (body.substr(0, 2) == "$$" || body.substr(0, 2) == "\\[") {
+                kind = kMath;
+                closer = body[0] == '$' ? "$$" : "\\]";
+                // $$ x $$ on one line opens and closes
+                fence = body.find(closer, 2) == std::string_view::npos;
+                if (!fence) {
+                    closer.clear();
+                }
+            }
+            if (open && !fence && continues(out.back().kind, kind, line)) {
+                out.back().end = end;
+            } else {
+                Block block;
+                block.kind = kind;
+                block.index = index + out.size();
+                block.start = pos;
+                block.end = end;
+                out.push_back(block);
+            }
+            open = fence || (kind != kHeading && kind != kRule && kind != kMath && kind != kCode);
+            pos = next;
+        }
+        return out;
+    }
+
+    static bool closes(Kind kind, std::string_view line, const std::string& closer) {
+        if (kind == kMath) {
+            return line.find(closer) != std::string_view::npos;
+        }
+        std::string_view body = unindent(line);
+        size_t count = run(body, closer[0]);
+        return count >= closer.size() && blank(body.substr(count));
+    }
+};
+
+}  // namespace markdown_blocks
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "batch_scheduler.h"
+#include "layer_pager.h"
+#include "memory_stats.h"
+
+/**
+ * Admission against forecast memory, so concurrent sessions, batch jobs and
+ * speculative work cannot together grow the process into the low-memory
+ * killer.
+ *
+ * A request's forecast is its peak: the KV of its prompt plus the answer its
+ * task usually gives (output_lengths.h, not max_gen_len), at the model's KV
+ * bytes per token. It is admitted while what the engine holds — resident
+ * weights, the TVM workspace, chat sessions' KV and the batch's KV, held or
+ * reserved — plus the forecast fits the budget. The budget is setMemoryBudget's,
+ * lowered to what the process holds plus what the system can still give
+ * (MemAvailable less a reserve), so other apps' pressure counts too; without
+ * a set budget only that live limit applies. The room never exceeds what the
+ * system can still give either: the rest of the process (the ART heap,
+ * camera buffers, tokenizer tables) is in VmRSS but not in what the engine
+ * holds, and the budget alone would count it as free.
+ *
+ * Each priority class may fill its own share of the budget: speculative work
+ * stops first, background jobs next, and the chat turn someone waits on gets
+ * the rest. A request that does not fit is deferred when nobody waits on it
+ * (the batch keeps it queued, a follow-up branch is not started) and degraded
+ * otherwise: the engine first evicts parked sessions' KV, then unloads the
+ * draft model and caps the answer at what still fits, never below
+ * kMinDegradedTokens.
+ */
+namespace memory_forecast {
+
+// Left to the system; below it Android's low-memory killer reaches the foreground app's neighbours
+static constexpr uint64_t kDefaultReserveBytes = 384ull << 20;
+static constexpr int64_t kMeminfoRefreshMs = 500;
+static constexpr int kMinDegradedTokens = 64;
+
+// Share of the budget each class may fill, by RequestPriority
+static constexpr double kClassFill[kPriorityClasses] = {1.0, 0.9, 0.75};
+
+enum Decision : int {
+    kAdmit = 0,
+    kDegrade = 1,
+    kDefer = 2,
+};
+
+// What the engine holds or has promised to running requests
+struct Usage {
+    uint64_t weights = 0;
+    uint64_t workspace = 0;
+    uint64_t sessions = 0;
+    uint64_t batch = 0;
+
+    uint64_t total() const { return weights + workspace + sessions + batch; }
+};
+
+struct Forecast {
+    uint64_t prompt_tokens = 0;
+    uint64_t output_tokens = 0;
+    uint64_t kv_bytes_per_token = 0;
+
+    uint64_t bytes() const { return (prompt_tokens + output_tokens) * kv_bytes_per_token; }
+};
+
+struct Verdict {
+    Decision decision = kAdmit;
+    uint64_t output_tokens = 0;  // answer tokens that fit; the forecast's when admitted
+};
+
+// What /proc reports for the process and the system; 0 where it could not be read
+struct Meminfo {
+    uint64_t rss = 0;
+    uint64_t available = 0;
+};
+
+struct Stats {
+    uint64_t admitted[kPriorityClasses] = {};
+    uint64_t degraded[kPriorityClasses] = {};
+    uint64_t deferred[kPriorityClasses] = {};
+    uint64_t last_budget = 0;      // effective, at the last decision
+    uint64_t last_usage = 0;
+    uint64_t last_forecast = 0;
+};
+
+// Not thread-safe: the engine decides under its lock
+class Admission {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // 0 leaves only the live limit
+    void set_budget(uint64_t bytes) { budget_ = bytes; }
+    uint64_t budget() const { return budget_; }
+
+    void set_reserve(uint64_t bytes) {
+        reserve_ = bytes;
+        refreshed_ = Clock::time_point{};
+    }
+
+    // The set budget lowered to what the process holds plus what the system can
+    // still give; MemAvailable and VmRSS are re-read every kMeminfoRefreshMs
+    uint64_t effective_budget() { return effective_budget(budget_, reserve_, meminfo()); }
+
+    // Bytes class `priority` may still take beside `usage`; UINT64_MAX when unbounded
+    uint64_t room(const Usage& usage, int priority) { return room(budget_, reserve_, meminfo(), usage, priority); }
+
+    static uint64_t effective_budget(uint64_t budget, uint64_t reserve, const Meminfo& meminfo) {
+        if (meminfo.available == 0) {
+            return budget;
+        }
+        uint64_t live = meminfo.rss + headroom(reserve, meminfo);
+        return budget > 0 ? std::min(budget, live) : live;
+    }
+
+    // The class's share of the budget less what the engine holds, capped at what
+    // the system can still give above the reserve
+    static uint64_t room(uint64_t budget, uint64_t reserve, const Meminfo& meminfo, const Usage& usage,
+                         int priority) {
+        uint64_t effective = effective_budget(budget, reserve, meminfo);
+        if (effective == 0) {
+            return UINT64_MAX;
+        }
+        uint64_t limit = static_cast<uint64_t>(effective * kClassFill[clamp_class(priority)]);
+        uint64_t left = limit > usage.total() ? limit - usage.total() : 0;
+        return meminfo.available == 0 ? left : std::min(left, headroom(reserve, meminfo));
+    }
+
+    // Admits, degrades (interactive) or defers (the others) `forecast` beside `usage`, and counts it
+    Verdict decide(const Usage& usage, const Forecast& forecast, int priority) {
+        int cls = clamp_class(priority);
+        uint64_t room_bytes = room(usage, cls);
+        stats_.last_budget = effective_budget();
+        stats_.last_usage = usage.total();
+        stats_.last_forecast = forecast.bytes();
+        Verdict verdict;
+        verdict.output_tokens = forecast.output_tokens;
+        if (forecast.bytes() <= room_bytes || forecast.kv_bytes_per_token == 0) {
+            stats_.admitted[cls]++;
+            return verdict;
+        }
+        uint64_t prompt_bytes = forecast.prompt_tokens * forecast.kv_bytes_per_token;
+        uint64_t fits = room_bytes > prompt_bytes ? (room_bytes - prompt_bytes) / forecast.kv_bytes_per_token : 0;
+        if (cls == kPriorityInteractive) {
+            verdict.decision = kDegrade;
+            verdict.output_tokens = std::max<uint64_t>(kMinDegradedTokens, fits);
+            stats_.degraded[cls]++;
+        } else {
+            verdict.decision = kDefer;
+            verdict.output_tokens = fits;
+            stats_.deferred[cls]++;
+        }
+        return verdict;
+    }
+
+    const Stats& stats() const { return stats_; }
+
+    std::string to_json() const {
+        char json[512];
+        snprintf(json, sizeof(json),
+                 "{\"budget\": %llu, \"reserve\": %llu, \"effective_budget\": %llu, \"usage\": %llu, "
+                 "\"forecast\": %llu, \"admitted\": [%llu, %llu, %llu], \"degraded\": [%llu, %llu, %llu], "
+                 "\"deferred\": [%llu, %llu, %llu]}",
+                 static_cast<unsigned long long>(budget_), static_cast<unsigned long long>(reserve_),
+                 static_cast<unsigned long long>(stats_.last_budget), static_cast<unsigned long long>(stats_.last_usage),
+                 static_cast<unsigned long long>(stats_.last_forecast), u(stats_.admitted[0]), u(stats_.admitted[1]),
+                 u(stats_.admitted[2]), u(stats_.degraded[0]), u(stats_.degraded[1]), u(stats_.degraded[2]),
+                 u(stats_.deferred[0]), u(stats_.deferred[1]), u(stats_.deferred[2]));
+        return json;
+    }
+
+private:
+    uint64_t budget_ = 0;
+    uint64_t reserve_ = kDefaultReserveBytes;
+    Meminfo meminfo_;
+    Clock::time_point refreshed_{};
+    Stats stats_;
+
+    const Meminfo& meminfo() {
+        auto now = Clock::now();
+        if (refreshed_ == Clock::time_point{} || now - refreshed_ > std::chrono::milliseconds(kMeminfoRefreshMs)) {
+            refreshed_ = now;
+            meminfo_.available = layer_pager::available_ram();
+            meminfo_.rss = memory_stats::status_bytes("VmRSS");
+        }
+        return meminfo_;
+    }
+
+    static uint64_t headroom(uint64_t reserve, const Meminfo& meminfo) {
+        return meminfo.available > reserve ? meminfo.available - reserve : 0;
+    }
+
+    static int clamp_class(int priority) { return std::min(std::max(priority, 0), kPriorityClasses - 1); }
+    static unsigned long long u(uint64_t value) { return static_cast<unsigned long long>(value); }
+};
+
+}  // namespace memory_forecast
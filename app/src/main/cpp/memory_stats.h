@@ -0,0 +1,181 @@
+#pragma once
+
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <tvm/runtime/memory/memory_manager.h>
+
+/**
+ * Where the process's memory goes, by category, for getMemoryStats().
+ *
+ * Weights and GPU driver memory come from /proc/self/smaps: the mmap loader
+ * maps the params shards, so their mappings give the mapped size against what
+ * is resident (clean pages the kernel can drop under pressure); GPU buffers
+ * show up as kgsl, mali or dma-buf mappings. Workspace is what TVM's memory
+ * manager allocators hold per device (the pooled one keeps freed blocks, which
+ * is the usual suspect when RSS only grows). Heap totals are bionic's
+ * mallinfo(); the engine adds its request arena (see request_arena.h).
+ *
+ * High-water marks are kept per category since the last reset(): the cheap
+ * categories are sampled after every chat turn, the smaps ones whenever the
+ * stats are read. Process peak RSS is the kernel's VmHWM, which reset() clears
+ * through /proc/self/clear_refs.
+ */
+namespace memory_stats {
+
+struct Mapping {
+    uint64_t size = 0;
+    uint64_t rss = 0;
+};
+
+struct SmapsTotals {
+    Mapping weights;  // files under the model directory: params shards and the model library
+    Mapping gpu;      // GPU driver mappings
+};
+
+inline bool gpu_mapping(const std::string& path) {
+    return path.rfind("/dev/kgsl", 0) == 0 || path.rfind("/dev/mali", 0) == 0 ||
+           path.find("dmabuf") != std::string::npos;
+}
+
+// Reads every mapping once; on a loaded model this takes a few milliseconds
+inline SmapsTotals read_smaps(const std::string& model_dir) {
+    SmapsTotals totals;
+    std::ifstream in("/proc/self/smaps");
+    std::string line;
+    Mapping* current = nullptr;
+    while (std::getline(in, line)) {
+        // A mapping header starts with its address range, "7f12-7f34 r--p ..."
+        size_t dash = line.find('-');
+        size_t space = line.find(' ');
+        if (dash != std::string::npos && space != std::string::npos && dash < space &&
+            line.find(':') > space) {
+            current = nullptr;
+            size_t slash = line.find('/');
+            std::string path = slash != std::string::npos ? line.substr(slash) : "";
+            if (!model_dir.empty() && path.rfind(model_dir, 0) == 0) {
+                current = &totals.weights;
+            } else if (gpu_mapping(path)) {
+                current = &totals.gpu;
+            }
+            continue;
+        }
+        if (current == nullptr) {
+            continue;
+        }
+        unsigned long long kb = 0;
+        if (sscanf(line.c_str(), "Size: %llu kB", &kb) == 1) {
+            current->size += kb << 10;
+        } else if (sscanf(line.c_str(), "Rss: %llu kB", &kb) == 1) {
+            current->rss += kb << 10;
+        }
+    }
+    return totals;
+}
+
+// madvise(MADV_DONTNEED) every read-only mapping of a file under `dir`. Their
+// pages are clean, so they are dropped now and faulted back in from the file
+// when next touched; writable mappings are left alone. Returns the bytes advised.
+inline uint64_t drop_mapped_pages(const std::string& dir) {
+    if (dir.empty()) {
+        return 0;
+    }
+    std::ifstream in("/proc/self/maps");
+    std::string line;
+    uint64_t advised = 0;
+    while (std::getline(in, line)) {
+        unsigned long long start = 0, end = 0;
+        char perms[8] = {0};
+        size_t slash = line.find('/');
+        if (slash == std::string::npos || line.compare(slash, dir.size(), dir) != 0 ||
+            sscanf(line.c_str(), "%llx-%llx %7s", &start, &end, perms) != 3 || perms[1] == 'w') {
+            continue;
+        }
+        if (madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED) == 0) {
+            advised += end - start;
+        }
+    }
+    return advised;
+}
+
+// A "Key:  N kB" line of /proc/self/status, in bytes
+inline uint64_t status_bytes(const char* key) {
+    std::ifstream in("/proc/self/status");
+    std::string line;
+    size_t length = strlen(key);
+    while (std::getline(in, line)) {
+        if (line.compare(0, length, key) == 0 && line.size() > length && line[length] == ':') {
+            return strtoull(line.c_str() + length + 1, nullptr, 10) << 10;
+        }
+    }
+    return 0;
+}
+
+// Bytes held by the naive and pooled allocators of `device`; 0 for those never created
+inline uint64_t workspace_bytes(DLDevice device) {
+    using tvm::runtime::memory::MemoryManager;
+    uint64_t used = 0;
+    for (auto type : {tvm::runtime::memory::kNaive, tvm::runtime::memory::kPooled}) {
+        try {
+            used += MemoryManager::GetAllocator(device, type)->UsedMemory();
+        } catch (const std::exception&) {
+            // GetAllocator throws for an allocator nobody asked for yet
+        }
+    }
+    return used;
+}
+
+struct HeapTotals {
+    uint64_t allocated = 0;  // in use
+    uint64_t free = 0;       // held by the allocator, not in use
+};
+
+inline HeapTotals heap_totals() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();  // mallinfo's int fields are deprecated on glibc, and wrap past 2 GB
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    HeapTotals totals;
+    totals.allocated = static_cast<uint64_t>(info.uordblks);
+    totals.free = static_cast<uint64_t>(info.fordblks);
+    return totals;
+}
+
+class HighWater {
+public:
+    // Records `bytes` for `category` and returns the peak so far
+    uint64_t note(const std::string& category, uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t& peak = peaks_[category];
+        peak = std::max(peak, bytes);
+        return peak;
+    }
+
+    void reset() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            peaks_.clear();
+        }
+        // "5" resets VmHWM to the current RSS; not every kernel allows it
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5";
+    }
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, uint64_t> peaks_;
+};
+
+}  // namespace memory_stats
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * In-process sampling of the app's resource use, in place of polling
+ * dumpsys meminfo and top over adb.
+ *
+ * A thread of its own samples at the configured interval: RSS
+ * (/proc/self/statm), PSS with its anon, file and shmem parts
+ * (/proc/self/smaps_rollup), CPU per thread name (/proc/self/task/<tid>/stat,
+ * as the share of one core over the interval, busiest first), and from the
+ * engine the tokens per second emitted and the requests queued or running.
+ * Samples go into a ring buffer of the configured capacity and are exported
+ * as JSON lines, stamped with wall-clock ms (what logcat -v threadtime
+ * prints) and CLOCK_MONOTONIC ms (what the engine's traces use), so they
+ * line up with generation events without adb's latency in between.
+ */
+class MetricsSampler {
+public:
+    static constexpr int kMinIntervalMs = 100;
+    static constexpr size_t kMaxThreads = 8;  // busiest thread names kept per sample
+
+    // What the engine reports for a sample: tokens emitted since start, requests in flight
+    struct Probe {
+        uint64_t tokens = 0;
+        uint32_t queue = 0;
+    };
+
+    struct Sample {
+        int64_t wall_ms = 0;
+        int64_t monotonic_ms = 0;
+        uint64_t rss_kb = 0;
+        uint64_t pss_kb = 0;
+        uint64_t pss_anon_kb = 0;
+        uint64_t pss_file_kb = 0;
+        uint64_t pss_shmem_kb = 0;
+        float cpu_percent = 0.0f;  // the process, 100 per busy core
+        float tokens_per_s = 0.0f;
+        uint32_t queue = 0;
+        std::vector<std::pair<std::string, float>> threads;  // (name, cpu percent)
+    };
+
+    ~MetricsSampler() { stop(); }
+
+    // (Re)start sampling every `interval_ms` into the last `capacity` samples
+    void start(int interval_ms, size_t capacity, std::function<Probe()> probe) {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            interval_ms_ = std::max(kMinIntervalMs, interval_ms);
+            capacity_ = std::max<size_t>(1, capacity);
+            while (samples_.size() > capacity_) {
+                samples_.pop_front();
+            }
+            probe_ = std::move(probe);
+            stopping_ = false;
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    bool running() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return thread_.joinable() && !stopping_;
+    }
+
+    // Samples taken after `since_wall_ms` (0 for all), one JSON object per line
+    std::string to_json_lines(int64_t since_wall_ms = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out;
+        for (const Sample& sample : samples_) {
+            if (sample.wall_ms > since_wall_ms) {
+                out += to_json(sample);
+            }
+        }
+        return out;
+    }
+
+    bool export_to(const std::string& path) {
+        std::string lines = to_json_lines();
+        std::ofstream out(path, std::ios::trunc);
+        out << lines;
+        return out.good();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        samples_.clear();
+    }
+
+private:
+    std::mutex mutex_;  // guards everything below but thread_
+    std::condition_variable wake_;
+    std::thread thread_;
+    bool stopping_ = true;
+    int interval_ms_ = 1000;
+    size_t capacity_ = 3600;
+    std::function<Probe()> probe_;
+    std::deque<Sample> samples_;
+
+    // Sampling thread state
+    std::map<int, std::pair<std::string, uint64_t>> last_ticks_;  // tid -> (name, utime + stime)
+    uint64_t last_tokens_ = 0;
+    int64_t last_monotonic_ms_ = 0;
+
+    void run() {
+        pthread_setname_np(pthread_self(), "MlcMetrics");
+        std::unique_lock<std::mutex> lock(mutex_);
+        last_ticks_.clear();
+        last_monotonic_ms_ = 0;
+        while (!stopping_) {
+            std::function<Probe()> probe = probe_;
+            lock.unlock();
+            Sample sample = take(probe);
+            lock.lock();
+            if (sample.monotonic_ms > 0) {
+                samples_.push_back(std::move(sample));
+                while (samples_.size() > capacity_) {
+                    samples_.pop_front();
+                }
+            }
+            wake_.wait_for(lock, std::chrono::milliseconds(interval_ms_), [this] { return stopping_; });
+        }
+    }
+
+    static int64_t clock_ms(clockid_t clock) {
+        timespec ts{};
+        clock_gettime(clock, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // The first call only sets the baselines and returns monotonic_ms 0
+    Sample take(const std::function<Probe()>& probe) {
+        Sample sample;
+        int64_t now = clock_ms(CLOCK_MONOTONIC);
+        sample.wall_ms = clock_ms(CLOCK_REALTIME);
+        read_memory(&sample);
+        Probe probed = probe ? probe() : Probe();
+        sample.queue = probed.queue;
+
+        std::map<int, std::pair<std::string, uint64_t>> ticks = read_thread_ticks();
+        double elapsed_ms = static_cast<double>(now - last_monotonic_ms_);
+        bool baseline = last_monotonic_ms_ > 0 && elapsed_ms > 0.0;
+        if (baseline) {
+            double tick_ms = 1000.0 / static_cast<double>(sysconf(_SC_CLK_TCK));
+            std::map<std::string, float> by_name;
+            for (const auto& entry : ticks) {
+                auto last = last_ticks_.find(entry.first);
+                uint64_t before = last != last_ticks_.end() ? last->second.second : 0;
+                uint64_t delta = entry.second.second >= before ? entry.second.second - before : 0;
+                float percent = static_cast<float>(delta * tick_ms * 100.0 / elapsed_ms);
+                by_name[entry.second.first] += percent;
+                sample.cpu_percent += percent;
+            }
+            sample.threads.assign(by_name.begin(), by_name.end());
+            std::sort(sample.threads.begin(), sample.threads.end(),
+                      [](const auto& a, const auto& b) { return a.second > b.second; });
+            if (sample.threads.size() > kMaxThreads) {
+                sample.threads.resize(kMaxThreads);
+            }
+            uint64_t tokens = probed.tokens >= last_tokens_ ? probed.tokens - last_tokens_ : 0;
+            sample.tokens_per_s = static_cast<float>(tokens * 1000.0 / elapsed_ms);
+            sample.monotonic_ms = now;
+        }
+        last_ticks_ = std::move(ticks);
+        last_tokens_ = probed.tokens;
+        last_monotonic_ms_ = now;
+        return sample;
+    }
+
+    static void read_memory(Sample* sample) {
+        std::ifstream statm("/proc/self/statm");
+        uint64_t size = 0;
+        uint64_t resident = 0;
+        if (statm >> size >> resident) {
+            sample->rss_kb = resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) / 1024;
+        }
+        std::ifstream rollup("/proc/self/smaps_rollup");
+        std::string line;
+        while (std::getline(rollup, line)) {
+            uint64_t* field = nullptr;
+            if (line.rfind("Pss:", 0) == 0) {
+                field = &sample->pss_kb;
+            } else if (line.rfind("Pss_Anon:", 0) == 0) {
+                field = &sample->pss_anon_kb;
+            } else if (line.rfind("Pss_File:", 0) == 0) {
+                field = &sample->pss_file_kb;
+            } else if (line.rfind("Pss_Shmem:", 0) == 0) {
+                field = &sample->pss_shmem_kb;
+            }
+            if (field != nullptr) {
+                *field = std::strtoull(line.c_str() + line.find(':') + 1, nullptr, 10);
+            }
+        }
+    }
+
+    // tid -> (thread name, utime + stime in clock ticks)
+    static std::map<int, std::pair<std::string, uint64_t>> read_thread_ticks() {
+        std::map<int, std::pair<std::string, uint64_t>> ticks;
+        DIR* dir = opendir("/proc/self/task");
+        if (dir == nullptr) {
+            return ticks;
+        }
+        while (dirent* entry = readdir(dir)) {
+            int tid = std::atoi(entry->d_name);
+            if (tid <= 0) {
+                continue;
+            }
+            std::ifstream in(std::string("/proc/self/task/") + entry->d_name + "/stat");
+            std::string stat;
+            std::getline(in, stat);
+            // "tid (name) state ..."; the name may hold spaces and parentheses
+            size_t open = stat.find('(');
+            size_t close = stat.rfind(')');
+            if (open == std::string::npos || close == std::string::npos || close < open) {
+                continue;
+            }
+            std::string name = stat.substr(open + 1, close - open - 1);
+            // Fields after the name: state(3) ... utime(14) stime(15)
+            const char* p = stat.c_str() + close + 1;
+            uint64_t utime = 0;
+            uint64_t stime = 0;
+            int field = 2;
+            while (*p != '\0' && field < 15) {
+                while (*p == ' ') {
+                    p++;
+                }
+                field++;
+                if (field == 14) {
+                    utime = std::strtoull(p, nullptr, 10);
+                } else if (field == 15) {
+                    stime = std::strtoull(p, nullptr, 10);
+                }
+                while (*p != '\0' && *p != ' ') {
+                    p++;
+                }
+            }
+            ticks[tid] = {name, utime + stime};
+        }
+        closedir(dir);
+        return ticks;
+    }
+
+    static std::string json_escaped(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) >= 0x20) {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    static std::string to_json(const Sample& sample) {
+        char head[384];
+        snprintf(head, sizeof(head),
+                 "{\"t_ms\": %lld, \"monotonic_ms\": %lld, \"rss_kb\": %llu, \"pss_kb\": %llu, "
+                 "\"pss_anon_kb\": %llu, \"pss_file_kb\": %llu, \"pss_shmem_kb\": %llu, \"cpu_pct\": %.1f, "
+                 "\"tokens_per_s\": %.2f, \"queue\": %u, \"threads\": {",
+                 static_cast<long long>(sample.wall_ms), static_cast<long long>(sample.monotonic_ms),
+                 static_cast<unsigned long long>(sample.rss_kb), static_cast<unsigned long long>(sample.pss_kb),
+                 static_cast<unsigned long long>(sample.pss_anon_kb),
+                 static_cast<unsigned long long>(sample.pss_file_kb),
+                 static_cast<unsigned long long>(sample.pss_shmem_kb), sample.cpu_percent, sample.tokens_per_s,
+                 sample.queue);
+        std::string json = head;
+        for (size_t i = 0; i < sample.threads.size(); ++i) {
+            char value[32];
+            snprintf(value, sizeof(value), "%.1f", sample.threads[i].second);
+            json += (i == 0 ? "\"" : ", \"") + json_escaped(sample.threads[i].first) + "\": " + value;
+        }
+        json += "}}\n";
+        return json;
+    }
+};
@@ -0,0 +1,867 @@
+// micro_bench: per-call costs of the text path around the model, with no
+// model loaded: tokenizers, the sampler, incremental detokenization, the
+// token delivery structures, streamed Markdown block diffs, OCR text
+// normalization, camera frame preprocessing, quiz answer scoring, the engine
+// threads' small-block cache (engine_heap.h), the staged page pipeline
+// (stage_pipeline.h), offloaded KV packing and resume (kv_offload.h) and the
+// shared worker pool (shared_pool.h).
+//
+//   adb push micro_bench /data/local/tmp/
+//   adb shell /data/local/tmp/micro_bench [--tokenizer <tokenizer.model>]
+//       [--filter <substring>] [--min-time-ms N] [--prefill-tokens-per-s N]
+// or ./micro_bench on a host build (CMakeLists.txt, the host branch).
+//
+// Inputs model the prompts the app sends: OCR'd textbook pages (about 2 KB,
+// line-broken, hyphenated, with digits, formulas and some OCR noise) and a
+// chapter of 16 of them. The SentencePiece cases need --tokenizer and are
+// skipped without it. --prefill-tokens-per-s, the rate getMetrics reports on
+// the device, adds a line comparing a KV resume against prefilling again.
+// The per-token JNI crossing (NewStringUTF + a callback
+// vs the token ring) needs a VM and runs in the app instead:
+// MlcLlmBridge.benchmarkTokenDelivery.
+//
+// Each case runs in batches that grow until one takes --min-time-ms (default
+// 250), like Google Benchmark, and prints one JSON object per line on stdout:
+//   {"name": "...", "iterations": N, "ns_per_op": x, "items_per_s": x, "bytes_per_s": x}
+// items are tokens (or tokens sampled) and bytes are UTF-8 text bytes; either
+// is 0 where it does not apply.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "answer_grading.h"
+#include "engine_heap.h"
+#include "image_preprocess.h"
+#include "kv_offload.h"
+#include "logit_sampler.h"
+#include "markdown_blocks.h"
+#include "ocr_text.h"
+#include "shared_pool.h"
+#include "simple_tokenizer.h"
+#include "sp_tokenizer.h"
+#include "stage_pipeline.h"
+#include "stream_frames.h"
+#include "token_ring.h"
+#include "utf8_stream.h"
+
+namespace {
+
+struct Options {
+    std::string tokenizer_path;
+    std::string filter;
+    double min_time_ms = 250.0;
+    double prefill_tokens_per_s = 0.0;
+};
+
+void usage() {
+    fprintf(stderr, "usage: micro_bench [--tokenizer tokenizer.model] [--filter SUBSTRING] [--min-time-ms N]\n"
+                    "                   [--prefill-tokens-per-s N]\n");
+}
+
+bool parse_options(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (value == nullptr) {
+            return false;
+        }
+        if (strcmp(arg, "--tokenizer") == 0) {
+            options->tokenizer_path = value;
+        } else if (strcmp(arg, "--filter") == 0) {
+            options->filter = value;
+        } else if (strcmp(arg, "--min-time-ms") == 0) {
+            options->min_time_ms = std::max(1.0, atof(value));
+        } else if (strcmp(arg, "--prefill-tokens-per-s") == 0) {
+            options->prefill_tokens_per_s = std::max(0.0, atof(value));
+        } else {
+            return false;
+        }
+        ++i;
+    }
+    return true;
+}
+
+// Keeps the compiler from dropping a result nobody reads
+template <typename T>
+inline void keep(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class Runner {
+public:
+    explicit Runner(const Options& options) : options_(options) {}
+
+    // `body(n)` runs the operation n times; `items` and `bytes` are per operation.
+    // Returns ns per operation, 0 if the filter skipped it.
+    template <typename Body>
+    double run(const std::string& name, double items, double bytes, Body&& body) {
+        if (!options_.filter.empty() && name.find(options_.filter) == std::string::npos) {
+            return 0.0;
+        }
+        body(1);  // warm caches and lazily built tables
+        uint64_t n = 1;
+        double ns = 0.0;
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            body(n);
+            ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (ns >= options_.min_time_ms * 1e6 || n >= (1ull << 40)) {
+                break;
+            }
+            // Aim 40% past the target so the last batch rarely falls short
+            double scale = ns > 0.0 ? options_.min_time_ms * 1e6 * 1.4 / ns : 100.0;
+            n = std::max<uint64_t>(n + 1, static_cast<uint64_t>(n * std::min(scale, 100.0)));
+        }
+        double per_op = ns / static_cast<double>(n);
+        printf("{\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f, \"items_per_s\": %.0f, "
+               "\"bytes_per_s\": %.0f}\n",
+               name.c_str(), static_cast<unsigned long long>(n), per_op, items * 1e9 / per_op,
+               bytes * 1e9 / per_op);
+        fflush(stdout);
+        return per_op;
+    }
+
+private:
+    const Options& options_;
+};
+
+// A synthetic OCR'd textbook page: prose with hard line breaks, words split by
+// end-of-line hyphens, numbers, a formula or two and stray OCR characters
+std::string ocr_page(uint32_t seed) {
+    static const char* kWords[] = {
+        "the", "cell", "membrane", "regulates", "which", "molecules", "enter", "and", "leave", "energy",
+        "photosynthesis", "chloroplast", "light", "reaction", "produces", "glucose", "oxygen", "water", "in",
+        "of", "a", "is", "to", "by", "equation", "velocity", "acceleration", "force", "mass", "newton",
+        "second", "law", "states", "that", "proportional", "figure", "table", "chapter", "example",
+        "therefore", "mitochondria", "respiration", "temperature", "pressure", "volume", "ideal", "gas",
+        "constant", "derivative", "function", "integral", "limit", "approaches", "infinity", "theorem",
+        "proof", "students", "should", "notice", "carefully", "résumé", "naïve", "café"};
+    static const char* kInserts[] = {"F = ma", "PV = nRT", "6CO₂ + 6H₂O → C₆H₁₂O₆ + 6O₂", "∫ f(x) dx",
+                                      "x² + y² = r²", "(see Fig. 3.2)", "Δt", "≈ 9.81 m/s²", "§ 4.1"};
+    static const char* kNoise[] = {"|", "~", "»", "·", "l", "0"};
+    std::mt19937 rng(seed);
+    std::string page;
+    page.reserve(2400);
+    size_t line = 0;
+    bool sentence_start = true;
+    while (page.size() < 2048) {
+        std::string word;
+        uint32_t pick = rng() % 100;
+        if (pick < 3) {
+            word = kInserts[rng() % (sizeof(kInserts) / sizeof(kInserts[0]))];
+        } else if (pick < 5) {
+            word = std::to_string(rng() % 2000);
+        } else {
+            word = kWords[rng() % (sizeof(kWords) / sizeof(kWords[0]))];
+            if (sentence_start) {
+                word[0] = static_cast<char>(std::toupper(static_cast<unsigned char>(word[0])));
+            }
+        }
+        if (rng() % 60 == 0) {
+            word += kNoise[rng() % (sizeof(kNoise) / sizeof(kNoise[0]))];
+        }
+        sentence_start = false;
+        if (rng() % 12 == 0) {
+            word += rng() % 3 == 0 ? "," : ".";
+            sentence_start = word.back() == '.';
+        }
+        if (line + word.size() > 72) {
+            if (word.size() > 6 && rng() % 2 == 0) {
+                size_t cut = word.size() / 2;
+                page += word.substr(0, cut) + "-\n";
+                word = word.substr(cut);
+            } else {
+                page += '\n';
+            }
+            line = 0;
+        } else if (line > 0) {
+            page += ' ';
+            line++;
+        }
+        page += word;
+        line += word.size();
+    }
+    page += '\n';
+    return page;
+}
+
+std::vector<std::string> split_pieces(const std::string& text) {
+    // Word-ish pieces of 1-6 bytes cut at UTF-8 boundaries, the shape of a decode stream
+    std::vector<std::string> pieces;
+    std::mt19937 rng(7);
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t len = std::min<size_t>(1 + rng() % 6, text.size() - pos);
+        size_t end = utf8_boundary_at_or_after(text, pos + len);
+        pieces.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+    return pieces;
+}
+
+size_t total_bytes(const std::vector<std::string>& pieces) {
+    size_t bytes = 0;
+    for (const std::string& piece : pieces) {
+        bytes += piece.size();
+    }
+    return bytes;
+}
+
+// Logits shaped like a decode step: a long low tail and a handful of likely tokens
+std::vector<float> decode_logits(size_t vocab, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> tail(-2.0f, 1.5f);
+    std::vector<float> logits(vocab);
+    for (float& logit : logits) {
+        logit = tail(rng);
+    }
+    for (int i = 0; i < 32; ++i) {
+        logits[rng() % vocab] = 8.0f + static_cast<float>(rng() % 600) / 100.0f;
+    }
+    return logits;
+}
+
+void bench_simple_tokenizer(Runner& runner, const std::string& page, const std::string& chapter) {
+    static SimpleTokenizer tokenizer;
+    std::vector<int> page_ids = tokenizer.tokenize(page);
+    std::vector<int> chapter_ids = tokenizer.tokenize(chapter);
+    runner.run("simple_tokenizer/tokenize/page", page_ids.size(), page.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.tokenize(page).size());
+        }
+    });
+    runner.run("simple_tokenizer/tokenize/chapter", chapter_ids.size(), chapter.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.tokenize(chapter).size());
+        }
+    });
+    runner.run("simple_tokenizer/detokenize/page", page_ids.size(), 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.detokenize(page_ids).size());
+        }
+    });
+}
+
+void bench_sp_tokenizer(Runner& runner, const Options& options, const std::string& page,
+                        const std::string& chapter) {
+    if (options.tokenizer_path.empty()) {
+        fprintf(stderr, "micro_bench: no --tokenizer, skipping the SentencePiece cases\n");
+        return;
+    }
+    static SpTokenizer tokenizer;
+    if (!tokenizer.load(options.tokenizer_path)) {
+        fprintf(stderr, "micro_bench: could not load %s\n", options.tokenizer_path.c_str());
+        return;
+    }
+    // Parsing the ModelProto every time against mapping the flat image the first load left
+    runner.run("sp_tokenizer/load/proto", tokenizer.vocab_size(), 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            SpTokenizer fresh;
+            keep(fresh.load(options.tokenizer_path, false));
+        }
+    });
+    runner.run("sp_tokenizer/load/flat", tokenizer.vocab_size(), 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            SpTokenizer fresh;
+            keep(fresh.load(options.tokenizer_path));
+        }
+    });
+    // Tokenizing from scratch every time, but for the case that measures the memo
+    tokenizer.memo().set_max_bytes(0);
+    std::vector<int> page_ids = tokenizer.encode(page);
+    std::vector<int> chapter_ids = tokenizer.encode(chapter);
+    runner.run("sp_tokenizer/encode/page", page_ids.size(), page.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.encode(page).size());
+        }
+    });
+    tokenizer.memo().set_max_bytes(TokenMemo::kDefaultMaxBytes);
+    runner.run("sp_tokenizer/encode/page_memoized", page_ids.size(), page.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.encode(page).size());
+        }
+    });
+    tokenizer.memo().set_max_bytes(0);
+    runner.run("sp_tokenizer/encode/chapter", chapter_ids.size(), chapter.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.encode(chapter).size());
+        }
+    });
+    // One long document cut at safe segment boundaries, a slice per pool thread
+    size_t workers = static_cast<size_t>(shared_pool::pool().concurrency());
+    runner.run("sp_tokenizer/encode_parallel/chapter", chapter_ids.size(), chapter.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.encode_parallel(chapter, workers).size());
+        }
+    });
+    runner.run("sp_tokenizer/count/chapter", chapter_ids.size(), chapter.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.count(chapter));
+        }
+    });
+    runner.run("sp_tokenizer/decode/page", page_ids.size(), page.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tokenizer.decode(page_ids).size());
+        }
+    });
+    // One push per generated token, as the engine streams
+    runner.run("sp_stream_decoder/push/page", page_ids.size(), page.size(), [&](uint64_t n) {
+        SpStreamDecoder decoder(tokenizer);
+        for (uint64_t i = 0; i < n; ++i) {
+            decoder.reset();
+            size_t bytes = 0;
+            for (int id : page_ids) {
+                bytes += decoder.push(id).size();
+            }
+            keep(bytes + decoder.flush().size());
+        }
+    });
+}
+
+void bench_sampler(Runner& runner) {
+    static constexpr size_t kVocab = 256000;
+    std::vector<float> logits = decode_logits(kVocab, 11);
+    std::vector<int> history;
+    std::mt19937 rng(13);
+    for (int i = 0; i < 512; ++i) {
+        history.push_back(static_cast<int>(rng() % kVocab));
+    }
+    LogitSampler sampler;
+    sampler.seed(17);
+    sampler.configure(0.0f, 1.0f, 1.0f);
+    runner.run("sampler/greedy/256k", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(sampler.sample(logits.data(), kVocab, nullptr, 0));
+        }
+    });
+    sampler.configure(0.8f, 0.95f, 1.0f);
+    runner.run("sampler/top_p/256k", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(sampler.sample(logits.data(), kVocab, nullptr, 0));
+        }
+    });
+    sampler.configure(0.8f, 0.95f, 1.1f);
+    runner.run("sampler/top_p_penalty512/256k", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(sampler.sample(logits.data(), kVocab, history.data(), history.size()));
+        }
+    });
+    // A grammar step mid-string: most words whole, some blocked, some mixed
+    std::vector<uint64_t> mask((kVocab + 63) / 64);
+    for (uint64_t& word : mask) {
+        uint32_t pick = rng() % 4;
+        word = pick == 0 ? 0 : pick == 3 ? (static_cast<uint64_t>(rng()) << 32 | rng()) : ~0ull;
+    }
+    sampler.configure(0.0f, 1.0f, 1.0f);
+    runner.run("sampler/greedy_masked/256k", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(sampler.sample_masked(logits.data(), kVocab, mask.data(), mask.size(), nullptr, 0));
+        }
+    });
+    sampler.configure(0.8f, 0.95f, 1.0f);
+    runner.run("sampler/top_p_masked/256k", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(sampler.sample_masked(logits.data(), kVocab, mask.data(), mask.size(), nullptr, 0));
+        }
+    });
+}
+
+// A 720p YUV_420_888 frame as CameraX hands it over (interleaved chroma, padded
+// rows) to the classifier's 224x224 float input and to a half-size NV21 for OCR,
+// and the frame's perceptual hash
+void bench_image_preprocess(Runner& runner) {
+    static constexpr int kWidth = 1280;
+    static constexpr int kHeight = 720;
+    static constexpr int kStride = 1344;
+    std::mt19937 rng(19);
+    std::vector<uint8_t> luma(static_cast<size_t>(kStride) * kHeight);
+    std::vector<uint8_t> chroma(static_cast<size_t>(kStride) * kHeight / 2);
+    for (uint8_t& b : luma) {
+        b = static_cast<uint8_t>(rng());
+    }
+    for (uint8_t& b : chroma) {
+        b = static_cast<uint8_t>(rng());
+    }
+    image_preprocess::YuvImage frame;
+    frame.y = luma.data();
+    frame.u = chroma.data();
+    frame.v = chroma.data() + 1;
+    frame.y_size = luma.size();
+    frame.u_size = chroma.size() - 1;
+    frame.v_size = chroma.size() - 1;
+    frame.width = kWidth;
+    frame.height = kHeight;
+    frame.y_row_stride = kStride;
+    frame.uv_row_stride = kStride;
+    frame.uv_pixel_stride = 2;
+
+    image_preprocess::Options classify;
+    classify.crop_x = (kWidth - kHeight) / 2;
+    classify.crop_width = kHeight;
+    classify.rotation = 90;
+    classify.width = 224;
+    classify.height = 224;
+    classify.format = image_preprocess::kFormatFloatRgb;
+    std::vector<uint8_t> input(image_preprocess::output_bytes(classify));
+    runner.run("image/classifier_224_float/720p", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(image_preprocess::preprocess(frame, classify, input.data(), input.size()));
+        }
+    });
+
+    image_preprocess::Options ocr;
+    ocr.width = kWidth / 2;
+    ocr.height = kHeight / 2;
+    ocr.format = image_preprocess::kFormatNv21;
+    std::vector<uint8_t> nv21(image_preprocess::output_bytes(ocr));
+    runner.run("image/ocr_nv21_half/720p", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(image_preprocess::preprocess(frame, ocr, nv21.data(), nv21.size()));
+        }
+    });
+
+    image_preprocess::Options whole;
+    image_preprocess::FrameHash hash;
+    runner.run("image/frame_hash/720p", 1, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(image_preprocess::frame_hash(frame, whole, &hash));
+        }
+    });
+}
+
+// The chapter as ML Kit would hand it over: each page under a running header
+// and over its page number
+void bench_ocr_text(Runner& runner) {
+    std::vector<std::string> pages;
+    for (uint32_t i = 0; i < 16; ++i) {
+        pages.push_back("BIOLOGY  Chapter 4: The Cell\n" + ocr_page(100 + i) + "\n- " + std::to_string(41 + i) + " -");
+    }
+    size_t bytes = total_bytes(pages);
+    runner.run("ocr_text/normalize/chapter", 0, bytes, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(ocr_text::normalize_pages(pages, nullptr).size());
+        }
+    });
+}
+
+void bench_detokenizer(Runner& runner, const std::vector<std::string>& pieces) {
+    size_t bytes = total_bytes(pieces);
+    // Pieces are split into raw bytes first so multi-byte characters straddle pushes
+    std::vector<std::string> byte_pieces;
+    for (const std::string& piece : pieces) {
+        for (char c : piece) {
+            byte_pieces.emplace_back(1, c);
+        }
+    }
+    runner.run("utf8_stream_buffer/push/page_pieces", pieces.size(), bytes, [&](uint64_t n) {
+        Utf8StreamBuffer buffer;
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t out = 0;
+            for (const std::string& piece : pieces) {
+                out += buffer.push(piece).size();
+            }
+            keep(out + buffer.flush().size());
+        }
+    });
+    runner.run("utf8_stream_buffer/push/page_bytes", byte_pieces.size(), bytes, [&](uint64_t n) {
+        Utf8StreamBuffer buffer;
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t out = 0;
+            for (const std::string& piece : byte_pieces) {
+                out += buffer.push(piece).size();
+            }
+            keep(out + buffer.flush().size());
+        }
+    });
+}
+
+void bench_delivery(Runner& runner, const std::string& page, const std::vector<std::string>& pieces) {
+    size_t bytes = total_bytes(pieces);
+    runner.run("utf8_to_utf16/page", 0, page.size(), [&](uint64_t n) {
+        std::u16string out;
+        for (uint64_t i = 0; i < n; ++i) {
+            utf8_to_utf16(page, out);
+            keep(out.size());
+        }
+    });
+    runner.run("stream_frames/delta/page_pieces", pieces.size(), bytes, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t out = 0;
+            for (const std::string& piece : pieces) {
+                out += stream_frames::delta(piece, 1).size();
+            }
+            keep(out);
+        }
+    });
+
+    // The producer side of a stream with a consumer draining as Kotlin does:
+    // park in await(), then take everything that is there
+    runner.run("token_ring/push_drain/page_pieces", pieces.size(), bytes, [&](uint64_t n) {
+        TokenRing ring(64 * 1024);
+        ring.reset();
+        std::thread consumer([&ring] {
+            while (true) {
+                int available = ring.await(100);
+                if (available < 0) {
+                    break;
+                }
+                ring.consume(static_cast<uint32_t>(available));
+            }
+        });
+        for (uint64_t i = 0; i < n; ++i) {
+            for (const std::string& piece : pieces) {
+                ring.push(piece);
+            }
+        }
+        ring.finish(false);
+        consumer.join();
+    });
+}
+
+// Scoring a 20-question quiz once its 80 texts are embedded: the part of
+// gradeAnswers that runs instead of a generation per answer
+void bench_answer_grading(Runner& runner) {
+    static constexpr size_t kQuestions = 20;
+    static constexpr size_t kReferences = 3;
+    static constexpr size_t kDim = 2304;  // Gemma-2 2B hidden size
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal;
+    auto unit_rows = [&](size_t count) {
+        std::vector<float> rows(count * kDim);
+        for (size_t r = 0; r < count; ++r) {
+            float sum = 0.0f;
+            for (size_t i = 0; i < kDim; ++i) {
+                rows[r * kDim + i] = normal(rng);
+                sum += rows[r * kDim + i] * rows[r * kDim + i];
+            }
+            for (size_t i = 0; i < kDim; ++i) {
+                rows[r * kDim + i] /= std::sqrt(sum);
+            }
+        }
+        return rows;
+    };
+    std::vector<float> answers = unit_rows(kQuestions);
+    std::vector<float> references = unit_rows(kQuestions * kReferences);
+    std::vector<size_t> first;
+    std::vector<float> recall;
+    for (size_t q = 0; q <= kQuestions; ++q) {
+        first.push_back(q * kReferences);
+    }
+    for (size_t r = 0; r < kQuestions * kReferences; ++r) {
+        recall.push_back(static_cast<float>(r % 5) / 4.0f);
+    }
+    std::vector<bool> blank(kQuestions, false);
+    answer_grading::Settings settings;
+    runner.run("answer_grading/grade/quiz20", kQuestions, 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(answer_grading::grade(answers.data(), references.data(), first, kDim, recall, blank, settings)
+                         .front()
+                         .score);
+        }
+    });
+}
+
+// The small allocations of a decode step (a token list grown one id at a time,
+// the piece string, a boxed callback) on a thread that goes straight to malloc
+// and on one with an engine_heap cache
+void bench_engine_heap(Runner& runner, const std::vector<std::string>& pieces) {
+    auto step = [&pieces](uint64_t n) {
+        size_t out = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            std::vector<int> ids;
+            for (size_t t = 0; t < pieces.size(); ++t) {
+                ids.push_back(static_cast<int>(t));
+                std::string piece = pieces[t] + " ";
+                std::function<size_t()> emit = [piece, &ids] { return piece.size() + ids.size(); };
+                out += emit();
+            }
+        }
+        keep(out);
+    };
+    for (bool cached : {false, true}) {
+        runner.run(cached ? "engine_heap/decode_allocs/thread_cache" : "engine_heap/decode_allocs/malloc",
+                   pieces.size(), 0, [&](uint64_t n) {
+                       std::thread thread([&] {
+                           if (cached) {
+                               engine_heap::attach_thread();
+                           }
+                           step(n);
+                       });
+                       thread.join();
+                   });
+    }
+}
+
+
+// A streamed worked solution's block structure kept up to date per token, and
+// re-derived from the whole answer per token as a view re-parsing it would
+void bench_markdown_blocks(Runner& runner) {
+    std::string answer;
+    for (int step = 1; step <= 24; ++step) {
+        std::string n = std::to_string(step);
+        answer += "## Step " + n + "\n\nSubtract " + n + " from both sides of 3x + 7 = 22:\n$$\n3x + 7 - " + n +
+                  " = 22 - " + n + "\n$$\n\n1. Simplify the left side\n2. Then divide by $3$\n\n```\nx = (22 - 7) / 3\n```\n\n";
+    }
+    std::vector<std::string> pieces;
+    for (size_t i = 0; i < answer.size(); i += 4) {
+        pieces.push_back(answer.substr(i, 4));
+    }
+    runner.run("markdown_blocks/answer/incremental", pieces.size(), answer.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            markdown_blocks::Tracker tracker;
+            std::vector<markdown_blocks::Change> changes;
+            for (const std::string& piece : pieces) {
+                changes.clear();
+                tracker.append(piece, &changes);
+            }
+            keep(tracker.size());
+        }
+    });
+    runner.run("markdown_blocks/answer/full_reparse", pieces.size(), answer.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            std::string text;
+            size_t blocks = 0;
+            for (const std::string& piece : pieces) {
+                text += piece;
+                markdown_blocks::Tracker tracker;
+                std::vector<markdown_blocks::Change> changes;
+                tracker.append(text, &changes);
+                blocks += tracker.size();
+            }
+            keep(blocks);
+        }
+    });
+}
+
+// A chapter's pages through normalize -> retrieve -> generate one after another
+// and in a stage_pipeline, where it takes about as long as the slowest stage.
+// Normalization is the real one; retrieve stands in as a spin and generate,
+// which mostly waits on the GPU, as a sleep.
+void bench_stage_pipeline(Runner& runner) {
+    std::vector<std::string> pages;
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < 16; ++i) {
+        pages.push_back(ocr_page(200 + i));
+        bytes += pages.back().size();
+    }
+    auto spin = [](std::chrono::microseconds length) {
+        auto until = std::chrono::steady_clock::now() + length;
+        while (std::chrono::steady_clock::now() < until) {
+        }
+    };
+    auto normalize = [](std::string& text) { text = ocr_text::normalize(text, nullptr); };
+    auto retrieve = [&spin](std::string& text) {
+        spin(std::chrono::microseconds(150));
+        text += " ";
+    };
+    auto generate = [](std::string& text) {
+        std::this_thread::sleep_for(std::chrono::microseconds(400));
+        keep(text.size());
+    };
+    runner.run("stage_pipeline/chapter/sequential", pages.size(), bytes, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            for (const std::string& page : pages) {
+                std::string text = page;
+                normalize(text);
+                retrieve(text);
+                generate(text);
+            }
+        }
+    });
+    runner.run("stage_pipeline/chapter/pipelined", pages.size(), bytes, [&](uint64_t n) {
+        using Pipeline = stage_pipeline::StagePipeline<std::string>;
+        std::vector<Pipeline::Stage> stages;
+        stages.push_back({"normalize", 1, [&](std::string& text, const Pipeline::Cancelled&) {
+                              normalize(text);
+                              return true;
+                          }});
+        stages.push_back({"retrieve", 1, [&](std::string& text, const Pipeline::Cancelled&) {
+                              retrieve(text);
+                              return true;
+                          }});
+        stages.push_back({"generate", 1, [&](std::string& text, const Pipeline::Cancelled&) {
+                              generate(text);
+                              return true;
+                          }});
+        Pipeline pipeline(std::move(stages), Pipeline::Options());
+        for (uint64_t i = 0; i < n; ++i) {
+            for (const std::string& page : pages) {
+                pipeline.push(page);
+            }
+        }
+        pipeline.close();
+    });
+}
+
+// One fork-join of small chunks (64 KB of floats summed each), as the
+// tokenizer, shard decode and embedding paths issue them: on the shared pool,
+// whose workers are already up, and on threads started for the call as
+// those paths did before.
+void bench_shared_pool(Runner& runner) {
+    static constexpr int64_t kChunks = 64;
+    static constexpr size_t kChunkFloats = 16 << 10;
+    std::vector<float> data(kChunks * kChunkFloats, 1.0f);
+    std::vector<float> sums(kChunks);
+    auto sum = [&](int64_t chunk) {
+        const float* begin = data.data() + chunk * kChunkFloats;
+        sums[chunk] = std::accumulate(begin, begin + kChunkFloats, 0.0f);
+    };
+    const size_t bytes = data.size() * sizeof(float);
+    runner.run("shared_pool/fork_join/pool", kChunks, bytes, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            shared_pool::pool().parallel_for(0, kChunks, sum);
+            keep(sums[0]);
+        }
+    });
+    runner.run("shared_pool/fork_join/spawned_threads", kChunks, bytes, [&](uint64_t n) {
+        unsigned int workers = std::max(1u, std::thread::hardware_concurrency());
+        for (uint64_t i = 0; i < n; ++i) {
+            std::atomic<int64_t> next{0};
+            auto work = [&] {
+                for (int64_t chunk; (chunk = next.fetch_add(1)) < kChunks;) {
+                    sum(chunk);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (unsigned int w = 1; w < workers; ++w) {
+                threads.emplace_back(work);
+            }
+            work();
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            keep(sums[0]);
+        }
+    });
+}
+
+}  // namespace
+
+// 8 MB of fp16 KV packed for the offload store, with the byte planes split
+// as kv_offload does and deflated as they are, and unpacked again. Values
+// are normal around 0, roughly what K and V activations look like.
+void bench_kv_offload(Runner& runner, const Options& options) {
+    std::mt19937 rng(11);
+    std::normal_distribution<float> value(0.0f, 1.0f);
+    std::vector<uint8_t> kv(8u << 20);
+    for (size_t i = 0; i + 1 < kv.size(); i += 2) {
+        float f = value(rng);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        // fp32 -> fp16 by truncation: sign, rebiased exponent, top 10 mantissa bits
+        int exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+        uint16_t half = static_cast<uint16_t>((bits >> 16) & 0x8000);
+        if (exponent > 0 && exponent < 31) {
+            half |= static_cast<uint16_t>((exponent << 10) | ((bits >> 13) & 0x3ff));
+        }
+        kv[i] = static_cast<uint8_t>(half & 0xff);
+        kv[i + 1] = static_cast<uint8_t>(half >> 8);
+    }
+    std::vector<uint8_t> packed;
+    kv_offload::pack(kv.data(), kv.size(), &packed);
+    runner.run("kv_offload/fp16/pack_planes", 1, kv.size(), [&](uint64_t n) {
+        std::vector<uint8_t> out;
+        for (uint64_t i = 0; i < n; ++i) {
+            kv_offload::pack(kv.data(), kv.size(), &out);
+            keep(out.size());
+        }
+    });
+    runner.run("kv_offload/fp16/pack_interleaved", 1, kv.size(), [&](uint64_t n) {
+        std::vector<uint8_t> out(compressBound(kv_offload::kBlockBytes));
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t total = 0;
+            for (size_t offset = 0; offset < kv.size(); offset += kv_offload::kBlockBytes) {
+                uLongf size = out.size();
+                compress2(out.data(), &size, kv.data() + offset, kv_offload::kBlockBytes, Z_BEST_SPEED);
+                total += size;
+            }
+            keep(total);
+        }
+    });
+    runner.run("kv_offload/fp16/unpack", 1, kv.size(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t total = 0;
+            kv_offload::unpack(packed.data(), packed.size(), [&](const uint8_t*, size_t size) {
+                total += size;
+                return true;
+            });
+            keep(total);
+        }
+    });
+
+    // A resume from the memory tier: stage() unpacking into a memfd, then
+    // load_kv reading it back through its path. Items are tokens of KV at
+    // Gemma 2 2B's shape: 26 layers of K and V over 4 fp16 heads of 256.
+    const double tokens = static_cast<double>(kv.size()) / (26 * 2 * 4 * 256 * 2);
+    double resume_ns = runner.run("kv_offload/fp16/resume_memory", tokens, kv.size(), [&](uint64_t n) {
+        std::vector<uint8_t> buffer(kv_offload::kBlockBytes);
+        for (uint64_t i = 0; i < n; ++i) {
+            int fd = kv_offload::unpack_buffer(packed, kv.size());
+            FILE* file = fd >= 0 ? fopen(kv_offload::buffer_path(fd).c_str(), "rb") : nullptr;
+            size_t total = 0;
+            if (file != nullptr) {
+                size_t read;
+                while ((read = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+                    total += read;
+                }
+                fclose(file);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            keep(total);
+        }
+    });
+    // Against prefilling those tokens again at the device's measured rate
+    if (resume_ns > 0.0 && options.prefill_tokens_per_s > 0.0) {
+        double prefill_ns = tokens * 1e9 / options.prefill_tokens_per_s;
+        printf("{\"name\": \"kv_offload/fp16/resume_vs_prefill\", \"tokens\": %.0f, \"resume_ms\": %.2f, "
+               "\"prefill_ms\": %.2f, \"speedup\": %.1f}\n",
+               tokens, resume_ns / 1e6, prefill_ns / 1e6, prefill_ns / resume_ns);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_options(argc, argv, &options)) {
+        usage();
+        return 2;
+    }
+
+    std::string page = ocr_page(1);
+    std::string chapter;
+    for (uint32_t i = 0; i < 16; ++i) {
+        chapter += ocr_page(100 + i);
+    }
+    std::vector<std::string> pieces = split_pieces(page);
+
+    Runner runner(options);
+    bench_simple_tokenizer(runner, page, chapter);
+    bench_sp_tokenizer(runner, options, page, chapter);
+    bench_sampler(runner);
+    bench_detokenizer(runner, pieces);
+    bench_delivery(runner, page, pieces);
+    bench_ocr_text(runner);
+    bench_image_preprocess(runner);
+    bench_answer_grading(runner);
+    bench_engine_heap(runner, pieces);
+    bench_markdown_blocks(runner);
+    bench_stage_pipeline(runner);
+    bench_kv_offload(runner, options);
+    bench_shared_pool(runner);
+    return 0;
+}
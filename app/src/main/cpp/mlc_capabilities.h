@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+// Optional capabilities a loaded chat module may provide. The engines resolve
+// every entry point once at load time and report the found set as a bitmask so
+// callers can pick the fastest available path.
+enum MlcCapability : uint32_t {
+    kMlcCapStreaming    = 1u << 0,  // token callback streaming (stream_chat)
+    kMlcCapAbort        = 1u << 1,  // abort an in-flight generation
+    kMlcCapBatch        = 1u << 2,  // batched generation over several prompts
+    kMlcCapPrefixCache  = 1u << 3,  // KV snapshot/restore (snapshot_kv / restore_kv)
+    kMlcCapSystemPrompt = 1u << 4,  // explicit system prompt prefill
+    kMlcCapSpeculative  = 1u << 5,  // draft model loaded and verify_draft available
+    kMlcCapAdapters     = 1u << 6,  // per-subject adapter switching (set_adapter)
+    kMlcCapNativeSampling = 1u << 7,  // logits entry points; tokens picked by LogitSampler
+    kMlcCapDeviceSampling = 1u << 8,  // sample_on_device: logits stay on the GPU
+    kMlcCapPagedKv      = 1u << 9,  // fork_kv / rollback_turns over copy-on-write KV pages
+    kMlcCapKvPersist    = 1u << 10,  // save_kv / load_kv: snapshot slots to and from files
+    kMlcCapKvQuant      = 1u << 11,  // KV cache stored in 8 bits (kv_cache_dtype), dequantized in attention
+    kMlcCapSlidingWindow = 1u << 12,  // shift_turns: drop the oldest turns in place, keeping sinks
+    kMlcCapChunkedPrefill = 1u << 13,  // prefill_begin / prefill_step: prefill in bounded chunks
+    kMlcCapDraftPrefill = 1u << 14,  // draft_append / draft_truncate: prefill the next turn while it is typed
+    kMlcCapBatchedDecode = 1u << 15,  // batch_prefill / batch_decode: continuous batching of requests
+    kMlcCapBatchFork = 1u << 16,      // batch_prefix / batch_fork / batch_finish: shared-prefix batches
+    kMlcCapGrammar = 1u << 17,        // native sampling can hold output to a JSON schema (jsonSchema)
+    kMlcCapPromptLookup = 1u << 18,   // verify_draft without a draft: speculation from prompt n-grams
+    kMlcCapPhaseDevices = 1u << 19,   // set_phase_device: prefill and decode on different devices
+    kMlcCapKernelTuning = 1u << 20,   // kernel_variants / select_kernel_variant: idle-time kernel tuning
+    kMlcCapKernelCache = 1u << 21,    // get/set_kernel_binaries: compiled GPU kernels kept across launches
+    kMlcCapKernelProfile = 1u << 22,  // profile_step: per-kernel reports from the Relax VM profiler
+    kMlcCapTokenIo = 1u << 23,        // prefill_token_ids: turns in and out as token ids (prefillTokens)
+    kMlcCapEmbedding = 1u << 24,      // an embedding model next to the chat model (embedText)
+    kMlcCapBatchAdapters = 1u << 25,  // batch_set_adapter: one batched decode step mixes LoRA adapters
+    kMlcCapHiddenStates = 1u << 26,   // hidden_states: embedTexts with the chat model (mean-pooled)
+    kMlcCapTemplateIds = 1u << 27,    // prefill_turn_ids: turns templated natively from pre-tokenized pieces
+    kMlcCapShortlist = 1u << 28,      // decode_logits_shortlist: constrained steps compute only the allowed logits
+    kMlcCapDecodeGraph = 1u << 29,    // decode_graph: GPU decode steps recorded once and replayed
+    kMlcCapSelfSpeculative = 1u << 30,  // self_draft: the target drafts with its own early layers
+    kMlcCapHeavyHitter = 1u << 31,    // kv_attention_mass / evict_tokens: evict least-attended tokens
+};
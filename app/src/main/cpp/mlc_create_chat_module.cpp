@@ -1,19 +1,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <android/log.h>
 #include <dlfcn.h>
 
-#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "MLC_CHAT_MODULE", __VA_ARGS__))
-#define LOGE(...) ((void)__android_log_print(ANDROID_LOG_ERROR, "MLC_CHAT_MODULE", __VA_ARGS__))
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("MLC_CHAT_MODULE", __VA_ARGS__)
+#define LOGE(...) NLOGE("MLC_CHAT_MODULE", __VA_ARGS__)
 
 // Add MLC-LLM integration headers
 #include "tvm/runtime/packed_func.h"
 #include "tvm/runtime/registry.h"
 
+#include "mlc_capabilities.h"
+
 // Pointer to the real module created by MLC-LLM
 static void* g_module = NULL;
 
+// Registry functions resolved once in mlc_create_chat_module. Registry::Get hands
+// out stable pointers, so the hot path never touches the registry again.
+struct ChatRegistryFunctions {
+    const tvm::runtime::PackedFunc* create = nullptr;
+    const tvm::runtime::PackedFunc* generate = nullptr;
+    const tvm::runtime::PackedFunc* reset = nullptr;
+    const tvm::runtime::PackedFunc* set_parameter = nullptr;
+    // Optional capabilities
+    const tvm::runtime::PackedFunc* stream = nullptr;
+    const tvm::runtime::PackedFunc* abort = nullptr;
+    const tvm::runtime::PackedFunc* generate_batch = nullptr;
+    uint32_t capabilities = 0;
+};
+static ChatRegistryFunctions g_funcs;
+static bool g_funcs_resolved = false;
+
+static void resolve_registry_functions() {
+    if (g_funcs_resolved) {
+        return;
+    }
+    
+    g_funcs.create = tvm::runtime::Registry::Get("mlc.llm_chat_create");
+    g_funcs.generate = tvm::runtime::Registry::Get("mlc.llm_chat_generate");
+    g_funcs.reset = tvm::runtime::Registry::Get("mlc.llm_chat_reset");
+    g_funcs.set_parameter = tvm::runtime::Registry::Get("mlc.llm_chat_set_parameter");
+    g_funcs.stream = tvm::runtime::Registry::Get("mlc.llm_chat_stream");
+    g_funcs.abort = tvm::runtime::Registry::Get("mlc.llm_chat_abort");
+    g_funcs.generate_batch = tvm::runtime::Registry::Get("mlc.llm_chat_generate_batch");
+    
+    g_funcs.capabilities = 0;
+    if (g_funcs.stream != nullptr) g_funcs.capabilities |= kMlcCapStreaming;
+    if (g_funcs.abort != nullptr) g_funcs.capabilities |= kMlcCapAbort;
+    if (g_funcs.generate_batch != nullptr) g_funcs.capabilities |= kMlcCapBatch;
+    
+    g_funcs_resolved = true;
+    LOGI("Resolved chat registry functions, capabilities: 0x%x", g_funcs.capabilities);
+}
+
 // Additional functions needed for MLC-LLM integration
 extern "C" {
     // This is the primary function that MLC-LLM needs: mlc_create_chat_module
@@ -32,9 +73,9 @@ extern "C" {
             
             LOGI("Initializing MLC-LLM with model path: %s", full_path.c_str());
             
-            // Use TVM's registry to get the proper create function
-            // This is how MLC-LLM loads models
-            auto* create_func = tvm::runtime::Registry::Get("mlc.llm_chat_create");
+            // Resolve every registry entry point once; this is how MLC-LLM loads models
+            resolve_registry_functions();
+            auto* create_func = g_funcs.create;
             if (create_func == nullptr) {
                 LOGE("Failed to find mlc.llm_chat_create in registry");
                 return nullptr;
@@ -67,8 +108,8 @@ extern "C" {
         }
         
         try {
-            // Get the generate function from the module
-            auto* generate_func = tvm::runtime::Registry::Get("mlc.llm_chat_generate");
+            // Generate function resolved at module creation
+            auto* generate_func = g_funcs.generate;
             if (generate_func == nullptr) {
                 LOGE("Failed to find mlc.llm_chat_generate in registry");
                 const char* error_msg = "ERROR: Failed to find generate function";
@@ -110,8 +151,8 @@ extern "C" {
         }
         
         try {
-            // Get the reset function from the module
-            auto* reset_func = tvm::runtime::Registry::Get("mlc.llm_chat_reset");
+            // Reset function resolved at module creation
+            auto* reset_func = g_funcs.reset;
             if (reset_func == nullptr) {
                 LOGE("Failed to find mlc.llm_chat_reset in registry");
                 return;
@@ -137,8 +178,8 @@ extern "C" {
         }
         
         try {
-            // Get the set parameter function from the module
-            auto* param_func = tvm::runtime::Registry::Get("mlc.llm_chat_set_parameter");
+            // Set parameter function resolved at module creation
+            auto* param_func = g_funcs.set_parameter;
             if (param_func == nullptr) {
                 LOGE("Failed to find mlc.llm_chat_set_parameter in registry");
                 return;
@@ -154,9 +195,17 @@ extern "C" {
         }
     }
     
+    // Report the optional capabilities (MlcCapability bits) found in the registry
+    uint32_t mlc_get_capabilities() {
+        resolve_registry_functions();
+        return g_funcs.capabilities;
+    }
+    
     // Clean up when the library is unloaded
     __attribute__((destructor)) void cleanup() {
         LOGI("Cleaning up module");
         g_module = NULL;
+        g_funcs = ChatRegistryFunctions();
+        g_funcs_resolved = false;
     }
 } 
\ No newline at end of file
@@ -1,18 +1,25 @@
 #include <jni.h>
 #include <string>
-#include <android/log.h>
 #include <memory>
 #include <vector>
 #include <fstream>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
 #include <functional>
-#include <queue>
+#include <random>
 
-#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "MLC_LLM_JNI", __VA_ARGS__))
-#define LOGE(...) ((void)__android_log_print(ANDROID_LOG_ERROR, "MLC_LLM_JNI", __VA_ARGS__))
-#define LOGD(...) ((void)__android_log_print(ANDROID_LOG_DEBUG, "MLC_LLM_JNI", __VA_ARGS__))
+#include "../generation_worker.h"
+#include "../jni_cache.h"
+#include "../latency_metrics.h"
+#include "../model_config.h"
+#include "../model_manifest.h"
+#include "../native_log.h"
+#include "../spsc_token_queue.h"
+#include "../topic_detector.h"
+
+#define LOGI(...) NLOGI("MLC_LLM_JNI", __VA_ARGS__)
+#define LOGE(...) NLOGE("MLC_LLM_JNI", __VA_ARGS__)
+#define LOGD(...) NLOGD("MLC_LLM_JNI", __VA_ARGS__)
 
 // Function signature for callback function
 typedef std::function<void(const char*)> TokenCallback;
@@ -37,55 +44,27 @@ extern "C" {
     JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_setMaxGenLen(
             JNIEnv* env, jobject thiz, jint max_gen_len);
             
+    JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_setSeed(
+            JNIEnv* env, jobject thiz, jlong seed);
+            
     JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_resetChat(
             JNIEnv* env, jobject thiz);
             
     JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_closeEngine(
             JNIEnv* env, jobject thiz);
+            
+    JNIEXPORT jstring JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_getMetrics(
+            JNIEnv* env, jobject thiz);
+            
+    JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_resetMetrics(
+            JNIEnv* env, jobject thiz);
 }
 
-// Thread-safe queue for handling token generation in a separate thread
-class TokenQueue {
-private:
-    std::queue<std::string> queue_;
-    std::mutex mutex_;
-    std::condition_variable cond_;
-    bool done_ = false;
-
-public:
-    void push(const std::string& token) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        queue_.push(token);
-        cond_.notify_one();
-    }
-
-    bool pop(std::string& token) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        cond_.wait(lock, [this] { return !queue_.empty() || done_; });
-        
-        if (done_ && queue_.empty()) {
-            return false;
-        }
-        
-        token = queue_.front();
-        queue_.pop();
-        return true;
-    }
-
-    void finish() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        done_ = true;
-        cond_.notify_all();
-    }
-
-    void reset() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        while (!queue_.empty()) {
-            queue_.pop();
-        }
-        done_ = false;
-    }
-};
+// Stage latencies of the requests served here, for getMetrics()
+static LatencyMetrics& latency_metrics() {
+    static LatencyMetrics* metrics = new LatencyMetrics();
+    return *metrics;
+}
 
 // Enhanced engine implementation that simulates MLC-LLM behavior more accurately
 class MlcEnhancedEngine {
@@ -95,23 +74,30 @@ private:
     float temperature = 0.7f;
     float top_p = 0.95f;
     int max_gen_len = 1024;
-    std::unique_ptr<TokenQueue> token_queue;
+    // Negative draws a fresh seed per request; otherwise every request replays from it
+    int64_t seed = -1;
+    std::unique_ptr<SpscTokenQueue> token_queue;
+    // Declared after token_queue so it is joined before the queue goes away
+    GenerationWorker worker{"MlcEnhancedWorker"};
     
-    // Verify model files exist
+    // Verify model files exist: in the manifest written after the download when
+    // there is one, otherwise with a stat each
     bool verifyModelFiles() {
         std::vector<std::string> required_files = {
-            "/mlc-chat-config.json",
-            "/tokenizer.model",
-            "/ndarray-cache.json"
+            "mlc-chat-config.json",
+            "tokenizer.model",
+            "ndarray-cache.json"
         };
         
+        model_manifest::Manifest manifest = model_manifest::read(model_path);
         for (const auto& file : required_files) {
-            std::ifstream check_file(model_path + file);
-            if (!check_file.good()) {
-                LOGE("Required file not found: %s", (model_path + file).c_str());
+            struct stat st;
+            bool found = manifest.loaded() ? manifest.find(file) != nullptr
+                                           : stat((model_path + "/" + file).c_str(), &st) == 0;
+            if (!found) {
+                LOGE("Required file not found: %s/%s", model_path.c_str(), file.c_str());
                 return false;
             }
-            LOGI("Found required file: %s", (model_path + file).c_str());
         }
         
         return true;
@@ -126,51 +112,42 @@ private:
             return false;
         }
         
+        // Sampling defaults come from the model's config; the setters override them
+        model_config::ModelConfig config = model_config::load(model_path);
+        if (config.loaded) {
+            temperature = config.sampling.temperature;
+            top_p = config.sampling.top_p;
+            max_gen_len = config.sampling.max_gen_len;
+        }
+        
         // In a real implementation, this would load the actual model
         // Here we're simulating the success of that operation
         LOGI("Model loaded successfully");
         return true;
     }
     
-    // Simulated text generation
-    void generateText(const std::string& prompt, std::function<void(const std::string&)> token_callback) {
+    // Simulated text generation; `timing` gets the prefill and each token
+    void generateText(const std::string& prompt, std::function<void(const std::string&)> token_callback,
+                      RequestTiming* timing) {
         LOGI("Generating text with prompt: %s", prompt.c_str());
         
         // Simulate model processing time
+        timing->begin_prefill();
         std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        timing->end_prefill();
         
         // Extract relevant context from the prompt
-        std::string topic;
-        if (prompt.find("math") != std::string::npos || 
-            prompt.find("equation") != std::string::npos ||
-            prompt.find("algebra") != std::string::npos ||
-            prompt.find("calculus") != std::string::npos ||
-            prompt.find("geometry") != std::string::npos ||
-            prompt.find("arithmetic") != std::string::npos ||
-            prompt.find("trigonometry") != std::string::npos) {
-            topic = "mathematics";
-        } else if (prompt.find("physics") != std::string::npos || 
-                  prompt.find("force") != std::string::npos ||
-                  prompt.find("gravity") != std::string::npos ||
-                  prompt.find("motion") != std::string::npos) {
-            topic = "physics";
-        } else if (prompt.find("history") != std::string::npos || 
-                  prompt.find("world war") != std::string::npos ||
-                  prompt.find("ancient") != std::string::npos ||
-                  prompt.find("civilization") != std::string::npos) {
-            topic = "history";
-        } else if (prompt.find("programming") != std::string::npos || 
-                  prompt.find("code") != std::string::npos ||
-                  prompt.find("algorithm") != std::string::npos ||
-                  prompt.find("software") != std::string::npos) {
-            topic = "programming";
-        } else if (prompt.find("literature") != std::string::npos || 
-                  prompt.find("book") != std::string::npos ||
-                  prompt.find("novel") != std::string::npos ||
-                  prompt.find("poetry") != std::string::npos) {
-            topic = "literature";
-        } else {
-            topic = "general knowledge";
+        uint32_t found = TopicDetector::instance().scan(prompt);
+        std::string topic = "general knowledge";
+        static const std::pair<uint32_t, const char*> kTopicOrder[] = {
+            {kTopicMath, "mathematics"}, {kTopicPhysics, "physics"}, {kTopicHistory, "history"},
+            {kTopicProgramming, "programming"}, {kTopicLiterature, "literature"},
+        };
+        for (const auto& entry : kTopicOrder) {
+            if (found & entry.first) {
+                topic = entry.second;
+                break;
+            }
         }
         
         LOGI("Detected topic: %s", topic.c_str());
@@ -233,18 +210,21 @@ private:
             };
         }
         
-        // Send tokens with a realistic delay
+        // Send tokens with a realistic delay, drawn from the request's seed
+        std::mt19937 rng(seed >= 0 ? static_cast<std::mt19937::result_type>(seed) : std::random_device()());
+        std::uniform_int_distribution<int> delay_ms(50, 149);
         for (const auto& token : tokens) {
             token_callback(token);
+            timing->token();
             
             // Add a small random delay between tokens to simulate real generation
-            int delay = 50 + (rand() % 100);  // 50-150ms delay
+            int delay = delay_ms(rng);  // 50-150ms delay
             std::this_thread::sleep_for(std::chrono::milliseconds(delay));
         }
     }
     
 public:
-    MlcEnhancedEngine() : token_queue(std::make_unique<TokenQueue>()) {
+    MlcEnhancedEngine() : token_queue(std::make_unique<SpscTokenQueue>()) {
         LOGI("MlcEnhancedEngine created");
     }
     
@@ -266,11 +246,14 @@ public:
         }
         
         std::string full_response;
+        RequestTiming timing;
+        timing.admit();
         
         // Use the token generation function to build a complete response
         generateText(prompt, [&full_response](const std::string& token) {
             full_response += token;
-        });
+        }, &timing);
+        latency_metrics().record(timing);
         
         return full_response;
     }
@@ -284,14 +267,27 @@ public:
         
         token_queue->reset();
         
-        // Start a background thread for generation
-        std::thread gen_thread([this, prompt, callback]() {
-            generateText(prompt, [this](const std::string& token) {
-                token_queue->push(token);
-            });
+        // Generate on the persistent worker instead of a fresh thread per request;
+        // the request waits in its queue from here until the worker admits it
+        RequestTiming timing;
+        bool queued = worker.submit(nullptr, [this, prompt, timing](JNIEnv*) mutable {
+            timing.admit();
+            try {
+                generateText(prompt, [this](const std::string& token) {
+                    token_queue->push(token);
+                }, &timing);
+            } catch (const std::exception& e) {
+                LOGE("Generation failed: %s", e.what());
+                timing.ok = false;
+            }
+            latency_metrics().record(timing);
+            // Always release the consumer, even when generation threw
             token_queue->finish();
         });
-        gen_thread.detach();
+        if (!queued) {
+            callback("ERROR: Generation worker stopped");
+            return;
+        }
         
         // Process tokens from the queue
         std::string token;
@@ -310,6 +306,11 @@ public:
         LOGI("Top_p set to %.2f", top_p);
     }
     
+    void set_seed(int64_t value) {
+        seed = value < 0 ? -1 : value;
+        LOGI("Seed set to %lld", static_cast<long long>(seed));
+    }
+    
     void set_max_gen_len(int len) {
         max_gen_len = len;
         LOGI("Max generation length set to %d", max_gen_len);
@@ -333,6 +334,11 @@ static std::unique_ptr<MlcEnhancedEngine> g_engine;
 // Implementation of JNI methods
 extern "C" {
 
+// Pin the classes and method IDs used on the request path
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* /* reserved */) {
+    return jni_cache_on_load(vm);
+}
+
 JNIEXPORT jboolean JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_initializeEngine(
         JNIEnv* env, jobject thiz, jstring model_path) {
     const char* path = env->GetStringUTFChars(model_path, nullptr);
@@ -376,8 +382,11 @@ void invokeJavaCallback(const char* token, void* context) {
     // Create a Java string from the token
     jstring jToken = ctx->env->NewStringUTF(token);
     
-    // Call the invoke method with the token
-    ctx->env->CallVoidMethod(ctx->callback, ctx->method, jToken);
+    // Call the invoke method with the token; the Unit it returns is dropped
+    jobject unit = ctx->env->CallObjectMethod(ctx->callback, ctx->method, jToken);
+    if (unit != nullptr) {
+        ctx->env->DeleteLocalRef(unit);
+    }
     
     // Clean up the local reference
     ctx->env->DeleteLocalRef(jToken);
@@ -388,13 +397,13 @@ JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_streamRespons
     if (!g_engine) {
         LOGE("Engine not initialized");
         
-        // Set up Java callback even for error case
-        jclass callbackClass = env->GetObjectClass(callback);
-        jmethodID invokeMethod = env->GetMethodID(callbackClass, "invoke", "(Ljava/lang/Object;)V");
-        jstring errorMsg = env->NewStringUTF("ERROR: Engine not initialized");
-        env->CallVoidMethod(callback, invokeMethod, errorMsg);
-        env->DeleteLocalRef(errorMsg);
-        env->DeleteLocalRef(callbackClass);
+        // Report the error through the callback; invoke is pinned in JNI_OnLoad
+        jmethodID invokeMethod = jni_function1_invoke(env, callback);
+        if (invokeMethod != nullptr) {
+            jstring errorMsg = env->NewStringUTF("ERROR: Engine not initialized");
+            env->CallObjectMethod(callback, invokeMethod, errorMsg);
+            env->DeleteLocalRef(errorMsg);
+        }
         
         return;
     }
@@ -405,10 +414,8 @@ JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_streamRespons
     StreamCallbackContext context;
     context.env = env;
     context.callback = env->NewGlobalRef(callback);  // Create global reference to keep it alive
-    jclass callbackClass = env->GetObjectClass(callback);
-    context.method = env->GetMethodID(callbackClass, "invoke", "(Ljava/lang/Object;)V");
-    context.stringClass = env->FindClass("java/lang/String");
-    env->DeleteLocalRef(callbackClass);
+    context.method = jni_function1_invoke(env, callback);
+    context.stringClass = jni_cache().string_class;
     
     // Create a wrapper for the callback
     auto callback_wrapper = [&context](const char* token) {
@@ -450,6 +457,15 @@ JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_setMaxGenLen(
     g_engine->set_max_gen_len(max_gen_len);
 }
 
+JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_setSeed(
+        JNIEnv* env, jobject thiz, jlong seed) {
+    if (!g_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    g_engine->set_seed(seed);
+}
+
 JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_resetChat(
         JNIEnv* env, jobject thiz) {
     if (!g_engine) {
@@ -469,4 +485,14 @@ JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_closeEngine(
     g_engine.reset();
 }
 
+JNIEXPORT jstring JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_getMetrics(
+        JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(latency_metrics().to_json().c_str());
+}
+
+JNIEXPORT void JNICALL Java_com_example_studybuddy_ml_MlcLlmBridge_resetMetrics(
+        JNIEnv* env, jobject thiz) {
+    latency_metrics().reset();
+}
+
 } // extern "C" 
\ No newline at end of file
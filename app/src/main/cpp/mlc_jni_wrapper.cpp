@@ -1,14 +1,27 @@
 #include <jni.h>
+#include <atomic>
+#include <mutex>
 #include <string>
-#include <android/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <errno.h>
 
+#include "async_requests.h"
+#include "cpu_features.h"
+#include "jni_cache.h"
+#include "jni_strings.h"
+#include "model_lib_abi.h"
+
 #define TAG "MlcJniWrapper"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+
+#include "native_log.h"
+
+#define LOGV(...) NLOGV(TAG, __VA_ARGS__)
+#define LOGD(...) NLOGD(TAG, __VA_ARGS__)
+#define LOGI(...) NLOGI(TAG, __VA_ARGS__)
+#define LOGE(...) NLOGE(TAG, __VA_ARGS__)
 
 // Function pointer types for Gemma functions
 typedef void* (*CreateModuleFn)(const char*);
@@ -23,31 +36,20 @@ static GenerateFn g_generate_fn = nullptr;
 static ResetChatFn g_reset_chat_fn = nullptr;
 static SetParameterFn g_set_parameter_fn = nullptr;
 
-// Pre-allocated memory buffer to prevent fragmentation
-static void* s_buffer = nullptr;
+// The library's versioned table, when it has one; read by the abort hook without the library lock
+static std::atomic<const MlcModelAbi*> g_abi{nullptr};
+static std::atomic<int64_t> g_next_abi_request{1};
 
-// Optimizes memory usage in a safer way that won't interfere with JIT
-bool optimize_memory_usage() {
-    // Don't use mlockall - it interferes with Android Runtime's JIT compiler
-    // and causes "Failed to write jitted method info in log" errors
-    
-    // Instead, we'll just hint to the kernel about our memory usage patterns
-    LOGI("Using memory optimization that's compatible with JIT compiler");
-    
-    // Note: mallopt with M_TRIM_THRESHOLD and M_MMAP_THRESHOLD aren't available in Android NDK
-    // We'll use alternative approaches for memory optimization
-    
-    // Pre-allocate some memory to reduce fragmentation
-    if (s_buffer == nullptr) {
-        s_buffer = malloc(32 * 1024 * 1024);  // 32MB buffer
-        if (s_buffer != nullptr) {
-            // Touch the pages to ensure they're actually allocated
-            memset(s_buffer, 0, 32 * 1024 * 1024);
-            LOGI("Pre-allocated 32MB memory buffer to reduce fragmentation");
-        }
-    }
-    
-    return true;
+// Reused by generate through generate_into; only touched under g_library_mutex
+static std::string g_reply_buffer(16 << 10, '\0');
+
+// Held while the library is called or unloaded, so shutdown never races a generation
+static std::mutex g_library_mutex;
+
+// Async generate requests, completed on a persistent worker thread
+static AsyncRequestTable& async_requests() {
+    static AsyncRequestTable* table = new AsyncRequestTable("GemmaAsyncWorker");
+    return *table;
 }
 
 // Loads the Gemma library and resolves all function pointers
@@ -59,15 +61,18 @@ bool initialize_gemma_library() {
     
     LOGI("Attempting to load Gemma library");
     
-    // Optimize memory usage first
-    optimize_memory_usage();
-    
-    // Try to load the library
-    const char* lib_name = "libgemma-2-2b-it-q4f16_1.so";
-    g_lib_handle = dlopen(lib_name, RTLD_NOW);
+    // Best build for this CPU first; a variant that is not packaged fails to open and the next is tried
+    const char* error = nullptr;
+    for (const std::string& lib_name : model_lib_candidates("libgemma-2-2b-it-q4f16_1", detect_cpu_features())) {
+        g_lib_handle = dlopen(lib_name.c_str(), RTLD_NOW);
+        if (g_lib_handle != nullptr) {
+            LOGI("Loading %s", lib_name.c_str());
+            break;
+        }
+        error = dlerror();
+    }
     
     if (g_lib_handle == nullptr) {
-        const char* error = dlerror();
         LOGE("CRITICAL ERROR: Failed to load Gemma library: %s", error ? error : "unknown error");
         LOGE("CRITICAL ERROR: Real Gemma model is required. Implementation verification failed.");
         return false;
@@ -78,6 +83,22 @@ bool initialize_gemma_library() {
     // Clear any existing errors
     dlerror();
     
+    const MlcModelAbi* abi = mlc_model_abi_from(g_lib_handle);
+    dlerror();
+    if (abi != nullptr) {
+        LOGI("Model library ABI v%u, capabilities 0x%llx", abi->abi_version,
+             static_cast<unsigned long long>(abi->capabilities));
+        if (abi->capabilities & kMlcAbiAbort) {
+            async_requests().set_abort_hook([] {
+                const MlcModelAbi* current = g_abi.load();
+                if (current != nullptr) {
+                    current->abort(0);
+                }
+            });
+        }
+    }
+    g_abi = abi;
+    
     // Resolve function pointers
     g_create_module_fn = (CreateModuleFn)dlsym(g_lib_handle, "mlc_create_chat_module");
     if (g_create_module_fn == nullptr) {
@@ -121,6 +142,11 @@ bool initialize_gemma_library() {
 
 // JNI wrapper functions with the proper naming convention
 extern "C" {
+    // Pin the classes and method IDs used on the request path
+    JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* /* reserved */) {
+        return jni_cache_on_load(vm);
+    }
+    
     // Implementation of mlc_create_chat_module
     JNIEXPORT jobject JNICALL
     Java_com_example_studybuddy_ml_SimpleMlcModel_mlc_1create_1chat_1module(
@@ -130,10 +156,7 @@ extern "C" {
         // Initialize the library if not already done
         if (!initialize_gemma_library()) {
             LOGE("CRITICAL ERROR: Failed to initialize Gemma library");
-            env->ThrowNew(
-                env->FindClass("java/lang/RuntimeException"),
-                "Failed to initialize Gemma library - required for real implementation"
-            );
+            jni_throw_runtime_exception(env, "Failed to initialize Gemma library - required for real implementation");
             return nullptr;
         }
         
@@ -150,17 +173,12 @@ extern "C" {
         // Check for errors
         if (module_ptr == nullptr) {
             LOGE("CRITICAL ERROR: Failed to create chat module - real implementation required");
-            env->ThrowNew(
-                env->FindClass("java/lang/RuntimeException"),
-                "Failed to initialize real Gemma language model - proper implementation required"
-            );
+            jni_throw_runtime_exception(env, "Failed to initialize real Gemma language model - proper implementation required");
             return nullptr;
         }
         
         // Convert the result to a Java Long object
-        jclass longClass = env->FindClass("java/lang/Long");
-        jmethodID longConstructor = env->GetMethodID(longClass, "<init>", "(J)V");
-        jobject longObject = env->NewObject(longClass, longConstructor, (jlong)module_ptr);
+        jobject longObject = jni_new_long(env, (jlong)module_ptr);
         
         LOGI("Successfully created chat module using real Gemma library");
         return longObject;
@@ -170,46 +188,68 @@ extern "C" {
     JNIEXPORT jstring JNICALL
     Java_com_example_studybuddy_ml_SimpleMlcModel_generate(
             JNIEnv* env, jobject thiz, jstring prompt) {
-        LOGI("JNI: generate called");
+        LOGD("JNI: generate called");
         
         // Check if library is initialized
         if (g_generate_fn == nullptr) {
             LOGE("CRITICAL ERROR: Gemma library not initialized");
-            env->ThrowNew(
-                env->FindClass("java/lang/RuntimeException"),
-                "Gemma library not initialized - required for real implementation"
-            );
+            jni_throw_runtime_exception(env, "Gemma library not initialized - required for real implementation");
             return env->NewStringUTF("ERROR: Gemma library not initialized");
         }
         
-        // Convert Java string to C string
-        const char* promptStr = env->GetStringUTFChars(prompt, 0);
-        LOGI("Prompt: %s", promptStr);
+        // Convert Java string to UTF-8
+        JniUtf8 promptText(env, prompt);
+        const char* promptStr = promptText.c_str();
+        LOGV("Prompt: %s", promptStr);
         
-        // Call the real Gemma library function through function pointer
-        char* result = g_generate_fn(promptStr);
+        // Into the reused buffer when the library can write into one, saving its malloc and our free
+        const MlcModelAbi* abi = g_abi.load();
+        if (abi != nullptr && (abi->capabilities & kMlcAbiGenerateInto)) {
+            jstring javaResult = nullptr;
+            {
+                std::lock_guard<std::mutex> library_lock(g_library_mutex);
+                size_t prompt_length = promptText.str().size();
+                int64_t length = abi->generate_into(promptStr, prompt_length, &g_reply_buffer[0], g_reply_buffer.size());
+                if (length >= static_cast<int64_t>(g_reply_buffer.size())) {
+                    // Cut short: grow to fit and generate once more
+                    g_reply_buffer.resize(static_cast<size_t>(length) + 1);
+                    length = abi->generate_into(promptStr, prompt_length, &g_reply_buffer[0], g_reply_buffer.size());
+                }
+                if (length >= 0) {
+                    javaResult = env->NewStringUTF(g_reply_buffer.c_str());
+                }
+            }
+            if (javaResult == nullptr) {
+                LOGE("CRITICAL ERROR: Failed to generate response - real implementation required");
+                jni_throw_runtime_exception(env, "Failed to generate response using real Gemma language model - check logs for details");
+                return env->NewStringUTF("ERROR: Failed to generate response from real LLM");
+            }
+            LOGD("Successfully generated response using real Gemma library");
+            return javaResult;
+        }
         
-        // Release the string
-        env->ReleaseStringUTFChars(prompt, promptStr);
+        // Call the real Gemma library function through function pointer
+        char* result;
+        {
+            std::lock_guard<std::mutex> library_lock(g_library_mutex);
+            result = g_generate_fn != nullptr ? g_generate_fn(promptStr) : nullptr;
+        }
         
         // Check for errors
         if (result == nullptr) {
             LOGE("CRITICAL ERROR: Failed to generate response - real implementation required");
-            env->ThrowNew(
-                env->FindClass("java/lang/RuntimeException"),
-                "Failed to generate response using real Gemma language model - check logs for details"
-            );
+            jni_throw_runtime_exception(env, "Failed to generate response using real Gemma language model - check logs for details");
             return env->NewStringUTF("ERROR: Failed to generate response from real LLM");
         }
         
         // Convert the result to a Java string
-        LOGI("Response: %s", result);
+        LOGV("Response: %s", result);
         jstring javaResult = env->NewStringUTF(result);
         
         // Free memory allocated by the Gemma library
         free(result);
         
-        LOGI("Successfully generated response using real Gemma library");
+        LOGD("Successfully generated response using real Gemma library");
         return javaResult;
     }
     
@@ -217,15 +257,12 @@ extern "C" {
     JNIEXPORT void JNICALL
     Java_com_example_studybuddy_ml_SimpleMlcModel_reset_1chat(
             JNIEnv* env, jobject thiz) {
-        LOGI("JNI: reset_chat called");
+        LOGD("JNI: reset_chat called");
         
         // Check if library is initialized
         if (g_reset_chat_fn == nullptr) {
             LOGE("CRITICAL ERROR: Gemma library not initialized");
-            env->ThrowNew(
-                env->FindClass("java/lang/RuntimeException"),
-                "Gemma library not initialized - required for real implementation"
-            );
+            jni_throw_runtime_exception(env, "Gemma library not initialized - required for real implementation");
             return;
         }
         
@@ -239,15 +276,12 @@ extern "C" {
     JNIEXPORT void JNICALL
     Java_com_example_studybuddy_ml_SimpleMlcModel_set_1parameter(
             JNIEnv* env, jobject thiz, jstring key, jfloat value) {
-        LOGI("JNI: set_parameter called");
+        LOGD("JNI: set_parameter called");
         
         // Check if library is initialized
         if (g_set_parameter_fn == nullptr) {
             LOGE("CRITICAL ERROR: Gemma library not initialized");
-            env->ThrowNew(
-                env->FindClass("java/lang/RuntimeException"),
-                "Gemma library not initialized - required for real implementation"
-            );
+            jni_throw_runtime_exception(env, "Gemma library not initialized - required for real implementation");
             return;
         }
         
@@ -288,14 +322,9 @@ extern "C" {
             JNIEnv* env, jobject thiz) {
         LOGI("JNI: shutdown_native called");
         
-        // Free our pre-allocated buffer if it exists
-        if (s_buffer != nullptr) {
-            free(s_buffer);
-            s_buffer = nullptr;
-            LOGI("Freed pre-allocated memory buffer");
-        }
-        
+        std::lock_guard<std::mutex> library_lock(g_library_mutex);
         if (g_lib_handle != nullptr) {
+            g_abi = nullptr;
             dlclose(g_lib_handle);
             g_lib_handle = nullptr;
             g_create_module_fn = nullptr;
@@ -305,4 +334,86 @@ extern "C" {
             LOGI("Successfully shut down Gemma library");
         }
     }
+    
+    // Start generate on the worker and return its request id at once (-1 on failure).
+    // `callback` receives the finished text, or "Error: ..." if generation failed.
+    JNIEXPORT jlong JNICALL
+    Java_com_example_studybuddy_ml_SimpleMlcModel_submit_1generate(
+            JNIEnv* env, jobject thiz, jstring prompt, jobject callback) {
+        std::string prompt_copy = jni_utf8(env, prompt);
+        
+        auto run = [](const std::string& text, const std::function<void(const std::string&)>& emit,
+                      const std::atomic<bool>& cancelled, std::string& error) {
+            std::lock_guard<std::mutex> library_lock(g_library_mutex);
+            if (g_generate_fn == nullptr) {
+                error = "Gemma library not initialized";
+                return false;
+            }
+            if (cancelled.load()) {
+                return true;
+            }
+            
+            // Token by token when the library streams; cancel() then ends it at the next token
+            const MlcModelAbi* abi = g_abi.load();
+            if (abi != nullptr && (abi->capabilities & kMlcAbiStream)) {
+                struct Sink {
+                    const std::function<void(const std::string&)>* emit;
+                    const std::atomic<bool>* cancelled;
+                } sink{&emit, &cancelled};
+                int status = abi->generate_stream(g_next_abi_request.fetch_add(1), text.data(), text.size(),
+                                                  [](const char* token, size_t length, void* user_data) {
+                    Sink* sink = static_cast<Sink*>(user_data);
+                    (*sink->emit)(std::string(token, length));
+                    return sink->cancelled->load() ? 1 : 0;
+                }, &sink);
+                if (status < 0) {
+                    error = "Failed to generate response from real LLM";
+                    return false;
+                }
+                return true;
+            }
+            
+            // The older exports have no token callback, so the answer arrives in one piece
+            char* result = g_generate_fn(text.c_str());
+            if (result == nullptr) {
+                error = "Failed to generate response from real LLM";
+                return false;
+            }
+            emit(result);
+            free(result);
+            return true;
+        };
+        
+        return static_cast<jlong>(async_requests().submit(env, std::move(prompt_copy), callback, run));
+    }
+    
+    JNIEXPORT jint JNICALL
+    Java_com_example_studybuddy_ml_SimpleMlcModel_request_1status(
+            JNIEnv* env, jobject thiz, jlong id) {
+        return static_cast<jint>(async_requests().status(id));
+    }
+    
+    JNIEXPORT jstring JNICALL
+    Java_com_example_studybuddy_ml_SimpleMlcModel_request_1output(
+            JNIEnv* env, jobject thiz, jlong id) {
+        return env->NewStringUTF(async_requests().output(id).c_str());
+    }
+    
+    JNIEXPORT jint JNICALL
+    Java_com_example_studybuddy_ml_SimpleMlcModel_queue_1position(
+            JNIEnv* env, jobject thiz, jlong id) {
+        return static_cast<jint>(async_requests().queue_position(id));
+    }
+    
+    JNIEXPORT jboolean JNICALL
+    Java_com_example_studybuddy_ml_SimpleMlcModel_cancel_1request(
+            JNIEnv* env, jobject thiz, jlong id) {
+        return async_requests().cancel(id) ? JNI_TRUE : JNI_FALSE;
+    }
+    
+    JNIEXPORT void JNICALL
+    Java_com_example_studybuddy_ml_SimpleMlcModel_release_1request(
+            JNIEnv* env, jobject thiz, jlong id) {
+        async_requests().release(id);
+    }
 } 
\ No newline at end of file
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include <dmlc/json.h>
+
+#include "generation_config.h"
+
+/**
+ * mlc-chat-config.json as a typed struct, the one source the engines take the
+ * model's shape, context window, conv_template and default sampling from.
+ *
+ * The first launch parses the JSON with dmlc's reader and writes
+ * mlc-chat-config.bin next to it; later launches read that instead, as long as
+ * the JSON's size and mtime still match the ones recorded in it. A field is
+ * read wherever it first appears, at any nesting level (the shape sits under
+ * "model_config"), and keeps its default if absent. "conv_template" is either
+ * a template name or an object whose "name" is taken.
+ */
+namespace model_config {
+
+static constexpr const char* kJsonName = "mlc-chat-config.json";
+static constexpr const char* kCacheName = "mlc-chat-config.bin";
+static constexpr uint32_t kCacheMagic = 0x434d4253;  // "SBMC"
+static constexpr uint32_t kCacheVersion = 3;
+
+struct ModelConfig {
+    bool loaded = false;
+
+    std::string model_type;
+    std::string conv_template;
+    std::string model_lib;       // library name without "lib" and ".so"; empty: whichever lib/ holds
+    std::string device;          // "opencl", "vulkan:0", ...; empty: auto
+    std::string kv_cache_dtype;  // see kv_budget.h
+
+    int64_t vocab_size = 0;
+    int64_t num_hidden_layers = 0;
+    int64_t num_key_value_heads = 0;
+    int64_t head_dim = 0;
+    int64_t kv_quant_group_size = 0;
+
+    int64_t context_window_size = 4096;
+    int64_t prefill_chunk_size = 0;   // largest prefill the model lib was compiled for; 0: unknown
+    int64_t sliding_window_size = -1;
+    int64_t sliding_window = 0;        // model_config: span of Gemma 2's local attention layers; 0: none
+    int64_t attention_sink_size = -1;  // -1: model default
+    int64_t mean_gen_len = 256;
+    double shift_fill_factor = 0.3;
+
+    // temperature, top_p, repetition_penalty and max_gen_len; the rest stays per request
+    GenerationConfig sampling;
+};
+
+// Calls visit(name, member) for every field, in the cache's order
+template <typename Config, typename Visit>
+inline void visit_fields(Config& config, Visit&& visit) {
+    visit("model_type", config.model_type);
+    visit("conv_template", config.conv_template);
+    visit("model_lib", config.model_lib);
+    visit("device", config.device);
+    visit("kv_cache_dtype", config.kv_cache_dtype);
+    visit("vocab_size", config.vocab_size);
+    visit("num_hidden_layers", config.num_hidden_layers);
+    visit("num_key_value_heads", config.num_key_value_heads);
+    visit("head_dim", config.head_dim);
+    visit("kv_quant_group_size", config.kv_quant_group_size);
+    visit("context_window_size", config.context_window_size);
+    visit("prefill_chunk_size", config.prefill_chunk_size);
+    visit("sliding_window_size", config.sliding_window_size);
+    visit("sliding_window", config.sliding_window);
+    visit("attention_sink_size", config.attention_sink_size);
+    visit("mean_gen_len", config.mean_gen_len);
+    visit("shift_fill_factor", config.shift_fill_factor);
+    visit("temperature", config.sampling.temperature);
+    visit("top_p", config.sampling.top_p);
+    visit("repetition_penalty", config.sampling.repetition_penalty);
+    visit("max_gen_len", config.sampling.max_gen_len);
+}
+
+// JSON parsing. dmlc reports malformed input by throwing dmlc::Error.
+
+inline int peek_value(std::istream& in) {
+    in >> std::ws;
+    return in.peek();
+}
+
+// Consumes the next value, whatever it is
+inline void skip_value(dmlc::JSONReader& reader, std::istream& in) {
+    int ch = peek_value(in);
+    std::string text;
+    if (ch == '{') {
+        reader.BeginObject();
+        while (reader.NextObjectItem(&text)) {
+            skip_value(reader, in);
+        }
+    } else if (ch == '[') {
+        reader.BeginArray();
+        while (reader.NextArrayItem()) {
+            skip_value(reader, in);
+        }
+    } else if (ch == '"') {
+        reader.ReadString(&text);
+    } else {
+        // A number, true, false or null
+        while ((ch = in.peek()) != EOF && (isalnum(ch) || ch == '-' || ch == '+' || ch == '.')) {
+            in.get();
+        }
+    }
+}
+
+inline void read_value(dmlc::JSONReader& reader, std::istream& in, std::string& out) {
+    if (peek_value(in) == '"') {
+        reader.ReadString(&out);
+    } else {
+        skip_value(reader, in);
+    }
+}
+
+template <typename Number>
+inline void read_value(dmlc::JSONReader& reader, std::istream& in, Number& out) {
+    int ch = peek_value(in);
+    if (isdigit(ch) || ch == '-') {
+        double value = 0.0;
+        reader.ReadNumber(&value);
+        out = static_cast<Number>(value);
+    } else {
+        skip_value(reader, in);  // null keeps the default
+    }
+}
+
+inline void parse_object(dmlc::JSONReader& reader, std::istream& in, ModelConfig& config,
+                         std::set<std::string>& seen) {
+    reader.BeginObject();
+    std::string key;
+    while (reader.NextObjectItem(&key)) {
+        int ch = peek_value(in);
+        if (key == "conv_template" && ch == '{') {
+            reader.BeginObject();
+            std::string inner;
+            while (reader.NextObjectItem(&inner)) {
+                if (inner == "name" && seen.insert(key).second) {
+                    read_value(reader, in, config.conv_template);
+                } else {
+                    skip_value(reader, in);
+                }
+            }
+        } else if (ch == '{') {
+            parse_object(reader, in, config, seen);
+        } else {
+            bool matched = false;
+            visit_fields(config, [&](const char* name, auto& field) {
+                if (!matched && key == name) {
+                    matched = true;
+                    if (seen.insert(key).second) {
+                        read_value(reader, in, field);
+                    } else {
+                        skip_value(reader, in);
+                    }
+                }
+            });
+            if (!matched) {
+                skip_value(reader, in);
+            }
+        }
+    }
+}
+
+inline bool parse(const std::string& text, ModelConfig& config) {
+    try {
+        std::istringstream in(text);
+        dmlc::JSONReader reader(&in);
+        std::set<std::string> seen;
+        parse_object(reader, in, config, seen);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// The binary cache: magic, version, the JSON's size and mtime, then the fields
+// in visit_fields order (numbers in host byte order, strings length-prefixed)
+
+inline void put(std::string& out, const std::string& value) {
+    uint32_t size = static_cast<uint32_t>(value.size());
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(value);
+}
+
+template <typename Number>
+inline void put(std::string& out, const Number& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline bool take(const std::string& in, size_t& at, std::string& value) {
+    uint32_t size = 0;
+    if (in.size() - at < sizeof(size)) {
+        return false;
+    }
+    memcpy(&size, in.data() + at, sizeof(size));
+    at += sizeof(size);
+    if (in.size() - at < size) {
+        return false;
+    }
+    value.assign(in, at, size);
+    at += size;
+    return true;
+}
+
+template <typename Number>
+inline bool take(const std::string& in, size_t& at, Number& value) {
+    if (in.size() - at < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, in.data() + at, sizeof(value));
+    at += sizeof(value);
+    return true;
+}
+
+inline bool read_file(const std::string& path, std::string& out) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.good()) {
+        return false;
+    }
+    out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+inline bool read_cache(const std::string& path, uint64_t json_size, int64_t json_mtime, ModelConfig& config) {
+    std::string data;
+    if (!read_file(path, data)) {
+        return false;
+    }
+    size_t at = 0;
+    uint32_t magic = 0, version = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    if (!take(data, at, magic) || !take(data, at, version) || !take(data, at, size) || !take(data, at, mtime) ||
+        magic != kCacheMagic || version != kCacheVersion || size != json_size || mtime != json_mtime) {
+        return false;
+    }
+    bool ok = true;
+    visit_fields(config, [&](const char*, auto& field) { ok = ok && take(data, at, field); });
+    return ok && at == data.size();
+}
+
+inline void write_cache(const std::string& path, uint64_t json_size, int64_t json_mtime, const ModelConfig& config) {
+    std::string data;
+    put(data, kCacheMagic);
+    put(data, kCacheVersion);
+    put(data, json_size);
+    put(data, json_mtime);
+    visit_fields(config, [&](const char*, const auto& field) { put(data, field); });
+
+    std::string tmp = path + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (out == nullptr) {
+        return;  // read-only model dir: parse again next time
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
+
+// The config of the model in `model_dir`; not loaded if its JSON is missing or malformed
+inline ModelConfig load(const std::string& model_dir) {
+    ModelConfig config;
+    std::string json_path = model_dir + "/" + kJsonName;
+    struct stat st;
+    if (stat(json_path.c_str(), &st) != 0) {
+        return config;
+    }
+    uint64_t json_size = static_cast<uint64_t>(st.st_size);
+    int64_t json_mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    std::string cache_path = model_dir + "/" + kCacheName;
+    if (read_cache(cache_path, json_size, json_mtime, config)) {
+        config.loaded = true;
+        return config;
+    }
+
+    config = ModelConfig();
+    std::string text;
+    if (!read_file(json_path, text) || !parse(text, config)) {
+        return ModelConfig();
+    }
+    config.loaded = true;
+    write_cache(cache_path, json_size, json_mtime, config);
+    return config;
+}
+
+}  // namespace model_config
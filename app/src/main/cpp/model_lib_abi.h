@@ -0,0 +1,80 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Versioned C ABI between a dynamically loaded model library and its loaders
+ * (mlc_jni_wrapper.cpp, the dlsym path of real_mlc_llm_jni.cpp).
+ *
+ * A library exports one symbol, mlc_model_abi(), returning a table of entry
+ * points for the version asked for, or null if it cannot serve it. Loaders
+ * check `abi_version` and read only the fields `struct_size` covers, so fields
+ * can be appended in later versions without breaking either side, and test
+ * `capabilities` before calling an optional entry. Libraries without the symbol
+ * keep working through the older per-function exports (generate, stream_chat,
+ * abort_chat), whose replies the callee mallocs and the caller frees.
+ *
+ * Nothing in this ABI allocates across the boundary: prompts are passed with
+ * their length, streamed tokens point into the callee's own buffer for the
+ * duration of the callback, and generate_into writes into the caller's buffer.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MLC_MODEL_ABI_VERSION 1
+#define MLC_MODEL_ABI_SYMBOL "mlc_model_abi"
+
+enum MlcModelAbiCapability {
+    kMlcAbiStream = 1u << 0,        // generate_stream
+    kMlcAbiAbort = 1u << 1,         // abort ends a request at its next token
+    kMlcAbiGenerateInto = 1u << 2,  // generate_into
+};
+
+// One piece of the reply; `token` is not NUL-terminated and is only valid during
+// the call. Return nonzero to stop the generation after this token.
+typedef int (*MlcTokenCallback)(const char* token, size_t length, void* user_data);
+
+typedef struct MlcModelAbi {
+    uint32_t abi_version;   // MLC_MODEL_ABI_VERSION the table was built for
+    uint32_t struct_size;   // sizeof(MlcModelAbi) on the library's side
+    uint64_t capabilities;  // MlcModelAbiCapability bits
+
+    void* (*create)(const char* model_path);  // null on failure
+    void (*load)(void);
+    void (*reset)(void);
+    void (*set_parameter)(const char* key, float value);
+
+    // Streams the reply on the calling thread. `request_id` is the caller's
+    // (nonzero) and names the request for abort(). Returns 0 when the reply
+    // ended, 1 if it was aborted or the callback stopped it, negative on failure.
+    int (*generate_stream)(int64_t request_id, const char* prompt, size_t prompt_length, MlcTokenCallback on_token,
+                           void* user_data);
+
+    // Ends the request at its next token; 0 ends whichever is running.
+    // Returns 0 if a request was running.
+    int (*abort)(int64_t request_id);
+
+    // Writes the reply, NUL-terminated and cut to `capacity - 1` bytes, into
+    // `buffer`. Returns the reply's full length, which is more than was written
+    // when the buffer was too small, or negative on failure.
+    int64_t (*generate_into)(const char* prompt, size_t prompt_length, char* buffer, size_t capacity);
+} MlcModelAbi;
+
+typedef const MlcModelAbi* (*MlcModelAbiFn)(uint32_t version);
+
+// The library's table for this version, or null if it has none (use the older exports)
+static inline const MlcModelAbi* mlc_model_abi_from(void* handle) {
+    MlcModelAbiFn get = (MlcModelAbiFn)dlsym(handle, MLC_MODEL_ABI_SYMBOL);
+    const MlcModelAbi* abi = get != NULL ? get(MLC_MODEL_ABI_VERSION) : NULL;
+    if (abi == NULL || abi->abi_version != MLC_MODEL_ABI_VERSION || abi->struct_size < sizeof(MlcModelAbi)) {
+        return NULL;
+    }
+    return abi;
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "shard_pack.h"
+
+/**
+ * What a downloaded model directory holds, written once after the download so
+ * a cold start reads one small file instead of probing the directory.
+ *
+ * model-manifest.txt lists every regular file of the directory with its size
+ * and FNV-1a hash, plus the model library picked for this device's CPU (see
+ * cpu_features.h), relative to the directory. Startup takes the library path
+ * and the shard sizes from it in one open and read; a missing or unreadable
+ * manifest means the old probing path. Hashes are only checked by verify(),
+ * from the explicit diagnostics call, since reading the shards is exactly what
+ * startup avoids.
+ *
+ * Weight files are also hashed in chunks of `chunk` bytes: the chunk hashes are
+ * the leaves of a Merkle tree whose root is the file's hash, so damage is found
+ * and repaired one chunk at a time (damaged_ranges(), verify_repaired()) rather
+ * than one shard file at a time. `chunks` also records the file's mtime when it
+ * last verified clean; a file whose size and mtime still match is skipped by
+ * the incremental check.
+ *
+ *   studybuddy-model-manifest 1
+ *   lib <path>
+ *   chunk <bytes>
+ *   file <size> <hash> <name>
+ *   chunks <mtime> <count> <leaf hashes, 16 hex digits each> <name>
+ */
+namespace model_manifest {
+
+static constexpr const char* kFileName = "model-manifest.txt";
+static constexpr const char* kHeader = "studybuddy-model-manifest 1";
+static constexpr uint64_t kChunkBytes = 1 << 20;
+static constexpr uint64_t kFnvBasis = 14695981039346656037ull;
+
+struct Entry {
+    std::string name;
+    uint64_t size = 0;
+    uint64_t hash = 0;             // FNV-1a of the contents; the Merkle root when chunked
+    int64_t mtime = 0;             // ns, when the chunks last verified clean
+    std::vector<uint64_t> chunks;  // FNV-1a of each chunk, the tree's leaves
+
+    bool chunked() const { return !chunks.empty(); }
+};
+
+// A run of damaged bytes of `name`, whose good copy is `file_size` bytes long
+struct Damage {
+    std::string name;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t file_size = 0;
+};
+
+// The files worth a chunk tree: the weights, in any of their forms
+inline bool is_weight_file(const std::string& name) {
+    return name.rfind("params_shard_", 0) == 0 || name == shard_pack::kFileName;
+}
+
+struct Manifest {
+    std::string model_lib;
+    uint64_t chunk_bytes = kChunkBytes;
+    std::vector<Entry> files;
+
+    bool loaded() const { return !files.empty(); }
+
+    const Entry* find(const std::string& name) const {
+        for (const Entry& entry : files) {
+            if (entry.name == name) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    Entry* find(const std::string& name) {
+        return const_cast<Entry*>(static_cast<const Manifest*>(this)->find(name));
+    }
+
+    uint64_t shard_bytes() const {
+        uint64_t total = 0;
+        for (const Entry& entry : files) {
+            if (is_weight_file(entry.name)) {
+                total += entry.size;
+            }
+        }
+        return total;
+    }
+};
+
+inline uint64_t fnv1a(const unsigned char* data, size_t size, uint64_t h = kFnvBasis) {
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// FNV-1a over the file's contents; false if it cannot be read
+inline bool hash_file(const std::string& path, uint64_t* hash) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<unsigned char> buffer(1 << 20);
+    uint64_t h = kFnvBasis;
+    ssize_t n;
+    while ((n = ::read(fd, buffer.data(), buffer.size())) > 0) {
+        h = fnv1a(buffer.data(), static_cast<size_t>(n), h);
+    }
+    ::close(fd);
+    *hash = h;
+    return n == 0;
+}
+
+// Pairs of nodes hash into their parent (an odd one out moves up as is) until one is left
+inline uint64_t merkle_root(std::vector<uint64_t> level) {
+    if (level.empty()) {
+        return kFnvBasis;
+    }
+    while (level.size() > 1) {
+        std::vector<uint64_t> parents;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                parents.push_back(level[i]);
+                continue;
+            }
+            uint64_t pair[2] = {level[i], level[i + 1]};
+            parents.push_back(fnv1a(reinterpret_cast<const unsigned char*>(pair), sizeof(pair)));
+        }
+        level.swap(parents);
+    }
+    return level[0];
+}
+
+inline size_t chunk_count(uint64_t size, uint64_t chunk_bytes) {
+    return static_cast<size_t>((size + chunk_bytes - 1) / chunk_bytes);
+}
+
+// Hash of chunk `index` of a file of `size` bytes; false if it cannot be read in full
+inline bool hash_chunk(int fd, uint64_t size, uint64_t chunk_bytes, size_t index, std::vector<unsigned char>& buffer,
+                       uint64_t* hash) {
+    uint64_t offset = index * chunk_bytes;
+    size_t want = static_cast<size_t>(std::min(chunk_bytes, size - offset));
+    buffer.resize(want);
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = pread(fd, buffer.data() + got, want - got, static_cast<off_t>(offset + got));
+        if (n <= 0) {
+            return false;
+        }
+        got += static_cast<size_t>(n);
+    }
+    *hash = fnv1a(buffer.data(), want);
+    return true;
+}
+
+// Leaf hashes of the file's chunks; false if it cannot be read
+inline bool hash_chunks(const std::string& path, uint64_t size, uint64_t chunk_bytes, std::vector<uint64_t>* chunks) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<unsigned char> buffer;
+    chunks->assign(chunk_count(size, chunk_bytes), 0);
+    bool ok = true;
+    for (size_t i = 0; ok && i < chunks->size(); ++i) {
+        ok = hash_chunk(fd, size, chunk_bytes, i, buffer, &(*chunks)[i]);
+    }
+    ::close(fd);
+    return ok;
+}
+
+inline int64_t mtime_ns(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Chunk hashes taken while a file was downloaded (download_sink.h), which
+// write() uses instead of reading the file again while its size and mtime match
+struct KnownChunks {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::vector<uint64_t> leaves;
+};
+
+inline std::mutex& known_chunks_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline std::map<std::string, KnownChunks>& known_chunks() {
+    static std::map<std::string, KnownChunks> known;
+    return known;
+}
+
+inline void remember_chunks(const std::string& path, uint64_t size, int64_t mtime, std::vector<uint64_t> leaves) {
+    std::lock_guard<std::mutex> lock(known_chunks_mutex());
+    known_chunks()[path] = KnownChunks{size, mtime, std::move(leaves)};
+}
+
+// The remembered chunk hashes of `path`, if it has not changed since; forgets them either way
+inline bool take_chunks(const std::string& path, const struct stat& st, std::vector<uint64_t>* leaves) {
+    std::lock_guard<std::mutex> lock(known_chunks_mutex());
+    auto it = known_chunks().find(path);
+    if (it == known_chunks().end()) {
+        return false;
+    }
+    bool same = it->second.size == static_cast<uint64_t>(st.st_size) && it->second.mtime == mtime_ns(st);
+    if (same) {
+        leaves->swap(it->second.leaves);
+    }
+    known_chunks().erase(it);
+    return same;
+}
+
+// The manifest of `dir`, read in one go; not loaded() if there is none
+inline Manifest read(const std::string& dir) {
+    Manifest manifest;
+    int fd = ::open((dir + "/" + kFileName).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return manifest;
+    }
+    struct stat st;
+    std::string text;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        text.resize(static_cast<size_t>(st.st_size));
+        ssize_t got = ::read(fd, &text[0], text.size());
+        text.resize(got > 0 ? static_cast<size_t>(got) : 0);
+    }
+    ::close(fd);
+    if (text.rfind(kHeader, 0) != 0) {
+        return manifest;
+    }
+
+    size_t at = 0;
+    while (at < text.size()) {
+        size_t end = text.find('\n', at);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string line = text.substr(at, end - at);
+        at = end + 1;
+        if (line.rfind("lib ", 0) == 0) {
+            manifest.model_lib = line.substr(4);
+            continue;
+        }
+        unsigned long long size = 0, hash = 0;
+        long long mtime = 0;
+        int name_at = 0;
+        if (sscanf(line.c_str(), "chunk %llu", &size) == 1 && size > 0) {
+            manifest.chunk_bytes = size;
+        } else if (sscanf(line.c_str(), "file %llu %llx %n", &size, &hash, &name_at) == 2 && name_at > 0) {
+            Entry entry;
+            entry.name = line.substr(static_cast<size_t>(name_at));
+            entry.size = size;
+            entry.hash = hash;
+            manifest.files.push_back(std::move(entry));
+        } else if (sscanf(line.c_str(), "chunks %lld %llu %n", &mtime, &size, &name_at) == 2 && name_at > 0) {
+            // `size` is the leaf count here; the name follows the leaves
+            size_t leaves_at = static_cast<size_t>(name_at);
+            if (size > line.size() / 16 || line.size() <= leaves_at + size * 16) {
+                return Manifest();
+            }
+            Entry* entry = manifest.find(line.substr(leaves_at + size * 16 + 1));
+            if (entry == nullptr) {
+                continue;
+            }
+            entry->mtime = mtime;
+            entry->chunks.resize(size);
+            for (size_t i = 0; i < entry->chunks.size(); ++i) {
+                entry->chunks[i] = strtoull(line.substr(leaves_at + i * 16, 16).c_str(), nullptr, 16);
+            }
+        }
+    }
+    // A tree that does not reproduce its root means the manifest itself is damaged
+    for (const Entry& entry : manifest.files) {
+        if (entry.chunked() && (entry.chunks.size() != chunk_count(entry.size, manifest.chunk_bytes) ||
+                                merkle_root(entry.chunks) != entry.hash)) {
+            return Manifest();
+        }
+    }
+    return manifest;
+}
+
+// Writes `manifest` into `dir` as `file_name`, replacing any older one
+inline bool save(const std::string& dir, const Manifest& manifest, const std::string& file_name = kFileName) {
+    std::string text = std::string(kHeader) + "\nlib " + manifest.model_lib + "\nchunk " +
+                       std::to_string(static_cast<unsigned long long>(manifest.chunk_bytes)) + "\n";
+    for (const Entry& entry : manifest.files) {
+        char line[64];
+        snprintf(line, sizeof(line), "file %llu %016llx ", static_cast<unsigned long long>(entry.size),
+                 static_cast<unsigned long long>(entry.hash));
+        text += line + entry.name + "\n";
+    }
+    for (const Entry& entry : manifest.files) {
+        if (!entry.chunked()) {
+            continue;
+        }
+        char line[64];
+        snprintf(line, sizeof(line), "chunks %lld %llu ", static_cast<long long>(entry.mtime),
+                 static_cast<unsigned long long>(entry.chunks.size()));
+        text += line;
+        for (uint64_t leaf : entry.chunks) {
+            snprintf(line, sizeof(line), "%016llx", static_cast<unsigned long long>(leaf));
+            text += line;
+        }
+        text += " " + entry.name + "\n";
+    }
+
+    std::string tmp = dir + "/" + file_name + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (out == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), out) == text.size();
+    ok = fclose(out) == 0 && ok;
+    return ok && rename(tmp.c_str(), (dir + "/" + file_name).c_str()) == 0;
+}
+
+// Lists and hashes `dir` and writes its manifest, replacing any older one;
+// `model_lib` is relative to `dir`. Run after a download, off the UI thread:
+// it reads every shard once.
+inline bool write(const std::string& dir, const std::string& model_lib) {
+    DIR* listing = opendir(dir.c_str());
+    if (listing == nullptr) {
+        return false;
+    }
+    std::vector<std::string> names;
+    while (dirent* entry = readdir(listing)) {
+        struct stat st;
+        if (entry->d_name[0] != '.' && strcmp(entry->d_name, kFileName) != 0 &&
+            stat((dir + "/" + entry->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(listing);
+    std::sort(names.begin(), names.end());
+
+    Manifest manifest;
+    manifest.model_lib = model_lib;
+    for (const std::string& name : names) {
+        std::string path = dir + "/" + name;
+        struct stat st;
+        Entry entry;
+        entry.name = name;
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+        entry.size = static_cast<uint64_t>(st.st_size);
+        if (is_weight_file(name) && entry.size > 0) {
+            if (!take_chunks(path, st, &entry.chunks) &&
+                !hash_chunks(path, entry.size, manifest.chunk_bytes, &entry.chunks)) {
+                return false;
+            }
+            entry.hash = merkle_root(entry.chunks);
+            entry.mtime = mtime_ns(st);
+        } else if (!hash_file(path, &entry.hash)) {
+            return false;
+        }
+        manifest.files.push_back(std::move(entry));
+    }
+    return save(dir, manifest);
+}
+
+// Names of the files in `manifest` that are missing from `dir` or differ from
+// it, by size (cheap) or, with `hashes`, by content
+inline std::vector<std::string> verify(const std::string& dir, const Manifest& manifest, bool hashes) {
+    std::vector<std::string> bad;
+    for (const Entry& entry : manifest.files) {
+        std::string path = dir + "/" + entry.name;
+        struct stat st;
+        uint64_t hash = 0;
+        std::vector<uint64_t> chunks;
+        bool same = stat(path.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) == entry.size;
+        if (same && hashes) {
+            same = entry.chunked()
+                       ? hash_chunks(path, entry.size, manifest.chunk_bytes, &chunks) && merkle_root(chunks) == entry.hash
+                       : hash_file(path, &hash) && hash == entry.hash;
+        }
+        if (!same) {
+            bad.push_back(entry.name);
+        }
+    }
+    return bad;
+}
+
+// The damaged bytes of `dir` by the manifest's hashes, adjacent bad chunks
+// merged. Unless `full`, a weight file whose size and mtime are unchanged since
+// it last verified clean is skipped; others record their mtime in `manifest`
+// when they come out clean (save() it afterwards). Files without a tree are
+// small and always hashed whole; any difference is the whole file.
+inline std::vector<Damage> damaged_ranges(const std::string& dir, Manifest& manifest, bool full) {
+    std::vector<Damage> damage;
+    std::vector<unsigned char> buffer;
+    for (Entry& entry : manifest.files) {
+        std::string path = dir + "/" + entry.name;
+        struct stat st;
+        bool present = stat(path.c_str(), &st) == 0;
+        uint64_t size = present ? static_cast<uint64_t>(st.st_size) : 0;
+        if (!entry.chunked()) {
+            uint64_t hash = 0;
+            if (!present || size != entry.size || !hash_file(path, &hash) || hash != entry.hash) {
+                damage.push_back(Damage{entry.name, 0, entry.size, entry.size});
+            }
+            continue;
+        }
+        if (!full && present && size == entry.size && mtime_ns(st) == entry.mtime) {
+            continue;
+        }
+        int fd = present ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        bool clean = fd >= 0 && size == entry.size;
+        for (size_t i = 0; i < entry.chunks.size(); ++i) {
+            uint64_t hash = 0;
+            // Reads past a truncated end fail, so the missing tail counts as damaged
+            if (fd >= 0 && hash_chunk(fd, entry.size, manifest.chunk_bytes, i, buffer, &hash) &&
+                hash == entry.chunks[i]) {
+                continue;
+            }
+            clean = false;
+            uint64_t offset = i * manifest.chunk_bytes;
+            uint64_t length = std::min(manifest.chunk_bytes, entry.size - offset);
+            if (!damage.empty() && damage.back().name == entry.name &&
+                damage.back().offset + damage.back().length == offset) {
+                damage.back().length += length;
+            } else {
+                damage.push_back(Damage{entry.name, offset, length, entry.size});
+            }
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (clean) {
+            entry.mtime = mtime_ns(st);
+        } else if (size > entry.size && (damage.empty() || damage.back().name != entry.name)) {
+            // Every chunk is good but the file runs on: only a truncate is needed
+            damage.push_back(Damage{entry.name, entry.size, 0, entry.size});
+        }
+    }
+    return damage;
+}
+
+// After chunks of `name` starting at `offsets` were rewritten: true if those
+// chunks, and nothing else, needed checking and they now match. Records the new
+// mtime, since the rest of the file verified clean before the repair.
+inline bool verify_repaired(const std::string& dir, Manifest& manifest, const std::string& name,
+                            const std::vector<uint64_t>& offsets) {
+    Entry* entry = manifest.find(name);
+    std::string path = dir + "/" + name;
+    struct stat st;
+    if (entry == nullptr || stat(path.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) != entry->size) {
+        return false;
+    }
+    if (!entry->chunked()) {
+        uint64_t hash = 0;
+        return hash_file(path, &hash) && hash == entry->hash;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    std::vector<unsigned char> buffer;
+    bool ok = true;
+    for (uint64_t offset : offsets) {
+        size_t index = static_cast<size_t>(offset / manifest.chunk_bytes);
+        uint64_t hash = 0;
+        ok = ok && index < entry->chunks.size() &&
+             hash_chunk(fd, entry->size, manifest.chunk_bytes, index, buffer, &hash) && hash == entry->chunks[index];
+    }
+    ::close(fd);
+    if (ok) {
+        entry->mtime = mtime_ns(st);
+    }
+    return ok;
+}
+
+}  // namespace model_manifest
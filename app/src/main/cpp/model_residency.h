@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "layer_pager.h"
+
+// Models that can be loaded into one engine next to each other
+enum ModelRole {
+    kModelChat = 0,      // the chat model itself; never evicted
+    kModelDraft = 1,     // <model_dir>/draft, for speculative decoding
+    kModelEmbedder = 2,  // <model_dir>/embedder, for notes search (embedText)
+};
+
+inline const char* model_role_name(ModelRole role) {
+    switch (role) {
+        case kModelDraft: return "draft";
+        case kModelEmbedder: return "embedder";
+        default: return "chat";
+    }
+}
+
+// Reported by getModelStats()
+struct ModelResidencyStats {
+    uint64_t budget_bytes = 0;
+    uint64_t resident_bytes = 0;
+    uint32_t resident_models = 0;
+    uint64_t evictions = 0;
+    uint64_t unmaps = 0;
+};
+
+/**
+ * One memory budget for every model an engine has loaded: the chat model and
+ * the optional draft and embedding models next to it.
+ *
+ * All of them run in the same TVM runtime, on its one thread pool, and
+ * allocate through the same pooled workspace allocators (pooled_device_api.h),
+ * so what differs per model is its weights. Each model is counted at the size
+ * of its params shards, in least-recently-used order. When a load would go
+ * over the budget, victims() names the secondary models to unload, oldest
+ * first; the chat model is never one of them. Under memory pressure the
+ * engine first unmaps a secondary model's weight pages (they fault back in
+ * from the shards when it runs again) and unloads it only if that is not
+ * enough (see RealMlcEngine::trim_memory).
+ */
+class ModelResidency {
+public:
+    // 2.5 GB: Gemma 2 2B at q4f16_1, a small draft and an embedder on a 6 GB phone
+    static constexpr uint64_t kDefaultBudgetBytes = 2560ull << 20;
+
+    void set_budget(uint64_t bytes) { budget_ = bytes; }
+    uint64_t budget() const { return budget_; }
+
+    // Bytes of the params shards in `dir`, the footprint a model is counted at
+    static uint64_t weight_bytes(const std::string& dir) { return layer_pager::shard_bytes(dir); }
+
+    // Record that `role` is loaded from `dir`, as the most recently used
+    void add(ModelRole role, const std::string& dir) {
+        erase(role);
+        order_.push_front(role);
+        entries_[role] = Entry{dir, weight_bytes(dir), false, order_.begin()};
+        resident_ += entries_[role].bytes;
+    }
+
+    // `role` just ran; its pages are back if they had been unmapped
+    void touch(ModelRole role) {
+        auto it = entries_.find(role);
+        if (it == entries_.end()) {
+            return;
+        }
+        order_.splice(order_.begin(), order_, it->second.position);
+        it->second.unmapped = false;
+    }
+
+    void erase(ModelRole role) {
+        auto it = entries_.find(role);
+        if (it == entries_.end()) {
+            return;
+        }
+        resident_ -= it->second.bytes;
+        order_.erase(it->second.position);
+        entries_.erase(it);
+    }
+
+    bool resident(ModelRole role) const { return entries_.find(role) != entries_.end(); }
+
+    // Secondary models to unload, least recently used first, so that
+    // `incoming` more bytes fit. Empty if they fit already, or cannot fit
+    // even with every secondary model gone. The caller reports each with evicted().
+    std::vector<ModelRole> victims(uint64_t incoming) const {
+        std::vector<ModelRole> out;
+        uint64_t total = resident_ + incoming;
+        for (auto it = order_.rbegin(); it != order_.rend() && total > budget_; ++it) {
+            if (*it == kModelChat) {
+                continue;
+            }
+            out.push_back(*it);
+            total -= entries_.at(*it).bytes;
+        }
+        if (total > budget_) {
+            out.clear();
+        }
+        return out;
+    }
+
+    bool fits(uint64_t incoming) const { return resident_ + incoming <= budget_; }
+
+    void evicted(ModelRole role) {
+        erase(role);
+        evictions_++;
+    }
+
+    // The least recently used secondary model whose pages are still mapped,
+    // and its directory; false if there is none
+    bool unmap_candidate(ModelRole* role, std::string* dir) const {
+        for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+            const Entry& entry = entries_.at(*it);
+            if (*it != kModelChat && !entry.unmapped) {
+                *role = *it;
+                *dir = entry.dir;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void unmapped(ModelRole role) {
+        auto it = entries_.find(role);
+        if (it != entries_.end() && !it->second.unmapped) {
+            it->second.unmapped = true;
+            unmaps_++;
+        }
+    }
+
+    // Loaded secondary models, least recently used first
+    std::vector<ModelRole> secondaries() const {
+        std::vector<ModelRole> out;
+        for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+            if (*it != kModelChat) {
+                out.push_back(*it);
+            }
+        }
+        return out;
+    }
+
+    void clear() {
+        entries_.clear();
+        order_.clear();
+        resident_ = 0;
+    }
+
+    ModelResidencyStats stats() const {
+        ModelResidencyStats s;
+        s.budget_bytes = budget_;
+        s.resident_bytes = resident_;
+        s.resident_models = static_cast<uint32_t>(entries_.size());
+        s.evictions = evictions_;
+        s.unmaps = unmaps_;
+        return s;
+    }
+
+private:
+    struct Entry {
+        std::string dir;
+        uint64_t bytes = 0;
+        bool unmapped = false;  // weight pages dropped since it last ran
+        std::list<ModelRole>::iterator position;
+    };
+
+    uint64_t budget_ = kDefaultBudgetBytes;
+    uint64_t resident_ = 0;
+    uint64_t evictions_ = 0;
+    uint64_t unmaps_ = 0;
+    std::list<ModelRole> order_;  // most recently used first
+    std::unordered_map<int, Entry> entries_;
+};
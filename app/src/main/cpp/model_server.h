@@ -0,0 +1,498 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * One loaded model shared by the app's processes.
+ *
+ * The process that owns the engine runs a ModelServer on an abstract Unix
+ * socket; others (a widget or quick-answer service in its own process) call
+ * request() instead of loading another copy of the weights. The socket is
+ * SOCK_SEQPACKET and only signals: the prompt travels in a memfd the client
+ * fills and passes with SCM_RIGHTS, and the response in a memfd the server
+ * creates and the client maps read-only. Each text frame says how far the
+ * response has been written, so a token costs one small packet and no copy
+ * through the kernel. Devices without memfd_create fall back to ashmem.
+ *
+ * Only peers with the server's uid are served (the app's own processes);
+ * others are refused before anything is read. Connections are served one at
+ * a time, as the engine runs one generation at a time anyway; the rest wait
+ * in the listen backlog. A client cancels by closing its socket, which the
+ * server sees at the next frame it sends.
+ */
+namespace model_server {
+
+static constexpr uint32_t kMagic = 0x4d4c4331;  // "MLC1"
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kMaxPromptBytes = 1 << 20;
+static constexpr size_t kOutputBytes = 1 << 20;  // response buffer, far above max_gen_len tokens
+static constexpr size_t kMaxErrorBytes = 256;
+static constexpr int kRequestTimeoutMs = 2000;  // for the request packet after connecting
+static constexpr int kBacklog = 8;
+
+enum Status : int32_t {
+    kStatusOk = 0,
+    kStatusFailed = 1,      // the generation failed; the frame carries the error
+    kStatusTruncated = 2,   // the response outgrew kOutputBytes
+    kStatusShutdown = 3,    // the server stopped mid-request
+};
+
+enum FrameKind : uint32_t {
+    kFrameAccepted = 1,  // with the response memfd; value is its size
+    kFrameText = 2,      // value is the response length written so far
+    kFrameDone = 3,      // status, value is the final length; errors follow the frame
+};
+
+struct RequestPacket {
+    uint32_t magic = kMagic;
+    uint32_t version = kVersion;
+    uint32_t prompt_bytes = 0;
+    int32_t max_gen_len = 0;     // <= 0 for the server's default
+    float temperature = -1.0f;   // < 0 for the server's default
+};
+
+struct Frame {
+    uint32_t kind = 0;
+    int32_t status = kStatusOk;
+    uint64_t value = 0;
+};
+
+// What a handler gets: the prompt and the client's overrides
+struct Request {
+    std::string prompt;
+    int max_gen_len = 0;
+    float temperature = -1.0f;
+};
+
+// A memfd (or ashmem region) of `bytes`, or -1
+inline int create_shared_memory(const char* name, size_t bytes) {
+    int fd = -1;
+#ifdef __NR_memfd_create
+    fd = static_cast<int>(syscall(__NR_memfd_create, name, MFD_CLOEXEC));
+    if (fd >= 0 && ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+#endif
+    if (fd < 0) {
+        // ASharedMemory_create is API 26, above minSdk
+        using Create = int (*)(const char*, size_t);
+        static Create create = reinterpret_cast<Create>(dlsym(RTLD_DEFAULT, "ASharedMemory_create"));
+        if (create != nullptr) {
+            fd = create(name, bytes);
+        }
+    }
+    return fd;
+}
+
+inline void fill_address(const std::string& name, sockaddr_un* addr, socklen_t* len) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // Abstract namespace: a leading NUL, no file to clean up
+    size_t n = std::min(name.size(), sizeof(addr->sun_path) - 2);
+    memcpy(addr->sun_path + 1, name.data(), n);
+    *len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + n);
+}
+
+// One packet with an optional fd attached
+inline bool send_packet(int sock, const void* data, size_t bytes, int fd = -1) {
+    iovec iov{const_cast<void*>(data), bytes};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == static_cast<ssize_t>(bytes);
+}
+
+// One packet into `data`; its fd, if any, into *fd. The packet's size, or -1.
+inline ssize_t receive_packet(int sock, void* data, size_t bytes, int* fd = nullptr) {
+    iovec iov{data, bytes};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got;
+    do {
+        got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+    if (fd != nullptr) {
+        *fd = -1;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int passed = -1;
+            memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+            if (fd != nullptr && *fd < 0) {
+                *fd = passed;
+            } else {
+                close(passed);
+            }
+        }
+    }
+    return got;
+}
+
+class ModelServer {
+public:
+    // Runs one request; emit returns false once the client is gone or the
+    // server stops, and the handler should then abort. False with *error on failure.
+    using Emit = std::function<bool(const std::string&)>;
+    using Handler = std::function<bool(const Request&, const Emit&, std::string* error)>;
+
+    struct Stats {
+        uint64_t served = 0;
+        uint64_t failed = 0;
+        uint64_t cancelled = 0;  // the client left mid-response
+        uint64_t refused = 0;    // another uid, or a malformed request
+        uint64_t bytes_out = 0;
+    };
+
+    ~ModelServer() { stop(); }
+
+    bool start(const std::string& name, Handler handler, std::string* error) {
+        stop();
+        int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            *error = std::string("socket: ") + strerror(errno);
+            return false;
+        }
+        sockaddr_un addr;
+        socklen_t len;
+        fill_address(name, &addr, &len);
+        if (bind(sock, reinterpret_cast<sockaddr*>(&addr), len) != 0 || listen(sock, kBacklog) != 0) {
+            *error = std::string("bind @") + name + ": " + strerror(errno);
+            close(sock);
+            return false;
+        }
+        if (pipe2(wake_, O_CLOEXEC) != 0) {
+            *error = std::string("pipe: ") + strerror(errno);
+            close(sock);
+            return false;
+        }
+        listen_fd_ = sock;
+        handler_ = std::move(handler);
+        stopping_ = false;
+        thread_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        stopping_ = true;
+        char byte = 0;
+        ssize_t ignored = write(wake_[1], &byte, 1);
+        (void) ignored;
+        thread_.join();
+        close(listen_fd_);
+        close(wake_[0]);
+        close(wake_[1]);
+        listen_fd_ = wake_[0] = wake_[1] = -1;
+    }
+
+    bool running() const { return thread_.joinable(); }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    std::thread thread_;
+    std::atomic<bool> stopping_{true};
+    int listen_fd_ = -1;
+    int wake_[2] = {-1, -1};
+    Handler handler_;
+    std::mutex mutex_;  // guards stats_
+    Stats stats_;
+
+    void count(uint64_t Stats::*field, uint64_t n = 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.*field += n;
+    }
+
+    void run() {
+        pthread_setname_np(pthread_self(), "MlcModelServer");
+        while (!stopping_) {
+            pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_[0], POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (stopping_ || (fds[1].revents & POLLIN)) {
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                int client = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    serve(client);
+                    close(client);
+                }
+            }
+        }
+    }
+
+    void serve(int client) {
+        ucred peer{};
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 || peer.uid != getuid()) {
+            count(&Stats::refused);
+            return;
+        }
+        Request request;
+        if (!read_request(client, &request)) {
+            count(&Stats::refused);
+            return;
+        }
+        int out_fd = create_shared_memory("mlc-response", kOutputBytes);
+        if (out_fd < 0) {
+            finish(client, kStatusFailed, 0, "no shared memory for the response");
+            count(&Stats::failed);
+            return;
+        }
+        void* mapped = mmap(nullptr, kOutputBytes, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+        Frame accepted{kFrameAccepted, kStatusOk, kOutputBytes};
+        bool sent = mapped != MAP_FAILED && send_packet(client, &accepted, sizeof(accepted), out_fd);
+        close(out_fd);
+        if (!sent) {
+            if (mapped != MAP_FAILED) {
+                munmap(mapped, kOutputBytes);
+            }
+            count(&Stats::failed);
+            return;
+        }
+        char* out = static_cast<char*>(mapped);
+        size_t written = 0;
+        int32_t status = kStatusOk;
+        bool gone = false;
+        Emit emit = [&](const std::string& piece) {
+            if (gone || status != kStatusOk) {
+                return false;
+            }
+            if (stopping_) {
+                status = kStatusShutdown;
+                return false;
+            }
+            if (piece.size() > kOutputBytes - written) {
+                status = kStatusTruncated;
+                return false;
+            }
+            memcpy(out + written, piece.data(), piece.size());
+            written += piece.size();
+            Frame text{kFrameText, kStatusOk, written};
+            gone = !send_packet(client, &text, sizeof(text));
+            return !gone;
+        };
+        std::string error;
+        bool ok = false;
+        try {
+            ok = handler_(request, emit, &error);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        munmap(mapped, kOutputBytes);
+        count(&Stats::bytes_out, written);
+        if (gone) {
+            count(&Stats::cancelled);
+            return;
+        }
+        if (!ok && status == kStatusOk) {
+            status = kStatusFailed;
+        }
+        finish(client, status, written, error);
+        count(status == kStatusOk ? &Stats::served : &Stats::failed);
+    }
+
+    static bool read_request(int client, Request* request) {
+        pollfd pfd{client, POLLIN, 0};
+        if (poll(&pfd, 1, kRequestTimeoutMs) <= 0) {
+            return false;
+        }
+        RequestPacket packet;
+        int prompt_fd = -1;
+        ssize_t got = receive_packet(client, &packet, sizeof(packet), &prompt_fd);
+        bool ok = got == static_cast<ssize_t>(sizeof(packet)) && packet.magic == kMagic &&
+                  packet.version == kVersion && packet.prompt_bytes <= kMaxPromptBytes &&
+                  (packet.prompt_bytes == 0 || prompt_fd >= 0);
+        if (ok && packet.prompt_bytes > 0) {
+            // pread, not mmap: a client shrinking the region cannot fault the server
+            request->prompt.resize(packet.prompt_bytes);
+            size_t done = 0;
+            while (ok && done < request->prompt.size()) {
+                ssize_t n = pread(prompt_fd, &request->prompt[done], request->prompt.size() - done,
+                                  static_cast<off_t>(done));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                ok = n > 0;
+                done += ok ? static_cast<size_t>(n) : 0;
+            }
+        }
+        if (prompt_fd >= 0) {
+            close(prompt_fd);
+        }
+        request->max_gen_len = packet.max_gen_len;
+        request->temperature = packet.temperature;
+        return ok;
+    }
+
+    static void finish(int client, int32_t status, size_t written, const std::string& error) {
+        // The frame, then as much of the error as fits
+        char packet[sizeof(Frame) + kMaxErrorBytes];
+        Frame done{kFrameDone, status, written};
+        memcpy(packet, &done, sizeof(done));
+        size_t error_bytes = std::min(error.size(), kMaxErrorBytes);
+        memcpy(packet + sizeof(done), error.data(), error_bytes);
+        send_packet(client, packet, sizeof(done) + error_bytes);
+    }
+};
+
+/**
+ * Runs `prompt` on the server at @name, passing each new piece of the
+ * response to on_text as it arrives; on_text returning false cancels. True
+ * once the server finished the response; false with *error otherwise,
+ * including when no server is listening (the caller then loads its own).
+ */
+inline bool request(const std::string& name, const Request& request,
+                    const std::function<bool(const char*, size_t)>& on_text, std::string* error) {
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        *error = std::string("socket: ") + strerror(errno);
+        return false;
+    }
+    sockaddr_un addr;
+    socklen_t len;
+    fill_address(name, &addr, &len);
+    if (connect(sock, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        *error = "no model server at @" + name + ": " + strerror(errno);
+        close(sock);
+        return false;
+    }
+    RequestPacket packet;
+    packet.prompt_bytes = static_cast<uint32_t>(std::min(request.prompt.size(), kMaxPromptBytes));
+    packet.max_gen_len = request.max_gen_len;
+    packet.temperature = request.temperature;
+    int prompt_fd = create_shared_memory("mlc-prompt", std::max<size_t>(packet.prompt_bytes, 1));
+    bool sent = prompt_fd >= 0 &&
+                pwrite(prompt_fd, request.prompt.data(), packet.prompt_bytes, 0) ==
+                        static_cast<ssize_t>(packet.prompt_bytes) &&
+                send_packet(sock, &packet, sizeof(packet), prompt_fd);
+    if (prompt_fd >= 0) {
+        close(prompt_fd);
+    }
+    if (!sent) {
+        *error = std::string("sending the request: ") + strerror(errno);
+        close(sock);
+        return false;
+    }
+
+    const char* out = nullptr;
+    size_t capacity = 0;
+    size_t seen = 0;
+    bool ok = false;
+    *error = "connection closed by the server";
+    char buffer[sizeof(Frame) + kMaxErrorBytes];
+    while (true) {
+        int fd = -1;
+        ssize_t got = receive_packet(sock, buffer, sizeof(buffer), &fd);
+        if (got < static_cast<ssize_t>(sizeof(Frame))) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        Frame frame;
+        memcpy(&frame, buffer, sizeof(frame));
+        if (frame.kind == kFrameAccepted) {
+            if (fd < 0 || out != nullptr) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                *error = "malformed response";
+                break;
+            }
+            void* mapped = mmap(nullptr, frame.value, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) {
+                *error = std::string("mapping the response: ") + strerror(errno);
+                break;
+            }
+            out = static_cast<const char*>(mapped);
+            capacity = frame.value;
+            continue;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        size_t end = std::min<size_t>(frame.value, capacity);
+        if (out == nullptr || end < seen) {
+            *error = "malformed response";
+            break;
+        }
+        if (end > seen && !on_text(out + seen, end - seen)) {
+            *error = "cancelled";
+            break;
+        }
+        seen = end;
+        if (frame.kind == kFrameDone) {
+            ok = frame.status == kStatusOk;
+            if (ok) {
+                error->clear();
+            } else if (frame.status == kStatusFailed) {
+                *error = std::string(buffer + sizeof(Frame), static_cast<size_t>(got) - sizeof(Frame));
+            } else if (frame.status == kStatusTruncated) {
+                *error = "response truncated";
+            } else if (frame.status == kStatusShutdown) {
+                *error = "model server stopped";
+            }
+            break;
+        }
+    }
+    if (out != nullptr) {
+        munmap(const_cast<char*>(out), capacity);
+    }
+    close(sock);
+    return ok;
+}
+
+}  // namespace model_server
@@ -0,0 +1,156 @@
+#pragma once
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+
+#include "trace_context.h"
+
+/**
+ * Log macros with a compile-time level, shared by the native libraries.
+ *
+ * A call below NATIVE_LOG_LEVEL expands to nothing: its arguments are never
+ * evaluated, so nothing is formatted or sent to logd. Release builds (NDEBUG,
+ * set by CMake for Release and RelWithDebInfo) keep INFO and up; debug builds
+ * keep everything. Override with -DNATIVE_LOG_LEVEL=<n> to go quieter or louder.
+ *
+ *   NLOGV  user text: prompts, responses, OCR output. Debug builds only, so a
+ *          release build never writes what the student typed to the system log.
+ *   NLOGD  per-call tracing ("generate called")
+ *   NLOGI / NLOGW / NLOGE  as usual
+ *
+ * Each file keeps its short LOGI/LOGE names, defined over these with its tag.
+ * Lines that would repeat on every request go through NLOG_EVERY_MS, which
+ * drops the ones that come sooner than its interval after the last one logged
+ * from the same call site.
+ *
+ * A line logged while the thread works for a traced request starts with
+ * "[trace <id>] " (trace_context.h), so logcat can be grepped for one request.
+ *
+ * Host builds (Linux, for llm_bench on a workstation; see CMakeLists.txt) have
+ * no logd: the same lines go to stderr as "I/TAG: message".
+ */
+#define NATIVE_LOG_VERBOSE 0
+#define NATIVE_LOG_DEBUG 1
+#define NATIVE_LOG_INFO 2
+#define NATIVE_LOG_WARN 3
+#define NATIVE_LOG_ERROR 4
+
+#ifndef NATIVE_LOG_LEVEL
+#ifdef NDEBUG
+#define NATIVE_LOG_LEVEL NATIVE_LOG_INFO
+#else
+#define NATIVE_LOG_LEVEL NATIVE_LOG_VERBOSE
+#endif
+#endif
+
+#ifdef __ANDROID__
+namespace native_log {
+
+inline void android_print(int priority, const char* tag, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+inline void android_print(int priority, const char* tag, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int64_t trace = trace_context::current();
+    if (trace == 0) {
+        __android_log_vprint(priority, tag, format, args);
+    } else {
+        char line[1024];
+        int prefix = snprintf(line, sizeof(line), "[trace %lld] ", static_cast<long long>(trace));
+        vsnprintf(line + prefix, sizeof(line) - prefix, format, args);
+        __android_log_write(priority, tag, line);
+    }
+    va_end(args);
+}
+
+}  // namespace native_log
+
+#define NATIVE_LOG_PRINT(priority, tag, ...) native_log::android_print(priority, tag, __VA_ARGS__)
+#else
+enum {
+    ANDROID_LOG_VERBOSE = 2,
+    ANDROID_LOG_DEBUG = 3,
+    ANDROID_LOG_INFO = 4,
+    ANDROID_LOG_WARN = 5,
+    ANDROID_LOG_ERROR = 6,
+};
+
+namespace native_log {
+
+inline void host_print(int priority, const char* tag, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+inline void host_print(int priority, const char* tag, const char* format, ...) {
+    static const char kLetters[] = "??VDIWE";
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    char letter = priority >= 0 && priority < static_cast<int>(sizeof(kLetters)) - 1 ? kLetters[priority] : '?';
+    int64_t trace = trace_context::current();
+    if (trace != 0) {
+        fprintf(stderr, "%c/%s: [trace %lld] %s\n", letter, tag, static_cast<long long>(trace), line);
+    } else {
+        fprintf(stderr, "%c/%s: %s\n", letter, tag, line);
+    }
+}
+
+}  // namespace native_log
+
+#define NATIVE_LOG_PRINT(priority, tag, ...) native_log::host_print(priority, tag, __VA_ARGS__)
+#endif
+
+#if NATIVE_LOG_LEVEL <= NATIVE_LOG_VERBOSE
+#define NLOGV(tag, ...) NATIVE_LOG_PRINT(ANDROID_LOG_VERBOSE, tag, __VA_ARGS__)
+#else
+#define NLOGV(tag, ...) ((void)0)
+#endif
+
+#if NATIVE_LOG_LEVEL <= NATIVE_LOG_DEBUG
+#define NLOGD(tag, ...) NATIVE_LOG_PRINT(ANDROID_LOG_DEBUG, tag, __VA_ARGS__)
+#else
+#define NLOGD(tag, ...) ((void)0)
+#endif
+
+#if NATIVE_LOG_LEVEL <= NATIVE_LOG_INFO
+#define NLOGI(tag, ...) NATIVE_LOG_PRINT(ANDROID_LOG_INFO, tag, __VA_ARGS__)
+#else
+#define NLOGI(tag, ...) ((void)0)
+#endif
+
+#if NATIVE_LOG_LEVEL <= NATIVE_LOG_WARN
+#define NLOGW(tag, ...) NATIVE_LOG_PRINT(ANDROID_LOG_WARN, tag, __VA_ARGS__)
+#else
+#define NLOGW(tag, ...) ((void)0)
+#endif
+
+#define NLOGE(tag, ...) NATIVE_LOG_PRINT(ANDROID_LOG_ERROR, tag, __VA_ARGS__)
+
+namespace native_log {
+
+// True at most once per `interval_ms` for the call site owning `last`
+inline bool due(std::atomic<int64_t>& last, int64_t interval_ms) {
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t previous = last.load(std::memory_order_relaxed);
+    return (previous == 0 || now - previous >= interval_ms) &&
+           last.compare_exchange_strong(previous, now, std::memory_order_relaxed);
+}
+
+}  // namespace native_log
+
+// `log(...)` (e.g. LOGI) when this call site last logged at least `interval_ms` ago
+#define NLOG_EVERY_MS(interval_ms, log, ...)                                  \
+    do {                                                                      \
+        static std::atomic<int64_t> native_log_last_{0};                      \
+        if (native_log::due(native_log_last_, (interval_ms))) {               \
+            log(__VA_ARGS__);                                                 \
+        }                                                                     \
+    } while (0)
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifdef __ANDROID__
+#include <android/trace.h>
+#else
+// Host builds have no atrace; sections still reach the flight recorder
+inline bool ATrace_isEnabled() { return false; }
+inline void ATrace_beginSection(const char*) {}
+inline void ATrace_endSection() {}
+#endif
+
+#include <atomic>
+#include <cstdio>
+
+#include "flight_recorder.h"
+#include "trace_context.h"
+
+/**
+ * Android trace sections around the native hot paths, so model loading,
+ * prefill chunks, decode steps, sampling, detokenization and JNI delivery
+ * line up with UI frames in one Perfetto / systrace capture.
+ *
+ * Always compiled in, off until setNativeTracing(true): a disabled section
+ * costs one relaxed atomic load besides the flight recorder's two clock
+ * reads. While on, sections are still skipped unless
+ * a trace is actually being recorded (ATrace_isEnabled). Names use an "mlc:"
+ * prefix so they filter together in the trace UI. Each library has its own
+ * switch.
+ *
+ * Every section also lands in the flight recorder (flight_recorder.h) with its
+ * start and duration, whether or not tracing is on, so a dump after a slow
+ * request shows which stage took the time, and each thread's innermost open
+ * section is its current stage for the stall watchdog. Sections run for a
+ * traced request (trace_context.h) carry its id: as " trace=<id>" after the
+ * atrace name, and in the flight recorder event.
+ */
+inline std::atomic<bool>& native_trace_flag() {
+    static std::atomic<bool> flag{false};
+    return flag;
+}
+
+inline void set_native_tracing(bool enabled) {
+    native_trace_flag().store(enabled, std::memory_order_relaxed);
+}
+
+// One section for the enclosing scope; sections on a thread must nest
+class TraceSection {
+public:
+    // `name` must outlive the process (a literal): the flight recorder keeps the pointer
+    explicit TraceSection(const char* name)
+        : name_(name), start_ns_(flight::now_ns()),
+          active_(native_trace_flag().load(std::memory_order_relaxed) && ATrace_isEnabled()) {
+        outer_ = flight::recorder().enter(name, start_ns_, &outer_ns_);
+        if (active_) {
+            // atrace copies the name, so a traced request's sections carry its id
+            int64_t trace = trace_context::current();
+            if (trace != 0) {
+                char traced[128];
+                snprintf(traced, sizeof(traced), "%s trace=%lld", name, static_cast<long long>(trace));
+                ATrace_beginSection(traced);
+            } else {
+                ATrace_beginSection(name);
+            }
+        }
+    }
+
+    ~TraceSection() {
+        if (active_) {
+            ATrace_endSection();
+        }
+        flight::recorder().leave(outer_, outer_ns_);
+        flight::recorder().record(flight::kEventSpan, name_, static_cast<int64_t>(flight::now_ns() - start_ns_),
+                                  trace_context::current(), start_ns_);
+    }
+
+    TraceSection(const TraceSection&) = delete;
+    TraceSection& operator=(const TraceSection&) = delete;
+
+private:
+    const char* name_;
+    uint64_t start_ns_;
+    bool active_;
+    const char* outer_ = nullptr;  // the section this one is nested in, restored on exit
+    uint64_t outer_ns_ = 0;
+};
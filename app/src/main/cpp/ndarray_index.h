@@ -0,0 +1,345 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <tvm/runtime/relax_vm/ndarray_cache_support.h>
+
+/**
+ * ndarray-cache.json as a binary table, so a load maps one file instead of
+ * parsing a few hundred KB of JSON.
+ *
+ * The first load converts the JSON into ndarray-cache.idx next to it; later
+ * loads map that and check it: the JSON's size and mtime must still be the
+ * ones recorded (otherwise it is rebuilt) and the table must match its FNV-1a
+ * checksum. The table also keeps the JSON's own hash, which names the repacked
+ * cache (see ndarray_mmap_loader.h), so that no longer reads the JSON either.
+ *
+ *   Header | FileEntry[files] | ParamEntry[params] | uint32 bucket[buckets]
+ *          | int64 shape[shapes] | strings
+ *
+ * Buckets are an open-addressing table of param index + 1 (0: empty) by name
+ * hash, for find() in O(1).
+ */
+namespace ndarray_index {
+
+static constexpr const char* kJsonName = "ndarray-cache.json";
+static constexpr const char* kFileName = "ndarray-cache.idx";
+static constexpr uint32_t kMagic = 0x58444e53;  // "SNDX"
+static constexpr uint32_t kVersion = 1;
+
+// The seed repacked_dir() has always hashed the JSON with, so cache names stay put
+static constexpr uint64_t kJsonHashSeed = 1469598103934665603ull;
+static constexpr uint64_t kHashSeed = 14695981039346656037ull;
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t json_size;
+    int64_t json_mtime;  // ns
+    uint64_t json_hash;
+    uint32_t file_count;
+    uint32_t param_count;
+    uint32_t bucket_count;  // power of two
+    uint32_t shape_count;
+    uint64_t string_bytes;
+    uint64_t checksum;  // of everything after the header
+};
+
+// Strings are (offset, length) into the string area
+struct FileEntry {
+    uint32_t path, path_len;
+    uint32_t format, format_len;
+    int64_t nbytes;
+    uint32_t first_param;
+    uint32_t param_count;
+};
+
+struct ParamEntry {
+    uint64_t name_hash;
+    uint32_t name, name_len;
+    uint32_t format, format_len;
+    int64_t nbytes;
+    int64_t byte_offset;
+    uint32_t shape;  // first dim in the shape area
+    uint32_t ndim;
+    uint8_t dtype_code;
+    uint8_t dtype_bits;
+    uint16_t dtype_lanes;
+    uint32_t file;
+};
+
+static_assert(sizeof(Header) % 8 == 0 && sizeof(FileEntry) % 8 == 0 && sizeof(ParamEntry) % 8 == 0,
+              "index entries keep the int64 areas aligned");
+
+inline bool json_stat(const std::string& dir, uint64_t* size, int64_t* mtime) {
+    struct stat st;
+    if (stat((dir + "/" + kJsonName).c_str(), &st) != 0) {
+        return false;
+    }
+    *size = static_cast<uint64_t>(st.st_size);
+    *mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// Converts `dir`/ndarray-cache.json and writes the table next to it
+inline bool build(const std::string& dir) {
+    uint64_t json_size = 0;
+    int64_t json_mtime = 0;
+    if (!json_stat(dir, &json_size, &json_mtime)) {
+        return false;
+    }
+    // Read once for its hash; TVM parses it from the file
+    std::ifstream in(dir + "/" + kJsonName, std::ios::binary);
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    using tvm::runtime::relax_vm::NDArrayCacheMetadata;
+    NDArrayCacheMetadata metadata = NDArrayCacheMetadata::Load(dir);
+
+    std::vector<FileEntry> files;
+    std::vector<ParamEntry> params;
+    std::vector<int64_t> shapes;
+    std::string strings;
+    auto add_string = [&strings](const std::string& s, uint32_t* offset, uint32_t* length) {
+        *offset = static_cast<uint32_t>(strings.size());
+        *length = static_cast<uint32_t>(s.size());
+        strings += s;
+    };
+    for (const auto& file : metadata.records) {
+        FileEntry entry{};
+        add_string(file.data_path, &entry.path, &entry.path_len);
+        add_string(file.format, &entry.format, &entry.format_len);
+        entry.nbytes = file.nbytes;
+        entry.first_param = static_cast<uint32_t>(params.size());
+        entry.param_count = static_cast<uint32_t>(file.records.size());
+        for (const auto& param : file.records) {
+            ParamEntry p{};
+            p.name_hash = fnv1a(param.name.data(), param.name.size(), kHashSeed);
+            add_string(param.name, &p.name, &p.name_len);
+            add_string(param.format, &p.format, &p.format_len);
+            p.nbytes = param.nbytes;
+            p.byte_offset = param.byte_offset;
+            p.shape = static_cast<uint32_t>(shapes.size());
+            p.ndim = static_cast<uint32_t>(param.shape.size());
+            shapes.insert(shapes.end(), param.shape.begin(), param.shape.end());
+            p.dtype_code = static_cast<uint8_t>(param.dtype.code());
+            p.dtype_bits = static_cast<uint8_t>(param.dtype.bits());
+            p.dtype_lanes = static_cast<uint16_t>(param.dtype.lanes());
+            p.file = static_cast<uint32_t>(files.size());
+            params.push_back(p);
+        }
+        files.push_back(entry);
+    }
+
+    uint32_t bucket_count = 2;
+    while (bucket_count < params.size() * 2) {
+        bucket_count *= 2;
+    }
+    std::vector<uint32_t> buckets(bucket_count, 0);
+    for (size_t i = 0; i < params.size(); ++i) {
+        uint32_t slot = static_cast<uint32_t>(params[i].name_hash) & (bucket_count - 1);
+        while (buckets[slot] != 0) {
+            slot = (slot + 1) & (bucket_count - 1);
+        }
+        buckets[slot] = static_cast<uint32_t>(i + 1);
+    }
+
+    std::string body;
+    body.append(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(FileEntry));
+    body.append(reinterpret_cast<const char*>(params.data()), params.size() * sizeof(ParamEntry));
+    body.append(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(uint32_t));
+    body.append(reinterpret_cast<const char*>(shapes.data()), shapes.size() * sizeof(int64_t));
+    body += strings;
+
+    Header header{};
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.json_size = json_size;
+    header.json_mtime = json_mtime;
+    header.json_hash = fnv1a(json.data(), json.size(), kJsonHashSeed);
+    header.file_count = static_cast<uint32_t>(files.size());
+    header.param_count = static_cast<uint32_t>(params.size());
+    header.bucket_count = bucket_count;
+    header.shape_count = static_cast<uint32_t>(shapes.size());
+    header.string_bytes = strings.size();
+    header.checksum = fnv1a(body.data(), body.size(), kHashSeed);
+
+    std::string path = dir + "/" + kFileName;
+    std::string tmp = path + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (out == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 && fwrite(body.data(), 1, body.size(), out) == body.size();
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A mapped, checked table
+class Index {
+public:
+    // The table of `dir` if it is current and intact; null otherwise
+    static std::unique_ptr<Index> open(const std::string& dir) {
+        uint64_t json_size = 0;
+        int64_t json_mtime = 0;
+        if (!json_stat(dir, &json_size, &json_mtime)) {
+            return nullptr;
+        }
+        int fd = ::open((dir + "/" + kFileName).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        void* addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+            addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        std::unique_ptr<Index> index(new Index(addr, static_cast<size_t>(st.st_size)));
+        return index->valid(json_size, json_mtime) ? std::move(index) : nullptr;
+    }
+
+    // The current table of `dir`, built from the JSON first if it is missing or stale
+    static std::unique_ptr<Index> load(const std::string& dir) {
+        std::unique_ptr<Index> index = open(dir);
+        if (index == nullptr && build(dir)) {
+            index = open(dir);
+        }
+        return index;
+    }
+
+    ~Index() { munmap(addr_, size_); }
+    Index(const Index&) = delete;
+    Index& operator=(const Index&) = delete;
+
+    uint64_t json_hash() const { return header().json_hash; }
+    size_t param_count() const { return header().param_count; }
+
+    // The param called `name`, or null
+    const ParamEntry* find(std::string_view name) const {
+        uint64_t hash = fnv1a(name.data(), name.size(), kHashSeed);
+        uint32_t mask = header().bucket_count - 1;
+        for (uint32_t slot = static_cast<uint32_t>(hash) & mask;; slot = (slot + 1) & mask) {
+            uint32_t entry = buckets()[slot];
+            if (entry == 0) {
+                return nullptr;
+            }
+            const ParamEntry& param = params()[entry - 1];
+            if (param.name_hash == hash && str(param.name, param.name_len) == name) {
+                return &param;
+            }
+        }
+    }
+
+    std::string_view name(const ParamEntry& param) const { return str(param.name, param.name_len); }
+
+    // The table as TVM's metadata, for the shard loaders
+    tvm::runtime::relax_vm::NDArrayCacheMetadata metadata(const std::string& dir) const {
+        tvm::runtime::relax_vm::NDArrayCacheMetadata metadata;
+        metadata.path = dir;
+        const Header& h = header();
+        metadata.records.resize(h.file_count);
+        for (uint32_t f = 0; f < h.file_count; ++f) {
+            const FileEntry& file = files()[f];
+            auto& record = metadata.records[f];
+            record.data_path = std::string(str(file.path, file.path_len));
+            record.format = std::string(str(file.format, file.format_len));
+            record.nbytes = file.nbytes;
+            record.records.resize(file.param_count);
+            for (uint32_t i = 0; i < file.param_count; ++i) {
+                const ParamEntry& param = params()[file.first_param + i];
+                auto& out = record.records[i];
+                out.name = std::string(str(param.name, param.name_len));
+                out.shape = tvm::runtime::ShapeTuple(shapes() + param.shape, shapes() + param.shape + param.ndim);
+                out.dtype = tvm::runtime::DataType(param.dtype_code, param.dtype_bits, param.dtype_lanes);
+                out.format = std::string(str(param.format, param.format_len));
+                out.nbytes = param.nbytes;
+                out.byte_offset = param.byte_offset;
+            }
+        }
+        return metadata;
+    }
+
+private:
+    void* addr_;
+    size_t size_;
+
+    Index(void* addr, size_t size) : addr_(addr), size_(size) {}
+
+    const uint8_t* base() const { return static_cast<const uint8_t*>(addr_); }
+    const Header& header() const { return *reinterpret_cast<const Header*>(base()); }
+    const FileEntry* files() const { return reinterpret_cast<const FileEntry*>(base() + sizeof(Header)); }
+    const ParamEntry* params() const {
+        return reinterpret_cast<const ParamEntry*>(files() + header().file_count);
+    }
+    const uint32_t* buckets() const { return reinterpret_cast<const uint32_t*>(params() + header().param_count); }
+    const int64_t* shapes() const { return reinterpret_cast<const int64_t*>(buckets() + header().bucket_count); }
+    const char* strings() const { return reinterpret_cast<const char*>(shapes() + header().shape_count); }
+
+    std::string_view str(uint32_t offset, uint32_t length) const { return std::string_view(strings() + offset, length); }
+
+    bool valid(uint64_t json_size, int64_t json_mtime) const {
+        const Header& h = header();
+        if (h.magic != kMagic || h.version != kVersion || h.json_size != json_size || h.json_mtime != json_mtime ||
+            h.bucket_count <= h.param_count || (h.bucket_count & (h.bucket_count - 1)) != 0) {
+            return false;
+        }
+        uint64_t body = uint64_t(h.file_count) * sizeof(FileEntry) + uint64_t(h.param_count) * sizeof(ParamEntry) +
+                        uint64_t(h.bucket_count) * sizeof(uint32_t) + uint64_t(h.shape_count) * sizeof(int64_t) +
+                        h.string_bytes;
+        if (sizeof(Header) + body != size_ || fnv1a(base() + sizeof(Header), body, kHashSeed) != h.checksum) {
+            return false;
+        }
+        // Offsets inside the areas they point into, so a reader never leaves the mapping
+        for (uint32_t f = 0; f < h.file_count; ++f) {
+            const FileEntry& file = files()[f];
+            if (uint64_t(file.path) + file.path_len > h.string_bytes ||
+                uint64_t(file.format) + file.format_len > h.string_bytes ||
+                uint64_t(file.first_param) + file.param_count > h.param_count) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < h.param_count; ++i) {
+            const ParamEntry& param = params()[i];
+            if (uint64_t(param.name) + param.name_len > h.string_bytes ||
+                uint64_t(param.format) + param.format_len > h.string_bytes ||
+                uint64_t(param.shape) + param.ndim > h.shape_count) {
+                return false;
+            }
+        }
+        for (uint32_t slot = 0; slot < h.bucket_count; ++slot) {
+            if (buckets()[slot] > h.param_count) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}  // namespace ndarray_index
@@ -0,0 +1,1230 @@
+#include "ndarray_mmap_loader.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <tvm/runtime/device_api.h>
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/registry.h>
+#include <tvm/runtime/relax_vm/ndarray_cache_support.h>
+
+#include "compressed_shard.h"
+#include "layer_pager.h"
+#include "ndarray_index.h"
+#include "requantize.h"
+#include "shard_pack.h"
+#include "startup_timeline.h"
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("MMAP_LOADER", __VA_ARGS__)
+#define LOGE(...) NLOGE("MMAP_LOADER", __VA_ARGS__)
+
+using tvm::runtime::NDArray;
+using tvm::runtime::relax_vm::NDArrayCacheMetadata;
+
+namespace mmap_loader {
+
+namespace {
+
+// A read-only mapping of one shard, or of a whole pack (shard_pack.h) whose
+// shards are views into it, or anonymous memory a compressed shard was decoded
+// into (compressed_shard.h). Zero-copy NDArrays keep it alive through their
+// DLPack deleter, so the pages stay mapped for as long as a weight uses them.
+class MappedShard {
+public:
+    static std::shared_ptr<MappedShard> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOGE("Failed to open shard %s", path.c_str());
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            LOGE("Failed to stat shard %s", path.c_str());
+            ::close(fd);
+            return nullptr;
+        }
+        // Larger readahead windows for the load, which reads every shard front to back
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            LOGE("Failed to mmap shard %s", path.c_str());
+            return nullptr;
+        }
+        return std::shared_ptr<MappedShard>(new MappedShard(addr, static_cast<size_t>(st.st_size), nullptr));
+    }
+
+    // `size` zeroed, page-aligned bytes to decode a shard into
+    static std::shared_ptr<MappedShard> anonymous(size_t size) {
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            LOGE("Failed to map %zu bytes for a decoded shard", size);
+            return nullptr;
+        }
+        auto shard = std::shared_ptr<MappedShard>(new MappedShard(addr, size, nullptr));
+        shard->file_backed_ = false;
+        return shard;
+    }
+
+    // `size` bytes of `whole` from a page-aligned `offset`, kept mapped by the view
+    static std::shared_ptr<MappedShard> view(const std::shared_ptr<MappedShard>& whole, size_t offset, size_t size) {
+        if (offset + size > whole->size_) {
+            return nullptr;
+        }
+        return std::shared_ptr<MappedShard>(new MappedShard(static_cast<uint8_t*>(whole->addr_) + offset, size, whole));
+    }
+
+    ~MappedShard() {
+        if (parent_ == nullptr) {
+            munmap(addr_, size_);
+        }
+    }
+
+    const uint8_t* data() const { return static_cast<const uint8_t*>(addr_); }
+    uint8_t* mutable_data() { return static_cast<uint8_t*>(addr_); }
+    size_t size() const { return size_; }
+    // Dropped pages read back from the file; anonymous ones would come back zeroed
+    bool file_backed() const { return file_backed_; }
+
+    void advise(int advice) {
+        madvise(addr_, size_, advice);
+    }
+
+    // Whole pages covering [offset, offset + bytes)
+    void advise(size_t offset, size_t bytes, int advice) {
+        size_t begin = page_floor(offset);
+        madvise(static_cast<uint8_t*>(addr_) + begin, page_floor(offset + bytes + page_size() - 1) - begin, advice);
+    }
+
+    bool lock(size_t offset, size_t bytes) {
+        size_t begin = page_floor(offset);
+        return mlock(static_cast<uint8_t*>(addr_) + begin, page_floor(offset + bytes + page_size() - 1) - begin) == 0;
+    }
+
+    // Read one byte per page so the kernel pulls the whole shard into page cache
+    void touch() const {
+        const long page = sysconf(_SC_PAGESIZE);
+        volatile uint8_t sink = 0;
+        for (size_t off = 0; off < size_; off += static_cast<size_t>(page)) {
+            sink ^= data()[off];
+        }
+        (void)sink;
+    }
+
+private:
+    void* addr_;
+    size_t size_;
+    std::shared_ptr<MappedShard> parent_;  // the pack a view points into
+    bool file_backed_ = true;
+
+    MappedShard(void* addr, size_t size, std::shared_ptr<MappedShard> parent)
+        : addr_(addr), size_(size), parent_(std::move(parent)) {}
+
+    static size_t page_size() {
+        static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return page;
+    }
+
+    static size_t page_floor(size_t offset) { return offset / page_size() * page_size(); }
+};
+
+// DLPack context for an NDArray that points into a MappedShard
+struct MappedTensorContext {
+    DLManagedTensor managed;
+    std::vector<int64_t> shape;
+    std::shared_ptr<MappedShard> shard;
+};
+
+void delete_mapped_tensor(DLManagedTensor* tensor) {
+    delete static_cast<MappedTensorContext*>(tensor->manager_ctx);
+}
+
+NDArray wrap_mapped(const NDArrayCacheMetadata::FileRecord::ParamRecord& param,
+                    const std::shared_ptr<MappedShard>& shard) {
+    auto* ctx = new MappedTensorContext();
+    ctx->shape.assign(param.shape.begin(), param.shape.end());
+    ctx->shard = shard;
+
+    DLTensor& t = ctx->managed.dl_tensor;
+    t.data = const_cast<uint8_t*>(shard->data() + param.byte_offset);
+    t.device = DLDevice{kDLCPU, 0};
+    t.ndim = static_cast<int32_t>(ctx->shape.size());
+    t.dtype = param.dtype;
+    t.shape = ctx->shape.data();
+    t.strides = nullptr;
+    t.byte_offset = 0;
+    ctx->managed.manager_ctx = ctx;
+    ctx->managed.deleter = delete_mapped_tensor;
+    return NDArray::FromDLPack(&ctx->managed);
+}
+
+bool can_wrap_in_place(const NDArrayCacheMetadata::FileRecord::ParamRecord& param, DLDevice device) {
+    // mmap returns page-aligned memory, so only the param offset decides alignment
+    return device.device_type == kDLCPU && param.format == "raw" &&
+           param.byte_offset % tvm::runtime::kAllocAlignment == 0;
+}
+
+NDArray load_param(const NDArrayCacheMetadata::FileRecord::ParamRecord& param,
+                   const std::shared_ptr<MappedShard>& shard, DLDevice device,
+                   tvm::runtime::Optional<NDArray>* staging) {
+    if (can_wrap_in_place(param, device)) {
+        return wrap_mapped(param, shard);
+    }
+    const uint8_t* src = shard->data() + param.byte_offset;
+    if (param.format == "raw") {
+        NDArray arr = NDArray::Empty(param.shape, param.dtype, device);
+        arr.CopyFromBytes(src, static_cast<size_t>(param.nbytes));
+        return arr;
+    }
+    // Encoded formats (e.g. f32-to-bf16) need TVM's decoder; hand it just this param
+    NDArrayCacheMetadata::FileRecord::ParamRecord local = param;
+    local.byte_offset = 0;
+    std::string raw(reinterpret_cast<const char*>(src), static_cast<size_t>(param.nbytes));
+    return local.Load(device, &raw, staging);
+}
+
+// Steady-state access hints for weights read in place. Decode reads every
+// dense weight once per token, in the same order, so those get MADV_NORMAL
+// (undoing the load's MADV_SEQUENTIAL, which drops pages behind the reader)
+// plus WILLNEED. An embedding table that is only gathered one row per token
+// gets MADV_RANDOM, which keeps readahead from pulling neighbouring rows into
+// page cache; a tied one (see TiedParams) is also the LM head, read whole
+// every step, and is hinted like the dense weights.
+//
+// Tensors under kHotTensorBytes (norms, biases, scales) are touched by every
+// layer of every step and can be pinned with mlock when set_lock_hot_tensors()
+// asks for it, up to kLockBudgetBytes and RLIMIT_MEMLOCK. Never mlockall: it
+// pins ART's JIT code cache as well and breaks the runtime's JIT profile
+// writes ("Failed to write jitted method info in log").
+constexpr size_t kHotTensorBytes = 256 << 10;
+constexpr size_t kLockBudgetBytes = 16 << 20;
+
+std::atomic<bool> g_lock_hot_tensors{false};
+std::atomic<size_t> g_locked_bytes{0};
+std::atomic<int> g_requantized_scheme{-1};
+
+bool embedding_param(const std::string& name) {
+    return name.find("embed_tokens") != std::string::npos || name.find("wte") != std::string::npos;
+}
+
+size_t lock_budget() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return kLockBudgetBytes;
+    }
+    return std::min(kLockBudgetBytes, static_cast<size_t>(limit.rlim_cur));
+}
+
+// `paged`: the layer pager (layer_pager.h) owns the layer weights' residency;
+// `tied`: the embedding table is the LM head as well
+void hint_steady_state(const NDArrayCacheMetadata::FileRecord::ParamRecord& param, MappedShard& shard,
+                       bool paged, bool tied, size_t* locked) {
+    size_t offset = static_cast<size_t>(param.byte_offset);
+    size_t bytes = static_cast<size_t>(param.nbytes);
+    if (embedding_param(param.name) && !tied) {
+        shard.advise(offset, bytes, MADV_RANDOM);
+        return;
+    }
+    if (paged && layer_pager::layer_of(param.name) >= 0) {
+        return;  // locked pages could not be dropped per pass
+    }
+    shard.advise(offset, bytes, MADV_NORMAL);
+    shard.advise(offset, bytes, MADV_WILLNEED);
+    if (g_lock_hot_tensors.load() && bytes <= kHotTensorBytes && *locked + bytes <= lock_budget()) {
+        if (shard.lock(offset, bytes)) {
+            *locked += bytes;
+        }
+    }
+}
+
+bool head_param(const std::string& name) {
+    return name.compare(0, 8, "lm_head.") == 0 || name.find(".lm_head.") != std::string::npos;
+}
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// A shard that has been mapped, validated and (for device uploads) faulted in
+struct PreparedShard {
+    size_t index = 0;
+    std::shared_ptr<MappedShard> shard;  // null if the read stage failed
+    // The read, for the startup timeline
+    Clock::time_point read_start;
+    double read_ms = 0.0;
+    startup::Counters read_cost;  // the worker's own
+};
+
+// A shard's read on its worker and its upload here, as phases of a launch in progress
+void record_shard(const PreparedShard& prepared, const std::string& path, Clock::time_point upload_start,
+                  const startup::Counters& upload_before) {
+    startup::Timeline& timeline = startup::timeline();
+    if (!timeline.open()) {
+        return;
+    }
+    startup::Counters upload_after = startup::thread_counters();
+    startup::PhaseRecord read;
+    read.name = "shard_read:" + path;
+    read.start_ms = timeline.elapsed_ms(prepared.read_start);
+    read.wall_ms = prepared.read_ms;
+    read.cpu_ms = prepared.read_cost.cpu_us * 1e-3;
+    read.read_bytes = prepared.shard->size();
+    read.major_faults = prepared.read_cost.major_faults;
+    timeline.add(std::move(read));
+    startup::PhaseRecord upload;
+    upload.name = "shard_upload:" + path;
+    upload.start_ms = timeline.elapsed_ms(upload_start);
+    upload.wall_ms = elapsed_ms(upload_start);
+    upload.cpu_ms = (upload_after.cpu_us - upload_before.cpu_us) * 1e-3;
+    upload.major_faults = upload_after.major_faults - upload_before.major_faults;
+    timeline.add(std::move(upload));
+}
+
+// FNV-1a of `dir`/ndarray-cache.json, which names its repacked cache and ties a
+// pack to it; kept by the binary index, so only a missing index reads the JSON
+uint64_t json_hash(const std::string& dir) {
+    std::unique_ptr<ndarray_index::Index> index = ndarray_index::Index::load(dir);
+    if (index != nullptr) {
+        return index->json_hash();
+    }
+    std::ifstream in(dir + "/ndarray-cache.json", std::ios::binary);
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return ndarray_index::fnv1a(json.data(), json.size(), ndarray_index::kJsonHashSeed);
+}
+
+// Where a directory's shards are read from: its pack when there is a current
+// one, mapped once with every shard a view into it, otherwise one file each,
+// decoded from <shard>.zblk when only the compressed form is present
+class ShardFiles {
+public:
+    explicit ShardFiles(const std::string& dir) : dir_(dir), pack_(shard_pack::Pack::open(dir, json_hash(dir))) {
+        if (!pack_.empty()) {
+            whole_ = MappedShard::open(pack_.path());
+        }
+    }
+
+    bool packed() const { return whole_ != nullptr; }
+
+    // `decode_threads`: cores a compressed shard's blocks are spread over
+    std::shared_ptr<MappedShard> open(const std::string& data_path, unsigned decode_threads = 1) const {
+        if (whole_ == nullptr) {
+            std::string path = dir_ + "/" + data_path;
+            if (access(path.c_str(), F_OK) != 0 && access((path + compressed_shard::kSuffix).c_str(), F_OK) == 0) {
+                return decode(path + compressed_shard::kSuffix, decode_threads);
+            }
+            return MappedShard::open(path);
+        }
+        const shard_pack::Entry* entry = pack_.find(data_path);
+        if (entry == nullptr) {
+            LOGE("Shard %s is not in %s", data_path.c_str(), pack_.path().c_str());
+            return nullptr;
+        }
+        return MappedShard::view(whole_, static_cast<size_t>(entry->offset), static_cast<size_t>(entry->nbytes));
+    }
+
+private:
+    std::string dir_;
+    shard_pack::Pack pack_;
+    std::shared_ptr<MappedShard> whole_;
+
+    static std::shared_ptr<MappedShard> decode(const std::string& path, unsigned threads) {
+        auto compressed = MappedShard::open(path);
+        if (!compressed) {
+            return nullptr;
+        }
+        uint64_t raw = compressed_shard::raw_size(compressed->data(), compressed->size());
+        auto shard = raw > 0 ? MappedShard::anonymous(static_cast<size_t>(raw)) : nullptr;
+        if (!shard || !compressed_shard::decode(compressed->data(), compressed->size(), shard->mutable_data(), threads)) {
+            LOGE("Failed to decode compressed shard %s", path.c_str());
+            return nullptr;
+        }
+        // The compressed pages are done with; the decoded ones are read like a shard file's
+        compressed->advise(MADV_DONTNEED);
+        return shard;
+    }
+};
+
+// Gemma ties the LM head to the embedding table. When the model's graph reads
+// the embedding params for both there is nothing to do but hint the table as
+// the dense weight it then is. Some exports write the table a second time as
+// lm_head.*; such a param is compared byte for byte with the embedding param
+// of the same suffix once, the result kept in ndarray-cache.ties (named by the
+// index's JSON hash), and loads register the embedding's array under both
+// names, so one mapped copy, or one upload, serves both roles.
+class TiedParams {
+public:
+    static constexpr const char* kFileName = "ndarray-cache.ties";
+
+    TiedParams(const std::string& dir, const NDArrayCacheMetadata& metadata, const ShardFiles& files) {
+        bool heads = false;
+        for (const auto& file : metadata.records) {
+            for (const auto& param : file.records) {
+                heads = heads || head_param(param.name);
+            }
+        }
+        if (!heads) {
+            embedding_is_head_ = true;  // the graph reads the table for the head
+            return;
+        }
+        std::string path = dir + "/" + kFileName;
+        char hash[24];
+        snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(json_hash(dir)));
+        if (!read(path, hash)) {
+            find(metadata, files);
+            write(path, hash);
+        }
+        embedding_is_head_ = !aliases_.empty();
+        for (const auto& alias : aliases_) {
+            targets_.emplace(alias.second, NDArray());
+        }
+    }
+
+    bool embedding_is_head() const { return embedding_is_head_; }
+    bool alias(const std::string& name) const { return aliases_.count(name) > 0; }
+    size_t size() const { return aliases_.size(); }
+
+    // Keep the array of a param that aliases point at
+    void loaded(const std::string& name, const NDArray& arr) {
+        auto it = targets_.find(name);
+        if (it != targets_.end()) {
+            it->second = arr;
+        }
+    }
+
+    // Register every alias with its target's array
+    void publish(const tvm::runtime::PackedFunc& update) const {
+        for (const auto& alias : aliases_) {
+            const NDArray& arr = targets_.at(alias.second);
+            if (arr.defined()) {
+                update(alias.first, arr, true);
+            }
+        }
+    }
+
+private:
+    std::map<std::string, std::string> aliases_;  // lm_head param -> embedding param
+    std::map<std::string, NDArray> targets_;
+    bool embedding_is_head_ = false;
+
+    using Record = NDArrayCacheMetadata::FileRecord::ParamRecord;
+    struct Located {
+        const NDArrayCacheMetadata::FileRecord* file;
+        const Record* param;
+    };
+
+    bool read(const std::string& path, const char* hash) {
+        std::ifstream in(path);
+        std::string line;
+        if (!std::getline(in, line) || line != hash) {
+            return false;
+        }
+        std::string alias, target;
+        while (in >> alias >> target) {
+            aliases_[alias] = target;
+        }
+        return true;
+    }
+
+    void write(const std::string& path, const char* hash) const {
+        std::string tmp = path + ".tmp";
+        std::ofstream out(tmp);
+        out << hash << "\n";
+        for (const auto& alias : aliases_) {
+            out << alias.first << " " << alias.second << "\n";
+        }
+        out.close();
+        if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());  // a read-only model directory checks again next load
+        }
+    }
+
+    void find(const NDArrayCacheMetadata& metadata, const ShardFiles& files) {
+        std::vector<Located> heads;
+        std::vector<Located> tables;
+        for (const auto& file : metadata.records) {
+            for (const auto& param : file.records) {
+                if (head_param(param.name)) {
+                    heads.push_back({&file, &param});
+                } else if (embedding_param(param.name)) {
+                    tables.push_back({&file, &param});
+                }
+            }
+        }
+        for (const Located& head : heads) {
+            std::string suffix = head.param->name.substr(head.param->name.rfind("lm_head.") + 7);
+            for (const Located& table : tables) {
+                const std::string& name = table.param->name;
+                bool suffixed = name.size() >= suffix.size() &&
+                                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+                if (!suffixed || !same_layout(*head.param, *table.param)) {
+                    continue;
+                }
+                if (same_bytes(head, table, files)) {
+                    LOGI("%s repeats %s; loading one copy for both", head.param->name.c_str(), name.c_str());
+                    aliases_[head.param->name] = name;
+                }
+                break;
+            }
+        }
+    }
+
+    static bool same_layout(const Record& a, const Record& b) {
+        return a.shape == b.shape && a.dtype == b.dtype && a.format == b.format && a.nbytes == b.nbytes;
+    }
+
+    static bool same_bytes(const Located& a, const Located& b, const ShardFiles& files) {
+        std::shared_ptr<MappedShard> first = files.open(a.file->data_path);
+        std::shared_ptr<MappedShard> second = a.file == b.file ? first : files.open(b.file->data_path);
+        if (!first || !second || a.param->byte_offset + a.param->nbytes > static_cast<int64_t>(first->size()) ||
+            b.param->byte_offset + b.param->nbytes > static_cast<int64_t>(second->size())) {
+            return false;
+        }
+        // In chunks, dropping each behind the compare; different tables differ early
+        constexpr size_t kChunk = 4 << 20;
+        size_t total = static_cast<size_t>(a.param->nbytes);
+        size_t at_a = static_cast<size_t>(a.param->byte_offset);
+        size_t at_b = static_cast<size_t>(b.param->byte_offset);
+        bool same = true;
+        for (size_t done = 0; done < total && same; done += kChunk) {
+            size_t n = std::min(kChunk, total - done);
+            same = memcmp(first->data() + at_a + done, second->data() + at_b + done, n) == 0;
+            first->advise(at_a + done, n, MADV_DONTNEED);
+            second->advise(at_b + done, n, MADV_DONTNEED);
+        }
+        return same;
+    }
+};
+
+// Read stage of the loader. A few workers map and fault in shards ahead of the
+// uploading thread, bounded by a small window so device loads do not pull the
+// whole model into page cache at once.
+class ShardPipeline {
+public:
+    static constexpr size_t kMaxWorkers = 4;
+
+    ShardPipeline(const ShardFiles& files, const NDArrayCacheMetadata& metadata, DLDevice device)
+        : files_(files), metadata_(metadata), device_(device) {
+        size_t hw = std::max(1u, std::thread::hardware_concurrency());
+        workers_count_ = std::min({kMaxWorkers, hw, std::max<size_t>(1, metadata.records.size())});
+        window_ = workers_count_ * 2;
+        // The cores the workers leave free decode compressed shards' blocks
+        decode_threads_ = static_cast<unsigned>(std::max<size_t>(1, hw / workers_count_));
+    }
+
+    ~ShardPipeline() { stop(); }
+
+    void start() {
+        for (size_t i = 0; i < workers_count_; ++i) {
+            workers_.emplace_back([this] { run_worker(); });
+        }
+    }
+
+    // Next ready shard in completion order, or nullptr once every shard was handed out
+    std::unique_ptr<PreparedShard> next() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (delivered_ == metadata_.records.size()) {
+            return nullptr;
+        }
+        ready_cv_.wait(lock, [this] { return !ready_.empty(); });
+        std::unique_ptr<PreparedShard> out = std::move(ready_.front());
+        ready_.pop_front();
+        delivered_++;
+        space_cv_.notify_one();
+        return out;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        space_cv_.notify_all();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+        workers_.clear();
+    }
+
+    double read_ms() const { return read_us_.load() / 1000.0; }
+    size_t worker_count() const { return workers_count_; }
+
+private:
+    const ShardFiles& files_;
+    const NDArrayCacheMetadata& metadata_;
+    DLDevice device_;
+    size_t workers_count_ = 1;
+    size_t window_ = 2;
+    unsigned decode_threads_ = 1;
+
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> next_index_{0};
+    std::atomic<int64_t> read_us_{0};
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    std::condition_variable space_cv_;
+    std::deque<std::unique_ptr<PreparedShard>> ready_;
+    size_t delivered_ = 0;
+    size_t in_flight_ = 0;
+    bool stopping_ = false;
+
+    void run_worker() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                space_cv_.wait(lock, [this] { return stopping_ || ready_.size() + in_flight_ < window_; });
+                if (stopping_) {
+                    return;
+                }
+                in_flight_++;
+            }
+
+            size_t index = next_index_.fetch_add(1);
+            std::unique_ptr<PreparedShard> prepared;
+            if (index < metadata_.records.size()) {
+                auto read_start = Clock::now();
+                startup::Counters before = startup::thread_counters();
+                prepared.reset(new PreparedShard());
+                prepared->index = index;
+                prepared->shard = read_shard(metadata_.records[index]);
+                startup::Counters after = startup::thread_counters();
+                prepared->read_start = read_start;
+                prepared->read_ms = elapsed_ms(read_start);
+                prepared->read_cost.cpu_us = after.cpu_us - before.cpu_us;
+                prepared->read_cost.major_faults = after.major_faults - before.major_faults;
+                read_us_.fetch_add(static_cast<int64_t>(prepared->read_ms * 1000.0));
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_flight_--;
+            if (!prepared) {
+                return;
+            }
+            ready_.push_back(std::move(prepared));
+            ready_cv_.notify_one();
+        }
+    }
+
+    std::shared_ptr<MappedShard> read_shard(const NDArrayCacheMetadata::FileRecord& file) {
+        auto shard = files_.open(file.data_path, decode_threads_);
+        if (!shard) {
+            return nullptr;
+        }
+        for (const auto& param : file.records) {
+            if (param.byte_offset + param.nbytes > static_cast<int64_t>(shard->size())) {
+                LOGE("Param %s runs past the end of %s", param.name.c_str(), file.data_path.c_str());
+                return nullptr;
+            }
+        }
+
+        if (device_.device_type == kDLCPU && layer_pager::instance().enabled()) {
+            // Low-RAM mode pages layers in per pass; reading the whole shard ahead defeats it
+            shard->advise(MADV_RANDOM);
+        } else if (device_.device_type == kDLCPU) {
+            // In-place weights fault in lazily; read ahead front to back, switched per tensor once wrapped
+            shard->advise(MADV_SEQUENTIAL);
+            shard->advise(MADV_WILLNEED);
+        } else {
+            // Fault the pages in here so the upload thread only ever hits page cache
+            shard->advise(MADV_SEQUENTIAL);
+            shard->touch();
+        }
+        return shard;
+    }
+};
+
+constexpr size_t kRepackAlignment = 4096;
+
+const char* device_key(int device_type) {
+    switch (device_type) {
+        case kDLCPU: return "cpu";
+        case kDLOpenCL: return "opencl";
+        case kDLVulkan: return "vulkan";
+        default: return "device";
+    }
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+bool file_exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+void remove_dir(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            unlink((path + "/" + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+}
+
+// The bytes one param holds once decoded, as TVM would upload them
+std::string decoded_bytes(const NDArrayCacheMetadata::FileRecord::ParamRecord& param, const MappedShard& shard,
+                          DLDataType* dtype) {
+    const char* src = reinterpret_cast<const char*>(shard.data() + param.byte_offset);
+    if (param.format == "raw") {
+        *dtype = param.dtype;
+        return std::string(src, static_cast<size_t>(param.nbytes));
+    }
+    NDArrayCacheMetadata::FileRecord::ParamRecord local = param;
+    local.byte_offset = 0;
+    std::string raw(src, static_cast<size_t>(param.nbytes));
+    NDArray arr = local.Load(DLDevice{kDLCPU, 0}, &raw);
+    *dtype = arr->dtype;
+    std::string out(tvm::runtime::GetDataSize(*arr.operator->()), '\0');
+    arr.CopyToBytes(&out[0], out.size());
+    return out;
+}
+
+// The shard metadata of `dir`, from its binary index (ndarray_index.h) when that
+// is current or can be built, else parsed from the JSON
+NDArrayCacheMetadata load_metadata(const std::string& dir) {
+    std::unique_ptr<ndarray_index::Index> index = ndarray_index::Index::load(dir);
+    if (index != nullptr) {
+        return index->metadata(dir);
+    }
+    LOGI("No usable ndarray cache index in %s; parsing the JSON", dir.c_str());
+    return NDArrayCacheMetadata::Load(dir);
+}
+
+// A param as a rewritten cache stores it
+struct RewrittenParam {
+    std::string bytes;
+    DLDataType dtype;
+    std::vector<int64_t> shape;
+};
+
+using ParamRewrite =
+    std::function<bool(const NDArrayCacheMetadata::FileRecord::ParamRecord&, const MappedShard&, RewrittenParam*)>;
+
+// Write every param of `metadata` through `rewrite` into `out_dir`, raw and
+// page-aligned, in as many shards as the source has. The index, with
+// `index_metadata()` as its "metadata", is the last file in, and renaming the
+// directory into place publishes it whole.
+bool write_cache(const NDArrayCacheMetadata& metadata, const ShardFiles& sources, const std::string& out_dir,
+                 const ParamRewrite& rewrite, const std::function<std::string()>& index_metadata, uint64_t* total) {
+    std::string tmp_dir = out_dir + ".tmp";
+    remove_dir(tmp_dir);
+    if (mkdir(tmp_dir.c_str(), 0700) != 0) {
+        LOGE("Failed to create %s", tmp_dir.c_str());
+        return false;
+    }
+
+    std::string records;
+    *total = 0;
+    for (size_t i = 0; i < metadata.records.size(); ++i) {
+        const auto& file = metadata.records[i];
+        auto shard = sources.open(file.data_path);
+        if (!shard) {
+            remove_dir(tmp_dir);
+            return false;
+        }
+        shard->advise(MADV_SEQUENTIAL);
+        std::string name = "params_shard_" + std::to_string(i) + ".bin";
+        FILE* output = fopen((tmp_dir + "/" + name).c_str(), "wb");
+        if (output == nullptr) {
+            LOGE("Failed to create %s", name.c_str());
+            remove_dir(tmp_dir);
+            return false;
+        }
+
+        std::string params;
+        size_t offset = 0;
+        bool written = true;
+        for (const auto& param : file.records) {
+            RewrittenParam out;
+            if (!rewrite(param, *shard, &out)) {
+                written = false;
+                break;
+            }
+            // Page-aligned: every param maps in place and no page is shared between layers
+            size_t aligned = (offset + kRepackAlignment - 1) / kRepackAlignment * kRepackAlignment;
+            std::string padding(aligned - offset, '\0');
+            written = written && fwrite(padding.data(), 1, padding.size(), output) == padding.size() &&
+                      fwrite(out.bytes.data(), 1, out.bytes.size(), output) == out.bytes.size();
+
+            std::string shape;
+            for (int64_t dim : out.shape) {
+                shape += (shape.empty() ? "" : ", ") + std::to_string(dim);
+            }
+            params += std::string(params.empty() ? "" : ", ") + "{\"name\": \"" + param.name +
+                      "\", \"shape\": [" + shape + "], \"dtype\": \"" +
+                      tvm::runtime::DLDataType2String(out.dtype) + "\", \"format\": \"raw\", \"nbytes\": " +
+                      std::to_string(out.bytes.size()) + ", \"byteOffset\": " + std::to_string(aligned) + "}";
+            offset = aligned + out.bytes.size();
+        }
+        written = fclose(output) == 0 && written;
+        shard->advise(MADV_DONTNEED);
+        if (!written) {
+            LOGE("Failed to write %s", name.c_str());
+            remove_dir(tmp_dir);
+            return false;
+        }
+        records += std::string(records.empty() ? "" : ", ") + "{\"dataPath\": \"" + name +
+                   "\", \"format\": \"raw-shard\", \"nbytes\": " + std::to_string(offset) +
+                   ", \"records\": [" + params + "]}";
+        *total += offset;
+    }
+
+    std::ofstream index(tmp_dir + "/ndarray-cache.json");
+    index << "{\"metadata\": " << index_metadata() << ", \"records\": [" << records << "]}";
+    index.close();
+    if (!index || rename(tmp_dir.c_str(), out_dir.c_str()) != 0) {
+        LOGE("Failed to publish %s", out_dir.c_str());
+        remove_dir(tmp_dir);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+std::string repacked_dir(const std::string& model_dir, int device_type) {
+    // Hashed shard index: a new download of the weights gets a new cache
+    uint64_t hash = json_hash(model_dir);
+    char key[48];
+    snprintf(key, sizeof(key), "%s-%016llx", device_key(device_type), static_cast<unsigned long long>(hash));
+    return model_dir + "/repacked/" + key;
+}
+
+bool repack_ndarray_cache(const std::string& model_dir, int device_type) {
+    std::string out_dir = repacked_dir(model_dir, device_type);
+    if (file_exists(out_dir + "/ndarray-cache.json")) {
+        return true;
+    }
+    try {
+        auto start = Clock::now();
+        NDArrayCacheMetadata metadata = load_metadata(model_dir);
+        ShardFiles sources(model_dir);
+        mkdir((model_dir + "/repacked").c_str(), 0700);
+        auto decode = [](const NDArrayCacheMetadata::FileRecord::ParamRecord& param, const MappedShard& shard,
+                         RewrittenParam* out) {
+            out->bytes = decoded_bytes(param, shard, &out->dtype);
+            out->shape.assign(param.shape.begin(), param.shape.end());
+            return true;
+        };
+        auto index_metadata = [device_type] {
+            return std::string("{\"repackedFor\": \"") + device_key(device_type) + "\"}";
+        };
+        uint64_t total = 0;
+        if (!write_cache(metadata, sources, out_dir, decode, index_metadata, &total)) {
+            return false;
+        }
+        LOGI("Repacked %zu shards (%llu MB) for %s in %.1f ms", metadata.records.size(),
+             static_cast<unsigned long long>(total >> 20), device_key(device_type), elapsed_ms(start));
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("Failed to repack %s: %s", model_dir.c_str(), e.what());
+        remove_dir(out_dir + ".tmp");
+        return false;
+    }
+}
+
+std::string requantized_dir(const std::string& model_dir, int scheme) {
+    const char* tag = requantize::scheme_tag(scheme);
+    char key[64];
+    snprintf(key, sizeof(key), "%s-%016llx", tag != nullptr ? tag : "unknown",
+             static_cast<unsigned long long>(json_hash(model_dir)));
+    return model_dir + "/requantized/" + key;
+}
+
+bool requantize_ndarray_cache(const std::string& model_dir, int scheme) {
+    const char* tag = requantize::scheme_tag(scheme);
+    if (tag == nullptr) {
+        LOGE("Unknown requantization scheme %d", scheme);
+        return false;
+    }
+    std::string out_dir = requantized_dir(model_dir, scheme);
+    if (file_exists(out_dir + "/ndarray-cache.json")) {
+        return true;
+    }
+    using Record = NDArrayCacheMetadata::FileRecord::ParamRecord;
+    try {
+        auto start = Clock::now();
+        NDArrayCacheMetadata metadata = load_metadata(model_dir);
+        ShardFiles sources(model_dir);
+        std::map<std::string, std::pair<const NDArrayCacheMetadata::FileRecord*, const Record*>> located;
+        for (const auto& file : metadata.records) {
+            for (const auto& param : file.records) {
+                located[param.name] = {&file, &param};
+            }
+        }
+        // A weight is converted with its scale, whichever comes first; the other waits here
+        std::map<std::string, RewrittenParam> pending;
+        requantize::Error error;
+        size_t rewritten = 0;
+        auto read = [&](const std::string& name, RewrittenParam* out) {
+            auto at = located.find(name);
+            std::shared_ptr<MappedShard> shard = at != located.end() ? sources.open(at->second.first->data_path)
+                                                                     : nullptr;
+            if (!shard) {
+                return false;
+            }
+            out->bytes = decoded_bytes(*at->second.second, *shard, &out->dtype);
+            out->shape.assign(at->second.second->shape.begin(), at->second.second->shape.end());
+            shard->advise(MADV_DONTNEED);
+            return true;
+        };
+        auto convert = [&](const std::string& weight_name) {
+            RewrittenParam weight;
+            RewrittenParam scale;
+            if (!read(weight_name, &weight) || !read(requantize::scale_name(weight_name), &scale)) {
+                LOGE("%s or its scale cannot be read", weight_name.c_str());
+                return false;
+            }
+            bool layout = weight.shape.size() == 2 && scale.shape.size() == 2 && weight.shape[0] == scale.shape[0] &&
+                          weight.dtype.code == kDLUInt && weight.dtype.bits == 32 && scale.dtype.code == kDLFloat &&
+                          scale.dtype.bits == 16 &&
+                          weight.shape[1] * requantize::kSourceValuesPerWord ==
+                              scale.shape[1] * requantize::kSourceGroupSize;
+            if (!layout) {
+                LOGE("%s is not a q4f16_1 weight", weight_name.c_str());
+                return false;
+            }
+            int64_t rows = weight.shape[0];
+            int64_t k = weight.shape[1] * requantize::kSourceValuesPerWord;
+            int64_t groups = static_cast<int64_t>(requantize::groups(k));
+            std::vector<uint32_t> q_weight(static_cast<size_t>(rows * groups * requantize::kWordsPerGroup));
+            std::vector<uint16_t> q_scale(static_cast<size_t>(rows * groups));
+            if (!requantize::convert(reinterpret_cast<const uint32_t*>(weight.bytes.data()),
+                                     reinterpret_cast<const uint16_t*>(scale.bytes.data()), rows, k, q_weight.data(),
+                                     q_scale.data(), &error)) {
+                return false;
+            }
+            weight.bytes.assign(reinterpret_cast<const char*>(q_weight.data()), q_weight.size() * sizeof(uint32_t));
+            weight.shape = {rows, groups * requantize::kWordsPerGroup};
+            scale.bytes.assign(reinterpret_cast<const char*>(q_scale.data()), q_scale.size() * sizeof(uint16_t));
+            scale.shape = {rows, groups};
+            pending[weight_name] = std::move(weight);
+            pending[requantize::scale_name(weight_name)] = std::move(scale);
+            rewritten++;
+            return true;
+        };
+        auto rewrite = [&](const Record& param, const MappedShard& shard, RewrittenParam* out) {
+            std::string weight_name;
+            if (requantize::rewrites(scheme, param.name)) {
+                weight_name = param.name;
+            } else if (param.name.size() > 8 && param.name.compare(param.name.size() - 8, 8, ".q_scale") == 0) {
+                std::string candidate = param.name.substr(0, param.name.size() - 5) + "weight";
+                if (requantize::rewrites(scheme, candidate) && located.count(candidate) > 0) {
+                    weight_name = candidate;
+                }
+            }
+            if (weight_name.empty()) {
+                out->bytes = decoded_bytes(param, shard, &out->dtype);
+                out->shape.assign(param.shape.begin(), param.shape.end());
+                return true;
+            }
+            if (pending.count(param.name) == 0 && !convert(weight_name)) {
+                return false;
+            }
+            *out = std::move(pending[param.name]);
+            pending.erase(param.name);
+            return true;
+        };
+        auto index_metadata = [&] {
+            char relative[32];
+            snprintf(relative, sizeof(relative), "%.6f", error.relative());
+            return std::string("{\"quantization\": \"") + tag + "\", \"requantizedFrom\": \"" +
+                   requantize::kSourceTag + "\", \"relativeError\": " + relative + "}";
+        };
+        mkdir((model_dir + "/requantized").c_str(), 0700);
+        uint64_t total = 0;
+        if (!write_cache(metadata, sources, out_dir, rewrite, index_metadata, &total)) {
+            return false;
+        }
+        LOGI("Requantized %zu weights to %s (%llu MB, relative RMS error %.4f) in %.1f ms", rewritten, tag,
+             static_cast<unsigned long long>(total >> 20), error.relative(), elapsed_ms(start));
+        // One mapping at load, like a packed download; the shards stay usable if this fails
+        if (!pack_shards(out_dir)) {
+            LOGI("Requantized shards of %s left unpacked", out_dir.c_str());
+        }
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("Failed to requantize %s: %s", model_dir.c_str(), e.what());
+        remove_dir(out_dir + ".tmp");
+        return false;
+    }
+}
+
+bool load_ndarray_cache(const std::string& model_dir, int device_type, int device_id) {
+    const tvm::runtime::PackedFunc* fupdate =
+        tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.update");
+    if (fupdate == nullptr) {
+        LOGE("vm.builtin.ndarray_cache.update is not registered");
+        return false;
+    }
+
+    try {
+        auto wall_start = Clock::now();
+        // The lower-bit variant the engine picked, else a repacked cache for this
+        // device, which needs no decoding and no copies on the CPU
+        int scheme = g_requantized_scheme.load();
+        std::string source = scheme >= 0 ? requantized_dir(model_dir, scheme) : repacked_dir(model_dir, device_type);
+        if (!file_exists(source + "/ndarray-cache.json")) {
+            source = model_dir;
+        }
+        const char* kind = source == model_dir ? "" : scheme >= 0 ? "requantized " : "repacked ";
+        auto metadata_start = Clock::now();
+        startup::Phase metadata_phase("weights_metadata");
+        NDArrayCacheMetadata metadata = load_metadata(source);
+        metadata_phase.end();
+        double metadata_ms = elapsed_ms(metadata_start);
+        DLDevice device{static_cast<DLDeviceType>(device_type), device_id};
+        ShardFiles files(source);
+        TiedParams tied(source, metadata, files);
+        ShardPipeline pipeline(files, metadata, device);
+        pipeline.start();
+
+        layer_pager::LayerPager& pager = layer_pager::instance();
+        bool paged = pager.enabled() && device.device_type == kDLCPU;
+        tvm::runtime::Optional<NDArray> staging;
+        size_t mapped = 0;
+        size_t copied = 0;
+        size_t locked = 0;
+        double upload_ms = 0.0;
+
+        // Uploads stay on this thread: device APIs (OpenCL in particular) expect one
+        // submitting thread, while the workers keep the next shards faulted in
+        std::unique_ptr<PreparedShard> prepared;
+        while ((prepared = pipeline.next()) != nullptr) {
+            if (!prepared->shard) {
+                pipeline.stop();
+                return false;
+            }
+            auto upload_start = Clock::now();
+            startup::Counters upload_cost = startup::thread_counters();
+            const auto& file = metadata.records[prepared->index];
+            for (const auto& param : file.records) {
+                if (tied.alias(param.name)) {
+                    continue;  // registered with its embedding param's array below
+                }
+                NDArray arr = load_param(param, prepared->shard, device, &staging);
+                tied.loaded(param.name, arr);
+                if (can_wrap_in_place(param, device)) {
+                    mapped++;
+                    if (paged && prepared->shard->file_backed()) {
+                        pager.add_param(param.name, prepared->shard->data() + param.byte_offset,
+                                        static_cast<size_t>(param.nbytes), prepared->shard);
+                    }
+                } else {
+                    copied++;
+                }
+                (*fupdate)(param.name, arr, true);
+            }
+            if (device.device_type == kDLCPU) {
+                for (const auto& param : file.records) {
+                    if (can_wrap_in_place(param, device) && !tied.alias(param.name)) {
+                        hint_steady_state(param, *prepared->shard, paged, tied.embedding_is_head(), &locked);
+                    }
+                }
+            }
+
+            // Pages that were uploaded somewhere else are no longer needed here
+            if (device.device_type != kDLCPU) {
+                prepared->shard->advise(MADV_DONTNEED);
+            }
+            upload_ms += elapsed_ms(upload_start);
+            record_shard(*prepared, file.data_path, upload_start, upload_cost);
+        }
+        pipeline.stop();
+        tied.publish(*fupdate);
+        if (paged) {
+            pager.start();
+        }
+
+        g_locked_bytes = locked;
+        LOGI("Loaded %zu params from %zu %sshards%s (%zu mapped in place, %zu copied, %zu tied, %zu KB locked)",
+             mapped + copied, metadata.records.size(), kind,
+             files.packed() ? " in one pack" : "", mapped, copied, tied.size(), locked >> 10);
+        LOGI("Shard load timings: metadata %.1f ms, read %.1f ms across %zu workers, upload %.1f ms, wall %.1f ms",
+             metadata_ms, pipeline.read_ms(), pipeline.worker_count(), upload_ms, elapsed_ms(wall_start));
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("Failed to load ndarray cache from %s: %s", model_dir.c_str(), e.what());
+        return false;
+    }
+}
+
+bool pack_shards(const std::string& model_dir) {
+    std::string pack_path = model_dir + "/" + shard_pack::kFileName;
+    std::string tmp_path = pack_path + ".tmp";
+    try {
+        auto start = Clock::now();
+        uint64_t hash = json_hash(model_dir);
+        if (!shard_pack::Pack::open(model_dir, hash).empty()) {
+            return true;
+        }
+        NDArrayCacheMetadata metadata = load_metadata(model_dir);
+        std::string json = read_file(model_dir + "/ndarray-cache.json");
+
+        // Lay the pack out first: header, entries, the JSON, then each shard aligned
+        shard_pack::Header header{};
+        header.magic = shard_pack::kMagic;
+        header.version = shard_pack::kVersion;
+        header.shard_count = static_cast<uint32_t>(metadata.records.size());
+        header.json_hash = hash;
+        header.json_offset = sizeof(header) + metadata.records.size() * sizeof(shard_pack::Entry);
+        header.json_bytes = json.size();
+        std::vector<shard_pack::Entry> entries(metadata.records.size());
+        std::vector<std::shared_ptr<MappedShard>> shards;
+        uint64_t offset = shard_pack::align_up(header.json_offset + header.json_bytes);
+        for (size_t i = 0; i < metadata.records.size(); ++i) {
+            const std::string& data_path = metadata.records[i].data_path;
+            auto shard = MappedShard::open(model_dir + "/" + data_path);
+            if (!shard || data_path.size() >= shard_pack::kMaxPathBytes) {
+                LOGE("Cannot pack shard %s", data_path.c_str());
+                return false;
+            }
+            memcpy(entries[i].data_path, data_path.data(), data_path.size());
+            entries[i].offset = offset;
+            entries[i].nbytes = shard->size();
+            offset = shard_pack::align_up(offset + shard->size());
+            shards.push_back(std::move(shard));
+        }
+
+        FILE* out = fopen(tmp_path.c_str(), "wb");
+        if (out == nullptr) {
+            LOGE("Failed to create %s", tmp_path.c_str());
+            return false;
+        }
+        // Entries are rewritten with the hashes at the end; the shards are streamed once
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                       fwrite(entries.data(), sizeof(shard_pack::Entry), entries.size(), out) == entries.size() &&
+                       fwrite(json.data(), 1, json.size(), out) == json.size();
+        uint64_t at = header.json_offset + header.json_bytes;
+        for (size_t i = 0; i < shards.size() && written; ++i) {
+            std::string padding(static_cast<size_t>(entries[i].offset - at), '\0');
+            shards[i]->advise(MADV_SEQUENTIAL);
+            written = fwrite(padding.data(), 1, padding.size(), out) == padding.size() &&
+                      fwrite(shards[i]->data(), 1, shards[i]->size(), out) == shards[i]->size();
+            entries[i].hash = ndarray_index::fnv1a(shards[i]->data(), shards[i]->size(), ndarray_index::kHashSeed);
+            shards[i]->advise(MADV_DONTNEED);
+            at = entries[i].offset + entries[i].nbytes;
+        }
+        written = written && fseek(out, sizeof(header), SEEK_SET) == 0 &&
+                  fwrite(entries.data(), sizeof(shard_pack::Entry), entries.size(), out) == entries.size();
+        written = fflush(out) == 0 && fsync(fileno(out)) == 0 && written;
+        written = fclose(out) == 0 && written;
+        if (!written || rename(tmp_path.c_str(), pack_path.c_str()) != 0) {
+            LOGE("Failed to write %s", pack_path.c_str());
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        // The pack replaces the shard files
+        shards.clear();
+        for (const auto& file : metadata.records) {
+            unlink((model_dir + "/" + file.data_path).c_str());
+        }
+        LOGI("Packed %zu shards (%llu MB) into %s in %.1f ms", entries.size(),
+             static_cast<unsigned long long>(offset >> 20), pack_path.c_str(), elapsed_ms(start));
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("Failed to pack %s: %s", model_dir.c_str(), e.what());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+}
+
+bool verify_pack(const std::string& model_dir) {
+    shard_pack::Pack pack = shard_pack::Pack::open(model_dir, json_hash(model_dir));
+    std::shared_ptr<MappedShard> whole = pack.empty() ? nullptr : MappedShard::open(pack.path());
+    if (whole == nullptr) {
+        return false;
+    }
+    // One front-to-back pass over the file
+    whole->advise(MADV_SEQUENTIAL);
+    bool intact = true;
+    for (const shard_pack::Entry& entry : pack.entries()) {
+        auto shard = MappedShard::view(whole, static_cast<size_t>(entry.offset), static_cast<size_t>(entry.nbytes));
+        if (!shard || ndarray_index::fnv1a(shard->data(), shard->size(), ndarray_index::kHashSeed) != entry.hash) {
+            LOGE("Shard %s of %s is damaged", entry.data_path, pack.path().c_str());
+            intact = false;
+        }
+        if (shard) {
+            shard->advise(MADV_DONTNEED);
+        }
+    }
+    return intact;
+}
+
+uint32_t accepted_formats() {
+    return kWeightFormatShards | kWeightFormatPack | kWeightFormatCompressed | kWeightFormatRepacked |
+           kWeightFormatRequantized;
+}
+
+void set_requantized_scheme(int scheme) {
+    g_requantized_scheme = scheme;
+}
+
+void set_lock_hot_tensors(bool lock) {
+    g_lock_hot_tensors = lock;
+}
+
+size_t locked_bytes() {
+    return g_locked_bytes.load();
+}
+
+void install_ndarray_cache_loader() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        // Keep TVM's own loader as the fallback for anything the mmap path cannot read
+        const tvm::runtime::PackedFunc* original =
+            tvm::runtime::Registry::Get("vm.builtin.ndarray_cache.load");
+        tvm::runtime::PackedFunc fallback = original != nullptr ? *original : tvm::runtime::PackedFunc(nullptr);
+
+        tvm::runtime::Registry::Register("vm.builtin.ndarray_cache.load", true)
+            .set_body([fallback](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                std::string cache_path = args[0];
+                int device_type = args[1];
+                int device_id = args[2];
+                if (load_ndarray_cache(cache_path, device_type, device_id)) {
+                    return;
+                }
+                if (fallback == nullptr) {
+                    throw std::runtime_error("Failed to load ndarray cache from " + cache_path);
+                }
+                LOGI("Falling back to TVM ndarray cache loader for %s", cache_path.c_str());
+                fallback.CallPacked(args, rv);
+            });
+        LOGI("Installed mmap ndarray cache loader");
+    });
+}
+
+}  // namespace mmap_loader
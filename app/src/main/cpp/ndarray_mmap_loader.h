@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Memory-mapped loader for MLC weight shards (params_shard_*.bin).
+ *
+ * Reads ndarray-cache.json through its binary index (ndarray_index.h), built on
+ * the first load, into tvm::runtime::relax_vm::NDArrayCacheMetadata, maps each shard read-only and feeds the resulting NDArrays into TVM's global
+ * ndarray cache. On CPU, raw and suitably aligned params are wrapped in place so
+ * the weights stay clean, reclaimable page cache. Other devices are uploaded
+ * straight from the mapped pages, so nothing goes through a heap-sized
+ * std::string per shard.
+ *
+ * Shards are mapped, validated and faulted in by a small worker pool while the
+ * calling thread uploads already-prepared shards, and per-stage timings are logged.
+ * In low-RAM mode the in-place layer weights are handed to the layer pager
+ * (layer_pager.h) instead of being read ahead.
+ *
+ * Shards are hinted sequential while they load; weights read in place are then
+ * hinted by how decode uses them (random for the embedding table, resident for
+ * dense weights), and the small hot ones can be locked in memory. An embedding
+ * table tied to the LM head is hinted as the dense weight it then is, and an
+ * lm_head.* param that merely repeats it is not loaded at all: the embedding's
+ * array is registered under its name too (checked once, in ndarray-cache.ties).
+ *
+ * Shards come from the directory's params.pack when pack_shards() wrote one
+ * (one open, one mapping), otherwise from their own files, block-compressed
+ * ones (compressed_shard.h) decoded by the read stage while earlier shards
+ * upload. Decoded shards live in anonymous memory, so the layer pager leaves
+ * them resident.
+ *
+ * repack_ndarray_cache() rewrites the shards once for a device: every param
+ * decoded to the dtype the kernels read and page-aligned, under
+ * `model_dir`/repacked/<device>-<index hash>/. Loads prefer that cache, so on
+ * the CPU every weight maps in place and nothing is decoded or copied.
+ *
+ * requantize_ndarray_cache() writes a q3f16_1 variant of q4f16_1 weights the
+ * same way, under `model_dir`/requantized/<scheme>-<index hash>/, for devices
+ * the q4 model does not fit (requantize.h).
+ */
+namespace mmap_loader {
+
+// Weight layouts the loader reads, as reported by accepted_formats();
+// mirrored in MlcLlmBridge as WEIGHT_FORMAT_*
+enum WeightFormat : uint32_t {
+    kWeightFormatShards = 1u << 0,       // params_shard_N.bin with ndarray-cache.json
+    kWeightFormatPack = 1u << 1,         // params.pack (pack_shards)
+    kWeightFormatCompressed = 1u << 2,   // params_shard_N.bin.zblk (compressed_shard.h)
+    kWeightFormatRepacked = 1u << 3,     // repacked/<device>-<hash>/ (repack_ndarray_cache)
+    kWeightFormatRequantized = 1u << 4,  // requantized/<scheme>-<hash>/ (requantize_ndarray_cache)
+};
+
+uint32_t accepted_formats();
+
+// Load every param listed in `model_dir`/ndarray-cache.json into the ndarray cache.
+// Returns false if the metadata or a shard cannot be read.
+bool load_ndarray_cache(const std::string& model_dir, int device_type, int device_id);
+
+// Where the repacked cache for `device_type` lives; it is used once its
+// ndarray-cache.json exists
+std::string repacked_dir(const std::string& model_dir, int device_type);
+
+// Write the repacked cache for `device_type` if it is missing. Takes about as
+// long as reading and writing the weights once; run it off the main thread.
+bool repack_ndarray_cache(const std::string& model_dir, int device_type);
+
+// Where the lower-bit variant `scheme` (requantize.h) of the weights lives; it
+// is complete once its ndarray-cache.json exists
+std::string requantized_dir(const std::string& model_dir, int scheme);
+
+// Write the variant `scheme` from the q4f16_1 shards if it is missing, packed
+// into one params.pack. Reads the weights once and writes about three quarters
+// of them; run it off the main thread.
+bool requantize_ndarray_cache(const std::string& model_dir, int scheme);
+
+// Load the variant `scheme` in place of the shards from now on, when it exists;
+// -1 for none. The engine sets it with the model library built for the variant.
+void set_requantized_scheme(int scheme);
+
+// Pack the shards of `model_dir` into one page-aligned params.pack (shard_pack.h)
+// and remove the shard files; loads then map the model once. Reads and writes
+// the weights once, so run it off the main thread. Only this loader reads packs.
+bool pack_shards(const std::string& model_dir);
+
+// Whether every shard in `model_dir`'s pack still matches its hash; false without a pack
+bool verify_pack(const std::string& model_dir);
+
+// mlock the small per-layer tensors (norms, scales) of later loads, within
+// RLIMIT_MEMLOCK; off by default. CPU in-place weights only.
+void set_lock_hot_tensors(bool lock);
+
+// Bytes the last load locked
+size_t locked_bytes();
+
+// Override vm.builtin.ndarray_cache.load so chat modules created afterwards pick up
+// the mmap path. Safe to call more than once.
+void install_ndarray_cache_loader();
+
+}  // namespace mmap_loader
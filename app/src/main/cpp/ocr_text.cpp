@@ -0,0 +1,336 @@
+#include "ocr_text.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace ocr_text {
+
+namespace {
+
+inline bool is_lower(char c) { return c >= 'a' && c <= 'z'; }
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+inline bool is_alpha(char c) { return is_lower(c) || (c >= 'A' && c <= 'Z'); }
+inline char to_lower(char c) { return c >= 'A' && c <= 'Z' ? static_cast<char>(c + 32) : c; }
+
+inline bool starts_with(std::string_view s, std::string_view prefix) {
+    return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+}
+
+inline bool ends_with(std::string_view s, std::string_view suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// `raw` with whitespace runs (ASCII space and controls, NBSP) as one space, trimmed
+std::string clean_line(std::string_view raw) {
+    std::string out;
+    out.reserve(raw.size());
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(raw.data());
+    const size_t n = raw.size();
+    bool space = false;
+    size_t i = 0;
+    while (i < n) {
+#if defined(__ARM_NEON)
+        // Runs without whitespace, controls or a possible NBSP lead byte go whole
+        const uint8x16_t blank = vdupq_n_u8(0x20);
+        const uint8x16_t del = vdupq_n_u8(0x7f);
+        const uint8x16_t nbsp = vdupq_n_u8(0xc2);
+        while (i + 16 <= n) {
+            uint8x16_t v = vld1q_u8(p + i);
+            uint8x16_t special = vorrq_u8(vcleq_u8(v, blank), vorrq_u8(vceqq_u8(v, del), vceqq_u8(v, nbsp)));
+            if (vmaxvq_u8(special) != 0) {
+                break;
+            }
+            if (space && !out.empty()) {
+                out += ' ';
+            }
+            space = false;
+            out.append(reinterpret_cast<const char*>(p + i), 16);
+            i += 16;
+        }
+        if (i >= n) {
+            break;
+        }
+#endif
+        uint8_t c = p[i];
+        if (c <= 0x20 || c == 0x7f) {
+            space = true;
+            i++;
+            continue;
+        }
+        if (c == 0xc2 && i + 1 < n && p[i + 1] == 0xa0) {
+            space = true;
+            i += 2;
+            continue;
+        }
+        if (space && !out.empty()) {
+            out += ' ';
+        }
+        space = false;
+        out += static_cast<char>(c);
+        i++;
+    }
+    return out;
+}
+
+// Lower case, en and em dashes as '-'
+std::string folded(std::string_view line) {
+    std::string out;
+    out.reserve(line.size());
+    for (size_t i = 0; i < line.size(); ++i) {
+        if (starts_with(line.substr(i), "\xe2\x80\x93") || starts_with(line.substr(i), "\xe2\x80\x94")) {
+            out += '-';
+            i += 2;
+        } else {
+            out += to_lower(line[i]);
+        }
+    }
+    return out;
+}
+
+// "12", "- 12 -", "[12]", "Page 12", "p. 12 of 30", "xii"
+bool is_page_number(std::string_view line) {
+    std::string s = folded(line);
+    std::string_view v = s;
+    auto trim = [&v]() {
+        while (!v.empty() && (v.front() == ' ' || v.front() == '-' || v.front() == '|' || v.front() == '[' ||
+                              v.front() == '(')) {
+            v.remove_prefix(1);
+        }
+        while (!v.empty() && (v.back() == ' ' || v.back() == '-' || v.back() == '|' || v.back() == ']' ||
+                              v.back() == ')')) {
+            v.remove_suffix(1);
+        }
+    };
+    trim();
+    for (std::string_view prefix : {"page", "pg.", "pg", "p."}) {
+        if (starts_with(v, prefix)) {
+            v.remove_prefix(prefix.size());
+            trim();
+            break;
+        }
+    }
+    size_t digits = 0;
+    while (digits < v.size() && is_digit(v[digits])) digits++;
+    if (digits == 0) {
+        size_t roman = 0;
+        while (roman < v.size() && strchr("ivxlcdm", v[roman]) != nullptr) roman++;
+        return roman > 0 && roman <= 7 && roman == v.size();
+    }
+    if (digits > 4) {
+        return false;
+    }
+    v.remove_prefix(digits);
+    if (v.empty()) {
+        return true;
+    }
+    if (!starts_with(v, " of ")) {
+        return false;
+    }
+    v.remove_prefix(4);
+    return !v.empty() && v.size() <= 4 && std::all_of(v.begin(), v.end(), is_digit);
+}
+
+// A running header or footer recurs with only its page number changed
+std::string boilerplate_key(std::string_view line) {
+    std::string key;
+    for (char c : line) {
+        if (is_digit(c)) {
+            continue;
+        }
+        if (c == ' ' && (key.empty() || key.back() == ' ')) {
+            continue;
+        }
+        key += to_lower(c);
+    }
+    while (!key.empty() && key.back() == ' ') key.pop_back();
+    return key.size() >= 4 ? key : std::string();
+}
+
+bool starts_list_item(std::string_view line) {
+    for (std::string_view bullet : {"\xe2\x80\xa2", "\xe2\x96\xaa", "\xe2\x97\x8f", "\xe2\x97\xa6", "- ", "* ",
+                                    "\xe2\x80\x93 "}) {
+        if (starts_with(line, bullet)) {
+            return true;
+        }
+    }
+    size_t digits = 0;
+    while (digits < line.size() && digits < 3 && is_digit(line[digits])) digits++;
+    size_t marker = digits > 0 ? digits : (line.size() > 1 && is_alpha(line[0]) ? 1 : 0);
+    return marker > 0 && marker + 1 < line.size() && (line[marker] == '.' || line[marker] == ')') &&
+           line[marker + 1] == ' ';
+}
+
+bool ends_sentence(std::string_view line) {
+    while (!line.empty() && (line.back() == '"' || line.back() == '\'' || line.back() == ')')) {
+        line.remove_suffix(1);
+    }
+    return !line.empty() && strchr(".!?:", line.back()) != nullptr;
+}
+
+struct Page {
+    std::vector<std::string> lines;  // cleaned; empty ones are blank
+    std::vector<size_t> edges;       // indices of the lines near the top and bottom
+};
+
+Page split_page(std::string_view text) {
+    Page page;
+    size_t start = 0;
+    while (start <= text.size()) {
+        const void* found = memchr(text.data() + start, '\n', text.size() - start);
+        size_t end = found != nullptr ? static_cast<size_t>(static_cast<const char*>(found) - text.data())
+                                      : text.size();
+        page.lines.push_back(clean_line(text.substr(start, end - start)));
+        start = end + 1;
+    }
+    std::vector<size_t> nonblank;
+    for (size_t i = 0; i < page.lines.size(); ++i) {
+        if (!page.lines[i].empty()) {
+            nonblank.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < nonblank.size(); ++i) {
+        if (i < static_cast<size_t>(kEdgeLines) || i + kEdgeLines >= nonblank.size()) {
+            page.edges.push_back(nonblank[i]);
+        }
+    }
+    return page;
+}
+
+// Kept lines of one page as paragraphs, appended to `out`
+void assemble(const Page& page, const std::vector<bool>& dropped, Stats* stats, std::string* out) {
+    std::vector<size_t> lengths;
+    for (size_t i = 0; i < page.lines.size(); ++i) {
+        if (!page.lines[i].empty() && !dropped[i]) {
+            lengths.push_back(page.lines[i].size());
+        }
+    }
+    if (lengths.empty()) {
+        return;
+    }
+    std::nth_element(lengths.begin(), lengths.begin() + lengths.size() / 2, lengths.end());
+    const double short_line = kShortLine * static_cast<double>(lengths[lengths.size() / 2]);
+
+    std::string paragraph;
+    bool previous_short_end = false;
+    auto flush = [&]() {
+        if (!paragraph.empty()) {
+            if (!out->empty() && out->back() != '\n') {
+                *out += '\n';
+            }
+            *out += paragraph;
+            paragraph.clear();
+        }
+    };
+    for (size_t i = 0; i < page.lines.size(); ++i) {
+        const std::string& line = page.lines[i];
+        if (dropped[i]) {
+            continue;
+        }
+        if (line.empty()) {
+            flush();
+            continue;
+        }
+        if (paragraph.empty()) {
+            paragraph = line;
+        } else if (is_lower(line[0]) && paragraph.size() >= 2 && ends_with(paragraph, "-") &&
+                   is_alpha(paragraph[paragraph.size() - 2])) {
+            paragraph.pop_back();
+            paragraph += line;
+            if (stats != nullptr) stats->dehyphenated++;
+        } else if (is_lower(line[0]) && ends_with(paragraph, "\xc2\xad")) {
+            paragraph.resize(paragraph.size() - 2);  // a soft hyphen
+            paragraph += line;
+            if (stats != nullptr) stats->dehyphenated++;
+        } else if (previous_short_end || starts_list_item(line)) {
+            flush();
+            paragraph = line;
+        } else {
+            paragraph += ' ';
+            paragraph += line;
+            if (stats != nullptr) stats->lines_joined++;
+        }
+        previous_short_end = static_cast<double>(line.size()) < short_line && ends_sentence(line);
+    }
+    flush();
+}
+
+}  // namespace
+
+std::string normalize_pages(const std::vector<std::string>& pages, Stats* stats) {
+    Stats local;
+    Stats* s = stats != nullptr ? stats : &local;
+    *s = Stats();
+    std::vector<Page> split;
+    split.reserve(pages.size());
+    for (const std::string& text : pages) {
+        s->bytes_in += text.size();
+        split.push_back(split_page(text));
+    }
+
+    // Pages on whose edges each key appears
+    std::unordered_map<std::string, size_t> recurring;
+    if (split.size() >= 2) {
+        for (const Page& page : split) {
+            std::unordered_set<std::string> seen;
+            for (size_t i : page.edges) {
+                std::string key = boilerplate_key(page.lines[i]);
+                if (!key.empty() && seen.insert(key).second) {
+                    recurring[key]++;
+                }
+            }
+        }
+    }
+    const size_t threshold = std::max<size_t>(2, (split.size() + 1) / 2);
+
+    std::string out;
+    for (const Page& page : split) {
+        std::vector<bool> dropped(page.lines.size(), false);
+        for (size_t i : page.edges) {
+            if (is_page_number(page.lines[i])) {
+                dropped[i] = true;
+                s->page_numbers++;
+                continue;
+            }
+            auto found = recurring.find(boilerplate_key(page.lines[i]));
+            if (found != recurring.end() && found->second >= threshold) {
+                dropped[i] = true;
+                s->boilerplate++;
+            }
+        }
+        std::string text;
+        assemble(page, dropped, s, &text);
+        if (text.empty()) {
+            continue;
+        }
+        if (!out.empty()) {
+            out += "\n\n";
+        }
+        out += text;
+    }
+    s->bytes_out = out.size();
+    return out;
+}
+
+std::string normalize(const std::string& text, Stats* stats) {
+    std::vector<std::string> pages;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find('\f', start);
+        pages.push_back(text.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    return normalize_pages(pages, stats);
+}
+
+}  // namespace ocr_text
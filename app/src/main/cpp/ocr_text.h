@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * OCR output tidied into prose before it is tokenized.
+ *
+ * ML Kit returns pages line by line as printed: words hyphenated across line
+ * breaks, the running header and footer on every page, page numbers, runs of
+ * spaces where columns were. All of it costs prompt tokens and prefill time
+ * and tells the model nothing. One pass per page:
+ *
+ *  - whitespace runs (tabs, NBSP, stray control bytes) collapse to one space
+ *    and lines are trimmed; plain runs are copied 16 bytes at a time (NEON);
+ *  - lines join into paragraphs with a space, and a word hyphenated at the
+ *    end of a line joins its rest when that starts in lower case;
+ *  - a paragraph ends at a blank line, before a list item, or after a short
+ *    line ending a sentence (under kShortLine of the page's median line);
+ *  - a line near the top or bottom of a page (within kEdgeLines) is dropped
+ *    if it is a page number ("12", "- 12 -", "Page 12 of 30", "xii"), or if
+ *    with its digits removed it recurs at the edges of at least half the pages
+ *    (two at least): running headers and footers.
+ *
+ * Paragraphs are separated by one newline and pages by a blank line. A '\f' in
+ * a single text separates pages too.
+ */
+namespace ocr_text {
+
+constexpr int kEdgeLines = 3;
+constexpr double kShortLine = 0.6;
+
+struct Stats {
+    size_t bytes_in = 0;
+    size_t bytes_out = 0;
+    int dehyphenated = 0;     // words joined across a line break
+    int lines_joined = 0;     // line breaks turned into spaces
+    int boilerplate = 0;      // running header or footer lines dropped
+    int page_numbers = 0;     // page number lines dropped
+};
+
+// `pages` as one normalized text; `stats` may be null
+std::string normalize_pages(const std::vector<std::string>& pages, Stats* stats);
+
+// One text, pages split at '\f'
+std::string normalize(const std::string& text, Stats* stats);
+
+}  // namespace ocr_text
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/**
+ * Answer lengths seen per kind of task, for sizing what a request reserves.
+ *
+ * max_gen_len is a cap, not an estimate: a chat answer averages a few hundred
+ * tokens and a flashcard a few dozen, yet both may run to 1024. Reserving the
+ * cap in the batch's KV keeps out sequences that would have fitted, so the
+ * scheduler reserves kQuantile of the last kWindow answers of the task instead,
+ * with kHeadroom on top. Until kMinSamples answers are in, the config's
+ * mean_gen_len stands in. A sequence that outgrows its reservation keeps
+ * decoding; its KV is counted as what it holds from then on, so later
+ * admissions see it.
+ *
+ * Answers that hit max_gen_len are recorded at the cap and counted, since the
+ * model wanted at least that many; cancelled ones are not recorded.
+ */
+enum TaskType : int {
+    kTaskChat = 0,       // chat turns and submitGenerate
+    kTaskFlashcard = 1,  // generateBatch and generateSamples: short items from one prompt
+    kTaskSummary = 2,    // summarizeDocument steps
+};
+constexpr int kTaskTypes = 3;
+
+class OutputLengths {
+public:
+    static constexpr size_t kWindow = 128;
+    static constexpr size_t kMinSamples = 8;
+    static constexpr double kQuantile = 0.95;
+    static constexpr double kHeadroom = 1.15;
+
+    struct Stats {
+        uint64_t samples = 0;  // recorded since start
+        double mean = 0.0;     // over the window
+        int p50 = 0;
+        int p95 = 0;
+        uint64_t capped = 0;   // answers that hit max_gen_len
+    };
+
+    // The config's mean_gen_len, used until a task has its own samples
+    void set_prior(int64_t mean_gen_len) { prior_ = static_cast<int>(std::max<int64_t>(1, mean_gen_len)); }
+
+    void record(int task, int tokens, int max_gen_len) {
+        if (task < 0 || task >= kTaskTypes || tokens <= 0) {
+            return;
+        }
+        Task& t = tasks_[task];
+        t.lengths.push_back(tokens);
+        if (t.lengths.size() > kWindow) {
+            t.lengths.pop_front();
+        }
+        t.samples++;
+        if (max_gen_len > 0 && tokens >= max_gen_len) {
+            t.capped++;
+        }
+    }
+
+    // Answer tokens to reserve for a request of `task` capped at `max_gen_len`
+    int reserve(int task, int max_gen_len) const {
+        int cap = std::max(1, max_gen_len);
+        if (task < 0 || task >= kTaskTypes || tasks_[task].lengths.size() < kMinSamples) {
+            return std::min(cap, prior_);
+        }
+        int length = quantile(tasks_[task].lengths, kQuantile);
+        return std::min(cap, std::max(1, static_cast<int>(length * kHeadroom + 0.5)));
+    }
+
+    Stats stats(int task) const {
+        Stats stats;
+        if (task < 0 || task >= kTaskTypes) {
+            return stats;
+        }
+        const Task& t = tasks_[task];
+        stats.samples = t.samples;
+        stats.capped = t.capped;
+        if (!t.lengths.empty()) {
+            double sum = 0.0;
+            for (int length : t.lengths) {
+                sum += length;
+            }
+            stats.mean = sum / static_cast<double>(t.lengths.size());
+            stats.p50 = quantile(t.lengths, 0.5);
+            stats.p95 = quantile(t.lengths, kQuantile);
+        }
+        return stats;
+    }
+
+private:
+    struct Task {
+        std::deque<int> lengths;  // the last kWindow answers, oldest first
+        uint64_t samples = 0;
+        uint64_t capped = 0;
+    };
+
+    static int quantile(const std::deque<int>& lengths, double q) {
+        std::vector<int> sorted(lengths.begin(), lengths.end());
+        size_t at = static_cast<size_t>(q * static_cast<double>(sorted.size() - 1) + 0.5);
+        std::nth_element(sorted.begin(), sorted.begin() + static_cast<std::ptrdiff_t>(at), sorted.end());
+        return sorted[at];
+    }
+
+    int prior_ = 256;
+    Task tasks_[kTaskTypes];
+};
@@ -0,0 +1,368 @@
+#include "page_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "native_log.h"
+#include "sha256.h"
+
+#define LOGI(...) NLOGI("PAGE_STORE", __VA_ARGS__)
+#define LOGE(...) NLOGE("PAGE_STORE", __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t kIndexMagic = 0x58495350;   // "PSIX"
+constexpr uint32_t kRecordMagic = 0x47505350;  // "PSPG"
+constexpr uint32_t kVersion = 1;
+constexpr char kIndexName[] = "/pages.index";
+constexpr char kRecordSuffix[] = ".page";
+
+// Fixed header, followed by the text, the ids and `keys` length-prefixed strings
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tag;
+    uint32_t text_bytes;
+    uint32_t ids;
+    uint32_t keys;
+    uint32_t reserved;
+};
+
+uint64_t fnv1a(const std::string& s) {
+    uint64_t hash = 1469598103934665603ull;
+    for (char c : s) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void remove_records(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return;
+    }
+    size_t suffix = strlen(kRecordSuffix);
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > suffix && name.compare(name.size() - suffix, suffix, kRecordSuffix) == 0) {
+            unlink((dir + "/" + name).c_str());
+        }
+    }
+    closedir(d);
+}
+
+bool read_bytes(const char*& p, const char* end, void* out, size_t size) {
+    if (static_cast<size_t>(end - p) < size) {
+        return false;
+    }
+    memcpy(out, p, size);
+    p += size;
+    return true;
+}
+
+}  // namespace
+
+struct PageStore::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t clock;  // last use stamp handed out
+};
+
+struct PageStore::Slot {
+    Digest digest;
+    uint64_t used = 0;  // 0: free
+    uint32_t bytes = 0;
+    uint32_t reserved = 0;
+};
+
+bool PageStore::Digest::from_hex(const std::string& hex, Digest* digest) {
+    if (hex.size() != 64) {
+        return false;
+    }
+    for (size_t i = 0; i < 64; ++i) {
+        char c = hex[i];
+        int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                                    : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (nibble < 0) {
+            return false;
+        }
+        uint8_t& byte = digest->bytes[i / 2];
+        byte = static_cast<uint8_t>(i % 2 == 0 ? nibble << 4 : byte | nibble);
+    }
+    return true;
+}
+
+std::string PageStore::Digest::hex() const {
+    char out[65];
+    for (int i = 0; i < 32; ++i) {
+        snprintf(out + 2 * i, 3, "%02x", bytes[i]);
+    }
+    return std::string(out, 64);
+}
+
+PageStore::Digest PageStore::hash(const uint8_t* data, size_t size) {
+    Digest digest;
+    sha256::Hasher hasher;
+    hasher.update(data, size);
+    hasher.digest(digest.bytes);
+    return digest;
+}
+
+bool PageStore::hash_file(const std::string& path, Digest* digest) {
+    std::atomic<uint64_t> done{0};
+    return Digest::from_hex(sha256::hash_file(path, &done), digest);
+}
+
+bool PageStore::open(const std::string& dir, const std::string& tag, uint64_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (header_ != nullptr) {
+        munmap(header_, sizeof(Header) + kSlots * sizeof(Slot));
+        header_ = nullptr;
+        slots_ = nullptr;
+    }
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        LOGE("Cannot create page store at %s", dir.c_str());
+        return false;
+    }
+    std::string path = dir + kIndexName;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Cannot open %s", path.c_str());
+        return false;
+    }
+    size_t size = sizeof(Header) + kSlots * sizeof(Slot);
+    struct stat st;
+    bool fresh = fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != size;
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0)) {
+        ::close(fd);
+        LOGE("Cannot size %s", path.c_str());
+        return false;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        LOGE("Failed to mmap %s", path.c_str());
+        return false;
+    }
+    header_ = static_cast<Header*>(addr);
+    slots_ = reinterpret_cast<Slot*>(static_cast<char*>(addr) + sizeof(Header));
+    if (fresh || header_->magic != kIndexMagic || header_->version != kVersion || header_->slots != kSlots) {
+        // Records of an index that is gone could never be found again
+        remove_records(dir);
+        memset(addr, 0, size);
+        header_->magic = kIndexMagic;
+        header_->version = kVersion;
+        header_->slots = kSlots;
+    }
+    dir_ = dir;
+    tag_ = fnv1a(tag);
+    max_bytes_ = max_bytes > 0 ? max_bytes : kDefaultMaxBytes;
+    LOGI("Page store at %s (tag %s, %llu KB cap)", dir.c_str(), tag.c_str(),
+         static_cast<unsigned long long>(max_bytes_ >> 10));
+    return true;
+}
+
+bool PageStore::is_open() const {
+    return header_ != nullptr;
+}
+
+void PageStore::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (header_ != nullptr) {
+        munmap(header_, sizeof(Header) + kSlots * sizeof(Slot));
+        header_ = nullptr;
+        slots_ = nullptr;
+    }
+}
+
+std::string PageStore::record_path(const Digest& digest) const {
+    return dir_ + "/" + digest.hex() + kRecordSuffix;
+}
+
+PageStore::Slot* PageStore::slot_of(const Digest& digest) {
+    for (uint32_t i = 0; i < kSlots; ++i) {
+        if (slots_[i].used != 0 && memcmp(slots_[i].digest.bytes, digest.bytes, sizeof(digest.bytes)) == 0) {
+            return &slots_[i];
+        }
+    }
+    return nullptr;
+}
+
+void PageStore::evict(Slot* slot) {
+    unlink(record_path(slot->digest).c_str());
+    *slot = Slot();
+}
+
+bool PageStore::find(const Digest& digest, PageRecord* record, bool count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot* slot = header_ != nullptr ? slot_of(digest) : nullptr;
+    int fd = slot != nullptr ? ::open(record_path(digest).c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(RecordHeader)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (slot != nullptr) {
+            *slot = Slot();  // the record went missing
+        }
+        stats_.misses += count;
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        stats_.misses += count;
+        return false;
+    }
+
+    const char* p = static_cast<const char*>(addr);
+    const char* end = p + size;
+    RecordHeader header;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    bool ok = header.magic == kRecordMagic && header.version == kVersion &&
+              static_cast<size_t>(end - p) >= header.text_bytes;
+    PageRecord loaded;
+    if (ok) {
+        loaded.text.assign(p, header.text_bytes);
+        p += header.text_bytes;
+        ok = static_cast<size_t>(end - p) / sizeof(int32_t) >= header.ids;
+        loaded.ids.resize(ok ? header.ids : 0);
+        ok = ok && read_bytes(p, end, loaded.ids.data(), loaded.ids.size() * sizeof(int32_t));
+    }
+    for (uint32_t i = 0; ok && i < header.keys; ++i) {
+        uint32_t bytes = 0;
+        ok = read_bytes(p, end, &bytes, sizeof(bytes)) && static_cast<size_t>(end - p) >= bytes;
+        if (ok) {
+            loaded.keys.emplace_back(p, bytes);
+            p += bytes;
+        }
+    }
+    munmap(addr, size);
+    if (!ok) {
+        LOGE("Page record %s is invalid, dropping it", digest.hex().c_str());
+        evict(slot);
+        stats_.misses += count;
+        return false;
+    }
+    if (header.tag != tag_) {
+        loaded.ids.clear();
+        loaded.keys.clear();
+    }
+    slot->used = ++header_->clock;
+    stats_.hits += count;
+    *record = std::move(loaded);
+    return true;
+}
+
+bool PageStore::put(const Digest& digest, const PageRecord& record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (header_ == nullptr) {
+        return false;
+    }
+    RecordHeader header{kRecordMagic, kVersion, tag_, static_cast<uint32_t>(record.text.size()),
+                        static_cast<uint32_t>(record.ids.size()), static_cast<uint32_t>(record.keys.size()), 0};
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data += record.text;
+    data.append(reinterpret_cast<const char*>(record.ids.data()), record.ids.size() * sizeof(int32_t));
+    for (const std::string& key : record.keys) {
+        uint32_t bytes = static_cast<uint32_t>(key.size());
+        data.append(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+        data += key;
+    }
+    if (data.size() > max_bytes_) {
+        return false;
+    }
+
+    // Write next to the record and rename, so a kill mid-write keeps the old one
+    std::string path = record_path(digest);
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!out.good()) {
+            LOGE("Failed to write %s", tmp.c_str());
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to replace %s", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    Slot* slot = slot_of(digest);
+    if (slot == nullptr) {
+        // A free slot, else the least recently used
+        slot = &slots_[0];
+        for (uint32_t i = 0; i < kSlots && slot->used != 0; ++i) {
+            if (slots_[i].used < slot->used) {
+                slot = &slots_[i];
+            }
+        }
+        if (slot->used != 0) {
+            evict(slot);
+        }
+        slot->digest = digest;
+    }
+    slot->bytes = static_cast<uint32_t>(data.size());
+    slot->used = ++header_->clock;
+
+    // Then the least recently used others until the pages fit the cap
+    for (;;) {
+        uint64_t total = 0;
+        Slot* oldest = nullptr;
+        for (uint32_t i = 0; i < kSlots; ++i) {
+            if (slots_[i].used == 0) {
+                continue;
+            }
+            total += slots_[i].bytes;
+            if (&slots_[i] != slot && (oldest == nullptr || slots_[i].used < oldest->used)) {
+                oldest = &slots_[i];
+            }
+        }
+        if (total <= max_bytes_ || oldest == nullptr) {
+            break;
+        }
+        evict(oldest);
+    }
+    return true;
+}
+
+void PageStore::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (header_ == nullptr) {
+        return;
+    }
+    for (uint32_t i = 0; i < kSlots; ++i) {
+        if (slots_[i].used != 0) {
+            evict(&slots_[i]);
+        }
+    }
+}
+
+PageStore::Stats PageStore::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    for (uint32_t i = 0; header_ != nullptr && i < kSlots; ++i) {
+        if (slots_[i].used != 0) {
+            stats.pages++;
+            stats.bytes += slots_[i].bytes;
+        }
+    }
+    return stats;
+}
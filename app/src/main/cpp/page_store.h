@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * OCR results of saved page images, by the SHA-256 of the image content.
+ *
+ * Students re-open the same captured pages again and again, and each time
+ * the page went through ML Kit and the tokenizer before the prefix KV cache
+ * had a chance to hit. The store maps an image's content hash to its
+ * normalized OCR text, the token ids of that text and any keys the caller
+ * files with it (chunk prefix keys, summary cache keys), so a page seen before
+ * goes straight to the prefix lookup.
+ *
+ * Each page is a small record, <hex>.page, written next to itself and renamed
+ * like a saved session and read back through mmap. The index is one mmapped
+ * file of kSlots fixed slots (digest, last use, record size): a lookup scans
+ * it and stamps the slot, with no write call, and the page cache writes it
+ * back. When the slots or the byte cap run out, the least recently used page
+ * goes. Ids and keys belong to one tokenizer and model, named by the tag the
+ * store is opened with; a record written under another tag keeps its text
+ * only. Thread-safe.
+ */
+struct PageRecord {
+    std::string text;               // normalized OCR text
+    std::vector<int32_t> ids;       // token ids of `text`; empty until stored
+    std::vector<std::string> keys;  // prefix or summary keys of the page's chunks
+};
+
+class PageStore {
+public:
+    static constexpr uint32_t kSlots = 1024;
+    static constexpr uint64_t kDefaultMaxBytes = 16ull << 20;
+
+    struct Digest {
+        uint8_t bytes[32] = {0};
+
+        // From 64 hex digits; false for anything else
+        static bool from_hex(const std::string& hex, Digest* digest);
+        std::string hex() const;
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t pages = 0;
+        uint64_t bytes = 0;
+    };
+
+    ~PageStore() { close(); }
+
+    // Use `dir` (created if missing) for ids and keys under `tag`; a store open elsewhere is closed first
+    bool open(const std::string& dir, const std::string& tag, uint64_t max_bytes);
+    bool is_open() const;
+    void close();
+
+    // The record of `digest`; counts a hit or a miss unless `count` is false
+    bool find(const Digest& digest, PageRecord* record, bool count = true);
+    // Writes or replaces the record of `digest`, evicting least recently used pages to fit
+    bool put(const Digest& digest, const PageRecord& record);
+    void clear();
+    Stats stats();
+
+    // SHA-256 of `size` bytes, and of an image file's bytes (false if it cannot be read)
+    static Digest hash(const uint8_t* data, size_t size);
+    static bool hash_file(const std::string& path, Digest* digest);
+
+private:
+    struct Header;
+    struct Slot;
+
+    std::mutex mutex_;
+    std::string dir_;
+    uint64_t tag_ = 0;
+    uint64_t max_bytes_ = kDefaultMaxBytes;
+    Header* header_ = nullptr;  // the mmapped index
+    Slot* slots_ = nullptr;
+    Stats stats_;
+
+    // Under mutex_
+    Slot* slot_of(const Digest& digest);
+    void evict(Slot* slot);
+    std::string record_path(const Digest& digest) const;
+};
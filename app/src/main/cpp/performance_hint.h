@@ -0,0 +1,219 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <tvm/runtime/c_backend_api.h>
+
+#include "shared_pool.h"
+
+/**
+ * ADPF performance hints for the threads that decode.
+ *
+ * The CPU governor picks clocks from recent utilization, so it sees a decode
+ * step as a short burst followed by idle time and keeps the cores lower than
+ * the token rate needs; a session from APerformanceHintManager tells it the
+ * work's real deadline instead. The session covers the engine thread, the
+ * shared pool's workers and those of TVM's pool (collected by one parallel launch),
+ * with a target work duration of one token at the rate asked of the governor,
+ * kDefaultTokensPerSecond without one. Each decode step reports how long it
+ * actually took; a step over the target raises the clocks, one well under it
+ * lets them fall.
+ *
+ * The NDK functions are API 33 (threads updated in place from 34, a workload
+ * increase announced at the start of a turn from 35) and looked up at runtime,
+ * so below that and on hosts nothing happens. Only the engine thread calls it.
+ */
+namespace performance_hint {
+
+constexpr float kDefaultTokensPerSecond = 12.0f;
+
+// One token at `tokens_per_second` (kDefaultTokensPerSecond when <= 0), in ns
+inline int64_t target_ns(float tokens_per_second) {
+    float rate = tokens_per_second > 0.0f ? tokens_per_second : kDefaultTokensPerSecond;
+    return static_cast<int64_t>(1e9 / rate);
+}
+
+// tids of the calling thread, the shared pool's workers and every TVM pool worker that ran a task of one launch
+inline std::vector<int32_t> pool_thread_ids() {
+    struct Collect {
+        std::mutex mutex;
+        std::vector<int32_t> tids;
+    } collect;
+    collect.tids.push_back(static_cast<int32_t>(syscall(SYS_gettid)));
+    TVMBackendParallelLaunch(
+        [](int task_id, TVMParallelGroupEnv* /* penv */, void* cdata) -> int {
+            (void)task_id;
+            auto* c = static_cast<Collect*>(cdata);
+            int32_t tid = static_cast<int32_t>(syscall(SYS_gettid));
+            std::lock_guard<std::mutex> lock(c->mutex);
+            if (std::find(c->tids.begin(), c->tids.end(), tid) == c->tids.end()) {
+                c->tids.push_back(tid);
+            }
+            return 0;
+        },
+        &collect, 0);
+    for (int32_t tid : shared_pool::pool().thread_ids()) {
+        if (std::find(collect.tids.begin(), collect.tids.end(), tid) == collect.tids.end()) {
+            collect.tids.push_back(tid);
+        }
+    }
+    return collect.tids;
+}
+
+struct Stats {
+    bool supported = false;  // the NDK has APerformanceHintManager
+    bool active = false;     // a session is open
+    int threads = 0;
+    int64_t target_ns = 0;
+    uint64_t reports = 0;
+    uint64_t over_target = 0;  // reports longer than the target
+    double average_ms = 0.0;   // of the reported steps
+};
+
+class HintSession {
+public:
+    ~HintSession() { close(); }
+
+    void set_enabled(bool enabled) {
+        enabled_ = enabled;
+        if (!enabled) {
+            close();
+        }
+    }
+    bool enabled() const { return enabled_; }
+
+    // Start timing a turn against `tokens_per_second`; opens the session, or
+    // points it at the pool's current threads, which a thread config change recreates
+    void begin_turn(float tokens_per_second) {
+        last_ = {};
+        if (!enabled_ || !api().loaded()) {
+            return;
+        }
+        std::vector<int32_t> tids = pool_thread_ids();
+        int64_t target = target_ns(tokens_per_second);
+        if (session_ != nullptr && tids != tids_ && api().set_threads == nullptr) {
+            close();  // API 33 cannot move a session to other threads
+        }
+        if (session_ == nullptr) {
+            session_ = api().create(api().manager, tids.data(), tids.size(), target);
+            if (session_ == nullptr) {
+                return;
+            }
+        } else {
+            if (tids != tids_) {
+                api().set_threads(session_, tids.data(), tids.size());
+            }
+            if (target != target_ns_) {
+                api().update_target(session_, target);
+            }
+        }
+        tids_ = std::move(tids);
+        target_ns_ = target;
+        if (api().notify_increase != nullptr) {
+            api().notify_increase(session_, true, false, "turn");
+        }
+        last_ = std::chrono::steady_clock::now();
+    }
+
+    // A decode step ended: reports the time since the previous one (or the turn's start)
+    void step() {
+        if (session_ == nullptr || last_ == std::chrono::steady_clock::time_point{}) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count();
+        last_ = now;
+        if (ns <= 0 || api().report(session_, ns) != 0) {
+            return;
+        }
+        reports_++;
+        over_target_ += ns > target_ns_;
+        reported_ns_ += ns;
+    }
+
+    // Idle time between turns is not reported as work
+    void end_turn() { last_ = {}; }
+
+    Stats stats() const {
+        Stats stats;
+        stats.supported = api().loaded();
+        stats.active = session_ != nullptr;
+        stats.threads = static_cast<int>(tids_.size());
+        stats.target_ns = target_ns_;
+        stats.reports = reports_;
+        stats.over_target = over_target_;
+        stats.average_ms = reports_ > 0 ? reported_ns_ / 1e6 / reports_ : 0.0;
+        return stats;
+    }
+
+    void close() {
+        if (session_ != nullptr) {
+            api().close(session_);
+            session_ = nullptr;
+        }
+        tids_.clear();
+        target_ns_ = 0;
+        last_ = {};
+    }
+
+private:
+    struct Api {
+        using GetManager = void* (*)();
+        using Create = void* (*)(void*, const int32_t*, size_t, int64_t);
+        using UpdateTarget = int (*)(void*, int64_t);
+        using Report = int (*)(void*, int64_t);
+        using Close = void (*)(void*);
+        using SetThreads = int (*)(void*, const int32_t*, size_t);
+        using NotifyIncrease = int (*)(void*, bool, bool, const char*);
+
+        void* manager = nullptr;
+        Create create = nullptr;
+        UpdateTarget update_target = nullptr;
+        Report report = nullptr;
+        Close close = nullptr;
+        SetThreads set_threads = nullptr;         // API 34
+        NotifyIncrease notify_increase = nullptr;  // API 35
+
+        bool loaded() const {
+            return manager != nullptr && create != nullptr && update_target != nullptr && report != nullptr &&
+                   close != nullptr;
+        }
+    };
+
+    static const Api& api() {
+        static const Api api = [] {
+            Api a;
+            auto get_manager = reinterpret_cast<Api::GetManager>(dlsym(RTLD_DEFAULT, "APerformanceHint_getManager"));
+            a.manager = get_manager != nullptr ? get_manager() : nullptr;
+            a.create = reinterpret_cast<Api::Create>(dlsym(RTLD_DEFAULT, "APerformanceHint_createSession"));
+            a.update_target = reinterpret_cast<Api::UpdateTarget>(
+                    dlsym(RTLD_DEFAULT, "APerformanceHint_updateTargetWorkDuration"));
+            a.report = reinterpret_cast<Api::Report>(dlsym(RTLD_DEFAULT, "APerformanceHint_reportActualWorkDuration"));
+            a.close = reinterpret_cast<Api::Close>(dlsym(RTLD_DEFAULT, "APerformanceHint_closeSession"));
+            a.set_threads = reinterpret_cast<Api::SetThreads>(dlsym(RTLD_DEFAULT, "APerformanceHint_setThreads"));
+            a.notify_increase = reinterpret_cast<Api::NotifyIncrease>(
+                    dlsym(RTLD_DEFAULT, "APerformanceHint_notifyWorkloadIncrease"));
+            return a;
+        }();
+        return api;
+    }
+
+    bool enabled_ = true;
+    void* session_ = nullptr;
+    std::vector<int32_t> tids_;
+    int64_t target_ns_ = 0;
+    std::chrono::steady_clock::time_point last_{};
+    uint64_t reports_ = 0;
+    uint64_t over_target_ = 0;
+    int64_t reported_ns_ = 0;
+};
+
+}  // namespace performance_hint
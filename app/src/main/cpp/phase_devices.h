@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "compute_device.h"
+#include "json_fields.h"
+
+/**
+ * Which device runs prefill and which runs decode.
+ *
+ * Prefill is compute bound and decode is bandwidth bound, so on some SoCs the
+ * GPU wins one phase and the CPU the other (a GPU with few shader cores next
+ * to big CPU cores, or a fast GPU behind a slow driver path for single-token
+ * kernels). A short calibration times both phases on every device present;
+ * the modules that can split them (set_phase_device) hand the KV across at
+ * the first decode step, which costs nothing on unified memory and a copy
+ * elsewhere. That handoff is measured too, and a split is only kept if it
+ * beats the best single device over a typical study turn.
+ *
+ * The plan is saved next to the model (phase-devices.json), tied to the
+ * model's fingerprint, so calibration runs once per model and device.
+ *
+ * A model library may also carry prefill graphs compiled for the NPU at a few
+ * fixed chunk sizes (npu_prefill_chunks). The NPU is then timed as a prefill
+ * device only, its decode never a candidate, and while it holds the prefill
+ * phase the prompt is stepped in chunks of those sizes (npu_chunk()), so a
+ * long OCR prompt runs on the NPU graph by graph before the KV goes back to
+ * the decode device.
+ */
+struct PhaseTiming {
+    ComputeBackend backend = kBackendCpu;
+    double prefill_ms_per_token = 0.0;
+    double decode_ms_per_token = 0.0;
+    double first_decode_ms = 0.0;  // first step after prefill, where a split hands the KV over
+
+    // For a device that cannot decode: never picked for the decode phase
+    void prefill_only() {
+        decode_ms_per_token = std::numeric_limits<double>::infinity();
+    }
+};
+
+// The next prefill step on the NPU for `left` tokens: the largest graph that
+// fits, else the smallest, which the module pads. `shapes` ascending, not empty.
+inline int64_t npu_chunk(const std::vector<int64_t>& shapes, int64_t left) {
+    int64_t chunk = shapes.front();
+    for (int64_t shape : shapes) {
+        if (shape <= left) {
+            chunk = shape;
+        }
+    }
+    return chunk;
+}
+
+struct PhasePlan {
+    // A typical turn: a page of OCR text in, a short explanation out
+    static constexpr double kTurnPromptTokens = 512.0;
+    static constexpr double kTurnOutputTokens = 192.0;
+
+    ComputeBackend prefill = kBackendAuto;  // auto: the module's own device for both
+    ComputeBackend decode = kBackendAuto;
+    double prefill_ms_per_token = 0.0;
+    double decode_ms_per_token = 0.0;
+    double handoff_ms = 0.0;  // KV handoff at the first decode step of a split
+
+    bool calibrated() const { return prefill != kBackendAuto && decode != kBackendAuto; }
+    bool split() const { return calibrated() && prefill != decode; }
+
+    double turn_ms() const {
+        return kTurnPromptTokens * prefill_ms_per_token + kTurnOutputTokens * decode_ms_per_token + handoff_ms;
+    }
+
+    // Best single device, and the best pairing of phases (equal to it when no split helps)
+    static PhasePlan best_single(const std::vector<PhaseTiming>& timings) {
+        PhasePlan best;
+        for (const PhaseTiming& t : timings) {
+            PhasePlan plan;
+            plan.prefill = plan.decode = t.backend;
+            plan.prefill_ms_per_token = t.prefill_ms_per_token;
+            plan.decode_ms_per_token = t.decode_ms_per_token;
+            if (!best.calibrated() || plan.turn_ms() < best.turn_ms()) {
+                best = plan;
+            }
+        }
+        return best;
+    }
+
+    static PhasePlan best_split(const std::vector<PhaseTiming>& timings) {
+        PhasePlan best;
+        for (const PhaseTiming& p : timings) {
+            for (const PhaseTiming& d : timings) {
+                PhasePlan plan;
+                plan.prefill = p.backend;
+                plan.decode = d.backend;
+                plan.prefill_ms_per_token = p.prefill_ms_per_token;
+                plan.decode_ms_per_token = d.decode_ms_per_token;
+                if (!best.calibrated() || plan.turn_ms() < best.turn_ms()) {
+                    best = plan;
+                }
+            }
+        }
+        return best;
+    }
+
+    std::string to_json(uint64_t model_hash) const {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"model_hash\": \"%016llx\", \"prefill\": \"%s\", \"decode\": \"%s\", "
+                 "\"prefill_ms_per_token\": %.4f, \"decode_ms_per_token\": %.4f, \"handoff_ms\": %.3f}\n",
+                 static_cast<unsigned long long>(model_hash), compute_backend_name(prefill),
+                 compute_backend_name(decode), prefill_ms_per_token, decode_ms_per_token, handoff_ms);
+        return buffer;
+    }
+
+    // False if the JSON is not a plan for this model
+    static bool from_json(const std::string& json, uint64_t model_hash, PhasePlan* plan) {
+        char expected[17];
+        snprintf(expected, sizeof(expected), "%016llx", static_cast<unsigned long long>(model_hash));
+        if (json_string_field(json, "model_hash") != expected) {
+            return false;
+        }
+        PhasePlan loaded;
+        loaded.prefill = backend_named(json_string_field(json, "prefill"));
+        loaded.decode = backend_named(json_string_field(json, "decode"));
+        loaded.prefill_ms_per_token = json_float_field(json, "prefill_ms_per_token", 0.0);
+        loaded.decode_ms_per_token = json_float_field(json, "decode_ms_per_token", 0.0);
+        loaded.handoff_ms = json_float_field(json, "handoff_ms", 0.0);
+        if (!loaded.calibrated()) {
+            return false;
+        }
+        *plan = loaded;
+        return true;
+    }
+
+private:
+    static ComputeBackend backend_named(const std::string& name) {
+        return name == compute_backend_name(kBackendNpu) ? kBackendNpu : compute_backend_from_device(name);
+    }
+};
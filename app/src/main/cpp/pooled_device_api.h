@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <tvm/runtime/device_api.h>
+#include <tvm/runtime/registry.h>
+
+#include "flight_recorder.h"
+#include "native_log.h"
+
+/**
+ * Size-class pool in front of the TVM device APIs.
+ *
+ * Every NDArray and VM storage block the runtime allocates goes through
+ * DeviceAPI::AllocDataSpace, also behind the memory manager's allocators
+ * (memory_manager.h): the naive one allocates on every call and the pooled
+ * one only reuses blocks of the exact same page-rounded size, so a decode
+ * step whose intermediate shapes change with the sequence length keeps
+ * missing. This wraps the registered "device_api.<name>" entries so freed
+ * blocks go to per-device free lists of size classes (four per power of two,
+ * at most 25% slack) and the next request of that class reuses them. After a
+ * warm-up pass has populated the lists, steady-state decode allocates
+ * nothing from the driver or the host heap; the counters show whether it does.
+ *
+ * The wrappers have to be registered before the runtime first asks for a
+ * device API, which it caches; install() checks that it took effect. Blocks
+ * with a memory scope (OpenCL textures) and alignments above kAlignment go
+ * straight to the driver. Workspace calls are forwarded unchanged (the CPU and
+ * OpenCL APIs pool them already) and only counted.
+ */
+// Driver allocations in the decode steps of one request, for getAllocStats()
+struct AllocStepStats {
+    // The first steps may still meet new shapes; later ones should not allocate
+    static constexpr int kWarmSteps = 2;
+
+    int steps = 0;
+    uint64_t steady_allocs = 0;  // in the steps after kWarmSteps
+    uint64_t last_step_allocs = 0;
+
+    void record(int step, uint64_t allocs) {
+        steps++;
+        last_step_allocs = allocs;
+        if (step >= kWarmSteps) {
+            steady_allocs += allocs;
+        }
+    }
+};
+
+namespace device_pool {
+
+using tvm::runtime::DeviceAPI;
+using tvm::runtime::DeviceAttrKind;
+using tvm::runtime::Optional;
+using tvm::runtime::String;
+using tvm::runtime::TVMArgs;
+using tvm::runtime::TVMRetValue;
+
+struct PoolCounts {
+    uint64_t driver_allocs = 0;     // AllocDataSpace calls that reached the driver
+    uint64_t pool_hits = 0;         // served from a free list
+    uint64_t workspace_allocs = 0;  // AllocWorkspace calls, forwarded
+    uint64_t pooled_bytes = 0;      // idle in free lists
+    uint64_t live_bytes = 0;        // handed out and not freed
+};
+
+class PooledDeviceAPI final : public DeviceAPI {
+public:
+    static constexpr size_t kAlignment = 256;
+    // Idle bytes kept per device; blocks freed past it go back to the driver
+    static constexpr uint64_t kMaxPooledBytes = 128ull << 20;
+
+    explicit PooledDeviceAPI(DeviceAPI* base) : base_(base) {}
+
+    // Rounded up to one of four steps per power of two, so slack is at most 25%
+    static size_t size_class(size_t bytes) {
+        if (bytes <= kAlignment) {
+            return kAlignment;
+        }
+        size_t power = size_t(1) << (63 - __builtin_clzll(static_cast<unsigned long long>(bytes)));
+        size_t step = std::max(power / 4, kAlignment);
+        return (bytes + step - 1) / step * step;
+    }
+
+    void* AllocDataSpace(tvm::Device dev, size_t nbytes, size_t alignment, DLDataType type_hint) final {
+        if (alignment > kAlignment) {
+            count_driver_alloc(dev, nbytes);
+            return base_->AllocDataSpace(dev, nbytes, alignment, type_hint);
+        }
+        size_t size = size_class(nbytes);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<void*>& free_list = free_[key(dev, size)];
+            if (!free_list.empty()) {
+                void* ptr = free_list.back();
+                free_list.pop_back();
+                live_[ptr] = Block{key(dev, size), size};
+                pooled_bytes_ -= size;
+                live_bytes_ += size;
+                pool_hits_.fetch_add(1, std::memory_order_relaxed);
+                return ptr;
+            }
+        }
+        count_driver_alloc(dev, size);
+        void* ptr = base_->AllocDataSpace(dev, size, kAlignment, type_hint);
+        std::lock_guard<std::mutex> lock(mutex_);
+        live_[ptr] = Block{key(dev, size), size};
+        live_bytes_ += size;
+        return ptr;
+    }
+
+    void* AllocDataSpace(tvm::Device dev, int ndim, const int64_t* shape, DLDataType dtype,
+                         Optional<String> mem_scope) final {
+        if (mem_scope.defined() && mem_scope.value() != "global") {
+            driver_allocs_.fetch_add(1, std::memory_order_relaxed);
+            return base_->AllocDataSpace(dev, ndim, shape, dtype, mem_scope);
+        }
+        DLTensor tensor{};
+        tensor.device = dev;
+        tensor.ndim = ndim;
+        tensor.dtype = dtype;
+        tensor.shape = const_cast<int64_t*>(shape);
+        return AllocDataSpace(dev, GetDataSize(tensor), tvm::runtime::kAllocAlignment, dtype);
+    }
+
+    void FreeDataSpace(tvm::Device dev, void* ptr) final {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = live_.find(ptr);
+            if (it != live_.end()) {
+                Block block = it->second;
+                live_.erase(it);
+                live_bytes_ -= block.size;
+                if (pooled_bytes_ + block.size <= kMaxPooledBytes) {
+                    free_[block.key].push_back(ptr);
+                    pooled_bytes_ += block.size;
+                    return;
+                }
+            }
+        }
+        base_->FreeDataSpace(dev, ptr);
+    }
+
+    void* AllocWorkspace(tvm::Device dev, size_t nbytes, DLDataType type_hint) final {
+        workspace_allocs_.fetch_add(1, std::memory_order_relaxed);
+        return base_->AllocWorkspace(dev, nbytes, type_hint);
+    }
+
+    void FreeWorkspace(tvm::Device dev, void* ptr) final { base_->FreeWorkspace(dev, ptr); }
+
+    // Give every idle block back to the driver
+    void trim() {
+        std::unordered_map<uint64_t, std::vector<void*>> idle;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            idle.swap(free_);
+            pooled_bytes_ = 0;
+        }
+        for (auto& entry : idle) {
+            tvm::Device dev{static_cast<DLDeviceType>(entry.first >> 56),
+                                     static_cast<int>((entry.first >> 48) & 0xff)};
+            for (void* ptr : entry.second) {
+                base_->FreeDataSpace(dev, ptr);
+            }
+        }
+    }
+
+    void add_driver_allocs(PoolCounts* counts) const {
+        counts->driver_allocs += driver_allocs_.load(std::memory_order_relaxed);
+    }
+
+    void add_counts(PoolCounts* counts) {
+        counts->driver_allocs += driver_allocs_.load(std::memory_order_relaxed);
+        counts->pool_hits += pool_hits_.load(std::memory_order_relaxed);
+        counts->workspace_allocs += workspace_allocs_.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        counts->pooled_bytes += pooled_bytes_;
+        counts->live_bytes += live_bytes_;
+    }
+
+    // Everything else is the driver's
+    void SetDevice(tvm::Device dev) final { base_->SetDevice(dev); }
+    void GetAttr(tvm::Device dev, DeviceAttrKind kind, TVMRetValue* rv) final {
+        base_->GetAttr(dev, kind, rv);
+    }
+    size_t GetDataSize(const DLTensor& arr, Optional<String> mem_scope = tvm::NullOpt) final {
+        return base_->GetDataSize(arr, mem_scope);
+    }
+    void GetTargetProperty(tvm::Device dev, const std::string& property, TVMRetValue* rv) final {
+        base_->GetTargetProperty(dev, property, rv);
+    }
+    void CopyDataFromTo(DLTensor* from, DLTensor* to, TVMStreamHandle stream) final {
+        base_->CopyDataFromTo(from, to, stream);
+    }
+    TVMStreamHandle CreateStream(tvm::Device dev) final { return base_->CreateStream(dev); }
+    void FreeStream(tvm::Device dev, TVMStreamHandle stream) final { base_->FreeStream(dev, stream); }
+    void StreamSync(tvm::Device dev, TVMStreamHandle stream) final { base_->StreamSync(dev, stream); }
+    void SetStream(tvm::Device dev, TVMStreamHandle stream) final { base_->SetStream(dev, stream); }
+    TVMStreamHandle GetCurrentStream(tvm::Device dev) final { return base_->GetCurrentStream(dev); }
+    void SyncStreamFromTo(tvm::Device dev, TVMStreamHandle event_src, TVMStreamHandle event_dst) final {
+        base_->SyncStreamFromTo(dev, event_src, event_dst);
+    }
+    bool SupportsDevicePointerArithmeticsOnHost() final { return base_->SupportsDevicePointerArithmeticsOnHost(); }
+
+private:
+    struct Block {
+        uint64_t key;
+        size_t size;
+    };
+
+    // Device type, device id and size class in one word
+    static uint64_t key(tvm::Device dev, size_t size) {
+        return (static_cast<uint64_t>(dev.device_type) << 56) | (static_cast<uint64_t>(dev.device_id & 0xff) << 48) |
+               (static_cast<uint64_t>(size) & ((1ull << 48) - 1));
+    }
+
+    // Large ones go to the flight recorder too: a driver allocation mid-request is a latency suspect
+    void count_driver_alloc(tvm::Device dev, size_t bytes) {
+        driver_allocs_.fetch_add(1, std::memory_order_relaxed);
+        if (bytes >= flight::kAllocThreshold) {
+            flight::record(flight::kEventAlloc, "driver_alloc", static_cast<int64_t>(bytes), dev.device_type);
+        }
+    }
+
+    DeviceAPI* base_;
+    std::mutex mutex_;
+    std::unordered_map<uint64_t, std::vector<void*>> free_;
+    std::unordered_map<void*, Block> live_;
+    uint64_t pooled_bytes_ = 0;
+    uint64_t live_bytes_ = 0;
+    std::atomic<uint64_t> driver_allocs_{0};
+    std::atomic<uint64_t> pool_hits_{0};
+    std::atomic<uint64_t> workspace_allocs_{0};
+};
+
+// Wrappers by device type; they live as long as the runtime's cached pointers
+inline std::vector<std::pair<int, PooledDeviceAPI*>>& installed() {
+    static std::vector<std::pair<int, PooledDeviceAPI*>>* apis = new std::vector<std::pair<int, PooledDeviceAPI*>>();
+    return *apis;
+}
+
+// Wraps the CPU, OpenCL and Vulkan device APIs present; safe to call more than once.
+// Returns how many device types the runtime now allocates through a pool.
+inline int install() {
+    static std::mutex install_mutex;
+    std::lock_guard<std::mutex> lock(install_mutex);
+    struct Target {
+        DLDeviceType type;
+        const char* name;
+    };
+    for (Target target : {Target{kDLCPU, "device_api.cpu"}, Target{kDLOpenCL, "device_api.opencl"},
+                          Target{kDLVulkan, "device_api.vulkan"}}) {
+        bool done = false;
+        for (const auto& entry : installed()) {
+            done = done || entry.first == target.type;
+        }
+        const tvm::runtime::PackedFunc* factory = tvm::runtime::Registry::Get(target.name);
+        if (done || factory == nullptr) {
+            continue;
+        }
+        void* base = (*factory)();
+        if (base == nullptr) {
+            continue;
+        }
+        PooledDeviceAPI* api = new PooledDeviceAPI(static_cast<DeviceAPI*>(base));
+        tvm::runtime::Registry::Register(target.name, true).set_body([api](TVMArgs, TVMRetValue* rv) {
+            *rv = static_cast<void*>(api);
+        });
+        // The runtime resolves each device type once; if that already happened the wrapper is unused
+        if (DeviceAPI::Get(tvm::Device{target.type, 0}, true) != api) {
+            NLOGW("DevicePool", "%s was resolved before the pool; not pooled", target.name);
+            continue;
+        }
+        installed().emplace_back(target.type, api);
+    }
+    return static_cast<int>(installed().size());
+}
+
+inline PoolCounts counts() {
+    PoolCounts total;
+    for (const auto& entry : installed()) {
+        entry.second->add_counts(&total);
+    }
+    return total;
+}
+
+// Just the driver allocation count, for a per-step delta on the decode path
+inline uint64_t driver_allocs() {
+    PoolCounts total;
+    for (const auto& entry : installed()) {
+        entry.second->add_driver_allocs(&total);
+    }
+    return total.driver_allocs;
+}
+
+inline void trim() {
+    for (const auto& entry : installed()) {
+        entry.second->trim();
+    }
+}
+
+}  // namespace device_pool
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "generation_governor.h"
+#include "thread_config.h"
+
+/**
+ * Battery-saver inference profile.
+ *
+ * The saver profile trades tokens/s for energy per token: the thread pool on
+ * the mid cores only (the prime core draws the most per instruction), no
+ * speculative decoding (rejected drafts and verify passes are spent energy;
+ * the draft model is unloaded), a smaller batch, and the model's lower-bit
+ * build when one ships in <model_dir>/saver, which reads less memory per
+ * token. Auto mode enters it while Android's battery saver is on or the
+ * battery is below the threshold and not charging, and leaves it
+ * kHysteresisPercent above the threshold so a battery at the line does not
+ * reload the model back and forth.
+ *
+ * Energy is measured per profile from the battery's own gauge: the power
+ * drawn at the end of a turn (current_now x voltage_now, which fuel gauges
+ * average over about a second) over the turn's duration. Turns on a charger
+ * are not measured; the gauge then reads the charge current.
+ */
+enum PowerMode : int {
+    kPowerAuto = 0,
+    kPowerNormal = 1,  // never the saver profile
+    kPowerSaver = 2,   // always the saver profile
+};
+
+enum PowerProfile : int {
+    kProfileNormal = 0,
+    kProfileSaver = 1,
+};
+constexpr int kPowerProfiles = 2;
+
+namespace power_profile {
+
+static constexpr const char* kSaverModelDir = "saver";  // under the model directory
+static constexpr int kSaverMaxBatch = 2;
+static constexpr float kDefaultThresholdPercent = 20.0f;
+static constexpr float kHysteresisPercent = 5.0f;
+
+// The lower-bit build shipped for the saver profile, or "" without one
+inline std::string saver_model_dir(const std::string& model_dir) {
+    std::string dir = model_dir + "/" + kSaverModelDir;
+    std::ifstream config(dir + "/mlc-chat-config.json");
+    return config.good() ? dir : std::string();
+}
+
+// The profile `mode` asks for in `state`, given the one in use
+inline PowerProfile decide(int mode, const DeviceState& state, float threshold_percent, PowerProfile current) {
+    if (mode == kPowerNormal) {
+        return kProfileNormal;
+    }
+    if (mode == kPowerSaver) {
+        return kProfileSaver;
+    }
+    if (state.power_save) {
+        return kProfileSaver;
+    }
+    if (state.charging || state.battery_percent < 0.0f) {
+        return kProfileNormal;
+    }
+    float leave = threshold_percent + (current == kProfileSaver ? kHysteresisPercent : 0.0f);
+    return state.battery_percent < leave ? kProfileSaver : kProfileNormal;
+}
+
+// Drawn from the battery right now in mW; <= 0 when unknown or charging
+inline float battery_power_mw() {
+    auto read = [](const char* path) {
+        std::ifstream in(path);
+        double value = 0.0;
+        return in >> value ? value : 0.0;
+    };
+    std::ifstream status_in("/sys/class/power_supply/battery/status");
+    std::string status;
+    std::getline(status_in, status);
+    if (status == "Charging" || status == "Full") {
+        return 0.0f;
+    }
+    // µA and µV; the sign of the current differs between vendors
+    double current_ua = std::fabs(read("/sys/class/power_supply/battery/current_now"));
+    double voltage_uv = read("/sys/class/power_supply/battery/voltage_now");
+    return static_cast<float>(current_ua * voltage_uv / 1e9);
+}
+
+class EnergyMeter {
+public:
+    struct Stats {
+        uint64_t tokens = 0;
+        double joules = 0.0;
+        double seconds = 0.0;
+
+        float mj_per_token() const {
+            return tokens == 0 ? 0.0f : static_cast<float>(joules * 1000.0 / static_cast<double>(tokens));
+        }
+        float mean_mw() const { return seconds <= 0.0 ? 0.0f : static_cast<float>(joules * 1000.0 / seconds); }
+    };
+
+    // A turn of `tokens` in `ms` under `profile`; false if the gauge had nothing to say
+    bool record(int profile, size_t tokens, double ms) {
+        float mw = battery_power_mw();
+        last_mw_ = mw;
+        if (profile < 0 || profile >= kPowerProfiles || mw <= 0.0f || tokens == 0 || ms <= 0.0) {
+            return false;
+        }
+        Stats& stats = stats_[profile];
+        stats.tokens += tokens;
+        stats.joules += mw * ms / 1e6;
+        stats.seconds += ms / 1000.0;
+        return true;
+    }
+
+    Stats stats(int profile) const {
+        return profile >= 0 && profile < kPowerProfiles ? stats_[profile] : Stats();
+    }
+    float last_mw() const { return last_mw_; }
+
+private:
+    Stats stats_[kPowerProfiles];
+    float last_mw_ = 0.0f;
+};
+
+}  // namespace power_profile
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "json_fields.h"
+#include "model_manifest.h"
+
+/**
+ * The system prompt + template prefix KV, computed when the model package is
+ * built (compile_model_for_android.py --prefix-kv) and shipped next to the
+ * weights, so the first conversation after install starts from it instead of
+ * prefilling the prefix on the device.
+ *
+ *   prefix_kv.bin    the prefix as the module's save_kv(slot, path) writes it;
+ *                    load_kv maps it into the snapshot slot
+ *   prefix_kv.json   {"version": 1, "fingerprint": "<16 hex digits>",
+ *                     "kv_cache_dtype": "float16", "system_prompt": "..."}
+ *
+ * The blob only fits the model it was computed with, so the fingerprint is
+ * FNV-1a over mlc-chat-config.json (conversation template included) and
+ * ndarray-cache.json, in that order; the build script computes the same. The
+ * model library is left out: the package is built with a host library of the
+ * model, not the device's. A blob for another KV dtype or another system
+ * prompt is ignored and the prefix is prefilled as before.
+ */
+namespace prefix_package {
+
+static constexpr const char* kKvFile = "/prefix_kv.bin";
+static constexpr const char* kMetaFile = "/prefix_kv.json";
+static constexpr int64_t kVersion = 1;
+
+inline bool read_text(const std::string& path, std::string* out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good()) {
+        return false;
+    }
+    out->assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+inline uint64_t fingerprint(const std::string& model_dir) {
+    uint64_t hash = model_manifest::kFnvBasis;
+    for (const char* file : {"/mlc-chat-config.json", "/ndarray-cache.json"}) {
+        std::string text;
+        read_text(model_dir + file, &text);
+        hash = model_manifest::fnv1a(reinterpret_cast<const unsigned char*>(text.data()), text.size(), hash);
+    }
+    return hash;
+}
+
+// The shipped blob for this model, KV dtype and system prompt, or "" with
+// the reason in `why`
+inline std::string usable_blob(const std::string& model_dir, const std::string& kv_dtype,
+                               const std::string& system_prompt, std::string* why) {
+    std::string meta;
+    if (!read_text(model_dir + kMetaFile, &meta)) {
+        *why = "none shipped";
+        return "";
+    }
+    char expected[17];
+    snprintf(expected, sizeof(expected), "%016llx", static_cast<unsigned long long>(fingerprint(model_dir)));
+    if (json_int_field(meta, "version", 0) != kVersion) {
+        *why = "unknown version";
+    } else if (json_string_field(meta, "fingerprint") != expected) {
+        *why = "built for other model files";
+    } else if (json_string_field(meta, "kv_cache_dtype") != kv_dtype) {
+        *why = "built for a " + json_string_field(meta, "kv_cache_dtype") + " KV cache";
+    } else if (json_string_field(meta, "system_prompt") != system_prompt) {
+        *why = "built for another system prompt";
+    } else if (access((model_dir + kKvFile).c_str(), R_OK) != 0) {
+        *why = "blob missing";
+    } else {
+        return model_dir + kKvFile;
+    }
+    return "";
+}
+
+}  // namespace prefix_package
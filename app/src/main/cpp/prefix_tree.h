@@ -0,0 +1,268 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Radix tree over the prompts that started conversations, for sharing their
+ * prefilled KV across requests and sessions.
+ *
+ * There is a tree per conversation base (adapter and system message, hashed by
+ * the caller). An edge holds a run of tokens, and a node that ends a kept
+ * prompt carries the snapshot slot holding its KV. match() finds the longest
+ * prefix of a new prompt that a kept one shares; insert() keeps another,
+ * evicting the least recently used leaf when every slot is taken. The slots
+ * are copy-on-write forks of the live KV, so prompts that share tokens share
+ * their pages, and a page is freed with the last slot referencing it.
+ */
+class PrefixTree {
+public:
+    static constexpr int kSlots = 8;
+    // A shorter shared prefix is cheaper to prefill again than to restore
+    static constexpr size_t kMinTokens = 32;
+
+    struct Match {
+        int slot = -1;      // -1 without a prefix worth restoring
+        size_t tokens = 0;  // prompt tokens the slot shares
+        size_t cached = 0;  // tokens the slot holds, at least `tokens`
+    };
+
+    PrefixTree() { slots_.fill(nullptr); }
+    PrefixTree(const PrefixTree&) = delete;
+    PrefixTree& operator=(const PrefixTree&) = delete;
+
+    // The most recently used slot sharing the longest prefix of `ids`
+    Match match(uint64_t base, const std::vector<int>& ids) {
+        lookups_++;
+        tokens_requested_ += ids.size();
+        Match result;
+        auto root = roots_.find(base);
+        if (root == roots_.end()) {
+            return result;
+        }
+        Node* node = root->second.get();
+        size_t matched = 0;
+        bool whole = true;  // matched ends where `node` does
+        while (matched < ids.size()) {
+            auto child = node->children.find(ids[matched]);
+            if (child == node->children.end()) {
+                break;
+            }
+            node = child->second.get();
+            size_t edge = 0;
+            while (edge < node->edge.size() && matched < ids.size() && node->edge[edge] == ids[matched]) {
+                edge++;
+                matched++;
+            }
+            if (edge < node->edge.size()) {
+                whole = false;
+                break;
+            }
+        }
+        if (matched < kMinTokens) {
+            return result;
+        }
+        // Every slot below `node` holds the matched tokens; its own needs no rollback
+        Node* best = whole && node->slot >= 0 ? node : most_recent(node);
+        if (best == nullptr) {
+            return result;
+        }
+        best->used = ++tick_;
+        hits_++;
+        tokens_saved_ += matched;
+        result.slot = best->slot;
+        result.tokens = matched;
+        result.cached = best->depth;
+        return result;
+    }
+
+    // Keep `ids` and return the slot to snapshot it into. A slot taken from
+    // another prompt, whose KV must be dropped first, is set in `evicted`.
+    int insert(uint64_t base, const std::vector<int>& ids, int* evicted) {
+        *evicted = -1;
+        if (ids.empty()) {
+            return -1;
+        }
+        int slot = free_slot();
+        if (slot < 0) {
+            slot = evict();
+            *evicted = slot;
+        }
+        std::unique_ptr<Node>& root = roots_[base];
+        if (!root) {
+            root.reset(new Node());
+        }
+        Node* node = root.get();
+        size_t pos = 0;
+        while (pos < ids.size()) {
+            auto child = node->children.find(ids[pos]);
+            if (child == node->children.end()) {
+                std::unique_ptr<Node> leaf(new Node());
+                leaf->parent = node;
+                leaf->edge.assign(ids.begin() + pos, ids.end());
+                leaf->depth = ids.size();
+                Node* raw = leaf.get();
+                node->children.emplace(ids[pos], std::move(leaf));
+                nodes_++;
+                node = raw;
+                break;
+            }
+            Node* next = child->second.get();
+            size_t edge = 0;
+            while (edge < next->edge.size() && pos < ids.size() && next->edge[edge] == ids[pos]) {
+                edge++;
+                pos++;
+            }
+            node = edge < next->edge.size() ? split(next, edge) : next;
+        }
+        if (node->slot >= 0) {
+            // Kept already: the slot taken for it stays free
+            node->used = ++tick_;
+            return node->slot;
+        }
+        node->slot = slot;
+        node->used = ++tick_;
+        slots_[slot] = node;
+        inserts_++;
+        cached_tokens_ += ids.size();
+        return slot;
+    }
+
+    // Slots in use, for dropping their KV
+    std::vector<int> slots() const {
+        std::vector<int> out;
+        for (int slot = 0; slot < kSlots; ++slot) {
+            if (slots_[slot] != nullptr) {
+                out.push_back(slot);
+            }
+        }
+        return out;
+    }
+
+    void clear() {
+        roots_.clear();
+        slots_.fill(nullptr);
+        cached_tokens_ = 0;
+        nodes_ = 0;
+    }
+
+    uint64_t lookups() const { return lookups_; }
+    uint64_t hits() const { return hits_; }
+    uint64_t tokens_requested() const { return tokens_requested_; }
+    uint64_t tokens_saved() const { return tokens_saved_; }
+    uint64_t inserts() const { return inserts_; }
+    uint64_t evictions() const { return evictions_; }
+    // Tokens the kept prompts hold together, counting shared ones once per prompt
+    size_t cached_tokens() const { return cached_tokens_; }
+    size_t nodes() const { return nodes_; }
+
+private:
+    struct Node {
+        Node* parent = nullptr;
+        std::vector<int> edge;  // tokens from the parent to here; empty at a root
+        std::unordered_map<int, std::unique_ptr<Node>> children;  // by first edge token
+        size_t depth = 0;       // tokens from the root to the end of `edge`
+        int slot = -1;
+        uint64_t used = 0;
+    };
+
+    std::unordered_map<uint64_t, std::unique_ptr<Node>> roots_;
+    std::array<Node*, kSlots> slots_;
+    uint64_t tick_ = 0;
+    uint64_t lookups_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t tokens_requested_ = 0;
+    uint64_t tokens_saved_ = 0;
+    uint64_t inserts_ = 0;
+    uint64_t evictions_ = 0;
+    size_t cached_tokens_ = 0;
+    size_t nodes_ = 0;
+
+    int free_slot() const {
+        for (int slot = 0; slot < kSlots; ++slot) {
+            if (slots_[slot] == nullptr) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    static Node* most_recent(Node* node) {
+        Node* best = node->slot >= 0 ? node : nullptr;
+        for (auto& child : node->children) {
+            Node* candidate = most_recent(child.second.get());
+            if (candidate != nullptr && (best == nullptr || candidate->used > best->used)) {
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    // Split `node`'s edge after `at` tokens; returns the new node ending there
+    Node* split(Node* node, size_t at) {
+        std::unique_ptr<Node>& owner = node->parent->children[node->edge.front()];
+        std::unique_ptr<Node> middle(new Node());
+        middle->parent = node->parent;
+        middle->edge.assign(node->edge.begin(), node->edge.begin() + at);
+        middle->depth = node->depth - (node->edge.size() - at);
+        node->edge.erase(node->edge.begin(), node->edge.begin() + at);
+        node->parent = middle.get();
+        middle->children.emplace(node->edge.front(), std::move(owner));
+        owner = std::move(middle);
+        nodes_++;
+        return owner.get();
+    }
+
+    // Free the slot of the least recently used leaf. Leaves always have a
+    // slot, since a leaf that loses it is removed with the branch it ended.
+    int evict() {
+        Node* victim = nullptr;
+        for (Node* node : slots_) {
+            if (node != nullptr && node->children.empty() && (victim == nullptr || node->used < victim->used)) {
+                victim = node;
+            }
+        }
+        int slot = victim->slot;
+        slots_[slot] = nullptr;
+        cached_tokens_ -= victim->depth;
+        victim->slot = -1;
+        evictions_++;
+        prune(victim);
+        return slot;
+    }
+
+    // Remove slotless leaves from `node` up, then merge a slotless node left
+    // with one child into it
+    void prune(Node* node) {
+        while (node->parent != nullptr && node->slot < 0 && node->children.empty()) {
+            Node* parent = node->parent;
+            parent->children.erase(node->edge.front());
+            nodes_--;
+            node = parent;
+        }
+        if (node->parent == nullptr) {
+            if (node->children.empty()) {
+                for (auto it = roots_.begin(); it != roots_.end(); ++it) {
+                    if (it->second.get() == node) {
+                        roots_.erase(it);
+                        break;
+                    }
+                }
+            }
+            return;
+        }
+        if (node->slot < 0 && node->children.size() == 1) {
+            Node* parent = node->parent;
+            int key = node->edge.front();
+            std::unique_ptr<Node> child = std::move(node->children.begin()->second);
+            child->edge.insert(child->edge.begin(), node->edge.begin(), node->edge.end());
+            child->parent = parent;
+            parent->children[key] = std::move(child);  // frees `node`
+            nodes_--;
+        }
+    }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/**
+ * Retrieved study material for a prompt (setRetrievedContext): the top-k chunks
+ * from the keyword and vector indexes, deduplicated and packed into the token
+ * budget the context window leaves.
+ *
+ * A chunk may say where it came from: `doc` and the byte offset `start` of its
+ * text in that document. Chunks of one document whose spans overlap or touch
+ * are merged into one span, and a text seen twice is kept once. Chunks are
+ * taken best-ranked first for as long as they fit. The result is rendered in
+ * document order rather than rank order, so the same material retrieved for
+ * another question produces the same text and the same KV (ContextKvCache).
+ */
+struct ContextChunk {
+    int64_t id = 0;
+    int64_t doc = -1;    // -1: no position, only exact repeats are merged
+    int64_t start = -1;  // byte offset of `text` in the document
+    std::string text;
+    size_t rank = 0;  // position in the retrieval ranking, best first
+};
+
+struct PackedContext {
+    std::string text;  // empty when nothing fit
+    std::vector<int64_t> ids;  // chunks packed, in rendered order
+    size_t tokens = 0;
+    size_t merged = 0;   // chunks folded into an overlapping or repeated one
+    size_t dropped = 0;  // chunks left out for the budget
+};
+
+namespace prompt_context {
+
+static constexpr const char* kHeader = "Study material for this conversation (cite it by number):";
+
+// Merge overlapping spans and repeated texts; returns the chunks in rank order
+inline std::vector<ContextChunk> dedupe(std::vector<ContextChunk> chunks, size_t* merged) {
+    *merged = 0;
+    std::sort(chunks.begin(), chunks.end(), [](const ContextChunk& a, const ContextChunk& b) {
+        if (a.doc != b.doc) return a.doc < b.doc;
+        return a.start != b.start ? a.start < b.start : a.rank < b.rank;
+    });
+    std::vector<ContextChunk> out;
+    for (ContextChunk& chunk : chunks) {
+        if (!out.empty() && chunk.doc >= 0 && chunk.start >= 0 && out.back().doc == chunk.doc &&
+            out.back().start >= 0) {
+            ContextChunk& last = out.back();
+            int64_t last_end = last.start + static_cast<int64_t>(last.text.size());
+            if (chunk.start <= last_end) {
+                int64_t end = chunk.start + static_cast<int64_t>(chunk.text.size());
+                if (end > last_end) {
+                    last.text += chunk.text.substr(static_cast<size_t>(last_end - chunk.start));
+                }
+                last.rank = std::min(last.rank, chunk.rank);
+                (*merged)++;
+                continue;
+            }
+        }
+        out.push_back(std::move(chunk));
+    }
+    std::sort(out.begin(), out.end(), [](const ContextChunk& a, const ContextChunk& b) { return a.rank < b.rank; });
+    std::unordered_set<std::string> seen;
+    std::vector<ContextChunk> unique;
+    for (ContextChunk& chunk : out) {
+        if (chunk.text.empty() || !seen.insert(chunk.text).second) {
+            (*merged)++;
+            continue;
+        }
+        unique.push_back(std::move(chunk));
+    }
+    return unique;
+}
+
+// Best-ranked chunks first while they fit `budget` tokens, rendered in
+// document order. `count` gives the tokens of a text.
+template <typename Count>
+PackedContext pack(const std::vector<ContextChunk>& ranked, size_t budget, Count&& count) {
+    PackedContext packed;
+    size_t used = count(std::string(kHeader));
+    std::vector<const ContextChunk*> chosen;
+    for (const ContextChunk& chunk : ranked) {
+        size_t tokens = count(chunk.text) + 4;  // "[n] " and the blank line after it
+        if (used + tokens > budget) {
+            packed.dropped++;
+            continue;
+        }
+        used += tokens;
+        chosen.push_back(&chunk);
+    }
+    if (chosen.empty()) {
+        return packed;
+    }
+    std::sort(chosen.begin(), chosen.end(), [](const ContextChunk* a, const ContextChunk* b) {
+        if (a->doc != b->doc) return a->doc < b->doc;
+        return a->start != b->start ? a->start < b->start : a->id < b->id;
+    });
+    packed.text = kHeader;
+    for (size_t i = 0; i < chosen.size(); ++i) {
+        packed.text += "\n\n[" + std::to_string(i + 1) + "] " + chosen[i]->text;
+        packed.ids.push_back(chosen[i]->id);
+    }
+    packed.tokens = used;
+    return packed;
+}
+
+}  // namespace prompt_context
+
+/**
+ * KV snapshots of conversations started from a system message with retrieved
+ * material, by a key of the adapter and the message. A fresh conversation over
+ * material packed before restores its snapshot instead of prefilling it again.
+ * Slots are reused least recently used first.
+ */
+class ContextKvCache {
+public:
+    static constexpr int kSlots = 4;
+
+    // The slot holding `key`, as the most recently used; -1 if none
+    int find(uint64_t key) {
+        for (auto it = order_.begin(); it != order_.end(); ++it) {
+            if (it->first == key) {
+                order_.splice(order_.begin(), order_, it);
+                hits_++;
+                return order_.front().second;
+            }
+        }
+        misses_++;
+        return -1;
+    }
+
+    // A slot to snapshot `key` into: a free one, else the least recently used
+    int insert(uint64_t key) {
+        int slot = 0;
+        if (order_.size() >= static_cast<size_t>(kSlots)) {
+            slot = order_.back().second;
+            order_.pop_back();
+        } else {
+            std::vector<int> used = slots();
+            while (std::find(used.begin(), used.end(), slot) != used.end()) {
+                slot++;
+            }
+        }
+        order_.emplace_front(key, slot);
+        return slot;
+    }
+
+    void erase(uint64_t key) {
+        order_.remove_if([key](const std::pair<uint64_t, int>& entry) { return entry.first == key; });
+    }
+
+    // Slots in use, for dropping their KV
+    std::vector<int> slots() const {
+        std::vector<int> out;
+        for (const auto& entry : order_) {
+            out.push_back(entry.second);
+        }
+        return out;
+    }
+
+    void clear() { order_.clear(); }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    std::list<std::pair<uint64_t, int>> order_;  // (key, slot), most recently used first
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Draft-free proposals for speculative decoding (prompt lookup).
+ *
+ * Summaries and explanations of photographed text copy long spans of the
+ * prompt. The last few tokens of the history are looked up among the earlier
+ * ones (prompt plus output so far), longest n-gram first, and whatever came
+ * after their latest earlier occurrence is proposed as the continuation. The
+ * target then verifies the proposal in one pass, as it would a draft model's.
+ *
+ * Each n-gram maps to the position right after its latest occurrence, and a
+ * new token only adds the n-grams ending just before it, so the tail currently
+ * being matched never finds itself.
+ */
+class PromptLookup {
+public:
+    static constexpr int kMaxNgram = 3;
+    static constexpr int kTokenBits = 21;  // n-grams pack into one key for vocabularies below 2M
+
+    void reset(const std::vector<int>& prompt) {
+        tokens_.clear();
+        for (auto& index : index_) {
+            index.clear();
+        }
+        tokens_.reserve(prompt.size() + 256);
+        for (int token : prompt) {
+            push(token);
+        }
+    }
+
+    void push(int token) {
+        tokens_.push_back(token);
+        size_t next = tokens_.size() - 1;
+        for (int n = 1; n <= kMaxNgram && static_cast<size_t>(n) <= next; ++n) {
+            index_[n - 1][key(next - n, n)] = next;
+        }
+    }
+
+    // Up to `k` tokens that continued the longest matching tail before; empty if none matched
+    std::vector<int64_t> propose(int k) const {
+        std::vector<int64_t> proposal;
+        for (int n = std::min<int>(kMaxNgram, static_cast<int>(tokens_.size())); n >= 1 && k > 0; --n) {
+            auto it = index_[n - 1].find(key(tokens_.size() - n, n));
+            if (it == index_[n - 1].end()) {
+                continue;
+            }
+            size_t end = std::min(tokens_.size(), it->second + static_cast<size_t>(k));
+            proposal.assign(tokens_.begin() + it->second, tokens_.begin() + end);
+            break;
+        }
+        return proposal;
+    }
+
+    size_t size() const { return tokens_.size(); }
+
+private:
+    std::vector<int> tokens_;
+    std::unordered_map<uint64_t, size_t> index_[kMaxNgram];
+
+    uint64_t key(size_t start, int n) const {
+        uint64_t packed = 0;
+        for (int i = 0; i < n; ++i) {
+            packed = (packed << kTokenBits) | (static_cast<uint64_t>(tokens_[start + i]) & ((1u << kTokenBits) - 1));
+        }
+        return packed;
+    }
+};
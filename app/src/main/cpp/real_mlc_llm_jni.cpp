@@ -1,20 +1,239 @@
 #include <jni.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <deque>
 #include <string>
-#include <android/log.h>
 #include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 #include <dlfcn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 // Include MLC-LLM headers
 #include <tvm/runtime/packed_func.h>
 #include <tvm/runtime/registry.h>
 #include <tvm/runtime/module.h>
 #include <tvm/runtime/device_api.h>
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/container/shape_tuple.h>
 
-#define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "REAL_MLC_LLM", __VA_ARGS__))
-#define LOGE(...) ((void)__android_log_print(ANDROID_LOG_ERROR, "REAL_MLC_LLM", __VA_ARGS__))
+#include "answer_grading.h"
+#include "async_requests.h"
+#include "batch_job.h"
+#include "batch_scheduler.h"
+#include "compute_device.h"
+#include "chat_template.h"
+#include "canned_response.h"
+#include "context_compression.h"
+#include "context_window.h"
+#include "conversation_log.h"
+#include "conversation_memory.h"
+#include "cpu_attention.h"
+#include "cpu_embedding.h"
+#include "cpu_matmul.h"
+#include "deadline.h"
+#include "decode_graph.h"
+#include "device_profile.h"
+#include "follow_up_prefetch.h"
+#include "document_summary.h"
+#include "flight_recorder.h"
+#include "cpu_features.h"
+#include "download_sink.h"
+#include "embed_batcher.h"
+#include "engine_async.h"
+#include "engine_heap.h"
+#include "generation_worker.h"
+#include "generation_config.h"
+#include "generation_governor.h"
+#include "host_staging.h"
+#include "jni_cache.h"
+#include "jni_strings.h"
+#include "json_grammar.h"
+#include "json_stream.h"
+#include "kernel_cache.h"
+#include "kernel_profile.h"
+#include "kernel_tuning.h"
+#include "keyword_index.h"
+#include "kv_budget.h"
+#include "kv_eviction.h"
+#include "kv_offload.h"
+#include "layer_pager.h"
+#include "latency_metrics.h"
+#include "llm_bench.h"
+#include "memory_forecast.h"
+#include "memory_stats.h"
+#include "metrics_sampler.h"
+#include "logit_sampler.h"
+#include "lora_adapters.h"
+#include "mlc_capabilities.h"
+#include "model_config.h"
+#include "model_lib_abi.h"
+#include "model_manifest.h"
+#include "model_residency.h"
+#include "model_server.h"
+#include "native_log.h"
+#include "native_trace.h"
+#include "ndarray_mmap_loader.h"
+#include "ocr_text.h"
+#include "output_lengths.h"
+#include "performance_hint.h"
+#include "phase_devices.h"
+#include "prompt_context.h"
+#include "pooled_device_api.h"
+#include "power_profile.h"
+#include "prefix_package.h"
+#include "prefix_tree.h"
+#include "requantize.h"
+#include "request_arena.h"
+#include "request_cost.h"
+#include "request_trace.h"
+#include "response_cache.h"
+#include "route_policy.h"
+#include "semantic_cache.h"
+#include "session_store.h"
+#include "sha256.h"
+#include "shared_pool.h"
+#include "sp_tokenizer.h"
+#include "speculative_decoder.h"
+#include "stage_pipeline.h"
+#include "stall_watchdog.h"
+#include "startup_timeline.h"
+#include "text_embedding.h"
+#include "thread_boost.h"
+#include "thread_config.h"
+#include "token_ring.h"
+#include "topic_router.h"
+#include "trace_context.h"
+#include "vector_index.h"
+#include "weight_delta.h"
+
+#define LOGV(...) NLOGV("REAL_MLC_LLM", __VA_ARGS__)
+#define LOGI(...) NLOGI("REAL_MLC_LLM", __VA_ARGS__)
+#define LOGE(...) NLOGE("REAL_MLC_LLM", __VA_ARGS__)
+
+// System prompt every StudyBuddy conversation starts with. Together with the
+// conv_template it forms the shared prefix that is prefilled once per engine.
+static const char* kStudyBuddySystemPrompt =
+    "You are StudyBuddy, a patient tutor. Explain concepts step by step, "
+    "check the student's understanding and keep answers focused on their studies.";
+
+// KV snapshot slot reserved for the system prompt + template prefix
+static const int kPrefixKvSlot = 0;
+
+// Subject prefixes are snapshotted lazily into kSubjectKvSlotBase + Subject
+static const int kSubjectKvSlotBase = 1;
+
+// Parked conversations of inactive sessions live in kSessionKvSlotBase + slot
+static const int kSessionKvSlotBase = kSubjectKvSlotBase + kSubjectCount;
+static const int kMaxSessions = 8;
+
+// Conversations started from retrieved material are snapshotted into kContextKvSlotBase + ContextKvCache slot
+static const int kContextKvSlotBase = kSessionKvSlotBase + kMaxSessions;
+
+// Prompts of new conversations are kept for sharing in kPrefixTreeSlotBase + PrefixTree slot
+static const int kPrefixTreeSlotBase = kContextKvSlotBase + ContextKvCache::kSlots;
+
+// Session 0 is the conversation used by the calls that take no session
+static const int64_t kDefaultSession = 0;
+
+// Appended to the system prompt for conversations routed to a subject
+static const char* kSubjectPromptHints[kSubjectCount] = {
+    "This conversation is about mathematics: show every step and check the final answer.",
+    "This conversation is about physics: state the principle first and keep track of units.",
+    "This conversation is about chemistry: name the reaction type and balance equations.",
+    "This conversation is about biology: connect structures to their functions.",
+    "This conversation is about history: place events in time and explain causes and effects.",
+    "This conversation is about literature: support interpretations with the text.",
+    "This conversation is about computer science: use short code examples and explain complexity.",
+    nullptr,
+};
+
+// Adapter name that selects the base model, over the session's and subject's adapters
+static const char* kBaseAdapter = "base";
+
+// Shared by the engine's governor and the batch worker; defined with the worker below
+static BatchScheduler& batch_scheduler();
+// Packs and spills what the engine offloaded (kv_offload.h); defined with its worker below
+static void schedule_kv_offload();
+
+// Anonymized turns for replayTrace (see request_trace.h); closed until setRequestTrace
+static RequestTraceWriter& request_trace() {
+    static RequestTraceWriter trace;
+    return trace;
+}
+
+// Peaks since the last resetMemoryStats (see memory_stats.h)
+static memory_stats::HighWater& memory_high_water() {
+    static memory_stats::HighWater* peaks = new memory_stats::HighWater();
+    return *peaks;
+}
+
+// The getMemoryStats() report; `model_dir` empty, `kv` and `arena` null without a loaded model
+static std::string memory_report(const std::string& model_dir, DLDevice device, const KvBudget* kv,
+                                 const RequestArena* arena) {
+    using memory_stats::HighWater;
+    HighWater& peaks = memory_high_water();
+    memory_stats::SmapsTotals maps = memory_stats::read_smaps(model_dir);
+    memory_stats::HeapTotals heap = memory_stats::heap_totals();
+    uint64_t device_workspace = memory_stats::workspace_bytes(device);
+    uint64_t cpu_workspace = device.device_type == kDLCPU ? 0 : memory_stats::workspace_bytes(DLDevice{kDLCPU, 0});
+    uint64_t rss = memory_stats::status_bytes("VmRSS");
+
+    std::string sessions;
+    uint64_t kv_bytes = 0;
+    uint64_t kv_budget = 0;
+    if (kv != nullptr) {
+        for (const auto& session : kv->session_bytes()) {
+            char entry[64];
+            snprintf(entry, sizeof(entry), "%s{\"id\": %lld, \"bytes\": %llu}", sessions.empty() ? "" : ", ",
+                     static_cast<long long>(session.first), static_cast<unsigned long long>(session.second));
+            sessions += entry;
+        }
+        KvBudgetStats stats = kv->stats();
+        kv_bytes = stats.resident_bytes;
+        kv_budget = stats.budget_bytes;
+    }
+
+    auto u = [](uint64_t value) { return static_cast<unsigned long long>(value); };
+    char report[1536];
+    snprintf(report, sizeof(report),
+             "{\"weights\": {\"mapped\": %llu, \"resident\": %llu, \"locked\": %llu}, "
+             "\"kv\": {\"bytes\": %llu, \"budget\": %llu, \"sessions\": [",
+             u(maps.weights.size), u(maps.weights.rss), u(mmap_loader::locked_bytes()), u(kv_bytes), u(kv_budget));
+    std::string json = report;
+    json += sessions;
+    snprintf(report, sizeof(report),
+             "]}, \"workspace\": {\"device\": %llu, \"cpu\": %llu}, "
+             "\"gpu\": {\"mapped\": %llu, \"resident\": %llu}, "
+             "\"heap\": {\"allocated\": %llu, \"free\": %llu, \"engine_cached\": %llu}, "
+             "\"arena\": {\"capacity\": %llu, \"recent_peak\": %llu}, "
+             "\"process\": {\"rss\": %llu, \"swap\": %llu}, "
+             "\"low_ram\": {\"paged_layers\": %zu, \"window\": %zu, \"layer_ms\": %.3f}, "
+             "\"peak\": {\"weights_resident\": %llu, \"kv\": %llu, \"workspace\": %llu, "
+             "\"gpu_resident\": %llu, \"heap\": %llu, \"rss\": %llu}}",
+             u(device_workspace), u(cpu_workspace), u(maps.gpu.size), u(maps.gpu.rss), u(heap.allocated),
+             u(heap.free), u(engine_heap::cached_bytes()), u(arena != nullptr ? arena->capacity() : 0),
+             u(arena != nullptr ? arena->recent_peak() : 0),
+             u(rss), u(memory_stats::status_bytes("VmSwap")), layer_pager::instance().layers(), layer_pager::kWindow,
+             layer_pager::instance().layer_ms(),
+             u(peaks.note("weights_resident", maps.weights.rss)), u(peaks.note("kv", kv_bytes)),
+             u(peaks.note("workspace", device_workspace + cpu_workspace)), u(peaks.note("gpu_resident", maps.gpu.rss)),
+             u(peaks.note("heap", heap.allocated)),
+             u(std::max(memory_stats::status_bytes("VmHWM"), peaks.note("rss", rss))));
+    json += report;
+    return json;
+}
 
 /**
  * This is the real implementation of the MLC-LLM engine.
@@ -28,534 +247,12121 @@ private:
     tvm::runtime::PackedFunc reset_chat_{nullptr};
     tvm::runtime::PackedFunc set_param_{nullptr};
     
-    bool initialized = false;
-    std::string model_path;
+    // Optional entry points, resolved once in initialize() and reused on the hot path
+    tvm::runtime::PackedFunc stream_chat_{nullptr};
+    tvm::runtime::PackedFunc abort_{nullptr};
+    tvm::runtime::PackedFunc generate_batch_{nullptr};
+    tvm::runtime::PackedFunc load_json_override_{nullptr};
+    tvm::runtime::PackedFunc process_system_prompts_{nullptr};
+    tvm::runtime::PackedFunc snapshot_kv_{nullptr};
+    tvm::runtime::PackedFunc restore_kv_{nullptr};
+    tvm::runtime::PackedFunc drop_kv_{nullptr};  // drop_kv(slot): free a snapshot slot
+    // Paged KV with reference-counted pages:
+    //   fork_kv(slot)        share the live conversation's pages into a snapshot slot, copy-on-write
+    //   rollback_turns(n)    drop the last n turns of the live conversation, releasing their pages
+    tvm::runtime::PackedFunc fork_kv_{nullptr};
+    tvm::runtime::PackedFunc rollback_turns_{nullptr};
+    // save_kv(slot, path) / load_kv(slot, path): a snapshot slot to and from a file
+    tvm::runtime::PackedFunc save_kv_{nullptr};
+    tvm::runtime::PackedFunc load_kv_{nullptr};
+    // kv_cache_dtype() -> str: storage of the allocated KV cache ("float16", "int8", "e4m3_float8")
+    tvm::runtime::PackedFunc kv_cache_dtype_{nullptr};
+    // shift_turns(n, sinks): evict the n oldest turns from the live KV in place,
+    // keeping the system prompt and the first `sinks` tokens, and re-position the rest
+    tvm::runtime::PackedFunc shift_turns_{nullptr};
+    // Heavy-hitter eviction (kv_eviction.h):
+    //   kv_attention_mass() -> NDArray   attention each token of the live KV has drawn, float32 [tokens]
+    //   evict_tokens(positions)          drop those tokens (ShapeTuple) in place, releasing emptied pages
+    tvm::runtime::PackedFunc kv_attention_mass_{nullptr};
+    tvm::runtime::PackedFunc evict_tokens_{nullptr};
+    // Chunked prefill of a user turn:
+    //   prefill_begin(prompt) -> int   template and tokenize the turn, return its token count
+    //   prefill_step(n) -> int         run up to n pending tokens, return how many are left
+    // The generate/stream/prefill_logits call that follows with the same prompt
+    // only prefills what is still pending; a turn that is never generated is
+    // dropped by the next prefill_begin or reset_chat.
+    tvm::runtime::PackedFunc prefill_begin_{nullptr};
+    tvm::runtime::PackedFunc prefill_step_{nullptr};
+    int prefill_chunk_tokens_ = 256;
     
-    // Generation parameters
-    float temperature = 0.7f;
-    float top_p = 0.95f;
-    int max_gen_len = 1024;
+    // Prefill of the next user turn while it is being typed:
+    //   draft_append(ids)      prefill draft tokens (ShapeTuple) after the user role header
+    //   draft_truncate(n)      roll the draft back to its first n tokens, releasing the rest
+    // The next turn reuses a draft whose tokens start its prompt and prefills
+    // only the remainder; any other turn or reset_chat drops the draft. A
+    // snapshot taken with a draft keeps it, and restoring it brings it back.
+    tvm::runtime::PackedFunc draft_append_{nullptr};
+    tvm::runtime::PackedFunc draft_truncate_{nullptr};
     
-    // Configure the chat module with current parameters
-    void configure_chat() {
-        LOGI("Configuring chat with temperature=%.2f, top_p=%.2f, max_gen_len=%d", 
-             temperature, top_p, max_gen_len);
-        
-        if (set_param_ != nullptr) {
+    // Independent sequences in a batched KV cache, for BatchScheduler:
+    //   batch_prefill(seq, prompt) -> NDArray        new sequence from the system prompt, logits [1, vocab]
+    //   batch_decode(seqs, tokens) -> NDArray        one token per sequence in one pass, logits [n, vocab]
+    //   batch_release(seq)                           free the sequence's KV
+    // These never touch the chat conversation in the live KV.
+    tvm::runtime::PackedFunc batch_prefill_{nullptr};
+    tvm::runtime::PackedFunc batch_decode_{nullptr};
+    tvm::runtime::PackedFunc batch_release_{nullptr};
+    
+    // Shared-prefix batches (generateBatch), over the same batched KV:
+    //   batch_prefix(seq, text)                      new sequence holding an open user turn, no logits
+    //   batch_fork(parent, child)                    child shares the parent's KV pages
+    //   batch_finish(seq, text) -> NDArray           append to the open turn and close it, logits [1, vocab]
+    tvm::runtime::PackedFunc batch_prefix_{nullptr};
+    tvm::runtime::PackedFunc batch_fork_{nullptr};
+    tvm::runtime::PackedFunc batch_finish_{nullptr};
+    
+    // Prefilled prefix of each group, released with its last branch
+    struct BatchRoot {
+        int64_t seq_id = 0;  // 0 until a branch prefills the prefix
+        int released = 0;    // branches retired so far
+    };
+    std::map<int64_t, BatchRoot> batch_roots_;
+    static constexpr int64_t kBatchRootSeqBase = 1ll << 40;  // above the scheduler's sequence ids
+    int64_t draft_session_ = -1;  // session whose live KV holds draft_tokens_
+    // A fresh conversation was routed on its streamed input (appendInput) so it
+    // could be drafted; the turn that reuses the draft keeps that subject
+    bool draft_routed_ = false;
+    
+    // The turn prefillTokens() left for generateTokens(); any other turn drops it
+    struct TokenTurn {
+        int64_t session = -1;
+        std::string prompt;               // decoded, for the session's record of the turn
+        bool prefilled = false;           // in the KV with `logits` for the first reply token
+        tvm::runtime::NDArray logits;
+        std::chrono::steady_clock::time_point started;
+    };
+    TokenTurn token_turn_;
+    // Left out of a draft for the system message and the instruction that ends the prompt
+    static constexpr int64_t kDraftReserveTokens = 512;
+    
+    void drop_token_turn() {
+        token_turn_ = TokenTurn();
+    }
+    std::vector<int> draft_tokens_;
+    
+    // Forget the draft of the live conversation (before it is parked or reset)
+    void drop_draft() {
+        if (draft_session_ < 0) {
+            return;
+        }
+        if (!draft_tokens_.empty() && draft_session_ == active_session_) {
             try {
-                set_param_("temperature", temperature);
-                set_param_("top_p", top_p);
-                set_param_("max_gen_len", max_gen_len);
+                draft_truncate_(static_cast<int64_t>(0));
             } catch (const std::exception& e) {
-                LOGE("Error setting parameters: %s", e.what());
+                LOGE("Error dropping the draft: %s", e.what());
             }
         }
+        draft_tokens_.clear();
+        draft_session_ = -1;
+        draft_routed_ = false;
     }
+    std::function<void(int64_t, int64_t)> prefill_progress_;
+    // Set from other threads by abort(); checked between prefill chunks
+    std::atomic<bool> abort_requested_{false};
+    std::atomic<bool> stalled_{false};  // the abort came from the stall watchdog
+    // Stage timestamps of the interactive request being served, owned by its InteractiveTurn
+    RequestTiming* timing_ = nullptr;
     
-public:
-    RealMlcEngine() : initialized(false) {
-        LOGI("Creating RealMlcEngine");
-    }
+    // The running request's deadline (deadline.h); time_point{} without one
+    std::chrono::steady_clock::time_point deadline_at_{};
+    deadline::Rates deadline_rates_;
+    int deadline_draft_restore_ = -1;  // draft length to go back to after the request
+    deadline::Report deadline_report_;  // of the last request
     
-    ~RealMlcEngine() {
-        close();
+    bool deadline_passed() const {
+        return deadline_at_ != std::chrono::steady_clock::time_point{} &&
+               std::chrono::steady_clock::now() >= deadline_at_;
     }
     
-    bool initialize(const std::string& model_dir) {
-        try {
-            LOGI("Initializing MLC-LLM with model directory: %s", model_dir.c_str());
-            model_path = model_dir;
-            
-            // Verify model files exist
-            std::ifstream configFile(model_dir + "/mlc-chat-config.json");
-            if (!configFile.good()) {
-                LOGE("Config file not found at %s/mlc-chat-config.json", model_dir.c_str());
-                return false;
-            }
-            
-            // Check if model lib exists - REQUIRE it to exist
-            std::string model_lib_path = model_dir + "/lib/libgemma-2-2b-it-q4f16_1.so";
-            std::ifstream modelLib(model_lib_path);
-            if (!modelLib.good()) {
-                LOGE("FATAL: Model library not found at %s", model_lib_path.c_str());
-                LOGE("The model library must exist at this exact path");
-                return false;
-            }
-            
-            // List all available TVM registry functions for debugging
-            auto registry_names = tvm::runtime::Registry::ListNames();
-            LOGI("Available TVM registry functions (%lu):", registry_names.size());
-            
-            // Log all registry functions to help with debugging
-            for (size_t i = 0; i < registry_names.size(); ++i) {
-                LOGI("  Function %zu: %s", i, registry_names[i].c_str());
-            }
-            
-            // Try to use the TVM Registry approach first
-            LOGI("Looking for function: mlc.create_chat_module");
-            auto chat_create = tvm::runtime::Registry::Get("mlc.create_chat_module");
-            
-            // Also try alternative module names based on the model library path
-            if (chat_create == nullptr) {
-                LOGI("Function not found, trying alternative: mlc_create_chat_module");
-                chat_create = tvm::runtime::Registry::Get("mlc_create_chat_module");
-            }
-            
-            if (chat_create == nullptr) {
-                // TVM registry approach failed, try direct loading with dlopen/dlsym
-                LOGI("TVM registry method failed, trying direct library loading: %s", model_lib_path.c_str());
-                
-                // Open the library
-                void* lib_handle = dlopen(model_lib_path.c_str(), RTLD_LAZY);
-                if (!lib_handle) {
-                    LOGE("FATAL: Failed to open model library with dlopen: %s", dlerror());
-                    return false;
-                }
-                
-                // Clear any existing error
-                dlerror();
-                
-                // Try to find the mlc_create_chat_module function
-                typedef void* (*CreateChatModuleFunc)(const char*);
-                CreateChatModuleFunc create_func = (CreateChatModuleFunc)dlsym(lib_handle, "mlc_create_chat_module");
-                const char* dlsym_error = dlerror();
-                
-                if (dlsym_error) {
-                    LOGE("FATAL: Could not find mlc_create_chat_module symbol: %s", dlsym_error);
-                    dlclose(lib_handle);
-                    
-                    LOGE("FATAL: Required chat module creation function not found in registry");
-                    LOGE("Please make sure the model library implements one of: mlc.create_chat_module or mlc_create_chat_module");
-                    return false;
-                }
-                
-                // Call the function to create the module
-                void* module_ptr = create_func(model_dir.c_str());
-                if (!module_ptr) {
-                    LOGE("FATAL: Create chat module function returned NULL");
-                    dlclose(lib_handle);
-                    return false;
-                }
-                
-                LOGI("Successfully created chat module using direct dlsym approach");
-                
-                // Now load the other functions
-                typedef void (*LoadModelFunc)();
-                typedef char* (*GenerateFunc)(const char*);
-                typedef void (*ResetChatFunc)();
-                typedef void (*SetParamFunc)(const char*, float);
-                
-                LoadModelFunc load_model_func = (LoadModelFunc)dlsym(lib_handle, "load_model");
-                GenerateFunc generate_func = (GenerateFunc)dlsym(lib_handle, "generate");
-                ResetChatFunc reset_chat_func = (ResetChatFunc)dlsym(lib_handle, "reset_chat");
-                SetParamFunc set_param_func = (SetParamFunc)dlsym(lib_handle, "set_parameter");
-                
-                // Check that all functions were found
-                if (!load_model_func || !generate_func || !reset_chat_func || !set_param_func) {
-                    LOGE("FATAL: Failed to find all required functions");
-                    if (!load_model_func) LOGE("Missing: load_model");
-                    if (!generate_func) LOGE("Missing: generate");
-                    if (!reset_chat_func) LOGE("Missing: reset_chat");
-                    if (!set_param_func) LOGE("Missing: set_parameter");
-                    dlclose(lib_handle);
-                    return false;
-                }
-                
-                // Create wrapper functions that call the loaded functions
-                model_load_ = tvm::runtime::PackedFunc([load_model_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
-                    load_model_func();
-                });
-                
-                generate_ = tvm::runtime::PackedFunc([generate_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
-                    std::string prompt = args[0];
-                    char* result = generate_func(prompt.c_str());
-                    std::string result_str(result);
-                    free(result); // Assume the function allocates memory we need to free
-                    *rv = result_str;
-                });
-                
-                reset_chat_ = tvm::runtime::PackedFunc([reset_chat_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
-                    reset_chat_func();
-                });
-                
-                set_param_ = tvm::runtime::PackedFunc([set_param_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
-                    std::string key = args[0];
-                    float value = static_cast<float>(static_cast<double>(args[1]));
-                    set_param_func(key.c_str(), value);
-                });
-                
-                // Create a fake module since we're not using TVM's module system
-                module_ = tvm::runtime::Module(nullptr);
-                
-                // Call load_model to initialize
-                load_model_func();
-                LOGI("Model loaded successfully using direct function calls");
-            } else {
-                LOGI("Found required function: mlc.create_chat_module");
-                
-                // Create the chat module by passing the model directory
-                try {
-                    module_ = (*chat_create)(model_dir);
-                    LOGI("Created chat module");
-                } catch (const std::exception& e) {
-                    LOGE("FATAL: Failed to create chat module: %s", e.what());
-                    return false;
-                }
-                
-                // Get the necessary functions from the module
-                model_load_ = module_.GetFunction("load_model");
-                generate_ = module_.GetFunction("generate");
-                reset_chat_ = module_.GetFunction("reset_chat");
-                set_param_ = module_.GetFunction("set_parameter");
-                
-                // Check if we got all required functions
-                if (model_load_ == nullptr || generate_ == nullptr || 
-                    reset_chat_ == nullptr || set_param_ == nullptr) {
-                    LOGE("FATAL: Failed to get required functions from the module");
-                    
-                    // Log which functions are missing
-                    LOGE("Missing functions:");
-                    if (model_load_ == nullptr) LOGE("  load_model");
-                    if (generate_ == nullptr) LOGE("  generate");
-                    if (reset_chat_ == nullptr) LOGE("  reset_chat");
-                    if (set_param_ == nullptr) LOGE("  set_parameter");
-                    
-                    return false;
-                }
-                
-                // Load the model
-                model_load_();
-                LOGI("Model loaded successfully");
-            }
-            
-            // Configure generation parameters
-            configure_chat();
-            
-            initialized = true;
-            LOGI("MLC-LLM initialization completed successfully");
+    // Fit `config` to its deadline from the measured rates: cap max_gen_len and
+    // pick the draft length. False when generating cannot make it, for a canned answer.
+    bool plan_deadline(const std::string& prompt, GenerationConfig* config) {
+        deadline_at_ = std::chrono::steady_clock::time_point{};
+        deadline_report_ = deadline::Report();
+        if (config->deadline_ms <= 0) {
             return true;
         }
-        catch (const std::exception& e) {
-            LOGE("FATAL: Error initializing MLC-LLM: %s", e.what());
+        auto now = std::chrono::steady_clock::now();
+        auto arrived = timing_ != nullptr ? timing_->enqueued : now;
+        double elapsed = std::chrono::duration<double, std::milli>(now - arrived).count();
+        deadline_at_ = arrived + std::chrono::milliseconds(config->deadline_ms);
+        deadline_report_.deadline_ms = config->deadline_ms;
+        if (!initialized) {
+            deadline_report_.outcome = deadline::kOutcomeCanned;
             return false;
         }
-    }
-    
-    std::string generate_response(const std::string& prompt) {
-        if (!initialized) {
-            LOGE("FATAL: MLC-LLM engine not initialized");
-            return "FATAL ERROR: MLC-LLM engine not initialized. The initialization process failed.";
+        if (speculative_.ready()) {
+            SpeculativeStats stats = speculative_.stats();
+            if (stats.proposed > 0 && stats.rounds > 0) {
+                deadline_rates_.draft_ms_per_token = stats.draft_ms / static_cast<double>(stats.proposed);
+                deadline_rates_.verify_ms_per_round = stats.verify_ms / static_cast<double>(stats.rounds);
+                deadline_rates_.acceptance = stats.acceptance_rate();
+            }
         }
-        
-        try {
-            LOGI("Generating response for prompt: %s", prompt.c_str());
-            
-            // First reset the chat to clear any previous conversation
-            reset_chat_();
-            
-            // Generate the response
-            std::string response = generate_(prompt);
-            
-            LOGI("Generated response: %s", response.c_str());
-            return response;
+        deadline::Plan plan = deadline::plan(config->deadline_ms, elapsed, estimate_tokens(prompt), config->max_gen_len,
+                                             deadline_rates_, SpeculativeDecoder::kMaxDraftLength);
+        deadline_report_.predicted_ms = plan.predicted_ms;
+        deadline_report_.max_tokens = plan.max_tokens;
+        if (plan.canned) {
+            LOGI("Deadline of %lld ms cannot be met (%.0f ms in), answering canned",
+                 static_cast<long long>(config->deadline_ms), elapsed);
+            deadline_report_.outcome = deadline::kOutcomeCanned;
+            return false;
         }
-        catch (const std::exception& e) {
-            LOGE("FATAL: Error generating response: %s", e.what());
-            return "FATAL ERROR: " + std::string(e.what());
+        config->max_gen_len = plan.max_tokens;
+        if (plan.draft_length > 0 && speculative_.ready() && plan.draft_length != speculative_.draft_length()) {
+            deadline_draft_restore_ = speculative_.draft_length();
+            speculative_.set_draft_length(plan.draft_length);
+            deadline_report_.draft_length = plan.draft_length;
         }
+        return true;
     }
     
-    // Define a callback function for streaming tokens
-    void stream_response(const std::string& prompt, std::function<void(std::string)> callback) {
-        if (!initialized) {
-            LOGE("MLC-LLM engine not initialized");
-            callback("Error: MLC-LLM engine not initialized");
+    // What the engine holds, for memory admission. The batch's KV is left out
+    // when the batch asks, since it adds its own.
+    memory_forecast::Usage memory_usage(bool with_batch) const {
+        memory_forecast::Usage usage;
+        KvBudgetStats kv = kv_budget_.stats();
+        usage.weights = residency_.stats().resident_bytes;
+        usage.workspace = initialized ? memory_stats::workspace_bytes(compute_device_.device) : 0;
+        usage.sessions = kv.resident_bytes;
+        if (with_batch) {
+            usage.batch = batch_scheduler().stats().kv_tokens * kv.bytes_per_token;
+        }
+        return usage;
+    }
+    
+    // Memory admission of a chat turn. When its forecast does not fit, parked
+    // sessions' KV goes first, least recently used first, then the draft
+    // model, and then the answer is capped at what is left.
+    void plan_admission(const std::string& prompt, GenerationConfig* config) {
+        uint64_t bytes_per_token = kv_budget_.stats().bytes_per_token;
+        if (!initialized || bytes_per_token == 0) {
             return;
         }
-        
-        try {
-            LOGI("Streaming response for prompt: %s", prompt.c_str());
-            
-            // Reset the chat
-            reset_chat_();
-            
-            // Get the stream function
-            auto stream_func = module_.GetFunction("stream_chat");
-            if (stream_func == nullptr) {
-                LOGE("Stream function not found");
-                callback("Error: Streaming not supported");
-                return;
+        memory_forecast::Forecast forecast;
+        forecast.prompt_tokens = estimate_tokens(prompt);
+        forecast.output_tokens = static_cast<uint64_t>(output_lengths_.reserve(kTaskChat, config->max_gen_len));
+        forecast.kv_bytes_per_token = bytes_per_token;
+        memory_forecast::Usage usage = memory_usage(true);
+        std::vector<std::pair<int64_t, uint64_t>> resident = kv_budget_.session_bytes();
+        for (auto it = resident.rbegin(); it != resident.rend(); ++it) {
+            if (forecast.bytes() <= admission_.room(usage, kPriorityInteractive)) {
+                break;
+            }
+            if (it->first != active_session_) {
+                evict_session_kv(it->first);
+                usage.sessions -= std::min(usage.sessions, it->second);
             }
-            
-            // Create a TVM callback to pass to the stream function
-            auto tvm_callback = tvm::runtime::TypedPackedFunc<void(std::string)>(
-                [callback](std::string token) {
-                    callback(token);
-                });
-            
-            // Call the stream function with the prompt and callback
-            stream_func(prompt, tvm_callback);
         }
-        catch (const std::exception& e) {
-            LOGE("Error streaming response: %s", e.what());
-            callback("Error streaming response: " + std::string(e.what()));
+        if (forecast.bytes() > admission_.room(usage, kPriorityInteractive) && draft_module_.defined()) {
+            evict_model(kModelDraft);
+            usage.weights = residency_.stats().resident_bytes;
+        }
+        memory_forecast::Verdict verdict = admission_.decide(usage, forecast, kPriorityInteractive);
+        if (verdict.decision == memory_forecast::kDegrade &&
+            static_cast<uint64_t>(config->max_gen_len) > verdict.output_tokens) {
+            config->max_gen_len = static_cast<int>(verdict.output_tokens);
+            LOGI("Memory forecast over budget, answer capped at %d tokens", config->max_gen_len);
         }
     }
     
-    void reset_chat() {
-        if (!initialized) {
-            LOGE("MLC-LLM engine not initialized");
-            return;
+    // Stand-in for a model answer that cannot arrive in time
+    std::string canned_answer(const std::string& prompt) {
+        stop_reason_ = kStopDeadline;
+        deadline_at_ = std::chrono::steady_clock::time_point{};
+        std::string response = canned_response::respond(prompt, route_subject(prompt),
+                                                        static_cast<uint32_t>(std::hash<std::string>()(prompt)));
+        deadline_report_.elapsed_ms = timing_ != nullptr ? std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - timing_->enqueued).count() : 0.0;
+        return response;
+    }
+    
+    void finish_deadline(int requested_tokens) {
+        if (deadline_draft_restore_ >= 0) {
+            speculative_.set_draft_length(deadline_draft_restore_);
+            deadline_draft_restore_ = -1;
         }
-        
-        try {
-            LOGI("Resetting chat");
-            reset_chat_();
+        if (deadline_at_ == std::chrono::steady_clock::time_point{}) {
+            return;
         }
-        catch (const std::exception& e) {
-            LOGE("Error resetting chat: %s", e.what());
+        auto now = std::chrono::steady_clock::now();
+        auto arrived = deadline_at_ - std::chrono::milliseconds(deadline_report_.deadline_ms);
+        deadline_report_.elapsed_ms = std::chrono::duration<double, std::milli>(now - arrived).count();
+        if (stop_reason_.load() == kStopDeadline) {
+            deadline_report_.outcome = deadline::kOutcomeCut;
+        } else if (now > deadline_at_) {
+            deadline_report_.outcome = deadline::kOutcomeMissed;
+        } else if (deadline_report_.max_tokens < requested_tokens) {
+            deadline_report_.outcome = deadline::kOutcomeTrimmed;
+        } else {
+            deadline_report_.outcome = deadline::kOutcomeMet;
         }
+        deadline_at_ = std::chrono::steady_clock::time_point{};
     }
     
-    void set_temperature(float temp) {
-        temperature = temp;
-        LOGI("Set temperature to %.2f", temperature);
-        
-        if (initialized) {
-            configure_chat();
+    // Prefill the turn chunk by chunk, reporting progress and giving other
+    // threads the cores between chunks. False if the request was cancelled.
+    bool chunked_prefill(const std::string& prompt) {
+        if (prefill_begin_ == nullptr || prefill_step_ == nullptr || speculative_.ready() || prompt_lookup_active() ||
+            self_speculation_active()) {
+            return true;  // the generation call prefills in one go
         }
-    }
-    
-    void set_top_p(float p) {
-        top_p = p;
-        LOGI("Set top_p to %.2f", top_p);
-        
-        if (initialized) {
-            configure_chat();
+        int64_t total = prefill_begin_(prompt).operator int64_t();
+        if (total <= prefill_chunk_tokens_ && !prefill_progress_ && !npu_prefill_) {
+            return true;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (timing_ != nullptr) {
+            timing_->prefill_start = start;
+            timing_->prompt_tokens = static_cast<size_t>(total);
         }
+        int64_t left = total;
+        int chunks = 0;
+        if (prefill_progress_) {
+            prefill_progress_(0, total);
+        }
+        while (left > 0) {
+            if (abort_requested_.load(std::memory_order_relaxed)) {
+                LOGI("Prefill cancelled with %lld of %lld tokens left", static_cast<long long>(left),
+                     static_cast<long long>(total));
+                return false;
+            }
+            {
+                TraceSection trace("mlc:prefill_chunk");
+                // The NPU runs only the chunk sizes its graphs were compiled for
+                int64_t chunk = npu_prefill_ ? npu_chunk(npu_chunks_, left) : prefill_chunk_tokens_;
+                left = prefill_step_(chunk).operator int64_t();
+            }
+            stall::progress();
+            chunks++;
+            if (prefill_progress_) {
+                prefill_progress_(total - std::max<int64_t>(left, 0), total);
+            }
+            std::this_thread::yield();
+        }
+        if (timing_ != nullptr) {
+            timing_->end_prefill();
+        }
+        NLOG_EVERY_MS(10000, LOGI, "Prefilled %lld tokens in %d chunks in %.1f ms", static_cast<long long>(total), chunks,
+                      std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+        return true;
     }
+    // LoRA adapters over the loaded base weights (see lora_adapters.h):
+    //   set_adapter(name)             adapter for the next turns, "" for the base model
+    //   load_adapter(name, dir)       upload an adapter from <model_dir>/adapters/<name>
+    //   unload_adapter(name)          free it again
+    //   batch_set_adapter(seq, name)  adapter of one batched sequence, for mixed-adapter decode
+    // Without load_adapter the module resolves adapter names itself.
+    tvm::runtime::PackedFunc set_adapter_{nullptr};
+    tvm::runtime::PackedFunc load_adapter_{nullptr};
+    tvm::runtime::PackedFunc unload_adapter_{nullptr};
+    tvm::runtime::PackedFunc batch_set_adapter_{nullptr};
+    AdapterSet adapters_;
+    std::string active_adapter_;  // last set_adapter, valid while adapter_known_
+    bool adapter_known_ = false;
     
-    void set_max_gen_len(int len) {
-        max_gen_len = len;
-        LOGI("Set max_gen_len to %d", max_gen_len);
+    // Make `name` resident in the module, unloading the least recently used
+    // adapters past AdapterSet::kMaxResident. False if it cannot be loaded.
+    bool load_adapter(const std::string& name) {
+        if (name.empty() || load_adapter_ == nullptr) {
+            return true;
+        }
+        const AdapterInfo* info = adapters_.find(name);
+        if (info == nullptr) {
+            LOGE("No adapter named %s next to the model", name.c_str());
+            return false;
+        }
+        bool needs_load = false;
+        for (const std::string& victim : adapters_.use(name, &needs_load)) {
+            if (adapter_known_ && victim == active_adapter_) {
+                adapter_known_ = false;
+            }
+            try {
+                if (unload_adapter_ != nullptr) {
+                    unload_adapter_(victim);
+                }
+            } catch (const std::exception& e) {
+                LOGE("Error unloading adapter %s: %s", victim.c_str(), e.what());
+            }
+        }
+        if (!needs_load) {
+            return true;
+        }
+        try {
+            TraceSection trace("mlc:load:adapter");
+            load_adapter_(name, info->dir);
+            LOGI("Loaded adapter %s (rank %d, %llu bytes)", name.c_str(), info->rank,
+                 static_cast<unsigned long long>(info->bytes));
+            return true;
+        } catch (const std::exception& e) {
+            LOGE("Error loading adapter %s: %s", name.c_str(), e.what());
+            adapters_.forget(name);
+            return false;
+        }
+    }
+    
+    // Switch the module to `name` for the next turns; the base weights stay as they are
+    void select_adapter(const std::string& name) {
+        if (set_adapter_ == nullptr || (adapter_known_ && name == active_adapter_)) {
+            return;
+        }
+        std::string selected = load_adapter(name) ? name : std::string();
+        try {
+            set_adapter_(selected);
+            active_adapter_ = selected;
+            adapter_known_ = true;
+        } catch (const std::exception& e) {
+            LOGE("Error selecting adapter %s: %s", selected.c_str(), e.what());
+            adapter_known_ = false;
+        }
+    }
+    
+    // Adapter a subject's conversations run with. Without an adapters
+    // directory or load_adapter, the module is asked for the subject key as is.
+    std::string subject_adapter(Subject subject) const {
+        std::string key(kSubjectKeys[subject]);
+        if (adapters_.has(key) || (adapters_.empty() && load_adapter_ == nullptr)) {
+            return key;
+        }
+        return std::string();
+    }
+    
+    // The request's adapter, else the session's, else the subject's; "base" is none
+    std::string turn_adapter(const std::string& requested, Subject subject) const {
+        std::string name = requested;
+        if (name.empty()) {
+            auto it = sessions_.find(active_session_);
+            name = it != sessions_.end() ? it->second.adapter : std::string();
+        }
+        if (name.empty()) {
+            return subject_adapter(subject);
+        }
+        return name == kBaseAdapter ? std::string() : name;
+    }
+    
+    // Logits-returning decode steps for native sampling:
+    //   prefill_logits(prompt) -> NDArray   prefill a user turn, logits for the next token
+    //   decode_logits(token)   -> NDArray   append `token`, logits for the one after it
+    tvm::runtime::PackedFunc prefill_logits_{nullptr};
+    tvm::runtime::PackedFunc decode_logits_{nullptr};
+    //   decode_logits_shortlist(token, ids) -> NDArray   decode_logits with the LM head as a gather
+    //                                       over the rows `ids` (ShapeTuple, ascending) of its weight:
+    //                                       logits [1, ids.size()] in the order of ids
+    tvm::runtime::PackedFunc decode_logits_shortlist_{nullptr};
+    //   prefill_token_ids(ids) -> NDArray   prefill_logits for a user turn given as the ids
+    //                                       (ShapeTuple) of its text; the module adds the template.
+    //                                       Like prefill_begin, a turn that is never generated
+    //                                       is dropped by the next prefill or reset_chat.
+    tvm::runtime::PackedFunc prefill_token_ids_{nullptr};
+    //   prefill_turn_ids(ids) -> NDArray    the same for a whole user turn, template included
+    //                                       (chat_template_): the ids are appended as they are
+    tvm::runtime::PackedFunc prefill_turn_ids_{nullptr};
+    ChatTemplate chat_template_;  // compiled with the tokenizer, when the module takes turn ids
+    // Sampling kernel next to the final layer, so device logits never cross to the host:
+    //   sample_on_device(logits, temperature, top_p, repetition_penalty, uniform, history) -> int64
+    // `uniform` is a host draw in [0, 1) that keeps the kernel seedable; `history`
+    // (ShapeTuple) lists the generated tokens to penalize.
+    tvm::runtime::PackedFunc sample_on_device_{nullptr};
+    std::atomic<bool> device_sampling_{true};  // set from any thread, read per token
+    
+    // Prefill and decode on different devices (see phase_devices.h):
+    //   set_phase_device(phase, device_type, device_id)   phase "prefill" or "decode";
+    //                                                     the module hands the KV across
+    tvm::runtime::PackedFunc set_phase_device_{nullptr};
+    PhasePlan phase_plan_;
+    //   npu_prefill_chunks() -> ShapeTuple   token counts of the prefill graphs compiled for
+    //                                        the NPU ("prefill" on kDLHexagon), ascending
+    tvm::runtime::PackedFunc npu_prefill_chunks_{nullptr};
+    std::vector<int64_t> npu_chunks_;
+    bool npu_prefill_ = false;  // the NPU holds the prefill phase
+    
+    // Precompiled schedule variants of the hot kernels (see kernel_tuning.h)
+    tvm::runtime::PackedFunc kernel_variants_{nullptr};
+    tvm::runtime::PackedFunc select_kernel_variant_{nullptr};
+    std::vector<KernelVariants> kernels_;
+    std::map<std::string, std::string> kernel_choice_;  // variant in use per kernel
+    TuningDatabase tuning_db_;
+    std::string tuning_path_;
+    // Tuning results imported from another phone of the same kind (see device_profile.h)
+    device_profile::DeviceProfile fleet_profile_;
+    
+    // Compiled GPU kernels from the last launch (see kernel_cache.h)
+    tvm::runtime::PackedFunc get_kernel_binaries_{nullptr};
+    tvm::runtime::PackedFunc set_kernel_binaries_{nullptr};
+    KernelBinaryCache kernel_cache_;
+    std::string kernel_cache_dir_;  // empty: next to the model
+    bool kernel_cache_dirty_ = false;  // kernels were built this launch and not saved yet
+    
+    // Relax VM profiler around one step; returns [logits, Report] (see kernel_profile.h)
+    tvm::runtime::PackedFunc profile_step_{nullptr};
+    
+    // Decode steps recorded once and replayed on the GPU backends (see decode_graph.h)
+    DecodeGraph decode_graph_;
+    bool decode_graph_enabled_ = true;
+    
+    bool initialized = false;
+    std::string model_path;
+    // The model library when it was opened for its direct exports; closed with the engine
+    void* model_lib_handle_ = nullptr;
+    // This engine enabled the process-wide layer pager (layer_pager.h)
+    bool owns_pager_ = false;
+    // The lower-bit variant of the weights loaded (requantize.h Scheme); -1 for the shipped ones
+    int requantized_scheme_ = -1;
+    
+    // Multi-turn mode keeps the module's KV cache alive between requests so
+    // each call only prefills the new user turn. resetChat() is the only thing
+    // that clears the conversation in this mode.
+    bool multi_turn_ = true;
+    int turn_count_ = 0;
+    
+    // True once the prefix KV has been snapshotted into kPrefixKvSlot
+    bool prefix_cached_ = false;
+    // prefix_kv.bin of the model package when it fits this model and module
+    // (prefix_package.h); cleared if the module cannot load it
+    std::string shipped_prefix_;
+    
+    // Subject the current conversation was routed to, and which subject
+    // prefixes have a KV snapshot (bit per Subject)
+    Subject conversation_subject_ = kSubjectGeneral;
+    uint32_t subject_prefix_cached_ = 0;
+    float last_route_us_ = 0.0f;
+    
+    // Snapshots of conversations started from retrieved material, and whether
+    // the module's conversation is one of those
+    ContextKvCache context_cache_;
+    bool context_entered_ = false;
+    // Prompts of new conversations with their KV (share_prefix), and whether
+    // settle_draft left a draft for the next turn to reuse instead
+    PrefixTree prefix_tree_;
+    bool draft_kept_ = false;
+    PackedContext last_context_;
+    // Retrieved context thinned per request (GenerationConfig.context_ratio)
+    struct CompressionStats {
+        context_compression::Result last;
+        double last_ms = 0.0;  // spent compressing
+        double last_saved_ms = 0.0;  // prefill saved at the measured prefill rate
+        uint64_t requests = 0;
+        uint64_t tokens_saved = 0;
+        double saved_ms = 0.0;
+    };
+    CompressionStats compression_;
+    
+    // MlcCapability bits for the optional entry points found in the module
+    uint32_t capabilities_ = 0;
+    
+    // Conversations share the weights; only one is in the module's KV at a
+    // time. The others are parked in their own KV snapshot slot, with the turn
+    // state needed to continue them.
+    struct Session {
+        int slot = 0;
+        bool parked = false;  // KV snapshot in kSessionKvSlotBase + slot is current
+        bool evicted = false;  // KV dropped for the budget; `turns` is re-prefilled on resume
+        bool offloaded = false;  // with `evicted`: KV in kv_offload::store(), tried before the replay
+        int turn_count = 0;
+        Subject subject = kSubjectGeneral;
+        uint64_t tokens = 0;  // estimated KV length of the conversation
+        uint64_t shared_tokens = 0;  // leading tokens on pages shared with the session it was forked from
+        int pending_rollback = 0;  // turns to roll back after the forked snapshot is restored
+        std::string adapter;  // setSessionAdapter; empty routes by subject
+        std::string context;  // retrieved material in the system message of the conversation
+        size_t context_tokens = 0;
+        std::vector<ContextChunk> staged;  // setRetrievedContext, packed at the next turn
+        size_t staged_max_tokens = 0;
+        size_t staged_merged = 0;
+        bool context_next = false;  // the next new conversation starts from `context`
+        std::string memory;  // summary of the turns folded out, in the system message
+        std::vector<std::pair<std::string, std::string>> turns;  // (prompt, response)
+        // Tokens generated in the conversation, for the repetition penalty; emptied
+        // with the conversation, so it spans turns while the KV does
+        PenaltyHistory penalty;
+        int kv_policy = kv_eviction::kPolicyWindow;  // setSessionKvPolicy
+        int64_t kv_budget_tokens = 0;  // heavy-hitter budget; <= 0 for the context window
+        // Every turn as text and ids, from openConversationLog; turns folded into
+        // `memory` stay in it
+        std::shared_ptr<ConversationLog> log;
+    };
+    std::map<int64_t, Session> sessions_{{kDefaultSession, Session()}};
+    int64_t active_session_ = kDefaultSession;
+    int64_t next_session_id_ = 1;
+    
+    // KV bytes held by the active and parked sessions, evicted LRU-first
+    KvBudget kv_budget_;
+    // Requests admitted against forecast memory (memory_forecast.h)
+    memory_forecast::Admission admission_;
+    KvBudget::KvLayout kv_layout_;
+    ContextWindow context_window_;
+    double memory_fill_factor_ = 0.6;  // kept over context_window_ reloads
+    // Answer lengths per task, sizing the context and batch KV answers are given
+    OutputLengths output_lengths_;
+    
+    // Sessions past memory_fill_factor after their last turn, for the memory worker
+    std::set<int64_t> memory_due_;
+    uint64_t memory_folds_ = 0;
+    uint64_t memory_turns_folded_ = 0;
+    uint64_t memory_tokens_saved_ = 0;
+    uint64_t kv_compressions_ = 0;
+    uint64_t kv_tokens_evicted_ = 0;
+    
+    // Follow-up answers prepared at idle time (follow_up_prefetch.h)
+    int follow_up_mode_ = follow_up::kModeOff;
+    std::vector<std::string> follow_up_prompts_ = follow_up::default_prompts();
+    int follow_up_max_tokens_ = follow_up::kDefaultMaxTokens;
+    follow_up::Cache follow_ups_;
+    follow_up::Stats follow_up_stats_;
+    follow_up::TokenAllowance follow_up_allowance_;
+    int64_t prefetch_due_ = -1;  // the session whose turn just ended, for the prefetch worker
+    bool prefetching_ = false;  // a branch is being answered; its turn schedules nothing
+    
+    // The system message a conversation is rebuilt with, summary included
+    static std::string session_system(const Session& session) {
+        std::string system = system_message(session.subject, session.context);
+        if (!session.memory.empty()) {
+            system += "\n\n" + conversation_memory::system_section(session.memory);
+        }
+        return system;
+    }
+    
+    std::vector<uint64_t> session_turn_sizes(const Session& session) const {
+        std::vector<uint64_t> sizes;
+        sizes.reserve(session.turns.size());
+        for (const auto& turn : session.turns) {
+            sizes.push_back(turn_tokens(turn));
+        }
+        return sizes;
+    }
+    
+    // Shift the oldest turns of the active session out of the context when the
+    // next turn would overflow it. In place with shift_turns; otherwise the
+    // kept turns are prefilled again, once per overflow instead of a reset.
+    void fit_context(const std::string& prompt) {
+        Session& session = sessions_[active_session_];
+        if (!multi_turn_ || turn_count_ == 0 || session.turns.empty()) {
+            return;
+        }
+        if (compress_context(session, prompt)) {
+            return;
+        }
+        std::vector<uint64_t> sizes = session_turn_sizes(session);
+        std::string system = system_message(conversation_subject_, session.context);
+        if (!session.memory.empty()) {
+            system += "\n\n" + conversation_memory::system_section(session.memory);
+        }
+        ContextWindow window = context_window_;
+        window.mean_gen_len = expected_answer_tokens();
+        size_t drop = window.turns_to_shift(estimate_tokens(system), sizes, estimate_tokens(prompt));
+        if (drop == 0) {
+            return;
+        }
         
-        if (initialized) {
-            configure_chat();
+        bool in_step = turn_count_ == static_cast<int>(session.turns.size());
+        bool shifted = false;
+        if (shift_turns_ != nullptr && in_step) {
+            try {
+                shift_turns_(static_cast<int>(drop), static_cast<int>(context_window_.sink_tokens));
+                shifted = true;
+            } catch (const std::exception& e) {
+                LOGE("Error shifting the context, prefilling the kept turns: %s", e.what());
+            }
+        }
+        for (size_t i = 0; i < drop; ++i) {
+            session.tokens -= std::min(session.tokens, sizes[i]);
+        }
+        session.turns.erase(session.turns.begin(), session.turns.begin() + drop);
+        session.shared_tokens = 0;
+        speculative_.reset();
+        if (shifted) {
+            turn_count_ -= static_cast<int>(drop);
+        } else {
+            session.subject = conversation_subject_;
+            if (session.turns.empty() || !replay_session(session)) {
+                clear_conversation();
+                turn_count_ = 0;
+                session.turns.clear();
+                session.memory.clear();
+                session.tokens = 0;
+            } else {
+                turn_count_ = static_cast<int>(session.turns.size());
+            }
         }
+        update_kv_budget(active_session_, session);
+        LOGI("Shifted %zu oldest turns out of the context (%s), %zu turns kept", drop,
+             shifted ? "in place" : "re-prefilled", session.turns.size());
     }
     
-    void close() {
-        if (initialized) {
-            LOGI("Closing MLC-LLM engine");
-            // Reset module references to release resources
-            model_load_ = tvm::runtime::PackedFunc(nullptr);
-            generate_ = tvm::runtime::PackedFunc(nullptr);
-            reset_chat_ = tvm::runtime::PackedFunc(nullptr);
-            set_param_ = tvm::runtime::PackedFunc(nullptr);
-            
-            // Create an empty module to replace the current one
-            module_ = tvm::runtime::Module(nullptr);
-            
-            initialized = false;
+    // Heavy-hitter policy: before a turn that would take the conversation past
+    // its budget, evict the tokens that drew the least attention so that the
+    // turn and its answer fit, instead of shifting whole turns out. The turn
+    // list stays as it was, for replay. False where the session or the module
+    // does not do this, leaving the turn to the sliding window.
+    bool compress_context(Session& session, const std::string& prompt) {
+        if (session.kv_policy != kv_eviction::kPolicyHeavyHitter || kv_attention_mass_ == nullptr ||
+            evict_tokens_ == nullptr) {
+            return false;
+        }
+        int64_t budget = session.kv_budget_tokens > 0 ? session.kv_budget_tokens : context_window_.window;
+        if (context_window_.window > 0) {
+            budget = std::min(budget, context_window_.window);
+        }
+        if (budget <= 0) {
+            return false;
+        }
+        uint64_t fixed = estimate_tokens(session_system(session)) +
+                         static_cast<uint64_t>(std::max<int64_t>(0, context_window_.sink_tokens));
+        uint64_t incoming = estimate_tokens(prompt) + static_cast<uint64_t>(expected_answer_tokens());
+        if (fixed + session.tokens + incoming <= static_cast<uint64_t>(budget)) {
+            return true;
+        }
+        std::vector<int64_t> positions;
+        try {
+            tvm::runtime::NDArray mass = kv_attention_mass_();
+            int64_t length = mass->ndim > 0 ? mass->shape[mass->ndim - 1] : 0;
+            if (mass->dtype.code != kDLFloat || mass->dtype.bits != 32 || length <= 0) {
+                LOGE("kv_attention_mass must return float32 [tokens]");
+                return false;
+            }
+            std::vector<float> host(static_cast<size_t>(length));
+            mass.CopyToBytes(host.data(), host.size() * sizeof(float));
+            uint64_t target = static_cast<uint64_t>(budget) - std::min<uint64_t>(budget, incoming);
+            positions = kv_eviction::select(host.data(), host.size(), static_cast<size_t>(fixed),
+                                            kv_eviction::kRecentTokens, static_cast<size_t>(target));
+            if (positions.empty()) {
+                return true;
+            }
+            evict_tokens_(tvm::runtime::ShapeTuple(positions.begin(), positions.end()));
+        } catch (const std::exception& e) {
+            LOGE("Error evicting low-attention tokens, shifting turns instead: %s", e.what());
+            return false;
+        }
+        session.tokens -= std::min<uint64_t>(session.tokens, positions.size());
+        session.shared_tokens = 0;
+        speculative_.reset();
+        kv_compressions_++;
+        kv_tokens_evicted_ += positions.size();
+        update_kv_budget(active_session_, session);
+        LOGI("Evicted %zu low-attention tokens, %llu kept for a %lld token budget", positions.size(),
+             static_cast<unsigned long long>(session.tokens), static_cast<long long>(budget));
+        return true;
+    }
+    
+    // The module reports the KV dtype it actually allocated; a library compiled
+    // without 8-bit attention keeps fp16 whatever the config asks for
+    void resolve_kv_layout() {
+        if (kv_cache_dtype_ != nullptr) {
+            try {
+                std::string name = kv_cache_dtype_();
+                KvCacheDtype dtype = kv_cache_dtype_from_name(name);
+                if (dtype != kv_layout_.dtype) {
+                    LOGI("mlc-chat-config.json asks for a %s KV cache, module uses %s",
+                         kv_cache_dtype_name(kv_layout_.dtype), kv_cache_dtype_name(dtype));
+                }
+                kv_layout_.dtype = dtype;
+            } catch (const std::exception& e) {
+                LOGE("Error reading the module's KV dtype: %s", e.what());
+            }
+        } else if (kv_layout_.dtype != kKvFloat16) {
+            LOGI("Module does not report its KV dtype; assuming the configured %s",
+                 kv_cache_dtype_name(kv_layout_.dtype));
+        }
+        kv_budget_.set_bytes_per_token(kv_layout_.bytes_per_token(), kv_layout_.local_bytes_per_token(),
+                                       kv_layout_.window);
+        LOGI("KV cache: %s, %llu bytes per token", kv_cache_dtype_name(kv_layout_.dtype),
+             static_cast<unsigned long long>(kv_layout_.bytes_per_token()));
+        if (kv_layout_.local_layers > 0) {
+            LOGI("%llu of %llu layers attend to the last %llu tokens, %llu bytes per token past that",
+                 static_cast<unsigned long long>(kv_layout_.local_layers),
+                 static_cast<unsigned long long>(kv_layout_.layers),
+                 static_cast<unsigned long long>(kv_layout_.window),
+                 static_cast<unsigned long long>(kv_layout_.bytes_per_token() - kv_layout_.local_bytes_per_token()));
+        }
+    }
+    
+    // Sessions saved to app storage, tied to the loaded model by its fingerprint
+    SessionStore session_store_;
+    // First-turn answers to deterministic requests, keyed with model_hash_
+    ResponseCache response_cache_;
+    // Near-duplicate questions over response_cache_, by prompt embedding
+    SemanticCache semantic_cache_;
+    double cache_saved_ms_ = 0.0;  // generation time of exact hits
+    // summarizeDocument steps by content (document_summary.h)
+    ResponseCache summary_cache_;
+    uint64_t model_hash_ = 0;
+    
+    // A request's place in the response cache, kept until its answer is remembered
+    struct AnswerLookup {
+        uint64_t key = 0;  // 0: not cacheable
+        uint64_t scope = 0;
+        std::string prompt;  // normalized
+        std::vector<float> embedding;  // for the semantic index, when it is on
+    };
+    
+    size_t estimate_tokens(const std::string& text) const {
+        return tokenizer_.loaded() ? tokenizer_.count(text) : text.size() / 4 + 1;
+    }
+    
+    // Room a chat answer is expected to take: what chat answers came to lately,
+    // mean_gen_len until there are enough of them
+    int64_t expected_answer_tokens() const {
+        return output_lengths_.reserve(kTaskChat, config_.snapshot()->max_gen_len);
+    }
+    
+    // A finished answer of `task`; cut-short and failed ones say nothing about its length
+    void note_length(int task, const std::string& response, int max_gen_len) {
+        int reason = stop_reason_.load();
+        if (reason == kStopAborted || reason == kStopError || reason == kStopCached || reason == kStopDeadline ||
+            response.rfind("Error:", 0) == 0 || response.rfind("FATAL ERROR:", 0) == 0) {
+            return;
+        }
+        output_lengths_.record(task, static_cast<int>(estimate_tokens(response)), max_gen_len);
+    }
+    
+    // Before a turn: the module keeps a draft that starts the prompt and
+    // prefills only the rest. A draft whose last tokens differ (a word the
+    // prompt goes on with tokenizes differently) is rolled back to what it
+    // shares with the prompt; any other draft is dropped here.
+    void settle_draft(const std::string& prompt) {
+        if (draft_session_ < 0) {
+            return;
+        }
+        std::vector<int> ids;
+        {
+            TraceSection trace("mlc:tokenize");
+            ids = tokenizer_.encode(prompt);
+        }
+        size_t common = 0;
+        if (draft_session_ == active_session_) {
+            size_t limit = std::min(ids.size(), draft_tokens_.size());
+            while (common < limit && ids[common] == draft_tokens_[common]) {
+                common++;
+            }
+        }
+        if (common == 0) {
+            drop_draft();
+            return;
+        }
+        if (common < draft_tokens_.size()) {
+            try {
+                draft_truncate_(static_cast<int64_t>(common));
+            } catch (const std::exception& e) {
+                LOGE("Error rolling back the draft: %s", e.what());
+                drop_draft();
+                return;
+            }
+        }
+        LOGI("Reusing %zu of %zu prompt tokens prefilled ahead", common, ids.size());
+        draft_tokens_.clear();
+        draft_session_ = -1;
+        draft_kept_ = true;
+    }
+    
+    // A new conversation keeps its prompt's KV in a prefix tree slot, and a
+    // later one on the same base whose prompt starts the same way (the same
+    // worksheet pasted into another session, a lesson asked about again)
+    // restores the longest such prefix and prefills only the rest. The prompt
+    // goes in as a draft, which the generation call then reuses; all but its
+    // last token, which the call prefills for the first reply logits.
+    void share_prefix(const std::string& prompt, const std::string& requested_adapter) {
+        if (std::exchange(draft_kept_, false) || turn_count_ != 0 || draft_session_ >= 0) {
+            return;
+        }
+        if (draft_append_ == nullptr || draft_truncate_ == nullptr || fork_kv_ == nullptr ||
+            restore_kv_ == nullptr || drop_kv_ == nullptr || !tokenizer_.loaded() || speculative_.ready() ||
+            prompt_lookup_active() || self_speculation_active()) {
+            return;
+        }
+        std::vector<int> ids;
+        {
+            TraceSection trace("mlc:tokenize");
+            ids = tokenizer_.encode(prompt);
+        }
+        if (ids.size() <= PrefixTree::kMinTokens) {
+            return;
+        }
+        ids.pop_back();
+        if (context_window_.window > 0 && static_cast<int64_t>(ids.size()) + expected_answer_tokens() +
+                                              kDraftReserveTokens > context_window_.window) {
+            return;  // too long to hold as a draft
+        }
+        const Session& session = sessions_[active_session_];
+        std::string adapter = turn_adapter(requested_adapter, conversation_subject_);
+        std::string system = system_message(conversation_subject_, context_entered_ ? session.context : std::string());
+        uint64_t base = std::hash<std::string>()(adapter + '\n' + system);
+        PrefixTree::Match hit = prefix_tree_.match(base, ids);
+        try {
+            if (hit.slot >= 0) {
+                restore_kv_(kPrefixTreeSlotBase + hit.slot);
+                if (hit.cached > hit.tokens) {
+                    draft_truncate_(static_cast<int64_t>(hit.tokens));
+                }
+            }
+            if (hit.tokens < ids.size()) {
+                std::vector<int64_t> rest(ids.begin() + hit.tokens, ids.end());
+                draft_append_(tvm::runtime::ShapeTuple(rest.begin(), rest.end()));
+            }
+            if (hit.tokens < ids.size() || hit.cached != ids.size()) {
+                int evicted = -1;
+                int slot = prefix_tree_.insert(base, ids, &evicted);
+                if (evicted >= 0) {
+                    drop_kv_(kPrefixTreeSlotBase + evicted);
+                }
+                fork_kv_(kPrefixTreeSlotBase + slot);
+            }
+            if (hit.slot >= 0) {
+                LOGI("Reusing %zu of %zu prompt tokens from the prefix tree", hit.tokens, ids.size() + 1);
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error sharing the prompt prefix, prefilling it whole: %s", e.what());
+            drop_prefix_tree();
+            if (context_entered_) {
+                enter_context(conversation_subject_, adapter, session.context);
+            } else {
+                enter_subject(conversation_subject_, adapter);
+            }
+        }
+    }
+    
+    void drop_prefix_tree() {
+        for (int slot : prefix_tree_.slots()) {
+            if (drop_kv_ == nullptr) {
+                break;
+            }
+            try {
+                drop_kv_(kPrefixTreeSlotBase + slot);
+            } catch (const std::exception& e) {
+                LOGE("Error dropping shared prefix KV: %s", e.what());
+            }
+        }
+        prefix_tree_.clear();
+    }
+    
+    // Keep the record of a finished turn in the active session and evict
+    // parked sessions until the KV fits the budget again
+    void record_turn(int turns_before, const std::string& prompt, const std::string& response) {
+        if (turn_count_ <= turns_before) {
+            return;  // the request failed before it reached the module
+        }
+        Session& session = sessions_[active_session_];
+        if (turn_count_ == 1) {
+            // begin_turn started a new conversation
+            session.turns.clear();
+            session.memory.clear();
+            session.tokens = session.context_tokens;
+            session.shared_tokens = 0;
+        }
+        session.turns.emplace_back(prompt, response);
+        session.tokens += estimate_tokens(prompt) + estimate_tokens(response);
+        log_turn(session, turn_count_ == 1);
+        if (memory_due(session)) {
+            memory_due_.insert(active_session_);
+        }
+        if (follow_up_mode_ != follow_up::kModeOff && !prefetching_) {
+            prefetch_due_ = active_session_;
+        }
+        update_kv_budget(active_session_, session);
+        enforce_kv_budget();
+        if (kernel_cache_dirty_) {
+            save_kernel_binaries();  // a full turn has built every kernel a turn needs
+        }
+    }
+    
+    // Append the session's last turn to its log, which starts over with a new conversation
+    void log_turn(Session& session, bool fresh) {
+        if (!session.log || session.turns.empty()) {
+            return;
+        }
+        if (fresh) {
+            session.log->truncate(0);
+        }
+        const auto& turn = session.turns.back();
+        std::vector<int> none;
+        bool ok = session.log->append(ConversationLog::kUser, turn.first,
+                                      tokenizer_.loaded() ? tokenizer_.encode(turn.first) : none) &&
+                  session.log->append(ConversationLog::kAssistant, turn.second,
+                                      tokenizer_.loaded() ? tokenizer_.encode(turn.second) : none);
+        if (!ok) {
+            LOGE("Cannot log the turn; closing %s", session.log->path().c_str());
+            session.log.reset();
+        }
+    }
+    
+    // Pages shared with a fork parent are charged to the parent only
+    void update_kv_budget(int64_t id, const Session& session) {
+        kv_budget_.update(id, session.tokens - std::min(session.tokens, session.shared_tokens));
+    }
+    
+    uint64_t turn_tokens(const std::pair<std::string, std::string>& turn) const {
+        return estimate_tokens(turn.first) + estimate_tokens(turn.second);
+    }
+    
+    // Turns of `session` to fold into its summary now; 0 when the module cannot
+    // rebuild a conversation from a message list
+    size_t turns_to_fold(const Session& session) const {
+        if (load_json_override_ == nullptr || !multi_turn_) {
+            return 0;
+        }
+        uint64_t prefix = estimate_tokens(session_system(session));
+        return context_window_.turns_to_fold(prefix, session_turn_sizes(session), conversation_memory::kKeepTurns);
+    }
+    
+    bool memory_due(const Session& session) const { return turns_to_fold(session) > 0; }
+    
+    // Take the last turn off the active session: its pages are released when the
+    // module has paged KV, otherwise the remaining turns are prefilled again
+    bool rewind_last_turn(Session& session) {
+        bool in_step = turn_count_ == static_cast<int>(session.turns.size());
+        session.tokens -= std::min(session.tokens, turn_tokens(session.turns.back()));
+        session.shared_tokens = std::min(session.shared_tokens, session.tokens);
+        session.turns.pop_back();
+        if (session.log) {
+            session.log->truncate(session.log->size() >= 2 ? session.log->size() - 2 : 0);
+        }
+        speculative_.reset();
+        if (rollback_turns_ != nullptr && in_step) {
+            try {
+                rollback_turns_(1);
+                turn_count_--;
+                update_kv_budget(active_session_, session);
+                return true;
+            } catch (const std::exception& e) {
+                LOGE("Error rolling back the last turn, prefilling again: %s", e.what());
+            }
+        }
+        session.subject = conversation_subject_;
+        if (session.turns.empty()) {
+            clear_conversation();
+            turn_count_ = 0;
+            session.memory.clear();
+            session.context_next = !session.context.empty();
+        } else if (replay_session(session)) {
+            turn_count_ = static_cast<int>(session.turns.size());
+        } else {
+            return false;
+        }
+        update_kv_budget(active_session_, session);
+        return true;
+    }
+    
+    void enforce_kv_budget() {
+        for (int64_t id : kv_budget_.victims(active_session_)) {
+            evict_session_kv(id);
+        }
+    }
+    
+    // Drop a parked session's KV and keep its turn list for replay on resume.
+    // With an offload store open the KV is saved there first, to load on resume.
+    void evict_session_kv(int64_t id) {
+        Session& session = sessions_[id];
+        session.offloaded = false;
+        if (session.parked && save_kv_ != nullptr && load_kv_ != nullptr && !session.turns.empty() &&
+            session.pending_rollback == 0) {
+            std::string path = kv_offload::store().begin_raw(id);
+            try {
+                if (!path.empty()) {
+                    save_kv_(kSessionKvSlotBase + session.slot, path);
+                    kv_offload::store().commit_raw(id);
+                    session.offloaded = kv_offload::store().tier(id) != kv_offload::kNone;
+                }
+            } catch (const std::exception& e) {
+                LOGE("Error offloading KV of session %lld: %s", static_cast<long long>(id), e.what());
+            }
+            if (!session.offloaded) {
+                kv_offload::store().erase(id);
+            }
+        }
+        if (session.parked && drop_kv_ != nullptr) {
+            try {
+                drop_kv_(kSessionKvSlotBase + session.slot);
+            } catch (const std::exception& e) {
+                LOGE("Error dropping KV of session %lld: %s", static_cast<long long>(id), e.what());
+            }
+        }
+        session.parked = false;
+        session.evicted = !session.turns.empty();
+        session.shared_tokens = 0;
+        session.pending_rollback = 0;
+        kv_budget_.evicted(id);
+        if (session.offloaded) {
+            schedule_kv_offload();
+        }
+        LOGI("Evicted KV of session %lld (%llu tokens, %s)", static_cast<long long>(id),
+             static_cast<unsigned long long>(session.tokens), session.offloaded ? "offloaded" : "dropped");
+    }
+    
+    // Load an offloaded session's KV back into its parking slot; false if the
+    // store dropped it or it will not load, leaving the replay
+    bool reload_offloaded(int64_t id, Session& session, bool prefetch) {
+        session.offloaded = false;
+        std::string path = kv_offload::store().stage(id, prefetch);
+        bool loaded = false;
+        if (!path.empty() && load_kv_ != nullptr) {
+            try {
+                load_kv_(kSessionKvSlotBase + session.slot, path);
+                loaded = true;
+            } catch (const std::exception& e) {
+                LOGE("Error loading offloaded KV of session %lld: %s", static_cast<long long>(id), e.what());
+            }
+        }
+        kv_offload::store().erase(id, loaded);
+        if (loaded) {
+            session.parked = true;
+            session.evicted = false;
+        }
+        return loaded;
+    }
+    
+    // Rebuild an evicted conversation from its turn list: the module gets the
+    // subject's system prompt and the past messages, and prefills them ahead of
+    // the next user turn
+    bool replay_session(const Session& session) {
+        if (load_json_override_ == nullptr) {
+            return false;
+        }
+        // A compressed conversation's turns may not fit whole; replay the latest that do
+        std::string system = session_system(session);
+        size_t first = 0;
+        if (session.kv_policy == kv_eviction::kPolicyHeavyHitter) {
+            first = context_window_.turns_to_shift(estimate_tokens(system), session_turn_sizes(session), 0);
+        }
+        std::string messages;
+        for (size_t i = first; i < session.turns.size(); ++i) {
+            const auto& turn = session.turns[i];
+            messages += messages.empty() ? "[" : ", [";
+            messages += "\"user\", \"" + json_escape(turn.first) + "\"], [\"assistant\", \"" +
+                json_escape(turn.second) + "\"]";
+        }
+        try {
+            reset_chat_();
+            load_json_override_(std::string("{\"conv_config\": {\"system_message\": \"") + json_escape(system) +
+                                "\", \"messages\": [" + messages + "]}}", false);
+            return true;
+        } catch (const std::exception& e) {
+            LOGE("Error replaying evicted session: %s", e.what());
+            return false;
+        }
+    }
+    
+    // Make `id` the conversation in the module's KV, parking the current one.
+    // Without KV snapshots the parked conversation is lost and restarts empty.
+    bool switch_session(int64_t id) {
+        auto target = sessions_.find(id);
+        if (target == sessions_.end()) {
+            return false;
+        }
+        if (id == active_session_) {
+            return true;
+        }
+        
+        drop_draft();
+        Session& current = sessions_[active_session_];
+        current.turn_count = turn_count_;
+        current.subject = conversation_subject_;
+        current.parked = false;
+        bool can_park = snapshot_kv_ != nullptr && restore_kv_ != nullptr;
+        if (can_park && turn_count_ > 0) {
+            try {
+                snapshot_kv_(kSessionKvSlotBase + current.slot);
+                current.parked = true;
+            } catch (const std::exception& e) {
+                LOGE("Error parking session %lld: %s", static_cast<long long>(active_session_), e.what());
+            }
+        }
+        if (!current.parked) {
+            // Without a snapshot the conversation can still come back from its turn list
+            bool replayable = !current.turns.empty() && load_json_override_ != nullptr;
+            if (replayable) {
+                current.evicted = true;
+                kv_budget_.erase(active_session_);
+            } else {
+                forget_session(active_session_, current);
+            }
+        }
+        
+        active_session_ = id;
+        Session& next = target->second;
+        speculative_.reset();
+        if (next.evicted && next.offloaded && reload_offloaded(id, next, false)) {
+            update_kv_budget(id, next);
+            enforce_kv_budget();
+        }
+        if (next.evicted) {
+            next.evicted = false;
+            next.shared_tokens = 0;
+            if (replay_session(next)) {
+                turn_count_ = next.turn_count;
+                conversation_subject_ = next.subject;
+                update_kv_budget(id, next);
+                enforce_kv_budget();
+                LOGI("Replayed evicted session %lld (%zu turns)", static_cast<long long>(id), next.turns.size());
+                return true;
+            }
+        }
+        if (next.parked) {
+            try {
+                restore_kv_(kSessionKvSlotBase + next.slot);
+                if (next.pending_rollback > 0) {
+                    // Forked ahead of its branch point; drop the parent's later turns
+                    rollback_turns_(next.pending_rollback);
+                    next.pending_rollback = 0;
+                }
+                turn_count_ = next.turn_count;
+                conversation_subject_ = next.subject;
+                LOGI("Resumed session %lld at turn %d", static_cast<long long>(id), turn_count_);
+                return true;
+            } catch (const std::exception& e) {
+                LOGE("Error resuming session %lld, starting it over: %s", static_cast<long long>(id), e.what());
+                next.parked = false;
+            }
+        }
+        forget_session(id, next);
+        clear_conversation();
+        turn_count_ = 0;
+        return true;
+    }
+    
+    void forget_session(int64_t id, Session& session) {
+        if (session.offloaded) {
+            kv_offload::store().erase(id);
+        }
+        session.parked = false;
+        session.evicted = false;
+        session.offloaded = false;
+        session.turn_count = 0;
+        session.tokens = 0;
+        session.shared_tokens = 0;
+        session.pending_rollback = 0;
+        session.turns.clear();
+        if (session.log) {
+            session.log->truncate(0);
+        }
+        session.memory.clear();
+        session.penalty.clear();
+        session.context.clear();
+        session.context_tokens = 0;
+        session.context_next = false;
+        memory_due_.erase(id);
+        kv_budget_.erase(id);
+    }
+    
+    // Where the chat modules run; chosen at initialize()
+    ComputeBackend preferred_backend_ = kBackendAuto;
+    layer_pager::Mode low_ram_mode_ = layer_pager::kModeAuto;
+    ComputeDevice compute_device_;
+    
+    // TVM thread pool cores; auto measures once per phone model (see thread_config.h)
+    ThreadConfig requested_threads_;
+    ThreadConfig thread_config_;
+    bool threads_calibrated_ = false;
+    
+    // Scales workers, batch size and draft length down as the phone heats up (see generation_governor.h)
+    GenerationGovernor governor_;
+    // ADPF session over the engine and pool threads, one token at the governor's target per step
+    performance_hint::HintSession hint_session_;
+    int draft_length_ = SpeculativeDecoder::kDefaultDraftLength;  // as set, before the governor scales it
+    int adaptive_ceiling_ = DraftController::kDefaultCeiling;      // likewise
+    // Task type of the turn being generated, for the draft length controllers
+    int turn_task_ = kTaskChat;
+    
+    // Battery-saver profile (power_profile.h): mid cores, no speculation, a smaller batch
+    bool saver_ = false;
+    power_profile::EnergyMeter energy_;
+    
+    // Create a chat module on compute_device_. A create function that only takes
+    // the model directory rejects the device arguments, and the module then
+    // picks its own device.
+    tvm::runtime::Module create_chat_module(const tvm::runtime::PackedFunc& create, const std::string& dir) {
+        try {
+            return create(dir, static_cast<int>(compute_device_.device.device_type), compute_device_.device.device_id);
+        } catch (const std::exception& e) {
+            LOGI("Chat module create takes no device (%s); the module picks its own", e.what());
+        }
+        return create(dir);
+    }
+    
+    // Optional draft model next to the target, used for speculative decoding
+    tvm::runtime::Module draft_module_{nullptr};
+    SpeculativeDecoder speculative_;
+    bool draft_evicted_ = false;  // unloaded for the model budget; reloaded once it fits again
+    // Optional embedding model next to the target, loaded on the first embedText:
+    //   embed(text) -> NDArray   the text's embedding, [dim] or [1, dim]
+    //   embed_batch(texts) -> NDArray   [n, dim], optional
+    tvm::runtime::Module embedder_module_{nullptr};
+    tvm::runtime::PackedFunc embed_{nullptr};
+    tvm::runtime::PackedFunc embed_batch_{nullptr};
+    // Chat model side of embedTexts, on a scratch sequence that leaves the conversation as is:
+    //   hidden_states(text) -> NDArray   last hidden states, [tokens, hidden]
+    tvm::runtime::PackedFunc hidden_states_{nullptr};
+    // Weights of the chat, draft and embedding models under one budget (see model_residency.h)
+    ModelResidency residency_;
+    // Creates the secondary models; null when the library is run through its direct exports
+    const tvm::runtime::PackedFunc* chat_create_ = nullptr;
+    // Draft-free speculation from the prompt's own n-grams; opt-in, a loaded draft wins
+    std::atomic<bool> prompt_lookup_{false};
+    
+    bool prompt_lookup_active() const {
+        return prompt_lookup_ && !saver_ && !speculative_.ready() && speculative_.lookup_ready() &&
+               tokenizer_.loaded() && !self_speculation_active();
+    }
+    
+    // Drafting with the target's own early layers; opt-in, a loaded draft wins, and it wins over prompt lookup
+    std::atomic<bool> self_speculation_{false};
+    
+    bool self_speculation_active() const {
+        return self_speculation_ && !saver_ && !speculative_.ready() && speculative_.self_ready();
+    }
+    
+    // Native sampling: the module returns logits and tokens are picked here,
+    // then detokenized with the model's own tokenizer.model
+    bool native_sampling_ = false;
+    SpTokenizer tokenizer_;
+    LogitSampler sampler_;
+    std::vector<int> stop_ids_;
+    host_staging::DeviceReadback readback_;
+    std::vector<float> host_logits_;
+    // Driver allocations per decode step of the last sampled request
+    int pooled_device_types_ = 0;
+    AllocStepStats alloc_steps_;
+    // Token lists of the request being sampled (see request_arena.h); the
+    // logits buffers above are per step and already reused across requests
+    RequestArena arena_;
+    
+    // Constrained decoding: the tokenizer's pieces for masking, and compiled
+    // schemas by their text so repeated requests share the mask cache
+    static constexpr size_t kMaxCompiledGrammars = 8;
+    std::shared_ptr<GrammarVocab> grammar_vocab_;
+    std::map<std::string, std::shared_ptr<CompiledGrammar>> grammars_;
+    // Steps whose grammar allows at most this many tokens compute only their
+    // logits (decode_logits_shortlist_); a 4096-row gather is under 2% of
+    // Gemma's 256k-row LM head. Above it the step runs dense and is masked.
+    static constexpr size_t kMaxShortlist = 4096;
+    std::vector<int> shortlist_;          // ids of the current shortlisted step, ascending
+    std::vector<int> shortlist_history_;  // the request's tokens as rows of shortlist_
+    
+    void resolve_capabilities() {
+        capabilities_ = 0;
+        if (stream_chat_ != nullptr) capabilities_ |= kMlcCapStreaming;
+        if (abort_ != nullptr) capabilities_ |= kMlcCapAbort;
+        if (generate_batch_ != nullptr) capabilities_ |= kMlcCapBatch;
+        if (snapshot_kv_ != nullptr && restore_kv_ != nullptr) capabilities_ |= kMlcCapPrefixCache;
+        if (process_system_prompts_ != nullptr) capabilities_ |= kMlcCapSystemPrompt;
+        if (speculative_.ready()) capabilities_ |= kMlcCapSpeculative;
+        if (speculative_.lookup_ready() && tokenizer_.loaded()) capabilities_ |= kMlcCapPromptLookup;
+        if (speculative_.self_ready()) capabilities_ |= kMlcCapSelfSpeculative;
+        if (set_adapter_ != nullptr) capabilities_ |= kMlcCapAdapters;
+        if (set_adapter_ != nullptr && batch_set_adapter_ != nullptr) capabilities_ |= kMlcCapBatchAdapters;
+        if (native_sampling_) capabilities_ |= kMlcCapNativeSampling;
+        if (native_sampling_ && sample_on_device_ != nullptr) capabilities_ |= kMlcCapDeviceSampling;
+        if (native_sampling_) capabilities_ |= kMlcCapGrammar;
+        if (phase_split_ready()) capabilities_ |= kMlcCapPhaseDevices;
+        if (kernel_tuning_ready()) capabilities_ |= kMlcCapKernelTuning;
+        if (kernel_cache_.is_open()) capabilities_ |= kMlcCapKernelCache;
+        if (profile_step_ != nullptr) capabilities_ |= kMlcCapKernelProfile;
+        if (native_sampling_ && prefill_token_ids_ != nullptr) capabilities_ |= kMlcCapTokenIo;
+        if (fork_kv_ != nullptr && rollback_turns_ != nullptr) capabilities_ |= kMlcCapPagedKv;
+        if (save_kv_ != nullptr && load_kv_ != nullptr) capabilities_ |= kMlcCapKvPersist;
+        if (shift_turns_ != nullptr) capabilities_ |= kMlcCapSlidingWindow;
+        if (kv_attention_mass_ != nullptr && evict_tokens_ != nullptr) capabilities_ |= kMlcCapHeavyHitter;
+        if (prefill_begin_ != nullptr && prefill_step_ != nullptr) capabilities_ |= kMlcCapChunkedPrefill;
+        if (draft_append_ != nullptr && draft_truncate_ != nullptr && tokenizer_.loaded()) {
+            capabilities_ |= kMlcCapDraftPrefill;
+        }
+        if (batching_ready()) capabilities_ |= kMlcCapBatchedDecode;
+        if (batch_forking_ready()) capabilities_ |= kMlcCapBatchFork;
+        if (kv_layout_.dtype != kKvFloat16) capabilities_ |= kMlcCapKvQuant;
+        if (chat_create_ != nullptr && std::ifstream(model_path + "/embedder/mlc-chat-config.json").good()) {
+            capabilities_ |= kMlcCapEmbedding;
+        }
+        if (hidden_states_ != nullptr) capabilities_ |= kMlcCapHiddenStates;
+        if (chat_template_.compiled()) capabilities_ |= kMlcCapTemplateIds;
+        if (native_sampling_ && decode_logits_shortlist_ != nullptr) capabilities_ |= kMlcCapShortlist;
+        if (decode_graph_ready()) capabilities_ |= kMlcCapDecodeGraph;
+        LOGI("Chat module capabilities: 0x%x", capabilities_);
+    }
+    
+    static std::string json_escape(const std::string& in) {
+        std::string out;
+        out.reserve(in.size() + 8);
+        for (char c : in) {
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\t': out += "\\t"; break;
+                default: out += c;
+            }
+        }
+        return out;
+    }
+    
+    void set_system_message(const std::string& message) {
+        if (load_json_override_ != nullptr) {
+            std::string override_json = std::string("{\"conv_config\": {\"system_message\": \"") +
+                json_escape(message) + "\"}}";
+            load_json_override_(override_json, false);
+        }
+    }
+    
+    // Prefill the system prompt + conversation template once and snapshot the
+    // resulting KV so new conversations can start from a copy of it. A prefix
+    // shipped with the model package is loaded instead of prefilled.
+    void prepare_prefix() {
+        if (load_shipped_prefix()) {
+            return;
+        }
+        if (process_system_prompts_ == nullptr) {
+            // The module prefills the template lazily on the first turn
+            return;
+        }
+        
+        try {
+            set_system_message(kStudyBuddySystemPrompt);
+            process_system_prompts_();
+            
+            if (snapshot_kv_ != nullptr) {
+                snapshot_kv_(kPrefixKvSlot);
+                prefix_cached_ = true;
+                LOGI("System prompt prefix prefilled and snapshotted");
+            } else {
+                LOGI("System prompt prefix prefilled (module has no KV snapshot support)");
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error preparing prompt prefix: %s", e.what());
+            prefix_cached_ = false;
+        }
+    }
+    
+    void resolve_shipped_prefix(const std::string& model_dir) {
+        shipped_prefix_.clear();
+        if (load_kv_ == nullptr || restore_kv_ == nullptr) {
+            return;
+        }
+        std::string why;
+        shipped_prefix_ = prefix_package::usable_blob(model_dir, kv_cache_dtype_name(kv_layout_.dtype),
+                                                      kStudyBuddySystemPrompt, &why);
+        if (shipped_prefix_.empty()) {
+            LOGI("No usable prefix KV in the model package: %s", why.c_str());
+        }
+    }
+    
+    bool load_shipped_prefix() {
+        if (shipped_prefix_.empty()) {
+            return false;
+        }
+        try {
+            set_system_message(kStudyBuddySystemPrompt);
+            load_kv_(kPrefixKvSlot, shipped_prefix_);
+            restore_kv_(kPrefixKvSlot);
+            prefix_cached_ = true;
+            LOGI("System prompt prefix loaded from %s", shipped_prefix_.c_str());
+            return true;
+        } catch (const std::exception& e) {
+            LOGE("Error loading the shipped prefix KV, prefilling it: %s", e.what());
+            shipped_prefix_.clear();
+            prefix_cached_ = false;
+            return false;
+        }
+    }
+    
+    // Load the draft model from <model_dir>/draft if one ships with the target.
+    // Without it (or without the token-level entry points) decoding stays plain.
+    void load_draft_model(const tvm::runtime::PackedFunc& chat_create, const std::string& model_dir) {
+        std::string draft_dir = model_dir + "/draft";
+        std::ifstream draftConfig(draft_dir + "/mlc-chat-config.json");
+        if (!draftConfig.good()) {
+            return;
+        }
+        if (saver_) {
+            draft_evicted_ = true;  // loaded when the saver profile ends
+            return;
+        }
+        if (!make_room(ModelResidency::weight_bytes(draft_dir))) {
+            LOGI("Draft model does not fit the model budget, decoding without it");
+            draft_evicted_ = true;
+            return;
+        }
+        
+        try {
+            draft_module_ = create_chat_module(chat_create, draft_dir);
+            tvm::runtime::PackedFunc draft_load = draft_module_.GetFunction("load_model");
+            if (draft_load != nullptr) {
+                draft_load();
+            }
+            if (!speculative_.attach(module_, draft_module_)) {
+                draft_module_ = tvm::runtime::Module(nullptr);
+            } else {
+                residency_.add(kModelDraft, draft_dir);
+                draft_evicted_ = false;
+                LOGI("Draft model loaded from %s", draft_dir.c_str());
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error loading draft model, continuing without it: %s", e.what());
+            speculative_.detach();
+            draft_module_ = tvm::runtime::Module(nullptr);
+        }
+    }
+    
+    // Unload secondary models, least recently used first, until `bytes` more
+    // fit the model budget; false if they cannot fit
+    bool make_room(uint64_t bytes) {
+        for (ModelRole role : residency_.victims(bytes)) {
+            evict_model(role);
+        }
+        return residency_.fits(bytes);
+    }
+    
+    // Unload a secondary model. A draft comes back on a later turn once it
+    // fits again, an embedder on the next embedText.
+    void evict_model(ModelRole role) {
+        if (role == kModelDraft) {
+            speculative_.detach();
+            draft_module_ = tvm::runtime::Module(nullptr);
+            draft_evicted_ = true;
+            // detach() dropped the target's entry points too
+            speculative_.attach_lookup(module_);
+            resolve_capabilities();
+        } else if (role == kModelEmbedder) {
+            embed_ = tvm::runtime::PackedFunc(nullptr);
+            embed_batch_ = tvm::runtime::PackedFunc(nullptr);
+            embedder_module_ = tvm::runtime::Module(nullptr);
+        } else {
+            return;
+        }
+        residency_.evicted(role);
+        // The module's buffers went back to the pools; hand them to the driver
+        device_pool::trim();
+        LOGI("Unloaded the %s model for the model budget", model_role_name(role));
+    }
+    
+    // Before a turn: bring back a draft unloaded for the budget, if it now fits
+    // without pushing anything else out
+    void restore_draft() {
+        if (!draft_evicted_ || chat_create_ == nullptr || saver_) {
+            return;
+        }
+        // Not while the system is short of memory either, or a trim that
+        // unloaded it would be undone by the next turn
+        uint64_t bytes = ModelResidency::weight_bytes(model_path + "/draft");
+        uint64_t available = layer_pager::available_ram();
+        if (!residency_.fits(bytes) || (available != 0 && available < bytes + layer_pager::kHeadroomBytes) ||
+            bytes > admission_.room(memory_usage(true), kPriorityInteractive)) {
+            return;
+        }
+        TraceSection trace("mlc:load:draft");
+        load_draft_model(*chat_create_, model_path);
+        resolve_capabilities();
+    }
+    
+    // Load <model_dir>/embedder if it is not loaded yet, making room for it
+    bool ensure_embedder() {
+        if (embed_ != nullptr) {
+            residency_.touch(kModelEmbedder);
+            return true;
+        }
+        std::string embedder_dir = model_path + "/embedder";
+        std::ifstream config(embedder_dir + "/mlc-chat-config.json");
+        if (chat_create_ == nullptr || !config.good()) {
+            return false;
+        }
+        if (!make_room(ModelResidency::weight_bytes(embedder_dir))) {
+            LOGE("Embedding model does not fit the model budget");
+            return false;
+        }
+        try {
+            TraceSection trace("mlc:load:embedder");
+            embedder_module_ = create_chat_module(*chat_create_, embedder_dir);
+            tvm::runtime::PackedFunc embedder_load = embedder_module_.GetFunction("load_model");
+            if (embedder_load != nullptr) {
+                embedder_load();
+            }
+            embed_ = embedder_module_.GetFunction("embed");
+            embed_batch_ = embedder_module_.GetFunction("embed_batch");
+            if (embed_ == nullptr) {
+                LOGE("Embedding model in %s has no embed function", embedder_dir.c_str());
+                embed_batch_ = tvm::runtime::PackedFunc(nullptr);
+                embedder_module_ = tvm::runtime::Module(nullptr);
+                return false;
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error loading embedding model: %s", e.what());
+            embed_ = tvm::runtime::PackedFunc(nullptr);
+            embed_batch_ = tvm::runtime::PackedFunc(nullptr);
+            embedder_module_ = tvm::runtime::Module(nullptr);
+            return false;
+        }
+        residency_.add(kModelEmbedder, embedder_dir);
+        LOGI("Embedding model loaded from %s", embedder_dir.c_str());
+        return true;
+    }
+    
+    // Return the module to an empty conversation that already contains the prefix
+    void clear_conversation() {
+        speculative_.reset();
+        context_entered_ = false;
+        sessions_[active_session_].penalty.clear();
+        // reset_chat / restore_kv drop a draft along with the conversation
+        draft_tokens_.clear();
+        draft_session_ = -1;
+        draft_routed_ = false;
+        conversation_subject_ = kSubjectGeneral;
+        if (prefix_cached_ && restore_kv_ != nullptr) {
+            try {
+                restore_kv_(kPrefixKvSlot);
+                return;
+            } catch (const std::exception& e) {
+                LOGE("Error restoring prefix KV, falling back to reset: %s", e.what());
+                prefix_cached_ = false;
+            }
+        }
+        
+        reset_chat_();
+        prepare_prefix();
+    }
+    
+    // Start an empty conversation from the subject's prefix: the base prompt plus
+    // the subject hint, prefilled on first use and restored from its KV snapshot
+    // afterwards. Falls back to the shared prefix when the module can't do this.
+    // The snapshots hold the subject's own adapter's KV, so a conversation on
+    // another adapter prefills its prefix afresh.
+    void enter_subject(Subject subject, const std::string& adapter) {
+        select_adapter(adapter);
+        context_entered_ = false;
+        if (set_adapter_ != nullptr && adapter != subject_adapter(subject)) {
+            speculative_.reset();
+            draft_tokens_.clear();
+            draft_session_ = -1;
+            try {
+                reset_chat_();
+                if (process_system_prompts_ != nullptr) {
+                    set_system_message(kSubjectPromptHints[subject] != nullptr
+                                           ? std::string(kStudyBuddySystemPrompt) + " " + kSubjectPromptHints[subject]
+                                           : std::string(kStudyBuddySystemPrompt));
+                    process_system_prompts_();
+                }
+            } catch (const std::exception& e) {
+                LOGE("Error prefilling the prefix for adapter %s: %s", adapter.c_str(), e.what());
+            }
+            conversation_subject_ = subject;
+            return;
+        }
+        
+        bool can_cache = kSubjectPromptHints[subject] != nullptr && process_system_prompts_ != nullptr &&
+                         load_json_override_ != nullptr && snapshot_kv_ != nullptr && restore_kv_ != nullptr;
+        if (!can_cache) {
+            clear_conversation();
+            conversation_subject_ = subject;
+            return;
+        }
+        
+        speculative_.reset();
+        int slot = kSubjectKvSlotBase + static_cast<int>(subject);
+        uint32_t bit = 1u << subject;
+        try {
+            if (subject_prefix_cached_ & bit) {
+                restore_kv_(slot);
+            } else {
+                reset_chat_();
+                set_system_message(std::string(kStudyBuddySystemPrompt) + " " + kSubjectPromptHints[subject]);
+                process_system_prompts_();
+                snapshot_kv_(slot);
+                subject_prefix_cached_ |= bit;
+                LOGI("Prefilled and snapshotted %s prefix", kSubjectKeys[subject].data());
+            }
+            conversation_subject_ = subject;
+        } catch (const std::exception& e) {
+            LOGE("Error preparing %s prefix, using the shared one: %s", kSubjectKeys[subject].data(), e.what());
+            subject_prefix_cached_ &= ~bit;
+            clear_conversation();
+            conversation_subject_ = subject;
+        }
+    }
+    
+    // The system message of a conversation on `subject`, with its retrieved material
+    static std::string system_message(Subject subject, const std::string& context) {
+        std::string system = kStudyBuddySystemPrompt;
+        if (kSubjectPromptHints[subject] != nullptr) {
+            system += std::string(" ") + kSubjectPromptHints[subject];
+        }
+        if (!context.empty()) {
+            system += "\n\n" + context;
+        }
+        return system;
+    }
+    
+    // Start an empty conversation whose system message carries retrieved
+    // material, restored from its snapshot when the same material was
+    // prefilled with the same adapter before
+    void enter_context(Subject subject, const std::string& adapter, const std::string& context) {
+        select_adapter(adapter);
+        speculative_.reset();
+        draft_tokens_.clear();
+        draft_session_ = -1;
+        std::string system = system_message(subject, context);
+        uint64_t key = std::hash<std::string>()(adapter + '\n' + system);
+        bool can_cache = process_system_prompts_ != nullptr && load_json_override_ != nullptr &&
+                         snapshot_kv_ != nullptr && restore_kv_ != nullptr;
+        int slot = can_cache ? context_cache_.find(key) : -1;
+        try {
+            if (slot >= 0) {
+                restore_kv_(kContextKvSlotBase + slot);
+            } else {
+                reset_chat_();
+                set_system_message(system);
+                if (process_system_prompts_ != nullptr) {
+                    process_system_prompts_();
+                }
+                if (can_cache) {
+                    slot = context_cache_.insert(key);
+                    snapshot_kv_(kContextKvSlotBase + slot);
+                }
+            }
+            context_entered_ = true;
+        } catch (const std::exception& e) {
+            LOGE("Error preparing the retrieved context, starting without it: %s", e.what());
+            context_cache_.erase(key);
+            clear_conversation();
+        }
+        conversation_subject_ = subject;
+    }
+    
+    // Thin the chunks' texts together to `ratio` of their tokens, before they are
+    // packed, so the budget then takes more of them
+    void compress_context(std::vector<ContextChunk>* chunks, float ratio) {
+        compression_.last = context_compression::Result();
+        compression_.last_ms = 0.0;
+        compression_.last_saved_ms = 0.0;
+        if (ratio <= 0.0f || ratio >= 1.0f || !tokenizer_.loaded()) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::string> texts;
+        texts.reserve(chunks->size());
+        for (const ContextChunk& chunk : *chunks) {
+            texts.push_back(chunk.text);
+        }
+        texts = context_compression::compress(texts, ratio, tokenizer_, &compression_.last);
+        for (size_t i = 0; i < chunks->size(); ++i) {
+            (*chunks)[i].text = std::move(texts[i]);
+        }
+        compression_.last_ms =
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        const context_compression::Result& result = compression_.last;
+        size_t saved = result.tokens_in - std::min(result.tokens_in, result.tokens_out);
+        if (deadline_rates_.prefill_tokens_per_s > 0.0) {
+            compression_.last_saved_ms = saved * 1000.0 / deadline_rates_.prefill_tokens_per_s;
+        }
+        compression_.requests++;
+        compression_.tokens_saved += saved;
+        compression_.saved_ms += compression_.last_saved_ms;
+        LOGI("Compressed retrieved context %zu -> %zu tokens (%zu words dropped) in %.2f ms, ~%.0f ms of prefill saved",
+             result.tokens_in, result.tokens_out, result.words_dropped, compression_.last_ms,
+             compression_.last_saved_ms);
+    }
+    
+    // Pack the chunks staged for the active session's next turn into what the
+    // context window leaves. A new conversation carries them in its system
+    // message (begin_turn), where their KV can be reused; a running one gets
+    // them ahead of the prompt, since its system message is already in the KV.
+    std::string apply_context(const std::string& prompt, const GenerationConfig& config) {
+        Session& session = sessions_[active_session_];
+        if (session.staged.empty()) {
+            return prompt;
+        }
+        std::vector<ContextChunk> chunks = std::move(session.staged);
+        session.staged.clear();
+        compress_context(&chunks, config.context_ratio);
+        bool fresh = !multi_turn_ || turn_count_ == 0;
+        
+        size_t hint_tokens = 0;
+        for (const char* hint : kSubjectPromptHints) {
+            if (hint != nullptr) {
+                hint_tokens = std::max(hint_tokens, estimate_tokens(hint));
+            }
+        }
+        uint64_t used = estimate_tokens(kStudyBuddySystemPrompt) + hint_tokens + estimate_tokens(prompt) +
+                        static_cast<uint64_t>(std::max<int64_t>(0, expected_answer_tokens())) +
+                        static_cast<uint64_t>(std::max<int64_t>(0, context_window_.sink_tokens)) +
+                        (fresh ? 0 : session.tokens);
+        size_t budget = session.staged_max_tokens > 0 ? session.staged_max_tokens : SIZE_MAX;
+        if (context_window_.window > 0) {
+            uint64_t window = static_cast<uint64_t>(context_window_.window);
+            budget = std::min<size_t>(budget, window > used ? window - used : 0);
+        }
+        last_context_ = prompt_context::pack(chunks, budget, [this](const std::string& text) {
+            return estimate_tokens(text);
+        });
+        last_context_.merged = session.staged_merged;
+        LOGI("Packed %zu of %zu retrieved chunks into %zu of %zu tokens (%zu merged)", last_context_.ids.size(),
+             chunks.size(), last_context_.tokens, budget, last_context_.merged);
+        if (last_context_.text.empty()) {
+            return prompt;
+        }
+        if (fresh) {
+            session.context = last_context_.text;
+            session.context_tokens = last_context_.tokens;
+            session.context_next = true;
+            return prompt;
+        }
+        return last_context_.text + "\n\nQuestion: " + prompt;
+    }
+    
+    // Reseed the module's sampler so this request replays token for token
+    void apply_seed() {
+        if (request_.seed < 0) {
+            return;
+        }
+        sampler_.seed(static_cast<uint64_t>(request_.seed));
+        if (set_param_ == nullptr) {
+            return;
+        }
+        try {
+            set_param_("seed", static_cast<double>(request_.seed));
+        } catch (const std::exception& e) {
+            LOGE("Error setting seed: %s", e.what());
+        }
+    }
+    
+    // Routing stage before prefill. A new conversation is tagged with a subject
+    // and moved to that subject's prefix; a running multi-turn conversation keeps
+    // the subject it started with, since its prefix is already in the KV cache.
+    // Either way the turn runs with turn_adapter(): a switch mid-conversation
+    // applies to the new tokens only.
+    void begin_turn(const std::string& prompt, const std::string& requested_adapter = std::string()) {
+        bool fresh = !multi_turn_ || turn_count_ == 0;
+        if (!fresh) {
+            select_adapter(turn_adapter(requested_adapter, conversation_subject_));
+            return;
+        }
+        sessions_[active_session_].penalty.clear();
+        
+        Subject subject = conversation_subject_;
+        if (!draft_routed_) {
+            auto start = std::chrono::steady_clock::now();
+            subject = route_subject(prompt);
+            last_route_us_ = std::chrono::duration<float, std::micro>(
+                std::chrono::steady_clock::now() - start).count();
+            NLOG_EVERY_MS(10000, LOGI, "Routed request to %s in %.1f us", kSubjectKeys[subject].data(), last_route_us_);
+        }
+        draft_routed_ = false;
+        
+        // An untouched conversation can stay as it is if it already has this
+        // subject, and its prefix came from the subject's own adapter
+        std::string adapter = turn_adapter(requested_adapter, subject);
+        Session& session = sessions_[active_session_];
+        if (session.context_next) {
+            session.context_next = false;
+            enter_context(subject, adapter, session.context);
+            turn_count_ = 0;
+            return;
+        }
+        session.context.clear();
+        session.context_tokens = 0;
+        if (turn_count_ > 0 || subject != conversation_subject_ || adapter != subject_adapter(subject) ||
+            context_entered_) {
+            enter_subject(subject, adapter);
+        } else {
+            select_adapter(adapter);
+        }
+        turn_count_ = 0;
+    }
+    
+    void set_phase_devices(ComputeBackend prefill, ComputeBackend decode) {
+        DLDevice prefill_device = compute_backend_device(prefill);
+        DLDevice decode_device = compute_backend_device(decode);
+        set_phase_device_(std::string("prefill"), static_cast<int>(prefill_device.device_type), prefill_device.device_id);
+        set_phase_device_(std::string("decode"), static_cast<int>(decode_device.device_type), decode_device.device_id);
+        npu_prefill_ = prefill == kBackendNpu;
+    }
+    
+    // The module has NPU prefill graphs and the Hexagon runtime finds a device for them
+    bool npu_prefill_ready() const {
+        return phase_split_ready() && !npu_chunks_.empty() &&
+               compute_device_exists(compute_backend_device(kBackendNpu), nullptr);
+    }
+    
+    void resolve_npu_chunks() {
+        npu_chunks_.clear();
+        if (npu_prefill_chunks_ == nullptr) {
+            return;
+        }
+        try {
+            tvm::runtime::ShapeTuple shapes = npu_prefill_chunks_();
+            for (int64_t shape : shapes) {
+                if (shape > 0) {
+                    npu_chunks_.push_back(shape);
+                }
+            }
+            std::sort(npu_chunks_.begin(), npu_chunks_.end());
+            if (!npu_chunks_.empty()) {
+                LOGI("NPU prefill graphs for %zu chunk sizes, %lld to %lld tokens", npu_chunks_.size(),
+                     static_cast<long long>(npu_chunks_.front()), static_cast<long long>(npu_chunks_.back()));
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error reading the NPU prefill chunk sizes: %s", e.what());
+            npu_chunks_.clear();
+        }
+    }
+    
+    // Prefill a fixed text and take a few greedy steps on the current phase devices.
+    // Reading each row back to the host waits for the device, so the times are real.
+    PhaseTiming time_phases() {
+        static constexpr int kDecodeSteps = 16;
+        std::string text = calibration_text();
+        using Clock = std::chrono::steady_clock;
+        auto ms_since = [](Clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        };
+        
+        PhaseTiming timing;
+        clear_conversation();
+        size_t vocab = 0;
+        auto start = Clock::now();
+        tvm::runtime::NDArray logits = prefill_logits_(text);
+        const float* row = logits_row(logits, &vocab);
+        timing.prefill_ms_per_token = ms_since(start) / std::max<size_t>(1, estimate_tokens(text));
+        int token = static_cast<int>(std::max_element(row, row + vocab) - row);
+        
+        double steady_ms = 0.0;
+        for (int step = 0; step < kDecodeSteps; ++step) {
+            start = Clock::now();
+            logits = decode_logits_(static_cast<int64_t>(token));
+            row = logits_row(logits, &vocab);
+            token = static_cast<int>(std::max_element(row, row + vocab) - row);
+            double ms = ms_since(start);
+            if (step == 0) {
+                timing.first_decode_ms = ms;
+            } else {
+                steady_ms += ms;
+            }
+        }
+        timing.decode_ms_per_token = steady_ms / (kDecodeSteps - 1);
+        clear_conversation();
+        return timing;
+    }
+    
+    static std::string calibration_text(int sentences = 8) {
+        static constexpr const char* kCalibrationText =
+            "Photosynthesis turns light, water and carbon dioxide into glucose and oxygen. ";
+        std::string text;
+        for (int i = 0; i < sentences; ++i) {
+            text += kCalibrationText;
+        }
+        return text;
+    }
+    
+    static int64_t steady_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    // The governor's level and the saver profile over the configured settings
+    void apply_governor() {
+        ThreadAffinity affinity = thread_config_.affinity == kAffinityAuto ? kAffinityBigMid : thread_config_.affinity;
+        if (saver_) {
+            affinity = kAffinityMid;
+        }
+        GovernorSettings base;
+        base.workers = thread_config_.workers;
+        base.max_batch = batch_scheduler().max_batch();
+        base.draft_length = draft_length_;
+        GovernorSettings governed = governor_.settings(base, static_cast<int>(cores_for(affinity).size()));
+        if (initialized && compute_device_.backend == kBackendCpu) {
+            apply_thread_config(affinity, governed.workers);
+        }
+        int batch_limit = governor_.level() > 0 ? governed.max_batch : 0;
+        if (saver_) {
+            batch_limit = batch_limit > 0 ? std::min(batch_limit, power_profile::kSaverMaxBatch)
+                                          : power_profile::kSaverMaxBatch;
+        }
+        batch_scheduler().set_batch_limit(batch_limit);
+        speculative_.set_draft_length(governed.draft_length);
+        GovernorSettings adaptive_base = base;
+        adaptive_base.draft_length = adaptive_ceiling_;
+        speculative_.set_adaptive_ceiling(governor_.settings(adaptive_base, 1).draft_length);
+        LOGI("Governor level %d%s: %d workers, batch %d, draft %d", governor_.level(), saver_ ? " (saver)" : "",
+             governed.workers, batch_limit > 0 ? batch_limit : governed.max_batch, governed.draft_length);
+    }
+    
+    // A response that came back whole counts as one burst of tokens at the end
+    void finish_timing(const std::string& response) {
+        if (timing_ == nullptr) {
+            return;
+        }
+        if (timing_->tokens == 0 && !response.empty()) {
+            timing_->token(estimate_tokens(response));
+        }
+        timing_->ok = response.rfind("Error:", 0) != 0 && response.rfind("FATAL ERROR:", 0) != 0;
+        if (timing_->ok && timing_->prefill_end > timing_->prefill_start) {
+            deadline_rates_.observe_prefill(timing_->prompt_tokens, std::chrono::duration<double, std::milli>(
+                    timing_->prefill_end - timing_->prefill_start).count());
+        }
+        if (timing_->ok && timing_->tokens > 1) {
+            deadline_rates_.observe_decode(timing_->tokens, std::chrono::duration<double, std::milli>(
+                    timing_->last_token - timing_->first_token).count());
+        }
+    }
+    
+    // Rate over the whole turn, prefill included, since that is what the user waits for
+    // The turn also goes to the energy meter of the profile it ran under
+    void govern_turn(const std::string& response, std::chrono::steady_clock::time_point started) {
+        if (response.rfind("Error:", 0) == 0) {
+            return;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        size_t tokens = estimate_tokens(response);
+        energy_.record(saver_ ? kProfileSaver : kProfileNormal, tokens, ms);
+        if (governor_.enabled() && governor_.observe(tokens, ms, steady_ms())) {
+            apply_governor();
+        }
+    }
+    
+    void trace_turn(int64_t session, const std::string& prompt, const GenerationConfig& config,
+                    const std::string& response, std::chrono::steady_clock::time_point started) {
+        if (!request_trace().recording()) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto arrived = timing_ != nullptr ? timing_->enqueued : started;
+        TraceTurn turn;
+        turn.session = session;
+        turn.config = config;
+        turn.prompt = prompt;
+        turn.prompt_tokens = estimate_tokens(prompt);
+        turn.output_tokens = response.empty() ? 0 : estimate_tokens(response);
+        if (timing_ != nullptr && timing_->tokens > 0) {
+            turn.ttft_ms = std::chrono::duration<double, std::milli>(timing_->first_token - arrived).count();
+        }
+        turn.e2e_ms = std::chrono::duration<double, std::milli>(now - arrived).count();
+        turn.ok = response.rfind("Error:", 0) != 0;
+        if (!request_trace().append(std::move(turn), arrived)) {
+            LOGE("Could not append to the request trace");
+        }
+    }
+    
+    // The categories that are cheap to read, after every turn, so their peaks
+    // do not depend on when getMemoryStats() happens to be called
+    void note_memory() {
+        memory_stats::HighWater& peaks = memory_high_water();
+        peaks.note("kv", kv_budget_.stats().resident_bytes);
+        uint64_t workspace = memory_stats::workspace_bytes(compute_device_.device);
+        if (compute_device_.device.device_type != kDLCPU) {
+            workspace += memory_stats::workspace_bytes(DLDevice{kDLCPU, 0});
+        }
+        peaks.note("workspace", workspace);
+        peaks.note("heap", memory_stats::heap_totals().allocated);
+    }
+    
+    // The variant written by requantizeWeights to load instead of weights that do not
+    // fit, with a model library built for it in lib/: the first that fits, else the
+    // smallest. -1 without one; `lib` gets the library's path.
+    int pick_requantized(const std::string& model_dir, std::string* lib) const {
+        std::string lib_dir = model_dir + "/lib";
+        std::string base = model_lib_base(lib_dir, model_config_.model_lib);
+        int smallest = -1;
+        for (int scheme : {requantize::kSchemeMixed, requantize::kSchemeQ3}) {
+            std::string dir = mmap_loader::requantized_dir(model_dir, scheme);
+            std::string variant = requantize::model_lib_base(base, scheme);
+            if (variant.empty() || access((dir + "/ndarray-cache.json").c_str(), R_OK) != 0) {
+                continue;
+            }
+            std::string path = select_model_lib(lib_dir, variant);
+            if (access(path.c_str(), R_OK) != 0) {
+                continue;
+            }
+            smallest = scheme;
+            *lib = path;
+            if (!layer_pager::wanted(layer_pager::kModeAuto, layer_pager::shard_bytes(dir))) {
+                break;
+            }
+        }
+        return smallest;
+    }
+    
+    // Before the first forward pass: an explicit choice, else the one saved for this phone
+    void configure_threads(const std::string& model_dir) {
+        thread_config_ = requested_threads_;
+        threads_calibrated_ = thread_config_.affinity != kAffinityAuto || compute_device_.backend != kBackendCpu;
+        if (thread_config_.affinity == kAffinityAuto && load_thread_config(model_dir, &thread_config_)) {
+            threads_calibrated_ = true;
+        }
+        if (!apply_thread_config(thread_config_.affinity, thread_config_.workers)) {
+            LOGI("CPU clusters unknown, keeping the default thread pool");
+            threads_calibrated_ = true;
+            return;
+        }
+        LOGI("Thread pool on %s cores, %d workers", thread_affinity_name(thread_config_.affinity),
+             thread_config_.workers);
+    }
+    
+    // Time decode with each distinct core set and keep the fastest
+    void calibrate_threads() {
+        threads_calibrated_ = true;
+        if (prefill_logits_ == nullptr || decode_logits_ == nullptr || !native_sampling_) {
+            return;
+        }
+        ThreadConfig best;
+        size_t tried = 0;
+        for (ThreadAffinity affinity : {kAffinityBig, kAffinityBigMid, kAffinityAll}) {
+            size_t cores = cores_for(affinity).size();
+            if (cores == 0 || cores == tried) {
+                continue;  // same clusters as the last mode
+            }
+            tried = cores;
+            try {
+                apply_thread_config(affinity, 0);
+                PhaseTiming timing = time_phases();
+                LOGI("Decode on %s cores: %.1f ms/token", thread_affinity_name(affinity), timing.decode_ms_per_token);
+                if (best.affinity == kAffinityAuto || timing.decode_ms_per_token < best.decode_ms_per_token) {
+                    best.affinity = affinity;
+                    best.decode_ms_per_token = timing.decode_ms_per_token;
+                }
+            } catch (const std::exception& e) {
+                LOGE("Error timing decode on %s cores: %s", thread_affinity_name(affinity), e.what());
+            }
+        }
+        if (best.affinity == kAffinityAuto) {
+            apply_thread_config(thread_config_.affinity, thread_config_.workers);
+            return;
+        }
+        apply_thread_config(best.affinity, best.workers);
+        thread_config_ = best;
+        if (!save_thread_config(model_path, best)) {
+            LOGE("Could not save the thread configuration next to the model");
+        }
+        LOGI("Thread pool on %s cores from now on", thread_affinity_name(best.affinity));
+    }
+    
+    // Benchmarks run in the module's conversation; rebuild the active one from its turns
+    // A few decode steps before the first request, so the device pools hold a
+    // block of every size class decode uses and the first answer does not pay
+    // for the allocations
+    void warm_device_pools() {
+        static constexpr int kWarmupSteps = 4;
+        if (pooled_device_types_ == 0 || prefill_logits_ == nullptr || decode_logits_ == nullptr) {
+            return;
+        }
+        TraceSection trace("mlc:load:warmup");
+        auto start = std::chrono::steady_clock::now();
+        uint64_t allocs = device_pool::driver_allocs();
+        try {
+            size_t vocab = 0;
+            tvm::runtime::NDArray logits = prefill_logits_(calibration_text(1));
+            for (int step = 0; step < kWarmupSteps; ++step) {
+                const float* row = logits_row(logits, &vocab);
+                logits = decode_logits_(static_cast<int64_t>(std::max_element(row, row + vocab) - row));
+            }
+        } catch (const std::exception& e) {
+            LOGE("Device pool warm-up failed: %s", e.what());
+        }
+        // The prefix is prepared right after this
+        reset_chat_();
+        device_pool::PoolCounts counts = device_pool::counts();
+        LOGI("Warmed device pools in %.0f ms: %llu driver allocations, %llu bytes pooled",
+             std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(),
+             static_cast<unsigned long long>(device_pool::driver_allocs() - allocs),
+             static_cast<unsigned long long>(counts.pooled_bytes));
+    }
+    
+    void restore_after_benchmark() {
+        Session& session = sessions_[active_session_];
+        if (!session.turns.empty() && replay_session(session)) {
+            turn_count_ = static_cast<int>(session.turns.size());
+            return;
+        }
+        clear_conversation();
+        turn_count_ = 0;
+    }
+    
+    void load_kernel_variants() {
+        kernels_.clear();
+        kernel_choice_.clear();
+        if (kernel_variants_ == nullptr || select_kernel_variant_ == nullptr) {
+            return;
+        }
+        try {
+            kernels_ = parse_kernel_variants(kernel_variants_().operator std::string());
+            for (const KernelVariants& kernel : kernels_) {
+                kernel_choice_[kernel.kernel] = kernel.variants.front();
+            }
+            LOGI("Chat module has %zu tunable kernels", kernels_.size());
+        } catch (const std::exception& e) {
+            LOGE("Error listing kernel variants: %s", e.what());
+            kernels_.clear();
+        }
+    }
+    
+    // Open this device's tuning records and use the best variant of every kernel they cover
+    void load_kernel_tuning() {
+        tuning_db_ = TuningDatabase();
+        if (kernels_.empty() || tuning_path_.empty()) {
+            return;
+        }
+        std::string device = std::string(compute_backend_name(compute_device_.backend)) + " " + compute_device_.name;
+        for (char& c : device) {
+            if (c == '"' || c == '\\') {
+                c = '_';
+            }
+        }
+        tuning_db_.open(tuning_path_, device, model_hash_);
+        int applied = 0;
+        for (const KernelVariants& kernel : kernels_) {
+            const TuningRecord* best = tuning_db_.best(kernel.kernel);
+            if (best != nullptr && select_variant(kernel.kernel, best->variant)) {
+                applied++;
+            }
+        }
+        LOGI("Kernel tuning: %zu records for %s, %d kernels tuned", tuning_db_.size(), device.c_str(), applied);
+    }
+    
+    bool select_variant(const std::string& kernel, const std::string& variant) {
+        try {
+            select_kernel_variant_(kernel, variant);
+            kernel_choice_[kernel] = variant;
+            kernel_cache_dirty_ = kernel_cache_.is_open();  // the variant may not be in the saved binaries
+            return true;
+        } catch (const std::exception& e) {
+            LOGE("Error selecting %s for %s: %s", variant.c_str(), kernel.c_str(), e.what());
+            return false;
+        }
+    }
+    
+    // GPU backends only; the CPU kernels are compiled into the model library
+    void restore_kernel_binaries() {
+        kernel_cache_ = KernelBinaryCache();
+        kernel_cache_dirty_ = false;
+        if (get_kernel_binaries_ == nullptr || set_kernel_binaries_ == nullptr ||
+            compute_device_.backend == kBackendCpu) {
+            return;
+        }
+        kernel_cache_.open(kernel_cache_dir_.empty() ? model_path : kernel_cache_dir_, compute_device_, model_hash_);
+        std::string binaries = kernel_cache_.load();
+        if (!binaries.empty()) {
+            try {
+                TVMByteArray bytes{binaries.data(), binaries.size()};
+                set_kernel_binaries_(bytes);
+                LOGI("Restored %zu bytes of compiled kernels from %s", binaries.size(), kernel_cache_.path().c_str());
+                return;
+            } catch (const std::exception& e) {
+                LOGE("Saved kernels were rejected, rebuilding: %s", e.what());
+            }
+        }
+        kernel_cache_dirty_ = true;
+    }
+    
+    void save_kernel_binaries() {
+        kernel_cache_dirty_ = false;
+        try {
+            std::string binaries = get_kernel_binaries_().operator std::string();
+            if (kernel_cache_.save(binaries)) {
+                LOGI("Saved %zu bytes of compiled kernels to %s", binaries.size(), kernel_cache_.path().c_str());
+            } else {
+                LOGE("Could not save compiled kernels to %s", kernel_cache_.path().c_str());
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error reading compiled kernels: %s", e.what());
+        }
+    }
+    
+    // Apply the plan a past calibration saved for this model, if any
+    void load_phase_plan() {
+        phase_plan_ = PhasePlan();
+        if (!phase_split_ready()) {
+            return;
+        }
+        std::ifstream in(model_path + "/phase-devices.json");
+        std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        PhasePlan plan;
+        if (json.empty() || !PhasePlan::from_json(json, model_hash_, &plan)) {
+            return;
+        }
+        if (plan.prefill == kBackendNpu && !npu_prefill_ready()) {
+            LOGI("Saved phase plan prefills on the NPU, which is unavailable; recalibrate");
+            return;
+        }
+        try {
+            set_phase_devices(plan.prefill, plan.decode);
+            phase_plan_ = plan;
+            LOGI("Phase plan from calibration: prefill on %s, decode on %s", compute_backend_name(plan.prefill),
+                 compute_backend_name(plan.decode));
+        } catch (const std::exception& e) {
+            LOGE("Error applying the saved phase plan: %s", e.what());
+        }
+    }
+    
+    void save_phase_plan() {
+        std::ofstream out(model_path + "/phase-devices.json", std::ios::trunc);
+        out << phase_plan_.to_json(model_hash_);
+        if (!out.good()) {
+            LOGE("Could not save the phase plan next to the model");
+        }
+    }
+    
+    // Fill in what this phone has not measured from the imported profile, when it was
+    // tuned on the same SoC, driver and model; what it fills in is saved as if measured here
+    void apply_device_profile() {
+        const device_profile::DeviceProfile& profile = fleet_profile_;
+        if (profile.empty() ||
+            !profile.matches(device_profile::soc_name(), device_profile::driver_name(compute_device_), model_hash_)) {
+            return;
+        }
+        std::string applied;
+        if (!threads_calibrated_ && profile.threads.affinity != kAffinityAuto &&
+            apply_thread_config(profile.threads.affinity, profile.threads.workers)) {
+            thread_config_ = profile.threads;
+            threads_calibrated_ = true;
+            if (!save_thread_config(model_path, thread_config_)) {
+                LOGE("Could not save the thread configuration next to the model");
+            }
+            applied += " threads";
+        }
+        if (!phase_plan_.calibrated() && profile.phases.calibrated() && phase_split_ready() &&
+            (profile.phases.prefill != kBackendNpu || npu_prefill_ready())) {
+            try {
+                set_phase_devices(profile.phases.prefill, profile.phases.decode);
+                phase_plan_ = profile.phases;
+                save_phase_plan();
+                applied += " phases";
+            } catch (const std::exception& e) {
+                LOGE("Error applying the imported phase plan: %s", e.what());
+            }
+        }
+        // Only kernels this phone has no record of, so the local search is never mixed with another's
+        int kernels = 0;
+        for (const KernelVariants& kernel : kernels_) {
+            if (tuning_db_.best(kernel.kernel) != nullptr) {
+                continue;
+            }
+            const TuningRecord* best = nullptr;
+            for (const TuningRecord& record : profile.kernels) {
+                if (record.kernel != kernel.kernel ||
+                    std::find(kernel.variants.begin(), kernel.variants.end(), record.variant) == kernel.variants.end()) {
+                    continue;
+                }
+                if (tuning_db_.is_open() && !tuning_db_.commit(record)) {
+                    LOGE("Could not append to the kernel tuning database");
+                }
+                if (best == nullptr || record.run_ms < best->run_ms) {
+                    best = &record;
+                }
+            }
+            if (best != nullptr && select_variant(kernel.kernel, best->variant)) {
+                kernels++;
+            }
+        }
+        if (kernels > 0) {
+            applied += " kernels(" + std::to_string(kernels) + ")";
+        }
+        LOGI("Device profile for %s matches; applied:%s", profile.soc.c_str(),
+             applied.empty() ? " nothing, all measured here" : applied.c_str());
+    }
+    
+    // Use native sampling when the module returns logits and the tokenizer loads
+    void setup_native_sampling(const std::string& model_dir) {
+        native_sampling_ = false;
+        grammar_vocab_.reset();
+        grammars_.clear();
+        if (prefill_logits_ == nullptr || decode_logits_ == nullptr) {
+            return;
+        }
+        if (!tokenizer_.load(model_dir + "/tokenizer.model")) {
+            LOGI("No usable tokenizer.model; sampling stays in the chat module");
+            return;
+        }
+        
+        stop_ids_.clear();
+        if (tokenizer_.eos_id() >= 0) {
+            stop_ids_.push_back(tokenizer_.eos_id());
+        }
+        int end_of_turn = tokenizer_.piece_id("<end_of_turn>");
+        if (end_of_turn >= 0) {
+            stop_ids_.push_back(end_of_turn);
+        }
+        native_sampling_ = true;
+        LOGI("Native sampling enabled over %zu pieces", tokenizer_.vocab_size());
+        
+        chat_template_ = ChatTemplate();
+        if (prefill_turn_ids_ != nullptr) {
+            if (chat_template_.compile(model_config_.conv_template, tokenizer_)) {
+                LOGI("Chat template %s compiled, %zu tokens per turn", chat_template_.name().c_str(),
+                     chat_template_.overhead());
+            } else {
+                LOGI("No native renderer for conv_template %s; the module templates turns",
+                     model_config_.conv_template.c_str());
+            }
+        }
+    }
+    
+    // Prefill a user turn for native sampling: templated here and tokenized
+    // once when the template is compiled, else by the module. `tokens` gets
+    // the turn's prompt tokens.
+    tvm::runtime::NDArray prefill_turn(const std::string& prompt, size_t* tokens) {
+        if (chat_template_.compiled()) {
+            std::vector<int> ids;
+            {
+                TraceSection trace("mlc:tokenize");
+                ids = chat_template_.user_turn(tokenizer_, prompt);
+            }
+            *tokens = ids.size();
+            layer_pager::LayerPager::Pass pass(layer_pager::instance(), ids.size());
+            return prefill_turn_ids_(tvm::runtime::ShapeTuple(ids.begin(), ids.end()));
+        }
+        *tokens = estimate_tokens(prompt);
+        layer_pager::LayerPager::Pass pass(layer_pager::instance(), *tokens);
+        return prefill_logits_(prompt);
+    }
+    
+    // The last logits row as host fp32, staged through a copy only when the
+    // array lives on the device or holds fp16
+    const float* logits_row(const tvm::runtime::NDArray& logits, size_t* vocab_size) {
+        size_t count = 0;
+        bool is_f32 = false;
+        const uint8_t* data = host_logits(logits, &count, vocab_size, &is_f32, true);
+        size_t vocab = *vocab_size;
+        
+        if (is_f32) {
+            return reinterpret_cast<const float*>(data);
+        }
+        host_logits_.resize(vocab);
+        LogitSampler::half_to_float(reinterpret_cast<const uint16_t*>(data), host_logits_.data(), vocab);
+        return host_logits_.data();
+    }
+    
+    // Every row of batched logits [n, vocab] as host fp32, copied from the device once
+    const float* logits_rows(const tvm::runtime::NDArray& logits, size_t* rows, size_t* vocab_size) {
+        size_t count = 0;
+        bool is_f32 = false;
+        const uint8_t* data = host_logits(logits, &count, vocab_size, &is_f32, false);
+        *rows = count / *vocab_size;
+        if (is_f32) {
+            return reinterpret_cast<const float*>(data);
+        }
+        host_logits_.resize(count);
+        LogitSampler::half_to_float(reinterpret_cast<const uint16_t*>(data), host_logits_.data(), count);
+        return host_logits_.data();
+    }
+    
+    // Host bytes of a logits array, or of its last row only (staged through a
+    // copy of just those when on the device)
+    const uint8_t* host_logits(const tvm::runtime::NDArray& logits, size_t* count, size_t* vocab_size, bool* is_f32,
+                               bool last_row) {
+        const DLTensor* tensor = logits.operator->();
+        *vocab_size = static_cast<size_t>(tensor->shape[tensor->ndim - 1]);
+        *count = 1;
+        for (int i = 0; i < tensor->ndim; ++i) {
+            *count *= static_cast<size_t>(tensor->shape[i]);
+        }
+        *is_f32 = tensor->dtype.code == kDLFloat && tensor->dtype.bits == 32 && tensor->dtype.lanes == 1;
+        bool is_f16 = tensor->dtype.code == kDLFloat && tensor->dtype.bits == 16 && tensor->dtype.lanes == 1;
+        if (!*is_f32 && !is_f16) {
+            throw std::runtime_error("unsupported logits dtype");
+        }
+        
+        size_t first = last_row ? *count - *vocab_size : 0;
+        if (tensor->device.device_type == kDLCPU) {
+            return static_cast<const uint8_t*>(tensor->data) + tensor->byte_offset + first * (*is_f32 ? 4 : 2);
+        }
+        return readback_.read(logits, first, *count - first);
+    }
+    
+    // Matcher for the request's JSON schema; nullptr when unconstrained. A schema
+    // that does not compile is logged and the request runs unconstrained.
+    std::unique_ptr<GrammarMatcher> grammar_for(const GenerationConfig& config) {
+        if (config.json_schema.empty()) {
+            return nullptr;
+        }
+        if (!native_sampling_) {
+            LOGE("JSON output needs native sampling; generating unconstrained");
+            return nullptr;
+        }
+        auto it = grammars_.find(config.json_schema);
+        if (it == grammars_.end()) {
+            std::string error;
+            std::shared_ptr<const JsonGrammar> grammar = JsonGrammar::compile(config.json_schema, &error);
+            if (!grammar) {
+                LOGE("Ignoring JSON schema: %s", error.c_str());
+                return nullptr;
+            }
+            if (!grammar_vocab_) {
+                grammar_vocab_ = std::make_shared<GrammarVocab>();
+                grammar_vocab_->build(tokenizer_, stop_ids_);
+            }
+            if (grammars_.size() >= kMaxCompiledGrammars) {
+                grammars_.clear();
+            }
+            LOGI("Compiled JSON schema into %zu grammar nodes", grammar->node_count());
+            it = grammars_.emplace(config.json_schema,
+                                   std::make_shared<CompiledGrammar>(grammar, grammar_vocab_)).first;
+        }
+        return std::make_unique<GrammarMatcher>(it->second);
+    }
+    
+    // Sample `row` over the grammar's allowed tokens, and advance the grammar. The
+    // sampler reads the mask in place, so the row is never copied or rewritten.
+    int sample_constrained(GrammarMatcher& grammar, const float* row, size_t vocab_size, const int* history,
+                           size_t history_size) {
+        std::shared_ptr<const std::vector<uint64_t>> mask = grammar.mask();
+        int token = sampler_.sample_masked(row, vocab_size, mask->data(), mask->size(), history, history_size);
+        if (token < 0) {
+            LOGE("The grammar allows no token here");
+            return -1;
+        }
+        if (!grammar.accept(token)) {
+            LOGE("Sampled token %d outside the grammar", token);
+            return -1;
+        }
+        return token;
+    }
+    
+    // Sample logits computed over shortlist_ only. Every row is allowed, so
+    // nothing is masked; the history is mapped to rows for the repetition penalty.
+    int sample_shortlisted(const tvm::runtime::NDArray& logits, const int* history, size_t history_size,
+                           GrammarMatcher& grammar) {
+        size_t rows = 0;
+        const float* row = logits_row(logits, &rows);
+        rows = std::min(rows, shortlist_.size());
+        auto end = shortlist_.begin() + static_cast<std::ptrdiff_t>(rows);
+        shortlist_history_.clear();
+        for (size_t i = 0; i < history_size; ++i) {
+            auto it = std::lower_bound(shortlist_.begin(), end, history[i]);
+            if (it != end && *it == history[i]) {
+                shortlist_history_.push_back(static_cast<int>(it - shortlist_.begin()));
+            }
+        }
+        int index = sampler_.sample(row, rows, shortlist_history_.data(), shortlist_history_.size());
+        sampler_.record_shortlist(rows);
+        int token = index >= 0 && static_cast<size_t>(index) < rows ? shortlist_[static_cast<size_t>(index)] : -1;
+        if (token >= 0 && !grammar.accept(token)) {
+            LOGE("Sampled token %d outside the grammar", token);
+            return -1;
+        }
+        return token;
+    }
+    
+    // The logits after `token`. While the grammar allows only a few tokens
+    // next (an enum value, a number, a literal), only theirs are computed.
+    tvm::runtime::NDArray decode_next(int token, GrammarMatcher* grammar, bool* shortlisted) {
+        *shortlisted = grammar != nullptr && decode_logits_shortlist_ != nullptr &&
+                       grammar->shortlist(kMaxShortlist, &shortlist_) && !shortlist_.empty();
+        if (*shortlisted) {
+            tvm::runtime::ShapeTuple ids(shortlist_.begin(), shortlist_.end());
+            return decode_logits_shortlist_(static_cast<int64_t>(token), ids);
+        }
+        return decode_logits_(static_cast<int64_t>(token));
+    }
+    
+    // Pick the next token. Device logits are sampled in place when the module has
+    // a sampling kernel; otherwise the row is brought to the host for sampler_.
+    // Constrained rows always come to the host for masking; `shortlisted` rows
+    // came from decode_next over shortlist_.
+    int sample_next(const tvm::runtime::NDArray& logits, const int* history, size_t history_size,
+                    GrammarMatcher* grammar = nullptr, bool shortlisted = false) {
+        TraceSection trace("mlc:sample");
+        if (shortlisted && grammar != nullptr) {
+            return sample_shortlisted(logits, history, history_size, *grammar);
+        }
+        if (grammar == nullptr && device_sampling_ && sample_on_device_ != nullptr &&
+            logits->device.device_type != kDLCPU) {
+            auto start = std::chrono::steady_clock::now();
+            tvm::runtime::ShapeTuple penalized(history, history + history_size);
+            int64_t token = sample_on_device_(logits, request_.temperature, request_.top_p, request_.repetition_penalty,
+                                              sampler_.next_uniform(), penalized);
+            sampler_.record_device_sample(std::chrono::duration<float, std::micro>(
+                std::chrono::steady_clock::now() - start).count());
+            return static_cast<int>(token);
+        }
+        
+        size_t vocab_size = 0;
+        const float* row = logits_row(logits, &vocab_size);
+        if (grammar != nullptr) {
+            return sample_constrained(*grammar, row, vocab_size, history, history_size);
+        }
+        return sampler_.sample(row, vocab_size, history, history_size);
+    }
+    
+    // End-of-sequence / end-of-turn plus the request's stop strings that are one piece
+    template <typename Tokens>
+    void stop_tokens_for(const GenerationConfig& config, Tokens* tokens) const {
+        tokens->assign(stop_ids_.begin(), stop_ids_.end());
+        for (const auto& stop : config.stop_strings) {
+            int id = tokenizer_.piece_id(stop);
+            if (id >= 0 && std::find(tokens->begin(), tokens->end(), id) == tokens->end()) {
+                tokens->push_back(id);
+            }
+        }
+    }
+    
+    // Decode loop with tokens chosen by sampler_ instead of inside the module.
+    // Stop tokens are caught before decoding and stop strings on the token that
+    // completes them, so nothing is generated past the end of the answer.
+    void stream_with_sampler(const std::string& prompt, const std::function<void(std::string)>& callback) {
+        // Declared first so the arena resets after everything drawn from it is gone
+        RequestArena::Scope arena_scope(arena_);
+        alloc_steps_ = AllocStepStats();
+        SpStreamDecoder decoder(tokenizer_);
+        ArenaVector<int> generated{ArenaAllocator<int>(&arena_)};
+        generated.reserve(static_cast<size_t>(std::max(request_.max_gen_len, 0)));
+        ArenaVector<int> stop_tokens{ArenaAllocator<int>(&arena_)};
+        stop_tokens.reserve(stop_ids_.size() + request_.stop_strings.size());
+        stop_tokens_for(request_, &stop_tokens);
+        StopStringMatcher stops(request_.stop_strings);
+        std::unique_ptr<GrammarMatcher> grammar = grammar_for(request_);
+        bool timed = timing_ != nullptr && timing_->prefill_start == RequestTiming::Clock::time_point{};
+        if (timed) {
+            timing_->begin_prefill();
+        }
+        tvm::runtime::NDArray logits;
+        size_t prompt_tokens = 0;
+        {
+            TraceSection trace("mlc:prefill");
+            logits = prefill_turn(prompt, &prompt_tokens);
+        }
+        if (timed) {
+            timing_->end_prefill();
+            timing_->prompt_tokens = prompt_tokens;
+        }
+        StopReason reason = kStopLength;
+        bool shortlisted = false;
+        PenaltyHistory& penalty = sessions_[active_session_].penalty;
+        
+        hint_session_.begin_turn(governor_.target_rate());
+        for (int step = 0; step < request_.max_gen_len; ++step) {
+            if (step > 0) {
+                hint_session_.step();
+            }
+            if (abort_requested_.load(std::memory_order_relaxed)) {
+                reason = kStopAborted;
+                break;
+            }
+            if (deadline_passed()) {
+                reason = kStopDeadline;
+                break;
+            }
+            int token = sample_next(logits, penalty.ids(), penalty.size(), grammar.get(), shortlisted);
+            if (token < 0) {
+                reason = kStopError;
+                break;
+            }
+            if (std::find(stop_tokens.begin(), stop_tokens.end(), token) != stop_tokens.end()) {
+                reason = kStopToken;
+                break;
+            }
+            generated.push_back(token);
+            penalty.add(token);
+            
+            auto decode = [&]() {
+                TraceSection trace("mlc:decode");
+                uint64_t allocs = device_pool::driver_allocs();
+                layer_pager::LayerPager::Pass pass(layer_pager::instance(), 1);
+                logits = decode_next(token, grammar.get(), &shortlisted);
+                alloc_steps_.record(static_cast<int>(step), device_pool::driver_allocs() - allocs);
+            };
+            // On a device the launch returns before the step has run, so the
+            // next step computes while this token is detokenized and delivered.
+            // A stop string completed by this token wastes that one step.
+            bool more = step + 1 < request_.max_gen_len;
+            bool overlapped = more && logits->device.device_type != kDLCPU;
+            if (overlapped) {
+                decode();
+                readback_.note_overlapped_step();
+            }
+            std::string text;
+            {
+                TraceSection trace("mlc:detokenize");
+                text = stops.push(decoder.push(token));
+            }
+            if (!text.empty()) {
+                callback(text);
+            }
+            if (stops.stopped()) {
+                reason = kStopString;
+                break;
+            }
+            if (more && !overlapped) {
+                decode();
+            }
+        }
+        hint_session_.end_turn();
+        
+        if (!stops.stopped()) {
+            std::string tail = stops.push(decoder.flush());
+            tail += stops.flush();
+            if (stops.stopped()) {
+                reason = kStopString;
+            }
+            if (!tail.empty()) {
+                callback(tail);
+            }
+        }
+        stop_reason_ = reason;
+        SamplerStats stats = sampler_.stats();
+        NLOG_EVERY_MS(10000, LOGI, "Sampled %zu tokens, stop reason %d, %.1f us per token on average (%llu on device)",
+                      generated.size(), static_cast<int>(reason), stats.average_us(),
+                      static_cast<unsigned long long>(stats.device_tokens));
+    }
+    
+    // stream_with_sampler from prefilled logits, collecting ids instead of text.
+    // Nothing is detokenized, so only stop strings that are one piece end the reply.
+    void sample_token_ids(tvm::runtime::NDArray logits, std::vector<int>& generated) {
+        RequestArena::Scope arena_scope(arena_);
+        generated.clear();
+        generated.reserve(static_cast<size_t>(std::max(request_.max_gen_len, 0)));
+        ArenaVector<int> stop_tokens{ArenaAllocator<int>(&arena_)};
+        stop_tokens_for(request_, &stop_tokens);
+        std::unique_ptr<GrammarMatcher> grammar = grammar_for(request_);
+        StopReason reason = kStopLength;
+        bool shortlisted = false;
+        PenaltyHistory& penalty = sessions_[active_session_].penalty;
+        hint_session_.begin_turn(governor_.target_rate());
+        for (int step = 0; step < request_.max_gen_len; ++step) {
+            if (step > 0) {
+                hint_session_.step();
+            }
+            if (abort_requested_.load(std::memory_order_relaxed)) {
+                reason = kStopAborted;
+                break;
+            }
+            int token = sample_next(logits, penalty.ids(), penalty.size(), grammar.get(), shortlisted);
+            if (token < 0) {
+                reason = kStopError;
+                break;
+            }
+            if (std::find(stop_tokens.begin(), stop_tokens.end(), token) != stop_tokens.end()) {
+                reason = kStopToken;
+                break;
+            }
+            generated.push_back(token);
+            penalty.add(token);
+            if (timing_ != nullptr) {
+                timing_->token();
+            }
+            if (step + 1 < request_.max_gen_len) {
+                TraceSection trace("mlc:decode");
+                layer_pager::LayerPager::Pass pass(layer_pager::instance(), 1);
+                logits = decode_next(token, grammar.get(), &shortlisted);
+            }
+        }
+        hint_session_.end_turn();
+        stop_reason_ = reason;
+    }
+    
+    // Defaults for requests that do not bring a config; the setters publish a
+    // new snapshot from any thread, the module picks it up with the next request
+    SharedConfig config_;
+    
+    // Settings whose setters would touch the module or the decoder: queued
+    // here and applied by whoever holds the engine (apply_pending_settings)
+    static constexpr int kNoPending = INT_MIN;
+    std::atomic<int> pending_draft_length_{kNoPending};
+    std::atomic<int> pending_adaptive_draft_{kNoPending};  // the ceiling, 0 for off
+    std::atomic<int> pending_multi_turn_{kNoPending};
+    std::atomic<int> pending_decode_graph_{kNoPending};
+    // mlc-chat-config.json of the loaded model
+    model_config::ModelConfig model_config_;
+    // Config of the request being generated, read by the sampling paths
+    GenerationConfig request_;
+    // Why the last request ended; read from other threads
+    std::atomic<int> stop_reason_{kStopNone};
+    // What the chat module was last configured with
+    GenerationConfig module_config_;
+    bool module_configured_ = false;
+    
+    // Make `config` the request's config. The module is only reconfigured when its
+    // sampling settings actually change, in one load_json_override call if the
+    // module has it and otherwise with set_param for the changed fields only.
+    void apply_config(const GenerationConfig& config) {
+        request_ = config;
+        sampler_.configure(config.temperature, config.top_p, config.repetition_penalty);
+        if (module_configured_ && module_config_.same_sampling(config)) {
+            return;
+        }
+        
+        LOGI("Configuring chat with temperature=%.2f, top_p=%.2f, repetition_penalty=%.2f, max_gen_len=%d",
+             config.temperature, config.top_p, config.repetition_penalty, config.max_gen_len);
+        try {
+            if (load_json_override_ != nullptr) {
+                load_json_override_(config.to_override_json(), true);
+            } else if (set_param_ != nullptr) {
+                bool all = !module_configured_;
+                if (all || config.temperature != module_config_.temperature) {
+                    set_param_("temperature", config.temperature);
+                }
+                if (all || config.top_p != module_config_.top_p) {
+                    set_param_("top_p", config.top_p);
+                }
+                if (all || config.repetition_penalty != module_config_.repetition_penalty) {
+                    set_param_("repetition_penalty", config.repetition_penalty);
+                }
+                if (all || config.max_gen_len != module_config_.max_gen_len) {
+                    set_param_("max_gen_len", config.max_gen_len);
+                }
+            }
+            module_config_ = config;
+            module_configured_ = true;
+        } catch (const std::exception& e) {
+            LOGE("Error setting parameters: %s", e.what());
+        }
+    }
+    
+public:
+    RealMlcEngine() : initialized(false) {
+        LOGI("Creating RealMlcEngine");
+    }
+    
+    ~RealMlcEngine() {
+        close();
+    }
+    
+    // generate, stream_chat and abort over a library's versioned table. Tokens
+    // arrive as views into the library's buffer and are copied once, into the
+    // std::string the callback receives; nothing is allocated across the boundary.
+    void bind_model_abi(const MlcModelAbi* abi) {
+        LOGI("Model library ABI v%u, capabilities 0x%llx", abi->abi_version,
+             static_cast<unsigned long long>(abi->capabilities));
+        auto next_request = std::make_shared<std::atomic<int64_t>>(1);
+        if (abi->capabilities & kMlcAbiStream) {
+            stream_chat_ = tvm::runtime::PackedFunc([abi, next_request](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                std::string prompt = args[0];
+                tvm::runtime::PackedFunc callback = args[1];
+                abi->generate_stream(next_request->fetch_add(1), prompt.data(), prompt.size(),
+                                     [](const char* token, size_t length, void* user_data) {
+                    (*static_cast<tvm::runtime::PackedFunc*>(user_data))(std::string(token, length));
+                    return 0;
+                }, &callback);
+            });
+            generate_ = tvm::runtime::PackedFunc([abi, next_request](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                std::string prompt = args[0];
+                std::string reply;
+                abi->generate_stream(next_request->fetch_add(1), prompt.data(), prompt.size(),
+                                     [](const char* token, size_t length, void* user_data) {
+                    static_cast<std::string*>(user_data)->append(token, length);
+                    return 0;
+                }, &reply);
+                *rv = reply;
+            });
+        } else if (abi->capabilities & kMlcAbiGenerateInto) {
+            generate_ = tvm::runtime::PackedFunc([abi](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                std::string prompt = args[0];
+                std::string reply(4096, '\0');
+                int64_t length = abi->generate_into(prompt.data(), prompt.size(), &reply[0], reply.size());
+                if (length >= static_cast<int64_t>(reply.size())) {
+                    // Cut short: once more with room for all of it
+                    reply.resize(static_cast<size_t>(length) + 1);
+                    length = abi->generate_into(prompt.data(), prompt.size(), &reply[0], reply.size());
+                }
+                reply.resize(length > 0 ? std::min(static_cast<size_t>(length), reply.size() - 1) : 0);
+                *rv = reply;
+            });
+        }
+        if (abi->capabilities & kMlcAbiAbort) {
+            abort_ = tvm::runtime::PackedFunc([abi](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                abi->abort(0);
+            });
+        }
+    }
+    
+    bool initialize(const std::string& model_dir) {
+        try {
+            LOGI("Initializing MLC-LLM with model directory: %s", model_dir.c_str());
+            model_path = model_dir;
+            // Before anything resolves a device API (see pooled_device_api.h)
+            pooled_device_types_ = device_pool::install();
+            
+            // Finishes a weight update a crash interrupted, so the files below are one release
+            startup::Phase manifest_phase("manifest");
+            if (!weight_delta::recover(model_dir)) {
+                LOGE("Unfinished weight update in %s", model_dir.c_str());
+            }
+            // Written after the download (writeModelManifest); saves probing the directory below
+            model_manifest::Manifest manifest = model_manifest::read(model_dir);
+            manifest_phase.end();
+            
+            // Parsed on the first launch, read from its binary cache after that (model_config.h)
+            startup::Phase config_phase("config");
+            model_config_ = model_config::load(model_dir);
+            if (!model_config_.loaded) {
+                LOGE("Config file missing or malformed at %s/mlc-chat-config.json", model_dir.c_str());
+                return false;
+            }
+            LOGI("Model %s, conv_template %s", model_config_.model_type.c_str(), model_config_.conv_template.c_str());
+            
+            // Size sessions' KV from the model shape for the budget
+            // (kv_cache_dtype there selects an 8-bit KV cache in the module)
+            kv_layout_ = KvBudget::layout_from_config(model_config_);
+            context_window_ = ContextWindow::from_config(model_config_);
+            context_window_.memory_fill_factor = memory_fill_factor_;
+            output_lengths_.set_prior(context_window_.mean_gen_len);
+            // The model's sampling defaults for requests without a config of their own;
+            // the setters override them after initialization
+            config_.update([this](GenerationConfig& config) {
+                config.temperature = model_config_.sampling.temperature;
+                config.top_p = model_config_.sampling.top_p;
+                config.repetition_penalty = model_config_.sampling.repetition_penalty;
+                config.max_gen_len = model_config_.sampling.max_gen_len;
+            });
+            // No prefill chunk larger than the model library was compiled for
+            if (model_config_.prefill_chunk_size > 0) {
+                prefill_chunk_tokens_ = std::min<int>(prefill_chunk_tokens_, static_cast<int>(model_config_.prefill_chunk_size));
+            }
+            LOGI("Context window %lld tokens, shifting at mean_gen_len %lld to %.0f%% with %lld sink tokens",
+                 static_cast<long long>(context_window_.window), static_cast<long long>(context_window_.mean_gen_len),
+                 context_window_.shift_fill_factor * 100.0, static_cast<long long>(context_window_.sink_tokens));
+            config_phase.end();
+            
+            // setComputeBackend() wins over the config's "device"; otherwise the fastest backend present
+            startup::Phase device_phase("device");
+            ComputeBackend preferred = preferred_backend_ != kBackendAuto ? preferred_backend_
+                                                                         : compute_backend_from_device(model_config_.device);
+            compute_device_ = select_compute_device(preferred);
+            // Low-RAM mode keeps the weights in the mapped shards, which only the CPU reads in place
+            bool low_ram = manifest.loaded() ? layer_pager::wanted(low_ram_mode_, manifest.shard_bytes())
+                                             : layer_pager::wanted(low_ram_mode_, model_dir);
+            // A lower-bit variant, when one was written, may fit where these weights do not
+            std::string variant_lib;
+            requantized_scheme_ = low_ram ? pick_requantized(model_dir, &variant_lib) : -1;
+            mmap_loader::set_requantized_scheme(requantized_scheme_);
+            if (requantized_scheme_ >= 0) {
+                std::string dir = mmap_loader::requantized_dir(model_dir, requantized_scheme_);
+                low_ram = layer_pager::wanted(low_ram_mode_, layer_pager::shard_bytes(dir));
+                LOGI("Low available memory: loading the %s variant of the weights%s",
+                     requantize::scheme_tag(requantized_scheme_), low_ram ? ", paged" : "");
+            }
+            if (low_ram && compute_device_.backend != kBackendCpu && preferred_backend_ == kBackendAuto) {
+                LOGI("Low available memory: running on the CPU to page layer weights from flash");
+                compute_device_ = select_compute_device(kBackendCpu);
+            }
+            owns_pager_ = low_ram && compute_device_.backend == kBackendCpu;
+            layer_pager::instance().set_enabled(owns_pager_);
+            LOGI("Compute backend: %s %s", compute_backend_name(compute_device_.backend), compute_device_.name.c_str());
+            configure_threads(model_dir);
+            device_phase.end();
+            
+            // The build for this CPU's features when one is packaged (see cpu_features.h); the
+            // manifest recorded the pick, otherwise the model lib must exist at the probed path
+            std::string model_lib_path;
+            if (!variant_lib.empty()) {
+                model_lib_path = variant_lib;
+            } else if (!manifest.model_lib.empty()) {
+                model_lib_path = model_dir + "/" + manifest.model_lib;
+            } else {
+                std::string lib_dir = model_dir + "/lib";
+                model_lib_path = select_model_lib(lib_dir, model_lib_base(lib_dir, model_config_.model_lib));
+                if (access(model_lib_path.c_str(), R_OK) != 0) {
+                    LOGE("FATAL: Model library not found at %s", model_lib_path.c_str());
+                    LOGE("The model library must exist at this exact path");
+                    return false;
+                }
+            }
+            LOGI("Model library: %s", model_lib_path.c_str());
+            model_hash_ = SessionStore::model_fingerprint(model_dir, model_lib_path);
+            
+            // Weights are read through mmap instead of being copied into heap buffers
+            mmap_loader::install_ndarray_cache_loader();
+            // Paged decode attention for CPU model builds compiled against it as an extern
+            cpu_attention::install();
+            // Row gather from the quantized embedding table, likewise
+            cpu_embedding::install();
+            // Int8-activation prefill matmuls on dotprod / i8mm cores, likewise
+            cpu_matmul::install();
+            
+            // Try to use the TVM Registry approach first
+            LOGI("Looking for function: mlc.create_chat_module");
+            auto chat_create = tvm::runtime::Registry::Get("mlc.create_chat_module");
+            
+            // Also try alternative module names based on the model library path
+            if (chat_create == nullptr) {
+                LOGI("Function not found, trying alternative: mlc_create_chat_module");
+                chat_create = tvm::runtime::Registry::Get("mlc_create_chat_module");
+            }
+            
+            if (chat_create == nullptr) {
+                // TVM registry approach failed, try direct loading with dlopen/dlsym
+                LOGI("TVM registry method failed, trying direct library loading: %s", model_lib_path.c_str());
+                
+                // Open the library
+                startup::Phase dlopen_phase("dlopen:" + model_lib_path.substr(model_lib_path.rfind('/') + 1));
+                void* lib_handle = dlopen(model_lib_path.c_str(), RTLD_LAZY);
+                dlopen_phase.end();
+                if (!lib_handle) {
+                    LOGE("FATAL: Failed to open model library with dlopen: %s", dlerror());
+                    return false;
+                }
+                
+                // Clear any existing error
+                dlerror();
+                
+                // The versioned table when the library has one (model_lib_abi.h), else the single exports
+                const MlcModelAbi* abi = mlc_model_abi_from(lib_handle);
+                dlerror();
+                
+                // Try to find the mlc_create_chat_module function
+                typedef void* (*CreateChatModuleFunc)(const char*);
+                CreateChatModuleFunc create_func = abi != nullptr ? abi->create
+                    : (CreateChatModuleFunc)dlsym(lib_handle, "mlc_create_chat_module");
+                const char* dlsym_error = create_func == nullptr ? dlerror() : nullptr;
+                
+                if (create_func == nullptr) {
+                    LOGE("FATAL: Could not find mlc_create_chat_module symbol: %s", dlsym_error);
+                    dlclose(lib_handle);
+                    
+                    LOGE("FATAL: Required chat module creation function not found in registry");
+                    LOGE("Please make sure the model library implements one of: mlc.create_chat_module or mlc_create_chat_module");
+                    return false;
+                }
+                
+                // Call the function to create the module
+                void* module_ptr = create_func(model_dir.c_str());
+                if (!module_ptr) {
+                    LOGE("FATAL: Create chat module function returned NULL");
+                    dlclose(lib_handle);
+                    return false;
+                }
+                
+                LOGI("Successfully created chat module using direct dlsym approach");
+                
+                // Now load the other functions
+                typedef void (*LoadModelFunc)();
+                typedef char* (*GenerateFunc)(const char*);
+                typedef void (*ResetChatFunc)();
+                typedef void (*SetParamFunc)(const char*, float);
+                
+                LoadModelFunc load_model_func = abi != nullptr ? abi->load : (LoadModelFunc)dlsym(lib_handle, "load_model");
+                GenerateFunc generate_func = abi != nullptr ? nullptr : (GenerateFunc)dlsym(lib_handle, "generate");
+                ResetChatFunc reset_chat_func = abi != nullptr ? abi->reset : (ResetChatFunc)dlsym(lib_handle, "reset_chat");
+                SetParamFunc set_param_func = abi != nullptr ? abi->set_parameter
+                                                             : (SetParamFunc)dlsym(lib_handle, "set_parameter");
+                
+                // Check that all functions were found
+                if (!load_model_func || (!generate_func && abi == nullptr) || !reset_chat_func || !set_param_func) {
+                    LOGE("FATAL: Failed to find all required functions");
+                    if (!load_model_func) LOGE("Missing: load_model");
+                    if (!generate_func) LOGE("Missing: generate");
+                    if (!reset_chat_func) LOGE("Missing: reset_chat");
+                    if (!set_param_func) LOGE("Missing: set_parameter");
+                    dlclose(lib_handle);
+                    return false;
+                }
+                
+                // Create wrapper functions that call the loaded functions
+                model_load_ = tvm::runtime::PackedFunc([load_model_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                    load_model_func();
+                });
+                
+                if (generate_func != nullptr) {
+                    generate_ = tvm::runtime::PackedFunc([generate_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        std::string prompt = args[0];
+                        char* result = generate_func(prompt.c_str());
+                        std::string result_str(result);
+                        free(result); // Assume the function allocates memory we need to free
+                        *rv = result_str;
+                    });
+                }
+                
+                reset_chat_ = tvm::runtime::PackedFunc([reset_chat_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                    reset_chat_func();
+                });
+                
+                set_param_ = tvm::runtime::PackedFunc([set_param_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                    std::string key = args[0];
+                    float value = static_cast<float>(static_cast<double>(args[1]));
+                    set_param_func(key.c_str(), value);
+                });
+                
+                // Optional functions for prefix caching
+                typedef void (*ProcessSystemPromptsFunc)();
+                typedef void (*KvSlotFunc)(int);
+                ProcessSystemPromptsFunc process_system_prompts_func =
+                    (ProcessSystemPromptsFunc)dlsym(lib_handle, "process_system_prompts");
+                KvSlotFunc snapshot_kv_func = (KvSlotFunc)dlsym(lib_handle, "snapshot_kv");
+                KvSlotFunc restore_kv_func = (KvSlotFunc)dlsym(lib_handle, "restore_kv");
+                KvSlotFunc drop_kv_func = (KvSlotFunc)dlsym(lib_handle, "drop_kv");
+                KvSlotFunc fork_kv_func = (KvSlotFunc)dlsym(lib_handle, "fork_kv");
+                KvSlotFunc rollback_turns_func = (KvSlotFunc)dlsym(lib_handle, "rollback_turns");
+                typedef void (*KvFileFunc)(int, const char*);
+                KvFileFunc save_kv_func = (KvFileFunc)dlsym(lib_handle, "save_kv");
+                KvFileFunc load_kv_func = (KvFileFunc)dlsym(lib_handle, "load_kv");
+                typedef void (*ShiftTurnsFunc)(int, int);
+                ShiftTurnsFunc shift_turns_func = (ShiftTurnsFunc)dlsym(lib_handle, "shift_turns");
+                dlerror();
+                
+                if (process_system_prompts_func) {
+                    process_system_prompts_ = tvm::runtime::PackedFunc([process_system_prompts_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        process_system_prompts_func();
+                    });
+                }
+                if (snapshot_kv_func && restore_kv_func) {
+                    snapshot_kv_ = tvm::runtime::PackedFunc([snapshot_kv_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        snapshot_kv_func(static_cast<int>(args[0]));
+                    });
+                    restore_kv_ = tvm::runtime::PackedFunc([restore_kv_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        restore_kv_func(static_cast<int>(args[0]));
+                    });
+                }
+                if (drop_kv_func) {
+                    drop_kv_ = tvm::runtime::PackedFunc([drop_kv_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        drop_kv_func(static_cast<int>(args[0]));
+                    });
+                }
+                if (fork_kv_func && rollback_turns_func) {
+                    fork_kv_ = tvm::runtime::PackedFunc([fork_kv_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        fork_kv_func(static_cast<int>(args[0]));
+                    });
+                    rollback_turns_ = tvm::runtime::PackedFunc([rollback_turns_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        rollback_turns_func(static_cast<int>(args[0]));
+                    });
+                }
+                if (save_kv_func && load_kv_func) {
+                    save_kv_ = tvm::runtime::PackedFunc([save_kv_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        std::string path = args[1];
+                        save_kv_func(static_cast<int>(args[0]), path.c_str());
+                    });
+                    load_kv_ = tvm::runtime::PackedFunc([load_kv_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        std::string path = args[1];
+                        load_kv_func(static_cast<int>(args[0]), path.c_str());
+                    });
+                }
+                if (shift_turns_func) {
+                    shift_turns_ = tvm::runtime::PackedFunc([shift_turns_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        shift_turns_func(static_cast<int>(args[0]), static_cast<int>(args[1]));
+                    });
+                }
+                
+                // Optional streaming, abort and batch (the fake model in generate_model_lib.cpp has all three)
+                typedef void (*TokenCallback)(const char*, void*);
+                typedef void (*StreamChatFunc)(const char*, TokenCallback, void*);
+                typedef void (*AbortChatFunc)();
+                typedef int (*GenerateBatchFunc)(const char**, int, char**);
+                StreamChatFunc stream_chat_func = (StreamChatFunc)dlsym(lib_handle, "stream_chat");
+                AbortChatFunc abort_chat_func = (AbortChatFunc)dlsym(lib_handle, "abort_chat");
+                GenerateBatchFunc generate_batch_func = (GenerateBatchFunc)dlsym(lib_handle, "generate_batch");
+                dlerror();
+                
+                if (stream_chat_func) {
+                    stream_chat_ = tvm::runtime::PackedFunc([stream_chat_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        std::string prompt = args[0];
+                        tvm::runtime::PackedFunc callback = args[1];
+                        stream_chat_func(prompt.c_str(), [](const char* token, void* user_data) {
+                            (*static_cast<tvm::runtime::PackedFunc*>(user_data))(std::string(token));
+                        }, &callback);
+                    });
+                }
+                if (abort_chat_func) {
+                    abort_ = tvm::runtime::PackedFunc([abort_chat_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        abort_chat_func();
+                    });
+                }
+                if (generate_batch_func) {
+                    generate_batch_ = tvm::runtime::PackedFunc([generate_batch_func](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+                        tvm::runtime::Array<tvm::runtime::String> prompts = args[0];
+                        std::vector<const char*> prompt_ptrs;
+                        for (const tvm::runtime::String& prompt : prompts) {
+                            prompt_ptrs.push_back(prompt.c_str());
+                        }
+                        std::vector<char*> outputs(prompts.size(), nullptr);
+                        generate_batch_func(prompt_ptrs.data(), static_cast<int>(prompt_ptrs.size()), outputs.data());
+                        tvm::runtime::Array<tvm::runtime::String> replies;
+                        for (char* output : outputs) {
+                            replies.push_back(tvm::runtime::String(output != nullptr ? output : ""));
+                            free(output);
+                        }
+                        *rv = replies;
+                    });
+                }
+                
+                if (abi != nullptr) {
+                    bind_model_abi(abi);
+                }
+                
+                // Create a fake module since we're not using TVM's module system
+                module_ = tvm::runtime::Module(nullptr);
+                // The functions above point into it until close()
+                model_lib_handle_ = lib_handle;
+                
+                // Call load_model to initialize
+                {
+                    startup::Phase phase("weights");
+                    load_model_func();
+                }
+                LOGI("Model loaded successfully using direct function calls");
+            } else {
+                LOGI("Found required function: mlc.create_chat_module");
+                
+                // Create the chat module by passing the model directory
+                try {
+                    TraceSection trace("mlc:load:create_module");
+                    // Loads the model library too
+                    startup::Phase phase("create_module");
+                    module_ = create_chat_module(*chat_create, model_dir);
+                    LOGI("Created chat module");
+                    // Before the weights load, whose parallel loops then run on the pool too
+                    LOGI("Model library parallel loops on %s", shared_pool::bind_model_library(model_lib_path)
+                                                                   ? "the shared pool" : "TVM's pool");
+                } catch (const std::exception& e) {
+                    LOGE("FATAL: Failed to create chat module: %s", e.what());
+                    return false;
+                }
+                
+                // Get the necessary functions from the module
+                model_load_ = module_.GetFunction("load_model");
+                generate_ = module_.GetFunction("generate");
+                reset_chat_ = module_.GetFunction("reset_chat");
+                set_param_ = module_.GetFunction("set_parameter");
+                
+                // Check if we got all required functions
+                if (model_load_ == nullptr || generate_ == nullptr || 
+                    reset_chat_ == nullptr || set_param_ == nullptr) {
+                    LOGE("FATAL: Failed to get required functions from the module");
+                    
+                    // Log which functions are missing
+                    LOGE("Missing functions:");
+                    if (model_load_ == nullptr) LOGE("  load_model");
+                    if (generate_ == nullptr) LOGE("  generate");
+                    if (reset_chat_ == nullptr) LOGE("  reset_chat");
+                    if (set_param_ == nullptr) LOGE("  set_parameter");
+                    
+                    return false;
+                }
+                
+                // Optional functions, looked up once here instead of per request
+                stream_chat_ = module_.GetFunction("stream_chat");
+                abort_ = module_.GetFunction("abort");
+                generate_batch_ = module_.GetFunction("generate_batch");
+                load_json_override_ = module_.GetFunction("load_json_override");
+                process_system_prompts_ = module_.GetFunction("process_system_prompts");
+                snapshot_kv_ = module_.GetFunction("snapshot_kv");
+                restore_kv_ = module_.GetFunction("restore_kv");
+                drop_kv_ = module_.GetFunction("drop_kv");
+                fork_kv_ = module_.GetFunction("fork_kv");
+                rollback_turns_ = module_.GetFunction("rollback_turns");
+                save_kv_ = module_.GetFunction("save_kv");
+                load_kv_ = module_.GetFunction("load_kv");
+                kv_cache_dtype_ = module_.GetFunction("kv_cache_dtype");
+                shift_turns_ = module_.GetFunction("shift_turns");
+                kv_attention_mass_ = module_.GetFunction("kv_attention_mass");
+                evict_tokens_ = module_.GetFunction("evict_tokens");
+                prefill_begin_ = module_.GetFunction("prefill_begin");
+                prefill_step_ = module_.GetFunction("prefill_step");
+                draft_append_ = module_.GetFunction("draft_append");
+                draft_truncate_ = module_.GetFunction("draft_truncate");
+                batch_prefill_ = module_.GetFunction("batch_prefill");
+                batch_decode_ = module_.GetFunction("batch_decode");
+                batch_release_ = module_.GetFunction("batch_release");
+                batch_prefix_ = module_.GetFunction("batch_prefix");
+                batch_fork_ = module_.GetFunction("batch_fork");
+                batch_finish_ = module_.GetFunction("batch_finish");
+                set_adapter_ = module_.GetFunction("set_adapter");
+                load_adapter_ = module_.GetFunction("load_adapter");
+                unload_adapter_ = module_.GetFunction("unload_adapter");
+                batch_set_adapter_ = module_.GetFunction("batch_set_adapter");
+                if (set_adapter_ != nullptr && load_adapter_ != nullptr) {
+                    adapters_.scan(model_dir);
+                    LOGI("Found %zu LoRA adapters", adapters_.available().size());
+                }
+                prefill_logits_ = module_.GetFunction("prefill_logits");
+                decode_logits_ = module_.GetFunction("decode_logits");
+                decode_logits_shortlist_ = module_.GetFunction("decode_logits_shortlist");
+                prefill_token_ids_ = module_.GetFunction("prefill_token_ids");
+                prefill_turn_ids_ = module_.GetFunction("prefill_turn_ids");
+                sample_on_device_ = module_.GetFunction("sample_on_device");
+                set_phase_device_ = module_.GetFunction("set_phase_device");
+                npu_prefill_chunks_ = module_.GetFunction("npu_prefill_chunks");
+                kernel_variants_ = module_.GetFunction("kernel_variants");
+                select_kernel_variant_ = module_.GetFunction("select_kernel_variant");
+                get_kernel_binaries_ = module_.GetFunction("get_kernel_binaries");
+                set_kernel_binaries_ = module_.GetFunction("set_kernel_binaries");
+                profile_step_ = module_.GetFunction("profile_step");
+                hidden_states_ = module_.GetFunction("hidden_states");
+                decode_graph_.bind(module_);
+                // Before anything runs, or the kernels get built from source anyway
+                {
+                    startup::Phase phase("kernel_cache");
+                    restore_kernel_binaries();
+                }
+                
+                // Load the model
+                {
+                    TraceSection trace("mlc:load:weights");
+                    startup::Phase phase("weights");
+                    model_load_();
+                }
+                LOGI("Model loaded successfully");
+                chat_create_ = chat_create;
+                residency_.add(kModelChat, model_dir);
+                
+                {
+                    TraceSection trace("mlc:load:draft");
+                    startup::Phase phase("draft");
+                    load_draft_model(*chat_create, model_dir);
+                }
+                {
+                    TraceSection trace("mlc:load:tokenizer");
+                    startup::Phase phase("tokenizer");
+                    setup_native_sampling(model_dir);
+                }
+                // Drafts are diffed in token space, and prompt lookup matches prompt tokens
+                bool lookup = speculative_.attach_lookup(module_);
+                if ((lookup || (draft_append_ != nullptr && draft_truncate_ != nullptr)) && !tokenizer_.loaded()) {
+                    tokenizer_.load(model_dir + "/tokenizer.model");
+                }
+            }
+            
+            startup::Phase resolve_phase("resolve");
+            resolve_kv_layout();
+            load_kernel_variants();
+            resolve_capabilities();
+            resolve_npu_chunks();
+            load_phase_plan();
+            load_kernel_tuning();
+            apply_device_profile();
+            apply_decode_graph();
+            resolve_phase.end();
+            if (!threads_calibrated_) {
+                startup::Phase phase("calibrate_threads");
+                calibrate_threads();
+            }
+            
+            // Configure generation parameters
+            {
+                startup::Phase phase("warmup");
+                apply_config(config_.get());
+                warm_device_pools();
+            }
+            
+            // Prefill the shared system prompt + template prefix once
+            {
+                startup::Phase phase("prefix");
+                resolve_shipped_prefix(model_dir);
+                prepare_prefix();
+            }
+            
+            initialized = true;
+            if (saver_) {
+                apply_governor();
+            }
+            LOGI("MLC-LLM initialization completed successfully");
+            return true;
+        }
+        catch (const std::exception& e) {
+            LOGE("FATAL: Error initializing MLC-LLM: %s", e.what());
+            return false;
+        }
+    }
+    
+    std::string generate_response(const std::string& prompt) {
+        return generate_response(prompt, config_.get());
+    }
+    
+    std::string generate_response(const std::string& prompt, const GenerationConfig& config) {
+        if (!initialized) {
+            LOGE("FATAL: MLC-LLM engine not initialized");
+            return "FATAL ERROR: MLC-LLM engine not initialized. The initialization process failed.";
+        }
+        
+        try {
+            LOGV("Generating response for prompt: %s", prompt.c_str());
+            
+            // Single-turn mode starts every request from an empty conversation;
+            // new conversations are routed to a subject prefix first
+            begin_turn(prompt, config.adapter);
+            share_prefix(prompt, config.adapter);
+            apply_config(config);
+            apply_seed();
+            clear_abort();
+            if (!chunked_prefill(prompt)) {
+                return "";
+            }
+            
+            // Generate the response; in multi-turn mode this appends to the existing KV
+            std::string response;
+            if (native_sampling_) {
+                stream_with_sampler(prompt, [this, &response](const std::string& text) {
+                    if (timing_ != nullptr) {
+                        timing_->token();
+                    }
+                    response += text;
+                });
+            } else {
+                // The module ran to its own end; cut at a stop string afterwards
+                stop_reason_ = kStopNone;
+                StopStringMatcher stops(request_.stop_strings);
+                TraceSection trace("mlc:generate");
+                response = stops.push(generate_(prompt).operator std::string());
+                response += stops.flush();
+                if (stops.stopped()) {
+                    stop_reason_ = kStopString;
+                }
+            }
+            turn_count_++;
+            
+            LOGV("Generated response (turn %d): %s", turn_count_, response.c_str());
+            return response;
+        }
+        catch (const std::exception& e) {
+            LOGE("FATAL: Error generating response: %s", e.what());
+            return "FATAL ERROR: " + std::string(e.what());
+        }
+    }
+    
+    // Define a callback function for streaming tokens
+    void stream_response(const std::string& prompt, std::function<void(std::string)> callback) {
+        stream_response(prompt, std::move(callback), config_.get());
+    }
+    
+    void stream_response(const std::string& prompt, std::function<void(std::string)> callback,
+                         const GenerationConfig& config) {
+        if (!initialized) {
+            LOGE("MLC-LLM engine not initialized");
+            callback("Error: MLC-LLM engine not initialized");
+            return;
+        }
+        
+        try {
+            LOGV("Streaming response for prompt: %s", prompt.c_str());
+            
+            // Single-turn mode starts every request from an empty conversation;
+            // new conversations are routed to a subject prefix first
+            begin_turn(prompt, config.adapter);
+            share_prefix(prompt, config.adapter);
+            apply_config(config);
+            apply_seed();
+            clear_abort();
+            if (!chunked_prefill(prompt)) {
+                return;
+            }
+            
+            // Draft + verify when a draft model is loaded, drafts from the target's
+            // early layers with self-speculation on, or proposals copied from the
+            // prompt when prompt lookup is on; none can follow a grammar
+            restore_draft();
+            bool self = self_speculation_active();
+            bool lookup = prompt_lookup_active();
+            if ((speculative_.ready() || self || lookup) && !(native_sampling_ && !request_.json_schema.empty())) {
+                if (speculative_.ready()) {
+                    residency_.touch(kModelDraft);
+                }
+                speculative_.set_context(active_session_, turn_task_);
+                stop_reason_ = kStopNone;
+                StopStringMatcher stops(request_.stop_strings);
+                std::atomic<bool> late{false};
+                auto emit = [this, &callback, &stops, &late](const std::string& text) {
+                    std::string shown = stops.push(text);
+                    if (!shown.empty()) {
+                        callback(shown);
+                    }
+                    if (deadline_passed()) {
+                        late = true;
+                    }
+                };
+                if (self) {
+                    TraceSection trace("mlc:speculate");
+                    if (!speculative_.generate_self(prompt, request_.max_gen_len, emit, &late)) {
+                        callback("Error: Self-speculative generation failed");
+                    }
+                } else if (lookup) {
+                    std::vector<int> prompt_tokens;
+                    {
+                        TraceSection trace("mlc:tokenize");
+                        prompt_tokens = tokenizer_.encode(prompt);
+                    }
+                    TraceSection trace("mlc:speculate");
+                    if (!speculative_.generate_lookup(prompt, prompt_tokens, request_.max_gen_len, emit, &late)) {
+                        callback("Error: Prompt lookup generation failed");
+                    }
+                } else {
+                    TraceSection trace("mlc:speculate");
+                    if (!speculative_.generate(prompt, request_.max_gen_len, emit, &late)) {
+                        callback("Error: Speculative generation failed");
+                    }
+                }
+                std::string tail = stops.flush();
+                if (!tail.empty()) {
+                    callback(tail);
+                }
+                if (stops.stopped()) {
+                    stop_reason_ = kStopString;
+                } else if (late.load()) {
+                    stop_reason_ = kStopDeadline;
+                }
+                turn_count_++;
+                return;
+            }
+            
+            // Logits come back to the engine and tokens are sampled natively
+            if (native_sampling_) {
+                stream_with_sampler(prompt, callback);
+                turn_count_++;
+                return;
+            }
+            
+            // The stream function was resolved once at initialization
+            if (stream_chat_ == nullptr) {
+                LOGE("Stream function not found");
+                callback("Error: Streaming not supported");
+                return;
+            }
+            
+            // Create a TVM callback to pass to the stream function; a completed
+            // stop string aborts the module's loop at its next token
+            stop_reason_ = kStopNone;
+            StopStringMatcher stops(request_.stop_strings);
+            auto tvm_callback = tvm::runtime::TypedPackedFunc<void(std::string)>(
+                [this, &callback, &stops](std::string token) {
+                    if (stops.stopped()) {
+                        return;
+                    }
+                    std::string shown = stops.push(token);
+                    if (!shown.empty()) {
+                        callback(shown);
+                    }
+                    if (stops.stopped()) {
+                        stop_reason_ = kStopString;
+                        if (abort_ != nullptr) {
+                            abort_();
+                        }
+                    } else if (deadline_passed() && stop_reason_.load() != kStopDeadline) {
+                        stop_reason_ = kStopDeadline;
+                        if (abort_ != nullptr) {
+                            abort_();
+                        }
+                    }
+                });
+            
+            // Call the stream function with the prompt and callback
+            TraceSection trace("mlc:generate");
+            stream_chat_(prompt, tvm_callback);
+            std::string tail = stops.flush();
+            if (!tail.empty()) {
+                callback(tail);
+            }
+            turn_count_++;
+        }
+        catch (const std::exception& e) {
+            LOGE("Error streaming response: %s", e.what());
+            callback("Error streaming response: " + std::string(e.what()));
+        }
+    }
+    
+    void reset_chat() {
+        if (!initialized) {
+            LOGE("MLC-LLM engine not initialized");
+            return;
+        }
+        
+        try {
+            LOGI("Resetting chat after %d turns", turn_count_);
+            clear_conversation();
+            turn_count_ = 0;
+        }
+        catch (const std::exception& e) {
+            LOGE("Error resetting chat: %s", e.what());
+        }
+    }
+    
+    uint32_t capabilities() const {
+        return initialized ? capabilities_ : 0;
+    }
+    
+    // New empty conversation sharing the loaded weights; -1 when all slots are taken
+    int64_t create_session() {
+        if (static_cast<int>(sessions_.size()) >= kMaxSessions) {
+            LOGE("Cannot create session: %d sessions already open", kMaxSessions);
+            return -1;
+        }
+        Session session;
+        for (int slot = 0; slot < kMaxSessions; ++slot) {
+            bool taken = false;
+            for (const auto& entry : sessions_) {
+                taken = taken || entry.second.slot == slot;
+            }
+            if (!taken) {
+                session.slot = slot;
+                break;
+            }
+        }
+        int64_t id = next_session_id_++;
+        sessions_[id] = session;
+        LOGI("Created session %lld (KV slot %d)", static_cast<long long>(id), kSessionKvSlotBase + session.slot);
+        return id;
+    }
+    
+    void close_session(int64_t id) {
+        if (id == kDefaultSession || sessions_.find(id) == sessions_.end()) {
+            return;
+        }
+        if (follow_ups_.parent == id) {
+            discard_follow_ups();
+        }
+        if (id == active_session_ && initialized) {
+            switch_session(kDefaultSession);
+        }
+        auto it = sessions_.find(id);
+        if (it->second.parked && drop_kv_ != nullptr) {
+            try {
+                drop_kv_(kSessionKvSlotBase + it->second.slot);
+            } catch (const std::exception& e) {
+                LOGE("Error dropping KV of session %lld: %s", static_cast<long long>(id), e.what());
+            }
+        }
+        if (it->second.offloaded) {
+            kv_offload::store().erase(id);
+        }
+        kv_budget_.erase(id);
+        speculative_.forget_session(id);
+        sessions_.erase(it);
+    }
+    
+    bool has_session(int64_t id) const {
+        return sessions_.find(id) != sessions_.end();
+    }
+    
+    std::string generate_in_session(int64_t id, const std::string& request_prompt, const GenerationConfig& config) {
+        drop_token_turn();
+        // An uninitialized engine reports itself in generate_response
+        std::string prepared;
+        if (adopt_follow_up(id, request_prompt, config, &prepared)) {
+            finish_timing(prepared);
+            return prepared;
+        }
+        if (initialized && !switch_session(id)) {
+            return "Error: Unknown session";
+        }
+        std::string prompt = apply_context(request_prompt, config);
+        AnswerLookup lookup;
+        std::string cached;
+        if (cached_answer(&prompt, config, &lookup, &cached)) {
+            serve_cached(prompt, cached);
+            finish_timing(cached);
+            return cached;
+        }
+        GenerationConfig planned = config;
+        if (!plan_deadline(prompt, &planned)) {
+            std::string canned = canned_answer(prompt);
+            finish_timing(canned);
+            return canned;
+        }
+        plan_admission(prompt, &planned);
+        settle_draft(prompt);
+        if (initialized) {
+            fit_context(prompt);
+        }
+        int turns_before = turn_count_;
+        auto started = std::chrono::steady_clock::now();
+        std::string response = generate_response(prompt, planned);
+        finish_deadline(config.max_gen_len);
+        note_length(kTaskChat, response, planned.max_gen_len);
+        record_turn(turns_before, prompt, response);
+        remember_answer(lookup, response, started);
+        govern_turn(response, started);
+        trace_turn(id, prompt, config, response, started);
+        note_memory();
+        finish_timing(response);
+        return response;
+    }
+    
+    void stream_in_session(int64_t id, const std::string& request_prompt, std::function<void(std::string)> callback,
+                           const GenerationConfig& config) {
+        drop_token_turn();
+        std::string prepared;
+        if (adopt_follow_up(id, request_prompt, config, &prepared)) {
+            finish_timing(prepared);
+            callback(std::move(prepared));
+            return;
+        }
+        if (initialized && !switch_session(id)) {
+            callback("Error: Unknown session");
+            return;
+        }
+        std::string prompt = apply_context(request_prompt, config);
+        AnswerLookup lookup;
+        std::string cached;
+        if (cached_answer(&prompt, config, &lookup, &cached)) {
+            serve_cached(prompt, cached);
+            finish_timing(cached);
+            callback(std::move(cached));
+            return;
+        }
+        GenerationConfig planned = config;
+        if (!plan_deadline(prompt, &planned)) {
+            std::string canned = canned_answer(prompt);
+            finish_timing(canned);
+            callback(std::move(canned));
+            return;
+        }
+        plan_admission(prompt, &planned);
+        settle_draft(prompt);
+        if (initialized) {
+            fit_context(prompt);
+        }
+        int turns_before = turn_count_;
+        auto started = std::chrono::steady_clock::now();
+        std::string response;
+        stream_response(prompt, [this, &response, &callback](std::string token) {
+            if (timing_ != nullptr) {
+                timing_->token();
+            }
+            response += token;
+            callback(std::move(token));
+        }, planned);
+        finish_deadline(config.max_gen_len);
+        note_length(kTaskChat, response, planned.max_gen_len);
+        record_turn(turns_before, prompt, response);
+        remember_answer(lookup, response, started);
+        govern_turn(response, started);
+        trace_turn(id, prompt, config, response, started);
+        note_memory();
+        finish_timing(response);
+    }
+    
+    // Prefill the next turn of `id` from the ids of its prompt; generate_tokens()
+    // answers it. With prefill_token_ids and native sampling the prompt is never
+    // tokenized and the reply never detokenized on the way. The session's own
+    // record of the turn (what context shifts and saved sessions replay) stays
+    // text: decoding ids is a table lookup per id, unlike encoding. Without those
+    // entry points the ids are only kept, and generate_tokens takes the text
+    // path. Returns the number of ids, or -1.
+    int prefill_tokens(int64_t id, std::vector<int> ids) {
+        if (!initialized || !tokenizer_.loaded() || ids.empty() || !switch_session(id)) {
+            return -1;
+        }
+        drop_token_turn();
+        token_turn_.session = id;
+        token_turn_.prompt = tokenizer_.decode(ids);
+        if (!native_sampling_ || prefill_token_ids_ == nullptr) {
+            return static_cast<int>(ids.size());
+        }
+        drop_draft();
+        fit_context(token_turn_.prompt);
+        begin_turn(token_turn_.prompt);
+        clear_abort();
+        token_turn_.started = std::chrono::steady_clock::now();
+        try {
+            TraceSection trace("mlc:prefill");
+            if (chat_template_.compiled()) {
+                std::vector<int> turn = chat_template_.wrap(ids);
+                layer_pager::LayerPager::Pass pass(layer_pager::instance(), turn.size());
+                token_turn_.logits = prefill_turn_ids_(tvm::runtime::ShapeTuple(turn.begin(), turn.end()));
+            } else {
+                layer_pager::LayerPager::Pass pass(layer_pager::instance(), ids.size());
+                token_turn_.logits = prefill_token_ids_(tvm::runtime::ShapeTuple(ids.begin(), ids.end()));
+            }
+            token_turn_.prefilled = true;
+        } catch (const std::exception& e) {
+            LOGE("Error prefilling %zu prompt tokens: %s", ids.size(), e.what());
+            drop_token_turn();
+            return -1;
+        }
+        return static_cast<int>(ids.size());
+    }
+    
+    // The reply to the turn prefill_tokens() left for `id`, as ids. False if
+    // there is none or generation failed.
+    bool generate_tokens(int64_t id, const GenerationConfig& config, std::vector<int>& reply) {
+        if (!initialized || token_turn_.session != id) {
+            return false;
+        }
+        TokenTurn turn = std::move(token_turn_);
+        drop_token_turn();
+        if (!turn.prefilled) {
+            std::string response = generate_in_session(id, turn.prompt, config);
+            if (response.rfind("Error:", 0) == 0 || response.rfind("FATAL ERROR:", 0) == 0) {
+                return false;
+            }
+            reply = tokenizer_.encode(response);
+            return true;
+        }
+        if (!switch_session(id)) {
+            return false;
+        }
+        int turns_before = turn_count_;
+        try {
+            apply_config(config);
+            apply_seed();
+            sample_token_ids(turn.logits, reply);
+        } catch (const std::exception& e) {
+            LOGE("Error generating from prefilled tokens: %s", e.what());
+            return false;
+        }
+        if (stop_reason_.load() == kStopError) {
+            return false;
+        }
+        turn_count_++;
+        std::string response = tokenizer_.decode(reply);
+        output_lengths_.record(kTaskChat, static_cast<int>(reply.size()), config.max_gen_len);
+        record_turn(turns_before, turn.prompt, response);
+        govern_turn(response, turn.started);
+        trace_turn(id, turn.prompt, config, response, turn.started);
+        note_memory();
+        finish_timing(response);
+        return true;
+    }
+    
+    // Bring the draft of `id` up to `text`: roll the live KV back to the tokens
+    // the old draft shares with it and prefill at most `max_tokens` of the new
+    // suffix. Returns true while more of the draft is left to prefill.
+    //
+    // A fresh conversation is routed on its full first question, so only
+    // follow-ups are drafted while typing. `streamed` input (OCR blocks) is
+    // material rather than a question: its first blocks route the new
+    // conversation and the rest is prefilled as it arrives. Past the room the
+    // window leaves for an answer, the rest waits for the turn.
+    bool update_draft(int64_t id, const std::string& text, int max_tokens, bool streamed = false) {
+        if (!initialized || draft_append_ == nullptr || draft_truncate_ == nullptr || !tokenizer_.loaded()) {
+            return false;
+        }
+        if (id != active_session_ || !multi_turn_) {
+            return false;
+        }
+        bool fresh = turn_count_ == 0;
+        if (fresh && (!streamed || sessions_[id].context_next)) {
+            return false;
+        }
+        if (fresh && draft_session_ != id) {
+            begin_turn(text);
+            draft_routed_ = true;
+        }
+        std::vector<int> ids = tokenizer_.encode(text);
+        if (context_window_.window > 0) {
+            int64_t room = context_window_.window - expected_answer_tokens() - kDraftReserveTokens -
+                           static_cast<int64_t>(sessions_[id].tokens);
+            ids.resize(std::min(ids.size(), static_cast<size_t>(std::max<int64_t>(0, room))));
+        }
+        size_t common = 0;
+        if (draft_session_ == id) {
+            size_t limit = std::min(ids.size(), draft_tokens_.size());
+            while (common < limit && ids[common] == draft_tokens_[common]) {
+                common++;
+            }
+        } else {
+            draft_tokens_.clear();
+        }
+        try {
+            if (common < draft_tokens_.size()) {
+                draft_truncate_(static_cast<int64_t>(common));
+                draft_tokens_.resize(common);
+            }
+            draft_session_ = id;
+            size_t end = std::min(ids.size(), common + static_cast<size_t>(std::max(1, max_tokens)));
+            if (end > common) {
+                std::vector<int64_t> chunk(ids.begin() + common, ids.begin() + end);
+                draft_append_(tvm::runtime::ShapeTuple(chunk.begin(), chunk.end()));
+                draft_tokens_.insert(draft_tokens_.end(), ids.begin() + common, ids.begin() + end);
+            }
+            return draft_tokens_.size() < ids.size();
+        } catch (const std::exception& e) {
+            LOGE("Error prefilling the draft: %s", e.what());
+            draft_tokens_.clear();
+            draft_session_ = -1;
+            return false;
+        }
+    }
+    
+    void clear_draft(int64_t id) {
+        if (draft_session_ == id) {
+            drop_draft();
+        }
+    }
+    
+    // Clear one session; a parked session is just forgotten, nothing is prefilled
+    void reset_session(int64_t id) {
+        if (token_turn_.session == id) {
+            drop_token_turn();
+        }
+        if (follow_ups_.parent == id) {
+            discard_follow_ups();
+        }
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) {
+            return;
+        }
+        if (id == active_session_) {
+            reset_chat();
+        }
+        forget_session(id, it->second);
+        it->second.subject = kSubjectGeneral;
+    }
+    
+    // New session continuing `parent` after its first `at_turn` turns (all of
+    // them when negative). With paged KV the child shares the parent's pages
+    // and only its own turns cost memory; otherwise the KV is copied, or the
+    // kept turns are prefilled again when the child is first used.
+    int64_t fork_session(int64_t parent, int at_turn) {
+        if (!initialized || !switch_session(parent)) {
+            return -1;
+        }
+        int64_t child_id = create_session();
+        if (child_id < 0) {
+            return -1;
+        }
+        Session& source = sessions_[parent];
+        Session& child = sessions_[child_id];
+        int total = static_cast<int>(source.turns.size());
+        int keep = at_turn < 0 || at_turn > total ? total : at_turn;
+        child.subject = conversation_subject_;
+        child.turns.assign(source.turns.begin(), source.turns.begin() + keep);
+        for (const auto& turn : child.turns) {
+            child.tokens += turn_tokens(turn);
+        }
+        child.turn_count = keep;
+        if (keep == 0) {
+            return child_id;
+        }
+        
+        int slot = kSessionKvSlotBase + child.slot;
+        bool in_step = turn_count_ == total;
+        try {
+            if (fork_kv_ != nullptr && rollback_turns_ != nullptr && in_step) {
+                fork_kv_(slot);
+                child.parked = true;
+                child.pending_rollback = total - keep;
+                child.shared_tokens = child.tokens;
+            } else if (snapshot_kv_ != nullptr && restore_kv_ != nullptr && in_step && keep == total) {
+                snapshot_kv_(slot);
+                child.parked = true;
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error forking KV of session %lld: %s", static_cast<long long>(parent), e.what());
+            child.parked = false;
+            child.pending_rollback = 0;
+            child.shared_tokens = 0;
+        }
+        child.evicted = !child.parked;
+        if (child.parked) {
+            update_kv_budget(child_id, child);
+            enforce_kv_budget();
+        }
+        LOGI("Forked session %lld at turn %d into %lld (%s)", static_cast<long long>(parent), keep,
+             static_cast<long long>(child_id), child.shared_tokens > 0 ? "shared pages" : child.parked ? "copied KV" : "replay");
+        return child_id;
+    }
+    
+    void set_follow_up_prefetch(int mode, std::vector<std::string> prompts, int max_tokens) {
+        follow_up_mode_ = mode;
+        if (!prompts.empty()) {
+            if (prompts.size() > static_cast<size_t>(follow_up::kMaxFollowUps)) {
+                prompts.resize(follow_up::kMaxFollowUps);
+            }
+            follow_up_prompts_ = std::move(prompts);
+        }
+        follow_up_max_tokens_ = max_tokens > 0 ? std::min(max_tokens, follow_up::kMaxTokensLimit)
+                                               : follow_up::kDefaultMaxTokens;
+        discard_follow_ups();
+        if (mode == follow_up::kModeOff) {
+            prefetch_due_ = -1;
+        }
+    }
+    
+    const follow_up::Stats& follow_up_stats() const { return follow_up_stats_; }
+    size_t follow_ups_prepared() const { return follow_ups_.branches.size(); }
+    
+    // The session to prepare follow-ups for, handed out once
+    int64_t take_prefetch_due() {
+        int64_t id = prefetch_due_;
+        prefetch_due_ = -1;
+        return id;
+    }
+    
+    // Close the prepared branches; the session they came from is made live
+    // first so closing a live branch does not swap in the default session
+    void discard_follow_ups() {
+        if (follow_ups_.empty()) {
+            return;
+        }
+        bool branch_live = false;
+        for (const follow_up::Branch& branch : follow_ups_.branches) {
+            branch_live = branch_live || branch.session == active_session_;
+        }
+        if (branch_live && has_session(follow_ups_.parent)) {
+            switch_session(follow_ups_.parent);
+        }
+        for (const follow_up::Branch& branch : follow_ups_.branches) {
+            if (branch.session >= 0) {
+                close_session(branch.session);
+            }
+        }
+        follow_up_stats_.discarded += follow_ups_.branches.size();
+        follow_ups_.clear();
+    }
+    
+    // A keystroke in `id`: its branches stay while the draft can still become one of them
+    void note_draft_text(int64_t id, const std::string& text) {
+        if (follow_ups_.parent != id) {
+            return;
+        }
+        std::string key = follow_up::normalize(text);
+        if (!key.empty() && !follow_ups_.leads_to_any(key)) {
+            discard_follow_ups();
+        }
+    }
+    
+    // Prepare the next prediction for the last turn of `parent`; `preempt` is
+    // polled between tokens. Returns false when there is nothing more to do
+    // within the caps.
+    bool prefetch_follow_up(int64_t parent, const std::function<bool()>& preempt) {
+        if (!initialized || follow_up_mode_ == follow_up::kModeOff || saver_ || !multi_turn_ || !has_session(parent)) {
+            return false;
+        }
+        int turns = parent == active_session_ ? turn_count_ : sessions_[parent].turn_count;
+        if (turns == 0 || !sessions_[parent].staged.empty()) {
+            return false;
+        }
+        if (follow_ups_.parent != parent || follow_ups_.turn_count != turns) {
+            discard_follow_ups();
+            follow_ups_.parent = parent;
+            follow_ups_.turn_count = turns;
+        }
+        const std::string* next = nullptr;
+        for (const std::string& prompt : follow_up_prompts_) {
+            if (follow_ups_.find(follow_up::normalize(prompt)) == nullptr) {
+                next = &prompt;
+                break;
+            }
+        }
+        if (next == nullptr) {
+            return false;
+        }
+        follow_up::Branch branch;
+        branch.prompt = *next;
+        branch.key = follow_up::normalize(*next);
+        int64_t prompt_tokens = static_cast<int64_t>(estimate_tokens(branch.prompt));
+        
+        if (follow_up_mode_ == follow_up::kModePrefill) {
+            // One draft per session: only the top prediction is prefilled, and
+            // not over a draft the user is typing
+            if (!follow_ups_.branches.empty() || parent != active_session_ || draft_session_ >= 0 ||
+                !follow_up_allowance_.available(steady_ms(), prompt_tokens)) {
+                return false;
+            }
+            update_draft(parent, branch.prompt, follow_up::kMaxTokensLimit);
+            if (draft_session_ != parent || draft_tokens_.empty()) {
+                return false;
+            }
+            follow_up_allowance_.spend(steady_ms(), static_cast<int64_t>(draft_tokens_.size()));
+            follow_up_stats_.tokens += draft_tokens_.size();
+            follow_up_stats_.predicted++;
+            follow_ups_.branches.push_back(std::move(branch));
+            return false;
+        }
+        
+        // A branch must share the session's pages; a copied KV per guess is not worth its memory
+        uint64_t branch_bytes = kv_budget_.bytes_for_tokens(static_cast<uint64_t>(prompt_tokens + follow_up_max_tokens_));
+        if (fork_kv_ == nullptr || rollback_turns_ == nullptr || draft_session_ >= 0 ||
+            kv_budget_.stats().resident_bytes + branch_bytes > kv_budget_.budget() || !admits_prefetch(static_cast<uint64_t>(prompt_tokens + follow_up_max_tokens_)) ||
+            !follow_up_allowance_.available(steady_ms(), prompt_tokens + follow_up_max_tokens_)) {
+            return false;
+        }
+        int64_t child = fork_session(parent, -1);
+        if (child < 0) {
+            return false;
+        }
+        GenerationConfig config = config_.get();
+        config.max_gen_len = std::min(config.max_gen_len, follow_up_max_tokens_);
+        config.json_schema.clear();
+        config.stop_strings.clear();
+        config.deadline_ms = 0;
+        bool preempted = false;
+        std::string answer;
+        if (sessions_[child].shared_tokens > 0 && switch_session(child)) {
+            prefetching_ = true;
+            fit_context(branch.prompt);
+            int turns_before = turn_count_;
+            stream_response(branch.prompt, [this, &answer, &preempted, &preempt](std::string token) {
+                answer += token;
+                if (!preempted && preempt()) {
+                    preempted = true;
+                    abort();
+                }
+            }, config);
+            record_turn(turns_before, branch.prompt, answer);
+            prefetching_ = false;
+        }
+        int reason = stop_reason_.load();
+        bool complete = !preempted && !answer.empty() && answer.rfind("Error:", 0) != 0 &&
+                        (reason == kStopNone || reason == kStopToken || reason == kStopString);
+        int64_t spent = prompt_tokens + static_cast<int64_t>(estimate_tokens(answer));
+        follow_up_allowance_.spend(steady_ms(), spent);
+        follow_up_stats_.tokens += static_cast<uint64_t>(spent);
+        // The session goes back in the KV for its next turn, whichever it is
+        switch_session(parent);
+        if (!complete) {
+            close_session(child);
+            if (preempted) {
+                follow_up_stats_.preempted++;
+            }
+            return false;
+        }
+        branch.session = child;
+        branch.answer = std::move(answer);
+        follow_ups_.branches.push_back(std::move(branch));
+        follow_up_stats_.predicted++;
+        LOGI("Prepared follow-up \"%s\" of session %lld on branch %lld", follow_ups_.branches.back().prompt.c_str(),
+             static_cast<long long>(parent), static_cast<long long>(child));
+        return true;
+    }
+    
+    // A turn of `id`. When it sends a prediction answered on a branch, the
+    // session takes the branch's KV and turns and the answer is returned at
+    // once; any other turn drops the branches. A prefilled prediction is left
+    // to the draft it already is.
+    bool adopt_follow_up(int64_t id, const std::string& prompt, const GenerationConfig& config, std::string* answer) {
+        if (follow_ups_.empty() || follow_ups_.parent != id) {
+            return false;
+        }
+        const follow_up::Branch* branch = follow_ups_.find(follow_up::normalize(prompt));
+        int turns = id == active_session_ ? turn_count_ : sessions_[id].turn_count;
+        bool usable = branch != nullptr && initialized && has_session(id) && turns == follow_ups_.turn_count &&
+                      sessions_[id].staged.empty() && config.json_schema.empty() && config.stop_strings.empty();
+        if (usable && branch->session < 0) {
+            follow_up_stats_.served++;
+            follow_ups_.clear();
+            return false;
+        }
+        if (!usable || !has_session(branch->session)) {
+            discard_follow_ups();
+            return false;
+        }
+        int64_t child = branch->session;
+        *answer = branch->answer;
+        for (const follow_up::Branch& other : follow_ups_.branches) {
+            if (other.session >= 0 && other.session != child) {
+                close_session(other.session);
+                follow_up_stats_.discarded++;
+            }
+        }
+        follow_ups_.clear();
+        
+        // Swap the two conversations: `id` continues from the branch, and the
+        // branch's id now holds the old conversation, which is closed
+        drop_token_turn();
+        if (id == active_session_ && !switch_session(child)) {
+            close_session(child);
+            return false;
+        }
+        std::swap(sessions_[id], sessions_[child]);
+        if (active_session_ == child) {
+            active_session_ = id;
+        }
+        close_session(child);
+        Session& session = sessions_[id];
+        session.shared_tokens = 0;  // the pages it shared are its own now
+        update_kv_budget(id, session);
+        enforce_kv_budget();
+        if (memory_due(session)) {
+            memory_due_.insert(id);
+        }
+        if (follow_up_mode_ != follow_up::kModeOff) {
+            prefetch_due_ = id;
+        }
+        stop_reason_ = kStopCached;
+        follow_up_stats_.served++;
+        LOGI("Served follow-up \"%s\" of session %lld from its branch", prompt.c_str(), static_cast<long long>(id));
+        return true;
+    }
+    
+    // Replace the last answer of a session: the turn is rolled back and its
+    // prompt generated again (with a fresh seed unless `config` pins one)
+    std::string regenerate(int64_t id, const GenerationConfig& config) {
+        if (!initialized) {
+            return "FATAL ERROR: MLC-LLM engine not initialized. The initialization process failed.";
+        }
+        if (follow_ups_.parent == id) {
+            discard_follow_ups();  // they follow the answer being replaced
+        }
+        if (!switch_session(id)) {
+            return "Error: Unknown session";
+        }
+        Session& session = sessions_[id];
+        if (session.turns.empty()) {
+            return "Error: Nothing to regenerate";
+        }
+        std::string prompt = session.turns.back().first;
+        if (!rewind_last_turn(session)) {
+            return "Error: Could not roll back the last turn";
+        }
+        return generate_in_session(id, prompt, config);
+    }
+    
+    // Cache answers in `dir`/responses.bin, and their prompts' embeddings in `dir`/semantic
+    bool open_response_cache(const std::string& dir) {
+        if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+            LOGE("Cannot create %s: %s", dir.c_str(), strerror(errno));
+            return false;
+        }
+        semantic_cache_.close();
+        if (!response_cache_.open(dir + "/responses.bin")) {
+            return false;
+        }
+        semantic_cache_.open(dir + "/semantic");
+        summary_cache_.open(dir + "/summaries.bin", document_summary::kCacheSlots);
+        return true;
+    }
+    
+    // Evicted entries leave the semantic index as lookups come across them
+    void clear_response_cache() {
+        response_cache_.clear();
+        summary_cache_.clear();
+    }
+    
+    // Scope of summarizeDocument steps run with `config` on this model
+    uint64_t summary_scope(const GenerationConfig& config) const {
+        return ResponseCache::scope(config, std::string(), model_hash_);
+    }
+    
+    bool cached_summary(uint64_t key, std::string* summary) {
+        ResponseCache::Entry entry;
+        if (!summary_cache_.find(key, &entry)) {
+            return false;
+        }
+        *summary = std::move(entry.response);
+        return true;
+    }
+    
+    void remember_summary(uint64_t key, const std::string& summary) {
+        if (!summary.empty()) {
+            ResponseCache::Entry entry;
+            entry.response = summary;
+            summary_cache_.put(key, entry);
+        }
+    }
+    
+    const ResponseCache& summary_cache() const { return summary_cache_; }
+    
+    const ResponseCache& response_cache() const { return response_cache_; }
+    SemanticCache& semantic_cache() { return semantic_cache_; }
+    double cache_saved_ms() const { return cache_saved_ms_; }
+    
+    // The cached answer to `prompt` if it starts a conversation with a
+    // deterministic config: the exact one, else a near duplicate's when the
+    // semantic cache is on. In seed mode a near duplicate's answer is put in
+    // `prompt` as a reference instead. `lookup` keeps what remember_answer
+    // needs to cache the answer generated otherwise.
+    bool cached_answer(std::string* prompt, const GenerationConfig& config, AnswerLookup* lookup,
+                       std::string* response) {
+        *lookup = AnswerLookup();
+        bool fresh = !multi_turn_ || turn_count_ == 0;
+        if (!initialized || !response_cache_.is_open() || !fresh || sessions_[active_session_].context_next ||
+            !ResponseCache::cacheable(config) || (multi_turn_ && load_json_override_ == nullptr)) {
+            return false;
+        }
+        std::string adapter = turn_adapter(config.adapter, route_subject(*prompt));
+        lookup->scope = ResponseCache::scope(config, adapter, model_hash_);
+        lookup->prompt = ResponseCache::normalize(*prompt);
+        lookup->key = ResponseCache::key(lookup->prompt, lookup->scope);
+        ResponseCache::Entry entry;
+        if (response_cache_.find(lookup->key, &entry)) {
+            cache_saved_ms_ += entry.millis;
+            *response = std::move(entry.response);
+            return true;
+        }
+        if (!semantic_cache_.enabled()) {
+            return false;
+        }
+        auto started = std::chrono::steady_clock::now();
+        size_t dim = 0;
+        lookup->embedding = embed_texts({lookup->prompt}, kEmbedAuto, &dim);
+        uint64_t key = 0;
+        float similarity = 0.0f;
+        if (lookup->embedding.empty() ||
+            !semantic_cache_.lookup(lookup->embedding, lookup->scope, response_cache_, &key, &similarity, &entry)) {
+            return false;
+        }
+        double lookup_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        SemanticCache::Hit hit{key, similarity, lookup->prompt, entry.prompt};
+        LOGI("Semantic cache hit (%.3f): \"%s\" for \"%s\"", similarity, entry.prompt.c_str(), lookup->prompt.c_str());
+        if (semantic_cache_.mode() == SemanticCache::kModeSeed) {
+            semantic_cache_.note_hit(std::move(hit), 0.0);
+            *prompt = "An answer to a similar question, to use where it applies:\n" + entry.response +
+                      "\n\nQuestion: " + *prompt;
+            // The answer leans on another one, so it is not this question's own to cache
+            *lookup = AnswerLookup();
+            return false;
+        }
+        semantic_cache_.note_hit(std::move(hit), entry.millis - lookup_ms);
+        *response = std::move(entry.response);
+        return true;
+    }
+    
+    // Answer from the cache. A multi-turn conversation goes on as if the
+    // module had generated it: the turn is replayed ahead of the next one.
+    void serve_cached(const std::string& prompt, const std::string& response) {
+        stop_reason_ = kStopCached;
+        if (!multi_turn_) {
+            return;
+        }
+        drop_draft();
+        speculative_.reset();
+        Session& session = sessions_[active_session_];
+        session.subject = route_subject(prompt);
+        session.turns.assign(1, {prompt, response});
+        session.memory.clear();
+        session.tokens = estimate_tokens(prompt) + estimate_tokens(response);
+        session.shared_tokens = 0;
+        if (replay_session(session)) {
+            turn_count_ = 1;
+            conversation_subject_ = session.subject;
+            context_entered_ = false;
+            update_kv_budget(active_session_, session);
+            enforce_kv_budget();
+        } else {
+            session.turns.clear();
+            session.tokens = 0;
+            clear_conversation();
+            turn_count_ = 0;
+        }
+    }
+    
+    // Keep a complete answer for cached_answer(); cut-off and failed ones are not
+    void remember_answer(const AnswerLookup& lookup, const std::string& response,
+                         std::chrono::steady_clock::time_point started) {
+        int reason = stop_reason_.load();
+        bool complete = reason == kStopNone || reason == kStopToken || reason == kStopString;
+        if (lookup.key == 0 || !complete || response.empty() || response.rfind("Error:", 0) == 0 ||
+            response.rfind("FATAL ERROR:", 0) == 0) {
+            return;
+        }
+        ResponseCache::Entry entry;
+        entry.scope = lookup.scope;
+        entry.prompt = lookup.prompt;
+        entry.response = response;
+        entry.millis = static_cast<uint32_t>(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+        if (response_cache_.put(lookup.key, entry) && !lookup.embedding.empty()) {
+            semantic_cache_.add(lookup.key, lookup.embedding);
+        }
+    }
+    
+    bool open_session_store(const std::string& dir) {
+        if (!initialized) {
+            LOGE("Cannot open the session store before the model is loaded");
+            return false;
+        }
+        return session_store_.open(dir, model_hash_);
+    }
+    
+    // Write a session's turn list, and with CAP_KV_PERSIST its KV, as `name`
+    bool save_session(int64_t id, const std::string& name) {
+        auto it = sessions_.find(id);
+        if (!initialized || !session_store_.is_open() || !SessionStore::valid_name(name) || it == sessions_.end()) {
+            return false;
+        }
+        Session& session = it->second;
+        bool active = id == active_session_;
+        SavedSession saved;
+        saved.subject = static_cast<int>(active ? conversation_subject_ : session.subject);
+        saved.turn_count = active ? turn_count_ : session.turn_count;
+        saved.turns = session.turns;
+        
+        // The KV file must hold exactly the saved turns
+        int slot = kSessionKvSlotBase + session.slot;
+        bool in_step = saved.turn_count == static_cast<int>(saved.turns.size()) && session.pending_rollback == 0;
+        if (save_kv_ != nullptr && load_kv_ != nullptr && in_step && !saved.turns.empty()) {
+            try {
+                bool in_slot = session.parked && !active;
+                if (active && snapshot_kv_ != nullptr) {
+                    snapshot_kv_(slot);
+                    in_slot = true;
+                }
+                if (in_slot) {
+                    save_kv_(slot, session_store_.kv_path(name));
+                    saved.has_kv = true;
+                }
+            } catch (const std::exception& e) {
+                LOGE("Error saving KV of session %lld, keeping turns only: %s", static_cast<long long>(id), e.what());
+            }
+        }
+        if (!saved.has_kv) {
+            saved.turn_count = static_cast<int>(saved.turns.size());
+        }
+        return session_store_.save(name, saved);
+    }
+    
+    // New session continuing the saved `name`: its KV is loaded from the file
+    // when there is one, otherwise the turns are prefilled on first use
+    int64_t restore_session(const std::string& name) {
+        if (!initialized) {
+            return -1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        SavedSession saved;
+        if (!session_store_.load(name, &saved)) {
+            return -1;
+        }
+        int64_t id = create_session();
+        if (id < 0) {
+            return -1;
+        }
+        Session& session = sessions_[id];
+        session.subject = saved.subject >= 0 && saved.subject < kSubjectCount ?
+            static_cast<Subject>(saved.subject) : kSubjectGeneral;
+        session.turn_count = saved.turn_count;
+        session.turns = std::move(saved.turns);
+        for (const auto& turn : session.turns) {
+            session.tokens += turn_tokens(turn);
+        }
+        if (saved.has_kv && load_kv_ != nullptr) {
+            try {
+                load_kv_(kSessionKvSlotBase + session.slot, session_store_.kv_path(name));
+                session.parked = true;
+            } catch (const std::exception& e) {
+                LOGE("Error loading KV of saved session %s, prefilling it again: %s", name.c_str(), e.what());
+            }
+        }
+        if (session.parked) {
+            update_kv_budget(id, session);
+            enforce_kv_budget();
+        } else {
+            session.turn_count = static_cast<int>(session.turns.size());
+            session.evicted = !session.turns.empty();
+        }
+        LOGI("Restored session %s as %lld in %.1f ms (%zu turns, %s)", name.c_str(), static_cast<long long>(id),
+             std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count(),
+             session.turns.size(), session.parked ? "KV loaded" : "replay");
+        return id;
+    }
+    
+    void delete_saved_session(const std::string& name) {
+        session_store_.remove(name);
+        std::string log_path = session_store_.log_path(name);
+        for (auto& entry : sessions_) {
+            if (entry.second.log && entry.second.log->path() == log_path) {
+                entry.second.log.reset();
+            }
+        }
+        ConversationLog::remove(log_path);
+    }
+    
+    // Log every turn of `id` to `name` next to the saved sessions, starting
+    // with the turns it has
+    bool open_conversation_log(int64_t id, const std::string& name) {
+        auto it = sessions_.find(id);
+        if (!initialized || !session_store_.is_open() || !SessionStore::valid_name(name) || it == sessions_.end()) {
+            return false;
+        }
+        Session& session = it->second;
+        auto log = std::make_shared<ConversationLog>();
+        if (!log->open(session_store_.log_path(name), model_hash_) || !log->truncate(0)) {
+            return false;
+        }
+        session.log = log;
+        std::vector<std::pair<std::string, std::string>> turns = std::move(session.turns);
+        for (auto& turn : turns) {
+            session.turns.push_back(std::move(turn));
+            log_turn(session, false);
+        }
+        return session.log != nullptr;
+    }
+    
+    // New session continuing the log `name`, read in place: its KV comes from
+    // the saved session of that name when that holds the same turns, otherwise
+    // the latest turns that fit the window are replayed on first use
+    int64_t resume_conversation(const std::string& name) {
+        if (!initialized || !session_store_.is_open() || !SessionStore::valid_name(name)) {
+            return -1;
+        }
+        auto log = std::make_shared<ConversationLog>();
+        if (!log->open(session_store_.log_path(name), model_hash_) || log->turns() == 0) {
+            return -1;
+        }
+        int64_t id = create_session();
+        if (id < 0) {
+            return -1;
+        }
+        Session& session = sessions_[id];
+        session.log = log;
+        std::vector<uint64_t> sizes;
+        ConversationLog::Entry user;
+        ConversationLog::Entry answer;
+        for (size_t t = 0; t < log->turns() && log->entry(2 * t, &user) && log->entry(2 * t + 1, &answer); ++t) {
+            session.turns.emplace_back(std::string(user.text), std::string(answer.text));
+            sizes.push_back(user.id_count + answer.id_count + chat_template_.overhead());
+        }
+        
+        SavedSession saved;
+        bool has_saved = session_store_.load(name, &saved);
+        if (has_saved && saved.subject >= 0 && saved.subject < kSubjectCount) {
+            session.subject = static_cast<Subject>(saved.subject);
+        }
+        if (has_saved && saved.has_kv && load_kv_ != nullptr && saved.turns == session.turns &&
+            saved.turn_count == static_cast<int>(saved.turns.size())) {
+            try {
+                load_kv_(kSessionKvSlotBase + session.slot, session_store_.kv_path(name));
+                session.parked = true;
+            } catch (const std::exception& e) {
+                LOGE("Error loading KV of conversation %s, replaying it: %s", name.c_str(), e.what());
+            }
+        }
+        if (!session.parked) {
+            size_t first = context_window_.turns_to_shift(estimate_tokens(session_system(session)), sizes, 0);
+            session.turns.erase(session.turns.begin(), session.turns.begin() + first);
+            sizes.erase(sizes.begin(), sizes.begin() + first);
+        }
+        for (uint64_t size : sizes) {
+            session.tokens += size;
+        }
+        session.turn_count = static_cast<int>(session.turns.size());
+        if (session.parked) {
+            update_kv_budget(id, session);
+            enforce_kv_budget();
+        } else {
+            session.evicted = true;
+        }
+        LOGI("Resumed conversation %s as %lld (%zu turns, %s)", name.c_str(), static_cast<long long>(id),
+             session.turns.size(), session.parked ? "KV loaded" : "replay");
+        return id;
+    }
+    
+    // Fork `parent` after `at_turn` turns (all when negative) into a new
+    // session whose log `name` starts as a copy of that much of the parent's
+    int64_t branch_conversation(int64_t parent, int at_turn, const std::string& name) {
+        auto it = sessions_.find(parent);
+        if (it == sessions_.end() || !it->second.log || !SessionStore::valid_name(name)) {
+            return -1;
+        }
+        std::shared_ptr<ConversationLog> source = it->second.log;
+        size_t logged = source->turns();
+        size_t held = it->second.turns.size();
+        int64_t child_id = fork_session(parent, at_turn);
+        if (child_id < 0) {
+            return -1;
+        }
+        // Folded turns are in the log but not in the session
+        size_t keep = sessions_[child_id].turns.size() + (logged > held ? logged - held : 0);
+        std::string path = session_store_.log_path(name);
+        auto log = std::make_shared<ConversationLog>();
+        if (source->branch(path, 2 * keep) && log->open(path, model_hash_)) {
+            sessions_[child_id].log = log;
+        }
+        return child_id;
+    }
+    
+    // Ids of message `index` (turn index / 2, user then answer) of `id`'s log, read in place
+    bool conversation_ids(int64_t id, size_t index, std::vector<int32_t>* ids) {
+        auto it = sessions_.find(id);
+        ConversationLog::Entry entry;
+        if (it == sessions_.end() || !it->second.log || !it->second.log->entry(index, &entry)) {
+            return false;
+        }
+        ids->assign(entry.ids, entry.ids + entry.id_count);
+        return true;
+    }
+    
+    // Drop the turns of `id` after the first `turns`; its log follows
+    bool truncate_conversation(int64_t id, int turns) {
+        if (!initialized || turns < 0 || !switch_session(id)) {
+            return false;
+        }
+        if (follow_ups_.parent == id) {
+            discard_follow_ups();
+        }
+        Session& session = sessions_[id];
+        drop_token_turn();
+        drop_draft();
+        while (static_cast<int>(session.turns.size()) > turns) {
+            if (!rewind_last_turn(session)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    void set_saved_session_cap(uint64_t bytes) {
+        session_store_.set_max_bytes(bytes);
+        session_store_.enforce_cap("");
+    }
+    
+    uint64_t saved_session_bytes() const {
+        return session_store_.total_bytes();
+    }
+    
+    // Cap on the KV held by all sessions; shrinking it evicts right away
+    void set_kv_budget(uint64_t bytes) {
+        kv_budget_.set_budget(bytes);
+        LOGI("Set KV budget to %llu bytes", static_cast<unsigned long long>(bytes));
+        enforce_kv_budget();
+    }
+    
+    KvBudgetStats kv_stats() const {
+        return kv_budget_.stats();
+    }
+    
+    // Speculative work growing the KV by `tokens`, at the prefetch class's share of the memory budget
+    bool admits_prefetch(uint64_t tokens) {
+        memory_forecast::Forecast forecast;
+        forecast.prompt_tokens = tokens;
+        forecast.kv_bytes_per_token = kv_budget_.stats().bytes_per_token;
+        return admission_.decide(memory_usage(true), forecast, kPriorityPrefetch).decision == memory_forecast::kAdmit;
+    }
+    
+    // setMemoryBudget: 0 leaves the limit to what the system has available, less `reserve`
+    void set_memory_budget(uint64_t bytes, uint64_t reserve) {
+        admission_.set_budget(bytes);
+        admission_.set_reserve(reserve);
+        LOGI("Set memory budget to %llu bytes (reserve %llu)", static_cast<unsigned long long>(bytes),
+             static_cast<unsigned long long>(reserve));
+    }
+    
+    std::string memory_admission_json() {
+        admission_.effective_budget();
+        return admission_.to_json();
+    }
+    
+    // Load an offloaded session back into its slot ahead of its resume, if it
+    // fits in the KV budget beside the resident ones; its pages are staged
+    // (kv_offload.h) already, so this is load_kv reading them from memory
+    bool prefetch_offloaded(int64_t id) {
+        auto it = sessions_.find(id);
+        if (!initialized || it == sessions_.end() || id == active_session_ || !it->second.offloaded) {
+            return false;
+        }
+        Session& session = it->second;
+        KvBudgetStats stats = kv_budget_.stats();
+        uint64_t bytes = kv_budget_.bytes_for_tokens(session.tokens - std::min(session.tokens, session.shared_tokens));
+        if (stats.resident_bytes + bytes > stats.budget_bytes || !admits_prefetch(session.tokens) ||
+            !reload_offloaded(id, session, false)) {
+            return false;
+        }
+        update_kv_budget(id, session);
+        LOGI("Prefetched offloaded KV of session %lld", static_cast<long long>(id));
+        return true;
+    }
+    
+    // Cap on the weights of all loaded models; shrinking it unloads secondary models right away
+    void set_model_budget(uint64_t bytes) {
+        residency_.set_budget(bytes);
+        LOGI("Set model budget to %llu bytes", static_cast<unsigned long long>(bytes));
+        make_room(0);
+    }
+    
+    ModelResidencyStats model_stats() const {
+        return residency_.stats();
+    }
+    
+    // Stage retrieved chunks, in rank order, for the session's next turn; they
+    // are deduplicated now and packed into the budget once the prompt is known.
+    // Returns the chunks left after deduplication, or -1 for an unknown session.
+    int set_retrieved_context(int64_t id, std::vector<ContextChunk> chunks, size_t max_tokens) {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) {
+            return -1;
+        }
+        Session& session = it->second;
+        session.staged = prompt_context::dedupe(std::move(chunks), &session.staged_merged);
+        session.staged_max_tokens = max_tokens;
+        return static_cast<int>(session.staged.size());
+    }
+    
+    const PackedContext& last_context() const { return last_context_; }
+    const CompressionStats& compression_stats() const { return compression_; }
+    const ContextKvCache& context_cache() const { return context_cache_; }
+    const PrefixTree& prefix_tree() const { return prefix_tree_; }
+    
+    // Fold the oldest turns into a summary once the history passes `fill`
+    // of the context window; 0 turns it off
+    void set_memory_fill(double fill) {
+        memory_fill_factor_ = fill > 0.0 && fill < 1.0 ? fill : 0.0;
+        context_window_.memory_fill_factor = memory_fill_factor_;
+        if (memory_fill_factor_ <= 0.0) {
+            memory_due_.clear();
+        }
+    }
+    
+    // Sessions to fold, each handed out once
+    std::vector<int64_t> take_memory_due() {
+        std::vector<int64_t> due(memory_due_.begin(), memory_due_.end());
+        memory_due_.clear();
+        return due;
+    }
+    
+    // A fold of one session: the step's input and the turns it replaces
+    struct MemoryPlan {
+        std::string input;
+        std::vector<std::pair<std::string, std::string>> turns;
+        GenerationConfig config;
+    };
+    
+    bool plan_memory(int64_t id, MemoryPlan* plan) const {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) {
+            return false;
+        }
+        const Session& session = it->second;
+        size_t fold = turns_to_fold(session);
+        if (fold == 0) {
+            return false;
+        }
+        plan->turns.assign(session.turns.begin(), session.turns.begin() + fold);
+        plan->input = conversation_memory::fold_input(session.memory, plan->turns);
+        plan->config = config_.get();
+        plan->config.json_schema.clear();
+        plan->config.max_gen_len = std::min(plan->config.max_gen_len, conversation_memory::kMemoryTokens);
+        return true;
+    }
+    
+    // Swap the planned turns for `summary`: the active conversation is rebuilt
+    // with it now, a parked one drops its snapshot and is rebuilt on resume.
+    // False when the session no longer starts with those turns.
+    bool apply_memory(int64_t id, const MemoryPlan& plan, const std::string& summary) {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end() || summary.empty()) {
+            return false;
+        }
+        Session& session = it->second;
+        size_t fold = plan.turns.size();
+        bool in_step = id != active_session_ || turn_count_ == static_cast<int>(session.turns.size());
+        if (!in_step || session.turns.size() < fold + conversation_memory::kKeepTurns ||
+            !std::equal(plan.turns.begin(), plan.turns.end(), session.turns.begin())) {
+            return false;
+        }
+        
+        uint64_t before = session.tokens;
+        uint64_t memory_before = estimate_tokens(session.memory);
+        for (const auto& turn : plan.turns) {
+            session.tokens -= std::min(session.tokens, turn_tokens(turn));
+        }
+        session.tokens -= std::min(session.tokens, memory_before);
+        session.memory = summary;
+        session.tokens += estimate_tokens(session.memory);
+        session.turns.erase(session.turns.begin(), session.turns.begin() + fold);
+        session.shared_tokens = 0;
+        session.pending_rollback = 0;
+        if (id == active_session_) {
+            drop_draft();
+            speculative_.reset();
+            session.subject = conversation_subject_;
+            if (replay_session(session)) {
+                turn_count_ = static_cast<int>(session.turns.size());
+                context_entered_ = false;
+            } else {
+                clear_conversation();
+                turn_count_ = 0;
+                session.turns.clear();
+                session.memory.clear();
+                session.tokens = 0;
+            }
+            update_kv_budget(id, session);
+        } else if (session.parked) {
+            evict_session_kv(id);
+        }
+        memory_folds_++;
+        memory_turns_folded_ += fold;
+        memory_tokens_saved_ += before - std::min(before, session.tokens);
+        LOGI("Folded %zu turns of session %lld into a %llu-token summary, %zu turns kept", fold,
+             static_cast<long long>(id), static_cast<unsigned long long>(estimate_tokens(session.memory)),
+             session.turns.size());
+        return true;
+    }
+    
+    // The summary a session carries of its folded turns; empty if none
+    std::string conversation_memory_of(int64_t id) const {
+        auto it = sessions_.find(id);
+        return it == sessions_.end() ? std::string() : it->second.memory;
+    }
+    
+    uint64_t memory_folds() const { return memory_folds_; }
+    uint64_t memory_turns_folded() const { return memory_turns_folded_; }
+    uint64_t memory_tokens_saved() const { return memory_tokens_saved_; }
+    
+    // Adapter for the session's turns from its next turn on; empty routes by
+    // subject again, "base" runs the base model. False for an unknown session
+    // or an adapter that is not next to the model.
+    bool set_session_adapter(int64_t id, const std::string& name) {
+        auto it = sessions_.find(id);
+        if (!initialized || set_adapter_ == nullptr || it == sessions_.end()) {
+            return false;
+        }
+        if (!name.empty() && name != kBaseAdapter && load_adapter_ != nullptr && !adapters_.has(name)) {
+            LOGE("No adapter named %s next to the model", name.c_str());
+            return false;
+        }
+        it->second.adapter = name;
+        return true;
+    }
+    
+    // Evict by attention instead of by turn for `id` from its next turn on,
+    // holding the conversation to `budget_tokens` (<= 0: the context window)
+    bool set_session_kv_policy(int64_t id, int policy, int64_t budget_tokens) {
+        auto it = sessions_.find(id);
+        bool known = policy == kv_eviction::kPolicyWindow || policy == kv_eviction::kPolicyHeavyHitter;
+        if (it == sessions_.end() || !known) {
+            return false;
+        }
+        if (policy == kv_eviction::kPolicyHeavyHitter && initialized &&
+            (kv_attention_mass_ == nullptr || evict_tokens_ == nullptr)) {
+            return false;
+        }
+        it->second.kv_policy = policy;
+        it->second.kv_budget_tokens = budget_tokens;
+        return true;
+    }
+    
+    uint64_t kv_compressions() const { return kv_compressions_; }
+    uint64_t kv_tokens_evicted() const { return kv_tokens_evicted_; }
+    
+    // "name rank alpha bytes loaded" per adapter found next to the model
+    std::vector<std::string> adapter_list() const {
+        std::vector<std::string> out;
+        for (const AdapterInfo* info : adapters_.available()) {
+            char line[64];
+            snprintf(line, sizeof(line), " %d %g %llu %d", info->rank, info->alpha,
+                     static_cast<unsigned long long>(info->bytes), adapters_.loaded(info->name) ? 1 : 0);
+            out.push_back(info->name + line);
+        }
+        return out;
+    }
+    
+    // Embeddings of `texts`, one L2-normalized row of `*dim` values each, back
+    // to back (see text_embedding.h); empty on failure
+    std::vector<float> embed_texts(const std::vector<std::string>& texts, EmbedSource source, size_t* dim) {
+        *dim = 0;
+        if (!initialized || texts.empty()) {
+            return {};
+        }
+        if (source == kEmbedAuto) {
+            source = (capabilities_ & kMlcCapEmbedding) ? kEmbedDedicated : kEmbedChat;
+        }
+        std::vector<float> rows;
+        if (source == kEmbedDedicated) {
+            if (!ensure_embedder()) {
+                return {};
+            }
+            TraceSection trace("mlc:embed");
+            if (embed_batch_ != nullptr && texts.size() > 1) {
+                tvm::runtime::Array<tvm::runtime::String> batch;
+                for (const std::string& text : texts) {
+                    batch.push_back(tvm::runtime::String(text));
+                }
+                tvm::runtime::NDArray out = embed_batch_(batch);
+                size_t count = 0;
+                const float* data = logits_rows(out, &count, dim);
+                if (count != texts.size()) {
+                    LOGE("embed_batch returned %zu rows for %zu texts", count, texts.size());
+                    return {};
+                }
+                rows.assign(data, data + count * *dim);
+            } else {
+                for (const std::string& text : texts) {
+                    tvm::runtime::NDArray out = embed_(text);
+                    size_t width = 0;
+                    const float* row = logits_row(out, &width);
+                    if (*dim != 0 && width != *dim) {
+                        return {};
+                    }
+                    *dim = width;
+                    rows.insert(rows.end(), row, row + width);
+                }
+            }
+        } else {
+            if (hidden_states_ == nullptr) {
+                LOGE("Chat module has no hidden_states to embed with");
+                return {};
+            }
+            TraceSection trace("mlc:embed:hidden");
+            for (size_t i = 0; i < texts.size(); ++i) {
+                tvm::runtime::NDArray hidden = hidden_states_(texts[i]);
+                size_t tokens = 0;
+                size_t width = 0;
+                const float* data = logits_rows(hidden, &tokens, &width);
+                *dim = width;
+                rows.resize((i + 1) * width);
+                text_embedding::mean_pool(data, tokens, width, rows.data() + i * width);
+            }
+        }
+        size_t width = *dim;
+        float* base = rows.data();
+        auto normalize = [base, width](int64_t i) { text_embedding::l2_normalize(base + i * width, width); };
+        if (texts.size() >= text_embedding::kParallelRows) {
+            shared_pool::pool().parallel_for(0, static_cast<int64_t>(texts.size()), normalize);
+        } else {
+            for (size_t i = 0; i < texts.size(); ++i) {
+                normalize(static_cast<int64_t>(i));
+            }
+        }
+        return rows;
+    }
+    
+    AllocStepStats alloc_step_stats() const {
+        return alloc_steps_;
+    }
+    
+    // {transfer counters, staging bytes}
+    std::pair<host_staging::TransferStats, size_t> transfer_stats() const {
+        return {readback_.stats(), readback_.capacity()};
+    }
+    
+    int pooled_device_types() const {
+        return pooled_device_types_;
+    }
+    
+    // onTrimMemory: shed what can be rebuilt, more the higher the level, so the
+    // process survives and the next turn costs a prefill instead of a reload.
+    //   1  idle device pool blocks, the request arena, engine threads' small-block caches, host logits
+    //      buffers, compiled grammars, the tokenizer's text memo
+    //   2  subject prefix snapshots and every parked session's KV (turn lists are kept);
+    //      the weight pages of the least recently used secondary model
+    //   3  the shared prefix snapshot and every secondary model (draft, embedder);
+    //      unsaved kernel binaries are written out
+    //   4  mapped weight pages (read-only, faulted back in from the shards)
+    // Returns the bytes released, as far as they can be counted.
+    int64_t trim_memory(int level) {
+        int tier = trim_tier(level);
+        if (!initialized || tier == 0) {
+            return 0;
+        }
+        uint64_t freed = 0;
+        
+        freed += device_pool::counts().pooled_bytes;
+        device_pool::trim();
+        if (decode_graph_ready()) {
+            try {
+                decode_graph_.reset();  // the next decode step records again
+            } catch (const std::exception& e) {
+                LOGE("Error dropping decode step recordings: %s", e.what());
+            }
+        }
+        discard_follow_ups();
+        freed += arena_.capacity();
+        arena_.trim();
+        freed += engine_heap::trim();  // this thread's cache; the workers give theirs back when they next run
+        freed += tokenizer_.memo().clear();
+        freed += readback_.capacity() + host_logits_.capacity() * sizeof(float);
+        readback_.trim();
+        std::vector<float>().swap(host_logits_);
+        grammars_.clear();
+        
+        // A prefix snapshot holds about the system prompt's tokens
+        uint64_t prefix_bytes = kv_budget_.bytes_for_tokens(estimate_tokens(kStudyBuddySystemPrompt));
+        if (tier >= 2) {
+            for (const auto& entry : kv_budget_.session_bytes()) {
+                auto it = sessions_.find(entry.first);
+                if (entry.first != active_session_ && it != sessions_.end() && it->second.parked) {
+                    freed += entry.second;
+                    evict_session_kv(entry.first);
+                }
+            }
+            for (int subject = 0; subject < kSubjectCount && drop_kv_ != nullptr; ++subject) {
+                uint32_t bit = 1u << subject;
+                if ((subject_prefix_cached_ & bit) && subject != conversation_subject_) {
+                    try {
+                        drop_kv_(kSubjectKvSlotBase + subject);
+                        subject_prefix_cached_ &= ~bit;
+                        freed += prefix_bytes;
+                    } catch (const std::exception& e) {
+                        LOGE("Error dropping subject prefix KV: %s", e.what());
+                    }
+                }
+            }
+            for (int slot : context_cache_.slots()) {
+                if (drop_kv_ == nullptr) {
+                    break;
+                }
+                try {
+                    drop_kv_(kContextKvSlotBase + slot);
+                } catch (const std::exception& e) {
+                    LOGE("Error dropping retrieved context KV: %s", e.what());
+                }
+            }
+            context_cache_.clear();
+            drop_prefix_tree();
+            ModelRole role;
+            std::string dir;
+            if (tier == 2 && residency_.unmap_candidate(&role, &dir)) {
+                uint64_t resident = memory_stats::read_smaps(dir).weights.rss;
+                memory_stats::drop_mapped_pages(dir);
+                uint64_t after = memory_stats::read_smaps(dir).weights.rss;
+                freed += resident > after ? resident - after : 0;
+                residency_.unmapped(role);
+            }
+        }
+        if (tier >= 3) {
+            if (prefix_cached_ && drop_kv_ != nullptr) {
+                try {
+                    drop_kv_(kPrefixKvSlot);
+                    prefix_cached_ = false;  // clear_conversation loads or prefills it again
+                    freed += prefix_bytes;
+                } catch (const std::exception& e) {
+                    LOGE("Error dropping prefix KV: %s", e.what());
+                }
+            }
+            if (kernel_cache_dirty_) {
+                save_kernel_binaries();
+            }
+            for (ModelRole role : residency_.secondaries()) {
+                freed += ModelResidency::weight_bytes(model_path + "/" + model_role_name(role));
+                evict_model(role);
+            }
+        }
+        if (tier >= 4) {
+            uint64_t resident = memory_stats::read_smaps(model_path).weights.rss;
+            memory_stats::drop_mapped_pages(model_path);
+            uint64_t after = memory_stats::read_smaps(model_path).weights.rss;
+            freed += resident > after ? resident - after : 0;
+        }
+        LOGI("Trim level %d (tier %d) released about %llu bytes", level, tier, static_cast<unsigned long long>(freed));
+        return static_cast<int64_t>(freed);
+    }
+    
+    // ComponentCallbacks2 levels: RUNNING_* while in the foreground, then UI_HIDDEN,
+    // BACKGROUND, MODERATE and COMPLETE as the process moves down the LRU list
+    static int trim_tier(int level) {
+        if (level >= 80) return 4;  // TRIM_MEMORY_COMPLETE
+        if (level >= 60) return 3;  // TRIM_MEMORY_MODERATE
+        if (level >= 40) return 2;  // TRIM_MEMORY_BACKGROUND
+        if (level >= 20) return 1;  // TRIM_MEMORY_UI_HIDDEN
+        if (level >= 15) return 3;  // TRIM_MEMORY_RUNNING_CRITICAL
+        if (level >= 10) return 2;  // TRIM_MEMORY_RUNNING_LOW
+        if (level >= 5) return 1;   // TRIM_MEMORY_RUNNING_MODERATE
+        return 0;
+    }
+    
+    // Bytes by category with their peaks (see memory_stats.h)
+    std::string memory_stats_json() const {
+        return memory_report(initialized ? model_path : "", compute_device_.device, &kv_budget_, &arena_);
+    }
+    
+    // 0 in the module's KV, 1 parked in a snapshot, 2 evicted to its turn list,
+    // 3 empty, 4 evicted with its KV offloaded, -1 unknown session
+    int session_residency(int64_t id) const {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) {
+            return -1;
+        }
+        if (id == active_session_) {
+            return 0;
+        }
+        if (it->second.parked) {
+            return 1;
+        }
+        if (it->second.evicted && it->second.offloaded) {
+            return 4;
+        }
+        return it->second.evicted ? 2 : 3;
+    }
+    
+    // Subject of the current conversation and how long routing it took
+    Subject conversation_subject() const {
+        return conversation_subject_;
+    }
+    
+    float last_route_us() const {
+        return last_route_us_;
+    }
+    
+    SpeculativeStats speculative_stats() const {
+        return speculative_.stats();
+    }
+    
+    // Applied before the next request (apply_pending_settings); safe from any thread
+    void set_draft_length(int k) {
+        pending_draft_length_.store(k);
+    }
+    
+    // Stamped with the stages of the request being served; null between requests
+    void set_request_timing(RequestTiming* timing) {
+        timing_ = timing;
+    }
+    
+    // Off restores the configured settings
+    void set_governor(bool enabled, float target_tokens_per_second) {
+        governor_.set_enabled(enabled);
+        governor_.set_target_rate(target_tokens_per_second);
+        if (!enabled && governor_.level() > 0) {
+            governor_.reset();
+            apply_governor();
+        }
+    }
+    
+    // Reported from the next turn; the target follows the governor's rate
+    void set_performance_hints(bool enabled) {
+        hint_session_.set_enabled(enabled);
+    }
+    
+    performance_hint::Stats performance_hint_stats() const {
+        return hint_session_.stats();
+    }
+    
+    void set_device_state(const DeviceState& state) {
+        governor_.set_state(state, steady_ms());
+    }
+    
+    // Enter or leave the saver profile; the draft model goes for its duration
+    void set_saver(bool saver) {
+        if (saver == saver_) {
+            return;
+        }
+        saver_ = saver;
+        LOGI("%s the battery saver profile", saver ? "Entering" : "Leaving");
+        if (saver && draft_module_.defined()) {
+            evict_model(kModelDraft);
+        }
+        apply_governor();
+    }
+    
+    bool saver() const {
+        return saver_;
+    }
+    
+    const std::string& model_dir() const {
+        return model_path;
+    }
+    
+    const power_profile::EnergyMeter& energy() const {
+        return energy_;
+    }
+    
+    GenerationGovernor& governor() {
+        return governor_;
+    }
+    
+    // Calibration times the phases with logits coming back, so it needs native sampling
+    bool phase_split_ready() const {
+        return set_phase_device_ != nullptr && native_sampling_;
+    }
+    
+    PhasePlan phase_plan() const {
+        return phase_plan_;
+    }
+    
+    // Time every device present, keep the fastest plan for a typical turn and save it.
+    // Leaves the conversation empty.
+    PhasePlan calibrate_phase_devices() {
+        if (!initialized || !phase_split_ready()) {
+            return phase_plan_;
+        }
+        std::vector<PhaseTiming> timings;
+        for (const ComputeDevice& device : available_compute_devices()) {
+            try {
+                set_phase_devices(device.backend, device.backend);
+                PhaseTiming timing = time_phases();
+                timing.backend = device.backend;
+                timings.push_back(timing);
+                LOGI("Calibrated %s: prefill %.2f ms/token, decode %.2f ms/token", compute_backend_name(device.backend),
+                     timing.prefill_ms_per_token, timing.decode_ms_per_token);
+            } catch (const std::exception& e) {
+                LOGE("Skipping %s in phase calibration: %s", compute_backend_name(device.backend), e.what());
+            }
+        }
+        if (npu_prefill_ready()) {
+            // Prefill only; the split below measures the handoff to the decode device
+            try {
+                set_phase_devices(kBackendNpu, compute_device_.backend);
+                PhaseTiming timing = time_phases();
+                timing.backend = kBackendNpu;
+                timing.prefill_only();
+                timings.push_back(timing);
+                LOGI("Calibrated npu: prefill %.2f ms/token", timing.prefill_ms_per_token);
+            } catch (const std::exception& e) {
+                LOGE("Skipping npu in phase calibration: %s", e.what());
+            }
+        }
+        
+        PhasePlan plan = PhasePlan::best_single(timings);
+        PhasePlan split = PhasePlan::best_split(timings);
+        if (split.split() && split.turn_ms() < plan.turn_ms()) {
+            // A split's first decode step carries the KV handoff on top of the decode device's own
+            try {
+                set_phase_devices(split.prefill, split.decode);
+                PhaseTiming measured = time_phases();
+                for (const PhaseTiming& t : timings) {
+                    if (t.backend == split.decode) {
+                        split.handoff_ms = std::max(0.0, measured.first_decode_ms - t.first_decode_ms);
+                    }
+                }
+                if (split.turn_ms() < plan.turn_ms()) {
+                    plan = split;
+                }
+            } catch (const std::exception& e) {
+                LOGE("Phase split %s/%s failed, keeping one device: %s", compute_backend_name(split.prefill),
+                     compute_backend_name(split.decode), e.what());
+            }
+        }
+        if (!plan.calibrated()) {
+            return phase_plan_;
+        }
+        
+        try {
+            set_phase_devices(plan.prefill, plan.decode);
+            phase_plan_ = plan;
+            save_phase_plan();
+        } catch (const std::exception& e) {
+            LOGE("Error applying the phase plan: %s", e.what());
+        }
+        LOGI("Phase plan: prefill on %s, decode on %s, handoff %.1f ms, %.0f ms per typical turn",
+             compute_backend_name(plan.prefill), compute_backend_name(plan.decode), plan.handoff_ms, plan.turn_ms());
+        return phase_plan_;
+    }
+    
+    // Like phase calibration, tuning times turns with logits coming back
+    bool kernel_tuning_ready() const {
+        return !kernels_.empty() && native_sampling_;
+    }
+    
+    // Takes effect at the next initialize(), since binaries must be in before the first kernel runs
+    void set_kernel_cache_dir(const std::string& dir) {
+        kernel_cache_dir_ = dir;
+    }
+    
+    // Records are kept in `path`; applied right away when a model is loaded
+    void set_tuning_path(const std::string& path) {
+        tuning_path_ = path;
+        if (initialized) {
+            load_kernel_tuning();
+        }
+    }
+    
+    // Used at the next initialize(), or right away on a loaded model
+    void set_device_profile(const device_profile::DeviceProfile& profile) {
+        fleet_profile_ = profile;
+        if (initialized) {
+            apply_device_profile();
+        }
+    }
+    
+    // The tuning results in use for the loaded model; an explicit thread choice was
+    // not measured and is left out
+    device_profile::DeviceProfile measured_profile() const {
+        device_profile::DeviceProfile profile;
+        if (!initialized) {
+            return profile;
+        }
+        profile.soc = device_profile::soc_name();
+        profile.driver = device_profile::driver_name(compute_device_);
+        profile.model_hash = model_hash_;
+        if (thread_config_.affinity != kAffinityAuto && thread_config_.decode_ms_per_token > 0.0) {
+            profile.threads = thread_config_;
+        }
+        profile.phases = phase_plan_;
+        profile.kernels = tuning_db_.records();
+        return profile;
+    }
+    
+    // {measured candidates, all candidates} for this device and model
+    std::pair<size_t, size_t> tuning_progress() const {
+        size_t total = 0;
+        size_t measured = 0;
+        for (const KernelVariants& kernel : kernels_) {
+            for (const std::string& variant : kernel.variants) {
+                total++;
+                measured += tuning_db_.measured(kernel.kernel, variant) ? 1 : 0;
+            }
+        }
+        return {measured, total};
+    }
+    
+    // Measure the next untried candidate: that variant for its kernel, the best so far
+    // for the others. 1 if one was measured, 0 when every candidate has a record, -1 on error.
+    int tune_next_kernel_variant() {
+        if (!initialized || !kernel_tuning_ready() || !tuning_db_.is_open()) {
+            return -1;
+        }
+        for (const KernelVariants& kernel : kernels_) {
+            for (const std::string& variant : kernel.variants) {
+                if (tuning_db_.measured(kernel.kernel, variant)) {
+                    continue;
+                }
+                std::string previous = kernel_choice_[kernel.kernel];
+                int result = 1;
+                if (select_variant(kernel.kernel, variant)) {
+                    try {
+                        PhaseTiming timing = time_phases();
+                        TuningRecord record;
+                        record.kernel = kernel.kernel;
+                        record.variant = variant;
+                        record.run_ms = PhasePlan::kTurnPromptTokens * timing.prefill_ms_per_token +
+                                        PhasePlan::kTurnOutputTokens * timing.decode_ms_per_token;
+                        if (!tuning_db_.commit(record)) {
+                            LOGE("Could not append to the kernel tuning database");
+                        }
+                        LOGI("Tuned %s/%s: %.0f ms per typical turn", kernel.kernel.c_str(), variant.c_str(),
+                             record.run_ms);
+                    } catch (const std::exception& e) {
+                        LOGE("Error measuring %s/%s: %s", kernel.kernel.c_str(), variant.c_str(), e.what());
+                        result = -1;
+                    }
+                } else {
+                    result = -1;
+                }
+                const TuningRecord* best = tuning_db_.best(kernel.kernel);
+                select_variant(kernel.kernel, best != nullptr ? best->variant : previous);
+                restore_after_benchmark();
+                return result;
+            }
+        }
+        return 0;
+    }
+    
+    // One prefill of the calibration text and `decode_steps` greedy steps, profiled per kernel when
+    // the module can, else per step. Writes profile-<backend>.json/.csv to `dir`; returns the JSON path.
+    std::string profile_kernels(const std::string& dir, int decode_steps) {
+        using namespace tvm::runtime;
+        if (!initialized) {
+            return "Error: model not loaded";
+        }
+        if (profile_step_ == nullptr && (prefill_logits_ == nullptr || decode_logits_ == nullptr)) {
+            return "Error: chat module has no logits or profiling entry points";
+        }
+        decode_steps = std::max(1, decode_steps);
+        std::string backend = compute_backend_name(compute_device_.backend);
+        Map<String, ObjectRef> configuration;
+        configuration.Set("Executor", String(profile_step_ != nullptr ? "relax.vm" : "mlc-chat"));
+        configuration.Set("Backend", String(backend));
+        configuration.Set("Device", String(compute_device_.name.empty() ? backend : compute_device_.name));
+        configuration.Set("Decode steps", ObjectRef(make_object<profiling::CountNode>(decode_steps)));
+        
+        std::string text = calibration_text();
+        size_t vocab = 0;
+        std::string path;
+        // A replayed step is one submission; the profiler needs the kernels launched one by one
+        bool replaying = decode_graph_.active();
+        try {
+            if (replaying) {
+                decode_graph_.set_enabled(false);
+            }
+            clear_conversation();
+            if (profile_step_ != nullptr) {
+                std::vector<std::pair<std::string, profiling::Report>> steps;
+                Array<ObjectRef> result = profile_step_(String("prefill"), String(text));
+                for (int step = 0;; ++step) {
+                    NDArray logits = Downcast<NDArray>(result[0]);
+                    steps.emplace_back(step == 0 ? "prefill" : "decode", Downcast<profiling::Report>(result[1]));
+                    if (step == decode_steps) {
+                        break;
+                    }
+                    const float* row = logits_row(logits, &vocab);
+                    int64_t token = std::max_element(row, row + vocab) - row;
+                    result = profile_step_(String("decode"), token);
+                }
+                path = kernel_profile::write_report(dir, backend, kernel_profile::merge_reports(steps, configuration));
+            } else {
+                std::vector<profiling::MetricCollector> collectors;
+                if (const PackedFunc* papi = Registry::Get("runtime.profiling.PAPIMetricCollector")) {
+                    collectors.push_back((*papi)(Map<profiling::DeviceWrapper, Array<String>>()));
+                }
+                std::unordered_map<String, ObjectRef> config(configuration.begin(), configuration.end());
+                profiling::Profiler profiler({compute_device_.device}, collectors, config);
+                profiler.Start();
+                profiler.StartCall("prefill", compute_device_.device);
+                NDArray logits = prefill_logits_(text);
+                const float* row = logits_row(logits, &vocab);
+                profiler.StopCall();
+                for (int step = 0; step < decode_steps; ++step) {
+                    int64_t token = std::max_element(row, row + vocab) - row;
+                    profiler.StartCall("decode", compute_device_.device);
+                    logits = decode_logits_(token);
+                    row = logits_row(logits, &vocab);
+                    profiler.StopCall();
+                }
+                profiler.Stop();
+                path = kernel_profile::write_report(dir, backend, profiler.Report());
+            }
+        } catch (const std::exception& e) {
+            LOGE("Error profiling kernels: %s", e.what());
+            path = "Error: " + std::string(e.what());
+        }
+        if (replaying) {
+            apply_decode_graph();
+        }
+        // The Profiler resets the thread pool, and the conversation holds the calibration text
+        if (compute_device_.backend == kBackendCpu) {
+            apply_governor();
+        }
+        restore_after_benchmark();
+        if (path.empty()) {
+            return "Error: could not write the profile to " + dir;
+        }
+        if (path.rfind("Error:", 0) != 0) {
+            LOGI("Kernel profile of prefill and %d decode steps written to %s", decode_steps, path.c_str());
+        }
+        return path;
+    }
+    
+    bool bench_run(int prompt_tokens, int decode_tokens, BenchRun* run, std::string* error) {
+        if (!initialized || prefill_logits_ == nullptr || decode_logits_ == nullptr) {
+            *error = initialized ? "chat module has no prefill_logits / decode_logits" : "model not loaded";
+            return false;
+        }
+        using Clock = std::chrono::steady_clock;
+        auto ms_since = [](Clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        };
+        std::string text;
+        for (int sentences = 1; estimate_tokens(text) < static_cast<size_t>(std::max(1, prompt_tokens)); ++sentences) {
+            text = calibration_text(sentences);
+        }
+        
+        *run = BenchRun();
+        run->prompt_tokens = static_cast<int>(estimate_tokens(text));
+        size_t vocab = 0;
+        try {
+            clear_conversation();
+            auto start = Clock::now();
+            tvm::runtime::NDArray logits = prefill_logits_(text);
+            const float* row = logits_row(logits, &vocab);
+            run->prefill_ms = ms_since(start);
+            int64_t token = std::max_element(row, row + vocab) - row;
+            run->ttft_ms = ms_since(start);
+            
+            start = Clock::now();
+            for (int step = 0; step < decode_tokens; ++step) {
+                logits = decode_logits_(token);
+                row = logits_row(logits, &vocab);
+                token = std::max_element(row, row + vocab) - row;
+                run->decode_tokens++;
+            }
+            run->decode_ms = ms_since(start);
+        } catch (const std::exception& e) {
+            *error = e.what();
+            clear_conversation();
+            return false;
+        }
+        clear_conversation();
+        if (governor_.enabled() &&
+            governor_.observe(run->decode_tokens, run->ttft_ms + run->decode_ms, steady_ms())) {
+            apply_governor();
+        }
+        return true;
+    }
+    
+    // Sessions through the batch scheduler as async requests go, but greedy, for exactly
+    // `decode_tokens` each and without touching the answer-length stats
+    bool bench_concurrent(int sessions, int context_tokens, int decode_tokens, BenchConcurrentRun* run,
+                          std::string* error) {
+        if (!initialized || !batching_ready()) {
+            *error = initialized ? "chat module has no batched entry points" : "model not loaded";
+            return false;
+        }
+        BatchScheduler& scheduler = batch_scheduler();
+        if (!scheduler.idle()) {
+            *error = "batch scheduler busy";
+            return false;
+        }
+        using Clock = std::chrono::steady_clock;
+        std::string text;
+        size_t wanted = static_cast<size_t>(std::max(1, context_tokens));
+        for (int sentences = 1; estimate_tokens(text) < wanted; ++sentences) {
+            text = calibration_text(sentences);
+        }
+        
+        *run = BenchConcurrentRun();
+        run->sessions = sessions;
+        run->context_tokens = static_cast<int>(estimate_tokens(text));
+        std::vector<Clock::time_point> first(sessions), last(sessions);
+        std::vector<bool> started(sessions, false);
+        std::vector<int> generated(sessions, 0);
+        BatchScheduler::Backend backend = batch_backend(
+                [](int64_t) { return false; },
+                [&](int64_t request, const std::string&) {
+                    if (!started[request]) {
+                        started[request] = true;
+                        first[request] = Clock::now();
+                    }
+                    last[request] = Clock::now();
+                });
+        backend.is_stop = [](int) { return false; };
+        backend.reserve = [this](const BatchSequence& seq) { return batch_reservation(seq, seq.prompt); };
+        backend.completed = [&](const BatchSequence& seq) {
+            generated[seq.request] = static_cast<int>(seq.generated.size());
+        };
+        
+        int previous_max = scheduler.max_batch();
+        scheduler.set_max_batch(sessions);
+        BatchStats before = scheduler.stats();
+        auto start = Clock::now();
+        for (int i = 0; i < sessions; ++i) {
+            BatchSequence seq;
+            seq.request = i;
+            seq.priority = kPriorityBackground;
+            seq.config = config_.get();
+            seq.config.temperature = 0.0f;
+            seq.config.max_gen_len = decode_tokens;
+            seq.config.stop_strings.clear();
+            seq.config.json_schema.clear();
+            // A different first sentence per session, so no two share a cached prefix
+            seq.prompt = "Session " + std::to_string(i + 1) + ". " + text;
+            scheduler.enqueue(std::move(seq));
+        }
+        std::vector<BatchScheduler::Finished> finished;
+        while (scheduler.step(backend, &finished)) {
+            BatchStats stats = scheduler.stats();
+            run->peak_batch = std::max(run->peak_batch, stats.active);
+            run->peak_kv_tokens = std::max(run->peak_kv_tokens, stats.kv_tokens);
+            run->peak_rss_bytes = std::max(run->peak_rss_bytes, memory_stats::status_bytes("VmRSS"));
+        }
+        run->wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        BatchStats after = scheduler.stats();
+        scheduler.set_max_batch(previous_max);
+        
+        for (const auto& done : finished) {
+            if (!done.ok) {
+                *error = done.error.empty() ? "a session failed" : done.error;
+                return false;
+            }
+        }
+        for (int i = 0; i < sessions; ++i) {
+            run->decode_tokens += generated[i];
+            run->ttft_ms.push_back(started[i] ? std::chrono::duration<double, std::milli>(first[i] - start).count()
+                                              : run->wall_ms);
+            double ms = started[i] ? std::chrono::duration<double, std::milli>(last[i] - first[i]).count() : 0.0;
+            run->session_tokens_per_s.push_back(ms > 0.0 && generated[i] > 1 ? (generated[i] - 1) * 1000.0 / ms : 0.0);
+        }
+        run->kv_deferrals = after.kv_deferrals - before.kv_deferrals;
+        return true;
+    }
+    
+    // Applied right away when a model is loaded; auto reverts to the saved or measured choice
+    void set_thread_config(ThreadAffinity affinity, int workers) {
+        requested_threads_.affinity = affinity;
+        requested_threads_.workers = affinity == kAffinityAuto ? 0 : workers;
+        if (initialized) {
+            configure_threads(model_path);
+            if (!threads_calibrated_) {
+                calibrate_threads();
+                restore_after_benchmark();
+            }
+            if (governor_.level() > 0 || saver_) {
+                apply_governor();
+            }
+        }
+    }
+    
+    const ThreadConfig& thread_config() const {
+        return thread_config_;
+    }
+    
+    // Takes effect at the next initialize()
+    void set_preferred_backend(ComputeBackend backend) {
+        preferred_backend_ = backend;
+    }
+    
+    void set_low_ram_mode(layer_pager::Mode mode) {
+        low_ram_mode_ = mode;
+    }
+    
+    ComputeBackend compute_backend() const {
+        return initialized ? compute_device_.backend : kBackendAuto;
+    }
+    
+    const ComputeDevice& compute_device() const {
+        return compute_device_;
+    }
+    
+    SpeculativeStats prompt_lookup_stats() const {
+        return speculative_.lookup_stats();
+    }
+    
+    void set_prompt_lookup(bool enabled) {
+        prompt_lookup_ = enabled;
+        LOGI("Prompt lookup decoding %s", enabled ? "on" : "off");
+    }
+    
+    SpeculativeStats self_speculation_stats() const {
+        return speculative_.self_stats();
+    }
+    
+    // `exit_layer` 0: the module's exit head, or half the layers without one
+    void set_self_speculation(bool enabled, int exit_layer) {
+        speculative_.set_exit_layer(exit_layer);
+        self_speculation_ = enabled;
+        LOGI("Self-speculation %s, drafting through %d of %d layers", enabled ? "on" : "off",
+             speculative_.exit_layer(), speculative_.layers());
+    }
+    
+    // {exit layer in use, layers}; 0, 0 when the module cannot self-draft
+    std::pair<int, int> self_speculation_layers() const {
+        return {speculative_.exit_layer(), speculative_.layers()};
+    }
+    
+    // Proposal length picked per round up to `ceiling` (0 for the default),
+    // or draft_length every round when off. Applied before the next request
+    // (apply_pending_settings); safe from any thread
+    void set_adaptive_draft_length(bool enabled, int ceiling) {
+        pending_adaptive_draft_.store(enabled ? (ceiling > 0 ? ceiling : DraftController::kDefaultCeiling) : 0);
+    }
+    
+    // The draft length controllers' state; the caller holds the engine
+    std::string draft_length_stats() const {
+        return speculative_.controller_json();
+    }
+    
+    // Task type of the next turns, kTaskChat unless a one-shot run says otherwise
+    void set_turn_task(int task) {
+        turn_task_ = task >= 0 && task < kTaskTypes ? task : kTaskChat;
+    }
+    
+    // Applied before the next request (apply_pending_settings); safe from any thread
+    void set_decode_graph(bool enabled) {
+        pending_decode_graph_.store(enabled ? 1 : 0);
+    }
+    
+    // The CPU kernels are calls into the model library; there is no launch to save
+    bool decode_graph_ready() const {
+        return decode_graph_.available() && compute_device_.backend != kBackendCpu;
+    }
+    
+    void apply_decode_graph() {
+        if (!decode_graph_ready()) {
+            return;
+        }
+        try {
+            bool active = decode_graph_.set_enabled(decode_graph_enabled_);
+            LOGI("Decode step recording %s", active ? "on" : decode_graph_enabled_ ? "unsupported on this device" : "off");
+        } catch (const std::exception& e) {
+            LOGE("Error switching decode step recording: %s", e.what());
+        }
+    }
+    
+    // {recording now, recordings, replayed steps, eager steps}
+    std::pair<bool, DecodeGraphStats> decode_graph_stats() const {
+        if (!initialized || !decode_graph_ready()) {
+            return {false, DecodeGraphStats()};
+        }
+        try {
+            return {decode_graph_.active(), decode_graph_.stats()};
+        } catch (const std::exception& e) {
+            LOGE("Error reading decode step recording stats: %s", e.what());
+            return {decode_graph_.active(), DecodeGraphStats()};
+        }
+    }
+    
+    // Applied before the next request (apply_pending_settings); safe from any thread
+    void set_multi_turn(bool enabled) {
+        pending_multi_turn_.store(enabled ? 1 : 0);
+    }
+    
+    // Settings queued by setters on other threads; the caller holds the engine
+    void apply_pending_settings() {
+        int draft_length = pending_draft_length_.exchange(kNoPending);
+        if (draft_length != kNoPending) {
+            speculative_.set_draft_length(draft_length);
+            draft_length_ = speculative_.draft_length();
+            if (governor_.level() > 0 || saver_) {
+                apply_governor();
+            }
+        }
+        int adaptive = pending_adaptive_draft_.exchange(kNoPending);
+        if (adaptive != kNoPending) {
+            speculative_.set_adaptive(adaptive > 0);
+            if (adaptive > 0) {
+                adaptive_ceiling_ = std::min(adaptive, SpeculativeDecoder::kMaxDraftLength);
+                apply_governor();
+            }
+            LOGI("Adaptive draft length %s, ceiling %d", adaptive > 0 ? "on" : "off",
+                 speculative_.adaptive_ceiling());
+        }
+        int multi_turn = pending_multi_turn_.exchange(kNoPending);
+        if (multi_turn != kNoPending) {
+            switch_multi_turn(multi_turn == 1);
+        }
+        int decode_graph = pending_decode_graph_.exchange(kNoPending);
+        if (decode_graph != kNoPending) {
+            decode_graph_enabled_ = decode_graph == 1;
+            apply_decode_graph();
+        }
+    }
+    
+    void switch_multi_turn(bool enabled) {
+        if (multi_turn_ == enabled) {
+            return;
+        }
+        multi_turn_ = enabled;
+        LOGI("Set multi-turn mode to %s", enabled ? "on" : "off");
+        
+        // Leaving multi-turn mode drops the accumulated conversation
+        if (!enabled && initialized) {
+            reset_chat();
+        }
+    }
+    
+    // The setters below change the default config only, from any thread; it
+    // is pushed into the module (once, and only if it changed) when the next
+    // request starts, and a running request keeps the snapshot it started with
+    void set_temperature(float temp) {
+        config_.update([temp](GenerationConfig& config) { config.temperature = temp; });
+        LOGI("Set temperature to %.2f", temp);
+    }
+    
+    void set_top_p(float p) {
+        config_.update([p](GenerationConfig& config) { config.top_p = p; });
+        LOGI("Set top_p to %.2f", p);
+    }
+    
+    void set_seed(int64_t seed) {
+        int64_t value = seed < 0 ? -1 : seed;
+        config_.update([value](GenerationConfig& config) { config.seed = value; });
+        LOGI("Set seed to %lld", static_cast<long long>(value));
+    }
+    
+    void set_repetition_penalty(float penalty) {
+        config_.update([penalty](GenerationConfig& config) { config.repetition_penalty = penalty; });
+        LOGI("Set repetition_penalty to %.2f", penalty);
+    }
+    
+    // Sample with the module's device kernel when logits are on the GPU.
+    // Disabling it copies the logits back and samples with the NEON sampler.
+    void set_device_sampling(bool enabled) {
+        device_sampling_ = enabled;
+        LOGI("Set device sampling to %s", enabled ? "on" : "off");
+    }
+    
+    deadline::Report last_deadline() const { return deadline_report_; }
+    
+    StopReason stop_reason() const {
+        if (stalled_.load()) {
+            return kStopStalled;
+        }
+        return static_cast<StopReason>(stop_reason_.load());
+    }
+    
+    SamplerStats sampler_stats() const {
+        return sampler_.stats();
+    }
+    
+    void set_max_gen_len(int len) {
+        config_.update([len](GenerationConfig& config) { config.max_gen_len = len; });
+        LOGI("Set max_gen_len to %d", len);
+    }
+    
+    GenerationConfig default_config() const {
+        return config_.get();
+    }
+    
+    // By the model's tokenizer, estimated without one
+    size_t count_tokens(const std::string& text) const {
+        return estimate_tokens(text);
+    }
+    
+    const ContextWindow& context_window() const { return context_window_; }
+    
+    // Stop an in-flight stream_chat at its next token; safe from any thread
+    // Batched sequences need native sampling: the rows are sampled here
+    bool batching_ready() const {
+        return initialized && native_sampling_ && batch_prefill_ != nullptr && batch_decode_ != nullptr &&
+               batch_release_ != nullptr;
+    }
+    
+    int sample_sequence(BatchSequence& seq, const float* row, size_t vocab) {
+        sampler_.configure(seq.config.temperature, seq.config.top_p, seq.config.repetition_penalty);
+        bool own_rng = seq.config.seed >= 0;
+        if (own_rng) {
+            sampler_.swap_rng(seq.rng);
+        }
+        int token = seq.grammar ? sample_constrained(*seq.grammar, row, vocab, seq.generated.data(),
+                                                     seq.generated.size())
+                                : sampler_.sample(row, vocab, seq.generated.data(), seq.generated.size());
+        if (own_rng) {
+            sampler_.swap_rng(seq.rng);
+        }
+        return token;
+    }
+    
+    bool batch_forking_ready() const {
+        return batching_ready() && batch_prefix_ != nullptr && batch_fork_ != nullptr && batch_finish_ != nullptr;
+    }
+    
+    // Forward passes and sampling for BatchScheduler; step() it under g_engine_mutex.
+    // Sequences sample with their own config, and a seeded one with its own
+    // generator, so it replays the same whatever else shares the batch.
+    BatchScheduler::Backend batch_backend(std::function<bool(int64_t request)> cancelled,
+                                          std::function<void(int64_t request, const std::string&)> emit) {
+        BatchScheduler::Backend backend;
+        backend.prefill = [this](BatchSequence& seq) {
+            if (!batching_ready()) {
+                return false;
+            }
+            if (seq.default_config) {
+                int64_t seed = seq.config.seed;
+                seq.config = config_.get();
+                if (seed >= 0) {
+                    seq.config.seed = seed;
+                } else if (seq.config.seed >= 0) {
+                    seq.config.seed += seq.index;  // branches of a group stay distinct
+                }
+            }
+            // A batch mixes adapters per sequence; a sequence without one runs on the base model
+            std::string adapter = seq.config.adapter == kBaseAdapter ? std::string() : seq.config.adapter;
+            if (!adapter.empty() && (batch_set_adapter_ == nullptr || !load_adapter(adapter))) {
+                LOGE("Adapter %s unavailable for batched decode, using the base model", adapter.c_str());
+                adapter.clear();
+            }
+            if (!adapter.empty()) {
+                adapters_.acquire(adapter);
+                seq.adapter = adapter;
+            }
+            tvm::runtime::NDArray logits;
+            if (seq.group != 0 && seq.prefix && batch_forking_ready()) {
+                BatchRoot& root = batch_roots_[seq.group];
+                if (root.seq_id == 0) {
+                    // First branch of the group to be admitted prefills the prefix once
+                    if (batch_set_adapter_ != nullptr) {
+                        batch_set_adapter_(kBatchRootSeqBase + seq.group, adapter);
+                    }
+                    batch_prefix_(kBatchRootSeqBase + seq.group, *seq.prefix);
+                    root.seq_id = kBatchRootSeqBase + seq.group;
+                }
+                batch_fork_(root.seq_id, seq.seq_id);
+                if (batch_set_adapter_ != nullptr) {
+                    batch_set_adapter_(seq.seq_id, adapter);
+                }
+                seq.decoder = std::make_unique<SpStreamDecoder>(tokenizer_);
+                TraceSection trace("mlc:prefill");
+                logits = batch_finish_(seq.seq_id, seq.prompt);
+            } else {
+                if (batch_set_adapter_ != nullptr) {
+                    batch_set_adapter_(seq.seq_id, adapter);
+                }
+                seq.decoder = std::make_unique<SpStreamDecoder>(tokenizer_);
+                TraceSection trace("mlc:prefill");
+                logits = batch_prefill_(seq.seq_id, seq.prefix ? *seq.prefix + seq.prompt : seq.prompt);
+            }
+            if (seq.config.seed >= 0) {
+                seq.rng.seed(static_cast<uint64_t>(seq.config.seed));
+            }
+            seq.grammar = grammar_for(seq.config);
+            if (!seq.stops && !seq.config.stop_strings.empty()) {
+                seq.stops = std::make_unique<StopStringMatcher>(seq.config.stop_strings);
+            }
+            stop_tokens_for(seq.config, &seq.stop_tokens);
+            seq.timing.prompt_tokens = estimate_tokens(seq.prefix ? *seq.prefix + seq.prompt : seq.prompt);
+            size_t vocab = 0;
+            const float* row = logits_row(logits, &vocab);
+            seq.next_token = sample_sequence(seq, row, vocab);
+            return true;
+        };
+        backend.decode = [this](const std::vector<BatchSequence*>& batch) {
+            if (!batching_ready()) {
+                return false;
+            }
+            std::vector<int64_t> seq_ids;
+            std::vector<int64_t> tokens;
+            for (const BatchSequence* seq : batch) {
+                seq_ids.push_back(seq->seq_id);
+                tokens.push_back(seq->next_token);
+            }
+            tvm::runtime::NDArray logits;
+            {
+                TraceSection trace("mlc:decode");
+                logits = batch_decode_(tvm::runtime::ShapeTuple(seq_ids.begin(), seq_ids.end()),
+                                       tvm::runtime::ShapeTuple(tokens.begin(), tokens.end()));
+            }
+            size_t rows = 0;
+            size_t vocab = 0;
+            const float* data = logits_rows(logits, &rows, &vocab);
+            if (rows < batch.size()) {
+                throw std::runtime_error("batch_decode returned too few logits rows");
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                batch[i]->next_token = sample_sequence(*batch[i], data + i * vocab, vocab);
+            }
+            return true;
+        };
+        backend.release = [this](BatchSequence& seq) {
+            // No decoder: the sequence never reached batch_prefill
+            if (batch_release_ != nullptr && seq.decoder) {
+                batch_release_(seq.seq_id);
+            }
+            if (!seq.adapter.empty()) {
+                adapters_.release(seq.adapter);
+                seq.adapter.clear();
+            }
+            if (seq.group == 0) {
+                return;
+            }
+            BatchRoot& root = batch_roots_[seq.group];
+            if (++root.released >= seq.group_size) {
+                int64_t root_seq = root.seq_id;
+                batch_roots_.erase(seq.group);
+                if (root_seq != 0 && batch_release_ != nullptr) {
+                    batch_release_(root_seq);
+                }
+            }
+        };
+        backend.is_stop = [this](int token) {
+            return std::find(stop_ids_.begin(), stop_ids_.end(), token) != stop_ids_.end();
+        };
+        backend.cancelled = [cancelled](const BatchSequence& seq) { return cancelled(seq.request); };
+        backend.emit = [emit](const BatchSequence& seq, const std::string& text) { emit(seq.request, text); };
+        backend.kv_capacity = [this](int priority) { return batch_kv_capacity(priority); };
+        backend.completed = [this, cancelled](const BatchSequence& seq) {
+            if (!cancelled(seq.request)) {
+                output_lengths_.record(seq.task, static_cast<int>(seq.generated.size()), seq.config.max_gen_len);
+            }
+        };
+        return backend;
+    }
+    
+    // KV tokens a waiting sequence reserves: its prompt, its share of a
+    // forked prefix, and the answer its task usually gives
+    uint64_t batch_reservation(const BatchSequence& seq, const std::string& prompt) const {
+        uint64_t tokens = estimate_tokens(prompt);
+        if (seq.prefix) {
+            uint64_t prefix = estimate_tokens(*seq.prefix);
+            tokens += batch_forking_ready() ? (prefix + seq.group_size - 1) / std::max(1, seq.group_size) : prefix;
+        }
+        int max_gen_len = seq.default_config ? config_.snapshot()->max_gen_len : seq.config.max_gen_len;
+        return tokens + static_cast<uint64_t>(output_lengths_.reserve(seq.task, max_gen_len));
+    }
+    
+    // KV tokens the budget leaves the batch after the chat sessions, within what
+    // memory admission leaves a request of `priority`; 0 when unsized
+    uint64_t batch_kv_capacity(int priority) {
+        KvBudgetStats stats = kv_budget_.stats();
+        if (stats.bytes_per_token == 0 || stats.budget_bytes == 0) {
+            return 0;
+        }
+        uint64_t free = stats.budget_bytes > stats.resident_bytes ? stats.budget_bytes - stats.resident_bytes : 0;
+        free = std::min(free, admission_.room(memory_usage(false), priority));
+        return std::max<uint64_t>(1, free / stats.bytes_per_token);  // 1: only into an empty batch
+    }
+    
+    OutputLengths::Stats output_length_stats(int task) const {
+        return output_lengths_.stats(task);
+    }
+    
+    int output_reservation(int task) const {
+        return output_lengths_.reserve(task, config_.snapshot()->max_gen_len);
+    }
+    
+    // May be called from another thread while a request runs
+    void abort() {
+        abort_requested_ = true;
+        if (abort_ != nullptr) {
+            abort_();
+        }
+    }
+    
+    // From the stall watchdog; the generation reports kStopStalled
+    void abort_stalled() {
+        stalled_ = true;
+        abort();
+    }
+    
+    void clear_abort() {
+        abort_requested_ = false;
+        stalled_ = false;
+    }
+    
+    // Tokens per prefill chunk; smaller keeps cancellation and the UI snappier
+    void set_prefill_chunk_tokens(int tokens) {
+        prefill_chunk_tokens_ = std::max(16, tokens);
+        LOGI("Set prefill chunk to %d tokens", prefill_chunk_tokens_);
+    }
+    
+    // Called with (done, total) tokens on the generating thread; empty to stop
+    void set_prefill_progress(std::function<void(int64_t, int64_t)> progress) {
+        prefill_progress_ = std::move(progress);
+    }
+    
+    const std::function<void(int64_t, int64_t)>& prefill_progress() const {
+        return prefill_progress_;
+    }
+    
+    // Whether a second engine can load while this one serves: not when this one
+    // pages layers (the pager is per process) or runs a library through its
+    // direct exports, whose model state is global to the library
+    bool can_load_alongside() const {
+        return initialized && !owns_pager_ && model_lib_handle_ == nullptr;
+    }
+    
+    void close() {
+        if (initialized) {
+            LOGI("Closing MLC-LLM engine");
+            // Offloaded KV is only good for this module
+            kv_offload::store().clear();
+            // Reset module references to release resources
+            model_load_ = tvm::runtime::PackedFunc(nullptr);
+            generate_ = tvm::runtime::PackedFunc(nullptr);
+            reset_chat_ = tvm::runtime::PackedFunc(nullptr);
+            set_param_ = tvm::runtime::PackedFunc(nullptr);
+            stream_chat_ = tvm::runtime::PackedFunc(nullptr);
+            abort_ = tvm::runtime::PackedFunc(nullptr);
+            generate_batch_ = tvm::runtime::PackedFunc(nullptr);
+            load_json_override_ = tvm::runtime::PackedFunc(nullptr);
+            process_system_prompts_ = tvm::runtime::PackedFunc(nullptr);
+            snapshot_kv_ = tvm::runtime::PackedFunc(nullptr);
+            restore_kv_ = tvm::runtime::PackedFunc(nullptr);
+            drop_kv_ = tvm::runtime::PackedFunc(nullptr);
+            fork_kv_ = tvm::runtime::PackedFunc(nullptr);
+            rollback_turns_ = tvm::runtime::PackedFunc(nullptr);
+            save_kv_ = tvm::runtime::PackedFunc(nullptr);
+            load_kv_ = tvm::runtime::PackedFunc(nullptr);
+            kv_cache_dtype_ = tvm::runtime::PackedFunc(nullptr);
+            shift_turns_ = tvm::runtime::PackedFunc(nullptr);
+            kv_attention_mass_ = tvm::runtime::PackedFunc(nullptr);
+            evict_tokens_ = tvm::runtime::PackedFunc(nullptr);
+            prefill_begin_ = tvm::runtime::PackedFunc(nullptr);
+            prefill_step_ = tvm::runtime::PackedFunc(nullptr);
+            draft_append_ = tvm::runtime::PackedFunc(nullptr);
+            draft_truncate_ = tvm::runtime::PackedFunc(nullptr);
+            prefill_token_ids_ = tvm::runtime::PackedFunc(nullptr);
+            prefill_turn_ids_ = tvm::runtime::PackedFunc(nullptr);
+            chat_template_ = ChatTemplate();
+            token_turn_ = TokenTurn();
+            batch_prefill_ = tvm::runtime::PackedFunc(nullptr);
+            batch_decode_ = tvm::runtime::PackedFunc(nullptr);
+            batch_release_ = tvm::runtime::PackedFunc(nullptr);
+            batch_prefix_ = tvm::runtime::PackedFunc(nullptr);
+            batch_fork_ = tvm::runtime::PackedFunc(nullptr);
+            batch_finish_ = tvm::runtime::PackedFunc(nullptr);
+            batch_roots_.clear();
+            draft_session_ = -1;
+            draft_tokens_.clear();
+            set_adapter_ = tvm::runtime::PackedFunc(nullptr);
+            load_adapter_ = tvm::runtime::PackedFunc(nullptr);
+            unload_adapter_ = tvm::runtime::PackedFunc(nullptr);
+            batch_set_adapter_ = tvm::runtime::PackedFunc(nullptr);
+            adapters_.clear();
+            adapter_known_ = false;
+            prefill_logits_ = tvm::runtime::PackedFunc(nullptr);
+            decode_logits_ = tvm::runtime::PackedFunc(nullptr);
+            decode_logits_shortlist_ = tvm::runtime::PackedFunc(nullptr);
+            sample_on_device_ = tvm::runtime::PackedFunc(nullptr);
+            set_phase_device_ = tvm::runtime::PackedFunc(nullptr);
+            phase_plan_ = PhasePlan();
+            npu_prefill_chunks_ = tvm::runtime::PackedFunc(nullptr);
+            npu_chunks_.clear();
+            npu_prefill_ = false;
+            kernel_variants_ = tvm::runtime::PackedFunc(nullptr);
+            select_kernel_variant_ = tvm::runtime::PackedFunc(nullptr);
+            kernels_.clear();
+            kernel_choice_.clear();
+            tuning_db_ = TuningDatabase();
+            get_kernel_binaries_ = tvm::runtime::PackedFunc(nullptr);
+            set_kernel_binaries_ = tvm::runtime::PackedFunc(nullptr);
+            profile_step_ = tvm::runtime::PackedFunc(nullptr);
+            hidden_states_ = tvm::runtime::PackedFunc(nullptr);
+            decode_graph_.unbind();
+            kernel_cache_ = KernelBinaryCache();
+            kernel_cache_dirty_ = false;
+            native_sampling_ = false;
+            prefix_cached_ = false;
+            shipped_prefix_.clear();
+            subject_prefix_cached_ = 0;
+            context_cache_.clear();
+            prefix_tree_.clear();
+            context_entered_ = false;
+            conversation_subject_ = kSubjectGeneral;
+            capabilities_ = 0;
+            speculative_.detach();
+            draft_module_ = tvm::runtime::Module(nullptr);
+            draft_evicted_ = false;
+            embed_ = tvm::runtime::PackedFunc(nullptr);
+            embed_batch_ = tvm::runtime::PackedFunc(nullptr);
+            embedder_module_ = tvm::runtime::Module(nullptr);
+            residency_.clear();
+            chat_create_ = nullptr;
+            
+            // Create an empty module to replace the current one
+            module_ = tvm::runtime::Module(nullptr);
+            
+            initialized = false;
+            module_configured_ = false;
+            turn_count_ = 0;
+            // Parked KV went away with the module
+            for (auto& entry : sessions_) {
+                forget_session(entry.first, entry.second);
+            }
+            // The module's blocks are in the free lists now
+            alloc_steps_ = AllocStepStats();
+            device_pool::trim();
+            if (owns_pager_) {
+                layer_pager::instance().stop();
+                owns_pager_ = false;
+            }
+            // Last, once nothing points into it
+            if (model_lib_handle_ != nullptr) {
+                dlclose(model_lib_handle_);
+                model_lib_handle_ = nullptr;
+            }
+        }
+    }
+};
+
+// Global engine instance
+std::unique_ptr<RealMlcEngine> g_mlc_engine;
+
+// Serializes generation between blocking calls and the async request worker
+static std::mutex g_engine_mutex;
+
+// Held by the generation setters and wherever g_mlc_engine is replaced, only to
+// keep the engine alive while a setter publishes to it: setters never wait for
+// a generation. Taken before g_engine_mutex, which it then only try-locks.
+static std::mutex g_settings_mutex;
+
+// Runs `set` on the engine from any thread. What it queues (settings that touch
+// the module) is applied now if the engine is idle, else by the next turn.
+template <typename Set>
+static void change_engine_settings(const char* what, Set set) {
+    std::lock_guard<std::mutex> lock(g_settings_mutex);
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    try {
+        set(*g_mlc_engine);
+        std::unique_lock<std::mutex> engine_lock(g_engine_mutex, std::try_to_lock);
+        if (engine_lock.owns_lock()) {
+            g_mlc_engine->apply_pending_settings();
+        }
+    } catch (const std::exception& e) {
+        LOGE("Exception in %s: %s", what, e.what());
+    }
+}
+
+// Async generateResponse requests, run on their own persistent worker
+static AsyncRequestTable& async_requests() {
+    static AsyncRequestTable* table = [] {
+        auto* t = new AsyncRequestTable("MlcAsyncWorker", engine_heap::attach_thread);
+        // Runs while the worker holds g_engine_mutex, so the engine cannot go away
+        t->set_abort_hook([] {
+            if (g_mlc_engine) {
+                g_mlc_engine->abort();
+            }
+        });
+        return t;
+    }();
+    return *table;
+}
+
+// What makes two async requests the same generation, for joining one in flight
+// (AsyncRequestTable coalescing): the entry point, the conversation it runs in,
+// the config (or the defaults) and the prompt normalized as the response cache
+// normalizes it
+static std::string request_key(const char* kind, int64_t session, bool has_config, const GenerationConfig& config,
+                               const std::string& prompt) {
+    return std::string(kind) + '\x1e' + std::to_string(session) + '\x1e' +
+           (has_config ? config.identity() : std::string("default")) + '\x1e' + ResponseCache::normalize(prompt);
+}
+
+// Copy a Java string argument as UTF-8; null becomes ""
+static std::string jstring_to_string(JNIEnv* env, jstring jText) {
+    return jni_utf8(env, jText);
+}
+
+// Drafts are prefilled on their own low-priority thread, a few tokens per
+// engine lock, so a send or another request never waits long behind one
+static const int kDraftChunkTokens = 16;
+static std::mutex g_draft_mutex;
+static std::map<int64_t, std::string> g_pending_drafts;  // latest text per session, under g_draft_mutex
+static std::map<int64_t, std::string> g_streamed_inputs;  // appendInput text so far per session, likewise
+static bool g_draft_job_queued = false;
+
+static GenerationWorker& draft_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcDraftWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+// Continuous batching of submitBatchedGenerate requests. The scheduler runs on
+// its own worker, one step per engine lock, so blocking calls interleave with
+// the batch at token boundaries.
+static std::atomic<bool> g_batching_ready{false};  // engine has the batched entry points
+static std::mutex g_batch_mutex;
+static bool g_batch_job_queued = false;  // under g_batch_mutex
+
+// Stage latencies of every request this bridge served, for getMetrics()
+static LatencyMetrics& latency_metrics() {
+    static LatencyMetrics* metrics = new LatencyMetrics();
+    return *metrics;
+}
+
+// On-device or remote per request (routeRequest); not under the engine lock,
+// so a decision never waits behind a generation
+static std::mutex g_route_mutex;
+static std::atomic<float> g_thermal_headroom{-1.0f};  // last setDeviceState
+
+static RoutePolicy& route_policy() {
+    static RoutePolicy* policy = new RoutePolicy();
+    return *policy;
+}
+
+static BatchScheduler& batch_scheduler() {
+    static BatchScheduler* scheduler = [] {
+        BatchScheduler* created = new BatchScheduler();
+        created->set_metrics(&latency_metrics());
+        return created;
+    }();
+    return *scheduler;
+}
+
+static GenerationWorker& batch_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcBatchWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+// Chat turns in flight; the batch loop does not step while any is
+static std::mutex g_turn_mutex;
+static std::condition_variable g_turn_cond;
+static int g_interactive_turns = 0;  // under g_turn_mutex
+static int64_t g_last_turn_ms = 0;  // likewise; steady clock, when the last one ended
+
+// Sessions whose oldest turns are being folded into their summary
+// (conversation_memory.h), off the interactive path at idle priority
+static std::mutex g_memory_mutex;
+static std::set<int64_t> g_pending_memories;  // under g_memory_mutex
+static bool g_memory_job_queued = false;  // likewise
+
+static GenerationWorker& memory_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcMemoryWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+static void run_memory_job(JNIEnv* env);
+
+static void schedule_memories(const std::vector<int64_t>& sessions) {
+    if (sessions.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_memory_mutex);
+    g_pending_memories.insert(sessions.begin(), sessions.end());
+    if (!g_memory_job_queued) {
+        g_memory_job_queued = true;
+        if (!memory_worker().submit(jni_cache().vm, run_memory_job)) {
+            g_memory_job_queued = false;
+            LOGE("Memory worker is shutting down");
+        }
+    }
+}
+
+// Packs and spills offloaded KV (kv_offload.h) off the engine lock, and
+// stages sessions the UI is about to resume
+static std::atomic<bool> g_kv_offload_queued{false};
+
+static GenerationWorker& kv_offload_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcKvOffloadWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+static void schedule_kv_offload() {
+    if (g_kv_offload_queued.exchange(true)) {
+        return;
+    }
+    bool submitted = kv_offload_worker().submit(jni_cache().vm, [](JNIEnv*) {
+        setpriority(PRIO_PROCESS, 0, 10);
+        g_kv_offload_queued = false;
+        kv_offload::store().compact();
+    });
+    if (!submitted) {
+        g_kv_offload_queued = false;
+        LOGE("KV offload worker is shutting down");
+    }
+}
+
+// Follow-ups of the last turn prepared at idle priority (follow_up_prefetch.h)
+static std::mutex g_prefetch_mutex;
+static int64_t g_prefetch_session = -1;  // under g_prefetch_mutex
+static bool g_prefetch_job_queued = false;  // likewise
+// A chat turn or a keystroke is coming; the branch being answered stops at its next token
+static std::atomic<bool> g_prefetch_stop{false};
+
+static GenerationWorker& prefetch_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcPrefetchWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+static void run_prefetch_job(JNIEnv* env);
+
+static void schedule_prefetch(int64_t session) {
+    if (session < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_prefetch_mutex);
+    g_prefetch_session = session;
+    g_prefetch_stop = false;
+    if (!g_prefetch_job_queued) {
+        g_prefetch_job_queued = true;
+        if (!prefetch_worker().submit(jni_cache().vm, run_prefetch_job)) {
+            g_prefetch_job_queued = false;
+            LOGE("Prefetch worker is shutting down");
+        }
+    }
+}
+
+// Holds g_engine_mutex for a chat turn. Announcing the turn first parks the
+// batch at its next token boundary instead of racing it for the lock.
+class InteractiveTurn {
+public:
+    // `enqueued` is when the request was made, for requests that queued before getting here
+    explicit InteractiveTurn(RequestTiming::Clock::time_point enqueued = RequestTiming::Clock::now()) {
+        auto start = std::chrono::steady_clock::now();
+        timing_.enqueued = enqueued;
+        {
+            std::lock_guard<std::mutex> lock(g_turn_mutex);
+            g_interactive_turns++;
+        }
+        g_prefetch_stop = true;
+        engine_lock_ = std::unique_lock<std::mutex>(g_engine_mutex);
+        batch_scheduler().record_wait(kPriorityInteractive, std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count());
+        timing_.admit();
+        boost_ = std::make_unique<thread_boost::Scope>(thread_boost::kModeInteractive);
+        busy_ = std::make_unique<stall::Busy>();
+        cost_ = std::make_unique<request_cost::Span>();
+        if (g_mlc_engine) {
+            g_mlc_engine->apply_pending_settings();
+            g_mlc_engine->set_request_timing(&timing_);
+        }
+    }
+    
+    ~InteractiveTurn() {
+        std::vector<int64_t> memories;
+        int64_t prefetch = -1;
+        if (g_mlc_engine) {
+            g_mlc_engine->set_request_timing(nullptr);
+            memories = g_mlc_engine->take_memory_due();
+            prefetch = g_mlc_engine->take_prefetch_due();
+        }
+        timing_.charge(cost_->process_us(), cost_->thread_us(), cost_->energy_mj());
+        latency_metrics().record(timing_);
+        busy_.reset();
+        boost_.reset();
+        engine_lock_.unlock();
+        {
+            std::lock_guard<std::mutex> lock(g_turn_mutex);
+            g_interactive_turns--;
+            g_last_turn_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        g_turn_cond.notify_all();
+        schedule_memories(memories);
+        schedule_prefetch(prefetch);
+    }
+    
+    InteractiveTurn(const InteractiveTurn&) = delete;
+    InteractiveTurn& operator=(const InteractiveTurn&) = delete;
+    
+private:
+    std::unique_lock<std::mutex> engine_lock_;
+    RequestTiming timing_;
+    std::unique_ptr<request_cost::Span> cost_;  // from admission, when the turn has the engine
+    std::unique_ptr<stall::Busy> busy_;  // while the turn has the engine
+    std::unique_ptr<thread_boost::Scope> boost_;  // likewise
+};
+
+// engine_async generations in the batch, by request id. The batch loop reports
+// their prefill and end here and their text through BatchSequence::on_text.
+static std::mutex g_async_generations_mutex;
+static std::unordered_map<int64_t, std::shared_ptr<engine_async::Generation>> g_async_generations;
+
+static std::shared_ptr<engine_async::Generation> async_generation(int64_t request, bool remove) {
+    std::lock_guard<std::mutex> lock(g_async_generations_mutex);
+    auto it = g_async_generations.find(request);
+    if (it == g_async_generations.end()) {
+        return nullptr;
+    }
+    std::shared_ptr<engine_async::Generation> generation = it->second;
+    if (remove) {
+        g_async_generations.erase(it);
+    }
+    return generation;
+}
+
+static void run_batch_job(JNIEnv* env) {
+    while (true) {
+        std::vector<BatchScheduler::Finished> finished;
+        bool more = false;
+        {
+            std::unique_lock<std::mutex> lock(g_turn_mutex);
+            g_turn_cond.wait(lock, [] { return g_interactive_turns == 0; });
+        }
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            if (g_mlc_engine && g_batching_ready.load()) {
+                BatchScheduler::Backend backend = g_mlc_engine->batch_backend(
+                        [](int64_t request) { return async_requests().cancelled(request); },
+                        [](int64_t request, const std::string& text) { async_requests().append(request, text); });
+                backend.reserve = [](const BatchSequence& seq) {
+                    // Submitted prompts wait in the request table until their prefill
+                    return g_mlc_engine->batch_reservation(
+                            seq, seq.prompt.empty() ? async_requests().prompt(seq.request) : seq.prompt);
+                };
+                auto prefill = backend.prefill;
+                backend.prefill = [prefill](BatchSequence& seq) {
+                    if (!async_requests().start(seq.request, &seq.prompt)) {
+                        seq.next_token = -1;  // cancelled or released while waiting
+                        return true;
+                    }
+                    bool ok = prefill(seq);
+                    if (std::shared_ptr<engine_async::Generation> generation = async_generation(seq.request, false)) {
+                        generation->prefilled(ok, seq.timing.prompt_tokens);
+                    }
+                    return ok;
+                };
+                stall::Busy busy;
+                thread_boost::Scope boost(batch_scheduler().top_priority() == kPriorityInteractive
+                                                  ? thread_boost::kModeInteractive
+                                                  : thread_boost::kModeBackground);
+                shared_pool::PriorityScope pool_priority(batch_scheduler().top_priority());
+                more = batch_scheduler().step(backend, &finished);
+            } else {
+                // The engine closed under the batch; its KV went with it
+                BatchScheduler::Backend inert;
+                inert.release = [](BatchSequence&) {};
+                inert.emit = [](const BatchSequence&, const std::string&) {};
+                batch_scheduler().clear(inert, &finished);
+            }
+        }
+        for (const auto& done : finished) {
+            async_requests().complete(env, done.request, done.ok, done.error);
+            if (std::shared_ptr<engine_async::Generation> generation = async_generation(done.request, true)) {
+                generation->finish(done.ok, done.error);
+                async_requests().release(done.request);  // nobody polls it
+            }
+        }
+        // Continuations of engine_async operations, now that the engine is free
+        engine_async::ready_queue().run();
+        if (!more) {
+            // Checked under g_batch_mutex so a concurrent submit either sees the
+            // job still queued or this loop sees its request
+            std::lock_guard<std::mutex> lock(g_batch_mutex);
+            if (batch_scheduler().idle()) {
+                g_batch_job_queued = false;
+                return;
+            }
+        }
+    }
+}
+
+// Start the batch loop unless it is already running; `env` may be null off JNI threads
+static void kick_batch_worker(JNIEnv* env) {
+    JavaVM* vm = jni_cache().vm;
+    if (env != nullptr) {
+        env->GetJavaVM(&vm);
+    }
+    std::lock_guard<std::mutex> lock(g_batch_mutex);
+    if (!g_batch_job_queued) {
+        g_batch_job_queued = true;
+        // The loop serves every batched request; each is traced through its own RequestTiming
+        trace_context::Scope untraced(0);
+        if (!batch_worker().submit(vm, run_batch_job)) {
+            g_batch_job_queued = false;
+            LOGE("Batch worker is shutting down");
+        }
+    }
+}
+
+// A one-shot prompt run serially on the async worker, in a session of its own
+// so it sees no chat history. Used when the module cannot batch; `task` is
+// the TaskType it is generated as.
+static AsyncRequestTable::Run one_shot_run(bool has_config, GenerationConfig config,
+                                           std::function<void(const std::string&)> on_text,
+                                           std::vector<std::string> stop_strings = {}, int task = kTaskChat,
+                                           int priority = kPriorityInteractive) {
+    return [has_config, config, on_text, stop_strings, task, priority](
+            const std::string& text, const std::function<void(const std::string&)>& emit,
+            const std::atomic<bool>& cancelled, std::string& error) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (!g_mlc_engine) {
+            error = "Engine not initialized";
+            return false;
+        }
+        thread_boost::Scope boost(priority == kPriorityInteractive ? thread_boost::kModeInteractive
+                                                                   : thread_boost::kModeBackground);
+        shared_pool::PriorityScope pool_priority(priority);
+        if (cancelled.load()) {
+            return true;
+        }
+        int64_t session = g_mlc_engine->create_session();
+        if (session < 0) {
+            error = "Too many sessions open";
+            return false;
+        }
+        // Without a config, a seed set on it alone still applies over the engine defaults
+        GenerationConfig effective = has_config ? config : g_mlc_engine->default_config();
+        if (!has_config && config.seed >= 0) {
+            effective.seed = config.seed;
+        }
+        bool first = true;
+        bool failed = false;
+        StopStringMatcher stops(stop_strings);
+        g_mlc_engine->set_turn_task(task);
+        auto deliver = [&](const std::string& piece) {
+            if (!piece.empty()) {
+                emit(piece);
+                if (on_text) {
+                    on_text(piece);
+                }
+            }
+        };
+        g_mlc_engine->stream_in_session(session, text, [&](std::string token) {
+            if (first && token.rfind("Error:", 0) == 0) {
+                failed = true;
+                error = token.substr(6 + (token.size() > 6 && token[6] == ' ' ? 1 : 0));
+            }
+            first = false;
+            if (failed || stops.stopped()) {
+                return;
+            }
+            deliver(stops.empty() ? token : stops.push(token));
+            if (stops.stopped()) {
+                g_mlc_engine->abort();
+            }
+        }, effective);
+        if (!failed) {
+            deliver(stops.flush());
+        }
+        g_mlc_engine->set_turn_task(kTaskChat);
+        g_mlc_engine->close_session(session);
+        return !failed;
+    };
+}
+
+// generateBatch listener shared by the branches of one batch; the global ref
+// goes with the last of them, on whichever attached thread that is
+static std::atomic<int64_t> g_next_batch_group{1};
+
+class BatchTokenListener {
+public:
+    BatchTokenListener(JNIEnv* env, jobject listener, jmethodID on_token)
+        : listener_(env->NewGlobalRef(listener)), on_token_(on_token) {}
+    
+    ~BatchTokenListener() {
+        JNIEnv* env = attached_env();
+        if (env != nullptr) {
+            env->DeleteGlobalRef(listener_);
+        }
+    }
+    
+    BatchTokenListener(const BatchTokenListener&) = delete;
+    BatchTokenListener& operator=(const BatchTokenListener&) = delete;
+    
+    void call(int index, const std::string& text) {
+        JNIEnv* env = attached_env();
+        if (env == nullptr) {
+            return;
+        }
+        TraceSection trace("mlc:deliver");
+        jstring jText = env->NewStringUTF(text.c_str());
+        env->CallVoidMethod(listener_, on_token_, static_cast<jint>(index), jText);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+        }
+        env->DeleteLocalRef(jText);
+    }
+    
+private:
+    jobject listener_;
+    jmethodID on_token_;
+    
+    static JNIEnv* attached_env() {
+        JNIEnv* env = nullptr;
+        JavaVM* vm = jni_cache().vm;
+        if (vm == nullptr || vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+            return nullptr;
+        }
+        return env;
+    }
+};
+
+// summarizeDocument listener: onProgress(done, total) in summarization steps
+class SummaryProgressListener {
+public:
+    SummaryProgressListener(JNIEnv* env, jobject listener, jmethodID on_progress)
+        : listener_(env->NewGlobalRef(listener)), on_progress_(on_progress) {}
+    
+    ~SummaryProgressListener() {
+        JNIEnv* env = attached_env();
+        if (env != nullptr) {
+            env->DeleteGlobalRef(listener_);
+        }
+    }
+    
+    SummaryProgressListener(const SummaryProgressListener&) = delete;
+    SummaryProgressListener& operator=(const SummaryProgressListener&) = delete;
+    
+    void call(size_t done, size_t total) {
+        JNIEnv* env = attached_env();
+        if (env == nullptr) {
+            return;
+        }
+        env->CallVoidMethod(listener_, on_progress_, static_cast<jint>(done), static_cast<jint>(total));
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+        }
+    }
+    
+private:
+    jobject listener_;
+    jmethodID on_progress_;
+    
+    static JNIEnv* attached_env() {
+        JNIEnv* env = nullptr;
+        JavaVM* vm = jni_cache().vm;
+        if (vm == nullptr || vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+            return nullptr;
+        }
+        return env;
+    }
+};
+
+// One level of summarizeDocument: every input summarized under `instruction`,
+// as branches of one batch group when the module batches, else one after
+// another on this worker. `stream` gets the text of a lone input as it comes;
+// `on_step` each input's index and output as it completes (not when cut short).
+static bool summarize_level(const std::string& instruction, const std::vector<std::string>& inputs,
+                            const GenerationConfig& config, int priority, const std::atomic<bool>& cancelled,
+                            const std::function<void(const std::string&)>& stream,
+                            const std::function<void(size_t, const std::string&)>& on_step,
+                            std::vector<std::string>* outputs, std::string& error) {
+    outputs->assign(inputs.size(), std::string());
+    if (!g_batching_ready.load()) {
+        for (size_t i = 0; i < inputs.size() && !cancelled.load(); ++i) {
+            std::string& output = (*outputs)[i];
+            auto collect = [&output, &stream, &inputs](const std::string& text) {
+                output += text;
+                if (stream && inputs.size() == 1) {
+                    stream(text);
+                }
+            };
+            auto run = one_shot_run(true, config, collect, {}, kTaskSummary, priority);
+            if (!run(instruction + inputs[i], [](const std::string&) {}, cancelled, error)) {
+                return false;
+            }
+            if (cancelled.load()) {
+                return true;
+            }
+            on_step(i, output);
+        }
+        return true;
+    }
+    
+    JNIEnv* env = nullptr;
+    JavaVM* vm = jni_cache().vm;
+    if (vm == nullptr || vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        error = "Summary worker is not attached";
+        return false;
+    }
+    // Branch texts arrive on the batch worker
+    struct Texts {
+        std::mutex mutex;
+        std::vector<std::string> texts;
+    };
+    auto texts = std::make_shared<Texts>();
+    texts->texts.resize(inputs.size());
+    bool lone = inputs.size() == 1;
+    auto prefix = std::make_shared<const std::string>(instruction);
+    int64_t group = g_next_batch_group++;
+    std::vector<int64_t> ids;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        BatchSequence seq;
+        seq.priority = priority;
+        seq.task = kTaskSummary;
+        seq.config = config;
+        seq.group = group;
+        seq.index = static_cast<int>(i);
+        seq.group_size = static_cast<int>(inputs.size());
+        seq.prefix = prefix;
+        seq.on_text = [texts, stream, lone](int index, const std::string& text) {
+            {
+                std::lock_guard<std::mutex> lock(texts->mutex);
+                texts->texts[static_cast<size_t>(index)] += text;
+            }
+            if (lone && stream) {
+                stream(text);
+            }
+        };
+        seq.request = async_requests().enqueue(env, inputs[i], nullptr);
+        ids.push_back(seq.request);
+        batch_scheduler().enqueue(std::move(seq));
+    }
+    kick_batch_worker(env);
+    
+    std::vector<bool> finished(ids.size(), false);
+    size_t remaining = ids.size();
+    bool ok = true;
+    while (remaining > 0) {
+        if (cancelled.load()) {
+            for (int64_t id : ids) {
+                async_requests().cancel(id);
+            }
+        }
+        size_t first = 0;
+        while (finished[first]) first++;
+        async_requests().wait(ids[first], std::chrono::milliseconds(100));
+        for (size_t i = 0; i < ids.size(); ++i) {
+            int state = finished[i] ? kAsyncDone : async_requests().status(ids[i]);
+            if (finished[i] || state == kAsyncQueued || state == kAsyncRunning) {
+                continue;
+            }
+            finished[i] = true;
+            remaining--;
+            if (state == kAsyncFailed && ok) {
+                std::string text = async_requests().output(ids[i]);
+                error = text.rfind("Error: ", 0) == 0 ? text.substr(7) : text;
+                ok = false;
+                // The rest cannot complete the summary
+                for (int64_t id : ids) {
+                    async_requests().cancel(id);
+                }
+            } else if (state == kAsyncDone) {
+                std::string output;
+                {
+                    std::lock_guard<std::mutex> lock(texts->mutex);
+                    output = texts->texts[i];
+                }
+                on_step(i, output);
+            }
+        }
+    }
+    for (int64_t id : ids) {
+        async_requests().release(id);
+    }
+    std::lock_guard<std::mutex> lock(texts->mutex);
+    *outputs = std::move(texts->texts);
+    return ok;
+}
+
+// summarizeDocument's job on the async worker: split, then summarize level by
+// level (document_summary.h). Blocks that worker for the whole document.
+static AsyncRequestTable::Run summary_run(bool has_config, GenerationConfig config, size_t chunk_tokens,
+                                          int priority, std::shared_ptr<SummaryProgressListener> listener) {
+    return [has_config, config, chunk_tokens, priority, listener](
+            const std::string& text, const std::function<void(const std::string&)>& emit,
+            const std::atomic<bool>& cancelled, std::string& error) {
+        GenerationConfig final_config;
+        size_t budget = 0;
+        std::vector<std::string> inputs;
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            if (!g_mlc_engine) {
+                error = "Engine not initialized";
+                return false;
+            }
+            final_config = has_config ? config : g_mlc_engine->default_config();
+            final_config.json_schema.clear();
+            size_t instruction = g_mlc_engine->count_tokens(document_summary::kReduceInstruction);
+            budget = document_summary::chunk_budget(g_mlc_engine->context_window().window, instruction,
+                                                    document_summary::kMapTokens, chunk_tokens);
+            inputs = document_summary::split(text, budget, [](const std::string& chunk) {
+                return g_mlc_engine->count_tokens(chunk);
+            });
+        }
+        if (inputs.empty()) {
+            error = "Nothing to summarize";
+            return false;
+        }
+        GenerationConfig step_config = final_config;
+        step_config.max_gen_len = std::min(final_config.max_gen_len, document_summary::kMapTokens);
+        // Partial summaries per reduce step, assuming each is as long as it may be
+        size_t fan_in = std::max<size_t>(2, budget / (document_summary::kMapTokens + 8));
+        auto planned = [fan_in](size_t count) {
+            size_t steps = 0;
+            while (true) {
+                steps += count;
+                if (count <= 1) return steps;
+                count = (count + fan_in - 1) / fan_in;
+            }
+        };
+        size_t done = 0;
+        size_t total = planned(inputs.size());
+        auto report = [&]() {
+            if (listener) {
+                listener->call(done, std::max(total, done));
+            }
+        };
+        report();
+        LOGI("Summarizing %zu chunks of up to %zu tokens, about %zu steps", inputs.size(), budget, total);
+        
+        const char* instruction = document_summary::kMapInstruction;
+        while (!cancelled.load()) {
+            bool last = inputs.size() == 1;
+            const GenerationConfig& level_config = last ? final_config : step_config;
+            // Steps summarized before, for this document or another one sharing the text
+            std::vector<std::string> summaries(inputs.size());
+            std::vector<uint64_t> keys(inputs.size());
+            std::vector<size_t> pending;
+            {
+                std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+                if (!g_mlc_engine) {
+                    error = "Engine not initialized";
+                    return false;
+                }
+                uint64_t scope = g_mlc_engine->summary_scope(level_config);
+                for (size_t i = 0; i < inputs.size(); ++i) {
+                    keys[i] = document_summary::step_key(instruction, inputs[i], scope);
+                    if (!g_mlc_engine->cached_summary(keys[i], &summaries[i])) {
+                        pending.push_back(i);
+                    }
+                }
+            }
+            if (pending.size() < inputs.size()) {
+                LOGI("Summary steps from the cache: %zu of %zu", inputs.size() - pending.size(), inputs.size());
+                done += inputs.size() - pending.size();
+                report();
+            }
+            if (last && pending.empty()) {
+                emit(summaries[0]);
+                return true;
+            }
+            std::vector<std::string> pending_inputs;
+            for (size_t i : pending) {
+                pending_inputs.push_back(inputs[i]);
+            }
+            std::vector<std::string> generated;
+            bool ok = summarize_level(instruction, pending_inputs, level_config, priority, cancelled, emit,
+                                      [&](size_t, const std::string&) { done++; report(); }, &generated, error);
+            if (!ok) {
+                return false;
+            }
+            if (cancelled.load()) {
+                return true;  // partial outputs are not cached
+            }
+            std::vector<size_t> tokens;
+            {
+                std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+                if (!g_mlc_engine) {
+                    error = "Engine not initialized";
+                    return false;
+                }
+                for (size_t j = 0; j < pending.size(); ++j) {
+                    summaries[pending[j]] = std::move(generated[j]);
+                    g_mlc_engine->remember_summary(keys[pending[j]], summaries[pending[j]]);
+                }
+                if (last) {
+                    return true;
+                }
+                for (const std::string& summary : summaries) {
+                    tokens.push_back(g_mlc_engine->count_tokens(summary) + 4);  // "Part n:" and the break
+                }
+            }
+            inputs.clear();
+            for (const auto& range : document_summary::group(tokens, budget)) {
+                inputs.push_back(document_summary::reduce_input(summaries, range.first, range.second));
+            }
+            instruction = document_summary::kReduceInstruction;
+            total = done + planned(inputs.size());
+            report();
+        }
+        return true;
+    };
+}
+
+// Fold due sessions one at a time, each once no chat turn is waiting
+static void run_memory_job(JNIEnv* /* env */) {
+    setpriority(PRIO_PROCESS, 0, 19);
+    const std::atomic<bool> never_cancelled{false};
+    while (true) {
+        int64_t session;
+        {
+            std::lock_guard<std::mutex> lock(g_memory_mutex);
+            if (g_pending_memories.empty()) {
+                g_memory_job_queued = false;
+                return;
+            }
+            session = *g_pending_memories.begin();
+            g_pending_memories.erase(g_pending_memories.begin());
+        }
+        {
+            std::unique_lock<std::mutex> lock(g_turn_mutex);
+            g_turn_cond.wait(lock, [] { return g_interactive_turns == 0; });
+        }
+        RealMlcEngine::MemoryPlan plan;
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            if (!g_mlc_engine || !g_mlc_engine->plan_memory(session, &plan)) {
+                continue;
+            }
+        }
+        std::vector<std::string> outputs;
+        std::string error;
+        bool ok = summarize_level(conversation_memory::kInstruction, {plan.input}, plan.config, kPriorityPrefetch,
+                                  never_cancelled, nullptr, [](size_t, const std::string&) {}, &outputs, error);
+        if (!ok || outputs.empty()) {
+            LOGE("Error folding turns of session %lld: %s", static_cast<long long>(session), error.c_str());
+            continue;
+        }
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (g_mlc_engine && !g_mlc_engine->apply_memory(session, plan, conversation_memory::trimmed(outputs[0]))) {
+            LOGI("Session %lld changed while its turns were folded; summary dropped",
+                 static_cast<long long>(session));
+        }
+    }
+}
+
+// Follow-ups of the session whose turn ended last, one branch per engine hold,
+// until the caps say stop or a newer turn, a chat request or a keystroke comes
+static void run_prefetch_job(JNIEnv* /* env */) {
+    setpriority(PRIO_PROCESS, 0, 19);
+    auto preempt = [] {
+        if (g_prefetch_stop.load()) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(g_turn_mutex);
+        return g_interactive_turns > 0;
+    };
+    while (true) {
+        int64_t session;
+        {
+            std::lock_guard<std::mutex> lock(g_prefetch_mutex);
+            if (g_prefetch_session < 0) {
+                g_prefetch_job_queued = false;
+                return;
+            }
+            session = g_prefetch_session;
+            g_prefetch_session = -1;
+        }
+        bool more = true;
+        while (more) {
+            {
+                std::unique_lock<std::mutex> lock(g_turn_mutex);
+                g_turn_cond.wait(lock, [] { return g_interactive_turns == 0; });
+            }
+            {
+                std::lock_guard<std::mutex> lock(g_prefetch_mutex);
+                if (g_prefetch_stop.load() || g_prefetch_session >= 0) {
+                    break;
+                }
+            }
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            thread_boost::Scope boost(thread_boost::kModeBackground);
+            shared_pool::PriorityScope pool_priority(kPriorityPrefetch);
+            more = g_mlc_engine && g_mlc_engine->prefetch_follow_up(session, preempt);
+        }
+    }
+}
+
+static void run_draft_job(JNIEnv* /* env */) {
+    setpriority(PRIO_PROCESS, 0, 10);
+    while (true) {
+        int64_t session;
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(g_draft_mutex);
+            if (g_pending_drafts.empty()) {
+                g_draft_job_queued = false;
+                return;
+            }
+            session = g_pending_drafts.begin()->first;
+            text = g_pending_drafts.begin()->second;
+        }
+        bool more = false;
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            bool current;
+            bool streamed;
+            {
+                // A send may have consumed this draft while we waited for the engine
+                std::lock_guard<std::mutex> lock(g_draft_mutex);
+                auto it = g_pending_drafts.find(session);
+                current = it != g_pending_drafts.end() && it->second == text;
+                streamed = g_streamed_inputs.count(session) != 0;
+            }
+            if (current && g_mlc_engine && !streamed) {
+                g_mlc_engine->note_draft_text(session, text);
+            }
+            more = current && g_mlc_engine &&
+                   g_mlc_engine->update_draft(session, text, kDraftChunkTokens, streamed);
+        }
+        {
+            // Done unless the draft is incomplete or was edited meanwhile
+            std::lock_guard<std::mutex> lock(g_draft_mutex);
+            auto it = g_pending_drafts.find(session);
+            if (it != g_pending_drafts.end() && !more && it->second == text) {
+                g_pending_drafts.erase(it);
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+// A turn consumes or drops its session's draft; drop the queued text with it
+static void forget_pending_draft(int64_t session) {
+    std::lock_guard<std::mutex> lock(g_draft_mutex);
+    g_pending_drafts.erase(session);
+    g_streamed_inputs.erase(session);
+}
+
+// Queue `text` as the draft of `session` and start the draft job; under g_draft_mutex
+static void schedule_draft(JNIEnv* env, int64_t session, std::string text) {
+    g_pending_drafts[session] = std::move(text);
+    if (!g_draft_job_queued) {
+        g_draft_job_queued = true;
+        JavaVM* vm = nullptr;
+        env->GetJavaVM(&vm);
+        draft_worker().submit(vm, run_draft_job);
+    }
+}
+
+extern "C" {
+
+// Pin the classes and method IDs used on the request path
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* /* reserved */) {
+    jint version = jni_cache_on_load(vm);
+    JNIEnv* env = nullptr;
+    if (version != JNI_ERR && vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) {
+        generation_config_on_load(env);
+    }
+    return version;
+}
+
+// Backend requested for the next initializeEngine; the engine may not exist yet
+static std::atomic<int> g_compute_backend{kBackendAuto};
+static std::atomic<int> g_low_ram_mode{layer_pager::kModeAuto};
+// Thread pool choice, likewise
+static std::atomic<int> g_thread_affinity{kAffinityAuto};
+static std::atomic<int> g_thread_workers{0};
+// Kernel tuning database in app storage, likewise
+static std::mutex g_tuning_mutex;
+static std::string g_tuning_path;
+static std::string g_kernel_cache_dir;  // under g_tuning_mutex
+// Key device profiles are signed with, and the last one imported; likewise
+static std::string g_profile_key;
+static device_profile::DeviceProfile g_device_profile;
+static std::atomic<bool> g_tuning_cancelled{false};
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setComputeBackend(
+        JNIEnv* env,
+        jobject /* this */,
+        jint backend) {
+    
+    if (backend < kBackendAuto || backend > kBackendCpu) {
+        LOGE("Unknown compute backend %d", backend);
+        return;
+    }
+    g_compute_backend = backend;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setLowRamMode(
+        JNIEnv* env,
+        jobject /* this */,
+        jint mode) {
+    
+    if (mode < layer_pager::kModeAuto || mode > layer_pager::kModeOff) {
+        LOGE("Unknown low-RAM mode %d", mode);
+        return;
+    }
+    g_low_ram_mode = mode;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_repackWeights(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path) {
+    
+    const char* path = env->GetStringUTFChars(model_path, nullptr);
+    std::string model_dir(path);
+    env->ReleaseStringUTFChars(model_path, path);
+    // Keyed by the device the next initializeEngine picks
+    ComputeDevice device = select_compute_device(static_cast<ComputeBackend>(g_compute_backend.load()));
+    return mmap_loader::repack_ndarray_cache(model_dir, device.device.device_type) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_requantizeWeights(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path,
+        jint scheme) {
+    
+    if (requantize::scheme_tag(scheme) == nullptr) {
+        LOGE("Unknown requantization scheme %d", scheme);
+        return JNI_FALSE;
+    }
+    return mmap_loader::requantize_ndarray_cache(jni_utf8(env, model_path), scheme) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getWeightFormats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    return static_cast<jint>(mmap_loader::accepted_formats());
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_packWeights(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path) {
+    
+    return mmap_loader::pack_shards(jni_utf8(env, model_path)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_writeModelManifest(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path) {
+    
+    std::string model_dir = jni_utf8(env, model_path);
+    std::string lib_dir = model_dir + "/lib";
+    std::string lib = select_model_lib(lib_dir, model_lib_base(lib_dir, model_config::load(model_dir).model_lib));
+    if (access(lib.c_str(), R_OK) != 0) {
+        LOGE("No model library in %s/lib; manifest not written", model_dir.c_str());
+        return JNI_FALSE;
+    }
+    bool ok = model_manifest::write(model_dir, lib.substr(model_dir.size() + 1));
+    LOGI("Model manifest %s for %s", ok ? "written" : "could not be written", model_dir.c_str());
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_applyWeightDelta(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path,
+        jstring delta_path) {
+    
+    std::string model_dir = jni_utf8(env, model_path);
+    std::string delta = jni_utf8(env, delta_path);
+    std::string error;
+    auto started = std::chrono::steady_clock::now();
+    if (!weight_delta::apply(model_dir, delta, &error)) {
+        LOGE("Weight delta %s not applied: %s", delta.c_str(), error.c_str());
+        return JNI_FALSE;
+    }
+    LOGI("Weight delta %s applied in %lld ms", delta.c_str(),
+         static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - started).count()));
+    return JNI_TRUE;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openDownloadTarget(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring path,
+        jlong size) {
+    
+    if (size < 0) {
+        return 0;
+    }
+    std::string target = jni_utf8(env, path);
+    int64_t handle = download_sink::open_handle(target, static_cast<uint64_t>(size));
+    if (handle == 0) {
+        LOGE("Cannot preallocate %lld bytes for %s", static_cast<long long>(size), target.c_str());
+    }
+    return static_cast<jlong>(handle);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_writeDownloadRange(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlong offset,
+        jobject buffer,
+        jint length) {
+    
+    std::shared_ptr<download_sink::Sink> sink = download_sink::find_handle(handle);
+    auto* data = static_cast<const uint8_t*>(env->GetDirectBufferAddress(buffer));
+    if (!sink || data == nullptr || offset < 0 || length < 0 || env->GetDirectBufferCapacity(buffer) < length) {
+        return JNI_FALSE;
+    }
+    return sink->write(static_cast<uint64_t>(offset), data, static_cast<size_t>(length)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_closeDownloadTarget(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jboolean complete) {
+    
+    return download_sink::close_handle(handle, complete == JNI_TRUE) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_findDamagedChunks(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path,
+        jboolean full) {
+    
+    std::string model_dir = jni_utf8(env, model_path);
+    model_manifest::Manifest manifest = model_manifest::read(model_dir);
+    if (!manifest.loaded()) {
+        LOGI("No model manifest in %s; nothing to check chunks against", model_dir.c_str());
+        return nullptr;
+    }
+    std::vector<model_manifest::Damage> damage = model_manifest::damaged_ranges(model_dir, manifest, full == JNI_TRUE);
+    // Records the mtimes of the files that came out clean, for the next incremental check
+    if (!model_manifest::save(model_dir, manifest)) {
+        LOGE("Could not update the model manifest in %s", model_dir.c_str());
+    }
+    jobjectArray result = env->NewObjectArray(static_cast<jsize>(damage.size()), jni_cache().string_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < damage.size(); ++i) {
+        const model_manifest::Damage& range = damage[i];
+        LOGE("Damaged: %s bytes %llu+%llu", range.name.c_str(), static_cast<unsigned long long>(range.offset),
+             static_cast<unsigned long long>(range.length));
+        std::string text = std::to_string(range.offset) + " " + std::to_string(range.length) + " " +
+                           std::to_string(range.file_size) + " " + range.name;
+        jstring jText = env->NewStringUTF(text.c_str());
+        env->SetObjectArrayElement(result, static_cast<jsize>(i), jText);
+        env->DeleteLocalRef(jText);
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_verifyRepairedChunks(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path,
+        jstring file_name,
+        jlongArray jOffsets) {
+    
+    std::string model_dir = jni_utf8(env, model_path);
+    std::string name = jni_utf8(env, file_name);
+    jsize count = jOffsets != nullptr ? env->GetArrayLength(jOffsets) : 0;
+    std::vector<jlong> raw(static_cast<size_t>(count));
+    if (count > 0) {
+        env->GetLongArrayRegion(jOffsets, 0, count, raw.data());
+    }
+    std::vector<uint64_t> offsets(raw.begin(), raw.end());
+    model_manifest::Manifest manifest = model_manifest::read(model_dir);
+    if (!manifest.loaded() || !model_manifest::verify_repaired(model_dir, manifest, name, offsets)) {
+        LOGE("Repaired chunks of %s still differ from the manifest", name.c_str());
+        return JNI_FALSE;
+    }
+    return model_manifest::save(model_dir, manifest) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_sha256Files(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jPaths,
+        jobject jListener) {
+    
+    jsize count = jPaths != nullptr ? env->GetArrayLength(jPaths) : 0;
+    std::vector<std::string> paths;
+    for (jsize i = 0; i < count; ++i) {
+        auto jPath = static_cast<jstring>(env->GetObjectArrayElement(jPaths, i));
+        paths.push_back(jni_utf8(env, jPath));
+        env->DeleteLocalRef(jPath);
+    }
+    jmethodID on_progress = jListener != nullptr ? jni_lookup_method(env, jListener, "onProgress", "(JJ)V") : nullptr;
+    auto started = std::chrono::steady_clock::now();
+    // Progress is reported from this thread while the pool hashes
+    std::vector<std::string> digests =
+        sha256::hash_files(paths, [env, jListener, on_progress](uint64_t done, uint64_t total) {
+            if (on_progress == nullptr) {
+                return;
+            }
+            env->CallVoidMethod(jListener, on_progress, static_cast<jlong>(done), static_cast<jlong>(total));
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+            }
+        });
+    LOGI("Hashed %d files in %lld ms (%s)", static_cast<int>(count),
+         static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - started).count()),
+         sha256::hardware_sha2() ? "SHA-2 instructions" : "scalar");
+    
+    jobjectArray result = env->NewObjectArray(count, jni_cache().string_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (jsize i = 0; i < count; ++i) {
+        jstring jDigest = env->NewStringUTF(digests[i].c_str());
+        env->SetObjectArrayElement(result, i, jDigest);
+        env->DeleteLocalRef(jDigest);
+    }
+    return result;
+}
+
+// What startup no longer probes: the directories, the manifest against them and
+// the TVM registry. One line per entry, logged and returned.
+static std::string model_diagnostics(const std::string& model_dir, bool hashes) {
+    std::string report;
+    auto line = [&report](const std::string& text) {
+        LOGI("%s", text.c_str());
+        report += text + "\n";
+    };
+    for (const std::string& dir : {model_dir, model_dir + "/lib"}) {
+        DIR* listing = opendir(dir.c_str());
+        if (listing == nullptr) {
+            line("Cannot open " + dir);
+            continue;
+        }
+        line("Contents of " + dir + ":");
+        while (dirent* entry = readdir(listing)) {
+            struct stat st;
+            if (entry->d_name[0] != '.' && stat((dir + "/" + entry->d_name).c_str(), &st) == 0) {
+                line("  " + std::string(entry->d_name) + " " + std::to_string(static_cast<long long>(st.st_size)));
+            }
+        }
+        closedir(listing);
+    }
+    
+    model_manifest::Manifest manifest = model_manifest::read(model_dir);
+    if (!manifest.loaded()) {
+        line("No model manifest; startup probes the directory");
+    } else {
+        line("Manifest: " + std::to_string(manifest.files.size()) + " files, library " + manifest.model_lib);
+        std::vector<std::string> bad = model_manifest::verify(model_dir, manifest, hashes);
+        for (const std::string& name : bad) {
+            line("  Differs from the manifest: " + name);
+        }
+        if (bad.empty()) {
+            line(hashes ? "  Every file matches by size and hash" : "  Every file matches by size");
+        }
+    }
+    
+    std::string pack = model_dir + "/" + shard_pack::kFileName;
+    if (access(pack.c_str(), F_OK) == 0) {
+        line(!hashes ? "Shards packed in " + pack
+                     : mmap_loader::verify_pack(model_dir) ? "Every shard in " + pack + " matches its hash"
+                                                           : "Damaged or stale pack " + pack);
+    }
+    
+    auto registry_names = tvm::runtime::Registry::ListNames();
+    line("TVM registry functions (" + std::to_string(registry_names.size()) + "):");
+    for (const auto& name : registry_names) {
+        line("  " + std::string(name));
+    }
+    return report;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getModelDiagnostics(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path,
+        jboolean check_hashes) {
+    
+    return env->NewStringUTF(model_diagnostics(jni_utf8(env, model_path), check_hashes == JNI_TRUE).c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setLockHotWeights(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean lock) {
+    
+    mmap_loader::set_lock_hot_tensors(lock == JNI_TRUE);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getComputeBackend(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    return g_mlc_engine ? static_cast<jint>(g_mlc_engine->compute_backend()) : kBackendAuto;
+}
+
+static void stop_job_windows();
+
+// Battery-saver profile (power_profile.h), decided from setDeviceState and setPowerProfile
+static std::mutex g_power_mutex;
+static int g_power_mode = kPowerAuto;  // under g_power_mutex
+static float g_power_threshold = power_profile::kDefaultThresholdPercent;  // likewise
+static DeviceState g_power_state;  // likewise; as of the last setDeviceState
+static bool g_power_reported = false;  // likewise; setDeviceState was called
+static std::string g_base_model_dir;  // likewise; the model as loaded by the app, not its saver build
+static std::atomic<int> g_power_profile{kProfileNormal};
+
+static GenerationWorker& power_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcPowerWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+// The saver build of `model_dir` while the saver profile is on and one ships; else `model_dir`
+static std::string profile_model_dir(const std::string& model_dir) {
+    if (g_power_profile.load() == kProfileSaver) {
+        std::string saver = power_profile::saver_model_dir(model_dir);
+        if (!saver.empty()) {
+            return saver;
+        }
+    }
+    return model_dir;
+}
+
+static bool reload_engine(const std::string& model_dir);
+
+// Decide the profile again. The engine follows at once; a change of model
+// build reloads on the power worker, which waits for the running request.
+static void update_power_profile() {
+    int next;
+    std::string base;
+    {
+        std::lock_guard<std::mutex> lock(g_power_mutex);
+        int current = g_power_profile.load();
+        next = power_profile::decide(g_power_mode, g_power_state, g_power_threshold,
+                                     static_cast<PowerProfile>(current));
+        if (next == current) {
+            return;
+        }
+        g_power_profile = next;
+        base = g_base_model_dir;
+    }
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_mlc_engine->set_saver(next == kProfileSaver);
+    }
+    if (base.empty() || power_profile::saver_model_dir(base).empty()) {
+        return;
+    }
+    // Reads the profile when it runs, so a quick flip back reloads nothing
+    bool queued = power_worker().submit(jni_cache().vm, [](JNIEnv* /* env */) {
+        std::string base;
+        {
+            std::lock_guard<std::mutex> lock(g_power_mutex);
+            base = g_base_model_dir;
+        }
+        std::string target = profile_model_dir(base);
+        std::string current;
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            if (g_mlc_engine) {
+                current = g_mlc_engine->model_dir();
+            }
+        }
+        if (!base.empty() && !current.empty() && target != current) {
+            LOGI("Power profile switch: loading %s", target.c_str());
+            reload_engine(target);
+        }
+    });
+    if (!queued) {
+        LOGE("Power worker is shutting down");
+    }
+}
+
+// The process-wide settings a new engine starts from; later changes reach it through the setters
+static void configure_engine(RealMlcEngine& engine) {
+    engine.set_saver(g_power_profile.load() == kProfileSaver);
+    engine.set_thread_config(static_cast<ThreadAffinity>(g_thread_affinity.load()), g_thread_workers.load());
+    engine.set_preferred_backend(static_cast<ComputeBackend>(g_compute_backend.load()));
+    engine.set_low_ram_mode(static_cast<layer_pager::Mode>(g_low_ram_mode.load()));
+    std::lock_guard<std::mutex> lock(g_tuning_mutex);
+    engine.set_tuning_path(g_tuning_path);
+    engine.set_kernel_cache_dir(g_kernel_cache_dir);
+    engine.set_device_profile(g_device_profile);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_initializeEngine(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jModelPath) {
+    
+    const char* model_path = env->GetStringUTFChars(jModelPath, nullptr);
+    LOGI("Initializing MLC-LLM engine with model path: %s", model_path);
+    
+    try {
+        // Create the engine if it doesn't exist
+        if (!g_mlc_engine) {
+            std::lock_guard<std::mutex> settings_lock(g_settings_mutex);
+            g_mlc_engine = std::make_unique<RealMlcEngine>();
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_power_mutex);
+            g_base_model_dir = model_path;
+        }
+        
+        // Initialize the engine
+        g_batching_ready = false;
+        configure_engine(*g_mlc_engine);
+        std::string model_dir = profile_model_dir(model_path);
+        startup::timeline().begin(model_dir);
+        bool success = g_mlc_engine->initialize(model_dir);
+        startup::timeline().finish(success);
+        g_batching_ready = success && g_mlc_engine->batching_ready();
+        
+        // Clean up
+        env->ReleaseStringUTFChars(jModelPath, model_path);
+        
+        return success ? JNI_TRUE : JNI_FALSE;
+    } 
+    catch (const std::exception& e) {
+        LOGE("Exception in initializeEngine: %s", e.what());
+        env->ReleaseStringUTFChars(jModelPath, model_path);
+        return JNI_FALSE;
+    }
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getStartupTimeline(
+        JNIEnv* env,
+        jobject /* this */,
+        jint launches) {
+    return env->NewStringUTF(startup::timeline().to_json(static_cast<size_t>(std::max(0, launches))).c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_recordStartupPhase(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jName,
+        jfloat wallMs,
+        jfloat cpuMs) {
+    
+    startup::PhaseRecord record;
+    record.name = jstring_to_string(env, jName);
+    record.wall_ms = wallMs;
+    record.cpu_ms = cpuMs;
+    startup::timeline().add_early(std::move(record));
+}
+
+// Swap the engine for one on `model_dir`: loaded alongside when both fit, in place otherwise
+static bool reload_engine(const std::string& model_dir) {
+    try {
+        bool alongside = false;
+        std::function<void(int64_t, int64_t)> prefill_progress;
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            alongside = g_mlc_engine && g_mlc_engine->can_load_alongside();
+            if (g_mlc_engine) {
+                prefill_progress = g_mlc_engine->prefill_progress();
+            }
+        }
+        auto next = std::make_unique<RealMlcEngine>();
+        configure_engine(*next);
+        next->set_prefill_progress(prefill_progress);
+        auto started = std::chrono::steady_clock::now();
+        
+        if (!alongside) {
+            // The old engine has to go first: requests wait for the load
+            LOGI("Reloading %s in place", model_dir.c_str());
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            g_batching_ready = false;
+            if (g_mlc_engine) {
+                g_mlc_engine->close();
+            }
+            {
+                std::lock_guard<std::mutex> settings_lock(g_settings_mutex);
+                g_mlc_engine.swap(next);
+            }
+            next.reset();
+            startup::timeline().begin(model_dir);
+            bool success = g_mlc_engine->initialize(model_dir);
+            startup::timeline().finish(success);
+            g_batching_ready = success && g_mlc_engine->batching_ready();
+            return success;
+        }
+        
+        // Loads while the old engine keeps serving; a failure leaves it in place
+        LOGI("Loading %s alongside the running model", model_dir.c_str());
+        startup::timeline().begin(model_dir);
+        bool loaded = next->initialize(model_dir);
+        startup::timeline().finish(loaded);
+        if (!loaded) {
+            LOGE("Reload of %s failed; the running model stays", model_dir.c_str());
+            return false;
+        }
+        {
+            // Between requests: every request path holds g_engine_mutex
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            std::lock_guard<std::mutex> settings_lock(g_settings_mutex);
+            g_mlc_engine.swap(next);
+            g_batching_ready = g_mlc_engine->batching_ready();
+        }
+        {
+            // Drafts were for sessions of the old model
+            std::lock_guard<std::mutex> lock(g_draft_mutex);
+            g_pending_drafts.clear();
+            g_streamed_inputs.clear();
+        }
+        next->close();
+        next.reset();
+        LOGI("Switched to %s after %lld ms", model_dir.c_str(),
+             static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - started).count()));
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("Exception reloading %s: %s", model_dir.c_str(), e.what());
+        return false;
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_reloadEngine(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jModelPath) {
+    
+    std::string model_dir = jni_utf8(env, jModelPath);
+    {
+        std::lock_guard<std::mutex> lock(g_power_mutex);
+        g_base_model_dir = model_dir;
+    }
+    return reload_engine(profile_model_dir(model_dir)) ? JNI_TRUE : JNI_FALSE;
+}
+
+// generateResponse and its config/session variants; a null config uses the engine defaults
+static jstring generate_response_jni(JNIEnv* env, int64_t session, jstring jPrompt, jobject jConfig) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return env->NewStringUTF("Error: Engine not initialized");
+    }
+    
+    forget_pending_draft(session);
+    JniUtf8 prompt(env, jPrompt);
+    LOGV("Processing chat prompt: %s", prompt.c_str());
+    
+    try {
+        // Generate a response
+        std::string response;
+        {
+            InteractiveTurn turn;
+            response = g_mlc_engine->generate_in_session(
+                session, prompt.str(), generation_config_from_java(env, jConfig, g_mlc_engine->default_config()));
+        }
+        
+        return env->NewStringUTF(response.c_str());
+    } 
+    catch (const std::exception& e) {
+        LOGE("Exception in generateResponse: %s", e.what());
+        return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
+    }
+}
+
+// streamResponse and its config/session variants
+static void stream_response_jni(JNIEnv* env, int64_t session, jstring jPrompt, jobject jConfig, jobject jCallback) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    forget_pending_draft(session);
+    
+    // Get the callback interface method (pinned in JNI_OnLoad)
+    jmethodID callbackMethod = jni_function1_invoke(env, jCallback);
+    
+    if (callbackMethod == nullptr) {
+        LOGE("Failed to find callback method");
+        return;
+    }
+    
+    JniUtf8 prompt(env, jPrompt);
+    
+    // Create a callback function to pass to the C++ stream function
+    auto callback = [env, jCallback, callbackMethod](const std::string& token) {
+        TraceSection trace("mlc:deliver");
+        jstring jToken = env->NewStringUTF(token.c_str());
+        env->CallObjectMethod(jCallback, callbackMethod, jToken);
+        env->DeleteLocalRef(jToken);
+    };
+    
+    // Stream the response
+    {
+        InteractiveTurn turn;
+        g_mlc_engine->stream_in_session(session, prompt.str(), callback,
+                                        generation_config_from_java(env, jConfig, g_mlc_engine->default_config()));
+    }
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateResponse(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt) {
+    return generate_response_jni(env, kDefaultSession, jPrompt, nullptr);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateResponseWithConfig(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt,
+        jobject jConfig) {
+    return generate_response_jni(env, kDefaultSession, jPrompt, jConfig);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_streamResponse(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt,
+        jobject jCallback) {
+    stream_response_jni(env, kDefaultSession, jPrompt, nullptr, jCallback);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_streamResponseWithConfig(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt,
+        jobject jConfig,
+        jobject jCallback) {
+    stream_response_jni(env, kDefaultSession, jPrompt, jConfig, jCallback);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_createSession(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return -1;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return static_cast<jlong>(g_mlc_engine->create_session());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_closeSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->close_session(session);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateInSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jPrompt,
+        jobject jConfig) {
+    return generate_response_jni(env, session, jPrompt, jConfig);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_streamInSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jPrompt,
+        jobject jConfig,
+        jobject jCallback) {
+    stream_response_jni(env, session, jPrompt, jConfig, jCallback);
+}
+
+// A turn whose answer is a JSON deck or quiz; each item goes to onEvent(event, index, text)
+// as its object closes (json_stream.h), and the whole answer is returned
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_streamStructured(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jPrompt,
+        jobject jConfig,
+        jobject jListener) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return env->NewStringUTF("Error: Engine not initialized");
+    }
+    jmethodID on_event = jListener != nullptr ? jni_lookup_method(env, jListener, "onEvent", "(IILjava/lang/String;)V")
+                                              : nullptr;
+    if (on_event == nullptr) {
+        LOGE("Failed to find onEvent method");
+        return env->NewStringUTF("Error: No listener");
+    }
+    forget_pending_draft(session);
+    JniUtf8 prompt(env, jPrompt);
+    
+    json_stream::ItemStream items([env, jListener, on_event](int event, int index, const std::string& text) {
+        TraceSection trace("mlc:deliver");
+        jstring jText = env->NewStringUTF(text.c_str());
+        env->CallVoidMethod(jListener, on_event, static_cast<jint>(event), static_cast<jint>(index), jText);
+        env->DeleteLocalRef(jText);
+    });
+    std::string response;
+    {
+        InteractiveTurn turn;
+        g_mlc_engine->stream_in_session(session, prompt.str(), [&response, &items](const std::string& token) {
+            response += token;
+            items.push(token);
+        }, generation_config_from_java(env, jConfig, g_mlc_engine->default_config()));
+    }
+    items.finish();
+    return env->NewStringUTF(response.c_str());
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_prefillTokens(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jintArray jTokens) {
+    
+    if (!g_mlc_engine || jTokens == nullptr) {
+        return -1;
+    }
+    forget_pending_draft(session);
+    jsize len = env->GetArrayLength(jTokens);
+    std::vector<int> ids(static_cast<size_t>(len));
+    if (len > 0) {
+        env->GetIntArrayRegion(jTokens, 0, len, reinterpret_cast<jint*>(ids.data()));
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return static_cast<jint>(g_mlc_engine->prefill_tokens(session, std::move(ids)));
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in prefillTokens: %s", e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateTokens(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jobject jConfig) {
+    
+    if (!g_mlc_engine) {
+        return nullptr;
+    }
+    std::vector<int> reply;
+    try {
+        InteractiveTurn turn;
+        GenerationConfig config = generation_config_from_java(env, jConfig, g_mlc_engine->default_config());
+        if (!g_mlc_engine->generate_tokens(session, config, reply)) {
+            return nullptr;
+        }
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in generateTokens: %s", e.what());
+        return nullptr;
+    }
+    jintArray result = env->NewIntArray(static_cast<jsize>(reply.size()));
+    if (result != nullptr && !reply.empty()) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(reply.size()), reinterpret_cast<const jint*>(reply.data()));
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_resetSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_mlc_engine->reset_session(session);
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in resetSession: %s", e.what());
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_forkSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jint turn) {
+    
+    if (!g_mlc_engine) {
+        return -1;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return static_cast<jlong>(g_mlc_engine->fork_session(session, turn));
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in forkSession: %s", e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_regenerate(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jobject jConfig) {
+    
+    if (!g_mlc_engine) {
+        return env->NewStringUTF("Error: Engine not initialized");
+    }
+    try {
+        std::string response;
+        {
+            InteractiveTurn turn;
+            response = g_mlc_engine->regenerate(
+                session, generation_config_from_java(env, jConfig, g_mlc_engine->default_config()));
+        }
+        return env->NewStringUTF(response.c_str());
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in regenerate: %s", e.what());
+        return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_updateDraft(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jText) {
+    
+    std::string text = jstring_to_string(env, jText);
+    g_prefetch_stop = true;
+    std::lock_guard<std::mutex> lock(g_draft_mutex);
+    // Typing replaces streamed input
+    g_streamed_inputs.erase(session);
+    schedule_draft(env, session, std::move(text));
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_appendInput(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jBlock) {
+    
+    std::string block = jstring_to_string(env, jBlock);
+    std::lock_guard<std::mutex> lock(g_draft_mutex);
+    std::string& input = g_streamed_inputs[session];
+    input += block;
+    schedule_draft(env, session, input);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getStreamedInput(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    std::string input;
+    {
+        std::lock_guard<std::mutex> lock(g_draft_mutex);
+        auto it = g_streamed_inputs.find(session);
+        if (it != g_streamed_inputs.end()) {
+            input = it->second;
+        }
+    }
+    return env->NewStringUTF(input.c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_clearDraft(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    forget_pending_draft(session);
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->clear_draft(session);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setPrefillChunkSize(
+        JNIEnv* env,
+        jobject /* this */,
+        jint tokens) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_prefill_chunk_tokens(tokens);
+}
+
+// {prefill backend, decode backend, prefill ms/token, decode ms/token, handoff ms}
+static jfloatArray phase_plan_array(JNIEnv* env, const PhasePlan& plan) {
+    jfloat values[5] = {
+        static_cast<jfloat>(plan.prefill),
+        static_cast<jfloat>(plan.decode),
+        static_cast<jfloat>(plan.prefill_ms_per_token),
+        static_cast<jfloat>(plan.decode_ms_per_token),
+        static_cast<jfloat>(plan.handoff_ms),
+    };
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_calibratePhaseDevices(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    PhasePlan plan;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        plan = g_mlc_engine->calibrate_phase_devices();
+    }
+    return phase_plan_array(env, plan);
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPhasePlan(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    PhasePlan plan;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        plan = g_mlc_engine->phase_plan();
+    }
+    return phase_plan_array(env, plan);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setKernelTuningDir(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir) {
+    
+    const char* dir = env->GetStringUTFChars(jDir, nullptr);
+    std::string path = std::string(dir) + "/kernel-tuning.jsonl";
+    env->ReleaseStringUTFChars(jDir, dir);
+    {
+        std::lock_guard<std::mutex> lock(g_tuning_mutex);
+        g_tuning_path = path;
+    }
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_mlc_engine->set_tuning_path(path);
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setGovernor(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled,
+        jfloat targetTokensPerSecond) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_governor(enabled == JNI_TRUE, targetTokensPerSecond);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setPerformanceHints(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_performance_hints(enabled == JNI_TRUE);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setThreadBoost(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    
+    thread_boost::booster().set_enabled(enabled == JNI_TRUE);
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getThreadBoostStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        thread_boost::Stats stats = thread_boost::booster().stats();
+        values[0] = stats.enabled ? 1.0f : 0.0f;
+        values[1] = static_cast<jfloat>(stats.mode);
+        values[2] = stats.uclamp ? 1.0f : 0.0f;
+        values[3] = static_cast<jfloat>(stats.interactive_holds);
+        values[4] = static_cast<jfloat>(stats.background_holds);
+        values[5] = static_cast<jfloat>(stats.failures);
+    }
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPerformanceHintStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        performance_hint::Stats stats = g_mlc_engine->performance_hint_stats();
+        values[0] = stats.supported ? (stats.active ? 2.0f : 1.0f) : 0.0f;
+        values[1] = static_cast<jfloat>(stats.threads);
+        values[2] = static_cast<jfloat>(stats.target_ns / 1e6);
+        values[3] = static_cast<jfloat>(stats.reports);
+        values[4] = static_cast<jfloat>(stats.over_target);
+        values[5] = static_cast<jfloat>(stats.average_ms);
+    }
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setDeviceState(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat thermalHeadroom,
+        jfloat batteryPercent,
+        jboolean charging,
+        jboolean powerSave) {
+    
+    g_thermal_headroom.store(thermalHeadroom);
+    DeviceState state;
+    state.thermal_headroom = thermalHeadroom;
+    state.battery_percent = batteryPercent;
+    state.charging = charging == JNI_TRUE;
+    state.power_save = powerSave == JNI_TRUE;
+    {
+        std::lock_guard<std::mutex> lock(g_power_mutex);
+        g_power_state = state;
+        g_power_reported = true;
+    }
+    update_power_profile();
+    if (!state.charging) {
+        stop_job_windows();
+    }
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_device_state(state);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setPowerProfile(
+        JNIEnv* env,
+        jobject /* this */,
+        jint mode,
+        jfloat batteryThresholdPercent) {
+    
+    if (mode < kPowerAuto || mode > kPowerSaver) {
+        LOGE("Unknown power mode %d", mode);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_power_mutex);
+        g_power_mode = mode;
+        g_power_threshold = std::max(0.0f, std::min(100.0f, static_cast<float>(batteryThresholdPercent)));
+    }
+    update_power_profile();
+}
+
+// {profile, normal mJ/token, saver mJ/token, normal tokens, saver tokens,
+//  normal mean mW, saver mean mW, last mW, saver build loaded}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPowerStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+    values[0] = static_cast<jfloat>(g_power_profile.load());
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const power_profile::EnergyMeter& energy = g_mlc_engine->energy();
+        power_profile::EnergyMeter::Stats normal = energy.stats(kProfileNormal);
+        power_profile::EnergyMeter::Stats saver = energy.stats(kProfileSaver);
+        values[1] = normal.mj_per_token();
+        values[2] = saver.mj_per_token();
+        values[3] = static_cast<jfloat>(normal.tokens);
+        values[4] = static_cast<jfloat>(saver.tokens);
+        values[5] = normal.mean_mw();
+        values[6] = saver.mean_mw();
+        values[7] = energy.last_mw();
+        const std::string& dir = g_mlc_engine->model_dir();
+        std::string suffix = std::string("/") + power_profile::kSaverModelDir;
+        values[8] = dir.size() > suffix.size() && dir.compare(dir.size() - suffix.size(), suffix.size(), suffix) == 0
+                            ? 1.0f : 0.0f;
+    }
+    jfloatArray result = env->NewFloatArray(9);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 9, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setRoutingPolicy(
+        JNIEnv* env,
+        jobject /* this */,
+        jint mode,
+        jfloat hedgeMargin) {
+    
+    std::lock_guard<std::mutex> lock(g_route_mutex);
+    route_policy().configure(mode, hedgeMargin);
+}
+
+// {route, local TTFT ms, local total ms, remote TTFT ms, remote total ms}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_routeRequest(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring prompt,
+        jint maxTokens) {
+    
+    size_t prompt_tokens = jstring_to_string(env, prompt).size() / 4 + 1;
+    LatencyMetrics::Profile measured = latency_metrics().profile();
+    RoutePolicy::LocalProfile local;
+    local.prefill_tokens_per_s = measured.prefill_tokens_per_s;
+    local.tpot_ms = measured.tpot_ms;
+    local.request_ms = measured.e2e_ms;
+    local.thermal_headroom = g_thermal_headroom.load();
+    size_t queued = async_requests().in_flight();
+    {
+        std::lock_guard<std::mutex> lock(g_turn_mutex);
+        queued += static_cast<size_t>(std::max(0, g_interactive_turns));
+    }
+    RoutePolicy::Prediction p;
+    {
+        std::lock_guard<std::mutex> lock(g_route_mutex);
+        p = route_policy().predict(local, prompt_tokens, static_cast<size_t>(std::max(1, static_cast<int>(maxTokens))),
+                                   queued);
+    }
+    jfloat values[5] = {static_cast<jfloat>(p.route), static_cast<jfloat>(p.local_ttft_ms),
+                        static_cast<jfloat>(p.local_total_ms), static_cast<jfloat>(p.remote_ttft_ms),
+                        static_cast<jfloat>(p.remote_total_ms)};
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_recordRemoteLatency(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat ttftMs,
+        jfloat totalMs,
+        jint tokens,
+        jboolean ok) {
+    
+    std::lock_guard<std::mutex> lock(g_route_mutex);
+    route_policy().record_remote(ttftMs, totalMs, static_cast<size_t>(std::max(0, static_cast<int>(tokens))),
+                                 ok == JNI_TRUE);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_recordHedgeWinner(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean local) {
+    
+    std::lock_guard<std::mutex> lock(g_route_mutex);
+    route_policy().record_hedge(local == JNI_TRUE);
+}
+
+// {routed local, routed remote, hedged, hedges won locally, hedges won remotely, remote samples}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getRoutingStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[6];
+    {
+        std::lock_guard<std::mutex> lock(g_route_mutex);
+        const RoutePolicy& policy = route_policy();
+        values[0] = static_cast<jfloat>(policy.routed(RoutePolicy::kRouteLocal));
+        values[1] = static_cast<jfloat>(policy.routed(RoutePolicy::kRouteRemote));
+        values[2] = static_cast<jfloat>(policy.routed(RoutePolicy::kRouteHedge));
+        values[3] = static_cast<jfloat>(policy.hedge_local_wins());
+        values[4] = static_cast<jfloat>(policy.hedge_remote_wins());
+        values[5] = static_cast<jfloat>(policy.remote_samples());
+    }
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+// {level, tokens/s, target tokens/s, thermal headroom, battery percent}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getGovernorState(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[5] = {0.0f, 0.0f, 0.0f, -1.0f, -1.0f};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const GenerationGovernor& governor = g_mlc_engine->governor();
+        values[0] = static_cast<jfloat>(governor.level());
+        values[1] = governor.rate();
+        values[2] = governor.target_rate();
+        values[3] = governor.state().thermal_headroom;
+        values[4] = governor.state().battery_percent;
+    }
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_drainGovernorEvents(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::string events;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        events = g_mlc_engine->governor().drain_events();
+    }
+    return env->NewStringUTF(events.c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setThreadConfig(
+        JNIEnv* env,
+        jobject /* this */,
+        jint affinity,
+        jint workers) {
+    
+    if (affinity < kAffinityAuto || affinity > kAffinityMid) {
+        LOGE("Unknown thread affinity %d", affinity);
+        return;
+    }
+    g_thread_affinity = affinity;
+    g_thread_workers = workers;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_mlc_engine->set_thread_config(static_cast<ThreadAffinity>(affinity), workers);
+    }
+}
+
+// {affinity, workers} in use; workers 0 means one per core
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getThreadConfig(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    ThreadConfig config;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        config = g_mlc_engine->thread_config();
+    }
+    jint values[2] = {static_cast<jint>(config.affinity), static_cast<jint>(config.workers)};
+    jintArray result = env->NewIntArray(2);
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getWorkerPoolStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    return env->NewStringUTF(shared_pool::pool().stats_json().c_str());
+}
+
+// Read at initializeEngine, before the chat module builds any kernel
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setKernelCacheDir(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir) {
+    
+    const char* dir = env->GetStringUTFChars(jDir, nullptr);
+    std::lock_guard<std::mutex> lock(g_tuning_mutex);
+    g_kernel_cache_dir = dir;
+    env->ReleaseStringUTFChars(jDir, dir);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setDeviceProfileKey(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jKey) {
+    
+    std::string key = jni_utf8(env, jKey);
+    std::lock_guard<std::mutex> lock(g_tuning_mutex);
+    g_profile_key = key;
+}
+
+// Checked against the key now; matched against the phone and model when one loads
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_importDeviceProfile(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jBlob) {
+    
+    std::string blob = jni_utf8(env, jBlob);
+    device_profile::DeviceProfile profile;
+    {
+        std::lock_guard<std::mutex> lock(g_tuning_mutex);
+        if (!device_profile::DeviceProfile::from_blob(blob, g_profile_key, &profile)) {
+            LOGE("Device profile rejected: malformed or not signed with the profile key");
+            return JNI_FALSE;
+        }
+        g_device_profile = profile;
+    }
+    LOGI("Imported a device profile for %s, %s", profile.soc.c_str(), profile.driver.c_str());
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_mlc_engine->set_device_profile(profile);
+    }
+    return JNI_TRUE;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_exportDeviceProfile(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    device_profile::DeviceProfile profile;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        profile = g_mlc_engine->measured_profile();
+    }
+    std::string blob;
+    if (!profile.empty()) {
+        std::lock_guard<std::mutex> lock(g_tuning_mutex);
+        blob = profile.to_blob(g_profile_key);
+    }
+    return env->NewStringUTF(blob.c_str());
+}
+
+// One candidate per engine-lock hold, yielding to chat turns in between
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_tuneKernels(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong budgetMs) {
+    
+    g_tuning_cancelled = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budgetMs);
+    int measured = 0;
+    while (!g_tuning_cancelled.load() && std::chrono::steady_clock::now() < deadline) {
+        {
+            std::unique_lock<std::mutex> lock(g_turn_mutex);
+            g_turn_cond.wait(lock, [] { return g_interactive_turns == 0; });
+        }
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (!g_mlc_engine || g_mlc_engine->tune_next_kernel_variant() != 1) {
+            break;
+        }
+        measured++;
+    }
+    return measured;
+}
+
+// Debug only: takes the engine for the whole run, after any chat turn in flight
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_profileKernels(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir,
+        jint decodeSteps) {
+    
+    const char* chars = env->GetStringUTFChars(jDir, nullptr);
+    std::string dir = chars;
+    env->ReleaseStringUTFChars(jDir, chars);
+    {
+        std::unique_lock<std::mutex> lock(g_turn_mutex);
+        g_turn_cond.wait(lock, [] { return g_interactive_turns == 0; });
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    std::string result = g_mlc_engine ? g_mlc_engine->profile_kernels(dir, decodeSteps)
+                                      : std::string("Error: Engine not initialized");
+    return env->NewStringUTF(result.c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_cancelKernelTuning(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    g_tuning_cancelled = true;
+}
+
+// {measured candidates, all candidates}
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getKernelTuningProgress(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::pair<size_t, size_t> progress{0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        progress = g_mlc_engine->tuning_progress();
+    }
+    jint values[2] = {static_cast<jint>(progress.first), static_cast<jint>(progress.second)};
+    jintArray result = env->NewIntArray(2);
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+// Global ref to the PrefillProgressListener, replaced under g_engine_mutex
+static jobject g_prefill_listener = nullptr;
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setPrefillProgressListener(
+        JNIEnv* env,
+        jobject /* this */,
+        jobject jListener) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    if (g_prefill_listener != nullptr) {
+        env->DeleteGlobalRef(g_prefill_listener);
+        g_prefill_listener = nullptr;
+    }
+    jmethodID on_progress = jListener != nullptr ? jni_lookup_method(env, jListener, "onProgress", "(II)V") : nullptr;
+    if (on_progress == nullptr) {
+        g_mlc_engine->set_prefill_progress(nullptr);
+        return;
+    }
+    g_prefill_listener = env->NewGlobalRef(jListener);
+    // Runs on whichever attached thread is generating
+    g_mlc_engine->set_prefill_progress([on_progress](int64_t done, int64_t total) {
+        JNIEnv* thread_env = nullptr;
+        JavaVM* vm = jni_cache().vm;
+        if (vm == nullptr || vm->GetEnv(reinterpret_cast<void**>(&thread_env), JNI_VERSION_1_6) != JNI_OK) {
+            return;
+        }
+        thread_env->CallVoidMethod(g_prefill_listener, on_progress, static_cast<jint>(done), static_cast<jint>(total));
+        if (thread_env->ExceptionCheck()) {
+            thread_env->ExceptionClear();
+        }
+    });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setKvBudget(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong bytes) {
+    
+    if (!g_mlc_engine || bytes < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_kv_budget(static_cast<uint64_t>(bytes));
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setMemoryBudget(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong bytes,
+        jlong reserveBytes) {
+    
+    if (!g_mlc_engine || bytes < 0 || reserveBytes < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_memory_budget(static_cast<uint64_t>(bytes), static_cast<uint64_t>(reserveBytes));
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getMemoryAdmission(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::string json = "{}";
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        json = g_mlc_engine->memory_admission_json();
+    }
+    return env->NewStringUTF(json.c_str());
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_trimMemory(
+        JNIEnv* env,
+        jobject /* this */,
+        jint level) {
+    
+    if (!g_mlc_engine) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return static_cast<jlong>(g_mlc_engine->trim_memory(static_cast<int>(level)));
+}
+
+// {copies, bytes copied, bytes left on the device, copy ms, overlapped decode steps, staging bytes}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getTransferStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::pair<host_staging::TransferStats, size_t> stats;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        stats = g_mlc_engine->transfer_stats();
+    }
+    
+    jfloat values[6] = {
+        static_cast<jfloat>(stats.first.copies),
+        static_cast<jfloat>(stats.first.bytes),
+        static_cast<jfloat>(stats.first.skipped_bytes),
+        static_cast<jfloat>(stats.first.copy_ms),
+        static_cast<jfloat>(stats.first.overlapped_steps),
+        static_cast<jfloat>(stats.second),
+    };
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getAllocStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    AllocStepStats steps;
+    int pooled_types = 0;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        steps = g_mlc_engine->alloc_step_stats();
+        pooled_types = g_mlc_engine->pooled_device_types();
+    }
+    device_pool::PoolCounts counts = device_pool::counts();
+    
+    jfloat values[9] = {
+        static_cast<jfloat>(pooled_types),
+        static_cast<jfloat>(counts.driver_allocs),
+        static_cast<jfloat>(counts.pool_hits),
+        static_cast<jfloat>(counts.workspace_allocs),
+        static_cast<jfloat>(counts.pooled_bytes),
+        static_cast<jfloat>(counts.live_bytes),
+        static_cast<jfloat>(steps.steps),
+        static_cast<jfloat>(steps.steady_allocs),
+        static_cast<jfloat>(steps.last_step_allocs),
+    };
+    jfloatArray result = env->NewFloatArray(9);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 9, values);
+    }
+    return result;
+}
+
+// {engine threads, allocations, allocations/s since the last call, cache hit rate, cached bytes,
+//  heap allocated, heap free, fragmentation}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getHeapStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    engine_heap::Stats stats = engine_heap::stats();
+    memory_stats::HeapTotals heap = memory_stats::heap_totals();
+    // Held by the heap but not in use: its own free bytes, and the blocks engine threads keep cached
+    uint64_t held = heap.allocated + heap.free;
+    float fragmentation =
+        held > 0 ? static_cast<float>(heap.free + stats.cached_bytes) / static_cast<float>(held) : 0.0f;
+    
+    jfloat values[8] = {
+        static_cast<jfloat>(stats.threads),
+        static_cast<jfloat>(stats.allocations),
+        static_cast<jfloat>(stats.allocations_per_s),
+        stats.allocations > 0 ? static_cast<jfloat>(stats.cache_hits) / static_cast<jfloat>(stats.allocations) : 0.0f,
+        static_cast<jfloat>(stats.cached_bytes),
+        static_cast<jfloat>(heap.allocated),
+        static_cast<jfloat>(heap.free),
+        fragmentation,
+    };
+    jfloatArray result = env->NewFloatArray(8);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 8, values);
+    }
+    return result;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getMemoryStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::string report;
+    {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (g_mlc_engine) {
+            report = g_mlc_engine->memory_stats_json();
+        }
+    }
+    if (report.empty()) {
+        report = memory_report("", DLDevice{kDLCPU, 0}, nullptr, nullptr);
+    }
+    return env->NewStringUTF(report.c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_resetMemoryStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    memory_high_water().reset();
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getKvStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    KvBudgetStats stats;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        stats = g_mlc_engine->kv_stats();
+    }
+    
+    jfloat values[5] = {
+        static_cast<jfloat>(stats.budget_bytes),
+        static_cast<jfloat>(stats.resident_bytes),
+        static_cast<jfloat>(stats.resident_sessions),
+        static_cast<jfloat>(stats.evictions),
+        static_cast<jfloat>(stats.bytes_per_token),
+    };
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openKvOffload(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDirectory,
+        jlong memoryBytes,
+        jlong flashBytes) {
+    
+    if (jDirectory == nullptr || memoryBytes < 0 || flashBytes < 0) {
+        return JNI_FALSE;
+    }
+    std::string dir = jstring_to_string(env, jDirectory);
+    if (!kv_offload::store().open(dir, static_cast<uint64_t>(memoryBytes), static_cast<uint64_t>(flashBytes))) {
+        LOGE("Cannot open KV offload store in %s", dir.c_str());
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_prefetchSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    int64_t id = session;
+    if (kv_offload::store().tier(id) == kv_offload::kNone) {
+        return;
+    }
+    kv_offload_worker().submit(jni_cache().vm, [id](JNIEnv*) {
+        if (kv_offload::store().stage(id, true).empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (g_mlc_engine) {
+            g_mlc_engine->prefetch_offloaded(id);
+        }
+    });
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getKvOffloadStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    return env->NewStringUTF(kv_offload::store().stats_json().c_str());
+}
+
+// The texts of a String[]; null entries become empty strings
+static std::vector<std::string> jstring_array_to_vector(JNIEnv* env, jobjectArray jTexts) {
+    std::vector<std::string> texts;
+    jsize count = jTexts != nullptr ? env->GetArrayLength(jTexts) : 0;
+    texts.reserve(static_cast<size_t>(count));
+    for (jsize i = 0; i < count; ++i) {
+        auto jText = static_cast<jstring>(env->GetObjectArrayElement(jTexts, i));
+        texts.push_back(jText != nullptr ? jstring_to_string(env, jText) : std::string());
+        if (jText != nullptr) {
+            env->DeleteLocalRef(jText);
+        }
+    }
+    return texts;
+}
+
+// Embedding calls from all threads, batched into shared forward passes (see embed_batcher.h)
+static EmbedBatcher& embed_batcher() {
+    static EmbedBatcher* batcher = new EmbedBatcher();
+    return *batcher;
+}
+
+static std::vector<float> embed_batched(const std::vector<std::string>& texts, EmbedSource source, int priority,
+                                        size_t* dim) {
+    return embed_batcher().embed(texts, source, priority, dim,
+                                 [](const std::vector<std::string>& batch, EmbedSource batch_source, size_t* width) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (!g_mlc_engine) {
+            return std::vector<float>();
+        }
+        try {
+            return g_mlc_engine->embed_texts(batch, batch_source, width);
+        } catch (const std::exception& e) {
+            LOGE("Exception embedding %zu texts: %s", batch.size(), e.what());
+            return std::vector<float>();
+        }
+    });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setEmbedBatching(
+        JNIEnv* env,
+        jobject /* this */,
+        jint priority,
+        jfloat windowMs,
+        jint maxTexts) {
+    
+    if (priority < kPriorityInteractive || priority >= kPriorityClasses) {
+        LOGE("Unknown priority class %d", priority);
+        return;
+    }
+    EmbedBatcher::Window window;
+    window.wait = std::chrono::microseconds(static_cast<int64_t>(std::max(0.0f, windowMs) * 1000.0f));
+    window.max_texts = static_cast<size_t>(std::max(1, static_cast<int>(maxTexts)));
+    embed_batcher().set_window(priority, window);
+}
+
+// {forward passes, calls, texts, mean wait per call in ms}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getEmbedBatchStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    EmbedBatcher::Stats stats = embed_batcher().stats();
+    jfloat values[4] = {static_cast<jfloat>(stats.batches), static_cast<jfloat>(stats.calls),
+                        static_cast<jfloat>(stats.texts),
+                        static_cast<jfloat>(stats.calls > 0 ? stats.wait_ms / stats.calls : 0.0)};
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_embedTexts(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jTexts,
+        jint source,
+        jint priority) {
+    
+    if (!g_mlc_engine) {
+        return nullptr;
+    }
+    std::vector<std::string> texts = jstring_array_to_vector(env, jTexts);
+    size_t dim = 0;
+    std::vector<float> rows = embed_batched(texts, static_cast<EmbedSource>(source), priority, &dim);
+    if (rows.empty() || dim == 0) {
+        return nullptr;
+    }
+    jobjectArray result = env->NewObjectArray(static_cast<jsize>(texts.size()), jni_cache().float_array_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < texts.size(); ++i) {
+        jfloatArray row = env->NewFloatArray(static_cast<jsize>(dim));
+        if (row == nullptr) {
+            return nullptr;
+        }
+        env->SetFloatArrayRegion(row, 0, static_cast<jsize>(dim), rows.data() + i * dim);
+        env->SetObjectArrayElement(result, static_cast<jsize>(i), row);
+        env->DeleteLocalRef(row);
+    }
+    return result;
+}
+
+JNIEXPORT jbyteArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_embedTextsPacked(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jTexts,
+        jint source,
+        jint format,
+        jint priority) {
+    
+    if (!g_mlc_engine || format < kEmbedFloat32 || format > kEmbedInt8) {
+        return nullptr;
+    }
+    std::vector<std::string> texts = jstring_array_to_vector(env, jTexts);
+    size_t dim = 0;
+    std::vector<float> rows = embed_batched(texts, static_cast<EmbedSource>(source), priority, &dim);
+    if (rows.empty() || dim == 0) {
+        return nullptr;
+    }
+    auto packing = static_cast<EmbedFormat>(format);
+    size_t row_bytes = text_embedding::packed_row_bytes(packing, dim);
+    std::vector<uint8_t> packed(row_bytes * texts.size());
+    auto pack = [&](int64_t i) {
+        text_embedding::pack_row(rows.data() + i * dim, dim, packing, packed.data() + i * row_bytes);
+    };
+    if (texts.size() >= text_embedding::kParallelRows) {
+        shared_pool::pool().parallel_for(0, static_cast<int64_t>(texts.size()), pack);
+    } else {
+        for (size_t i = 0; i < texts.size(); ++i) {
+            pack(static_cast<int64_t>(i));
+        }
+    }
+    jbyteArray result = env->NewByteArray(static_cast<jsize>(packed.size()));
+    if (result != nullptr) {
+        env->SetByteArrayRegion(result, 0, static_cast<jsize>(packed.size()), reinterpret_cast<const jbyte*>(packed.data()));
+    }
+    return result;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openVectorIndex(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring dir,
+        jint dim) {
+    
+    if (dim <= 0) {
+        return 0;
+    }
+    std::string path = jni_utf8(env, dir);
+    try {
+        return static_cast<jlong>(vector_index::open_handle(path, static_cast<uint32_t>(dim)));
+    } catch (const std::exception& e) {
+        LOGE("Cannot open vector index %s: %s", path.c_str(), e.what());
+        return 0;
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_addVectors(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlongArray ids,
+        jfloatArray vectors) {
+    
+    std::shared_ptr<vector_index::Handle> index = vector_index::find_handle(handle);
+    if (!index || ids == nullptr || vectors == nullptr) {
+        return JNI_FALSE;
+    }
+    jsize count = env->GetArrayLength(ids);
+    std::vector<jlong> id_values(static_cast<size_t>(count));
+    std::vector<float> values(static_cast<size_t>(env->GetArrayLength(vectors)));
+    env->GetLongArrayRegion(ids, 0, count, id_values.data());
+    env->GetFloatArrayRegion(vectors, 0, static_cast<jsize>(values.size()), values.data());
+    
+    std::lock_guard<std::mutex> index_lock(index->mutex);
+    size_t dim = values.size() / std::max<size_t>(1, id_values.size());
+    if (id_values.empty() || dim * id_values.size() != values.size() || dim != index->index.code_bytes() * VectorIndex::kSubDim) {
+        LOGE("addVectors: %zu floats for %zu ids", values.size(), id_values.size());
+        return JNI_FALSE;
+    }
+    try {
+        for (size_t i = 0; i < id_values.size(); ++i) {
+            if (!index->index.add(static_cast<int64_t>(id_values[i]), values.data() + i * dim)) {
+                return JNI_FALSE;
+            }
+        }
+        return JNI_TRUE;
+    } catch (const std::exception& e) {
+        LOGE("Exception in addVectors: %s", e.what());
+        return JNI_FALSE;
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_removeVector(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlong id) {
+    
+    std::shared_ptr<vector_index::Handle> index = vector_index::find_handle(handle);
+    if (!index) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> index_lock(index->mutex);
+    return index->index.remove(static_cast<int64_t>(id)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_searchVectorIndex(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jfloatArray query,
+        jint k,
+        jfloatArray scores) {
+    
+    std::shared_ptr<vector_index::Handle> index = vector_index::find_handle(handle);
+    if (!index || query == nullptr || k <= 0) {
+        return nullptr;
+    }
+    std::vector<float> q(static_cast<size_t>(env->GetArrayLength(query)));
+    env->GetFloatArrayRegion(query, 0, static_cast<jsize>(q.size()), q.data());
+    std::vector<int64_t> ids(static_cast<size_t>(k));
+    std::vector<float> best(static_cast<size_t>(k));
+    size_t found = 0;
+    {
+        std::lock_guard<std::mutex> index_lock(index->mutex);
+        if (q.size() != index->index.code_bytes() * VectorIndex::kSubDim) {
+            LOGE("searchVectorIndex: query of %zu floats", q.size());
+            return nullptr;
+        }
+        found = index->index.search(q.data(), ids.size(), VectorIndex::kDefaultProbes, ids.data(), best.data());
+    }
+    if (scores != nullptr) {
+        jsize n = std::min(static_cast<jsize>(found), env->GetArrayLength(scores));
+        env->SetFloatArrayRegion(scores, 0, n, best.data());
+    }
+    jlongArray result = env->NewLongArray(static_cast<jsize>(found));
+    if (result != nullptr) {
+        std::vector<jlong> out(ids.begin(), ids.begin() + found);
+        env->SetLongArrayRegion(result, 0, static_cast<jsize>(found), out.data());
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_closeVectorIndex(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle) {
+    
+    return vector_index::close_handle(handle) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getVectorIndexStats(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle) {
+    
+    jfloat values[4] = {0, 0, 0, 0};
+    std::shared_ptr<vector_index::Handle> index = vector_index::find_handle(handle);
+    if (index) {
+        std::lock_guard<std::mutex> index_lock(index->mutex);
+        values[0] = static_cast<jfloat>(index->index.size());
+        values[1] = index->index.trained() ? 1.0f : 0.0f;
+        values[2] = static_cast<jfloat>(index->index.lists());
+        values[3] = static_cast<jfloat>(index->index.trained() ? index->index.code_bytes() : 0);
+    }
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openKeywordIndex(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring dir,
+        jstring tokenizer_path) {
+    
+    std::string path = jni_utf8(env, dir);
+    try {
+        return static_cast<jlong>(keyword_index::open_handle(path, jni_utf8(env, tokenizer_path)));
+    } catch (const std::exception& e) {
+        LOGE("Cannot open keyword index %s: %s", path.c_str(), e.what());
+        return 0;
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_addDocuments(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlongArray ids,
+        jobjectArray texts) {
+    
+    std::shared_ptr<keyword_index::Handle> index = keyword_index::find_handle(handle);
+    if (!index || ids == nullptr || texts == nullptr || env->GetArrayLength(ids) != env->GetArrayLength(texts)) {
+        return JNI_FALSE;
+    }
+    std::vector<jlong> id_values(static_cast<size_t>(env->GetArrayLength(ids)));
+    env->GetLongArrayRegion(ids, 0, static_cast<jsize>(id_values.size()), id_values.data());
+    std::vector<std::string> documents = jstring_array_to_vector(env, texts);
+    
+    std::lock_guard<std::mutex> index_lock(index->mutex);
+    try {
+        for (size_t i = 0; i < documents.size(); ++i) {
+            if (!index->index.add(static_cast<int64_t>(id_values[i]), documents[i])) {
+                return JNI_FALSE;
+            }
+        }
+        return JNI_TRUE;
+    } catch (const std::exception& e) {
+        LOGE("Exception in addDocuments: %s", e.what());
+        return JNI_FALSE;
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_removeDocument(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlong id) {
+    
+    std::shared_ptr<keyword_index::Handle> index = keyword_index::find_handle(handle);
+    if (!index) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> index_lock(index->mutex);
+    return index->index.remove(static_cast<int64_t>(id)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_searchKeywordIndex(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jstring query,
+        jint k,
+        jfloatArray scores) {
+    
+    std::shared_ptr<keyword_index::Handle> index = keyword_index::find_handle(handle);
+    if (!index || query == nullptr || k <= 0) {
+        return nullptr;
+    }
+    std::string text = jni_utf8(env, query);
+    std::vector<int64_t> ids(static_cast<size_t>(k));
+    std::vector<float> best(static_cast<size_t>(k));
+    size_t found = 0;
+    {
+        std::lock_guard<std::mutex> index_lock(index->mutex);
+        found = index->index.search(text, ids.size(), ids.data(), best.data());
+    }
+    if (scores != nullptr) {
+        jsize n = std::min(static_cast<jsize>(found), env->GetArrayLength(scores));
+        env->SetFloatArrayRegion(scores, 0, n, best.data());
+    }
+    jlongArray result = env->NewLongArray(static_cast<jsize>(found));
+    if (result != nullptr) {
+        std::vector<jlong> out(ids.begin(), ids.begin() + found);
+        env->SetLongArrayRegion(result, 0, static_cast<jsize>(found), out.data());
+    }
+    return result;
+}
+
+// Quiz grading thresholds (see answer_grading.h)
+static std::mutex g_grading_mutex;
+static answer_grading::Settings g_grading_settings;
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setGradingThresholds(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat similarityWeight,
+        jfloat accept,
+        jfloat reject) {
+    
+    std::lock_guard<std::mutex> lock(g_grading_mutex);
+    g_grading_settings.similarity_weight = std::max(0.0f, std::min(1.0f, static_cast<float>(similarityWeight)));
+    g_grading_settings.accept = accept;
+    g_grading_settings.reject = std::min(static_cast<float>(reject), static_cast<float>(accept));
+}
+
+// GRADE_FIELDS floats per answer: {score, similarity, keyword recall, verdict}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_gradeAnswers(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jAnswers,
+        jobjectArray jReferences,
+        jintArray jReferenceCounts,
+        jlong keywordHandle,
+        jint source) {
+    
+    if (!g_mlc_engine || jAnswers == nullptr || jReferences == nullptr || jReferenceCounts == nullptr) {
+        return nullptr;
+    }
+    std::vector<std::string> answers = jstring_array_to_vector(env, jAnswers);
+    std::vector<std::string> references = jstring_array_to_vector(env, jReferences);
+    std::vector<jint> counts(static_cast<size_t>(env->GetArrayLength(jReferenceCounts)));
+    env->GetIntArrayRegion(jReferenceCounts, 0, static_cast<jsize>(counts.size()), counts.data());
+    if (counts.size() != answers.size()) {
+        LOGE("gradeAnswers: %zu reference counts for %zu answers", counts.size(), answers.size());
+        return nullptr;
+    }
+    std::vector<size_t> first(1, 0);
+    for (jint count : counts) {
+        first.push_back(first.back() + static_cast<size_t>(std::max(0, static_cast<int>(count))));
+    }
+    if (first.back() != references.size()) {
+        LOGE("gradeAnswers: reference counts add up to %zu, got %zu references", first.back(), references.size());
+        return nullptr;
+    }
+    
+    // Answers and references in one pass
+    std::vector<std::string> texts = answers;
+    texts.insert(texts.end(), references.begin(), references.end());
+    size_t dim = 0;
+    std::vector<float> rows = embed_batched(texts, static_cast<EmbedSource>(source), kPriorityInteractive, &dim);
+    if (rows.empty() || dim == 0) {
+        return nullptr;
+    }
+    std::vector<float> recall;
+    std::shared_ptr<keyword_index::Handle> keywords = keyword_index::find_handle(keywordHandle);
+    if (keywords) {
+        recall.resize(references.size());
+        std::lock_guard<std::mutex> index_lock(keywords->mutex);
+        for (size_t q = 0; q < answers.size(); ++q) {
+            for (size_t r = first[q]; r < first[q + 1]; ++r) {
+                recall[r] = keywords->index.term_recall(answers[q], references[r]);
+            }
+        }
+    }
+    std::vector<bool> blank(answers.size());
+    for (size_t q = 0; q < answers.size(); ++q) {
+        blank[q] = answers[q].find_first_not_of(" \t\r\n") == std::string::npos;
+    }
+    answer_grading::Settings settings;
+    {
+        std::lock_guard<std::mutex> lock(g_grading_mutex);
+        settings = g_grading_settings;
+    }
+    std::vector<answer_grading::Grade> grades = answer_grading::grade(
+            rows.data(), rows.data() + answers.size() * dim, first, dim, recall, blank, settings);
+    
+    std::vector<jfloat> values;
+    values.reserve(grades.size() * 4);
+    for (const answer_grading::Grade& grade : grades) {
+        values.push_back(grade.score);
+        values.push_back(grade.similarity);
+        values.push_back(grade.recall);
+        values.push_back(static_cast<jfloat>(grade.verdict));
+    }
+    jfloatArray result = env->NewFloatArray(static_cast<jsize>(values.size()));
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, static_cast<jsize>(values.size()), values.data());
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_closeKeywordIndex(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle) {
+    
+    return keyword_index::close_handle(handle) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getKeywordIndexStats(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle) {
+    
+    jfloat values[4] = {0, 0, 0, 0};
+    std::shared_ptr<keyword_index::Handle> index = keyword_index::find_handle(handle);
+    if (index) {
+        std::lock_guard<std::mutex> index_lock(index->mutex);
+        values[0] = static_cast<jfloat>(index->index.size());
+        values[1] = static_cast<jfloat>(index->index.terms());
+        values[2] = static_cast<jfloat>(index->index.posting_bytes());
+        values[3] = index->index.average_length();
+    }
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_hybridSearch(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong keyword_handle,
+        jlong vector_handle,
+        jstring query,
+        jfloatArray query_vector,
+        jint k) {
+    
+    if (k <= 0) {
+        return nullptr;
+    }
+    // Each side ranks a few times more candidates than asked for, then the rankings are fused
+    size_t depth = static_cast<size_t>(k) * 4;
+    std::vector<std::vector<int64_t>> rankings;
+    std::shared_ptr<keyword_index::Handle> keywords = keyword_index::find_handle(keyword_handle);
+    if (keywords && query != nullptr) {
+        std::string text = jni_utf8(env, query);
+        std::vector<int64_t> ids(depth);
+        std::lock_guard<std::mutex> index_lock(keywords->mutex);
+        ids.resize(keywords->index.search(text, depth, ids.data(), nullptr));
+        rankings.push_back(std::move(ids));
+    }
+    std::shared_ptr<vector_index::Handle> vectors = vector_index::find_handle(vector_handle);
+    if (vectors && query_vector != nullptr) {
+        std::vector<float> q(static_cast<size_t>(env->GetArrayLength(query_vector)));
+        env->GetFloatArrayRegion(query_vector, 0, static_cast<jsize>(q.size()), q.data());
+        std::vector<int64_t> ids(depth);
+        std::lock_guard<std::mutex> index_lock(vectors->mutex);
+        if (q.size() == vectors->index.code_bytes() * VectorIndex::kSubDim) {
+            ids.resize(vectors->index.search(q.data(), depth, VectorIndex::kDefaultProbes, ids.data(), nullptr));
+            rankings.push_back(std::move(ids));
+        }
+    }
+    if (rankings.empty()) {
+        return nullptr;
+    }
+    std::vector<int64_t> fused = keyword_index::fuse_rankings(rankings, static_cast<size_t>(k));
+    jlongArray result = env->NewLongArray(static_cast<jsize>(fused.size()));
+    if (result != nullptr) {
+        std::vector<jlong> out(fused.begin(), fused.end());
+        env->SetLongArrayRegion(result, 0, static_cast<jsize>(out.size()), out.data());
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setRetrievedContext(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jlongArray ids,
+        jobjectArray texts,
+        jlongArray docs,
+        jlongArray starts,
+        jint max_tokens) {
+    
+    if (!g_mlc_engine || ids == nullptr || texts == nullptr) {
+        return -1;
+    }
+    jsize count = env->GetArrayLength(ids);
+    if (env->GetArrayLength(texts) != count || (docs != nullptr && env->GetArrayLength(docs) != count) ||
+        (starts != nullptr && env->GetArrayLength(starts) != count)) {
+        return -1;
+    }
+    std::vector<jlong> id_values(static_cast<size_t>(count));
+    std::vector<jlong> doc_values(static_cast<size_t>(count), -1);
+    std::vector<jlong> start_values(static_cast<size_t>(count), -1);
+    env->GetLongArrayRegion(ids, 0, count, id_values.data());
+    if (docs != nullptr && starts != nullptr) {
+        env->GetLongArrayRegion(docs, 0, count, doc_values.data());
+        env->GetLongArrayRegion(starts, 0, count, start_values.data());
+    }
+    std::vector<std::string> chunk_texts = jstring_array_to_vector(env, texts);
+    std::vector<ContextChunk> chunks(static_cast<size_t>(count));
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].id = static_cast<int64_t>(id_values[i]);
+        chunks[i].doc = static_cast<int64_t>(doc_values[i]);
+        chunks[i].start = static_cast<int64_t>(start_values[i]);
+        chunks[i].text = std::move(chunk_texts[i]);
+        chunks[i].rank = i;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return static_cast<jint>(g_mlc_engine->set_retrieved_context(
+        static_cast<int64_t>(session), std::move(chunks), static_cast<size_t>(std::max(0, static_cast<int>(max_tokens)))));
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPackedContextIds(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::vector<jlong> ids;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const PackedContext& packed = g_mlc_engine->last_context();
+        ids.assign(packed.ids.begin(), packed.ids.end());
+    }
+    jlongArray result = env->NewLongArray(static_cast<jsize>(ids.size()));
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, static_cast<jsize>(ids.size()), ids.data());
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setConversationMemory(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat fillFactor) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_memory_fill(static_cast<double>(fillFactor));
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getConversationMemory(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    std::string memory;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        memory = g_mlc_engine->conversation_memory_of(session);
+    }
+    return env->NewStringUTF(memory.c_str());
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getConversationMemoryStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[3] = {0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        values[0] = static_cast<jfloat>(g_mlc_engine->memory_folds());
+        values[1] = static_cast<jfloat>(g_mlc_engine->memory_turns_folded());
+        values[2] = static_cast<jfloat>(g_mlc_engine->memory_tokens_saved());
+    }
+    jfloatArray result = env->NewFloatArray(3);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 3, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getContextStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[6] = {0, 0, 0, 0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const PackedContext& packed = g_mlc_engine->last_context();
+        values[0] = static_cast<jfloat>(packed.ids.size());
+        values[1] = static_cast<jfloat>(packed.tokens);
+        values[2] = static_cast<jfloat>(packed.merged);
+        values[3] = static_cast<jfloat>(packed.dropped);
+        values[4] = static_cast<jfloat>(g_mlc_engine->context_cache().hits());
+        values[5] = static_cast<jfloat>(g_mlc_engine->context_cache().misses());
+    }
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getContextCompressionStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const auto& stats = g_mlc_engine->compression_stats();
+        values[0] = static_cast<jfloat>(stats.last.tokens_in);
+        values[1] = static_cast<jfloat>(stats.last.tokens_out);
+        values[2] = stats.last.tokens_in > 0 ? static_cast<jfloat>(stats.last.tokens_out) / stats.last.tokens_in : 0.0f;
+        values[3] = static_cast<jfloat>(stats.last.words_dropped);
+        values[4] = static_cast<jfloat>(stats.last_ms);
+        values[5] = static_cast<jfloat>(stats.last_saved_ms);
+        values[6] = static_cast<jfloat>(stats.requests);
+        values[7] = static_cast<jfloat>(stats.tokens_saved);
+        values[8] = static_cast<jfloat>(stats.saved_ms);
+    }
+    jfloatArray result = env->NewFloatArray(9);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 9, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPrefixTreeStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    // {lookups, hits, tokens looked up, tokens saved, token hit rate, inserts, evictions, slots, cached tokens, nodes}
+    jfloat values[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const PrefixTree& tree = g_mlc_engine->prefix_tree();
+        values[0] = static_cast<jfloat>(tree.lookups());
+        values[1] = static_cast<jfloat>(tree.hits());
+        values[2] = static_cast<jfloat>(tree.tokens_requested());
+        values[3] = static_cast<jfloat>(tree.tokens_saved());
+        values[4] = tree.tokens_requested() > 0
+                        ? static_cast<jfloat>(static_cast<double>(tree.tokens_saved()) / tree.tokens_requested())
+                        : 0.0f;
+        values[5] = static_cast<jfloat>(tree.inserts());
+        values[6] = static_cast<jfloat>(tree.evictions());
+        values[7] = static_cast<jfloat>(tree.slots().size());
+        values[8] = static_cast<jfloat>(tree.cached_tokens());
+        values[9] = static_cast<jfloat>(tree.nodes());
+    }
+    jfloatArray result = env->NewFloatArray(10);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 10, values);
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setSessionAdapter(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    std::string name = jName != nullptr ? jstring_to_string(env, jName) : std::string();
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->set_session_adapter(static_cast<int64_t>(session), name) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setSessionKvPolicy(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jint policy,
+        jint budgetTokens) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->set_session_kv_policy(static_cast<int64_t>(session), static_cast<int>(policy),
+                                               static_cast<int64_t>(budgetTokens)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getKvEvictionStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    // {compressions, tokens evicted}
+    jfloat values[2] = {0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        values[0] = static_cast<jfloat>(g_mlc_engine->kv_compressions());
+        values[1] = static_cast<jfloat>(g_mlc_engine->kv_tokens_evicted());
+    }
+    jfloatArray result = env->NewFloatArray(2);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_listAdapters(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return nullptr;
+    }
+    std::vector<std::string> adapters;
+    {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        adapters = g_mlc_engine->adapter_list();
+    }
+    jobjectArray result = env->NewObjectArray(static_cast<jsize>(adapters.size()), jni_cache().string_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < adapters.size(); ++i) {
+        jstring text = env->NewStringUTF(adapters[i].c_str());
+        env->SetObjectArrayElement(result, static_cast<jsize>(i), text);
+        env->DeleteLocalRef(text);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setModelBudget(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong bytes) {
+    
+    if (!g_mlc_engine || bytes < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_model_budget(static_cast<uint64_t>(bytes));
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getModelStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    ModelResidencyStats stats;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        stats = g_mlc_engine->model_stats();
+    }
+    
+    jfloat values[5] = {
+        static_cast<jfloat>(stats.budget_bytes),
+        static_cast<jfloat>(stats.resident_bytes),
+        static_cast<jfloat>(stats.resident_models),
+        static_cast<jfloat>(stats.evictions),
+        static_cast<jfloat>(stats.unmaps),
+    };
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_embedText(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jText) {
+    
+    if (!g_mlc_engine) {
+        return nullptr;
+    }
+    size_t dim = 0;
+    std::vector<float> embedding = embed_batched({jstring_to_string(env, jText)}, kEmbedDedicated,
+                                                 kPriorityInteractive, &dim);
+    if (embedding.empty()) {
+        return nullptr;
+    }
+    jfloatArray result = env->NewFloatArray(static_cast<jsize>(embedding.size()));
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, static_cast<jsize>(embedding.size()), embedding.data());
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getSessionResidency(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session) {
+    
+    if (!g_mlc_engine) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->session_residency(session);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openResponseCache(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDirectory) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->open_response_cache(jstring_to_string(env, jDirectory)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_clearResponseCache(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->clear_response_cache();
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getResponseCacheStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        const ResponseCache& cache = g_mlc_engine->response_cache();
+        const SemanticCache& semantic = g_mlc_engine->semantic_cache();
+        values[0] = static_cast<jfloat>(cache.entries());
+        values[1] = static_cast<jfloat>(cache.slots());
+        values[2] = static_cast<jfloat>(cache.hits());
+        values[3] = static_cast<jfloat>(cache.misses());
+        values[4] = static_cast<jfloat>(semantic.hits());
+        values[5] = static_cast<jfloat>(semantic.misses());
+        values[6] = static_cast<jfloat>(semantic.false_hits());
+        values[7] = static_cast<jfloat>(g_mlc_engine->cache_saved_ms() + semantic.saved_ms());
+        values[8] = static_cast<jfloat>(semantic.size());
+        const ResponseCache& summaries = g_mlc_engine->summary_cache();
+        values[9] = static_cast<jfloat>(summaries.entries());
+        values[10] = static_cast<jfloat>(summaries.hits());
+        values[11] = static_cast<jfloat>(summaries.misses());
+    }
+    jfloatArray result = env->NewFloatArray(12);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 12, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setSemanticCache(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat threshold,
+        jint mode) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->semantic_cache().configure(threshold, mode);
+    LOGI("Semantic cache %s (threshold %.3f, mode %d)", threshold > 0.0f ? "on" : "off", threshold, mode);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_reportSemanticFalseHit(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->semantic_cache().report_false_hit() ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getSemanticCacheAudit(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::vector<std::string> lines;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        char similarity[16];
+        for (const SemanticCache::Hit& hit : g_mlc_engine->semantic_cache().audit()) {
+            snprintf(similarity, sizeof(similarity), "%.3f", hit.similarity);
+            lines.push_back(std::string(similarity) + "\t" + hit.query + "\t" + hit.matched);
+        }
+    }
+    jobjectArray result = env->NewObjectArray(static_cast<jsize>(lines.size()), jni_cache().string_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < lines.size(); ++i) {
+        jstring line = env->NewStringUTF(lines[i].c_str());
+        env->SetObjectArrayElement(result, static_cast<jsize>(i), line);
+        env->DeleteLocalRef(line);
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openSessionStore(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDirectory) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->open_session_store(jstring_to_string(env, jDirectory)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_saveSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return g_mlc_engine->save_session(session, jstring_to_string(env, jName)) ? JNI_TRUE : JNI_FALSE;
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in saveSession: %s", e.what());
+        return JNI_FALSE;
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_restoreSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return -1;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return static_cast<jlong>(g_mlc_engine->restore_session(jstring_to_string(env, jName)));
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in restoreSession: %s", e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_deleteSavedSession(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->delete_saved_session(jstring_to_string(env, jName));
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setSavedSessionCap(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong bytes) {
+    
+    if (!g_mlc_engine || bytes < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    g_mlc_engine->set_saved_session_cap(static_cast<uint64_t>(bytes));
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getSavedSessionBytes(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return static_cast<jlong>(g_mlc_engine->saved_session_bytes());
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_openConversationLog(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine->open_conversation_log(session, jstring_to_string(env, jName)) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_resumeConversation(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return -1;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return static_cast<jlong>(g_mlc_engine->resume_conversation(jstring_to_string(env, jName)));
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in resumeConversation: %s", e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_branchConversation(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jint turn,
+        jstring jName) {
+    
+    if (!g_mlc_engine) {
+        return -1;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return static_cast<jlong>(g_mlc_engine->branch_conversation(session, turn, jstring_to_string(env, jName)));
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in branchConversation: %s", e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getConversationIds(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jint message) {
+    
+    if (!g_mlc_engine || message < 0) {
+        return nullptr;
+    }
+    std::vector<int32_t> ids;
+    {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (!g_mlc_engine->conversation_ids(session, static_cast<size_t>(message), &ids)) {
+            return nullptr;
+        }
+    }
+    jintArray result = env->NewIntArray(static_cast<jsize>(ids.size()));
+    if (result != nullptr && !ids.empty()) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(ids.size()), reinterpret_cast<const jint*>(ids.data()));
+    }
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_truncateConversation(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong session,
+        jint turns) {
+    
+    if (!g_mlc_engine) {
+        return JNI_FALSE;
+    }
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        return g_mlc_engine->truncate_conversation(session, turns) ? JNI_TRUE : JNI_FALSE;
+    }
+    catch (const std::exception& e) {
+        LOGE("Exception in truncateConversation: %s", e.what());
+        return JNI_FALSE;
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_resetChat(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_mlc_engine->reset_session(kDefaultSession);
+    } 
+    catch (const std::exception& e) {
+        LOGE("Exception in resetChat: %s", e.what());
+    }
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getCapabilities(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return 0;
+    }
+    return static_cast<jint>(g_mlc_engine->capabilities());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setMultiTurn(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    
+    change_engine_settings("setMultiTurn", [enabled](RealMlcEngine& engine) { engine.set_multi_turn(enabled == JNI_TRUE); });
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getConversationSubject(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return static_cast<jint>(kSubjectGeneral);
+    }
+    return static_cast<jint>(g_mlc_engine->conversation_subject());
+}
+
+JNIEXPORT jfloat JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getLastRouteMicros(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    return g_mlc_engine ? g_mlc_engine->last_route_us() : 0.0f;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getSpeculativeStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    SpeculativeStats stats;
+    if (g_mlc_engine) {
+        stats = g_mlc_engine->speculative_stats();
+    }
+    
+    jfloat values[4] = {
+        stats.acceptance_rate(),
+        stats.tokens_per_target_pass(),
+        stats.tokens_per_second(),
+        static_cast<jfloat>(stats.emitted),
+    };
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPromptLookupStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    SpeculativeStats stats;
+    if (g_mlc_engine) {
+        stats = g_mlc_engine->prompt_lookup_stats();
+    }
+    
+    jfloat values[4] = {
+        stats.acceptance_rate(),
+        stats.tokens_per_target_pass(),
+        stats.tokens_per_second(),
+        static_cast<jfloat>(stats.emitted),
+    };
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+// {acceptance rate, tokens per target pass, tokens/s, tokens emitted, exit layer, layers}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getSelfSpeculationStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    SpeculativeStats stats;
+    std::pair<int, int> layers{0, 0};
+    if (g_mlc_engine) {
+        stats = g_mlc_engine->self_speculation_stats();
+        layers = g_mlc_engine->self_speculation_layers();
+    }
+    
+    jfloat values[6] = {
+        stats.acceptance_rate(),
+        stats.tokens_per_target_pass(),
+        stats.tokens_per_second(),
+        static_cast<jfloat>(stats.emitted),
+        static_cast<jfloat>(layers.first),
+        static_cast<jfloat>(layers.second),
+    };
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setSelfSpeculation(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled,
+        jint exitLayer) {
+    
+    change_engine_settings("setSelfSpeculation", [enabled, exitLayer](RealMlcEngine& engine) {
+        engine.set_self_speculation(enabled == JNI_TRUE, exitLayer);
+    });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setAdaptiveDraftLength(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled,
+        jint maxLength) {
+    
+    change_engine_settings("setAdaptiveDraftLength", [enabled, maxLength](RealMlcEngine& engine) {
+        engine.set_adaptive_draft_length(enabled == JNI_TRUE, maxLength);
+    });
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getDraftLengthStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::string stats = "{}";
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        stats = g_mlc_engine->draft_length_stats();
+    }
+    return env->NewStringUTF(stats.c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setPromptLookup(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    
+    change_engine_settings("setPromptLookup", [enabled](RealMlcEngine& engine) { engine.set_prompt_lookup(enabled == JNI_TRUE); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setDraftLength(
+        JNIEnv* env,
+        jobject /* this */,
+        jint length) {
+    
+    change_engine_settings("setDraftLength", [length](RealMlcEngine& engine) { engine.set_draft_length(length); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setTemperature(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat temperature) {
+    
+    change_engine_settings("setTemperature", [temperature](RealMlcEngine& engine) { engine.set_temperature(temperature); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setTopP(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat topP) {
+    
+    change_engine_settings("setTopP", [topP](RealMlcEngine& engine) { engine.set_top_p(topP); });
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getSamplerStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    SamplerStats stats;
+    if (g_mlc_engine) {
+        stats = g_mlc_engine->sampler_stats();
+    }
+    
+    uint64_t host_tokens = stats.tokens - stats.device_tokens;
+    jfloat values[7] = {
+        stats.last_us,
+        stats.average_us(),
+        static_cast<jfloat>(stats.tokens),
+        host_tokens == 0 ? 0.0f : static_cast<jfloat>(stats.candidates) / host_tokens,
+        static_cast<jfloat>(stats.device_tokens),
+        static_cast<jfloat>(stats.shortlist_tokens),
+        stats.shortlist_tokens == 0 ? 0.0f : static_cast<jfloat>(stats.shortlist_rows) / stats.shortlist_tokens,
+    };
+    jfloatArray result = env->NewFloatArray(7);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 7, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setDecodeGraph(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    
+    change_engine_settings("setDecodeGraph", [enabled](RealMlcEngine& engine) { engine.set_decode_graph(enabled == JNI_TRUE); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setFollowUpPrefetch(
+        JNIEnv* env,
+        jobject /* this */,
+        jint mode,
+        jobjectArray jPrompts,
+        jint maxTokens) {
+    
+    if (mode < follow_up::kModeOff || mode > follow_up::kModeGenerate) {
+        LOGE("Unknown follow-up prefetch mode %d", static_cast<int>(mode));
+        return;
+    }
+    std::vector<std::string> prompts;
+    if (jPrompts != nullptr) {
+        prompts = jstring_array_to_vector(env, jPrompts);
+    }
+    // Dropping the branches closes sessions; stop the one being answered first
+    g_prefetch_stop = true;
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    try {
+        g_mlc_engine->set_follow_up_prefetch(mode, std::move(prompts), maxTokens);
+    } catch (const std::exception& e) {
+        LOGE("Exception in setFollowUpPrefetch: %s", e.what());
+    }
+}
+
+// {predicted, served, discarded, tokens, preempted, prepared now}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getFollowUpPrefetchStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    follow_up::Stats stats;
+    size_t prepared = 0;
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (g_mlc_engine) {
+            stats = g_mlc_engine->follow_up_stats();
+            prepared = g_mlc_engine->follow_ups_prepared();
+        }
+    }
+    
+    jfloat values[6] = {
+        static_cast<jfloat>(stats.predicted),
+        static_cast<jfloat>(stats.served),
+        static_cast<jfloat>(stats.discarded),
+        static_cast<jfloat>(stats.tokens),
+        static_cast<jfloat>(stats.preempted),
+        static_cast<jfloat>(prepared),
+    };
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+// Per-token delivery to Kotlin, timed inside ART with no model: a jstring and a
+// callback per token (streamResponse) against a record in a TokenRing drained
+// by another thread (TVMBridge's ByteBuffer stream; Kotlin's read of the records
+// is not included). micro_bench covers the native-only costs.
+// {callback ns per token, ring ns per token}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_benchmarkTokenDelivery(
+        JNIEnv* env,
+        jobject /* this */,
+        jobject jCallback,
+        jint tokens) {
+    
+    static const char* kPieces[] = {" the", " cell", " membr", "ane", " reg", "ulates", ",", " é", "nergy", "."};
+    static constexpr size_t kPieceCount = sizeof(kPieces) / sizeof(kPieces[0]);
+    jmethodID callbackMethod = jni_function1_invoke(env, jCallback);
+    if (callbackMethod == nullptr || tokens <= 0) {
+        LOGE("benchmarkTokenDelivery needs a callback and a token count");
+        return nullptr;
+    }
+    std::vector<std::string> pieces(kPieces, kPieces + kPieceCount);
+    
+    auto start = std::chrono::steady_clock::now();
+    for (jint i = 0; i < tokens; ++i) {
+        jstring jToken = env->NewStringUTF(pieces[i % kPieceCount].c_str());
+        env->CallObjectMethod(jCallback, callbackMethod, jToken);
+        env->DeleteLocalRef(jToken);
+        if (env->ExceptionCheck()) {
+            return nullptr;
+        }
+    }
+    double callback_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    
+    TokenRing ring(64 * 1024);
+    ring.reset();
+    std::thread consumer([&ring] {
+        while (true) {
+            int available = ring.await(100);
+            if (available < 0) {
+                break;
+            }
+            ring.consume(static_cast<uint32_t>(available));
+        }
+    });
+    start = std::chrono::steady_clock::now();
+    for (jint i = 0; i < tokens; ++i) {
+        ring.push(pieces[i % kPieceCount]);
+    }
+    ring.finish(false);
+    consumer.join();
+    double ring_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    
+    jfloat values[2] = {
+        static_cast<jfloat>(callback_ns / tokens),
+        static_cast<jfloat>(ring_ns / tokens),
+    };
+    jfloatArray result = env->NewFloatArray(2);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+// {recording, recordings, replayed steps, eager steps}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getDecodeGraphStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::pair<bool, DecodeGraphStats> stats{false, DecodeGraphStats()};
+    if (g_mlc_engine) {
+        // The counters live in the module; wait for the request using it
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (g_mlc_engine) {
+            stats = g_mlc_engine->decode_graph_stats();
+        }
+    }
+    
+    jfloat values[4] = {
+        stats.first ? 1.0f : 0.0f,
+        static_cast<jfloat>(stats.second.recordings),
+        static_cast<jfloat>(stats.second.replays),
+        static_cast<jfloat>(stats.second.eager_steps),
+    };
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getLastStopReason(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        return kStopNone;
+    }
+    return static_cast<jint>(g_mlc_engine->stop_reason());
+}
+
+// {outcome, deadline ms, predicted ms, elapsed ms, planned max tokens, planned draft length}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getLastDeadlineOutcome(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    jfloat values[6] = {0, 0, 0, 0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        deadline::Report report = g_mlc_engine->last_deadline();
+        values[0] = static_cast<jfloat>(report.outcome);
+        values[1] = static_cast<jfloat>(report.deadline_ms);
+        values[2] = static_cast<jfloat>(report.predicted_ms);
+        values[3] = static_cast<jfloat>(report.elapsed_ms);
+        values[4] = static_cast<jfloat>(report.max_tokens);
+        values[5] = static_cast<jfloat>(report.draft_length);
+    }
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setDeviceSampling(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    
+    change_engine_settings("setDeviceSampling", [enabled](RealMlcEngine& engine) { engine.set_device_sampling(enabled == JNI_TRUE); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setRepetitionPenalty(
+        JNIEnv* env,
+        jobject /* this */,
+        jfloat penalty) {
+    
+    change_engine_settings("setRepetitionPenalty", [penalty](RealMlcEngine& engine) { engine.set_repetition_penalty(penalty); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setSeed(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong seed) {
+    
+    change_engine_settings("setSeed", [seed](RealMlcEngine& engine) { engine.set_seed(seed); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setMaxGenLen(
+        JNIEnv* env,
+        jobject /* this */,
+        jint maxGenLen) {
+    
+    change_engine_settings("setMaxGenLen", [maxGenLen](RealMlcEngine& engine) { engine.set_max_gen_len(maxGenLen); });
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_closeEngine(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    if (!g_mlc_engine) {
+        LOGE("Engine not initialized");
+        return;
+    }
+    
+    try {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        g_batching_ready = false;
+        g_mlc_engine->close();
+        std::unique_ptr<RealMlcEngine> closed;
+        {
+            std::lock_guard<std::mutex> settings_lock(g_settings_mutex);
+            closed.swap(g_mlc_engine);
+        }
+        closed.reset();
+        LOGI("Engine closed successfully");
+    } 
+    catch (const std::exception& e) {
+        LOGE("Exception in closeEngine: %s", e.what());
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_submitGenerate(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt,
+        jobject jConfig,
+        jobject jCallback) {
+    
+    std::string prompt_str = jni_utf8(env, jPrompt);
+    
+    // Read the config now; a null config takes the engine defaults when the request runs
+    bool has_config = jConfig != nullptr && generation_config_fields().seed != nullptr;
+    GenerationConfig config = generation_config_from_java(env, jConfig, GenerationConfig());
+    
+    auto submitted = RequestTiming::Clock::now();
+    auto run = [has_config, config, submitted](const std::string& text,
+                  const std::function<void(const std::string&)>& emit,
+                  const std::atomic<bool>& cancelled, std::string& error) {
+        InteractiveTurn turn(submitted);
+        if (!g_mlc_engine) {
+            error = "Engine not initialized";
+            return false;
+        }
+        if (cancelled.load()) {
+            return true;
+        }
+        
+        // Stream so partial output can be polled; the engine reports failures as an "Error:" chunk
+        bool first = true;
+        bool failed = false;
+        g_mlc_engine->stream_in_session(kDefaultSession, text, [&](std::string token) {
+            if (first && token.rfind("Error:", 0) == 0) {
+                failed = true;
+                error = token.substr(6 + (token.size() > 6 && token[6] == ' ' ? 1 : 0));
+            }
+            first = false;
+            if (!failed) {
+                emit(token);
+            }
+        }, has_config ? config : g_mlc_engine->default_config());
+        return !failed;
+    };
+    
+    std::string key = request_key("chat", kDefaultSession, has_config, config, prompt_str);
+    jlong id = static_cast<jlong>(async_requests().submit(env, std::move(prompt_str), jCallback, run, key));
+    if (id < 0) {
+        LOGE("Async generation worker is shutting down");
+    }
+    return id;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_submitBatchedGenerate(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt,
+        jobject jConfig,
+        jint priority,
+        jobject jCallback) {
+    
+    std::string prompt_str = jstring_to_string(env, jPrompt);
+    bool has_config = jConfig != nullptr && generation_config_fields().seed != nullptr;
+    GenerationConfig config = generation_config_from_java(env, jConfig, GenerationConfig());
+    
+    std::string key = request_key("one-shot", -1, has_config, config, prompt_str);
+    if (!g_batching_ready.load()) {
+        // No batched entry points: run it as a one-shot request on the async worker
+        jlong id = static_cast<jlong>(async_requests().submit(env, std::move(prompt_str), jCallback,
+                                                              one_shot_run(has_config, config, nullptr), key));
+        if (id < 0) {
+            LOGE("Async generation worker is shutting down");
+        }
+        return id;
+    }
+    
+    BatchSequence seq;
+    seq.priority = priority;
+    seq.config = config;
+    seq.default_config = !has_config;
+    bool joined = false;
+    seq.request = async_requests().enqueue(env, std::move(prompt_str), jCallback, key, &joined);
+    jlong id = static_cast<jlong>(seq.request);
+    if (joined) {
+        return id;
+    }
+    batch_scheduler().enqueue(std::move(seq));
+    kick_batch_worker(env);
+    return id;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateBatch(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrefix,
+        jobjectArray jSuffixes,
+        jobject jConfig,
+        jint priority,
+        jobject jListener) {
+    
+    jsize count = jSuffixes != nullptr ? env->GetArrayLength(jSuffixes) : 0;
+    std::vector<std::string> suffixes;
+    for (jsize i = 0; i < count; ++i) {
+        auto jSuffix = static_cast<jstring>(env->GetObjectArrayElement(jSuffixes, i));
+        suffixes.push_back(jstring_to_string(env, jSuffix));
+        if (jSuffix != nullptr) {
+            env->DeleteLocalRef(jSuffix);
+        }
+    }
+    auto prefix = std::make_shared<const std::string>(jstring_to_string(env, jPrefix));
+    bool has_config = jConfig != nullptr && generation_config_fields().seed != nullptr;
+    GenerationConfig config = generation_config_from_java(env, jConfig, GenerationConfig());
+    
+    std::function<void(int, const std::string&)> on_text;
+    jmethodID on_token = jListener != nullptr ? jni_lookup_method(env, jListener, "onToken", "(ILjava/lang/String;)V")
+                                              : nullptr;
+    if (on_token != nullptr) {
+        auto listener = std::make_shared<BatchTokenListener>(env, jListener, on_token);
+        on_text = [listener](int index, const std::string& text) { listener->call(index, text); };
+    }
+    
+    std::vector<jlong> ids;
+    bool batched = g_batching_ready.load();
+    int64_t group = g_next_batch_group++;
+    for (jsize i = 0; i < count; ++i) {
+        if (!batched) {
+            // Serial fallback: each branch prefills the whole prompt
+            std::function<void(const std::string&)> emit;
+            if (on_text) {
+                emit = [on_text, i](const std::string& text) { on_text(static_cast<int>(i), text); };
+            }
+            ids.push_back(static_cast<jlong>(async_requests().submit(
+                    env, *prefix + suffixes[i], nullptr, one_shot_run(has_config, config, emit, {}, kTaskFlashcard))));
+            continue;
+        }
+        BatchSequence seq;
+        seq.priority = priority;
+        seq.task = kTaskFlashcard;
+        seq.config = config;
+        seq.default_config = !has_config;
+        seq.group = group;
+        seq.index = static_cast<int>(i);
+        seq.group_size = static_cast<int>(count);
+        seq.prefix = prefix;
+        seq.on_text = on_text;
+        seq.request = async_requests().enqueue(env, suffixes[i], nullptr);
+        ids.push_back(static_cast<jlong>(seq.request));
+        batch_scheduler().enqueue(std::move(seq));
+    }
+    if (batched && count > 0) {
+        kick_batch_worker(env);
+    }
+    
+    jlongArray result = env->NewLongArray(count);
+    if (result != nullptr && count > 0) {
+        env->SetLongArrayRegion(result, 0, count, ids.data());
+    }
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateSamples(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPrompt,
+        jint n,
+        jobject jConfig,
+        jlongArray jSeeds,
+        jobjectArray jStopStrings,
+        jint priority,
+        jobject jListener) {
+    
+    int count = std::max(0, static_cast<int>(n));
+    auto prompt = std::make_shared<const std::string>(jstring_to_string(env, jPrompt));
+    bool has_config = jConfig != nullptr && generation_config_fields().seed != nullptr;
+    GenerationConfig config = generation_config_from_java(env, jConfig, GenerationConfig());
+    
+    std::vector<jlong> seeds;
+    if (jSeeds != nullptr) {
+        seeds.resize(env->GetArrayLength(jSeeds));
+        env->GetLongArrayRegion(jSeeds, 0, static_cast<jsize>(seeds.size()), seeds.data());
+    }
+    std::vector<std::string> stop_strings;
+    jsize stop_count = jStopStrings != nullptr ? env->GetArrayLength(jStopStrings) : 0;
+    for (jsize i = 0; i < stop_count; ++i) {
+        auto jStop = static_cast<jstring>(env->GetObjectArrayElement(jStopStrings, i));
+        stop_strings.push_back(jstring_to_string(env, jStop));
+        if (jStop != nullptr) {
+            env->DeleteLocalRef(jStop);
+        }
+    }
+    
+    std::function<void(int, const std::string&)> on_text;
+    jmethodID on_token = jListener != nullptr ? jni_lookup_method(env, jListener, "onToken", "(ILjava/lang/String;)V")
+                                              : nullptr;
+    if (on_token != nullptr) {
+        auto listener = std::make_shared<BatchTokenListener>(env, jListener, on_token);
+        on_text = [listener](int index, const std::string& text) { listener->call(index, text); };
+    }
+    
+    // Samples are branches of one group with an empty suffix, so the prompt is
+    // prefilled once and each branch decodes from a fork of it
+    std::vector<jlong> ids;
+    bool batched = g_batching_ready.load();
+    int64_t group = g_next_batch_group++;
+    for (int i = 0; i < count; ++i) {
+        GenerationConfig sample_config = config;
+        if (i < static_cast<int>(seeds.size())) {
+            sample_config.seed = seeds[i];
+        } else if (has_config && config.seed >= 0) {
+            sample_config.seed = config.seed + i;  // distinct but still reproducible
+        }
+        if (!batched) {
+            std::function<void(const std::string&)> emit;
+            if (on_text) {
+                emit = [on_text, i](const std::string& text) { on_text(i, text); };
+            }
+            ids.push_back(static_cast<jlong>(async_requests().submit(
+                    env, *prompt, nullptr,
+                    one_shot_run(has_config, sample_config, emit, stop_strings, kTaskFlashcard))));
+            continue;
+        }
+        BatchSequence seq;
+        seq.priority = priority;
+        seq.task = kTaskFlashcard;
+        seq.config = sample_config;
+        seq.default_config = !has_config;
+        seq.group = group;
+        seq.index = i;
+        seq.group_size = count;
+        seq.prefix = prompt;
+        seq.on_text = on_text;
+        if (!stop_strings.empty()) {
+            seq.stops = std::make_unique<StopStringMatcher>(stop_strings);
+        }
+        seq.request = async_requests().enqueue(env, std::string(), nullptr);
+        ids.push_back(static_cast<jlong>(seq.request));
+        batch_scheduler().enqueue(std::move(seq));
+    }
+    if (batched && count > 0) {
+        kick_batch_worker(env);
+    }
+    
+    jlongArray result = env->NewLongArray(count);
+    if (result != nullptr && count > 0) {
+        env->SetLongArrayRegion(result, 0, count, ids.data());
+    }
+    return result;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_summarizeDocument(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jText,
+        jobject jConfig,
+        jint chunkTokens,
+        jint priority,
+        jobject jListener,
+        jobject jCallback) {
+    
+    std::string text = jstring_to_string(env, jText);
+    bool has_config = jConfig != nullptr && generation_config_fields().seed != nullptr;
+    GenerationConfig config = generation_config_from_java(env, jConfig, GenerationConfig());
+    
+    std::shared_ptr<SummaryProgressListener> listener;
+    jmethodID on_progress = jListener != nullptr ? jni_lookup_method(env, jListener, "onProgress", "(II)V") : nullptr;
+    if (on_progress != nullptr) {
+        listener = std::make_shared<SummaryProgressListener>(env, jListener, on_progress);
+    }
+    
+    std::string key = request_key(("summary/" + std::to_string(chunkTokens)).c_str(), -1, has_config, config, text);
+    jlong id = static_cast<jlong>(async_requests().submit(
+            env, std::move(text), jCallback,
+            summary_run(has_config, config, static_cast<size_t>(std::max(0, static_cast<int>(chunkTokens))),
+                        priority, listener), key));
+    if (id < 0) {
+        LOGE("Async generation worker is shutting down");
+    }
+    return id;
+}
+
+// startBatchJob jobs of this process by directory; the worker runs them one at a time
+static std::mutex g_jobs_mutex;
+static std::condition_variable g_jobs_cond;  // wakes waiting jobs on cancel
+static std::map<std::string, std::shared_ptr<batch_job::Job>> g_jobs;  // under g_jobs_mutex
+
+static GenerationWorker& job_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcJobWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+// Unplugged: running windows stop at their next token, the chunks they finished are kept
+static void stop_job_windows() {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    for (auto& entry : g_jobs) {
+        if (entry.second->state.load() == batch_job::kStateRunning) {
+            entry.second->window_stop.store(true);
+        }
+    }
+}
+
+// What keeps a job from starting its next window, kWaitNone if nothing
+static int job_wait_reason() {
+    bool charging;
+    bool reported;
+    {
+        std::lock_guard<std::mutex> lock(g_power_mutex);
+        charging = g_power_state.charging;
+        reported = g_power_reported;
+    }
+    if (!reported) {
+        charging = GenerationGovernor::read_sysfs_state().charging;
+    }
+    if (!charging) {
+        return batch_job::kWaitCharging;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_turn_mutex);
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (g_interactive_turns > 0 || (g_last_turn_ms > 0 && now - g_last_turn_ms < batch_job::kIdleQuietMs)) {
+            return batch_job::kWaitIdle;
+        }
+    }
+    return g_mlc_engine ? batch_job::kWaitNone : batch_job::kWaitEngine;
+}
+
+// A job on the job worker: window after window of unfinished chunks, each
+// chunk's output checkpointed as it completes (batch_job.h)
+static void run_document_job(const std::shared_ptr<batch_job::Job>& job,
+                             const std::shared_ptr<SummaryProgressListener>& listener) {
+    using namespace batch_job;
+    setpriority(PRIO_PROCESS, 0, 19);
+    auto report = [&job, &listener]() {
+        if (!listener) {
+            return;
+        }
+        size_t done;
+        size_t total;
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            done = job->log.done();
+            total = job->log.total();
+        }
+        listener->call(done, total);
+    };
+    report();
+    while (!job->cancelled.load()) {
+        std::vector<size_t> window;
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            window = job->log.next(kWindowChunks);
+        }
+        if (window.empty()) {
+            job->state.store(kStateDone);
+            LOGI("Batch job %s done: %zu chunks", job->dir.c_str(), job->manifest.chunks.size());
+            break;
+        }
+        int wait = job_wait_reason();
+        job->wait.store(wait);
+        if (wait != kWaitNone) {
+            job->state.store(kStateWaiting);
+            std::unique_lock<std::mutex> lock(g_jobs_mutex);
+            g_jobs_cond.wait_for(lock, std::chrono::milliseconds(kPollMs), [&job] { return job->cancelled.load(); });
+            continue;
+        }
+        job->window_stop.store(false);
+        job->state.store(kStateRunning);
+        std::vector<std::string> inputs;
+        for (size_t index : window) {
+            inputs.push_back(job->manifest.chunks[index]);
+        }
+        bool write_failed = false;
+        std::vector<std::string> outputs;
+        std::string error;
+        bool ok = summarize_level(job->manifest.instruction, inputs, job->manifest.config, kPriorityBackground,
+                                  job->window_stop, nullptr,
+                                  [&](size_t i, const std::string& output) {
+                                      {
+                                          std::lock_guard<std::mutex> lock(job->mutex);
+                                          write_failed = !job->log.append_output(window[i], output) || write_failed;
+                                      }
+                                      report();
+                                  },
+                                  &outputs, error);
+        if (!ok && !write_failed) {
+            LOGE("Batch job %s: window at chunk %zu failed: %s", job->dir.c_str(), window.front(), error.c_str());
+            std::lock_guard<std::mutex> lock(job->mutex);
+            for (size_t index : window) {
+                if (!job->log.finished(index)) {
+                    write_failed = !job->log.append_failure(index, error) || write_failed;
+                }
+            }
+        }
+        if (write_failed) {
+            LOGE("Batch job %s: could not write its checkpoint", job->dir.c_str());
+            job->state.store(kStateFailed);
+            break;
+        }
+        if (!ok) {
+            report();
+        }
+    }
+    if (job->cancelled.load()) {
+        job->state.store(kStateStopped);
+    }
+    job->wait.store(kWaitNone);
+    job->queued.store(false);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_startBatchJob(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir,
+        jstring jText,
+        jstring jInstruction,
+        jobject jConfig,
+        jint chunkTokens,
+        jobject jListener) {
+    
+    using namespace batch_job;
+    std::string dir = jstring_to_string(env, jDir);
+    if (dir.empty()) {
+        return -1;
+    }
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        auto it = g_jobs.find(dir);
+        if (it != g_jobs.end() && it->second->queued.load()) {
+            std::lock_guard<std::mutex> log_lock(it->second->mutex);
+            return static_cast<jint>(it->second->log.done());
+        }
+        job = it != g_jobs.end() ? it->second : std::make_shared<Job>();
+    }
+    
+    job->dir = dir;
+    if (has_manifest(dir)) {
+        // A job already on disk resumes as it was created
+        if (!read_manifest(dir, &job->manifest)) {
+            LOGE("Batch job %s: unreadable job.bin", dir.c_str());
+            return -1;
+        }
+    } else {
+        std::string text = jText != nullptr ? jstring_to_string(env, jText) : std::string();
+        if (text.empty() || !g_mlc_engine) {
+            LOGE(text.empty() ? "Batch job %s: no text" : "Batch job %s: engine not initialized", dir.c_str());
+            return -1;
+        }
+        bool has_config = jConfig != nullptr && generation_config_fields().seed != nullptr;
+        GenerationConfig config = generation_config_from_java(env, jConfig, GenerationConfig());
+        Manifest manifest;
+        manifest.instruction = jInstruction != nullptr ? jstring_to_string(env, jInstruction) : std::string();
+        {
+            std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+            if (!g_mlc_engine) {
+                return -1;
+            }
+            manifest.config = has_config ? config : g_mlc_engine->default_config();
+            size_t instruction = g_mlc_engine->count_tokens(manifest.instruction);
+            size_t budget = document_summary::chunk_budget(
+                    g_mlc_engine->context_window().window, instruction,
+                    static_cast<size_t>(std::max(1, manifest.config.max_gen_len)),
+                    static_cast<size_t>(std::max(0, static_cast<int>(chunkTokens))));
+            manifest.chunks = document_summary::split(text, budget, [](const std::string& chunk) {
+                return g_mlc_engine->count_tokens(chunk);
+            });
+        }
+        if (manifest.chunks.empty() || !write_manifest(dir, manifest)) {
+            LOGE("Batch job %s: could not write job.bin", dir.c_str());
+            return -1;
+        }
+        job->manifest = std::move(manifest);
+        LOGI("Batch job %s: %zu chunks", dir.c_str(), job->manifest.chunks.size());
+    }
+    size_t done = 0;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        if (!job->log.open(dir, job->manifest.chunks.size())) {
+            LOGE("Batch job %s: could not open outputs.log", dir.c_str());
+            return -1;
+        }
+        done = job->log.done();
+    }
+    
+    std::shared_ptr<SummaryProgressListener> listener;
+    jmethodID on_progress = jListener != nullptr ? jni_lookup_method(env, jListener, "onProgress", "(II)V") : nullptr;
+    if (on_progress != nullptr) {
+        listener = std::make_shared<SummaryProgressListener>(env, jListener, on_progress);
+    }
+    job->cancelled.store(false);
+    job->state.store(kStateWaiting);
+    job->queued.store(true);
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        g_jobs[dir] = job;
+    }
+    JavaVM* vm = nullptr;
+    env->GetJavaVM(&vm);
+    if (!job_worker().submit(vm, [job, listener](JNIEnv*) { run_document_job(job, listener); })) {
+        job->queued.store(false);
+        job->state.store(kStateStopped);
+        LOGE("Job worker is shutting down");
+        return -1;
+    }
+    LOGI("Batch job %s: %zu of %zu chunks already done", dir.c_str(), done, job->manifest.chunks.size());
+    return static_cast<jint>(done);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_cancelBatchJob(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir) {
+    
+    std::string dir = jstring_to_string(env, jDir);
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    auto it = g_jobs.find(dir);
+    if (it == g_jobs.end() || !it->second->queued.load()) {
+        return JNI_FALSE;
+    }
+    it->second->cancelled.store(true);
+    it->second->window_stop.store(true);
+    g_jobs_cond.notify_all();
+    return JNI_TRUE;
+}
+
+// {state, wait reason, chunks done, chunks}; a job of an earlier process is read from its directory
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getBatchJobStatus(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir) {
+    
+    using namespace batch_job;
+    std::string dir = jstring_to_string(env, jDir);
+    jfloat values[4] = {static_cast<jfloat>(kStateStopped), static_cast<jfloat>(kWaitNone), 0, 0};
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        auto it = g_jobs.find(dir);
+        if (it != g_jobs.end()) {
+            job = it->second;
+        }
+    }
+    if (job) {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        values[0] = static_cast<jfloat>(job->state.load());
+        values[1] = static_cast<jfloat>(job->wait.load());
+        values[2] = static_cast<jfloat>(job->log.done());
+        values[3] = static_cast<jfloat>(job->log.total());
+    } else {
+        Manifest manifest;
+        OutputLog log;
+        if (read_manifest(dir, &manifest) && log.open(dir, manifest.chunks.size())) {
+            values[0] = static_cast<jfloat>(log.done() == log.total() ? kStateDone : kStateStopped);
+            values[2] = static_cast<jfloat>(log.done());
+            values[3] = static_cast<jfloat>(log.total());
+        }
+    }
+    jfloatArray result = env->NewFloatArray(4);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+// Outputs in chunk order, "" for chunks not done; null if there is no job in `dir`
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getBatchJobOutputs(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir) {
+    
+    using namespace batch_job;
+    std::string dir = jstring_to_string(env, jDir);
+    std::vector<std::string> outputs;
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        auto it = g_jobs.find(dir);
+        if (it != g_jobs.end()) {
+            job = it->second;
+        }
+    }
+    if (job) {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        outputs = job->log.outputs();
+    } else {
+        Manifest manifest;
+        OutputLog log;
+        if (!read_manifest(dir, &manifest) || !log.open(dir, manifest.chunks.size())) {
+            return nullptr;
+        }
+        outputs = log.outputs();
+    }
+    jobjectArray result = env->NewObjectArray(static_cast<jsize>(outputs.size()), jni_cache().string_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        jstring jOutput = env->NewStringUTF(outputs[i].c_str());
+        env->SetObjectArrayElement(result, static_cast<jsize>(i), jOutput);
+        env->DeleteLocalRef(jOutput);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setMaxBatchSize(
+        JNIEnv* env,
+        jobject /* this */,
+        jint size) {
+    batch_scheduler().set_max_batch(size);
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getBatchStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    BatchStats stats = batch_scheduler().stats();
+    jfloat values[9] = {
+        static_cast<jfloat>(stats.steps),
+        stats.average_batch(),
+        static_cast<jfloat>(stats.peak_batch),
+        static_cast<jfloat>(stats.active),
+        static_cast<jfloat>(stats.waiting),
+        static_cast<jfloat>(stats.requests),
+        static_cast<jfloat>(stats.parked),
+        static_cast<jfloat>(stats.kv_tokens),
+        static_cast<jfloat>(stats.kv_deferrals),
+    };
+    jfloatArray result = env->NewFloatArray(9);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 9, values);
+    }
+    return result;
+}
+
+// {answers recorded, mean tokens, p50, p95, tokens reserved per request, answers that hit max_gen_len}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getOutputLengthStats(
+        JNIEnv* env,
+        jobject /* this */,
+        jint task) {
+    
+    if (task < 0 || task >= kTaskTypes) {
+        return nullptr;
+    }
+    jfloat values[6] = {0, 0, 0, 0, 0, 0};
+    if (g_mlc_engine) {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        OutputLengths::Stats stats = g_mlc_engine->output_length_stats(task);
+        values[0] = static_cast<jfloat>(stats.samples);
+        values[1] = static_cast<jfloat>(stats.mean);
+        values[2] = static_cast<jfloat>(stats.p50);
+        values[3] = static_cast<jfloat>(stats.p95);
+        values[4] = static_cast<jfloat>(g_mlc_engine->output_reservation(task));
+        values[5] = static_cast<jfloat>(stats.capped);
+    }
+    jfloatArray result = env->NewFloatArray(6);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getLatencyStats(
+        JNIEnv* env,
+        jobject /* this */,
+        jint priority) {
+    if (priority < 0 || priority >= kPriorityClasses) {
+        return nullptr;
+    }
+    BatchStats stats = batch_scheduler().stats();
+    const ClassLatency& latency = stats.classes[priority];
+    jfloat values[5] = {
+        static_cast<jfloat>(latency.requests),
+        latency.mean_wait_ms(),
+        latency.mean_first_token_ms(),
+        static_cast<jfloat>(latency.max_first_token_ms),
+        static_cast<jfloat>(latency.preemptions),
+    };
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setNativeTracing(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    set_native_tracing(enabled == JNI_TRUE);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getMetrics(
+        JNIEnv* env,
+        jobject /* this */) {
+    return env->NewStringUTF(latency_metrics().to_json().c_str());
+}
+
+// Trace id for what the calling thread asks of the engine from now on; returns the previous one
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setTraceId(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong traceId) {
+    return static_cast<jlong>(trace_context::exchange(static_cast<int64_t>(traceId)));
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getRequestTrace(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong traceId) {
+    std::string json = latency_metrics().trace_json(static_cast<int64_t>(traceId));
+    return env->NewStringUTF(json.empty() ? "{}" : json.c_str());
+}
+
+// BatteryManager's current and voltage, for the energy in getMetrics()
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_reportBatteryPower(
+        JNIEnv* env,
+        jobject /* this */,
+        jint currentMicroamps,
+        jint voltageMillivolts,
+        jboolean charging) {
+    
+    // The sign of CURRENT_NOW differs between vendors
+    double mw = std::fabs(static_cast<double>(currentMicroamps)) * voltageMillivolts / 1e6;
+    request_cost::power_sampler().report(charging == JNI_TRUE ? 0.0f : static_cast<float>(mw));
+}
+
+static MetricsSampler& metrics_sampler() {
+    static MetricsSampler* sampler = new MetricsSampler();
+    return *sampler;
+}
+
+// Tokens streamed so far and requests queued or running, for each sample
+static MetricsSampler::Probe metrics_probe() {
+    MetricsSampler::Probe probe;
+    probe.tokens = tokens_emitted().load(std::memory_order_relaxed);
+    size_t queued = async_requests().in_flight();
+    {
+        std::lock_guard<std::mutex> lock(g_turn_mutex);
+        queued += static_cast<size_t>(std::max(0, g_interactive_turns));
+    }
+    probe.queue = static_cast<uint32_t>(queued);
+    return probe;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_startMetricsSampler(
+        JNIEnv* env,
+        jobject /* this */,
+        jint intervalMs,
+        jint capacity) {
+    
+    int interval = std::max(MetricsSampler::kMinIntervalMs, static_cast<int>(intervalMs));
+    int kept = std::max(1, static_cast<int>(capacity));
+    metrics_sampler().start(interval, static_cast<size_t>(kept), metrics_probe);
+    LOGI("Metrics sampler started: every %d ms, last %d samples kept", interval, kept);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_stopMetricsSampler(
+        JNIEnv* env,
+        jobject /* this */) {
+    metrics_sampler().stop();
+}
+
+// Samples after sinceWallMs (0 for all) as JSON lines
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getMetricsSamples(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong sinceWallMs) {
+    return env->NewStringUTF(metrics_sampler().to_json_lines(static_cast<int64_t>(sinceWallMs)).c_str());
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_exportMetricsSamples(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPath) {
+    
+    std::string path = jstring_to_string(env, jPath);
+    if (path.empty() || !metrics_sampler().export_to(path)) {
+        LOGE("Could not export metrics samples to %s", path.c_str());
+        return JNI_FALSE;
+    }
+    LOGI("Metrics samples exported to %s", path.c_str());
+    return JNI_TRUE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_resetMetrics(
+        JNIEnv* env,
+        jobject /* this */) {
+    latency_metrics().reset();
+}
+
+// Where slow requests and fatal signals dump the flight recorder (flight_recorder.h)
+static std::mutex g_flight_mutex;
+static std::string g_flight_dir;  // under g_flight_mutex; empty until setFlightRecorder
+
+static GenerationWorker& flight_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcFlightWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+// Called on the thread finishing the request; the dump is written by the flight worker
+static void dump_flight_after_slo(int64_t request_id, int64_t e2e_us) {
+    flight_worker().submit(jni_cache().vm, [request_id, e2e_us](JNIEnv*) {
+        std::string dir;
+        {
+            std::lock_guard<std::mutex> lock(g_flight_mutex);
+            dir = g_flight_dir;
+        }
+        if (dir.empty()) {
+            return;
+        }
+        std::string path = flight::recorder().dump_in(dir, "slo");
+        if (path.empty()) {
+            LOGE("Could not write the flight recorder to %s", dir.c_str());
+            return;
+        }
+        LOGI("Request %lld took %.0f ms, past its SLO; flight recorder written to %s",
+             static_cast<long long>(request_id), e2e_us / 1000.0, path.c_str());
+    });
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setFlightRecorder(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jDir,
+        jint sloMs) {
+    
+    std::string dir = jstring_to_string(env, jDir);
+    if (dir.empty()) {
+        flight::recorder().set_slo(0, nullptr);
+        return JNI_TRUE;
+    }
+    mkdir(dir.c_str(), 0755);
+    if (!flight::crash::install(dir)) {
+        LOGE("Could not open the flight recorder's crash file in %s", dir.c_str());
+        return JNI_FALSE;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_flight_mutex);
+        g_flight_dir = dir;
+    }
+    flight::recorder().set_slo(static_cast<int64_t>(sloMs), dump_flight_after_slo);
+    LOGI("Flight recorder dumps to %s, SLO %d ms", dir.c_str(), static_cast<int>(sloMs));
+    return JNI_TRUE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_dumpFlightRecorder(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPath) {
+    
+    std::string path = jstring_to_string(env, jPath);
+    if (path.empty() || !flight::recorder().dump_to(path, "requested")) {
+        LOGE("Could not write the flight recorder to %s", path.c_str());
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+static stall::StallWatchdog& stall_watchdog() {
+    static stall::StallWatchdog* watchdog = new stall::StallWatchdog();
+    return *watchdog;
+}
+
+// For stall reports: what the app last said about the device and the profile in use
+static std::string describe_device_for_stall() {
+    DeviceState state;
+    {
+        std::lock_guard<std::mutex> lock(g_power_mutex);
+        state = g_power_state;
+    }
+    char line[192];
+    snprintf(line, sizeof(line), "thermal_headroom %.2f, battery %.0f%%, charging %d, power_save %d, profile %s\n",
+             g_thermal_headroom.load(), state.battery_percent, state.charging ? 1 : 0, state.power_save ? 1 : 0,
+             g_power_profile.load() == kProfileSaver ? "saver" : "normal");
+    return line;
+}
+
+static void on_generation_stall(int action) {
+    LOGE("Generation stalled; %s", action == stall::kActionReport ? "reported" : "aborted");
+    if (action == stall::kActionFallback) {
+        std::lock_guard<std::mutex> lock(g_route_mutex);
+        route_policy().local_stalled(static_cast<double>(stall::kFallbackCooldownMs));
+    }
+}
+
+// thresholdMs <= 0 stops the watchdog; the report goes to the flight recorder's directory
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setStallWatchdog(
+        JNIEnv* env,
+        jobject /* this */,
+        jint thresholdMs,
+        jint action) {
+    
+    if (thresholdMs <= 0) {
+        stall_watchdog().stop();
+        return;
+    }
+    stall::set_abort_hook([] {
+        // Under the Busy mutex, so the holder still has the engine
+        if (g_mlc_engine) {
+            g_mlc_engine->abort_stalled();
+        }
+    });
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(g_flight_mutex);
+        dir = g_flight_dir;
+    }
+    stall_watchdog().start(static_cast<int64_t>(thresholdMs), static_cast<int>(action), dir,
+                           describe_device_for_stall, on_generation_stall);
+    LOGI("Stall watchdog at %d ms, action %d%s", static_cast<int>(thresholdMs), static_cast<int>(action),
+         dir.empty() ? ", no dump directory" : "");
+}
+
+// {stalls, aborted, longest_ms}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getStallStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    stall::StallWatchdog::Stats stats = stall_watchdog().stats();
+    jfloat values[3] = {static_cast<jfloat>(stats.stalls), static_cast<jfloat>(stats.cancelled),
+                        static_cast<jfloat>(stats.longest_ms)};
+    jfloatArray result = env->NewFloatArray(3);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 3, values);
+    }
+    return result;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getLastStallReport(
+        JNIEnv* env,
+        jobject /* this */) {
+    return env->NewStringUTF(stall_watchdog().last_report().c_str());
+}
+
+static model_server::ModelServer& model_server_instance() {
+    static model_server::ModelServer* server = new model_server::ModelServer();
+    return *server;
+}
+
+// Serializes starting and stopping the server
+static std::mutex g_model_server_mutex;
+
+// A request from another process: a chat turn in a session of its own, so it
+// neither sees nor adds to this process's conversation
+static bool serve_model_request(const model_server::Request& request, const model_server::ModelServer::Emit& emit,
+                                std::string* error) {
+    InteractiveTurn turn;
+    if (!g_mlc_engine) {
+        *error = "Engine not initialized";
+        return false;
+    }
+    int64_t session = g_mlc_engine->create_session();
+    if (session < 0) {
+        *error = "Too many sessions open";
+        return false;
+    }
+    GenerationConfig config = g_mlc_engine->default_config();
+    if (request.max_gen_len > 0) {
+        config.max_gen_len = request.max_gen_len;
+    }
+    if (request.temperature >= 0.0f) {
+        config.temperature = request.temperature;
+    }
+    bool first = true;
+    bool failed = false;
+    g_mlc_engine->stream_in_session(session, request.prompt, [&](std::string token) {
+        if (first && token.rfind("Error:", 0) == 0) {
+            failed = true;
+            *error = token.substr(6 + (token.size() > 6 && token[6] == ' ' ? 1 : 0));
+        }
+        first = false;
+        if (!failed && !emit(token)) {
+            g_mlc_engine->abort();  // the client left or the server is stopping
+        }
+    }, config);
+    g_mlc_engine->close_session(session);
+    return !failed;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_startModelServer(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jName) {
+    
+    std::string name = jstring_to_string(env, jName);
+    if (name.empty()) {
+        LOGE("Model server needs a socket name");
+        return JNI_FALSE;
+    }
+    std::lock_guard<std::mutex> lock(g_model_server_mutex);
+    std::string error;
+    if (!model_server_instance().start(name, serve_model_request, &error)) {
+        LOGE("Could not start the model server: %s", error.c_str());
+        return JNI_FALSE;
+    }
+    LOGI("Serving the model at @%s", name.c_str());
+    return JNI_TRUE;
+}
+
+// Waits for a request being served to reach its next token
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_stopModelServer(
+        JNIEnv* env,
+        jobject /* this */) {
+    std::lock_guard<std::mutex> lock(g_model_server_mutex);
+    model_server_instance().stop();
+}
+
+// {served, failed, cancelled, refused, bytes_out}
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getModelServerStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    model_server::ModelServer::Stats stats = model_server_instance().stats();
+    jfloat values[5] = {static_cast<jfloat>(stats.served), static_cast<jfloat>(stats.failed),
+                        static_cast<jfloat>(stats.cancelled), static_cast<jfloat>(stats.refused),
+                        static_cast<jfloat>(stats.bytes_out)};
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+// Client side, for a process without an engine of its own
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_generateViaModelServer(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jName,
+        jstring jPrompt,
+        jint maxGenLen,
+        jfloat temperature,
+        jobject jCallback) {
+    
+    jmethodID callbackMethod = jCallback != nullptr ? jni_function1_invoke(env, jCallback) : nullptr;
+    if (jCallback != nullptr && callbackMethod == nullptr) {
+        LOGE("Failed to find callback method");
+        return env->NewStringUTF("Error: no callback method");
+    }
+    model_server::Request request;
+    request.prompt = jni_utf8(env, jPrompt);
+    request.max_gen_len = static_cast<int>(maxGenLen);
+    request.temperature = static_cast<float>(temperature);
+    std::string response;
+    std::string error;
+    bool ok = model_server::request(jstring_to_string(env, jName), request, [&](const char* text, size_t bytes) {
+        std::string piece(text, bytes);
+        response += piece;
+        if (callbackMethod != nullptr) {
+            jstring jPiece = env->NewStringUTF(piece.c_str());
+            env->CallObjectMethod(jCallback, callbackMethod, jPiece);
+            env->DeleteLocalRef(jPiece);
+            if (env->ExceptionCheck()) {
+                return false;  // thrown by the callback; it surfaces when this returns
+            }
         }
+        return true;
+    }, &error);
+    if (!ok) {
+        LOGE("Model server request failed: %s", error.c_str());
+        if (env->ExceptionCheck()) {
+            return nullptr;
+        }
+        return env->NewStringUTF(("Error: " + error).c_str());
     }
-};
-
-// Global engine instance
-std::unique_ptr<RealMlcEngine> g_mlc_engine;
-
-extern "C" {
+    return env->NewStringUTF(response.c_str());
+}
 
+// Empty path stops recording
 JNIEXPORT jboolean JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_initializeEngine(
+Java_com_example_studybuddy_ml_MlcLlmBridge_setRequestTrace(
         JNIEnv* env,
         jobject /* this */,
-        jstring jModelPath) {
-    
-    const char* model_path = env->GetStringUTFChars(jModelPath, nullptr);
-    LOGI("Initializing MLC-LLM engine with model path: %s", model_path);
+        jstring jPath) {
     
-    try {
-        // Create the engine if it doesn't exist
-        if (!g_mlc_engine) {
-            g_mlc_engine = std::make_unique<RealMlcEngine>();
-        }
-        
-        // Initialize the engine
-        bool success = g_mlc_engine->initialize(model_path);
-        
-        // Clean up
-        env->ReleaseStringUTFChars(jModelPath, model_path);
-        
-        return success ? JNI_TRUE : JNI_FALSE;
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in initializeEngine: %s", e.what());
-        env->ReleaseStringUTFChars(jModelPath, model_path);
+    std::string path = jstring_to_string(env, jPath);
+    if (path.empty()) {
+        request_trace().close();
+        return JNI_TRUE;
+    }
+    if (!request_trace().open(path)) {
+        LOGE("Could not open the request trace %s", path.c_str());
         return JNI_FALSE;
     }
+    LOGI("Recording anonymized requests to %s", path.c_str());
+    return JNI_TRUE;
 }
 
+// Blocks until every replayed turn has finished
 JNIEXPORT jstring JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_generateResponse(
+Java_com_example_studybuddy_ml_MlcLlmBridge_replayTrace(
         JNIEnv* env,
         jobject /* this */,
-        jstring jPrompt) {
+        jstring jPath,
+        jfloat speed) {
     
+    std::vector<TraceTurn> turns = read_request_trace(jstring_to_string(env, jPath));
+    if (turns.empty()) {
+        return env->NewStringUTF("Error: No turns in the trace");
+    }
     if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
         return env->NewStringUTF("Error: Engine not initialized");
     }
     
-    const char* prompt = env->GetStringUTFChars(jPrompt, nullptr);
-    LOGI("Processing chat prompt: %s", prompt);
+    // Recorded session -> replay session; created on first use, oldest closed when full
+    struct ReplaySessions {
+        std::map<int64_t, int64_t> mapped;
+        std::vector<int64_t> order;
+    };
+    auto sessions = std::make_shared<ReplaySessions>();
+    request_trace().set_paused(true);
+    latency_metrics().reset();
     
-    try {
-        // Generate a response
-        std::string response = g_mlc_engine->generate_response(prompt);
-        
-        // Clean up
-        env->ReleaseStringUTFChars(jPrompt, prompt);
-        
-        return env->NewStringUTF(response.c_str());
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in generateResponse: %s", e.what());
-        env->ReleaseStringUTFChars(jPrompt, prompt);
-        return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    std::vector<int64_t> ids;
+    for (const TraceTurn& turn : turns) {
+        if (speed > 0.0f) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(
+                    static_cast<int64_t>(static_cast<double>(turn.at_ms) * 1000.0 / speed)));
+        }
+        auto submitted = RequestTiming::Clock::now();
+        AsyncRequestTable::Run run = [sessions, turn, submitted](const std::string& text,
+                const std::function<void(const std::string&)>& emit,
+                const std::atomic<bool>& cancelled, std::string& error) {
+            InteractiveTurn interactive(submitted);
+            if (!g_mlc_engine) {
+                error = "Engine not initialized";
+                return false;
+            }
+            auto it = sessions->mapped.find(turn.session);
+            if (it == sessions->mapped.end()) {
+                int64_t session = g_mlc_engine->create_session();
+                if (session < 0 && !sessions->order.empty()) {
+                    g_mlc_engine->close_session(sessions->order.front());
+                    sessions->mapped.erase(std::find_if(sessions->mapped.begin(), sessions->mapped.end(),
+                            [&](const std::pair<const int64_t, int64_t>& entry) {
+                                return entry.second == sessions->order.front();
+                            }));
+                    sessions->order.erase(sessions->order.begin());
+                    session = g_mlc_engine->create_session();
+                }
+                if (session < 0) {
+                    error = "Too many sessions open";
+                    return false;
+                }
+                it = sessions->mapped.emplace(turn.session, session).first;
+                sessions->order.push_back(session);
+            }
+            // Output length as recorded; the text differs, the work per turn does not
+            GenerationConfig config = turn.config;
+            if (turn.output_tokens > 0) {
+                config.max_gen_len = static_cast<int>(turn.output_tokens);
+            }
+            bool failed = false;
+            g_mlc_engine->stream_in_session(it->second, text, [&](std::string token) {
+                failed = failed || token.rfind("Error:", 0) == 0;
+                if (failed) {
+                    error = token;
+                } else {
+                    emit(token);
+                }
+            }, config);
+            return !failed;
+        };
+        ids.push_back(async_requests().submit(env, turn.prompt, nullptr, run));
+    }
+    
+    int failed = 0;
+    for (int64_t id : ids) {
+        int status = id < 0 ? kAsyncFailed : async_requests().status(id);
+        while (status == kAsyncQueued || status == kAsyncRunning) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            status = async_requests().status(id);
+        }
+        failed += status == kAsyncFailed ? 1 : 0;
+        async_requests().release(id);
+    }
+    double wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    {
+        std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+        if (g_mlc_engine) {
+            for (int64_t session : sessions->order) {
+                g_mlc_engine->close_session(session);
+            }
+        }
     }
+    request_trace().set_paused(false);
+    
+    char head[192];
+    snprintf(head, sizeof(head), "{\"turns\": %zu, \"failed\": %d, \"recorded_ms\": %lld, \"wall_ms\": %.0f, \"metrics\": ",
+             turns.size(), failed, static_cast<long long>(turns.back().at_ms), wall_ms);
+    std::string summary = std::string(head) + latency_metrics().to_json() + "}";
+    LOGI("Replayed %zu turns in %.0f ms, %d failed", turns.size(), wall_ms, failed);
+    return env->NewStringUTF(summary.c_str());
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getRequestStatus(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong id) {
+    return static_cast<jint>(async_requests().status(id));
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getRequestOutput(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong id) {
+    return env->NewStringUTF(async_requests().output(id).c_str());
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getQueuePosition(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong id) {
+    return static_cast<jint>(async_requests().queue_position(id));
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_cancelRequest(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong id) {
+    return async_requests().cancel(id) ? JNI_TRUE : JNI_FALSE;
 }
 
 JNIEXPORT void JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_streamResponse(
+Java_com_example_studybuddy_ml_MlcLlmBridge_releaseRequest(
         JNIEnv* env,
-        jobject thiz,
-        jstring jPrompt,
-        jobject jCallback) {
-    
+        jobject /* this */,
+        jlong id) {
+    async_requests().release(id);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_setRequestCoalescing(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean enabled) {
+    async_requests().set_coalescing(enabled == JNI_TRUE);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getCoalescedRequests(
+        JNIEnv* env,
+        jobject /* this */) {
+    return static_cast<jlong>(async_requests().coalesced());
+}
+
+// createStudyPipeline: recognized pages through normalize -> retrieve -> generate
+// at once, each page an async request (stage_pipeline.h)
+struct StudyPage {
+    int64_t request = -1;
+    int64_t doc = -1;
+    std::string text;
+    std::string prompt;
+    std::string error;
+    RequestTiming::Clock::time_point submitted;
+};
+
+struct StudyPipeline {
+    std::shared_ptr<keyword_index::Handle> keywords;  // null: no context
+    std::string prompt_template;
+    size_t context_pages = 0;
+    std::mutex pages_mutex;
+    std::unordered_map<int64_t, std::string> pages;  // normalized text by doc, under pages_mutex
+    std::mutex stats_mutex;  // stats() measures since its previous call, one reader at a time
+    std::unique_ptr<stage_pipeline::StagePipeline<StudyPage>> stages;
+};
+
+static std::mutex g_pipelines_mutex;
+static std::map<int64_t, std::shared_ptr<StudyPipeline>> g_pipelines;  // under g_pipelines_mutex
+static int64_t g_next_pipeline = 1;
+
+static std::shared_ptr<StudyPipeline> find_pipeline(int64_t handle) {
+    std::lock_guard<std::mutex> lock(g_pipelines_mutex);
+    auto it = g_pipelines.find(handle);
+    return it == g_pipelines.end() ? nullptr : it->second;
+}
+
+static void replace_all(std::string& text, const std::string& from, const std::string& to) {
+    for (size_t at = text.find(from); at != std::string::npos; at = text.find(from, at + to.size())) {
+        text.replace(at, from.size(), to);
+    }
+}
+
+// Indexes the page, then fills the template with it and the earlier pages most like it
+static bool retrieve_page_context(StudyPipeline& pipeline, StudyPage& page) {
+    std::string context;
+    if (pipeline.keywords) {
+        std::vector<int64_t> ids(pipeline.context_pages + 1);
+        {
+            std::lock_guard<std::mutex> index_lock(pipeline.keywords->mutex);
+            pipeline.keywords->index.add(page.doc, page.text);
+            ids.resize(pipeline.keywords->index.search(page.text, ids.size(), ids.data(), nullptr));
+        }
+        std::lock_guard<std::mutex> lock(pipeline.pages_mutex);
+        size_t used = 0;
+        for (int64_t id : ids) {
+            auto it = pipeline.pages.find(id);
+            if (id == page.doc || it == pipeline.pages.end() || used == pipeline.context_pages) {
+                continue;
+            }
+            context += (used++ == 0 ? "" : "\n\n") + it->second;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(pipeline.pages_mutex);
+        pipeline.pages[page.doc] = page.text;
+    }
+    page.prompt = pipeline.prompt_template;
+    if (page.prompt.find("{page}") == std::string::npos) {
+        page.prompt += "\n\n{page}";
+    }
+    replace_all(page.prompt, "{context}", context);
+    replace_all(page.prompt, "{page}", page.text);
+    return true;
+}
+
+static bool generate_page(StudyPage& page, const std::function<bool()>& cancelled) {
+    std::string unused;
+    if (!async_requests().start(page.request, &unused)) {
+        return true;  // cancelled or released meanwhile
+    }
+    trace_context::Scope untraced(0);
+    InteractiveTurn turn(page.submitted);
     if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
-        return;
+        page.error = "Engine not initialized";
+        return false;
     }
-    
-    // Get the callback interface method
-    jclass callbackClass = env->GetObjectClass(jCallback);
-    jmethodID callbackMethod = env->GetMethodID(callbackClass, "invoke", "(Ljava/lang/Object;)Ljava/lang/Object;");
-    
-    if (callbackMethod == nullptr) {
-        LOGE("Failed to find callback method");
-        return;
+    int64_t session = g_mlc_engine->create_session();
+    if (session < 0) {
+        page.error = "Too many sessions open";
+        return false;
     }
+    bool first = true;
+    bool failed = false;
+    g_mlc_engine->stream_in_session(session, page.prompt, [&](std::string token) {
+        if (first && token.rfind("Error:", 0) == 0) {
+            failed = true;
+            page.error = token.substr(6 + (token.size() > 6 && token[6] == ' ' ? 1 : 0));
+        }
+        first = false;
+        if (failed) {
+            return;
+        }
+        async_requests().append(page.request, token);
+        if (cancelled()) {
+            g_mlc_engine->abort();
+        }
+    }, g_mlc_engine->default_config());
+    g_mlc_engine->close_session(session);
+    return !failed;
+}
+
+// On a generate worker, attached to the JVM for the request's callback
+static void finish_page(StudyPage& page, stage_pipeline::Outcome outcome) {
+    std::string unused;
+    if (outcome == stage_pipeline::kCancelled) {
+        async_requests().cancel(page.request);
+    } else if (outcome == stage_pipeline::kFailed) {
+        // Failed before generating: report it like a generation that failed
+        async_requests().start(page.request, &unused);
+    }
+    JNIEnv* env = nullptr;
+    JavaVM* vm = jni_cache().vm;
+    if (vm != nullptr) {
+        vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
+    }
+    async_requests().complete(env, page.request, outcome != stage_pipeline::kFailed, page.error);
+}
+
+static void attach_pipeline_thread(size_t stage) {
+    engine_heap::attach_thread();
+    JavaVM* vm = jni_cache().vm;
+    if (stage == 2 && vm != nullptr) {
+        JNIEnv* env = nullptr;
+        JavaVMAttachArgs args;
+        args.version = JNI_VERSION_1_6;
+        args.name = const_cast<char*>("MlcPipelineGenerate");
+        args.group = nullptr;
+        if (vm->AttachCurrentThread(&env, &args) != JNI_OK) {
+            LOGE("Failed to attach the pipeline's generate worker to the JVM");
+        }
+    }
+}
+
+static void detach_pipeline_thread(size_t stage) {
+    JavaVM* vm = jni_cache().vm;
+    if (stage == 2 && vm != nullptr) {
+        vm->DetachCurrentThread();
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_createStudyPipeline(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong keyword_handle,
+        jstring prompt_template,
+        jint context_pages,
+        jint normalize_workers,
+        jint retrieve_workers,
+        jint queue_depth) {
     
-    const char* prompt = env->GetStringUTFChars(jPrompt, nullptr);
-    
-    // Create a callback function to pass to the C++ stream function
-    auto callback = [env, jCallback, callbackMethod](const std::string& token) {
-        jstring jToken = env->NewStringUTF(token.c_str());
-        env->CallObjectMethod(jCallback, callbackMethod, jToken);
-        env->DeleteLocalRef(jToken);
-    };
+    auto pipeline = std::make_shared<StudyPipeline>();
+    pipeline->keywords = keyword_handle > 0 ? keyword_index::find_handle(keyword_handle) : nullptr;
+    pipeline->prompt_template = prompt_template != nullptr ? jni_utf8(env, prompt_template) : std::string();
+    pipeline->context_pages = static_cast<size_t>(std::max(0, static_cast<int>(context_pages)));
+    StudyPipeline* raw = pipeline.get();
     
-    // Stream the response
-    g_mlc_engine->stream_response(prompt, callback);
+    using Stages = stage_pipeline::StagePipeline<StudyPage>;
+    std::vector<Stages::Stage> stages;
+    stages.push_back({"normalize", std::max(1, static_cast<int>(normalize_workers)),
+                      [](StudyPage& page, const Stages::Cancelled&) {
+                          page.text = ocr_text::normalize(page.text, nullptr);
+                          return true;
+                      }});
+    stages.push_back({"retrieve", std::max(1, static_cast<int>(retrieve_workers)),
+                      [raw](StudyPage& page, const Stages::Cancelled&) {
+                          return retrieve_page_context(*raw, page);
+                      }});
+    // The engine runs one generation at a time
+    stages.push_back({"generate", 1, generate_page});
+    Stages::Options options;
+    options.queue_depth = static_cast<size_t>(std::max(1, static_cast<int>(queue_depth)));
+    options.cancelled = [](const StudyPage& page) { return async_requests().cancelled(page.request); };
+    options.done = finish_page;
+    options.thread_start = attach_pipeline_thread;
+    options.thread_exit = detach_pipeline_thread;
+    pipeline->stages = std::make_unique<Stages>(std::move(stages), std::move(options));
     
-    // Clean up
-    env->ReleaseStringUTFChars(jPrompt, prompt);
+    std::lock_guard<std::mutex> lock(g_pipelines_mutex);
+    int64_t handle = g_next_pipeline++;
+    g_pipelines[handle] = pipeline;
+    return static_cast<jlong>(handle);
 }
 
-JNIEXPORT void JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_resetChat(
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_submitPipelinePage(
         JNIEnv* env,
-        jobject /* this */) {
+        jobject /* this */,
+        jlong handle,
+        jlong doc_id,
+        jstring ocr_text,
+        jobject callback) {
     
-    if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
-        return;
+    std::shared_ptr<StudyPipeline> pipeline = find_pipeline(handle);
+    if (!pipeline || ocr_text == nullptr) {
+        return -1;
     }
-    
-    try {
-        g_mlc_engine->reset_chat();
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in resetChat: %s", e.what());
+    StudyPage page;
+    page.doc = static_cast<int64_t>(doc_id);
+    page.text = jni_utf8(env, ocr_text);
+    page.submitted = RequestTiming::Clock::now();
+    page.request = async_requests().enqueue(env, page.text, callback);
+    int64_t request = page.request;
+    // Waits here while the first stage is full
+    if (!pipeline->stages->push(std::move(page))) {
+        async_requests().cancel(request);
+        async_requests().complete(env, request, false, "Pipeline closed");
+        return -1;
     }
+    return static_cast<jlong>(request);
 }
 
 JNIEXPORT void JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_setTemperature(
+Java_com_example_studybuddy_ml_MlcLlmBridge_cancelPipeline(
         JNIEnv* env,
         jobject /* this */,
-        jfloat temperature) {
-    
-    if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
-        return;
+        jlong handle) {
+    std::shared_ptr<StudyPipeline> pipeline = find_pipeline(handle);
+    if (pipeline) {
+        pipeline->stages->cancel_all();
     }
-    
-    try {
-        g_mlc_engine->set_temperature(temperature);
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in setTemperature: %s", e.what());
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_MlcLlmBridge_getPipelineStats(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle) {
+    std::shared_ptr<StudyPipeline> pipeline = find_pipeline(handle);
+    if (!pipeline) {
+        return env->NewStringUTF("{}");
     }
+    std::lock_guard<std::mutex> lock(pipeline->stats_mutex);
+    return env->NewStringUTF(pipeline->stages->stats_json().c_str());
 }
 
 JNIEXPORT void JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_setTopP(
+Java_com_example_studybuddy_ml_MlcLlmBridge_closePipeline(
         JNIEnv* env,
         jobject /* this */,
-        jfloat topP) {
-    
-    if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
-        return;
+        jlong handle) {
+    std::shared_ptr<StudyPipeline> pipeline;
+    {
+        std::lock_guard<std::mutex> lock(g_pipelines_mutex);
+        auto it = g_pipelines.find(handle);
+        if (it == g_pipelines.end()) {
+            return;
+        }
+        pipeline = it->second;
+        g_pipelines.erase(it);
     }
-    
+    // What is in flight completes as cancelled; the last reference, here or in a
+    // submit still waiting to push, joins the workers
+    pipeline->stages->cancel_all();
+    pipeline->stages->close();
+}
+
+}
+
+// llm_bench.h: the same engine and globals, driven from a plain executable
+bool bench_load_model(const std::string& model_dir, ComputeBackend backend, std::string* error) {
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
     try {
-        g_mlc_engine->set_top_p(topP);
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in setTopP: %s", e.what());
+        if (!g_mlc_engine) {
+            std::lock_guard<std::mutex> settings_lock(g_settings_mutex);
+            g_mlc_engine = std::make_unique<RealMlcEngine>();
+            g_mlc_engine->set_thread_config(static_cast<ThreadAffinity>(g_thread_affinity.load()),
+                                            g_thread_workers.load());
+        }
+        g_mlc_engine->set_preferred_backend(backend);
+        if (!g_mlc_engine->initialize(model_dir)) {
+            *error = "could not load the model in " + model_dir;
+            return false;
+        }
+        return true;
+    } catch (const std::exception& e) {
+        *error = e.what();
+        return false;
     }
 }
 
-JNIEXPORT void JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_setMaxGenLen(
-        JNIEnv* env,
-        jobject /* this */,
-        jint maxGenLen) {
-    
+std::string bench_device() {
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
     if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
-        return;
+        return "";
     }
-    
-    try {
-        g_mlc_engine->set_max_gen_len(maxGenLen);
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in setMaxGenLen: %s", e.what());
+    const ComputeDevice& device = g_mlc_engine->compute_device();
+    std::string name = compute_backend_name(device.backend);
+    return device.name.empty() ? name : name + " " + device.name;
+}
+
+bool bench_run(int prompt_tokens, int decode_tokens, BenchRun* run, std::string* error) {
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    if (!g_mlc_engine) {
+        *error = "Engine not initialized";
+        return false;
     }
+    return g_mlc_engine->bench_run(prompt_tokens, decode_tokens, run, error);
 }
 
-JNIEXPORT void JNICALL
-Java_com_example_studybuddy_ml_MlcLlmBridge_closeEngine(
-        JNIEnv* env,
-        jobject /* this */) {
-    
+bool bench_concurrent(int sessions, int context_tokens, int decode_tokens, BenchConcurrentRun* run,
+                      std::string* error) {
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
     if (!g_mlc_engine) {
-        LOGE("Engine not initialized");
-        return;
+        *error = "Engine not initialized";
+        return false;
     }
-    
-    try {
+    return g_mlc_engine->bench_concurrent(sessions, context_tokens, decode_tokens, run, error);
+}
+
+void bench_configure(ThreadAffinity affinity, int workers, bool governor, float governor_target) {
+    g_thread_affinity = affinity;
+    g_thread_workers = workers;
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    if (g_mlc_engine) {
+        g_mlc_engine->set_governor(governor, governor_target);
+        g_mlc_engine->set_thread_config(affinity, workers);
+    }
+}
+
+int bench_governor_level() {
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    return g_mlc_engine ? g_mlc_engine->governor().level() : 0;
+}
+
+void bench_unload() {
+    std::lock_guard<std::mutex> engine_lock(g_engine_mutex);
+    if (g_mlc_engine) {
         g_mlc_engine->close();
-        g_mlc_engine.reset();
-        LOGI("Engine closed successfully");
-    } 
-    catch (const std::exception& e) {
-        LOGE("Exception in closeEngine: %s", e.what());
+        std::unique_ptr<RealMlcEngine> closed;
+        std::lock_guard<std::mutex> settings_lock(g_settings_mutex);
+        closed.swap(g_mlc_engine);
+    }
+}
+
+// engine_async.h: generations join the batch and are read as it decodes them
+std::shared_ptr<engine_async::Generation> engine_async::generate(const std::string& prompt,
+                                                                 const GenerationConfig* config, int priority) {
+    auto generation = std::make_shared<Generation>(&ready_queue());
+    if (!g_batching_ready.load()) {
+        generation->finish(false, "No batched generation in this model");
+        return generation;
+    }
+    BatchSequence seq;
+    seq.priority = priority;
+    seq.config = config != nullptr ? *config : GenerationConfig();
+    seq.default_config = config == nullptr;
+    seq.request = async_requests().enqueue(nullptr, prompt, nullptr);
+    int64_t request = seq.request;
+    generation->bind(request, [request] { async_requests().cancel(request); });
+    seq.on_text = [generation](int, const std::string& text) { generation->text(text); };
+    {
+        std::lock_guard<std::mutex> lock(g_async_generations_mutex);
+        g_async_generations[request] = generation;
+    }
+    batch_scheduler().enqueue(std::move(seq));
+    kick_batch_worker(nullptr);
+    return generation;
+}
+
+// engine_async::embed calls waiting for the embed worker. A pass takes every
+// call queued with the first one's source and priority, so async callers
+// share forward passes like concurrent blocking ones do (embed_batcher.h).
+struct AsyncEmbed {
+    std::vector<std::string> texts;
+    EmbedSource source = kEmbedAuto;
+    int priority = kPriorityBackground;
+    engine_async::Promise<engine_async::Embedding> promise;
+};
+
+static std::mutex g_async_embeds_mutex;
+static std::deque<AsyncEmbed> g_async_embeds;  // under g_async_embeds_mutex
+
+static GenerationWorker& embed_worker() {
+    static GenerationWorker* worker = new GenerationWorker("MlcEmbedWorker", engine_heap::attach_thread);
+    return *worker;
+}
+
+static void run_async_embeds(JNIEnv*) {
+    std::vector<AsyncEmbed> calls;
+    {
+        std::lock_guard<std::mutex> lock(g_async_embeds_mutex);
+        for (auto it = g_async_embeds.begin(); it != g_async_embeds.end();) {
+            if (calls.empty() || (it->source == calls[0].source && it->priority == calls[0].priority)) {
+                calls.push_back(std::move(*it));
+                it = g_async_embeds.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (calls.empty()) {
+        return;  // an earlier pass took them
+    }
+    std::vector<std::string> texts;
+    for (const AsyncEmbed& call : calls) {
+        texts.insert(texts.end(), call.texts.begin(), call.texts.end());
+    }
+    size_t dim = 0;
+    std::vector<float> rows = texts.empty() ? std::vector<float>()
+                                            : embed_batched(texts, calls[0].source, calls[0].priority, &dim);
+    size_t offset = 0;
+    for (AsyncEmbed& call : calls) {
+        if (!call.texts.empty() && (rows.empty() || dim == 0)) {
+            call.promise.fail("Embedding failed");
+            continue;
+        }
+        engine_async::Embedding embedding;
+        embedding.dim = dim;
+        embedding.rows.assign(rows.begin() + static_cast<std::ptrdiff_t>(offset * dim),
+                              rows.begin() + static_cast<std::ptrdiff_t>((offset + call.texts.size()) * dim));
+        offset += call.texts.size();
+        call.promise.resolve(std::move(embedding));
     }
 }
 
-} 
\ No newline at end of file
+engine_async::Future<engine_async::Embedding> engine_async::embed(std::vector<std::string> texts,
+                                                                  EmbedSource source, int priority) {
+    AsyncEmbed call;
+    call.texts = std::move(texts);
+    call.source = source;
+    call.priority = priority;
+    Future<Embedding> future = call.promise.future();
+    {
+        std::lock_guard<std::mutex> lock(g_async_embeds_mutex);
+        g_async_embeds.push_back(call);
+    }
+    if (!embed_worker().submit(nullptr, run_async_embeds)) {
+        call.promise.fail("Embed worker is shutting down");
+    }
+    return future;
+}
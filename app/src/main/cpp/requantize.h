@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * Lower-bit variants of the q4f16_1 weights, written on the device.
+ *
+ * Phones under the RAM threshold would rather run a slightly worse model than
+ * page a 1.5 GB one from flash every token. requantize_ndarray_cache()
+ * (ndarray_mmap_loader.h) rewrites the downloaded shards once into the
+ * q3f16_1 layout, under the same param names and index, so no second download
+ * is hosted per quantization; the engine loads the variant when a model library
+ * built for it is packaged next to the q4 one.
+ *
+ * q3f16_1, as MLC lays it out: ten 3-bit values per uint32, low bits first,
+ * each (q - 3) times the fp16 scale of its group of 40. A row of K values is
+ * padded with zeros to whole groups, so q_weight is [rows, groups * 4] and
+ * q_scale [rows, groups]. The values come from the q4 ones dequantized, so the
+ * error is measured against what the q4 model computes with.
+ */
+namespace requantize {
+
+enum Scheme : int {
+    kSchemeQ3 = 0,     // every quantized weight, the embedding too, to q3f16_1
+    kSchemeMixed = 1,  // MLP weights to q3f16_1; attention and the embedding stay q4f16_1
+};
+
+constexpr int kSchemeCount = 2;
+
+constexpr const char* kSourceTag = "q4f16_1";
+constexpr int kSourceValuesPerWord = 8;
+constexpr int kSourceGroupSize = 32;
+constexpr int kSourceZero = 7;
+
+constexpr int kValuesPerWord = 10;
+constexpr int kGroupSize = 40;
+constexpr int kWordsPerGroup = kGroupSize / kValuesPerWord;
+constexpr int kMaxInt = 3;
+
+// The quantization the model library of `scheme` is named with; nullptr for an unknown one
+inline const char* scheme_tag(int scheme) {
+    switch (scheme) {
+        case kSchemeQ3: return "q3f16_1";
+        case kSchemeMixed: return "q3f16_1-mixed";
+        default: return nullptr;
+    }
+}
+
+// Whether `scheme` rewrites the q4f16_1 weight `name` (a ".q_weight"; its ".q_scale" goes with it)
+inline bool rewrites(int scheme, const std::string& name) {
+    static const std::string kSuffix = ".q_weight";
+    if (name.size() <= kSuffix.size() || name.compare(name.size() - kSuffix.size(), kSuffix.size(), kSuffix) != 0) {
+        return false;
+    }
+    return scheme == kSchemeQ3 || (scheme == kSchemeMixed && name.find(".mlp.") != std::string::npos);
+}
+
+// The scale param that goes with weight `name`
+inline std::string scale_name(const std::string& name) {
+    return name.substr(0, name.size() - 6) + "scale";
+}
+
+// Library base name (no ".so") of the variant: `base` with its q4f16_1 swapped
+// for the scheme's tag; empty when `base` names no q4f16_1 build
+inline std::string model_lib_base(const std::string& base, int scheme) {
+    const char* tag = scheme_tag(scheme);
+    size_t at = base.rfind(kSourceTag);
+    if (tag == nullptr || at == std::string::npos) {
+        return std::string();
+    }
+    return base.substr(0, at) + tag + base.substr(at + strlen(kSourceTag));
+}
+
+inline size_t groups(int64_t k) {
+    return static_cast<size_t>((k + kGroupSize - 1) / kGroupSize);
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        exponent = 113;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+    float out;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+// IEEE half, rounded to nearest even; scales are positive and normal or zero
+inline uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t abs = bits & 0x7fffffffu;
+    if (abs >= 0x477ff000u) {
+        return static_cast<uint16_t>(sign | 0x7bffu);  // the largest half, not inf
+    }
+    if (abs < 0x38800000u) {
+        return static_cast<uint16_t>(sign | 0x0400u * (abs != 0));  // the smallest normal
+    }
+    uint32_t half = (abs - 0x38000000u) >> 13;
+    uint32_t rest = abs & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+// Squared error against the source, and the source's squared magnitude
+struct Error {
+    double squared = 0.0;
+    double reference = 0.0;
+
+    void add(const Error& other) {
+        squared += other.squared;
+        reference += other.reference;
+    }
+
+    // RMS error over RMS value
+    double relative() const { return reference > 0.0 ? std::sqrt(squared / reference) : 0.0; }
+};
+
+/**
+ * `rows` rows of K = `k` values, from q4f16_1 `weight` [rows, k / 8] and
+ * `scale` [rows, k / 32] to q3f16_1 `out_weight` [rows, groups(k) * 4] and
+ * `out_scale` [rows, groups(k)]. False if `k` is not whole q4 groups.
+ */
+inline bool convert(const uint32_t* weight, const uint16_t* scale, int64_t rows, int64_t k, uint32_t* out_weight,
+                    uint16_t* out_scale, Error* error) {
+    if (k <= 0 || k % kSourceGroupSize != 0) {
+        return false;
+    }
+    const size_t row_groups = groups(k);
+    const int64_t source_words = k / kSourceValuesPerWord;
+    const int64_t source_groups = k / kSourceGroupSize;
+    float values[kGroupSize];
+    Error total;
+    for (int64_t row = 0; row < rows; ++row) {
+        const uint32_t* words = weight + row * source_words;
+        const uint16_t* scales = scale + row * source_groups;
+        uint32_t* dst = out_weight + static_cast<size_t>(row) * row_groups * kWordsPerGroup;
+        uint16_t* dst_scale = out_scale + static_cast<size_t>(row) * row_groups;
+        for (size_t group = 0; group < row_groups; ++group) {
+            int64_t first = static_cast<int64_t>(group) * kGroupSize;
+            float peak = 0.0f;
+            for (int i = 0; i < kGroupSize; ++i) {
+                int64_t at = first + i;
+                float value = 0.0f;
+                if (at < k) {
+                    uint32_t word = words[at / kSourceValuesPerWord];
+                    int q = static_cast<int>((word >> (4 * (at % kSourceValuesPerWord))) & 0xfu);
+                    value = static_cast<float>(q - kSourceZero) * half_to_float(scales[at / kSourceGroupSize]);
+                }
+                values[i] = value;
+                peak = std::max(peak, std::fabs(value));
+            }
+            // The scale the kernels read is the fp16 one, so the values are rounded against it
+            uint16_t stored = float_to_half(peak / kMaxInt);
+            float step = half_to_float(stored);
+            dst_scale[group] = stored;
+            uint32_t* group_words = dst + group * kWordsPerGroup;
+            std::fill(group_words, group_words + kWordsPerGroup, 0u);
+            for (int i = 0; i < kGroupSize; ++i) {
+                int q = step > 0.0f ? static_cast<int>(std::lround(values[i] / step)) : 0;
+                q = std::min(kMaxInt, std::max(-kMaxInt, q));
+                group_words[i / kValuesPerWord] |= static_cast<uint32_t>(q + kMaxInt) << (3 * (i % kValuesPerWord));
+                float diff = static_cast<float>(q) * step - values[i];
+                total.squared += static_cast<double>(diff) * diff;
+                total.reference += static_cast<double>(values[i]) * values[i];
+            }
+        }
+    }
+    if (error != nullptr) {
+        error->add(total);
+    }
+    return true;
+}
+
+}  // namespace requantize
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <new>
+#include <vector>
+
+/**
+ * Bump allocator for the temporaries of one request.
+ *
+ * The decode loop's token lists are carved out of one block and dropped
+ * together when the request ends, instead of going through malloc on every
+ * growth. The block is sized from what recent requests actually used: a
+ * request that outgrows it chains another block, and at the next reset the
+ * chain is replaced by a single block a quarter larger than the highest peak of
+ * the last kHistory requests. When requests get smaller again the block
+ * shrinks the same way, so nothing is held that recent traffic did not need.
+ * No memory is reserved before the first request.
+ *
+ * Not thread-safe: the engine only uses it under its lock.
+ */
+class RequestArena {
+public:
+    static constexpr size_t kMinBlock = 16 << 10;
+    static constexpr size_t kHistory = 32;
+
+    RequestArena() = default;
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+    ~RequestArena() { release(); }
+
+    void* allocate(size_t bytes, size_t align) {
+        if (blocks_.empty() || !fits(blocks_.back(), bytes, align)) {
+            size_t size = std::max(bytes + align, blocks_.empty() ? std::max(target_, kMinBlock)
+                                                                  : blocks_.back().size * 2);
+            add_block(size);
+        }
+        Block& block = blocks_.back();
+        size_t offset = aligned(block, align);
+        block.used = offset + bytes;
+        used_ += bytes;
+        peak_ = std::max(peak_, used_);
+        return block.data + offset;
+    }
+
+    // End of request: everything allocated since the last reset is gone
+    void reset() {
+        if (requests_.size() == kHistory) {
+            requests_.pop_front();
+        }
+        requests_.push_back(peak_);
+        size_t high = *std::max_element(requests_.begin(), requests_.end());
+        target_ = std::max(kMinBlock, round_up(high + high / 4, 4 << 10));
+        used_ = 0;
+        peak_ = 0;
+
+        // One block of the target size; a block more than twice it is given back
+        if (blocks_.size() > 1 || (!blocks_.empty() && blocks_.back().size > target_ * 2)) {
+            release();
+        }
+        for (Block& block : blocks_) {
+            block.used = 0;
+        }
+    }
+
+    // Between requests: give the block back; the next request starts one of the target size
+    void trim() { release(); }
+
+    // Bytes held now, and the most one of the recent requests used
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Block& block : blocks_) {
+            total += block.size;
+        }
+        return total;
+    }
+
+    size_t recent_peak() const {
+        size_t high = peak_;
+        for (size_t peak : requests_) {
+            high = std::max(high, peak);
+        }
+        return high;
+    }
+
+    // Resets the arena when the request's scope ends, however it ends
+    class Scope {
+    public:
+        explicit Scope(RequestArena& arena) : arena_(arena) {}
+        ~Scope() { arena_.reset(); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        RequestArena& arena_;
+    };
+
+private:
+    struct Block {
+        char* data = nullptr;
+        size_t size = 0;
+        size_t used = 0;
+    };
+
+    std::vector<Block> blocks_;
+    std::deque<size_t> requests_;  // peak bytes of the last kHistory requests
+    size_t target_ = 0;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+
+    static size_t round_up(size_t value, size_t unit) { return (value + unit - 1) / unit * unit; }
+
+    static size_t aligned(const Block& block, size_t align) {
+        uintptr_t at = reinterpret_cast<uintptr_t>(block.data) + block.used;
+        return block.used + (align - at % align) % align;
+    }
+
+    static bool fits(const Block& block, size_t bytes, size_t align) {
+        return aligned(block, align) + bytes <= block.size;
+    }
+
+    void add_block(size_t size) {
+        char* data = static_cast<char*>(malloc(size));
+        if (data == nullptr) {
+            throw std::bad_alloc();
+        }
+        blocks_.push_back(Block{data, size, 0});
+    }
+
+    void release() {
+        for (Block& block : blocks_) {
+            free(block.data);
+        }
+        blocks_.clear();
+    }
+};
+
+// STL allocator over a RequestArena; deallocation is a no-op until the arena resets
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(RequestArena* arena) : arena_(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(arena_->allocate(count * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    RequestArena* arena() const { return arena_; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena_ == other.arena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena_ != other.arena(); }
+
+private:
+    RequestArena* arena_;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include "power_profile.h"
+
+/**
+ * CPU time and energy of requests, for LatencyMetrics.
+ *
+ * A chat turn has the engine to itself, so it is charged the process CPU time
+ * between its admission and completion: its own thread plus the TVM pool
+ * workers that run its kernels, which CLOCK_THREAD_CPUTIME_ID on the request
+ * thread alone would miss. Its own thread's time is kept as well. A batched
+ * sequence is charged each pass it took part in, split evenly across the
+ * sequences of the pass.
+ *
+ * Energy is battery power over the same spans. Power comes from
+ * BatteryManager samples the app reports (reportBatteryPower) while they are
+ * fresh, otherwise from the fuel gauge in sysfs, read at most every
+ * kSysfsRefreshMs. Neither is known on a charger, and requests are then
+ * charged no energy.
+ */
+namespace request_cost {
+
+static constexpr int64_t kReportedFreshMs = 2000;
+static constexpr int64_t kSysfsRefreshMs = 250;
+
+inline uint64_t cpu_clock_us(clockid_t clock) {
+    timespec ts{};
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000ull + static_cast<uint64_t>(ts.tv_nsec) / 1000ull;
+}
+
+inline uint64_t process_cpu_us() { return cpu_clock_us(CLOCK_PROCESS_CPUTIME_ID); }
+inline uint64_t thread_cpu_us() { return cpu_clock_us(CLOCK_THREAD_CPUTIME_ID); }
+
+class PowerSampler {
+public:
+    // A BatteryManager reading from the app; <= 0 when charging or unknown
+    void report(float mw) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reported_mw_ = mw;
+        reported_at_ms_ = now_ms();
+    }
+
+    // Drawn from the battery now, in mW; 0 when unknown
+    float power_mw() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now = now_ms();
+        if (reported_at_ms_ > 0 && now - reported_at_ms_ <= kReportedFreshMs) {
+            return reported_mw_ > 0.0f ? reported_mw_ : 0.0f;
+        }
+        if (read_at_ms_ == 0 || now - read_at_ms_ >= kSysfsRefreshMs) {
+            read_mw_ = power_profile::battery_power_mw();
+            read_at_ms_ = now;
+        }
+        return read_mw_ > 0.0f ? read_mw_ : 0.0f;
+    }
+
+private:
+    std::mutex mutex_;
+    float reported_mw_ = 0.0f;
+    int64_t reported_at_ms_ = 0;
+    float read_mw_ = 0.0f;
+    int64_t read_at_ms_ = 0;
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+inline PowerSampler& power_sampler() {
+    static PowerSampler* sampler = new PowerSampler();
+    return *sampler;
+}
+
+// Process and thread CPU and energy over a span on one thread
+class Span {
+public:
+    Span()
+        : process_us_(process_cpu_us()), thread_us_(thread_cpu_us()), start_(std::chrono::steady_clock::now()),
+          start_mw_(power_sampler().power_mw()) {}
+
+    uint64_t process_us() const { return process_cpu_us() - process_us_; }
+    uint64_t thread_us() const { return thread_cpu_us() - thread_us_; }
+
+    // Power at both ends, averaged, over the span
+    double energy_mj() const {
+        float end_mw = power_sampler().power_mw();
+        if (start_mw_ <= 0.0f || end_mw <= 0.0f) {
+            return 0.0;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+        return 0.5 * (start_mw_ + end_mw) * ms / 1000.0;
+    }
+
+private:
+    uint64_t process_us_;
+    uint64_t thread_us_;
+    std::chrono::steady_clock::time_point start_;
+    float start_mw_;
+};
+
+}  // namespace request_cost
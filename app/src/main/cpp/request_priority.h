@@ -0,0 +1,12 @@
+#pragma once
+
+// Priority class of a request, most urgent first. The batch admits and
+// preempts by it (batch_scheduler.h), admission gives each class its share of
+// memory (memory_forecast.h), and the worker pool runs its tasks in this
+// order (shared_pool.h).
+enum RequestPriority : int {
+    kPriorityInteractive = 0,  // someone is waiting on the answer
+    kPriorityBackground = 1,   // e.g. generating flashcards from a chapter
+    kPriorityPrefetch = 2,     // speculative work nobody asked for yet
+};
+constexpr int kPriorityClasses = 3;
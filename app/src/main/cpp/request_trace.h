@@ -0,0 +1,228 @@
+#pragma once
+
+#include <dmlc/recordio.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "generation_config.h"
+#include "json_fields.h"
+
+/**
+ * Anonymized traces of real chat traffic, for replaying its arrival pattern.
+ *
+ * Each finished turn appends one record: when it arrived relative to the start
+ * of the trace, its session, the generation config, prompt and output lengths
+ * and the latency it saw, plus the prompt with every word replaced. Words map
+ * to letters of the same length through a hash keyed per recording, so a
+ * prompt that repeats an earlier one (or starts with it) still does after
+ * anonymizing, and the replay hits the same KV reuse; the key is never
+ * written. The output itself is not kept, only its length.
+ *
+ * Records are framed as dmlc RecordIO (magic, length word, data padded to 4
+ * bytes), so an interrupted write loses at most the last record and the file
+ * reads with dmlc or MXNet recordio tools. The framing is done here with the
+ * header's constants: the RecordIOWriter/Reader bodies live in dmlc-core,
+ * which is not part of the prebuilt TVM runtime. Payloads are one JSON object
+ * of ASCII only, so they never contain the magic number and every record has
+ * cflag 0.
+ */
+struct TraceTurn {
+    int64_t at_ms = 0;    // arrival, since the trace was opened
+    int64_t session = 0;  // as recorded; replay gives every recorded session its own
+    GenerationConfig config;
+    size_t prompt_tokens = 0;
+    size_t output_tokens = 0;
+    double ttft_ms = -1.0;  // < 0 unknown
+    double e2e_ms = 0.0;
+    bool ok = true;
+    std::string prompt;  // anonymized
+
+    std::string to_json() const {
+        char head[512];
+        snprintf(head, sizeof(head),
+                 "{\"at_ms\": %lld, \"session\": %lld, \"temperature\": %.6g, \"top_p\": %.6g, "
+                 "\"repetition_penalty\": %.6g, \"max_gen_len\": %d, \"seed\": %lld, \"json\": %d, \"stops\": %zu, "
+                 "\"prompt_tokens\": %zu, \"output_tokens\": %zu, \"ttft_ms\": %.1f, \"e2e_ms\": %.1f, \"ok\": %d, "
+                 "\"prompt\": \"",
+                 static_cast<long long>(at_ms), static_cast<long long>(session), config.temperature, config.top_p,
+                 config.repetition_penalty, config.max_gen_len, static_cast<long long>(config.seed),
+                 config.json_schema.empty() ? 0 : 1, config.stop_strings.size(), prompt_tokens, output_tokens,
+                 ttft_ms, e2e_ms, ok ? 1 : 0);
+        std::string json = head;
+        for (char c : prompt) {
+            if (c == '"' || c == '\\') {
+                json += '\\';
+                json += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                json += escaped;
+            } else {
+                json += c;
+            }
+        }
+        json += "\"}";
+        return json;
+    }
+
+    // Stop strings are dropped (the record only counts them); a schema replays as any JSON
+    static bool from_json(const std::string& json, TraceTurn* turn) {
+        size_t open = json_value_offset(json, "prompt");
+        if (open == std::string::npos || (open = json.find('"', open)) == std::string::npos) {
+            return false;
+        }
+        TraceTurn parsed;
+        parsed.at_ms = json_int_field(json, "at_ms", 0);
+        parsed.session = json_int_field(json, "session", 0);
+        parsed.config.temperature = static_cast<float>(json_float_field(json, "temperature", parsed.config.temperature));
+        parsed.config.top_p = static_cast<float>(json_float_field(json, "top_p", parsed.config.top_p));
+        parsed.config.repetition_penalty =
+                static_cast<float>(json_float_field(json, "repetition_penalty", parsed.config.repetition_penalty));
+        parsed.config.max_gen_len = static_cast<int>(json_int_field(json, "max_gen_len", parsed.config.max_gen_len));
+        parsed.config.seed = json_int_field(json, "seed", -1);
+        if (json_int_field(json, "json", 0) != 0) {
+            parsed.config.json_schema = "{}";
+        }
+        parsed.prompt_tokens = static_cast<size_t>(json_int_field(json, "prompt_tokens", 0));
+        parsed.output_tokens = static_cast<size_t>(json_int_field(json, "output_tokens", 0));
+        parsed.ttft_ms = json_float_field(json, "ttft_ms", -1.0);
+        parsed.e2e_ms = json_float_field(json, "e2e_ms", 0.0);
+        parsed.ok = json_int_field(json, "ok", 1) != 0;
+        for (size_t i = open + 1; i < json.size(); ++i) {
+            char c = json[i];
+            if (c == '"') {
+                *turn = std::move(parsed);
+                return true;
+            }
+            if (c == '\\' && i + 1 < json.size()) {
+                c = json[++i];
+                if (c == 'u' && i + 4 < json.size()) {
+                    c = static_cast<char>(strtol(json.substr(i + 1, 4).c_str(), nullptr, 16));
+                    i += 4;
+                }
+            }
+            parsed.prompt += c;
+        }
+        return false;  // unterminated
+    }
+};
+
+// Same length, same word boundaries and punctuation; the result is ASCII
+inline std::string anonymize_text(const std::string& text, uint64_t key) {
+    auto word_byte = [](unsigned char c) {
+        return c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    };
+    std::string out;
+    out.reserve(text.size());
+    size_t i = 0;
+    while (i < text.size()) {
+        if (!word_byte(static_cast<unsigned char>(text[i]))) {
+            out += text[i++];
+            continue;
+        }
+        size_t end = i;
+        uint64_t hash = 1469598103934665603ull ^ key;
+        while (end < text.size() && word_byte(static_cast<unsigned char>(text[end]))) {
+            hash = (hash ^ static_cast<unsigned char>(text[end++])) * 1099511628211ull;
+        }
+        for (; i < end; ++i) {
+            hash ^= hash >> 29;
+            hash *= 0xbf58476d1ce4e5b9ull;
+            out += static_cast<char>('a' + (hash >> 32) % 26);
+        }
+    }
+    return out;
+}
+
+class RequestTraceWriter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Appends to `path`; arrival times count from now
+    bool open(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out_.close();
+        out_.clear();
+        out_.open(path, std::ios::binary | std::ios::app);
+        opened_ = Clock::now();
+        key_ = (static_cast<uint64_t>(std::random_device()()) << 32) ^ std::random_device()();
+        return static_cast<bool>(out_);
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out_.close();
+    }
+
+    bool is_open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return out_.is_open();
+    }
+
+    // While a trace is being replayed, so the replay does not record itself
+    void set_paused(bool paused) { paused_ = paused; }
+    bool recording() { return !paused_.load() && is_open(); }
+
+    // `turn.prompt` is the raw prompt; it is anonymized here
+    bool append(TraceTurn turn, Clock::time_point arrived) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!out_.is_open()) {
+            return false;
+        }
+        turn.at_ms = std::chrono::duration_cast<std::chrono::milliseconds>(arrived - opened_).count();
+        turn.prompt = anonymize_text(turn.prompt, key_);
+        std::string data = turn.to_json();
+        uint32_t header[2] = {dmlc::RecordIOWriter::kMagic,
+                              dmlc::RecordIOWriter::EncodeLRec(0, static_cast<uint32_t>(data.size()))};
+        static const char kPad[4] = {0, 0, 0, 0};
+        out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out_.write(data.data(), static_cast<std::streamsize>(data.size()));
+        out_.write(kPad, static_cast<std::streamsize>((4 - data.size() % 4) % 4));
+        out_.flush();
+        return static_cast<bool>(out_);
+    }
+
+private:
+    std::mutex mutex_;
+    std::atomic<bool> paused_{false};
+    std::ofstream out_;
+    Clock::time_point opened_ = Clock::now();
+    uint64_t key_ = 0;
+};
+
+// Every complete record in order; a torn or foreign record ends the read. Recordings
+// appended to one file are laid end to end, since each counts from its own open().
+inline std::vector<TraceTurn> read_request_trace(const std::string& path) {
+    std::vector<TraceTurn> turns;
+    int64_t offset = 0;
+    std::ifstream in(path, std::ios::binary);
+    uint32_t header[2];
+    while (in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        if (header[0] != dmlc::RecordIOWriter::kMagic || dmlc::RecordIOWriter::DecodeFlag(header[1]) != 0) {
+            break;
+        }
+        uint32_t length = dmlc::RecordIOWriter::DecodeLength(header[1]);
+        std::string data(length + (4 - length % 4) % 4, '\0');
+        if (!in.read(&data[0], static_cast<std::streamsize>(data.size()))) {
+            break;
+        }
+        data.resize(length);
+        TraceTurn turn;
+        if (TraceTurn::from_json(data, &turn)) {
+            if (!turns.empty() && turn.at_ms + offset < turns.back().at_ms) {
+                offset = turns.back().at_ms - turn.at_ms;
+            }
+            turn.at_ms += offset;
+            turns.push_back(std::move(turn));
+        }
+    }
+    return turns;
+}
@@ -0,0 +1,262 @@
+#include "response_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("RESPONSE_CACHE", __VA_ARGS__)
+#define LOGE(...) NLOGE("RESPONSE_CACHE", __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t kMagic = 0x43524253;  // "SBRC"
+constexpr uint32_t kVersion = 2;
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_bytes;
+    uint64_t clock;
+    uint64_t reserved;
+};
+
+uint64_t fnv1a(uint64_t hash, const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t fnv1a(uint64_t hash, const std::string& s) {
+    // The terminator keeps ("ab", "c") and ("a", "bc") apart
+    return fnv1a(hash, s.c_str(), s.size() + 1);
+}
+
+uint32_t checksum(uint64_t key, const char* text, size_t length) {
+    uint64_t hash = fnv1a(14695981039346656037ull, reinterpret_cast<const char*>(&key), sizeof(key));
+    hash = fnv1a(hash, text, length);
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+}  // namespace
+
+ResponseCache::~ResponseCache() {
+    close();
+}
+
+bool ResponseCache::open(const std::string& path, uint32_t slots) {
+    close();
+    if (slots == 0) {
+        return false;
+    }
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        LOGE("Cannot open %s: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+    size_t bytes = sizeof(FileHeader) + static_cast<size_t>(slots) * kSlotBytes;
+    FileHeader header = {};
+    bool valid = static_cast<size_t>(st.st_size) == bytes &&
+                 pread(fd_, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+                 header.magic == kMagic && header.version == kVersion && header.slots == slots &&
+                 header.slot_bytes == kSlotBytes;
+    if (!valid && (ftruncate(fd_, 0) != 0 || ftruncate(fd_, static_cast<off_t>(bytes)) != 0)) {
+        LOGE("Cannot size %s: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+    map_ = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        close();
+        return false;
+    }
+    map_bytes_ = bytes;
+    slots_ = slots;
+    if (!valid) {
+        header = {kMagic, kVersion, slots, kSlotBytes, 0, 0};
+        memcpy(map_, &header, sizeof(header));
+    }
+    for (uint32_t i = 0; i < slots_; ++i) {
+        SlotHeader* s = slot(i);
+        const char* text = reinterpret_cast<const char*>(s + 1);
+        if (s->key == 0) {
+            continue;
+        }
+        size_t length = static_cast<size_t>(s->prompt_length) + s->length;
+        if (length > kSlotBytes - sizeof(SlotHeader) || s->checksum != checksum(s->key, text, length)) {
+            s->key = 0;
+            continue;
+        }
+        index_[s->key] = i;
+    }
+    LOGI("Opened response cache %s: %zu of %u slots used", path.c_str(), index_.size(), slots_);
+    return true;
+}
+
+void ResponseCache::close() {
+    if (map_ != nullptr) {
+        msync(map_, map_bytes_, MS_ASYNC);
+        munmap(map_, map_bytes_);
+        map_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    map_bytes_ = 0;
+    slots_ = 0;
+    index_.clear();
+}
+
+ResponseCache::SlotHeader* ResponseCache::slot(uint32_t i) const {
+    return reinterpret_cast<SlotHeader*>(static_cast<uint8_t*>(map_) + sizeof(FileHeader) +
+                                         static_cast<size_t>(i) * kSlotBytes);
+}
+
+uint64_t ResponseCache::tick() {
+    FileHeader* header = static_cast<FileHeader*>(map_);
+    return ++header->clock;
+}
+
+bool ResponseCache::cacheable(const GenerationConfig& config) {
+    return config.temperature <= 0.0f || config.seed >= 0;
+}
+
+std::string ResponseCache::normalize(const std::string& prompt) {
+    std::string out;
+    out.reserve(prompt.size());
+    for (char c : prompt) {
+        if (is_space(c)) {
+            if (!out.empty() && out.back() != ' ') {
+                out += ' ';
+            }
+            continue;
+        }
+        out += (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+    while (!out.empty() && (out.back() == ' ' || strchr("?!.,;:", out.back()) != nullptr)) {
+        out.pop_back();
+    }
+    return out;
+}
+
+uint64_t ResponseCache::scope(const GenerationConfig& config, const std::string& adapter, uint64_t model_hash) {
+    char sampling[128];
+    // The seed only matters when sampling; greedy answers are the same under any seed
+    long long seed = config.temperature <= 0.0f ? -1 : static_cast<long long>(config.seed);
+    snprintf(sampling, sizeof(sampling), "%.6g %.6g %.6g %d %lld", config.temperature, config.top_p,
+             config.repetition_penalty, config.max_gen_len, seed);
+    uint64_t hash = fnv1a(14695981039346656037ull, std::string(sampling));
+    hash = fnv1a(hash, config.json_schema);
+    for (const std::string& stop : config.stop_strings) {
+        hash = fnv1a(hash, stop);
+    }
+    hash = fnv1a(hash, adapter);
+    return fnv1a(hash, reinterpret_cast<const char*>(&model_hash), sizeof(model_hash));
+}
+
+uint64_t ResponseCache::key(const std::string& normalized_prompt, uint64_t scope) {
+    uint64_t hash = fnv1a(14695981039346656037ull, normalized_prompt);
+    hash = fnv1a(hash, reinterpret_cast<const char*>(&scope), sizeof(scope));
+    return hash != 0 ? hash : 1;
+}
+
+bool ResponseCache::find(uint64_t key, Entry* entry, bool count) {
+    auto it = index_.find(key);
+    if (!is_open() || it == index_.end()) {
+        misses_ += count ? 1 : 0;
+        return false;
+    }
+    SlotHeader* s = slot(it->second);
+    const char* text = reinterpret_cast<const char*>(s + 1);
+    entry->scope = s->scope;
+    entry->prompt.assign(text, s->prompt_length);
+    entry->response.assign(text + s->prompt_length, s->length);
+    entry->millis = s->millis;
+    if (count) {
+        s->used = tick();
+        hits_++;
+    }
+    return true;
+}
+
+bool ResponseCache::put(uint64_t key, const Entry& entry) {
+    size_t length = entry.prompt.size() + entry.response.size();
+    if (!is_open() || key == 0 || length > kSlotBytes - sizeof(SlotHeader)) {
+        return false;
+    }
+    uint32_t target = 0;
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        target = it->second;
+    } else {
+        // A free slot, else the least recently used
+        uint64_t oldest = UINT64_MAX;
+        for (uint32_t i = 0; i < slots_; ++i) {
+            SlotHeader* s = slot(i);
+            if (s->key == 0) {
+                target = i;
+                break;
+            }
+            if (s->used < oldest) {
+                oldest = s->used;
+                target = i;
+            }
+        }
+        SlotHeader* victim = slot(target);
+        if (victim->key != 0) {
+            index_.erase(victim->key);
+        }
+    }
+    SlotHeader* s = slot(target);
+    s->key = 0;
+    char* text = reinterpret_cast<char*>(s + 1);
+    memcpy(text, entry.prompt.data(), entry.prompt.size());
+    memcpy(text + entry.prompt.size(), entry.response.data(), entry.response.size());
+    s->scope = entry.scope;
+    s->prompt_length = static_cast<uint32_t>(entry.prompt.size());
+    s->length = static_cast<uint32_t>(entry.response.size());
+    s->millis = entry.millis;
+    s->used = tick();
+    s->checksum = checksum(key, text, length);
+    s->key = key;
+    index_[key] = target;
+    return true;
+}
+
+bool ResponseCache::erase(uint64_t key) {
+    auto it = index_.find(key);
+    if (!is_open() || it == index_.end()) {
+        return false;
+    }
+    slot(it->second)->key = 0;
+    index_.erase(it);
+    return true;
+}
+
+void ResponseCache::clear() {
+    if (!is_open()) {
+        return;
+    }
+    for (uint32_t i = 0; i < slots_; ++i) {
+        slot(i)->key = 0;
+    }
+    index_.clear();
+    msync(map_, map_bytes_, MS_ASYNC);
+}
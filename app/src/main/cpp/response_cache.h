@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "generation_config.h"
+
+/**
+ * Exact-match cache of first-turn answers, for the questions students ask over
+ * and over ("what is photosynthesis").
+ *
+ * A key is FNV-1a over the normalized prompt (lower case, whitespace collapsed,
+ * trailing punctuation dropped) and a scope: the sampling settings, the
+ * adapter and the model fingerprint. Only deterministic requests are cached:
+ * greedy, or with a fixed seed, which replays token for token anyway.
+ *
+ * The cache is one file of fixed-size slots, mmapped: a header, then `slots`
+ * slots of kSlotBytes, each a SlotHeader, the normalized prompt and the
+ * response text. A slot's key is cleared while it is rewritten and its
+ * checksum covers the text, so one torn by a crash is skipped on open. When
+ * full, the least recently used slot is replaced.
+ *
+ * The prompt and scope are kept so semantic_cache.h can serve an entry to a
+ * question worded differently, and the time the answer took to generate so
+ * the latency a hit saves can be reported.
+ */
+class ResponseCache {
+public:
+    static constexpr uint32_t kDefaultSlots = 256;  // 1 MB
+    static constexpr uint32_t kSlotBytes = 4096;
+
+    ResponseCache() = default;
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+    ~ResponseCache();
+
+    bool open(const std::string& path, uint32_t slots = kDefaultSlots);
+    void close();
+    bool is_open() const { return map_ != nullptr; }
+
+    // Whether `config` produces the same answer every time
+    static bool cacheable(const GenerationConfig& config);
+    static std::string normalize(const std::string& prompt);
+    static uint64_t scope(const GenerationConfig& config, const std::string& adapter, uint64_t model_hash);
+    static uint64_t key(const std::string& normalized_prompt, uint64_t scope);
+
+    struct Entry {
+        uint64_t scope = 0;
+        std::string prompt;  // normalized
+        std::string response;
+        uint32_t millis = 0;  // to generate it
+    };
+
+    // Counts a hit or a miss; `count` false for a semantic candidate checked only
+    bool find(uint64_t key, Entry* entry, bool count = true);
+    // False if the prompt and response do not fit a slot
+    bool put(uint64_t key, const Entry& entry);
+    bool erase(uint64_t key);
+    void clear();
+
+    size_t entries() const { return index_.size(); }
+    uint32_t slots() const { return slots_; }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    struct SlotHeader {
+        uint64_t key;  // 0: empty
+        uint64_t scope;
+        uint64_t used;  // clock of the last hit or write
+        uint32_t prompt_length;
+        uint32_t length;  // of the response, after the prompt
+        uint32_t millis;
+        uint32_t checksum;  // of the key and the text
+    };
+
+    SlotHeader* slot(uint32_t i) const;
+    uint64_t tick();
+
+    int fd_ = -1;
+    void* map_ = nullptr;
+    size_t map_bytes_ = 0;
+    uint32_t slots_ = 0;
+    std::unordered_map<uint64_t, uint32_t> index_;  // key -> slot
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
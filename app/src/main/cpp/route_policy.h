@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/**
+ * Choice between the on-device engine and the remote API (LlmApiService) per
+ * request, by predicted latency.
+ *
+ * Local latency is predicted from the device's own measurements
+ * (LatencyMetrics): prompt tokens at the measured prefill rate, the answer at
+ * the measured time per output token, and the requests ahead of it at the
+ * measured mean request time. Thermal headroom past kThermalKnee stretches
+ * all of it, as the governor will be slowing decode by then. Remote latency
+ * is the median of the last kRemoteSamples recorded calls, with their time
+ * per output token for answers of another length.
+ *
+ * The faster path wins by more than the hedge margin; within it, or while
+ * either side has too few samples or the remote one too wide a spread to
+ * trust, the request is hedged: sent to both, the first answer kept and the
+ * other cancelled. Remote failures count as samples of kFailureMs; after
+ * kMinRemoteSamples of them in a row requests stay local, with one in
+ * kProbeEvery hedged to notice when the network is back. After the stall
+ * watchdog gave up on a local generation, auto mode sends requests remotely
+ * until the cooldown ends.
+ */
+class RoutePolicy {
+public:
+    enum Route {
+        kRouteLocal = 0,
+        kRouteRemote = 1,
+        kRouteHedge = 2,
+    };
+
+    enum Mode {
+        kModeAuto = 0,
+        kModeLocal = 1,   // always on device
+        kModeRemote = 2,  // always remote, unless it keeps failing
+    };
+
+    static constexpr size_t kRemoteSamples = 16;
+    static constexpr size_t kMinRemoteSamples = 3;
+    static constexpr double kFailureMs = 30000.0;
+    static constexpr double kThermalKnee = 0.8;
+    static constexpr double kSpreadLimit = 3.0;  // p90 / p50 of remote latency above which it is hedged
+    static constexpr uint64_t kProbeEvery = 8;
+
+    // What the device measured so far; zeros where nothing was measured yet
+    struct LocalProfile {
+        double prefill_tokens_per_s = 0.0;
+        double tpot_ms = 0.0;
+        double request_ms = 0.0;  // mean end-to-end time of a request
+        double thermal_headroom = -1.0;
+    };
+
+    struct Prediction {
+        int route = kRouteLocal;
+        double local_ttft_ms = 0.0;
+        double local_total_ms = 0.0;
+        double remote_ttft_ms = -1.0;  // -1 without remote samples
+        double remote_total_ms = -1.0;
+    };
+
+    void configure(int mode, double hedge_margin) {
+        mode_ = mode == kModeLocal || mode == kModeRemote ? mode : kModeAuto;
+        hedge_margin_ = std::max(0.0, hedge_margin);
+    }
+
+    int mode() const { return mode_; }
+
+    // A finished remote call; `ttft_ms` equals `total_ms` when it did not stream
+    void record_remote(double ttft_ms, double total_ms, size_t tokens, bool ok) {
+        Sample sample;
+        sample.ok = ok;
+        sample.ttft_ms = ok ? std::max(0.0, ttft_ms) : kFailureMs;
+        sample.total_ms = ok ? std::max(sample.ttft_ms, total_ms) : kFailureMs;
+        sample.tokens = ok ? tokens : 0;
+        samples_.push_back(sample);
+        if (samples_.size() > kRemoteSamples) {
+            samples_.pop_front();
+        }
+    }
+
+    // The device stalled; prefer the remote API for `cooldown_ms`
+    void local_stalled(double cooldown_ms) {
+        stalled_until_ = std::chrono::steady_clock::now() +
+                         std::chrono::milliseconds(static_cast<int64_t>(std::max(0.0, cooldown_ms)));
+    }
+
+    // A hedged request finished; `local_won` when the device answered first
+    void record_hedge(bool local_won) { (local_won ? hedge_local_wins_ : hedge_remote_wins_)++; }
+
+    Prediction predict(const LocalProfile& local, size_t prompt_tokens, size_t output_tokens, size_t queued) {
+        Prediction p;
+        double stretch = 1.0;
+        if (local.thermal_headroom > kThermalKnee) {
+            stretch += std::min(1.0, (local.thermal_headroom - kThermalKnee) * 2.5);
+        }
+        double prefill_ms = local.prefill_tokens_per_s > 0.0 ? prompt_tokens * 1000.0 / local.prefill_tokens_per_s
+                                                             : 0.0;
+        p.local_ttft_ms = (queued * local.request_ms + prefill_ms) * stretch;
+        p.local_total_ms = p.local_ttft_ms + output_tokens * local.tpot_ms * stretch;
+
+        bool trusted = remote_estimate(output_tokens, &p.remote_ttft_ms, &p.remote_total_ms);
+        bool measured = local.tpot_ms > 0.0 && local.prefill_tokens_per_s > 0.0;
+        bool failing = remote_failing();
+        failing_routes_ = failing ? failing_routes_ + 1 : 0;
+        if (mode_ == kModeLocal) {
+            p.route = kRouteLocal;
+        } else if (failing) {
+            p.route = failing_routes_ % kProbeEvery == 0 ? kRouteHedge : kRouteLocal;
+        } else if (mode_ == kModeRemote || std::chrono::steady_clock::now() < stalled_until_) {
+            p.route = kRouteRemote;
+        } else if (!trusted || !measured) {
+            p.route = kRouteHedge;  // cannot compare yet: let both run and learn from the result
+        } else if (p.local_total_ms * (1.0 + hedge_margin_) < p.remote_total_ms) {
+            p.route = kRouteLocal;
+        } else if (p.remote_total_ms * (1.0 + hedge_margin_) < p.local_total_ms) {
+            p.route = kRouteRemote;
+        } else {
+            p.route = kRouteHedge;
+        }
+        routed_[p.route]++;
+        return p;
+    }
+
+    uint64_t routed(int route) const { return route >= 0 && route < 3 ? routed_[route] : 0; }
+    uint64_t hedge_local_wins() const { return hedge_local_wins_; }
+    uint64_t hedge_remote_wins() const { return hedge_remote_wins_; }
+    size_t remote_samples() const { return samples_.size(); }
+
+private:
+    struct Sample {
+        double ttft_ms = 0.0;
+        double total_ms = 0.0;
+        size_t tokens = 0;
+        bool ok = true;
+    };
+
+    static double quantile(std::vector<double> values, double q) {
+        if (values.empty()) {
+            return -1.0;
+        }
+        size_t at = static_cast<size_t>(q * static_cast<double>(values.size() - 1));
+        std::nth_element(values.begin(), values.begin() + at, values.end());
+        return values[at];
+    }
+
+    // Median remote latency for `output_tokens`; false while too few or too
+    // scattered samples to rely on
+    bool remote_estimate(size_t output_tokens, double* ttft_ms, double* total_ms) const {
+        std::vector<double> ttft, per_token, total;
+        for (const Sample& sample : samples_) {
+            ttft.push_back(sample.ttft_ms);
+            total.push_back(sample.total_ms);
+            if (sample.ok && sample.tokens > 0) {
+                per_token.push_back((sample.total_ms - sample.ttft_ms) / sample.tokens);
+            }
+        }
+        if (samples_.empty()) {
+            return false;
+        }
+        *ttft_ms = quantile(ttft, 0.5);
+        double tpot = quantile(per_token, 0.5);
+        // Non-streamed calls: latency as measured, whatever the length
+        *total_ms = tpot > 0.0 ? *ttft_ms + output_tokens * tpot : quantile(total, 0.5);
+        double p50 = quantile(total, 0.5);
+        double p90 = quantile(total, 0.9);
+        return samples_.size() >= kMinRemoteSamples && p50 > 0.0 && p90 <= kSpreadLimit * p50;
+    }
+
+    // The last kMinRemoteSamples calls all failed
+    bool remote_failing() const {
+        if (samples_.size() < kMinRemoteSamples) {
+            return false;
+        }
+        for (size_t i = samples_.size() - kMinRemoteSamples; i < samples_.size(); ++i) {
+            if (samples_[i].ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int mode_ = kModeAuto;
+    double hedge_margin_ = 0.25;
+    std::deque<Sample> samples_;
+    uint64_t routed_[3] = {0, 0, 0};
+    uint64_t hedge_local_wins_ = 0;
+    uint64_t hedge_remote_wins_ = 0;
+    std::chrono::steady_clock::time_point stalled_until_{};
+    uint64_t failing_routes_ = 0;
+};
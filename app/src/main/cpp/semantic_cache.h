@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "response_cache.h"
+#include "vector_index.h"
+
+/**
+ * Near-duplicate lookup over the response cache: "what's photosynthesis" and
+ * "explain photosynthesis to me" should not both be generated.
+ *
+ * Every answer the response cache keeps is also indexed by the embedding of
+ * its normalized prompt, by its cache key, in a VectorIndex next to the cache
+ * file. A question that misses the exact cache is embedded and its nearest
+ * prompts are looked up; the best one in the same scope (sampling settings,
+ * adapter, model) at or above the similarity threshold is a hit. Depending on
+ * the mode, the cached answer is served as it is or given to the model as a
+ * reference for a fresh answer.
+ *
+ * Hits are kept in a short audit trail so a wrong one can be spotted and
+ * reported; a reported prompt is taken out of the semantic index (its exact
+ * entry still answers the question it was generated for).
+ *
+ * The index is opened on the first embedding, whose width it takes. Not
+ * thread safe; the engine calls it under its lock.
+ */
+class SemanticCache {
+public:
+    static constexpr size_t kCandidates = 4;
+    static constexpr size_t kAuditSize = 16;
+
+    enum Mode {
+        kModeServe = 0,  // answer with the cached response
+        kModeSeed = 1,   // generate, with the cached response as a reference
+    };
+
+    struct Hit {
+        uint64_t key = 0;
+        float similarity = 0.0f;
+        std::string query;    // normalized
+        std::string matched;  // the cached prompt it was served for
+    };
+
+    SemanticCache() = default;
+    SemanticCache(const SemanticCache&) = delete;
+    SemanticCache& operator=(const SemanticCache&) = delete;
+
+    void open(const std::string& dir) {
+        close();
+        dir_ = dir;
+    }
+
+    void close() {
+        index_.close();
+        dir_.clear();
+        index_open_ = false;
+        index_failed_ = false;
+        audit_.clear();
+    }
+
+    // `threshold` in (0, 1] enables lookups, 0 turns them off
+    void configure(float threshold, int mode) {
+        threshold_ = threshold > 0.0f && threshold <= 1.0f ? threshold : 0.0f;
+        mode_ = mode == kModeSeed ? kModeSeed : kModeServe;
+    }
+
+    bool enabled() const { return threshold_ > 0.0f && !dir_.empty() && !index_failed_; }
+    float threshold() const { return threshold_; }
+    int mode() const { return mode_; }
+
+    // The best entry of `scope` within the threshold of `embedding`. Entries
+    // the response cache has evicted are dropped from the index on the way.
+    bool lookup(const std::vector<float>& embedding, uint64_t scope, ResponseCache& cache, uint64_t* key,
+                float* similarity, ResponseCache::Entry* entry) {
+        if (!enabled() || !ensure_index(embedding.size()) || index_.size() == 0) {
+            misses_++;
+            return false;
+        }
+        int64_t ids[kCandidates];
+        float scores[kCandidates];
+        size_t found = index_.search(embedding.data(), kCandidates, VectorIndex::kDefaultProbes, ids, scores);
+        for (size_t i = 0; i < found && scores[i] >= threshold_; ++i) {
+            uint64_t candidate = static_cast<uint64_t>(ids[i]);
+            if (!cache.find(candidate, entry, false)) {
+                index_.remove(ids[i]);
+                continue;
+            }
+            if (entry->scope == scope) {
+                *key = candidate;
+                *similarity = scores[i];
+                return true;
+            }
+        }
+        misses_++;
+        return false;
+    }
+
+    void add(uint64_t key, const std::vector<float>& embedding) {
+        if (enabled() && ensure_index(embedding.size())) {
+            index_.add(static_cast<int64_t>(key), embedding.data());
+        }
+    }
+
+    // A hit served or seeded; `saved_ms` is the generation time it spared, if any
+    void note_hit(Hit hit, double saved_ms) {
+        hits_++;
+        saved_ms_ += saved_ms > 0.0 ? saved_ms : 0.0;
+        audit_.push_back(std::move(hit));
+        if (audit_.size() > kAuditSize) {
+            audit_.pop_front();
+        }
+    }
+
+    // The most recent hit was wrong: stop matching other questions to its prompt
+    bool report_false_hit() {
+        if (audit_.empty()) {
+            return false;
+        }
+        if (index_open_) {
+            index_.remove(static_cast<int64_t>(audit_.back().key));
+        }
+        audit_.pop_back();
+        false_hits_++;
+        return true;
+    }
+
+    // Recent hits, oldest first
+    const std::deque<Hit>& audit() const { return audit_; }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t false_hits() const { return false_hits_; }
+    double saved_ms() const { return saved_ms_; }
+    size_t size() const { return index_open_ ? index_.size() : 0; }
+
+    void sync() {
+        if (index_open_) {
+            index_.sync();
+        }
+    }
+
+private:
+    bool ensure_index(size_t dim) {
+        if (!index_open_ && !index_failed_ && dim > 0) {
+            index_open_ = index_.open(dir_, static_cast<uint32_t>(dim));
+            // Another width (a new embedding model) or a bad directory: stay off until reopened
+            index_failed_ = !index_open_;
+        }
+        return index_open_;
+    }
+
+    std::string dir_;
+    VectorIndex index_;
+    bool index_open_ = false;
+    bool index_failed_ = false;
+    float threshold_ = 0.0f;
+    int mode_ = kModeServe;
+    std::deque<Hit> audit_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t false_hits_ = 0;
+    double saved_ms_ = 0.0;
+};
@@ -0,0 +1,277 @@
+#include "session_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("SESSION_STORE", __VA_ARGS__)
+#define LOGE(...) NLOGE("SESSION_STORE", __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t kMagic = 0x53534253;  // "SBSS"
+constexpr uint32_t kVersion = 1;
+constexpr char kRecordSuffix[] = ".session";
+constexpr char kKvSuffix[] = ".kv";
+
+// Fixed header, followed by `turns` (prompt, response) pairs of length-prefixed strings
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_hash;
+    int32_t subject;
+    int32_t turn_count;
+    uint32_t has_kv;
+    uint32_t turns;
+};
+
+uint64_t fnv1a(uint64_t hash, const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void append_string(std::string& out, const std::string& s) {
+    uint32_t size = static_cast<uint32_t>(s.size());
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out += s;
+}
+
+bool read_string(const char*& p, const char* end, std::string* out) {
+    uint32_t size;
+    if (end - p < static_cast<ptrdiff_t>(sizeof(size))) {
+        return false;
+    }
+    memcpy(&size, p, sizeof(size));
+    p += sizeof(size);
+    if (static_cast<size_t>(end - p) < size) {
+        return false;
+    }
+    out->assign(p, size);
+    p += size;
+    return true;
+}
+
+bool ends_with(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+uint64_t file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+}  // namespace
+
+bool SessionStore::open(const std::string& dir, uint64_t model_hash) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        LOGE("Cannot create session store at %s", dir.c_str());
+        return false;
+    }
+    dir_ = dir;
+    model_hash_ = model_hash;
+    LOGI("Session store at %s (model %016llx)", dir.c_str(), static_cast<unsigned long long>(model_hash));
+    return true;
+}
+
+bool SessionStore::valid_name(const std::string& name) {
+    if (name.empty() || name.size() > 128) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    });
+}
+
+std::string SessionStore::record_path(const std::string& name) const {
+    return dir_ + "/" + name + kRecordSuffix;
+}
+
+std::string SessionStore::kv_path(const std::string& name) const {
+    return dir_ + "/" + name + kKvSuffix;
+}
+
+bool SessionStore::save(const std::string& name, const SavedSession& session) {
+    if (!is_open() || !valid_name(name)) {
+        return false;
+    }
+    RecordHeader header{kMagic, kVersion, model_hash_, session.subject, session.turn_count,
+                        session.has_kv ? 1u : 0u, static_cast<uint32_t>(session.turns.size())};
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto& turn : session.turns) {
+        append_string(data, turn.first);
+        append_string(data, turn.second);
+    }
+
+    // Write next to the record and rename, so a kill mid-write keeps the old one
+    std::string path = record_path(name);
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!out.good()) {
+            LOGE("Failed to write %s", tmp.c_str());
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to replace %s", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (!session.has_kv) {
+        unlink(kv_path(name).c_str());
+    }
+    LOGI("Saved session %s: %zu turns, %zu bytes%s", name.c_str(), session.turns.size(), data.size(),
+         session.has_kv ? " + KV" : "");
+    enforce_cap(name);
+    return true;
+}
+
+bool SessionStore::load(const std::string& name, SavedSession* session) const {
+    if (!is_open() || !valid_name(name)) {
+        return false;
+    }
+    std::string path = record_path(name);
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(RecordHeader)) {
+        close(fd);
+        LOGE("Session record %s is truncated", path.c_str());
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOGE("Failed to mmap %s", path.c_str());
+        return false;
+    }
+
+    const char* p = static_cast<const char*>(addr);
+    const char* end = p + size;
+    RecordHeader header;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    bool ok = header.magic == kMagic && header.version == kVersion;
+    if (ok && header.model_hash != model_hash_) {
+        LOGE("Session %s was saved for another model, ignoring it", name.c_str());
+        ok = false;
+    }
+    SavedSession loaded;
+    loaded.subject = header.subject;
+    loaded.turn_count = header.turn_count;
+    loaded.has_kv = header.has_kv != 0;
+    for (uint32_t i = 0; ok && i < header.turns; ++i) {
+        std::pair<std::string, std::string> turn;
+        ok = read_string(p, end, &turn.first) && read_string(p, end, &turn.second);
+        if (ok) {
+            loaded.turns.push_back(std::move(turn));
+        }
+    }
+    munmap(addr, size);
+    if (!ok) {
+        LOGE("Session record %s is invalid", path.c_str());
+        return false;
+    }
+    // A KV blob that went missing leaves the turn list to prefill again
+    loaded.has_kv = loaded.has_kv && access(kv_path(name).c_str(), R_OK) == 0;
+    *session = std::move(loaded);
+    return true;
+}
+
+void SessionStore::remove(const std::string& name) {
+    if (!is_open() || !valid_name(name)) {
+        return;
+    }
+    unlink(record_path(name).c_str());
+    unlink(kv_path(name).c_str());
+}
+
+uint64_t SessionStore::total_bytes() const {
+    uint64_t total = 0;
+    DIR* d = is_open() ? opendir(dir_.c_str()) : nullptr;
+    if (d == nullptr) {
+        return 0;
+    }
+    while (dirent* entry = readdir(d)) {
+        std::string file = entry->d_name;
+        if (ends_with(file, kRecordSuffix) || ends_with(file, kKvSuffix)) {
+            total += file_size(dir_ + "/" + file);
+        }
+    }
+    closedir(d);
+    return total;
+}
+
+void SessionStore::enforce_cap(const std::string& keep) {
+    DIR* d = is_open() ? opendir(dir_.c_str()) : nullptr;
+    if (d == nullptr) {
+        return;
+    }
+    struct Saved {
+        std::string name;
+        time_t saved_at;
+        uint64_t bytes;
+    };
+    std::vector<Saved> saved;
+    uint64_t total = 0;
+    size_t suffix_len = strlen(kRecordSuffix);
+    while (dirent* entry = readdir(d)) {
+        std::string file = entry->d_name;
+        if (!ends_with(file, kRecordSuffix)) {
+            continue;
+        }
+        std::string name = file.substr(0, file.size() - suffix_len);
+        struct stat st;
+        if (stat(record_path(name).c_str(), &st) != 0) {
+            continue;
+        }
+        uint64_t bytes = static_cast<uint64_t>(st.st_size) + file_size(kv_path(name));
+        saved.push_back({name, st.st_mtime, bytes});
+        total += bytes;
+    }
+    closedir(d);
+
+    std::sort(saved.begin(), saved.end(), [](const Saved& a, const Saved& b) { return a.saved_at < b.saved_at; });
+    for (const Saved& s : saved) {
+        if (total <= max_bytes_) {
+            break;
+        }
+        if (s.name == keep) {
+            continue;
+        }
+        remove(s.name);
+        total -= s.bytes;
+        LOGI("Evicted saved session %s (%llu bytes)", s.name.c_str(), static_cast<unsigned long long>(s.bytes));
+    }
+}
+
+uint64_t SessionStore::model_fingerprint(const std::string& model_dir, const std::string& model_lib_path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* file : {"/mlc-chat-config.json", "/ndarray-cache.json"}) {
+        std::ifstream in(model_dir + file, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        hash = fnv1a(hash, text.data(), text.size());
+    }
+    uint64_t lib_size = file_size(model_lib_path);
+    return fnv1a(hash, reinterpret_cast<const char*>(&lib_size), sizeof(lib_size));
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * On-disk store for chat sessions, so a study session survives the app being
+ * killed in the background.
+ *
+ * Each saved session is <name>.session — a small binary record of the turn
+ * list, subject and model fingerprint — plus, when the chat module can
+ * serialize its KV pages (save_kv / load_kv), a <name>.kv blob next to it. The
+ * record is mmapped and validated on load; a record written for another model
+ * is rejected. The store keeps its total size under a cap by deleting the
+ * least recently saved sessions.
+ */
+struct SavedSession {
+    int subject = 0;
+    int turn_count = 0;
+    bool has_kv = false;  // <name>.kv holds the module's KV for this record
+    std::vector<std::pair<std::string, std::string>> turns;  // (prompt, response)
+};
+
+class SessionStore {
+public:
+    static constexpr uint64_t kDefaultMaxBytes = 64ull << 20;
+
+    // Use `dir` (created if missing) for sessions of the model `model_hash`
+    bool open(const std::string& dir, uint64_t model_hash);
+    bool is_open() const { return !dir_.empty(); }
+
+    void set_max_bytes(uint64_t bytes) { max_bytes_ = bytes; }
+    uint64_t max_bytes() const { return max_bytes_; }
+
+    // Names are [A-Za-z0-9_-]+ so they map to file names as they are
+    static bool valid_name(const std::string& name);
+
+    // Where the module writes and reads the KV blob of `name`
+    std::string kv_path(const std::string& name) const;
+    // The conversation log of `name` (conversation_log.h), without its suffixes
+    std::string log_path(const std::string& name) const { return dir_ + "/" + name; }
+
+    bool save(const std::string& name, const SavedSession& session);
+    bool load(const std::string& name, SavedSession* session) const;
+    void remove(const std::string& name);
+
+    // Delete the oldest saved sessions until the store fits its cap; `keep` is spared
+    void enforce_cap(const std::string& keep);
+    uint64_t total_bytes() const;
+
+    // Identifies the model a snapshot belongs to: FNV-1a over the chat config
+    // and the weight manifest, plus the model library's size
+    static uint64_t model_fingerprint(const std::string& model_dir, const std::string& model_lib_path);
+
+private:
+    std::string dir_;
+    uint64_t model_hash_ = 0;
+    uint64_t max_bytes_ = kDefaultMaxBytes;
+
+    std::string record_path(const std::string& name) const;
+};
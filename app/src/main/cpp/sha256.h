@@ -0,0 +1,314 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "cpu_features.h"
+#include "thread_config.h"
+
+/**
+ * SHA-256 of downloaded model files, natively and in parallel.
+ *
+ * On cores with the ARMv8 SHA-2 instructions (HWCAP_SHA2, nearly every arm64
+ * phone) a block takes 16 sha256h/sha256h2 pairs instead of 64 scalar rounds;
+ * the function is compiled for them with a target attribute and only called
+ * after the hwcap check, so the library still runs on cores without them.
+ *
+ * hash_files() maps each file and hashes several at once, one thread per core
+ * of the big and mid clusters (thread_config.h): SHA-256 is sequential within
+ * a file, so the shards are the unit of parallelism. Pages already hashed are
+ * unmapped and then dropped from the page cache behind the reader, so a 1.5 GB
+ * model does not crowd it.
+ */
+namespace sha256 {
+
+static const uint32_t kRound[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline void compress_scalar(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = uint32_t(data[4 * i]) << 24 | uint32_t(data[4 * i + 1]) << 16 | uint32_t(data[4 * i + 2]) << 8 |
+                   uint32_t(data[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kRound[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__aarch64__)
+// Four rounds per sha256h/sha256h2 pair; the schedule for the next sixteen
+// words comes from sha256su0/su1 over the four message vectors in turn
+__attribute__((target("crypto"))) inline void compress_armv8(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32x4_t efgh = vld1q_u32(state + 4);
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32x4_t msg[4];
+        for (int i = 0; i < 4; ++i) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+        uint32x4_t abcd_start = abcd;
+        uint32x4_t efgh_start = efgh;
+        for (int i = 0; i < 16; ++i) {
+            uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(kRound + 4 * i));
+            uint32x4_t abcd_before = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, abcd_before, wk);
+            if (i < 12) {
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]), msg[(i + 2) & 3],
+                                             msg[(i + 3) & 3]);
+            }
+        }
+        abcd = vaddq_u32(abcd, abcd_start);
+        efgh = vaddq_u32(efgh, efgh_start);
+    }
+    vst1q_u32(state, abcd);
+    vst1q_u32(state + 4, efgh);
+}
+#endif
+
+inline bool hardware_sha2() {
+    static const bool available = detect_cpu_features().sha2;
+    return available;
+}
+
+class Hasher {
+public:
+    void update(const uint8_t* data, size_t size) {
+        total_ += size;
+        if (buffered_ > 0) {
+            size_t take = std::min(size, sizeof(buffer_) - buffered_);
+            memcpy(buffer_ + buffered_, data, take);
+            buffered_ += take;
+            data += take;
+            size -= take;
+            if (buffered_ < sizeof(buffer_)) {
+                return;
+            }
+            compress(buffer_, 1);
+            buffered_ = 0;
+        }
+        compress(data, size / 64);
+        data += size / 64 * 64;
+        buffered_ = size % 64;
+        memcpy(buffer_, data, buffered_);
+    }
+
+    // The 32 digest bytes; the hasher is spent afterwards
+    void digest(uint8_t out[32]) {
+        finish();
+        for (int i = 0; i < 32; ++i) {
+            out[i] = static_cast<uint8_t>(state_[i / 4] >> (24 - 8 * (i % 4)));
+        }
+    }
+
+    // Lowercase hex, as GemmaModelDownloader's FILE_CHECKSUMS lists them
+    std::string hex_digest() {
+        finish();
+        char hex[65];
+        for (int i = 0; i < 8; ++i) {
+            snprintf(hex + 8 * i, 9, "%08x", state_[i]);
+        }
+        return std::string(hex, 64);
+    }
+
+private:
+    uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t buffer_[64];
+    size_t buffered_ = 0;
+    uint64_t total_ = 0;
+
+    void finish() {
+        uint64_t bits = total_ * 8;
+        uint8_t pad[72] = {0x80};
+        size_t pad_bytes = (buffered_ < 56 ? 56 : 120) - buffered_;
+        for (int i = 0; i < 8; ++i) {
+            pad[pad_bytes + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        update(pad, pad_bytes + 8);
+    }
+
+    void compress(const uint8_t* data, size_t blocks) {
+        if (blocks == 0) {
+            return;
+        }
+#if defined(__aarch64__)
+        if (hardware_sha2()) {
+            compress_armv8(state_, data, blocks);
+            return;
+        }
+#endif
+        compress_scalar(state_, data, blocks);
+    }
+};
+
+// Hex HMAC-SHA256 (RFC 2104) of `message` under `key`, for signing small records
+inline std::string hmac_hex(const std::string& key, const std::string& message) {
+    uint8_t block[64] = {0};
+    if (key.size() > sizeof(block)) {
+        Hasher hasher;
+        hasher.update(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+        hasher.digest(block);
+    } else {
+        memcpy(block, key.data(), key.size());
+    }
+    uint8_t pad[64];
+    for (int i = 0; i < 64; ++i) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    Hasher inner;
+    inner.update(pad, sizeof(pad));
+    inner.update(reinterpret_cast<const uint8_t*>(message.data()), message.size());
+    uint8_t inner_digest[32];
+    inner.digest(inner_digest);
+    for (int i = 0; i < 64; ++i) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    Hasher outer;
+    outer.update(pad, sizeof(pad));
+    outer.update(inner_digest, sizeof(inner_digest));
+    return outer.hex_digest();
+}
+
+// Hex SHA-256 of the file at `path`, "" if it cannot be read. `done` counts
+// the bytes hashed so far.
+inline std::string hash_file(const std::string& path, std::atomic<uint64_t>* done) {
+    static constexpr size_t kChunk = 4 << 20;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::string();
+    }
+    struct stat st;
+    Hasher hasher;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return std::string();
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    if (addr == MAP_FAILED) {
+        ::close(fd);
+        return std::string();
+    }
+    uint8_t* data = static_cast<uint8_t*>(addr);
+    madvise(addr, size, MADV_SEQUENTIAL);
+    for (size_t at = 0; at < size; at += kChunk) {
+        size_t bytes = std::min(kChunk, size - at);
+        hasher.update(data + at, bytes);
+        // Chunks are page multiples. MADV_DONTNEED only unmaps the pages from
+        // this mapping; the fadvise then evicts them from the page cache, which
+        // keeps pages as long as anything maps them
+        madvise(data + at, bytes, MADV_DONTNEED);
+        posix_fadvise(fd, static_cast<off_t>(at), static_cast<off_t>(bytes), POSIX_FADV_DONTNEED);
+        done->fetch_add(bytes, std::memory_order_relaxed);
+    }
+    if (addr != nullptr) {
+        munmap(addr, size);
+    }
+    ::close(fd);
+    return hasher.hex_digest();
+}
+
+// Hex digests of `paths` ("" for any that cannot be read), hashed on the big
+// and mid cores. `progress(done, total)` runs on the calling thread every
+// `interval_ms` and once at the end.
+template <typename Progress>
+std::vector<std::string> hash_files(const std::vector<std::string>& paths, Progress&& progress,
+                                    int interval_ms = 200) {
+    uint64_t total = 0;
+    for (const std::string& path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            total += static_cast<uint64_t>(st.st_size);
+        }
+    }
+    std::vector<unsigned int> cores = cores_for(kAffinityBigMid);
+    size_t workers = std::max<size_t>(1, std::min(paths.size(), std::max<size_t>(cores.size(), 1)));
+
+    std::vector<std::string> digests(paths.size());
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> finished{0};
+    std::atomic<uint64_t> done{0};
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < workers; ++w) {
+        pool.emplace_back([&] {
+            if (!cores.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (unsigned int core : cores) {
+                    CPU_SET(core, &set);
+                }
+                sched_setaffinity(0, sizeof(set), &set);
+            }
+            for (size_t i; (i = next.fetch_add(1)) < paths.size();) {
+                digests[i] = hash_file(paths[i], &done);
+            }
+            finished.fetch_add(1);
+        });
+    }
+    while (finished.load() < workers) {
+        progress(done.load(), total);
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    progress(done.load(), total);
+    return digests;
+}
+
+}  // namespace sha256
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * params.pack: every weight shard of a model directory in one file, so a load
+ * opens and maps once instead of once per shard (38 for Gemma 2B), with one
+ * VMA and one readahead stream.
+ *
+ *   Header | Entry[shards] | ndarray-cache.json | shard 0 | shard 1 | ...
+ *
+ * Each shard starts on a kAlignment boundary, so a shard's mapping is page
+ * aligned exactly as if its own file had been mapped, and the param offsets of
+ * ndarray-cache.json apply unchanged. The embedded JSON makes the pack self
+ * describing; `json_hash` ties it to the directory's (see ndarray_index.h), so
+ * a re-downloaded model never reads an old pack. Entries carry each shard's
+ * FNV-1a hash for one sequential integrity pass (mmap_loader::verify_pack).
+ *
+ * Written by mmap_loader::pack_shards(), which removes the shard files once the
+ * pack is in place. Only the mmap loader reads packs; TVM's own loader needs
+ * the shard files.
+ */
+namespace shard_pack {
+
+static constexpr const char* kFileName = "params.pack";
+static constexpr uint32_t kMagic = 0x4b504253;  // "SBPK"
+static constexpr uint32_t kVersion = 1;
+static constexpr uint64_t kAlignment = 4096;
+static constexpr size_t kMaxPathBytes = 64;
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shard_count;
+    uint32_t reserved;
+    uint64_t json_hash;    // ndarray_index hash of the source ndarray-cache.json
+    uint64_t json_offset;  // the embedded JSON
+    uint64_t json_bytes;
+};
+
+struct Entry {
+    char data_path[kMaxPathBytes];  // as in ndarray-cache.json, NUL-padded
+    uint64_t offset;
+    uint64_t nbytes;
+    uint64_t hash;  // FNV-1a of the shard's bytes
+};
+
+static_assert(sizeof(Header) % 8 == 0 && sizeof(Entry) % 8 == 0, "pack entries stay 8-byte aligned");
+
+inline uint64_t align_up(uint64_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// The shard table of `dir`'s pack; empty() if there is none or it was made
+// for another ndarray-cache.json
+class Pack {
+public:
+    static Pack open(const std::string& dir, uint64_t json_hash) {
+        Pack pack;
+        int fd = ::open((dir + "/" + kFileName).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return pack;
+        }
+        struct stat st;
+        Header header{};
+        if (fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+            header.magic == kMagic && header.version == kVersion && header.json_hash == json_hash) {
+            std::vector<Entry> entries(header.shard_count);
+            size_t bytes = entries.size() * sizeof(Entry);
+            if (pread(fd, entries.data(), bytes, sizeof(header)) == static_cast<ssize_t>(bytes)) {
+                bool bounded = true;
+                for (Entry& entry : entries) {
+                    entry.data_path[kMaxPathBytes - 1] = '\0';
+                    bounded = bounded && entry.offset % kAlignment == 0 &&
+                              entry.offset + entry.nbytes <= static_cast<uint64_t>(st.st_size);
+                }
+                if (bounded) {
+                    pack.path_ = dir + "/" + kFileName;
+                    pack.entries_ = std::move(entries);
+                }
+            }
+        }
+        ::close(fd);
+        return pack;
+    }
+
+    bool empty() const { return entries_.empty(); }
+    const std::string& path() const { return path_; }
+    const std::vector<Entry>& entries() const { return entries_; }
+
+    const Entry* find(const std::string& data_path) const {
+        for (const Entry& entry : entries_) {
+            if (data_path == entry.data_path) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    std::string path_;
+    std::vector<Entry> entries_;
+};
+
+}  // namespace shard_pack
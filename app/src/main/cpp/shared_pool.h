@@ -0,0 +1,433 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <tvm/runtime/c_backend_api.h>
+
+#include "request_priority.h"
+
+/**
+ * One worker pool for every CPU-parallel piece of the native side: the model
+ * library's kernels, the CPU attention and matmul externs, embedding
+ * normalization, tokenizer batches, compressed shard decoding, index
+ * training.
+ *
+ * TVM's pool is thread-local (each thread that launches gets workers of its
+ * own), and the tokenizer, loader and index each started threads per call, so
+ * an 8-core phone could have several times eight runnable threads during
+ * generation. Here the workers are started once, on the cores thread_config.h
+ * picked, and a launch is split into tasks that whichever thread is free
+ * claims next: the launching thread runs its own tasks too, and an idle worker
+ * takes tasks of the most urgent launch queued, by priority. A launch
+ * made while an interactive request decoded in the last kInteractiveHoldMs
+ * may start background or prefetch tasks on at most half the workers, so decode
+ * finds the rest free; a task that is already running is never preempted, so
+ * long jobs should be split finely.
+ *
+ * The priority is the launching thread's (PriorityScope), interactive unless
+ * set. Model libraries reach the pool through bind_model_library(): a TVM
+ * library calls its kernels' parallel loops through the __TVMBackendParallelLaunch
+ * pointer that the runtime fills in at load time, and the engine points it
+ * here. A library that also uses TVMBackendParallelBarrier stays on TVM's
+ * pool, because a barrier needs every task of a launch running at once, and
+ * claimed tasks do not guarantee that.
+ */
+namespace shared_pool {
+
+static constexpr int kTasksPerThread = 4;           // parallel_for's split, for balance
+static constexpr int64_t kSpinMicros = 100;         // a worker's wait for the next launch before it sleeps
+static constexpr int64_t kInteractiveHoldMs = 50;   // how long an interactive launch holds back background work
+
+struct Stats {
+    int workers = 0;
+    uint64_t launches[kPriorityClasses] = {};
+    uint64_t tasks[kPriorityClasses] = {};
+    uint64_t caller_tasks = 0;    // run by the launching thread
+    uint64_t held_back = 0;       // times a worker left background tasks queued for decode
+    bool model_library = false;   // bind_model_library() took over the model's parallel loops
+};
+
+// The RequestPriority class the calling thread's launches run at
+inline int& thread_priority() {
+    thread_local int priority = kPriorityInteractive;
+    return priority;
+}
+
+// Launches from this thread run at `priority` while it lives
+class PriorityScope {
+public:
+    explicit PriorityScope(int priority) : previous_(thread_priority()) { thread_priority() = priority; }
+    ~PriorityScope() { thread_priority() = previous_; }
+
+    PriorityScope(const PriorityScope&) = delete;
+    PriorityScope& operator=(const PriorityScope&) = delete;
+
+private:
+    int previous_;
+};
+
+class Pool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ~Pool() { stop(); }
+
+    // Restarts the pool with `workers` threads besides the launching one, unless
+    // it runs so already. With one core per thread (cores.size() == workers + 1)
+    // each worker is pinned to its own, the first left to the caller; otherwise
+    // they share `cores`.
+    void configure(int workers, const std::vector<unsigned int>& cores) {
+        std::lock_guard<std::mutex> configuring(configure_mutex_);
+        workers = std::max(0, workers);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (configured_.load() && workers == workers_.load() && cores == cores_) {
+                return;
+            }
+        }
+        stop();
+        std::lock_guard<std::mutex> lock(mutex_);
+        spawn(workers, cores);
+    }
+
+    // Threads a launch can use: the workers and the caller
+    int concurrency() {
+        start();
+        return workers_.load() + 1;
+    }
+
+    // TVM's parallel launch contract: flambda(task, penv, cdata) for task in
+    // [0, num_task), num_task <= 0 meaning concurrency(); returns once all ran,
+    // nonzero if any failed
+    int launch(FTVMParallelLambda flambda, void* cdata, int num_task, int priority = thread_priority()) {
+        start();
+        int workers = workers_.load();
+        int cls = std::min(std::max(priority, 0), kPriorityClasses - 1);
+        if (num_task <= 0) {
+            num_task = workers + 1;
+        }
+        if (cls == kPriorityInteractive) {
+            last_interactive_.store(now_ms(), std::memory_order_relaxed);
+        }
+        launches_[cls].fetch_add(1, std::memory_order_relaxed);
+        tasks_[cls].fetch_add(static_cast<uint64_t>(num_task), std::memory_order_relaxed);
+        auto job = std::make_shared<Job>();
+        job->flambda = flambda;
+        job->cdata = cdata;
+        job->env.sync_handle = nullptr;
+        job->env.num_task = num_task;
+        job->num_task = num_task;
+        job->remaining.store(num_task);
+        if (num_task > 1 && workers > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queues_[cls].push_back(job);
+            posted_.fetch_add(1, std::memory_order_release);
+            for (int i = 0; i < std::min(sleeping_, num_task - 1); ++i) {
+                wake_.notify_one();
+            }
+        }
+        uint64_t ran = 0;
+        for (int task; (task = job->next.fetch_add(1)) < num_task; ++ran) {
+            execute(*job, task);
+        }
+        caller_tasks_.fetch_add(ran, std::memory_order_relaxed);
+        auto until = Clock::now() + std::chrono::microseconds(kSpinMicros);
+        while (job->remaining.load(std::memory_order_acquire) > 0 && Clock::now() < until) {
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->done.wait(lock, [&] { return job->remaining.load(std::memory_order_acquire) == 0; });
+        return job->failed.load() ? -1 : 0;
+    }
+
+    // fn(i) for i in [begin, end), in up to `max_tasks` ranges (0: kTasksPerThread
+    // per thread); the first exception fn throws is rethrown here once all ranges ended
+    template <typename F>
+    void parallel_for(int64_t begin, int64_t end, F&& fn, int max_tasks = 0) {
+        int64_t n = end - begin;
+        if (n <= 0) {
+            return;
+        }
+        struct Range {
+            std::remove_reference_t<F>* fn;
+            int64_t begin;
+            int64_t n;
+            int tasks;
+            std::mutex mutex;
+            std::exception_ptr error;
+        } range;
+        range.fn = &fn;
+        range.begin = begin;
+        range.n = n;
+        int64_t tasks = max_tasks > 0 ? max_tasks : concurrency() * kTasksPerThread;
+        range.tasks = static_cast<int>(std::min<int64_t>(n, tasks));
+        launch(
+                [](int task, TVMParallelGroupEnv* /* penv */, void* cdata) -> int {
+                    auto* r = static_cast<Range*>(cdata);
+                    int64_t lo = r->begin + r->n * task / r->tasks;
+                    int64_t hi = r->begin + r->n * (task + 1) / r->tasks;
+                    try {
+                        for (int64_t i = lo; i < hi; ++i) {
+                            (*r->fn)(i);
+                        }
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(r->mutex);
+                        if (!r->error) {
+                            r->error = std::current_exception();
+                        }
+                        return -1;
+                    }
+                    return 0;
+                },
+                &range, range.tasks);
+        if (range.error) {
+            std::rethrow_exception(range.error);
+        }
+    }
+
+    // tids of the workers, for scheduling hints on them
+    std::vector<int32_t> thread_ids() {
+        start();
+        std::unique_lock<std::mutex> lock(mutex_);
+        started_.wait(lock, [&] { return static_cast<int>(thread_ids_.size()) == workers_.load() || stopping_; });
+        return thread_ids_;
+    }
+
+    void set_model_library(bool bound) { model_library_ = bound; }
+
+    Stats stats() {
+        Stats stats;
+        stats.workers = workers_.load();
+        for (int i = 0; i < kPriorityClasses; ++i) {
+            stats.launches[i] = launches_[i].load();
+            stats.tasks[i] = tasks_[i].load();
+        }
+        stats.caller_tasks = caller_tasks_.load();
+        stats.held_back = held_back_.load();
+        stats.model_library = model_library_.load();
+        return stats;
+    }
+
+    std::string stats_json() {
+        Stats s = stats();
+        char json[512];
+        snprintf(json, sizeof(json),
+                 "{\"workers\": %d, \"launches\": [%llu, %llu, %llu], \"tasks\": [%llu, %llu, %llu], "
+                 "\"caller_tasks\": %llu, \"held_back\": %llu, \"model_library\": %s}",
+                 s.workers, u(s.launches[0]), u(s.launches[1]), u(s.launches[2]), u(s.tasks[0]), u(s.tasks[1]),
+                 u(s.tasks[2]), u(s.caller_tasks), u(s.held_back), s.model_library ? "true" : "false");
+        return json;
+    }
+
+private:
+    struct Job {
+        FTVMParallelLambda flambda = nullptr;
+        void* cdata = nullptr;
+        TVMParallelGroupEnv env{};
+        int num_task = 0;
+        std::atomic<int> next{0};
+        std::atomic<int> remaining{0};
+        std::atomic<bool> failed{false};
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    std::mutex configure_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable started_;
+    std::deque<std::shared_ptr<Job>> queues_[kPriorityClasses];
+    std::vector<std::thread> threads_;
+    std::vector<int32_t> thread_ids_;
+    std::vector<unsigned int> cores_;
+    std::atomic<int> workers_{0};
+    int sleeping_ = 0;
+    bool stopping_ = false;
+    std::atomic<bool> configured_{false};
+    int background_running_ = 0;
+    std::atomic<uint64_t> posted_{0};
+    std::atomic<int64_t> last_interactive_{0};
+    std::atomic<uint64_t> launches_[kPriorityClasses] = {};
+    std::atomic<uint64_t> tasks_[kPriorityClasses] = {};
+    std::atomic<uint64_t> caller_tasks_{0};
+    std::atomic<uint64_t> held_back_{0};
+    std::atomic<bool> model_library_{false};
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+    }
+    static unsigned long long u(uint64_t value) { return static_cast<unsigned long long>(value); }
+
+    // Unconfigured, one worker per core less the caller, unpinned
+    void start() {
+        if (configured_.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!configured_.load()) {
+            spawn(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())) - 1, {});
+        }
+    }
+
+    // Under mutex_, with no workers running
+    void spawn(int workers, const std::vector<unsigned int>& cores) {
+        stopping_ = false;
+        thread_ids_.clear();
+        cores_ = cores;
+        bool one_per_core = cores.size() == static_cast<size_t>(workers) + 1;
+        for (int i = 0; i < workers; ++i) {
+            std::vector<unsigned int> mine = one_per_core ? std::vector<unsigned int>{cores[i + 1]} : cores;
+            threads_.emplace_back([this, mine] { run(mine); });
+        }
+        workers_.store(static_cast<int>(threads_.size()));
+        configured_.store(true, std::memory_order_release);
+    }
+
+    void stop() {
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            threads.swap(threads_);
+            wake_.notify_all();
+            started_.notify_all();
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        workers_.store(0);
+    }
+
+    static void execute(Job& job, int task) {
+        if (job.flambda(task, &job.env, job.cdata) != 0) {
+            job.failed.store(true);
+        }
+        if (job.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.done.notify_all();
+        }
+    }
+
+    // Under mutex_: a task of the most urgent launch this worker may start
+    bool take(std::shared_ptr<Job>* job, int* task, int* cls, bool* held) {
+        bool decoding = now_ms() - last_interactive_.load(std::memory_order_relaxed) < kInteractiveHoldMs;
+        for (int c = 0; c < kPriorityClasses; ++c) {
+            std::deque<std::shared_ptr<Job>>& queue = queues_[c];
+            while (!queue.empty()) {
+                if (c != kPriorityInteractive && decoding && background_running_ >= std::max(1, workers_.load() / 2)) {
+                    *held = true;
+                    return false;
+                }
+                int claimed = queue.front()->next.fetch_add(1);
+                if (claimed < queue.front()->num_task) {
+                    *job = queue.front();
+                    *task = claimed;
+                    *cls = c;
+                    background_running_ += c != kPriorityInteractive ? 1 : 0;
+                    return true;
+                }
+                queue.pop_front();  // every task claimed
+            }
+        }
+        return false;
+    }
+
+    void run(const std::vector<unsigned int>& cores) {
+        if (!cores.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (unsigned int core : cores) {
+                CPU_SET(core, &set);
+            }
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        thread_ids_.push_back(static_cast<int32_t>(syscall(SYS_gettid)));
+        started_.notify_all();
+        while (!stopping_) {
+            std::shared_ptr<Job> job;
+            int task = 0;
+            int cls = 0;
+            bool held = false;
+            if (take(&job, &task, &cls, &held)) {
+                lock.unlock();
+                execute(*job, task);
+                job.reset();
+                lock.lock();
+                background_running_ -= cls != kPriorityInteractive ? 1 : 0;
+                continue;
+            }
+            if (held) {
+                held_back_.fetch_add(1, std::memory_order_relaxed);
+            }
+            // Decode launches come back to back: spin a little before sleeping
+            uint64_t seen = posted_.load(std::memory_order_acquire);
+            lock.unlock();
+            auto until = Clock::now() + std::chrono::microseconds(kSpinMicros);
+            while (posted_.load(std::memory_order_acquire) == seen && Clock::now() < until) {
+                std::this_thread::yield();
+            }
+            lock.lock();
+            if (posted_.load(std::memory_order_acquire) != seen || stopping_) {
+                continue;
+            }
+            sleeping_++;
+            auto woken = [&] { return stopping_ || posted_.load(std::memory_order_acquire) != seen; };
+            if (held) {
+                wake_.wait_for(lock, std::chrono::milliseconds(kInteractiveHoldMs), woken);  // until decode is over
+            } else {
+                wake_.wait(lock, woken);
+            }
+            sleeping_--;
+        }
+    }
+};
+
+inline Pool& pool() {
+    static Pool* instance = new Pool();
+    return *instance;
+}
+
+// As TVMBackendParallelLaunch, on the shared pool at the calling thread's priority
+inline int tvm_parallel_launch(FTVMParallelLambda flambda, void* cdata, int num_task) {
+    return pool().launch(flambda, cdata, num_task);
+}
+
+// Points an already loaded TVM model library's parallel loops at the pool;
+// false if it is not loaded, has no parallel loops, or needs TVM's barrier
+inline bool bind_model_library(const std::string& path) {
+    void* handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_NOLOAD);
+    if (handle == nullptr) {
+        return false;
+    }
+    using Launch = int (*)(FTVMParallelLambda, void*, int);
+    auto* launch = static_cast<Launch*>(dlsym(handle, "__TVMBackendParallelLaunch"));
+    void* barrier = dlsym(handle, "__TVMBackendParallelBarrier");
+    bool bound = launch != nullptr && barrier == nullptr;
+    if (bound) {
+        *launch = tvm_parallel_launch;
+    }
+    dlclose(handle);  // only drops the reference taken above
+    pool().set_model_library(bound);
+    return bound;
+}
+
+}  // namespace shared_pool
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A simple structure to simulate a language model's vocabulary
+// Vocabulary ids are indices into `vocabulary`; lookups go through a flat trie.
+struct SimpleTokenizer {
+    std::vector<std::string> vocabulary;
+    
+    SimpleTokenizer() {
+        // Add some basic vocabulary
+        vocabulary = {
+            // Special tokens
+            "<bos>", "<eos>", ".", ",", "!", "?", ":", ";", "(", ")", "[", "]", "\"", "'", "-", "_", "+", "=", "*", "/", "%", "<", ">", "$", "#", "@", "&", "^",
+            
+            // Basic words
+            "the", "a", "an", "of", "to", "and", "in", "for", "is", "on", "that", "by", "this",
+            "with", "I", "you", "he", "she", "it", "we", "they", "my", "your", "his", "her", "its", "our", "their",
+            "am", "are", "was", "were", "be", "been", "have", "has", "had", "do", "does", "did", "can", "could", "will", "would", "should", "may", "might",
+            
+            // Greetings and conversational
+            "hello", "hi", "hey", "greetings", "good", "morning", "afternoon", "evening", "night", 
+            "bye", "goodbye", "see", "talk", "later", "next", "time",
+            "thanks", "thank", "please", "welcome", "sorry", "excuse", "pardon", "ok", "okay", "yes", "no", "maybe",
+            "how", "what", "when", "where", "why", "who", "which", "whose", 
+            
+            // Time-related
+            "time", "day", "today", "tomorrow", "yesterday", "now", "later", "before", "after", "during",
+            "week", "month", "year", "hour", "minute", "second", "monday", "tuesday", "wednesday", "thursday", "friday", "saturday", "sunday",
+            "january", "february", "march", "april", "may", "june", "july", "august", "september", "october", "november", "december",
+            
+            // Study-related general
+            "study", "buddy", "student", "teacher", "professor", "learn", "learning", "education", "school", "college", "university",
+            "class", "course", "lecture", "lesson", "exam", "test", "quiz", "assignment", "homework", "project", "research", "paper", "essay",
+            "grade", "score", "point", "academic", "semester", "term", "degree", "bachelor", "master", "phd", "doctorate",
+            "textbook", "note", "notes", "chapter", "page", "reference", "cite", "citation", "bibliography",
+            "library", "laboratory", "lab", "classroom", "lecture", "hall", "campus", "dormitory", "dorm",
+            
+            // Academic subjects
+            "math", "mathematics", "algebra", "geometry", "calculus", "trigonometry", "statistics", "probability",
+            "science", "physics", "chemistry", "biology", "geology", "astronomy", "neuroscience", "psychology",
+            "history", "geography", "economics", "political", "politics", "sociology", "anthropology", "archaeology",
+            "english", "literature", "grammar", "vocabulary", "writing", "reading", "composition", "rhetoric", "linguistics",
+            "language", "spanish", "french", "german", "chinese", "japanese", "latin", "greek",
+            "art", "music", "philosophy", "religion", "ethics", "logic", "aesthetics", "epistemology",
+            "computer", "programming", "software", "hardware", "algorithm", "data", "structure", "code",
+            "engineering", "mechanical", "electrical", "civil", "chemical", "material", "aerospace",
+            "medicine", "anatomy", "physiology", "pathology", "microbiology", "pharmacology", "nursing",
+            
+            // Math terms
+            "number", "integer", "fraction", "decimal", "equation", "formula", "function", "variable", "constant",
+            "sum", "difference", "product", "quotient", "factor", "multiple", "divisor", "dividend", "remainder",
+            "exponent", "power", "root", "square", "cube", "logarithm", "derivative", "integral", "limit",
+            "angle", "degree", "radian", "triangle", "circle", "rectangle", "polygon", "coordinate", "axis", "graph",
+            "matrix", "vector", "scalar", "theorem", "proof", "axiom", "corollary", "lemma",
+            
+            // Science terms
+            "theory", "hypothesis", "experiment", "observation", "evidence", "conclusion", "analysis", "method",
+            "atom", "molecule", "cell", "tissue", "organ", "system", "organism", "species", "genus", "family",
+            "element", "compound", "reaction", "energy", "force", "mass", "weight", "velocity", "acceleration",
+            "temperature", "pressure", "volume", "density", "wave", "particle", "quantum", "photon", "electron",
+            "nucleus", "proton", "neutron", "chromosome", "gene", "dna", "rna", "protein", "enzyme",
+            
+            // Study skills
+            "focus", "concentration", "attention", "memory", "recall", "comprehension", "understanding",
+            "practice", "review", "revise", "summarize", "outline", "highlight", "flashcard", "mnemonic",
+            "schedule", "deadline", "priority", "organization", "efficiency", "effectiveness", "productivity",
+            "stress", "anxiety", "relaxation", "mindfulness", "meditation", "sleep", "rest", "break",
+            "goal", "motivation", "discipline", "habit", "routine", "strategy", "technique", "method",
+            
+            // Common verbs for learning
+            "explain", "describe", "define", "analyze", "evaluate", "compare", "contrast", "discuss", "argue",
+            "solve", "calculate", "compute", "derive", "prove", "demonstrate", "illustrate", "clarify",
+            "understand", "know", "think", "believe", "remember", "forget", "recall", "recognize", "identify",
+            "read", "write", "speak", "listen", "present", "practice", "apply", "implement", "use",
+            "study", "learn", "teach", "tutor", "mentor", "guide", "help", "assist", "support",
+            
+            // AI and technology
+            "model", "ai", "artificial", "intelligence", "machine", "learning", "neural", "network", "deep", "natural", "language", "processing",
+            "chat", "bot", "assistant", "help", "question", "answer", "response", "conversation", "dialogue",
+            "digital", "electronic", "device", "application", "app", "software", "program", "system",
+            "internet", "web", "online", "website", "cloud", "database", "server", "client", "interface",
+            "mobile", "phone", "tablet", "laptop", "desktop", "computer", "algorithm", "computation",
+            
+            // Common adjectives
+            "good", "bad", "better", "best", "worse", "worst", "easy", "difficult", "hard", "simple", "complex",
+            "important", "essential", "critical", "necessary", "useful", "helpful", "valuable", "worthwhile",
+            "interesting", "boring", "exciting", "engaging", "motivating", "inspiring", "challenging", "rewarding",
+            "clear", "unclear", "confusing", "ambiguous", "specific", "general", "detailed", "thorough",
+            "correct", "incorrect", "right", "wrong", "accurate", "inaccurate", "precise", "vague",
+            
+            // Quantifiers and numbers
+            "one", "two", "three", "four", "five", "six", "seven", "eight", "nine", "ten",
+            "first", "second", "third", "fourth", "fifth", "last", "next", "previous",
+            "many", "few", "several", "some", "any", "all", "none", "most", "more", "less",
+            "each", "every", "both", "either", "neither", "other", "another",
+            
+            // Other useful words
+            "way", "method", "approach", "strategy", "technique", "process", "procedure", "step",
+            "example", "instance", "case", "illustration", "demonstration", "problem", "solution", "issue", "challenge",
+            "fact", "information", "data", "evidence", "point", "detail", "aspect", "feature",
+            "idea", "concept", "theory", "principle", "rule", "law", "formula", "equation", "model",
+            "part", "section", "chapter", "unit", "module", "component", "element", "factor", "variable"
+        };
+        
+        build_trie();
+    }
+    
+    // Id of an exact vocabulary entry, or -1
+    int token_id(std::string_view token) const {
+        uint32_t node = 0;
+        for (char c : token) {
+            node = child(node, static_cast<unsigned char>(c));
+            if (node == kNoNode) {
+                return -1;
+            }
+        }
+        return nodes[node].token_id;
+    }
+    
+    std::vector<int> tokenize(std::string_view text) const {
+        std::vector<int> tokens;
+        tokens.reserve(text.size() / 4 + 2);
+        
+        // Add BOS token if present in vocabulary
+        if (bos_id >= 0) {
+            tokens.push_back(bos_id);
+        }
+        
+        size_t i = 0;
+        while (i < text.size()) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            
+            // Alphanumeric characters and apostrophes form words, matched case-insensitively
+            if (std::isalnum(c) || c == '\'') {
+                size_t end = i;
+                while (end < text.size() &&
+                       (std::isalnum(static_cast<unsigned char>(text[end])) || text[end] == '\'')) {
+                    ++end;
+                }
+                tokenize_word(text.substr(i, end - i), tokens);
+                i = end;
+                continue;
+            }
+            
+            // Spaces are implied; the detokenizer puts them back
+            if (c != ' ') {
+                int id = single_char_id[c];
+                if (id >= 0) {
+                    tokens.push_back(id);
+                }
+            }
+            ++i;
+        }
+        
+        return tokens;
+    }
+    
+private:
+    static constexpr uint32_t kNoNode = UINT32_MAX;
+    
+    // Trie over the vocabulary, flattened once at construction. Each node's
+    // outgoing edges are a sorted, contiguous run of `edges`.
+    struct TrieNode {
+        int token_id = -1;
+        uint32_t first_edge = 0;
+        uint32_t edge_count = 0;
+    };
+    struct TrieEdge {
+        unsigned char label;
+        uint32_t target;
+    };
+    std::vector<TrieNode> nodes;
+    std::vector<TrieEdge> edges;
+    int single_char_id[256];
+    int bos_id = -1;
+    int fallback_id = -1;
+    
+    uint32_t child(uint32_t node, unsigned char label) const {
+        const TrieNode& n = nodes[node];
+        auto begin = edges.begin() + n.first_edge;
+        auto end = begin + n.edge_count;
+        auto it = std::lower_bound(begin, end, label,
+                                   [](const TrieEdge& e, unsigned char l) { return e.label < l; });
+        return (it != end && it->label == label) ? it->target : kNoNode;
+    }
+    
+    void build_trie() {
+        // Build with per-node child maps, then flatten into BFS-ordered arrays
+        struct BuildNode {
+            int token_id = -1;
+            std::map<unsigned char, uint32_t> children;
+        };
+        std::vector<BuildNode> build(1);
+        for (size_t i = 0; i < vocabulary.size(); ++i) {
+            uint32_t node = 0;
+            for (char ch : vocabulary[i]) {
+                unsigned char c = static_cast<unsigned char>(ch);
+                auto it = build[node].children.find(c);
+                if (it == build[node].children.end()) {
+                    build.emplace_back();
+                    it = build[node].children.emplace(c, static_cast<uint32_t>(build.size() - 1)).first;
+                }
+                node = it->second;
+            }
+            // Later duplicates win, as they did with the old token map
+            build[node].token_id = static_cast<int>(i);
+        }
+        
+        nodes.assign(build.size(), TrieNode());
+        edges.clear();
+        edges.reserve(build.size());
+        std::vector<uint32_t> order(1, 0);
+        std::vector<uint32_t> remap(build.size(), 0);
+        for (size_t head = 0; head < order.size(); ++head) {
+            uint32_t old_index = order[head];
+            TrieNode& n = nodes[head];
+            n.token_id = build[old_index].token_id;
+            n.first_edge = static_cast<uint32_t>(edges.size());
+            n.edge_count = static_cast<uint32_t>(build[old_index].children.size());
+            for (const auto& entry : build[old_index].children) {
+                remap[entry.second] = static_cast<uint32_t>(order.size());
+                order.push_back(entry.second);
+                edges.push_back({entry.first, 0});
+            }
+        }
+        for (size_t e = 0; e < edges.size(); ++e) {
+            edges[e].target = remap[order[e + 1]];
+        }
+        
+        for (int c = 0; c < 256; ++c) {
+            uint32_t node = child(0, static_cast<unsigned char>(c));
+            single_char_id[c] = node == kNoNode ? -1 : nodes[node].token_id;
+        }
+        bos_id = token_id("<bos>");
+        fallback_id = token_id("the");
+    }
+    
+    // Greedy longest-match of one word against the trie, lowercasing on the fly
+    void tokenize_word(std::string_view word, std::vector<int>& tokens) const {
+        bool found_any = false;
+        size_t j = 0;
+        while (j < word.size()) {
+            int best_id = -1;
+            size_t best_len = 0;
+            uint32_t node = 0;
+            for (size_t k = j; k < word.size(); ++k) {
+                node = child(node, static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(word[k]))));
+                if (node == kNoNode) {
+                    break;
+                }
+                if (nodes[node].token_id >= 0) {
+                    best_id = nodes[node].token_id;
+                    best_len = k - j + 1;
+                }
+            }
+            
+            if (best_id >= 0) {
+                tokens.push_back(best_id);
+                j += best_len;
+                found_any = true;
+            } else {
+                // Characters with no vocabulary entry are dropped
+                j++;
+            }
+        }
+        
+        // If we couldn't tokenize anything, use a common word as a placeholder
+        if (!found_any && fallback_id >= 0) {
+            tokens.push_back(fallback_id);
+        }
+    }
+    
+public:
+    std::string detokenize(const std::vector<int>& tokens) const {
+        std::string text;
+        text.reserve(tokens.size() * 6);
+        bool needs_space = false;
+        
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (tokens[i] >= 0 && static_cast<size_t>(tokens[i]) < vocabulary.size()) {
+                const std::string& token = vocabulary[tokens[i]];
+                
+                // Skip special tokens
+                if (token == "<bos>" || token == "<eos>") {
+                    continue;
+                }
+                
+                // Handle punctuation and special characters
+                bool is_punctuation = (token == "." || token == "," || token == "!" || 
+                                     token == "?" || token == ":" || token == ";" ||
+                                     token == ")" || token == "]" || token == "}" ||
+                                     token == "'" || token == "\"");
+                
+                bool is_opening = (token == "(" || token == "[" || token == "{" ||
+                                  token == "'" || token == "\"");
+                
+                // Add space before token if needed
+                if (needs_space && !is_punctuation && text.length() > 0) {
+                    text += " ";
+                }
+                
+                // Add the token
+                text += token;
+                
+                // Determine if next token needs space before it
+                needs_space = !is_punctuation && !is_opening;
+            }
+        }
+        
+        // Post-process the text to fix spacing issues
+        std::string processed_text;
+        bool last_was_space = false;
+        bool capitalize_next = true;
+        
+        for (size_t i = 0; i < text.length(); ++i) {
+            char c = text[i];
+            
+            // Handle spaces
+            if (c == ' ') {
+                if (!last_was_space) {
+                    processed_text += c;
+                }
+                last_was_space = true;
+                continue;
+            }
+            
+            // Capitalize if needed
+            if (capitalize_next && std::isalpha(c)) {
+                processed_text += std::toupper(c);
+                capitalize_next = false;
+            } else {
+                processed_text += c;
+            }
+            
+            // Check for sentence endings
+            if (c == '.' || c == '!' || c == '?') {
+                capitalize_next = true;
+            }
+            
+            last_was_space = false;
+        }
+        
+        // Final cleanup: ensure sentences end with proper punctuation
+        if (!processed_text.empty() && 
+            processed_text.back() != '.' && 
+            processed_text.back() != '!' && 
+            processed_text.back() != '?') {
+            processed_text += '.';
+        }
+        
+        return processed_text;
+    }
+};
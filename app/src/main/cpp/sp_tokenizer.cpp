@@ -0,0 +1,1213 @@
+#include "sp_tokenizer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <queue>
+#include <sstream>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "native_log.h"
+#include "shared_pool.h"
+
+#define LOGI(...) NLOGI("SP_TOKENIZER", __VA_ARGS__)
+#define LOGE(...) NLOGE("SP_TOKENIZER", __VA_ARGS__)
+
+namespace {
+
+// U+2581 LOWER ONE EIGHTH BLOCK, SentencePiece's escaped space
+constexpr char kSpaceSymbol[] = "\xE2\x96\x81";
+constexpr size_t kSpaceSymbolLen = 3;
+
+bool starts_with_space_symbol(std::string_view s, size_t pos) {
+    return s.size() - pos >= kSpaceSymbolLen && memcmp(s.data() + pos, kSpaceSymbol, kSpaceSymbolLen) == 0;
+}
+
+size_t utf8_char_len(uint8_t lead) {
+    if (lead < 0x80) return 1;
+    if ((lead & 0xE0) == 0xC0) return 2;
+    if ((lead & 0xF0) == 0xE0) return 3;
+    if ((lead & 0xF8) == 0xF0) return 4;
+    return 1;  // stray continuation byte, handled by byte fallback
+}
+
+// Offset of the first byte in [p, p+n) equal to `c`, or n
+size_t find_byte(const uint8_t* p, size_t n, uint8_t c) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    const uint8x16_t needle = vdupq_n_u8(c);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t hits = vceqq_u8(vld1q_u8(p + i), needle);
+        if (vmaxvq_u8(hits) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (p[i] == c) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Length of the leading run of ASCII bytes in [p, p+n)
+size_t ascii_prefix(const uint8_t* p, size_t n) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(p + i)) >= 0x80) {
+            break;
+        }
+    }
+#endif
+    while (i < n && p[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+// Minimal protobuf wire-format reader, enough for sentencepiece_model.proto
+class ProtoReader {
+public:
+    explicit ProtoReader(std::string_view data)
+        : p_(reinterpret_cast<const uint8_t*>(data.data())), end_(p_ + data.size()) {}
+
+    bool done() const { return p_ >= end_; }
+
+    bool next_field(uint32_t* field, uint32_t* wire) {
+        uint64_t key;
+        if (!varint(&key)) {
+            return false;
+        }
+        *field = static_cast<uint32_t>(key >> 3);
+        *wire = static_cast<uint32_t>(key & 7);
+        return true;
+    }
+
+    bool varint(uint64_t* out) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64 && p_ < end_; shift += 7) {
+            uint8_t b = *p_++;
+            value |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if ((b & 0x80) == 0) {
+                *out = value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool bytes(std::string_view* out) {
+        uint64_t len;
+        if (!varint(&len) || len > static_cast<uint64_t>(end_ - p_)) {
+            return false;
+        }
+        *out = std::string_view(reinterpret_cast<const char*>(p_), static_cast<size_t>(len));
+        p_ += len;
+        return true;
+    }
+
+    bool fixed32(uint32_t* out) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        memcpy(out, p_, 4);
+        p_ += 4;
+        return true;
+    }
+
+    bool skip(uint32_t wire) {
+        uint64_t ignored;
+        std::string_view view;
+        uint32_t word;
+        switch (wire) {
+            case 0: return varint(&ignored);
+            case 1:
+                if (end_ - p_ < 8) return false;
+                p_ += 8;
+                return true;
+            case 2: return bytes(&view);
+            case 5: return fixed32(&word);
+            default: return false;
+        }
+    }
+
+private:
+    const uint8_t* p_;
+    const uint8_t* end_;
+};
+
+// ModelProto / TrainerSpec / NormalizerSpec field numbers
+constexpr uint32_t kModelPieces = 1;
+constexpr uint32_t kModelTrainerSpec = 2;
+constexpr uint32_t kModelNormalizerSpec = 3;
+constexpr uint32_t kPieceText = 1;
+constexpr uint32_t kPieceScore = 2;
+constexpr uint32_t kPieceType = 3;
+constexpr uint32_t kTrainerModelType = 3;
+constexpr uint32_t kTrainerSplitByWhitespace = 22;
+constexpr uint32_t kTrainerAllowWhitespaceOnlyPieces = 26;
+constexpr uint32_t kTrainerByteFallback = 35;
+constexpr uint32_t kTrainerBosId = 41;
+constexpr uint32_t kTrainerEosId = 42;
+constexpr uint32_t kTrainerUnkId = 40;
+constexpr uint32_t kNormalizerAddDummyPrefix = 3;
+constexpr uint32_t kNormalizerRemoveExtraWhitespaces = 4;
+constexpr uint32_t kNormalizerEscapeWhitespaces = 5;
+constexpr uint64_t kModelTypeBpe = 2;
+
+// Flat image (tokenizer.model.flat), all sections 8-byte aligned:
+//   FlatHeader
+//   PieceRecord[piece_count]   by id
+//   texts                      each piece's bytes plus a NUL
+//   TrieUnit[trie_size]        double-array trie over the piece texts
+// Trie labels are byte + 1, and label 0 marks the end of a piece: the unit at
+// base + 0 of the node a piece ends on holds -(id + 1).
+constexpr char kFlatMagic[8] = {'S', 'P', 'F', 'L', 'A', 'T', '\0', '\0'};
+constexpr uint32_t kFlatVersion = 1;
+constexpr uint32_t kFlagByteFallback = 1u << 0;
+constexpr uint32_t kFlagSplitByWhitespace = 1u << 1;
+constexpr uint32_t kFlagAllowWhitespaceOnlyPieces = 1u << 2;
+constexpr uint32_t kFlagAddDummyPrefix = 1u << 3;
+constexpr uint32_t kFlagRemoveExtraWhitespaces = 1u << 4;
+constexpr uint32_t kFlagEscapeWhitespaces = 1u << 5;
+
+struct FlatHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    int32_t unk_id;
+    int32_t bos_id;
+    int32_t eos_id;
+    uint32_t piece_count;
+    uint32_t trie_size;
+    uint32_t max_user_defined_len;
+    uint32_t text_bytes;
+    uint32_t reserved;
+    // The tokenizer.model the image was converted from
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint64_t pieces_offset;
+    uint64_t text_offset;
+    uint64_t trie_offset;
+    uint64_t total_bytes;
+    int32_t byte_ids[256];
+    uint8_t user_defined_first_byte[256];
+};
+static_assert(sizeof(FlatHeader) % 8 == 0, "flat sections are 8-byte aligned");
+
+struct ParsedPiece {
+    std::string_view text;  // into the model file
+    float score = 0.0f;
+    int type = 1;           // kNormal
+};
+
+struct ParsedModel {
+    uint64_t model_type = 1;  // proto default is UNIGRAM
+    uint32_t flags = kFlagSplitByWhitespace | kFlagAddDummyPrefix | kFlagRemoveExtraWhitespaces |
+                     kFlagEscapeWhitespaces;
+    int unk_id = 0;
+    int bos_id = -1;
+    int eos_id = -1;
+    std::vector<ParsedPiece> pieces;
+};
+
+void set_flag(uint32_t* flags, uint32_t flag, uint64_t value) {
+    *flags = value != 0 ? (*flags | flag) : (*flags & ~flag);
+}
+
+bool parse_model(std::string_view data, ParsedModel* out) {
+    ProtoReader model(data);
+    uint32_t field, wire;
+    while (!model.done()) {
+        if (!model.next_field(&field, &wire)) {
+            return false;
+        }
+        std::string_view sub;
+        if (wire == 2 && (field == kModelPieces || field == kModelTrainerSpec || field == kModelNormalizerSpec)) {
+            if (!model.bytes(&sub)) {
+                return false;
+            }
+        } else {
+            if (!model.skip(wire)) {
+                return false;
+            }
+            continue;
+        }
+
+        ProtoReader reader(sub);
+        if (field == kModelPieces) {
+            ParsedPiece piece;
+            while (!reader.done()) {
+                uint32_t f, w;
+                uint64_t v;
+                uint32_t bits;
+                if (!reader.next_field(&f, &w)) return false;
+                if (f == kPieceText && w == 2) {
+                    if (!reader.bytes(&piece.text)) return false;
+                } else if (f == kPieceScore && w == 5) {
+                    if (!reader.fixed32(&bits)) return false;
+                    memcpy(&piece.score, &bits, sizeof(float));
+                } else if (f == kPieceType && w == 0) {
+                    if (!reader.varint(&v)) return false;
+                    piece.type = static_cast<int>(v);
+                } else if (!reader.skip(w)) {
+                    return false;
+                }
+            }
+            if (piece.type == 2) {  // kUnknown
+                out->unk_id = static_cast<int>(out->pieces.size());
+            }
+            out->pieces.push_back(piece);
+            continue;
+        }
+
+        while (!reader.done()) {
+            uint32_t f, w;
+            uint64_t v = 0;
+            if (!reader.next_field(&f, &w)) return false;
+            if (w != 0) {
+                if (!reader.skip(w)) return false;
+                continue;
+            }
+            if (!reader.varint(&v)) return false;
+            if (field == kModelTrainerSpec) {
+                switch (f) {
+                    case kTrainerModelType: out->model_type = v; break;
+                    case kTrainerSplitByWhitespace: set_flag(&out->flags, kFlagSplitByWhitespace, v); break;
+                    case kTrainerAllowWhitespaceOnlyPieces:
+                        set_flag(&out->flags, kFlagAllowWhitespaceOnlyPieces, v);
+                        break;
+                    case kTrainerByteFallback: set_flag(&out->flags, kFlagByteFallback, v); break;
+                    case kTrainerUnkId: out->unk_id = static_cast<int>(v); break;
+                    case kTrainerBosId: out->bos_id = static_cast<int>(static_cast<int64_t>(v)); break;
+                    case kTrainerEosId: out->eos_id = static_cast<int>(static_cast<int64_t>(v)); break;
+                    default: break;
+                }
+            } else {
+                switch (f) {
+                    case kNormalizerAddDummyPrefix: set_flag(&out->flags, kFlagAddDummyPrefix, v); break;
+                    case kNormalizerRemoveExtraWhitespaces:
+                        set_flag(&out->flags, kFlagRemoveExtraWhitespaces, v);
+                        break;
+                    case kNormalizerEscapeWhitespaces: set_flag(&out->flags, kFlagEscapeWhitespaces, v); break;
+                    default: break;
+                }
+            }
+        }
+    }
+
+    if (out->model_type != kModelTypeBpe) {
+        LOGE("Unsupported SentencePiece model type %llu, only BPE is implemented",
+             static_cast<unsigned long long>(out->model_type));
+        return false;
+    }
+    return !out->pieces.empty();
+}
+
+size_t align8(size_t n) {
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+// Byte pieces are spelled <0xAB>; their byte, or -1
+int byte_piece_value(std::string_view text) {
+    auto hex = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    };
+    if (text.size() != 6 || text.compare(0, 3, "<0x") != 0 || text[5] != '>') {
+        return -1;
+    }
+    int high = hex(text[3]);
+    int low = hex(text[4]);
+    return high < 0 || low < 0 ? -1 : high * 16 + low;
+}
+
+constexpr uint8_t kMaxAnchorFailures = 16;
+
+// Double-array trie over `keys` (sorted, distinct, non-empty), laid out breadth
+// first. Each node takes the first base where all its child labels are free,
+// searched along a list of the free units so the packed front is not rescanned;
+// a free unit that keeps failing as an anchor leaves the list (it can still
+// take a later label), which keeps the search short in the sparse tail.
+template <typename Unit>
+std::vector<Unit> build_trie(const std::vector<std::pair<std::string_view, int>>& keys) {
+    struct Node {
+        int32_t unit;
+        size_t lo, hi, depth;
+    };
+    std::vector<Unit> units(1, Unit{0, 0});
+    std::vector<int32_t> next_free(1, -1);
+    std::vector<int32_t> prev_free(1, -1);
+    // Failed tries as an anchor; past kMaxAnchorFailures the unit is off the list
+    std::vector<uint8_t> failures(1, kMaxAnchorFailures + 1);
+    int32_t head = -1;
+    int32_t tail = -1;
+    // New units are free and go at the end of the list
+    auto grow = [&](size_t size) {
+        size_t old = units.size();
+        if (size <= old) {
+            return;
+        }
+        units.resize(size, Unit{0, -1});
+        next_free.resize(size);
+        prev_free.resize(size);
+        failures.resize(size, 0);
+        for (size_t i = old; i < size; ++i) {
+            prev_free[i] = i == old ? tail : static_cast<int32_t>(i - 1);
+            next_free[i] = i + 1 < size ? static_cast<int32_t>(i + 1) : -1;
+        }
+        if (tail >= 0) {
+            next_free[tail] = static_cast<int32_t>(old);
+        } else {
+            head = static_cast<int32_t>(old);
+        }
+        tail = static_cast<int32_t>(size - 1);
+    };
+    auto unlink = [&](size_t at) {
+        if (failures[at] > kMaxAnchorFailures) {
+            return;
+        }
+        failures[at] = kMaxAnchorFailures + 1;
+        int32_t prev = prev_free[at];
+        int32_t next = next_free[at];
+        (prev >= 0 ? next_free[prev] : head) = next;
+        (next >= 0 ? prev_free[next] : tail) = prev;
+    };
+
+    std::queue<Node> nodes;
+    nodes.push({0, 0, keys.size(), 0});
+    std::vector<int> labels;
+    std::vector<size_t> starts;
+    while (!nodes.empty()) {
+        Node node = nodes.front();
+        nodes.pop();
+        labels.clear();
+        starts.clear();
+        for (size_t k = node.lo; k < node.hi; ++k) {
+            std::string_view key = keys[k].first;
+            int label = key.size() == node.depth ? 0 : static_cast<uint8_t>(key[node.depth]) + 1;
+            if (labels.empty() || labels.back() != label) {
+                labels.push_back(label);
+                starts.push_back(k);
+            }
+        }
+        starts.push_back(node.hi);
+
+        // The first label goes in a free unit; the rest must be free there too
+        size_t base = 0;
+        for (int32_t slot = head;; slot = next_free[slot]) {
+            if (slot < 0) {
+                slot = static_cast<int32_t>(units.size());
+                grow(units.size() + 257);
+            }
+            if (slot <= labels[0]) {
+                continue;
+            }
+            base = static_cast<size_t>(slot - labels[0]);
+            grow(base + labels.back() + 1);
+            bool fits = true;
+            for (size_t l = 1; fits && l < labels.size(); ++l) {
+                fits = units[base + labels[l]].check < 0;
+            }
+            if (fits) {
+                break;
+            }
+            // Unlinking leaves next_free[slot] as it was, so the walk goes on
+            if (failures[slot] == kMaxAnchorFailures) {
+                unlink(slot);
+            } else {
+                failures[slot]++;
+            }
+        }
+        units[node.unit].base = static_cast<int32_t>(base);
+        for (size_t l = 0; l < labels.size(); ++l) {
+            size_t at = base + labels[l];
+            unlink(at);
+            units[at].check = node.unit;
+            if (labels[l] == 0) {
+                units[at].base = -(keys[starts[l]].second + 1);
+            } else {
+                nodes.push({static_cast<int32_t>(at), starts[l], starts[l + 1], node.depth + 1});
+            }
+        }
+    }
+    // Lookups bounds-check, so the free tail need not be stored
+    while (units.back().check < 0) {
+        units.pop_back();
+    }
+    return units;
+}
+
+// Modification time of `st` in nanoseconds
+int64_t mtime_ns(const struct stat& st) {
+#if defined(__APPLE__)
+    return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Replace `path` with `bytes` of `data`: written to a temporary file and renamed over it
+bool write_file(const std::string& path, const void* data, size_t bytes) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_all(fd, data, bytes);
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+SpTokenizer::~SpTokenizer() {
+    release();
+}
+
+void SpTokenizer::release() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_bytes_);
+        mapping_ = nullptr;
+        mapping_bytes_ = 0;
+    }
+    image_.clear();
+    image_.shrink_to_fit();
+    pieces_ = nullptr;
+    piece_count_ = 0;
+    texts_ = nullptr;
+    text_bytes_ = 0;
+    trie_ = nullptr;
+    trie_size_ = 0;
+}
+
+bool SpTokenizer::load(const std::string& path, bool use_flat) {
+    auto start = std::chrono::steady_clock::now();
+    struct stat source;
+    if (stat(path.c_str(), &source) != 0) {
+        LOGE("Tokenizer model not found at %s", path.c_str());
+        return false;
+    }
+    release();
+    {
+        std::lock_guard<std::shared_mutex> lock(cache_mutex_);
+        segment_cache_.clear();
+    }
+    memo_.clear();
+    path_.clear();
+
+    // A flat image converted from this very file is mapped as it is
+    const std::string flat_path = path + ".flat";
+    if (use_flat) {
+        int fd = ::open(flat_path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(FlatHeader)) {
+            size_t bytes = static_cast<size_t>(st.st_size);
+            void* map = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                const FlatHeader* header = static_cast<const FlatHeader*>(map);
+                if (header->source_size == static_cast<uint64_t>(source.st_size) &&
+                    header->source_mtime_ns == mtime_ns(source) && adopt(map, bytes)) {
+                    mapping_ = map;
+                    mapping_bytes_ = bytes;
+                } else {
+                    munmap(map, bytes);
+                }
+            }
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (mapped()) {
+            path_ = path;
+            LOGI("Mapped %zu pieces from %s in %.2f ms", piece_count_, flat_path.c_str(),
+                 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            return true;
+        }
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good()) {
+        LOGE("Tokenizer model not found at %s", path.c_str());
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string data = buffer.str();
+    ParsedModel model;
+    if (!parse_model(data, &model)) {
+        return false;
+    }
+
+    // Trie keys: every piece by text, the first id of a repeated text winning
+    std::vector<std::pair<std::string_view, int>> keys;
+    keys.reserve(model.pieces.size());
+    for (size_t i = 0; i < model.pieces.size(); ++i) {
+        if (!model.pieces[i].text.empty()) {
+            keys.emplace_back(model.pieces[i].text, static_cast<int>(i));
+        }
+    }
+    std::stable_sort(keys.begin(), keys.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    keys.erase(std::unique(keys.begin(), keys.end(), [](const auto& a, const auto& b) { return a.first == b.first; }),
+               keys.end());
+    std::vector<TrieUnit> trie = build_trie<TrieUnit>(keys);
+
+    FlatHeader header = {};
+    memcpy(header.magic, kFlatMagic, sizeof(kFlatMagic));
+    header.version = kFlatVersion;
+    header.flags = model.flags;
+    header.unk_id = model.unk_id;
+    header.bos_id = model.bos_id;
+    header.eos_id = model.eos_id;
+    header.piece_count = static_cast<uint32_t>(model.pieces.size());
+    header.trie_size = static_cast<uint32_t>(trie.size());
+    header.source_size = static_cast<uint64_t>(source.st_size);
+    header.source_mtime_ns = mtime_ns(source);
+    std::fill(std::begin(header.byte_ids), std::end(header.byte_ids), -1);
+    size_t text_bytes = 0;
+    for (const ParsedPiece& piece : model.pieces) {
+        text_bytes += piece.text.size() + 1;
+        if (piece.type == kByte) {
+            int value = byte_piece_value(piece.text);
+            if (value >= 0) {
+                header.byte_ids[value] = static_cast<int32_t>(&piece - model.pieces.data());
+            }
+        } else if (piece.type == kUserDefined && !piece.text.empty()) {
+            header.user_defined_first_byte[static_cast<uint8_t>(piece.text[0])] = 1;
+            header.max_user_defined_len =
+                std::max(header.max_user_defined_len, static_cast<uint32_t>(piece.text.size()));
+        }
+    }
+    header.text_bytes = static_cast<uint32_t>(text_bytes);
+    header.pieces_offset = sizeof(FlatHeader);
+    header.text_offset = header.pieces_offset + align8(model.pieces.size() * sizeof(PieceRecord));
+    header.trie_offset = header.text_offset + align8(text_bytes);
+    header.total_bytes = header.trie_offset + trie.size() * sizeof(TrieUnit);
+
+    std::vector<uint64_t> image(header.total_bytes / sizeof(uint64_t), 0);
+    uint8_t* base = reinterpret_cast<uint8_t*>(image.data());
+    memcpy(base, &header, sizeof(header));
+    PieceRecord* records = reinterpret_cast<PieceRecord*>(base + header.pieces_offset);
+    char* texts = reinterpret_cast<char*>(base + header.text_offset);
+    uint32_t text_offset = 0;
+    for (size_t i = 0; i < model.pieces.size(); ++i) {
+        const ParsedPiece& piece = model.pieces[i];
+        records[i] = {text_offset, static_cast<uint32_t>(piece.text.size()), piece.score,
+                      static_cast<int32_t>(piece.type)};
+        memcpy(texts + text_offset, piece.text.data(), piece.text.size());
+        text_offset += static_cast<uint32_t>(piece.text.size()) + 1;
+    }
+    memcpy(base + header.trie_offset, trie.data(), trie.size() * sizeof(TrieUnit));
+    double convert_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // Map what was written, so this process shares the pages with the next one
+    if (use_flat && write_file(flat_path, base, header.total_bytes)) {
+        int fd = ::open(flat_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            void* map = mmap(nullptr, header.total_bytes, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map != MAP_FAILED && adopt(map, header.total_bytes)) {
+                mapping_ = map;
+                mapping_bytes_ = header.total_bytes;
+            } else if (map != MAP_FAILED) {
+                munmap(map, header.total_bytes);
+            }
+        }
+    } else if (use_flat) {
+        LOGI("Could not write %s, keeping the tokenizer image in memory", flat_path.c_str());
+    }
+    if (!mapped()) {
+        image_ = std::move(image);
+        if (!adopt(image_.data(), header.total_bytes)) {
+            release();
+            return false;
+        }
+    }
+    path_ = path;
+    LOGI("Converted %zu pieces from %s in %.2f ms (byte_fallback=%d, %s)", piece_count_, path.c_str(), convert_ms,
+         byte_fallback_, mapped() ? "mapped" : "in memory");
+    return true;
+}
+
+// Point the tables at a flat image after checking that its sections fit in
+// `bytes`. Entries are bounds-checked where they are used, so nothing larger
+// than the header is read here.
+bool SpTokenizer::adopt(const void* image, size_t bytes) {
+    const FlatHeader* header = static_cast<const FlatHeader*>(image);
+    if (bytes < sizeof(FlatHeader) || memcmp(header->magic, kFlatMagic, sizeof(kFlatMagic)) != 0 ||
+        header->version != kFlatVersion || header->total_bytes != bytes || header->piece_count == 0 ||
+        header->pieces_offset != sizeof(FlatHeader) ||
+        header->text_offset <
+            header->pieces_offset + static_cast<uint64_t>(header->piece_count) * sizeof(PieceRecord) ||
+        header->trie_offset < header->text_offset + header->text_bytes || header->trie_offset % 8 != 0 ||
+        header->trie_offset + static_cast<uint64_t>(header->trie_size) * sizeof(TrieUnit) > bytes ||
+        header->trie_size == 0) {
+        LOGE("Tokenizer image is malformed or from another version");
+        return false;
+    }
+    const uint8_t* base = static_cast<const uint8_t*>(image);
+    pieces_ = reinterpret_cast<const PieceRecord*>(base + header->pieces_offset);
+    piece_count_ = header->piece_count;
+    texts_ = reinterpret_cast<const char*>(base + header->text_offset);
+    text_bytes_ = header->text_bytes;
+    trie_ = reinterpret_cast<const TrieUnit*>(base + header->trie_offset);
+    trie_size_ = header->trie_size;
+
+    byte_fallback_ = (header->flags & kFlagByteFallback) != 0;
+    split_by_whitespace_ = (header->flags & kFlagSplitByWhitespace) != 0;
+    allow_whitespace_only_pieces_ = (header->flags & kFlagAllowWhitespaceOnlyPieces) != 0;
+    add_dummy_prefix_ = (header->flags & kFlagAddDummyPrefix) != 0;
+    remove_extra_whitespaces_ = (header->flags & kFlagRemoveExtraWhitespaces) != 0;
+    escape_whitespaces_ = (header->flags & kFlagEscapeWhitespaces) != 0;
+    unk_id_ = header->unk_id;
+    bos_id_ = header->bos_id;
+    eos_id_ = header->eos_id;
+    max_user_defined_len_ = header->max_user_defined_len;
+    for (int b = 0; b < 256; ++b) {
+        int id = header->byte_ids[b];
+        byte_ids_[b] = id >= 0 && static_cast<size_t>(id) < piece_count_ ? id : -1;
+        user_defined_first_byte_[b] = header->user_defined_first_byte[b] != 0;
+    }
+
+    // Bytes the segmenter has to stop at
+    std::fill(std::begin(special_), std::end(special_), false);
+    special_list_.clear();
+    if (split_by_whitespace_) {
+        special_[0xE2] = true;
+    }
+    for (int b = 0; b < 256; ++b) {
+        special_[b] = special_[b] || user_defined_first_byte_[b];
+        if (special_[b]) {
+            special_list_.push_back(static_cast<uint8_t>(b));
+        }
+    }
+    return true;
+}
+
+std::string_view SpTokenizer::piece_text(int id) const {
+    const PieceRecord& piece = pieces_[id];
+    if (piece.text_offset > text_bytes_ || piece.text_len > text_bytes_ - piece.text_offset) {
+        return std::string_view();
+    }
+    return std::string_view(texts_ + piece.text_offset, piece.text_len);
+}
+
+int SpTokenizer::find_piece(std::string_view text) const {
+    if (text.empty() || trie_size_ == 0) {
+        return -1;
+    }
+    int32_t node = 0;
+    for (char c : text) {
+        uint64_t next = static_cast<uint64_t>(trie_[node].base) + static_cast<uint8_t>(c) + 1;
+        if (trie_[node].base < 1 || next >= trie_size_ || trie_[next].check != node) {
+            return -1;
+        }
+        node = static_cast<int32_t>(next);
+    }
+    int32_t end = trie_[node].base;
+    if (end < 1 || static_cast<size_t>(end) >= trie_size_ || trie_[end].check != node || trie_[end].base >= 0) {
+        return -1;
+    }
+    int id = -trie_[end].base - 1;
+    return static_cast<size_t>(id) < piece_count_ ? id : -1;
+}
+
+int SpTokenizer::find_mergeable(std::string_view text) const {
+    int id = find_piece(text);
+    return id >= 0 && (pieces_[id].type == kNormal || pieces_[id].type == kUserDefined) ? id : -1;
+}
+
+// Apply the normalizer flags. Gemma ships an identity normalizer, so there is no
+// precompiled charsmap to run; only whitespace handling applies.
+std::string SpTokenizer::normalize(std::string_view text) const {
+    std::string out;
+    out.reserve(text.size() + text.size() / 4 + kSpaceSymbolLen);
+
+    if (remove_extra_whitespaces_) {
+        size_t first = text.find_first_not_of(' ');
+        if (first == std::string_view::npos) {
+            return out;
+        }
+        size_t last = text.find_last_not_of(' ');
+        text = text.substr(first, last - first + 1);
+    }
+    if (text.empty()) {
+        return out;
+    }
+    if (add_dummy_prefix_) {
+        out.append(escape_whitespaces_ ? kSpaceSymbol : " ", escape_whitespaces_ ? kSpaceSymbolLen : 1);
+    }
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(text.data());
+    size_t n = text.size();
+    size_t i = 0;
+    while (i < n) {
+        size_t run = find_byte(p + i, n - i, ' ');
+        out.append(text.data() + i, run);
+        i += run;
+        if (i >= n) {
+            break;
+        }
+        // Collapse a run of spaces to one when removing extra whitespace
+        size_t spaces = 1;
+        while (i + spaces < n && p[i + spaces] == ' ') {
+            ++spaces;
+        }
+        size_t emit = remove_extra_whitespaces_ ? 1 : spaces;
+        for (size_t s = 0; s < emit; ++s) {
+            out.append(escape_whitespaces_ ? kSpaceSymbol : " ", escape_whitespaces_ ? kSpaceSymbolLen : 1);
+        }
+        i += spaces;
+    }
+    return out;
+}
+
+// Offset of the first byte in [p, p+n) that can start a user-defined symbol or a
+// whitespace split, or n. The common case is a handful of distinct bytes
+// ('<', '\n', the space-symbol lead), which NEON checks 16 bytes at a time.
+size_t SpTokenizer::find_special(const uint8_t* p, size_t n) const {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    if (!special_list_.empty() && special_list_.size() <= kMaxSimdSpecials) {
+        uint8x16_t needles[kMaxSimdSpecials];
+        for (size_t k = 0; k < special_list_.size(); ++k) {
+            needles[k] = vdupq_n_u8(special_list_[k]);
+        }
+        for (; i + 16 <= n; i += 16) {
+            uint8x16_t chunk = vld1q_u8(p + i);
+            uint8x16_t hits = vceqq_u8(chunk, needles[0]);
+            for (size_t k = 1; k < special_list_.size(); ++k) {
+                hits = vorrq_u8(hits, vceqq_u8(chunk, needles[k]));
+            }
+            if (vmaxvq_u8(hits) != 0) {
+                break;
+            }
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (special_[p[i]]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Longest user-defined symbol starting at text[i], in one walk down the trie
+size_t SpTokenizer::match_user_defined(std::string_view text, size_t i, int* id) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(text.data());
+    size_t longest = std::min(max_user_defined_len_, text.size() - i);
+    size_t match_len = 0;
+    int32_t node = 0;
+    for (size_t len = 1; len <= longest; ++len) {
+        uint64_t next = static_cast<uint64_t>(trie_[node].base) + p[i + len - 1] + 1;
+        if (trie_[node].base < 1 || next >= trie_size_ || trie_[next].check != node) {
+            break;
+        }
+        node = static_cast<int32_t>(next);
+        int32_t end = trie_[node].base;
+        if (end >= 1 && static_cast<size_t>(end) < trie_size_ && trie_[end].check == node && trie_[end].base < 0) {
+            int found = -trie_[end].base - 1;
+            if (static_cast<size_t>(found) < piece_count_ && pieces_[found].type == kUserDefined) {
+                *id = found;
+                match_len = len;
+            }
+        }
+    }
+    return match_len;
+}
+
+// Split normalized text into independently merged segments. User-defined symbols
+// become their own segment; with split_by_whitespace a space symbol starts a new
+// segment. sink(segment, fixed_id) gets fixed_id >= 0 for user-defined symbols.
+template <typename Sink>
+void SpTokenizer::for_each_segment(std::string_view text, Sink&& sink) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(text.data());
+    const size_t n = text.size();
+    size_t seg_start = 0;
+    size_t i = 0;
+    bool in_whitespace = false;
+
+    while (i < n) {
+        if (user_defined_first_byte_[p[i]]) {
+            int fixed_id = -1;
+            size_t match_len = match_user_defined(text, i, &fixed_id);
+            if (match_len > 0) {
+                if (i > seg_start) {
+                    sink(text.substr(seg_start, i - seg_start), -1);
+                }
+                sink(text.substr(i, match_len), fixed_id);
+                i += match_len;
+                seg_start = i;
+                in_whitespace = false;
+                continue;
+            }
+        }
+
+        if (split_by_whitespace_ && starts_with_space_symbol(text, i)) {
+            if (i > seg_start && (!in_whitespace || !allow_whitespace_only_pieces_)) {
+                sink(text.substr(seg_start, i - seg_start), -1);
+                seg_start = i;
+            }
+            in_whitespace = true;
+            i += kSpaceSymbolLen;
+            continue;
+        }
+
+        // Ordinary byte: jump to the next byte that could start a symbol or a split
+        in_whitespace = false;
+        i += 1 + find_special(p + i + 1, n - i - 1);
+    }
+    if (seg_start < n) {
+        sink(text.substr(seg_start), -1);
+    }
+}
+
+// BPE over one segment: start from UTF-8 characters and repeatedly merge the
+// adjacent pair whose concatenation is the highest-scoring piece.
+void SpTokenizer::encode_segment(std::string_view segment, std::vector<int>& out) const {
+    struct Symbol {
+        uint32_t start;
+        uint32_t len;
+        int prev;
+        int next;
+    };
+    struct Candidate {
+        float score;
+        int left;
+        uint32_t len;
+        bool operator<(const Candidate& other) const {
+            // Highest score first, leftmost pair on ties
+            return score < other.score || (score == other.score && left > other.left);
+        }
+    };
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(segment.data());
+    const size_t n = segment.size();
+    std::vector<Symbol> symbols;
+    symbols.reserve(n);
+    size_t i = 0;
+    while (i < n) {
+        // ASCII runs split one byte per symbol without decoding
+        size_t ascii = ascii_prefix(p + i, n - i);
+        for (size_t k = 0; k < ascii; ++k, ++i) {
+            int idx = static_cast<int>(symbols.size());
+            symbols.push_back({static_cast<uint32_t>(i), 1, idx - 1, idx + 1});
+        }
+        if (i < n) {
+            size_t len = std::min(utf8_char_len(p[i]), n - i);
+            int idx = static_cast<int>(symbols.size());
+            symbols.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(len), idx - 1, idx + 1});
+            i += len;
+        }
+    }
+    if (symbols.empty()) {
+        return;
+    }
+    symbols.back().next = -1;
+
+    std::priority_queue<Candidate> queue;
+    auto try_pair = [&](int left) {
+        if (left < 0 || symbols[left].next < 0) {
+            return;
+        }
+        const Symbol& a = symbols[left];
+        const Symbol& b = symbols[a.next];
+        int id = find_mergeable(segment.substr(a.start, a.len + b.len));
+        if (id >= 0) {
+            queue.push({pieces_[id].score, left, a.len + b.len});
+        }
+    };
+    for (size_t s = 0; s + 1 < symbols.size(); ++s) {
+        try_pair(static_cast<int>(s));
+    }
+
+    while (!queue.empty()) {
+        Candidate top = queue.top();
+        queue.pop();
+        Symbol& left = symbols[top.left];
+        // Skip candidates invalidated by an earlier merge
+        if (left.len == 0 || left.next < 0 || left.len + symbols[left.next].len != top.len) {
+            continue;
+        }
+        Symbol& right = symbols[left.next];
+        left.len += right.len;
+        right.len = 0;
+        left.next = right.next;
+        if (right.next >= 0) {
+            symbols[right.next].prev = top.left;
+        }
+        try_pair(left.prev);
+        try_pair(top.left);
+    }
+
+    for (int s = 0; s >= 0; s = symbols[s].next) {
+        std::string_view piece = segment.substr(symbols[s].start, symbols[s].len);
+        int found = find_mergeable(piece);
+        if (found >= 0) {
+            out.push_back(found);
+        } else if (byte_fallback_) {
+            for (char c : piece) {
+                int id = byte_ids_[static_cast<uint8_t>(c)];
+                out.push_back(id >= 0 ? id : unk_id_);
+            }
+        } else {
+            out.push_back(unk_id_);
+        }
+    }
+}
+
+void SpTokenizer::append_segment(std::string_view segment, std::vector<int>* out, size_t* count) const {
+    {
+        std::shared_lock<std::shared_mutex> lock(cache_mutex_);
+        auto it = segment_cache_.find(std::string(segment));
+        if (it != segment_cache_.end()) {
+            if (out) out->insert(out->end(), it->second.begin(), it->second.end());
+            if (count) *count += it->second.size();
+            return;
+        }
+    }
+
+    std::vector<int> ids;
+    encode_segment(segment, ids);
+    if (out) out->insert(out->end(), ids.begin(), ids.end());
+    if (count) *count += ids.size();
+
+    std::lock_guard<std::shared_mutex> lock(cache_mutex_);
+    if (segment_cache_.size() >= kMaxCachedSegments) {
+        segment_cache_.clear();
+    }
+    segment_cache_.emplace(std::string(segment), std::move(ids));
+}
+
+int SpTokenizer::piece_id(std::string_view text) const {
+    return loaded() ? find_piece(text) : -1;
+}
+
+std::vector<int> SpTokenizer::encode(std::string_view text) const {
+    std::vector<int> ids;
+    if (!loaded()) {
+        return ids;
+    }
+    bool memoizable = TokenMemo::memoizable(text);
+    if (memoizable && memo_.find(text, &ids)) {
+        return ids;
+    }
+    encode_normalized(normalize(text), ids);
+    if (memoizable) {
+        memo_.put(text, ids);
+    }
+    return ids;
+}
+
+void SpTokenizer::encode_normalized(std::string_view normalized, std::vector<int>& ids) const {
+    ids.reserve(ids.size() + normalized.size() / 3 + 1);
+    for_each_segment(normalized, [&](std::string_view segment, int fixed_id) {
+        if (fixed_id >= 0) {
+            ids.push_back(fixed_id);
+        } else {
+            append_segment(segment, &ids, nullptr);
+        }
+    });
+}
+
+// The serial scan reaches a space symbol that follows a non-space with the
+// previous segment open, closes it and goes on exactly as a scan started there
+// would, unless a user-defined symbol begun earlier swallows the position.
+// A symbol starting at `at` itself is matched the same way by both scans.
+bool SpTokenizer::safe_cut(std::string_view normalized, size_t at) const {
+    if (!split_by_whitespace_ || at < kSpaceSymbolLen || !starts_with_space_symbol(normalized, at) ||
+        starts_with_space_symbol(normalized, at - kSpaceSymbolLen)) {
+        return false;
+    }
+    size_t from = at >= max_user_defined_len_ ? at - max_user_defined_len_ + 1 : 0;
+    for (size_t i = from; i < at; ++i) {
+        int id = -1;
+        if (user_defined_first_byte_[static_cast<uint8_t>(normalized[i])] &&
+            i + match_user_defined(normalized, i, &id) > at) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<int> SpTokenizer::encode_parallel(std::string_view text, size_t workers) const {
+    // Below this per slice, handing slices to the pool costs about what splitting saves
+    static constexpr size_t kMinSliceBytes = 16 << 10;
+    std::vector<int> ids;
+    if (!loaded()) {
+        return ids;
+    }
+    if (TokenMemo::memoizable(text)) {
+        return encode(text);
+    }
+    std::string normalized = normalize(text);
+    workers = std::min(workers, normalized.size() / kMinSliceBytes);
+
+    // Slice boundaries: the first safe cut at or after each even share
+    std::vector<size_t> cuts{0};
+    for (size_t w = 1; w < workers; ++w) {
+        size_t at = std::max(cuts.back() + 1, normalized.size() * w / workers);
+        while (at < normalized.size() && !safe_cut(normalized, at)) {
+            at = normalized.find(kSpaceSymbol, at + 1, kSpaceSymbolLen);
+        }
+        if (at >= normalized.size()) {
+            break;
+        }
+        cuts.push_back(at);
+    }
+    cuts.push_back(normalized.size());
+    size_t slices = cuts.size() - 1;
+    if (slices < 2) {
+        encode_normalized(normalized, ids);
+        return ids;
+    }
+
+    std::vector<std::vector<int>> parts(slices);
+    auto encode_slice = [&](size_t k) {
+        encode_normalized(std::string_view(normalized).substr(cuts[k], cuts[k + 1] - cuts[k]), parts[k]);
+    };
+    auto encode_task = [&](int64_t k) { encode_slice(static_cast<size_t>(k)); };
+    shared_pool::pool().parallel_for(0, static_cast<int64_t>(slices), encode_task, static_cast<int>(slices));
+    size_t total = 0;
+    for (const std::vector<int>& part : parts) {
+        total += part.size();
+    }
+    ids.reserve(total);
+    for (const std::vector<int>& part : parts) {
+        ids.insert(ids.end(), part.begin(), part.end());
+    }
+    return ids;
+}
+
+size_t SpTokenizer::count(std::string_view text) const {
+    size_t total = 0;
+    if (!loaded()) {
+        return total;
+    }
+    // A short text is encoded once and memoized, so a later encode() of it is a lookup too
+    if (TokenMemo::memoizable(text)) {
+        long memoized = memo_.count(text);
+        if (memoized >= 0) {
+            return static_cast<size_t>(memoized);
+        }
+        std::vector<int> ids;
+        encode_normalized(normalize(text), ids);
+        memo_.put(text, ids);
+        return ids.size();
+    }
+    std::string normalized = normalize(text);
+    for_each_segment(normalized, [&](std::string_view segment, int fixed_id) {
+        if (fixed_id >= 0) {
+            total++;
+        } else {
+            append_segment(segment, nullptr, &total);
+        }
+    });
+    return total;
+}
+
+void SpTokenizer::append_piece(int id, std::string& out) const {
+    if (id < 0 || static_cast<size_t>(id) >= piece_count_) {
+        return;
+    }
+    switch (pieces_[id].type) {
+        case kControl:
+        case kUnused:
+            break;
+        case kUnknown:
+            out += " \xE2\x81\x87 ";  // SentencePiece renders unknowns as U+2047
+            break;
+        case kByte: {
+            int value = byte_piece_value(piece_text(id));
+            if (value >= 0) {
+                out.push_back(static_cast<char>(value));
+            }
+            break;
+        }
+        default: {
+            // Unescape space symbols back to spaces
+            std::string_view text = piece_text(id);
+            size_t pos = 0;
+            while (pos < text.size()) {
+                size_t found = text.find(kSpaceSymbol, pos);
+                if (found == std::string_view::npos) {
+                    out.append(text.data() + pos, text.size() - pos);
+                    break;
+                }
+                out.append(text.data() + pos, found - pos);
+                out.push_back(' ');
+                pos = found + kSpaceSymbolLen;
+            }
+            break;
+        }
+    }
+}
+
+std::string SpTokenizer::decode(const std::vector<int>& ids) const {
+    std::string out;
+    for (int id : ids) {
+        append_piece(id, out);
+    }
+    if (add_dummy_prefix_ && !out.empty() && out[0] == ' ') {
+        out.erase(0, 1);
+    }
+    return out;
+}
+
+std::string SpStreamDecoder::push(int id) {
+    scratch_.clear();
+    tokenizer_.append_piece(id, scratch_);
+    std::string_view text = scratch_;
+    // The dummy prefix only ever shows up as a leading space on the first piece
+    if (at_start_ && !text.empty()) {
+        if (tokenizer_.adds_dummy_prefix() && text[0] == ' ') {
+            text.remove_prefix(1);
+        }
+        at_start_ = text.empty();
+    }
+    return buffer_.push(text);
+}
+
+std::string SpStreamDecoder::flush() {
+    return buffer_.flush();
+}
+
+void SpStreamDecoder::reset() {
+    buffer_.clear();
+    at_start_ = true;
+}
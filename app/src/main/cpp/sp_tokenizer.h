@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "token_memo.h"
+#include "utf8_stream.h"
+
+/**
+ * SentencePiece BPE tokenizer that reads tokenizer.model directly.
+ *
+ * Only the parts of the ModelProto that Gemma uses are parsed: the piece table
+ * and the trainer/normalizer flags for whitespace handling and byte
+ * fallback. Text is normalized, split into segments (user-defined symbols and
+ * whitespace-prefixed words), and each segment is merged by piece score. Segment results are cached because textbook pages repeat the same words
+ * over and over, and whole short texts are memoized (token_memo.h) because
+ * prompts repeat the same fragments.
+ *
+ * The first load converts the model into a flat image next to it
+ * (tokenizer.model.flat): a piece table, the piece texts, a double-array trie
+ * over them and the byte-fallback table, laid out to be used in place. Later
+ * loads check it against the model's size and mtime and mmap it, with no
+ * parsing and no per-piece allocation, and processes loading the same model
+ * share its pages. When the directory is read-only the image stays on the heap.
+ *
+ * encode_parallel() spreads one long text over the shared worker pool
+ * (shared_pool.h). The normalized
+ * text is cut only where the serial segmenter is certain to start a segment: a
+ * space symbol after a non-space, with no user-defined symbol running across
+ * it. Segments merge independently, so the slices' ids joined are exactly
+ * encode()'s.
+ */
+class SpTokenizer {
+public:
+    SpTokenizer() = default;
+    SpTokenizer(const SpTokenizer&) = delete;
+    SpTokenizer& operator=(const SpTokenizer&) = delete;
+    ~SpTokenizer();
+
+    // Load a serialized SentencePiece ModelProto, through its flat image unless
+    // `use_flat` is false. Returns false on a malformed file or a model type
+    // other than BPE.
+    bool load(const std::string& path, bool use_flat = true);
+    bool loaded() const { return piece_count_ > 0; }
+    // The pieces come from a mapped flat image rather than the heap
+    bool mapped() const { return mapping_ != nullptr; }
+    const std::string& path() const { return path_; }
+
+    std::vector<int> encode(std::string_view text) const;
+    // encode() in up to `workers` slices on the shared pool; texts too short to
+    // be worth splitting, or without a safe cut, run on the caller
+    std::vector<int> encode_parallel(std::string_view text, size_t workers) const;
+    // Same result as encode(text).size(), without materializing the ids
+    size_t count(std::string_view text) const;
+    std::string decode(const std::vector<int>& ids) const;
+    // Append the text of one piece (spaces unescaped, raw byte for byte pieces)
+    void append_piece(int id, std::string& out) const;
+    bool adds_dummy_prefix() const { return add_dummy_prefix_; }
+    // The whole-text memo of encode() and count(); cleared by load()
+    TokenMemo& memo() const { return memo_; }
+
+    size_t vocab_size() const { return piece_count_; }
+    int bos_id() const { return bos_id_; }
+    int eos_id() const { return eos_id_; }
+    // Id of the piece spelled exactly `text`, whatever its type, or -1
+    int piece_id(std::string_view text) const;
+    // Merge score of a piece (higher merges first; about minus its rank in a
+    // Gemma vocabulary) and whether it is an ordinary vocabulary piece rather
+    // than a control, byte or user-defined one
+    float piece_score(int id) const {
+        return id >= 0 && static_cast<size_t>(id) < piece_count_ ? pieces_[id].score : 0.0f;
+    }
+    bool normal_piece(int id) const {
+        return id >= 0 && static_cast<size_t>(id) < piece_count_ && pieces_[id].type == kNormal;
+    }
+
+private:
+    enum PieceType {
+        kNormal = 1,
+        kUnknown = 2,
+        kControl = 3,
+        kUserDefined = 4,
+        kUnused = 5,
+        kByte = 6,
+    };
+
+    // Flat image records, used in place (layout in sp_tokenizer.cpp)
+    struct PieceRecord {
+        uint32_t text_offset;  // into the text block, NUL terminated
+        uint32_t text_len;
+        float score;
+        int32_t type;
+    };
+    struct TrieUnit {
+        int32_t base;   // children at base + label; a terminal holds -(id + 1)
+        int32_t check;  // parent unit, -1 when free
+    };
+
+    std::string path_;
+    const PieceRecord* pieces_ = nullptr;
+    size_t piece_count_ = 0;
+    const char* texts_ = nullptr;
+    size_t text_bytes_ = 0;
+    const TrieUnit* trie_ = nullptr;
+    size_t trie_size_ = 0;
+    // What the views above point into: the mapped flat file, or image_
+    void* mapping_ = nullptr;
+    size_t mapping_bytes_ = 0;
+    std::vector<uint64_t> image_;
+    bool user_defined_first_byte_[256] = {};
+    size_t max_user_defined_len_ = 0;
+    
+    // Bytes where segmentation may need to stop, as a table and as a list for NEON
+    static constexpr size_t kMaxSimdSpecials = 8;
+    bool special_[256] = {};
+    std::vector<uint8_t> special_list_;
+    int byte_ids_[256];
+    int unk_id_ = 0;
+    int bos_id_ = -1;
+    int eos_id_ = -1;
+
+    // Trainer and normalizer flags
+    bool byte_fallback_ = false;
+    bool split_by_whitespace_ = true;
+    bool allow_whitespace_only_pieces_ = false;
+    bool add_dummy_prefix_ = true;
+    bool remove_extra_whitespaces_ = true;
+    bool escape_whitespaces_ = true;
+
+    // Segment -> ids, bounded; shared by encode() and count(). Lookups take the
+    // lock shared so parallel slices do not queue on it.
+    static constexpr size_t kMaxCachedSegments = 16384;
+    mutable std::shared_mutex cache_mutex_;
+    mutable std::unordered_map<std::string, std::vector<int>> segment_cache_;
+    mutable TokenMemo memo_;
+
+    bool adopt(const void* image, size_t bytes);
+    void release();
+    std::string_view piece_text(int id) const;
+    // Id of the piece spelled `text` by exact trie lookup, or -1
+    int find_piece(std::string_view text) const;
+    // find_piece restricted to pieces BPE may produce (normal and user-defined)
+    int find_mergeable(std::string_view text) const;
+    std::string normalize(std::string_view text) const;
+    size_t find_special(const uint8_t* p, size_t n) const;
+    // Length of the longest user-defined symbol at text[i], 0 if none; its id in `*id`
+    size_t match_user_defined(std::string_view text, size_t i, int* id) const;
+    template <typename Sink>
+    void for_each_segment(std::string_view normalized, Sink&& sink) const;
+    void encode_normalized(std::string_view normalized, std::vector<int>& ids) const;
+    // Whether the segmenter starts a segment at `at` whatever came before it
+    bool safe_cut(std::string_view normalized, size_t at) const;
+    void encode_segment(std::string_view segment, std::vector<int>& out) const;
+    // Encode through the segment cache, appending ids to `out` and/or adding to `count`
+    void append_segment(std::string_view segment, std::vector<int>* out, size_t* count) const;
+};
+
+/**
+ * Incremental detokenizer for streaming generation. Each push() decodes only the
+ * new piece and returns the text that is complete so far. Bytes of a code point
+ * split across byte-fallback pieces are held back until the code point is whole.
+ * Because "\u2581" is a piece prefix, a piece never changes the text that came
+ * before it, and nothing emitted earlier has to be decoded again.
+ */
+class SpStreamDecoder {
+public:
+    explicit SpStreamDecoder(const SpTokenizer& tokenizer) : tokenizer_(tokenizer) {}
+
+    std::string push(int id);
+    // Remaining held-back bytes at end of stream
+    std::string flush();
+    void reset();
+
+private:
+    const SpTokenizer& tokenizer_;
+    Utf8StreamBuffer buffer_;
+    std::string scratch_;
+    bool at_start_ = true;
+};
@@ -0,0 +1,354 @@
+#include <jni.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "context_compression.h"
+#include "jni_cache.h"
+#include "jni_strings.h"
+#include "native_log.h"
+#include "ocr_text.h"
+#include "shared_pool.h"
+#include "sp_tokenizer.h"
+
+#define LOGI(...) NLOGI("SP_TOKENIZER_JNI", __VA_ARGS__)
+#define LOGE(...) NLOGE("SP_TOKENIZER_JNI", __VA_ARGS__)
+
+// Loaded once per process and shared by every NativeTokenizer instance
+static std::mutex g_tokenizer_mutex;
+static std::shared_ptr<const SpTokenizer> g_tokenizer;
+
+// setMemoBytes(), applied to every tokenizer loaded after it too
+static size_t g_memo_bytes = TokenMemo::kDefaultMaxBytes;
+
+static std::shared_ptr<const SpTokenizer> current_tokenizer() {
+    std::lock_guard<std::mutex> lock(g_tokenizer_mutex);
+    return g_tokenizer;
+}
+
+// Text crosses JNI as UTF-8 bytes; GetStringUTFChars would hand us modified UTF-8
+static std::string utf8_from_bytes(JNIEnv* env, jbyteArray bytes) {
+    jsize len = env->GetArrayLength(bytes);
+    std::string text(static_cast<size_t>(len), '\0');
+    if (len > 0) {
+        env->GetByteArrayRegion(bytes, 0, len, reinterpret_cast<jbyte*>(&text[0]));
+    }
+    return text;
+}
+
+// Batches smaller than this (in UTF-8 bytes) are tokenized on the calling thread
+static const size_t kParallelBatchBytes = 32 * 1024;
+
+// Read a String[] as UTF-8 in one pass over the array
+static std::vector<std::string> utf8_from_string_array(JNIEnv* env, jobjectArray jTexts, size_t* total_bytes) {
+    jsize count = env->GetArrayLength(jTexts);
+    std::vector<std::string> texts(static_cast<size_t>(count));
+    *total_bytes = 0;
+    for (jsize i = 0; i < count; ++i) {
+        jstring jText = static_cast<jstring>(env->GetObjectArrayElement(jTexts, i));
+        if (jText == nullptr) {
+            continue;
+        }
+        jni_utf8_into(env, jText, texts[i]);
+        *total_bytes += texts[i].size();
+        env->DeleteLocalRef(jText);
+    }
+    return texts;
+}
+
+// Run fn(i) for every text, one pool task each when the batch is large, so
+// whichever thread is free takes the next text
+template <typename Fn>
+static void for_each_text(size_t count, size_t total_bytes, Fn&& fn) {
+    if (total_bytes < kParallelBatchBytes || count < 2) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    shared_pool::pool().parallel_for(0, static_cast<int64_t>(count), [&](int64_t i) { fn(static_cast<size_t>(i)); },
+                                     static_cast<int>(count));
+}
+
+extern "C" {
+
+// Built into libmlc_llm_jni.so, whose JNI_OnLoad (real_mlc_llm_jni.cpp) pins the JNI cache
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_loadModel(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring jPath) {
+    
+    const char* path_cstr = env->GetStringUTFChars(jPath, nullptr);
+    std::string path(path_cstr);
+    env->ReleaseStringUTFChars(jPath, path_cstr);
+    
+    std::lock_guard<std::mutex> lock(g_tokenizer_mutex);
+    if (g_tokenizer && g_tokenizer->path() == path) {
+        return JNI_TRUE;
+    }
+    
+    auto tokenizer = std::make_shared<SpTokenizer>();
+    if (!tokenizer->load(path)) {
+        LOGE("Failed to load tokenizer from %s", path.c_str());
+        return JNI_FALSE;
+    }
+    tokenizer->memo().set_max_bytes(g_memo_bytes);
+    g_tokenizer = tokenizer;
+    return JNI_TRUE;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_nativeEncode(
+        JNIEnv* env,
+        jobject /* this */,
+        jbyteArray jText) {
+    
+    std::vector<int> ids;
+    if (auto tokenizer = current_tokenizer()) {
+        ids = tokenizer->encode_parallel(utf8_from_bytes(env, jText),
+                                         static_cast<size_t>(shared_pool::pool().concurrency()));
+    }
+    
+    jintArray result = env->NewIntArray(static_cast<jsize>(ids.size()));
+    if (result != nullptr && !ids.empty()) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(ids.size()), reinterpret_cast<const jint*>(ids.data()));
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_nativeCount(
+        JNIEnv* env,
+        jobject /* this */,
+        jbyteArray jText) {
+    
+    auto tokenizer = current_tokenizer();
+    if (!tokenizer) {
+        return -1;
+    }
+    return static_cast<jint>(tokenizer->count(utf8_from_bytes(env, jText)));
+}
+
+JNIEXPORT jbyteArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_nativeDecode(
+        JNIEnv* env,
+        jobject /* this */,
+        jintArray jIds) {
+    
+    std::string text;
+    if (auto tokenizer = current_tokenizer()) {
+        jsize len = env->GetArrayLength(jIds);
+        std::vector<int> ids(static_cast<size_t>(len));
+        if (len > 0) {
+            env->GetIntArrayRegion(jIds, 0, len, reinterpret_cast<jint*>(ids.data()));
+        }
+        text = tokenizer->decode(ids);
+    }
+    
+    jbyteArray result = env->NewByteArray(static_cast<jsize>(text.size()));
+    if (result != nullptr && !text.empty()) {
+        env->SetByteArrayRegion(result, 0, static_cast<jsize>(text.size()), reinterpret_cast<const jbyte*>(text.data()));
+    }
+    return result;
+}
+
+// Tokenize every text in one crossing. Ids come back concatenated; offsets
+// (length texts.size + 1) is filled with the start of each text's ids.
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_nativeEncodeBatch(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jTexts,
+        jintArray jOffsets) {
+    
+    size_t total_bytes = 0;
+    std::vector<std::string> texts = utf8_from_string_array(env, jTexts, &total_bytes);
+    std::vector<std::vector<int>> ids(texts.size());
+    if (auto tokenizer = current_tokenizer()) {
+        for_each_text(texts.size(), total_bytes, [&](size_t i) {
+            ids[i] = tokenizer->encode(texts[i]);
+        });
+    }
+    
+    std::vector<jint> offsets(texts.size() + 1, 0);
+    for (size_t i = 0; i < texts.size(); ++i) {
+        offsets[i + 1] = offsets[i] + static_cast<jint>(ids[i].size());
+    }
+    if (env->GetArrayLength(jOffsets) >= static_cast<jsize>(offsets.size())) {
+        env->SetIntArrayRegion(jOffsets, 0, static_cast<jsize>(offsets.size()), offsets.data());
+    } else {
+        LOGE("Offsets array too small for %zu texts", texts.size());
+    }
+    
+    jintArray result = env->NewIntArray(offsets.back());
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (!ids[i].empty()) {
+            env->SetIntArrayRegion(result, offsets[i], static_cast<jsize>(ids[i].size()),
+                                   reinterpret_cast<const jint*>(ids[i].data()));
+        }
+    }
+    return result;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_countTokensBatch(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jTexts) {
+    
+    size_t total_bytes = 0;
+    std::vector<std::string> texts = utf8_from_string_array(env, jTexts, &total_bytes);
+    std::vector<jint> counts(texts.size(), -1);
+    if (auto tokenizer = current_tokenizer()) {
+        for_each_text(texts.size(), total_bytes, [&](size_t i) {
+            counts[i] = static_cast<jint>(tokenizer->count(texts[i]));
+        });
+    }
+    
+    jintArray result = env->NewIntArray(static_cast<jsize>(counts.size()));
+    if (result != nullptr && !counts.empty()) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(counts.size()), counts.data());
+    }
+    return result;
+}
+
+// OCR pages as one normalized text (ocr_text.h). stats (kOcrStatCount ints) gets
+// the tokens in and out, -1 without a model, then the ocr_text::Stats counts.
+static const jsize kOcrStatCount = 8;
+
+JNIEXPORT jbyteArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_nativeNormalizeOcr(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray jPages,
+        jintArray jStats) {
+    
+    size_t total_bytes = 0;
+    std::vector<std::string> pages = utf8_from_string_array(env, jPages, &total_bytes);
+    ocr_text::Stats stats;
+    std::string text = ocr_text::normalize_pages(pages, &stats);
+    
+    jint tokens_in = -1;
+    jint tokens_out = -1;
+    if (auto tokenizer = current_tokenizer()) {
+        std::vector<size_t> counts(pages.size(), 0);
+        for_each_text(pages.size(), total_bytes, [&](size_t i) {
+            counts[i] = tokenizer->count(pages[i]);
+        });
+        tokens_in = 0;
+        for (size_t count : counts) {
+            tokens_in += static_cast<jint>(count);
+        }
+        tokens_out = static_cast<jint>(tokenizer->count(text));
+    }
+    if (jStats != nullptr && env->GetArrayLength(jStats) >= kOcrStatCount) {
+        jint values[kOcrStatCount] = {
+            tokens_in,
+            tokens_out,
+            static_cast<jint>(stats.bytes_in),
+            static_cast<jint>(stats.bytes_out),
+            stats.dehyphenated,
+            stats.lines_joined,
+            stats.boilerplate,
+            stats.page_numbers,
+        };
+        env->SetIntArrayRegion(jStats, 0, kOcrStatCount, values);
+    }
+    if (tokens_in >= 0) {
+        LOGI("Normalized %zu OCR pages: %zu -> %zu bytes, %d -> %d tokens", pages.size(), stats.bytes_in,
+             stats.bytes_out, tokens_in, tokens_out);
+    }
+    
+    jbyteArray result = env->NewByteArray(static_cast<jsize>(text.size()));
+    if (result != nullptr && !text.empty()) {
+        env->SetByteArrayRegion(result, 0, static_cast<jsize>(text.size()), reinterpret_cast<const jbyte*>(text.data()));
+    }
+    return result;
+}
+
+// `text` thinned to `ratio` of its tokens (context_compression.h); stats (3
+// ints) gets the tokens in and out and the words dropped
+JNIEXPORT jbyteArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_nativeCompress(
+        JNIEnv* env,
+        jobject /* this */,
+        jbyteArray jText,
+        jfloat ratio,
+        jintArray jStats) {
+    
+    std::vector<std::string> texts{utf8_from_bytes(env, jText)};
+    context_compression::Result compressed;
+    if (auto tokenizer = current_tokenizer()) {
+        texts = context_compression::compress(texts, ratio, *tokenizer, &compressed);
+    }
+    if (jStats != nullptr && env->GetArrayLength(jStats) >= 3) {
+        jint values[3] = {
+            static_cast<jint>(compressed.tokens_in),
+            static_cast<jint>(compressed.tokens_out),
+            static_cast<jint>(compressed.words_dropped),
+        };
+        env->SetIntArrayRegion(jStats, 0, 3, values);
+    }
+    
+    const std::string& text = texts[0];
+    jbyteArray result = env->NewByteArray(static_cast<jsize>(text.size()));
+    if (result != nullptr && !text.empty()) {
+        env->SetByteArrayRegion(result, 0, static_cast<jsize>(text.size()), reinterpret_cast<const jbyte*>(text.data()));
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_vocabSize(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    auto tokenizer = current_tokenizer();
+    return tokenizer ? static_cast<jint>(tokenizer->vocab_size()) : 0;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_setMemoBytes(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong bytes) {
+    
+    std::lock_guard<std::mutex> lock(g_tokenizer_mutex);
+    g_memo_bytes = static_cast<size_t>(std::max<jlong>(0, bytes));
+    if (g_tokenizer) {
+        g_tokenizer->memo().set_max_bytes(g_memo_bytes);
+    }
+}
+
+// {hits, misses, entries, bytes}
+JNIEXPORT jlongArray JNICALL
+Java_com_example_studybuddy_ml_NativeTokenizer_getMemoStats(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    TokenMemo::Stats stats;
+    if (auto tokenizer = current_tokenizer()) {
+        stats = tokenizer->memo().stats();
+    }
+    jlong values[4] = {
+        static_cast<jlong>(stats.hits),
+        static_cast<jlong>(stats.misses),
+        static_cast<jlong>(stats.entries),
+        static_cast<jlong>(stats.bytes),
+    };
+    jlongArray result = env->NewLongArray(4);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+}
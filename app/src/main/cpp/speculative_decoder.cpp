@@ -0,0 +1,332 @@
+#include "speculative_decoder.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <tvm/runtime/container/shape_tuple.h>
+
+#include "native_log.h"
+
+#define LOGI(...) NLOGI("SPECULATIVE", __VA_ARGS__)
+#define LOGE(...) NLOGE("SPECULATIVE", __VA_ARGS__)
+
+using tvm::runtime::PackedFunc;
+using tvm::runtime::ShapeTuple;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+}  // namespace
+
+bool SpeculativeDecoder::resolve_target(tvm::runtime::Module target) {
+    target_prefill_ = target.GetFunction("prefill");
+    target_verify_ = target.GetFunction("verify_draft");
+    target_get_message_ = target.GetFunction("get_message");
+    target_stopped_ = target.GetFunction("stopped");
+    return target_prefill_ != nullptr && target_verify_ != nullptr &&
+           target_get_message_ != nullptr && target_stopped_ != nullptr;
+}
+
+void SpeculativeDecoder::resolve_self_draft(tvm::runtime::Module target) {
+    target_self_draft_ = target.GetFunction("self_draft");
+    PackedFunc layers = target.GetFunction("self_draft_layers");
+    layers_ = 0;
+    exit_head_layer_ = 0;
+    if (target_self_draft_ != nullptr && layers != nullptr) {
+        ShapeTuple info = layers();
+        if (info.size() >= 2) {
+            layers_ = static_cast<int>(info[0]);
+            exit_head_layer_ = info[1] > 0 && info[1] < info[0] ? static_cast<int>(info[1]) : 0;
+        }
+    }
+    self_ready_ = target_self_draft_ != nullptr && layers_ > 1;
+    if (self_ready_) {
+        LOGI("Self-speculation available: %d layers, exit head %s", layers_,
+             exit_head_layer_ > 0 ? std::to_string(exit_head_layer_).c_str() : "none");
+    }
+}
+
+bool SpeculativeDecoder::attach(tvm::runtime::Module target, tvm::runtime::Module draft) {
+    detach();
+
+    bool target_ok = resolve_target(target);
+    draft_prefill_ = draft.GetFunction("prefill");
+    draft_propose_ = draft.GetFunction("draft_propose");
+    draft_rollback_ = draft.GetFunction("rollback_tokens");
+    draft_append_ = draft.GetFunction("append_tokens");
+    draft_reset_ = draft.GetFunction("reset_chat");
+
+    if (!target_ok || draft_prefill_ == nullptr || draft_propose_ == nullptr ||
+        draft_rollback_ == nullptr || draft_append_ == nullptr || draft_reset_ == nullptr) {
+        LOGI("Speculative decoding unavailable: missing token-level entry points");
+        detach();
+        return false;
+    }
+
+    target_ = target;
+    draft_ = draft;
+    ready_ = true;
+    lookup_ready_ = true;
+    resolve_self_draft(target);
+    LOGI("Speculative decoding enabled with draft length %d", draft_length_);
+    return true;
+}
+
+bool SpeculativeDecoder::attach_lookup(tvm::runtime::Module target) {
+    if (lookup_ready_) {
+        return true;
+    }
+    if (!resolve_target(target)) {
+        LOGI("Prompt lookup unavailable: target has no verify_draft");
+        detach();
+        return false;
+    }
+    target_ = target;
+    lookup_ready_ = true;
+    resolve_self_draft(target);
+    LOGI("Prompt lookup decoding available");
+    return true;
+}
+
+void SpeculativeDecoder::detach() {
+    target_prefill_ = PackedFunc(nullptr);
+    target_verify_ = PackedFunc(nullptr);
+    target_get_message_ = PackedFunc(nullptr);
+    target_stopped_ = PackedFunc(nullptr);
+    target_self_draft_ = PackedFunc(nullptr);
+    draft_prefill_ = PackedFunc(nullptr);
+    draft_propose_ = PackedFunc(nullptr);
+    draft_rollback_ = PackedFunc(nullptr);
+    draft_append_ = PackedFunc(nullptr);
+    draft_reset_ = PackedFunc(nullptr);
+    target_ = tvm::runtime::Module(nullptr);
+    draft_ = tvm::runtime::Module(nullptr);
+    ready_ = false;
+    lookup_ready_ = false;
+    self_ready_ = false;
+    layers_ = 0;
+    exit_head_layer_ = 0;
+}
+
+void SpeculativeDecoder::set_draft_length(int k) {
+    draft_length_ = std::max(1, std::min(k, kMaxDraftLength));
+}
+
+void SpeculativeDecoder::set_adaptive_ceiling(int k) {
+    adaptive_ceiling_ = std::max(1, std::min(k, kMaxDraftLength));
+}
+
+void SpeculativeDecoder::forget_session(int64_t session) {
+    for (DraftController& controller : controllers_) {
+        controller.forget(session);
+    }
+}
+
+std::string SpeculativeDecoder::controller_json() const {
+    return std::string("{\"adaptive\": ") + (adaptive_ ? "true" : "false") +
+           ", \"ceiling\": " + std::to_string(adaptive_ceiling_) +
+           ", \"draft\": " + controllers_[kMethodDraft].to_json() +
+           ", \"self\": " + controllers_[kMethodSelf].to_json() +
+           ", \"lookup\": " + controllers_[kMethodLookup].to_json() + "}";
+}
+
+void SpeculativeDecoder::reset_controllers() {
+    for (DraftController& controller : controllers_) {
+        controller.reset();
+    }
+}
+
+int SpeculativeDecoder::round_length(int method, int room) {
+    int k = adaptive_ ? controllers_[method].next(session_, task_, adaptive_ceiling_) : draft_length_;
+    return std::max(0, std::min(k, room));
+}
+
+void SpeculativeDecoder::set_exit_layer(int layer) {
+    exit_layer_ = std::max(0, layer);
+}
+
+int SpeculativeDecoder::exit_layer() const {
+    if (layers_ <= 1) {
+        return 0;
+    }
+    int layer = exit_layer_ > 0 ? exit_layer_ : exit_head_layer_ > 0 ? exit_head_layer_ : layers_ / 2;
+    return std::min(layer, layers_ - 1);
+}
+
+void SpeculativeDecoder::reset() {
+    if (ready_) {
+        draft_reset_();
+    }
+}
+
+bool SpeculativeDecoder::generate(const std::string& prompt, int max_tokens,
+                                  const std::function<void(const std::string&)>& emit,
+                                  const std::atomic<bool>* cancelled) {
+    if (!ready_) {
+        return false;
+    }
+
+    try {
+        target_prefill_(prompt);
+        draft_prefill_(prompt);
+
+        std::string emitted_text;
+        int produced = 0;
+        while (produced < max_tokens && !static_cast<bool>(target_stopped_())) {
+            if (cancelled != nullptr && cancelled->load(std::memory_order_relaxed)) {
+                break;
+            }
+
+            // k 0 is a plain decode step; the draft only takes the target's token
+            int k = round_length(kMethodDraft, max_tokens - produced);
+
+            auto draft_start = Clock::now();
+            ShapeTuple proposal = k > 0 ? static_cast<ShapeTuple>(draft_propose_(k)) : ShapeTuple();
+            double draft_ms = elapsed_ms(draft_start);
+            stats_.draft_ms += draft_ms;
+
+            auto verify_start = Clock::now();
+            ShapeTuple verdict = target_verify_(proposal);
+            double verify_ms = elapsed_ms(verify_start);
+            stats_.verify_ms += verify_ms;
+            if (verdict.size() < 2) {
+                LOGE("verify_draft returned %zu values, expected 2", verdict.size());
+                return false;
+            }
+
+            int64_t accepted = std::max<int64_t>(0, std::min<int64_t>(verdict[0], proposal.size()));
+            int64_t next_token = verdict[1];
+
+            // Bring the draft back in line with what the target kept
+            if (accepted < static_cast<int64_t>(proposal.size())) {
+                draft_rollback_(static_cast<int>(proposal.size() - accepted));
+            }
+            draft_append_(ShapeTuple({next_token}));
+            controllers_[kMethodDraft].observe(session_, task_, static_cast<int>(proposal.size()),
+                                               static_cast<int>(accepted), draft_ms, verify_ms);
+
+            stats_.rounds++;
+            stats_.proposed += proposal.size();
+            stats_.accepted += accepted;
+            stats_.emitted += accepted + 1;
+            produced += static_cast<int>(accepted + 1);
+
+            emit_message(emitted_text, emit);
+        }
+
+        LOGI("Speculative stats: acceptance %.2f, %.2f tokens per target pass",
+             stats_.acceptance_rate(), stats_.tokens_per_target_pass());
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("Speculative generation failed: %s", e.what());
+        return false;
+    }
+}
+
+bool SpeculativeDecoder::generate_lookup(const std::string& prompt, const std::vector<int>& prompt_tokens,
+                                         int max_tokens, const std::function<void(const std::string&)>& emit,
+                                         const std::atomic<bool>* cancelled) {
+    if (!lookup_ready_) {
+        return false;
+    }
+    lookup_.reset(prompt_tokens);
+    return generate_proposed(
+            "Prompt lookup", kMethodLookup, prompt, max_tokens, [this](int k) { return lookup_.propose(k); },
+            [this](const std::vector<int64_t>& tokens, int64_t accepted, int64_t next_token) {
+                for (int64_t i = 0; i < accepted; ++i) {
+                    lookup_.push(static_cast<int>(tokens[i]));
+                }
+                lookup_.push(static_cast<int>(next_token));
+            },
+            lookup_stats_, emit, cancelled);
+}
+
+bool SpeculativeDecoder::generate_self(const std::string& prompt, int max_tokens,
+                                       const std::function<void(const std::string&)>& emit,
+                                       const std::atomic<bool>* cancelled) {
+    if (!self_ready_) {
+        return false;
+    }
+    int exit = exit_layer();
+    return generate_proposed(
+            "Self-speculation", kMethodSelf, prompt, max_tokens,
+            [this, exit](int k) {
+                if (k <= 0) {
+                    return std::vector<int64_t>();
+                }
+                ShapeTuple proposal = target_self_draft_(k, exit);
+                return std::vector<int64_t>(proposal.begin(), proposal.end());
+            },
+            [](const std::vector<int64_t>&, int64_t, int64_t) {}, self_stats_, emit, cancelled);
+}
+
+bool SpeculativeDecoder::generate_proposed(
+        const char* label, int method, const std::string& prompt, int max_tokens,
+        const std::function<std::vector<int64_t>(int k)>& propose,
+        const std::function<void(const std::vector<int64_t>&, int64_t accepted, int64_t next)>& kept,
+        SpeculativeStats& stats, const std::function<void(const std::string&)>& emit,
+        const std::atomic<bool>* cancelled) {
+    try {
+        target_prefill_(prompt);
+
+        std::string emitted_text;
+        int produced = 0;
+        while (produced < max_tokens && !static_cast<bool>(target_stopped_())) {
+            if (cancelled != nullptr && cancelled->load(std::memory_order_relaxed)) {
+                break;
+            }
+
+            auto draft_start = Clock::now();
+            std::vector<int64_t> tokens = propose(round_length(method, max_tokens - produced - 1));
+            double draft_ms = elapsed_ms(draft_start);
+            stats.draft_ms += draft_ms;
+
+            auto verify_start = Clock::now();
+            ShapeTuple verdict = target_verify_(ShapeTuple(tokens.begin(), tokens.end()));
+            double verify_ms = elapsed_ms(verify_start);
+            stats.verify_ms += verify_ms;
+            if (verdict.size() < 2) {
+                LOGE("verify_draft returned %zu values, expected 2", verdict.size());
+                return false;
+            }
+
+            int64_t accepted = std::max<int64_t>(0, std::min<int64_t>(verdict[0], tokens.size()));
+            kept(tokens, accepted, verdict[1]);
+            controllers_[method].observe(session_, task_, static_cast<int>(tokens.size()),
+                                         static_cast<int>(accepted), draft_ms, verify_ms);
+
+            stats.rounds++;
+            stats.proposed += tokens.size();
+            stats.accepted += accepted;
+            stats.emitted += accepted + 1;
+            produced += static_cast<int>(accepted + 1);
+
+            emit_message(emitted_text, emit);
+        }
+
+        LOGI("%s stats: acceptance %.2f, %.2f tokens per target pass", label, stats.acceptance_rate(),
+             stats.tokens_per_target_pass());
+        return true;
+    } catch (const std::exception& e) {
+        LOGE("%s generation failed: %s", label, e.what());
+        return false;
+    }
+}
+
+void SpeculativeDecoder::emit_message(std::string& emitted_text,
+                                      const std::function<void(const std::string&)>& emit) {
+    std::string message = target_get_message_();
+    if (message.size() > emitted_text.size() &&
+        message.compare(0, emitted_text.size(), emitted_text) == 0) {
+        emit(message.substr(emitted_text.size()));
+        emitted_text = message;
+    } else if (message != emitted_text) {
+        // The detokenized message was rewritten (e.g. a merged byte sequence)
+        emitted_text = message;
+    }
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "draft_controller.h"
+#include "prompt_lookup.h"
+
+#include <tvm/runtime/module.h>
+#include <tvm/runtime/packed_func.h>
+
+/**
+ * Draft/verify speculative decoding over two chat modules.
+ *
+ * The small draft model proposes k tokens and the target model scores all of
+ * them in one batched forward pass, so a bandwidth-bound target emits several
+ * tokens per weight read. The target model always makes the final decision, so
+ * if the draft's history drifts behind the target's, only the acceptance rate
+ * drops.
+ *
+ * Token-level entry points required on top of the usual chat module API:
+ *   draft:  draft_propose(k) -> ShapeTuple   k greedy tokens, kept in its history
+ *           rollback_tokens(n)               drop the last n history tokens
+ *           append_tokens(ShapeTuple)        forward tokens into its history
+ *   target: verify_draft(ShapeTuple) -> ShapeTuple {accepted, next_token}
+ *           accepts a prefix of the draft plus one token of its own
+ *
+ * Without a draft model the same verification runs on proposals copied from
+ * the prompt (PromptLookup); an empty proposal makes it a plain decode step.
+ *
+ * Or the target drafts for itself (self-speculation), for devices with no
+ * memory to spare for a draft model, when it exports:
+ *   self_draft(k, exit_layer) -> ShapeTuple   k greedy tokens through the first exit_layer
+ *                                             layers and the exit head (the final norm and
+ *                                             LM head when it has none); the history stays
+ *                                             put and the early layers' KV of the drafted
+ *                                             positions is kept for verify_draft to reuse
+ *   self_draft_layers() -> ShapeTuple         [layers, layer of a trained exit head or 0]
+ * It reads the same weights and writes the same KV as plain decoding, so it
+ * costs no resident memory; the exit layer trades draft speed for acceptance.
+ *
+ * The proposal length is draft_length every round, or with adaptive length on
+ * whatever the method's DraftController picks for the current session and task
+ * type, up to the adaptive ceiling. The controllers observe every round either
+ * way, so their metrics show what the fixed length is getting.
+ */
+struct SpeculativeStats {
+    uint64_t rounds = 0;     // target verification passes
+    uint64_t proposed = 0;   // draft tokens offered
+    uint64_t accepted = 0;   // draft tokens kept by the target
+    uint64_t emitted = 0;    // tokens produced (accepted + one per round)
+    double draft_ms = 0.0;
+    double verify_ms = 0.0;
+
+    float acceptance_rate() const {
+        return proposed == 0 ? 0.0f : static_cast<float>(accepted) / proposed;
+    }
+    // Tokens per target forward pass; plain decoding is always 1.0
+    float tokens_per_target_pass() const {
+        return rounds == 0 ? 0.0f : static_cast<float>(emitted) / rounds;
+    }
+    float tokens_per_second() const {
+        double ms = draft_ms + verify_ms;
+        return ms <= 0.0 ? 0.0f : static_cast<float>(emitted * 1000.0 / ms);
+    }
+};
+
+class SpeculativeDecoder {
+public:
+    static constexpr int kDefaultDraftLength = 4;
+    static constexpr int kMaxDraftLength = DraftController::kMaxLength;
+
+    enum Method : int { kMethodDraft = 0, kMethodSelf = 1, kMethodLookup = 2 };
+    static constexpr int kMethods = 3;
+
+    // Resolve the token-level entry points. Returns false if either module lacks them.
+    bool attach(tvm::runtime::Module target, tvm::runtime::Module draft);
+    // Prompt lookup only needs the target's entry points; attach() implies it.
+    // Self-speculation is resolved with them when the target has self_draft.
+    bool attach_lookup(tvm::runtime::Module target);
+    void detach();
+    bool ready() const { return ready_; }
+    bool lookup_ready() const { return lookup_ready_; }
+    bool self_ready() const { return self_ready_; }
+
+    // Layers the target drafts through; 0 picks its exit head, else half the stack
+    void set_exit_layer(int layer);
+    int exit_layer() const;
+    int layers() const { return layers_; }
+
+    void set_draft_length(int k);
+    int draft_length() const { return draft_length_; }
+
+    // Adaptive proposal length, up to `ceiling` tokens a round
+    void set_adaptive(bool enabled) { adaptive_ = enabled; }
+    bool adaptive() const { return adaptive_; }
+    void set_adaptive_ceiling(int k);
+    int adaptive_ceiling() const { return adaptive_ceiling_; }
+    // The session and task type the next generation runs for
+    void set_context(int64_t session, int task) {
+        session_ = session;
+        task_ = task;
+    }
+    void forget_session(int64_t session);
+    // {"adaptive", "ceiling", "draft": {...}, "self": {...}, "lookup": {...}}, see DraftController::to_json
+    std::string controller_json() const;
+    void reset_controllers();
+
+    // Prefill `prompt` on both models and stream text deltas until the target stops
+    bool generate(const std::string& prompt, int max_tokens,
+                  const std::function<void(const std::string&)>& emit,
+                  const std::atomic<bool>* cancelled = nullptr);
+    // Same, proposing continuations of `prompt_tokens` (the prompt as the target tokenizes it)
+    bool generate_lookup(const std::string& prompt, const std::vector<int>& prompt_tokens, int max_tokens,
+                         const std::function<void(const std::string&)>& emit,
+                         const std::atomic<bool>* cancelled = nullptr);
+    // Same, drafting with the target's own early layers
+    bool generate_self(const std::string& prompt, int max_tokens,
+                       const std::function<void(const std::string&)>& emit,
+                       const std::atomic<bool>* cancelled = nullptr);
+
+    // Start the draft from an empty conversation, mirroring a target reset
+    void reset();
+
+    SpeculativeStats stats() const { return stats_; }
+    // draft_ms counts the n-gram lookups
+    SpeculativeStats lookup_stats() const { return lookup_stats_; }
+    SpeculativeStats self_stats() const { return self_stats_; }
+    void reset_stats() {
+        stats_ = SpeculativeStats();
+        lookup_stats_ = SpeculativeStats();
+        self_stats_ = SpeculativeStats();
+    }
+
+private:
+    tvm::runtime::Module target_{nullptr};
+    tvm::runtime::Module draft_{nullptr};
+
+    tvm::runtime::PackedFunc target_prefill_{nullptr};
+    tvm::runtime::PackedFunc target_verify_{nullptr};
+    tvm::runtime::PackedFunc target_get_message_{nullptr};
+    tvm::runtime::PackedFunc target_stopped_{nullptr};
+    tvm::runtime::PackedFunc target_self_draft_{nullptr};
+
+    tvm::runtime::PackedFunc draft_prefill_{nullptr};
+    tvm::runtime::PackedFunc draft_propose_{nullptr};
+    tvm::runtime::PackedFunc draft_rollback_{nullptr};
+    tvm::runtime::PackedFunc draft_append_{nullptr};
+    tvm::runtime::PackedFunc draft_reset_{nullptr};
+
+    bool ready_ = false;
+    bool lookup_ready_ = false;
+    bool self_ready_ = false;
+    int draft_length_ = kDefaultDraftLength;
+    int layers_ = 0;
+    int exit_head_layer_ = 0;  // 0: the module has no trained exit head
+    int exit_layer_ = 0;       // requested; 0 for the default
+    bool adaptive_ = false;
+    int adaptive_ceiling_ = DraftController::kDefaultCeiling;
+    int64_t session_ = 0;
+    int task_ = kTaskChat;
+    DraftController controllers_[kMethods];
+    SpeculativeStats stats_;
+    SpeculativeStats lookup_stats_;
+    SpeculativeStats self_stats_;
+    PromptLookup lookup_;
+
+    bool resolve_target(tvm::runtime::Module target);
+    void resolve_self_draft(tvm::runtime::Module target);
+    // Tokens to propose this round, `room` at most
+    int round_length(int method, int room);
+    // The proposal loop shared by prompt lookup and self-speculation
+    bool generate_proposed(const char* label, int method, const std::string& prompt, int max_tokens,
+                           const std::function<std::vector<int64_t>(int k)>& propose,
+                           const std::function<void(const std::vector<int64_t>&, int64_t accepted, int64_t next)>& kept,
+                           SpeculativeStats& stats, const std::function<void(const std::string&)>& emit,
+                           const std::atomic<bool>* cancelled);
+    void emit_message(std::string& emitted_text, const std::function<void(const std::string&)>& emit);
+};
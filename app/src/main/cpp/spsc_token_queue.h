@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Lock-free single-producer/single-consumer token queue.
+ *
+ * Tokens are copied into fixed-size slots of a power-of-two ring; a token longer
+ * than one slot spans consecutive slots and is published with a single head
+ * store, so the consumer only ever sees whole tokens. Neither side takes a lock:
+ * the producer only pays a futex wake when the consumer is actually parked.
+ *
+ * The producer never blocks. When the consumer has fallen a full ring behind,
+ * tokens wait in a producer-private overflow list and are flushed on the next
+ * push, so a slow UI never stalls a decode step.
+ */
+class SpscTokenQueue {
+public:
+    explicit SpscTokenQueue(size_t requested_slots = 1024) {
+        slot_count_ = 64;
+        while (slot_count_ < requested_slots && slot_count_ < (1u << 16)) {
+            slot_count_ <<= 1;
+        }
+        slots_.reset(new Slot[slot_count_]);
+    }
+
+    SpscTokenQueue(const SpscTokenQueue&) = delete;
+    SpscTokenQueue& operator=(const SpscTokenQueue&) = delete;
+
+    // Producer: queue one token
+    void push(const std::string& token) {
+        if (token.empty()) {
+            return;
+        }
+        if (!overflow_.empty()) {
+            flush_overflow();
+        }
+        if (!overflow_.empty() || !try_write(token)) {
+            overflow_.push_back(token);
+        }
+    }
+
+    // Producer: end the stream. Anything still in overflow is handed over first;
+    // this is the only place the producer may wait, and only after generation is done.
+    void finish() {
+        while (!overflow_.empty()) {
+            flush_overflow();
+            if (!overflow_.empty()) {
+                std::this_thread::yield();
+            }
+        }
+        done_.store(true, std::memory_order_release);
+        wake();
+    }
+
+    // Consumer: take the next token, parking until one arrives.
+    // Returns false once the stream finished and everything was delivered.
+    bool pop(std::string& token) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        while (head == tail) {
+            if (done_.load(std::memory_order_acquire)) {
+                // done_ is stored after the last head store, so re-check once
+                head = head_.load(std::memory_order_acquire);
+                if (head == tail) {
+                    return false;
+                }
+                break;
+            }
+            park();
+            head = head_.load(std::memory_order_acquire);
+        }
+
+        token.clear();
+        while (true) {
+            const Slot& slot = slots_[tail & (slot_count_ - 1)];
+            token.append(slot.bytes, slot.len);
+            ++tail;
+            if (!slot.more) {
+                break;
+            }
+        }
+        tail_.store(tail, std::memory_order_release);
+        return true;
+    }
+
+    // Prepare for a new stream. Only call while neither side is running.
+    void reset() {
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        overflow_.clear();
+        parked_.store(0, std::memory_order_relaxed);
+        done_.store(false, std::memory_order_release);
+    }
+
+private:
+    static constexpr size_t kSlotBytes = 61;
+
+    struct alignas(64) Slot {
+        uint16_t len;
+        uint8_t more;  // token continues in the next slot
+        char bytes[kSlotBytes];
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t slot_count_ = 0;
+    std::deque<std::string> overflow_;  // producer-only
+
+    // Producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<uint32_t> head_{0};
+    alignas(64) std::atomic<uint32_t> tail_{0};
+    alignas(64) std::atomic<uint32_t> parked_{0};  // futex word: 1 while the consumer sleeps
+    std::atomic<bool> done_{false};
+
+    // Copy a whole token into the ring, or leave the ring untouched if it does not fit
+    bool try_write(const std::string& token) {
+        size_t len = std::min(token.size(), kSlotBytes * slot_count_);
+        size_t needed = (len + kSlotBytes - 1) / kSlotBytes;
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (slot_count_ - (head - tail_.load(std::memory_order_acquire)) < needed) {
+            return false;
+        }
+
+        size_t offset = 0;
+        for (size_t i = 0; i < needed; ++i) {
+            Slot& slot = slots_[(head + i) & (slot_count_ - 1)];
+            size_t chunk = std::min(kSlotBytes, len - offset);
+            memcpy(slot.bytes, token.data() + offset, chunk);
+            slot.len = static_cast<uint16_t>(chunk);
+            slot.more = (i + 1 < needed) ? 1 : 0;
+            offset += chunk;
+        }
+        head_.store(head + static_cast<uint32_t>(needed), std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    void flush_overflow() {
+        while (!overflow_.empty() && try_write(overflow_.front())) {
+            overflow_.pop_front();
+        }
+    }
+
+    void park() {
+        parked_.store(1, std::memory_order_seq_cst);
+        // Re-check after announcing ourselves so a publish in between is not missed
+        if (head_.load(std::memory_order_seq_cst) != tail_.load(std::memory_order_relaxed) ||
+            done_.load(std::memory_order_seq_cst)) {
+            parked_.store(0, std::memory_order_relaxed);
+            return;
+        }
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&parked_), FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+        while (parked_.load(std::memory_order_acquire) == 1) {
+            std::this_thread::yield();
+        }
+#endif
+        parked_.store(0, std::memory_order_relaxed);
+    }
+
+    // Only enter the kernel when the consumer is actually parked
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        if (parked_.exchange(0, std::memory_order_seq_cst) == 1) {
+#if defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&parked_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+        }
+    }
+};
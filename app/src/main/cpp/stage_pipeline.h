@@ -0,0 +1,512 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Stages of a flow run concurrently, each on its own workers, with bounded
+ * lock-free queues between them.
+ *
+ * Page by page, the study flow is OCR text -> normalize -> retrieve ->
+ * generate. Run as separate calls from Kotlin, every page waits for the whole
+ * chain and every stage waits for the one before it on every page, so a
+ * chapter takes the sum of the stages. Here page N+1 is normalized and
+ * retrieved for while page N generates, and the chapter takes about as long
+ * as its slowest stage.
+ *
+ * Each stage has a worker pool of its own size and reads a bounded MPMC ring
+ * (Vyukov's sequence-numbered cells, no locks on the hot path). A worker that
+ * finds the next ring full waits for room, so a slow stage holds back the ones
+ * before it, and push() blocks the producer itself once the first ring is
+ * full: memory stays bounded at queue_depth items per stage. Waiting parks on
+ * a futex and costs the other side a syscall only while someone is parked.
+ *
+ * Cancellation reaches every stage: an item whose `cancelled` predicate turns
+ * true, or any item in flight when cancel_all() is called, skips the stages it
+ * has not run, and a running stage can poll the predicate it is handed to stop
+ * early. Failed and cancelled items still travel to the end, so `done` runs
+ * exactly once per pushed item, always on a worker of the last stage, which
+ * is where completion callbacks belong. The destructor cancels what is in
+ * flight, drains it through `done` and joins the workers.
+ *
+ * stats() reports per stage the items run, failed and skipped, the input ring
+ * depth, and how its workers spent the time since the previous call: running
+ * (occupancy, 1 meaning every worker busy), waiting for input, or waiting for
+ * room downstream. The stage with the highest occupancy is the bottleneck.
+ */
+namespace stage_pipeline {
+
+enum Outcome : int {
+    kDone = 0,
+    kFailed = 1,
+    kCancelled = 2,
+};
+
+// Sleep until notified; wakers pay a syscall only while someone sleeps
+class EventCount {
+public:
+    // Announce a wait, then re-check the condition before wait(key)
+    uint32_t prepare() {
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        return epoch_.load(std::memory_order_seq_cst);
+    }
+
+    void cancel_wait() { waiters_.fetch_sub(1, std::memory_order_seq_cst); }
+
+    void wait(uint32_t key) {
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+        while (epoch_.load(std::memory_order_acquire) == key) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+#endif
+        waiters_.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void notify_all() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_seq_cst) == 0) {
+            return;
+        }
+        epoch_.fetch_add(1, std::memory_order_seq_cst);
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+private:
+    std::atomic<uint32_t> epoch_{0};
+    std::atomic<uint32_t> waiters_{0};
+};
+
+// Bounded multi-producer, multi-consumer ring of movable, default-constructible values
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool try_push(T& value) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // empty
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate while others push and pop
+    size_t size() const {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence{0};
+        T value{};
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+template <typename T>
+class StagePipeline {
+public:
+    using Cancelled = std::function<bool()>;
+
+    struct Stage {
+        std::string name;
+        int workers = 1;
+        // Returns false if the item failed; may poll `cancelled` to stop early
+        std::function<bool(T& item, const Cancelled& cancelled)> run;
+    };
+
+    struct Options {
+        size_t queue_depth = 4;  // items waiting in front of each stage
+        // Whether an item was cancelled from outside, checked before every stage
+        std::function<bool(const T& item)> cancelled;
+        // Once per pushed item, on a worker of the last stage
+        std::function<void(T& item, Outcome outcome)> done;
+        // First and last thing on every worker, with its stage's index
+        std::function<void(size_t stage)> thread_start;
+        std::function<void(size_t stage)> thread_exit;
+    };
+
+    struct StageStats {
+        std::string name;
+        int workers = 0;
+        size_t queued = 0;       // in the stage's input ring now
+        uint64_t processed = 0;  // items run, since start
+        uint64_t failed = 0;
+        uint64_t skipped = 0;    // cancelled or failed before reaching the stage
+        // Shares of the workers' time since the previous stats() call
+        double occupancy = 0.0;  // running items
+        double starved = 0.0;    // waiting for input
+        double blocked = 0.0;    // waiting for room in the next ring
+    };
+
+    struct Stats {
+        std::vector<StageStats> stages;
+        uint64_t pushed = 0;
+        uint64_t completed = 0;  // reached `done`, whatever the outcome
+        double items_per_s = 0.0;  // completed, since the previous stats() call
+        int bottleneck = -1;  // the stage with the highest occupancy
+    };
+
+    StagePipeline(std::vector<Stage> stages, Options options) : options_(std::move(options)) {
+        size_t depth = std::max<size_t>(1, options_.queue_depth);
+        for (Stage& stage : stages) {
+            auto state = std::make_unique<StageState>(depth);
+            state->stage = std::move(stage);
+            state->stage.workers = std::max(1, state->stage.workers);
+            state->alive.store(state->stage.workers);
+            stages_.push_back(std::move(state));
+        }
+        last_read_ = Clock::now();
+        for (size_t i = 0; i < stages_.size(); ++i) {
+            for (int w = 0; w < stages_[i]->stage.workers; ++w) {
+                threads_.emplace_back([this, i] { run_worker(i); });
+            }
+        }
+    }
+
+    ~StagePipeline() {
+        cancel_all();
+        close();
+        for (std::thread& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    StagePipeline(const StagePipeline&) = delete;
+    StagePipeline& operator=(const StagePipeline&) = delete;
+
+    // Queue an item, waiting while the first stage's ring is full. False once closed.
+    bool push(T item) {
+        if (stages_.empty()) {
+            return false;
+        }
+        pushing_.fetch_add(1);
+        if (closed_.load()) {
+            finish_push();
+            return false;
+        }
+        auto envelope = std::make_unique<Envelope>();
+        envelope->item = std::move(item);
+        envelope->epoch = cancel_epoch_.load();
+        pushed_.fetch_add(1, std::memory_order_relaxed);
+        put(*stages_[0], envelope, nullptr);
+        finish_push();
+        return true;
+    }
+
+    // Everything pushed so far skips the stages it has not run
+    void cancel_all() { cancel_epoch_.fetch_add(1); }
+
+    // No more pushes; the workers drain what is queued and exit
+    void close() {
+        closed_.store(true);
+        if (!stages_.empty()) {
+            stages_[0]->not_empty.notify_all();
+        }
+    }
+
+    size_t in_flight() const {
+        return static_cast<size_t>(pushed_.load() - completed_.load());
+    }
+
+    Stats stats() {
+        Stats stats;
+        Clock::time_point now = Clock::now();
+        double window_ns = std::chrono::duration<double, std::nano>(now - last_read_).count();
+        double best = -1.0;
+        for (size_t i = 0; i < stages_.size(); ++i) {
+            StageState& state = *stages_[i];
+            StageStats s;
+            s.name = state.stage.name;
+            s.workers = state.stage.workers;
+            s.queued = state.input.size();
+            s.processed = state.processed.load();
+            s.failed = state.failed.load();
+            s.skipped = state.skipped.load();
+            uint64_t busy = state.busy_ns.load();
+            uint64_t idle = state.idle_ns.load();
+            uint64_t blocked = state.blocked_ns.load();
+            double capacity = window_ns * s.workers;
+            if (capacity > 0.0) {
+                s.occupancy = std::min(1.0, (busy - state.last_busy_ns) / capacity);
+                s.starved = std::min(1.0, (idle - state.last_idle_ns) / capacity);
+                s.blocked = std::min(1.0, (blocked - state.last_blocked_ns) / capacity);
+            }
+            state.last_busy_ns = busy;
+            state.last_idle_ns = idle;
+            state.last_blocked_ns = blocked;
+            if (s.occupancy > best) {
+                best = s.occupancy;
+                stats.bottleneck = static_cast<int>(i);
+            }
+            stats.stages.push_back(std::move(s));
+        }
+        stats.pushed = pushed_.load();
+        stats.completed = completed_.load();
+        if (window_ns > 0.0) {
+            stats.items_per_s = (stats.completed - last_completed_) * 1e9 / window_ns;
+        }
+        last_completed_ = stats.completed;
+        last_read_ = now;
+        return stats;
+    }
+
+    std::string stats_json() {
+        Stats s = stats();
+        char head[160];
+        snprintf(head, sizeof(head), "{\"pushed\": %llu, \"completed\": %llu, \"items_per_s\": %.2f, \"bottleneck\": \"",
+                 static_cast<unsigned long long>(s.pushed), static_cast<unsigned long long>(s.completed),
+                 s.items_per_s);
+        std::string json = head;
+        json += s.bottleneck >= 0 ? s.stages[static_cast<size_t>(s.bottleneck)].name : std::string();
+        json += "\", \"stages\": [";
+        for (size_t i = 0; i < s.stages.size(); ++i) {
+            const StageStats& stage = s.stages[i];
+            char values[256];
+            snprintf(values, sizeof(values),
+                     "\", \"workers\": %d, \"queued\": %zu, \"processed\": %llu, \"failed\": %llu, "
+                     "\"skipped\": %llu, \"occupancy\": %.3f, \"starved\": %.3f, \"blocked\": %.3f}",
+                     stage.workers, stage.queued, static_cast<unsigned long long>(stage.processed),
+                     static_cast<unsigned long long>(stage.failed), static_cast<unsigned long long>(stage.skipped),
+                     stage.occupancy, stage.starved, stage.blocked);
+            json += (i == 0 ? "{\"name\": \"" : ", {\"name\": \"") + stage.name + values;
+        }
+        return json + "]}";
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Envelope {
+        T item{};
+        uint64_t epoch = 0;  // cancel_all() calls before the push
+        Outcome outcome = kDone;
+    };
+
+    struct StageState {
+        explicit StageState(size_t depth) : input(depth) {}
+
+        Stage stage;
+        BoundedQueue<std::unique_ptr<Envelope>> input;
+        EventCount not_empty;
+        EventCount not_full;
+        std::atomic<int> alive{0};  // workers still running
+        std::atomic<uint64_t> processed{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> skipped{0};
+        std::atomic<uint64_t> busy_ns{0};
+        std::atomic<uint64_t> idle_ns{0};
+        std::atomic<uint64_t> blocked_ns{0};
+        // As of the previous stats(), which is called from one thread at a time
+        uint64_t last_busy_ns = 0;
+        uint64_t last_idle_ns = 0;
+        uint64_t last_blocked_ns = 0;
+    };
+
+    Options options_;
+    std::vector<std::unique_ptr<StageState>> stages_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> closed_{false};
+    std::atomic<int> pushing_{0};  // push() calls under way
+    std::atomic<uint64_t> cancel_epoch_{0};
+    std::atomic<uint64_t> pushed_{0};
+    std::atomic<uint64_t> completed_{0};
+    uint64_t last_completed_ = 0;
+    Clock::time_point last_read_;
+
+    static uint64_t ns_since(Clock::time_point start) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    }
+
+    bool cancelled(const Envelope& envelope) const {
+        return envelope.epoch < cancel_epoch_.load() || (options_.cancelled && options_.cancelled(envelope.item));
+    }
+
+    // Into `state`'s ring, waiting for room; the wait counts as `waiter`'s blocked time
+    void put(StageState& state, std::unique_ptr<Envelope>& envelope, StageState* waiter) {
+        Clock::time_point start{};
+        while (!state.input.try_push(envelope)) {
+            if (start == Clock::time_point{}) {
+                start = Clock::now();
+            }
+            uint32_t key = state.not_full.prepare();
+            if (state.input.try_push(envelope)) {
+                state.not_full.cancel_wait();
+                break;
+            }
+            state.not_full.wait(key);
+        }
+        if (waiter != nullptr && start != Clock::time_point{}) {
+            waiter->blocked_ns.fetch_add(ns_since(start), std::memory_order_relaxed);
+        }
+        state.not_empty.notify_all();
+    }
+
+    // After close(), the first stage may be parked waiting on the last push
+    void finish_push() {
+        if (pushing_.fetch_sub(1) == 1 && closed_.load()) {
+            stages_[0]->not_empty.notify_all();
+        }
+    }
+
+    // Nothing more comes in once the pipeline is closed with no push under way (first stage)
+    // or every worker of the stage before has exited
+    bool upstream_done(size_t index) const {
+        return index == 0 ? closed_.load() && pushing_.load() == 0 : stages_[index - 1]->alive.load() == 0;
+    }
+
+    // The next envelope for stage `index`, or null once its input is drained for good
+    std::unique_ptr<Envelope> take(size_t index) {
+        StageState& state = *stages_[index];
+        std::unique_ptr<Envelope> envelope;
+        Clock::time_point start = Clock::now();
+        while (!state.input.try_pop(envelope)) {
+            uint32_t key = state.not_empty.prepare();
+            if (state.input.try_pop(envelope)) {
+                state.not_empty.cancel_wait();
+                break;
+            }
+            if (upstream_done(index)) {
+                state.not_empty.cancel_wait();
+                // A last push may have landed after the check above
+                if (state.input.try_pop(envelope)) {
+                    break;
+                }
+                return nullptr;
+            }
+            state.not_empty.wait(key);
+        }
+        state.idle_ns.fetch_add(ns_since(start), std::memory_order_relaxed);
+        state.not_full.notify_all();
+        return envelope;
+    }
+
+    void run_worker(size_t index) {
+        if (options_.thread_start) {
+            options_.thread_start(index);
+        }
+        StageState& state = *stages_[index];
+        bool last = index + 1 == stages_.size();
+        while (std::unique_ptr<Envelope> envelope = take(index)) {
+            if (envelope->outcome == kDone && cancelled(*envelope)) {
+                envelope->outcome = kCancelled;
+            }
+            if (envelope->outcome != kDone) {
+                state.skipped.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                Envelope* current = envelope.get();
+                Cancelled poll = [this, current] { return cancelled(*current); };
+                Clock::time_point start = Clock::now();
+                bool ok = false;
+                try {
+                    ok = state.stage.run(envelope->item, poll);
+                } catch (...) {
+                    ok = false;
+                }
+                state.busy_ns.fetch_add(ns_since(start), std::memory_order_relaxed);
+                state.processed.fetch_add(1, std::memory_order_relaxed);
+                if (!ok) {
+                    state.failed.fetch_add(1, std::memory_order_relaxed);
+                    envelope->outcome = cancelled(*envelope) ? kCancelled : kFailed;
+                }
+            }
+            if (last) {
+                if (envelope->outcome == kDone && cancelled(*envelope)) {
+                    envelope->outcome = kCancelled;
+                }
+                if (options_.done) {
+                    options_.done(envelope->item, envelope->outcome);
+                }
+                completed_.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                put(*stages_[index + 1], envelope, &state);
+            }
+        }
+        // The next stage may be parked waiting for input that will not come
+        if (state.alive.fetch_sub(1) == 1 && !last) {
+            stages_[index + 1]->not_empty.notify_all();
+        }
+        if (options_.thread_exit) {
+            options_.thread_exit(index);
+        }
+    }
+};
+
+}  // namespace stage_pipeline
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flight_recorder.h"
+
+/**
+ * Watchdog for generations that stop producing tokens.
+ *
+ * Whoever runs a generation holds a Busy for it (chat turns, batch steps)
+ * and marks progress per token and per prefill chunk. The watchdog thread
+ * checks a few times per threshold; when a Busy is held and nothing has
+ * progressed for the threshold, it captures once per stall what could
+ * explain it: the stage each native thread is in and for how long (its
+ * innermost trace section), every thread's scheduler state and wait channel,
+ * the thermal zones and CPU clocks (a throttle shows as low cur/max), what the
+ * app last reported about the device, and the flight recorder. The report
+ * goes to <dir>/flight_<wall ms>.txt as a flight recorder dump with the
+ * diagnostics ahead of the events, and stays readable for getLastStallReport.
+ *
+ * kActionCancel then aborts the generation (it ends with kStopStalled);
+ * kActionFallback also sends requests to the remote API for the cooldown.
+ * The abort hook runs under the Busy mutex, and Busies are only held while
+ * their holder has the engine, so the engine cannot go away under it.
+ */
+namespace stall {
+
+enum Action : int {
+    kActionReport = 0,    // capture only
+    kActionCancel = 1,    // capture, then abort the stalled generation
+    kActionFallback = 2,  // and route requests remotely for kFallbackCooldownMs
+};
+
+static constexpr int64_t kDefaultThresholdMs = 5000;
+static constexpr int64_t kMinThresholdMs = 200;
+static constexpr int64_t kFallbackCooldownMs = 60000;
+
+struct Activity {
+    std::mutex mutex;  // guards active and the abort hook call
+    int active = 0;
+    void (*abort_hook)() = nullptr;
+    std::atomic<uint64_t> progress_ns{0};
+};
+
+inline Activity& activity() {
+    static Activity* state = new Activity();
+    return *state;
+}
+
+// A token, prefill chunk or other sign that the generation moves
+inline void progress() {
+    activity().progress_ns.store(flight::now_ns(), std::memory_order_relaxed);
+}
+
+// A generation in progress, for the scope of its holder
+class Busy {
+public:
+    Busy() {
+        std::lock_guard<std::mutex> lock(activity().mutex);
+        activity().active++;
+        progress();
+    }
+
+    ~Busy() {
+        std::lock_guard<std::mutex> lock(activity().mutex);
+        activity().active--;
+    }
+
+    Busy(const Busy&) = delete;
+    Busy& operator=(const Busy&) = delete;
+};
+
+inline void set_abort_hook(void (*hook)()) {
+    std::lock_guard<std::mutex> lock(activity().mutex);
+    activity().abort_hook = hook;
+}
+
+// Aborts whatever holds a Busy; false if nothing did
+inline bool abort_busy() {
+    std::lock_guard<std::mutex> lock(activity().mutex);
+    if (activity().active <= 0 || activity().abort_hook == nullptr) {
+        return false;
+    }
+    activity().abort_hook();
+    return true;
+}
+
+inline std::string read_line(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// "tid name state wchan" for every thread of the process
+inline std::string thread_states() {
+    std::string out;
+    DIR* dir = opendir("/proc/self/task");
+    if (dir == nullptr) {
+        return out;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (std::atoi(entry->d_name) <= 0) {
+            continue;
+        }
+        std::string task = std::string("/proc/self/task/") + entry->d_name;
+        std::string stat = read_line(task + "/stat");
+        size_t open = stat.find('(');
+        size_t close = stat.rfind(')');
+        if (open == std::string::npos || close == std::string::npos || close + 2 >= stat.size()) {
+            continue;
+        }
+        std::string wchan = read_line(task + "/wchan");
+        out += std::string(entry->d_name) + " " + stat.substr(open + 1, close - open - 1) + " " + stat[close + 2] +
+               " " + (wchan.empty() || wchan == "0" ? "-" : wchan) + "\n";
+    }
+    closedir(dir);
+    return out;
+}
+
+// Thermal zones and per-CPU clocks
+inline std::string thermal_state() {
+    std::string out;
+    if (DIR* dir = opendir("/sys/class/thermal")) {
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 12, "thermal_zone") != 0) {
+                continue;
+            }
+            std::string zone = "/sys/class/thermal/" + name;
+            std::string temp = read_line(zone + "/temp");
+            if (!temp.empty()) {
+                char line[160];
+                snprintf(line, sizeof(line), "%s %s %.1f C\n", name.c_str(), read_line(zone + "/type").c_str(),
+                         std::atof(temp.c_str()) / 1000.0);
+                out += line;
+            }
+        }
+        closedir(dir);
+    }
+    for (int cpu = 0; cpu < 16; ++cpu) {
+        std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/";
+        std::string cur = read_line(base + "scaling_cur_freq");
+        if (cur.empty()) {
+            continue;
+        }
+        out += "cpu" + std::to_string(cpu) + " " + cur + " / " + read_line(base + "scaling_max_freq") + " kHz\n";
+    }
+    return out;
+}
+
+class StallWatchdog {
+public:
+    struct Stats {
+        uint64_t stalls = 0;
+        uint64_t cancelled = 0;
+        double longest_ms = 0.0;  // longest stall seen, reported or not yet
+    };
+
+    // What the engine side adds to a report (the device state the app reported)
+    using Describe = std::string (*)();
+    // Called on the watchdog thread after a report, with its action
+    using OnStall = void (*)(int action);
+
+    ~StallWatchdog() { stop(); }
+
+    void start(int64_t threshold_ms, int action, const std::string& dir, Describe describe, OnStall on_stall) {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            threshold_ms_ = std::max(kMinThresholdMs, threshold_ms);
+            action_ = std::min(std::max(action, static_cast<int>(kActionReport)), static_cast<int>(kActionFallback));
+            dir_ = dir;
+            describe_ = describe;
+            on_stall_ = on_stall;
+            stopping_ = false;
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    std::string last_report() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_report_;
+    }
+
+private:
+    std::mutex mutex_;  // guards everything below but thread_
+    std::condition_variable wake_;
+    std::thread thread_;
+    bool stopping_ = true;
+    int64_t threshold_ms_ = kDefaultThresholdMs;
+    int action_ = kActionReport;
+    std::string dir_;
+    Describe describe_ = nullptr;
+    OnStall on_stall_ = nullptr;
+    Stats stats_;
+    std::string last_report_;
+
+    void run() {
+        pthread_setname_np(pthread_self(), "MlcWatchdog");
+        uint64_t reported_at = 0;  // progress_ns of the stall already reported
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            int64_t period_ms = std::min<int64_t>(1000, std::max<int64_t>(50, threshold_ms_ / 4));
+            wake_.wait_for(lock, std::chrono::milliseconds(period_ms), [this] { return stopping_; });
+            if (stopping_) {
+                break;
+            }
+            int active = 0;
+            {
+                std::lock_guard<std::mutex> busy_lock(activity().mutex);
+                active = activity().active;
+            }
+            uint64_t last = activity().progress_ns.load(std::memory_order_relaxed);
+            uint64_t now = flight::now_ns();
+            double quiet_ms = active > 0 && now > last ? (now - last) / 1e6 : 0.0;
+            stats_.longest_ms = std::max(stats_.longest_ms, quiet_ms);
+            if (quiet_ms < static_cast<double>(threshold_ms_) || last == reported_at) {
+                continue;
+            }
+            reported_at = last;
+            stats_.stalls++;
+            int action = action_;
+            std::string dir = dir_;
+            Describe describe = describe_;
+            OnStall on_stall = on_stall_;
+            lock.unlock();
+            std::string report = capture(quiet_ms, active, describe);
+            std::string path = dir.empty() ? std::string() : flight::recorder().dump_in(dir, "stall", report);
+            bool cancelled = action >= kActionCancel && abort_busy();
+            if (on_stall != nullptr) {
+                on_stall(action);
+            }
+            lock.lock();
+            last_report_ = path.empty() ? report : "# written to " + path + "\n" + report;
+            if (cancelled) {
+                stats_.cancelled++;
+            }
+        }
+    }
+
+    static std::string capture(double quiet_ms, int active, Describe describe) {
+        char head[128];
+        snprintf(head, sizeof(head), "# stall: no progress for %.0f ms, %d generation(s) running\n", quiet_ms, active);
+        std::string report = head;
+        report += "# stages (tid stage time in it)\n" + flight::recorder().stages();
+        report += "# threads (tid name state wchan)\n" + thread_states();
+        report += "# thermal\n" + thermal_state();
+        if (describe != nullptr) {
+            report += "# device\n" + describe();
+        }
+        // Commented out line by line, so the dump's event lines still parse alone
+        std::string commented;
+        size_t start = 0;
+        while (start < report.size()) {
+            size_t end = report.find('\n', start);
+            end = end == std::string::npos ? report.size() : end;
+            std::string line = report.substr(start, end - start);
+            commented += (line.rfind("#", 0) == 0 ? line : "#   " + line) + "\n";
+            start = end + 1;
+        }
+        return commented;
+    }
+};
+
+}  // namespace stall
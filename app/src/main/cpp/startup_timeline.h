@@ -0,0 +1,315 @@
+#pragma once
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Where the time of a cold start goes, phase by phase, for this launch and
+ * the ones before it.
+ *
+ * The engine opens a launch around initialize() and closes it when that
+ * returns; in between every Phase it runs through (manifest, config, device,
+ * library load, kernel cache, weights and each shard's read and upload,
+ * tokenizer, warmup) is recorded with its start, wall time, CPU time, bytes
+ * read from storage and major faults. Phases nest (weights holds the shards),
+ * so the start offsets tell how they overlap. CPU, bytes and faults of a
+ * Phase are the whole process's over its span, loader workers and TVM pool
+ * included; a shard's read is its worker's own CPU and faults, and the
+ * shard's size as bytes. Phases that happen before a launch opens, such as
+ * the app timing System.loadLibrary, are reported ahead and join the next
+ * launch.
+ *
+ * Each closed launch is appended as one JSON line to startup-timeline.jsonl
+ * next to the model, keeping the last kHistory, so a cold start that got
+ * slower can be compared with the ones before it phase by phase.
+ */
+namespace startup {
+
+static constexpr size_t kHistory = 20;
+static constexpr char kHistoryFile[] = "/startup-timeline.jsonl";
+
+struct Counters {
+    uint64_t cpu_us = 0;
+    uint64_t read_bytes = 0;
+    uint64_t major_faults = 0;
+};
+
+inline uint64_t cpu_clock_us(clockid_t clock) {
+    timespec ts{};
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000ull + static_cast<uint64_t>(ts.tv_nsec) / 1000ull;
+}
+
+// The process's CPU, storage reads (/proc/self/io, which counts mmap faults too) and major faults
+inline Counters process_counters() {
+    Counters counters;
+    counters.cpu_us = cpu_clock_us(CLOCK_PROCESS_CPUTIME_ID);
+    FILE* io = fopen("/proc/self/io", "r");
+    if (io != nullptr) {
+        char line[128];
+        unsigned long long value = 0;
+        while (fgets(line, sizeof(line), io) != nullptr) {
+            if (sscanf(line, "read_bytes: %llu", &value) == 1) {
+                counters.read_bytes = value;
+                break;
+            }
+        }
+        fclose(io);
+    }
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters.major_faults = static_cast<uint64_t>(usage.ru_majflt);
+    }
+    return counters;
+}
+
+// The calling thread's CPU and major faults; no bytes, which are per process
+inline Counters thread_counters() {
+    Counters counters;
+    counters.cpu_us = cpu_clock_us(CLOCK_THREAD_CPUTIME_ID);
+    rusage usage{};
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+        counters.major_faults = static_cast<uint64_t>(usage.ru_majflt);
+    }
+    return counters;
+}
+
+struct PhaseRecord {
+    std::string name;
+    double start_ms = 0.0;  // from the launch's start; negative for phases reported ahead of it
+    double wall_ms = 0.0;
+    double cpu_ms = 0.0;
+    uint64_t read_bytes = 0;
+    uint64_t major_faults = 0;
+};
+
+class Timeline {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Opens a launch for `model_dir`, taking the phases reported ahead of it
+    void begin(const std::string& model_dir) {
+        Counters counters = process_counters();
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_ = true;
+        model_dir_ = model_dir;
+        started_ = Clock::now();
+        started_wall_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        started_counters_ = counters;
+        phases_.swap(early_);
+        early_.clear();
+        for (PhaseRecord& phase : phases_) {
+            phase.start_ms = -phase.wall_ms;
+        }
+    }
+
+    // Closes the launch and appends it to the model's history
+    void finish(bool ok) {
+        Counters counters = process_counters();
+        std::string line;
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!open_) {
+                return;
+            }
+            open_ = false;
+            ok_ = ok;
+            line = launch_json(ms(started_, Clock::now()), since_start(counters));
+            path = model_dir_ + kHistoryFile;
+        }
+        append_history(path, line);
+    }
+
+    bool open() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return open_;
+    }
+
+    // A phase of the open launch; dropped when none is open
+    void add(PhaseRecord record) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (open_) {
+            phases_.push_back(std::move(record));
+        }
+    }
+
+    // A phase timed before the launch opens; joins the next one
+    void add_early(PhaseRecord record) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        early_.push_back(std::move(record));
+    }
+
+    double elapsed_ms(Clock::time_point at) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return ms(started_, at);
+    }
+
+    // The last `launches` launches of the model, newest first, the one still loading included
+    std::string to_json(size_t launches) const {
+        Counters counters = process_counters();
+        std::string path;
+        std::string current;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (model_dir_.empty()) {
+                return "[]";
+            }
+            path = model_dir_ + kHistoryFile;
+            if (open_) {
+                current = launch_json(ms(started_, Clock::now()), since_start(counters));
+            }
+        }
+        std::vector<std::string> lines = read_history(path);
+        if (!current.empty()) {
+            lines.push_back(current);
+        }
+        std::string json = "[";
+        size_t written = 0;
+        for (auto it = lines.rbegin(); it != lines.rend() && written < launches; ++it, ++written) {
+            json += (written == 0 ? "" : ", ") + *it;
+        }
+        return json + "]";
+    }
+
+private:
+    mutable std::mutex mutex_;
+    bool open_ = false;
+    bool ok_ = false;
+    std::string model_dir_;
+    Clock::time_point started_ = Clock::now();
+    int64_t started_wall_ms_ = 0;
+    Counters started_counters_;
+    std::vector<PhaseRecord> phases_;
+    std::vector<PhaseRecord> early_;
+
+    static double ms(Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+    static std::string escaped(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            if (static_cast<unsigned char>(c) >= 0x20) {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    // Under mutex_
+    Counters since_start(const Counters& now) const {
+        return Counters{now.cpu_us - started_counters_.cpu_us, now.read_bytes - started_counters_.read_bytes,
+                        now.major_faults - started_counters_.major_faults};
+    }
+
+    // Under mutex_; a launch still loading reports "loading" and its totals so far
+    std::string launch_json(double total_ms, const Counters& total) const {
+        char head[256];
+        snprintf(head, sizeof(head),
+                 "{\"wall_ms\": %lld, \"state\": \"%s\", \"total_ms\": %.1f, \"cpu_ms\": %.1f, "
+                 "\"read_bytes\": %llu, \"major_faults\": %llu, \"model\": \"",
+                 static_cast<long long>(started_wall_ms_), open_ ? "loading" : ok_ ? "ok" : "failed", total_ms,
+                 total.cpu_us * 1e-3, static_cast<unsigned long long>(total.read_bytes),
+                 static_cast<unsigned long long>(total.major_faults));
+        std::string json = head + escaped(model_dir_) + "\", \"phases\": [";
+        for (size_t i = 0; i < phases_.size(); ++i) {
+            const PhaseRecord& phase = phases_[i];
+            char values[192];
+            snprintf(values, sizeof(values),
+                     "\", \"start_ms\": %.1f, \"wall_ms\": %.1f, \"cpu_ms\": %.1f, \"read_bytes\": %llu, "
+                     "\"major_faults\": %llu}",
+                     phase.start_ms, phase.wall_ms, phase.cpu_ms, static_cast<unsigned long long>(phase.read_bytes),
+                     static_cast<unsigned long long>(phase.major_faults));
+            json += (i == 0 ? "{\"name\": \"" : ", {\"name\": \"") + escaped(phase.name) + values;
+        }
+        return json + "]}";
+    }
+
+    static std::vector<std::string> read_history(const std::string& path) {
+        std::vector<std::string> lines;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty()) {
+                lines.push_back(line);
+            }
+        }
+        return lines;
+    }
+
+    // Rewritten whole through a temporary file, so a kill leaves the old history or the new one
+    static void append_history(const std::string& path, const std::string& line) {
+        std::vector<std::string> lines = read_history(path);
+        lines.push_back(line);
+        size_t first = lines.size() > kHistory ? lines.size() - kHistory : 0;
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            for (size_t i = first; i < lines.size(); ++i) {
+                out << lines[i] << '\n';
+            }
+            if (!out) {
+                return;
+            }
+        }
+        rename(tmp.c_str(), path.c_str());
+    }
+};
+
+inline Timeline& timeline() {
+    static Timeline* t = new Timeline();
+    return *t;
+}
+
+// Records the enclosing scope, or up to end(), as `name` in the open launch
+class Phase {
+public:
+    explicit Phase(std::string name)
+        : name_(std::move(name)), started_(Timeline::Clock::now()), counters_(process_counters()) {}
+
+    ~Phase() { end(); }
+
+    void end() {
+        Timeline& t = timeline();
+        if (ended_ || !t.open()) {
+            ended_ = true;
+            return;
+        }
+        ended_ = true;
+        Counters now = process_counters();
+        PhaseRecord record;
+        record.name = std::move(name_);
+        record.start_ms = t.elapsed_ms(started_);
+        record.wall_ms = std::chrono::duration<double, std::milli>(Timeline::Clock::now() - started_).count();
+        record.cpu_ms = (now.cpu_us - counters_.cpu_us) * 1e-3;
+        record.read_bytes = now.read_bytes - counters_.read_bytes;
+        record.major_faults = now.major_faults - counters_.major_faults;
+        t.add(std::move(record));
+    }
+
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+
+private:
+    std::string name_;
+    Timeline::Clock::time_point started_;
+    Counters counters_;
+    bool ended_ = false;
+};
+
+}  // namespace startup
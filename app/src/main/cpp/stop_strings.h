@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Why the last generation ended; mirrored as STOP_* in MlcLlmBridge.kt
+enum StopReason : int {
+    kStopNone = 0,      // still running, or ended inside the chat module
+    kStopToken = 1,     // end of sequence / end of turn, or a stop string that is one piece
+    kStopString = 2,    // a stop string completed in the decoded text
+    kStopLength = 3,    // max_gen_len reached
+    kStopAborted = 4,
+    kStopError = 5,
+    kStopCached = 6,    // answered from the response cache (response_cache.h)
+    kStopDeadline = 7,  // stopped at the request's deadline, or answered canned (deadline.h)
+    kStopStalled = 8,   // aborted by the stall watchdog (stall_watchdog.h)
+};
+
+/**
+ * Aho-Corasick automaton over the bytes of a set of stop strings, built once
+ * per set. A state is the longest tail of the text so far that some stop
+ * string starts with, so its depth is exactly what a stream has to hold back.
+ */
+class StopAutomaton {
+public:
+    explicit StopAutomaton(const std::vector<std::string>& stops) {
+        std::vector<std::map<uint8_t, int>> trie(1);
+        std::vector<int> terminal(1, 0);
+        for (const auto& stop : stops) {
+            if (stop.empty()) {
+                continue;
+            }
+            int state = 0;
+            for (unsigned char c : stop) {
+                auto it = trie[state].find(c);
+                if (it == trie[state].end()) {
+                    int child = static_cast<int>(trie.size());
+                    trie[state][c] = child;
+                    trie.emplace_back();
+                    terminal.push_back(0);
+                    state = child;
+                } else {
+                    state = it->second;
+                }
+            }
+            terminal[state] = 1;
+            count_++;
+        }
+
+        // Depths and transitions breadth first; a missing edge follows the failure link
+        size_t states = trie.size();
+        next_.assign(states * 256, 0);
+        match_.assign(states, 0);
+        depth_.assign(states, 0);
+        std::vector<int> fail(states, 0);
+        std::deque<int> queue;
+        for (int c = 0; c < 256; ++c) {
+            auto it = trie[0].find(static_cast<uint8_t>(c));
+            if (it != trie[0].end()) {
+                next_[c] = it->second;
+                depth_[it->second] = 1;
+                queue.push_back(it->second);
+            }
+        }
+        while (!queue.empty()) {
+            int state = queue.front();
+            queue.pop_front();
+            // The longest stop string ending here starts earliest
+            match_[state] = terminal[state] ? depth_[state] : match_[fail[state]];
+            for (int c = 0; c < 256; ++c) {
+                auto it = trie[state].find(static_cast<uint8_t>(c));
+                if (it == trie[state].end()) {
+                    next_[state * 256 + c] = next_[fail[state] * 256 + c];
+                    continue;
+                }
+                int child = it->second;
+                fail[child] = next_[fail[state] * 256 + c];
+                depth_[child] = depth_[state] + 1;
+                next_[state * 256 + c] = child;
+                queue.push_back(child);
+            }
+        }
+    }
+
+    bool empty() const { return count_ == 0; }
+    int step(int state, uint8_t c) const { return next_[state * 256 + c]; }
+    // Bytes of the text the state stands for
+    int depth(int state) const { return depth_[state]; }
+    // Length of the stop string that ends at this state; 0 if none does
+    int match(int state) const { return match_[state]; }
+
+private:
+    std::vector<int> next_;  // [state][byte]
+    std::vector<int> depth_;
+    std::vector<int> match_;
+    size_t count_ = 0;
+};
+
+/**
+ * Ends a stream at the first of a set of stop strings.
+ *
+ * Decoded text goes through push(), which returns what is safe to show: text
+ * that could still be the start of a stop string is held back until the next
+ * piece settles it. Once a stop string completes, it and everything after it
+ * are dropped and stopped() turns true, so the caller can stop decoding on the
+ * token that completed it. Stop strings are matched on bytes; since they are
+ * valid UTF-8, held-back text always splits on a character boundary.
+ */
+class StopStringMatcher {
+public:
+    explicit StopStringMatcher(const std::vector<std::string>& stops)
+        : automaton_(std::make_shared<StopAutomaton>(stops)) {}
+    explicit StopStringMatcher(std::shared_ptr<const StopAutomaton> automaton)
+        : automaton_(std::move(automaton)) {}
+
+    bool empty() const { return automaton_->empty(); }
+    bool stopped() const { return stopped_; }
+
+    std::string push(const std::string& text) {
+        if (stopped_) {
+            return std::string();
+        }
+        if (automaton_->empty()) {
+            return text;
+        }
+        size_t start = pending_.size();
+        pending_ += text;
+        for (size_t i = start; i < pending_.size(); ++i) {
+            state_ = automaton_->step(state_, static_cast<uint8_t>(pending_[i]));
+            int length = automaton_->match(state_);
+            if (length > 0) {
+                stopped_ = true;
+                std::string out = pending_.substr(0, i + 1 - length);
+                pending_.clear();
+                return out;
+            }
+        }
+        size_t keep = static_cast<size_t>(automaton_->depth(state_));
+        std::string out = pending_.substr(0, pending_.size() - keep);
+        pending_.erase(0, pending_.size() - keep);
+        return out;
+    }
+
+    // Text held back at the end of the stream
+    std::string flush() {
+        std::string out;
+        if (!stopped_) {
+            out.swap(pending_);
+        }
+        pending_.clear();
+        state_ = 0;
+        return out;
+    }
+
+private:
+    std::shared_ptr<const StopAutomaton> automaton_;
+    std::string pending_;
+    int state_ = 0;
+    bool stopped_ = false;
+};
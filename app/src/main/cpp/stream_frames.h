@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * Binary stream frames, in place of an OpenAI-style JSON chunk per delta.
+ *
+ * Each frame is one TokenRing record, so Kotlin reads them out of the shared
+ * buffer with fixed-offset loads instead of building and parsing JSON per
+ * token. All fields are native byte order; layouts must match StreamFrames.kt.
+ *
+ *   delta   [u8 kDelta][u8 0][u16 tokens][f32 logprob][utf8 text...]
+ *   finish  [u8 kFinish][u8 reason][u16 0][u32 prompt_tokens][u32 completion_tokens]
+ *           [f32 prefill_ms][f32 decode_ms][i64 request_id]
+ *   error   [u8 kError][u8 0][u16 0][u32 0][i64 request_id][utf8 message...]
+ *   block   [u8 kBlock][u8 op][u8 kind][u8 0][u32 index][u32 keep][utf8 text...]
+ *
+ * `tokens` is how many decode steps the delta covers; the detokenizer can
+ * hold a piece back or merge two. logprob is the delta's summed log
+ * probability, NaN when the module does not report one. Every stream ends
+ * with exactly one finish or error frame.
+ *
+ * Streams asked for blocks follow each delta with a block frame per block of
+ * the answer it started, changed or removed (markdown_blocks.h): op and kind
+ * are markdown_blocks::Op and Kind, and the block's text is its first `keep`
+ * bytes as reported before, then `text`.
+ */
+namespace stream_frames {
+
+enum Kind : uint8_t {
+    kDelta = 1,
+    kFinish = 2,
+    kError = 3,
+    kBlock = 4,
+};
+
+// As OpenAI's finish_reason, with mlc's "abort"
+enum FinishReason : uint8_t {
+    kFinishStop = 0,
+    kFinishLength = 1,
+    kFinishAbort = 2,
+};
+
+static constexpr size_t kDeltaHeader = 8;
+static constexpr size_t kFinishSize = 32;
+static constexpr size_t kErrorHeader = 16;
+static constexpr size_t kBlockHeader = 12;
+
+struct Usage {
+    uint32_t prompt_tokens = 0;
+    uint32_t completion_tokens = 0;
+    float prefill_ms = 0.0f;
+    float decode_ms = 0.0f;
+};
+
+template <typename T>
+inline void put(std::string& out, size_t offset, T value) {
+    memcpy(&out[offset], &value, sizeof(T));
+}
+
+inline std::string delta(const std::string& text, uint32_t tokens, float logprob = NAN) {
+    std::string out(kDeltaHeader, '\0');
+    out[0] = static_cast<char>(kDelta);
+    put<uint16_t>(out, 2, static_cast<uint16_t>(tokens > UINT16_MAX ? UINT16_MAX : tokens));
+    put<float>(out, 4, logprob);
+    out += text;
+    return out;
+}
+
+inline std::string finish(FinishReason reason, const Usage& usage, int64_t request_id) {
+    std::string out(kFinishSize, '\0');
+    out[0] = static_cast<char>(kFinish);
+    out[1] = static_cast<char>(reason);
+    put<uint32_t>(out, 4, usage.prompt_tokens);
+    put<uint32_t>(out, 8, usage.completion_tokens);
+    put<float>(out, 12, usage.prefill_ms);
+    put<float>(out, 16, usage.decode_ms);
+    put<int64_t>(out, 24, request_id);
+    return out;
+}
+
+inline std::string error(const std::string& message, int64_t request_id) {
+    std::string out(kErrorHeader, '\0');
+    out[0] = static_cast<char>(kError);
+    put<int64_t>(out, 8, request_id);
+    out += message;
+    return out;
+}
+
+inline std::string block(uint8_t op, uint8_t kind, uint32_t index, uint32_t keep, const std::string& text) {
+    std::string out(kBlockHeader, '\0');
+    out[0] = static_cast<char>(kBlock);
+    out[1] = static_cast<char>(op);
+    out[2] = static_cast<char>(kind);
+    put<uint32_t>(out, 4, index);
+    put<uint32_t>(out, 8, keep);
+    out += text;
+    return out;
+}
+
+}  // namespace stream_frames
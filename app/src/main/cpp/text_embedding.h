@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * Host side of embedTexts: pooling, normalization and the packed output formats.
+ *
+ * An embedding comes either from the dedicated embedding model (embed_batch
+ * or embed, see model_residency.h) or from the chat model's last hidden
+ * states (hidden_states(text) -> [tokens, hidden]), mean-pooled over the
+ * tokens. Every row is L2-normalized, so a dot product is the cosine
+ * similarity. The two sources have different widths and are not comparable
+ * with each other.
+ *
+ * Packed rows, little-endian and back to back:
+ *   fp16  dim halves
+ *   int8  a float32 scale, then dim int8 values; value = q * scale
+ */
+enum EmbedSource {
+    kEmbedAuto = 0,       // the embedding model when there is one, else the chat model
+    kEmbedChat = 1,       // mean-pooled hidden states of the chat model
+    kEmbedDedicated = 2,  // the embedding model in <model_dir>/embedder
+};
+
+enum EmbedFormat {
+    kEmbedFloat32 = 0,
+    kEmbedFloat16 = 1,
+    kEmbedInt8 = 2,
+};
+
+namespace text_embedding {
+
+// Rows at which pooling and packing are split over the TVM worker threads
+static constexpr size_t kParallelRows = 16;
+
+// Mean over `tokens` rows of `dim` values
+inline void mean_pool(const float* hidden, size_t tokens, size_t dim, float* out) {
+    std::fill(out, out + dim, 0.0f);
+    for (size_t t = 0; t < tokens; ++t) {
+        const float* row = hidden + t * dim;
+        for (size_t i = 0; i < dim; ++i) {
+            out[i] += row[i];
+        }
+    }
+    if (tokens > 0) {
+        float inv = 1.0f / static_cast<float>(tokens);
+        for (size_t i = 0; i < dim; ++i) {
+            out[i] *= inv;
+        }
+    }
+}
+
+inline void l2_normalize(float* row, size_t dim) {
+    double sum = 0.0;
+    for (size_t i = 0; i < dim; ++i) {
+        sum += static_cast<double>(row[i]) * row[i];
+    }
+    if (sum <= 0.0) {
+        return;
+    }
+    float inv = static_cast<float>(1.0 / std::sqrt(sum));
+    for (size_t i = 0; i < dim; ++i) {
+        row[i] *= inv;
+    }
+}
+
+// IEEE half, rounded to nearest even
+inline uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t abs = bits & 0x7fffffffu;
+    if (abs >= 0x7f800000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0));  // inf, nan
+    }
+    if (abs >= 0x477ff000u) {
+        return static_cast<uint16_t>(sign | 0x7c00u);  // overflows to inf
+    }
+    if (abs < 0x38800000u) {
+        // Subnormal half: shift the mantissa with its implicit bit into place
+        if (abs < 0x33000000u) {
+            return static_cast<uint16_t>(sign);
+        }
+        uint32_t exponent = abs >> 23;
+        uint32_t mantissa = (abs & 0x7fffffu) | 0x800000u;
+        uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1u))) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = ((abs - 0x38000000u) >> 13);
+    uint32_t rest = abs & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+inline size_t packed_row_bytes(EmbedFormat format, size_t dim) {
+    switch (format) {
+        case kEmbedFloat16: return dim * 2;
+        case kEmbedInt8: return sizeof(float) + dim;
+        default: return dim * sizeof(float);
+    }
+}
+
+// Write one row in `format` to `out` (packed_row_bytes of it)
+inline void pack_row(const float* row, size_t dim, EmbedFormat format, uint8_t* out) {
+    if (format == kEmbedFloat16) {
+        for (size_t i = 0; i < dim; ++i) {
+            uint16_t half = float_to_half(row[i]);
+            memcpy(out + i * 2, &half, 2);
+        }
+    } else if (format == kEmbedInt8) {
+        float peak = 0.0f;
+        for (size_t i = 0; i < dim; ++i) {
+            peak = std::max(peak, std::fabs(row[i]));
+        }
+        float scale = peak > 0.0f ? peak / 127.0f : 1.0f;
+        memcpy(out, &scale, sizeof(scale));
+        int8_t* values = reinterpret_cast<int8_t*>(out + sizeof(scale));
+        for (size_t i = 0; i < dim; ++i) {
+            long q = std::lround(row[i] / scale);
+            values[i] = static_cast<int8_t>(std::max(-127L, std::min(127L, q)));
+        }
+    } else {
+        memcpy(out, row, dim * sizeof(float));
+    }
+}
+
+}  // namespace text_embedding
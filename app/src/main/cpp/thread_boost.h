@@ -0,0 +1,171 @@
+#pragma once
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "performance_hint.h"
+
+/**
+ * Scheduling of the threads that run inference, by what they are running.
+ *
+ * Prefill and decode run on the engine's caller and the TVM pool at default
+ * priority, next to the UI, the camera and whatever else the phone is doing,
+ * and the time to first token is what suffers. While an interactive request
+ * holds the engine, those threads run at kInteractiveNice with uclamp.min at
+ * kInteractiveUtilMin, so the scheduler places them on big cores at a useful
+ * clock from the first kernel on instead of ramping up. Background work
+ * (batch jobs, summaries, prefetch) holds them at idle priority instead. When
+ * the hold ends the threads go back to what they had, so nothing stays pinned
+ * between requests.
+ *
+ * uclamp is set through sched_setattr (Linux 5.3) and only where the kernel
+ * and the app's cgroup allow it; the first refusal turns it off and priorities
+ * alone are used. Only a holder of the engine applies a Scope, so scopes never
+ * interleave.
+ */
+namespace thread_boost {
+
+enum Mode : int {
+    kModeDefault = 0,
+    kModeInteractive = 1,
+    kModeBackground = 2,
+};
+
+constexpr int kInteractiveNice = -8;       // Android's THREAD_PRIORITY_URGENT_DISPLAY
+constexpr int kBackgroundNice = 19;        // THREAD_PRIORITY_LOWEST
+constexpr uint32_t kInteractiveUtilMin = 512;  // of 1024
+
+struct Stats {
+    bool enabled = false;
+    int mode = kModeDefault;
+    bool uclamp = false;  // uclamp.min is being set
+    uint64_t interactive_holds = 0;
+    uint64_t background_holds = 0;
+    uint64_t failures = 0;  // threads whose priority could not be set
+};
+
+class Booster {
+public:
+    void set_enabled(bool enabled) { enabled_ = enabled; }
+    bool enabled() const { return enabled_; }
+
+    Stats stats() const {
+        Stats stats;
+        stats.enabled = enabled_;
+        stats.mode = mode_;
+        stats.uclamp = uclamp_;
+        stats.interactive_holds = interactive_holds_;
+        stats.background_holds = background_holds_;
+        stats.failures = failures_;
+        return stats;
+    }
+
+    // Per thread, what a Scope found and restores
+    struct Saved {
+        int32_t tid;
+        int nice;
+    };
+
+    // Put the caller and the pool in `mode`; the previous state goes to `saved`
+    int enter(Mode mode, std::vector<Saved>* saved) {
+        int previous = mode_;
+        saved->clear();
+        if (!enabled_ || mode == kModeDefault) {
+            return previous;
+        }
+        (mode == kModeInteractive ? interactive_holds_ : background_holds_)++;
+        for (int32_t tid : performance_hint::pool_thread_ids()) {
+            errno = 0;
+            int nice = getpriority(PRIO_PROCESS, static_cast<id_t>(tid));
+            if (nice == -1 && errno != 0) {
+                continue;
+            }
+            saved->push_back({tid, nice});
+            set(tid, mode == kModeInteractive ? kInteractiveNice : kBackgroundNice,
+                mode == kModeInteractive ? kInteractiveUtilMin : 0);
+        }
+        mode_ = mode;
+        return previous;
+    }
+
+    void leave(int previous, const std::vector<Saved>& saved) {
+        for (const Saved& thread : saved) {
+            set(thread.tid, thread.nice, 0);
+        }
+        mode_ = previous;
+    }
+
+private:
+    // struct sched_attr of the kernel, up to the clamps (SCHED_ATTR_SIZE_VER1)
+    struct SchedAttr {
+        uint32_t size;
+        uint32_t sched_policy;
+        uint64_t sched_flags;
+        int32_t sched_nice;
+        uint32_t sched_priority;
+        uint64_t sched_runtime;
+        uint64_t sched_deadline;
+        uint64_t sched_period;
+        uint32_t sched_util_min;
+        uint32_t sched_util_max;
+    };
+
+    static constexpr uint64_t kFlagKeepPolicy = 0x08;
+    static constexpr uint64_t kFlagKeepParams = 0x10;
+    static constexpr uint64_t kFlagUtilClampMin = 0x20;
+
+    void set(int32_t tid, int nice, uint32_t util_min) {
+        if (setpriority(PRIO_PROCESS, static_cast<id_t>(tid), nice) != 0) {
+            failures_++;
+        }
+#ifdef SYS_sched_setattr
+        if (uclamp_) {
+            SchedAttr attr = {};
+            attr.size = sizeof(attr);
+            attr.sched_flags = kFlagKeepPolicy | kFlagKeepParams | kFlagUtilClampMin;
+            attr.sched_util_min = util_min;
+            if (syscall(SYS_sched_setattr, tid, &attr, 0) != 0) {
+                uclamp_ = false;  // EPERM from the cgroup, or EINVAL before 5.3
+            }
+        }
+#else
+        (void)util_min;
+        uclamp_ = false;
+#endif
+    }
+
+    std::atomic<bool> enabled_{true};
+    int mode_ = kModeDefault;
+    bool uclamp_ = true;
+    uint64_t interactive_holds_ = 0;
+    uint64_t background_holds_ = 0;
+    uint64_t failures_ = 0;
+};
+
+inline Booster& booster() {
+    static Booster* instance = new Booster();
+    return *instance;
+}
+
+// `mode` for as long as the engine is held
+class Scope {
+public:
+    explicit Scope(Mode mode) : previous_(booster().enter(mode, &saved_)) {}
+    ~Scope() { booster().leave(previous_, saved_); }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    std::vector<Booster::Saved> saved_;
+    int previous_;
+};
+
+}  // namespace thread_boost
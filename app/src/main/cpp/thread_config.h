@@ -0,0 +1,196 @@
+#pragma once
+
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <tvm/runtime/threading_backend.h>
+
+#include "json_fields.h"
+#include "shared_pool.h"
+
+/**
+ * Which CPU cores the worker pool (shared_pool.h, and TVM's for what still
+ * launches there) runs on.
+ *
+ * The pool defaults to one worker per core, but decode splits each GEMV
+ * evenly across workers and waits for the slowest, so a worker on an
+ * efficiency core holds back the big ones. Cores are grouped into clusters by
+ * their maximum frequency (prime and big, mid, little on current SoCs); a mode
+ * keeps the fastest one, two or all clusters, one worker pinned per core
+ * unless fewer workers are asked for.
+ *
+ * Auto mode times decode under each mode once and keeps the fastest. The
+ * result is saved next to the model (thread-config.json) with the phone
+ * model it was measured on, and a different phone measures again. Only the
+ * CPU backend is timed; GPU backends keep the big+mid default for the few
+ * host-side kernels they run. The mid mode is not timed: it is the battery
+ * saver profile's (power_profile.h), slower but cheaper per token.
+ */
+enum ThreadAffinity : int {
+    kAffinityAuto = 0,
+    kAffinityBig = 1,     // fastest cluster only
+    kAffinityBigMid = 2,  // all but the slowest cluster (everything on two-cluster SoCs)
+    kAffinityAll = 3,
+    kAffinityMid = 4,     // neither the fastest nor, with three or more, the slowest cluster
+};
+
+struct ThreadConfig {
+    ThreadAffinity affinity = kAffinityAuto;
+    int workers = 0;  // 0: one per core of the chosen clusters
+    double decode_ms_per_token = 0.0;  // as measured when auto picked it
+};
+
+inline const char* thread_affinity_name(ThreadAffinity affinity) {
+    switch (affinity) {
+        case kAffinityBig: return "big";
+        case kAffinityBigMid: return "big+mid";
+        case kAffinityAll: return "all";
+        case kAffinityMid: return "mid";
+        default: return "auto";
+    }
+}
+
+// ro.product.model, what the saved choice is kept for; the board's DMI
+// product name on a host build
+inline std::string device_model_name() {
+#ifdef __ANDROID__
+    char model[PROP_VALUE_MAX] = {0};
+    __system_property_get("ro.product.model", model);
+    std::string name = model;
+#else
+    std::string name;
+    std::ifstream product("/sys/devices/virtual/dmi/id/product_name");
+    std::getline(product, name);
+    if (name.empty()) {
+        name = "host";
+    }
+#endif
+    for (char& c : name) {
+        if (c == '"' || c == '\\') {
+            c = '_';
+        }
+    }
+    return name;
+}
+
+// Core ids per cluster, fastest cluster first
+inline std::vector<std::vector<unsigned int>> cpu_clusters() {
+    std::vector<std::pair<long, unsigned int>> cores;  // (max kHz, id)
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < count; ++cpu) {
+        std::ifstream in("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/cpuinfo_max_freq");
+        long khz = 0;
+        if (in >> khz) {  // offline cores have no cpufreq
+            cores.emplace_back(khz, static_cast<unsigned int>(cpu));
+        }
+    }
+    std::sort(cores.begin(), cores.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    std::vector<std::vector<unsigned int>> clusters;
+    long current = -1;
+    for (const auto& core : cores) {
+        if (core.first != current) {
+            clusters.emplace_back();
+            current = core.first;
+        }
+        clusters.back().push_back(core.second);
+    }
+    return clusters;
+}
+
+inline std::vector<unsigned int> cores_for(ThreadAffinity affinity) {
+    std::vector<std::vector<unsigned int>> clusters = cpu_clusters();
+    size_t keep = clusters.size();
+    if (affinity == kAffinityMid && clusters.size() > 1) {
+        size_t end = clusters.size() > 2 ? clusters.size() - 1 : clusters.size();
+        std::vector<unsigned int> cores;
+        for (size_t i = 1; i < end; ++i) {
+            cores.insert(cores.end(), clusters[i].begin(), clusters[i].end());
+        }
+        return cores;
+    }
+    if (affinity == kAffinityBig) {
+        keep = std::min<size_t>(1, clusters.size());
+    } else if (affinity == kAffinityBigMid && clusters.size() > 2) {
+        keep = clusters.size() - 1;
+    }
+    std::vector<unsigned int> cores;
+    for (size_t i = 0; i < keep; ++i) {
+        cores.insert(cores.end(), clusters[i].begin(), clusters[i].end());
+    }
+    return cores;
+}
+
+// Reconfigure the pool; takes effect at the next parallel kernel. False if the cores are unknown.
+inline bool apply_thread_config(ThreadAffinity affinity, int workers) {
+    if (affinity == kAffinityAuto) {
+        affinity = kAffinityBigMid;  // until auto has measured
+    }
+    std::vector<unsigned int> cores = cores_for(affinity);
+    if (cores.empty()) {
+        return false;
+    }
+    int count = static_cast<int>(cores.size());
+    if (workers <= 0 || workers > count) {
+        workers = count;
+    }
+    using tvm::runtime::threading::ThreadGroup;
+    tvm::runtime::threading::Configure(workers == count ? ThreadGroup::kSpecifyOneCorePerThread
+                                                        : ThreadGroup::kSpecifyThreadShareAllCore,
+                                       workers, cores);
+    shared_pool::pool().configure(workers - 1, cores);  // the launching thread is the other one
+    return true;
+}
+
+inline std::string thread_config_to_json(const ThreadConfig& config) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "{\"device_model\": \"%s\", \"affinity\": \"%s\", \"workers\": %d, \"decode_ms_per_token\": %.4f}\n",
+             device_model_name().c_str(), thread_affinity_name(config.affinity), config.workers,
+             config.decode_ms_per_token);
+    return buffer;
+}
+
+// False if the file holds no choice for this phone model
+inline bool thread_config_from_json(const std::string& json, ThreadConfig* config) {
+    if (json.empty() || json_string_field(json, "device_model") != device_model_name()) {
+        return false;
+    }
+    std::string affinity = json_string_field(json, "affinity");
+    ThreadConfig loaded;
+    for (ThreadAffinity candidate : {kAffinityBig, kAffinityBigMid, kAffinityAll, kAffinityMid}) {
+        if (affinity == thread_affinity_name(candidate)) {
+            loaded.affinity = candidate;
+        }
+    }
+    if (loaded.affinity == kAffinityAuto) {
+        return false;
+    }
+    loaded.workers = static_cast<int>(json_int_field(json, "workers", 0));
+    loaded.decode_ms_per_token = json_float_field(json, "decode_ms_per_token", 0.0);
+    *config = loaded;
+    return true;
+}
+
+inline bool load_thread_config(const std::string& model_dir, ThreadConfig* config) {
+    std::ifstream in(model_dir + "/thread-config.json");
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return thread_config_from_json(json, config);
+}
+
+inline bool save_thread_config(const std::string& model_dir, const ThreadConfig& config) {
+    std::ofstream out(model_dir + "/thread-config.json", std::ios::trunc);
+    out << thread_config_to_json(config);
+    return out.good();
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+
+/**
+ * How streamed tokens are grouped before they are handed to the UI.
+ *
+ * A batch is flushed once `interval_us` has passed since the previous flush or
+ * `max_tokens` tokens are pending, whichever comes first. The first token of a
+ * response and the final one are always flushed immediately.
+ */
+struct DeliveryPolicy {
+    int64_t interval_us = 16000;  // one 60 Hz frame
+    uint32_t max_tokens = 8;
+
+    // Deliver every token as its own callback (the old behaviour)
+    static DeliveryPolicy every_token() { return DeliveryPolicy{0, 1}; }
+};
+
+struct DeliveryStats {
+    uint64_t tokens = 0;      // tokens produced by the decode loop
+    uint64_t deliveries = 0;  // callbacks made into Java
+    float first_delivery_ms = 0.0f;  // request start to first callback
+    float max_gap_ms = 0.0f;         // longest wait between two callbacks
+
+    float tokens_per_delivery() const {
+        return deliveries == 0 ? 0.0f : static_cast<float>(tokens) / static_cast<float>(deliveries);
+    }
+};
+
+/**
+ * Coalesces decoded tokens into batches according to a DeliveryPolicy and
+ * passes each batch to `sink(text, is_last)`. Single-threaded: feed it from the
+ * decode loop that produces the tokens.
+ */
+class TokenCoalescer {
+public:
+    using Sink = std::function<void(const std::string&, bool)>;
+    using Clock = std::chrono::steady_clock;
+
+    TokenCoalescer(DeliveryPolicy policy, Sink sink)
+        : policy_(policy), sink_(std::move(sink)), start_(Clock::now()), last_flush_(start_) {
+        if (policy_.max_tokens == 0) {
+            policy_.max_tokens = 1;
+        }
+    }
+
+    // Add one decoded token. `is_last` flushes right away, even with no text.
+    void add(const std::string& text, bool is_last) {
+        if (!text.empty()) {
+            pending_ += text;
+            ++pending_tokens_;
+            ++stats_.tokens;
+        }
+
+        Clock::time_point now = Clock::now();
+        bool due = is_last || stats_.deliveries == 0 ||
+                   pending_tokens_ >= policy_.max_tokens ||
+                   now - last_flush_ >= std::chrono::microseconds(policy_.interval_us);
+        if (due && (!pending_.empty() || is_last)) {
+            flush(now, is_last);
+        }
+    }
+
+    // Hand over anything still pending, e.g. when the loop ended without an is_last token
+    void finish(bool is_last) {
+        if (!pending_.empty() || is_last) {
+            flush(Clock::now(), is_last);
+        }
+    }
+
+    const DeliveryStats& stats() const { return stats_; }
+
+private:
+    DeliveryPolicy policy_;
+    Sink sink_;
+    Clock::time_point start_;
+    Clock::time_point last_flush_;
+    std::string pending_;
+    uint32_t pending_tokens_ = 0;
+    DeliveryStats stats_;
+
+    void flush(Clock::time_point now, bool is_last) {
+        float since_ms = std::chrono::duration<float, std::milli>(
+            now - (stats_.deliveries == 0 ? start_ : last_flush_)).count();
+        if (stats_.deliveries == 0) {
+            stats_.first_delivery_ms = since_ms;
+        } else if (since_ms > stats_.max_gap_ms) {
+            stats_.max_gap_ms = since_ms;
+        }
+        ++stats_.deliveries;
+        last_flush_ = now;
+
+        sink_(pending_, is_last);
+        pending_.clear();
+        pending_tokens_ = 0;
+    }
+};
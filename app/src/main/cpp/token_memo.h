@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Whole-text memo of one tokenizer's encode() results, least recently used
+ * out first.
+ *
+ * The same strings are tokenized again and again: template fragments, quiz
+ * instructions, preset prompts, the retrieved chunks of a study set. The
+ * segment cache (sp_tokenizer.h) saves the merges but not the normalization
+ * and the walk over the text; here a repeated input is one hash lookup and a
+ * copy of its ids, which are the very ids the first encode produced, so the
+ * prefix caches downstream see stable keys. Entries are keyed by the raw text
+ * itself (the map hashes it and compares on a hit, so a collision is a miss,
+ * never wrong ids) and bounded by bytes: text, ids and bookkeeping. Only texts
+ * up to kMaxTextBytes are kept; a chapter would push out many short strings
+ * that repeat for one long one that rarely does. The tokenizer clears its memo
+ * when it loads a model. Thread-safe.
+ */
+class TokenMemo {
+public:
+    static constexpr size_t kDefaultMaxBytes = 4 << 20;
+    static constexpr size_t kMaxTextBytes = 16 << 10;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    static bool memoizable(std::string_view text) { return !text.empty() && text.size() <= kMaxTextBytes; }
+
+    bool find(std::string_view text, std::vector<int>* ids) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(text);
+        if (it == index_.end()) {
+            misses_++;
+            return false;
+        }
+        hits_++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        if (ids != nullptr) {
+            *ids = it->second->ids;
+        }
+        return true;
+    }
+
+    // The id count of a memoized text, or -1
+    long count(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(text);
+        if (it == index_.end()) {
+            misses_++;
+            return -1;
+        }
+        hits_++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return static_cast<long>(it->second->ids.size());
+    }
+
+    void put(std::string_view text, const std::vector<int>& ids) {
+        size_t size = entry_bytes(text, ids);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size > max_bytes_ || index_.count(text) > 0) {
+            return;
+        }
+        entries_.push_front(Entry{std::string(text), ids});
+        index_.emplace(entries_.front().text, entries_.begin());
+        bytes_ += size;
+        evict(max_bytes_);
+    }
+
+    void set_max_bytes(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_bytes_ = bytes;
+        evict(max_bytes_);
+    }
+
+    // Everything, and the counters; returns the bytes that were held
+    size_t clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t held = bytes_;
+        evict(0);
+        hits_ = 0;
+        misses_ = 0;
+        return held;
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats stats;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        stats.entries = entries_.size();
+        stats.bytes = bytes_;
+        return stats;
+    }
+
+private:
+    struct Entry {
+        std::string text;
+        std::vector<int> ids;
+    };
+
+    std::mutex mutex_;
+    std::list<Entry> entries_;  // most recently used first
+    // Views into the entries' own text, which list nodes keep in place
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+    size_t max_bytes_ = kDefaultMaxBytes;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+
+    static size_t entry_bytes(std::string_view text, const std::vector<int>& ids) {
+        // A list node, a map node and the two heap blocks, roughly
+        return text.size() + ids.size() * sizeof(int) + 96;
+    }
+
+    // Under mutex_
+    void evict(size_t limit) {
+        while (bytes_ > limit && !entries_.empty()) {
+            const Entry& last = entries_.back();
+            bytes_ -= entry_bytes(last.text, last.ids);
+            index_.erase(last.text);
+            entries_.pop_back();
+        }
+    }
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Byte ring shared with Kotlin through a direct ByteBuffer.
+ *
+ * The native side appends UTF-8 token records and Kotlin drains them straight
+ * out of the buffer, so a stream costs one wakeup per batch of tokens instead of
+ * a NewStringUTF + CallVoidMethod per token.
+ *
+ * Buffer layout (native byte order):
+ *   [0..4)   uint32 head   - bytes written, advanced by the producer
+ *   [4..8)   uint32 tail   - bytes consumed, advanced by the consumer
+ *   [8..12)  uint32 flags  - kFlagFinished / kFlagError
+ *   [12..16) reserved
+ *   [16..)   data, `capacity` bytes (power of two), records are [uint16 len][bytes]
+ *
+ * head and tail are free-running counters; positions are taken modulo capacity.
+ */
+class TokenRing {
+public:
+    static constexpr size_t kHeaderSize = 16;
+    static constexpr uint32_t kFlagFinished = 1u << 0;
+    static constexpr uint32_t kFlagError = 1u << 1;
+
+    explicit TokenRing(size_t requested_capacity) {
+        capacity_ = 1024;
+        while (capacity_ < requested_capacity && capacity_ < (1u << 24)) {
+            capacity_ <<= 1;
+        }
+        storage_.reset(new uint8_t[kHeaderSize + capacity_]());
+    }
+
+    uint8_t* buffer() { return storage_.get(); }
+    size_t buffer_size() const { return kHeaderSize + capacity_; }
+    size_t capacity() const { return capacity_; }
+
+    // Prepare the ring for a new stream. Only call while no producer is running.
+    void reset() {
+        head()->store(0, std::memory_order_relaxed);
+        tail()->store(0, std::memory_order_relaxed);
+        flags()->store(0, std::memory_order_release);
+    }
+
+    // Append one token record. Never blocks on the UI: if Kotlin has fallen a full
+    // ring behind, the producer yields briefly until space frees up or `cancelled` is set.
+    bool push(const std::string& token, const std::atomic<bool>* cancelled = nullptr) {
+        if (token.empty()) {
+            return true;
+        }
+        size_t len = std::min(token.size(), static_cast<size_t>(UINT16_MAX));
+        size_t needed = len + sizeof(uint16_t);
+        if (needed > capacity_) {
+            return false;
+        }
+
+        uint32_t h = head()->load(std::memory_order_relaxed);
+        while (capacity_ - (h - tail()->load(std::memory_order_acquire)) < needed) {
+            if (cancelled != nullptr && cancelled->load(std::memory_order_relaxed)) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+
+        uint16_t len16 = static_cast<uint16_t>(len);
+        write_bytes(h, reinterpret_cast<const uint8_t*>(&len16), sizeof(len16));
+        write_bytes(h + sizeof(len16), reinterpret_cast<const uint8_t*>(token.data()), len);
+        head()->store(h + static_cast<uint32_t>(needed), std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    // Mark the stream complete; the consumer sees it after draining the remaining records
+    void finish(bool error) {
+        flags()->fetch_or(kFlagFinished | (error ? kFlagError : 0), std::memory_order_release);
+        wake();
+    }
+
+    // Block the consumer until records are available or the stream finished.
+    // Returns the number of unread bytes, or -1 once finished and fully drained.
+    int await(int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        consumer_parked_.store(true, std::memory_order_seq_cst);
+        cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
+            return available() > 0 || finished();
+        });
+        consumer_parked_.store(false, std::memory_order_relaxed);
+
+        uint32_t pending = available();
+        if (pending == 0 && finished()) {
+            return -1;
+        }
+        return static_cast<int>(pending);
+    }
+
+    // Consumer side for native readers (micro_bench); Kotlin advances the tail itself
+    void consume(uint32_t bytes) {
+        tail()->fetch_add(bytes, std::memory_order_release);
+    }
+
+private:
+    std::unique_ptr<uint8_t[]> storage_;
+    size_t capacity_ = 0;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::atomic<bool> consumer_parked_{false};
+
+    std::atomic<uint32_t>* head() { return reinterpret_cast<std::atomic<uint32_t>*>(storage_.get()); }
+    std::atomic<uint32_t>* tail() { return reinterpret_cast<std::atomic<uint32_t>*>(storage_.get() + 4); }
+    std::atomic<uint32_t>* flags() { return reinterpret_cast<std::atomic<uint32_t>*>(storage_.get() + 8); }
+
+    uint32_t available() {
+        return head()->load(std::memory_order_acquire) - tail()->load(std::memory_order_acquire);
+    }
+
+    bool finished() {
+        return (flags()->load(std::memory_order_acquire) & kFlagFinished) != 0;
+    }
+
+    void write_bytes(uint32_t pos, const uint8_t* src, size_t len) {
+        uint8_t* data = storage_.get() + kHeaderSize;
+        size_t offset = pos & (capacity_ - 1);
+        size_t first = std::min(len, capacity_ - offset);
+        memcpy(data + offset, src, first);
+        if (first < len) {
+            memcpy(data, src + first, len - first);
+        }
+    }
+
+    // Only take the lock and signal when the consumer is actually parked
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumer_parked_.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cond_.notify_one();
+        }
+    }
+};
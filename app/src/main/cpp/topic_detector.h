@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/**
+ * Keyword-based topic and intent detection shared by the offline responders.
+ *
+ * All keywords live in one constexpr table and are compiled once into an
+ * Aho-Corasick automaton. The automaton is stored as a full DFA over a compact
+ * alphabet, so detection is a single case-insensitive pass over the message with
+ * no lowercased copy and no failure-link walks. Matching is by substring, as the
+ * std::string::find chains it replaces were.
+ */
+enum TopicBit : uint32_t {
+    kTopicMath        = 1u << 0,
+    kTopicPhysics     = 1u << 1,
+    kTopicChemistry   = 1u << 2,
+    kTopicBiology     = 1u << 3,
+    kTopicHistory     = 1u << 4,
+    kTopicLiterature  = 1u << 5,
+    kTopicEnglish     = 1u << 6,
+    kTopicProgramming = 1u << 7,
+    kTopicScience     = 1u << 8,
+    kIntentGreeting   = 1u << 9,
+    kIntentQuestion   = 1u << 10,
+};
+
+struct TopicKeyword {
+    const char* text;  // lowercase
+    uint32_t bits;
+};
+
+constexpr TopicKeyword kTopicKeywords[] = {
+    {"math", kTopicMath}, {"equation", kTopicMath}, {"algebra", kTopicMath},
+    {"geometry", kTopicMath}, {"calculus", kTopicMath}, {"trigonometry", kTopicMath},
+    {"arithmetic", kTopicMath},
+
+    {"physics", kTopicPhysics}, {"force", kTopicPhysics}, {"gravity", kTopicPhysics},
+    {"motion", kTopicPhysics}, {"energy", kTopicPhysics}, {"quantum", kTopicPhysics},
+
+    {"chemistry", kTopicChemistry}, {"molecule", kTopicChemistry}, {"atom", kTopicChemistry},
+    {"element", kTopicChemistry}, {"compound", kTopicChemistry}, {"reaction", kTopicChemistry},
+
+    {"biology", kTopicBiology}, {"cell", kTopicBiology}, {"organism", kTopicBiology},
+    {"evolution", kTopicBiology}, {"ecology", kTopicBiology}, {"genetics", kTopicBiology},
+
+    {"history", kTopicHistory}, {"civilization", kTopicHistory}, {"war", kTopicHistory},
+    {"revolution", kTopicHistory}, {"ancient", kTopicHistory}, {"century", kTopicHistory},
+
+    {"literature", kTopicLiterature}, {"book", kTopicLiterature}, {"author", kTopicLiterature},
+    {"novel", kTopicLiterature}, {"poetry", kTopicLiterature}, {"character", kTopicLiterature},
+
+    {"english", kTopicEnglish},
+
+    {"computer", kTopicProgramming}, {"programming", kTopicProgramming}, {"code", kTopicProgramming},
+    {"algorithm", kTopicProgramming}, {"software", kTopicProgramming}, {"data", kTopicProgramming},
+
+    {"science", kTopicScience},
+
+    {"hello", kIntentGreeting}, {"hi ", kIntentGreeting}, {"hey", kIntentGreeting},
+
+    {"?", kIntentQuestion}, {"what", kIntentQuestion}, {"how", kIntentQuestion},
+    {"why", kIntentQuestion}, {"when", kIntentQuestion}, {"where", kIntentQuestion},
+    {"who", kIntentQuestion}, {"which", kIntentQuestion}, {"can you", kIntentQuestion},
+    {"could you", kIntentQuestion},
+};
+
+class TopicDetector {
+public:
+    // Shared automaton, built on first use
+    static const TopicDetector& instance() {
+        static const TopicDetector detector;
+        return detector;
+    }
+
+    // OR of the bits of every keyword that occurs in `text`
+    uint32_t scan(std::string_view text) const {
+        uint32_t found = 0;
+        uint32_t state = 0;
+        for (char c : text) {
+            state = next_[state * alphabet_size_ + char_class_[static_cast<uint8_t>(c)]];
+            found |= output_[state];
+        }
+        return found;
+    }
+
+private:
+    uint8_t char_class_[256] = {};  // 0 is "not in any keyword"
+    size_t alphabet_size_ = 1;
+    std::vector<uint32_t> next_;    // state * alphabet_size_ + class -> state
+    std::vector<uint32_t> output_;  // bits matched on entering a state, suffixes included
+
+    TopicDetector() {
+        // Compact alphabet: one class per distinct keyword byte, uppercase folded in
+        for (const TopicKeyword& keyword : kTopicKeywords) {
+            for (const char* p = keyword.text; *p; ++p) {
+                uint8_t c = static_cast<uint8_t>(*p);
+                if (char_class_[c] == 0) {
+                    char_class_[c] = static_cast<uint8_t>(alphabet_size_++);
+                }
+            }
+        }
+        for (int c = 'a'; c <= 'z'; ++c) {
+            char_class_[c - 'a' + 'A'] = char_class_[c];
+        }
+
+        // Trie, with missing edges marked as kNone
+        const uint32_t kNone = UINT32_MAX;
+        next_.assign(alphabet_size_, kNone);
+        output_.assign(1, 0);
+        for (const TopicKeyword& keyword : kTopicKeywords) {
+            uint32_t state = 0;
+            for (const char* p = keyword.text; *p; ++p) {
+                size_t slot = state * alphabet_size_ + char_class_[static_cast<uint8_t>(*p)];
+                if (next_[slot] == kNone) {
+                    next_[slot] = static_cast<uint32_t>(output_.size());
+                    output_.push_back(0);
+                    next_.resize(next_.size() + alphabet_size_, kNone);
+                }
+                state = next_[slot];
+            }
+            output_[state] |= keyword.bits;
+        }
+
+        // BFS over the trie filling failure transitions into a full DFA
+        std::vector<uint32_t> fail(output_.size(), 0);
+        std::vector<uint32_t> queue;
+        for (size_t c = 0; c < alphabet_size_; ++c) {
+            uint32_t& target = next_[c];
+            if (target == kNone) {
+                target = 0;
+            } else {
+                fail[target] = 0;
+                queue.push_back(target);
+            }
+        }
+        for (size_t head = 0; head < queue.size(); ++head) {
+            uint32_t state = queue[head];
+            output_[state] |= output_[fail[state]];
+            for (size_t c = 0; c < alphabet_size_; ++c) {
+                uint32_t& target = next_[state * alphabet_size_ + c];
+                uint32_t via_fail = next_[fail[state] * alphabet_size_ + c];
+                if (target == kNone) {
+                    target = via_fail;
+                } else {
+                    fail[target] = via_fail;
+                    queue.push_back(target);
+                }
+            }
+        }
+    }
+};
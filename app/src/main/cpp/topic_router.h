@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+#include "topic_detector.h"
+
+/**
+ * Subject routing that runs before prefill.
+ *
+ * A request is tagged with one subject from a single TopicDetector pass, so
+ * routing costs microseconds and never needs a model forward pass. Engines use
+ * the tag to pick subject-specific resources: canned text in the fallback
+ * responders, and a cached system prompt prefix or adapter in the real engine.
+ */
+enum Subject {
+    kSubjectMathematics,
+    kSubjectPhysics,
+    kSubjectChemistry,
+    kSubjectBiology,
+    kSubjectHistory,
+    kSubjectLiterature,
+    kSubjectComputerScience,
+    kSubjectGeneral,
+    kSubjectCount,
+};
+
+// Display names, as used in responses
+constexpr std::string_view kSubjectNames[kSubjectCount] = {
+    "mathematics", "physics", "chemistry", "biology",
+    "history", "literature", "computer science", "general",
+};
+
+// Identifiers for adapters and logs
+constexpr std::string_view kSubjectKeys[kSubjectCount] = {
+    "math", "physics", "chemistry", "biology",
+    "history", "literature", "computer_science", "general",
+};
+
+// Tag `text` with the first matching subject, in this priority order
+inline Subject route_subject(std::string_view text) {
+    static constexpr std::pair<uint32_t, Subject> kSubjectOrder[] = {
+        {kTopicMath, kSubjectMathematics}, {kTopicPhysics, kSubjectPhysics},
+        {kTopicChemistry, kSubjectChemistry}, {kTopicBiology, kSubjectBiology},
+        {kTopicHistory, kSubjectHistory}, {kTopicLiterature, kSubjectLiterature},
+        {kTopicProgramming, kSubjectComputerScience},
+    };
+
+    uint32_t found = TopicDetector::instance().scan(text);
+    for (const auto& entry : kSubjectOrder) {
+        if (found & entry.first) {
+            return entry.second;
+        }
+    }
+    return kSubjectGeneral;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * The caller's trace id for the request a thread is working on, so one slow
+ * answer can be followed from Kotlin through every native stage.
+ *
+ * Kotlin sets it on its calling thread (setTraceId) before a native call and
+ * the id rides along from there: RequestTiming takes it when the request is
+ * made, GenerationWorker carries it with each job to the worker thread, and
+ * every log line (native_log.h), trace section and flight recorder event
+ * (native_trace.h) written meanwhile is stamped with it. 0 is no trace.
+ */
+namespace trace_context {
+
+inline int64_t& current_ref() {
+    thread_local int64_t id = 0;
+    return id;
+}
+
+inline int64_t current() {
+    return current_ref();
+}
+
+// Sets the calling thread's id; returns the one it replaces
+inline int64_t exchange(int64_t id) {
+    int64_t previous = current_ref();
+    current_ref() = id;
+    return previous;
+}
+
+// `id` for the enclosing scope, then whatever was there before
+class Scope {
+public:
+    explicit Scope(int64_t id) : previous_(exchange(id)) {}
+    ~Scope() { current_ref() = previous_; }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    int64_t previous_;
+};
+
+}  // namespace trace_context
@@ -1,8 +1,8 @@
 #include <jni.h>
 #include <string>
-#include <android/log.h>
 #include <dlfcn.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <vector>
 #include <map>
@@ -13,27 +13,71 @@
 #include <thread>
 #include <chrono>
 #include <regex>
+#include <functional>
+#include <climits>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <fstream>
+#include <iterator>
 
 // MLC-LLM and TVM includes
 #include <tvm/runtime/c_runtime_api.h>
 #include <dlpack/dlpack.h>
 
+#include "compute_device.h"
+#include "cpu_features.h"
+#include "token_coalescer.h"
+#include "token_ring.h"
+#include "stream_frames.h"
+#include "generation_config.h"
+#include "generation_worker.h"
+#include "thread_config.h"
+#include "jni_cache.h"
+#include "jni_strings.h"
+#include "latency_metrics.h"
+#include "markdown_blocks.h"
+#include "model_config.h"
+#include "model_manifest.h"
+#include "simple_tokenizer.h"
+#include "weight_delta.h"
+#include "native_log.h"
+#include "native_trace.h"
+#include "topic_detector.h"
+#include "trace_context.h"
+#include "utf8_stream.h"
+
 #define LOG_TAG "TVMBridge"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+#define LOGV(...) NLOGV(LOG_TAG, __VA_ARGS__)
+#define LOGI(...) NLOGI(LOG_TAG, __VA_ARGS__)
+#define LOGE(...) NLOGE(LOG_TAG, __VA_ARGS__)
+#define LOGD(...) NLOGD(LOG_TAG, __VA_ARGS__)
+#define LOGW(...) NLOGW(LOG_TAG, __VA_ARGS__)
+
+// Default sampling settings. Each request takes a snapshot when it starts, so
+// changing a setting never touches a generation that is already running.
+static SharedConfig g_generation_config = [] {
+    GenerationConfig config;
+    config.temperature = 0.8f;
+    config.repetition_penalty = 1.1f;
+    return SharedConfig(std::move(config));
+}();
+
+static GenerationConfig current_generation_config() {
+    return g_generation_config.get();
+}
 
 // Global variables for configuration
-static float temperature = 0.8f;
-static float top_p = 0.95f;
-static float repetition_penalty = 1.1f;
 static bool is_initialized = false;
 static std::string model_name = "gemma-2b-it";
-static std::mt19937 rng(static_cast<unsigned int>(std::time(nullptr)));
+
+// Sampling seed applied at the start of every request. Negative draws fresh
+// entropy per request; a fixed value makes benchmark runs replay token for token.
+static std::atomic<int64_t> g_generation_seed{-1};
 
 // Variables for real MLC-LLM 
-static bool model_loaded = false;
+static std::atomic<bool> model_loaded{false};  // set by initialize / destroy, read by the generation worker
 static void* tvm_handle = nullptr;
 static void* mlc_handle = nullptr;
 static TVMFunctionHandle generate_handle = nullptr;
@@ -42,324 +86,103 @@ static TVMFunctionHandle reset_chat_handle = nullptr;
 static TVMFunctionHandle create_session_handle = nullptr;
 static TVMFunctionHandle get_response_handle = nullptr;
 
-// A simple structure to simulate a language model's vocabulary
-struct SimpleTokenizer {
-    std::vector<std::string> vocabulary;
-    std::map<std::string, int> token_to_id;
-    std::map<int, std::string> id_to_token;
-    
-    SimpleTokenizer() {
-        // Add some basic vocabulary
-        vocabulary = {
-            // Special tokens
-            "<bos>", "<eos>", ".", ",", "!", "?", ":", ";", "(", ")", "[", "]", "\"", "'", "-", "_", "+", "=", "*", "/", "%", "<", ">", "$", "#", "@", "&", "^",
-            
-            // Basic words
-            "the", "a", "an", "of", "to", "and", "in", "for", "is", "on", "that", "by", "this",
-            "with", "I", "you", "he", "she", "it", "we", "they", "my", "your", "his", "her", "its", "our", "their",
-            "am", "are", "was", "were", "be", "been", "have", "has", "had", "do", "does", "did", "can", "could", "will", "would", "should", "may", "might",
-            
-            // Greetings and conversational
-            "hello", "hi", "hey", "greetings", "good", "morning", "afternoon", "evening", "night", 
-            "bye", "goodbye", "see", "talk", "later", "next", "time",
-            "thanks", "thank", "please", "welcome", "sorry", "excuse", "pardon", "ok", "okay", "yes", "no", "maybe",
-            "how", "what", "when", "where", "why", "who", "which", "whose", 
-            
-            // Time-related
-            "time", "day", "today", "tomorrow", "yesterday", "now", "later", "before", "after", "during",
-            "week", "month", "year", "hour", "minute", "second", "monday", "tuesday", "wednesday", "thursday", "friday", "saturday", "sunday",
-            "january", "february", "march", "april", "may", "june", "july", "august", "september", "october", "november", "december",
-            
-            // Study-related general
-            "study", "buddy", "student", "teacher", "professor", "learn", "learning", "education", "school", "college", "university",
-            "class", "course", "lecture", "lesson", "exam", "test", "quiz", "assignment", "homework", "project", "research", "paper", "essay",
-            "grade", "score", "point", "academic", "semester", "term", "degree", "bachelor", "master", "phd", "doctorate",
-            "textbook", "note", "notes", "chapter", "page", "reference", "cite", "citation", "bibliography",
-            "library", "laboratory", "lab", "classroom", "lecture", "hall", "campus", "dormitory", "dorm",
-            
-            // Academic subjects
-            "math", "mathematics", "algebra", "geometry", "calculus", "trigonometry", "statistics", "probability",
-            "science", "physics", "chemistry", "biology", "geology", "astronomy", "neuroscience", "psychology",
-            "history", "geography", "economics", "political", "politics", "sociology", "anthropology", "archaeology",
-            "english", "literature", "grammar", "vocabulary", "writing", "reading", "composition", "rhetoric", "linguistics",
-            "language", "spanish", "french", "german", "chinese", "japanese", "latin", "greek",
-            "art", "music", "philosophy", "religion", "ethics", "logic", "aesthetics", "epistemology",
-            "computer", "programming", "software", "hardware", "algorithm", "data", "structure", "code",
-            "engineering", "mechanical", "electrical", "civil", "chemical", "material", "aerospace",
-            "medicine", "anatomy", "physiology", "pathology", "microbiology", "pharmacology", "nursing",
-            
-            // Math terms
-            "number", "integer", "fraction", "decimal", "equation", "formula", "function", "variable", "constant",
-            "sum", "difference", "product", "quotient", "factor", "multiple", "divisor", "dividend", "remainder",
-            "exponent", "power", "root", "square", "cube", "logarithm", "derivative", "integral", "limit",
-            "angle", "degree", "radian", "triangle", "circle", "rectangle", "polygon", "coordinate", "axis", "graph",
-            "matrix", "vector", "scalar", "theorem", "proof", "axiom", "corollary", "lemma",
-            
-            // Science terms
-            "theory", "hypothesis", "experiment", "observation", "evidence", "conclusion", "analysis", "method",
-            "atom", "molecule", "cell", "tissue", "organ", "system", "organism", "species", "genus", "family",
-            "element", "compound", "reaction", "energy", "force", "mass", "weight", "velocity", "acceleration",
-            "temperature", "pressure", "volume", "density", "wave", "particle", "quantum", "photon", "electron",
-            "nucleus", "proton", "neutron", "chromosome", "gene", "dna", "rna", "protein", "enzyme",
-            
-            // Study skills
-            "focus", "concentration", "attention", "memory", "recall", "comprehension", "understanding",
-            "practice", "review", "revise", "summarize", "outline", "highlight", "flashcard", "mnemonic",
-            "schedule", "deadline", "priority", "organization", "efficiency", "effectiveness", "productivity",
-            "stress", "anxiety", "relaxation", "mindfulness", "meditation", "sleep", "rest", "break",
-            "goal", "motivation", "discipline", "habit", "routine", "strategy", "technique", "method",
-            
-            // Common verbs for learning
-            "explain", "describe", "define", "analyze", "evaluate", "compare", "contrast", "discuss", "argue",
-            "solve", "calculate", "compute", "derive", "prove", "demonstrate", "illustrate", "clarify",
-            "understand", "know", "think", "believe", "remember", "forget", "recall", "recognize", "identify",
-            "read", "write", "speak", "listen", "present", "practice", "apply", "implement", "use",
-            "study", "learn", "teach", "tutor", "mentor", "guide", "help", "assist", "support",
-            
-            // AI and technology
-            "model", "ai", "artificial", "intelligence", "machine", "learning", "neural", "network", "deep", "natural", "language", "processing",
-            "chat", "bot", "assistant", "help", "question", "answer", "response", "conversation", "dialogue",
-            "digital", "electronic", "device", "application", "app", "software", "program", "system",
-            "internet", "web", "online", "website", "cloud", "database", "server", "client", "interface",
-            "mobile", "phone", "tablet", "laptop", "desktop", "computer", "algorithm", "computation",
-            
-            // Common adjectives
-            "good", "bad", "better", "best", "worse", "worst", "easy", "difficult", "hard", "simple", "complex",
-            "important", "essential", "critical", "necessary", "useful", "helpful", "valuable", "worthwhile",
-            "interesting", "boring", "exciting", "engaging", "motivating", "inspiring", "challenging", "rewarding",
-            "clear", "unclear", "confusing", "ambiguous", "specific", "general", "detailed", "thorough",
-            "correct", "incorrect", "right", "wrong", "accurate", "inaccurate", "precise", "vague",
-            
-            // Quantifiers and numbers
-            "one", "two", "three", "four", "five", "six", "seven", "eight", "nine", "ten",
-            "first", "second", "third", "fourth", "fifth", "last", "next", "previous",
-            "many", "few", "several", "some", "any", "all", "none", "most", "more", "less",
-            "each", "every", "both", "either", "neither", "other", "another",
-            
-            // Other useful words
-            "way", "method", "approach", "strategy", "technique", "process", "procedure", "step",
-            "example", "instance", "case", "illustration", "demonstration", "problem", "solution", "issue", "challenge",
-            "fact", "information", "data", "evidence", "point", "detail", "aspect", "feature",
-            "idea", "concept", "theory", "principle", "rule", "law", "formula", "equation", "model",
-            "part", "section", "chapter", "unit", "module", "component", "element", "factor", "variable"
-        };
-        
-        // Build token mappings
-        for (size_t i = 0; i < vocabulary.size(); ++i) {
-            token_to_id[vocabulary[i]] = static_cast<int>(i);
-            id_to_token[static_cast<int>(i)] = vocabulary[i];
-        }
+// TVM C API entry points resolved from libtvm_runtime.so
+struct TVMRuntimeApi {
+    int (*FuncGetGlobal)(const char*, TVMFunctionHandle*) = nullptr;
+    int (*FuncCall)(TVMFunctionHandle, TVMValue*, int*, int, TVMValue*, int*) = nullptr;
+    int (*FuncFree)(TVMFunctionHandle) = nullptr;
+    int (*ModGetFunction)(TVMModuleHandle, const char*, int, TVMFunctionHandle*) = nullptr;
+    int (*ModFree)(TVMModuleHandle) = nullptr;
+    const char* (*GetLastError)() = nullptr;
+};
+static TVMRuntimeApi tvm_api;
+
+// Chat module and its decode-loop functions (prefill/decode/stopped/get_message)
+static TVMModuleHandle chat_module_handle = nullptr;
+static TVMFunctionHandle prefill_handle = nullptr;
+static TVMFunctionHandle decode_handle = nullptr;
+static TVMFunctionHandle stopped_handle = nullptr;
+static TVMFunctionHandle get_message_handle = nullptr;
+static TVMFunctionHandle set_seed_handle = nullptr;  // optional
+static TVMFunctionHandle load_json_override_handle = nullptr;  // optional
+
+// Backend requested from Kotlin (kBackendAuto defers to the config) and the device in use
+static std::atomic<int> g_compute_backend{kBackendAuto};
+static std::atomic<int> g_compute_backend_in_use{kBackendAuto};
+
+// setComputeBackend() wins over the "device" of mlc-chat-config.json; otherwise
+// the fastest backend present
+static ComputeDevice choose_compute_device(const std::string& model_dir) {
+    ComputeBackend preferred = static_cast<ComputeBackend>(g_compute_backend.load());
+    if (preferred == kBackendAuto) {
+        preferred = compute_backend_from_device(model_config::load(model_dir).device);
     }
-    
-    std::vector<int> tokenize(const std::string& text) {
-        std::vector<int> tokens;
-        std::string word;
-        
-        // Add BOS token if present in vocabulary
-        if (token_to_id.find("<bos>") != token_to_id.end()) {
-            tokens.push_back(token_to_id["<bos>"]);
-        }
-        
-        for (size_t i = 0; i < text.length(); ++i) {
-            char c = text[i];
-            
-            // Handle alphanumeric characters and apostrophes as part of words
-            if (std::isalnum(c) || c == '\'') {
-                word += std::tolower(c);
-            }
-            // Handle punctuation and spaces
-            else {
-                // Process the current word if there is one
-                if (!word.empty()) {
-                    // Check if the complete word exists in vocabulary
-                    if (token_to_id.find(word) != token_to_id.end()) {
-                        tokens.push_back(token_to_id[word]);
-                    } 
-                    // If not, try to split into known subwords
-                    else {
-                        bool found_any = false;
-                        // Try to find longest matching subwords
-                        for (size_t j = 0; j < word.length(); ) {
-                            bool found = false;
-                            // Try decreasing subword lengths
-                            for (size_t len = word.length() - j; len > 0; --len) {
-                                std::string subword = word.substr(j, len);
-                                if (token_to_id.find(subword) != token_to_id.end()) {
-                                    tokens.push_back(token_to_id[subword]);
-                                    j += len;
-                                    found = true;
-                                    found_any = true;
-                                    break;
-                                }
-                            }
-                            // If no subword matched, treat as individual characters
-                            if (!found) {
-                                char ch = word[j];
-                                std::string char_str(1, ch);
-                                if (token_to_id.find(char_str) != token_to_id.end()) {
-                                    tokens.push_back(token_to_id[char_str]);
-                                    found_any = true;
-                                }
-                                j++;
-                            }
-                        }
-                        
-                        // If we couldn't tokenize anything, use a placeholder
-                        if (!found_any && token_to_id.find("the") != token_to_id.end()) {
-                            tokens.push_back(token_to_id["the"]); // Use common word as fallback
-                        }
-                    }
-                    
-                    word.clear();
-                }
-                
-                // Handle space with special care
-                if (c == ' ') {
-                    // Just ignore spaces, the detokenizer will handle them
-                    continue;
-                }
-                
-                // Add the delimiter/punctuation if it's in the vocabulary
-                std::string delim_str(1, c);
-                if (token_to_id.find(delim_str) != token_to_id.end()) {
-                    tokens.push_back(token_to_id[delim_str]);
-                }
-            }
-        }
-        
-        // Process the last word if there is one
-        if (!word.empty()) {
-            if (token_to_id.find(word) != token_to_id.end()) {
-                tokens.push_back(token_to_id[word]);
-            } else {
-                // Same subword handling logic as above
-                bool found_any = false;
-                for (size_t j = 0; j < word.length(); ) {
-                    bool found = false;
-                    for (size_t len = word.length() - j; len > 0; --len) {
-                        std::string subword = word.substr(j, len);
-                        if (token_to_id.find(subword) != token_to_id.end()) {
-                            tokens.push_back(token_to_id[subword]);
-                            j += len;
-                            found = true;
-                            found_any = true;
-                            break;
-                        }
-                    }
-                    if (!found) {
-                        char ch = word[j];
-                        std::string char_str(1, ch);
-                        if (token_to_id.find(char_str) != token_to_id.end()) {
-                            tokens.push_back(token_to_id[char_str]);
-                            found_any = true;
-                        }
-                        j++;
-                    }
-                }
-                
-                if (!found_any && token_to_id.find("the") != token_to_id.end()) {
-                    tokens.push_back(token_to_id["the"]);
-                }
-            }
-        }
-        
-        return tokens;
+    ComputeDevice device = select_compute_device(preferred);
+    LOGI("Compute backend: %s %s", compute_backend_name(device.backend), device.name.c_str());
+    g_compute_backend_in_use = device.backend;
+    return device;
+}
+
+// Thread pool cores requested from Kotlin; auto uses what MlcLlmBridge measured for this phone
+static std::atomic<int> g_thread_affinity{kAffinityAuto};
+static std::atomic<int> g_thread_workers{0};
+
+// Before the first forward pass; this bridge does not measure, so auto without a saved choice is big+mid
+static void configure_thread_pool(const std::string& model_dir) {
+    ThreadConfig config;
+    config.affinity = static_cast<ThreadAffinity>(g_thread_affinity.load());
+    config.workers = g_thread_workers.load();
+    if (config.affinity == kAffinityAuto) {
+        load_thread_config(model_dir, &config);
     }
-    
-    std::string detokenize(const std::vector<int>& tokens) {
-        std::string text;
-        bool needs_space = false;
-        
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (id_to_token.find(tokens[i]) != id_to_token.end()) {
-                std::string token = id_to_token[tokens[i]];
-                
-                // Skip special tokens
-                if (token == "<bos>" || token == "<eos>") {
-                    continue;
-                }
-                
-                // Handle punctuation and special characters
-                bool is_punctuation = (token == "." || token == "," || token == "!" || 
-                                     token == "?" || token == ":" || token == ";" ||
-                                     token == ")" || token == "]" || token == "}" ||
-                                     token == "'" || token == "\"");
-                
-                bool is_opening = (token == "(" || token == "[" || token == "{" ||
-                                  token == "'" || token == "\"");
-                
-                // Add space before token if needed
-                if (needs_space && !is_punctuation && text.length() > 0) {
-                    text += " ";
-                }
-                
-                // Add the token
-                text += token;
-                
-                // Determine if next token needs space before it
-                needs_space = !is_punctuation && !is_opening;
-            }
-        }
-        
-        // Post-process the text to fix spacing issues
-        std::string processed_text;
-        bool last_was_space = false;
-        bool capitalize_next = true;
-        
-        for (size_t i = 0; i < text.length(); ++i) {
-            char c = text[i];
-            
-            // Handle spaces
-            if (c == ' ') {
-                if (!last_was_space) {
-                    processed_text += c;
-                }
-                last_was_space = true;
-                continue;
-            }
-            
-            // Capitalize if needed
-            if (capitalize_next && std::isalpha(c)) {
-                processed_text += std::toupper(c);
-                capitalize_next = false;
-            } else {
-                processed_text += c;
-            }
-            
-            // Check for sentence endings
-            if (c == '.' || c == '!' || c == '?') {
-                capitalize_next = true;
-            }
-            
-            last_was_space = false;
-        }
-        
-        // Final cleanup: ensure sentences end with proper punctuation
-        if (!processed_text.empty() && 
-            processed_text.back() != '.' && 
-            processed_text.back() != '!' && 
-            processed_text.back() != '?') {
-            processed_text += '.';
-        }
-        
-        return processed_text;
+    if (apply_thread_config(config.affinity, config.workers)) {
+        LOGI("Thread pool on %s cores", thread_affinity_name(config.affinity == kAffinityAuto ? kAffinityBigMid
+                                                                                              : config.affinity));
     }
-};
+}
+
+// Sampling settings the chat module currently holds
+static GenerationConfig g_module_config;
+static bool g_module_configured = false;
 
 // Global tokenizer
 static SimpleTokenizer tokenizer;
 
-// Template-based response system to use until real LLM is integrated
+// Whether chat_module_ready(), readable without g_generation_mutex
+static std::atomic<bool> g_chat_module_live{false};
+
+// One fallback answer being streamed. Each request owns its cursor, so
+// concurrent fallback streams share nothing that changes.
+struct ResponseCursor {
+    std::string text;
+    size_t position = 0;
+    
+    bool done() const { return position >= text.size(); }
+    
+    // The next piece of about `bytes` bytes, never cut inside a multi-byte character
+    std::string next(size_t bytes) {
+        if (done()) {
+            return "";
+        }
+        size_t end = utf8_boundary_at_or_after(text, std::min(position + bytes, text.size()));
+        std::string piece = text.substr(position, end - position);
+        position = end;
+        return piece;
+    }
+};
+
+// Template-based response system to use until real LLM is integrated. The
+// tables are filled once and only read afterwards; every pick draws from the
+// request's own generator, so any number of threads may answer at once.
 class TemplateResponseSystem {
 private:
     std::map<std::string, std::vector<std::string>> topicResponses;
     std::vector<std::string> defaultResponses;
     std::vector<std::string> greetingResponses;
     std::vector<std::string> questionStarters;
-    std::mt19937 rng;
     
 public:
-    TemplateResponseSystem() : rng(std::random_device()()) {
+    TemplateResponseSystem() {
         initialize();
     }
     
@@ -448,89 +271,150 @@ public:
         };
     }
     
-    std::string generateResponse(const std::string& userMessage) {
-        // Convert user message to lowercase for easier matching
-        std::string lowerUserMsg = userMessage;
-        std::transform(lowerUserMsg.begin(), lowerUserMsg.end(), lowerUserMsg.begin(), ::tolower);
+    // The answer picked with `seed`; the same seed replays the same answer
+    ResponseCursor openStream(const std::string& userMessage, uint64_t seed) const {
+        std::mt19937 rng(static_cast<std::mt19937::result_type>(seed));
+        return ResponseCursor{generateResponse(userMessage, rng), 0};
+    }
+    
+    std::string generateResponse(const std::string& userMessage, std::mt19937& rng) const {
+        // One case-insensitive pass finds every topic and intent keyword
+        uint32_t found = TopicDetector::instance().scan(userMessage);
         
         // Check for greetings
-        if (lowerUserMsg.find("hello") != std::string::npos || 
-            lowerUserMsg.find("hi ") != std::string::npos || 
-            lowerUserMsg.find("hey") != std::string::npos ||
-            lowerUserMsg == "hi") {
-            
-            return getRandomResponse(greetingResponses);
+        bool isBareHi = userMessage.size() == 2 && std::tolower(static_cast<unsigned char>(userMessage[0])) == 'h' &&
+                        std::tolower(static_cast<unsigned char>(userMessage[1])) == 'i';
+        if ((found & kIntentGreeting) || isBareHi) {
+            return getRandomResponse(greetingResponses, rng);
         }
         
         // Check if it's a question
-        bool isQuestion = (lowerUserMsg.find("?") != std::string::npos) || 
-                         (lowerUserMsg.find("what") != std::string::npos) ||
-                         (lowerUserMsg.find("how") != std::string::npos) ||
-                         (lowerUserMsg.find("why") != std::string::npos) ||
-                         (lowerUserMsg.find("when") != std::string::npos) ||
-                         (lowerUserMsg.find("where") != std::string::npos) ||
-                         (lowerUserMsg.find("who") != std::string::npos) ||
-                         (lowerUserMsg.find("which") != std::string::npos) ||
-                         (lowerUserMsg.find("can you") != std::string::npos) ||
-                         (lowerUserMsg.find("could you") != std::string::npos);
-        
-        // Check for subject/topic matches
-        for (const auto& topic : topicResponses) {
-            if (lowerUserMsg.find(topic.first) != std::string::npos) {
+        bool isQuestion = (found & kIntentQuestion) != 0;
+        
+        // Check for subject/topic matches, in the same priority order as before
+        static const std::pair<uint32_t, const char*> kTopicOrder[] = {
+            {kTopicEnglish, "english"}, {kTopicHistory, "history"}, {kTopicMath, "math"},
+            {kTopicPhysics, "physics"}, {kTopicProgramming, "programming"}, {kTopicScience, "science"},
+        };
+        for (const auto& topic : kTopicOrder) {
+            if (found & topic.first) {
                 std::string response = isQuestion ? 
-                    getRandomResponse(questionStarters) : "";
-                return response + getRandomResponse(topic.second);
+                    getRandomResponse(questionStarters, rng) : "";
+                return response + getRandomResponse(topicResponses.at(topic.second), rng);
             }
         }
         
         // If it's a question but no specific topic detected
         if (isQuestion) {
-            return getRandomResponse(questionStarters) + getRandomResponse(defaultResponses);
+            return getRandomResponse(questionStarters, rng) + getRandomResponse(defaultResponses, rng);
         }
         
         // Default response
-        return getRandomResponse(defaultResponses);
+        return getRandomResponse(defaultResponses, rng);
     }
     
-    std::string getRandomResponse(const std::vector<std::string>& responses) {
+    static std::string getRandomResponse(const std::vector<std::string>& responses, std::mt19937& rng) {
         std::uniform_int_distribution<int> dist(0, responses.size() - 1);
         return responses[dist(rng)];
     }
-    
-    std::string generateStreamingToken(const std::string& userMessage, bool isFirst, bool isLast) {
-        // For streaming, we'll just generate the complete response and pretend we're streaming
-        // This is a placeholder until real token-by-token generation is implemented
-        static std::string fullResponse;
-        static size_t position = 0;
-        
-        if (isFirst) {
-            // Generate a new complete response at the start
-            fullResponse = generateResponse(userMessage);
-            position = 0;
-        }
-        
-        if (isLast || position >= fullResponse.length()) {
-            // End of streaming
-            std::string remaining = position < fullResponse.length() ? 
-                fullResponse.substr(position) : "";
-            position = 0;
-            return remaining;
-        }
-        
-        // Return the next few characters to simulate token streaming
-        size_t tokenLength = std::min(static_cast<size_t>(3), fullResponse.length() - position);
-        std::string token = fullResponse.substr(position, tokenLength);
-        position += tokenLength;
-        return token;
-    }
 };
 
 // Global response system
 static TemplateResponseSystem responseSystem;
 
-// Global callback for streaming generation
-static jobject g_streaming_callback = nullptr;
-static jmethodID g_streaming_method = nullptr;
+// One in-flight streaming request. The generation thread owns the callback global
+// ref; stopStreamingGeneration only flips the cancellation flag.
+struct StreamingRequest {
+    std::atomic<bool> cancelled{false};
+    int64_t id = 0;  // the caller's id for framed ring streams, 0 otherwise
+    jobject callback = nullptr;
+    jmethodID method = nullptr;
+};
+
+// The request currently being streamed, if any
+static std::mutex g_streaming_mutex;
+static std::shared_ptr<StreamingRequest> g_active_stream;
+
+// Serializes access to the chat module between generation threads
+static std::mutex g_generation_mutex;
+
+// Ring shared with Kotlin as a direct ByteBuffer for batched token delivery
+static std::unique_ptr<TokenRing> g_token_ring;
+
+// Delivery metrics of the most recent callback stream, read by getDeliveryStats
+static std::mutex g_delivery_mutex;
+static DeliveryStats g_last_delivery_stats;
+
+static void record_delivery_stats(const DeliveryStats& stats) {
+    std::lock_guard<std::mutex> lock(g_delivery_mutex);
+    g_last_delivery_stats = stats;
+}
+
+// Negative values from Java keep the default (one frame / 8 tokens)
+static DeliveryPolicy delivery_policy_from(jint interval_us, jint max_tokens) {
+    DeliveryPolicy policy;
+    if (interval_us >= 0) {
+        policy.interval_us = interval_us;
+    }
+    if (max_tokens > 0) {
+        policy.max_tokens = static_cast<uint32_t>(max_tokens);
+    }
+    return policy;
+}
+
+// Background warm start. The warmup thread holds g_generation_mutex while it works
+// and checks g_warmup_yield between stages, so a real request takes over quickly.
+static std::atomic<bool> g_warmup_running{false};
+static std::atomic<bool> g_warmup_yield{false};
+static std::string g_warm_model_path;  // model the loaded chat module belongs to; guarded by g_generation_mutex
+
+// Every streaming request runs on this one thread, attached to the JVM once.
+// Never destroyed: it stays attached for the life of the process.
+static GenerationWorker& generation_worker() {
+    static GenerationWorker* worker = new GenerationWorker("StreamingGenerationThread");
+    return *worker;
+}
+
+// Fallback answers stream on these instead, taking turns, so they wait
+// neither for a cold load holding g_generation_mutex nor for each other
+static constexpr size_t kFallbackWorkers = 2;
+
+static GenerationWorker& fallback_worker() {
+    static GenerationWorker* workers[kFallbackWorkers] = {new GenerationWorker("FallbackStreamThread0"),
+                                                          new GenerationWorker("FallbackStreamThread1")};
+    static std::atomic<size_t> next{0};
+    return *workers[next.fetch_add(1, std::memory_order_relaxed) % kFallbackWorkers];
+}
+
+// Drop `request` as the active stream if it still is
+static void finish_request(const std::shared_ptr<StreamingRequest>& request) {
+    std::lock_guard<std::mutex> lock(g_streaming_mutex);
+    if (g_active_stream == request) {
+        g_active_stream.reset();
+    }
+}
+
+// Build a jstring from standard UTF-8. NewStringUTF expects modified UTF-8 and
+// rejects supplementary characters and malformed bytes.
+static jstring new_jstring_utf8(JNIEnv* env, const std::string& text) {
+    std::u16string utf16;
+    utf8_to_utf16(text, utf16);
+    return env->NewString(reinterpret_cast<const jchar*>(utf16.data()), static_cast<jsize>(utf16.size()));
+}
+
+// Seed for one request: `request_seed` if given, else the configured seed, else fresh entropy.
+// Logged so any run can be replayed by passing the same value back in.
+static uint64_t resolve_request_seed(int64_t request_seed = -1) {
+    int64_t fixed = request_seed >= 0 ? request_seed : g_generation_seed.load(std::memory_order_relaxed);
+    if (fixed >= 0) {
+        LOGI("Request seed: %lld", static_cast<long long>(fixed));
+        return static_cast<uint64_t>(fixed);
+    }
+    std::random_device entropy;
+    uint64_t seed = ((static_cast<uint64_t>(entropy()) << 32) | entropy()) & INT64_MAX;
+    LOGI("Request seed: %llu (random)", static_cast<unsigned long long>(seed));
+    return seed;
+}
 
 // Check if a file exists
 bool file_exists(const char* path) {
@@ -546,17 +430,24 @@ void list_directory(const char* path) {
         return;
     }
     
-    LOGD("Directory contents of %s:", path);
+    LOGI("Directory contents of %s:", path);
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
-        LOGD("  %s", entry->d_name);
+        LOGI("  %s", entry->d_name);
     }
     closedir(dir);
 }
 
+// Handle of a library this one links against. It is mapped and relocated
+// already, so RTLD_NOLOAD just returns it; a full load is only the fallback.
+static void* linked_library(const char* lib_name) {
+    void* handle = dlopen(lib_name, RTLD_NOLOAD | RTLD_LAZY);
+    return handle != nullptr ? handle : dlopen(lib_name, RTLD_LAZY);
+}
+
 // Try to dlopen a library and report result
 void* try_dlopen_with_handle(const char* lib_name) {
-    void* handle = dlopen(lib_name, RTLD_NOW);
+    void* handle = linked_library(lib_name);
     if (handle == NULL) {
         LOGE("Failed to load %s: %s", lib_name, dlerror());
         return nullptr;
@@ -565,6 +456,283 @@ void* try_dlopen_with_handle(const char* lib_name) {
     return handle;
 }
 
+// Call a chat module function and log the TVM error on failure
+static bool call_chat_function(TVMFunctionHandle fn, TVMValue* args, int* type_codes, int num_args,
+                               TVMValue* ret, int* ret_type_code) {
+    if (fn == nullptr || tvm_api.FuncCall == nullptr) {
+        return false;
+    }
+    if (tvm_api.FuncCall(fn, args, type_codes, num_args, ret, ret_type_code) != 0) {
+        LOGE("TVM call failed: %s", tvm_api.GetLastError ? tvm_api.GetLastError() : "unknown error");
+        return false;
+    }
+    return true;
+}
+
+// True when the loaded chat module exposes everything the decode loop needs
+static bool chat_module_ready() {
+    return chat_module_handle != nullptr && prefill_handle != nullptr && decode_handle != nullptr &&
+           stopped_handle != nullptr && get_message_handle != nullptr;
+}
+
+// Release the chat module and every function handle obtained from it
+static void release_chat_module() {
+    TVMFunctionHandle* handles[] = {&prefill_handle, &decode_handle, &stopped_handle,
+                                    &get_message_handle, &reset_chat_handle, &set_seed_handle,
+                                    &load_json_override_handle};
+    for (TVMFunctionHandle* handle : handles) {
+        if (*handle != nullptr && tvm_api.FuncFree != nullptr) {
+            tvm_api.FuncFree(*handle);
+        }
+        *handle = nullptr;
+    }
+    if (chat_module_handle != nullptr && tvm_api.ModFree != nullptr) {
+        tvm_api.ModFree(chat_module_handle);
+    }
+    chat_module_handle = nullptr;
+    g_module_configured = false;
+    g_chat_module_live.store(false);
+}
+
+// Create the MLC chat module through the TVM C API and resolve its decode-loop functions
+static bool load_chat_module(const std::string& model_dir) {
+    TraceSection trace("mlc:load:create_module");
+    if (tvm_handle == nullptr) {
+        return false;
+    }
+    
+    tvm_api.FuncGetGlobal = (int (*)(const char*, TVMFunctionHandle*))dlsym(tvm_handle, "TVMFuncGetGlobal");
+    tvm_api.FuncCall = (int (*)(TVMFunctionHandle, TVMValue*, int*, int, TVMValue*, int*))dlsym(tvm_handle, "TVMFuncCall");
+    tvm_api.FuncFree = (int (*)(TVMFunctionHandle))dlsym(tvm_handle, "TVMFuncFree");
+    tvm_api.ModGetFunction = (int (*)(TVMModuleHandle, const char*, int, TVMFunctionHandle*))dlsym(tvm_handle, "TVMModGetFunction");
+    tvm_api.ModFree = (int (*)(TVMModuleHandle))dlsym(tvm_handle, "TVMModFree");
+    tvm_api.GetLastError = (const char* (*)())dlsym(tvm_handle, "TVMGetLastError");
+    
+    if (!tvm_api.FuncGetGlobal || !tvm_api.FuncCall || !tvm_api.ModGetFunction) {
+        LOGE("TVM C API not available in libtvm_runtime.so");
+        return false;
+    }
+    
+    TVMFunctionHandle create_handle = nullptr;
+    if (tvm_api.FuncGetGlobal("mlc.create_chat_module", &create_handle) != 0 || create_handle == nullptr) {
+        LOGW("mlc.create_chat_module is not registered; streaming uses the placeholder responder");
+        return false;
+    }
+    
+    // Create on the chosen device; a create function that only takes the model
+    // directory rejects the device arguments and picks its own device
+    ComputeDevice compute = choose_compute_device(model_dir);
+    configure_thread_pool(model_dir);
+    TVMValue args[3];
+    int arg_codes[3] = {kTVMStr, kDLInt, kDLInt};
+    args[0].v_str = model_dir.c_str();
+    args[1].v_int64 = static_cast<int64_t>(compute.device.device_type);
+    args[2].v_int64 = compute.device.device_id;
+    TVMValue ret;
+    int ret_code = kTVMNullptr;
+    bool created = tvm_api.FuncCall(create_handle, args, arg_codes, 3, &ret, &ret_code) == 0 &&
+                   ret_code == kTVMModuleHandle;
+    if (!created) {
+        LOGI("Chat module create takes no device; the module picks its own");
+        created = call_chat_function(create_handle, args, arg_codes, 1, &ret, &ret_code) &&
+                  ret_code == kTVMModuleHandle;
+    }
+    if (!created) {
+        LOGE("Failed to create chat module for %s", model_dir.c_str());
+        return false;
+    }
+    chat_module_handle = ret.v_handle;
+    
+    tvm_api.ModGetFunction(chat_module_handle, "prefill", 0, &prefill_handle);
+    tvm_api.ModGetFunction(chat_module_handle, "decode", 0, &decode_handle);
+    tvm_api.ModGetFunction(chat_module_handle, "stopped", 0, &stopped_handle);
+    tvm_api.ModGetFunction(chat_module_handle, "get_message", 0, &get_message_handle);
+    tvm_api.ModGetFunction(chat_module_handle, "reset_chat", 0, &reset_chat_handle);
+    tvm_api.ModGetFunction(chat_module_handle, "set_seed", 0, &set_seed_handle);
+    tvm_api.ModGetFunction(chat_module_handle, "load_json_override", 0, &load_json_override_handle);
+    
+    if (!chat_module_ready()) {
+        LOGW("Chat module does not expose prefill/decode/stopped/get_message");
+        release_chat_module();
+        return false;
+    }
+    
+    LOGI("Chat module loaded with token-level decode support");
+    g_chat_module_live.store(true);
+    return true;
+}
+
+// Push `config` into the chat module in one load_json_override call, skipped when
+// the module already has these settings
+static void apply_generation_config(const GenerationConfig& config) {
+    if (load_json_override_handle == nullptr || (g_module_configured && g_module_config.same_sampling(config))) {
+        return;
+    }
+    std::string override_json = config.to_override_json();
+    TVMValue args[2];
+    int codes[2] = {kTVMStr, kDLInt};
+    args[0].v_str = override_json.c_str();
+    args[1].v_int64 = 1;  // partial update
+    TVMValue ret;
+    int ret_code;
+    if (call_chat_function(load_json_override_handle, args, codes, 2, &ret, &ret_code)) {
+        g_module_config = config;
+        g_module_configured = true;
+    }
+}
+
+// Stage latencies of the requests served here, for getMetrics()
+static LatencyMetrics& latency_metrics() {
+    static LatencyMetrics* metrics = new LatencyMetrics();
+    return *metrics;
+}
+
+// Drive the real decode loop: prefill the prompt, then decode one token per step and
+// hand each newly produced piece of text to emit(text, is_last). `config` is the
+// request's sampling snapshot; null takes the current defaults. `timing`, when
+// given, gets the stage timestamps; the caller records it.
+// The loop checks `cancelled` at every token boundary and stops there; a cancelled
+// turn is dropped from the chat module so its KV is released.
+// Returns false if the chat module is unavailable or a call fails.
+static bool stream_with_chat_module(const std::string& prompt, int max_tokens,
+                                    const std::function<void(const std::string&, bool)>& emit,
+                                    const std::atomic<bool>* cancelled = nullptr,
+                                    int64_t seed = -1,
+                                    const GenerationConfig* config = nullptr,
+                                    RequestTiming* timing = nullptr) {
+    if (!chat_module_ready()) {
+        return false;
+    }
+    if (timing != nullptr) {
+        timing->admit();
+    }
+    
+    apply_generation_config(config != nullptr ? *config : current_generation_config());
+    
+    const int limit = max_tokens > 0 ? max_tokens : INT_MAX;
+    TVMValue arg;
+    int arg_code = kTVMStr;
+    arg.v_str = prompt.c_str();
+    TVMValue ret;
+    int ret_code;
+    
+    // Reseed the module's sampler so the request is reproducible from its seed
+    if (set_seed_handle != nullptr) {
+        TVMValue seed_arg;
+        int seed_code = kDLInt;
+        seed_arg.v_int64 = static_cast<int64_t>(resolve_request_seed(seed));
+        call_chat_function(set_seed_handle, &seed_arg, &seed_code, 1, &ret, &ret_code);
+    }
+    
+    // prefill() also decodes the first token of the answer
+    if (timing != nullptr) {
+        timing->begin_prefill();
+        timing->prompt_tokens = prompt.size() / 4 + 1;  // the module tokenizes; about 4 bytes a token
+    }
+    {
+        TraceSection trace("mlc:prefill");
+        if (!call_chat_function(prefill_handle, &arg, &arg_code, 1, &ret, &ret_code)) {
+            return false;
+        }
+    }
+    if (timing != nullptr) {
+        timing->end_prefill();
+        timing->token();
+    }
+    
+    size_t emitted = 0;
+    int produced = 1;
+    while (true) {
+        std::string message;
+        {
+            TraceSection trace("mlc:detokenize");
+            if (!call_chat_function(get_message_handle, nullptr, nullptr, 0, &ret, &ret_code)) {
+                return false;
+            }
+            message = (ret_code == kTVMStr && ret.v_str != nullptr) ? ret.v_str : "";
+        }
+        
+        if (!call_chat_function(stopped_handle, nullptr, nullptr, 0, &ret, &ret_code)) {
+            return false;
+        }
+        bool was_cancelled = cancelled != nullptr && cancelled->load(std::memory_order_relaxed);
+        bool finished = ret.v_int64 != 0 || produced >= limit || was_cancelled;
+        
+        // Hold back a code point the detokenizer has only partly produced
+        size_t ready = finished ? message.length() : utf8_complete_prefix(message);
+        std::string delta = ready > emitted ? message.substr(emitted, ready - emitted) : "";
+        emitted = std::max(emitted, ready);
+        if (!delta.empty() || finished) {
+            emit(delta, finished);
+        }
+        if (finished) {
+            if (was_cancelled && reset_chat_handle != nullptr) {
+                LOGI("Generation cancelled after %d tokens, releasing KV", produced);
+                call_chat_function(reset_chat_handle, nullptr, nullptr, 0, &ret, &ret_code);
+            }
+            return true;
+        }
+        
+        {
+            TraceSection trace("mlc:decode");
+            if (!call_chat_function(decode_handle, nullptr, nullptr, 0, &ret, &ret_code)) {
+                return false;
+            }
+        }
+        produced++;
+        if (timing != nullptr) {
+            timing->token();
+        }
+    }
+}
+
+// Warm the engine for `model_path`: open the runtime libraries, create the chat
+// module (maps the weights) and run one throwaway prefill/decode so kernels are
+// compiled and first-use caches are hot. Caller holds g_generation_mutex.
+static void run_warmup(const std::string& model_path) {
+    // Load at background priority; the chat module is reused by initializeTVMRuntime
+    setpriority(PRIO_PROCESS, 0, 10);
+    
+    if (!tvm_handle) {
+        tvm_handle = linked_library("libtvm_runtime.so");
+    }
+    if (!mlc_handle) {
+        mlc_handle = linked_library("libmlc_llm.so");
+    }
+    if (!tvm_handle || g_warmup_yield.load()) {
+        return;
+    }
+    
+    if (g_warm_model_path != model_path || !chat_module_ready()) {
+        release_chat_module();
+        g_warm_model_path.clear();
+        if (!load_chat_module(model_path)) {
+            LOGW("Warmup could not create the chat module for %s", model_path.c_str());
+            return;
+        }
+        g_warm_model_path = model_path;
+    }
+    if (g_warmup_yield.load()) {
+        return;
+    }
+    
+    // Back to normal priority before the first kernels run: TVM's worker pool is
+    // spawned from this thread and would otherwise inherit the background nice value
+    setpriority(PRIO_PROCESS, 0, 0);
+    
+    auto start = std::chrono::steady_clock::now();
+    bool ok = stream_with_chat_module("Hi", 2, [](const std::string&, bool) {}, &g_warmup_yield, 0);
+    if (ok && !g_warmup_yield.load() && reset_chat_handle != nullptr) {
+        // Drop the dummy turn so the first real conversation starts empty
+        TVMValue ret;
+        int ret_code;
+        call_chat_function(reset_chat_handle, nullptr, nullptr, 0, &ret, &ret_code);
+    }
+    long ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    LOGI("Warmup step %s in %ld ms", ok ? "finished" : "failed", ms);
+}
+
 // Initialize the real MLC-LLM model
 bool initialize_mlc_llm(const std::string& model_dir) {
     LOGI("Initializing real MLC-LLM model from %s", model_dir.c_str());
@@ -613,12 +781,15 @@ bool initialize_mlc_llm(const std::string& model_dir) {
         // - Look for model weights and other files
         // - Call the appropriate TVM/MLC-LLM APIs to load the model
         
-        // Create a DLDevice for CPU
-        DLDevice dev = {kDLCPU, 0};
+        // Pick the fastest device present unless one was requested
+        choose_compute_device(model_dir);
+        configure_thread_pool(model_dir);
         
         // 2. Initialize TVMModule
         TVMModuleHandle mod_handle;
-        std::string model_lib_path = model_dir + "/lib/libgemma-2b-it-q4f16_1.so";
+        std::string lib_dir = model_dir + "/lib";
+        std::string model_lib_path =
+            select_model_lib(lib_dir, model_lib_base(lib_dir, model_config::load(model_dir).model_lib));
         if (file_exists(model_lib_path.c_str())) {
             int status = TVMModLoad(model_lib_path.c_str(), 0, &mod_handle);
             if (status != 0) {
@@ -664,7 +835,7 @@ std::string generate_with_mlc_llm(const std::string& prompt, int max_tokens) {
     }
     
     try {
-        LOGI("Generating text with MLC-LLM for prompt: %s", prompt.c_str());
+        LOGV("Generating text with MLC-LLM for prompt: %s", prompt.c_str());
         
         // In a complete implementation, you would:
         // 1. Prepare the input prompt in the format expected by the model
@@ -695,12 +866,42 @@ std::string generate_with_mlc_llm(const std::string& prompt, int max_tokens) {
 // Implementation of JNI methods
 extern "C" {
 
+// Pin the classes and method IDs used on the request path
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* /* reserved */) {
+    return jni_cache_on_load(vm);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_logDiagnostics(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring model_path_jstring) {
+    std::string model_path = jni_utf8(env, model_path_jstring);
+    LOGI("Contents of model directory:");
+    list_directory(model_path.c_str());
+    LOGI("Contents of lib directory (if exists):");
+    list_directory((model_path + "/lib").c_str());
+    
+    model_manifest::Manifest manifest = model_manifest::read(model_path);
+    if (manifest.loaded()) {
+        for (const std::string& name : model_manifest::verify(model_path, manifest, false)) {
+            LOGW("Differs from the model manifest: %s", name.c_str());
+        }
+    } else {
+        LOGI("No model manifest in %s", model_path.c_str());
+    }
+}
+
 JNIEXPORT jboolean JNICALL
 Java_com_example_studybuddy_ml_TVMBridge_initializeTVMRuntime(
         JNIEnv* env,
         jobject /* this */,
         jstring model_path_jstring) {
     try {
+        // A real request takes over from any background warmup
+        g_warmup_yield.store(true);
+        std::lock_guard<std::mutex> generation_lock(g_generation_mutex);
+        
         // Reset state
         model_loaded = false;
         
@@ -710,17 +911,16 @@ Java_com_example_studybuddy_ml_TVMBridge_initializeTVMRuntime(
         env->ReleaseStringUTFChars(model_path_jstring, model_path_cstr);
         
         LOGI("Initializing real MLC-LLM model from %s", model_path.c_str());
-        
-        // Log all directory contents
-        LOGI("Contents of model directory:");
-        list_directory(model_path.c_str());
-        
-        std::string lib_dir = model_path + "/lib";
-        LOGI("Contents of lib directory (if exists):");
-        list_directory(lib_dir.c_str());
+        // The directory listings moved to logDiagnostics()
+        if (!weight_delta::recover(model_path)) {
+            LOGE("Unfinished weight update in %s", model_path.c_str());
+        }
+        model_manifest::Manifest manifest = model_manifest::read(model_path);
         
         // Load the TVM runtime library
-        tvm_handle = dlopen("libtvm_runtime.so", RTLD_LAZY);
+        if (!tvm_handle) {
+            tvm_handle = linked_library("libtvm_runtime.so");
+        }
         if (!tvm_handle) {
             LOGE("Failed to load libtvm_runtime.so: %s", dlerror());
             // Continue anyway - we'll use the placeholder model
@@ -729,7 +929,9 @@ Java_com_example_studybuddy_ml_TVMBridge_initializeTVMRuntime(
         }
         
         // Load the MLC LLM library
-        mlc_handle = dlopen("libmlc_llm.so", RTLD_LAZY);
+        if (!mlc_handle) {
+            mlc_handle = linked_library("libmlc_llm.so");
+        }
         if (!mlc_handle) {
             LOGE("Failed to load libmlc_llm.so: %s", dlerror());
             // Continue anyway - we'll use the placeholder model
@@ -737,12 +939,15 @@ Java_com_example_studybuddy_ml_TVMBridge_initializeTVMRuntime(
             LOGI("Successfully loaded libmlc_llm.so");
         }
         
-        // Verify model files are available - only need minimal files now
+        // Verify model files are available - only need minimal files now, taken
+        // from the manifest when the download wrote one
         struct stat buffer;
-        bool config_exists = (stat((model_path + "/config.json").c_str(), &buffer) == 0);
+        bool config_exists = manifest.loaded() ? manifest.find("config.json") != nullptr
+                                               : stat((model_path + "/config.json").c_str(), &buffer) == 0;
         
         // Check for at least one parameter file (instead of all 38)
-        bool param_exists = (stat((model_path + "/params_shard_0.bin").c_str(), &buffer) == 0);
+        bool param_exists = manifest.loaded() ? manifest.find("params_shard_0.bin") != nullptr
+                                              : stat((model_path + "/params_shard_0.bin").c_str(), &buffer) == 0;
         
         LOGI("File check results - config: %d, params: %d", config_exists, param_exists);
         
@@ -752,6 +957,20 @@ Java_com_example_studybuddy_ml_TVMBridge_initializeTVMRuntime(
             return JNI_FALSE;
         }
         
+        // Create the chat module so streaming can run the real decode loop,
+        // reusing the one the warm start already loaded for this model
+        if (g_warm_model_path == model_path && chat_module_ready()) {
+            LOGI("Reusing warmed chat module for %s", model_path.c_str());
+        } else {
+            release_chat_module();
+            g_warm_model_path.clear();
+            if (load_chat_module(model_path)) {
+                g_warm_model_path = model_path;
+            } else {
+                LOGW("Real decode loop unavailable; streaming will use the placeholder responder");
+            }
+        }
+        
         // Since we've verified necessary files exist, mark the model as loaded
         model_loaded = true;
         
@@ -776,11 +995,9 @@ Java_com_example_studybuddy_ml_TVMBridge_generateResponse(
         }
         
         // Get the prompt
-        const char* prompt_cstr = env->GetStringUTFChars(prompt_jstring, nullptr);
-        std::string prompt(prompt_cstr);
-        env->ReleaseStringUTFChars(prompt_jstring, prompt_cstr);
+        std::string prompt = jni_utf8(env, prompt_jstring);
         
-        LOGI("Generating response for prompt: %s", prompt.c_str());
+        LOGV("Generating response for prompt: %s", prompt.c_str());
         
         // Simplified implementation for text generation
         std::string response = "I'm using the simplified Gemma 2B-IT LLM implementation. ";
@@ -798,7 +1015,7 @@ Java_com_example_studybuddy_ml_TVMBridge_generateResponse(
             response += "I'm still learning but I'll do my best to assist you.";
         }
         
-        LOGI("Generated response: %s", response.c_str());
+        LOGV("Generated response: %s", response.c_str());
         
         // Return the response
         return env->NewStringUTF(response.c_str());
@@ -813,11 +1030,12 @@ Java_com_example_studybuddy_ml_TVMBridge_streamResponse(
         JNIEnv* env,
         jobject /* this */,
         jstring prompt_jstring,
+        jint flush_interval_us,
+        jint max_batch_tokens,
         jobject callback) {
     // Check if model is loaded
     if (!model_loaded) {
-        jclass callbackClass = env->GetObjectClass(callback);
-        jmethodID callbackMethod = env->GetMethodID(callbackClass, "invoke", "(Ljava/lang/Object;)Ljava/lang/Object;");
+        jmethodID callbackMethod = jni_function1_invoke(env, callback);
         jstring errorMessage = env->NewStringUTF("ERROR: Model not initialized. Please load the model first.");
         env->CallObjectMethod(callback, callbackMethod, errorMessage);
         env->DeleteLocalRef(errorMessage);
@@ -825,16 +1043,41 @@ Java_com_example_studybuddy_ml_TVMBridge_streamResponse(
     }
     
     // Get the prompt
-    const char* prompt_cstr = env->GetStringUTFChars(prompt_jstring, nullptr);
-    std::string prompt(prompt_cstr);
-    env->ReleaseStringUTFChars(prompt_jstring, prompt_cstr);
+    std::string prompt = jni_utf8(env, prompt_jstring);
     
-    LOGI("Starting streaming generation for prompt: %s", prompt.c_str());
+    LOGV("Starting streaming generation for prompt: %s", prompt.c_str());
     
     // Simplified LLM implementation
     try {
-        jclass callbackClass = env->GetObjectClass(callback);
-        jmethodID callbackMethod = env->GetMethodID(callbackClass, "invoke", "(Ljava/lang/Object;)Ljava/lang/Object;");
+        jmethodID callbackMethod = jni_function1_invoke(env, callback);
+        
+        // Stream tokens from the real decode loop, coalesced per the request's policy
+        if (chat_module_ready()) {
+            RequestTiming timing;
+            std::lock_guard<std::mutex> generation_lock(g_generation_mutex);
+            TokenCoalescer coalescer(delivery_policy_from(flush_interval_us, max_batch_tokens),
+                                     [env, callback, callbackMethod](const std::string& text, bool) {
+                if (text.empty()) {
+                    return;
+                }
+                jstring jtext = new_jstring_utf8(env, text);
+                env->CallObjectMethod(callback, callbackMethod, jtext);
+                env->DeleteLocalRef(jtext);
+            });
+            bool ok = stream_with_chat_module(prompt, 0, [&coalescer](const std::string& text, bool is_last) {
+                coalescer.add(text, is_last);
+            }, nullptr, -1, nullptr, &timing);
+            coalescer.finish(false);
+            record_delivery_stats(coalescer.stats());
+            timing.ok = ok;
+            latency_metrics().record(timing);
+            if (!ok) {
+                jstring jerror = env->NewStringUTF("ERROR: Generation failed in the chat module");
+                env->CallObjectMethod(callback, callbackMethod, jerror);
+                env->DeleteLocalRef(jerror);
+            }
+            return;
+        }
             
         // Process the prompt and generate a simple response
         std::string response = "I'm ";
@@ -900,8 +1143,7 @@ Java_com_example_studybuddy_ml_TVMBridge_streamResponse(
         }
     } catch (const std::exception& e) {
         LOGE("Error in streaming: %s", e.what());
-        jclass callbackClass = env->GetObjectClass(callback);
-        jmethodID callbackMethod = env->GetMethodID(callbackClass, "invoke", "(Ljava/lang/Object;)Ljava/lang/Object;");
+        jmethodID callbackMethod = jni_function1_invoke(env, callback);
         jstring error_msg = env->NewStringUTF(("Error in streaming: " + std::string(e.what())).c_str());
         env->CallObjectMethod(callback, callbackMethod, error_msg);
         env->DeleteLocalRef(error_msg);
@@ -910,18 +1152,24 @@ Java_com_example_studybuddy_ml_TVMBridge_streamResponse(
 
 JNIEXPORT jboolean JNICALL
 Java_com_example_studybuddy_ml_TVMBridge_setGenerationTemperature(JNIEnv* env, jclass clazz, jfloat value) {
-    temperature = value;
-    LOGI("Temperature set to: %f", temperature);
+    g_generation_config.update([value](GenerationConfig& config) { config.temperature = value; });
+    LOGI("Temperature set to: %f", value);
     return JNI_TRUE;
 }
 
 JNIEXPORT jboolean JNICALL
 Java_com_example_studybuddy_ml_TVMBridge_setGenerationTopP(JNIEnv* env, jclass clazz, jfloat value) {
-    top_p = value;
-    LOGI("Top-p set to: %f", top_p);
+    g_generation_config.update([value](GenerationConfig& config) { config.top_p = value; });
+    LOGI("Top-p set to: %f", value);
     return JNI_TRUE;
 }
 
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_setGenerationSeed(JNIEnv* env, jclass clazz, jlong seed) {
+    g_generation_seed.store(seed < 0 ? -1 : static_cast<int64_t>(seed));
+    LOGI("Generation seed set to: %lld", static_cast<long long>(seed));
+}
+
 JNIEXPORT jboolean JNICALL
 Java_com_example_studybuddy_ml_TVMBridge_resetChatSession(JNIEnv* env, jclass clazz) {
     LOGI("Resetting chat session");
@@ -932,193 +1180,529 @@ JNIEXPORT void JNICALL
 Java_com_example_studybuddy_ml_TVMBridge_destroyRuntime(JNIEnv* env, jclass clazz) {
     LOGI("Destroying MLC-LLM runtime");
     model_loaded = false;
-    // No real cleanup needed for our Markov chain model
+    {
+        // The stream in flight stops at its next token and a warmup at its next
+        // step, instead of holding the module
+        g_warmup_yield.store(true);
+        std::lock_guard<std::mutex> lock(g_streaming_mutex);
+        if (g_active_stream) {
+            g_active_stream->cancelled.store(true, std::memory_order_relaxed);
+        }
+    }
+    // Module calls belong to whoever holds g_generation_mutex
+    std::lock_guard<std::mutex> generation_lock(g_generation_mutex);
+    release_chat_module();
+    g_warm_model_path.clear();
 }
 
 JNIEXPORT jboolean JNICALL
-Java_com_example_studybuddy_ml_TVMBridge_startStreamingGeneration(JNIEnv* env, jclass clazz, jstring jPrompt, jint maxTokens, jobject callback) {
-    if (!model_loaded) {
-        LOGE("Model not initialized for streaming generation");
+Java_com_example_studybuddy_ml_TVMBridge_warmStart(JNIEnv* env, jobject thiz, jstring jModelPath) {
+    if (model_loaded || g_warmup_running.exchange(true)) {
         return JNI_FALSE;
     }
     
-    // Store the callback object and method globally (we'll need to release it later)
-    if (g_streaming_callback != nullptr) {
-        env->DeleteGlobalRef(g_streaming_callback);
-        g_streaming_callback = nullptr;
+    const char* path_cstr = env->GetStringUTFChars(jModelPath, nullptr);
+    std::string model_path(path_cstr);
+    env->ReleaseStringUTFChars(jModelPath, path_cstr);
+    g_warmup_yield.store(false);
+    
+    // Warm on the generation worker itself, so the thread that serves the first
+    // request already has hot caches
+    bool queued = generation_worker().submit(nullptr, [model_path](JNIEnv*) {
+        {
+            std::lock_guard<std::mutex> generation_lock(g_generation_mutex);
+            if (!g_warmup_yield.load() && !model_loaded) {
+                LOGI("Warm start for %s", model_path.c_str());
+                run_warmup(model_path);
+            }
+        }
+        // run_warmup may stop early at background priority; the worker must not stay there
+        setpriority(PRIO_PROCESS, 0, 0);
+        g_warmup_running.store(false);
+    });
+    if (!queued) {
+        g_warmup_running.store(false);
+    }
+    return queued ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_cancelWarmup(JNIEnv* env, jobject thiz, jboolean releaseIfUnused) {
+    g_warmup_yield.store(true);
+    if (!releaseIfUnused) {
+        return;
     }
     
-    g_streaming_callback = env->NewGlobalRef(callback);
-    if (g_streaming_callback == nullptr) {
-        LOGE("Failed to create global reference for callback");
+    // Never block the caller (onTrimMemory runs on the main thread)
+    std::unique_lock<std::mutex> generation_lock(g_generation_mutex, std::try_to_lock);
+    if (generation_lock.owns_lock() && !model_loaded && chat_module_ready()) {
+        LOGI("Releasing unused warmed chat module under memory pressure");
+        release_chat_module();
+        g_warm_model_path.clear();
+    }
+}
+
+// Deliver one token to the request's callback
+static void deliver_token(JNIEnv* env, const StreamingRequest& request, const std::string& text, bool is_last) {
+    TraceSection trace("mlc:deliver");
+    jstring jToken = new_jstring_utf8(env, text);
+    env->CallVoidMethod(request.callback, request.method, jToken, is_last ? JNI_TRUE : JNI_FALSE);
+    env->DeleteLocalRef(jToken);
+}
+
+// Stream a pre-built response in fixed-size chunks, stopping early on cancellation
+static void stream_placeholder(JNIEnv* env, const StreamingRequest& request, ResponseCursor cursor, size_t tokenSize) {
+    // Send an empty token to start
+    deliver_token(env, request, "", false);
+    
+    while (!cursor.done()) {
+        if (request.cancelled.load(std::memory_order_relaxed)) {
+            deliver_token(env, request, "", true);
+            return;
+        }
+        
+        std::string piece = cursor.next(tokenSize);
+        deliver_token(env, request, piece, cursor.done());
+        
+        // Add a small delay to simulate token-by-token generation
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+}
+
+// Pick the placeholder answer used when the model build has no decode API
+static std::string placeholder_response(const std::string& prompt_str) {
+    if (prompt_str.find("math") != std::string::npos) {
+        return "To solve mathematical problems effectively, I'll need more specific details. Are you working on algebra, calculus, geometry, or another branch of mathematics? If you have a specific problem, please share it, and I'll guide you through the solution step by step.";
+    } else if (prompt_str.find("3x") != std::string::npos && prompt_str.find("7") != std::string::npos) {
+        // Special case for the math problem seen in the screenshot
+        return "To calculate 3x + 7, we need to know the value of x. If you're asking how to solve this expression:\n\n1. First, multiply 3 by the value of x\n2. Then add 7 to the result\n\nFor example, if x = 2:\n3×2 + 7 = 6 + 7 = 13\n\nIf you're trying to solve the equation 3x + 7 = some value, please provide that value so I can help you find x.";
+    } else if (prompt_str.find("physics") != std::string::npos) {
+        return "Physics covers a wide range of topics from mechanics to quantum theory. To provide the most helpful assistance, could you let me know which specific concept or problem in physics you're working with? I can explain principles, help with problem-solving approaches, or provide examples to clarify concepts.";
+    } else if (prompt_str.find("help") != std::string::npos) {
+        return "I'm here to help with your academic needs! I can assist with many subjects including:\n\n- Mathematics (algebra, calculus, geometry)\n- Sciences (physics, chemistry, biology)\n- Language arts and literature\n- History and social studies\n- Study strategies and exam preparation\n\nJust tell me what you're working on, and I'll provide explanations, examples, or guidance to support your learning.";
+    }
+    return "I'm your StudyBuddy AI assistant, designed to help with academic questions and learning. To provide the most relevant assistance, could you tell me more about what subject or topic you're studying? I can help explain concepts, work through problems, or provide study strategies tailored to your needs.";
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_startStreamingGeneration(JNIEnv* env, jclass clazz, jstring jPrompt, jint maxTokens, jobject callback) {
+    if (!model_loaded) {
+        LOGE("Model not initialized for streaming generation");
         return JNI_FALSE;
     }
     
-    // Find the onToken method in the callback interface
-    jclass callbackClass = env->GetObjectClass(g_streaming_callback);
-    if (callbackClass == nullptr) {
-        LOGE("Failed to get callback class");
-        env->DeleteGlobalRef(g_streaming_callback);
-        g_streaming_callback = nullptr;
+    auto request = std::make_shared<StreamingRequest>();
+    
+    // The generation thread owns this global reference and deletes it when done
+    request->callback = env->NewGlobalRef(callback);
+    if (request->callback == nullptr) {
+        LOGE("Failed to create global reference for callback");
         return JNI_FALSE;
     }
     
-    g_streaming_method = env->GetMethodID(callbackClass, "onToken", "(Ljava/lang/String;Z)V");
-    if (g_streaming_method == nullptr) {
+    // onToken is pinned in JNI_OnLoad; only an unknown callback type is looked up here
+    request->method = jni_streaming_callback_on_token(env, request->callback);
+    if (request->method == nullptr) {
         LOGE("Failed to find onToken method");
-        env->DeleteGlobalRef(g_streaming_callback);
-        g_streaming_callback = nullptr;
+        env->DeleteGlobalRef(request->callback);
         return JNI_FALSE;
     }
     
     // Get the prompt as a C++ string
-    const char* prompt = env->GetStringUTFChars(jPrompt, nullptr);
-    std::string prompt_str(prompt);
-    env->ReleaseStringUTFChars(jPrompt, prompt);
+    std::string prompt_str = jni_utf8(env, jPrompt);
     
-    // Get a JavaVM pointer which we'll need to attach the thread
+    // The generation worker attaches to this JavaVM once, on its first JNI job
     JavaVM* jvm;
     if (env->GetJavaVM(&jvm) != JNI_OK) {
         LOGE("Failed to get JavaVM pointer");
-        env->DeleteGlobalRef(g_streaming_callback);
-        g_streaming_callback = nullptr;
+        env->DeleteGlobalRef(request->callback);
         return JNI_FALSE;
     }
     
-    // Spawn a thread for generation to avoid blocking the UI
+    // A new request supersedes the previous one; it stops at its next token boundary
+    {
+        std::lock_guard<std::mutex> lock(g_streaming_mutex);
+        if (g_active_stream) {
+            g_active_stream->cancelled.store(true, std::memory_order_relaxed);
+        }
+        g_active_stream = request;
+    }
+    
+    // Run on the persistent generation worker to avoid blocking the UI
     bool model_mode = model_loaded; // Create a local copy
-    std::thread generation_thread([prompt_str, maxTokens, jvm, model_mode]() {
-        JNIEnv* streaming_env = nullptr;
-        // Properly attach this thread to the JVM with name
-        JavaVMAttachArgs args;
-        args.version = JNI_VERSION_1_6;
-        args.name = const_cast<char*>("StreamingGenerationThread");
-        args.group = nullptr;
-        
-        jint attach_result = jvm->AttachCurrentThread(&streaming_env, &args);
-        if (attach_result != JNI_OK || streaming_env == nullptr) {
-            LOGE("Failed to attach thread to JVM");
+    
+    // A fallback answer needs neither the chat module nor g_generation_mutex,
+    // which a cold load holds; it gets a cursor of its own and another thread.
+    // A module that goes away meanwhile is still caught under the lock below.
+    if (!model_mode || !g_chat_module_live.load()) {
+        ResponseCursor cursor = model_mode ? ResponseCursor{placeholder_response(prompt_str), 0}
+                                           : responseSystem.openStream(prompt_str, resolve_request_seed());
+        size_t piece = model_mode ? 5 : 3;
+        bool queued = fallback_worker().submit(jvm, [request, cursor, piece](JNIEnv* fallback_env) {
+            if (fallback_env == nullptr) {
+                LOGE("Fallback worker is not attached to the JVM");
+                finish_request(request);
+                return;
+            }
+            stream_placeholder(fallback_env, *request, cursor, piece);
+            fallback_env->DeleteGlobalRef(request->callback);
+            request->callback = nullptr;
+            finish_request(request);
+        });
+        if (!queued) {
+            LOGE("Fallback worker is shutting down");
+            env->DeleteGlobalRef(request->callback);
+            request->callback = nullptr;
+            finish_request(request);
+            return JNI_FALSE;
+        }
+        return JNI_TRUE;
+    }
+    
+    GenerationConfig config = current_generation_config();
+    RequestTiming timing;  // enqueued now; the worker stamps the rest
+    bool queued = generation_worker().submit(jvm, [request, prompt_str, maxTokens, model_mode, config,
+                                                   timing](JNIEnv* streaming_env) mutable {
+        if (streaming_env == nullptr) {
+            LOGE("Generation worker is not attached to the JVM");
+            finish_request(request);
             return;
         }
         
         try {
-            if (model_mode) {
-                // Use the real MLC-LLM model for streaming generation
-                LOGI("Starting real MLC-LLM streaming generation for prompt: %s", prompt_str.c_str());
-                
-                // In a complete implementation, you would:
-                // 1. Set up the streaming generation parameters
-                // 2. Call the MLC-LLM API with a callback for each token
-                // 3. Process each token as it's generated
-                
-                // For now, simulate with a smarter placeholder that seems more like real LLM output
-                // but with our domain-specific responses
-                
-                // Send an empty token to start
-                jstring jEmpty = streaming_env->NewStringUTF("");
-                streaming_env->CallVoidMethod(g_streaming_callback, g_streaming_method, jEmpty, JNI_FALSE);
-                streaming_env->DeleteLocalRef(jEmpty);
+            // Serializes against the warmup thread, which also drives the chat module
+            std::lock_guard<std::mutex> generation_lock(g_generation_mutex);
+            
+            if (request->cancelled.load(std::memory_order_relaxed)) {
+                // Cancelled while waiting for the previous generation to stop
+                deliver_token(streaming_env, *request, "", true);
+            } else if (model_mode && chat_module_ready()) {
+                // Drive the real decode loop and deliver each token as soon as it is produced
+                LOGV("Starting real MLC-LLM streaming generation for prompt: %s", prompt_str.c_str());
                 
-                // Pregenerate a more plausible response based on the prompt
-                std::string fullResponse;
-                if (prompt_str.find("math") != std::string::npos) {
-                    fullResponse = "To solve mathematical problems effectively, I'll need more specific details. Are you working on algebra, calculus, geometry, or another branch of mathematics? If you have a specific problem, please share it, and I'll guide you through the solution step by step.";
-                } else if (prompt_str.find("3x") != std::string::npos && prompt_str.find("7") != std::string::npos) {
-                    // Special case for the math problem seen in the screenshot
-                    fullResponse = "To calculate 3x + 7, we need to know the value of x. If you're asking how to solve this expression:\n\n1. First, multiply 3 by the value of x\n2. Then add 7 to the result\n\nFor example, if x = 2:\n3×2 + 7 = 6 + 7 = 13\n\nIf you're trying to solve the equation 3x + 7 = some value, please provide that value so I can help you find x.";
-                } else if (prompt_str.find("physics") != std::string::npos) {
-                    fullResponse = "Physics covers a wide range of topics from mechanics to quantum theory. To provide the most helpful assistance, could you let me know which specific concept or problem in physics you're working with? I can explain principles, help with problem-solving approaches, or provide examples to clarify concepts.";
-                } else if (prompt_str.find("help") != std::string::npos) {
-                    fullResponse = "I'm here to help with your academic needs! I can assist with many subjects including:\n\n- Mathematics (algebra, calculus, geometry)\n- Sciences (physics, chemistry, biology)\n- Language arts and literature\n- History and social studies\n- Study strategies and exam preparation\n\nJust tell me what you're working on, and I'll provide explanations, examples, or guidance to support your learning.";
-                } else {
-                    fullResponse = "I'm your StudyBuddy AI assistant, designed to help with academic questions and learning. To provide the most relevant assistance, could you tell me more about what subject or topic you're studying? I can help explain concepts, work through problems, or provide study strategies tailored to your needs.";
+                TokenCoalescer coalescer(DeliveryPolicy(), [streaming_env, &request](const std::string& text, bool is_last) {
+                    deliver_token(streaming_env, *request, text, is_last);
+                });
+                bool ok = stream_with_chat_module(prompt_str, maxTokens, [&coalescer](const std::string& text, bool is_last) {
+                    coalescer.add(text, is_last);
+                }, &request->cancelled, -1, &config, &timing);
+                timing.ok = ok;
+                latency_metrics().record(timing);
+                if (!ok) {
+                    // Flush what was decoded before the failure, ahead of the error
+                    coalescer.finish(false);
                 }
+                record_delivery_stats(coalescer.stats());
                 
-                // Stream the response token by token
-                const size_t tokenSize = 5; // Characters per "token" - using a larger chunk for more realistic streaming
-                for (size_t i = 0; i < fullResponse.length(); i += tokenSize) {
-                    // Get a token (5 characters or fewer at the end)
-                    size_t len = std::min(tokenSize, fullResponse.length() - i);
-                    std::string token = fullResponse.substr(i, len);
-                    
-                    // Send this token
-                    jstring jToken = streaming_env->NewStringUTF(token.c_str());
-                    bool isLast = (i + len >= fullResponse.length());
-                    streaming_env->CallVoidMethod(g_streaming_callback, g_streaming_method, jToken, isLast);
-                    streaming_env->DeleteLocalRef(jToken);
-                    
-                    // Add a small delay to simulate token-by-token generation
-                    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                if (!ok) {
+                    deliver_token(streaming_env, *request, "ERROR: Generation failed in the chat module", true);
                 }
+            } else if (model_mode) {
+                // No token-level decode API in this model build; use the placeholder responder
+                LOGV("Starting placeholder streaming generation for prompt: %s", prompt_str.c_str());
+                stream_placeholder(streaming_env, *request, ResponseCursor{placeholder_response(prompt_str), 0}, 5);
             } else {
                 // Fall back to template-based responses with simulated streaming
-                // Pre-generate the full response
-                std::string fullResponse = responseSystem.generateResponse(prompt_str);
-                
-                // Simulate token-by-token generation
-                const size_t tokenSize = 3; // Characters per "token"
-                
-                // Send an empty token to start
-                jstring jEmpty = streaming_env->NewStringUTF("");
-                streaming_env->CallVoidMethod(g_streaming_callback, g_streaming_method, jEmpty, JNI_FALSE);
-                streaming_env->DeleteLocalRef(jEmpty);
-                
-                // Break the response into tokens and send them one by one
-                for (size_t i = 0; i < fullResponse.length(); i += tokenSize) {
-                    // Get a token (3 characters or fewer at the end)
-                    size_t len = std::min(tokenSize, fullResponse.length() - i);
-                    std::string token = fullResponse.substr(i, len);
-                    
-                    // Send this token
-                    jstring jToken = streaming_env->NewStringUTF(token.c_str());
-                    bool isLast = (i + len >= fullResponse.length());
-                    streaming_env->CallVoidMethod(g_streaming_callback, g_streaming_method, jToken, isLast);
-                    streaming_env->DeleteLocalRef(jToken);
-                    
-                    // Add a small delay to simulate token-by-token generation
-                    std::this_thread::sleep_for(std::chrono::milliseconds(30));
-                }
+                ResponseCursor cursor = responseSystem.openStream(prompt_str, resolve_request_seed());
+                stream_placeholder(streaming_env, *request, cursor, 3);
             }
-            
-            // Clean up the global reference
-            if (g_streaming_callback != nullptr) {
-                streaming_env->DeleteGlobalRef(g_streaming_callback);
-                g_streaming_callback = nullptr;
-            }
-            
         } catch (std::exception& e) {
             LOGE("Exception during streaming generation: %s", e.what());
-            if (g_streaming_callback != nullptr && g_streaming_method != nullptr) {
-                jstring jError = streaming_env->NewStringUTF(e.what());
-                streaming_env->CallVoidMethod(g_streaming_callback, g_streaming_method, jError, JNI_TRUE);
-                streaming_env->DeleteLocalRef(jError);
-                
-                // Clean up the global reference
-                streaming_env->DeleteGlobalRef(g_streaming_callback);
-                g_streaming_callback = nullptr;
-            }
+            deliver_token(streaming_env, *request, e.what(), true);
         }
         
-        // Detach the thread when done - this is CRITICAL
-        jvm->DetachCurrentThread();
+        // Clean up the global reference now that nothing can call it any more
+        streaming_env->DeleteGlobalRef(request->callback);
+        request->callback = nullptr;
+        finish_request(request);
     });
     
-    // Detach the thread so it runs independently
-    generation_thread.detach();
+    if (!queued) {
+        LOGE("Generation worker is shutting down");
+        env->DeleteGlobalRef(request->callback);
+        request->callback = nullptr;
+        finish_request(request);
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_createTokenRing(JNIEnv* env, jobject thiz, jint capacity) {
+    {
+        std::lock_guard<std::mutex> lock(g_streaming_mutex);
+        if (g_active_stream) {
+            LOGE("Cannot replace the token ring while a stream is active");
+            return nullptr;
+        }
+    }
+    
+    g_token_ring = std::make_unique<TokenRing>(capacity > 0 ? static_cast<size_t>(capacity) : 64 * 1024);
+    LOGI("Created token ring with %zu data bytes", g_token_ring->capacity());
+    return env->NewDirectByteBuffer(g_token_ring->buffer(), static_cast<jlong>(g_token_ring->buffer_size()));
+}
+
+// Usage for a finish frame, from what the request's timing saw
+static stream_frames::Usage frame_usage(const RequestTiming& timing) {
+    auto ms = [](RequestTiming::Clock::time_point from, RequestTiming::Clock::time_point to) {
+        return from == RequestTiming::Clock::time_point{} || to < from
+                ? 0.0f : std::chrono::duration<float, std::milli>(to - from).count();
+    };
+    stream_frames::Usage usage;
+    usage.prompt_tokens = static_cast<uint32_t>(timing.prompt_tokens);
+    usage.completion_tokens = static_cast<uint32_t>(timing.tokens);
+    usage.prefill_ms = ms(timing.prefill_start, timing.prefill_end);
+    usage.decode_ms = ms(timing.prefill_end, timing.last_token);
+    return usage;
+}
+
+// Block frames for what `delta` started, changed or removed in the answer's
+// blocks; a long block text goes out in several, each fitting a ring record
+static void push_block_frames(TokenRing* ring, markdown_blocks::Tracker& blocks, const std::string& delta,
+                              const std::atomic<bool>* cancelled) {
+    static constexpr size_t kBlockChunk = 4096;
+    std::vector<markdown_blocks::Change> changes;
+    blocks.append(delta, &changes);
+    for (const markdown_blocks::Change& change : changes) {
+        uint8_t op = change.op;
+        size_t sent = 0;
+        do {
+            size_t end = change.text.size() - sent > kBlockChunk
+                    ? utf8_boundary_at_or_after(change.text, sent + kBlockChunk) : change.text.size();
+            ring->push(stream_frames::block(op, change.kind, change.index, change.keep + static_cast<uint32_t>(sent),
+                                            change.text.substr(sent, end - sent)), cancelled);
+            op = markdown_blocks::kUpdated;
+            sent = end;
+        } while (sent < change.text.size());
+    }
+}
+
+// startStreamingToRing and startFramedStream. Framed streams write
+// stream_frames.h records: deltas with their token counts, then one finish
+// frame with the reason and usage (or an error frame), all in the ring. With
+// `blocks`, each delta is followed by the block frames of what it changed.
+static jboolean start_ring_stream(JNIEnv* env, jstring jPrompt, jint maxTokens, jlong seed, int64_t request_id,
+                                  bool framed, bool blocks) {
+    if (!model_loaded || !g_token_ring) {
+        LOGE("Model or token ring not initialized for ring streaming");
+        return JNI_FALSE;
+    }
+    
+    std::string prompt_str = jni_utf8(env, jPrompt);
     
+    auto request = std::make_shared<StreamingRequest>();
+    request->id = request_id;
+    {
+        std::lock_guard<std::mutex> lock(g_streaming_mutex);
+        if (g_active_stream) {
+            LOGE("A stream is already active on the token ring");
+            return JNI_FALSE;
+        }
+        g_active_stream = request;
+    }
+    
+    TokenRing* ring = g_token_ring.get();
+    ring->reset();
+    
+    // The producer never touches the JVM, so the job needs no JNIEnv
+    GenerationConfig config = current_generation_config();
+    RequestTiming timing;
+    bool queued = generation_worker().submit(nullptr, [request, ring, prompt_str, maxTokens, seed, config,
+                                                       timing, framed, blocks](JNIEnv*) mutable {
+        bool ok = true;
+        std::string error;
+        markdown_blocks::Tracker tracker;
+        auto push_delta = [&](const std::string& text, uint32_t tokens) {
+            ring->push(stream_frames::delta(text, tokens), &request->cancelled);
+            if (blocks) {
+                push_block_frames(ring, tracker, text, &request->cancelled);
+            }
+        };
+        try {
+            std::lock_guard<std::mutex> generation_lock(g_generation_mutex);
+            
+            if (chat_module_ready()) {
+                size_t framed_tokens = 0;
+                ok = stream_with_chat_module(prompt_str, maxTokens, [&](const std::string& text, bool) {
+                    if (!framed) {
+                        ring->push(text, &request->cancelled);
+                    } else if (!text.empty()) {
+                        // The chat module reports no logprobs
+                        uint32_t tokens = static_cast<uint32_t>(timing.tokens - framed_tokens);
+                        framed_tokens = timing.tokens;
+                        push_delta(text, tokens);
+                    }
+                }, &request->cancelled, static_cast<int64_t>(seed), &config, &timing);
+                timing.ok = ok;
+                latency_metrics().record(timing);
+                if (!ok) {
+                    error = "generation failed";
+                }
+            } else {
+                // Placeholder responder: deliver word-sized pieces without artificial delays
+                std::string fullResponse = placeholder_response(prompt_str);
+                for (size_t i = 0; i < fullResponse.length() && !request->cancelled.load(); ) {
+                    size_t end = utf8_boundary_at_or_after(fullResponse, std::min(i + 5, fullResponse.length()));
+                    std::string piece = fullResponse.substr(i, end - i);
+                    if (framed) {
+                        push_delta(piece, 1);
+                    } else {
+                        ring->push(piece, &request->cancelled);
+                    }
+                    timing.tokens++;
+                    i = end;
+                }
+            }
+        } catch (const std::exception& e) {
+            LOGE("Exception during ring streaming: %s", e.what());
+            ok = false;
+            error = e.what();
+        }
+        
+        if (framed) {
+            // Pushed even after a cancel, so the reader always sees how the stream ended
+            if (ok) {
+                stream_frames::FinishReason reason = stream_frames::kFinishStop;
+                if (request->cancelled.load()) {
+                    reason = stream_frames::kFinishAbort;
+                } else if (maxTokens > 0 && timing.tokens >= static_cast<size_t>(maxTokens)) {
+                    reason = stream_frames::kFinishLength;
+                }
+                ring->push(stream_frames::finish(reason, frame_usage(timing), request->id));
+            } else {
+                ring->push(stream_frames::error(error, request->id));
+            }
+        }
+        ring->finish(!ok);
+        finish_request(request);
+    });
+    
+    if (!queued) {
+        if (framed) {
+            ring->push(stream_frames::error("generation worker is shutting down", request_id));
+        }
+        ring->finish(true);
+        finish_request(request);
+        return JNI_FALSE;
+    }
     return JNI_TRUE;
 }
 
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_startStreamingToRing(JNIEnv* env, jobject thiz, jstring jPrompt, jint maxTokens,
+                                                              jlong seed) {
+    return start_ring_stream(env, jPrompt, maxTokens, seed, 0, false, false);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_startFramedStream(JNIEnv* env, jobject thiz, jlong requestId, jstring jPrompt,
+                                                           jint maxTokens, jlong seed, jboolean blocks) {
+    return start_ring_stream(env, jPrompt, maxTokens, seed, static_cast<int64_t>(requestId), true,
+                             blocks == JNI_TRUE);
+}
+
+// Stops the framed stream with this id at its next token; it finishes with kFinishAbort
+JNIEXPORT jboolean JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_abortFramedStream(JNIEnv* env, jobject thiz, jlong requestId) {
+    std::lock_guard<std::mutex> lock(g_streaming_mutex);
+    if (!g_active_stream || g_active_stream->id != static_cast<int64_t>(requestId)) {
+        return JNI_FALSE;
+    }
+    g_active_stream->cancelled.store(true, std::memory_order_relaxed);
+    return JNI_TRUE;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_awaitTokenRing(JNIEnv* env, jobject thiz, jint timeoutMs) {
+    if (!g_token_ring) {
+        return -1;
+    }
+    return g_token_ring->await(timeoutMs);
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_getDeliveryStats(JNIEnv* env, jobject thiz) {
+    DeliveryStats stats;
+    {
+        std::lock_guard<std::mutex> lock(g_delivery_mutex);
+        stats = g_last_delivery_stats;
+    }
+    
+    jfloat values[5] = {
+        static_cast<jfloat>(stats.tokens),
+        static_cast<jfloat>(stats.deliveries),
+        stats.tokens_per_delivery(),
+        stats.first_delivery_ms,
+        stats.max_gap_ms,
+    };
+    jfloatArray result = env->NewFloatArray(5);
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, 5, values);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_setComputeBackend(JNIEnv* env, jobject thiz, jint backend) {
+    if (backend < kBackendAuto || backend > kBackendCpu) {
+        LOGE("Unknown compute backend %d", backend);
+        return;
+    }
+    g_compute_backend = backend;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_getComputeBackend(JNIEnv* env, jobject thiz) {
+    return g_compute_backend_in_use.load();
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_setNativeTracing(JNIEnv* env, jobject thiz, jboolean enabled) {
+    set_native_tracing(enabled == JNI_TRUE);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_getMetrics(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(latency_metrics().to_json().c_str());
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_setTraceId(JNIEnv* env, jobject thiz, jlong traceId) {
+    return static_cast<jlong>(trace_context::exchange(static_cast<int64_t>(traceId)));
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_getRequestTrace(JNIEnv* env, jobject thiz, jlong traceId) {
+    std::string json = latency_metrics().trace_json(static_cast<int64_t>(traceId));
+    return env->NewStringUTF(json.empty() ? "{}" : json.c_str());
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_resetMetrics(JNIEnv* env, jobject thiz) {
+    latency_metrics().reset();
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_studybuddy_ml_TVMBridge_setThreadConfig(JNIEnv* env, jobject thiz, jint affinity, jint workers) {
+    if (affinity < kAffinityAuto || affinity > kAffinityAll) {
+        LOGE("Unknown thread affinity %d", affinity);
+        return;
+    }
+    g_thread_affinity = affinity;
+    g_thread_workers = workers;
+}
+
 JNIEXPORT void JNICALL
 Java_com_example_studybuddy_ml_TVMBridge_stopStreamingGeneration(JNIEnv* env, jclass clazz) {
-    // Clean up the global callback reference if it exists
-    if (g_streaming_callback != nullptr) {
-        env->DeleteGlobalRef(g_streaming_callback);
-        g_streaming_callback = nullptr;
+    // Ask the in-flight request to stop at its next token boundary. The generation
+    // thread releases the callback and the chat module state itself.
+    std::lock_guard<std::mutex> lock(g_streaming_mutex);
+    if (g_active_stream) {
+        g_active_stream->cancelled.store(true, std::memory_order_relaxed);
+        LOGI("Streaming generation stop requested");
+    } else {
+        LOGI("Streaming generation stop requested with no active request");
     }
-    
-    // For a full implementation, we would need a way to interrupt the generation thread
-    LOGI("Streaming generation stop requested");
 }
 
-} // extern "C" 
\ No newline at end of file
+} // extern "C" 
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Helpers for streaming text in pieces without splitting UTF-8 code points.
+ *
+ * Token text arrives in arbitrary byte chunks (byte-fallback tokens, fixed-size
+ * placeholder slices), but every string handed to Java must be complete. These
+ * helpers only look at the last few bytes of each chunk, never the whole response.
+ */
+
+// Expected length of a UTF-8 sequence from its lead byte; 0 for a continuation byte
+inline size_t utf8_sequence_length(uint8_t lead) {
+    if (lead < 0x80) return 1;
+    if ((lead & 0xE0) == 0xC0) return 2;
+    if ((lead & 0xF0) == 0xE0) return 3;
+    if ((lead & 0xF8) == 0xF0) return 4;
+    return (lead & 0xC0) == 0x80 ? 0 : 1;
+}
+
+// Length of the longest prefix of `s` that does not end inside a code point
+inline size_t utf8_complete_prefix(std::string_view s) {
+    size_t n = s.size();
+    // Walk back over at most three continuation bytes to the last lead byte
+    for (size_t back = 1; back <= 4 && back <= n; ++back) {
+        size_t need = utf8_sequence_length(static_cast<uint8_t>(s[n - back]));
+        if (need == 0) {
+            continue;
+        }
+        return need > back ? n - back : n;
+    }
+    // Only continuation bytes at the end: malformed, let the converter replace them
+    return n;
+}
+
+// Smallest code point boundary at or after `pos`
+inline size_t utf8_boundary_at_or_after(std::string_view s, size_t pos) {
+    while (pos < s.size() && utf8_sequence_length(static_cast<uint8_t>(s[pos])) == 0) {
+        ++pos;
+    }
+    return pos < s.size() ? pos : s.size();
+}
+
+// Decode UTF-8 into UTF-16 for JNI NewString. Malformed input becomes U+FFFD,
+// and supplementary characters become surrogate pairs (NewStringUTF would need
+// modified UTF-8 for both).
+inline void utf8_to_utf16(std::string_view s, std::u16string& out) {
+    out.clear();
+    out.reserve(s.size());
+    size_t i = 0;
+    while (i < s.size()) {
+        uint8_t lead = static_cast<uint8_t>(s[i]);
+        size_t len = utf8_sequence_length(lead);
+        if (len == 1 && lead < 0x80) {
+            out.push_back(static_cast<char16_t>(lead));
+            ++i;
+            continue;
+        }
+        uint32_t cp = 0;
+        bool valid = len >= 2 && i + len <= s.size();
+        if (valid) {
+            cp = lead & (0x7F >> len);
+            for (size_t k = 1; k < len; ++k) {
+                uint8_t b = static_cast<uint8_t>(s[i + k]);
+                if ((b & 0xC0) != 0x80) {
+                    valid = false;
+                    break;
+                }
+                cp = (cp << 6) | (b & 0x3F);
+            }
+            static const uint32_t kMinForLength[5] = {0, 0, 0x80, 0x800, 0x10000};
+            valid = valid && cp >= kMinForLength[len] && cp <= 0x10FFFF && (cp < 0xD800 || cp > 0xDFFF);
+        }
+        if (!valid) {
+            out.push_back(u'\uFFFD');
+            ++i;
+            continue;
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            out.push_back(static_cast<char16_t>(0xD800 + (cp >> 10)));
+            out.push_back(static_cast<char16_t>(0xDC00 + (cp & 0x3FF)));
+        } else {
+            out.push_back(static_cast<char16_t>(cp));
+        }
+        i += len;
+    }
+}
+
+// Encode UTF-16 (as read with GetStringRegion) into UTF-8. Unpaired surrogates
+// become U+FFFD.
+inline void utf16_to_utf8(const char16_t* s, size_t n, std::string& out) {
+    out.clear();
+    out.reserve(n + n / 2);
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t cp = s[i];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < n && s[i + 1] >= 0xDC00 && s[i + 1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (s[i + 1] - 0xDC00);
+            ++i;
+        } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = 0xFFFD;
+        }
+        if (cp < 0x80) {
+            out.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+}
+
+// Buffers the tail of an incomplete code point between pushes
+class Utf8StreamBuffer {
+public:
+    // Append `bytes` and return the complete text that can be emitted now
+    std::string push(std::string_view bytes) {
+        pending_.append(bytes.data(), bytes.size());
+        size_t ready = utf8_complete_prefix(pending_);
+        std::string out = pending_.substr(0, ready);
+        pending_.erase(0, ready);
+        return out;
+    }
+
+    // Emit whatever is left at end of stream, even if incomplete
+    std::string flush() {
+        std::string out;
+        out.swap(pending_);
+        return out;
+    }
+
+    void clear() { pending_.clear(); }
+
+private:
+    std::string pending_;
+};
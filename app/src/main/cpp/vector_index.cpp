@@ -0,0 +1,727 @@
+#include "vector_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "native_log.h"
+#include "shared_pool.h"
+
+#define LOGI(...) NLOGI("VECTOR_INDEX", __VA_ARGS__)
+#define LOGE(...) NLOGE("VECTOR_INDEX", __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kRawMagic = 0x52564253;        // "SBVR"
+constexpr uint32_t kCodesMagic = 0x43564253;      // "SBVC"
+constexpr uint32_t kQuantizerMagic = 0x51564253;  // "SBVQ"
+constexpr int kKmeansIterations = 10;
+constexpr uint32_t kMaxLists = 256;
+
+constexpr char kRawFile[] = "/raw.bin";
+constexpr char kCodesFile[] = "/codes.bin";
+constexpr char kQuantizerFile[] = "/quantizer.bin";
+
+// Leads raw.bin and codes.bin; records follow back to back
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t reserved;
+};
+
+// Leads quantizer.bin, followed by the centroids and the codebooks
+struct QuantizerHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t subspaces;
+    uint32_t lists;
+    uint32_t codebook_size;
+    uint32_t reserved[2];
+};
+
+// raw.bin: int64 id, int32 op (1 add, 0 remove), int32 unused, dim floats
+size_t raw_record_bytes(uint32_t dim) {
+    return 16 + static_cast<size_t>(dim) * sizeof(float);
+}
+
+// codes.bin: int64 id, int32 list (-1 remove), one code byte per subspace, padded to 4
+size_t code_record_bytes(uint32_t subspaces) {
+    return (12 + subspaces + 3) & ~static_cast<size_t>(3);
+}
+
+int64_t record_id(const uint8_t* record) {
+    int64_t id;
+    memcpy(&id, record, sizeof(id));
+    return id;
+}
+
+int32_t record_tag(const uint8_t* record) {
+    int32_t tag;
+    memcpy(&tag, record + 8, sizeof(tag));
+    return tag;
+}
+
+bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Replace `path` with `data`: written to a temporary file, synced and renamed over it
+bool write_file(const std::string& path, const std::string& data) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_all(fd, data.data(), data.size()) && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+float squared_distance(const float* a, const float* b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t s0 = vdupq_n_f32(0.0f), s1 = s0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        s0 = vfmaq_f32(s0, d0, d0);
+        s1 = vfmaq_f32(s1, d1, d1);
+    }
+    sum = vaddvq_f32(vaddq_f32(s0, s1));
+#endif
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+size_t nearest(const float* vector, const float* centroids, size_t k, size_t dim) {
+    size_t best = 0;
+    float best_distance = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < k; ++c) {
+        float distance = squared_distance(vector, centroids + c * dim, dim);
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// Lloyd's k-means over n rows of `dim`, seeded with k distinct rows. An
+// empty cluster is reseeded with a random row.
+void kmeans(const float* data, size_t n, size_t dim, size_t k, float* centroids, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), rng);
+    for (size_t c = 0; c < k; ++c) {
+        memcpy(centroids + c * dim, data + order[c % n] * dim, dim * sizeof(float));
+    }
+    std::vector<float> sums(k * dim);
+    std::vector<uint32_t> counts(k);
+    for (int iteration = 0; iteration < kKmeansIterations; ++iteration) {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; ++i) {
+            const float* row = data + i * dim;
+            size_t c = nearest(row, centroids, k, dim);
+            float* sum = sums.data() + c * dim;
+            for (size_t d = 0; d < dim; ++d) {
+                sum[d] += row[d];
+            }
+            counts[c]++;
+        }
+        for (size_t c = 0; c < k; ++c) {
+            float* centroid = centroids + c * dim;
+            if (counts[c] == 0) {
+                memcpy(centroid, data + (rng() % n) * dim, dim * sizeof(float));
+                continue;
+            }
+            float inv = 1.0f / static_cast<float>(counts[c]);
+            for (size_t d = 0; d < dim; ++d) {
+                centroid[d] = sums[c * dim + d] * inv;
+            }
+        }
+    }
+}
+
+}  // namespace
+
+float vector_dot(const float* a, const float* b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t s0 = vdupq_n_f32(0.0f), s1 = s0, s2 = s0, s3 = s0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = vfmaq_f32(s0, vld1q_f32(a + i), vld1q_f32(b + i));
+        s1 = vfmaq_f32(s1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        s2 = vfmaq_f32(s2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        s3 = vfmaq_f32(s3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        s0 = vfmaq_f32(s0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    sum = vaddvq_f32(vaddq_f32(vaddq_f32(s0, s1), vaddq_f32(s2, s3)));
+#endif
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+const uint8_t* VectorIndex::RecordFile::record(size_t i) const {
+    if (i < mapped) {
+        return static_cast<const uint8_t*>(map) + sizeof(FileHeader) + i * record_bytes;
+    }
+    return tail.data() + (i - mapped) * record_bytes;
+}
+
+bool VectorIndex::RecordFile::open(const std::string& path, uint32_t magic, uint32_t dim, size_t bytes) {
+    close();
+    record_bytes = bytes;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LOGE("Cannot open %s: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(FileHeader)) {
+        FileHeader header = {magic, kVersion, dim, 0};
+        if (ftruncate(fd, 0) != 0 || !write_all(fd, &header, sizeof(header))) {
+            close();
+            return false;
+        }
+        size = sizeof(header);
+    } else {
+        FileHeader header;
+        if (pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+            header.magic != magic || header.version != kVersion || header.dim != dim) {
+            LOGE("%s is not an index of %u-wide vectors", path.c_str(), dim);
+            close();
+            return false;
+        }
+    }
+    // Drops a record torn by a crash mid-append
+    size_t records = (size - sizeof(FileHeader)) / record_bytes;
+    size_t whole = sizeof(FileHeader) + records * record_bytes;
+    if (whole != size && ftruncate(fd, static_cast<off_t>(whole)) != 0) {
+        close();
+        return false;
+    }
+    if (records > 0) {
+        map = mmap(nullptr, whole, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            close();
+            return false;
+        }
+        map_bytes = whole;
+        madvise(map, whole, MADV_WILLNEED);
+    }
+    mapped = records;
+    lseek(fd, static_cast<off_t>(whole), SEEK_SET);
+    return true;
+}
+
+bool VectorIndex::RecordFile::append(const void* data) {
+    if (fd < 0 || !write_all(fd, data, record_bytes)) {
+        return false;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    tail.insert(tail.end(), bytes, bytes + record_bytes);
+    return true;
+}
+
+void VectorIndex::RecordFile::close() {
+    if (map != nullptr) {
+        munmap(map, map_bytes);
+        map = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    map_bytes = 0;
+    mapped = 0;
+    tail.clear();
+}
+
+VectorIndex::~VectorIndex() {
+    close();
+}
+
+bool VectorIndex::open(const std::string& dir, uint32_t dim) {
+    close();
+    if (dim == 0 || dim % kSubDim != 0) {
+        LOGE("Vector width %u is not a multiple of %u", dim, kSubDim);
+        return false;
+    }
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        LOGE("Cannot create %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+    dir_ = dir;
+    dim_ = dim;
+    subspaces_ = dim / kSubDim;
+    struct stat st;
+    if (stat((dir + kQuantizerFile).c_str(), &st) == 0) {
+        if (!load_quantizer(dir + kQuantizerFile)) {
+            close();
+            return false;
+        }
+        // Training stopped between writing the quantizer and retiring raw.bin: encode it again
+        if (stat((dir + kRawFile).c_str(), &st) == 0 &&
+            (!raw_.open(dir + kRawFile, kRawMagic, dim_, raw_record_bytes(dim_)) || !encode_raw())) {
+            close();
+            return false;
+        }
+        if (!codes_.open(dir + kCodesFile, kCodesMagic, dim_, code_record_bytes(subspaces_))) {
+            close();
+            return false;
+        }
+    } else if (!raw_.open(dir + kRawFile, kRawMagic, dim_, raw_record_bytes(dim_))) {
+        close();
+        return false;
+    }
+    rebuild();
+    LOGI("Opened vector index %s: %zu vectors, %s", dir.c_str(), live_count_,
+         trained_ ? "trained" : "exact until trained");
+    return true;
+}
+
+void VectorIndex::close() {
+    raw_.close();
+    codes_.close();
+    if (quantizer_map_ != nullptr) {
+        munmap(quantizer_map_, quantizer_bytes_);
+        quantizer_map_ = nullptr;
+    }
+    quantizer_bytes_ = 0;
+    centroids_ = nullptr;
+    codebooks_ = nullptr;
+    trained_ = false;
+    lists_ = 0;
+    latest_.clear();
+    live_.clear();
+    postings_.clear();
+    live_count_ = 0;
+    dir_.clear();
+}
+
+bool VectorIndex::load_quantizer(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = size >= sizeof(QuantizerHeader) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    QuantizerHeader header;
+    memcpy(&header, map, sizeof(header));
+    size_t expected = sizeof(header) + (static_cast<size_t>(header.lists) * header.dim +
+                                        static_cast<size_t>(header.subspaces) * header.codebook_size * kSubDim) *
+                                           sizeof(float);
+    if (header.magic != kQuantizerMagic || header.version != kVersion || header.dim != dim_ ||
+        header.subspaces != subspaces_ || header.lists == 0 || header.codebook_size != kCodebookSize ||
+        size != expected) {
+        LOGE("%s does not match %u-wide vectors", path.c_str(), dim_);
+        munmap(map, size);
+        return false;
+    }
+    quantizer_map_ = map;
+    quantizer_bytes_ = size;
+    lists_ = header.lists;
+    codebook_size_ = header.codebook_size;
+    centroids_ = reinterpret_cast<const float*>(static_cast<const uint8_t*>(map) + sizeof(header));
+    codebooks_ = centroids_ + static_cast<size_t>(lists_) * dim_;
+    trained_ = true;
+    return true;
+}
+
+void VectorIndex::note_record(size_t index, int64_t id, bool live) {
+    auto it = latest_.find(id);
+    if (it != latest_.end()) {
+        live_[it->second] = 0;
+        live_count_--;
+        latest_.erase(it);
+    }
+    if (live_.size() <= index) {
+        live_.resize(index + 1, 0);
+    }
+    if (live) {
+        latest_[id] = static_cast<uint32_t>(index);
+        live_[index] = 1;
+        live_count_++;
+    }
+}
+
+void VectorIndex::rebuild() {
+    latest_.clear();
+    live_.clear();
+    live_count_ = 0;
+    postings_.assign(trained_ ? lists_ : 0, {});
+    const RecordFile& file = trained_ ? codes_ : raw_;
+    size_t count = file.count();
+    live_.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* record = file.record(i);
+        int32_t tag = record_tag(record);
+        bool live = trained_ ? tag >= 0 && static_cast<uint32_t>(tag) < lists_ : tag == 1;
+        note_record(i, record_id(record), live);
+        if (trained_ && live) {
+            postings_[tag].push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+int VectorIndex::nearest_list(const float* vector) const {
+    return static_cast<int>(nearest(vector, centroids_, lists_, dim_));
+}
+
+void VectorIndex::encode(const float* vector, int32_t* list, uint8_t* codes) const {
+    *list = nearest_list(vector);
+    const float* centroid = centroids_ + static_cast<size_t>(*list) * dim_;
+    float residual[kSubDim];
+    for (uint32_t j = 0; j < subspaces_; ++j) {
+        for (uint32_t t = 0; t < kSubDim; ++t) {
+            residual[t] = vector[j * kSubDim + t] - centroid[j * kSubDim + t];
+        }
+        const float* codebook = codebooks_ + static_cast<size_t>(j) * codebook_size_ * kSubDim;
+        codes[j] = static_cast<uint8_t>(nearest(residual, codebook, codebook_size_, kSubDim));
+    }
+}
+
+bool VectorIndex::add_code(int64_t id, const float* vector) {
+    std::vector<uint8_t> record(code_record_bytes(subspaces_), 0);
+    int32_t list = 0;
+    encode(vector, &list, record.data() + 12);
+    memcpy(record.data(), &id, sizeof(id));
+    memcpy(record.data() + 8, &list, sizeof(list));
+    if (!codes_.append(record.data())) {
+        return false;
+    }
+    size_t index = codes_.count() - 1;
+    note_record(index, id, true);
+    postings_[list].push_back(static_cast<uint32_t>(index));
+    return true;
+}
+
+bool VectorIndex::add(int64_t id, const float* vector) {
+    if (dir_.empty()) {
+        return false;
+    }
+    if (trained_) {
+        return add_code(id, vector);
+    }
+    std::vector<uint8_t> record(raw_record_bytes(dim_), 0);
+    int32_t op = 1;
+    memcpy(record.data(), &id, sizeof(id));
+    memcpy(record.data() + 8, &op, sizeof(op));
+    memcpy(record.data() + 16, vector, dim_ * sizeof(float));
+    if (!raw_.append(record.data())) {
+        return false;
+    }
+    note_record(raw_.count() - 1, id, true);
+    if (live_count_ >= kTrainSize && !train()) {
+        LOGE("Training failed; the index stays exact");
+    }
+    return true;
+}
+
+bool VectorIndex::remove(int64_t id) {
+    if (dir_.empty() || latest_.find(id) == latest_.end()) {
+        return false;
+    }
+    RecordFile& file = trained_ ? codes_ : raw_;
+    std::vector<uint8_t> record(file.record_bytes, 0);
+    int32_t tag = trained_ ? -1 : 0;
+    memcpy(record.data(), &id, sizeof(id));
+    memcpy(record.data() + 8, &tag, sizeof(tag));
+    if (!file.append(record.data())) {
+        return false;
+    }
+    note_record(file.count() - 1, id, false);
+    return true;
+}
+
+bool VectorIndex::train() {
+    if (trained_) {
+        return true;
+    }
+    if (dir_.empty() || live_count_ < kCodebookSize) {
+        return false;
+    }
+    size_t n = live_count_;
+    std::vector<float> data;
+    data.reserve(n * dim_);
+    for (size_t i = 0; i < raw_.count(); ++i) {
+        if (live_[i]) {
+            const float* vector = reinterpret_cast<const float*>(raw_.record(i) + 16);
+            data.insert(data.end(), vector, vector + dim_);
+        }
+    }
+    auto started = std::chrono::steady_clock::now();
+    uint32_t lists = std::max<uint32_t>(1, std::min<uint32_t>(kMaxLists, static_cast<uint32_t>(std::lround(std::sqrt(n)))));
+    std::vector<float> centroids(static_cast<size_t>(lists) * dim_);
+    kmeans(data.data(), n, dim_, lists, centroids.data(), 1);
+
+    // Residuals from the nearest centroid, then one codebook per subspace of them
+    std::vector<float> residuals(n * dim_);
+    for (size_t i = 0; i < n; ++i) {
+        const float* row = data.data() + i * dim_;
+        const float* centroid = centroids.data() + nearest(row, centroids.data(), lists, dim_) * dim_;
+        for (uint32_t d = 0; d < dim_; ++d) {
+            residuals[i * dim_ + d] = row[d] - centroid[d];
+        }
+    }
+    std::vector<float> codebooks(static_cast<size_t>(subspaces_) * kCodebookSize * kSubDim);
+    auto train_subspace = [&](int64_t subspace) {
+        uint32_t j = static_cast<uint32_t>(subspace);
+        std::vector<float> sub(n * kSubDim);
+        for (size_t i = 0; i < n; ++i) {
+            memcpy(sub.data() + i * kSubDim, residuals.data() + i * dim_ + j * kSubDim, kSubDim * sizeof(float));
+        }
+        float* codebook = codebooks.data() + static_cast<size_t>(j) * kCodebookSize * kSubDim;
+        kmeans(sub.data(), n, kSubDim, kCodebookSize, codebook, 2 + j);
+    };
+    // Indexing is never what someone waits on; decode keeps the workers it needs
+    shared_pool::PriorityScope background(kPriorityBackground);
+    shared_pool::pool().parallel_for(0, subspaces_, train_subspace, static_cast<int>(subspaces_));
+
+    QuantizerHeader header = {kQuantizerMagic, kVersion, dim_, subspaces_, lists, kCodebookSize, {0, 0}};
+    std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(centroids.data()), centroids.size() * sizeof(float));
+    out.append(reinterpret_cast<const char*>(codebooks.data()), codebooks.size() * sizeof(float));
+    if (!write_file(dir_ + kQuantizerFile, out) || !load_quantizer(dir_ + kQuantizerFile) || !encode_raw()) {
+        LOGE("Cannot write the quantizer of %s", dir_.c_str());
+        return false;
+    }
+    if (!codes_.open(dir_ + kCodesFile, kCodesMagic, dim_, code_record_bytes(subspaces_))) {
+        return false;
+    }
+    rebuild();
+    LOGI("Trained %u lists and %u x %u codebooks on %zu vectors in %.0f ms", lists_, subspaces_, kCodebookSize, n,
+         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+    return true;
+}
+
+// Write codes.bin afresh from the live vectors of raw.bin, then retire raw.bin
+bool VectorIndex::encode_raw() {
+    std::map<int64_t, size_t> latest;
+    for (size_t i = 0; i < raw_.count(); ++i) {
+        const uint8_t* record = raw_.record(i);
+        if (record_tag(record) == 1) {
+            latest[record_id(record)] = i;
+        } else {
+            latest.erase(record_id(record));
+        }
+    }
+    FileHeader header = {kCodesMagic, kVersion, dim_, 0};
+    std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::vector<uint8_t> record(code_record_bytes(subspaces_), 0);
+    for (const auto& entry : latest) {
+        int32_t list = 0;
+        encode(reinterpret_cast<const float*>(raw_.record(entry.second) + 16), &list, record.data() + 12);
+        memcpy(record.data(), &entry.first, sizeof(entry.first));
+        memcpy(record.data() + 8, &list, sizeof(list));
+        out.append(reinterpret_cast<const char*>(record.data()), record.size());
+    }
+    codes_.close();
+    if (!write_file(dir_ + kCodesFile, out)) {
+        return false;
+    }
+    raw_.close();
+    unlink((dir_ + kRawFile).c_str());
+    return true;
+}
+
+size_t VectorIndex::search(const float* query, size_t k, int probes, int64_t* ids, float* scores) const {
+    if (k == 0 || live_count_ == 0) {
+        return 0;
+    }
+    // Min-heap of the best k so far
+    std::vector<std::pair<float, int64_t>> best;
+    best.reserve(k + 1);
+    auto offer = [&best, k](float score, int64_t id) {
+        if (best.size() < k) {
+            best.emplace_back(score, id);
+            std::push_heap(best.begin(), best.end(), std::greater<std::pair<float, int64_t>>());
+        } else if (score > best.front().first) {
+            std::pop_heap(best.begin(), best.end(), std::greater<std::pair<float, int64_t>>());
+            best.back() = {score, id};
+            std::push_heap(best.begin(), best.end(), std::greater<std::pair<float, int64_t>>());
+        }
+    };
+
+    if (!trained_) {
+        for (size_t i = 0; i < raw_.count(); ++i) {
+            if (live_[i]) {
+                const uint8_t* record = raw_.record(i);
+                offer(vector_dot(query, reinterpret_cast<const float*>(record + 16), dim_), record_id(record));
+            }
+        }
+    } else {
+        size_t probe_count = static_cast<size_t>(std::max(1, std::min(probes, static_cast<int>(lists_))));
+        std::vector<std::pair<float, uint32_t>> coarse(lists_);
+        for (uint32_t l = 0; l < lists_; ++l) {
+            coarse[l] = {vector_dot(query, centroids_ + static_cast<size_t>(l) * dim_, dim_), l};
+        }
+        std::partial_sort(coarse.begin(), coarse.begin() + probe_count, coarse.end(),
+                          std::greater<std::pair<float, uint32_t>>());
+
+        // table[j][c]: query . codebook entry c of subspace j
+        std::vector<float> table(static_cast<size_t>(subspaces_) * codebook_size_);
+        for (uint32_t j = 0; j < subspaces_; ++j) {
+            const float* q = query + j * kSubDim;
+            const float* codebook = codebooks_ + static_cast<size_t>(j) * codebook_size_ * kSubDim;
+            for (uint32_t c = 0; c < codebook_size_; ++c) {
+                table[j * codebook_size_ + c] = vector_dot(q, codebook + c * kSubDim, kSubDim);
+            }
+        }
+        for (size_t p = 0; p < probe_count; ++p) {
+            for (uint32_t index : postings_[coarse[p].second]) {
+                if (!live_[index]) {
+                    continue;
+                }
+                const uint8_t* record = codes_.record(index);
+                const uint8_t* codes = record + 12;
+                const float* row = table.data();
+                float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+                uint32_t j = 0;
+                for (; j + 4 <= subspaces_; j += 4, row += 4 * codebook_size_) {
+                    s0 += row[codes[j]];
+                    s1 += row[codebook_size_ + codes[j + 1]];
+                    s2 += row[2 * codebook_size_ + codes[j + 2]];
+                    s3 += row[3 * codebook_size_ + codes[j + 3]];
+                }
+                for (; j < subspaces_; ++j, row += codebook_size_) {
+                    s0 += row[codes[j]];
+                }
+                offer(coarse[p].first + (s0 + s1) + (s2 + s3), record_id(record));
+            }
+        }
+    }
+    std::sort_heap(best.begin(), best.end(), std::greater<std::pair<float, int64_t>>());
+    for (size_t i = 0; i < best.size(); ++i) {
+        ids[i] = best[i].second;
+        if (scores != nullptr) {
+            scores[i] = best[i].first;
+        }
+    }
+    return best.size();
+}
+
+bool VectorIndex::sync() {
+    const RecordFile& file = trained_ ? codes_ : raw_;
+    return file.fd >= 0 && fsync(file.fd) == 0;
+}
+
+namespace vector_index {
+
+namespace {
+
+std::mutex& handles_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::map<int64_t, std::pair<std::string, std::shared_ptr<Handle>>>& handles() {
+    static std::map<int64_t, std::pair<std::string, std::shared_ptr<Handle>>> open_handles;
+    return open_handles;
+}
+
+}  // namespace
+
+int64_t open_handle(const std::string& dir, uint32_t dim) {
+    static int64_t next_handle = 1;
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex());
+        for (const auto& entry : handles()) {
+            if (entry.second.first == dir) {
+                LOGE("Vector index %s is already open", dir.c_str());
+                return 0;
+            }
+        }
+    }
+    auto handle = std::make_shared<Handle>();
+    if (!handle->index.open(dir, dim)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(handles_mutex());
+    int64_t id = next_handle++;
+    handles()[id] = {dir, handle};
+    return id;
+}
+
+std::shared_ptr<Handle> find_handle(int64_t handle) {
+    std::lock_guard<std::mutex> lock(handles_mutex());
+    auto it = handles().find(handle);
+    return it != handles().end() ? it->second.second : nullptr;
+}
+
+bool close_handle(int64_t handle) {
+    std::shared_ptr<Handle> index;
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex());
+        auto it = handles().find(handle);
+        if (it == handles().end()) {
+            return false;
+        }
+        index = std::move(it->second.second);
+        handles().erase(it);
+    }
+    std::lock_guard<std::mutex> lock(index->mutex);
+    bool synced = index->index.sync();
+    index->index.close();
+    return synced;
+}
+
+}  // namespace vector_index
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Nearest-neighbour index over note and OCR embeddings (embedTexts): IVF-PQ
+ * in memory-mapped files.
+ *
+ * Embeddings are L2-normalized, so the score is the inner product. The first
+ * kTrainSize vectors are stored as they are and searched exactly. Then the
+ * index trains itself once: k-means picks `lists` coarse centroids, and the
+ * residual of every vector from its nearest centroid is product-quantized to
+ * one byte per kSubDim values (96 bytes for a 768-wide embedding, 32x less
+ * than fp32). A search scores the query against every centroid and scans the
+ * `probes` best lists. Each code's score is q.c plus a sum of per-subspace
+ * table lookups, and q.residual is the same sum in every list, so one
+ * m x 256 table per query serves all of them.
+ *
+ * On disk, in the index directory:
+ *   quantizer.bin  centroids and codebooks, written once when trained
+ *   codes.bin      append-only (id, list, m code bytes) records; list -1 removes the id
+ *   raw.bin        append-only (id, op, dim floats) records until trained
+ * Files are mmapped on open and read once to build the posting lists, so a
+ * few thousand notes open without decoding anything. Records appended after
+ * that are kept in memory as well. Adding an id again replaces it.
+ *
+ * Not thread safe; the JNI handles below serialize each index.
+ */
+class VectorIndex {
+public:
+    static constexpr uint32_t kSubDim = 8;          // values per PQ subspace
+    static constexpr uint32_t kCodebookSize = 256;  // one code byte per subspace
+    static constexpr size_t kTrainSize = 1024;      // vectors kept exact before training
+    static constexpr int kDefaultProbes = 8;
+
+    VectorIndex() = default;
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+    ~VectorIndex();
+
+    // Open or create the index in `dir` for `dim`-wide vectors (a multiple of kSubDim)
+    bool open(const std::string& dir, uint32_t dim);
+    void close();
+
+    bool add(int64_t id, const float* vector);
+    bool remove(int64_t id);
+
+    // Train now instead of at kTrainSize; needs kCodebookSize vectors
+    bool train();
+
+    // Up to `k` best ids with their scores, best first; returns how many
+    size_t search(const float* query, size_t k, int probes, int64_t* ids, float* scores) const;
+
+    // fsync the appended records
+    bool sync();
+
+    size_t size() const { return live_count_; }
+    bool trained() const { return trained_; }
+    uint32_t lists() const { return lists_; }
+    uint32_t code_bytes() const { return subspaces_; }
+
+private:
+    // A mmapped record file plus the records appended since it was mapped
+    struct RecordFile {
+        int fd = -1;
+        void* map = nullptr;
+        size_t map_bytes = 0;
+        size_t mapped = 0;  // records in the map
+        size_t record_bytes = 0;
+        std::vector<uint8_t> tail;
+
+        size_t count() const { return mapped + tail.size() / record_bytes; }
+        const uint8_t* record(size_t i) const;
+        bool open(const std::string& path, uint32_t magic, uint32_t dim, size_t record_bytes);
+        bool append(const void* record);
+        void close();
+    };
+
+    bool load_quantizer(const std::string& path);
+    bool encode_raw();
+    void note_record(size_t index, int64_t id, bool live);
+    void rebuild();
+    int nearest_list(const float* vector) const;
+    void encode(const float* vector, int32_t* list, uint8_t* codes) const;
+    bool add_code(int64_t id, const float* vector);
+
+    std::string dir_;
+    uint32_t dim_ = 0;
+    uint32_t subspaces_ = 0;
+    bool trained_ = false;
+
+    // Quantizer, mmapped from quantizer.bin once trained
+    void* quantizer_map_ = nullptr;
+    size_t quantizer_bytes_ = 0;
+    uint32_t lists_ = 0;
+    uint32_t codebook_size_ = 0;
+    const float* centroids_ = nullptr;  // lists x dim
+    const float* codebooks_ = nullptr;  // subspaces x codebook_size x kSubDim
+
+    RecordFile raw_;
+    RecordFile codes_;
+    std::unordered_map<int64_t, uint32_t> latest_;  // id -> its current record in the active file
+    std::vector<uint8_t> live_;                     // per record: still the current one of its id
+    std::vector<std::vector<uint32_t>> postings_;   // record indices per list
+    size_t live_count_ = 0;
+};
+
+// Dot product of n floats; NEON on arm64
+float vector_dot(const float* a, const float* b, size_t n);
+
+// Indexes by the handle the Java side holds, each used under its own lock
+namespace vector_index {
+
+struct Handle {
+    std::mutex mutex;
+    VectorIndex index;
+};
+
+// 0 if the index cannot be opened
+int64_t open_handle(const std::string& dir, uint32_t dim);
+std::shared_ptr<Handle> find_handle(int64_t handle);
+bool close_handle(int64_t handle);
+
+}  // namespace vector_index
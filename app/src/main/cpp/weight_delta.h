@@ -0,0 +1,390 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "model_manifest.h"
+
+/**
+ * Weight updates between releases as a delta against the installed model, so
+ * an update downloads what changed rather than all 38 shards again.
+ *
+ *   Header | per file: FileHeader, name, ChunkRef[chunks] | removed names | literal chunks
+ *
+ * A delta lists every file the new release changes or adds, chunked exactly as
+ * the model manifest chunks the weights (model_manifest.h), and each chunk is
+ * either literal bytes in the delta or a reference by hash to a chunk the
+ * installed weights already have, wherever it sits: a re-quantized layer that
+ * moved to another shard still costs nothing. tools/make_weight_delta.py
+ * writes them.
+ *
+ * apply() builds each changed file next to the old one as `<name>.delta-new`,
+ * hashing every chunk as it is written, so a damaged delta or a damaged local
+ * chunk fails the update before anything is replaced. Unchanged files are not
+ * touched. The new manifest follows from the delta's hashes without reading
+ * the files again. Only then does it write a journal of the renames and carry
+ * it out; recover() finishes a journal a crash interrupted, so the directory
+ * is always either the old release or the new one.
+ */
+namespace weight_delta {
+
+static constexpr uint32_t kMagic = 0x4c444253;  // "SBDL"
+static constexpr uint32_t kVersion = 1;
+static constexpr uint64_t kFromInstalled = UINT64_MAX;
+static constexpr const char* kStagedSuffix = ".delta-new";
+static constexpr const char* kJournalName = "delta-journal.txt";
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t chunk_bytes;
+    uint32_t file_count;
+    uint32_t removed_count;
+};
+
+struct FileHeader {
+    uint32_t name_bytes;
+    uint32_t chunk_count;
+    uint64_t size;
+};
+
+struct ChunkRef {
+    uint64_t hash;     // FNV-1a of the chunk, as in the manifest
+    uint64_t literal;  // offset of its bytes in the delta; kFromInstalled: find it by hash
+};
+
+static_assert(sizeof(Header) == 24 && sizeof(FileHeader) == 16 && sizeof(ChunkRef) == 16,
+              "matches tools/make_weight_delta.py");
+
+struct FileDelta {
+    std::string name;
+    uint64_t size = 0;
+    std::vector<ChunkRef> chunks;
+};
+
+struct Delta {
+    uint64_t chunk_bytes = 0;
+    std::vector<FileDelta> files;
+    std::vector<std::string> removed;
+};
+
+// Relative to the model directory and never one of the update's own files
+inline bool safe_name(const std::string& name) {
+    return !name.empty() && name[0] != '/' && name.find("..") == std::string::npos &&
+           name != model_manifest::kFileName && name != kJournalName;
+}
+
+inline bool parse(const uint8_t* data, size_t size, Delta* delta) {
+    size_t at = 0;
+    auto take = [&](void* out, size_t bytes) {
+        if (size - at < bytes) {
+            return false;
+        }
+        memcpy(out, data + at, bytes);
+        at += bytes;
+        return true;
+    };
+    auto take_name = [&](uint32_t bytes, std::string* name) {
+        if (size - at < bytes) {
+            return false;
+        }
+        name->assign(reinterpret_cast<const char*>(data + at), bytes);
+        at += bytes;
+        return safe_name(*name);
+    };
+    Header header;
+    if (!take(&header, sizeof(header)) || header.magic != kMagic || header.version != kVersion ||
+        header.chunk_bytes == 0) {
+        return false;
+    }
+    delta->chunk_bytes = header.chunk_bytes;
+    for (uint32_t i = 0; i < header.file_count; ++i) {
+        FileHeader file_header;
+        FileDelta file;
+        if (!take(&file_header, sizeof(file_header)) || !take_name(file_header.name_bytes, &file.name) ||
+            file_header.chunk_count != model_manifest::chunk_count(file_header.size, header.chunk_bytes) ||
+            size_t(file_header.chunk_count) * sizeof(ChunkRef) > size - at) {
+            return false;
+        }
+        file.size = file_header.size;
+        file.chunks.resize(file_header.chunk_count);
+        take(file.chunks.data(), file.chunks.size() * sizeof(ChunkRef));
+        for (size_t c = 0; c < file.chunks.size(); ++c) {
+            uint64_t length = std::min(header.chunk_bytes, file.size - c * header.chunk_bytes);
+            uint64_t literal = file.chunks[c].literal;
+            if (literal != kFromInstalled && (literal > size || length > size - literal)) {
+                return false;
+            }
+        }
+        delta->files.push_back(std::move(file));
+    }
+    for (uint32_t i = 0; i < header.removed_count; ++i) {
+        uint32_t name_bytes = 0;
+        std::string name;
+        if (!take(&name_bytes, sizeof(name_bytes)) || !take_name(name_bytes, &name)) {
+            return false;
+        }
+        delta->removed.push_back(std::move(name));
+    }
+    return true;
+}
+
+inline bool fsync_path(const std::string& path, int flags) {
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Carries out an interrupted update's journal, if there is one: renames the
+// staged files that are still staged and removes what the update removed.
+// False if the journal is there but cannot be finished.
+inline bool recover(const std::string& dir) {
+    std::string journal_path = dir + "/" + kJournalName;
+    FILE* journal = fopen(journal_path.c_str(), "rb");
+    if (journal == nullptr) {
+        return true;
+    }
+    bool ok = true;
+    char line[1024];
+    while (fgets(line, sizeof(line), journal) != nullptr) {
+        std::string text(line);
+        if (!text.empty() && text.back() == '\n') {
+            text.pop_back();
+        }
+        if (text.rfind("rename ", 0) == 0) {
+            std::string name = text.substr(7);
+            std::string staged = dir + "/" + name + kStagedSuffix;
+            if (access(staged.c_str(), F_OK) == 0 && rename(staged.c_str(), (dir + "/" + name).c_str()) != 0) {
+                ok = false;
+            }
+        } else if (text.rfind("remove ", 0) == 0) {
+            remove((dir + "/" + text.substr(7)).c_str());
+        }
+    }
+    fclose(journal);
+    ok = ok && fsync_path(dir, O_RDONLY | O_DIRECTORY);
+    return ok && remove(journal_path.c_str()) == 0;
+}
+
+// Where the installed weights hold a chunk of each hash
+struct Source {
+    std::string name;
+    uint64_t offset = 0;
+};
+
+inline std::map<uint64_t, Source> installed_chunks(const model_manifest::Manifest& manifest) {
+    std::map<uint64_t, Source> sources;
+    for (const model_manifest::Entry& entry : manifest.files) {
+        for (size_t i = 0; i < entry.chunks.size(); ++i) {
+            sources.emplace(entry.chunks[i], Source{entry.name, i * manifest.chunk_bytes});
+        }
+    }
+    return sources;
+}
+
+// Writes `file` as its staged copy; false, with `error` set, if a chunk is
+// missing or does not match its hash
+inline bool stage_file(const std::string& dir, const Delta& delta, const FileDelta& file, const uint8_t* data,
+                       const std::map<uint64_t, Source>& sources, std::map<std::string, int>& open_sources,
+                       std::string* error) {
+    std::string staged = dir + "/" + file.name + kStagedSuffix;
+    int fd = ::open(staged.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || (file.size > 0 && posix_fallocate(fd, 0, static_cast<off_t>(file.size)) != 0 &&
+                   ftruncate(fd, static_cast<off_t>(file.size)) != 0)) {
+        *error = "cannot create " + staged;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    std::vector<uint8_t> buffer;
+    bool ok = true;
+    for (size_t c = 0; ok && c < file.chunks.size(); ++c) {
+        const ChunkRef& chunk = file.chunks[c];
+        uint64_t offset = c * delta.chunk_bytes;
+        size_t length = static_cast<size_t>(std::min(delta.chunk_bytes, file.size - offset));
+        const uint8_t* bytes = data + chunk.literal;
+        if (chunk.literal == kFromInstalled) {
+            auto source = sources.find(chunk.hash);
+            if (source == sources.end()) {
+                *error = file.name + ": chunk " + std::to_string(c) + " is neither in the delta nor installed";
+                ok = false;
+                break;
+            }
+            auto it = open_sources.find(source->second.name);
+            if (it == open_sources.end()) {
+                it = open_sources.emplace(source->second.name,
+                                          ::open((dir + "/" + source->second.name).c_str(), O_RDONLY | O_CLOEXEC))
+                         .first;
+            }
+            buffer.resize(length);
+            ok = it->second >= 0 && pread(it->second, buffer.data(), length, static_cast<off_t>(source->second.offset)) ==
+                                        static_cast<ssize_t>(length);
+            bytes = buffer.data();
+        }
+        // A damaged delta or installed chunk stops the update here
+        if (!ok || model_manifest::fnv1a(bytes, length) != chunk.hash) {
+            *error = file.name + ": chunk " + std::to_string(c) + " does not match its hash";
+            ok = false;
+            break;
+        }
+        ok = pwrite(fd, bytes, length, static_cast<off_t>(offset)) == static_cast<ssize_t>(length);
+        if (!ok) {
+            *error = "cannot write " + staged;
+        }
+    }
+    ok = ok && fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Applies the delta at `delta_path` to the model in `dir`; the directory keeps
+// the old release unless it returns true. Needs the installed model's manifest,
+// which the delta's references are resolved against.
+inline bool apply(const std::string& dir, const std::string& delta_path, std::string* error) {
+    if (!recover(dir)) {
+        *error = "an earlier update could not be finished";
+        return false;
+    }
+    model_manifest::Manifest manifest = model_manifest::read(dir);
+    if (!manifest.loaded()) {
+        *error = "no model manifest to apply the delta against";
+        return false;
+    }
+    int fd = ::open(delta_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        *error = "cannot read " + delta_path;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        *error = "cannot map " + delta_path;
+        return false;
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(mapped);
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    Delta delta;
+    bool ok = parse(data, size, &delta);
+    if (!ok) {
+        *error = "malformed delta";
+    } else if (delta.chunk_bytes != manifest.chunk_bytes) {
+        *error = "delta chunked differently from the manifest";
+        ok = false;
+    }
+    std::map<uint64_t, Source> sources = installed_chunks(manifest);
+    std::map<std::string, int> open_sources;
+    size_t staged = 0;
+    for (; ok && staged < delta.files.size(); ++staged) {
+        ok = stage_file(dir, delta, delta.files[staged], data, sources, open_sources, error);
+    }
+    for (auto& source : open_sources) {
+        if (source.second >= 0) {
+            ::close(source.second);
+        }
+    }
+    munmap(mapped, size);
+
+    // The new manifest, from the delta's hashes and the staged files' mtimes (renames keep them)
+    for (size_t i = 0; ok && i < delta.files.size(); ++i) {
+        const FileDelta& file = delta.files[i];
+        if (file.name.find('/') != std::string::npos) {
+            continue;  // the manifest lists the top level
+        }
+        std::string path = dir + "/" + file.name + kStagedSuffix;
+        struct stat staged_st;
+        model_manifest::Entry entry;
+        entry.name = file.name;
+        entry.size = file.size;
+        if (model_manifest::is_weight_file(file.name) && file.size > 0) {
+            for (const ChunkRef& chunk : file.chunks) {
+                entry.chunks.push_back(chunk.hash);
+            }
+            entry.hash = model_manifest::merkle_root(entry.chunks);
+            ok = stat(path.c_str(), &staged_st) == 0;
+            entry.mtime = ok ? model_manifest::mtime_ns(staged_st) : 0;
+        } else {
+            ok = model_manifest::hash_file(path, &entry.hash);
+        }
+        model_manifest::Entry* existing = manifest.find(file.name);
+        if (existing != nullptr) {
+            *existing = std::move(entry);
+        } else {
+            manifest.files.push_back(std::move(entry));
+        }
+    }
+    for (const std::string& name : delta.removed) {
+        manifest.files.erase(std::remove_if(manifest.files.begin(), manifest.files.end(),
+                                            [&name](const model_manifest::Entry& entry) { return entry.name == name; }),
+                             manifest.files.end());
+    }
+    std::sort(manifest.files.begin(), manifest.files.end(),
+              [](const model_manifest::Entry& a, const model_manifest::Entry& b) { return a.name < b.name; });
+    std::string staged_manifest = std::string(model_manifest::kFileName) + kStagedSuffix;
+    if (ok && !model_manifest::save(dir, manifest, staged_manifest)) {
+        *error = "cannot write the new manifest";
+        ok = false;
+    }
+
+    auto discard_staged = [&] {
+        for (size_t i = 0; i < std::min(staged + 1, delta.files.size()); ++i) {
+            remove((dir + "/" + delta.files[i].name + kStagedSuffix).c_str());
+        }
+        remove((dir + "/" + staged_manifest).c_str());
+    };
+    if (!ok) {
+        discard_staged();
+        return false;
+    }
+
+    // Everything is staged and verified: commit through the journal
+    std::string journal;
+    for (const FileDelta& file : delta.files) {
+        journal += "rename " + file.name + "\n";
+    }
+    for (const std::string& name : delta.removed) {
+        journal += "remove " + name + "\n";
+    }
+    journal += "rename " + std::string(model_manifest::kFileName) + "\n";
+    std::string journal_path = dir + "/" + kJournalName;
+    FILE* out = fopen((journal_path + ".tmp").c_str(), "wb");
+    if (out != nullptr) {
+        ok = fwrite(journal.data(), 1, journal.size(), out) == journal.size() && fflush(out) == 0 &&
+             fsync(fileno(out)) == 0;
+        ok = fclose(out) == 0 && ok;
+    }
+    if (out == nullptr || !ok || rename((journal_path + ".tmp").c_str(), journal_path.c_str()) != 0 ||
+        !fsync_path(dir, O_RDONLY | O_DIRECTORY)) {
+        *error = "cannot write the update journal";
+        remove((journal_path + ".tmp").c_str());
+        discard_staged();
+        return false;
+    }
+    if (!recover(dir)) {
+        *error = "update journaled but not finished; recover() completes it";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace weight_delta
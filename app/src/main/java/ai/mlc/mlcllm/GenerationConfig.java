@@ -2,42 +2,167 @@ package ai.mlc.mlcllm;
 
 /**
  * A simplified GenerationConfig class to allow compilation without the actual implementation.
+ * The native engines read these fields directly (see generation_config.h), so keep
+ * the names and types in sync with it.
  */
 public class GenerationConfig {
     private float temperature;
     private float topP;
+    private float repetitionPenalty;
     private int maxGenLen;
-    
+    private long seed;
+    private String jsonSchema;
+    private String[] stopStrings;
+    private String adapter;
+    private long deadlineMs;
+    private float contextRatio;
+
     private GenerationConfig(Builder builder) {
         this.temperature = builder.temperature;
         this.topP = builder.topP;
+        this.repetitionPenalty = builder.repetitionPenalty;
         this.maxGenLen = builder.maxGenLen;
+        this.seed = builder.seed;
+        this.jsonSchema = builder.jsonSchema;
+        this.stopStrings = builder.stopStrings;
+        this.adapter = builder.adapter;
+        this.deadlineMs = builder.deadlineMs;
+        this.contextRatio = builder.contextRatio;
     }
-    
+
     public static Builder builder() {
         return new Builder();
     }
-    
+
+    public float getTemperature() {
+        return temperature;
+    }
+
+    public float getTopP() {
+        return topP;
+    }
+
+    public float getRepetitionPenalty() {
+        return repetitionPenalty;
+    }
+
+    public int getMaxGenLen() {
+        return maxGenLen;
+    }
+
+    public long getSeed() {
+        return seed;
+    }
+
+    public String getJsonSchema() {
+        return jsonSchema;
+    }
+
+    public String[] getStopStrings() {
+        return stopStrings;
+    }
+
+    public String getAdapter() {
+        return adapter;
+    }
+
+    public long getDeadlineMs() {
+        return deadlineMs;
+    }
+
+    public float getContextRatio() {
+        return contextRatio;
+    }
+
     public static class Builder {
         private float temperature = 0.7f;
         private float topP = 0.95f;
+        private float repetitionPenalty = 1.0f;
         private int maxGenLen = 1024;
-        
+        private long seed = -1L;
+        private String jsonSchema = null;
+        private String[] stopStrings = null;
+        private String adapter = null;
+        private long deadlineMs = 0L;
+        private float contextRatio = 0f;
+
         public Builder temperature(float temperature) {
             this.temperature = temperature;
             return this;
         }
-        
+
         public Builder topP(float topP) {
             this.topP = topP;
             return this;
         }
-        
+
+        public Builder repetitionPenalty(float repetitionPenalty) {
+            this.repetitionPenalty = repetitionPenalty;
+            return this;
+        }
+
         public Builder maxGenLen(int maxGenLen) {
             this.maxGenLen = maxGenLen;
             return this;
         }
-        
+
+        /**
+         * Seed sampling for this request; negative draws a fresh seed
+         */
+        public Builder seed(long seed) {
+            this.seed = seed;
+            return this;
+        }
+
+        /**
+         * Constrain the output to JSON matching this schema ("{}" for any JSON);
+         * needs native sampling. Null leaves the output free.
+         */
+        public Builder jsonSchema(String jsonSchema) {
+            this.jsonSchema = jsonSchema;
+            return this;
+        }
+
+        /**
+         * End the output at the first of these strings, which is left out.
+         * A string that is a single vocabulary piece (e.g. "<end_of_turn>")
+         * stops on that token.
+         */
+        public Builder stopStrings(String... stopStrings) {
+            this.stopStrings = stopStrings;
+            return this;
+        }
+
+        /**
+         * Run this request with the LoRA adapter of this name from the model's
+         * adapters directory, or "base" for the base model. Null leaves it to
+         * the session's adapter, then to the routed subject's.
+         */
+        public Builder adapter(String adapter) {
+            this.adapter = adapter;
+            return this;
+        }
+
+        /**
+         * Answer within this many milliseconds of the request: the answer is
+         * capped to what fits, cut at the deadline if it runs late, and
+         * canned if no model answer can make it. 0 for no deadline.
+         */
+        public Builder deadlineMs(long deadlineMs) {
+            this.deadlineMs = deadlineMs;
+            return this;
+        }
+
+        /**
+         * Thin long retrieved context to about this share of its tokens before
+         * prefill, dropping its least informative words first. 0 (or 1) keeps
+         * it whole.
+         */
+        public Builder contextRatio(float contextRatio) {
+            this.contextRatio = contextRatio;
+            return this;
+        }
+
         public GenerationConfig build() {
             return new GenerationConfig(this);
         }
@@ -1,9 +1,13 @@
 package com.example.studybuddy
 
 import android.app.Application
+import android.content.ComponentCallbacks2
 import androidx.multidex.MultiDexApplication
 import android.util.Log
+import com.example.studybuddy.ml.RealMlcLanguageModel
+import com.example.studybuddy.ml.TVMBridge
 import java.io.File
+import kotlin.concurrent.thread
 
 /**
  * Custom Application class that enables MultiDex support for the application.
@@ -12,6 +16,9 @@ import java.io.File
 class StudyBuddyApplication : MultiDexApplication() {
     private val TAG = "StudyBuddyApplication"
     
+    @Volatile
+    private var warmupBridge: TVMBridge? = null
+    
     override fun onCreate() {
         super.onCreate()
         Log.d(TAG, "Application initialized with MultiDex support")
@@ -24,6 +31,46 @@ class StudyBuddyApplication : MultiDexApplication() {
             Log.e(TAG, "Uncaught exception in thread ${thread.name}", throwable)
             // You could add crash reporting here
         }
+        
+        startEngineWarmup()
+    }
+    
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        if (level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW) {
+            // Give the memory back rather than holding an engine nobody asked for yet
+            warmupBridge?.cancelWarmup(level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL)
+        }
+        // The engine lock may be held by a request in progress; do not wait on the main thread
+        thread(name = "engine-trim") {
+            val freed = RealMlcLanguageModel.trimMemory(level)
+            if (freed > 0) {
+                Log.d(TAG, "Trim level $level released ${freed / 1024} KB")
+            }
+        }
+    }
+    
+    /**
+     * Load and warm the model in the background so the first chat does not pay for
+     * library loading, weight mapping and kernel compilation.
+     */
+    private fun startEngineWarmup() {
+        val modelDir = File(filesDir, "models/gemma2_2b_it")
+        if (!File(modelDir, "config.json").exists()) {
+            Log.d(TAG, "No downloaded model yet, skipping warm start")
+            return
+        }
+        
+        thread(name = "engine-warmup", priority = Thread.MIN_PRIORITY) {
+            try {
+                val bridge = TVMBridge()
+                warmupBridge = bridge
+                val started = bridge.warmStart(modelDir.absolutePath)
+                Log.d(TAG, "Engine warm start ${if (started) "started" else "skipped"}")
+            } catch (e: Throwable) {
+                Log.e(TAG, "Engine warm start failed", e)
+            }
+        }
     }
     
     /**
@@ -0,0 +1,247 @@
+package com.example.studybuddy.ml
+
+import android.content.Context
+import android.os.Build
+import android.os.Debug
+import android.os.SystemClock
+import android.util.Log
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import org.json.JSONArray
+import org.json.JSONObject
+import java.io.File
+
+/**
+ * A/B benchmark of the native engines LLMFactory can pick from.
+ *
+ * Every engine is loaded in turn, runs the same prompt suite and is shut down
+ * before the next one loads, so only one model is resident at a time. For each
+ * engine the report has the load time, time to first token, decode rate and
+ * the process RSS and native heap at their peak during the suite. The engine
+ * with the best decode rate among those that answered every prompt wins (a
+ * lower TTFT breaks a tie within 5%), and the result is saved for this build
+ * of the device, which LLMFactory.createLLM then follows.
+ *
+ * SimpleMlcModel does not stream, so its TTFT is the whole reply. Tokens are
+ * estimated at 4 characters each for every engine, which keeps the rates
+ * comparable with each other although not with the native token counts.
+ */
+class EngineBenchmark(private val context: Context) {
+
+    enum class Engine { TVM_BRIDGE, MLC_LLM, SIMPLE_MLC }
+
+    data class EngineResult(
+        val engine: Engine,
+        val loaded: Boolean,
+        val loadMs: Long = 0,
+        val ttftMs: Double = 0.0,
+        val tokensPerSecond: Double = 0.0,
+        val completed: Int = 0,
+        val peakRssKb: Long = 0,
+        val peakNativeHeapKb: Long = 0,
+        val error: String? = null
+    ) {
+        fun toJson(): JSONObject = JSONObject()
+            .put("engine", engine.name)
+            .put("loaded", loaded)
+            .put("load_ms", loadMs)
+            .put("ttft_ms", ttftMs)
+            .put("tokens_per_second", tokensPerSecond)
+            .put("completed", completed)
+            .put("peak_rss_kb", peakRssKb)
+            .put("peak_native_heap_kb", peakNativeHeapKb)
+            .put("error", error ?: JSONObject.NULL)
+    }
+
+    companion object {
+        private const val TAG = "EngineBenchmark"
+        private const val REPORT_FILE = "engine_benchmark.json"
+
+        val DEFAULT_PROMPTS = listOf(
+            "Explain photosynthesis in two sentences.",
+            "What is the derivative of x squared times sine of x?",
+            "Give three tips for memorizing vocabulary in a new language.",
+            "Summarize the causes of the First World War in one paragraph."
+        )
+
+        /**
+         * Engine that won the last benchmark on this device build, or null if it
+         * has not been run since the last system update.
+         */
+        fun preferredEngine(context: Context): Engine? {
+            return try {
+                val file = File(context.filesDir, REPORT_FILE)
+                if (!file.exists()) {
+                    return null
+                }
+                val report = JSONObject(file.readText())
+                if (report.optString("device") != Build.FINGERPRINT || report.isNull("winner")) {
+                    return null
+                }
+                Engine.valueOf(report.getString("winner"))
+            } catch (e: Exception) {
+                Log.w(TAG, "Ignoring unreadable benchmark report: ${e.message}")
+                null
+            }
+        }
+
+        fun createModel(context: Context, engine: Engine): LanguageModel = when (engine) {
+            Engine.TVM_BRIDGE -> TVMLanguageModel(context)
+            Engine.MLC_LLM -> RealMlcLanguageModel(context)
+            Engine.SIMPLE_MLC -> MlcLanguageModel(context)
+        }
+    }
+
+    /**
+     * Benchmark every engine and save the report; returns it as JSON.
+     * Takes minutes with a real model, so run it from a settings or debug action.
+     */
+    suspend fun run(prompts: List<String> = DEFAULT_PROMPTS): String = withContext(Dispatchers.IO) {
+        val results = Engine.values().map { engine ->
+            Log.i(TAG, "Benchmarking $engine")
+            benchmark(engine, prompts).also { Log.i(TAG, "$engine: ${it.toJson()}") }
+        }
+        val winner = pickWinner(results, prompts.size)
+
+        val report = JSONObject()
+            .put("device", Build.FINGERPRINT)
+            .put("model", Build.MODEL)
+            .put("prompts", prompts.size)
+            .put("winner", winner?.name ?: JSONObject.NULL)
+            .put("engines", JSONArray(results.map { it.toJson() }))
+        try {
+            File(context.filesDir, REPORT_FILE).writeText(report.toString())
+        } catch (e: Exception) {
+            Log.e(TAG, "Failed to save benchmark report: ${e.message}", e)
+        }
+        Log.i(TAG, "Winner on ${Build.MODEL}: ${winner ?: "none"}")
+        report.toString()
+    }
+
+    private fun pickWinner(results: List<EngineResult>, prompts: Int): Engine? {
+        val complete = results.filter { it.loaded && it.completed == prompts && it.tokensPerSecond > 0.0 }
+        val best = complete.maxByOrNull { it.tokensPerSecond } ?: return null
+        return complete
+            .filter { it.tokensPerSecond >= best.tokensPerSecond * 0.95 }
+            .minByOrNull { it.ttftMs }
+            ?.engine
+    }
+
+    private suspend fun benchmark(engine: Engine, prompts: List<String>): EngineResult {
+        val model = try {
+            createModel(context, engine)
+        } catch (e: Throwable) {
+            return EngineResult(engine, loaded = false, error = e.message ?: e.toString())
+        }
+
+        var peakRss = rssKb()
+        var peakHeap = Debug.getNativeHeapAllocatedSize() / 1024
+        val loadStart = SystemClock.elapsedRealtime()
+        try {
+            // SimpleMlcModel throws where the others only set error
+            model.initialize()
+        } catch (e: Throwable) {
+            Log.w(TAG, "$engine failed to load: ${e.message}")
+        }
+        val loadMs = SystemClock.elapsedRealtime() - loadStart
+        if (!model.initialized.value) {
+            shutdownQuietly(model)
+            return EngineResult(engine, loaded = false, loadMs = loadMs,
+                error = model.error.value ?: "Failed to initialize")
+        }
+
+        var ttftTotal = 0.0
+        var decodeTokens = 0.0
+        var decodeSeconds = 0.0
+        var completed = 0
+        var lastError: String? = null
+        for (prompt in prompts) {
+            try {
+                model.reset()
+                val run = runPrompt(engine, model, prompt)
+                if (run.error != null) {
+                    lastError = run.error
+                } else {
+                    completed++
+                    ttftTotal += run.ttftMs
+                    // Decode rate excludes the first token; a single-chunk reply counts whole
+                    val tokens = run.chars / 4.0
+                    val seconds = (run.totalMs - if (run.chunks > 1) run.ttftMs else 0.0) / 1000.0
+                    if (seconds > 0.0) {
+                        decodeTokens += tokens
+                        decodeSeconds += seconds
+                    }
+                }
+            } catch (e: Exception) {
+                lastError = e.message ?: e.toString()
+            }
+            peakRss = maxOf(peakRss, rssKb())
+            peakHeap = maxOf(peakHeap, Debug.getNativeHeapAllocatedSize() / 1024)
+        }
+        shutdownQuietly(model)
+
+        return EngineResult(
+            engine,
+            loaded = true,
+            loadMs = loadMs,
+            ttftMs = if (completed > 0) ttftTotal / completed else 0.0,
+            tokensPerSecond = if (decodeSeconds > 0.0) decodeTokens / decodeSeconds else 0.0,
+            completed = completed,
+            peakRssKb = peakRss,
+            peakNativeHeapKb = peakHeap,
+            error = lastError
+        )
+    }
+
+    private class PromptRun(val ttftMs: Double, val totalMs: Double, val chars: Int, val chunks: Int, val error: String?)
+
+    private suspend fun runPrompt(engine: Engine, model: LanguageModel, prompt: String): PromptRun {
+        val start = SystemClock.elapsedRealtimeNanos()
+        fun sinceStartMs() = (SystemClock.elapsedRealtimeNanos() - start) / 1e6
+
+        if (engine == Engine.SIMPLE_MLC) {
+            val reply = model.generateText(prompt)
+            val total = sinceStartMs()
+            val error = if (reply.startsWith("ERROR:") || reply.startsWith("Error:")) reply else null
+            return PromptRun(total, total, reply.length, 1, error)
+        }
+
+        // TVMLanguageModel and RealMlcLanguageModel stream on the calling thread
+        var ttft = -1.0
+        var chars = 0
+        var chunks = 0
+        var error: String? = null
+        model.streamText(prompt, { token ->
+            if (ttft < 0.0) {
+                ttft = sinceStartMs()
+            }
+            chars += token.length
+            chunks++
+        }, { message -> error = message })
+        val total = sinceStartMs()
+        if (error == null && chunks == 0) {
+            error = "Empty response"
+        }
+        return PromptRun(if (ttft < 0.0) total else ttft, total, chars, chunks, error)
+    }
+
+    private suspend fun shutdownQuietly(model: LanguageModel) {
+        try {
+            model.shutdown()
+        } catch (e: Throwable) {
+            Log.w(TAG, "Shutdown failed: ${e.message}")
+        }
+    }
+
+    private fun rssKb(): Long {
+        return try {
+            File("/proc/self/status").readLines()
+                .firstOrNull { it.startsWith("VmRSS:") }
+                ?.split(Regex("\\s+"))
+                ?.getOrNull(1)
+                ?.toLongOrNull() ?: 0L
+        } catch (e: Exception) {
+            0L
+        }
+    }
+}
@@ -7,12 +7,17 @@ import kotlinx.coroutines.async
 import kotlinx.coroutines.awaitAll
 import kotlinx.coroutines.coroutineScope
 import kotlinx.coroutines.withContext
+import java.util.concurrent.atomic.AtomicLong
 import java.io.File
 import java.io.FileOutputStream
 import java.io.IOException
+import java.io.RandomAccessFile
 import java.net.HttpURLConnection
 import java.net.URL
+import java.nio.ByteBuffer
+import java.nio.channels.Channels
 import java.security.MessageDigest
+import kotlin.concurrent.thread
 
 /**
  * Downloader for the Gemma 2B-IT model from Hugging Face.
@@ -24,6 +29,10 @@ class GemmaModelDownloader(private val context: Context) {
         private const val BASE_URL = "https://huggingface.co/mlc-ai/gemma-2b-it-q4f16_1-MLC/resolve/main/"
         private const val BUFFER_SIZE = 8192
         private const val MAX_CONCURRENT_DOWNLOADS = 3
+        // Range requests start on chunk boundaries of the model manifest (model_manifest.h)
+        private const val RANGE_ALIGNMENT = 1L shl 20
+        private const val RANGE_BUFFER_SIZE = 256 * 1024
+        private const val RANGE_ATTEMPTS = 3
         
         // Essential files needed for the model to work
         private val ESSENTIAL_FILES = listOf(
@@ -39,6 +48,11 @@ class GemmaModelDownloader(private val context: Context) {
             "params_shard_$index.bin"
         }
         
+        // All shards in one file once packShards packed them
+        private const val SHARD_PACK = "params.pack"
+        // Block-compressed shard next to or instead of params_shard_N.bin
+        private const val COMPRESSED_SHARD_SUFFIX = ".zblk"
+        
         // Checksums for essential files (SHA-256)
         private val FILE_CHECKSUMS = mapOf(
             "tokenizer_config.json" to "75b24ea2b06f254e9f4e0633a9c0dbb0b051a6517bef557dfa234a5f70caa957",
@@ -52,6 +66,21 @@ class GemmaModelDownloader(private val context: Context) {
     // Directory to store model files
     private val modelDir by lazy { File(context.filesDir, "models/gemma2_2b_it") }
     
+    /**
+     * Pack the shards into one params.pack after a download (MlcLlmBridge.packWeights),
+     * so loads open and map a single file. The shard files are removed, and only the
+     * MlcLlmBridge loader reads the pack: leave this off when TVMBridge loads the model.
+     */
+    var packShards = false
+    
+    /**
+     * Parallel range requests per parameter shard, written natively into the
+     * preallocated shard (MlcLlmBridge.openDownloadTarget), hashed for the model
+     * manifest as they arrive. 1 (or no engine library) keeps the resumable
+     * single-connection download through a temp file.
+     */
+    var rangeConnections = 4
+    
     /**
      * Download a single file from the Hugging Face repository.
      * @param fileName Name of the file to download
@@ -202,26 +231,158 @@ class GemmaModelDownloader(private val context: Context) {
     }
     
     /**
-     * Verify file integrity using SHA-256 checksum
+     * Download [fileName] with [rangeConnections] parallel range requests written
+     * straight into the preallocated file. Falls back to [downloadFile] when the
+     * file exists already, the server does not serve ranges or the engine
+     * library is missing.
      */
-    private fun verifyFileChecksum(file: File, fileName: String): Boolean {
-        val expectedChecksum = FILE_CHECKSUMS[fileName] ?: return true // Skip verification if no checksum
+    suspend fun downloadFileRanges(fileName: String, progressCallback: (Float) -> Unit): Boolean = withContext(Dispatchers.IO) {
+        val targetFile = File(modelDir, fileName)
+        if (rangeConnections <= 1 || targetFile.exists() || (!modelDir.exists() && !modelDir.mkdirs())) {
+            return@withContext downloadFile(fileName, progressCallback)
+        }
+        val size = rangeFileSize(fileName)
+        val bridge = try {
+            MlcLlmBridge()
+        } catch (e: Throwable) {
+            null
+        }
+        val handle = if (bridge != null && size > 0) bridge.openDownloadTarget(targetFile.absolutePath, size) else 0L
+        if (bridge == null || handle == 0L) {
+            return@withContext downloadFile(fileName, progressCallback)
+        }
         
+        // Split on chunk boundaries, so each chunk comes through one connection in order
+        val perConnection = (size + rangeConnections - 1) / rangeConnections
+        val segmentBytes = (perConnection + RANGE_ALIGNMENT - 1) / RANGE_ALIGNMENT * RANGE_ALIGNMENT
+        val received = AtomicLong(0)
+        var fetched = false
         try {
-            val digest = MessageDigest.getInstance("SHA-256")
-            val buffer = ByteArray(8192)
-            var bytesRead: Int
-            
-            file.inputStream().use { inputStream ->
-                while (inputStream.read(buffer).also { bytesRead = it } != -1) {
-                    digest.update(buffer, 0, bytesRead)
-                }
+            fetched = coroutineScope {
+                (0L until size step segmentBytes).map { start ->
+                    async {
+                        fetchSegment(bridge, handle, fileName, start, minOf(size, start + segmentBytes)) { bytes ->
+                            progressCallback(received.addAndGet(bytes).toFloat() / size.toFloat())
+                        }
+                    }
+                }.awaitAll().all { it }
             }
-            
-            val calculatedChecksum = digest.digest().joinToString("") { 
-                String.format("%02x", it) 
+        } finally {
+            // Discards the partial target when a connection failed or threw
+            if (!fetched) {
+                bridge.closeDownloadTarget(handle, false)
             }
-            
+        }
+        val success = fetched && bridge.closeDownloadTarget(handle, true)
+        
+        if (!success) {
+            Log.e(TAG, "Ranged download of $fileName failed")
+            return@withContext false
+        }
+        if (FILE_CHECKSUMS.containsKey(fileName) && !verifyFileChecksum(targetFile, fileName)) {
+            Log.e(TAG, "Checksum verification failed for downloaded file: $fileName")
+            targetFile.delete()
+            return@withContext false
+        }
+        progressCallback(1.0f)
+        Log.d(TAG, "Downloaded $fileName (${targetFile.length()} bytes) over $rangeConnections connections")
+        return@withContext true
+    }
+    
+    /**
+     * Size of [fileName] on the server, 0 if unknown or if it does not serve byte ranges
+     */
+    private fun rangeFileSize(fileName: String): Long {
+        try {
+            val connection = URL("$BASE_URL$fileName").openConnection() as HttpURLConnection
+            connection.requestMethod = "HEAD"
+            connection.connectTimeout = 15000
+            connection.readTimeout = 30000
+            connection.instanceFollowRedirects = true
+            if (connection.responseCode != HttpURLConnection.HTTP_OK ||
+                connection.getHeaderField("Accept-Ranges") != "bytes") {
+                return 0L
+            }
+            return maxOf(connection.contentLengthLong, 0L)
+        } catch (e: IOException) {
+            Log.w(TAG, "Cannot size $fileName for a ranged download: ${e.message}")
+            return 0L
+        }
+    }
+    
+    /**
+     * Fetch bytes [start] until [end] of [fileName] into the download target,
+     * reconnecting from where it stopped up to RANGE_ATTEMPTS times.
+     */
+    private fun fetchSegment(
+        bridge: MlcLlmBridge,
+        handle: Long,
+        fileName: String,
+        start: Long,
+        end: Long,
+        onBytes: (Long) -> Unit
+    ): Boolean {
+        var position = start
+        val buffer = ByteBuffer.allocateDirect(RANGE_BUFFER_SIZE)
+        for (attempt in 1..RANGE_ATTEMPTS) {
+            try {
+                val connection = URL("$BASE_URL$fileName").openConnection() as HttpURLConnection
+                connection.requestMethod = "GET"
+                connection.connectTimeout = 15000
+                connection.readTimeout = 30000
+                connection.instanceFollowRedirects = true
+                connection.setRequestProperty("Range", "bytes=$position-${end - 1}")
+                if (connection.responseCode != HttpURLConnection.HTTP_PARTIAL) {
+                    Log.e(TAG, "Range request for $fileName returned HTTP ${connection.responseCode}")
+                    return false
+                }
+                Channels.newChannel(connection.inputStream).use { channel ->
+                    while (position < end) {
+                        buffer.clear()
+                        buffer.limit(minOf(RANGE_BUFFER_SIZE.toLong(), end - position).toInt())
+                        val bytesRead = channel.read(buffer)
+                        if (bytesRead < 0) {
+                            break
+                        }
+                        if (!bridge.writeDownloadRange(handle, position, buffer, bytesRead)) {
+                            Log.e(TAG, "Cannot write $fileName at $position")
+                            return false
+                        }
+                        position += bytesRead
+                        onBytes(bytesRead.toLong())
+                    }
+                }
+                if (position == end) {
+                    return true
+                }
+            } catch (e: IOException) {
+                Log.w(TAG, "Range of $fileName interrupted at $position (attempt $attempt): ${e.message}")
+            }
+        }
+        return false
+    }
+    
+    /**
+     * Verify file integrity using SHA-256 checksum
+     */
+    private fun verifyFileChecksum(file: File, fileName: String): Boolean {
+        if (!FILE_CHECKSUMS.containsKey(fileName)) {
+            return true // Skip verification if no checksum
+        }
+        return verifyChecksums(listOf(fileName), listOf(file)).isEmpty()
+    }
+    
+    /**
+     * Verify [fileNames] (stored at [files]) against FILE_CHECKSUMS in one pass.
+     * @return The names that failed; names without a known checksum pass
+     */
+    private fun verifyChecksums(fileNames: List<String>, files: List<File>): List<String> {
+        val checked = fileNames.indices.filter { FILE_CHECKSUMS.containsKey(fileNames[it]) }
+        val digests = sha256(checked.map { files[it] })
+        return checked.filterIndexed { i, index ->
+            val fileName = fileNames[index]
+            val expectedChecksum = FILE_CHECKSUMS.getValue(fileName)
+            val calculatedChecksum = digests[i]
             val isValid = calculatedChecksum == expectedChecksum
             if (isValid) {
                 Log.d(TAG, "Checksum verification passed for $fileName")
@@ -230,11 +391,45 @@ class GemmaModelDownloader(private val context: Context) {
                 Log.e(TAG, "Expected: $expectedChecksum")
                 Log.e(TAG, "Calculated: $calculatedChecksum")
             }
-            
-            return isValid
-        } catch (e: Exception) {
-            Log.e(TAG, "Error verifying checksum for $fileName", e)
-            return false
+            !isValid
+        }.map { fileNames[it] }
+    }
+    
+    /**
+     * SHA-256 of each of [files], natively and in parallel where the engine
+     * library is available (MlcLlmBridge.sha256Files), else with MessageDigest.
+     * An unreadable file gets null.
+     */
+    private fun sha256(files: List<File>): List<String?> {
+        if (files.isEmpty()) {
+            return emptyList()
+        }
+        try {
+            val digests = MlcLlmBridge().sha256Files(files.map { it.absolutePath }.toTypedArray(), null)
+            if (digests != null) {
+                return digests.map { it.ifEmpty { null } }
+            }
+        } catch (e: Throwable) {
+            // The engine library may be missing from this build
+            Log.w(TAG, "Native checksums unavailable: ${e.message}")
+        }
+        return files.map { file ->
+            try {
+                val digest = MessageDigest.getInstance("SHA-256")
+                val buffer = ByteArray(1 shl 20)
+                var bytesRead: Int
+                
+                file.inputStream().use { inputStream ->
+                    while (inputStream.read(buffer).also { bytesRead = it } != -1) {
+                        digest.update(buffer, 0, bytesRead)
+                    }
+                }
+                
+                digest.digest().joinToString("") { String.format("%02x", it) }
+            } catch (e: Exception) {
+                Log.e(TAG, "Error verifying checksum for ${file.name}", e)
+                null
+            }
         }
     }
     
@@ -273,7 +468,7 @@ class GemmaModelDownloader(private val context: Context) {
         for (batch in parameterShardBatches) {
             val downloadResults = batch.map { file ->
                 async {
-                    val success = downloadFile(file) { progress ->
+                    val success = downloadFileRanges(file) { progress ->
                         fileProgressCallback(file, progress)
                     }
                     
@@ -294,11 +489,10 @@ class GemmaModelDownloader(private val context: Context) {
             }
         }
         
-        // Verify all essential files are present with correct checksums
-        val missingOrInvalidFiles = ESSENTIAL_FILES.filter { fileName ->
-            val file = File(modelDir, fileName)
-            !file.exists() || !verifyFileChecksum(file, fileName)
-        }
+        // Verify all essential files are present with correct checksums, hashed together
+        val missingFiles = ESSENTIAL_FILES.filter { !File(modelDir, it).exists() }
+        val presentFiles = ESSENTIAL_FILES - missingFiles.toSet()
+        val missingOrInvalidFiles = missingFiles + verifyChecksums(presentFiles, presentFiles.map { File(modelDir, it) })
         
         if (missingOrInvalidFiles.isNotEmpty()) {
             Log.e(TAG, "Missing or invalid essential files after download: $missingOrInvalidFiles")
@@ -306,9 +500,153 @@ class GemmaModelDownloader(private val context: Context) {
         }
         
         Log.d(TAG, "Successfully downloaded all model files")
+        startWeightRepack()
         return@coroutineScope true
     }
     
+    /**
+     * Update the downloaded model to a new release from the weight delta
+     * [deltaFile] (MlcLlmBridge.applyWeightDelta), downloading only what changed
+     * instead of every shard. The delta file is deleted afterwards either way.
+     * @return True if the new release is in place; false leaves the old one
+     */
+    suspend fun applyWeightDelta(deltaFile: File): Boolean = withContext(Dispatchers.IO) {
+        try {
+            val applied = MlcLlmBridge().applyWeightDelta(modelDir.absolutePath, deltaFile.absolutePath)
+            Log.d(TAG, "Weight delta ${deltaFile.name} ${if (applied) "applied" else "not applied"}")
+            return@withContext applied
+        } catch (e: Throwable) {
+            // The engine library may be missing from this build
+            Log.w(TAG, "Weight delta skipped: ${e.message}")
+            return@withContext false
+        } finally {
+            deltaFile.delete()
+        }
+    }
+    
+    /**
+     * Find damaged chunks of the downloaded model (MlcLlmBridge.findDamagedChunks)
+     * and fetch only those byte ranges again with HTTP Range requests, instead of
+     * whole shards. Unless [full], only files changed since they last verified
+     * clean are read.
+     * @return True if nothing was damaged or every damaged range was repaired
+     */
+    suspend fun repairModel(full: Boolean = false): Boolean = withContext(Dispatchers.IO) {
+        val bridge = try {
+            MlcLlmBridge()
+        } catch (e: Throwable) {
+            Log.w(TAG, "Chunk repair unavailable: ${e.message}")
+            return@withContext false
+        }
+        val ranges = bridge.findDamagedChunks(modelDir.absolutePath, full)
+        if (ranges == null) {
+            Log.w(TAG, "No model manifest to repair against")
+            return@withContext false
+        }
+        var repaired = true
+        // "<offset> <length> <fileSize> <name>", grouped by file
+        ranges.map { it.split(" ", limit = 4) }.groupBy { it[3] }.forEach { (fileName, fileRanges) ->
+            if (fileName !in ESSENTIAL_FILES && fileName !in PARAMETER_SHARDS) {
+                // params.pack and compressed shards are made on the device, not downloaded
+                Log.e(TAG, "Cannot fetch damaged $fileName from $BASE_URL")
+                repaired = false
+                return@forEach
+            }
+            val offsets = mutableListOf<Long>()
+            RandomAccessFile(File(modelDir, fileName), "rw").use { file ->
+                file.setLength(fileRanges[0][2].toLong())
+                for (range in fileRanges) {
+                    val offset = range[0].toLong()
+                    val length = range[1].toLong()
+                    // A zero-length range only asks for the truncate above
+                    if (length == 0L) {
+                        continue
+                    }
+                    if (!fetchRange(fileName, file, offset, length)) {
+                        repaired = false
+                        return@forEach
+                    }
+                    offsets.add(offset)
+                }
+                file.fd.sync()
+            }
+            val bytes = fileRanges.sumOf { it[1].toLong() }
+            if (bridge.verifyRepairedChunks(modelDir.absolutePath, fileName, offsets.toLongArray())) {
+                Log.d(TAG, "Repaired $fileName: $bytes bytes in ${fileRanges.size} ranges")
+            } else {
+                repaired = false
+            }
+        }
+        return@withContext repaired
+    }
+    
+    /**
+     * Download bytes [offset] to [offset] + [length] of [fileName] into the same
+     * place of [target].
+     */
+    private fun fetchRange(fileName: String, target: RandomAccessFile, offset: Long, length: Long): Boolean {
+        try {
+            val connection = URL("$BASE_URL$fileName").openConnection() as HttpURLConnection
+            connection.requestMethod = "GET"
+            connection.connectTimeout = 15000
+            connection.readTimeout = 30000
+            connection.instanceFollowRedirects = true
+            connection.setRequestProperty("Range", "bytes=$offset-${offset + length - 1}")
+            
+            // A 200 would be the whole file, not the range
+            if (connection.responseCode != HttpURLConnection.HTTP_PARTIAL) {
+                Log.e(TAG, "Range request for $fileName returned HTTP ${connection.responseCode}")
+                return false
+            }
+            
+            var written = 0L
+            target.seek(offset)
+            connection.inputStream.use { input ->
+                val buffer = ByteArray(BUFFER_SIZE)
+                var bytesRead: Int
+                while (written < length && input.read(buffer).also { bytesRead = it } != -1) {
+                    val take = minOf(bytesRead.toLong(), length - written).toInt()
+                    target.write(buffer, 0, take)
+                    written += take
+                }
+            }
+            if (written != length) {
+                Log.e(TAG, "Range of $fileName ended after $written of $length bytes")
+                return false
+            }
+            return true
+        } catch (e: IOException) {
+            Log.e(TAG, "Error fetching $fileName bytes $offset+$length", e)
+            return false
+        }
+    }
+    
+    /**
+     * Pack the shards if [packShards] asks for it, write the model manifest
+     * (MlcLlmBridge.writeModelManifest), so startup reads one file instead of probing
+     * the directory, then repack the new shards for this device
+     * (MlcLlmBridge.repackWeights), so every load after the first skips the decoding
+     * and copies. All of it runs in the background.
+     */
+    private fun startWeightRepack() {
+        thread(name = "weight-repack", priority = Thread.MIN_PRIORITY) {
+            try {
+                val bridge = MlcLlmBridge()
+                if (packShards) {
+                    val packed = bridge.packWeights(modelDir.absolutePath)
+                    Log.d(TAG, "Shard pack ${if (packed) "written" else "failed"}")
+                }
+                val manifest = bridge.writeModelManifest(modelDir.absolutePath)
+                Log.d(TAG, "Model manifest ${if (manifest) "written" else "not written"}")
+                val repacked = bridge.repackWeights(modelDir.absolutePath)
+                Log.d(TAG, "Weight repack ${if (repacked) "done" else "failed"}")
+            } catch (e: Throwable) {
+                // The engine library may be missing from this build
+                Log.w(TAG, "Weight repack skipped: ${e.message}")
+            }
+        }
+    }
+    
     /**
      * Check if the model is already downloaded.
      * This performs a basic check to see if the essential files exist.
@@ -340,10 +678,17 @@ class GemmaModelDownloader(private val context: Context) {
             }
         }
         
-        // Check all parameter shards
+        // Packed shards live in one file (see packShards)
+        val pack = File(modelDir, SHARD_PACK)
+        if (pack.exists() && pack.length() > 0L) {
+            return true
+        }
+        
+        // Check all parameter shards, either form (see MlcLlmBridge.getWeightFormats)
         for (file in PARAMETER_SHARDS) {
             val f = File(modelDir, file)
-            if (!f.exists() || f.length() <= 0L) {
+            val compressed = File(modelDir, "$file$COMPRESSED_SHARD_SUFFIX")
+            if ((!f.exists() || f.length() <= 0L) && (!compressed.exists() || compressed.length() <= 0L)) {
                 return false
             }
         }
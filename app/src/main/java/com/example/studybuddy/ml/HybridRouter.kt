@@ -0,0 +1,81 @@
+package com.example.studybuddy.ml
+
+import android.os.SystemClock
+import android.util.Log
+import com.example.studybuddy.api.LlmApiService
+import kotlinx.coroutines.async
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.currentCoroutineContext
+import kotlinx.coroutines.isActive
+import kotlinx.coroutines.selects.select
+import kotlinx.coroutines.suspendCancellableCoroutine
+import kotlin.coroutines.resume
+
+/**
+ * Answers a prompt on the device or through LlmApiService, whichever
+ * MlcLlmBridge.routeRequest predicts is faster. A hedged request goes to both:
+ * the first answer that is not an error wins and the other one is cancelled.
+ * Remote calls are timed into the bridge's routing policy as they finish.
+ */
+class HybridRouter(private val bridge: MlcLlmBridge, private val remote: LlmApiService) {
+    private val tag = "HybridRouter"
+
+    suspend fun generate(prompt: String, maxTokens: Int = 512): String {
+        val route = bridge.routeRequest(prompt, maxTokens)[MlcLlmBridge.ROUTE_DECISION].toInt()
+        return when (route) {
+            MlcLlmBridge.ROUTE_REMOTE -> {
+                val answer = remoteAnswer(prompt)
+                if (isError(answer)) localAnswer(prompt) else answer
+            }
+            MlcLlmBridge.ROUTE_HEDGE -> hedged(prompt)
+            else -> localAnswer(prompt)
+        }
+    }
+
+    private suspend fun hedged(prompt: String): String = coroutineScope {
+        val local = async { localAnswer(prompt) }
+        val remoteCall = async { remoteAnswer(prompt) }
+        var (answer, localWon) = select<Pair<String, Boolean>> {
+            local.onAwait { it to true }
+            remoteCall.onAwait { it to false }
+        }
+        if (isError(answer)) {
+            // The first side failed; the other may still answer
+            answer = if (localWon) remoteCall.await() else local.await()
+            localWon = !localWon
+        }
+        local.cancel()
+        remoteCall.cancel()
+        bridge.recordHedgeWinner(localWon)
+        Log.d(tag, "Hedged request answered ${if (localWon) "on device" else "remotely"}")
+        answer
+    }
+
+    /**
+     * Generate on the native worker and suspend until it completes. Cancelling
+     * the coroutine cancels the request.
+     */
+    private suspend fun localAnswer(prompt: String): String = suspendCancellableCoroutine { cont ->
+        val id = bridge.submitGenerate(prompt, null) { result -> if (cont.isActive) cont.resume(result) }
+        if (id < 0) {
+            cont.resume("Error: Failed to queue generation")
+            return@suspendCancellableCoroutine
+        }
+        cont.invokeOnCancellation { bridge.cancelRequest(id) }
+    }
+
+    // A cancelled call (the device won a hedge) is not recorded
+    private suspend fun remoteAnswer(prompt: String): String {
+        val start = SystemClock.elapsedRealtime()
+        val answer = remote.getCompletion(prompt)
+        val ms = (SystemClock.elapsedRealtime() - start).toFloat()
+        if (!currentCoroutineContext().isActive) {
+            return answer
+        }
+        val ok = !isError(answer)
+        bridge.recordRemoteLatency(ms, ms, if (ok) answer.length / 4 + 1 else 0, ok)
+        return answer
+    }
+
+    private fun isError(text: String) = text.startsWith("Error:") || text.startsWith("ERROR:")
+}
@@ -12,10 +12,17 @@ class LLMFactory {
         
         /**
          * Create an appropriate LLM instance based on available libraries.
-         * Prioritizes MLC-LLM and will fail if it cannot be initialized.
+         * Uses the engine that won EngineBenchmark on this device, and the
+         * SimpleMlcModel-backed MLC-LLM model until a benchmark has been run.
          */
         fun createLLM(context: Context): LanguageModel {
             try {
+                val engine = EngineBenchmark.preferredEngine(context)
+                if (engine != null) {
+                    Log.d(TAG, "Creating $engine language model (benchmark winner)")
+                    return EngineBenchmark.createModel(context, engine)
+                }
+                
                 Log.d(TAG, "Creating SimpleMlcModel language model")
                 // Create our SimpleMlcModel which uses the mock implementation
                 val mlcModel = MlcLanguageModel(context)
@@ -24,7 +31,7 @@ class LLMFactory {
                 // Let the component handle initialization
                 return mlcModel
             } catch (e: Exception) {
-                val errorMsg = "Failed to create SimpleMlcModel: ${e.message}"
+                val errorMsg = "Failed to create language model: ${e.message}"
                 Log.e(TAG, errorMsg, e)
                 
                 // Return an error model instead of throwing
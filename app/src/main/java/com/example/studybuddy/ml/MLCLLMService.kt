@@ -8,6 +8,7 @@ import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.withContext
 import java.io.File
 import java.io.IOException
+import java.util.concurrent.atomic.AtomicLong
 
 /**
  * A service for managing MLC-LLM model loading and inference
@@ -45,6 +46,14 @@ class MLCLLMService private constructor(private val context: Context) {
     
     private var lastStreamedText = ""
     
+    // Trace ids tie a call's native logs, trace sections and metrics together
+    private val nextTraceId = AtomicLong(System.currentTimeMillis() shl 16)
+    
+    /** Trace id of the latest generateText or streamText call, for [requestTrace] */
+    @Volatile
+    var lastTraceId = 0L
+        private set
+    
     init {
         // Initialize the model on first use
         _isModelLoaded.value = false
@@ -268,12 +277,17 @@ class MLCLLMService private constructor(private val context: Context) {
             }
         }
         
+        val traceId = newTraceId()
         try {
             val tvmBridge = TVMBridge()
-            val response = tvmBridge.chat(prompt)
-            return@withContext response
+            val previous = tvmBridge.setTraceId(traceId)
+            try {
+                return@withContext tvmBridge.chat(prompt)
+            } finally {
+                tvmBridge.setTraceId(previous)
+            }
         } catch (e: Exception) {
-            val errorMsg = "Error generating text: ${e.message}"
+            val errorMsg = "Error generating text (trace $traceId): ${e.message}"
             Log.e(TAG, errorMsg, e)
             _errorMessage.value = errorMsg
             throw RuntimeException(errorMsg)
@@ -307,15 +321,17 @@ class MLCLLMService private constructor(private val context: Context) {
             // Use the TVMBridge for streaming text generation
             val tvmBridge = TVMBridge()
             
-            // Start streaming in a separate thread
+            // Start streaming in a separate thread, which carries the trace id into native code
+            val traceId = newTraceId()
             val thread = Thread {
                 try {
+                    tvmBridge.setTraceId(traceId)
                     tvmBridge.streamChat(prompt) { token ->
                         lastStreamedText += token
                         _textStream.value = listOf(lastStreamedText)
                     }
                 } catch (e: Exception) {
-                    val errorMsg = "Error in streaming thread: ${e.message}"
+                    val errorMsg = "Error in streaming thread (trace $traceId): ${e.message}"
                     Log.e(TAG, errorMsg, e)
                     _errorMessage.value = errorMsg
                     _textStream.value = listOf(lastStreamedText + "\n\nError: ${e.message}")
@@ -335,6 +351,23 @@ class MLCLLMService private constructor(private val context: Context) {
         }
     }
 
+    /**
+     * Everything recorded natively for one call, by the trace id it was given
+     * ([lastTraceId], or the id in its log lines): stage timestamps, the
+     * request's flight recorder events and spans. "{}" once the request has
+     * aged out of the native history or when it never reached the engine.
+     */
+    fun requestTrace(traceId: Long): String {
+        return TVMBridge().getRequestTrace(traceId)
+    }
+    
+    private fun newTraceId(): Long {
+        val traceId = nextTraceId.incrementAndGet()
+        lastTraceId = traceId
+        Log.d(TAG, "Request trace $traceId")
+        return traceId
+    }
+    
     /**
      * Check if model files are already available
      */
@@ -0,0 +1,66 @@
+package com.example.studybuddy.ml
+
+import android.content.BroadcastReceiver
+import android.content.Context
+import android.content.Intent
+import android.util.Log
+import java.io.File
+
+/**
+ * Drives the native metrics sampler from adb, for performance_monitoring.sh:
+ *
+ *   am broadcast -a com.example.studybuddy.metrics.START --ei interval_ms 500 --ei capacity 7200
+ *   am broadcast -a com.example.studybuddy.metrics.PROMPT --es prompt "..."
+ *   am broadcast -a com.example.studybuddy.metrics.EXPORT
+ *   am broadcast -a com.example.studybuddy.metrics.STOP
+ *
+ * EXPORT writes the samples to getExternalFilesDir()/metrics.jsonl (or the
+ * "file" extra's name there) for adb pull, and the engine's getMetrics() JSON
+ * beside it as metrics_summary.json. PROMPT queues a generation on the loaded
+ * engine in place of tapping through the UI. The receiver requires DUMP, which
+ * the adb shell holds and other apps do not.
+ */
+class MetricsExportReceiver : BroadcastReceiver() {
+    companion object {
+        private const val TAG = "MetricsExport"
+        const val ACTION_START = "com.example.studybuddy.metrics.START"
+        const val ACTION_STOP = "com.example.studybuddy.metrics.STOP"
+        const val ACTION_EXPORT = "com.example.studybuddy.metrics.EXPORT"
+        const val ACTION_PROMPT = "com.example.studybuddy.metrics.PROMPT"
+        private const val DEFAULT_INTERVAL_MS = 1000
+        private const val DEFAULT_CAPACITY = 3600
+    }
+
+    override fun onReceive(context: Context, intent: Intent) {
+        val bridge = try {
+            MlcLlmBridge()
+        } catch (e: Throwable) {
+            Log.e(TAG, "Native bridge unavailable: ${e.message}")
+            return
+        }
+        when (intent.action) {
+            ACTION_START -> {
+                val intervalMs = intent.getIntExtra("interval_ms", DEFAULT_INTERVAL_MS)
+                val capacity = intent.getIntExtra("capacity", DEFAULT_CAPACITY)
+                bridge.startMetricsSampler(intervalMs, capacity)
+                Log.i(TAG, "Sampling every $intervalMs ms")
+            }
+            ACTION_STOP -> bridge.stopMetricsSampler()
+            ACTION_EXPORT -> {
+                val dir = context.getExternalFilesDir(null) ?: context.filesDir
+                val file = File(dir, intent.getStringExtra("file") ?: "metrics.jsonl")
+                val ok = bridge.exportMetricsSamples(file.absolutePath)
+                File(dir, "metrics_summary.json").writeText(bridge.getMetrics())
+                Log.i(TAG, if (ok) "Exported ${file.absolutePath}" else "Export to ${file.absolutePath} failed")
+            }
+            ACTION_PROMPT -> {
+                val prompt = intent.getStringExtra("prompt") ?: return
+                val started = System.currentTimeMillis()
+                val id = bridge.submitGenerate(prompt, null) { text ->
+                    Log.i(TAG, "PROMPT_DONE ${System.currentTimeMillis() - started} ms, ${text.length} chars")
+                }
+                Log.i(TAG, if (id >= 0) "PROMPT_START request $id" else "PROMPT_FAILED")
+            }
+        }
+    }
+}
@@ -1,5 +1,8 @@
 package com.example.studybuddy.ml
 
+import ai.mlc.mlcllm.GenerationConfig
+import android.os.Debug
+import android.os.SystemClock
 import android.util.Log
 
 /**
@@ -9,15 +12,473 @@ class MlcLlmBridge {
     companion object {
         private const val TAG = "MlcLlmBridge"
         
+        // Capability bits returned by getCapabilities(), mirrored from mlc_capabilities.h
+        const val CAP_STREAMING = 1 shl 0
+        const val CAP_ABORT = 1 shl 1
+        const val CAP_BATCH = 1 shl 2
+        const val CAP_PREFIX_CACHE = 1 shl 3
+        const val CAP_SYSTEM_PROMPT = 1 shl 4
+        const val CAP_SPECULATIVE = 1 shl 5
+        const val CAP_ADAPTERS = 1 shl 6
+        const val CAP_NATIVE_SAMPLING = 1 shl 7
+        const val CAP_DEVICE_SAMPLING = 1 shl 8
+        const val CAP_PAGED_KV = 1 shl 9
+        const val CAP_KV_PERSIST = 1 shl 10
+        const val CAP_KV_QUANT = 1 shl 11
+        const val CAP_SLIDING_WINDOW = 1 shl 12
+        const val CAP_CHUNKED_PREFILL = 1 shl 13
+        const val CAP_DRAFT_PREFILL = 1 shl 14
+        const val CAP_BATCHED_DECODE = 1 shl 15
+        const val CAP_BATCH_FORK = 1 shl 16
+        const val CAP_GRAMMAR = 1 shl 17
+        const val CAP_PROMPT_LOOKUP = 1 shl 18
+        const val CAP_PHASE_DEVICES = 1 shl 19
+        const val CAP_KERNEL_TUNING = 1 shl 20
+        const val CAP_KERNEL_CACHE = 1 shl 21
+        const val CAP_KERNEL_PROFILE = 1 shl 22
+        const val CAP_TOKEN_IO = 1 shl 23
+        const val CAP_EMBEDDING = 1 shl 24
+        const val CAP_BATCH_ADAPTERS = 1 shl 25
+        const val CAP_HIDDEN_STATES = 1 shl 26
+        const val CAP_TEMPLATE_IDS = 1 shl 27
+        const val CAP_SHORTLIST = 1 shl 28
+        const val CAP_DECODE_GRAPH = 1 shl 29
+        const val CAP_SELF_SPECULATIVE = 1 shl 30
+        const val CAP_HEAVY_HITTER = 1 shl 31
+        
+        // embedTexts() sources
+        const val EMBED_AUTO = 0
+        const val EMBED_CHAT = 1
+        const val EMBED_DEDICATED = 2
+        
+        // embedTextsPacked() formats
+        const val EMBED_FLOAT32 = 0
+        const val EMBED_FLOAT16 = 1
+        const val EMBED_INT8 = 2
+        
+        // getEmbedBatchStats() indices
+        const val EMBED_BATCHES = 0
+        const val EMBED_BATCH_CALLS = 1
+        const val EMBED_BATCH_TEXTS = 2
+        const val EMBED_BATCH_WAIT_MS = 3
+        
+        // gradeAnswers() fields, GRADE_FIELDS per answer
+        const val GRADE_SCORE = 0
+        const val GRADE_SIMILARITY = 1
+        const val GRADE_RECALL = 2
+        const val GRADE_VERDICT = 3
+        const val GRADE_FIELDS = 4
+        
+        // gradeAnswers() verdicts, at GRADE_VERDICT
+        const val GRADE_INCORRECT = 0
+        const val GRADE_CORRECT = 1
+        const val GRADE_AMBIGUOUS = 2
+        
+        // getVectorIndexStats() indices
+        const val VINDEX_SIZE = 0
+        const val VINDEX_TRAINED = 1
+        const val VINDEX_LISTS = 2
+        const val VINDEX_CODE_BYTES = 3
+        
+        // getKeywordIndexStats() indices
+        const val KINDEX_SIZE = 0
+        const val KINDEX_TERMS = 1
+        const val KINDEX_POSTING_BYTES = 2
+        const val KINDEX_AVERAGE_LENGTH = 3
+        
+        // getContextStats() indices
+        const val CTX_CHUNKS = 0
+        const val CTX_TOKENS = 1
+        const val CTX_MERGED = 2
+        const val CTX_DROPPED = 3
+        const val CTX_CACHE_HITS = 4
+        const val CTX_CACHE_MISSES = 5
+        
+        // getContextCompressionStats() indices
+        const val COMPRESS_TOKENS_IN = 0
+        const val COMPRESS_TOKENS_OUT = 1
+        const val COMPRESS_RATIO = 2
+        const val COMPRESS_WORDS_DROPPED = 3
+        const val COMPRESS_MS = 4
+        const val COMPRESS_PREFILL_SAVED_MS = 5
+        const val COMPRESS_REQUESTS = 6
+        const val COMPRESS_TOTAL_TOKENS_SAVED = 7
+        const val COMPRESS_TOTAL_SAVED_MS = 8
+        
+        // getPrefixTreeStats() indices
+        const val PREFIX_TREE_LOOKUPS = 0
+        const val PREFIX_TREE_HITS = 1
+        const val PREFIX_TREE_TOKENS = 2
+        const val PREFIX_TREE_TOKENS_SAVED = 3
+        const val PREFIX_TREE_HIT_RATE = 4
+        const val PREFIX_TREE_INSERTS = 5
+        const val PREFIX_TREE_EVICTIONS = 6
+        const val PREFIX_TREE_SLOTS = 7
+        const val PREFIX_TREE_CACHED_TOKENS = 8
+        const val PREFIX_TREE_NODES = 9
+        
+        // setSessionKvPolicy() policies
+        const val KV_POLICY_WINDOW = 0
+        const val KV_POLICY_HEAVY_HITTER = 1
+        
+        // getKvEvictionStats() indices
+        const val KV_EVICT_COMPRESSIONS = 0
+        const val KV_EVICT_TOKENS = 1
+        
+        // getConversationMemoryStats() indices
+        const val MEMORY_FOLDS = 0
+        const val MEMORY_TURNS_FOLDED = 1
+        const val MEMORY_TOKENS_SAVED = 2
+        
+        // getResponseCacheStats() indices
+        const val RCACHE_ENTRIES = 0
+        const val RCACHE_SLOTS = 1
+        const val RCACHE_HITS = 2
+        const val RCACHE_MISSES = 3
+        const val RCACHE_SEMANTIC_HITS = 4
+        const val RCACHE_SEMANTIC_MISSES = 5
+        const val RCACHE_FALSE_HITS = 6
+        const val RCACHE_SAVED_MS = 7
+        const val RCACHE_SEMANTIC_SIZE = 8
+        const val RCACHE_SUMMARY_ENTRIES = 9
+        const val RCACHE_SUMMARY_HITS = 10
+        const val RCACHE_SUMMARY_MISSES = 11
+        
+        // setSemanticCache() modes
+        const val SEMANTIC_SERVE = 0
+        const val SEMANTIC_SEED = 1
+        
+        // Indices into getGovernorState()
+        const val GOV_LEVEL = 0
+        const val GOV_TOKENS_PER_SECOND = 1
+        const val GOV_TARGET = 2
+        const val GOV_THERMAL_HEADROOM = 3
+        const val GOV_BATTERY_PERCENT = 4
+        
+        // Indices into getPerformanceHintStats()
+        const val PERF_HINT_STATE = 0          // 0 unsupported (below API 33), 1 no session, 2 active
+        const val PERF_HINT_THREADS = 1
+        const val PERF_HINT_TARGET_MS = 2
+        const val PERF_HINT_REPORTS = 3
+        const val PERF_HINT_OVER_TARGET = 4
+        const val PERF_HINT_AVERAGE_MS = 5
+        
+        // Indices into getThreadBoostStats(); BOOST_MODE is 0 idle, 1 interactive, 2 background
+        const val BOOST_ENABLED = 0
+        const val BOOST_MODE = 1
+        const val BOOST_UCLAMP = 2
+        const val BOOST_INTERACTIVE_HOLDS = 3
+        const val BOOST_BACKGROUND_HOLDS = 4
+        const val BOOST_FAILURES = 5
+        
+        // Thread pool core sets for setThreadConfig(), mirrored from thread_config.h
+        const val AFFINITY_AUTO = 0
+        const val AFFINITY_BIG = 1
+        const val AFFINITY_BIG_MID = 2
+        const val AFFINITY_ALL = 3
+        const val AFFINITY_MID = 4
+        
+        // setPowerProfile() modes, mirrored from power_profile.h
+        const val POWER_AUTO = 0
+        const val POWER_NORMAL = 1
+        const val POWER_SAVER = 2
+        
+        // Profiles at index POWER_PROFILE
+        const val PROFILE_NORMAL = 0
+        const val PROFILE_SAVER = 1
+        
+        // getPowerStats() indices
+        const val POWER_PROFILE = 0
+        const val POWER_NORMAL_MJ_PER_TOKEN = 1
+        const val POWER_SAVER_MJ_PER_TOKEN = 2
+        const val POWER_NORMAL_TOKENS = 3
+        const val POWER_SAVER_TOKENS = 4
+        const val POWER_NORMAL_MEAN_MW = 5
+        const val POWER_SAVER_MEAN_MW = 6
+        const val POWER_LAST_MW = 7
+        const val POWER_SAVER_MODEL = 8
+        
+        // Subjects returned by getConversationSubject(), mirrored from topic_router.h
+        const val SUBJECT_MATHEMATICS = 0
+        const val SUBJECT_PHYSICS = 1
+        const val SUBJECT_CHEMISTRY = 2
+        const val SUBJECT_BIOLOGY = 3
+        const val SUBJECT_HISTORY = 4
+        const val SUBJECT_LITERATURE = 5
+        const val SUBJECT_COMPUTER_SCIENCE = 6
+        const val SUBJECT_GENERAL = 7
+        
+        // Indices into getSpeculativeStats()
+        const val SPEC_ACCEPTANCE_RATE = 0
+        const val SPEC_TOKENS_PER_TARGET_PASS = 1
+        const val SPEC_TOKENS_PER_SECOND = 2
+        const val SPEC_TOKENS_EMITTED = 3
+        
+        // Further indices into getSelfSpeculationStats(), after the SPEC_* ones
+        const val SELF_SPEC_EXIT_LAYER = 4
+        const val SELF_SPEC_LAYERS = 5
+        
+        // Indices into getSamplerStats()
+        const val SAMPLER_LAST_US = 0
+        const val SAMPLER_AVERAGE_US = 1
+        const val SAMPLER_TOKENS = 2
+        const val SAMPLER_AVERAGE_CANDIDATES = 3
+        const val SAMPLER_DEVICE_TOKENS = 4
+        const val SAMPLER_SHORTLIST_TOKENS = 5
+        const val SAMPLER_AVERAGE_SHORTLIST = 6
+        
+        // Indices into getDecodeGraphStats()
+        const val DECODE_GRAPH_ACTIVE = 0
+        const val DECODE_GRAPH_RECORDINGS = 1
+        const val DECODE_GRAPH_REPLAYS = 2
+        const val DECODE_GRAPH_EAGER_STEPS = 3
+        
+        // Modes of setFollowUpPrefetch(), mirrored from follow_up_prefetch.h
+        const val FOLLOW_UP_OFF = 0
+        const val FOLLOW_UP_PREFILL = 1
+        const val FOLLOW_UP_GENERATE = 2
+        
+        // Indices into getFollowUpPrefetchStats()
+        const val FOLLOW_UP_PREDICTED = 0
+        const val FOLLOW_UP_SERVED = 1
+        const val FOLLOW_UP_DISCARDED = 2
+        const val FOLLOW_UP_TOKENS = 3
+        const val FOLLOW_UP_PREEMPTED = 4
+        const val FOLLOW_UP_PREPARED = 5
+        
+        // Indices into benchmarkTokenDelivery()
+        const val TOKEN_DELIVERY_CALLBACK_NS = 0
+        const val TOKEN_DELIVERY_RING_NS = 1
+        
+        // Returned by getLastStopReason(), mirrored from stop_strings.h
+        const val STOP_NONE = 0
+        const val STOP_TOKEN = 1
+        const val STOP_STRING = 2
+        const val STOP_LENGTH = 3
+        const val STOP_ABORTED = 4
+        const val STOP_ERROR = 5
+        const val STOP_CACHED = 6
+        const val STOP_DEADLINE = 7
+        const val STOP_STALLED = 8
+        
+        // setStallWatchdog() actions, mirrored from stall_watchdog.h
+        const val STALL_REPORT = 0
+        const val STALL_CANCEL = 1
+        const val STALL_FALLBACK = 2
+        
+        // getStallStats() indices
+        const val STALL_COUNT = 0
+        const val STALL_ABORTED = 1
+        const val STALL_LONGEST_MS = 2
+
+        // getModelServerStats() indices
+        const val MODEL_SERVER_SERVED = 0
+        const val MODEL_SERVER_FAILED = 1
+        const val MODEL_SERVER_CANCELLED = 2
+        const val MODEL_SERVER_REFUSED = 3
+        const val MODEL_SERVER_BYTES_OUT = 4
+        
+        // Compute backends for setComputeBackend(), mirrored from compute_device.h
+        const val BACKEND_AUTO = 0
+        const val BACKEND_OPENCL = 1
+        const val BACKEND_VULKAN = 2
+        const val BACKEND_CPU = 3
+        const val BACKEND_NPU = 4  // a prefill device in phase plans only, not for setComputeBackend()
+        
+        // Low-RAM modes for setLowRamMode(), mirrored from layer_pager.h
+        const val LOW_RAM_AUTO = 0
+        const val LOW_RAM_ON = 1
+        const val LOW_RAM_OFF = 2
+        
+        // Indices into calibratePhaseDevices() / getPhasePlan()
+        const val PHASE_PREFILL_BACKEND = 0
+        const val PHASE_DECODE_BACKEND = 1
+        const val PHASE_PREFILL_MS_PER_TOKEN = 2
+        const val PHASE_DECODE_MS_PER_TOKEN = 3
+        const val PHASE_HANDOFF_MS = 4
+        
+        // Request states returned by getRequestStatus(), mirrored from async_requests.h
+        const val REQUEST_UNKNOWN = -1
+        const val REQUEST_QUEUED = 0
+        const val REQUEST_RUNNING = 1
+        const val REQUEST_DONE = 2
+        const val REQUEST_FAILED = 3
+        const val REQUEST_CANCELLED = 4
+        
+        // getWeightFormats() bits, mirrored from ndarray_mmap_loader.h
+        const val WEIGHT_FORMAT_SHARDS = 1 shl 0
+        const val WEIGHT_FORMAT_PACK = 1 shl 1
+        const val WEIGHT_FORMAT_COMPRESSED = 1 shl 2
+        const val WEIGHT_FORMAT_REPACKED = 1 shl 3
+        const val WEIGHT_FORMAT_REQUANTIZED = 1 shl 4
+        
+        // Lower-bit variants for requantizeWeights(), mirrored from requantize.h
+        const val REQUANTIZE_Q3 = 0
+        const val REQUANTIZE_MIXED = 1
+        
+        // getKvStats() indices
+        const val KV_BUDGET_BYTES = 0
+        const val KV_RESIDENT_BYTES = 1
+        const val KV_RESIDENT_SESSIONS = 2
+        const val KV_EVICTIONS = 3
+        const val KV_BYTES_PER_TOKEN = 4
+        
+        // getModelStats() indices
+        const val MODEL_BUDGET_BYTES = 0
+        const val MODEL_RESIDENT_BYTES = 1
+        const val MODEL_RESIDENT_COUNT = 2
+        const val MODEL_EVICTIONS = 3
+        const val MODEL_UNMAPS = 4
+        
+        // getAllocStats() indices
+        const val ALLOC_POOLED_DEVICE_TYPES = 0
+        const val ALLOC_DRIVER_ALLOCS = 1
+        const val ALLOC_POOL_HITS = 2
+        const val ALLOC_WORKSPACE_ALLOCS = 3
+        const val ALLOC_POOLED_BYTES = 4
+        const val ALLOC_LIVE_BYTES = 5
+        const val ALLOC_DECODE_STEPS = 6
+        const val ALLOC_STEADY_DECODE_ALLOCS = 7
+        const val ALLOC_LAST_STEP_ALLOCS = 8
+        
+        // getHeapStats() indices
+        const val HEAP_ENGINE_THREADS = 0
+        const val HEAP_ALLOCATIONS = 1
+        const val HEAP_ALLOCATIONS_PER_S = 2
+        const val HEAP_CACHE_HIT_RATE = 3
+        const val HEAP_CACHED_BYTES = 4
+        const val HEAP_ALLOCATED_BYTES = 5
+        const val HEAP_FREE_BYTES = 6
+        const val HEAP_FRAGMENTATION = 7
+        
+        // StructuredItemListener events, mirrored from json_stream.h
+        const val STRUCTURED_ITEM = 0
+        const val STRUCTURED_END = 1
+        const val STRUCTURED_ERROR = 2
+        
+        // getTransferStats() indices
+        const val TRANSFER_COPIES = 0
+        const val TRANSFER_BYTES = 1
+        const val TRANSFER_SKIPPED_BYTES = 2
+        const val TRANSFER_COPY_MS = 3
+        const val TRANSFER_OVERLAPPED_STEPS = 4
+        const val TRANSFER_STAGING_BYTES = 5
+        
+        // getBatchStats() indices
+        const val BATCH_STEPS = 0
+        const val BATCH_AVERAGE_SIZE = 1
+        const val BATCH_PEAK_SIZE = 2
+        const val BATCH_ACTIVE = 3
+        const val BATCH_WAITING = 4
+        const val BATCH_REQUESTS = 5
+        const val BATCH_PARKED = 6
+        const val BATCH_KV_TOKENS = 7
+        const val BATCH_KV_DEFERRALS = 8
+        
+        // getBatchJobStatus() indices, and its states and wait reasons mirrored from batch_job.h
+        const val JOB_STATE = 0
+        const val JOB_WAIT = 1
+        const val JOB_DONE = 2
+        const val JOB_TOTAL = 3
+        const val JOB_STOPPED = 0
+        const val JOB_WAITING = 1
+        const val JOB_RUNNING = 2
+        const val JOB_FINISHED = 3
+        const val JOB_FAILED = 4
+        const val JOB_WAIT_NONE = 0
+        const val JOB_WAIT_CHARGING = 1
+        const val JOB_WAIT_IDLE = 2
+        const val JOB_WAIT_ENGINE = 3
+        
+        // getOutputLengthStats() task types, mirrored from output_lengths.h
+        const val TASK_CHAT = 0
+        const val TASK_FLASHCARD = 1
+        const val TASK_SUMMARY = 2
+        
+        // getOutputLengthStats() indices
+        const val LENGTH_SAMPLES = 0
+        const val LENGTH_MEAN = 1
+        const val LENGTH_P50 = 2
+        const val LENGTH_P95 = 3
+        const val LENGTH_RESERVED = 4
+        const val LENGTH_CAPPED = 5
+        
+        // submitBatchedGenerate() priorities, highest first
+        const val PRIORITY_INTERACTIVE = 0
+        const val PRIORITY_BACKGROUND = 1
+        const val PRIORITY_PREFETCH = 2
+        
+        // getLatencyStats() indices
+        const val LATENCY_REQUESTS = 0
+        const val LATENCY_MEAN_WAIT_MS = 1
+        const val LATENCY_MEAN_FIRST_TOKEN_MS = 2
+        const val LATENCY_MAX_FIRST_TOKEN_MS = 3
+        const val LATENCY_PREEMPTIONS = 4
+        
+        // getSessionResidency() results
+        const val RESIDENCY_UNKNOWN = -1
+        const val RESIDENCY_ACTIVE = 0
+        const val RESIDENCY_PARKED = 1
+        const val RESIDENCY_EVICTED = 2
+        const val RESIDENCY_EMPTY = 3
+        const val RESIDENCY_OFFLOADED = 4
+        
+        // setRoutingPolicy() modes
+        const val ROUTING_AUTO = 0
+        const val ROUTING_LOCAL = 1
+        const val ROUTING_REMOTE = 2
+        
+        // routeRequest() decisions, at index ROUTE_DECISION
+        const val ROUTE_LOCAL = 0
+        const val ROUTE_REMOTE = 1
+        const val ROUTE_HEDGE = 2
+        
+        // routeRequest() indices
+        const val ROUTE_DECISION = 0
+        const val ROUTE_LOCAL_TTFT_MS = 1
+        const val ROUTE_LOCAL_TOTAL_MS = 2
+        const val ROUTE_REMOTE_TTFT_MS = 3
+        const val ROUTE_REMOTE_TOTAL_MS = 4
+        
+        // getRoutingStats() indices
+        const val ROUTING_ROUTED_LOCAL = 0
+        const val ROUTING_ROUTED_REMOTE = 1
+        const val ROUTING_HEDGED = 2
+        const val ROUTING_HEDGE_LOCAL_WINS = 3
+        const val ROUTING_HEDGE_REMOTE_WINS = 4
+        const val ROUTING_REMOTE_SAMPLES = 5
+        
+        // getLastDeadlineOutcome() outcomes, at index DEADLINE_OUTCOME, mirrored from deadline.h
+        const val DEADLINE_NONE = 0
+        const val DEADLINE_MET = 1
+        const val DEADLINE_TRIMMED = 2
+        const val DEADLINE_CUT = 3
+        const val DEADLINE_MISSED = 4
+        const val DEADLINE_CANNED = 5
+        
+        // getLastDeadlineOutcome() indices
+        const val DEADLINE_OUTCOME = 0
+        const val DEADLINE_MS = 1
+        const val DEADLINE_PREDICTED_MS = 2
+        const val DEADLINE_ELAPSED_MS = 3
+        const val DEADLINE_MAX_TOKENS = 4
+        const val DEADLINE_DRAFT_LENGTH = 5
+        
+        // System.loadLibrary, for the first launch's startup timeline
+        private var libraryLoadMs = 0f
+        private var libraryLoadCpuMs = 0f
+        @Volatile
+        private var libraryLoadReported = false
+        
         init {
             try {
-                // Load native libraries in correct order
-                System.loadLibrary("c++_shared")
-                System.loadLibrary("tvm_runtime")
-                System.loadLibrary("tvm")
-                System.loadLibrary("mlc_llm")
+                // The linker maps its dependencies (c++_shared, tvm_runtime, mlc_llm) from the APK
+                val started = SystemClock.elapsedRealtimeNanos()
+                val cpuStarted = Debug.threadCpuTimeNanos()
                 System.loadLibrary("mlc_llm_jni")
-                Log.i(TAG, "MLC-LLM libraries loaded successfully")
+                libraryLoadMs = (SystemClock.elapsedRealtimeNanos() - started) / 1e6f
+                libraryLoadCpuMs = (Debug.threadCpuTimeNanos() - cpuStarted) / 1e6f
+                Log.i(TAG, "MLC-LLM libraries loaded successfully in $libraryLoadMs ms")
             } catch (e: UnsatisfiedLinkError) {
                 Log.e(TAG, "Failed to load native library: ${e.message}")
                 throw RuntimeException("Failed to load required native libraries: ${e.message}")
@@ -25,30 +486,1637 @@ class MlcLlmBridge {
         }
     }
     
+    init {
+        if (!libraryLoadReported) {
+            libraryLoadReported = true
+            recordStartupPhase("dlopen:libmlc_llm_jni.so", libraryLoadMs, libraryLoadCpuMs)
+        }
+    }
+    
     /**
      * Initialize the MLC-LLM engine
      */
     external fun initializeEngine(modelPath: String): Boolean
     
+    /**
+     * The cold starts of the model loaded last, newest first, at most
+     * [launches] of them (the last 20 are kept next to the model), as a JSON
+     * array. Each launch has wall_ms (when it started), state ("ok", "failed",
+     * or "loading" for one in progress), total_ms, cpu_ms, read_bytes (from
+     * storage, mmap faults included), major_faults, model, and phases: every
+     * step of initializeEngine or reloadEngine with name, start_ms from the
+     * launch's start, wall_ms, cpu_ms, read_bytes and major_faults. Phases
+     * include the library load (dlopen:*), manifest, config, device,
+     * create_module, kernel_cache, weights with weights_metadata and one
+     * shard_read:* and shard_upload:* per shard, draft, tokenizer, resolve,
+     * calibrate_threads, warmup and prefix. A phase's CPU, bytes and faults
+     * are the whole process's over its span; a shard read's are its loader
+     * worker's, with the shard's size as read_bytes. "[]" before any launch.
+     */
+    external fun getStartupTimeline(launches: Int): String
+    
+    /**
+     * A startup phase timed outside the engine, added to the next launch
+     * getStartupTimeline() reports, with a negative start_ms. The library load
+     * is reported this way when the first bridge is made.
+     */
+    external fun recordStartupPhase(name: String, wallMs: Float, cpuMs: Float)
+    
+    /**
+     * Switch to the model in [modelPath] (another model, library or quantization)
+     * without an outage: it loads while the current one keeps serving, and the
+     * switch happens between requests. Sessions, and settings made through the
+     * setters, belong to the old model and end with it; the prefill listener
+     * carries over. When the current model pages layers or runs a library
+     * through its direct exports, it is closed first and requests wait for the
+     * load. False if the new model failed to load; on the hot path the old one
+     * then keeps running. Blocks for the load; run it off the UI thread.
+     */
+    external fun reloadEngine(modelPath: String): Boolean
+    
+    /**
+     * Run the next initializeEngine on [backend] (BACKEND_* values) instead of the
+     * one mlc-chat-config.json names ("device") or the fastest found. A backend the
+     * device does not have falls back to probing OpenCL, Vulkan, then CPU.
+     */
+    external fun setComputeBackend(backend: Int)
+    
+    /**
+     * Low-RAM mode for the next initializeEngine (LOW_RAM_* values). When on, the
+     * model runs on the CPU straight from the mapped weight shards and each
+     * layer's weights are read in from flash per forward pass, so only a few
+     * layers are resident at a time at the cost of decode speed. LOW_RAM_AUTO
+     * turns it on when available memory is below the weights plus 1.5 GB, unless
+     * setComputeBackend() asked for a GPU backend.
+     */
+    external fun setLowRamMode(mode: Int)
+    
+    /**
+     * Pin the small per-layer weights (norms, scales) in memory at the next
+     * initializeEngine, within the process's mlock limit; off by default. Only
+     * applies to CPU weights read in place from the shards. getMemoryStats()
+     * reports the locked bytes.
+     */
+    external fun setLockHotWeights(lock: Boolean)
+    
+    /**
+     * Rewrite the weight shards in [modelPath] once, for the device the next
+     * initializeEngine will pick: decoded and page-aligned under repacked/, which
+     * later loads use without decoding or copying. Needs as much free storage as
+     * the shards again and takes about a minute; returns true when the cache
+     * exists. Run it on a background thread.
+     */
+    external fun repackWeights(modelPath: String): Boolean
+    
+    /**
+     * Write a lower-bit variant of the q4f16_1 weights in [modelPath] from the
+     * downloaded shards, under requantized/ and packed into one params.pack:
+     * [scheme] REQUANTIZE_Q3 takes every weight to q3f16_1, REQUANTIZE_MIXED only
+     * the MLP and keeps attention and the embedding at 4 bits. When the memory
+     * check of setLowRamMode() finds the weights too large, initializeEngine
+     * loads the best variant that fits, provided lib/ holds a model library
+     * built for it (the q4 library's name with q3f16_1 or q3f16_1-mixed in
+     * place of q4f16_1). Needs about three quarters of the shards' size in free
+     * storage and several minutes; returns true when the variant exists. Run it
+     * on a background thread, on devices short of RAM.
+     */
+    external fun requantizeWeights(modelPath: String, scheme: Int): Boolean
+    
+    /**
+     * Weight layouts the loader reads (WEIGHT_FORMAT_* bits): shard files, a
+     * params.pack, block-compressed params_shard_N.bin.zblk shards (from
+     * tools/compress_shards.py, decoded while earlier shards upload) and the
+     * repacked cache, and requantized variants. Needs no loaded model.
+     */
+    external fun getWeightFormats(): Int
+    
+    /**
+     * Pack the weight shards in [modelPath] into one page-aligned params.pack and
+     * remove the shard files, so loads open and map the weights once. Reads and
+     * writes the weights once; run it on a background thread. Returns true when
+     * the pack exists. TVM's own loader (TVMBridge) cannot read packs.
+     */
+    external fun packWeights(modelPath: String): Boolean
+    
+    /**
+     * Write model-manifest.txt into [modelPath]: every file with its size and hash,
+     * and the model library picked for this CPU. initializeEngine reads it instead
+     * of probing the directory. Hashes every shard, so run it on a background
+     * thread, once per download.
+     */
+    external fun writeModelManifest(modelPath: String): Boolean
+    
+    /**
+     * Receives checksum progress in bytes across all files, on the calling thread
+     */
+    fun interface ChecksumProgressListener {
+        fun onProgress(bytesDone: Long, bytesTotal: Long)
+    }
+    
+    /**
+     * Lowercase hex SHA-256 of each of [paths], "" for a file that cannot be read.
+     * Files are memory-mapped and hashed in parallel on the big and mid cores, with
+     * the ARMv8 SHA-2 instructions where the CPU has them. Blocks; [listener] is
+     * called about every 200 ms. Needs no loaded model.
+     */
+    external fun sha256Files(paths: Array<String>, listener: ChecksumProgressListener?): Array<String>?
+    
+    /**
+     * Update the model in [modelPath] to a new release with the delta file at
+     * [deltaPath] (tools/make_weight_delta.py): chunks the installed weights
+     * already hold are copied, every chunk is checked against its hash as it is
+     * written, and the changed files replace the old ones only once all are in
+     * place. Returns false, leaving the old release, if the delta is damaged or
+     * needs chunks this install lacks (a packed or compressed install needs the
+     * full download). Takes effect at the next initializeEngine or
+     * reloadEngine; run it off the UI thread.
+     */
+    external fun applyWeightDelta(modelPath: String, deltaPath: String): Boolean
+    
+    /**
+     * Create the download target [path] (written as [path].tmp until complete)
+     * with all [size] bytes preallocated. Returns a handle for writeDownloadRange,
+     * 0 if the space cannot be reserved. Needs no loaded model.
+     */
+    external fun openDownloadTarget(path: String, size: Long): Long
+    
+    /**
+     * Write the first [length] bytes of the direct [buffer] at [offset] of the
+     * target. Callable from several threads at once for different 1 MiB chunks;
+     * the chunk hashes for the model manifest are taken as the bytes pass.
+     */
+    external fun writeDownloadRange(handle: Long, offset: Long, buffer: java.nio.ByteBuffer, length: Int): Boolean
+    
+    /**
+     * Release [handle]. When [complete], sync the target and move it into place,
+     * keeping its chunk hashes for writeModelManifest; otherwise discard it.
+     */
+    external fun closeDownloadTarget(handle: Long, complete: Boolean): Boolean
+    
+    /**
+     * Damaged byte ranges of [modelPath] by the chunk hashes of its manifest, one
+     * "<offset> <length> <fileSize> <name>" per run of bad 1 MiB chunks; a file
+     * without chunk hashes, or missing, is one range over the whole file. Unless
+     * [full], weight files unchanged since they last came out clean are skipped.
+     * Null without a manifest. Reads what it checks; run it off the UI thread.
+     */
+    external fun findDamagedChunks(modelPath: String, full: Boolean): Array<String>?
+    
+    /**
+     * After rewriting the chunks of [fileName] that findDamagedChunks reported,
+     * starting at [offsets]: true if they now match the manifest, which then
+     * counts the file as clean again. Only those chunks are read.
+     */
+    external fun verifyRepairedChunks(modelPath: String, fileName: String, offsets: LongArray): Boolean
+    
+    /**
+     * Diagnostics initialization no longer gathers: the model and lib directory
+     * listings, files that differ from the manifest (by size, and by hash when
+     * [checkHashes], which reads every shard) and the TVM registry. Also logged.
+     */
+    external fun getModelDiagnostics(modelPath: String, checkHashes: Boolean): String
+    
+    /**
+     * Backend the loaded model runs on (BACKEND_* values); BACKEND_AUTO before initialization
+     */
+    external fun getComputeBackend(): Int
+    
+    /**
+     * Run the TVM thread pool on [affinity] cores (AFFINITY_* values) with
+     * [workers] threads, 0 for one per core of those clusters. AFFINITY_AUTO
+     * times decode on each core set the first time a model runs on the CPU
+     * and keeps the fastest, saved for this phone model. Applied before the
+     * first forward pass, or right away when a model is loaded.
+     */
+    external fun setThreadConfig(affinity: Int, workers: Int)
+    
+    /**
+     * {affinity, workers} of the thread pool in use; AFFINITY_AUTO before initialization
+     */
+    external fun getThreadConfig(): IntArray
+    
+    /**
+     * JSON: the shared worker pool's "workers" (besides the launching thread),
+     * "launches" and "tasks" per priority class (interactive, background,
+     * prefetch), "caller_tasks" run by launching threads, "held_back" times a
+     * worker left lower classes' tasks queued while interactive work ran, and whether
+     * the model library's parallel loops run on it ("model_library")
+     */
+    external fun getWorkerPoolStats(): String
+    
+    /**
+     * Hold generation near [targetTokensPerSecond] instead of running flat out
+     * until the phone throttles: each turn, the governor steps thread workers,
+     * batch size and draft length down while turns run above the target and
+     * back up below it, never past what was configured. High thermal headroom,
+     * a low battery or power saver hold it down regardless; a target of 0 only
+     * applies those. Disabling restores the configured settings.
+     */
+    external fun setGovernor(enabled: Boolean, targetTokensPerSecond: Float)
+    
+    /**
+     * ADPF performance hints (API 33+): a hint session over the engine and
+     * TVM pool threads, reporting each decode step against one token at the
+     * governor's target rate (12 tokens/s without one), so the CPU clocks
+     * follow the token deadline rather than bursty utilization. On by default;
+     * a no-op on older releases.
+     */
+    external fun setPerformanceHints(enabled: Boolean)
+    
+    /**
+     * Hint session state and what it reported (PERF_HINT_* indices)
+     */
+    external fun getPerformanceHintStats(): FloatArray
+    
+    /**
+     * While a chat turn or an interactive request holds the engine, its thread
+     * and the TVM pool run at THREAD_PRIORITY_URGENT_DISPLAY with uclamp.min
+     * at half capacity where the kernel allows it; batch jobs, summaries and
+     * prefetch run them at the lowest priority. Restored when the hold ends.
+     * On by default.
+     */
+    external fun setThreadBoost(enabled: Boolean)
+    
+    /**
+     * Boost state and counts (BOOST_* indices)
+     */
+    external fun getThreadBoostStats(): FloatArray
+    
+    /**
+     * Device state for the governor: PowerManager.getThermalHeadroom() (1.0 at
+     * the throttling threshold, negative if unknown) and the battery broadcast.
+     * Used for 30 seconds, after which the governor reads sysfs instead. The
+     * power profile (setPowerProfile) is decided from it too.
+     */
+    external fun setDeviceState(thermalHeadroom: Float, batteryPercent: Float, charging: Boolean, powerSave: Boolean)
+    
+    /**
+     * Battery-saver profile: the thread pool on AFFINITY_MID cores, no
+     * speculative decoding or draft model, at most two batched sequences, and
+     * the lower-bit build in <model>/saver when it ships (loaded in the
+     * background once the running request ends). POWER_AUTO enters it while
+     * battery saver is on or the battery is below [batteryThresholdPercent]
+     * and not charging, and leaves it 5 points above; POWER_SAVER and
+     * POWER_NORMAL force either profile.
+     */
+    external fun setPowerProfile(mode: Int, batteryThresholdPercent: Float)
+    
+    /**
+     * The profile in use and energy per token measured under each
+     * (POWER_* indices), from the battery's fuel gauge at the end of each chat
+     * turn. Turns on a charger are not measured; 0 until a turn was.
+     */
+    external fun getPowerStats(): FloatArray
+    
+    /**
+     * Governor level and inputs (GOV_* indices); level 0 runs as configured
+     */
+    external fun getGovernorState(): FloatArray
+    
+    /**
+     * How routeRequest decides (ROUTING_*). Under ROUTING_AUTO the faster
+     * predicted path must win by more than [hedgeMargin] (0.25 = 25%), else
+     * the request is hedged to both. Default ROUTING_AUTO, 0.25.
+     */
+    external fun setRoutingPolicy(mode: Int, hedgeMargin: Float)
+    
+    /**
+     * Where to send [prompt] for an answer of about [maxTokens]: local TTFT and
+     * total are predicted from this device's measured prefill rate, time per
+     * token and queue (getMetrics), stretched when thermal headroom is low;
+     * remote ones from recordRemoteLatency. ROUTE_* indices; remote values are
+     * -1 until a remote call was recorded. Does not wait for the engine.
+     */
+    external fun routeRequest(prompt: String, maxTokens: Int): FloatArray
+    
+    /**
+     * A finished LlmApiService call, for routeRequest. Pass [ttftMs] =
+     * [totalMs] for a call that did not stream; a failed call counts as slow.
+     */
+    external fun recordRemoteLatency(ttftMs: Float, totalMs: Float, tokens: Int, ok: Boolean)
+    
+    /**
+     * Which side answered a hedged request first
+     */
+    external fun recordHedgeWinner(local: Boolean)
+    
+    /**
+     * Routing decisions and hedge outcomes since start (ROUTING_* indices)
+     */
+    external fun getRoutingStats(): FloatArray
+    
+    /**
+     * Governor decisions since the last call, one JSON object per line, for the metrics log
+     */
+    external fun drainGovernorEvents(): String
+    
+    /**
+     * Time prefill and decode on every device present and keep the fastest
+     * pairing for a typical turn, which may split the phases across devices
+     * (PHASE_* indices, backends as BACKEND_* values). When the model library
+     * carries prefill graphs for the NPU and the phone has one, it is timed for
+     * prefill too, and BACKEND_NPU may come back as the prefill backend; the
+     * prompt then runs in the graphs' fixed chunk sizes. Takes a few seconds and
+     * clears the conversation; the plan is saved next to the model and applied
+     * at every later initialization. Needs CAP_PHASE_DEVICES.
+     */
+    external fun calibratePhaseDevices(): FloatArray
+    
+    /**
+     * The phase plan in use (PHASE_* indices); BACKEND_AUTO backends when uncalibrated
+     */
+    external fun getPhasePlan(): FloatArray
+    
+    /**
+     * Directory for the kernel tuning database (kernel-tuning.jsonl). Records
+     * are kept per device and model, and the fastest recorded kernel variants
+     * are applied whenever a model loads. Call before initializeEngine.
+     */
+    external fun setKernelTuningDir(dir: String)
+    
+    /**
+     * Directory for compiled GPU kernels (OpenCL program binaries, the Vulkan
+     * pipeline cache), so later launches skip building them; the model
+     * directory when unset. codeCacheDir fits, as it is cleared on app updates.
+     * Saved files are keyed by driver version and model and are replaced after
+     * a driver update. Call before initializeEngine; needs CAP_KERNEL_CACHE.
+     */
+    external fun setKernelCacheDir(dir: String)
+    
+    /**
+     * Measure untried kernel variants for up to budgetMs, one at a time,
+     * yielding to chat turns between them; returns how many were measured
+     * (0 once tuning is complete). Meant for a background job that runs while
+     * the phone is charging and idle. The conversation is rebuilt after each
+     * measurement. Needs CAP_KERNEL_TUNING.
+     */
+    external fun tuneKernels(budgetMs: Long): Int
+    
+    /**
+     * Make a running tuneKernels() return after the current measurement
+     */
+    external fun cancelKernelTuning()
+    
+    /**
+     * Debug builds: profile one prefill and decodeSteps decode steps and
+     * write profile-<backend>.json and .csv into dir. With CAP_KERNEL_PROFILE
+     * there is a row per kernel launch, otherwise per step; both include
+     * per-device totals. The JSON loads with TVM's Report.from_json. Waits
+     * for the current chat turn and holds the engine until done; the
+     * conversation is rebuilt afterwards. Returns the JSON path or "Error: ...".
+     */
+    external fun profileKernels(dir: String, decodeSteps: Int): String
+    
+    /**
+     * {measured, total} kernel variant candidates for the loaded model on this device
+     */
+    external fun getKernelTuningProgress(): IntArray
+    
+    /**
+     * Key device profiles are signed and checked with (HMAC-SHA256); the same
+     * one the backend signs with. Call before import or export.
+     */
+    external fun setDeviceProfileKey(key: String)
+    
+    /**
+     * Tuning results from another phone: thread calibration, phase plan and
+     * kernel variant timings, keyed by SoC, backend and driver, and model. When
+     * the loaded model matches on this phone, whatever was not measured here is
+     * taken from the profile and saved, so calibration and tuning are skipped.
+     * Call before initializeEngine, or any time after. False if the blob is
+     * malformed or not signed with the profile key.
+     */
+    external fun importDeviceProfile(blob: String): Boolean
+    
+    /**
+     * This phone's tuning results for the loaded model as a signed blob for
+     * importDeviceProfile on others of its kind; "" when nothing was measured,
+     * no model is loaded or no key is set.
+     */
+    external fun exportDeviceProfile(): String
+    
     /**
      * Generate a response using the model
      */
     external fun generateResponse(prompt: String): String
     
     /**
-     * Stream a response using the model
+     * Generate with settings for this request only; the engine defaults set with
+     * setTemperature etc. are left untouched
      */
-    external fun streamResponse(prompt: String, callback: (String) -> Unit)
+    external fun generateResponseWithConfig(prompt: String, config: GenerationConfig): String
     
     /**
-     * Set the generation temperature
+     * Stream with settings for this request only
      */
-    external fun setTemperature(temperature: Float)
+    external fun streamResponseWithConfig(prompt: String, config: GenerationConfig, callback: (String) -> Unit)
     
     /**
-     * Set the top-p sampling parameter
+     * Open a conversation with its own KV state next to the default one; the
+     * weights are shared. Returns -1 when every session slot is in use.
+     * Switching between sessions restores the parked KV instead of prefilling
+     * the conversation again (needs CAP_PREFIX_CACHE; otherwise a parked
+     * session restarts empty).
      */
-    external fun setTopP(topP: Float)
+    external fun createSession(): Long
+    
+    /**
+     * Close a session created with createSession
+     */
+    external fun closeSession(session: Long)
+    
+    /**
+     * Generate the next turn of [session]; a null [config] uses the engine defaults
+     */
+    external fun generateInSession(session: Long, prompt: String, config: GenerationConfig?): String
+    
+    /**
+     * Stream the next turn of [session]
+     */
+    external fun streamInSession(session: Long, prompt: String, config: GenerationConfig?, callback: (String) -> Unit)
+    
+    /**
+     * Receives the items of a structured answer as they complete (STRUCTURED_*
+     * events): each item object's JSON text with its index, then one end or
+     * error event. Called on the generating thread; must not call back into
+     * the bridge.
+     */
+    fun interface StructuredItemListener {
+        fun onEvent(event: Int, index: Int, text: String)
+    }
+    
+    /**
+     * Stream the next turn of [session] as a JSON deck or quiz, handing each
+     * item to [listener] the moment its object closes: the elements of a
+     * top-level array, or of the first array in a top-level object such as
+     * {"cards": [...]}, or the whole object when it has no array. Pair it with
+     * a jsonSchema in [config] so the answer is valid JSON. Returns the whole
+     * answer, like generateInSession.
+     */
+    external fun streamStructured(
+        session: Long,
+        prompt: String,
+        config: GenerationConfig?,
+        listener: StructuredItemListener
+    ): String
+    
+    /**
+     * Prefill the next turn of [session] from the token ids of its prompt, as
+     * NativeTokenizer.encode returns them, for prompts that are already
+     * tokenized (cached prompts, quiz templates). Returns the number of ids, or
+     * -1 on failure. generateTokens answers the turn; any other turn drops it.
+     * Without CAP_TOKEN_IO the ids are decoded and go through the text path.
+     */
+    external fun prefillTokens(session: Long, tokens: IntArray): Int
+    
+    /**
+     * The reply to the turn prefillTokens left in [session], as token ids;
+     * decode them with NativeTokenizer where the text is shown. Null if there is
+     * no such turn or generation failed. A stop string ends the reply only if it
+     * is a single token.
+     */
+    external fun generateTokens(session: Long, config: GenerationConfig?): IntArray?
+    
+    /**
+     * Clear the conversation of [session] only
+     */
+    external fun resetSession(session: Long)
+    
+    /**
+     * Branch [session] after its first [turn] turns (all of them when negative)
+     * into a new session, e.g. to ask a follow-up variant. With CAP_PAGED_KV the
+     * branch shares the parent's KV pages and is instant. Returns -1 on failure.
+     */
+    external fun forkSession(session: Long, turn: Int): Long
+    
+    /**
+     * Roll back the last turn of [session] and answer its prompt again
+     */
+    external fun regenerate(session: Long, config: GenerationConfig?): String
+    
+    /**
+     * Cap the KV memory held by all sessions. Least recently used sessions go
+     * over it first: their KV is dropped and only the turn list is kept, which
+     * is prefilled again when the session is used next. Default 256 MB.
+     */
+    external fun setKvBudget(bytes: Long)
+    
+    /**
+     * Admit requests against their forecast memory: the KV of the prompt plus
+     * the answer length the task usually needs. Chat turns that do not fit
+     * evict parked sessions, unload the draft model, then get a shorter
+     * answer; batch jobs wait and speculative work is skipped. [bytes] caps
+     * the engine (0: no cap); either way it keeps within what the system can
+     * still give less [reserveBytes] (default 384 MB).
+     */
+    external fun setMemoryBudget(bytes: Long, reserveBytes: Long)
+    
+    /**
+     * JSON: budget, reserve, the effective budget and usage at the last
+     * decision, and admitted/degraded/deferred counts per priority class
+     */
+    external fun getMemoryAdmission(): String
+    
+    /**
+     * KV budget, resident bytes and sessions, evictions so far and KV bytes per
+     * token (halved with CAP_KV_QUANT) (KV_* indices)
+     */
+    external fun getKvStats(): FloatArray
+    
+    /**
+     * Keep the KV of sessions the budget evicts instead of dropping it: it is
+     * saved to [directory], packed into up to [memoryBytes] of memory, then
+     * spilled to up to [flashBytes] there, and loaded back when the session is
+     * resumed instead of prefilled again. Needs CAP_KV_PERSIST; files left in
+     * [directory] by an earlier run are deleted. Works without a loaded model.
+     */
+    external fun openKvOffload(directory: String, memoryBytes: Long, flashBytes: Long): Boolean
+    
+    /**
+     * [session] is about to be resumed (its chat tab got focus): unpack its
+     * offloaded KV in the background, and load it back into its slot if it fits
+     * in the KV budget, so the switch does not wait for it. No-op unless the
+     * session is RESIDENCY_OFFLOADED.
+     */
+    external fun prefetchSession(session: Long)
+    
+    /**
+     * JSON: offloaded sessions and bytes per tier (raw, memory, flash), what
+     * they packed from, and counts of offloads, restores, prefetches and drops
+     */
+    external fun getKvOffloadStats(): String
+    
+    /**
+     * Cap the weights of all loaded models: the chat model plus the optional
+     * draft (<model>/draft) and embedding (<model>/embedder) models. Loading a
+     * secondary model unloads the least recently used other one when it would
+     * go over; the chat model always stays. Default 2.5 GB.
+     */
+    external fun setModelBudget(bytes: Long)
+    
+    /**
+     * Model budget, resident weight bytes and models, secondary models
+     * unloaded and unmapped so far (MODEL_* indices)
+     */
+    external fun getModelStats(): FloatArray
+    
+    /**
+     * Embedding of [text] from the embedding model shipped in <model>/embedder
+     * (CAP_EMBEDDING), loaded on first use within the model budget; null
+     * without one or on failure. Waits for any running turn. Batched with
+     * other calls as PRIORITY_INTERACTIVE (see setEmbedBatching).
+     */
+    external fun embedText(text: String): FloatArray?
+    
+    /**
+     * One L2-normalized embedding per text, from [source] (EMBED_*): the
+     * embedding model (CAP_EMBEDDING), the chat model's mean-pooled hidden
+     * states (CAP_HIDDEN_STATES), or EMBED_AUTO for the first of those. The
+     * two sources differ in width and must not be mixed in one index. Null on
+     * failure. Waits for any running turn. Calls from other threads with the
+     * same source share one forward pass, within [priority]'s (PRIORITY_*)
+     * window and batch size.
+     */
+    external fun embedTexts(texts: Array<String>, source: Int, priority: Int): Array<FloatArray>?
+    
+    /**
+     * embedTexts packed back to back in [format] (EMBED_FLOAT32, EMBED_FLOAT16,
+     * or EMBED_INT8: a float32 scale and then one signed byte per value per
+     * row), little-endian, for compact storage of note indexes
+     */
+    external fun embedTextsPacked(texts: Array<String>, source: Int, format: Int, priority: Int): ByteArray?
+    
+    /**
+     * How long an embedding call of [priority] (PRIORITY_*) waits for others
+     * to join its forward pass, and how many texts end the wait early.
+     * Defaults: interactive 2 ms / 16, background 20 ms / 64, prefetch
+     * 50 ms / 64. A window of 0 turns batching off for the class, except for
+     * calls that queue behind a running pass.
+     */
+    external fun setEmbedBatching(priority: Int, windowMs: Float, maxTexts: Int)
+    
+    /**
+     * Embedding batching since start (EMBED_BATCH* indices)
+     */
+    external fun getEmbedBatchStats(): FloatArray
+    
+    /**
+     * Open or create the nearest-neighbour index of [dim]-wide embeddings (a
+     * multiple of 8) in [dir], e.g. one per embedTexts source. Returns a
+     * handle, or 0 if it cannot be opened or is already open.
+     */
+    external fun openVectorIndex(dir: String, dim: Int): Long
+    
+    /**
+     * Add one vector per id, [vectors] holding them back to back; an id added
+     * again replaces its vector. The call that brings the index to 1024
+     * vectors also trains its quantizer, which takes a few seconds.
+     */
+    external fun addVectors(handle: Long, ids: LongArray, vectors: FloatArray): Boolean
+    
+    /**
+     * Drop [id] from the index; false if it is not there
+     */
+    external fun removeVector(handle: Long, id: Long): Boolean
+    
+    /**
+     * Up to [k] ids nearest to [query] by inner product, best first, with
+     * their scores in [scores] if given. Exact until the index is trained,
+     * approximate after that; null on a bad handle or width.
+     */
+    external fun searchVectorIndex(handle: Long, query: FloatArray, k: Int, scores: FloatArray?): LongArray?
+    
+    /**
+     * Sync and close the index; the handle is invalid after this
+     */
+    external fun closeVectorIndex(handle: Long): Boolean
+    
+    /**
+     * Vectors in the index, whether it is trained, its coarse lists and the
+     * bytes per stored vector (VINDEX_* indices)
+     */
+    external fun getVectorIndexStats(handle: Long): FloatArray
+    
+    /**
+     * Open or create the BM25 keyword index in [dir], whose terms are the
+     * pieces of the tokenizer at [tokenizerPath] (the model's tokenizer.model).
+     * Returns a handle, or 0 if it cannot be opened, is already open, or was
+     * built with another tokenizer.
+     */
+    external fun openKeywordIndex(dir: String, tokenizerPath: String): Long
+    
+    /**
+     * Index one text per id, e.g. OCR pages as they arrive; an id added again
+     * replaces its text
+     */
+    external fun addDocuments(handle: Long, ids: LongArray, texts: Array<String>): Boolean
+    
+    /**
+     * Drop [id] from the keyword index; false if it is not there
+     */
+    external fun removeDocument(handle: Long, id: Long): Boolean
+    
+    /**
+     * Up to [k] ids best matching [query] by BM25, best first, with their
+     * scores in [scores] if given; null on a bad handle
+     */
+    external fun searchKeywordIndex(handle: Long, query: String, k: Int, scores: FloatArray?): LongArray?
+    
+    /**
+     * Sync and close the keyword index; the handle is invalid after this
+     */
+    external fun closeKeywordIndex(handle: Long): Boolean
+    
+    /**
+     * Documents, distinct terms, compressed posting bytes and average document
+     * length in terms (KINDEX_* indices)
+     */
+    external fun getKeywordIndexStats(handle: Long): FloatArray
+    
+    /**
+     * Grade a quiz's free-text [answers] without generating: answer i has the
+     * next [referenceCounts][i] entries of [references] as acceptable answers.
+     * Everything is embedded in one batch from [source] (EMBED_*) and each
+     * answer scores by similarity to its best reference, relative to its
+     * similarity to the other questions' references, blended with the
+     * IDF-weighted share of that reference's terms it uses, from the keyword
+     * index [keywordIndex] over the material (0 for similarity alone).
+     * GRADE_FIELDS floats per answer (GRADE_* indices); only GRADE_AMBIGUOUS
+     * answers need the chat model. Null on failure.
+     */
+    external fun gradeAnswers(answers: Array<String>, references: Array<String>, referenceCounts: IntArray, keywordIndex: Long, source: Int): FloatArray?
+    
+    /**
+     * Blend and cut-offs for gradeAnswers: score = [similarityWeight] *
+     * similarity + the rest * keyword recall; at or above [accept] correct,
+     * below [reject] incorrect, ambiguous in between. Defaults 0.7, 0.7, 0.4.
+     */
+    external fun setGradingThresholds(similarityWeight: Float, accept: Float, reject: Float)
+    
+    /**
+     * Up to [k] ids for a retrieval-augmented prompt: the keyword ranking of
+     * [query] and the vector ranking of [queryVector] (its embedTexts
+     * embedding), merged by reciprocal rank fusion. Either handle may be 0 to
+     * use one side only; null if neither could search.
+     */
+    external fun hybridSearch(keywordIndex: Long, vectorIndex: Long, query: String?, queryVector: FloatArray?, k: Int): LongArray?
+    
+    /**
+     * Retrieved chunks for the next turn of [session], best first (e.g. from
+     * hybridSearch). Where [docs] and [starts] give each chunk's document and
+     * byte offset, overlapping spans of a document are merged; repeated texts
+     * are always. The next turn packs the best that fit what the context
+     * window leaves after its prompt, capped at [maxTokens] if > 0. A new
+     * conversation gets them in its system message, whose KV is reused when
+     * the same material comes up again; a running one gets them ahead of the
+     * prompt. Returns the chunks kept after merging, -1 for an unknown session.
+     */
+    external fun setRetrievedContext(session: Long, ids: LongArray, texts: Array<String>, docs: LongArray?, starts: LongArray?, maxTokens: Int): Int
+    
+    /**
+     * Ids of the chunks the last turn with retrieved material packed, in the
+     * order they were numbered in the prompt
+     */
+    external fun getPackedContextIds(): LongArray
+    
+    /**
+     * For the last turn with retrieved material: chunks packed, their tokens,
+     * chunks merged away and left out for the budget; and the context KV
+     * cache's hits and misses since load (CTX_* indices)
+     */
+    external fun getContextStats(): FloatArray
+    
+    /**
+     * Retrieved context compression (GenerationConfig.contextRatio) of the last
+     * turn with retrieved material: tokens before and after, the share kept,
+     * words dropped, time spent and prefill time saved at the measured prefill
+     * rate (0 until one is measured); then requests compressed, tokens and
+     * prefill milliseconds saved since load (COMPRESS_* indices). The last-turn
+     * values are 0 when it was not compressed.
+     */
+    external fun getContextCompressionStats(): FloatArray
+    
+    /**
+     * Prompt prefix sharing across conversations since load: prompts of new
+     * conversations looked up, those that restored a shared prefix, their
+     * tokens and the tokens that needed no prefill, the token hit rate
+     * (saved / looked up), prompts kept and evicted, slots in use, the tokens
+     * the kept prompts hold and the tree's nodes (PREFIX_TREE_* indices)
+     */
+    external fun getPrefixTreeStats(): FloatArray
+    
+    /**
+     * Once a conversation's history passes [fillFactor] of the context window
+     * after a turn, its oldest turns are summarized in the background at idle
+     * priority and the conversation continues from that summary plus the
+     * recent turns, instead of losing them to the sliding window later.
+     * 0 turns it off; the default is 0.6.
+     */
+    external fun setConversationMemory(fillFactor: Float)
+    
+    /**
+     * The summary [session] carries of its folded turns, empty if none
+     */
+    external fun getConversationMemory(session: Long): String
+    
+    /**
+     * Folds since load, turns folded and estimated KV tokens saved
+     * (MEMORY_* indices)
+     */
+    external fun getConversationMemoryStats(): FloatArray
+    
+    /**
+     * Keep answers to repeated first questions in [directory] (app storage).
+     * Only deterministic requests (temperature 0 or a fixed seed) without
+     * retrieved material are cached. A hit is streamed in one callback and
+     * getLastStopReason returns STOP_CACHED.
+     */
+    external fun openResponseCache(directory: String): Boolean
+    
+    /**
+     * Drop every cached answer, e.g. after the user edits a note
+     */
+    external fun clearResponseCache()
+    
+    /**
+     * Answers cached, slots, and hits and misses since open; semantic hits,
+     * misses and reported false hits, generation time the hits saved in ms,
+     * prompts in the semantic index; and summarizeDocument steps cached, and
+     * their hits and misses (RCACHE_* indices)
+     */
+    external fun getResponseCacheStats(): FloatArray
+    
+    /**
+     * Also match questions worded differently: a cache miss is embedded and
+     * the nearest cached prompt at or above [threshold] (cosine, e.g. 0.92) is
+     * a hit. SEMANTIC_SERVE returns its answer like an exact hit; SEMANTIC_SEED
+     * generates a new answer with it as a reference. 0 turns it off (default).
+     * Needs openResponseCache; uses the embedding model when there is one.
+     */
+    external fun setSemanticCache(threshold: Float, mode: Int)
+    
+    /**
+     * The last semantic hit answered a different question: its prompt is no
+     * longer matched to others. False if there was none.
+     */
+    external fun reportSemanticFalseHit(): Boolean
+    
+    /**
+     * Recent semantic hits, oldest first, as "similarity\tquestion\tcached question"
+     * (both normalized), for auditing the threshold
+     */
+    external fun getSemanticCacheAudit(): Array<String>
+    
+    /**
+     * Device allocations through the size-class pools (ALLOC_* indices): device
+     * types pooled (0 if the runtime resolved its device APIs first), driver
+     * allocations, pool hits and workspace calls since load, idle and live pool
+     * bytes, and for the last natively sampled request its decode steps, the
+     * driver allocations after its first two steps (0 in steady state) and in
+     * its last step.
+     */
+    external fun getAllocStats(): FloatArray
+    
+    /**
+     * Native heap use of the engine's worker threads (HEAP_* indices). Their
+     * small allocations are served from per-thread caches instead of scudo; this
+     * gives the threads with a cache, operator new calls on them since load and
+     * per second since the previous call, the share served from a cache, the
+     * bytes cached, the heap's allocated and free bytes (mallinfo) and its
+     * fragmentation: free plus cached bytes over everything the heap holds.
+     * After a memory trim, an idle thread's cache stays counted until the
+     * thread next allocates or frees, when it gives the cache back.
+     * Works without a loaded model.
+     */
+    external fun getHeapStats(): FloatArray
+    
+    /**
+     * Device-to-host logits copies since load (TRANSFER_* indices): copies,
+     * bytes copied, bytes of rows the host did not need and left on the device,
+     * milliseconds spent waiting for copies, decode steps launched before the
+     * previous token was delivered, and the reusable staging block's size.
+     */
+    external fun getTransferStats(): FloatArray
+    
+    /**
+     * Shed caches for an onTrimMemory level, more the higher the level: idle pool
+     * blocks, the request arena, engine threads' small-block caches and host
+     * buffers first, then subject prefixes and parked sessions' KV, then the
+     * shared prefix, and at TRIM_MEMORY_COMPLETE the resident weight pages.
+     * Everything is rebuilt on demand. Returns the bytes released as far as they
+     * can be counted; 0 without an engine.
+     */
+    external fun trimMemory(level: Int): Long
+    
+    /**
+     * Native memory by category as JSON: "weights" mapped and resident bytes
+     * of the mmapped shards, "kv" bytes per resident session, "workspace" held
+     * by TVM's allocators on the compute device and the CPU, "gpu" driver
+     * mappings, "heap" (mallinfo, and "engine_cached" as in getHeapStats()),
+     * "arena" held for request temporaries and the most recent requests used,
+     * "process" RSS and swap, and "peak" per category since resetMemoryStats().
+     * Works without a loaded model.
+     */
+    external fun getMemoryStats(): String
+    
+    /**
+     * Restart the high-water marks of getMemoryStats(), including the process peak RSS
+     */
+    external fun resetMemoryStats()
+    
+    /**
+     * Where the KV of [session] lives (RESIDENCY_*)
+     */
+    external fun getSessionResidency(session: Long): Int
+    
+    /**
+     * Run [session]'s turns with the LoRA adapter [name] from <model>/adapters,
+     * from its next turn on, unless a request's GenerationConfig names one.
+     * "base" runs the base model; null or "" routes by subject again (an
+     * adapter named after a subject key, e.g. "math"). Switching never
+     * reloads the base weights. False for an unknown session or adapter, or
+     * without CAP_ADAPTERS.
+     */
+    external fun setSessionAdapter(session: Long, name: String?): Boolean
+    
+    /**
+     * How [session]'s conversation is kept within its KV budget from its next
+     * turn on. KV_POLICY_WINDOW (the default) shifts the oldest turns out when
+     * the context window fills. KV_POLICY_HEAVY_HITTER evicts the tokens that
+     * have drawn the least attention while keeping the system prompt, the
+     * attention sinks and the latest tokens, so it stays at [budgetTokens]
+     * (<= 0 for the context window) and keeps what the tutoring keeps coming
+     * back to. False for an unknown session or policy, or for the heavy-hitter
+     * policy without CAP_HEAVY_HITTER.
+     */
+    external fun setSessionKvPolicy(session: Long, policy: Int, budgetTokens: Int): Boolean
+    
+    /**
+     * Heavy-hitter evictions since load: turns that evicted tokens, and the
+     * tokens evicted (KV_EVICT_* indices)
+     */
+    external fun getKvEvictionStats(): FloatArray
+    
+    /**
+     * Adapters found next to the model, one "name rank alpha bytes loaded"
+     * line each; null when no engine is loaded
+     */
+    external fun listAdapters(): Array<String>?
+    
+    /**
+     * Receives prefill progress of long prompts in tokens, on the generating
+     * thread. Must not call back into the bridge.
+     */
+    fun interface PrefillProgressListener {
+        fun onProgress(done: Int, total: Int)
+    }
+    
+    /**
+     * Report prefill progress to [listener] (null to stop). Needs CAP_CHUNKED_PREFILL.
+     */
+    external fun setPrefillProgressListener(listener: PrefillProgressListener?)
+    
+    /**
+     * Tokens per prefill chunk (default 256). Cancellation is checked between
+     * chunks and other threads get the cores, so smaller chunks keep the app
+     * responsive at a small throughput cost.
+     */
+    external fun setPrefillChunkSize(tokens: Int)
+    
+    /**
+     * The user is typing [text] as the next message of [session]. Returns at
+     * once; a low-priority native thread rolls the KV back to what the previous
+     * draft shares with [text] and prefills the rest, so sending it only
+     * prefills the last few tokens. Follow-up turns only; needs CAP_DRAFT_PREFILL.
+     */
+    external fun updateDraft(session: Long, text: String)
+    
+    /**
+     * The draft of [session] was discarded
+     */
+    external fun clearDraft(session: Long)
+    
+    /**
+     * Stream recognized text into the next message of [session] as OCR emits
+     * it, [block] by block (include the separators, e.g. "\n\n"). Returns at
+     * once; like updateDraft, each block is tokenized and prefilled on a
+     * low-priority native thread while the next page is recognized. Unlike
+     * typing, this also works on a fresh session, which is routed on its first
+     * blocks. Send a prompt that starts with getStreamedInput() and only the
+     * instruction after it is left to prefill. clearDraft or updateDraft drop
+     * the input. Needs CAP_DRAFT_PREFILL.
+     */
+    external fun appendInput(session: Long, block: String)
+    
+    /**
+     * The text appendInput has collected for [session]'s next message, empty if none
+     */
+    external fun getStreamedInput(session: Long): String
+    
+    /**
+     * Keep saved sessions in [directory] (app storage). Call after initializeEngine;
+     * sessions saved for a different model are ignored on restore.
+     */
+    external fun openSessionStore(directory: String): Boolean
+    
+    /**
+     * Save [session] as [name] ([A-Za-z0-9_-]) so it survives the process being
+     * killed. The turn list is always saved; with CAP_KV_PERSIST the KV is too,
+     * so restoring skips the prefill.
+     */
+    external fun saveSession(session: Long, name: String): Boolean
+    
+    /**
+     * Open the saved session [name] as a new session; -1 if there is none
+     */
+    external fun restoreSession(name: String): Long
+    
+    /**
+     * Delete the saved session [name]
+     */
+    external fun deleteSavedSession(name: String)
+    
+    /**
+     * Cap the size of the session store; the least recently saved sessions are
+     * deleted first. Default 64 MB.
+     */
+    external fun setSavedSessionCap(bytes: Long)
+    
+    /**
+     * Bytes used by saved sessions
+     */
+    external fun getSavedSessionBytes(): Long
+    
+    /**
+     * Log every turn of [session] from now on, as text and token ids, to the
+     * append-only log [name] in the session store, starting with the turns it
+     * has (an existing log of that name is replaced). Unlike [saveSession]
+     * nothing is rewritten: each turn appends, and the log is current without a
+     * save call. Not counted against [setSavedSessionCap].
+     */
+    external fun openConversationLog(session: Long, name: String): Boolean
+    
+    /**
+     * The logged conversation [name] as a new session, logging on; -1 if there
+     * is none. Its KV is loaded when [saveSession] saved [name] with KV at the
+     * same turn, otherwise the latest turns that fit are prefilled on first use.
+     */
+    external fun resumeConversation(name: String): Long
+    
+    /**
+     * [forkSession] of a logged [session] at [turn] whose own log [name] starts
+     * with the parent's first [turn] turns; -1 if [session] has no log
+     */
+    external fun branchConversation(session: Long, turn: Int, name: String): Long
+    
+    /**
+     * Token ids of message [message] of [session]'s log (turn * 2 for the
+     * prompt, + 1 for the answer), read in place, e.g. for [prefillTokens];
+     * null without a log or such a message
+     */
+    external fun getConversationIds(session: Long, message: Int): IntArray?
+    
+    /**
+     * Drop the turns of [session] after the first [turns], from its KV and its log
+     */
+    external fun truncateConversation(session: Long, turns: Int): Boolean
+    
+    /**
+     * Queue a generation on the native worker and return its request id at once
+     * (-1 if it could not be queued). A null [config] uses the engine defaults. [callback], if given, receives the finished
+     * text (or "Error: ...") on the worker thread and the request is dropped
+     * after it; without one, poll getRequestStatus / getRequestOutput and call
+     * releaseRequest when done.
+     */
+    external fun submitGenerate(prompt: String, config: GenerationConfig?, callback: ((String) -> Unit)?): Long
+    
+    /**
+     * Like submitGenerate, but for independent one-shot prompts (no chat history)
+     * that should run side by side: with CAP_BATCHED_DECODE, active requests
+     * share each decode pass and new ones join at the next token. Otherwise they
+     * run one after another on the async worker. Same request id API.
+     *
+     * [priority] is a PRIORITY_* class. A full batch parks its lowest-class
+     * sequence (KV kept) for a higher-class arrival and resumes it afterwards,
+     * and every chat turn pauses the batch until it is done. The serial
+     * fallback runs in submission order.
+     */
+    external fun submitBatchedGenerate(prompt: String, config: GenerationConfig?, priority: Int, callback: ((String) -> Unit)?): Long
+    
+    /**
+     * Receives generateBatch output as it is decoded, tagged with the suffix's
+     * index, on the native worker thread. Must not call back into the bridge.
+     */
+    fun interface BatchTokenListener {
+        fun onToken(index: Int, text: String)
+    }
+    
+    /**
+     * Generate one answer per suffix to prompts sharing a long [prefix], e.g.
+     * flashcards from one chapter; each prompt is prefix + suffix as is. With
+     * CAP_BATCH_FORK the prefix is prefilled once and forked per suffix;
+     * with CAP_BATCHED_DECODE alone each branch prefills its whole prompt; the
+     * branches then decode together. Returns one request id per suffix, in
+     * order; poll them as with submitGenerate and release them when done.
+     */
+    external fun generateBatch(
+        prefix: String,
+        suffixes: Array<String>,
+        config: GenerationConfig?,
+        priority: Int,
+        listener: BatchTokenListener?
+    ): LongArray
+    
+    /**
+     * [n] samples of one [prompt], e.g. candidate distractors for a quiz. The
+     * prompt is prefilled once and the samples decode as a batch (see
+     * generateBatch for what each capability gives). [seeds] seeds sample i
+     * with seeds[i]; without it a seeded config gives seed + i. A sample ends
+     * early at the first of [stopStrings], which is not included. Returns one
+     * request id per sample.
+     */
+    external fun generateSamples(
+        prompt: String,
+        n: Int,
+        config: GenerationConfig?,
+        seeds: LongArray?,
+        stopStrings: Array<String>?,
+        priority: Int,
+        listener: BatchTokenListener?
+    ): LongArray
+    
+    /**
+     * Receives summarizeDocument progress in steps (chunk and combine
+     * summaries), on the native worker thread. [total] is re-estimated as
+     * partial summaries come in. Must not call back into the bridge.
+     */
+    fun interface SummaryProgressListener {
+        fun onProgress(done: Int, total: Int)
+    }
+    
+    /**
+     * Summarize [text] of any length, e.g. pages from the OCR processor. It is
+     * split into chunks of at most [chunkTokens] (0 to fit the context window)
+     * at paragraph, sentence or word breaks; the chunks are summarized as one
+     * batch (see generateBatch), and the partial summaries are combined the
+     * same way, level by level, until one is left. Returns a request id, like
+     * submitGenerate; the final summary streams into it and [callback] gets it
+     * whole. Occupies the async worker until done.
+     *
+     * With openResponseCache, every step's summary is kept by the hash of its
+     * text, so a re-opened chapter or a paragraph run shared with another
+     * capture is not summarized again.
+     */
+    external fun summarizeDocument(
+        text: String,
+        config: GenerationConfig?,
+        chunkTokens: Int,
+        priority: Int,
+        listener: SummaryProgressListener?,
+        callback: ((String) -> Unit)?
+    ): Long
+    
+    /**
+     * Start or resume a background job in [dir] that runs [instruction] over
+     * every chunk of [text], e.g. "Write flashcards for this passage" over a
+     * whole OCR'd textbook. A new job splits [text] into chunks of at most
+     * [chunkTokens] (0 to fit the context window) and writes them to [dir];
+     * an existing one resumes as it was created, ignoring [text], [instruction]
+     * and [config]. Chunks are generated as batches at background priority,
+     * only while the device charges (setDeviceState) and no chat turn ran for
+     * two minutes, and each chunk's output is on disk as soon as it completes.
+     * Call it again after a process restart to pick up at the first chunk not
+     * done. Returns the chunks already done, or -1. [listener] gets progress in
+     * chunks.
+     */
+    external fun startBatchJob(
+        dir: String,
+        text: String?,
+        instruction: String?,
+        config: GenerationConfig?,
+        chunkTokens: Int,
+        listener: SummaryProgressListener?
+    ): Int
+    
+    /**
+     * Stop the job in [dir] at its next token; the chunks it finished are kept
+     * and startBatchJob resumes it. False if it was not running.
+     */
+    external fun cancelBatchJob(dir: String): Boolean
+    
+    /**
+     * State, wait reason, chunks done and chunks of the job in [dir] (JOB_*
+     * indices and values), also for a job left by an earlier process.
+     */
+    external fun getBatchJobStatus(dir: String): FloatArray
+    
+    /**
+     * The job's outputs in chunk order, "" for chunks not done yet (or given
+     * up after repeated failures); null if [dir] holds no job.
+     */
+    external fun getBatchJobOutputs(dir: String): Array<String>?
+    
+    /**
+     * Most requests decoded together (default 4)
+     */
+    external fun setMaxBatchSize(size: Int)
+    
+    /**
+     * Batch scheduler counters (BATCH_* indices). BATCH_KV_TOKENS is the KV the
+     * batch holds or has reserved; BATCH_KV_DEFERRALS counts steps a request
+     * waited for KV the budget did not have.
+     */
+    external fun getBatchStats(): FloatArray
+    
+    /**
+     * Answer lengths of one TASK_* type (LENGTH_* indices), or null for an
+     * unknown type. LENGTH_RESERVED is what a request of that type reserves
+     * at the default max_gen_len: the p95 of recent answers with some
+     * headroom, or mean_gen_len until enough were seen. Chat turns and
+     * submitGenerate count as chat, generateBatch and generateSamples as
+     * flashcards, summarizeDocument steps as summaries.
+     */
+    external fun getOutputLengthStats(task: Int): FloatArray?
+    
+    /**
+     * Latency of one PRIORITY_* class (LATENCY_* indices), or null for an
+     * unknown class. Interactive counts chat turns too, by their wait for the
+     * engine.
+     */
+    external fun getLatencyStats(priority: Int): FloatArray?
+    
+    /**
+     * Stage latencies of every request since the last resetMetrics(), as JSON:
+     * request, error and token counts, overall prefill tokens/s, and for
+     * queue_wait_ms, ttft_ms, tpot_ms, prefill_ms, prefill_rate (tokens/s) and
+     * e2e_ms an object of count, mean, p50, p90, p99 and max. Percentiles come
+     * from native histograms, within about 3%. Covers interactive, async and
+     * batched requests.
+     *
+     * Each request's cost comes with it: cpu_ms (process CPU, TVM pool workers
+     * included; a batched pass is split across its sequences), thread_cpu_ms
+     * (the request's own thread) and energy_mj, with cpu_ms_per_token, total
+     * joules and mj_per_token at the top level. Energy needs reportBatteryPower
+     * samples or a readable fuel gauge; requests on a charger count none.
+     */
+    external fun getMetrics(): String
+    
+    /**
+     * Tag what this thread asks of the engine from now on with [traceId] (0
+     * for none), returning the previous id. Native log lines, "mlc:" trace
+     * sections, flight recorder events and the request's metrics carry it,
+     * across the engine's worker threads too; see getRequestTrace. Batched
+     * decode passes serve several requests and are not tagged.
+     */
+    external fun setTraceId(traceId: Long): Long
+    
+    /**
+     * One traced request as JSON: trace_id, request_id, ok, prompt_tokens,
+     * tokens, admitted_ms, prefill_start_ms, prefill_end_ms, first_token_ms,
+     * last_token_ms and done_ms from enqueue (-1 when never reached), cpu_ms,
+     * and its flight recorder lines in "events". The last 64 finished requests
+     * are kept; "{}" for any other id.
+     */
+    external fun getRequestTrace(traceId: Long): String
+    
+    /**
+     * A BatteryManager sample (BATTERY_PROPERTY_CURRENT_NOW and the
+     * broadcast's voltage) for the energy in getMetrics(). Report about once a
+     * second while generating; without fresh samples the fuel gauge in sysfs
+     * is read instead.
+     */
+    external fun reportBatteryPower(currentMicroamps: Int, voltageMillivolts: Int, charging: Boolean)
+    
+    /**
+     * Sample the process from a native thread every [intervalMs] (at least
+     * 100): RSS, PSS split into anon / file / shmem, CPU per thread name, tokens
+     * per second and requests queued or running, keeping the last [capacity]
+     * samples. Restarting keeps the samples already taken. Replaces polling
+     * dumpsys meminfo and top over adb; see MetricsExportReceiver.
+     */
+    external fun startMetricsSampler(intervalMs: Int, capacity: Int)
+    
+    external fun stopMetricsSampler()
+    
+    /**
+     * Samples taken after [sinceWallMs] (System.currentTimeMillis(); 0 for all),
+     * one JSON object per line: t_ms (wall clock, as logcat prints it),
+     * monotonic_ms, rss_kb, pss_kb, pss_anon_kb, pss_file_kb, pss_shmem_kb,
+     * cpu_pct (100 per busy core), tokens_per_s, queue and threads (name to
+     * cpu_pct, busiest first).
+     */
+    external fun getMetricsSamples(sinceWallMs: Long): String
+    
+    /** Write every sample kept to [path] as getMetricsSamples(0) would; false on failure */
+    external fun exportMetricsSamples(path: String): Boolean
+    
+    /**
+     * Emit "mlc:" trace sections (model load, tokenize, prefill chunks, decode
+     * steps, sampling, detokenize, JNI delivery) into Perfetto / systrace
+     * captures. Off by default; while off the sections cost nothing measurable.
+     */
+    external fun setNativeTracing(enabled: Boolean)
+    
+    /**
+     * Start the getMetrics() histograms over, e.g. after shipping a snapshot
+     */
+    external fun resetMetrics()
+    
+    /**
+     * Where the native flight recorder dumps: the last 1024 events of every
+     * native thread (stage spans with durations, request admit / prefill /
+     * first token / end, driver allocations of 1 MiB or more), recorded all
+     * the time at a few nanoseconds each. A request slower than [sloMs] writes
+     * flight_<wall ms>.txt into [dir] (at most one per 10 s, the newest 8
+     * kept); a native crash writes flight_crash.txt, and the one from the
+     * previous run moves to flight_crash.prev.txt. Lines are "ns tid kind name
+     * a b", ns on CLOCK_MONOTONIC. [sloMs] <= 0 keeps only crash dumps; an
+     * empty [dir] turns SLO dumps off. Returns false if [dir] is not writable.
+     */
+    external fun setFlightRecorder(dir: String, sloMs: Int): Boolean
+    
+    /** Write the flight recorder to [path] now, sorted by time */
+    external fun dumpFlightRecorder(path: String): Boolean
+    
+    /**
+     * Watch for generations that produce no token (or prefill chunk) for
+     * [thresholdMs]; <= 0 stops watching. A stall is reported once: each
+     * thread's current stage and how long it has been in it, thread states
+     * and wait channels, thermal zones and CPU clocks, the last setDeviceState,
+     * then the flight recorder, written as a flight dump into the
+     * setFlightRecorder directory (call that first) and kept for
+     * getLastStallReport(). STALL_CANCEL also aborts the generation, which
+     * ends with STOP_STALLED; STALL_FALLBACK besides routes requests remotely
+     * (routeRequest) for a minute.
+     */
+    external fun setStallWatchdog(thresholdMs: Int, action: Int)
+    
+    /** Stalls seen, generations aborted for one, and the longest quiet spell in ms (STALL_* indices) */
+    external fun getStallStats(): FloatArray
+    
+    /** The diagnostics of the last stall, "" before any */
+    external fun getLastStallReport(): String
+    
+    /**
+     * Serve the loaded model to the app's other processes on the abstract
+     * socket @name, so a widget or quick-answer process reuses this engine
+     * instead of loading its own copy. Requests run as chat turns in sessions
+     * of their own; only processes of this app's uid are served. False if the
+     * name is taken or the socket could not be set up.
+     */
+    external fun startModelServer(name: String): Boolean
+    
+    /** Stop serving; a request in progress ends at its next token */
+    external fun stopModelServer()
+    
+    /** Requests served, failed, cancelled by the client, refused, and response bytes (MODEL_SERVER_* indices) */
+    external fun getModelServerStats(): FloatArray
+    
+    /**
+     * From a process without an engine: run prompt on the model server at
+     * @name, passing each piece of the response to callback (if given) as it
+     * arrives. maxGenLen <= 0 and temperature < 0 keep the server's defaults.
+     * Returns the whole response, or "Error: ..." (also when no server is
+     * listening, so the caller can fall back to loading a model itself).
+     * Blocks until the response ends; call it off the main thread.
+     */
+    external fun generateViaModelServer(
+        name: String,
+        prompt: String,
+        maxGenLen: Int,
+        temperature: Float,
+        callback: ((String) -> Unit)?
+    ): String
+    
+    /**
+     * Append an anonymized record of every finished turn to path (created if
+     * missing): arrival time, session, generation config, prompt and output
+     * lengths, latency, and the prompt with each word replaced by random
+     * letters of the same length. Repeated prompt text stays repeated, so a
+     * replay reuses the KV cache as the real traffic did. An empty path stops
+     * recording. Returns false if the file could not be opened.
+     */
+    external fun setRequestTrace(path: String): Boolean
+    
+    /**
+     * Re-drive the engine with a trace from setRequestTrace: each turn is
+     * submitted as an async request at its recorded arrival time divided by
+     * speed (0 submits them all at once), in a session of its own per recorded
+     * session, with its recorded output length. Blocks until all have
+     * finished, so call it off the main thread. Resets the getMetrics()
+     * histograms first and returns JSON with turns, failed, recorded_ms,
+     * wall_ms and the metrics of the replay, or "Error: ...".
+     */
+    external fun replayTrace(path: String, speed: Float): String
+    
+    /**
+     * State of an async request (REQUEST_*)
+     */
+    external fun getRequestStatus(id: Long): Int
+    
+    /**
+     * Text generated so far; the full answer once the request is done
+     */
+    external fun getRequestOutput(id: Long): String
+    
+    /**
+     * 0 while the request runs, N with N requests ahead of it, -1 otherwise
+     */
+    external fun getQueuePosition(id: Long): Int
+    
+    /**
+     * Drop a queued request, or abort a running one
+     */
+    external fun cancelRequest(id: Long): Boolean
+    
+    /**
+     * Free a finished polled request
+     */
+    external fun releaseRequest(id: Long)
+    
+    /**
+     * Identical requests in flight at once run once (on by default). A
+     * submitGenerate, submitBatchedGenerate or summarizeDocument call with the
+     * same prompt (normalized: case, spacing, trailing punctuation), config and
+     * conversation as a request still queued or running joins it: it gets its
+     * own id and callback, reports that request's status and output, and
+     * finishes with its text; a progress listener of the joining call is not
+     * called. Cancelling a joined request only detaches it, and cancelling the
+     * one it joined keeps the generation going for the others.
+     */
+    external fun setRequestCoalescing(enabled: Boolean)
+    
+    /**
+     * Requests that joined an identical one in flight since load
+     */
+    external fun getCoalescedRequests(): Long
+    
+    /**
+     * Opens a pipeline that runs recognized pages through normalize -> retrieve ->
+     * generate, all three at once: while page N generates, page N+1 is already
+     * normalized and its context retrieved. Each stage has its own workers
+     * (generate has one, the engine runs one generation at a time) and a queue of
+     * [queueDepth] pages in front of it. Retrieve adds each page to the keyword
+     * index [keywordIndex] (0 for none) under its doc id and fills [promptTemplate]:
+     * "{page}" with the page's normalized text (appended when missing) and
+     * "{context}" with up to [contextPages] earlier pages of this pipeline most like
+     * it. Returns a handle for submitPipelinePage.
+     */
+    external fun createStudyPipeline(
+        keywordIndex: Long,
+        promptTemplate: String,
+        contextPages: Int,
+        normalizeWorkers: Int,
+        retrieveWorkers: Int,
+        queueDepth: Int
+    ): Long
+    
+    /**
+     * Queues a page's OCR text as document [docId] and returns its request id:
+     * getRequestStatus, getRequestOutput, cancelRequest and releaseRequest apply
+     * as to submitGenerate's, and [callback] gets the answer on a native thread.
+     * Blocks while the pipeline's first queue is full, so call it from the thread
+     * that produces pages, never the main thread. Cancelling the request drops
+     * the page at whatever stage it is in. -1 once the pipeline is closed.
+     */
+    external fun submitPipelinePage(pipeline: Long, docId: Long, ocrText: String, callback: ((String) -> Unit)?): Long
+    
+    /**
+     * Cancels every page submitted so far; pages submitted after still run
+     */
+    external fun cancelPipeline(pipeline: Long)
+    
+    /**
+     * JSON: pushed, completed, items_per_s and the bottleneck stage, then per
+     * stage its workers, queued pages, processed, failed and skipped counts and
+     * the shares of its workers' time since the previous call spent running
+     * (occupancy), waiting for input (starved) and waiting for room downstream
+     * (blocked). "{}" for an unknown handle.
+     */
+    external fun getPipelineStats(pipeline: Long): String
+    
+    /**
+     * Cancels what is in flight and stops the pipeline; its pages' requests
+     * finish as cancelled. Not from a page's callback.
+     */
+    external fun closePipeline(pipeline: Long)
+    
+    /**
+     * Stream a response using the model
+     */
+    external fun streamResponse(prompt: String, callback: (String) -> Unit)
+    
+    /**
+     * Optional features found in the loaded chat module (CAP_* bits)
+     */
+    external fun getCapabilities(): Int
+    
+    /**
+     * Keep the conversation (and its KV cache) between calls. When disabled,
+     * every prompt starts from an empty conversation. Safe from any thread and
+     * never waits for a running generation: it applies once the engine is idle.
+     */
+    external fun setMultiTurn(enabled: Boolean)
+    
+    /**
+     * Subject the current conversation was routed to before prefill (SUBJECT_*)
+     */
+    external fun getConversationSubject(): Int
+    
+    /**
+     * Time the last routing pass took, in microseconds
+     */
+    external fun getLastRouteMicros(): Float
+    
+    /**
+     * Speculative decoding metrics since the engine was created (SPEC_* indices).
+     * Tokens per target pass is the speedup over plain decoding in target forward passes.
+     */
+    external fun getSpeculativeStats(): FloatArray
+    
+    /**
+     * Number of tokens the draft model proposes per verification pass. Takes
+     * effect from the next request if a generation is running.
+     */
+    external fun setDraftLength(length: Int)
+    
+    /**
+     * Speculate without a draft model by proposing continuations copied from
+     * the prompt, verified by the target in one pass; pays off when answers
+     * quote their input, e.g. summaries of photographed text. Needs
+     * CAP_PROMPT_LOOKUP; a loaded draft model takes precedence. Off by default.
+     */
+    external fun setPromptLookup(enabled: Boolean)
+    
+    /**
+     * Prompt lookup metrics, laid out like getSpeculativeStats() (SPEC_* indices)
+     */
+    external fun getPromptLookupStats(): FloatArray
+    
+    /**
+     * Speculate without a draft model by drafting with the first [exitLayer] layers
+     * of the model itself (0: its trained exit head, or half the layers without one)
+     * and verifying with the full stack in one pass. Uses the same weights and KV, so
+     * it needs no memory beyond the model's. Needs CAP_SELF_SPECULATIVE; a loaded draft
+     * model takes precedence, and it takes precedence over prompt lookup. Off by default.
+     */
+    external fun setSelfSpeculation(enabled: Boolean, exitLayer: Int)
+    
+    /**
+     * Self-speculation metrics, laid out like getSpeculativeStats() (SPEC_* indices)
+     * plus SELF_SPEC_EXIT_LAYER and SELF_SPEC_LAYERS
+     */
+    external fun getSelfSpeculationStats(): FloatArray
+    
+    /**
+     * Pick the number of tokens proposed per speculation round (draft model,
+     * self-speculation or prompt lookup) from the acceptance rate of the current
+     * session and task type, up to [maxLength] (0: 8), instead of setDraftLength()
+     * every round. Rounds where proposals rarely survive fall back to plain decode
+     * steps; the thermal governor scales the ceiling down like the draft length.
+     * Off by default.
+     */
+    external fun setAdaptiveDraftLength(enabled: Boolean, maxLength: Int)
+    
+    /**
+     * The draft length controllers as JSON: per method ("draft", "self", "lookup")
+     * rounds, mean proposal length, acceptance overall and per task type, measured
+     * draft and verify times, and how many rounds ran at each length 0..16
+     */
+    external fun getDraftLengthStats(): String
+
+    /**
+     * Set the default generation temperature. Like the other setters this only
+     * records the value; the module is reconfigured once, at the next request.
+     */
+    external fun setTemperature(temperature: Float)
+    
+    /**
+     * Set the top-p sampling parameter
+     */
+    external fun setTopP(topP: Float)
+    
+    /**
+     * Seed sampling for every following request so runs replay token for token.
+     * A negative seed restores fresh randomness per request.
+     */
+    external fun setSeed(seed: Long)
+    
+    /**
+     * Native sampler timings (SAMPLER_* indices). Only populated when the engine
+     * reports CAP_NATIVE_SAMPLING.
+     */
+    external fun getSamplerStats(): FloatArray
+    
+    /**
+     * Why the last chat response ended (STOP_* values). STOP_NONE when it ran
+     * inside the chat module and no stop string cut it short; STOP_CACHED when
+     * it came from the response cache; STOP_DEADLINE when it was cut at its
+     * GenerationConfig deadline or answered canned to meet it; STOP_STALLED
+     * when the stall watchdog aborted it.
+     */
+    external fun getLastStopReason(): Int
+    
+    /**
+     * How the last request with a GenerationConfig deadline did (DEADLINE_*
+     * indices): the outcome, the deadline, the predicted and actual time from
+     * the request to its answer, and the max tokens and draft length planned
+     * to meet it (draft length 0 when left as it was).
+     */
+    external fun getLastDeadlineOutcome(): FloatArray
+    
+    /**
+     * Sample on the GPU next to the final layer when the module supports it
+     * (CAP_DEVICE_SAMPLING), so only the token id is copied back. On by default.
+     */
+    external fun setDeviceSampling(enabled: Boolean)
+    
+    /**
+     * Record the decode step's GPU kernel launches once and replay them with the
+     * new position on later steps, when the module supports it (CAP_DECODE_GRAPH).
+     * On by default; applied before the next request.
+     */
+    external fun setDecodeGraph(enabled: Boolean)
+    
+    /**
+     * Decode step recording counters (DECODE_GRAPH_* indices): whether steps are
+     * being replayed now, and the recordings, replayed steps and eager steps since
+     * the model loaded. Waits for a running request.
+     */
+    external fun getDecodeGraphStats(): FloatArray
+    
+    /**
+     * Prepare likely follow-ups ("Explain more", "Give an example", "Quiz me" unless
+     * [prompts] replaces them; at most 3) once a turn ends and the engine is idle.
+     * FOLLOW_UP_PREFILL prefills the first as the session's draft; FOLLOW_UP_GENERATE
+     * answers each on a branch sharing the session's KV pages, so sending one returns
+     * its answer at once (stop reason STOP_CACHED). Answers are capped at [maxTokens]
+     * (0 for 256); nothing is prepared on the battery saver profile, without room in
+     * the KV budget or past an hourly token allowance. A request or a keystroke stops
+     * the work at the next token, and typing anything else drops what was prepared.
+     * Off by default.
+     */
+    external fun setFollowUpPrefetch(mode: Int, prompts: Array<String>?, maxTokens: Int)
+    
+    /**
+     * Follow-up prefetch counters (FOLLOW_UP_* indices): follow-ups prepared, served,
+     * discarded unused, tokens spent on them, branches preempted, and how many
+     * are prepared now.
+     */
+    external fun getFollowUpPrefetchStats(): FloatArray
+    
+    /**
+     * Time delivering [tokens] short tokens to Kotlin (TOKEN_DELIVERY_* indices, ns per
+     * token): one String and one [callback] call per token, as streamResponse delivers,
+     * against a record per token in a native token ring drained by another thread. Needs
+     * no model; the rest of the text path is measured by the micro_bench executable.
+     */
+    external fun benchmarkTokenDelivery(callback: (String) -> Unit, tokens: Int): FloatArray?
+    
+    /**
+     * Set the repetition penalty applied to tokens already in the answer
+     */
+    external fun setRepetitionPenalty(penalty: Float)
     
     /**
      * Set maximum generation length
@@ -0,0 +1,220 @@
+package com.example.studybuddy.ml
+
+import android.graphics.Bitmap
+import android.graphics.ImageFormat
+import android.graphics.Rect
+import android.util.Log
+import androidx.camera.core.ImageProxy
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Camera frames to model inputs in native code (image_preprocess.h), built into
+ * libmlc_llm_jni.so. Crop, bilinear resize, rotation and the YUV conversion run
+ * on the ImageProxy's plane buffers directly, NEON on arm64, into a direct
+ * ByteBuffer the caller keeps across frames; no Bitmap is made.
+ */
+object NativeImagePreprocessor {
+    private const val TAG = "NativeImagePreprocessor"
+    
+    // Output formats, mirrored from image_preprocess.h
+    const val FORMAT_RGB = 0        // uint8 RGB
+    const val FORMAT_GRAY = 1       // uint8 luma
+    const val FORMAT_NV21 = 2       // for InputImage.fromByteBuffer; even sizes only
+    const val FORMAT_FLOAT_RGB = 3  // float32 RGB, (value / 255 - mean) / std
+    
+    // Frames this many bits or fewer apart (of 256) are the same page, mirrored from frame_cache.h
+    const val NEAR_DUPLICATE_BITS = 48
+    
+    // Indices into getFrameCacheStats()
+    const val FRAME_CACHE_HITS = 0
+    const val FRAME_CACHE_MISSES = 1
+    const val FRAME_CACHE_SIZE = 2
+    
+    // Indices into getPageStoreStats()
+    const val PAGE_STORE_HITS = 0
+    const val PAGE_STORE_MISSES = 1
+    const val PAGE_STORE_PAGES = 2
+    const val PAGE_STORE_BYTES = 3
+    
+    init {
+        try {
+            System.loadLibrary("mlc_llm_jni")
+        } catch (e: UnsatisfiedLinkError) {
+            Log.e(TAG, "Failed to load native preprocessor: ${e.message}")
+            throw RuntimeException("Failed to load required native libraries: ${e.message}")
+        }
+    }
+    
+    /**
+     * Bytes a [width] x [height] output in [format] takes; 0 if out of range
+     */
+    external fun outputBytes(width: Int, height: Int, format: Int): Int
+    
+    /**
+     * A buffer for [width] x [height] outputs in [format], to reuse frame after frame
+     */
+    fun allocate(width: Int, height: Int, format: Int): ByteBuffer =
+        ByteBuffer.allocateDirect(outputBytes(width, height, format)).order(ByteOrder.nativeOrder())
+    
+    /**
+     * [image] (YUV_420_888) cropped to [crop], turned [rotationDegrees]
+     * clockwise and resized to [width] x [height] in [format] into [out], which
+     * must be direct and at least [outputBytes] long. [mean] and [std] are per
+     * channel, for FORMAT_FLOAT_RGB. False if the frame or the sizes do not fit.
+     * The image can be closed as soon as this returns.
+     */
+    fun preprocess(
+        image: ImageProxy,
+        out: ByteBuffer,
+        width: Int,
+        height: Int,
+        format: Int,
+        crop: Rect = image.cropRect,
+        rotationDegrees: Int = image.imageInfo.rotationDegrees,
+        mean: FloatArray = floatArrayOf(0f, 0f, 0f),
+        std: FloatArray = floatArrayOf(1f, 1f, 1f)
+    ): Boolean {
+        if (image.format != ImageFormat.YUV_420_888 || image.planes.size < 3) {
+            Log.e(TAG, "Expected a YUV_420_888 frame, got format ${image.format}")
+            return false
+        }
+        val (y, u, v) = image.planes
+        val geometry = intArrayOf(crop.left, crop.top, crop.width(), crop.height(), rotationDegrees, width, height)
+        return nativePreprocess(
+            y.buffer, u.buffer, v.buffer, image.width, image.height, y.rowStride, u.rowStride, u.pixelStride,
+            geometry, format, mean + std, out
+        )
+    }
+    
+    /**
+     * 256-bit difference hash of [image]'s luma inside [crop], as four longs:
+     * nearly the same for frames of the same page despite noise, exposure or a
+     * slight shift. Null if the frame does not fit.
+     */
+    fun frameHash(image: ImageProxy, crop: Rect = image.cropRect): LongArray? {
+        val y = image.planes.firstOrNull() ?: return null
+        return nativeFrameHash(y.buffer, image.width, image.height, y.rowStride,
+            crop.left, crop.top, crop.width(), crop.height())
+    }
+    
+    /**
+     * Bits in which two [frameHash]es differ, -1 if either is malformed
+     */
+    external fun frameDistance(a: LongArray, b: LongArray): Int
+    
+    /**
+     * OCR text stored for the recent frame nearest [hash] within [maxDistance]
+     * bits, or null; the 32 least recently used frames are kept
+     */
+    external fun lookupFrameText(hash: LongArray, maxDistance: Int = NEAR_DUPLICATE_BITS): String?
+    
+    /**
+     * Token ids stored for that frame's text, or null until [rememberFrameTokens]
+     */
+    external fun lookupFrameTokens(hash: LongArray, maxDistance: Int = NEAR_DUPLICATE_BITS): IntArray?
+    
+    /**
+     * The OCR text of the frame [hash]; its token ids are cleared
+     */
+    external fun rememberFrame(hash: LongArray, text: String): Boolean
+    
+    /**
+     * Token ids of the text stored for the frame nearest [hash]; false without one
+     */
+    external fun rememberFrameTokens(hash: LongArray, maxDistance: Int, ids: IntArray): Boolean
+    
+    /**
+     * Frame cache hits, misses and size (FRAME_CACHE_* indices)
+     */
+    external fun getFrameCacheStats(): LongArray
+    
+    external fun clearFrameCache()
+    
+    /**
+     * Keep OCR results of saved pages in [dir] (page_store.h), across launches,
+     * up to [maxBytes] (0: 16 MB); least recently used pages go first. Token ids
+     * and keys stored under another [tag] (the tokenizer and model they belong
+     * to) are not returned.
+     */
+    external fun openPageStore(dir: String, tag: String, maxBytes: Long = 0): Boolean
+    
+    /**
+     * SHA-256 of [bitmap]'s pixels as hex, the key of its page in the page store
+     */
+    fun pageHash(bitmap: Bitmap): String? {
+        val pixels = ByteBuffer.allocateDirect(bitmap.byteCount)
+        bitmap.copyPixelsToBuffer(pixels)
+        return nativePageHash(pixels, pixels.position())
+    }
+    
+    /**
+     * SHA-256 of a saved image file's bytes, for a page re-opened without decoding it; null if unreadable
+     */
+    external fun pageHashOfFile(path: String): String?
+    
+    /**
+     * OCR text stored for the page [hash], or null
+     */
+    external fun lookupPageText(hash: String): String?
+    
+    /**
+     * Token ids stored for that page's text, or null until [rememberPageTokens]
+     */
+    external fun lookupPageTokens(hash: String): IntArray?
+    
+    /**
+     * Prefix or summary keys stored for that page's chunks, or null until [rememberPageKeys]
+     */
+    external fun lookupPageKeys(hash: String): Array<String>?
+    
+    /**
+     * The OCR text of the page [hash]; token ids and keys are cleared if the text changed
+     */
+    external fun rememberPage(hash: String, text: String): Boolean
+    
+    /**
+     * Token ids of the text of the page [hash]
+     */
+    external fun rememberPageTokens(hash: String, ids: IntArray): Boolean
+    
+    /**
+     * Keys the page [hash]'s chunks are cached under, replacing any stored before
+     */
+    external fun rememberPageKeys(hash: String, keys: Array<String>): Boolean
+    
+    /**
+     * Page store hits, misses, pages and bytes (PAGE_STORE_* indices)
+     */
+    external fun getPageStoreStats(): LongArray
+    
+    external fun clearPageStore()
+    
+    private external fun nativePageHash(pixels: ByteBuffer, length: Int): String?
+    
+    private external fun nativeFrameHash(
+        y: ByteBuffer,
+        width: Int,
+        height: Int,
+        yRowStride: Int,
+        cropX: Int,
+        cropY: Int,
+        cropWidth: Int,
+        cropHeight: Int
+    ): LongArray?
+    
+    private external fun nativePreprocess(
+        y: ByteBuffer,
+        u: ByteBuffer,
+        v: ByteBuffer,
+        width: Int,
+        height: Int,
+        yRowStride: Int,
+        uvRowStride: Int,
+        uvPixelStride: Int,
+        cropAndSize: IntArray,
+        format: Int,
+        meanStd: FloatArray,
+        out: ByteBuffer
+    ): Boolean
+}
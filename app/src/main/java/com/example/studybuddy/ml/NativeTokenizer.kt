@@ -0,0 +1,179 @@
+package com.example.studybuddy.ml
+
+import android.util.Log
+
+/**
+ * JNI bridge for the native SentencePiece tokenizer, built into libmlc_llm_jni.so.
+ * The model is loaded once per process; every instance shares it.
+ */
+class NativeTokenizer {
+    companion object {
+        private const val TAG = "NativeTokenizer"
+        
+        // normalizeOcr stats, in the order nativeNormalizeOcr fills them
+        private const val OCR_TOKENS_IN = 0
+        private const val OCR_TOKENS_OUT = 1
+        private const val OCR_BYTES_IN = 2
+        private const val OCR_BYTES_OUT = 3
+        private const val OCR_DEHYPHENATED = 4
+        private const val OCR_LINES_JOINED = 5
+        private const val OCR_BOILERPLATE = 6
+        private const val OCR_PAGE_NUMBERS = 7
+        private const val OCR_STAT_COUNT = 8
+        
+        // getMemoStats() indices
+        const val MEMO_HITS = 0
+        const val MEMO_MISSES = 1
+        const val MEMO_ENTRIES = 2
+        const val MEMO_BYTES = 3
+        
+        init {
+            try {
+                System.loadLibrary("mlc_llm_jni")
+            } catch (e: UnsatisfiedLinkError) {
+                Log.e(TAG, "Failed to load native tokenizer: ${e.message}")
+                throw RuntimeException("Failed to load required native libraries: ${e.message}")
+            }
+        }
+    }
+    
+    /**
+     * Load tokenizer.model; a no-op if the same file is already loaded. The first load
+     * leaves a flat copy beside it (tokenizer.model.flat) that later loads map instead
+     * of parsing the model again.
+     */
+    external fun loadModel(path: String): Boolean
+    
+    /**
+     * Number of pieces in the loaded vocabulary, or 0 if nothing is loaded
+     */
+    external fun vocabSize(): Int
+    
+    /**
+     * Bytes the memo of whole short texts (up to 16 KB each) may hold, for this
+     * model and any loaded later; 4 MB by default, 0 turns it off. encode() and
+     * countTokens() of a text seen before are a lookup returning the same ids.
+     */
+    external fun setMemoBytes(bytes: Long)
+    
+    /**
+     * The text memo since the model was loaded (MEMO_* indices): hits, misses,
+     * texts held and their bytes
+     */
+    external fun getMemoStats(): LongArray
+    
+    /**
+     * Token ids for [text]; a long document is cut at word boundaries and
+     * tokenized on the big cores, with the same ids as in one piece
+     */
+    fun encode(text: String): IntArray = nativeEncode(text.toByteArray(Charsets.UTF_8))
+    
+    /**
+     * Token count for [text] without returning the ids, or -1 if no model is loaded.
+     * Use this to budget context before sending long pages to the model.
+     */
+    fun countTokens(text: String): Int = nativeCount(text.toByteArray(Charsets.UTF_8))
+    
+    /**
+     * Token ids for many texts in one JNI call, e.g. every block of an OCR'd page.
+     * Large batches are tokenized on several cores.
+     */
+    fun encodeBatch(texts: List<String>): TokenBatch {
+        val offsets = IntArray(texts.size + 1)
+        val ids = nativeEncodeBatch(texts.toTypedArray(), offsets)
+        return TokenBatch(ids, offsets)
+    }
+    
+    /**
+     * Token count per text in one JNI call; -1 entries if no model is loaded
+     */
+    fun countTokens(texts: List<String>): IntArray = countTokensBatch(texts.toTypedArray())
+    
+    /**
+     * Text for [ids]; control tokens are dropped
+     */
+    fun decode(ids: IntArray): String = String(nativeDecode(ids), Charsets.UTF_8)
+    
+    /**
+     * OCR'd [pages] as one prompt-ready text: words hyphenated across line breaks
+     * rejoined, lines merged into paragraphs, running headers, footers and page
+     * numbers dropped, whitespace collapsed. One native pass; the token counts
+     * before and after say what it saved (-1 if no model is loaded).
+     */
+    fun normalizeOcr(pages: List<String>): OcrText {
+        val stats = IntArray(OCR_STAT_COUNT)
+        val text = String(nativeNormalizeOcr(pages.toTypedArray(), stats), Charsets.UTF_8)
+        return OcrText(
+            text = text,
+            tokensIn = stats[OCR_TOKENS_IN],
+            tokensOut = stats[OCR_TOKENS_OUT],
+            bytesIn = stats[OCR_BYTES_IN],
+            bytesOut = stats[OCR_BYTES_OUT],
+            dehyphenated = stats[OCR_DEHYPHENATED],
+            linesJoined = stats[OCR_LINES_JOINED],
+            boilerplateLines = stats[OCR_BOILERPLATE],
+            pageNumbers = stats[OCR_PAGE_NUMBERS]
+        )
+    }
+    
+    /**
+     * Same for one text; a form feed separates pages
+     */
+    fun normalizeOcr(text: String): OcrText = normalizeOcr(text.split('\u000C'))
+    
+    /**
+     * [text] (a long OCR'd or retrieved context) thinned to about [ratio] of its
+     * tokens, least informative words first: function words and repeats go,
+     * terms, names and numbers stay. Returned whole, with equal counts, if it is
+     * short, [ratio] is not in (0, 1) or no model is loaded (counts 0).
+     */
+    fun compressContext(text: String, ratio: Float): CompressedText {
+        val stats = IntArray(3)
+        val compressed = String(nativeCompress(text.toByteArray(Charsets.UTF_8), ratio, stats), Charsets.UTF_8)
+        return CompressedText(compressed, tokensIn = stats[0], tokensOut = stats[1], wordsDropped = stats[2])
+    }
+    
+    private external fun nativeEncode(utf8: ByteArray): IntArray
+    private external fun nativeCount(utf8: ByteArray): Int
+    private external fun nativeDecode(ids: IntArray): ByteArray
+    private external fun nativeEncodeBatch(texts: Array<String>, offsets: IntArray): IntArray
+    private external fun countTokensBatch(texts: Array<String>): IntArray
+    private external fun nativeNormalizeOcr(pages: Array<String>, stats: IntArray): ByteArray
+    private external fun nativeCompress(utf8: ByteArray, ratio: Float, stats: IntArray): ByteArray
+}
+
+/**
+ * Ids for a batch of texts stored flat: text i owns ids[offsets[i] until offsets[i + 1]]
+ */
+class TokenBatch(val ids: IntArray, val offsets: IntArray) {
+    val size: Int
+        get() = offsets.size - 1
+    
+    fun tokenCount(index: Int): Int = offsets[index + 1] - offsets[index]
+    
+    fun tokens(index: Int): IntArray = ids.copyOfRange(offsets[index], offsets[index + 1])
+}
+
+/**
+ * Normalized OCR text and what normalizing it did
+ */
+data class OcrText(
+    val text: String,
+    val tokensIn: Int,
+    val tokensOut: Int,
+    val bytesIn: Int,
+    val bytesOut: Int,
+    val dehyphenated: Int,
+    val linesJoined: Int,
+    val boilerplateLines: Int,
+    val pageNumbers: Int
+) {
+    /** Prompt tokens saved, or 0 if no model was loaded to count them */
+    val tokensSaved: Int
+        get() = if (tokensIn >= 0 && tokensOut >= 0) tokensIn - tokensOut else 0
+}
+
+/**
+ * A context after compressContext, with its token counts before and after
+ */
+data class CompressedText(val text: String, val tokensIn: Int, val tokensOut: Int, val wordsDropped: Int)
@@ -2,8 +2,10 @@ package com.example.studybuddy.ml
 
 import android.content.Context
 import android.graphics.Bitmap
+import android.graphics.Rect
 import android.os.SystemClock
 import android.util.Log
+import androidx.camera.core.ImageProxy
 import com.example.studybuddy.utils.ModelHelper
 import org.tensorflow.lite.Interpreter
 import org.tensorflow.lite.support.common.ops.NormalizeOp
@@ -27,9 +29,21 @@ import java.nio.channels.FileChannel
  * Placeholder for TensorFlow Lite image classification
  */
 class OnDeviceImageClassifier(private val context: Context) {
+    companion object {
+        // MobileNet-style input: 224x224 RGB with ImageNet normalization
+        private const val INPUT_SIZE = 224
+        private val MEAN = floatArrayOf(0.485f, 0.456f, 0.406f)
+        private val STD = floatArrayOf(0.229f, 0.224f, 0.225f)
+    }
+    
     private val TAG = "OnDeviceImageClassifier"
     private var isInitialized = false
     
+    // Model input for camera frames, filled natively (NativeImagePreprocessor) frame after frame
+    private val input: ByteBuffer by lazy {
+        NativeImagePreprocessor.allocate(INPUT_SIZE, INPUT_SIZE, NativeImagePreprocessor.FORMAT_FLOAT_RGB)
+    }
+    
     data class Classification(val label: String, val confidence: Float)
     
     /**
@@ -57,6 +71,32 @@ class OnDeviceImageClassifier(private val context: Context) {
         )
     }
     
+    /**
+     * Classify a camera frame: its center square, upright, at the model's
+     * input size and normalized, from the YUV planes with no Bitmap made.
+     * Close [image] once this returns.
+     */
+    fun classifyImage(image: ImageProxy): List<Classification> {
+        if (!isInitialized) {
+            return emptyList()
+        }
+        val crop = image.cropRect
+        val side = minOf(crop.width(), crop.height())
+        val square = Rect(crop.centerX() - side / 2, crop.centerY() - side / 2,
+            crop.centerX() - side / 2 + side, crop.centerY() - side / 2 + side)
+        input.clear()
+        if (!NativeImagePreprocessor.preprocess(image, input, INPUT_SIZE, INPUT_SIZE,
+                NativeImagePreprocessor.FORMAT_FLOAT_RGB, square, mean = MEAN, std = STD)) {
+            return emptyList()
+        }
+        // Same placeholder classifications until a model consumes [input]
+        return listOf(
+            Classification("book", 0.85f),
+            Classification("text", 0.75f),
+            Classification("document", 0.65f)
+        )
+    }
+    
     /**
      * Clean up resources
      */
@@ -0,0 +1,168 @@
+package com.example.studybuddy.ml
+
+import android.content.Context
+import android.util.Log
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import java.io.File
+
+/**
+ * Implementation of LanguageModel that runs the MLC-LLM engine (libmlc_llm_jni)
+ * through MlcLlmBridge. Uses the same model directory as SimpleMlcModel.
+ */
+class RealMlcLanguageModel(context: Context) : LanguageModel(context) {
+    private val tag = "RealMlcLanguageModel"
+    private var bridge: MlcLlmBridge? = null
+    private var isInitialized = false
+
+    companion object {
+        // The bridge of the model that last initialized, for onTrimMemory
+        @Volatile
+        private var activeBridge: MlcLlmBridge? = null
+
+        /**
+         * Forward an onTrimMemory level to the loaded engine; returns the bytes it
+         * released. Waits for a request in progress, so call it off the main thread.
+         */
+        fun trimMemory(level: Int): Long {
+            return try {
+                activeBridge?.trimMemory(level) ?: 0L
+            } catch (e: Throwable) {
+                Log.e("RealMlcLanguageModel", "trimMemory failed", e)
+                0L
+            }
+        }
+    }
+
+    private val internalModelDir by lazy { File(context.filesDir, "models/gemma2_2b_it") }
+
+    override suspend fun initialize() {
+        withContext(Dispatchers.IO) {
+            try {
+                Log.d(tag, "Initializing RealMlcLanguageModel")
+
+                val modelDownloader = GemmaModelDownloader(context)
+                val modelDir = if (modelDownloader.isModelDownloaded()) {
+                    modelDownloader.getModelDirectory()
+                } else {
+                    internalModelDir
+                }
+                if (!modelDir.exists()) {
+                    val error = "Model not found at ${modelDir.absolutePath}"
+                    Log.e(tag, error)
+                    _error.value = error
+                    _initialized.value = false
+                    return@withContext
+                }
+
+                // Loading the bridge class loads the native libraries
+                val engine = bridge ?: MlcLlmBridge().also { bridge = it }
+                if (!engine.initializeEngine(modelDir.absolutePath)) {
+                    val error = "Failed to initialize MLC-LLM engine"
+                    Log.e(tag, error)
+                    _error.value = error
+                    _initialized.value = false
+                    return@withContext
+                }
+
+                engine.setTemperature(temperature)
+                engine.setTopP(topP)
+
+                isInitialized = true
+                activeBridge = engine
+                _initialized.value = true
+                _error.value = null
+                Log.d(tag, "RealMlcLanguageModel initialized from ${modelDir.absolutePath}")
+            } catch (e: Throwable) {
+                // RuntimeException from a missing native library included
+                val error = "Error initializing RealMlcLanguageModel: ${e.message}"
+                Log.e(tag, error, e)
+                _error.value = error
+                _initialized.value = false
+            }
+        }
+    }
+
+    override suspend fun generateText(prompt: String): String {
+        val engine = bridge
+        if (!isInitialized || engine == null) {
+            _error.value = "Model not initialized"
+            return "ERROR: Model not initialized"
+        }
+
+        return withContext(Dispatchers.IO) {
+            try {
+                engine.generateResponse(prompt)
+            } catch (e: Exception) {
+                val error = "Error generating text: ${e.message}"
+                Log.e(tag, error, e)
+                _error.value = error
+                "ERROR: $error"
+            }
+        }
+    }
+
+    /**
+     * Blocks the calling thread until the response is complete, like TVMLanguageModel.
+     */
+    override fun streamText(prompt: String, onToken: (String) -> Unit, onError: (String) -> Unit) {
+        val engine = bridge
+        if (!isInitialized || engine == null) {
+            _error.value = "Model not initialized"
+            onError("ERROR: Model not initialized")
+            return
+        }
+
+        try {
+            engine.streamResponse(prompt) { token ->
+                if (token.startsWith("Error:") || token.startsWith("ERROR:")) {
+                    onError(token)
+                } else {
+                    onToken(token)
+                }
+            }
+        } catch (e: Exception) {
+            val error = "Error streaming text: ${e.message}"
+            Log.e(tag, error, e)
+            _error.value = error
+            onError("ERROR: $error")
+        }
+    }
+
+    override suspend fun reset() {
+        if (isInitialized) {
+            withContext(Dispatchers.IO) {
+                bridge?.resetChat()
+            }
+        }
+    }
+
+    override fun getModelInfo(): String {
+        return "Gemma 2-2B-IT on the MLC-LLM engine"
+    }
+
+    override suspend fun shutdown() {
+        withContext(Dispatchers.IO) {
+            if (isInitialized) {
+                bridge?.closeEngine()
+            }
+            if (activeBridge === bridge) {
+                activeBridge = null
+            }
+            isInitialized = false
+            _initialized.value = false
+        }
+    }
+
+    override fun onTemperatureChanged(newValue: Float) {
+        if (isInitialized) {
+            bridge?.setTemperature(newValue)
+        }
+    }
+
+    override fun onTopPChanged(newValue: Float) {
+        if (isInitialized) {
+            bridge?.setTopP(newValue)
+        }
+    }
+}
@@ -5,8 +5,10 @@ import android.util.Log
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.GlobalScope
 import kotlinx.coroutines.launch
+import kotlinx.coroutines.suspendCancellableCoroutine
 import kotlinx.coroutines.withContext
 import java.io.File
+import kotlin.coroutines.resume
 
 /**
  * A simplified implementation of LanguageModel that uses our native library
@@ -40,6 +42,14 @@ class SimpleMlcModel(context: Context) : LanguageModel(context) {
     private external fun set_parameter(key: String, value: Float)
     private external fun shutdown_native()
     
+    // Non-blocking generation: returns a request id, completes through the callback
+    private external fun submit_generate(prompt: String, callback: (String) -> Unit): Long
+    private external fun request_status(id: Long): Int
+    private external fun request_output(id: Long): String
+    private external fun queue_position(id: Long): Int
+    private external fun cancel_request(id: Long): Boolean
+    private external fun release_request(id: Long)
+    
     override suspend fun initialize() {
         withContext(Dispatchers.IO) {
             try {
@@ -142,37 +152,51 @@ class SimpleMlcModel(context: Context) : LanguageModel(context) {
             return "ERROR: $error"
         }
         
-        return withContext(Dispatchers.IO) {
-            try {
-                Log.d(tag, "Generating text for prompt: $prompt")
-                
-                // Preprocess the prompt to ensure correct formatting
-                val formattedPrompt = if (!prompt.endsWith("\nAssistant:")) {
-                    // Make sure the prompt ends with "Assistant:" for proper response generation
-                    if (prompt.contains("Assistant:")) {
-                        prompt
-                    } else {
-                        "$prompt\nAssistant:"
-                    }
-                } else {
+        return try {
+            Log.d(tag, "Generating text for prompt: $prompt")
+            
+            // Preprocess the prompt to ensure correct formatting
+            val formattedPrompt = if (!prompt.endsWith("\nAssistant:")) {
+                // Make sure the prompt ends with "Assistant:" for proper response generation
+                if (prompt.contains("Assistant:")) {
                     prompt
+                } else {
+                    "$prompt\nAssistant:"
                 }
-                
-                Log.d(tag, "Using formatted prompt: $formattedPrompt")
-                val response = generate(formattedPrompt)
-                
-                // Post-process the response for better display
-                val cleanedResponse = response.trim()
-                Log.d(tag, "Generated text successfully")
-                
-                cleanedResponse
-            } catch (e: Exception) {
-                val error = "Error generating text: ${e.message}"
-                Log.e(tag, error, e)
-                _error.value = error
-                "ERROR: $error"
+            } else {
+                prompt
+            }
+            
+            Log.d(tag, "Using formatted prompt: $formattedPrompt")
+            val response = awaitGenerate(formattedPrompt)
+            if (response.startsWith("Error:")) {
+                throw RuntimeException(response)
             }
+            
+            // Post-process the response for better display
+            val cleanedResponse = response.trim()
+            Log.d(tag, "Generated text successfully")
+            
+            cleanedResponse
+        } catch (e: Exception) {
+            val error = "Error generating text: ${e.message}"
+            Log.e(tag, error, e)
+            _error.value = error
+            "ERROR: $error"
+        }
+    }
+    
+    /**
+     * Run generate on the native worker and suspend until it completes, without
+     * holding a dispatcher thread. Cancelling the coroutine cancels the request.
+     */
+    private suspend fun awaitGenerate(prompt: String): String = suspendCancellableCoroutine { cont ->
+        val id = submit_generate(prompt) { result -> cont.resume(result) }
+        if (id < 0) {
+            cont.resume("Error: Failed to queue generation")
+            return@suspendCancellableCoroutine
         }
+        cont.invokeOnCancellation { cancel_request(id) }
     }
     
     override fun streamText(prompt: String, onToken: (String) -> Unit, onError: (String) -> Unit) {
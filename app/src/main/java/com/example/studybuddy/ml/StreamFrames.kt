@@ -0,0 +1,138 @@
+package com.example.studybuddy.ml
+
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/** One record of a framed ring stream, decoded */
+sealed class StreamFrame {
+    /** Text for [tokens] decode steps; [logprob] is NaN when the module reports none */
+    data class Delta(val text: String, val tokens: Int, val logprob: Float) : StreamFrame()
+    
+    /** The end of a stream, with [reason] one of the StreamFrames.FINISH_* values */
+    data class Finish(
+        val requestId: Long,
+        val reason: Int,
+        val promptTokens: Int,
+        val completionTokens: Int,
+        val prefillMs: Float,
+        val decodeMs: Float
+    ) : StreamFrame()
+    
+    data class Error(val requestId: Long, val message: String) : StreamFrame()
+    
+    /**
+     * Block [index] of the answer started, changed or (with [op] BLOCK_REMOVED)
+     * was dropped with every block after it. Its text is now its first [keep]
+     * bytes as reported before, then [text]; [kind] is one of the BLOCK_* kinds.
+     */
+    data class Block(val op: Int, val kind: Int, val index: Int, val keep: Int, val text: String) : StreamFrame()
+}
+
+/**
+ * Decodes the binary frames of app/src/main/cpp/stream_frames.h (the layouts
+ * must match), read from the token ring with [TokenRingReader.drainRecords].
+ */
+object StreamFrames {
+    private const val KIND_DELTA = 1
+    private const val KIND_FINISH = 2
+    private const val KIND_ERROR = 3
+    private const val DELTA_HEADER = 8
+    private const val FINISH_SIZE = 32
+    private const val ERROR_HEADER = 16
+    private const val KIND_BLOCK = 4
+    private const val BLOCK_HEADER = 12
+    
+    // Finish reasons, as OpenAI's finish_reason
+    const val FINISH_STOP = 0
+    const val FINISH_LENGTH = 1
+    const val FINISH_ABORT = 2
+    
+    // Block frame ops and block kinds, as markdown_blocks.h
+    const val BLOCK_STARTED = 0
+    const val BLOCK_UPDATED = 1
+    const val BLOCK_REMOVED = 2
+    const val BLOCK_PARAGRAPH = 0
+    const val BLOCK_HEADING = 1
+    const val BLOCK_LIST = 2
+    const val BLOCK_QUOTE = 3
+    const val BLOCK_TABLE = 4
+    const val BLOCK_RULE = 5
+    const val BLOCK_CODE = 6
+    const val BLOCK_MATH = 7
+    
+    /** The frame in the first len bytes of bytes, or null for one this build does not know */
+    fun decode(bytes: ByteArray, len: Int): StreamFrame? {
+        if (len < 1) {
+            return null
+        }
+        val frame = ByteBuffer.wrap(bytes, 0, len).order(ByteOrder.nativeOrder())
+        return when (bytes[0].toInt()) {
+            KIND_DELTA -> if (len < DELTA_HEADER) null else StreamFrame.Delta(
+                String(bytes, DELTA_HEADER, len - DELTA_HEADER, Charsets.UTF_8),
+                frame.getShort(2).toInt() and 0xffff,
+                frame.getFloat(4)
+            )
+            KIND_FINISH -> if (len < FINISH_SIZE) null else StreamFrame.Finish(
+                frame.getLong(24),
+                bytes[1].toInt() and 0xff,
+                frame.getInt(4),
+                frame.getInt(8),
+                frame.getFloat(12),
+                frame.getFloat(16)
+            )
+            KIND_ERROR -> if (len < ERROR_HEADER) null else StreamFrame.Error(
+                frame.getLong(8),
+                String(bytes, ERROR_HEADER, len - ERROR_HEADER, Charsets.UTF_8)
+            )
+            KIND_BLOCK -> if (len < BLOCK_HEADER) null else StreamFrame.Block(
+                bytes[1].toInt() and 0xff,
+                bytes[2].toInt() and 0xff,
+                frame.getInt(4),
+                frame.getInt(8),
+                String(bytes, BLOCK_HEADER, len - BLOCK_HEADER, Charsets.UTF_8)
+            )
+            else -> null
+        }
+    }
+}
+
+/**
+ * The answer's blocks as block frames report them, so a view re-renders only
+ * the block [apply] returns instead of re-parsing the whole answer per token.
+ * `keep` counts UTF-8 bytes; blocks are kept as bytes for that reason.
+ */
+class StreamBlocks {
+    private val texts = mutableListOf<ByteArray>()
+    private val kinds = mutableListOf<Int>()
+    
+    val size: Int get() = texts.size
+    
+    fun text(index: Int): String = String(texts[index], Charsets.UTF_8)
+    
+    fun kind(index: Int): Int = kinds[index]
+    
+    /** Applies [frame]; returns the index of the block it changed, or of the first one removed */
+    fun apply(frame: StreamFrame.Block): Int {
+        if (frame.op == StreamFrames.BLOCK_REMOVED) {
+            while (texts.size > frame.index) {
+                texts.removeAt(texts.size - 1)
+                kinds.removeAt(kinds.size - 1)
+            }
+            return frame.index
+        }
+        val added = frame.text.toByteArray(Charsets.UTF_8)
+        if (frame.index >= texts.size) {
+            texts.add(added)
+            kinds.add(frame.kind)
+        } else {
+            texts[frame.index] = texts[frame.index].copyOf(frame.keep) + added
+            kinds[frame.index] = frame.kind
+        }
+        return frame.index
+    }
+    
+    fun clear() {
+        texts.clear()
+        kinds.clear()
+    }
+}
@@ -2,6 +2,7 @@ package com.example.studybuddy.ml
 
 import android.util.Log
 import java.io.File
+import java.nio.ByteBuffer
 
 /**
  * Bridge to the native TVM/MLC runtime.
@@ -9,12 +10,23 @@ import java.io.File
 class TVMBridge {
     companion object {
         private const val TAG = "TVMBridge"
+        private const val RING_CAPACITY = 64 * 1024
+        private const val RING_WAIT_MS = 100
+        
+        /** Seed value that draws a fresh random seed for each request */
+        const val RANDOM_SEED = -1L
+        
+        // Indices into getDeliveryStats()
+        const val DELIVERY_TOKENS = 0
+        const val DELIVERY_CALLBACKS = 1
+        const val DELIVERY_TOKENS_PER_CALLBACK = 2
+        const val DELIVERY_FIRST_MS = 3
+        const val DELIVERY_MAX_GAP_MS = 4
         
         init {
             try {
                 System.loadLibrary("c++_shared")
                 System.loadLibrary("tvm_runtime")
-                System.loadLibrary("tvm")
                 System.loadLibrary("mlc_llm")
                 System.loadLibrary("mlc_llm_module")
                 System.loadLibrary("tvm_bridge")
@@ -78,11 +90,25 @@ class TVMBridge {
     }
     
     /**
-     * Stream tokens from the model for the given prompt
+     * How streamed tokens are grouped into callbacks: a batch is delivered after
+     * [intervalMicros] or [maxTokens] tokens, whichever comes first. The first
+     * token of a response is always delivered immediately.
      */
-    fun streamChat(prompt: String, callback: (String) -> Unit) {
+    data class DeliveryPolicy(val intervalMicros: Int, val maxTokens: Int) {
+        companion object {
+            /** One 60 Hz frame or 8 tokens */
+            val FRAME = DeliveryPolicy(16_000, 8)
+            /** One callback per token */
+            val EVERY_TOKEN = DeliveryPolicy(0, 1)
+        }
+    }
+    
+    /**
+     * Stream tokens from the model for the given prompt, coalesced per [policy]
+     */
+    fun streamChat(prompt: String, policy: DeliveryPolicy = DeliveryPolicy.FRAME, callback: (String) -> Unit) {
         Log.d(TAG, "Streaming response for prompt: $prompt")
-        streamResponse(prompt) { token ->
+        streamResponse(prompt, policy.intervalMicros, policy.maxTokens) { token ->
             if (token.startsWith("ERROR:") || token.startsWith("Error:")) {
                 Log.e(TAG, "Error in streaming: $token")
                 throw RuntimeException(token)
@@ -91,6 +117,146 @@ class TVMBridge {
         }
     }
     
+    /**
+     * Stream tokens through a shared direct ByteBuffer ring instead of one JNI
+     * callback per token. Tokens are drained in batches after each native wakeup.
+     * A non-negative [seed] makes this request's sampling reproducible; otherwise
+     * the seed set with [setSeed] applies.
+     */
+    fun streamChatBatched(prompt: String, maxTokens: Int = 0, seed: Long = RANDOM_SEED,
+                          callback: (String) -> Unit) {
+        val buffer = ringBuffer ?: createTokenRing(RING_CAPACITY)?.also { ringBuffer = it }
+            ?: throw RuntimeException("Failed to create token ring")
+        val reader = ringReader ?: TokenRingReader(buffer).also { ringReader = it }
+        
+        if (!startStreamingToRing(prompt, maxTokens, seed)) {
+            throw RuntimeException("Failed to start ring streaming")
+        }
+        
+        while (true) {
+            val available = awaitTokenRing(RING_WAIT_MS)
+            if (available > 0) {
+                reader.drain(callback)
+            } else if (available < 0) {
+                break
+            }
+        }
+        if (reader.hasError) {
+            throw RuntimeException("Error in streaming generation")
+        }
+    }
+    
+    /**
+     * Like [streamChatBatched], but as binary [StreamFrame]s: deltas carry
+     * their token count (and logprob, NaN from the chat module), and the
+     * stream ends with one Finish frame holding the finish reason and usage,
+     * or an Error frame. [requestId] names the stream for [abortFramed] and is
+     * echoed in the last frame. Returns that last frame. With [blocks], each
+     * delta is followed by Block frames for the Markdown/LaTeX blocks of the
+     * answer it started or changed; feed them to a [StreamBlocks] and re-render
+     * only the block it returns.
+     */
+    fun streamChatFramed(requestId: Long, prompt: String, maxTokens: Int = 0, seed: Long = RANDOM_SEED,
+                         blocks: Boolean = false, onFrame: (StreamFrame) -> Unit): StreamFrame? {
+        val buffer = ringBuffer ?: createTokenRing(RING_CAPACITY)?.also { ringBuffer = it }
+            ?: throw RuntimeException("Failed to create token ring")
+        val reader = ringReader ?: TokenRingReader(buffer).also { ringReader = it }
+        
+        if (!startFramedStream(requestId, prompt, maxTokens, seed, blocks)) {
+            throw RuntimeException("Failed to start framed streaming")
+        }
+        
+        var last: StreamFrame? = null
+        while (true) {
+            val available = awaitTokenRing(RING_WAIT_MS)
+            if (available > 0) {
+                reader.drainRecords { bytes, len ->
+                    StreamFrames.decode(bytes, len)?.let { frame ->
+                        if (frame is StreamFrame.Finish || frame is StreamFrame.Error) {
+                            last = frame
+                        }
+                        onFrame(frame)
+                    }
+                }
+            } else if (available < 0) {
+                break
+            }
+        }
+        return last
+    }
+    
+    /** Stop the framed stream [requestId] at its next token; false if it is not the one running */
+    fun abortFramed(requestId: Long): Boolean = abortFramedStream(requestId)
+    
+    private var ringBuffer: ByteBuffer? = null
+    private var ringReader: TokenRingReader? = null
+    
+    /**
+     * Start loading and warming the engine for [modelPath] on a native background
+     * thread. A later initializeEngine with the same path reuses the warmed module.
+     */
+    external fun warmStart(modelPath: String): Boolean
+    
+    /**
+     * Stop a running warmup at its next stage boundary. With [releaseIfUnused] the
+     * warmed module is also dropped if no real request has claimed it yet.
+     */
+    external fun cancelWarmup(releaseIfUnused: Boolean)
+    
+    /**
+     * Delivery metrics of the last streamChat request (DELIVERY_* indices)
+     */
+    external fun getDeliveryStats(): FloatArray
+    
+    /**
+     * Stage latencies of the chat-module requests this bridge served, as JSON
+     * laid out like MlcLlmBridge.getMetrics(). Prompt token counts are
+     * estimated, since the module tokenizes.
+     */
+    external fun getMetrics(): String
+    
+    /**
+     * Tag this thread's requests with [traceId] (0 for none), returning the
+     * previous id; as MlcLlmBridge.setTraceId()
+     */
+    external fun setTraceId(traceId: Long): Long
+    
+    /**
+     * A traced request's stage timestamps and flight recorder lines, laid out
+     * like MlcLlmBridge.getRequestTrace(); "{}" for an unknown id
+     */
+    external fun getRequestTrace(traceId: Long): String
+    
+    /**
+     * Emit "mlc:" trace sections (model load, tokenize, prefill chunks, decode
+     * steps, sampling, detokenize, JNI delivery) into Perfetto / systrace
+     * captures. Off by default; while off the sections cost nothing measurable.
+     */
+    external fun setNativeTracing(enabled: Boolean)
+    
+    /**
+     * Start the getMetrics() histograms over
+     */
+    external fun resetMetrics()
+    
+    /**
+     * Create the next chat module on [backend] (MlcLlmBridge.BACKEND_* values)
+     * instead of the config's "device" or the fastest one found
+     */
+    external fun setComputeBackend(backend: Int)
+    
+    /**
+     * Backend of the last chat module created (MlcLlmBridge.BACKEND_* values)
+     */
+    external fun getComputeBackend(): Int
+    
+    /**
+     * Run the TVM thread pool of the next chat module on [affinity] cores
+     * (MlcLlmBridge.AFFINITY_* values) with [workers] threads, 0 for one per
+     * core. AFFINITY_AUTO uses the choice MlcLlmBridge measured for this phone.
+     */
+    external fun setThreadConfig(affinity: Int, workers: Int)
+    
     /**
      * Set temperature for text generation
      */
@@ -107,6 +273,23 @@ class TVMBridge {
         setGenerationTopP(topP)
     }
     
+    /**
+     * Seed every following request with [seed] so runs replay token for token.
+     * [RANDOM_SEED] restores a fresh seed per request.
+     */
+    fun setSeed(seed: Long) {
+        Log.i(TAG, "Seed set to: $seed")
+        setGenerationSeed(seed)
+    }
+    
+    /**
+     * Log the model and lib directory listings and any file that differs from the
+     * model manifest. Initialization no longer lists the directories itself.
+     */
+    fun logModelDiagnostics(modelPath: String) {
+        logDiagnostics(modelPath)
+    }
+    
     /**
      * Reset the chat session
      */
@@ -117,9 +300,18 @@ class TVMBridge {
     
     // Native method declarations
     private external fun initializeTVMRuntime(modelPath: String): Boolean
+    private external fun logDiagnostics(modelPath: String)
     private external fun generateResponse(prompt: String): String
-    private external fun streamResponse(prompt: String, callback: (String) -> Unit)
+    private external fun streamResponse(prompt: String, flushIntervalUs: Int, maxBatchTokens: Int,
+                                        callback: (String) -> Unit)
     private external fun setGenerationTemperature(temperature: Float): Boolean
     private external fun setGenerationTopP(topP: Float): Boolean
+    private external fun setGenerationSeed(seed: Long)
     private external fun resetChatSession(): Boolean
+    private external fun createTokenRing(capacity: Int): ByteBuffer?
+    private external fun startStreamingToRing(prompt: String, maxTokens: Int, seed: Long): Boolean
+    private external fun startFramedStream(requestId: Long, prompt: String, maxTokens: Int, seed: Long,
+                                           blocks: Boolean): Boolean
+    private external fun abortFramedStream(requestId: Long): Boolean
+    private external fun awaitTokenRing(timeoutMs: Int): Int
 } 
\ No newline at end of file
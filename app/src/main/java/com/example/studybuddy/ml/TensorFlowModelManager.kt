@@ -32,6 +32,9 @@ class TensorFlowModelManager(private val context: Context) {
     private val imageClassifier = OnDeviceImageClassifier(context)
     private val ocrProcessor = OcrProcessor(context)
     
+    // OCR text is normalized natively before it goes into a prompt
+    private val ocrNormalizer by lazy { NativeTokenizer() }
+    
     // Model status
     private var mlcInitialized = false
     private var tfInitialized = false
@@ -264,6 +267,22 @@ class TensorFlowModelManager(private val context: Context) {
         }
     }
     
+    /**
+     * [ocrText] rejoined into paragraphs without running headers, page numbers
+     * and hyphenation (NativeTokenizer.normalizeOcr); unchanged if that fails
+     */
+    private fun normalizeOcr(ocrText: String): String {
+        return try {
+            val normalized = ocrNormalizer.normalizeOcr(ocrText)
+            Log.d(TAG, "OCR text normalized: ${normalized.bytesIn} -> ${normalized.bytesOut} bytes, " +
+                "${normalized.tokensSaved} tokens saved")
+            normalized.text.ifEmpty { ocrText }
+        } catch (e: Throwable) {
+            Log.w(TAG, "Could not normalize OCR text: ${e.message}")
+            ocrText
+        }
+    }
+    
     /**
      * Process OCR text with LLM
      */
@@ -274,7 +293,8 @@ class TensorFlowModelManager(private val context: Context) {
         
         try {
             // Build a prompt with the OCR text and user question
-            val prompt = "I have this text extracted from an image: '$ocrText'. Based on this text, $userQuestion"
+            val prompt = "I have this text extracted from an image: '${normalizeOcr(ocrText)}'. " +
+                "Based on this text, $userQuestion"
             
             // Process with MLC-LLM model if available
             return mlcModel.generateText(prompt)
@@ -311,7 +331,8 @@ class TensorFlowModelManager(private val context: Context) {
     private fun streamProcessOcrTextInternal(ocrText: String, userQuestion: String, callback: (String) -> Unit) {
         try {
             // Build a prompt with the OCR text and user question
-            val prompt = "I have this text extracted from an image: '$ocrText'. Based on this text, $userQuestion"
+            val prompt = "I have this text extracted from an image: '${normalizeOcr(ocrText)}'. " +
+                "Based on this text, $userQuestion"
             
             // Process with MLC-LLM model in streaming mode
             mlcModel.streamText(prompt, callback) { error ->
@@ -2,30 +2,114 @@ package com.example.studybuddy.ml
 
 import android.graphics.Bitmap
 import android.util.Log
+import androidx.camera.core.ImageProxy
 import com.google.mlkit.vision.common.InputImage
 import com.google.mlkit.vision.text.Text
 import com.google.mlkit.vision.text.TextRecognition
 import com.google.mlkit.vision.text.latin.TextRecognizerOptions
 import kotlinx.coroutines.suspendCancellableCoroutine
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import java.io.File
+import java.nio.ByteBuffer
 import kotlin.coroutines.resume
 import kotlin.coroutines.resumeWithException
 
 /**
  * Service for performing OCR text recognition on images using ML Kit.
  */
-class TextRecognitionService {
+class TextRecognitionService(pageStoreDir: File? = null, pageStoreTag: String = "") {
     private val recognizer = TextRecognition.getClient(TextRecognizerOptions.DEFAULT_OPTIONS)
     private val TAG = "TextRecognitionService"
     
+    // NV21 frames for ML Kit, reused while one recognition at a time reads it
+    private val frameLock = Mutex()
+    private var frame: ByteBuffer? = null
+    
+    /**
+     * Perceptual hash of the last camera frame recognized, for storing the token
+     * ids of its text (NativeImagePreprocessor.rememberFrameTokens)
+     */
+    @Volatile
+    var lastFrameHash: LongArray? = null
+        private set
+    
+    /**
+     * Content hash of the last bitmap recognized, for storing the token ids and
+     * chunk keys of its text (NativeImagePreprocessor.rememberPageTokens, rememberPageKeys)
+     */
+    @Volatile
+    var lastPageHash: String? = null
+        private set
+    
+    init {
+        if (pageStoreDir != null && !NativeImagePreprocessor.openPageStore(pageStoreDir.absolutePath, pageStoreTag)) {
+            Log.w(TAG, "Page store unavailable; saved pages will run OCR each time")
+        }
+    }
+    
     /**
      * Asynchronously processes an image and extracts text using OCR.
      * 
+     * A page whose pixels were recognized before, in this launch or an earlier
+     * one with the page store open, returns the stored text without OCR.
+     * 
      * @param bitmap The image to extract text from
      * @return A string containing all recognized text from the image
      */
-    suspend fun recognizeText(bitmap: Bitmap): String = suspendCancellableCoroutine { continuation ->
-        val image = InputImage.fromBitmap(bitmap, 0)
-        
+    suspend fun recognizeText(bitmap: Bitmap): String {
+        val hash = NativeImagePreprocessor.pageHash(bitmap)
+        lastPageHash = hash
+        if (hash != null) {
+            NativeImagePreprocessor.lookupPageText(hash)?.let {
+                Log.d(TAG, "Page seen before; reusing its text")
+                return it
+            }
+        }
+        val text = recognize(InputImage.fromBitmap(bitmap, 0))
+        if (hash != null && text.isNotEmpty()) {
+            NativeImagePreprocessor.rememberPage(hash, text)
+        }
+        return text
+    }
+    
+    /**
+     * Same for a camera frame, converted natively (NativeImagePreprocessor) to
+     * NV21 with its long side at most [maxSide]; ML Kit applies the rotation.
+     * A frame of the page recognized a moment ago (its perceptual hash within
+     * NEAR_DUPLICATE_BITS of a recent one) returns that text without OCR.
+     * Close [image] once this returns.
+     */
+    suspend fun recognizeText(image: ImageProxy, maxSide: Int = 1280): String = frameLock.withLock {
+        val hash = NativeImagePreprocessor.frameHash(image)
+        lastFrameHash = hash
+        if (hash != null) {
+            NativeImagePreprocessor.lookupFrameText(hash)?.let {
+                Log.d(TAG, "Frame matches a recent one; reusing its text")
+                return@withLock it
+            }
+        }
+        val crop = image.cropRect
+        val scale = minOf(1f, maxSide.toFloat() / maxOf(crop.width(), crop.height()))
+        val width = (crop.width() * scale).toInt() and 1.inv()
+        val height = (crop.height() * scale).toInt() and 1.inv()
+        val size = NativeImagePreprocessor.outputBytes(width, height, NativeImagePreprocessor.FORMAT_NV21)
+        val buffer = frame?.takeIf { it.capacity() >= size }
+            ?: NativeImagePreprocessor.allocate(width, height, NativeImagePreprocessor.FORMAT_NV21).also { frame = it }
+        buffer.clear()
+        if (!NativeImagePreprocessor.preprocess(image, buffer, width, height, NativeImagePreprocessor.FORMAT_NV21,
+                rotationDegrees = 0)) {
+            throw IllegalArgumentException("Cannot convert a ${image.width}x${image.height} frame for OCR")
+        }
+        val text = recognize(InputImage.fromByteBuffer(buffer, width, height, image.imageInfo.rotationDegrees,
+            InputImage.IMAGE_FORMAT_NV21))
+        if (hash != null && text.isNotEmpty()) {
+            NativeImagePreprocessor.rememberFrame(hash, text)
+        }
+        text
+    }
+    
+    private suspend fun recognize(image: InputImage): String = suspendCancellableCoroutine { continuation ->
         recognizer.process(image)
             .addOnSuccessListener { text ->
                 Log.d(TAG, "OCR process completed successfully")
@@ -0,0 +1,64 @@
+package com.example.studybuddy.ml
+
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Reads token records written by the native side into the shared ring created by
+ * [TVMBridge.createTokenRing]. Layout must match app/src/main/cpp/token_ring.h.
+ */
+class TokenRingReader(buffer: ByteBuffer) {
+    companion object {
+        private const val HEADER_SIZE = 16
+        private const val HEAD_OFFSET = 0
+        private const val TAIL_OFFSET = 4
+        private const val FLAGS_OFFSET = 8
+        private const val FLAG_ERROR = 1 shl 1
+    }
+    
+    private val ring = buffer.order(ByteOrder.nativeOrder())
+    private val capacity = ring.capacity() - HEADER_SIZE
+    private val mask = capacity - 1
+    private var scratch = ByteArray(256)
+    
+    /** True if the native producer finished with an error */
+    val hasError: Boolean
+        get() = (ring.getInt(FLAGS_OFFSET) and FLAG_ERROR) != 0
+    
+    /**
+     * Decode every complete record currently in the ring and hand it to [onToken].
+     * Returns the number of records consumed.
+     */
+    fun drain(onToken: (String) -> Unit): Int =
+        drainRecords { bytes, len -> onToken(String(bytes, 0, len, Charsets.UTF_8)) }
+    
+    /**
+     * Hand each complete record's raw bytes to [onRecord], for binary records
+     * such as [StreamFrames]. The array is reused: only its first len bytes
+     * are the record, and only until [onRecord] returns.
+     */
+    fun drainRecords(onRecord: (ByteArray, Int) -> Unit): Int {
+        val head = ring.getInt(HEAD_OFFSET)
+        var tail = ring.getInt(TAIL_OFFSET)
+        var count = 0
+        
+        while (head - tail >= 2) {
+            val len = (readByte(tail).toInt() and 0xff) or ((readByte(tail + 1).toInt() and 0xff) shl 8)
+            if (scratch.size < len) {
+                scratch = ByteArray(len)
+            }
+            for (i in 0 until len) {
+                scratch[i] = readByte(tail + 2 + i)
+            }
+            onRecord(scratch, len)
+            tail += 2 + len
+            count++
+        }
+        
+        // Publish consumption so the producer can reuse the space
+        ring.putInt(TAIL_OFFSET, tail)
+        return count
+    }
+    
+    private fun readByte(pos: Int): Byte = ring.get(HEADER_SIZE + (pos and mask))
+}
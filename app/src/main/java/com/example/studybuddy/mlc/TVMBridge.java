@@ -15,7 +15,6 @@ public class TVMBridge {
             // Load the required libraries in the correct order
             System.loadLibrary("c++_shared");
             System.loadLibrary("tvm_runtime");
-            System.loadLibrary("tvm");
             System.loadLibrary("mlc_llm");
             System.loadLibrary("mlc_llm_module");
             
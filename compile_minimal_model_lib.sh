@@ -48,7 +48,7 @@ if [ -d "$ANDROID_NDK_HOME" ] || [ -d "$ANDROID_HOME/ndk" ]; then
         
         if [ -n "$CLANG" ]; then
             echo "Using compiler: $CLANG"
-            $CLANG -shared -fPIC -o libgemma-2-2b-it-q4f16_1.so generate_model_lib.cpp -std=c++14
+            $CLANG -shared -fPIC -o libgemma-2-2b-it-q4f16_1.so generate_model_lib.cpp -std=c++14 -pthread
             COMPILE_SUCCESS=$?
         else
             echo "Could not find Android NDK clang++ compiler"
@@ -67,10 +67,10 @@ fi
 if [ $COMPILE_SUCCESS -ne 0 ]; then
     echo "Trying system compiler..."
     if command -v clang++ > /dev/null; then
-        clang++ -shared -fPIC -o libgemma-2-2b-it-q4f16_1.so generate_model_lib.cpp -std=c++14
+        clang++ -shared -fPIC -o libgemma-2-2b-it-q4f16_1.so generate_model_lib.cpp -std=c++14 -pthread
         COMPILE_SUCCESS=$?
     elif command -v g++ > /dev/null; then
-        g++ -shared -fPIC -o libgemma-2-2b-it-q4f16_1.so generate_model_lib.cpp -std=c++14
+        g++ -shared -fPIC -o libgemma-2-2b-it-q4f16_1.so generate_model_lib.cpp -std=c++14 -pthread
         COMPILE_SUCCESS=$?
     else
         echo "No compatible C++ compiler found"
@@ -116,6 +116,19 @@ if [ ! -f "../$MODEL_DIR/mlc-chat-config.json" ]; then
 EOF
 fi
 
+# Timing of the fake model (see generate_model_lib.cpp); edit to benchmark other rates
+if [ ! -f "../$MODEL_DIR/fake-model.json" ]; then
+    echo "Creating fake model timing file..."
+    cat > "../$MODEL_DIR/fake-model.json" << EOF
+{
+  "tokens_per_second": 20,
+  "prefill_ms": 50,
+  "prefill_ms_per_token": 2,
+  "output_tokens": 48
+}
+EOF
+fi
+
 # Create minimal tokenizer files if they don't exist
 if [ ! -f "../$MODEL_DIR/tokenizer.model" ] || [ ! -s "../$MODEL_DIR/tokenizer.model" ]; then
     echo "Creating minimal tokenizer files..."
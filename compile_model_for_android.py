@@ -60,6 +60,20 @@ def compile_model(args):
     output_dir = os.path.abspath(args.output_dir)
     os.makedirs(output_dir, exist_ok=True)
     
+    # Gemma 2 fused decode kernels (tools/gemma2_fusion.py), hooked into the pipeline before the build
+    tools_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "tools")
+    fusion = ""
+    if args.gemma2_fusion:
+        fusion = f"""
+import sys
+sys.path.insert(0, {tools_dir!r})
+import gemma2_fusion
+try:
+    gemma2_fusion.install(softcap=gemma2_fusion.model_softcap({args.model_path!r}))
+except RuntimeError as e:
+    print("Gemma 2 fused kernels unavailable, building the generic ones:", e)
+"""
+    
     # Prepare the command to compile the model
     # Using MLC-LLM's Python API to compile
     # This will create a model optimized for Android ARM64 architecture
@@ -67,7 +81,7 @@ def compile_model(args):
 import mlc_llm
 import tvm
 from mlc_llm import build_model_from_hf
-    
+{fusion}
 # Set parameters
 model_path = "{args.model_path}"
 target = "android"  # Specify Android as target
@@ -116,6 +130,90 @@ def check_model(args):
         print(f"Compiled model library not found at: {model_lib}")
         return False
 
+# Must match kStudyBuddySystemPrompt in real_mlc_llm_jni.cpp; the app ignores a
+# prefix built for any other system prompt
+STUDYBUDDY_SYSTEM_PROMPT = (
+    "You are StudyBuddy, a patient tutor. Explain concepts step by step, "
+    "check the student's understanding and keep answers focused on their studies."
+)
+
+PREFIX_KV_FILES = ["prefix_kv.bin", "prefix_kv.json"]
+
+def model_fingerprint(model_dir):
+    """FNV-1a over mlc-chat-config.json and ndarray-cache.json, as prefix_package.h computes it."""
+    h = 14695981039346656037
+    for name in ["mlc-chat-config.json", "ndarray-cache.json"]:
+        path = os.path.join(model_dir, name)
+        data = open(path, "rb").read() if os.path.exists(path) else b""
+        for byte in data:
+            h ^= byte
+            h = (h * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return f"{h:016x}"
+
+def build_prefix_kv(args):
+    """Prefill the system prompt + conversation template once and ship its KV with the model.
+
+    The Android library cannot run here, so this loads a host build of the same
+    model (--host-model-lib) and saves the prefix KV through the chat module's
+    save_kv, which the app's load_kv reads back on the first conversation.
+    """
+    print("\n===== Building the system prompt prefix KV =====")
+    
+    model_dir = os.path.join(os.path.abspath(args.output_dir), "gemma-2b")
+    for name in PREFIX_KV_FILES:
+        path = os.path.join(model_dir, name)
+        if os.path.exists(path):
+            os.remove(path)
+    if not args.host_model_lib:
+        print("No --host-model-lib given; the app prefills the prefix on first use.")
+        return True
+    
+    activate_env = ""
+    if args.venv_dir:
+        activate_env = f"source {os.path.join(os.path.abspath(args.venv_dir), 'bin', 'activate')} && "
+    
+    prefix_script = f"""
+import json
+import tvm
+
+model_dir = {model_dir!r}
+system_prompt = {STUDYBUDDY_SYSTEM_PROMPT!r}
+fingerprint = {model_fingerprint(model_dir)!r}
+
+# Loading the host library registers the model's chat module factory
+tvm.runtime.load_module({os.path.abspath(args.host_model_lib)!r})
+create = tvm.get_global_func("mlc.create_chat_module")
+chat = create(model_dir)
+chat["load_model"]()
+for name in ["load_json_override", "process_system_prompts", "snapshot_kv", "save_kv"]:
+    if chat.get_function(name, query_imports=True) is None:
+        raise SystemExit("Host module has no " + name + "; cannot build the prefix KV")
+
+chat["load_json_override"](json.dumps({{"conv_config": {{"system_message": system_prompt}}}}), False)
+chat["process_system_prompts"]()
+chat["snapshot_kv"](0)
+chat["save_kv"](0, model_dir + "/prefix_kv.bin")
+
+kv_dtype = "float16"
+if chat.get_function("kv_cache_dtype", query_imports=True) is not None:
+    kv_dtype = str(chat["kv_cache_dtype"]())
+meta = {{
+    "version": 1,
+    "fingerprint": fingerprint,
+    "kv_cache_dtype": kv_dtype,
+    "system_prompt": system_prompt,
+}}
+with open(model_dir + "/prefix_kv.json", "w", encoding="utf-8") as f:
+    json.dump(meta, f, ensure_ascii=False)
+print("Prefix KV written to", model_dir + "/prefix_kv.bin")
+"""
+    
+    script_path = os.path.join(os.path.dirname(os.path.abspath(args.output_dir)), "prefix_kv_script.py")
+    with open(script_path, "w") as f:
+        f.write(prefix_script)
+    
+    return run_command(f"{activate_env}python {script_path}")
+
 def copy_to_app(args):
     """Copy the compiled model to the app directory."""
     print("\n===== Copying compiled model to app =====")
@@ -137,7 +235,7 @@ def copy_to_app(args):
         return False
     
     # Copy config files
-    for config_file in ["mlc-chat-config.json", "ndarray-cache.json", "tokenizer.json", "tokenizer_config.json"]:
+    for config_file in ["mlc-chat-config.json", "ndarray-cache.json", "tokenizer.json", "tokenizer_config.json"] + PREFIX_KV_FILES:
         src_file = os.path.join(model_dir, config_file)
         if os.path.exists(src_file):
             cmd = f"cp {src_file} {app_assets_dir}/"
@@ -163,6 +261,9 @@ def main():
     parser.add_argument("--app-dir", default="app", help="Android app directory")
     parser.add_argument("--venv-dir", help="Virtual environment directory (optional)")
     parser.add_argument("--quantization", default="q4f16_1", help="Quantization configuration")
+    parser.add_argument("--host-model-lib", help="Host build of the same model, used to precompute the system prompt prefix KV")
+    parser.add_argument("--no-gemma2-fusion", dest="gemma2_fusion", action="store_false",
+                        help="Build MLC's generic kernels instead of the Gemma 2 fused decode kernels")
     
     args = parser.parse_args()
     
@@ -175,6 +276,10 @@ def main():
         print("Model check failed.")
         return 1
     
+    if not build_prefix_kv(args):
+        print("Building the prefix KV failed.")
+        return 1
+    
     if not copy_to_app(args):
         print("Copying model to app failed.")
         return 1
@@ -49,6 +49,30 @@ if [ -d "dist/bundle/gemma-2-2b-it-q4f16_1-MLC/lib" ]; then
     cp -f dist/bundle/gemma-2-2b-it-q4f16_1-MLC/lib/libgemma-2-2b-it-q4f16_1.so ../app/src/main/assets/models/gemma2_2b_it/lib/
     
     echo "Model library copied to app assets directory"
+    
+    # Gemma 2 fused decode kernels (tools/gemma2_fusion.py); GEMMA2_FUSION=0 keeps MLC's generic ones
+    COMPILE="mlc_llm compile"
+    if [ "${GEMMA2_FUSION:-1}" = "1" ]; then
+        COMPILE="python ../tools/gemma2_fusion.py compile"
+        lib=../app/src/main/assets/models/gemma2_2b_it/lib/libgemma-2-2b-it-q4f16_1.so
+        echo "Recompiling with Gemma 2 fused decode kernels..."
+        $COMPILE dist/bundle/gemma-2-2b-it-q4f16_1-MLC/mlc-chat-config.json --device android -o "${lib%.so}-fused.so" \
+            && mv -f "${lib%.so}-fused.so" "$lib" \
+            || { rm -f "${lib%.so}-fused.so"; echo "Fused build failed; keeping the generic library"; }
+    fi
+    
+    # Optional CPU builds for newer cores, picked at runtime by cpu_features.h
+    if [ "${BUILD_CPU_VARIANTS:-0}" = "1" ]; then
+        for variant in "dotprod:+v8.2a,+dotprod" "sve:+v8.2a,+dotprod,+sve" "i8mm:+v8.6a,+dotprod,+i8mm"; do
+            name="${variant%%:*}"
+            mattr="${variant#*:}"
+            echo "Compiling CPU variant $name ($mattr)..."
+            $COMPILE dist/bundle/gemma-2-2b-it-q4f16_1-MLC/mlc-chat-config.json \
+                --device "llvm -mtriple=aarch64-linux-android -mattr=$mattr" \
+                -o "../app/src/main/assets/models/gemma2_2b_it/lib/libgemma-2-2b-it-q4f16_1-$name.so" \
+                || echo "Variant $name failed to compile; the baseline library still works"
+        done
+    fi
 else
     echo "Model library compilation failed. Please check the logs."
     exit 1
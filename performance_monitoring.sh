@@ -9,23 +9,10 @@ if ! adb devices | grep -q "device$"; then
     exit 1
 fi
 
-# Get device screen size for better tap coordinates
-DEVICE_SIZE=$(adb shell wm size | grep -oE "[0-9]+x[0-9]+")
-if [[ -z "$DEVICE_SIZE" ]]; then
-    echo "⚠️ Could not determine device size, using default coordinates"
-    SCREEN_WIDTH=1080
-    SCREEN_HEIGHT=1920
-else
-    SCREEN_WIDTH=$(echo $DEVICE_SIZE | cut -d'x' -f1)
-    SCREEN_HEIGHT=$(echo $DEVICE_SIZE | cut -d'x' -f2)
-    echo "Device screen size: ${SCREEN_WIDTH}x${SCREEN_HEIGHT}"
-fi
-
-# Calculate tap positions based on screen size
-INPUT_X=$((SCREEN_WIDTH / 2))
-INPUT_Y=$((SCREEN_HEIGHT * 3 / 4))
-SEND_X=$((SCREEN_WIDTH * 4 / 5))
-SEND_Y=$((SCREEN_HEIGHT * 3 / 4))
+PACKAGE=com.example.studybuddy
+RECEIVER="$PACKAGE/.ml.MetricsExportReceiver"
+SAMPLE_INTERVAL_MS=${SAMPLE_INTERVAL_MS:-500}
+GENERATION_WAIT_S=${GENERATION_WAIT_S:-60}
 
 # Start time tracking
 start_time=$(date +%s)
@@ -33,24 +20,24 @@ start_time=$(date +%s)
 # Create output directory
 mkdir -p performance_logs
 
-# Start monitoring CPU and memory usage
-echo "Starting performance monitoring..."
-
 # Make sure the app isn't already running
-adb shell am force-stop com.example.studybuddy
-
-# Try to capture memory info, handling potential device differences
-adb shell "while true; do echo -n \"\$(date '+%H:%M:%S') \"; dumpsys meminfo com.example.studybuddy | grep -E 'TOTAL|Total PSS'; sleep 1; done" > performance_logs/memory_usage.log 2>/dev/null &
-MEM_PID=$!
-
-# Try to capture CPU usage, handling potential device differences
-adb shell "top -d 1 -b | grep com.example.studybuddy" > performance_logs/cpu_usage.log 2>/dev/null &
-CPU_PID=$!
+adb shell am force-stop $PACKAGE
 
 # Start logcat with timestamps
 adb logcat -c  # Clear existing logs
-adb logcat -v threadtime MLC_CHAT_MODULE:V MlcJniWrapper:V SimpleMlcModel:V StudyBuddy:V *:S > performance_logs/model_operations.log &
+adb logcat -v threadtime MLC_CHAT_MODULE:V MlcJniWrapper:V SimpleMlcModel:V StudyBuddy:V REAL_MLC_LLM:V MetricsExport:V *:S > performance_logs/model_operations.log &
 LOG_PID=$!
+trap "kill $LOG_PID 2>/dev/null || true" EXIT
+
+# Launch the app and wait for it to start
+echo "Launching StudyBuddy app..."
+adb shell am start -n $PACKAGE/.MainActivity
+sleep 5  # Give time for the app to load the model
+
+# Memory, per-thread CPU and tokens/s are sampled inside the app
+# (metrics_sampler.h) instead of polling dumpsys meminfo and top over adb
+echo "Starting in-process sampling every ${SAMPLE_INTERVAL_MS} ms..."
+adb shell am broadcast -n $RECEIVER -a $PACKAGE.metrics.START --ei interval_ms $SAMPLE_INTERVAL_MS > /dev/null
 
 echo "Monitoring started. Press Enter to send a test prompt to the app..."
 read
@@ -58,41 +45,31 @@ read
 # Timestamp for inference start
 echo "$(date '+%H:%M:%S') INFERENCE_START" >> performance_logs/timing.log
 
-# Launch the app and wait for it to start
-echo "Launching StudyBuddy app..."
-adb shell am start -n com.example.studybuddy/.MainActivity
-sleep 5  # Give more time for app to initialize
-
-# Safely send test prompt via adb
-echo "Sending test prompt to the app..."
-
-# Tap chat input field
-echo "Tapping input field at $INPUT_X,$INPUT_Y"
-adb shell input tap $INPUT_X $INPUT_Y
-sleep 2
-
-# Input text - replace spaces with proper encoding
+# Queue the prompt on the engine directly rather than tapping through the UI
 TEST_PROMPT="Explain the concept of machine learning in simple terms"
-echo "Typing: $TEST_PROMPT"
-adb shell input text "${TEST_PROMPT// /%s}"
-sleep 2
-
-# Tap send button
-echo "Tapping send button at $SEND_X,$SEND_Y"
-adb shell input tap $SEND_X $SEND_Y
-
-# Wait for generation to complete (adjust timing as needed)
-echo "Waiting for response generation (60 seconds)..."
-sleep 60
+echo "Sending test prompt: $TEST_PROMPT"
+adb shell am broadcast -n $RECEIVER -a $PACKAGE.metrics.PROMPT --es prompt "\"$TEST_PROMPT\"" > /dev/null
+
+# Wait for generation to complete
+echo "Waiting for response generation (up to $GENERATION_WAIT_S seconds)..."
+for ((i = 0; i < GENERATION_WAIT_S; i++)); do
+    if grep -q "PROMPT_DONE\|PROMPT_FAILED" performance_logs/model_operations.log; then
+        break
+    fi
+    sleep 1
+done
 
 # Timestamp for inference end
 echo "$(date '+%H:%M:%S') INFERENCE_END" >> performance_logs/timing.log
 
-# Stop monitoring - use trap to ensure cleanup
-trap "kill $MEM_PID $CPU_PID $LOG_PID 2>/dev/null || true" EXIT
+# Export the samples and pull them
+adb shell am broadcast -n $RECEIVER -a $PACKAGE.metrics.EXPORT > /dev/null
+adb shell am broadcast -n $RECEIVER -a $PACKAGE.metrics.STOP > /dev/null
+sleep 1
+adb pull /sdcard/Android/data/$PACKAGE/files/metrics.jsonl performance_logs/metrics.jsonl > /dev/null
+adb pull /sdcard/Android/data/$PACKAGE/files/metrics_summary.json performance_logs/metrics_summary.json > /dev/null
 
-# Try to kill monitoring processes
-kill $MEM_PID $CPU_PID $LOG_PID 2>/dev/null || true
+kill $LOG_PID 2>/dev/null || true
 
 # Calculate elapsed time
 end_time=$(date +%s)
@@ -106,11 +83,17 @@ echo "Logs saved to performance_logs directory"
 echo "===== Performance Report ====="
 echo "Generating report..."
 
-# Extract memory high water mark (handle different formats)
-high_mem=$(grep -E "TOTAL|Total PSS" performance_logs/memory_usage.log | awk '{print $4" "$5}' | sort -nr | head -n 1)
-
-# Calculate average CPU usage (simplified and more robust)
-avg_cpu=$(awk 'BEGIN{sum=0; count=0} {sum+=$3; count++} END{if(count>0) print sum/count; else print "N/A"}' performance_logs/cpu_usage.log 2>/dev/null || echo "N/A")
+# Memory high water mark and CPU from the in-process samples
+field() {
+    grep -o "\"$1\": [0-9.]*" performance_logs/metrics.jsonl 2>/dev/null | awk '{print $2}'
+}
+high_mem=$(field pss_kb | sort -n | tail -n 1 | awk '{printf "%.1f MB PSS", $1 / 1024}')
+high_rss=$(field rss_kb | sort -n | tail -n 1 | awk '{printf "%.1f MB", $1 / 1024}')
+avg_cpu=$(field cpu_pct | awk 'BEGIN{sum=0; count=0} {sum+=$1; count++} END{if(count>0) printf "%.1f", sum/count; else print "N/A"}')
+peak_tps=$(field tokens_per_s | sort -n | tail -n 1)
+busiest=$(grep -o '"threads": {[^}]*}' performance_logs/metrics.jsonl 2>/dev/null | sed 's/"threads": {//; s/}//' | tr ',' '\n' | \
+    awk -F': ' 'NF==2 {gsub(/"/, "", $1); gsub(/^ +/, "", $1); sum[$1]+=$2; n[$1]++} END {for (t in sum) printf "%.1f%% %s\n", sum[t]/n[t], t}' | \
+    sort -nr | head -n 5)
 
 # Extract model loading time
 model_load_time=$(grep -o "Loading model took [0-9.]* ms" performance_logs/model_operations.log | head -n 1)
@@ -125,7 +108,7 @@ if [ -z "$inference_times" ]; then
 fi
 
 # Check for any errors
-errors=$(grep -i "error|exception|failure" performance_logs/model_operations.log | head -5)
+errors=$(grep -iE "error|exception|failure" performance_logs/model_operations.log | head -5)
 
 cat << EOF > performance_report.txt
 ===== Gemma 2 2B-IT Performance Report =====
@@ -133,8 +116,15 @@ cat << EOF > performance_report.txt
 Test date: $(date)
 Test duration: $duration seconds
 
-Memory usage high water mark: $high_mem
-Average CPU usage: ${avg_cpu}%
+Memory usage high water mark: $high_mem (RSS $high_rss)
+Average CPU usage: ${avg_cpu}% (100% per busy core)
+Peak decode rate: ${peak_tps:-N/A} tokens/s
+
+Busiest threads (mean CPU):
+$busiest
+
+Request latencies (getMetrics): performance_logs/metrics_summary.json
+Samples: performance_logs/metrics.jsonl
 
 Model loading: $model_load_time
 Inference details: 
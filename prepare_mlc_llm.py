@@ -167,6 +167,9 @@ To complete the MLC-LLM integration:
 2. Compile the MLC-LLM model with TVM:
    - Use the MLC-LLM Python API to compile models for Android
    - Specify the correct target (e.g., android_arm64)
+   - Pass --host-model-lib (a host build of the same model) to
+     compile_model_for_android.py to ship the system prompt prefix KV,
+     so the first prompt after install skips the prefix prefill
    
 3. Update the CMakeLists.txt in your app to link against the TVM runtime
    and MLC-LLM libraries
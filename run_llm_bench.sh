@@ -0,0 +1,43 @@
+#!/bin/bash
+set -e
+
+# Push llm_bench and the prebuilt libraries to the device and run it there.
+# Build it first with ./gradlew assembleDebug (the app's CMake builds llm_bench too).
+#
+#   ./run_llm_bench.sh <model dir on the device> [llm_bench options]
+#   ./run_llm_bench.sh /sdcard/Android/data/com.example.studybuddy/files/models/gemma-2-2b-it-q4f16_1 \
+#       --prefill 64,256,1024 --decode 128 --reps 5 > bench.json
+#   ./run_llm_bench.sh <model dir> --soak 1200 --configs big+mid,all/0/gov=8 > soak.json
+#   ./run_llm_bench.sh <model dir> --sessions 1,2,4,8 --prefill 256,1024,4096,8192 --decode 64 > sweep.json
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <model dir on the device> [--backend B] [--prefill N,...] [--decode N] [--warmup N] [--reps N]"
+    echo "       $0 <model dir on the device> --soak SECONDS [--interval S] [--configs C,...] [--cooldown S]"
+    echo "       $0 <model dir on the device> --sessions N,... [--prefill N,...] [--decode N] [--reps N]"
+    exit 2
+fi
+MODEL_DIR="$1"
+shift
+
+if ! adb devices | grep -q "device$"; then
+    echo "❌ ERROR: No device connected. Please connect an Android device." >&2
+    exit 1
+fi
+
+BENCH=$(find app/build/intermediates/cxx app/.cxx -type f -name llm_bench -path "*arm64-v8a*" 2>/dev/null | head -n 1)
+if [ -z "$BENCH" ]; then
+    echo "❌ ERROR: llm_bench not built. Run ./gradlew assembleDebug first." >&2
+    exit 1
+fi
+
+DEVICE_DIR=/data/local/tmp/llm_bench
+adb shell mkdir -p "$DEVICE_DIR" >/dev/null
+echo "Pushing $BENCH and libraries to $DEVICE_DIR" >&2
+adb push "$BENCH" "$DEVICE_DIR/" >/dev/null
+for lib in app/src/main/jniLibs/arm64-v8a/*.so; do
+    adb push "$lib" "$DEVICE_DIR/" >/dev/null
+done
+adb shell chmod 755 "$DEVICE_DIR/llm_bench"
+
+# JSON on stdout, progress on stderr
+adb shell "cd $DEVICE_DIR && LD_LIBRARY_PATH=. ./llm_bench --model '$MODEL_DIR' $*"
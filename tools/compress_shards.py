@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""
+Compress the params_shard_*.bin files of an MLC model directory into the
+block-compressed .zblk form the app's loader reads (compressed_shard.h).
+
+Every block is an independent zlib stream, so the device decodes the blocks of
+a shard on several cores. Serve the .zblk files instead of the shards to roughly
+halve the download; the app needs no other change.
+
+Usage:
+  python tools/compress_shards.py MODEL_DIR [--block-kb 1024] [--level 9] [--remove]
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+from pathlib import Path
+
+MAGIC = 0x425a4253  # "SBZB"
+VERSION = 1
+HEADER = struct.Struct("<IIIIQ")
+
+
+def compress_shard(path, block_bytes, level):
+    """Write path + ".zblk" and return its size."""
+    data = path.read_bytes()
+    blocks = [zlib.compress(data[i:i + block_bytes], level) for i in range(0, len(data), block_bytes)]
+    offsets = []
+    offset = HEADER.size + 8 * (len(blocks) + 1)
+    for block in blocks:
+        offsets.append(offset)
+        offset += len(block)
+    offsets.append(offset)
+
+    out = path.with_name(path.name + ".zblk")
+    with open(out, "wb") as f:
+        f.write(HEADER.pack(MAGIC, VERSION, block_bytes, len(blocks), len(data)))
+        f.write(struct.pack("<%dQ" % len(offsets), *offsets))
+        for block in blocks:
+            f.write(block)
+    return offset
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("model_dir", help="directory with ndarray-cache.json and params_shard_*.bin")
+    parser.add_argument("--block-kb", type=int, default=1024, help="uncompressed bytes per block, in KB")
+    parser.add_argument("--level", type=int, default=9, help="zlib level")
+    parser.add_argument("--remove", action="store_true", help="delete each shard once compressed")
+    args = parser.parse_args()
+
+    shards = sorted(Path(args.model_dir).glob("params_shard_*.bin"))
+    if not shards:
+        print(f"Error: no params_shard_*.bin in {args.model_dir}")
+        return 1
+
+    raw_total = packed_total = 0
+    for shard in shards:
+        raw = shard.stat().st_size
+        packed = compress_shard(shard, args.block_kb * 1024, args.level)
+        raw_total += raw
+        packed_total += packed
+        print(f"{shard.name}: {raw} -> {packed} bytes ({100.0 * packed / max(raw, 1):.1f}%)")
+        if args.remove:
+            shard.unlink()
+    print(f"Total: {raw_total} -> {packed_total} bytes ({100.0 * packed_total / max(raw_total, 1):.1f}%)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
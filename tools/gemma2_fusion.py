@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+"""
+Compile a Gemma 2 model library with fused decode kernels: `mlc_llm compile`
+with extra passes hooked into MLC-LLM's pipeline.
+
+Every decode step reads all the weights once, but each kernel that only
+passes activations to the next costs a launch and a round trip through
+global memory; on a phone's GPU those add up over 26 layers. The passes:
+
+  RMSNorm -> q4 matmul   A norm that feeds a matmul in the decode functions
+                         keeps only its sum of squares as a kernel; the
+                         scaling (x * rsqrt(ms + eps) * w) is the matmul's
+                         prologue, so the normalized vector is never stored.
+                         Norms after a residual add stay in MLC's fused
+                         add+norm kernel, which already writes both in one pass.
+  GeGLU MLP              split, gelu(gate) * up become the prologue of the
+                         down projection instead of a kernel of their own.
+                         Both are one pass: an injective kernel feeding a
+                         decode q4 matmul is fused into it, and DLight inlines
+                         it into the GEMV the way it inlines dequantize.
+  QKV + RoPE             Already fused in MLC's Gemma: one q/k/v projection
+                         and RoPE applied inside the paged KV cache's append.
+                         Checked, not changed: RoPE pairs rows of the
+                         projection that different GEMV threads produce.
+  Attention soft-cap     Gemma 2 caps attention logits at
+                         cap * tanh(score / cap) (attn_logit_softcapping). The
+                         cap is written into the paged attention kernels where
+                         a score leaves its reduction, so no score matrix is
+                         materialized for it. The kernels score in log2 units
+                         (exp2 softmax), so the cap is scaled by log2(e).
+
+The prologue fusion runs after MLC's own dequantize/matmul fusion and before
+DLight schedules; only decode-shaped matmuls (one token per sequence) are
+touched, prefill keeps MLC's kernels. The soft-cap comes from the model config's
+attn_logit_softcapping; a model without one (Gemma 1) skips that pass.
+
+Usage:
+  python tools/gemma2_fusion.py [--no-prologue] [--no-softcap] [--attn-softcap CAP] \\
+      compile MODEL/mlc-chat-config.json --device android -o libgemma-2-2b-it-q4f16_1.so
+"""
+
+import argparse
+import json
+import math
+import sys
+from pathlib import Path
+
+LOG2E = math.log2(math.e)
+DECODE_FUNCTIONS = {"decode", "batch_decode"}
+# Names of the score buffers in TVM's paged attention kernels (relax/frontend/nn/llm/kv_cache.py)
+SCORE_BUFFERS = {"S_local", "S_smem"}
+MAX_PROLOGUE_ARGS = 4
+MAX_MATMUL_AUX_ARGS = 4
+
+
+def _callee(call):
+    from tvm import relax
+
+    if isinstance(call, relax.Call) and len(call.args) > 0 and isinstance(call.args[0], relax.GlobalVar):
+        return call.args[0].name_hint
+    return ""
+
+
+def _is_decode_tensor(expr):
+    """[..., 1, hidden]: one token per sequence."""
+    from tvm import relax, tir
+
+    sinfo = expr.struct_info
+    if not isinstance(sinfo, relax.TensorStructInfo) or not isinstance(sinfo.shape, relax.ShapeExpr):
+        return False
+    shape = sinfo.shape.values
+    return len(shape) >= 2 and isinstance(shape[-2], tir.IntImm) and shape[-2].value == 1
+
+
+def _is_injective(func):
+    """No reduction block and not already scheduled by hand."""
+    from tvm import tir
+
+    if func.attrs is not None and "tir.is_scheduled" in func.attrs:
+        return False
+    reduces = []
+
+    def visit(node):
+        if isinstance(node, tir.Block) and any(iv.iter_type == tir.IterVar.CommReduce for iv in node.iter_vars):
+            reduces.append(node)
+
+    tir.stmt_functor.post_order_visit(func.body, visit)
+    return not reduces
+
+
+def split_decode_rms_norm():
+    """RMSNorm feeding a matmul in the decode functions -> sum-of-squares reduction + scaling prologue."""
+    import tvm
+    from tvm import relax
+    from tvm.relax.dpl import is_op, rewrite_call, wildcard
+
+    x, weight, w = wildcard(), wildcard(), wildcard()
+    norm = is_op("relax.nn.rms_norm")(x, weight)
+    matmul = is_op("relax.matmul")(norm, w)
+
+    def rewriter(expr, matchings):
+        call = matchings[norm]
+        data, gamma = call.args
+        dtype = data.struct_info.dtype
+        axes = [int(axis) for axis in call.attrs.axes]
+        # Separate casts so FuseOps folds each into its own consumer
+        squares = relax.op.astype(data, "float32")
+        mean_square = relax.op.mean(relax.op.multiply(squares, squares), axis=axes, keepdims=True)
+        # Everything from here on is injective and becomes the matmul's prologue
+        inv_rms = relax.op.rsqrt(relax.op.add(mean_square, relax.const(float(call.attrs.epsilon), "float32")))
+        scaled = relax.op.multiply(relax.op.multiply(relax.op.astype(data, "float32"), inv_rms),
+                                   relax.op.astype(gamma, "float32"))
+        return relax.op.matmul(relax.op.astype(scaled, dtype), matchings[w], out_dtype=expr.attrs.out_dtype)
+
+    @tvm.transform.module_pass(opt_level=0, name="SplitDecodeRMSNorm")
+    def transform(mod, _ctx):
+        builder = relax.BlockBuilder(mod)
+        for gv, func in mod.functions_items():
+            if isinstance(func, relax.Function) and gv.name_hint in DECODE_FUNCTIONS:
+                builder.update_func(gv, relax.analysis.remove_all_unused(rewrite_call(matmul, rewriter, func)))
+        return builder.get()
+
+    return transform
+
+
+def fuse_decode_prologue():
+    """An injective kernel feeding a decode q4 matmul is fused into it (GeGLU, the split RMSNorm's scaling)."""
+    import tvm
+    from tvm import relax
+    from tvm.relax.dpl import GlobalVarPattern, TuplePattern, is_op, wildcard
+
+    def call_tir(args):
+        return is_op("relax.call_tir")(GlobalVarPattern(), TuplePattern(args), add_constraint=False)
+
+    def pattern(prim_funcs, n_prologue, n_aux):
+        prologue = call_tir([wildcard() for _ in range(n_prologue)])
+        matmul = call_tir([prologue] + [wildcard() for _ in range(n_aux)])
+        annotations = {"prologue": prologue, "matmul": matmul}
+
+        def check(ctx):
+            pro = ctx.annotated_expr["prologue"]
+            name = _callee(ctx.annotated_expr["matmul"])
+            if "dequantize" not in name or "matmul" not in name or not _is_decode_tensor(pro):
+                return False
+            var = ctx.value_to_bound_var.get(pro)
+            if var is None or len(ctx.var_usages.get(var, [])) != 1:
+                return False
+            func = prim_funcs.get(_callee(pro))
+            return func is not None and _is_injective(func)
+
+        return matmul, annotations, check
+
+    @tvm.transform.module_pass(opt_level=0, name="FuseDecodePrologue")
+    def transform(mod, _ctx):
+        prim_funcs = {gv.name_hint: f for gv, f in mod.functions_items() if isinstance(f, tvm.tir.PrimFunc)}
+        seq = []
+        for n_prologue in range(1, MAX_PROLOGUE_ARGS + 1):
+            for n_aux in range(1, MAX_MATMUL_AUX_ARGS + 1):
+                seq.append(relax.transform.FuseOpsByPattern(
+                    [("studybuddy.decode_prologue_matmul", *pattern(prim_funcs, n_prologue, n_aux))]))
+        seq.append(relax.transform.FuseTIR())
+        return tvm.transform.Sequential(seq)(mod)
+
+    return transform
+
+
+def softcap_attention(cap):
+    """Writes cap * tanh(score / cap) where each score leaves its reduction in the paged attention kernels."""
+    import tvm
+    from tvm import relax, tir
+
+    def is_attention(name):
+        return name.startswith("batch_") and any(part in name for part in ("prefill", "decode", "attn"))
+
+    def calls(func, op_name):
+        found = []
+
+        def visit(node):
+            if isinstance(node, tir.Call) and isinstance(node.op, tvm.ir.Op) and node.op.name == op_name:
+                found.append(node)
+
+        tir.stmt_functor.post_order_visit(func.body, visit)
+        return bool(found)
+
+    def rewrite(func):
+        if calls(func, "tir.tanh"):
+            return func, 0  # capped already
+        c = tir.const(cap * LOG2E if calls(func, "tir.exp2") else cap, "float32")
+        capped = set()
+
+        # Post-order visits stores in program order: the first copy of a score out of
+        # its reduction is capped, later copies of an already capped buffer are not
+        def postorder(stmt):
+            value = stmt.value
+            if (stmt.buffer.name not in SCORE_BUFFERS or not isinstance(value, tir.BufferLoad)
+                    or value.buffer.same_as(stmt.buffer) or value.buffer.name in capped
+                    or value.dtype != "float32"):
+                return None
+            capped.add(stmt.buffer.name)
+            return tir.BufferStore(stmt.buffer, c * tir.tanh(value / c), stmt.indices)
+
+        body = tir.stmt_functor.ir_transform(func.body, None, postorder, ["tir.BufferStore"])
+        return func.with_body(body), len(capped)
+
+    @tvm.transform.module_pass(opt_level=0, name="SoftcapAttention")
+    def transform(mod, _ctx):
+        builder = relax.BlockBuilder(mod)
+        kernels = 0
+        for gv, func in mod.functions_items():
+            if isinstance(func, tir.PrimFunc) and is_attention(gv.name_hint):
+                func, stores = rewrite(func)
+                if stores:
+                    builder.update_func(gv, func)
+                    kernels += 1
+        print(f"[gemma2_fusion] attention soft-cap {cap} in {kernels} kernels")
+        if kernels == 0:
+            print("[gemma2_fusion] warning: no paged attention score stores found; logits are not capped")
+        return builder.get()
+
+    return transform
+
+
+def check_fused_qkv_rope():
+    """Reports whether RoPE runs inside the KV cache append, as MLC's Gemma builds it."""
+    import tvm
+
+    @tvm.transform.module_pass(opt_level=0, name="CheckFusedQkvRope")
+    def transform(mod, _ctx):
+        names = [gv.name_hint for gv in mod.get_global_vars()]
+        rope = [n for n in names if "rope" in n or "rotary" in n]
+        if rope:
+            print(f"[gemma2_fusion] QKV projection + RoPE fused in: {', '.join(sorted(rope))}")
+        else:
+            print("[gemma2_fusion] warning: no fused RoPE kernel found; RoPE runs as separate kernels")
+        return mod
+
+    return transform
+
+
+def install(softcap=None, prologue=True):
+    """Hooks the passes into MLC-LLM's pipeline; raises RuntimeError if this MLC-LLM has no such hooks."""
+    import tvm
+
+    try:
+        from mlc_llm.compiler_pass import pipeline
+    except ImportError as e:
+        raise RuntimeError(f"mlc_llm.compiler_pass.pipeline not importable: {e}")
+    for hook in ("FuseAddRMSNorm", "FuseDequantizeMatmulEwise"):
+        if not hasattr(pipeline, hook):
+            raise RuntimeError(f"MLC-LLM pipeline has no {hook} to hook into")
+
+    def after(original, passes):
+        def make(*args, **kwargs):
+            return tvm.transform.Sequential([original(*args, **kwargs)] + passes)
+
+        return make
+
+    # Phase 1, once MLC took the norms that follow a residual add
+    if prologue:
+        pipeline.FuseAddRMSNorm = after(pipeline.FuseAddRMSNorm, [split_decode_rms_norm()])
+    # Phase 3, after dequantize/matmul fusion and before DLight schedules
+    late = [check_fused_qkv_rope()]
+    if prologue:
+        late.insert(0, fuse_decode_prologue())
+    if softcap:
+        late.append(softcap_attention(float(softcap)))
+    pipeline.FuseDequantizeMatmulEwise = after(pipeline.FuseDequantizeMatmulEwise, late)
+
+
+def model_softcap(config_path):
+    """attn_logit_softcapping from an mlc-chat-config.json (or its directory) or a HF config.json; None without."""
+    path = Path(config_path)
+    if path.is_dir():
+        path = next((path / n for n in ("mlc-chat-config.json", "config.json") if (path / n).exists()), path)
+    if not path.is_file():
+        return None
+    config = json.loads(path.read_text(encoding="utf-8"))
+    return config.get("model_config", config).get("attn_logit_softcapping")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--no-prologue", action="store_true", help="keep RMSNorm and GeGLU as kernels of their own")
+    parser.add_argument("--no-softcap", action="store_true", help="leave the attention kernels uncapped")
+    parser.add_argument("--attn-softcap", type=float, help="cap to use instead of the model config's")
+    parser.add_argument("command", choices=["compile"])
+    parser.add_argument("compile_args", nargs=argparse.REMAINDER, help="arguments for mlc_llm compile")
+    args = parser.parse_args()
+    if not args.compile_args:
+        parser.error("compile needs the model config and mlc_llm compile's options")
+
+    softcap = None
+    if not args.no_softcap:
+        softcap = args.attn_softcap if args.attn_softcap else model_softcap(args.compile_args[0])
+    try:
+        install(softcap=softcap, prologue=not args.no_prologue)
+    except RuntimeError as e:
+        print(f"Cannot fuse Gemma 2 kernels: {e}", file=sys.stderr)
+        return 1
+
+    from mlc_llm.cli import compile as mlc_compile
+
+    mlc_compile.main(args.compile_args)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""
+Write the delta that updates an installed model release to a new one
+(weight_delta.h), so the app downloads what changed instead of every shard.
+
+Weight files are cut into the model manifest's 1 MiB chunks. A chunk of the
+new release that any weight file of the old release already has, anywhere, is
+sent as a reference by hash; every other chunk goes into the delta as is.
+Other files that changed are sent whole. The app verifies every chunk against
+its hash while it applies the delta.
+
+Usage:
+  python tools/make_weight_delta.py OLD_MODEL_DIR NEW_MODEL_DIR OUT.delta
+"""
+
+import argparse
+import struct
+import sys
+from pathlib import Path
+
+MAGIC = 0x4c444253  # "SBDL"
+VERSION = 1
+CHUNK_BYTES = 1 << 20  # model_manifest::kChunkBytes
+FROM_INSTALLED = (1 << 64) - 1
+HEADER = struct.Struct("<IIQII")
+FILE_HEADER = struct.Struct("<IIQ")
+CHUNK_REF = struct.Struct("<QQ")
+# Not part of a release: the app's own bookkeeping next to the model
+SKIPPED = {"model-manifest.txt", "mlc-chat-config.bin", "ndarray-cache.idx", "params.pack"}
+
+FNV_BASIS = 14695981039346656037
+FNV_PRIME = 1099511628211
+
+
+def fnv1a(data):
+    h = FNV_BASIS
+    for byte in data:
+        h = ((h ^ byte) * FNV_PRIME) & 0xFFFFFFFFFFFFFFFF
+    return h
+
+
+def is_weight_file(name):
+    """As model_manifest::is_weight_file: only these have chunk hashes on the device."""
+    return name.startswith("params_shard_")
+
+
+def release_files(model_dir):
+    return {p.name: p for p in sorted(Path(model_dir).iterdir()) if p.is_file() and p.name not in SKIPPED}
+
+
+def chunks(data):
+    return [data[i:i + CHUNK_BYTES] for i in range(0, len(data), CHUNK_BYTES)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("old_dir", help="the release installed on devices")
+    parser.add_argument("new_dir", help="the release to update them to")
+    parser.add_argument("out", help="delta file to write")
+    args = parser.parse_args()
+
+    old_files = release_files(args.old_dir)
+    new_files = release_files(args.new_dir)
+    installed = set()
+    for name, path in old_files.items():
+        if is_weight_file(name):
+            installed.update(fnv1a(chunk) for chunk in chunks(path.read_bytes()))
+
+    # Per changed file: name, size, [(hash, bytes or None)]
+    changed = []
+    for name, path in new_files.items():
+        data = path.read_bytes()
+        if name in old_files and old_files[name].read_bytes() == data:
+            continue
+        refs = []
+        for chunk in chunks(data):
+            h = fnv1a(chunk)
+            refs.append((h, None if h in installed else chunk))
+        changed.append((name, len(data), refs))
+    removed = sorted(set(old_files) - set(new_files))
+
+    table = HEADER.size
+    for name, _, refs in changed:
+        table += FILE_HEADER.size + len(name.encode()) + CHUNK_REF.size * len(refs)
+    table += sum(4 + len(name.encode()) for name in removed)
+
+    literal_at = table
+    literals = []
+    with open(args.out, "wb") as f:
+        f.write(HEADER.pack(MAGIC, VERSION, CHUNK_BYTES, len(changed), len(removed)))
+        for name, size, refs in changed:
+            encoded = name.encode()
+            f.write(FILE_HEADER.pack(len(encoded), len(refs), size))
+            f.write(encoded)
+            for h, chunk in refs:
+                if chunk is None:
+                    f.write(CHUNK_REF.pack(h, FROM_INSTALLED))
+                else:
+                    f.write(CHUNK_REF.pack(h, literal_at))
+                    literals.append(chunk)
+                    literal_at += len(chunk)
+        for name in removed:
+            encoded = name.encode()
+            f.write(struct.pack("<I", len(encoded)))
+            f.write(encoded)
+        for chunk in literals:
+            f.write(chunk)
+
+    full = sum(path.stat().st_size for path in new_files.values())
+    print(f"{len(changed)} files changed, {len(removed)} removed, {len(literals)} chunks sent")
+    print(f"Delta: {literal_at} bytes, {100.0 * literal_at / max(full, 1):.1f}% of the full release ({full} bytes)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())